@@ -50,8 +50,22 @@ endif
 LOCAL_SRC_FILES := \
     twrp.cpp \
     fixContexts.cpp \
+    twrpSELabel.cpp \
     twrpTar.cpp \
+    twrpTarStream.cpp \
+    twrpTarCrypt.cpp \
+    twrpWorkPool.cpp \
+    twrpStartup.cpp \
+    twrpTarIndex.cpp \
+    twrpRawTransfer.cpp \
+    twrpBlockMap.cpp \
+    twrpSnapshot.cpp \
+    twrpManifest.cpp \
+    twrpBackupCatalog.cpp \
+    twrpBackupMeta.cpp \
+    twrpChunkStore.cpp \
     exclude.cpp \
+    twrpMediaIndex.cpp \
     find_file.cpp \
     infomanager.cpp \
     data.cpp \
@@ -61,6 +75,10 @@ LOCAL_SRC_FILES := \
     twinstall.cpp \
     twrp-functions.cpp \
     twrpDigestDriver.cpp \
+    twrpTrace.cpp \
+    twrpMemory.cpp \
+    twrpPerf.cpp \
+    twrpLog.cpp \
     openrecoveryscript.cpp \
     tarWrite.c \
     twrpAdbBuFifo.cpp
@@ -155,6 +173,15 @@ ifneq ($(wildcard system/core/libsparse/Android.mk),)
 LOCAL_SHARED_LIBRARIES += libsparse
 endif
 
+ifneq ($(wildcard external/lz4/lib/lz4frame.h),)
+    LOCAL_CFLAGS += -DTW_HAVE_LZ4
+    LOCAL_C_INCLUDES += external/lz4/lib
+    LOCAL_STATIC_LIBRARIES += liblz4
+endif
+ifneq ($(TW_TAR_BUFFER_SIZE_MB),)
+    LOCAL_CFLAGS += -DTW_TAR_BUFFER_SIZE_MB=$(TW_TAR_BUFFER_SIZE_MB)
+endif
+
 ifeq ($(TW_OEM_BUILD),true)
     LOCAL_CFLAGS += -DTW_OEM_BUILD
     BOARD_HAS_NO_REAL_SDCARD := true
@@ -273,6 +300,10 @@ endif
 ifneq ($(BOARD_UMS_LUNFILE),)
     LOCAL_CFLAGS += -DCUSTOM_LUN_FILE=\"$(BOARD_UMS_LUNFILE)\"
 endif
+ifeq ($(TW_USB_STORAGE_FFS), true)
+    LOCAL_CFLAGS += -DTW_USB_STORAGE_FFS
+    LOCAL_SRC_FILES += twrpUsbDisk.cpp
+endif
 ifeq ($(TW_HAS_DOWNLOAD_MODE), true)
     LOCAL_CFLAGS += -DTW_HAS_DOWNLOAD_MODE
 endif
@@ -335,6 +366,10 @@ ifneq ($(TW_CUSTOM_CPU_TEMP_PATH),)
 endif
 ifneq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
     LOCAL_SHARED_LIBRARIES += libopenaes
+    # New encrypted backups use AES-GCM from libcrypto, OAES is still read
+    ifeq ($(shell test $(PLATFORM_SDK_VERSION) -ge 24; echo $$?),0)
+        LOCAL_CFLAGS += -DTW_HAVE_AES_GCM
+    endif
 else
     LOCAL_CFLAGS += -DTW_EXCLUDE_ENCRYPTED_BACKUPS
 endif
@@ -668,6 +703,9 @@ LOCAL_CFLAGS := -std=gnu++0x
 LOCAL_SRC_FILES := adb_install.cpp legacy_property_service.cpp set_metadata.cpp tw_atomic.cpp installcommand.cpp zipwrap.cpp
 LOCAL_SHARED_LIBRARIES += libc liblog libcutils libmtdutils libfusesideload libselinux libminzip
 LOCAL_CFLAGS += -DRECOVERY_API_VERSION=$(RECOVERY_API_VERSION)
+ifeq ($(shell test $(PLATFORM_SDK_VERSION) -gt 20; echo $$?),0)
+    LOCAL_CFLAGS += -DHAVE_PROPERTY_AREA_SERIAL
+endif
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
     LOCAL_SHARED_LIBRARIES += libstdc++ libstlport
     LOCAL_C_INCLUDES += bionic external/stlport/stlport
@@ -31,6 +31,7 @@
 #include <fstream>
 #include <sstream>
 #include <assert.h>
+#include <inttypes.h>
 
 #include "twadbstream.h"
 #include "libtwadbbu.hpp"
@@ -144,7 +145,7 @@ bool twadbbu::Write_ADB_Stream_Header(uint64_t partition_count) {
 	strncpy(twhdr.start_of_header, TWRP, sizeof(twhdr.start_of_header));
 	strncpy(twhdr.type, TWSTREAMHDR, sizeof(twhdr.type));
 	twhdr.partition_count = partition_count;
-	twhdr.version = ADB_BACKUP_VERSION;
+	twhdr.version = ADB_BACKUP_CHECKPOINT_VERSION;
 	memset(twhdr.space, 0, sizeof(twhdr.space));
 	twhdr.crc = crc32(0L, Z_NULL, 0);
 	twhdr.crc = crc32(twhdr.crc, (const unsigned char*) &twhdr, sizeof(twhdr));
@@ -180,15 +181,17 @@ bool twadbbu::Write_ADB_Stream_Trailer() {
 	return true;
 }
 
-bool twadbbu::Write_TWFN(std::string Backup_FileName, uint64_t file_size, bool use_compression) {
+bool twadbbu::Write_TWFN(std::string Backup_FileName, uint64_t file_size, uint64_t codec, uint32_t stream_id) {
 	int adb_control_bu_fd;
 	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_WRONLY | O_NONBLOCK);
 	struct twfilehdr twfilehdr;
+	memset(&twfilehdr, 0, sizeof(twfilehdr));
 	strncpy(twfilehdr.start_of_header, TWRP, sizeof(twfilehdr.start_of_header));
 	strncpy(twfilehdr.type, TWFN, sizeof(twfilehdr.type));
-	strncpy(twfilehdr.name, Backup_FileName.c_str(), sizeof(twfilehdr.name));
+	strncpy(twfilehdr.name, Backup_FileName.c_str(), sizeof(twfilehdr.name) - 1);
 	twfilehdr.size = (file_size == 0 ? 1024 : file_size);
-	twfilehdr.compressed = use_compression;
+	twfilehdr.compressed = codec;
+	twfilehdr.stream_id = stream_id;
 	twfilehdr.crc = crc32(0L, Z_NULL, 0);
 	twfilehdr.crc = crc32(twfilehdr.crc, (const unsigned char*) &twfilehdr, sizeof(twfilehdr));
 
@@ -203,27 +206,30 @@ bool twadbbu::Write_TWFN(std::string Backup_FileName, uint64_t file_size, bool u
 	return true;
 }
 
-bool twadbbu::Write_TWIMG(std::string Backup_FileName, uint64_t file_size) {
+bool twadbbu::Write_TWIMG(std::string Backup_FileName, uint64_t file_size, uint32_t stream_id) {
 	int adb_control_bu_fd;
 	struct twfilehdr twimghdr;
 
 	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_WRONLY | O_NONBLOCK);
+	memset(&twimghdr, 0, sizeof(twimghdr));
 	strncpy(twimghdr.start_of_header, TWRP, sizeof(twimghdr.start_of_header));
 	strncpy(twimghdr.type, TWIMG, sizeof(twimghdr.type));
 	twimghdr.size = file_size;
-	strncpy(twimghdr.name, Backup_FileName.c_str(), sizeof(twimghdr.name));
+	strncpy(twimghdr.name, Backup_FileName.c_str(), sizeof(twimghdr.name) - 1);
+	twimghdr.stream_id = stream_id;
 	twimghdr.crc = crc32(0L, Z_NULL, 0);
 	twimghdr.crc = crc32(twimghdr.crc, (const unsigned char*) &twimghdr, sizeof(twimghdr));
 	printf("Sending TWIMG to adb\n");
 	if (write(adb_control_bu_fd, &twimghdr, sizeof(twimghdr)) < 1) {
 		printf("Cannot write to adb control channel: %s\n", strerror(errno));
+		close(adb_control_bu_fd);
 		return false;
 	}
-
+	close(adb_control_bu_fd);
 	return true;
 }
 
-bool twadbbu::Write_TWEOF() {
+bool twadbbu::Write_TWEOF(uint32_t stream_id) {
 	struct AdbBackupControlType tweof;
 	int adb_control_bu_fd;
 	int errctr = 0;
@@ -244,6 +250,7 @@ bool twadbbu::Write_TWEOF() {
 	memset(&tweof, 0, sizeof(tweof));
 	strncpy(tweof.start_of_header, TWRP, sizeof(tweof.start_of_header));
 	strncpy(tweof.type, TWEOF, sizeof(tweof.type));
+	tweof.stream_id = stream_id;
 	tweof.crc = crc32(0L, Z_NULL, 0);
 	tweof.crc = crc32(tweof.crc, (const unsigned char*) &tweof, sizeof(tweof));
 	printf("Sending TWEOF to adb backup\n");
@@ -260,9 +267,9 @@ bool twadbbu::Write_TWERROR() {
 	struct AdbBackupControlType twerror;
 	int adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_WRONLY | O_NONBLOCK);
 
+	memset(&twerror, 0, sizeof(twerror));
 	strncpy(twerror.start_of_header, TWRP, sizeof(twerror.start_of_header));
 	strncpy(twerror.type, TWERROR, sizeof(twerror.type));
-	memset(twerror.space, 0, sizeof(twerror.space));
 	twerror.crc = crc32(0L, Z_NULL, 0);
 	twerror.crc = crc32(twerror.crc, (const unsigned char*) &twerror, sizeof(twerror));
 	if (write(adb_control_bu_fd, &twerror, sizeof(twerror)) < 0) {
@@ -293,11 +300,13 @@ bool twadbbu::Write_TWENDADB() {
 	return true;
 }
 
-bool twadbbu::Write_TWDATA(FILE* adbd_fp) {
+bool twadbbu::Write_TWDATA(FILE* adbd_fp, uint32_t stream_id, uint64_t data_size) {
 	struct AdbBackupControlType data_block;
 	memset(&data_block, 0, sizeof(data_block));
 	strncpy(data_block.start_of_header, TWRP, sizeof(data_block.start_of_header));
 	strncpy(data_block.type, TWDATA, sizeof(data_block.type));
+	data_block.stream_id = stream_id;
+	data_block.data_size = data_size;
 	data_block.crc = crc32(0L, Z_NULL, 0);
 	data_block.crc = crc32(data_block.crc, (const unsigned char*) &data_block, sizeof(data_block));
 	if (fwrite(&data_block, 1, sizeof(data_block), adbd_fp) != sizeof(data_block))  {
@@ -305,3 +314,29 @@ bool twadbbu::Write_TWDATA(FILE* adbd_fp) {
 	}
 	return true;
 }
+
+uint64_t twadbbu::Get_Link_Rate() {
+	uint64_t rate = 0;
+	FILE *fp = fopen(TW_ADB_LINK_RATE, "r");
+
+	if (fp == NULL)
+		return 0;
+	if (fscanf(fp, "%" SCNu64, &rate) != 1)
+		rate = 0;
+	fclose(fp);
+	return rate;
+}
+
+bool twadbbu::Resume_Restore() {
+	int fd;
+
+	if (access(TW_ADB_CHECKPOINT, F_OK) != 0)
+		return false;
+	fd = open(TW_ADB_RESUME, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("Unable to create %s: %s\n", TW_ADB_RESUME, strerror(errno));
+		return false;
+	}
+	close(fd);
+	return true;
+}
@@ -40,12 +40,24 @@ public:
 	static std::vector<std::string> Get_ADB_Backup_Files(std::string fname);                       //List ADB Files in String Vector
 	static bool Write_ADB_Stream_Header(uint64_t partition_count);                                 //Write ADB Stream Header to stream
 	static bool Write_ADB_Stream_Trailer();                                                        //Write ADB Stream Trailer to stream
-	static bool Write_TWFN(std::string Backup_FileName, uint64_t file_size, bool use_compression); //Write a tar image to stream
-	static bool Write_TWIMG(std::string Backup_FileName, uint64_t file_size);                      //Write a partition image to stream
-	static bool Write_TWEOF();                                                                     //Write ADB End-Of-File marker to stream
+	static bool Write_TWFN(std::string Backup_FileName, uint64_t file_size, uint64_t codec, uint32_t stream_id); //Write a tar image to stream
+	static bool Write_TWIMG(std::string Backup_FileName, uint64_t file_size, uint32_t stream_id);  //Write a partition image to stream
+	static bool Write_TWEOF(uint32_t stream_id);                                                   //Write ADB End-Of-File marker to stream
 	static bool Write_TWERROR();                                                                   //Write error message occurred to stream
 	static bool Write_TWENDADB();                                                                  //Write ADB End-Of-Stream command to stream
-	static bool Write_TWDATA(FILE* adbd_fp);                                                       //Write TWDATA separator
+	static bool Write_TWDATA(FILE* adbd_fp, uint32_t stream_id, uint64_t data_size);               //Write TWDATA separator
+	static uint64_t Get_Link_Rate();                                                               //Bytes per second ADB Backup can send, 0 if not measured yet
+	static bool Resume_Restore();                                                                  //Let the next adb restore resume the interrupted one, false if there is none
+
+	//Name of the data FIFO of a stream, inline as twrpTar uses it without the library
+	static std::string Stream_Fifo(const std::string& fifo, uint32_t stream_id) {
+		std::stringstream str;
+
+		if (stream_id == 0)
+			return fifo;
+		str << fifo << "." << stream_id;
+		return str.str();
+	}
 };
 
 #endif //__LIBTWADBBU_HPP
@@ -22,10 +22,15 @@
 #define TWRP_STREAM_ARG "stream"
 #define TW_ADB_BACKUP "/tmp/twadbbackup"		//FIFO for adb backup
 #define TW_ADB_RESTORE "/tmp/twadbrestore"		//FIFO for adb restore
+							//Streams other than 0 use the FIFO name followed by .<stream id>
 #define TW_ADB_BU_CONTROL "/tmp/twadbbucontrol"		//FIFO for sending control from TWRP to ADB Backup
 #define TW_ADB_TWRP_CONTROL "/tmp/twadbtwrpcontrol"	//FIFO for sending control from ADB Backup to TWRP
+#define TW_ADB_LINK_RATE "/tmp/twadblinkrate"		//Bytes per second ADB Backup measured sending to adbd, updated after each file
+#define TW_ADB_CHECKPOINT "/tmp/twadbcheckpoint"	//Files and checkpoints the last adb restore got through
+#define TW_ADB_RESUME "/tmp/twadbresume"		//Present when the next adb restore resumes from TW_ADB_CHECKPOINT
 #define TWRP "TWRP"					//Magic Value
 #define ADB_BU_MAX_ERROR 20				//Max amount of errors for while loops
+#define ADB_BACKUP_DATA_WAIT 10000			//usecs to wait for a stream fifo to fill before checking it again
 #define ADB_BACKUP_OP "adbbackup"
 #define ADB_RESTORE_OP "adbrestore"
 
@@ -39,9 +44,22 @@
 #define TWMD5 "twverifymd5"				//This command is compared to the md5trailer by ORS to verify transfer
 #define TWENDADB "twendadb"				//End Protocol
 #define TWERROR "twerror"				//Send error
+#define TWCHECKPOINT "twcheckpoint"			//Offset and md5 of the data of a file so far
 #define ADB_BACKUP_VERSION 3				//Backup Version
+#define ADB_BACKUP_MULTI_STREAM_VERSION 4		//Backup Version of streams with more than one partition in flight
+#define ADB_BACKUP_SIZED_DATA_VERSION 5			//Backup Version of streams whose data headers carry the size of the data
+#define ADB_BACKUP_CODEC_VERSION 6			//Backup Version of streams whose files can be LZ4 compressed
+#define ADB_BACKUP_CHECKPOINT_VERSION 7			//Backup Version of streams with checkpoints in the file data
+#define ADB_CHECKPOINT_INTERVAL (64 * 1024 * 1024)	//File data between checkpoints
+
+//Codec of a file in the compressed field of its header, the same values as Tar_Stream_Codec
+#define ADB_CODEC_NONE 0
+#define ADB_CODEC_GZIP 1
+#define ADB_CODEC_LZ4 2
+#define ADB_BACKUP_MAX_STREAMS 2			//Stream 0 carries file system partitions, stream 1 images
 #define DATA_MAX_CHUNK_SIZE 1048576			//Maximum size between each data header
 #define MAX_ADB_READ 512				//align with default tar size for amount to read fom adb stream
+#define RESTORE_RING_SIZE (4 * DATA_MAX_CHUNK_SIZE)	//Buffer of each restore stream, larger than its fifo and two chunks
 
 /*
 structs for adb backup need to align to 512 bytes for reading 512
@@ -60,6 +78,21 @@ struct but not really a command
   | File Data              |
   | File/Image MD5 Trailer |
   | etc...                 |
+
+  File data is sent in chunks of DATA_MAX_CHUNK_SIZE, each one a TWDATA
+  header followed by the data, the last chunk of a file is padded with 0s.
+  From version 5 the TWDATA header gives the size of the data after it
+  instead, padded with 0s to a multiple of MAX_ADB_READ. A data size of 0
+  is a full chunk of the older versions.
+  File headers, data headers and trailers carry the id of the stream they
+  belong to. In a version 4 stream the chunks of different streams are
+  interleaved, so a partition image and a tar can be sent at the same time.
+  Each stream has its own FIFO between TWRP and adb backup and carries one
+  file at a time. Version 3 streams only use stream 0, whose id fields are 0.
+  From version 7 a checkpoint follows every ADB_CHECKPOINT_INTERVAL of file
+  data. It gives the md5 of the data of the file so far, a restore that was
+  interrupted can skip the files it finished and continue an image from the
+  last checkpoint it reached.
 */
 
 //determine whether struct is 512 bytes, if not fail compilation
@@ -70,7 +103,9 @@ struct AdbBackupControlType {
 	char start_of_header[8];			//stores the magic value #define TWRP
 	char type[16];					//stores the type of command, TWENDADB, TWCNT, TWEOF, TWMD5, TWDATA and TWERROR
 	uint32_t crc;					//stores the zlib 32 bit crc of the AdbBackupControlType struct to allow for making sure we are processing metadata
-	char space[484];				//stores space to align the struct to 512 bytes
+	uint32_t stream_id;				//stores the stream a TWDATA or TWEOF belongs to
+	uint64_t data_size;				//stores the bytes of data after a TWDATA header, 0 for DATA_MAX_CHUNK_SIZE - MAX_ADB_READ
+	char space[472];				//stores space to align the struct to 512 bytes
 
 	//return a C++ string while not reading outside the type char array
 	std::string get_type() {
@@ -83,9 +118,11 @@ struct twfilehdr {
 	char start_of_header[8];			//stores the magic value #define TWRP
 	char type[16];					//stores the type of file header, TWFN or TWIMG
 	uint64_t size;					//stores the size of the file contained after this header in the backup file
-	uint64_t compressed;				//stores whether the file is compressed or not. 1 == compressed and 0 == uncompressed
+	uint64_t compressed;				//stores the codec of the file, ADB_CODEC_NONE, ADB_CODEC_GZIP or ADB_CODEC_LZ4
 	uint32_t crc;					//stores the zlib 32 bit crc of the twfilehdr struct to allow for making sure we are processing metadata
-	char name[468];					//stores the filename of the file
+	char name[456];					//stores the filename of the file
+	uint32_t stream_id;				//stores the stream the file is sent on
+	uint64_t resume_offset;				//stores where a resumed restore continues the image, set by adb backup for TWRP
 };
 
 //md5 for files stored as a trailer to files in the adb backup file to check
@@ -96,7 +133,19 @@ struct AdbBackupFileTrailer {
 	uint32_t crc;					//stores the zlib 32 bit crc of the AdbBackupFileTrailer struct to allow for making sure we are processing metadata
 	uint32_t ident;					//stores crc to determine if header is encapsulated in stream as data
 	char md5[40];					//stores the md5 computation of the file
-	char space[440];				//stores space to align the struct to 512 bytes
+	uint32_t stream_id;				//stores the stream of the file the trailer ends
+	char space[436];				//stores space to align the struct to 512 bytes
+};
+
+//position in the data of a file an interrupted restore can continue from
+struct AdbBackupCheckpoint {
+	char start_of_header[8];			//stores the magic value #define TWRP
+	char type[16];					//stores the AdbBackupCheckpoint type TWCHECKPOINT
+	uint32_t crc;					//stores the zlib 32 bit crc of the AdbBackupCheckpoint struct to allow for making sure we are processing metadata
+	uint32_t stream_id;				//stores the stream of the file
+	uint64_t offset;				//stores the bytes of file data before the checkpoint
+	char md5[40];					//stores the md5 computation of those bytes
+	char space[432];				//stores space to align the struct to 512 bytes
 };
 
 //info for version and number of partitions backed up
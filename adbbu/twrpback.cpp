@@ -23,7 +23,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/time.h>
+#include <time.h>
+#include <inttypes.h>
 #include <zlib.h>
 #include <ctype.h>
 #include <semaphore.h>
@@ -47,11 +52,16 @@ twrpback::twrpback(void) {
 	write_fd = 0;
 	adb_control_twrp_fd = 0;
 	adb_control_bu_fd = 0;
-	adb_read_fd = 0;
-	adb_write_fd = 0;
 	ors_fd = 0;
-	debug_adb_fd = 0;
 	firstPart = true;
+	totalbytes = 0;
+	endadbReceived = false;
+	digest_pipe[0] = digest_pipe[1] = -1;
+	spliceAdb = true;
+	vmspliceFifo = true;
+	adbdBytes = 0;
+	adbdUsecs = 0;
+	initStreams();
 	createFifos();
 	adbloginit();
 }
@@ -98,23 +108,68 @@ void twrpback::adblogwrite(std::string writemsg) {
 	adblogfile << writemsg << std::flush;
 }
 
+void twrpback::initStreams(void) {
+	for (uint32_t i = 0; i < ADB_BACKUP_MAX_STREAMS; i++) {
+		streams[i].fd = -1;
+		streams[i].debug_fd = -1;
+		streams[i].busy = false;
+		streams[i].trailer = false;
+		streams[i].eof = false;
+		streams[i].md5fnsize = 0;
+		streams[i].fileBytes = 0;
+		streams[i].chunk = NULL;
+		streams[i].pipeSize = 0;
+		streams[i].ring = NULL;
+		streams[i].ringSize = 0;
+		streams[i].ringPos = 0;
+		streams[i].waiting = false;
+		streams[i].nextCheckpoint = 0;
+		streams[i].skip = false;
+		streams[i].resumeOffset = 0;
+		streams[i].resumeVerified = false;
+		streams[i].image = false;
+	}
+}
+
+void twrpback::closeStreams(const char *fifo) {
+	for (uint32_t i = 0; i < ADB_BACKUP_MAX_STREAMS; i++) {
+		std::string fn = twadbbu::Stream_Fifo(fifo, i);
+
+		if (streams[i].fd >= 0)
+			close(streams[i].fd);
+		if (streams[i].debug_fd >= 0)
+			close(streams[i].debug_fd);
+		delete [] streams[i].chunk;
+		if (streams[i].ring != NULL)
+			munmap(streams[i].ring, streams[i].ringSize);
+		streams[i].fd = -1;
+		streams[i].debug_fd = -1;
+		streams[i].chunk = NULL;
+		streams[i].ring = NULL;
+		streams[i].ringSize = 0;
+		streams[i].busy = false;
+		if (access(fn.c_str(), F_OK) == 0)
+			unlink(fn.c_str());
+	}
+}
+
 void twrpback::close_backup_fds() {
 	if (ors_fd > 0)
 		close(ors_fd);
 	if (write_fd > 0)
 		close(write_fd);
-	if (adb_read_fd > 0)
-		close(adb_read_fd);
 	if (adb_control_bu_fd > 0)
 		close(adb_control_bu_fd);
-	#ifdef _DEBUG_ADB_BACKUP
-		if (debug_adb_fd > 0)
-			close(debug_adb_fd);
-	#endif
+	ors_fd = write_fd = adb_control_bu_fd = 0;
 	if (adbd_fp != NULL)
 		fclose(adbd_fp);
-	if (access(TW_ADB_BACKUP, F_OK) == 0)
-		unlink(TW_ADB_BACKUP);
+	adbd_fp = NULL;
+	for (int i = 0; i < 2; i++) {
+		if (digest_pipe[i] >= 0)
+			close(digest_pipe[i]);
+		digest_pipe[i] = -1;
+	}
+	closeStreams(TW_ADB_BACKUP);
 }
 
 void twrpback::close_restore_fds() {
@@ -126,39 +181,266 @@ void twrpback::close_restore_fds() {
 		close(adb_control_bu_fd);
 	if (adb_control_twrp_fd > 0)
 		close(adb_control_twrp_fd);
+	ors_fd = write_fd = adb_control_bu_fd = adb_control_twrp_fd = 0;
 	if (adbd_fp != NULL)
 		fclose(adbd_fp);
-	if (access(TW_ADB_RESTORE, F_OK) == 0)
-		unlink(TW_ADB_RESTORE);
+	adbd_fp = NULL;
+	closeStreams(TW_ADB_RESTORE);
+}
+
+static const size_t page_size = sysconf(_SC_PAGESIZE);
+
+static uint64_t Now_Usecs(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+The time spent moving data to adbd is how long adbd and the USB link took
+to take it, TWRP uses the rate to decide whether compressing a partition
+helps. It is written to a new file that is renamed so TWRP never reads a
+partial value.
+*/
+void twrpback::saveLinkRate(void) {
+	std::string tmp = std::string(TW_ADB_LINK_RATE) + ".tmp";
+	FILE *fp;
+
+	if (adbdUsecs == 0)
+		return;
+	fp = fopen(tmp.c_str(), "w");
+	if (fp == NULL)
+		return;
+	fprintf(fp, "%" PRIu64 "\n", adbdBytes * 1000000 / adbdUsecs);
+	if (fclose(fp) == 0)
+		rename(tmp.c_str(), TW_ADB_LINK_RATE);
+	else
+		unlink(tmp.c_str());
+}
+
+bool twrpback::writeAdbd(const char *data, size_t len) {
+	if (fwrite(data, 1, len, adbd_fp) != len || fflush(adbd_fp) != 0) {
+		adblogwrite("Error writing backup data to adbd\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+Move up to len bytes of the fifo of a stream to adbd. The data is spliced
+to adbd so it never passes through twrpback, a tee of it taken first is
+read back from the digest pipe for the md5. If the adbd fd can't be
+spliced to the data is copied like before.
+*/
+ssize_t twrpback::moveBackupData(adbStream *stream, size_t len) {
+	ssize_t bytes, moved, ret;
+	uint64_t start;
+
+	len = std::min(len, (size_t) DATA_MAX_CHUNK_SIZE);
+	if (spliceAdb) {
+		bytes = tee(stream->fd, digest_pipe[1], len, 0);
+		if (bytes <= 0) {
+			std::string msg = "Cannot tee backup stream: ";
+			printErrMsg(msg, errno);
+			return -1;
+		}
+		start = Now_Usecs();
+		for (moved = 0; moved < bytes; moved += ret) {
+			ret = splice(stream->fd, NULL, adbd_fd, NULL, bytes - moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			if (ret < 0 && errno == EINVAL && moved == 0) {
+				adblogwrite("adbd does not support splice, copying backup data\n");
+				spliceAdb = false;
+				if (read(stream->fd, stream->chunk, bytes) != bytes || !writeAdbd(stream->chunk, bytes))
+					return -1;
+				break;
+			}
+			if (ret <= 0) {
+				std::string msg = "Cannot splice backup data to adbd: ";
+				printErrMsg(msg, errno);
+				return -1;
+			}
+		}
+		adbdUsecs += Now_Usecs() - start;
+		for (moved = 0; moved < bytes; moved += ret) {
+			ret = read(digest_pipe[0], stream->chunk + moved, bytes - moved);
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			if (ret <= 0) {
+				std::string msg = "Cannot read digest pipe: ";
+				printErrMsg(msg, errno);
+				return -1;
+			}
+		}
+	} else {
+		bytes = read(stream->fd, stream->chunk, len);
+		if (bytes <= 0) {
+			std::string msg = "Cannot read backup stream: ";
+			printErrMsg(msg, errno);
+			return -1;
+		}
+		start = Now_Usecs();
+		if (!writeAdbd(stream->chunk, bytes))
+			return -1;
+		adbdUsecs += Now_Usecs() - start;
+	}
+	adbdBytes += bytes;
+	stream->digest.update((unsigned char *) stream->chunk, bytes);
+	#ifdef _DEBUG_ADB_BACKUP
+	if (write(stream->debug_fd, stream->chunk, bytes) < 1) {
+		std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
+		printErrMsg(msg, errno);
+		return -1;
+	}
+	#endif
+	return bytes;
+}
+
+/*
+Data TWRP writes to a stream fifo is sent to adbd behind a TWDATA header
+with the id of the stream and the size of the data, so the data of
+several streams can follow each other in any order. Data is only sent
+once the fifo is half full, that keeps the headers a small part of the
+stream. When drain is set at the end of the file everything left in the
+fifo is sent and padded to a multiple of MAX_ADB_READ.
+*/
+bool twrpback::sendBackupData(uint32_t id, bool drain) {
+	adbStream *stream = &streams[id];
+	char padding[MAX_ADB_READ];
+	int avail = 0;
+	size_t dataSize, sent;
+	ssize_t bytes;
+
+	if (ioctl(stream->fd, FIONREAD, &avail) < 0) {
+		std::string msg = "Cannot read backup stream: ";
+		printErrMsg(msg, errno);
+		return false;
+	}
+	dataSize = drain ? avail : avail & ~(MAX_ADB_READ - 1);
+	stream->waiting = (!drain && dataSize < stream->pipeSize / 2 && avail > 0);
+	if (dataSize == 0 || stream->waiting)
+		return true;
+
+	if (!twadbbu::Write_TWDATA(adbd_fp, id, dataSize) || fflush(adbd_fp) != 0) {
+		adblogwrite("Error writing TWDATA to adbd\n");
+		return false;
+	}
+	for (sent = 0; sent < dataSize; sent += bytes) {
+		bytes = moveBackupData(stream, dataSize - sent);
+		if (bytes < 0)
+			return false;
+	}
+	if (dataSize % MAX_ADB_READ) {
+		std::stringstream paddingStr;
+		paddingStr << MAX_ADB_READ - dataSize % MAX_ADB_READ;
+		adblogwrite("writing padding to stream: " + paddingStr.str() + " bytes\n");
+		memset(padding, 0, sizeof(padding));
+		if (!writeAdbd(padding, MAX_ADB_READ - dataSize % MAX_ADB_READ))
+			return false;
+	}
+	totalbytes += dataSize;
+	stream->fileBytes += dataSize;
+	if (!drain && stream->fileBytes >= stream->nextCheckpoint)
+		return writeCheckpoint(id);
+	return true;
+}
+
+/*
+A checkpoint gives the md5 of the data of the file sent so far. It always
+sits between two TWDATA chunks, so a restore can check the data up to it
+and continue an interrupted image from there.
+*/
+bool twrpback::writeCheckpoint(uint32_t id) {
+	adbStream *stream = &streams[id];
+	struct AdbBackupCheckpoint checkpoint;
+	twrpMD5 digest = stream->digest; //the md5 of the file goes on, finish a copy
+
+	memset(&checkpoint, 0, sizeof(checkpoint));
+	strncpy(checkpoint.start_of_header, TWRP, sizeof(checkpoint.start_of_header));
+	strncpy(checkpoint.type, TWCHECKPOINT, sizeof(checkpoint.type));
+	checkpoint.stream_id = id;
+	checkpoint.offset = stream->fileBytes;
+	strncpy(checkpoint.md5, digest.return_digest_string().c_str(), sizeof(checkpoint.md5) - 1);
+	checkpoint.crc = crc32(0L, Z_NULL, 0);
+	checkpoint.crc = crc32(checkpoint.crc, (const unsigned char*) &checkpoint, sizeof(checkpoint));
+	if (!writeAdbd((const char*) &checkpoint, sizeof(checkpoint)))
+		return false;
+	stream->nextCheckpoint = stream->fileBytes + ADB_CHECKPOINT_INTERVAL;
+	return true;
+}
+
+/*
+We received the command that TWRP is done with the file on a stream.
+TWRP closed the fifo before sending it, so the data still in the fifo
+belongs to this file. We send it followed by the md5 trailer of the file.
+*/
+bool twrpback::endBackupFile(uint32_t id) {
+	adbStream *stream = &streams[id];
+	AdbBackupFileTrailer md5trailer;
+
+	if (!sendBackupData(id, true))
+		return false;
+
+	memset(&md5trailer, 0, sizeof(md5trailer));
+
+	std::string md5string = stream->digest.return_digest_string();
+
+	strncpy(md5trailer.start_of_trailer, TWRP, sizeof(md5trailer.start_of_trailer));
+	strncpy(md5trailer.type, MD5TRAILER, sizeof(md5trailer.type));
+	strncpy(md5trailer.md5, md5string.c_str(), sizeof(md5trailer.md5));
+	md5trailer.stream_id = id;
+
+	md5trailer.crc = crc32(0L, Z_NULL, 0);
+	md5trailer.crc = crc32(md5trailer.crc, (const unsigned char*) &md5trailer, sizeof(md5trailer));
+
+	md5trailer.ident = crc32(0L, Z_NULL, 0);
+	md5trailer.ident = crc32(md5trailer.ident, (const unsigned char*) &md5trailer, sizeof(md5trailer));
+	md5trailer.ident = crc32(md5trailer.ident, (const unsigned char*) &stream->md5fnsize, sizeof(stream->md5fnsize));
+
+	if (fwrite(&md5trailer, 1, sizeof(md5trailer), adbd_fp) != sizeof(md5trailer))  {
+		adblogwrite("Error writing md5trailer to adbd\n");
+		return false;
+	}
+	fflush(adbd_fp);
 	#ifdef _DEBUG_ADB_BACKUP
-	if (debug_adb_fd > 0)
-		close(debug_adb_fd);
+	if (stream->debug_fd >= 0)
+		close(stream->debug_fd);
+	stream->debug_fd = -1;
 	#endif
+	saveLinkRate();
+	stream->busy = false;
+	return true;
 }
 
 bool twrpback::backup(std::string command) {
-	twrpMD5 digest;
-	int bytes = 0, errctr = 0;
-	char adbReadStream[MAX_ADB_READ];
-	uint64_t totalbytes = 0, dataChunkBytes = 0, fileBytes = 0;
-	uint64_t md5fnsize = 0;
+	int errctr = 0;
 	struct AdbBackupControlType endadb;
 
 	//ADBSTRUCT_STATIC_ASSERT(sizeof(endadb) == MAX_ADB_READ);
 
-	bool writedata = true;
-	bool compressed = false;
-	bool firstDataPacket = true;
-
 	adbd_fp = fdopen(adbd_fd, "w");
 	if (adbd_fp == NULL) {
 		adblogwrite("Unable to open adb_fp\n");
 		return false;
 	}
 
-	if (mkfifo(TW_ADB_BACKUP, 0666) < 0) {
-		adblogwrite("Unable to create TW_ADB_BACKUP fifo\n");
-		return false;
+	//the rate of an earlier backup may be for a different link
+	unlink(TW_ADB_LINK_RATE);
+
+	for (uint32_t i = 0; i < ADB_BACKUP_MAX_STREAMS; i++) {
+		std::string fifo = twadbbu::Stream_Fifo(TW_ADB_BACKUP, i);
+
+		if (mkfifo(fifo.c_str(), 0666) < 0) {
+			adblogwrite("Unable to create " + fifo + " fifo\n");
+			close_backup_fds();
+			return false;
+		}
 	}
 
 	adblogwrite("opening TW_ADB_FIFO\n");
@@ -188,28 +470,76 @@ bool twrpback::backup(std::string command) {
 		return false;
 	}
 
-	memset(&adbReadStream, 0, sizeof(adbReadStream));
 	memset(&cmd, 0, sizeof(cmd));
 
+	//The fifos are opened for writing as well, select() would see the end
+	//of file each time TWRP closes its end otherwise
 	adblogwrite("opening TW_ADB_BU_CONTROL\n");
-	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_RDONLY | O_NONBLOCK);
+	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_RDWR | O_NONBLOCK);
 	if (adb_control_bu_fd < 0) {
 		adblogwrite("Unable to open TW_ADB_BU_CONTROL for reading.\n");
 		close_backup_fds();
 		return false;
 	}
 
-	adblogwrite("opening TW_ADB_BACKUP\n");
-	adb_read_fd = open(TW_ADB_BACKUP, O_RDONLY | O_NONBLOCK);
-	if (adb_read_fd < 0) {
-		adblogwrite("Unable to open TW_ADB_BACKUP for reading.\n");
+	for (uint32_t i = 0; i < ADB_BACKUP_MAX_STREAMS; i++) {
+		std::string fifo = twadbbu::Stream_Fifo(TW_ADB_BACKUP, i);
+
+		adblogwrite("opening " + fifo + "\n");
+		streams[i].fd = open(fifo.c_str(), O_RDWR | O_NONBLOCK);
+		if (streams[i].fd < 0) {
+			adblogwrite("Unable to open " + fifo + " for reading.\n");
+			close_backup_fds();
+			return false;
+		}
+		//a larger fifo lets each TWDATA carry more data, the default works too
+		if (fcntl(streams[i].fd, F_SETPIPE_SZ, DATA_MAX_CHUNK_SIZE) < 0)
+			adblogwrite("Unable to resize " + fifo + "\n");
+		streams[i].pipeSize = fcntl(streams[i].fd, F_GETPIPE_SZ);
+		if ((int) streams[i].pipeSize < 0)
+			streams[i].pipeSize = 0;
+		streams[i].chunk = new char [DATA_MAX_CHUNK_SIZE];
+	}
+
+	if (pipe(digest_pipe) < 0) {
+		std::string msg = "Unable to create digest pipe: ";
+		printErrMsg(msg, errno);
 		close_backup_fds();
 		return false;
 	}
+	fcntl(digest_pipe[1], F_SETPIPE_SZ, DATA_MAX_CHUNK_SIZE);
 
 	//loop until TWENDADB sent
 	while (true) {
-		if (read(adb_control_bu_fd, &cmd, sizeof(cmd)) > 0) {
+		fd_set fds;
+		int max_fd = adb_control_bu_fd;
+		bool waiting = false;
+		struct timeval timeout;
+
+		FD_ZERO(&fds);
+		FD_SET(adb_control_bu_fd, &fds);
+		for (uint32_t i = 0; i < ADB_BACKUP_MAX_STREAMS; i++) {
+			//a fifo with data stays readable, check those again after a while
+			if (streams[i].busy && streams[i].waiting) {
+				waiting = true;
+			} else if (streams[i].busy) {
+				FD_SET(streams[i].fd, &fds);
+				max_fd = std::max(max_fd, streams[i].fd);
+			}
+		}
+		timeout.tv_sec = 0;
+		timeout.tv_usec = ADB_BACKUP_DATA_WAIT;
+		if (select(max_fd + 1, &fds, NULL, NULL, waiting ? &timeout : NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			std::string msg = "Unable to wait for backup data: ";
+			printErrMsg(msg, errno);
+			close_backup_fds();
+			return false;
+		}
+
+		//commands go first so TWEOF picks up the end of its file
+		if (FD_ISSET(adb_control_bu_fd, &fds) && read(adb_control_bu_fd, &cmd, sizeof(cmd)) == sizeof(cmd)) {
 			struct AdbBackupControlType structcmd;
 
 			memcpy(&structcmd, cmd, sizeof(cmd));
@@ -217,14 +547,12 @@ bool twrpback::backup(std::string command) {
 
 			//we received an error, exit and unlink
 			if (cmdtype == TWERROR) {
-				writedata = false;
 				adblogwrite("Error received. Quitting...\n");
 				close_backup_fds();
 				return false;
 			}
 			//we received the end of adb backup stream so we should break the loop
 			else if (cmdtype == TWENDADB) {
-				writedata = false;
 				adblogwrite("Recieved TWENDADB\n");
 				memcpy(&endadb, cmd, sizeof(cmd));
 				std::stringstream str;
@@ -234,7 +562,6 @@ bool twrpback::backup(std::string command) {
 			}
 			//we recieved the TWSTREAMHDR structure metadata to write to adb
 			else if (cmdtype == TWSTREAMHDR) {
-				writedata = false;
 				adblogwrite("writing TWSTREAMHDR\n");
 				if (fwrite(cmd, 1, sizeof(cmd), adbd_fp) != sizeof(cmd)) {
 					std::string msg = "Error writing TWSTREAMHDR to adbd";
@@ -244,279 +571,392 @@ bool twrpback::backup(std::string command) {
 				}
 				fflush(adbd_fp);
 			}
-			//we will be writing an image from TWRP
-			else if (cmdtype == TWIMG) {
-				struct twfilehdr twimghdr;
-
-				adblogwrite("writing TWIMG\n");
-				digest.init();
-				memset(&twimghdr, 0, sizeof(twimghdr));
-				memcpy(&twimghdr, cmd, sizeof(cmd));
-				md5fnsize = twimghdr.size;
-				compressed = false;
-
-				#ifdef _DEBUG_ADB_BACKUP
-				std::string debug_fname = "/data/media/";
-				debug_fname.append(basename(twimghdr.name));
-				debug_fname.append("-backup.img");
-				debug_adb_fd = open(debug_fname.c_str(), O_WRONLY | O_CREAT, 0666);
-				adblogwrite("Opening adb debug tar\n");
-				#endif
-
-				if (fwrite(cmd, 1, sizeof(cmd), adbd_fp) != sizeof(cmd)) {
-					adblogwrite("Error writing TWIMG to adbd\n");
-					close_backup_fds();
-					return false;
-				}
-				fflush(adbd_fp);
-				writedata = true;
-			}
-			//we will be writing a tar from TWRP
-			else if (cmdtype == TWFN) {
+			//we will be writing an image or a tar from TWRP on one of the streams
+			else if (cmdtype == TWIMG || cmdtype == TWFN) {
 				struct twfilehdr twfilehdr;
 
-				adblogwrite("writing TWFN\n");
-				digest.init();
-
 				//ADBSTRUCT_STATIC_ASSERT(sizeof(twfilehdr) == MAX_ADB_READ);
 
-				memset(&twfilehdr, 0, sizeof(twfilehdr));
+				adblogwrite("writing " + cmdtype + "\n");
 				memcpy(&twfilehdr, cmd, sizeof(cmd));
-				md5fnsize = twfilehdr.size;
-
-				compressed = twfilehdr.compressed == 1 ? true: false;
+				uint32_t id = twfilehdr.stream_id;
+				if (id >= ADB_BACKUP_MAX_STREAMS || streams[id].busy) {
+					adblogwrite("Invalid stream for " + cmdtype + "\n");
+					close_backup_fds();
+					return false;
+				}
+				streams[id].digest.init();
+				streams[id].md5fnsize = twfilehdr.size;
+				streams[id].fileBytes = 0;
+				streams[id].waiting = false;
+				streams[id].nextCheckpoint = ADB_CHECKPOINT_INTERVAL;
+				streams[id].busy = true;
 
 				#ifdef _DEBUG_ADB_BACKUP
 				std::string debug_fname = "/data/media/";
 				debug_fname.append(basename(twfilehdr.name));
-				debug_fname.append("-backup.tar");
-				debug_adb_fd = open(debug_fname.c_str(), O_WRONLY | O_CREAT, 0666);
+				debug_fname.append(cmdtype == TWIMG ? "-backup.img" : "-backup.tar");
+				streams[id].debug_fd = open(debug_fname.c_str(), O_WRONLY | O_CREAT, 0666);
 				adblogwrite("Opening adb debug tar\n");
 				#endif
 
 				if (fwrite(cmd, 1, sizeof(cmd), adbd_fp) != sizeof(cmd)) {
-					adblogwrite("Error writing TWFN to adbd\n");
+					adblogwrite("Error writing " + cmdtype + " to adbd\n");
 					close_backup_fds();
 					return false;
 				}
 				fflush(adbd_fp);
-				writedata = true;
-			}
-			/*
-			We received the command that we are done with the file stream.
-			We will flush the remaining data stream.
-			Update md5 and write final results to adb stream.
-			If we need padding because the total bytes are not a multiple
-			of 512, we pad the end with 0s to we reach 512.
-			We also write the final md5 to the adb stream.
-			*/
+			}
 			else if (cmdtype == TWEOF) {
 				adblogwrite("received TWEOF\n");
-				while ((bytes = read(adb_read_fd, &adbReadStream, sizeof(adbReadStream)) != 0)) {
-					totalbytes += bytes;
-					fileBytes += bytes;
-					dataChunkBytes += bytes;
-
-					char *writeAdbReadStream = new char [bytes];
-					memcpy(writeAdbReadStream, adbReadStream, bytes);
-
-					digest.update((unsigned char *) writeAdbReadStream, bytes);
-					if (fwrite(writeAdbReadStream, 1, bytes, adbd_fp) < 0) {
-						std::string msg = "Cannot write to adbd stream: ";
-						printErrMsg(msg, errno);
-					}
-					#if defined(_DEBUG_ADB_BACKUP)
-					if (write(debug_adb_fd, writeAdbReadStream, bytes) < 1) {
-						std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-						printErrMsg(msg, errno);
-						close_restore_fds();
-						return false;
-					}
-					#endif
-					fflush(adbd_fp);
-					delete [] writeAdbReadStream;
-					memset(adbReadStream, 0, sizeof(adbReadStream));
+				if (structcmd.stream_id >= ADB_BACKUP_MAX_STREAMS || !streams[structcmd.stream_id].busy) {
+					adblogwrite("TWEOF for a stream without a file\n");
+					close_backup_fds();
+					return false;
 				}
-
-				if (fileBytes % DATA_MAX_CHUNK_SIZE != 0) {
-					int64_t count = fileBytes / DATA_MAX_CHUNK_SIZE + 1;
-					uint64_t ceilingBytes = count * DATA_MAX_CHUNK_SIZE;
-					char padding[ceilingBytes - fileBytes];
-					int paddingBytes = sizeof(padding);
-					memset(padding, 0, paddingBytes);
-					std::stringstream paddingStr;
-					paddingStr << paddingBytes;
-					adblogwrite("writing padding to stream: " + paddingStr.str() + " bytes\n");
-					if (fwrite(padding, 1, paddingBytes, adbd_fp) != sizeof(padding)) {
-						adblogwrite("Error writing padding to adbd\n");
-						close_backup_fds();
-						return false;
-					}
-					#if defined(_DEBUG_ADB_BACKUP)
-					if (write(debug_adb_fd, padding, paddingBytes) < 1) {
-						std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-						printErrMsg(msg, errno);
-						close_restore_fds();
-						return false;
-					}
-					#endif
-					totalbytes += paddingBytes;
-					digest.update((unsigned char *) padding, paddingBytes);
-					fflush(adbd_fp);
+				if (!endBackupFile(structcmd.stream_id)) {
+					close_backup_fds();
+					return false;
 				}
+			}
+			memset(&cmd, 0, sizeof(cmd));
+		}
 
-				AdbBackupFileTrailer md5trailer;
+		for (uint32_t i = 0; i < ADB_BACKUP_MAX_STREAMS; i++) {
+			if (streams[i].busy && (streams[i].waiting || FD_ISSET(streams[i].fd, &fds)) && !sendBackupData(i, false)) {
+				close_backup_fds();
+				return false;
+			}
+		}
+	}
 
-				memset(&md5trailer, 0, sizeof(md5trailer));
+	//Write the final end adb structure to the adb stream
+	if (fwrite(&endadb, 1, sizeof(endadb), adbd_fp) != sizeof(endadb)) {
+		adblogwrite("Error writing endadb to adbd\n");
+		close_backup_fds();
+		return false;
+	}
+	fflush(adbd_fp);
+	close_backup_fds();
+	return true;
+}
 
-				std::string md5string = digest.return_digest_string();
+/*
+Commands TWRP sends while restoring. When wait is set this blocks until
+one command was handled, otherwise it handles what is already there.
+*/
+bool twrpback::restoreControl(bool wait) {
+	char cmd[MAX_ADB_READ];
+	struct AdbBackupControlType structcmd;
+	ssize_t bytes;
 
-				strncpy(md5trailer.start_of_trailer, TWRP, sizeof(md5trailer.start_of_trailer));
-				strncpy(md5trailer.type, MD5TRAILER, sizeof(md5trailer.type));
-				strncpy(md5trailer.md5, md5string.c_str(), sizeof(md5trailer.md5));
+	while (true) {
+		bytes = read(adb_control_bu_fd, &cmd, sizeof(cmd));
+		if (bytes != sizeof(cmd)) {
+			if (bytes < 0 && errno != EAGAIN && errno != EINTR) {
+				std::string msg = "Unable to read TW_ADB_BU_CONTROL: ";
+				printErrMsg(msg, errno);
+				return false;
+			}
+			if (!wait)
+				return true;
+			fd_set fds;
+			FD_ZERO(&fds);
+			FD_SET(adb_control_bu_fd, &fds);
+			select(adb_control_bu_fd + 1, &fds, NULL, NULL, NULL);
+			continue;
+		}
 
-				md5trailer.crc = crc32(0L, Z_NULL, 0);
-				md5trailer.crc = crc32(md5trailer.crc, (const unsigned char*) &md5trailer, sizeof(md5trailer));
+		memcpy(&structcmd, cmd, sizeof(cmd));
+		std::string cmdtype = structcmd.get_type();
+
+		//If we receive TWEOF from TWRP close the data fifo of the stream
+		if (cmdtype == TWEOF) {
+			adblogwrite("Received TWEOF\n");
+			if (structcmd.stream_id < ADB_BACKUP_MAX_STREAMS) {
+				adbStream *stream = &streams[structcmd.stream_id];
+
+				if (stream->fd >= 0)
+					close(stream->fd);
+				stream->fd = -1;
+				stream->eof = true;
+				if (stream->trailer)
+					fileRestored(structcmd.stream_id);
+			}
+		}
+		//Stop when TWRP sends TWENDADB
+		else if (cmdtype == TWENDADB) {
+			adblogwrite("Received TWENDADB\n");
+			endadbReceived = true;
+		}
+		//we received an error, exit and unlink
+		else if (cmdtype == TWERROR) {
+			adblogwrite("Error received. Quitting...\n");
+			return false;
+		}
+		if (wait)
+			return true;
+	}
+}
 
-				md5trailer.ident = crc32(0L, Z_NULL, 0);
-				md5trailer.ident = crc32(md5trailer.ident, (const unsigned char*) &md5trailer, sizeof(md5trailer));
-				md5trailer.ident = crc32(md5trailer.ident, (const unsigned char*) &md5fnsize, sizeof(md5fnsize));
+/*
+Pass the data chunk after a TWDATA header to the fifo of its stream.
+Once TWRP has read all it needs it closes the fifo, the rest of the chunk
+is then only added to the md5. Chunks of version 5 streams give the size
+of their data, what follows up to the next MAX_ADB_READ is padding.
+The chunk is read from adbd into the ring of the stream, added to the
+md5 and handed to the fifo whole instead of MAX_ADB_READ at a time.
+*/
+bool twrpback::restoreData(uint32_t id, uint64_t dataSize) {
+	adbStream *stream;
+	uint64_t chunkSize;
+	size_t readBytes;
 
-				if (fwrite(&md5trailer, 1, sizeof(md5trailer), adbd_fp) != sizeof(md5trailer))  {
-					adblogwrite("Error writing md5trailer to adbd\n");
-					close_backup_fds();
-					return false;
-				}
-				fflush(adbd_fp);
-				writedata = false;
-				firstDataPacket = true;
-				fileBytes = 0;
-			}
-			memset(&cmd, 0, sizeof(cmd));
-			dataChunkBytes = 0;
-		}
-		//If we are to write data because of a new file stream, lets write all the data.
-		//This will allow us to not write data after a command structure has been written
-		//to the adb stream.
-		//If the stream is compressed, we need to always write the data.
-		if (writedata || compressed) {
-			while ((bytes = read(adb_read_fd, &adbReadStream, sizeof(adbReadStream))) > 0) {
-				if (firstDataPacket) {
-					if (!twadbbu::Write_TWDATA(adbd_fp)) {
-						close_backup_fds();
-						return false;
-					}
-					fileBytes += MAX_ADB_READ;
-					fflush(adbd_fp);
-					firstDataPacket = false;
-					dataChunkBytes += sizeof(adbReadStream);
-				}
-				char *writeAdbReadStream = new char [bytes];
-				memcpy(writeAdbReadStream, adbReadStream, bytes);
+	if (id >= ADB_BACKUP_MAX_STREAMS || !streams[id].busy || streams[id].trailer) {
+		adblogwrite("ADB TWDATA for a stream without a file\n");
+		return false;
+	}
+	stream = &streams[id];
+	if (dataSize == 0)
+		dataSize = DATA_MAX_CHUNK_SIZE - MAX_ADB_READ;
+	chunkSize = (dataSize + MAX_ADB_READ - 1) & ~((uint64_t) MAX_ADB_READ - 1);
+	if (stream->ring == NULL) {
+		stream->ringSize = RESTORE_RING_SIZE;
+		void *ring = mmap(NULL, stream->ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ring == MAP_FAILED) {
+			std::string msg = "Unable to map the restore ring: ";
+			printErrMsg(msg, errno);
+			stream->ringSize = 0;
+			return false;
+		}
+		stream->ring = (char*) ring;
+		stream->ringPos = 0;
+	}
 
-				digest.update((unsigned char *) writeAdbReadStream, bytes);
+	for (uint64_t dataChunkBytes = 0; dataChunkBytes < chunkSize; dataChunkBytes += readBytes) {
+		readBytes = std::min((uint64_t) DATA_MAX_CHUNK_SIZE, chunkSize - dataChunkBytes);
+		if (stream->ringPos + readBytes > stream->ringSize)
+			stream->ringPos = 0;
+		char *data = stream->ring + stream->ringPos;
+		if (fread(data, 1, readBytes, adbd_fp) != readBytes) {
+			adblogwrite("Unable to read TWDATA from adbd\n");
+			return false;
+		}
+		//every chunk starts on a page of its own
+		stream->ringPos = (stream->ringPos + readBytes + page_size - 1) / page_size * page_size;
+		if (dataChunkBytes >= dataSize || stream->skip)
+			continue;
+		size_t len = std::min((uint64_t) readBytes, dataSize - dataChunkBytes);
+		if (!passData(stream, data, len))
+			return false;
+	}
+	return true;
+}
 
-				totalbytes += bytes;
-				fileBytes += bytes;
-				dataChunkBytes += bytes;
+bool twrpback::passData(adbStream *stream, char *data, size_t len) {
+	uint64_t offset = stream->fileBytes;
+	size_t skip = 0;
 
-				if (fwrite(writeAdbReadStream, 1, bytes, adbd_fp) != (unsigned long long)bytes) {
-					adblogwrite("Error writing backup data to adbd\n");
-					close_backup_fds();
-					return false;
-				}
-				#ifdef _DEBUG_ADB_BACKUP
-				if (write(debug_adb_fd, writeAdbReadStream, bytes) < 1) {
-					std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-					printErrMsg(msg, errno);
-					close_restore_fds();
-					return false;
-				}
-				#endif
-				fflush(adbd_fp);
-				delete [] writeAdbReadStream;
+	stream->digest.update((unsigned char*) data, len);
+	stream->fileBytes += len;
+	totalbytes += len;
 
-				memset(&adbReadStream, 0, sizeof(adbReadStream));
+	//the interrupted restore wrote the blocks before resumeOffset already
+	if (offset + len <= stream->resumeOffset)
+		return true;
+	if (offset < stream->resumeOffset)
+		skip = (stream->resumeOffset - offset) / MAX_ADB_READ * MAX_ADB_READ;
+	if (stream->resumeOffset > 0 && !stream->resumeVerified) {
+		adblogwrite("The backup does not match the interrupted restore\n");
+		return false;
+	}
+	data += skip;
+	len -= skip;
 
-				if (dataChunkBytes == DATA_MAX_CHUNK_SIZE) {
-					dataChunkBytes = 0;
-					firstDataPacket = true;
-				}
-				else if (dataChunkBytes > (DATA_MAX_CHUNK_SIZE - sizeof(adbReadStream))) {
-					int bytesLeft = DATA_MAX_CHUNK_SIZE - dataChunkBytes;
-					char extraData[bytesLeft];
-
-					memset(&extraData, 0, bytesLeft);
-					while ((bytes = read(adb_read_fd, &extraData, bytesLeft)) != 0) {
-						if (bytes > 0) {
-							totalbytes += bytes;
-							fileBytes += bytes;
-							dataChunkBytes += bytes;
-
-							bytesLeft -= bytes;
-							char *writeAdbReadStream = new char [bytes];
-							memcpy(writeAdbReadStream, extraData, bytes);
-
-							digest.update((unsigned char *) writeAdbReadStream, bytes);
-							if (fwrite(writeAdbReadStream, 1, bytes, adbd_fp) < 0) {
-								std::string msg = "Cannot write to adbd stream: ";
-								printErrMsg(msg, errno);
-								close_restore_fds();
-								return false;
-							}
-							#ifdef _DEBUG_ADB_BACKUP
-							if (write(debug_adb_fd, writeAdbReadStream, bytes) < 1) {
-								std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-								printErrMsg(msg, errno);
-								close_restore_fds();
-								return false;
-							}
-							#endif
-							fflush(adbd_fp);
-							delete [] writeAdbReadStream;
-						}
-						memset(&extraData, 0, bytesLeft);
-						if (bytesLeft == 0) {
-							break;
-						}
-					}
+	#ifdef _DEBUG_ADB_BACKUP
+	if (write(stream->debug_fd, data, len) < 0) {
+		std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
+		printErrMsg(msg, errno);
+		return false;
+	}
+	#endif
 
-					fflush(adbd_fp);
-					dataChunkBytes = 0;
-					firstDataPacket = true;
-				}
+	return writeStream(stream, data, len);
+}
+
+/*
+Hand restored data in the ring of a stream to its fifo. vmsplice() only
+puts references to the ring pages into the pipe and TWRP copies the data
+out of them when it reads, so the data is copied once less than with
+write(). A pipe holds at most pipeSize / page_size pages and each
+chunk starts on a page of its own, so the ring, larger than the pipe and
+two chunks, never reads a chunk into pages the pipe still references.
+Kernels or fifos without vmsplice() get the data written like before.
+*/
+bool twrpback::writeStream(adbStream *stream, char *data, size_t len) {
+	if (stream->fd >= 0 && vmspliceFifo && stream->pipeSize + 2 * DATA_MAX_CHUNK_SIZE > stream->ringSize) {
+		adblogwrite("The stream fifo is larger than the restore ring, writing restore data\n");
+		vmspliceFifo = false;
+	}
+	while (stream->fd >= 0 && len > 0) {
+		ssize_t written;
+
+		if (vmspliceFifo) {
+			struct iovec iov;
+
+			iov.iov_base = data;
+			iov.iov_len = len;
+			written = vmsplice(stream->fd, &iov, 1, 0);
+			if (written < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				adblogwrite("The stream fifo does not support vmsplice, writing restore data\n");
+				vmspliceFifo = false;
+				continue;
 			}
+		} else {
+			written = write(stream->fd, data, len);
+		}
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0) {
+			std::string msg = "Cannot write to TWRP ADB FIFO: ";
+			printErrMsg(msg, errno);
+			adblogwrite("end of stream reached.\n");
+			close(stream->fd);
+			stream->fd = -1;
+			break;
 		}
+		data += written;
+		len -= written;
 	}
+	return true;
+}
 
-	//Write the final end adb structure to the adb stream
-	if (fwrite(&endadb, 1, sizeof(endadb), adbd_fp) != sizeof(endadb)) {
-		adblogwrite("Error writing endadb to adbd\n");
-		close_backup_fds();
+/*
+The checkpoint file lists the files TWRP restored and the last checkpoint
+reached in each image. It stays behind when a restore fails, so a resume
+can skip those files and continue the images. A file is listed with the
+md5 of its trailer, a resume checks the backup sent again against it.
+*/
+void twrpback::loadCheckpoints(void) {
+	std::ifstream file(TW_ADB_CHECKPOINT);
+	std::string type, md5, name;
+	uint64_t offset;
+
+	while (file >> type) {
+		if (type == "file" && file >> md5 && std::getline(file, name) && name.size() > 1) {
+			restoredFiles[name.substr(1)] = md5;
+		} else if (type == "image" && file >> offset >> md5 && std::getline(file, name) && name.size() > 1) {
+			checkpoint point;
+			point.offset = offset;
+			point.md5 = md5;
+			resumeCheckpoints[name.substr(1)] = point;
+		} else {
+			adblogwrite("Invalid line in " TW_ADB_CHECKPOINT "\n");
+			break;
+		}
+	}
+	std::stringstream str;
+	str << restoredFiles.size() << " files and " << resumeCheckpoints.size() << " images to resume\n";
+	adblogwrite(str.str());
+}
+
+void twrpback::saveCheckpoints(void) {
+	std::string tmp = std::string(TW_ADB_CHECKPOINT) + ".tmp";
+	std::ofstream file(tmp.c_str(), std::ofstream::trunc);
+	std::map<std::string, std::string>::iterator done;
+	std::map<std::string, checkpoint>::iterator point;
+
+	for (done = restoredFiles.begin(); done != restoredFiles.end(); done++)
+		file << "file " << done->second << " " << done->first << "\n";
+	for (point = imageCheckpoints.begin(); point != imageCheckpoints.end(); point++)
+		file << "image " << point->second.offset << " " << point->second.md5 << " " << point->first << "\n";
+	file.close();
+	if (file.fail() || rename(tmp.c_str(), TW_ADB_CHECKPOINT) != 0) {
+		adblogwrite("Unable to write " TW_ADB_CHECKPOINT "\n");
+		unlink(tmp.c_str());
+	}
+}
+
+void twrpback::fileRestored(uint32_t id) {
+	adbStream *stream = &streams[id];
+
+	stream->busy = false;
+	if (stream->skip || stream->md5.empty())
+		return;
+	restoredFiles[stream->name] = stream->md5;
+	imageCheckpoints.erase(stream->name);
+	saveCheckpoints();
+}
+
+/*
+Everything before a checkpoint is in the stream fifo when it is read, TWRP
+writes that out even if adb goes away now. The checkpoints of images are
+recorded so a resume can continue from the last one.
+*/
+bool twrpback::restoreCheckpoint(char adbReadStream[]) {
+	struct AdbBackupCheckpoint cp;
+	uint32_t crc, cpcrc;
+	adbStream *stream;
+
+	memcpy(&cp, adbReadStream, sizeof(cp));
+	cpcrc = cp.crc;
+	memset(&cp.crc, 0, sizeof(cp.crc));
+	crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, (const unsigned char*) &cp, sizeof(cp));
+	if (crc != cpcrc) {
+		adblogwrite("ADB TWCHECKPOINT crc header doesn't match\n");
 		return false;
 	}
-	fflush(adbd_fp);
-	close_backup_fds();
+	if (cp.stream_id >= ADB_BACKUP_MAX_STREAMS || !streams[cp.stream_id].busy || streams[cp.stream_id].trailer) {
+		adblogwrite("ADB TWCHECKPOINT for a stream without a file\n");
+		return false;
+	}
+	stream = &streams[cp.stream_id];
+	if (stream->skip)
+		return true;
+
+	twrpMD5 digest = stream->digest; //the md5 of the file goes on, finish a copy
+	std::string md5 = digest.return_digest_string();
+	cp.md5[sizeof(cp.md5) - 1] = 0;
+	if (cp.offset != stream->fileBytes || md5 != cp.md5) {
+		adblogwrite("ADB TWCHECKPOINT doesn't match the data\n");
+		return false;
+	}
+	if (stream->resumeOffset > 0 && cp.offset == stream->resumeOffset) {
+		if (resumeCheckpoints[stream->name].md5 != md5) {
+			adblogwrite("The backup does not match the interrupted restore\n");
+			return false;
+		}
+		adblogwrite("resuming " + stream->name + "\n");
+		stream->resumeVerified = true;
+	}
+	if (stream->image && cp.offset >= stream->resumeOffset) {
+		checkpoint point;
+		point.offset = cp.offset;
+		point.md5 = md5;
+		imageCheckpoints[stream->name] = point;
+		saveCheckpoints();
+	}
 	return true;
 }
 
 bool twrpback::restore(void) {
-	twrpMD5 digest;
-	char cmd[MAX_ADB_READ];
 	char readAdbStream[MAX_ADB_READ];
 	struct AdbBackupControlType structcmd;
 	int errctr = 0;
-	uint64_t totalbytes = 0, dataChunkBytes = 0;
-	uint64_t md5fnsize = 0, fileBytes = 0;
-	bool read_from_adb;
-	bool md5sumdata;
-	bool compressed, tweofrcvd, extraData;
-
-	read_from_adb = true;
+	bool restored = false;
 
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGHUP, SIG_IGN);
 
+	//adb restore continues the last restore only when asked to
+	if (access(TW_ADB_RESUME, F_OK) == 0) {
+		unlink(TW_ADB_RESUME);
+		loadCheckpoints();
+	}
+	else
+		unlink(TW_ADB_CHECKPOINT);
+
 	adbd_fp = fdopen(adbd_fd, "r");
 	if (adbd_fp == NULL) {
 		adblogwrite("Unable to open adb_fp\n");
@@ -524,10 +964,14 @@ bool twrpback::restore(void) {
 		return false;
 	}
 
-	if(mkfifo(TW_ADB_RESTORE, 0666)) {
-		adblogwrite("Unable to create TW_ADB_RESTORE fifo\n");
-		close_restore_fds();
-		return false;
+	for (uint32_t i = 0; i < ADB_BACKUP_MAX_STREAMS; i++) {
+		std::string fifo = twadbbu::Stream_Fifo(TW_ADB_RESTORE, i);
+
+		if (mkfifo(fifo.c_str(), 0666)) {
+			adblogwrite("Unable to create " + fifo + " fifo\n");
+			close_restore_fds();
+			return false;
+		}
 	}
 
 	adblogwrite("opening TW_ADB_FIFO\n");
@@ -553,10 +997,11 @@ bool twrpback::restore(void) {
 	}
 
 	memset(&readAdbStream, 0, sizeof(readAdbStream));
-	memset(&cmd, 0, sizeof(cmd));
 
+	//Also opened for writing so waiting on it does not see the end of file
+	//each time TWRP closes its end after a command
 	adblogwrite("opening TW_ADB_BU_CONTROL\n");
-	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_RDONLY | O_NONBLOCK);
+	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_RDWR | O_NONBLOCK);
 	if (adb_control_bu_fd < 0) {
 		std::string msg = "Unable to open TW_ADB_BU_CONTROL for writing.";
 		printErrMsg(msg, errno);
@@ -575,284 +1020,263 @@ bool twrpback::restore(void) {
 			errctr++;
 			if (errctr > ADB_BU_MAX_ERROR) {
 				adblogwrite("Unable to open TW_ADB_TWRP_CONTROL\n");
-				close_backup_fds();
+				close_restore_fds();
 				return false;
 			}
 		}
 	}
 
 	//Loop until we receive TWENDADB from TWRP
-	while (true) {
-		memset(&cmd, 0, sizeof(cmd));
-		if (read(adb_control_bu_fd, &cmd, sizeof(cmd)) > 0) {
-			struct AdbBackupControlType structcmd;
-			memcpy(&structcmd, cmd, sizeof(cmd));
-			std::string cmdtype = structcmd.get_type();
+	while (!endadbReceived) {
+		if (!restoreControl(false)) {
+			close_restore_fds();
+			return false;
+		}
+		if (endadbReceived)
+			break;
 
-			//If we receive TWEOF from TWRP close adb data fifo
-			if (cmdtype == TWEOF) {
-				adblogwrite("Received TWEOF\n");
-				read_from_adb = true;
-				tweofrcvd = true;
-				close(adb_write_fd);
-			}
-			//Break when TWRP sends TWENDADB
-			else if (cmdtype == TWENDADB) {
-				adblogwrite("Received TWENDADB\n");
-				break;
-			}
-			//we received an error, exit and unlink
-			else if (cmdtype == TWERROR) {
-				adblogwrite("Error received. Quitting...\n");
+		if (fread(readAdbStream, 1, sizeof(readAdbStream), adbd_fp) != sizeof(readAdbStream)) {
+			adblogwrite("adb stream ended before TWENDADB\n");
+			close_restore_fds();
+			return false;
+		}
+		memcpy(&structcmd, readAdbStream, sizeof(readAdbStream));
+		std::string cmdtype = structcmd.get_type();
+
+		//Tell TWRP we have read the entire adb stream
+		if (cmdtype == TWENDADB) {
+			struct AdbBackupControlType endadb;
+			uint32_t crc, endadbcrc;
+
+			memset(&endadb, 0, sizeof(endadb));
+			memcpy(&endadb, readAdbStream, sizeof(readAdbStream));
+			endadbcrc = endadb.crc;
+			memset(&endadb.crc, 0, sizeof(endadb.crc));
+			crc = crc32(0L, Z_NULL, 0);
+			crc = crc32(crc, (const unsigned char*) &endadb, sizeof(endadb));
+
+			if (crc != endadbcrc) {
+				adblogwrite("ADB TWENDADB crc header doesn't match\n");
 				close_restore_fds();
 				return false;
 			}
-		}
-		//If we should read from the adb stream, write commands and data to TWRP
-		if (read_from_adb) {
-			int readbytes;
-			if ((readbytes = fread(readAdbStream, 1, sizeof(readAdbStream), adbd_fp)) == sizeof(readAdbStream)) {
-				memcpy(&structcmd, readAdbStream, sizeof(readAdbStream));
-				std::string cmdtype = structcmd.get_type();
-
-				//Tell TWRP we have read the entire adb stream
-				if (cmdtype == TWENDADB) {
-					struct AdbBackupControlType endadb;
-					uint32_t crc, endadbcrc;
-
-					md5sumdata = false;
-					memset(&endadb, 0, sizeof(endadb));
-					memcpy(&endadb, readAdbStream, sizeof(readAdbStream));
-					endadbcrc = endadb.crc;
-					memset(&endadb.crc, 0, sizeof(endadb.crc));
-					crc = crc32(0L, Z_NULL, 0);
-					crc = crc32(crc, (const unsigned char*) &endadb, sizeof(endadb));
-
-					if (crc == endadbcrc) {
-						adblogwrite("sending TWENDADB\n");
-						if (write(adb_control_twrp_fd, &endadb, sizeof(endadb)) < 1) {
-							std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-							printErrMsg(msg, errno);
-							close_restore_fds();
-							return false;
-						}
-						read_from_adb = false;
-					}
-					else {
-						adblogwrite("ADB TWENDADB crc header doesn't match\n");
-						close_restore_fds();
-						return false;
-					}
-				}
-				//Send TWRP partition metadata
-				else if (cmdtype == TWSTREAMHDR) {
-					struct AdbBackupStreamHeader cnthdr;
-					uint32_t crc, cnthdrcrc;
-
-					//ADBSTRUCT_STATIC_ASSERT(sizeof(cnthdr) == MAX_ADB_READ);
-
-					md5sumdata = false;
-					memset(&cnthdr, 0, sizeof(cnthdr));
-					memcpy(&cnthdr, readAdbStream, sizeof(readAdbStream));
-					cnthdrcrc = cnthdr.crc;
-					memset(&cnthdr.crc, 0, sizeof(cnthdr.crc));
-					crc = crc32(0L, Z_NULL, 0);
-					crc = crc32(crc, (const unsigned char*) &cnthdr, sizeof(cnthdr));
-
-					if (crc == cnthdrcrc) {
-						adblogwrite("Restoring TWSTREAMHDR\n");
-						if (write(adb_control_twrp_fd, readAdbStream, sizeof(readAdbStream)) < 0) {
-							std::string msg = "Cannot write to adb_control_twrp_fd: ";
-							printErrMsg(msg, errno);
-							close_restore_fds();
-							return false;
-						}
-					}
-					else {
-						adblogwrite("ADB TWSTREAMHDR crc header doesn't match\n");
-						close_restore_fds();
-						return false;
-					}
-				}
-				//Tell TWRP we are sending a partition image
-				else if (cmdtype == TWIMG) {
-					struct twfilehdr twimghdr;
-					uint32_t crc, twimghdrcrc;
-					md5sumdata = false;
-					fileBytes = 0;
-					read_from_adb = true;
-					dataChunkBytes = 0;
-					extraData = false;
-
-					digest.init();
-					adblogwrite("Restoring TWIMG\n");
-					memset(&twimghdr, 0, sizeof(twimghdr));
-					memcpy(&twimghdr, readAdbStream, sizeof(readAdbStream));
-					md5fnsize = twimghdr.size;
-					twimghdrcrc = twimghdr.crc;
-					memset(&twimghdr.crc, 0, sizeof(twimghdr.crc));
-
-					crc = crc32(0L, Z_NULL, 0);
-					crc = crc32(crc, (const unsigned char*) &twimghdr, sizeof(twimghdr));
-					if (crc == twimghdrcrc) {
-						if (write(adb_control_twrp_fd, readAdbStream, sizeof(readAdbStream)) < 1) {
-							std::string msg = "Cannot write to adb_control_twrp_fd: ";
-							printErrMsg(msg, errno);
-							close_restore_fds();
-							return false;
-						}
-					}
-					else {
-						adblogwrite("ADB TWIMG crc header doesn't match\n");
-						close_restore_fds();
-						return false;
-					}
 
-					#ifdef _DEBUG_ADB_BACKUP
-					std::string debug_fname = "/data/media/";
-					debug_fname.append(basename(twimghdr.name));
-					debug_fname.append("-restore.img");
-					adblogwrite("image: " + debug_fname + "\n");
-					debug_adb_fd = open(debug_fname.c_str(), O_WRONLY | O_CREAT, 0666);
-					adblogwrite("Opened restore image\n");
-					#endif
-
-					adblogwrite("opening TW_ADB_RESTORE\n");
-					adb_write_fd = open(TW_ADB_RESTORE, O_WRONLY);
-				}
-				//Tell TWRP we are sending a tar stream
-				else if (cmdtype == TWFN) {
-					struct twfilehdr twfilehdr;
-					uint32_t crc, twfilehdrcrc;
-					fileBytes = 0;
-					md5sumdata = false;
-					read_from_adb = true;
-					dataChunkBytes = 0;
-					extraData = false;
-
-					digest.init();
-					adblogwrite("Restoring TWFN\n");
-					memset(&twfilehdr, 0, sizeof(twfilehdr));
-					memcpy(&twfilehdr, readAdbStream, sizeof(readAdbStream));
-					md5fnsize = twfilehdr.size;
-					twfilehdrcrc = twfilehdr.crc;
-					memset(&twfilehdr.crc, 0, sizeof(twfilehdr.crc));
-
-					crc = crc32(0L, Z_NULL, 0);
-					crc = crc32(crc, (const unsigned char*) &twfilehdr, sizeof(twfilehdr));
-
-					if (crc == twfilehdrcrc) {
-						if (write(adb_control_twrp_fd, readAdbStream, sizeof(readAdbStream)) < 1) {
-							std::string msg = "Cannot write to adb_control_twrp_fd: ";
-							printErrMsg(msg, errno);
-							close_restore_fds();
-							return false;
-						}
-					}
-					else {
-						adblogwrite("ADB TWFN crc header doesn't match\n");
+			//TWRP has to be done with every stream first
+			for (uint32_t i = 0; i < ADB_BACKUP_MAX_STREAMS; i++) {
+				while (streams[i].busy && !endadbReceived) {
+					if (!restoreControl(true)) {
 						close_restore_fds();
 						return false;
 					}
+				}
+			}
+			if (endadbReceived)
+				break;
 
-					#ifdef _DEBUG_ADB_BACKUP
-					std::string debug_fname = "/data/media/";
-					debug_fname.append(basename(twfilehdr.name));
-					debug_fname.append("-restore.tar");
-					adblogwrite("tar: " + debug_fname + "\n");
-					debug_adb_fd = open(debug_fname.c_str(), O_WRONLY | O_CREAT, 0666);
-					adblogwrite("Opened restore tar\n");
-					#endif
-
-					compressed = twfilehdr.compressed == 1 ? true: false;
-					adblogwrite("opening TW_ADB_RESTORE\n");
-					adb_write_fd = open(TW_ADB_RESTORE, O_WRONLY);
+			restored = true;
+			adblogwrite("sending TWENDADB\n");
+			if (write(adb_control_twrp_fd, &endadb, sizeof(endadb)) < 1) {
+				std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
+				printErrMsg(msg, errno);
+				close_restore_fds();
+				return false;
+			}
+			while (!endadbReceived) {
+				if (!restoreControl(true)) {
+					close_restore_fds();
+					return false;
 				}
-				else if (cmdtype == MD5TRAILER) {
-					if (fileBytes >= md5fnsize)
-						close(adb_write_fd);
-					if (tweofrcvd) {
-						read_from_adb = true;
-						tweofrcvd = false;
-					}
-					else
-						read_from_adb = false; //don't read from adb until TWRP sends TWEOF
-					md5sumdata = false;
-					if (!checkMD5Trailer(readAdbStream, md5fnsize, &digest)) {
-						close_restore_fds();
-						break;
-					}
-					continue;
+			}
+		}
+		//Send TWRP partition metadata
+		else if (cmdtype == TWSTREAMHDR) {
+			struct AdbBackupStreamHeader cnthdr;
+			uint32_t crc, cnthdrcrc;
+
+			//ADBSTRUCT_STATIC_ASSERT(sizeof(cnthdr) == MAX_ADB_READ);
+
+			memset(&cnthdr, 0, sizeof(cnthdr));
+			memcpy(&cnthdr, readAdbStream, sizeof(readAdbStream));
+			cnthdrcrc = cnthdr.crc;
+			memset(&cnthdr.crc, 0, sizeof(cnthdr.crc));
+			crc = crc32(0L, Z_NULL, 0);
+			crc = crc32(crc, (const unsigned char*) &cnthdr, sizeof(cnthdr));
+
+			if (crc == cnthdrcrc) {
+				adblogwrite("Restoring TWSTREAMHDR\n");
+				if (write(adb_control_twrp_fd, readAdbStream, sizeof(readAdbStream)) < 0) {
+					std::string msg = "Cannot write to adb_control_twrp_fd: ";
+					printErrMsg(msg, errno);
+					close_restore_fds();
+					return false;
 				}
-				//Send the tar or partition image md5 to TWRP
-				else if (cmdtype == TWDATA) {
-					dataChunkBytes += sizeof(readAdbStream);
-					while (true) {
-						if ((readbytes = fread(readAdbStream, 1, sizeof(readAdbStream), adbd_fp)) != sizeof(readAdbStream)) {
-							close_restore_fds();
-							return false;
-						}
-						memcpy(&structcmd, readAdbStream, sizeof(readAdbStream));
-						std::string cmdtype = structcmd.get_type();
-
-						dataChunkBytes += readbytes;
-						totalbytes += readbytes;
-						fileBytes += readbytes;
-
-						if (cmdtype == MD5TRAILER) {
-							if (fileBytes >= md5fnsize)
-								close(adb_write_fd);
-							if (tweofrcvd) {
-								tweofrcvd = false;
-								read_from_adb = true;
-							}
-							else
-								read_from_adb = false; //don't read from adb until TWRP sends TWEOF
-							if (!checkMD5Trailer(readAdbStream, md5fnsize, &digest)) {
-								close_restore_fds();
-								break;
-							}
-							break;
-						}
-
-						digest.update((unsigned char*)readAdbStream, readbytes);
-
-						read_from_adb = true;
-
-						#ifdef _DEBUG_ADB_BACKUP
-						if (write(debug_adb_fd, readAdbStream, sizeof(readAdbStream)) < 0) {
-							std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-							printErrMsg(msg, errno);
-							close_restore_fds();
-							return false;
-						}
-						#endif
-
-						if (write(adb_write_fd, readAdbStream, sizeof(readAdbStream)) < 0) {
-							std::string msg = "Cannot write to TWRP ADB FIFO: ";
-							md5sumdata = true;
-							printErrMsg(msg, errno);
-							adblogwrite("end of stream reached.\n"); 
-							break;
-						}
-
-						if (dataChunkBytes == DATA_MAX_CHUNK_SIZE) {
-							dataChunkBytes = 0;
-							md5sumdata = false;
-							break;
-						}
-					}
+			}
+			else {
+				adblogwrite("ADB TWSTREAMHDR crc header doesn't match\n");
+				close_restore_fds();
+				return false;
+			}
+		}
+		//Tell TWRP we are sending a partition image or a tar stream
+		else if (cmdtype == TWIMG || cmdtype == TWFN) {
+			struct twfilehdr twfilehdr;
+			uint32_t crc, twfilehdrcrc;
+
+			adblogwrite("Restoring " + cmdtype + "\n");
+			memset(&twfilehdr, 0, sizeof(twfilehdr));
+			memcpy(&twfilehdr, readAdbStream, sizeof(readAdbStream));
+			twfilehdrcrc = twfilehdr.crc;
+			memset(&twfilehdr.crc, 0, sizeof(twfilehdr.crc));
+
+			crc = crc32(0L, Z_NULL, 0);
+			crc = crc32(crc, (const unsigned char*) &twfilehdr, sizeof(twfilehdr));
+			if (crc != twfilehdrcrc) {
+				adblogwrite("ADB " + cmdtype + " crc header doesn't match\n");
+				close_restore_fds();
+				return false;
+			}
+
+			uint32_t id = twfilehdr.stream_id;
+			if (id >= ADB_BACKUP_MAX_STREAMS) {
+				adblogwrite("ADB " + cmdtype + " has an invalid stream\n");
+				close_restore_fds();
+				return false;
+			}
+			//a stream carries one file at a time, TWRP has to finish the last one
+			while (streams[id].busy && !endadbReceived) {
+				if (!restoreControl(true)) {
+					close_restore_fds();
+					return false;
 				}
-				else if (md5sumdata) {
-					digest.update((unsigned char*)readAdbStream, sizeof(readAdbStream));
-					md5sumdata = true;
+			}
+			if (endadbReceived)
+				break;
+
+			adbStream *stream = &streams[id];
+			stream->digest.init();
+			stream->md5fnsize = twfilehdr.size;
+			stream->fileBytes = 0;
+			stream->trailer = false;
+			stream->eof = false;
+			stream->busy = true;
+			stream->name = std::string(twfilehdr.name, strnlen(twfilehdr.name, sizeof(twfilehdr.name)));
+			stream->image = (cmdtype == TWIMG);
+			stream->skip = false;
+			stream->resumeOffset = 0;
+			stream->resumeVerified = false;
+			stream->md5 = "";
+
+			//TWRP restored the file before the restore was interrupted
+			if (restoredFiles.find(stream->name) != restoredFiles.end()) {
+				adblogwrite("skipping restored " + stream->name + "\n");
+				stream->skip = true;
+				continue;
+			}
+			std::map<std::string, checkpoint>::iterator point = resumeCheckpoints.find(stream->name);
+			if (stream->image && point != resumeCheckpoints.end()) {
+				std::stringstream str;
+				str << point->second.offset;
+				adblogwrite("resuming " + stream->name + " at " + str.str() + "\n");
+				stream->resumeOffset = point->second.offset;
+				twfilehdr.resume_offset = stream->resumeOffset;
+				crc = crc32(0L, Z_NULL, 0);
+				crc = crc32(crc, (const unsigned char*) &twfilehdr, sizeof(twfilehdr));
+				twfilehdr.crc = crc;
+				memcpy(readAdbStream, &twfilehdr, sizeof(twfilehdr));
+			}
+
+			if (write(adb_control_twrp_fd, readAdbStream, sizeof(readAdbStream)) < 1) {
+				std::string msg = "Cannot write to adb_control_twrp_fd: ";
+				printErrMsg(msg, errno);
+				close_restore_fds();
+				return false;
+			}
+
+			#ifdef _DEBUG_ADB_BACKUP
+			std::string debug_fname = "/data/media/";
+			debug_fname.append(basename(twfilehdr.name));
+			debug_fname.append(cmdtype == TWIMG ? "-restore.img" : "-restore.tar");
+			adblogwrite("debug file: " + debug_fname + "\n");
+			if (stream->debug_fd >= 0)
+				close(stream->debug_fd);
+			stream->debug_fd = open(debug_fname.c_str(), O_WRONLY | O_CREAT, 0666);
+			#endif
+
+			std::string fifo = twadbbu::Stream_Fifo(TW_ADB_RESTORE, id);
+			adblogwrite("opening " + fifo + "\n");
+			stream->fd = open(fifo.c_str(), O_WRONLY);
+			if (stream->fd < 0) {
+				std::string msg = "Unable to open " + fifo + ": ";
+				printErrMsg(msg, errno);
+				close_restore_fds();
+				return false;
+			}
+			//a whole chunk fits, TWRP reads it with one copy out of the ring
+			fcntl(stream->fd, F_SETPIPE_SZ, DATA_MAX_CHUNK_SIZE);
+			int pipeSize = fcntl(stream->fd, F_GETPIPE_SZ);
+			stream->pipeSize = pipeSize > 0 ? pipeSize : 0;
+		}
+		//Send the data chunk to the stream it belongs to
+		else if (cmdtype == TWDATA) {
+			if (!restoreData(structcmd.stream_id, structcmd.data_size)) {
+				close_restore_fds();
+				return false;
+			}
+		}
+		//Check the data of a file sent so far against the backup
+		else if (cmdtype == TWCHECKPOINT) {
+			if (!restoreCheckpoint(readAdbStream)) {
+				close_restore_fds();
+				return false;
+			}
+		}
+		//Send the tar or partition image md5 to TWRP
+		else if (cmdtype == MD5TRAILER) {
+			struct AdbBackupFileTrailer md5tr;
+
+			memcpy(&md5tr, readAdbStream, sizeof(md5tr));
+			uint32_t id = md5tr.stream_id;
+			if (id >= ADB_BACKUP_MAX_STREAMS || !streams[id].busy || streams[id].trailer) {
+				adblogwrite("ADB MD5TRAILER for a stream without a file\n");
+				close_restore_fds();
+				return false;
+			}
+
+			adbStream *stream = &streams[id];
+			md5tr.md5[sizeof(md5tr.md5) - 1] = 0;
+			//TWRP has the file already, the backup has to be the one restored
+			if (stream->skip) {
+				if (restoredFiles[stream->name] != md5tr.md5) {
+					adblogwrite("The backup does not match the interrupted restore\n");
+					close_restore_fds();
+					return false;
 				}
+				stream->trailer = true;
+				stream->busy = false;
+				continue;
+			}
+			if (stream->fd >= 0)
+				close(stream->fd);
+			stream->fd = -1;
+			twrpMD5 digest = stream->digest;
+			if (digest.return_digest_string() == md5tr.md5)
+				stream->md5 = md5tr.md5;
+			if (!checkMD5Trailer(readAdbStream, stream->md5fnsize, &stream->digest)) {
+				close_restore_fds();
+				return false;
 			}
+			stream->trailer = true;
+			//don't send the next file of the stream until TWRP sends TWEOF
+			if (stream->eof)
+				fileRestored(id);
 		}
 	}
 	std::stringstream str;
 	str << totalbytes;
 	close_restore_fds();
+	//TWRP ends the restore with TWENDADB when it fails too
+	if (restored)
+		unlink(TW_ADB_CHECKPOINT);
 	adblogwrite(str.str() + " bytes restored from adbbackup\n");
 	return true;
 }
@@ -18,6 +18,9 @@
 #define _TWRPBACK_HPP
 
 #include <fstream>
+#include <map>
+#include <string>
+#include "twadbstream.h"
 #include "../twrpDigest/twrpMD5.hpp"
 
 class twrpback {
@@ -35,26 +38,79 @@ public:
 	void threadStream(void);                                                 // thread bu for streaming
 
 private:
+	struct adbStream {                                                       // state of one stream of partitions
+		int fd;                                                          // stream FIFO, -1 when closed
+		int debug_fd;                                                    // fd to write debug tars of the stream
+		bool busy;                                                       // a file is in flight on the stream
+		bool trailer;                                                    // restore: md5 trailer of the file was read
+		bool eof;                                                        // restore: TWRP sent TWEOF for the file
+		uint64_t md5fnsize;                                              // size from the file header
+		uint64_t fileBytes;                                              // bytes of the file sent so far
+		char *chunk;                                                     // backup: buffer for the md5 copy of the data
+		size_t pipeSize;                                                 // capacity of the stream FIFO
+		char *ring;                                                      // restore: page aligned buffer the TWDATA chunks are read into
+		size_t ringSize;                                                 // restore: bytes mapped for the ring
+		size_t ringPos;                                                  // restore: where the next chunk is read to
+		bool waiting;                                                    // backup: data in the FIFO, too little to send yet
+		uint64_t nextCheckpoint;                                         // backup: file bytes after which a checkpoint is sent
+		std::string name;                                                // restore: name from the file header
+		bool skip;                                                       // restore: file was restored before the resume, not passed to TWRP
+		uint64_t resumeOffset;                                           // restore: data before this was written before the resume
+		bool resumeVerified;                                             // restore: the checkpoint at resumeOffset matched
+		bool image;                                                      // restore: the file is a partition image
+		std::string md5;                                                 // restore: md5 of the trailer once the data matched it
+		twrpMD5 digest;
+	};
+
+	struct checkpoint {                                                      // last checkpoint reached in an image
+		uint64_t offset;
+		std::string md5;
+	};
+
 	int read_fd;                                                             // ors input fd
 	int write_fd;                                                            // ors operation fd
 	int ors_fd;                                                              // ors output fd
 	int adb_control_twrp_fd;                                                 // fd for bu to twrp communication
 	int adb_control_bu_fd;                                                   // fd for twrp to bu communication
-	int adb_read_fd;                                                         // adb read data stream
-	int adb_write_fd;                                                        // adb write data stream
-	int debug_adb_fd;                                                        // fd to write debug tars
 	bool firstPart;                                                          // first partition in the stream
 	FILE *adbd_fp;                                                           // file pointer for adb stream
 	char cmd[512];                                                           // store result of commands
 	char operation[512];                                                     // operation to send to ors
 	std::ofstream adblogfile;                                                // adb stream log file
 	std::string streamFn;
+	adbStream streams[ADB_BACKUP_MAX_STREAMS];                               // streams in flight, indexed by stream id
+	uint64_t totalbytes;                                                     // data bytes sent or restored
+	bool endadbReceived;                                                     // restore: TWRP sent TWENDADB
+	int digest_pipe[2];                                                      // backup: tee of the data being spliced, for the md5
+	bool spliceAdb;                                                          // backup: adbd fd accepts splice()
+	bool vmspliceFifo;                                                       // restore: stream FIFOs accept vmsplice()
+	uint64_t adbdBytes;                                                      // backup: data bytes handed to adbd
+	uint64_t adbdUsecs;                                                      // backup: time spent handing them over
+	std::map<std::string, std::string> restoredFiles;                        // restore: md5 of the files TWRP restored, by name
+	std::map<std::string, checkpoint> imageCheckpoints;                      // restore: checkpoints of the images being restored, by name
+	std::map<std::string, checkpoint> resumeCheckpoints;                     // restore: where the interrupted restore got to in its images
 	typedef void (twrpback::*ThreadPtr)(void);
 	typedef void* (*PThreadPtr)(void *);
 	void adbloginit(void);                                                   // setup adb log stream file
 	void close_backup_fds();                                                 // close backup resources
 	void close_restore_fds();                                                // close restore resources
 	bool checkMD5Trailer(char adbReadStream[], uint64_t md5fnsize, twrpMD5* digest); // Check MD5 Trailer
+	void initStreams(void);                                                  // reset the stream states
+	void closeStreams(const char *fifo);                                     // close and remove the stream FIFOs
+	bool sendBackupData(uint32_t id, bool drain);                            // send data TWRP wrote to a stream
+	ssize_t moveBackupData(adbStream *stream, size_t len);                   // move data of a stream FIFO to adbd
+	bool writeAdbd(const char *data, size_t len);                            // write to adbd, false on error
+	void saveLinkRate(void);                                                 // store the measured adbd throughput for TWRP
+	bool writeCheckpoint(uint32_t id);                                       // send a checkpoint of the file on a stream
+	void loadCheckpoints(void);                                              // read what the interrupted restore got through
+	void saveCheckpoints(void);                                              // record what this restore got through
+	bool restoreCheckpoint(char adbReadStream[]);                            // check a checkpoint and record it for images
+	void fileRestored(uint32_t id);                                          // TWRP is done with the file on a stream
+	bool endBackupFile(uint32_t id);                                         // send the rest of a file and its md5 trailer
+	bool restoreControl(bool wait);                                          // handle commands from TWRP during restore
+	bool restoreData(uint32_t id, uint64_t dataSize);                        // pass a data chunk from adbd to its stream
+	bool passData(adbStream *stream, char *data, size_t len);                // add restored data to the md5 and write it to the stream
+	bool writeStream(adbStream *stream, char *data, size_t len);             // hand restored data in the ring to the stream FIFO
 	void printErrMsg(std::string msg, int errNum);                          // print error msg to adb log
 };
 
@@ -20,6 +20,7 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := \
     applypatch.cpp \
     bspatch.cpp \
+    deflate_backend.cpp \
     freecache.cpp \
     imgpatch.cpp
 LOCAL_MODULE := libapplypatch
@@ -55,6 +56,7 @@ include $(BUILD_STATIC_LIBRARY)
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := \
     bspatch.cpp \
+    deflate_backend.cpp \
     imgpatch.cpp
 LOCAL_MODULE := libimgpatch
 LOCAL_C_INCLUDES := \
@@ -77,6 +79,7 @@ include $(BUILD_STATIC_LIBRARY)
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := \
     bspatch.cpp \
+    deflate_backend.cpp \
     imgpatch.cpp
 LOCAL_MODULE := libimgpatch
 LOCAL_MODULE_HOST_OS := linux
@@ -132,7 +135,9 @@ LOCAL_SHARED_LIBRARIES := \
 LOCAL_CFLAGS := -Werror
 include $(BUILD_EXECUTABLE)
 
-libimgdiff_src_files := imgdiff.cpp
+libimgdiff_src_files := \
+    deflate_backend.cpp \
+    imgdiff.cpp
 
 # libbsdiff is compiled with -D_FILE_OFFSET_BITS=64.
 libimgdiff_cflags := \
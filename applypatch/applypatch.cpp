@@ -27,9 +27,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <functional>
+#include <map>
 #include <memory>
 #include <string>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -54,6 +57,64 @@ static int GenerateTarget(const FileContents& source_file, const std::unique_ptr
 
 static bool mtd_partitions_scanned = false;
 
+// Size of the writes to, and the verification reads from, an EMMC partition.
+static constexpr size_t kPartitionWriteSize = 1 << 20;
+// Partition writes are synced once per this many bytes, rather than for every write.
+static constexpr size_t kSyncRegionSize = 16 << 20;
+// Alignment of the O_DIRECT verification reads, and the granularity of restarting a write.
+static constexpr size_t kVerifyBlockSize = 4096;
+
+// Digests of the files and partitions this process has read or written, so that checking the same
+// source several times (apply_patch_check, apply_patch, then a verify) reads and hashes it once.
+// Entries are keyed by the inode and the size hashed (the length of the prefix for partitions), and
+// hold while the times of the inode are unchanged and nothing was opened for writing since they
+// were taken; writes to a block device don't show in the stat of its node.
+struct DigestEntry {
+  uint64_t generation;
+  struct timespec mtime;
+  struct timespec ctime;
+  uint8_t sha1[SHA_DIGEST_LENGTH];
+};
+
+static std::map<std::tuple<dev_t, ino_t, uint64_t>, DigestEntry> digest_cache;
+
+static bool SameTime(const struct timespec& a, const struct timespec& b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// 'generation' is the ota_write_generation() from before the data was read.
+static void CacheDigest(const struct stat& sb, uint64_t size, const uint8_t* sha1,
+                        uint64_t generation) {
+  DigestEntry& entry = digest_cache[std::make_tuple(sb.st_dev, sb.st_ino, size)];
+  entry.generation = generation;
+  entry.mtime = sb.st_mtim;
+  entry.ctime = sb.st_ctim;
+  memcpy(entry.sha1, sha1, SHA_DIGEST_LENGTH);
+}
+
+static bool CachedDigest(const struct stat& sb, uint64_t size, uint8_t* sha1) {
+  auto it = digest_cache.find(std::make_tuple(sb.st_dev, sb.st_ino, size));
+  if (it == digest_cache.end()) {
+    return false;
+  }
+  const DigestEntry& entry = it->second;
+  if (entry.generation != ota_write_generation() || !SameTime(entry.mtime, sb.st_mtim) ||
+      !SameTime(entry.ctime, sb.st_ctim)) {
+    digest_cache.erase(it);
+    return false;
+  }
+  memcpy(sha1, entry.sha1, SHA_DIGEST_LENGTH);
+  return true;
+}
+
+// Records the digest of the first 'size' bytes just written to 'partition' and verified.
+static void CachePartitionDigest(const char* partition, size_t size, const uint8_t* sha1) {
+  struct stat sb;
+  if (stat(partition, &sb) == 0) {
+    CacheDigest(sb, size, sha1, ota_write_generation());
+  }
+}
+
 // Read a file into memory; store the file contents and associated metadata in *file.
 // Return 0 on success.
 int LoadFileContents(const char* filename, FileContents* file) {
@@ -65,6 +126,7 @@ int LoadFileContents(const char* filename, FileContents* file) {
     return LoadPartitionContents(filename, file);
   }
 
+  uint64_t generation = ota_write_generation();
   struct stat sb;
   if (stat(filename, &sb) == -1) {
     printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
@@ -85,6 +147,7 @@ int LoadFileContents(const char* filename, FileContents* file) {
   }
   file->data = std::move(data);
   SHA1(file->data.data(), file->data.size(), file->sha1);
+  CacheDigest(sb, sb.st_size, file->sha1, generation);
   return 0;
 }
 
@@ -138,11 +201,14 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
   std::sort(pairs.begin(), pairs.end());
 
   const char* partition = pieces[1].c_str();
+  uint64_t generation = ota_write_generation();
   unique_file dev(ota_fopen(partition, "rb"));
   if (!dev) {
     printf("failed to open emmc partition \"%s\": %s\n", partition, strerror(errno));
     return -1;
   }
+  struct stat sb;
+  bool have_stat = fstat(fileno(dev.get()), &sb) == 0;
 
   SHA_CTX sha_ctx;
   SHA1_Init(&sha_ctx);
@@ -185,6 +251,9 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
     memcpy(&temp_ctx, &sha_ctx, sizeof(SHA_CTX));
     uint8_t sha_so_far[SHA_DIGEST_LENGTH];
     SHA1_Final(sha_so_far, &temp_ctx);
+    if (have_stat) {
+      CacheDigest(sb, current_size, sha_so_far, generation);
+    }
 
     uint8_t parsed_sha[SHA_DIGEST_LENGTH];
     if (ParseSha1(current_sha1.c_str(), parsed_sha) != 0) {
@@ -233,6 +302,10 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     printf("fsync of \"%s\" failed: %s\n", filename, strerror(errno));
     return -1;
   }
+  struct stat sb;
+  if (fstat(fd, &sb) == 0) {
+    CacheDigest(sb, file->data.size(), file->sha1, ota_write_generation());
+  }
   if (ota_close(fd) != 0) {
     printf("close of \"%s\" failed: %s\n", filename, strerror(errno));
     return -1;
@@ -241,6 +314,91 @@ int SaveFileContents(const char* filename, const FileContents* file) {
   return 0;
 }
 
+// Flush and drop the page cache, so that a following read really comes from the device.
+static void DropCaches() {
+  sync();
+  unique_fd dc(ota_open("/proc/sys/vm/drop_caches", O_WRONLY));
+  if (TEMP_FAILURE_RETRY(ota_write(dc, "3\n", 2)) == -1) {
+    printf("write to /proc/sys/vm/drop_caches failed: %s\n", strerror(errno));
+  } else {
+    printf("  caches dropped\n");
+  }
+  ota_close(dc);
+  sleep(1);
+}
+
+// Writes 'len' bytes to a partition, syncing whenever 'unsynced' (the bytes written since the last
+// sync) reaches kSyncRegionSize, so the dirty data stays bounded without a sync per write.
+static bool WritePartitionData(int fd, const unsigned char* data, size_t len, size_t* unsynced) {
+  size_t done = 0;
+  while (done < len) {
+    size_t to_write = std::min(len - done, kPartitionWriteSize);
+    if (FileSink(data + done, to_write, fd) != to_write) {
+      return false;
+    }
+    done += to_write;
+    *unsynced += to_write;
+    if (*unsynced >= kSyncRegionSize) {
+      if (ota_fsync(fd) != 0) {
+        return false;
+      }
+      *unsynced = 0;
+    }
+  }
+  return true;
+}
+
+// Reads back the first 'size' bytes of 'partition', kPartitionWriteSize at a time, and passes each
+// piece with its offset to 'fn' until it returns false. The reads use O_DIRECT so that they come
+// from the device rather than the page cache; if the partition doesn't support it, the caches are
+// dropped instead. Returns false on read errors.
+static bool ReadBackPartition(
+    const char* partition, size_t size,
+    const std::function<bool(const unsigned char*, size_t, size_t)>& fn) {
+  bool direct = true;
+  unique_fd fd(ota_open(partition, O_RDONLY | O_DIRECT));
+  if (fd == -1 && errno == EINVAL) {
+    direct = false;
+    DropCaches();
+    fd.reset(ota_open(partition, O_RDONLY));
+  }
+  if (fd == -1) {
+    printf("failed to reopen %s for verify (%s)\n", partition, strerror(errno));
+    return false;
+  }
+
+  void* aligned = nullptr;
+  if (posix_memalign(&aligned, kVerifyBlockSize, kPartitionWriteSize) != 0) {
+    printf("failed to allocate the verify buffer\n");
+    return false;
+  }
+  std::unique_ptr<unsigned char, decltype(&free)> buffer(static_cast<unsigned char*>(aligned),
+                                                         free);
+
+  for (size_t pos = 0; pos < size;) {
+    size_t to_read = std::min(size - pos, kPartitionWriteSize);
+    // O_DIRECT reads must be block aligned; the tail is read up to the next block boundary.
+    size_t request = direct ? (to_read + kVerifyBlockSize - 1) / kVerifyBlockSize * kVerifyBlockSize
+                            : to_read;
+    size_t so_far = 0;
+    while (so_far < to_read) {
+      ssize_t read_count =
+          TEMP_FAILURE_RETRY(ota_read(fd, buffer.get() + so_far, request - so_far));
+      if (read_count <= 0) {
+        printf("verify read error %s at %zu: %s\n", partition, pos + so_far,
+               read_count == 0 ? "unexpected EOF" : strerror(errno));
+        return false;
+      }
+      so_far += read_count;
+    }
+    if (!fn(buffer.get(), pos, to_read)) {
+      return true;
+    }
+    pos += to_read;
+  }
+  return true;
+}
+
 // Write a memory buffer to 'target' partition, a string of the form
 // "EMMC:<partition_device>[:...]". The target name
 // might contain multiple colons, but WriteToPartition() only uses the first
@@ -332,27 +490,20 @@ int WriteToPartition(const unsigned char* data, size_t len, const std::string& t
         case EMMC: {
             size_t start = 0;
             bool success = false;
-            unique_fd fd(ota_open(partition, O_RDWR | O_SYNC));
-            if (fd < 0) {
-                printf("failed to open %s: %s\n", partition, strerror(errno));
-                return -1;
-            }
-
             for (size_t attempt = 0; attempt < 2; ++attempt) {
+                unique_fd fd(ota_open(partition, O_RDWR));
+                if (fd < 0) {
+                    printf("failed to open %s: %s\n", partition, strerror(errno));
+                    return -1;
+                }
                 if (TEMP_FAILURE_RETRY(lseek(fd, start, SEEK_SET)) == -1) {
                     printf("failed seek on %s: %s\n", partition, strerror(errno));
                     return -1;
                 }
-                while (start < len) {
-                    size_t to_write = len - start;
-                    if (to_write > 1<<20) to_write = 1<<20;
-
-                    ssize_t written = TEMP_FAILURE_RETRY(ota_write(fd, data+start, to_write));
-                    if (written == -1) {
-                        printf("failed write writing to %s: %s\n", partition, strerror(errno));
-                        return -1;
-                    }
-                    start += written;
+                size_t unsynced = 0;
+                if (!WritePartitionData(fd, data + start, len - start, &unsynced)) {
+                    printf("failed write writing to %s: %s\n", partition, strerror(errno));
+                    return -1;
                 }
                 if (ota_fsync(fd) != 0) {
                    printf("failed to sync to %s (%s)\n", partition, strerror(errno));
@@ -362,59 +513,23 @@ int WriteToPartition(const unsigned char* data, size_t len, const std::string& t
                    printf("failed to close %s (%s)\n", partition, strerror(errno));
                    return -1;
                 }
-                unique_fd fd(ota_open(partition, O_RDONLY));
-                if (fd < 0) {
-                   printf("failed to reopen %s for verify (%s)\n", partition, strerror(errno));
-                   return -1;
-                }
-
-                // Drop caches so our subsequent verification read
-                // won't just be reading the cache.
-                sync();
-                unique_fd dc(ota_open("/proc/sys/vm/drop_caches", O_WRONLY));
-                if (TEMP_FAILURE_RETRY(ota_write(dc, "3\n", 2)) == -1) {
-                    printf("write to /proc/sys/vm/drop_caches failed: %s\n", strerror(errno));
-                } else {
-                    printf("  caches dropped\n");
-                }
-                ota_close(dc);
-                sleep(1);
 
-                // verify
-                if (TEMP_FAILURE_RETRY(lseek(fd, 0, SEEK_SET)) == -1) {
-                    printf("failed to seek back to beginning of %s: %s\n",
-                           partition, strerror(errno));
-                    return -1;
-                }
-                unsigned char buffer[4096];
+                // verify, restarting the write from the first mismatching block if any
                 start = len;
-                for (size_t p = 0; p < len; p += sizeof(buffer)) {
-                    size_t to_read = len - p;
-                    if (to_read > sizeof(buffer)) {
-                        to_read = sizeof(buffer);
-                    }
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count =
-                                TEMP_FAILURE_RETRY(ota_read(fd, buffer+so_far, to_read-so_far));
-                        if (read_count == -1) {
-                            printf("verify read error %s at %zu: %s\n",
-                                   partition, p, strerror(errno));
-                            return -1;
+                bool read_ok = ReadBackPartition(partition, len,
+                        [&](const unsigned char* buffer, size_t pos, size_t size) {
+                    for (size_t p = 0; p < size; p += kVerifyBlockSize) {
+                        size_t n = std::min(kVerifyBlockSize, size - p);
+                        if (memcmp(buffer + p, data + pos + p, n) != 0) {
+                            printf("verification failed starting at %zu\n", pos + p);
+                            start = pos + p;
+                            return false;
                         }
-                        if (static_cast<size_t>(read_count) < to_read) {
-                            printf("short verify read %s at %zu: %zd %zu %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
-                    }
-
-                    if (memcmp(buffer, data+p, to_read) != 0) {
-                        printf("verification failed starting at %zu\n", p);
-                        start = p;
-                        break;
                     }
+                    return true;
+                });
+                if (!read_ok) {
+                    return -1;
                 }
 
                 if (start == len) {
@@ -429,10 +544,6 @@ int WriteToPartition(const unsigned char* data, size_t len, const std::string& t
                 return -1;
             }
 
-            if (ota_close(fd) != 0) {
-                printf("error closing %s (%s)\n", partition, strerror(errno));
-                return -1;
-            }
             sync();
             break;
         }
@@ -484,6 +595,48 @@ static int FindMatchingPatch(uint8_t* sha1, const std::vector<std::string>& patc
   return -1;
 }
 
+// Answers what loading 'filename' and matching it against 'patch_sha1_str' would, from the digest
+// cache: returns 1 if it matches (or, with no sha1s, would load), 0 if it doesn't, and -1 if the
+// digests it needs aren't cached.
+static int CachedSha1Check(const char* filename, const std::vector<std::string>& patch_sha1_str) {
+  uint8_t sha1[SHA_DIGEST_LENGTH];
+  struct stat sb;
+  if (strncmp(filename, "MTD:", 4) == 0 || strncmp(filename, "BML:", 4) == 0) {
+    return -1;
+  }
+  if (strncmp(filename, "EMMC:", 5) != 0) {
+    if (stat(filename, &sb) == -1 || !CachedDigest(sb, sb.st_size, sha1)) {
+      return -1;
+    }
+    return (patch_sha1_str.empty() || FindMatchingPatch(sha1, patch_sha1_str) >= 0) ? 1 : 0;
+  }
+
+  // Like LoadPartitionContents(), the smallest size whose prefix has its sha1 decides.
+  std::vector<std::string> pieces = android::base::Split(filename, ":");
+  if (pieces.size() < 4 || pieces.size() % 2 != 0 || stat(pieces[1].c_str(), &sb) == -1) {
+    return -1;
+  }
+  std::vector<std::pair<size_t, std::string>> pairs;
+  for (size_t i = 2; i < pieces.size(); i += 2) {
+    size_t size;
+    if (!android::base::ParseUint(pieces[i], &size) || size == 0) {
+      return -1;
+    }
+    pairs.push_back({ size, pieces[i + 1] });
+  }
+  std::sort(pairs.begin(), pairs.end());
+  for (const auto& pair : pairs) {
+    uint8_t expected[SHA_DIGEST_LENGTH];
+    if (ParseSha1(pair.second.c_str(), expected) != 0 || !CachedDigest(sb, pair.first, sha1)) {
+      return -1;
+    }
+    if (memcmp(sha1, expected, SHA_DIGEST_LENGTH) == 0) {
+      return (patch_sha1_str.empty() || FindMatchingPatch(sha1, patch_sha1_str) >= 0) ? 1 : 0;
+    }
+  }
+  return 0;
+}
+
 // Returns 0 if the contents of the file (argv[2]) or the cached file
 // match any of the sha1's on the command line (argv[3:]).  Returns
 // nonzero otherwise.
@@ -494,14 +647,23 @@ int applypatch_check(const char* filename, const std::vector<std::string>& patch
   // LoadFileContents is successful.  (Useful for reading
   // partitions, where the filename encodes the sha1s; no need to
   // check them twice.)
-  if (LoadFileContents(filename, &file) != 0 ||
+  int cached = CachedSha1Check(filename, patch_sha1_str);
+  if (cached == 1) {
+    printf("file \"%s\" unchanged since it was last checked\n", filename);
+    return 0;
+  }
+  if (cached == 0 || LoadFileContents(filename, &file) != 0 ||
       (!patch_sha1_str.empty() && FindMatchingPatch(file.sha1, patch_sha1_str) < 0)) {
     printf("file \"%s\" doesn't have any of expected sha1 sums; checking cache\n", filename);
 
     // If the source file is missing or corrupted, it might be because we were killed in the middle
     // of patching it.  A copy of it should have been made in cache_temp_source.  If that file
     // exists and matches the sha1 we're looking for, the check still passes.
-    if (LoadFileContents(CacheLocation::location().cache_temp_source().c_str(), &file) != 0) {
+    std::string cache_source = CacheLocation::location().cache_temp_source();
+    if (!patch_sha1_str.empty() && CachedSha1Check(cache_source.c_str(), patch_sha1_str) == 1) {
+      return 0;
+    }
+    if (LoadFileContents(cache_source.c_str(), &file) != 0) {
       printf("failed to load cache file\n");
       return 1;
     }
@@ -593,6 +755,11 @@ int applypatch(const char* source_filename, const char* target_filename,
     return 1;
   }
 
+  if (CachedSha1Check(target_filename, { target_sha1_str }) == 1) {
+    printf("already %s\n", short_sha1(target_sha1).c_str());
+    return 0;
+  }
+
   // We try to load the target file into the source_file object.
   FileContents source_file;
   if (LoadFileContents(target_filename, &source_file) == 0) {
@@ -666,6 +833,10 @@ int applypatch_flash(const char* source_filename, const char* target_filename,
   pieces.push_back(target_sha1_str);
   std::string fullname = android::base::Join(pieces, ':');
   FileContents source_file;
+  if (CachedSha1Check(fullname.c_str(), { target_sha1_str }) == 1) {
+    printf("already %s\n", short_sha1(target_sha1).c_str());
+    return 0;
+  }
   if (LoadPartitionContents(fullname, &source_file) == 0 &&
       memcmp(source_file.sha1, target_sha1, SHA_DIGEST_LENGTH) == 0) {
     // The early-exit case: the image was already applied, this partition
@@ -688,9 +859,37 @@ int applypatch_flash(const char* source_filename, const char* target_filename,
     printf("write of copied data to %s failed\n", target_filename);
     return 1;
   }
+  if (source_file.data.size() == target_size &&
+      memcmp(source_file.sha1, target_sha1, SHA_DIGEST_LENGTH) == 0) {
+    CachePartitionDigest(pieces[1].c_str(), target_size, target_sha1);
+  }
   return 0;
 }
 
+// Reads back the first 'size' bytes of 'partition' and returns whether they hash to 'sha1'.
+static bool VerifyPartition(const char* partition, size_t size,
+                            const uint8_t sha1[SHA_DIGEST_LENGTH]) {
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  size_t verified = 0;
+  if (!ReadBackPartition(partition, size, [&](const unsigned char* data, size_t, size_t len) {
+        SHA1_Update(&ctx, data, len);
+        verified += len;
+        return true;
+      }) ||
+      verified != size) {
+    return false;
+  }
+
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1_Final(digest, &ctx);
+  if (memcmp(digest, sha1, SHA_DIGEST_LENGTH) != 0) {
+    printf("verification of %s failed: got %s\n", partition, short_sha1(digest).c_str());
+    return false;
+  }
+  return true;
+}
+
 static int GenerateTarget(const FileContents& source_file, const std::unique_ptr<Value>& patch,
                           const std::string& target_filename,
                           const uint8_t target_sha1[SHA_DIGEST_LENGTH], const Value* bonus_data) {
@@ -723,45 +922,96 @@ static int GenerateTarget(const FileContents& source_file, const std::unique_ptr
     return 1;
   }
 
-  // We store the decoded output in memory.
-  std::string memory_sink_str;  // Don't need to reserve space.
-  SinkFn sink = [&memory_sink_str](const unsigned char* data, size_t len) {
-    memory_sink_str.append(reinterpret_cast<const char*>(data), len);
-    return len;
-  };
+  // The patched output is streamed to the partition instead of being kept in memory, so the peak
+  // memory stays at the source plus a write buffer. Overwriting the target before its SHA-1 is
+  // known is safe: the source is backed up on /cache above, and applypatch falls back to that copy
+  // when it runs again.
+  std::vector<std::string> pieces = android::base::Split(target_filename, ":");
+  const char* partition = pieces[1].c_str();
 
-  SHA_CTX ctx;
-  SHA1_Init(&ctx);
+  bool success = false;
+  for (size_t attempt = 0; attempt < 2 && !success; ++attempt) {
+    unique_fd fd(ota_open(partition, O_RDWR));
+    if (fd == -1) {
+      printf("failed to open %s: %s\n", partition, strerror(errno));
+      return 1;
+    }
 
-  int result;
-  if (use_bsdiff) {
-    result =
-        ApplyBSDiffPatch(source_file.data.data(), source_file.data.size(), *patch, 0, sink, &ctx);
-  } else {
-    result = ApplyImagePatch(source_file.data.data(), source_file.data.size(), *patch, sink, &ctx,
-                             bonus_data);
-  }
+    std::vector<unsigned char> buffer;
+    buffer.reserve(kPartitionWriteSize);
+    size_t target_size = 0;
+    size_t unsynced = 0;
+    bool write_failed = false;
+    auto flush_buffer = [&]() {
+      if (!write_failed && !WritePartitionData(fd, buffer.data(), buffer.size(), &unsynced)) {
+        printf("failed write writing to %s: %s\n", partition, strerror(errno));
+        write_failed = true;
+      }
+      buffer.clear();
+      return !write_failed;
+    };
+    SinkFn sink = [&](const unsigned char* data, size_t len) {
+      size_t done = 0;
+      while (done < len) {
+        size_t to_copy = std::min(len - done, kPartitionWriteSize - buffer.size());
+        buffer.insert(buffer.end(), data + done, data + done + to_copy);
+        done += to_copy;
+        if (buffer.size() == kPartitionWriteSize && !flush_buffer()) {
+          return static_cast<size_t>(0);
+        }
+      }
+      target_size += len;
+      return len;
+    };
 
-  if (result != 0) {
-    printf("applying patch failed\n");
-    return 1;
-  }
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
 
-  uint8_t current_target_sha1[SHA_DIGEST_LENGTH];
-  SHA1_Final(current_target_sha1, &ctx);
-  if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_LENGTH) != 0) {
-    printf("patch did not produce expected sha1\n");
-    return 1;
-  } else {
-    printf("now %s\n", short_sha1(target_sha1).c_str());
+    int result;
+    if (use_bsdiff) {
+      result =
+          ApplyBSDiffPatch(source_file.data.data(), source_file.data.size(), *patch, 0, sink, &ctx);
+    } else {
+      result = ApplyImagePatch(source_file.data.data(), source_file.data.size(), *patch, sink,
+                               &ctx, bonus_data);
+    }
+
+    if (result != 0 || !flush_buffer()) {
+      printf("applying patch failed\n");
+      return 1;
+    }
+
+    uint8_t current_target_sha1[SHA_DIGEST_LENGTH];
+    SHA1_Final(current_target_sha1, &ctx);
+    if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_LENGTH) != 0) {
+      printf("patch did not produce expected sha1\n");
+      return 1;
+    } else if (attempt == 0) {
+      printf("now %s\n", short_sha1(target_sha1).c_str());
+    }
+
+    if (ota_fsync(fd) != 0) {
+      printf("failed to sync to %s (%s)\n", partition, strerror(errno));
+      return 1;
+    }
+    if (ota_close(fd) != 0) {
+      printf("failed to close %s (%s)\n", partition, strerror(errno));
+      return 1;
+    }
+
+    // Read the partition back and check its hash; the data isn't around any more to compare with.
+    if (VerifyPartition(partition, target_size, target_sha1)) {
+      printf("verification read succeeded (attempt %zu)\n", attempt + 1);
+      CachePartitionDigest(partition, target_size, target_sha1);
+      success = true;
+    }
   }
 
-  // Write back the temp file to the partition.
-  if (WriteToPartition(reinterpret_cast<const unsigned char*>(memory_sink_str.c_str()),
-                       memory_sink_str.size(), target_filename) != 0) {
+  if (!success) {
     printf("write of patched data to %s failed\n", target_filename.c_str());
     return 1;
   }
+  sync();
 
   // Delete the backup copy of the source.
   unlink(CacheLocation::location().cache_temp_source().c_str());
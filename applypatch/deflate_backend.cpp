@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "applypatch/deflate_backend.h"
+
+#include <atomic>
+#include <string>
+
+#include <zlib.h>
+
+static int ZlibInit(z_stream* strm, int level, int method, int window_bits, int mem_level,
+                    int strategy) {
+  return deflateInit2(strm, level, method, window_bits, mem_level, strategy);
+}
+
+static int ZlibDeflate(z_stream* strm, int flush) {
+  return deflate(strm, flush);
+}
+
+static int ZlibEnd(z_stream* strm) {
+  return deflateEnd(strm);
+}
+
+static bool ZlibExact(int, int, int, int, int) {
+  return true;
+}
+
+static const DeflateBackend kZlibBackend = {
+  "zlib", ZlibInit, ZlibDeflate, ZlibEnd, ZlibExact,
+};
+
+static std::atomic<const DeflateBackend*> installed_backend(&kZlibBackend);
+
+const DeflateBackend& ZlibDeflateBackend() {
+  return kZlibBackend;
+}
+
+void SetDeflateBackend(const DeflateBackend* backend) {
+  installed_backend.store(backend != nullptr ? backend : &kZlibBackend);
+}
+
+const DeflateBackend& GetDeflateBackend(int level, int method, int window_bits, int mem_level,
+                                        int strategy) {
+  const DeflateBackend* backend = installed_backend.load();
+  if (backend->exact(level, method, window_bits, mem_level, strategy)) {
+    return *backend;
+  }
+  return kZlibBackend;
+}
+
+int DeflateWith(const DeflateBackend& backend, const uint8_t* data, size_t len, int level,
+                int method, int window_bits, int mem_level, int strategy, std::string* out) {
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = len;
+  // libimgdiff is built without ZLIB_CONST.
+  strm.next_in = const_cast<uint8_t*>(data);
+  int ret = backend.init(&strm, level, method, window_bits, mem_level, strategy);
+  if (ret != Z_OK) {
+    return ret;
+  }
+
+  uint8_t buffer[32768];
+  do {
+    strm.avail_out = sizeof(buffer);
+    strm.next_out = buffer;
+    ret = backend.deflate(&strm, Z_FINISH);
+    if (ret != Z_OK && ret != Z_STREAM_END) {
+      backend.end(&strm);
+      return ret;
+    }
+    out->append(reinterpret_cast<const char*>(buffer), sizeof(buffer) - strm.avail_out);
+  } while (ret != Z_STREAM_END);
+  backend.end(&strm);
+  return Z_OK;
+}
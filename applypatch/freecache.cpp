@@ -25,9 +25,14 @@
 #include <dirent.h>
 #include <ctype.h>
 
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <set>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
@@ -35,50 +40,110 @@
 #include "applypatch/applypatch.h"
 #include "otautil/cache_location.h"
 
-static int EliminateOpenFiles(std::set<std::string>* files) {
-  std::unique_ptr<DIR, decltype(&closedir)> d(opendir("/proc"), closedir);
-  if (!d) {
-    printf("error opening /proc: %s\n", strerror(errno));
-    return -1;
-  }
-  struct dirent* de;
-  while ((de = readdir(d.get())) != 0) {
-    unsigned int pid;
-    if (!android::base::ParseUint(de->d_name, &pid)) {
-        continue;
-    }
-    std::string path = android::base::StringPrintf("/proc/%s/fd/", de->d_name);
+// /proc/<pid>/fd of the other processes is read by this many threads.
+static constexpr size_t kOpenFileScanThreads = 4;
 
-    struct dirent* fdde;
+// A file by its device and inode, so a file is recognized whatever path it was opened by.
+using FileId = std::pair<dev_t, ino_t>;
+
+// Adds the files on |dev| that the processes in |pids| hold open.
+static void ScanOpenFiles(const std::vector<std::string>& pids, size_t first, size_t step, dev_t dev,
+                          std::set<FileId>* open_files) {
+  for (size_t i = first; i < pids.size(); i += step) {
+    std::string path = "/proc/" + pids[i] + "/fd";
     std::unique_ptr<DIR, decltype(&closedir)> fdd(opendir(path.c_str()), closedir);
     if (!fdd) {
-      printf("error opening %s: %s\n", path.c_str(), strerror(errno));
+      // The process may have exited since /proc was read.
       continue;
     }
-    while ((fdde = readdir(fdd.get())) != 0) {
-      std::string fd_path = path + fdde->d_name;
-      char link[FILENAME_MAX];
-
-      int count = readlink(fd_path.c_str(), link, sizeof(link)-1);
-      if (count >= 0) {
-        link[count] = '\0';
-        if (strncmp(link, "/cache/", 7) == 0) {
-          if (files->erase(link) > 0) {
-            printf("%s is open by %s\n", link, de->d_name);
-          }
-        }
+    struct dirent* fdde;
+    while ((fdde = readdir(fdd.get())) != nullptr) {
+      if (fdde->d_name[0] == '.') {
+        continue;
+      }
+      // fstatat follows the fd link to the open file, without the readlink and the string
+      // compare of the path.
+      struct stat st;
+      if (fstatat(dirfd(fdd.get()), fdde->d_name, &st, 0) == 0 && st.st_dev == dev &&
+          S_ISREG(st.st_mode)) {
+        open_files->emplace(st.st_dev, st.st_ino);
+      }
+    }
+  }
+}
+
+// Files on |dev| held open by any process. The other processes are scanned once per session
+// from a few threads; our own process opens and closes files on /cache while patching, so it
+// is scanned on every call.
+static int FindOpenFiles(dev_t dev, std::set<FileId>* open_files) {
+  static bool scanned = false;
+  static dev_t scanned_dev;
+  static std::set<FileId> others;
+
+  if (!scanned || scanned_dev != dev) {
+    std::unique_ptr<DIR, decltype(&closedir)> d(opendir("/proc"), closedir);
+    if (!d) {
+      printf("error opening /proc: %s\n", strerror(errno));
+      return -1;
+    }
+    std::string self = std::to_string(getpid());
+    std::vector<std::string> pids;
+    struct dirent* de;
+    while ((de = readdir(d.get())) != nullptr) {
+      unsigned int pid;
+      if (android::base::ParseUint(de->d_name, &pid) && self != de->d_name) {
+        pids.push_back(de->d_name);
+      }
+    }
+
+    size_t thread_count = std::min<size_t>(kOpenFileScanThreads, pids.size());
+    std::vector<std::set<FileId>> found(thread_count);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; ++i) {
+      threads.emplace_back(ScanOpenFiles, std::cref(pids), i, thread_count, dev, &found[i]);
+    }
+    if (thread_count > 0) {
+      ScanOpenFiles(pids, 0, thread_count, dev, &found[0]);
+    }
+    others.clear();
+    for (size_t i = 0; i < thread_count; ++i) {
+      if (i > 0) {
+        threads[i - 1].join();
       }
+      others.insert(found[i].begin(), found[i].end());
     }
+    scanned = true;
+    scanned_dev = dev;
+    printf("%zu processes hold %zu files open on /cache\n", pids.size(), others.size());
   }
+
+  *open_files = others;
+  ScanOpenFiles({ "self" }, 0, 1, dev, open_files);
   return 0;
 }
 
-static std::set<std::string> FindExpendableFiles() {
-  std::set<std::string> files;
+struct ExpendableFile {
+  std::string path;
+  size_t size;  // bytes allocated to the file, what deleting it frees
+};
+
+// The unopened regular files that may be deleted, smallest first.
+static std::vector<ExpendableFile> FindExpendableFiles() {
+  std::vector<ExpendableFile> files;
   // We're allowed to delete unopened regular files in any of these
   // directories.
   const char* dirs[2] = {"/cache", "/cache/recovery/otatest"};
 
+  struct stat cache_st;
+  if (stat("/cache", &cache_st) != 0) {
+    printf("error stat'ing /cache: %s\n", strerror(errno));
+    return files;
+  }
+  std::set<FileId> open_files;
+  if (FindOpenFiles(cache_st.st_dev, &open_files) < 0) {
+    return files;
+  }
+
   for (size_t i = 0; i < sizeof(dirs)/sizeof(dirs[0]); ++i) {
     std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dirs[i]), closedir);
     if (!d) {
@@ -98,16 +163,21 @@ static std::set<std::string> FindExpendableFiles() {
       }
 
       struct stat st;
-      if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
-        files.insert(path);
+      if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        continue;
+      }
+      if (open_files.count(FileId(st.st_dev, st.st_ino)) > 0) {
+        printf("%s is open\n", path.c_str());
+        continue;
       }
+      files.push_back({ path, static_cast<size_t>(st.st_blocks) * 512 });
     }
   }
 
+  std::sort(files.begin(), files.end(), [](const ExpendableFile& a, const ExpendableFile& b) {
+    return a.size < b.size;
+  });
   printf("%zu regular files in deletable directories\n", files.size());
-  if (EliminateOpenFiles(&files) < 0) {
-    return std::set<std::string>();
-  }
   return files;
 }
 
@@ -124,26 +194,51 @@ int MakeFreeSpaceOnCache(size_t bytes_needed) {
   if (free_now >= bytes_needed) {
     return 0;
   }
-  std::set<std::string> files = FindExpendableFiles();
+  std::vector<ExpendableFile> files = FindExpendableFiles();
   if (files.empty()) {
     // nothing we can delete to free up space!
     printf("no files can be deleted to free space on /cache\n");
     return -1;
   }
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
+  // Delete the smallest file that frees enough on its own, or else the
+  // biggest files until enough is free, so as little as possible is lost.
+  size_t missing = bytes_needed - free_now;
+  std::vector<const ExpendableFile*> victims;
+  auto fits = std::lower_bound(files.begin(), files.end(), missing,
+                               [](const ExpendableFile& f, size_t n) { return f.size < n; });
+  if (fits != files.end()) {
+    victims.push_back(&*fits);
+  } else {
+    size_t freed = 0;
+    for (auto it = files.rbegin(); it != files.rend() && freed < missing; ++it) {
+      victims.push_back(&*it);
+      freed += it->size;
+    }
+  }
 
-  for (const auto& file : files) {
-    unlink(file.c_str());
-    free_now = FreeSpaceForFile("/cache");
-    printf("deleted %s; now %zu bytes free\n", file.c_str(), free_now);
-    if (free_now < bytes_needed) {
-        break;
+  for (const auto* file : victims) {
+    if (unlink(file->path.c_str()) == 0) {
+      printf("deleted %s (%zu bytes)\n", file->path.c_str(), file->size);
+    } else {
+      printf("failed to delete %s: %s\n", file->path.c_str(), strerror(errno));
+    }
+  }
+  free_now = FreeSpaceForFile("/cache");
+  printf("now %zu bytes free\n", free_now);
+  if (free_now >= bytes_needed || victims.size() == files.size()) {
+    return (free_now >= bytes_needed) ? 0 : -1;
+  }
+
+  // Allocation sizes are an estimate of what the filesystem gets back;
+  // fall back to deleting the rest, biggest first, until it is enough.
+  for (auto it = files.rbegin(); it != files.rend() && free_now < bytes_needed; ++it) {
+    if (std::find(victims.begin(), victims.end(), &*it) != victims.end()) {
+      continue;
     }
+    unlink(it->path.c_str());
+    free_now = FreeSpaceForFile("/cache");
+    printf("deleted %s; now %zu bytes free\n", it->path.c_str(), free_now);
   }
   return (free_now >= bytes_needed) ? 0 : -1;
 }
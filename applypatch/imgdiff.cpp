@@ -153,7 +153,13 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -167,6 +173,7 @@
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
 
+#include "applypatch/deflate_backend.h"
 #include "applypatch/imgdiff_image.h"
 #include "otautil/rangeset.h"
 
@@ -180,6 +187,11 @@ static_assert(VERSION <= 9, "VERSION occupies more than one byte");
 static constexpr size_t BLOCK_SIZE = 4096;
 static constexpr size_t BUFFER_SIZE = 0x8000;
 
+// Number of threads computing chunk patches (-j), and the estimated memory they may use at once in
+// bytes (--memory-budget, 0 for no limit). The patch doesn't depend on either.
+static size_t patch_threads = 1;
+static size_t patch_memory_budget = 0;
+
 // If we use this function to write the offset and length (type size_t), their values should not
 // exceed 2^63; because the signed bit will be casted away.
 static inline bool Write8(int fd, int64_t value) {
@@ -251,10 +263,183 @@ static const struct option OPTIONS[] = {
   { "block-limit", required_argument, nullptr, 0 },
   { "debug-dir", required_argument, nullptr, 0 },
   { "split-info", required_argument, nullptr, 0 },
+  { "jobs", required_argument, nullptr, 'j' },
+  { "memory-budget", required_argument, nullptr, 0 },
+  { "suffix-array-cache", required_argument, nullptr, 0 },
   { "verbose", no_argument, nullptr, 'v' },
   { nullptr, 0, nullptr, 0 },
 };
 
+// A unit of patch generation, with the estimated memory it needs while running.
+struct PatchTask {
+  size_t memory;
+  std::function<bool()> run;
+};
+
+// Estimated peak memory of bsdiff: the suffix array of the source (8 bytes per byte) plus the
+// source and target data.
+static size_t EstimateBsdiffMemory(const ImageChunk& tgt, const ImageChunk& src) {
+  return src.DataLengthForPatch() * 9 + tgt.DataLengthForPatch();
+}
+
+// Runs the tasks on up to patch_threads threads, starting a task only while the estimated memory
+// of the running ones stays within patch_memory_budget; a single task always gets to run. Tasks
+// write their results to their own slots, so the outcome doesn't depend on the scheduling.
+static bool RunPatchTasks(const std::vector<PatchTask>& tasks) {
+  if (patch_threads <= 1 || tasks.size() <= 1) {
+    for (const auto& task : tasks) {
+      if (!task.run()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t next_task = 0;
+  size_t memory_in_use = 0;
+  bool failed = false;
+
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!failed && next_task < tasks.size()) {
+      const PatchTask& task = tasks[next_task];
+      if (patch_memory_budget != 0 && memory_in_use != 0 &&
+          memory_in_use + task.memory > patch_memory_budget) {
+        cv.wait(lock);
+        continue;
+      }
+      next_task++;
+      memory_in_use += task.memory;
+      lock.unlock();
+
+      bool result = task.run();
+
+      lock.lock();
+      memory_in_use -= task.memory;
+      if (!result) {
+        failed = true;
+      }
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < std::min(patch_threads, tasks.size()); i++) {
+    threads.emplace_back(worker);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return !failed;
+}
+
+// Keeps the bsdiff suffix arrays of recently diffed sources, so that chunks diffed against the same
+// source data (e.g. the pseudo source of a zip, or identical split source pieces) build the array
+// only once. The cache holds at most |budget| bytes of suffix arrays plus their source copies, and
+// evicts the least recently used ones first. It may be shared by the patch threads; a suffix array
+// is only read once built.
+class SuffixArrayCache {
+ public:
+  explicit SuffixArrayCache(size_t budget) : budget_(budget) {}
+
+  bool MakePatch(const ImageChunk& tgt, const ImageChunk& src, std::vector<uint8_t>* patch_data) {
+    std::shared_ptr<bsdiff::SuffixArrayIndexInterface> index = Find(src);
+    if (index) {
+      bsdiff::SuffixArrayIndexInterface* cached = index.get();
+      return ImageChunk::MakePatch(tgt, src, patch_data, &cached);
+    }
+
+    bsdiff::SuffixArrayIndexInterface* built = nullptr;
+    bool result = ImageChunk::MakePatch(tgt, src, patch_data, &built);
+    std::shared_ptr<bsdiff::SuffixArrayIndexInterface> owned(built);
+    if (result && owned) {
+      Insert(src, owned);
+    }
+    return result;
+  }
+
+ private:
+  struct Entry {
+    uint64_t hash;
+    std::vector<uint8_t> source;
+    std::shared_ptr<bsdiff::SuffixArrayIndexInterface> index;
+  };
+
+  static uint64_t Hash(const uint8_t* data, size_t len) {
+    // 64-bit FNV-1a.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+      hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+  }
+
+  static size_t EntrySize(size_t len) {
+    return len * 9;
+  }
+
+  std::shared_ptr<bsdiff::SuffixArrayIndexInterface> Find(const ImageChunk& src) {
+    const uint8_t* data = src.DataForPatch();
+    size_t len = src.DataLengthForPatch();
+    uint64_t hash = Hash(data, len);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end(); it++) {
+      if (it->hash == hash && it->source.size() == len &&
+          std::equal(it->source.begin(), it->source.end(), data)) {
+        entries_.splice(entries_.begin(), entries_, it);
+        return entries_.front().index;
+      }
+    }
+    return nullptr;
+  }
+
+  void Insert(const ImageChunk& src, std::shared_ptr<bsdiff::SuffixArrayIndexInterface> index) {
+    const uint8_t* data = src.DataForPatch();
+    size_t len = src.DataLengthForPatch();
+    if (EntrySize(len) > budget_) {
+      return;
+    }
+    uint64_t hash = Hash(data, len);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Another thread may have built the same array meanwhile.
+    for (const auto& entry : entries_) {
+      if (entry.hash == hash && entry.source.size() == len &&
+          std::equal(entry.source.begin(), entry.source.end(), data)) {
+        return;
+      }
+    }
+    while (!entries_.empty() && bytes_ + EntrySize(len) > budget_) {
+      bytes_ -= EntrySize(entries_.back().source.size());
+      entries_.pop_back();
+    }
+    entries_.push_front({ hash, std::vector<uint8_t>(data, data + len), std::move(index) });
+    bytes_ += EntrySize(len);
+  }
+
+  const size_t budget_;
+  std::mutex mutex_;
+  std::list<Entry> entries_;
+  size_t bytes_ = 0;
+};
+
+// Enabled with --suffix-array-cache.
+static std::unique_ptr<SuffixArrayCache> suffix_array_cache;
+
+// Generates the patch of a chunk, through the suffix array cache if there's one; otherwise
+// |bsdiff_cache| (if not null) holds the suffix array of |src| across calls.
+static bool MakeChunkPatch(const ImageChunk& tgt, const ImageChunk& src,
+                           std::vector<uint8_t>* patch_data,
+                           bsdiff::SuffixArrayIndexInterface** bsdiff_cache) {
+  if (suffix_array_cache) {
+    return suffix_array_cache->MakePatch(tgt, src, patch_data);
+  }
+  return ImageChunk::MakePatch(tgt, src, patch_data, bsdiff_cache);
+}
+
 ImageChunk::ImageChunk(int type, size_t start, const std::vector<uint8_t>* file_content,
                        size_t raw_data_len, std::string entry_name)
     : type_(type),
@@ -401,13 +586,14 @@ bool ImageChunk::ReconstructDeflateChunk() {
  * stored in the chunk).
  */
 bool ImageChunk::TryReconstruction(int level) {
+  const DeflateBackend& backend = GetDeflateBackend(level, METHOD, WINDOWBITS, MEMLEVEL, STRATEGY);
   z_stream strm;
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
   strm.opaque = Z_NULL;
   strm.avail_in = uncompressed_data_.size();
   strm.next_in = uncompressed_data_.data();
-  int ret = deflateInit2(&strm, level, METHOD, WINDOWBITS, MEMLEVEL, STRATEGY);
+  int ret = backend.init(&strm, level, METHOD, WINDOWBITS, MEMLEVEL, STRATEGY);
   if (ret < 0) {
     LOG(ERROR) << "Failed to initialize deflate: " << ret;
     return false;
@@ -418,7 +604,7 @@ bool ImageChunk::TryReconstruction(int level) {
   do {
     strm.avail_out = buffer.size();
     strm.next_out = buffer.data();
-    ret = deflate(&strm, Z_FINISH);
+    ret = backend.deflate(&strm, Z_FINISH);
     if (ret < 0) {
       LOG(ERROR) << "Failed to deflate: " << ret;
       return false;
@@ -427,12 +613,12 @@ bool ImageChunk::TryReconstruction(int level) {
     size_t compressed_size = buffer.size() - strm.avail_out;
     if (memcmp(buffer.data(), input_file_ptr_->data() + start_ + offset, compressed_size) != 0) {
       // mismatch; data isn't the same.
-      deflateEnd(&strm);
+      backend.end(&strm);
       return false;
     }
     offset += compressed_size;
   } while (ret != Z_STREAM_END);
-  deflateEnd(&strm);
+  backend.end(&strm);
 
   if (offset != raw_data_len_) {
     // mismatch; ran out of data before we should have.
@@ -1101,39 +1287,81 @@ bool ZipModeImage::GeneratePatchesInternal(const ZipModeImage& tgt_image,
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
   patch_chunks->clear();
 
-  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+  // The chunks without a matching source entry are all diffed against the pseudo source. They
+  // share one bsdiff suffix array, so they run one after another in a single task.
+  std::vector<const ImageChunk*> src_refs(tgt_image.NumOfChunks(), nullptr);
+  std::vector<std::vector<uint8_t>> patches(tgt_image.NumOfChunks());
+  std::vector<PatchTask> tasks;
+  std::vector<size_t> pseudo_source_chunks;
+  size_t pseudo_source_memory = 0;
+  const ImageChunk pseudo_source = src_image.PseudoSource();
   for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
     const auto& tgt_chunk = tgt_image[i];
 
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks->emplace_back(tgt_chunk);
       continue;
     }
 
     const ImageChunk* src_chunk = (tgt_chunk.GetType() != CHUNK_DEFLATE)
                                       ? nullptr
                                       : src_image.FindChunkByName(tgt_chunk.GetEntryName());
+    if (src_chunk == nullptr) {
+      src_refs[i] = &pseudo_source;
+      pseudo_source_chunks.push_back(i);
+      pseudo_source_memory =
+          std::max(pseudo_source_memory, EstimateBsdiffMemory(tgt_chunk, *src_refs[i]));
+      continue;
+    }
 
-    const auto& src_ref = (src_chunk == nullptr) ? src_image.PseudoSource() : *src_chunk;
-    bsdiff::SuffixArrayIndexInterface** bsdiff_cache_ptr =
-        (src_chunk == nullptr) ? &bsdiff_cache : nullptr;
+    src_refs[i] = src_chunk;
+    tasks.push_back({ EstimateBsdiffMemory(tgt_chunk, *src_chunk), [&, i]() {
+                       if (!MakeChunkPatch(tgt_image[i], *src_refs[i], &patches[i],
+                                                  nullptr)) {
+                         LOG(ERROR) << "Failed to generate patch, name: "
+                                    << tgt_image[i].GetEntryName();
+                         return false;
+                       }
+                       return true;
+                     } });
+  }
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &patch_data, bsdiff_cache_ptr)) {
-      LOG(ERROR) << "Failed to generate patch, name: " << tgt_chunk.GetEntryName();
-      return false;
+  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+  if (!pseudo_source_chunks.empty()) {
+    tasks.push_back({ pseudo_source_memory, [&]() {
+                       for (size_t i : pseudo_source_chunks) {
+                         if (!MakeChunkPatch(tgt_image[i], *src_refs[i], &patches[i],
+                                                    &bsdiff_cache)) {
+                           LOG(ERROR) << "Failed to generate patch, name: "
+                                      << tgt_image[i].GetEntryName();
+                           return false;
+                         }
+                       }
+                       return true;
+                     } });
+  }
+
+  bool success = RunPatchTasks(tasks);
+  delete bsdiff_cache;
+  if (!success) {
+    return false;
+  }
+
+  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+    const auto& tgt_chunk = tgt_image[i];
+    if (src_refs[i] == nullptr) {
+      patch_chunks->emplace_back(tgt_chunk);
+      continue;
     }
 
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << patches[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patches[i].size())) {
       patch_chunks->emplace_back(tgt_chunk);
     } else {
-      patch_chunks->emplace_back(tgt_chunk, src_ref, std::move(patch_data));
+      patch_chunks->emplace_back(tgt_chunk, *src_refs[i], std::move(patches[i]));
     }
   }
-  delete bsdiff_cache;
 
   CHECK_EQ(patch_chunks->size(), tgt_image.NumOfChunks());
   return true;
@@ -1432,30 +1660,51 @@ bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
                                      const ImageModeImage& src_image,
                                      const std::string& patch_name) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
-  std::vector<PatchChunk> patch_chunks;
-  patch_chunks.reserve(tgt_image.NumOfChunks());
+  std::vector<std::vector<uint8_t>> patches(tgt_image.NumOfChunks());
+  std::vector<bool> is_raw(tgt_image.NumOfChunks(), false);
+  std::vector<PatchTask> tasks;
 
   for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
     const auto& tgt_chunk = tgt_image[i];
     const auto& src_chunk = src_image[i];
 
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks.emplace_back(tgt_chunk);
+      is_raw[i] = true;
       continue;
     }
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_chunk, &patch_data, nullptr)) {
-      LOG(ERROR) << "Failed to generate patch for target chunk " << i;
-      return false;
+    tasks.push_back({ EstimateBsdiffMemory(tgt_chunk, src_chunk), [&, i]() {
+                       if (!MakeChunkPatch(tgt_image[i], src_image[i], &patches[i],
+                                                  nullptr)) {
+                         LOG(ERROR) << "Failed to generate patch for target chunk " << i;
+                         return false;
+                       }
+                       return true;
+                     } });
+  }
+
+  if (!RunPatchTasks(tasks)) {
+    return false;
+  }
+
+  std::vector<PatchChunk> patch_chunks;
+  patch_chunks.reserve(tgt_image.NumOfChunks());
+  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+    const auto& tgt_chunk = tgt_image[i];
+    const auto& src_chunk = src_image[i];
+
+    if (is_raw[i]) {
+      patch_chunks.emplace_back(tgt_chunk);
+      continue;
     }
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+
+    LOG(INFO) << "patch " << i << " is " << patches[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patches[i].size())) {
       patch_chunks.emplace_back(tgt_chunk);
     } else {
-      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patch_data));
+      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patches[i]));
     }
   }
 
@@ -1482,8 +1731,11 @@ int imgdiff(int argc, const char** argv) {
   int opt;
   int option_index;
   optind = 0;  // Reset the getopt state so that we can call it multiple times for test.
+  patch_threads = 1;
+  patch_memory_budget = 0;
+  suffix_array_cache.reset();
 
-  while ((opt = getopt_long(argc, const_cast<char**>(argv), "zb:v", OPTIONS, &option_index)) !=
+  while ((opt = getopt_long(argc, const_cast<char**>(argv), "zb:j:v", OPTIONS, &option_index)) !=
          -1) {
     switch (opt) {
       case 'z':
@@ -1509,6 +1761,12 @@ int imgdiff(int argc, const char** argv) {
         }
         break;
       }
+      case 'j':
+        if (!android::base::ParseUint(optarg, &patch_threads) || patch_threads == 0) {
+          LOG(ERROR) << "Failed to parse the number of jobs: " << optarg;
+          return 1;
+        }
+        break;
       case 'v':
         verbose = true;
         break;
@@ -1521,6 +1779,20 @@ int imgdiff(int argc, const char** argv) {
           split_info_file = optarg;
         } else if (name == "debug-dir") {
           debug_dir = optarg;
+        } else if (name == "memory-budget") {
+          size_t budget_mib;
+          if (!android::base::ParseUint(optarg, &budget_mib)) {
+            LOG(ERROR) << "Failed to parse memory budget: " << optarg;
+            return 1;
+          }
+          patch_memory_budget = budget_mib << 20;
+        } else if (name == "suffix-array-cache") {
+          size_t cache_mib;
+          if (!android::base::ParseUint(optarg, &cache_mib)) {
+            LOG(ERROR) << "Failed to parse suffix array cache size: " << optarg;
+            return 1;
+          }
+          suffix_array_cache.reset(cache_mib == 0 ? nullptr : new SuffixArrayCache(cache_mib << 20));
         }
         break;
       }
@@ -1546,6 +1818,14 @@ int imgdiff(int argc, const char** argv) {
            "  --split-info,     Output the split information (patch_size, tgt_size, src_ranges);\n"
            "                    zip mode with block-limit only.\n"
            "  --debug-dir,      Debug directory to put the split srcs and patches, zip mode only.\n"
+           "  -j, --jobs,       Number of threads computing the chunk patches (default 1). The\n"
+           "                    patch is the same for any number of jobs.\n"
+           "  --memory-budget,  Estimated memory in MiB the jobs may use at once (default no\n"
+           "                    limit).\n"
+           "  --suffix-array-cache,\n"
+           "                    Memory in MiB to keep the bsdiff suffix arrays of the sources, so\n"
+           "                    that chunks diffed against the same source data reuse them\n"
+           "                    (default 0, disabled).\n"
            "  -v, --verbose,    Enable verbose logging.";
     return 2;
   }
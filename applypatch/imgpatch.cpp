@@ -26,13 +26,16 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <future>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/memory.h>
 #include <applypatch/applypatch.h>
+#include <applypatch/deflate_backend.h>
 #include <applypatch/imgdiff.h>
 #include <openssl/sha.h>
 #include <zlib.h>
@@ -59,13 +62,15 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   int mem_level = Read4(deflate_header + 52);
   int strategy = Read4(deflate_header + 56);
 
+  const DeflateBackend& backend =
+      GetDeflateBackend(level, method, window_bits, mem_level, strategy);
   z_stream strm;
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
   strm.opaque = Z_NULL;
   strm.avail_in = 0;
   strm.next_in = nullptr;
-  int ret = deflateInit2(&strm, level, method, window_bits, mem_level, strategy);
+  int ret = backend.init(&strm, level, method, window_bits, mem_level, strategy);
   if (ret != Z_OK) {
     LOG(ERROR) << "Failed to init uncompressed data deflation: " << ret;
     return false;
@@ -76,8 +81,8 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   size_t actual_target_length = 0;
   size_t total_written = 0;
   static constexpr size_t buffer_size = 32768;
-  auto compression_sink = [&strm, &actual_target_length, &expected_target_length, &total_written,
-                           &ret, &ctx, &sink](const uint8_t* data, size_t len) -> size_t {
+  auto compression_sink = [&backend, &strm, &actual_target_length, &expected_target_length,
+                           &total_written, &ret, &ctx, &sink](const uint8_t* data, size_t len) -> size_t {
     // The input patch length for an update never exceeds INT_MAX.
     strm.avail_in = len;
     strm.next_in = data;
@@ -86,9 +91,9 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
       strm.avail_out = buffer_size;
       strm.next_out = buffer.data();
       if (actual_target_length + len < expected_target_length) {
-        ret = deflate(&strm, Z_NO_FLUSH);
+        ret = backend.deflate(&strm, Z_NO_FLUSH);
       } else {
-        ret = deflate(&strm, Z_FINISH);
+        ret = backend.deflate(&strm, Z_FINISH);
       }
       if (ret != Z_OK && ret != Z_STREAM_END) {
         LOG(ERROR) << "Failed to deflate stream: " << ret;
@@ -111,7 +116,7 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
 
   int bspatch_result =
       ApplyBSDiffPatch(src_data, src_len, patch, patch_offset, compression_sink, nullptr);
-  deflateEnd(&strm);
+  backend.end(&strm);
 
   if (bspatch_result != 0) {
     return false;
@@ -138,6 +143,104 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsign
   return ApplyImagePatch(old_data, old_size, patch, sink, nullptr, nullptr);
 }
 
+// Inflates the source data of a deflate chunk into expanded_source. The chunk header tells us
+// exactly how big we expect it to be when decompressed.
+static bool InflateChunkSource(const unsigned char* old_data, size_t old_size,
+                               const char* deflate_header, const Value* bonus_data,
+                               std::vector<unsigned char>* expanded_source) {
+  size_t src_start = static_cast<size_t>(Read8(deflate_header));
+  size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
+  size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
+
+  if (src_start + src_len > old_size) {
+    printf("source data too short\n");
+    return false;
+  }
+
+  // Note: expanded_len will include the bonus data size if
+  // the patch was constructed with bonus data.  The
+  // deflation will come up 'bonus_size' bytes short; these
+  // must be appended from the bonus_data value.
+  size_t bonus_size = (bonus_data != NULL) ? bonus_data->data.size() : 0;
+
+  expanded_source->resize(expanded_len);
+
+  // inflate() doesn't like strm.next_out being a nullptr even with
+  // avail_out being zero (Z_STREAM_ERROR).
+  if (expanded_len != 0) {
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = src_len;
+    strm.next_in = old_data + src_start;
+    strm.avail_out = expanded_len;
+    strm.next_out = expanded_source->data();
+
+    int ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+      printf("failed to init source inflation: %d\n", ret);
+      return false;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    if (ret != Z_STREAM_END) {
+      printf("source inflation returned %d\n", ret);
+      inflateEnd(&strm);
+      return false;
+    }
+    // We should have filled the output buffer exactly, except
+    // for the bonus_size.
+    if (strm.avail_out != bonus_size) {
+      printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
+      inflateEnd(&strm);
+      return false;
+    }
+    inflateEnd(&strm);
+
+    if (bonus_size) {
+      memcpy(expanded_source->data() + (expanded_len - bonus_size), &bonus_data->data[0],
+             bonus_size);
+    }
+  }
+  return true;
+}
+
+// Inflates the source of a deflate chunk, patches it and streams the re-deflated result to sink.
+static bool ApplyDeflateChunk(const unsigned char* old_data, size_t old_size, const Value& patch,
+                              const char* deflate_header, const Value* bonus_data, SinkFn sink,
+                              SHA_CTX* ctx) {
+  std::vector<unsigned char> expanded_source;
+  if (!InflateChunkSource(old_data, old_size, deflate_header, bonus_data, &expanded_source)) {
+    return false;
+  }
+
+  size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
+  if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), expanded_source.size(), patch,
+                                       patch_offset, deflate_header, sink, ctx)) {
+    LOG(ERROR) << "Fail to apply streaming bspatch.";
+    return false;
+  }
+  return true;
+}
+
+// A chunk record of the patch, parsed and bounds checked.
+struct ImageChunkPatch {
+  int type;
+  const char* header;
+  // The data of a raw chunk, within the patch.
+  size_t raw_pos;
+  size_t raw_len;
+};
+
+// The deflate output of a chunk patched on a worker; ok is false if patching failed.
+struct DeflateChunkOutput {
+  bool ok;
+  std::vector<unsigned char> data;
+};
+
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
                     SHA_CTX* ctx, const Value* bonus_data) {
   if (patch.data.size() < 12) {
@@ -154,6 +257,8 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
   }
 
   int num_chunks = Read4(patch_header + 8);
+  std::vector<ImageChunkPatch> chunks;
+  size_t deflate_chunks = 0;
   size_t pos = 12;
   for (int i = 0; i < num_chunks; ++i) {
     // each chunk's header record starts with 4 bytes.
@@ -161,128 +266,112 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
       printf("failed to read chunk %d record\n", i);
       return -1;
     }
-    int type = Read4(patch_header + pos);
+    ImageChunkPatch chunk = { Read4(patch_header + pos), patch_header + pos + 4, 0, 0 };
     pos += 4;
 
-    if (type == CHUNK_NORMAL) {
-      const char* normal_header = patch_header + pos;
+    if (chunk.type == CHUNK_NORMAL) {
       pos += 24;
       if (pos > patch.data.size()) {
         printf("failed to read chunk %d normal header data\n", i);
         return -1;
       }
-
-      size_t src_start = static_cast<size_t>(Read8(normal_header));
-      size_t src_len = static_cast<size_t>(Read8(normal_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(normal_header + 16));
-
-      if (src_start + src_len > old_size) {
-        printf("source data too short\n");
-        return -1;
-      }
-      if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink, ctx) != 0) {
-        printf("Failed to apply bsdiff patch.\n");
-        return -1;
-      }
-    } else if (type == CHUNK_RAW) {
-      const char* raw_header = patch_header + pos;
+    } else if (chunk.type == CHUNK_RAW) {
       pos += 4;
       if (pos > patch.data.size()) {
         printf("failed to read chunk %d raw header data\n", i);
         return -1;
       }
 
-      size_t data_len = static_cast<size_t>(Read4(raw_header));
+      chunk.raw_pos = pos;
+      chunk.raw_len = static_cast<size_t>(Read4(chunk.header));
 
-      if (pos + data_len > patch.data.size()) {
+      if (pos + chunk.raw_len > patch.data.size()) {
         printf("failed to read chunk %d raw data\n", i);
         return -1;
       }
-      if (ctx) {
-        SHA1_Update(ctx, patch_header + pos, data_len);
-      }
-      if (sink(reinterpret_cast<const unsigned char*>(patch_header + pos), data_len) != data_len) {
-        printf("failed to write chunk %d raw data\n", i);
-        return -1;
-      }
-      pos += data_len;
-    } else if (type == CHUNK_DEFLATE) {
+      pos += chunk.raw_len;
+    } else if (chunk.type == CHUNK_DEFLATE) {
       // deflate chunks have an additional 60 bytes in their chunk header.
-      const char* deflate_header = patch_header + pos;
       pos += 60;
       if (pos > patch.data.size()) {
         printf("failed to read chunk %d deflate header data\n", i);
         return -1;
       }
+      deflate_chunks++;
+    } else {
+      printf("patch chunk %d is unknown type %d\n", i, chunk.type);
+      return -1;
+    }
+    chunks.push_back(chunk);
+  }
 
-      size_t src_start = static_cast<size_t>(Read8(deflate_header));
-      size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
-      size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
+  // Deflate chunks are patched and re-deflated on worker threads, up to a few chunks ahead of the
+  // one being written out, into per-chunk buffers that are then written out in order. Normal and
+  // raw chunks are streamed to the sink as before, since they may be as large as the image.
+  size_t threads = std::thread::hardware_concurrency();
+  size_t max_pending = (threads > 1 && deflate_chunks > 1) ? threads * 2 : 0;
+  std::vector<std::future<DeflateChunkOutput>> pending(chunks.size());
+  size_t next_async = 0;
+  size_t num_pending = 0;
+
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    const ImageChunkPatch& chunk = chunks[i];
+    const Value* chunk_bonus = (i == 1) ? bonus_data : nullptr;
+
+    for (; next_async < chunks.size() && num_pending < max_pending; ++next_async) {
+      if (next_async <= i || chunks[next_async].type != CHUNK_DEFLATE) continue;
+      const char* header = chunks[next_async].header;
+      const Value* bonus = (next_async == 1) ? bonus_data : nullptr;
+      pending[next_async] = std::async(std::launch::async, [=, &patch]() {
+        DeflateChunkOutput output;
+        output.ok = ApplyDeflateChunk(old_data, old_size, patch, header, bonus,
+                                      [&output](const unsigned char* data, size_t len) {
+                                        output.data.insert(output.data.end(), data, data + len);
+                                        return len;
+                                      },
+                                      nullptr);
+        return output;
+      });
+      num_pending++;
+    }
+
+    if (chunk.type == CHUNK_NORMAL) {
+      size_t src_start = static_cast<size_t>(Read8(chunk.header));
+      size_t src_len = static_cast<size_t>(Read8(chunk.header + 8));
+      size_t patch_offset = static_cast<size_t>(Read8(chunk.header + 16));
 
       if (src_start + src_len > old_size) {
         printf("source data too short\n");
         return -1;
       }
-
-      // Decompress the source data; the chunk header tells us exactly
-      // how big we expect it to be when decompressed.
-
-      // Note: expanded_len will include the bonus data size if
-      // the patch was constructed with bonus data.  The
-      // deflation will come up 'bonus_size' bytes short; these
-      // must be appended from the bonus_data value.
-      size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->data.size() : 0;
-
-      std::vector<unsigned char> expanded_source(expanded_len);
-
-      // inflate() doesn't like strm.next_out being a nullptr even with
-      // avail_out being zero (Z_STREAM_ERROR).
-      if (expanded_len != 0) {
-        z_stream strm;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        strm.avail_in = src_len;
-        strm.next_in = old_data + src_start;
-        strm.avail_out = expanded_len;
-        strm.next_out = expanded_source.data();
-
-        int ret = inflateInit2(&strm, -15);
-        if (ret != Z_OK) {
-          printf("failed to init source inflation: %d\n", ret);
-          return -1;
-        }
-
-        // Because we've provided enough room to accommodate the output
-        // data, we expect one call to inflate() to suffice.
-        ret = inflate(&strm, Z_SYNC_FLUSH);
-        if (ret != Z_STREAM_END) {
-          printf("source inflation returned %d\n", ret);
-          return -1;
-        }
-        // We should have filled the output buffer exactly, except
-        // for the bonus_size.
-        if (strm.avail_out != bonus_size) {
-          printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
-          return -1;
-        }
-        inflateEnd(&strm);
-
-        if (bonus_size) {
-          memcpy(expanded_source.data() + (expanded_len - bonus_size), &bonus_data->data[0],
-                 bonus_size);
-        }
+      if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink, ctx) != 0) {
+        printf("Failed to apply bsdiff patch.\n");
+        return -1;
       }
-
-      if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), expanded_len, patch,
-                                           patch_offset, deflate_header, sink, ctx)) {
-        LOG(ERROR) << "Fail to apply streaming bspatch.";
+    } else if (chunk.type == CHUNK_RAW) {
+      if (ctx) {
+        SHA1_Update(ctx, patch_header + chunk.raw_pos, chunk.raw_len);
+      }
+      if (sink(reinterpret_cast<const unsigned char*>(patch_header + chunk.raw_pos),
+               chunk.raw_len) != chunk.raw_len) {
+        printf("failed to write chunk %zu raw data\n", i);
         return -1;
       }
-
-    } else {
-      printf("patch chunk %d is unknown type %d\n", i, type);
+    } else if (pending[i].valid()) {
+      DeflateChunkOutput output = pending[i].get();
+      num_pending--;
+      if (!output.ok) {
+        return -1;
+      }
+      if (ctx) {
+        SHA1_Update(ctx, output.data.data(), output.data.size());
+      }
+      if (sink(output.data.data(), output.data.size()) != output.data.size()) {
+        LOG(ERROR) << "Failed to write " << output.data.size() << " compressed bytes to output.";
+        return -1;
+      }
+    } else if (!ApplyDeflateChunk(old_data, old_size, patch, chunk.header, chunk_bonus, sink,
+                                  ctx)) {
       return -1;
     }
   }
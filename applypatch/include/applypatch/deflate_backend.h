@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_DEFLATE_BACKEND_H
+#define _APPLYPATCH_DEFLATE_BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include <zlib.h>
+
+// The deflate encoder used by imgpatch to recompress the patched chunks and by imgdiff to find the
+// settings that reproduce a compressed chunk. Both need the exact bytes zlib would produce, so an
+// alternative (faster) encoder only gets used for the parameters it claims to be bit-exact with
+// zlib for; everything else falls back to zlib.
+struct DeflateBackend {
+  const char* name;
+
+  // Same contracts as zlib's deflateInit2(), deflate() and deflateEnd() on the given z_stream.
+  int (*init)(z_stream* strm, int level, int method, int window_bits, int mem_level, int strategy);
+  int (*deflate)(z_stream* strm, int flush);
+  int (*end)(z_stream* strm);
+
+  // Returns true if the output for these parameters is byte for byte the one from zlib.
+  bool (*exact)(int level, int method, int window_bits, int mem_level, int strategy);
+};
+
+// The stock zlib encoder, always exact.
+const DeflateBackend& ZlibDeflateBackend();
+
+// Installs an alternative encoder, or restores zlib when given nullptr. Not thread-safe with
+// respect to running patches; meant to be called once at startup (or by tests).
+void SetDeflateBackend(const DeflateBackend* backend);
+
+// The encoder to use for the given parameters: the installed one if it is exact for them, zlib
+// otherwise.
+const DeflateBackend& GetDeflateBackend(int level, int method, int window_bits, int mem_level,
+                                        int strategy);
+
+// Compresses |len| bytes of |data| in one go with |backend| and the given parameters, appending
+// the result to |out|. Returns the zlib status of the failing call, or Z_OK.
+int DeflateWith(const DeflateBackend& backend, const uint8_t* data, size_t len, int level,
+                int method, int window_bits, int mem_level, int strategy, std::string* out);
+
+#endif  // _APPLYPATCH_DEFLATE_BACKEND_H
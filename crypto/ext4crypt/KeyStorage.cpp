@@ -284,6 +284,16 @@ static bool generateAppId(const KeyAuthentication& auth, const std::string& stre
     return true;
 }*/
 
+// Opening the keymaster is a round trip to the HAL, so one device is kept for
+// the later keys of a decrypt and for password retries. It is opened again
+// after a failed decrypt in case the HAL went away.
+static std::unique_ptr<Keymaster> sharedKeymaster;
+
+static Keymaster& getKeymaster() {
+    if (!sharedKeymaster || !*sharedKeymaster) sharedKeymaster.reset(new Keymaster());
+    return *sharedKeymaster;
+}
+
 bool retrieveKey(const std::string& dir, const KeyAuthentication& auth, std::string* key) {
     std::string version;
     if (!readFileToString(dir + "/" + kFn_version, &version)) return false;
@@ -305,9 +315,13 @@ bool retrieveKey(const std::string& dir, const KeyAuthentication& auth, std::str
     if (!readFileToString(dir + "/" + kFn_keymaster_key_blob, &kmKey)) return false;
     std::string encryptedMessage;
     if (!readFileToString(dir + "/" + kFn_encrypted_key, &encryptedMessage)) return false;
-    Keymaster keymaster;
+    Keymaster& keymaster = getKeymaster();
     if (!keymaster) return false;
-    return decryptWithKeymasterKey(keymaster, kmKey, auth, appId, encryptedMessage, key);
+    if (!decryptWithKeymasterKey(keymaster, kmKey, auth, appId, encryptedMessage, key)) {
+        sharedKeymaster.reset();
+        return false;
+    }
+    return true;
 }
 
 static bool deleteKey(const std::string& dir) {
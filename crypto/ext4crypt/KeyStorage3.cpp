@@ -443,6 +443,16 @@ static bool decryptWithoutKeymaster(const std::string& preKey,
     return true;
 }*/
 
+// Opening the keymaster is a round trip to the HAL, so one device is kept for
+// the later keys of a decrypt and for password retries. It is opened again
+// after a failed decrypt in case the HAL went away.
+static std::unique_ptr<Keymaster> sharedKeymaster;
+
+static Keymaster& getKeymaster() {
+    if (!sharedKeymaster || !*sharedKeymaster) sharedKeymaster.reset(new Keymaster());
+    return *sharedKeymaster;
+}
+
 bool retrieveKey(const std::string& dir, const KeyAuthentication& auth, std::string* key) {
     std::string version;
     if (!readFileToString(dir + "/" + kFn_version, &version)) return false;
@@ -463,10 +473,13 @@ bool retrieveKey(const std::string& dir, const KeyAuthentication& auth, std::str
     std::string encryptedMessage;
     if (!readFileToString(dir + "/" + kFn_encrypted_key, &encryptedMessage)) return false;
     if (auth.usesKeymaster()) {
-        Keymaster keymaster;
+        Keymaster& keymaster = getKeymaster();
         if (!keymaster) return false;
         auto keyParams = beginParams(auth, appId);
-        if (!decryptWithKeymasterKey(keymaster, dir, keyParams, encryptedMessage, key)) return false;
+        if (!decryptWithKeymasterKey(keymaster, dir, keyParams, encryptedMessage, key)) {
+            sharedKeymaster.reset();
+            return false;
+        }
     } else {
         if (!decryptWithoutKeymaster(appId, encryptedMessage, key)) return false;
     }
@@ -509,6 +509,16 @@ bool storeKeyAtomically(const std::string& key_path, const std::string& tmp_path
     return true;
 }
 
+// Opening the keymaster is a round trip to the HAL, so one device is kept for
+// the later keys of a decrypt and for password retries. It is opened again
+// after a failed decrypt in case the HAL went away.
+static std::unique_ptr<Keymaster> sharedKeymaster;
+
+static Keymaster& getKeymaster() {
+    if (!sharedKeymaster || !*sharedKeymaster) sharedKeymaster.reset(new Keymaster());
+    return *sharedKeymaster;
+}
+
 bool retrieveKey(const std::string& dir, const KeyAuthentication& auth, KeyBuffer* key) {
     std::string version;
     if (!readFileToString(dir + "/" + kFn_version, &version)) return false;
@@ -529,13 +539,15 @@ bool retrieveKey(const std::string& dir, const KeyAuthentication& auth, KeyBuffe
     std::string encryptedMessage;
     if (!readFileToString(dir + "/" + kFn_encrypted_key, &encryptedMessage)) return false;
     if (auth.usesKeymaster()) {
-        Keymaster keymaster;
+        Keymaster& keymaster = getKeymaster();
         if (!keymaster) return false;
         km::AuthorizationSet keyParams;
         km::HardwareAuthToken authToken;
         std::tie(keyParams, authToken) = beginParams(auth, appId);
-        if (!decryptWithKeymasterKey(keymaster, dir, keyParams, authToken, encryptedMessage, key))
+        if (!decryptWithKeymasterKey(keymaster, dir, keyParams, authToken, encryptedMessage, key)) {
+            sharedKeymaster.reset();
             return false;
+        }
     } else {
         if (!decryptWithoutKeymaster(appId, encryptedMessage, key)) return false;
     }
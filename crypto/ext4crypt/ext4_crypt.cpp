@@ -163,14 +163,16 @@ extern "C" bool e4crypt_policy_get_struct(const char *directory, ext4_encryption
         PLOG(ERROR) << "Failed to open directory " << directory;
         return false;
     }
-    memset(eep, 0, sizeof(ext4_encryption_policy));
-    if (ioctl(fd, EXT4_IOC_GET_ENCRYPTION_POLICY, eep) != 0) {
+    bool ret = e4crypt_policy_get_struct_fd(fd, eep);
+    if (!ret)
         PLOG(ERROR) << "Failed to get encryption policy for " << directory;
-        close(fd);
-        return false;
-    }
     close(fd);
-    return true;
+    return ret;
+}
+
+extern "C" bool e4crypt_policy_get_struct_fd(int fd, ext4_encryption_policy *eep) {
+    memset(eep, 0, sizeof(ext4_encryption_policy));
+    return ioctl(fd, EXT4_IOC_GET_ENCRYPTION_POLICY, eep) == 0;
 }
 
 extern "C" bool e4crypt_set_mode() {
@@ -51,6 +51,7 @@ bool e4crypt_policy_get(const char *directory, char *policy,
 void e4crypt_policy_fill_default_struct(struct ext4_encryption_policy *eep);
 bool e4crypt_policy_set_struct(const char *directory, const struct ext4_encryption_policy *eep);
 bool e4crypt_policy_get_struct(const char *directory, struct ext4_encryption_policy *eep);
+bool e4crypt_policy_get_struct_fd(int fd, struct ext4_encryption_policy *eep); // Same for an open directory
 
 bool e4crypt_set_mode();
 __END_DECLS
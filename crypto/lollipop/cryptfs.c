@@ -141,10 +141,19 @@ void set_partition_data(const char* block_device, const char* key_location, cons
 }
 
 #ifndef TW_CRYPTO_HAVE_KEYMASTERX
+/* Opening the keymaster can take longer than the signature itself, so the
+ * device is opened once and kept for every later password attempt. */
+static keymaster_device_t *open_keymaster_dev = NULL;
+
 static int keymaster_init(keymaster_device_t **keymaster_dev)
 {
     int rc;
 
+    if (open_keymaster_dev) {
+        *keymaster_dev = open_keymaster_dev;
+        return 0;
+    }
+
     const hw_module_t* mod;
     rc = hw_get_module_by_class(KEYSTORE_HARDWARE_MODULE_ID, NULL, &mod);
     if (rc) {
@@ -159,6 +168,7 @@ static int keymaster_init(keymaster_device_t **keymaster_dev)
         goto out;
     }
 
+    open_keymaster_dev = *keymaster_dev;
     return 0;
 
 out:
@@ -193,7 +203,6 @@ static int keymaster_check_compatibility()
 
 #endif
 out:
-    keymaster_close(keymaster_dev);
     return rc;
 }
 
@@ -233,7 +242,6 @@ static int keymaster_create_key(struct crypt_mnt_ftr *ftr)
     ftr->keymaster_blob_size = key_size;
 
 out:
-    keymaster_close(keymaster_dev);
     free(key);
     return rc;
 }
@@ -320,15 +328,25 @@ static int keymaster_sign_object(struct crypt_mnt_ftr *ftr,
                                   signature,
                                   signature_size);
 
-    keymaster_close(keymaster_dev);
     return rc;
 }
 #else //#ifndef TW_CRYPTO_HAVE_KEYMASTERX
+/* Opening the keymaster can take longer than the signature itself, so the
+ * device is opened once and kept for every later password attempt. */
+static keymaster0_device_t *open_keymaster0_dev = NULL;
+static keymaster1_device_t *open_keymaster1_dev = NULL;
+
 static int keymaster_init(keymaster0_device_t **keymaster0_dev,
                           keymaster1_device_t **keymaster1_dev)
 {
     int rc;
 
+    if (open_keymaster0_dev || open_keymaster1_dev) {
+        *keymaster0_dev = open_keymaster0_dev;
+        *keymaster1_dev = open_keymaster1_dev;
+        return 0;
+    }
+
     const hw_module_t* mod;
     rc = hw_get_module_by_class(KEYSTORE_HARDWARE_MODULE_ID, NULL, &mod);
     if (rc) {
@@ -355,6 +373,8 @@ static int keymaster_init(keymaster0_device_t **keymaster0_dev,
         goto err;
     }
 
+    open_keymaster0_dev = *keymaster0_dev;
+    open_keymaster1_dev = *keymaster1_dev;
     return 0;
 
 err:
@@ -395,12 +415,6 @@ static int keymaster_check_compatibility()
     }
 
 out:
-    if (keymaster1_dev) {
-        keymaster1_close(keymaster1_dev);
-    }
-    if (keymaster0_dev) {
-        keymaster0_close(keymaster0_dev);
-    }
     return rc;
 }
 
@@ -483,10 +497,6 @@ static int keymaster_create_key(struct crypt_mnt_ftr *ftr)
     ftr->keymaster_blob_size = key_size;
 
 out:
-    if (keymaster0_dev)
-        keymaster0_close(keymaster0_dev);
-    if (keymaster1_dev)
-        keymaster1_close(keymaster1_dev);
     free(key);
     return rc;
 }
@@ -617,11 +627,6 @@ static int keymaster_sign_object(struct crypt_mnt_ftr *ftr,
     }
 
     out:
-        if (keymaster1_dev)
-            keymaster1_close(keymaster1_dev);
-        if (keymaster0_dev)
-            keymaster0_close(keymaster0_dev);
-
         return rc;
 }
 #endif //#ifndef TW_CRYPTO_HAVE_KEYMASTERX
@@ -6,6 +6,15 @@ local_additional_dependencies := $(LOCAL_PATH)/android-config.mk $(LOCAL_PATH)/S
 
 include $(LOCAL_PATH)/Scrypt-config.mk
 
+# 32-bit ARM CPU variants without guaranteed NEON carry both the reference
+# and the NEON scrypt, crypto_scrypt-arm.c picks one at runtime
+ifeq ($(TARGET_ARCH),arm)
+ifneq ($(ARCH_ARM_HAVE_NEON),true)
+target_src_files := $(filter-out lib/crypto/crypto_scrypt-ref.c, $(target_src_files))
+target_src_files += lib/crypto/crypto_scrypt-arm.c lib/crypto/crypto_scrypt-arm-neon.c.neon
+endif
+endif
+
 #######################################
 # target static library
 include $(CLEAR_VARS)
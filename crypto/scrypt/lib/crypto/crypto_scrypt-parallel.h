@@ -0,0 +1,135 @@
+/*-
+ * Copyright 2009 Colin Percival
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file was originally written by Colin Percival as part of the Tarsnap
+ * online backup system.
+ */
+#ifndef _CRYPTO_SCRYPT_PARALLEL_H_
+#define _CRYPTO_SCRYPT_PARALLEL_H_
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/* Each extra thread needs its own V, which is 128 * r * N bytes. */
+#define SCRYPT_MAX_THREADS 4
+
+typedef void (*smix_func)(uint8_t *, size_t, uint64_t, void *, void *);
+
+struct smix_lane_set {
+	smix_func smix;
+	uint8_t * B;
+	size_t r;
+	uint64_t N;
+	uint32_t p;
+	uint32_t step;
+};
+
+struct smix_worker {
+	struct smix_lane_set * lanes;
+	uint32_t first;
+	void * V;
+	void * XY;
+	pthread_t thread;
+	int started;
+};
+
+static void *
+smix_worker_run(void * cookie)
+{
+	struct smix_worker * w = cookie;
+	struct smix_lane_set * l = w->lanes;
+	uint32_t i;
+
+	for (i = w->first; i < l->p; i += l->step)
+		l->smix(&l->B[i * 128 * l->r], l->r, l->N, w->V, w->XY);
+	return (NULL);
+}
+
+/**
+ * smix_parallel(B, r, N, p, V, XY, smix):
+ * Compute B_i <-- MF(B_i, N) for i = 0 to p - 1.  The lanes are independent,
+ * so with p > 1 they are spread over up to SCRYPT_MAX_THREADS threads, one
+ * per online CPU.  The calling thread uses V and XY; the others allocate
+ * their own.  When memory or threads run short, the remaining lanes run on
+ * the calling thread, so this never fails.
+ */
+static void
+smix_parallel(uint8_t * B, size_t r, uint64_t N, uint32_t p,
+    void * V, void * XY, smix_func smix)
+{
+	struct smix_worker w[SCRYPT_MAX_THREADS];
+	struct smix_lane_set lanes;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t nworkers = 1, i;
+
+	lanes.smix = smix;
+	lanes.B = B;
+	lanes.r = r;
+	lanes.N = N;
+	lanes.p = p;
+
+	w[0].V = V;
+	w[0].XY = XY;
+	while (nworkers < p && nworkers < SCRYPT_MAX_THREADS &&
+	    (ncpu <= 0 || nworkers < (uint32_t)ncpu)) {
+		w[nworkers].V = mmap(NULL, 128 * r * N, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (w[nworkers].V == MAP_FAILED)
+			break;
+		w[nworkers].XY = mmap(NULL, 256 * r + 64, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (w[nworkers].XY == MAP_FAILED) {
+			munmap(w[nworkers].V, 128 * r * N);
+			break;
+		}
+		nworkers++;
+	}
+
+	lanes.step = nworkers;
+	for (i = 0; i < nworkers; i++) {
+		w[i].lanes = &lanes;
+		w[i].first = i;
+		w[i].started = 0;
+	}
+	for (i = 1; i < nworkers; i++)
+		w[i].started = (pthread_create(&w[i].thread, NULL,
+		    smix_worker_run, &w[i]) == 0);
+
+	smix_worker_run(&w[0]);
+	for (i = 1; i < nworkers; i++) {
+		if (w[i].started)
+			pthread_join(w[i].thread, NULL);
+		else
+			smix_worker_run(&w[i]);
+		munmap(w[i].XY, 256 * r + 64);
+		munmap(w[i].V, 128 * r * N);
+	}
+}
+
+#endif /* !_CRYPTO_SCRYPT_PARALLEL_H_ */
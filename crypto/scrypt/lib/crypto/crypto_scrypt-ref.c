@@ -41,6 +41,7 @@
 #include "sysendian.h"
 
 #include "crypto_scrypt.h"
+#include "crypto_scrypt-parallel.h"
 
 static void blkcpy(uint8_t *, uint8_t *, size_t);
 static void blkxor(uint8_t *, uint8_t *, size_t);
@@ -207,6 +208,14 @@ smix(uint8_t * B, size_t r, uint64_t N, uint8_t * V, uint8_t * XY)
 	blkcpy(B, X, 128 * r);
 }
 
+/* smix() with the argument types of smix_parallel(). */
+static void
+smix_lane(uint8_t * B, size_t r, uint64_t N, void * V, void * XY)
+{
+
+	smix(B, r, N, V, XY);
+}
+
 /**
  * crypto_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen):
  * Compute scrypt(passwd[0 .. passwdlen - 1], salt[0 .. saltlen - 1], N, r,
@@ -224,7 +233,6 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 	uint8_t * B;
 	uint8_t * V;
 	uint8_t * XY;
-	uint32_t i;
 
 	/* Sanity-check parameters. */
 #if SIZE_MAX > UINT32_MAX
@@ -266,10 +274,8 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 #endif
 
 	/* 2: for i = 0 to p - 1 do */
-	for (i = 0; i < p; i++) {
-		/* 3: B_i <-- MF(B_i, N) */
-		smix(&B[i * 128 * r], r, N, V, XY);
-	}
+	/* 3: B_i <-- MF(B_i, N) */
+	smix_parallel(B, r, N, p, V, XY, smix_lane);
 
 	/* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
 #ifdef USE_OPENSSL_PBKDF2
@@ -22,6 +22,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/mount.h>
 #include <sys/time.h>
 #include <dirent.h>
@@ -49,6 +51,10 @@ extern "C" {
 	#include <cutils/properties.h>
 }
 
+#ifdef TW_PROPERTY_WAIT
+#include <sys/system_properties.h>
+#endif
+
 #include "vold_decrypt.h"
 
 namespace {
@@ -61,6 +67,8 @@ namespace {
 /* The minimal sleeping interval between checking for the service's state
  * when looping for SLEEP_MAX_USEC */
 #define  SLEEP_MIN_USEC      200000  /* 200 msec */
+/* How often a property is read when init cannot notify us of changes */
+#define  SLEEP_POLL_USEC      20000  /* 20 msec */
 
 
 /* vold response codes defined in ResponseCode.h */
@@ -203,30 +211,63 @@ int vsymlink(const string& oldname, const string& newname, bool verbose = false)
 
 
 /* Properties and Services Functions */
+int64_t Usec_Until(const struct timespec& deadline) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)(deadline.tv_sec - now.tv_sec) * 1000000 + (deadline.tv_nsec - now.tv_nsec) / 1000;
+}
+
+bool Property_Matches(const string& property_name, const string& expected_value, char* prop_value) {
+	property_get(property_name.c_str(), prop_value, "error");
+	if (expected_value == "not_empty")
+		return (strcmp(prop_value, "error") != 0);
+	return (strcmp(prop_value, expected_value.c_str()) == 0);
+}
+
+/* Returns as soon as the property has the expected value instead of checking
+ * it every SLEEP_MIN_USEC. With __system_property_wait init wakes us on each
+ * change, older bionic has no way to wait with a timeout so it is polled. */
 string Wait_For_Property(const string& property_name, int utimeout = SLEEP_MAX_USEC, const string& expected_value = "not_empty") {
 	char prop_value[PROPERTY_VALUE_MAX];
-
-	if (expected_value == "not_empty") {
-		while (utimeout > 0) {
-			property_get(property_name.c_str(), prop_value, "error");
-			if (strcmp(prop_value, "error") != 0)
-				break;
-			LOGKMSG("waiting for %s to get set\n", property_name.c_str());
-			utimeout -= SLEEP_MIN_USEC;
-			usleep(SLEEP_MIN_USEC);;
-		}
+	struct timespec deadline;
+	bool logged = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += utimeout / 1000000;
+	deadline.tv_nsec += (utimeout % 1000000) * 1000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
 	}
-	else {
-		while (utimeout > 0) {
-			property_get(property_name.c_str(), prop_value, "error");
-			if (strcmp(prop_value, expected_value.c_str()) == 0)
-				break;
-			LOGKMSG("waiting for %s to change from '%s' to '%s'\n", property_name.c_str(), prop_value, expected_value.c_str());
-			utimeout -= SLEEP_MIN_USEC;
-			usleep(SLEEP_MIN_USEC);;
+
+	for (;;) {
+#ifdef TW_PROPERTY_WAIT
+		// Take the serial before reading so a change in between still wakes us,
+		// a property that does not exist yet is waited for through any change
+		const prop_info* pi = __system_property_find(property_name.c_str());
+		uint32_t serial = pi ? __system_property_serial(pi) : __system_property_area_serial();
+#endif
+		if (Property_Matches(property_name, expected_value, prop_value))
+			break;
+		int64_t remaining = Usec_Until(deadline);
+		if (remaining <= 0)
+			break;
+		if (!logged) {
+			if (expected_value == "not_empty")
+				LOGKMSG("waiting for %s to get set\n", property_name.c_str());
+			else
+				LOGKMSG("waiting for %s to change from '%s' to '%s'\n", property_name.c_str(), prop_value, expected_value.c_str());
+			logged = true;
 		}
+#ifdef TW_PROPERTY_WAIT
+		struct timespec timeout;
+		timeout.tv_sec = remaining / 1000000;
+		timeout.tv_nsec = (remaining % 1000000) * 1000;
+		__system_property_wait(pi, serial, &serial, &timeout);
+#else
+		usleep(remaining < SLEEP_POLL_USEC ? remaining : SLEEP_POLL_USEC);
+#endif
 	}
-	property_get(property_name.c_str(), prop_value, "error");
 
 	return prop_value;
 }
@@ -254,6 +295,11 @@ bool Start_Service(const string& initrc_svc, int utimeout = SLEEP_MAX_USEC) {
 	string res = "error";
 	string init_svc = "init.svc." + initrc_svc;
 
+	if (Is_Service_Running(initrc_svc)) {
+		LOGINFO("Start service %s: already running.\n", initrc_svc.c_str());
+		return true;
+	}
+
 	property_set("ctl.start", initrc_svc.c_str());
 
 	res = Wait_For_Property(init_svc, utimeout, "running");
@@ -841,39 +887,57 @@ int Exec_vdc_cryptfs(const string& command, const string& argument, vdc_ReturnVa
 
 		default:
 		{
-			int timeout = 30*100;
+			struct timespec deadline;
+			struct pollfd fds[2];
+			int open_fds = 2;
+
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += 30;
 
 			for (int i = 0; i < 2; ++i) {
 				close(pipe_fd[i][1]);
 
-				// Non-blocking read loop with timeout
+				// Non-blocking reads, poll() says when there is output
 				int flags = fcntl(pipe_fd[i][0], F_GETFL, 0);
 				fcntl(pipe_fd[i][0], F_SETFL, flags | O_NONBLOCK);
+				fds[i].fd = pipe_fd[i][0];
+				fds[i].events = POLLIN;
 			}
 
 			char buffer[128];
 			ssize_t count;
 			string strout[2];
-			pid_t retpid = waitpid(pid, &status, WNOHANG);
-			while (true) {
+			pid_t retpid = 0;
+			int64_t remaining;
+			while (open_fds > 0 && (remaining = Usec_Until(deadline)) > 0) {
+				int ret = poll(fds, 2, (int)((remaining + 999) / 1000));
+				if (ret < 0) {
+					if (errno == EINTR)
+						continue;
+					LOGERROR("exec_vdc_cryptfs: poll() error %d (%s)\n", errno, strerror(errno));
+					break;
+				}
 				for (int i = 0; i < 2; ++i) {
-					count = read(pipe_fd[i][0], buffer, sizeof(buffer));
-					if (count == -1) {
-						if (errno == EINTR)
-							continue;
-						else if (errno != EAGAIN)
-							LOGERROR("exec_vdc_cryptfs: read() error %d (%s)\n!", errno, strerror(errno));
-					} else if (count > 0) {
+					if (fds[i].fd < 0 || !fds[i].revents)
+						continue;
+					count = read(fds[i].fd, buffer, sizeof(buffer));
+					if (count > 0) {
 						strout[i].append(buffer, count);
+					} else if (count == 0 || (errno != EINTR && errno != EAGAIN)) {
+						if (count < 0)
+							LOGERROR("exec_vdc_cryptfs: read() error %d (%s)\n!", errno, strerror(errno));
+						fds[i].fd = -1;
+						open_fds--;
 					}
 				}
+			}
 
+			// Both pipes are closed once vdc exits, so this rarely has to wait
+			retpid = waitpid(pid, &status, WNOHANG);
+			while (retpid == 0 && Usec_Until(deadline) > 0) {
+				usleep(10000);
 				retpid = waitpid(pid, &status, WNOHANG);
-				if (retpid == 0 && --timeout)
-					usleep(10000);
-				else
-					break;
-			};
+			}
 
 			for (int i = 0; i < 2; ++i) {
 				close(pipe_fd[i][0]);
@@ -893,10 +957,10 @@ int Exec_vdc_cryptfs(const string& command, const string& argument, vdc_ReturnVa
 			vdcResult->Output += "RC=" + TWFunc::to_string(WEXITSTATUS(status));
 
 			// Error handling
-			if (retpid == 0 && timeout == 0) {
+			if (retpid == 0) {
 				LOGERROR("exec_vdc_cryptfs: took too long, killing process\n");
 				kill(pid, SIGKILL);
-				for (timeout = 5; retpid == 0 && timeout; --timeout) {
+				for (int timeout = 5; retpid == 0 && timeout; --timeout) {
 					sleep(1);
 					retpid = waitpid(pid, &status, WNOHANG);
 				}
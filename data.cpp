@@ -16,6 +16,7 @@
 	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <errno.h>
 #include <pthread.h>
 #include <time.h>
 #include <string>
@@ -36,6 +37,10 @@
 #include "set_metadata.h"
 #include "gui/gui.hpp"
 #include "infomanager.hpp"
+#include "twrpTrace.hpp"
+#ifdef TW_USB_STORAGE_FFS
+#include "twrpUsbDisk.hpp"
+#endif
 
 #define DEVID_MAX 64
 #define HWID_MAX 32
@@ -49,6 +54,7 @@ extern "C"
 #include "minuitwrp/minui.h"
 
 #define FILE_VERSION 0x00010010 // Do not set to 0
+#define SAVE_DELAY_SEC 2 // Persisted changes are written once none came in for this long
 
 using namespace std;
 
@@ -65,6 +71,16 @@ pthread_mutex_t DataManager::m_valuesLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
 #else
 pthread_mutex_t DataManager::m_valuesLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 #endif
+pthread_mutex_t DataManager::m_saveLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t DataManager::m_saveCond;
+bool DataManager::mSaveDirty = false;
+bool DataManager::mSaveThreadStarted = false;
+struct timespec DataManager::mSaveDeadline;
+#ifndef PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+pthread_mutex_t DataManager::m_writeLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
+#else
+pthread_mutex_t DataManager::m_writeLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#endif
 
 // Device ID functions
 void DataManager::sanitize_device_id(char* device_id) {
@@ -303,76 +319,149 @@ int DataManager::LoadPersistValues(void)
 
 int DataManager::Flush()
 {
+	pthread_mutex_lock(&m_saveLock);
+	mSaveDirty = false;
+	pthread_mutex_unlock(&m_saveLock);
 	return SaveValues();
 }
 
-int DataManager::SaveValues()
+int DataManager::SaveValues(bool mount /* = true */)
 {
 #ifndef TW_OEM_BUILD
-	if (PartitionManager.Mount_By_Path("/persist", false)) {
-		mPersist.SetFile(PERSIST_SETTINGS_FILE);
-		mPersist.SetFileVersion(FILE_VERSION);
-		pthread_mutex_lock(&m_valuesLock);
-		mPersist.SaveValues();
-		pthread_mutex_unlock(&m_valuesLock);
+	// Write a copy so readers aren't blocked on the storage
+	pthread_mutex_lock(&m_valuesLock);
+	InfoManager values(mPersist);
+	pthread_mutex_unlock(&m_valuesLock);
+	values.SetFileVersion(FILE_VERSION);
+
+	pthread_mutex_lock(&m_writeLock);
+	if (mount ? PartitionManager.Mount_By_Path("/persist", false) : PartitionManager.Is_Mounted_By_Path("/persist")) {
+		values.SetFile(PERSIST_SETTINGS_FILE);
+		values.SaveValues(mount);
 		LOGINFO("Saved settings file values to %s\n", PERSIST_SETTINGS_FILE);
 	}
 
-	if (mBackingFile.empty())
+	if (mBackingFile.empty()) {
+		pthread_mutex_unlock(&m_writeLock);
 		return -1;
+	}
 
 	string mount_path = GetSettingsStoragePath();
-	PartitionManager.Mount_By_Path(mount_path.c_str(), 1);
+	if (mount)
+		PartitionManager.Mount_By_Path(mount_path.c_str(), 1);
+	else if (!PartitionManager.Is_Mounted_By_Path(mount_path)) {
+		// Saved by the next Flush(), mounting from here could race a wipe
+		pthread_mutex_unlock(&m_writeLock);
+		return -1;
+	}
 
-	mPersist.SetFile(mBackingFile);
-	mPersist.SetFileVersion(FILE_VERSION);
-	pthread_mutex_lock(&m_valuesLock);
-	mPersist.SaveValues();
-	pthread_mutex_unlock(&m_valuesLock);
+	values.SetFile(mBackingFile);
+	values.SaveValues(mount);
+	pthread_mutex_unlock(&m_writeLock);
 
-	tw_set_default_metadata(mBackingFile.c_str());
 	LOGINFO("Saved settings file values to '%s'\n", mBackingFile.c_str());
 #endif // ifdef TW_OEM_BUILD
 	return 0;
 }
 
+void DataManager::Lock_Settings_Storage()
+{
+	pthread_mutex_lock(&m_writeLock);
+}
+
+void DataManager::Unlock_Settings_Storage()
+{
+	pthread_mutex_unlock(&m_writeLock);
+}
+
+void DataManager::Schedule_Save()
+{
+	pthread_mutex_lock(&m_saveLock);
+	if (!mSaveThreadStarted) {
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&m_saveCond, &attr);
+		pthread_condattr_destroy(&attr);
+
+		pthread_t thread;
+		mSaveThreadStarted = (pthread_create(&thread, NULL, Save_Thread, NULL) == 0);
+		if (mSaveThreadStarted)
+			pthread_detach(thread);
+		else
+			LOGINFO("Unable to start settings save thread, saving on flush only\n");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &mSaveDeadline);
+	mSaveDeadline.tv_sec += SAVE_DELAY_SEC;
+	mSaveDirty = true;
+	if (mSaveThreadStarted)
+		pthread_cond_signal(&m_saveCond);
+	pthread_mutex_unlock(&m_saveLock);
+}
+
+void* DataManager::Save_Thread(void* cookie __unused)
+{
+	pthread_mutex_lock(&m_saveLock);
+	while (true) {
+		if (!mSaveDirty) {
+			pthread_cond_wait(&m_saveCond, &m_saveLock);
+			continue;
+		}
+		// Every change pushes the deadline out, so a burst is one write
+		if (pthread_cond_timedwait(&m_saveCond, &m_saveLock, &mSaveDeadline) != ETIMEDOUT)
+			continue;
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (!mSaveDirty || now.tv_sec < mSaveDeadline.tv_sec ||
+			(now.tv_sec == mSaveDeadline.tv_sec && now.tv_nsec < mSaveDeadline.tv_nsec))
+			continue;
+		mSaveDirty = false;
+		pthread_mutex_unlock(&m_saveLock);
+		SaveValues(false);
+		pthread_mutex_lock(&m_saveLock);
+	}
+	return NULL;
+}
+
 int DataManager::GetValue(const string& varName, string& value)
 {
-	string localStr = varName;
+	// Only copy the name when it has to be changed, this is called a lot
+	const string* localStr = &varName;
+	string stripped;
 	int ret = 0;
 
 	if (!mInitialized)
 		SetDefaultValues();
 
 	// Strip off leading and trailing '%' if provided
-	if (localStr.length() > 2 && localStr[0] == '%' && localStr[localStr.length()-1] == '%')
+	if (varName.length() > 2 && varName[0] == '%' && varName[varName.length()-1] == '%')
 	{
-		localStr.erase(0, 1);
-		localStr.erase(localStr.length() - 1, 1);
+		stripped = varName.substr(1, varName.length() - 2);
+		localStr = &stripped;
 	}
 
 	// Handle magic values
-	if (GetMagicValue(localStr, value) == 0)
+	if (GetMagicValue(*localStr, value) == 0)
 		return 0;
 
 	// Handle property
-	if (localStr.length() > 9 && localStr.substr(0, 9) == "property.") {
+	if (localStr->length() > 9 && localStr->compare(0, 9, "property.") == 0) {
 		char property_value[PROPERTY_VALUE_MAX];
-		property_get(localStr.substr(9).c_str(), property_value, "");
+		property_get(localStr->c_str() + 9, property_value, "");
 		value = property_value;
 		return 0;
 	}
 
 	pthread_mutex_lock(&m_valuesLock);
-	ret = mConst.GetValue(localStr, value);
+	ret = mConst.GetValue(*localStr, value);
 	if (ret == 0)
 		goto exit;
 
-	ret = mPersist.GetValue(localStr, value);
+	ret = mPersist.GetValue(*localStr, value);
 	if (ret == 0)
 		goto exit;
 
-	ret = mData.GetValue(localStr, value);
+	ret = mData.GetValue(*localStr, value);
 exit:
 	pthread_mutex_unlock(&m_valuesLock);
 	return ret;
@@ -435,10 +524,10 @@ int DataManager::SetValue(const string& varName, const string& value, const int
 		SetDefaultValues();
 
 	// Handle property
-	if (varName.length() > 9 && varName.substr(0, 9) == "property.") {
-		int ret = property_set(varName.substr(9).c_str(), value.c_str());
+	if (varName.length() > 9 && varName.compare(0, 9, "property.") == 0) {
+		int ret = property_set(varName.c_str() + 9, value.c_str());
 		if (ret)
-			LOGERR("Error setting property '%s' to '%s'\n", varName.substr(9).c_str(), value.c_str());
+			LOGERR("Error setting property '%s' to '%s'\n", varName.c_str() + 9, value.c_str());
 		return ret;
 	}
 
@@ -446,27 +535,26 @@ int DataManager::SetValue(const string& varName, const string& value, const int
 	if (varName.empty() || (varName[0] >= '0' && varName[0] <= '9'))
 		return -1;
 
-	string test;
 	pthread_mutex_lock(&m_valuesLock);
-	int constChk = mConst.GetValue(varName, test);
-	if (constChk == 0) {
+	if (mConst.Exists(varName)) {
 		pthread_mutex_unlock(&m_valuesLock);
 		return -1;
 	}
 
-	if (persist) {
+	bool save = false;
+	if (persist || mPersist.Exists(varName)) {
+		// Nothing is saved until the settings file has been read
+		save = !mBackingFile.empty() && !mPersist.HasValue(varName, value);
 		mPersist.SetValue(varName, value);
 	} else {
-		int persistChk = mPersist.GetValue(varName, test);
-		if (persistChk == 0) {
-			mPersist.SetValue(varName, value);
-		} else {
-			mData.SetValue(varName, value);
-		}
+		mData.SetValue(varName, value);
 	}
 
 	pthread_mutex_unlock(&m_valuesLock);
 
+	if (save)
+		Schedule_Save();
+
 #ifndef TW_NO_SCREEN_TIMEOUT
 	if (varName == "tw_screen_timeout_secs") {
 		blankTimer.setTime(atoi(value.c_str()));
@@ -474,6 +562,8 @@ int DataManager::SetValue(const string& varName, const string& value, const int
 #endif
 	if (varName == "tw_storage_path") {
 		SetBackupFolder();
+	} else if (varName == TW_TRACE_VAR) {
+		twrpTrace::Set_Enabled(value == "1");
 	}
 	gui_notifyVarChange(varName.c_str(), value.c_str());
 	return 0;
@@ -515,6 +605,14 @@ int DataManager::ShowProgress(const float Portion, const float Seconds)
 	return 0;
 }
 
+size_t DataManager::GetMemoryUsage()
+{
+	pthread_mutex_lock(&m_valuesLock);
+	size_t bytes = mPersist.GetMemoryUsage() + mData.GetMemoryUsage() + mConst.GetMemoryUsage() + InfoManager::GetMemoryUsage(mConstValues);
+	pthread_mutex_unlock(&m_valuesLock);
+	return bytes;
+}
+
 void DataManager::update_tz_environment_variables(void)
 {
 	setenv("TZ", GetStrValue(TW_TIME_ZONE_VAR).c_str(), 1);
@@ -686,6 +784,12 @@ void DataManager::SetDefaultValues()
 		sprintf(lun_file, CUSTOM_LUN_FILE, 0);
 		Lun_File_str = lun_file;
 	}
+#ifdef TW_USB_STORAGE_FFS
+	if (TWFunc::Path_Exists(USB_DISK_FFS_EP0)) {
+		LOGINFO("USB storage mode served through '%s'\n", USB_DISK_FFS_PATH);
+		mData.SetValue(TW_HAS_USB_STORAGE, "1");
+	} else
+#endif
 	if (!TWFunc::Path_Exists(Lun_File_str)) {
 		LOGINFO("Lun file '%s' does not exist, USB storage mode disabled\n", Lun_File_str.c_str());
 		mConst.SetValue(TW_HAS_USB_STORAGE, "0");
@@ -728,12 +832,21 @@ void DataManager::SetDefaultValues()
 	mPersist.SetValue(TW_SIGNED_ZIP_VERIFY_VAR, "0");
 	mPersist.SetValue(TW_DISABLE_FREE_SPACE_VAR, "0");
 	mPersist.SetValue(TW_FORCE_DIGEST_CHECK_VAR, "0");
+	mPersist.SetValue(TW_TRACE_VAR, "0");
 	mPersist.SetValue(TW_USE_COMPRESSION_VAR, "0");
+	mPersist.SetValue(TW_USE_LZ4_VAR, "0");
+	mPersist.SetValue(TW_SPARSE_IMAGE_BACKUP_VAR, "0");
+	mPersist.SetValue(TW_INCREMENTAL_BACKUP_VAR, "0");
+	mPersist.SetValue(TW_DEDUP_BACKUP_VAR, "0");
+	mPersist.SetValue(TW_SNAPSHOT_BACKUP_VAR, "0");
+	mPersist.SetValue(TW_USED_BLOCKS_BACKUP_VAR, "0");
 	mPersist.SetValue(TW_TIME_ZONE_VAR, "CST6CDT,M3.2.0,M11.1.0");
 	mPersist.SetValue(TW_GUI_SORT_ORDER, "1");
 	mPersist.SetValue(TW_RM_RF_VAR, "0");
 	mPersist.SetValue(TW_SKIP_DIGEST_CHECK_VAR, "0");
 	mPersist.SetValue(TW_SKIP_DIGEST_GENERATE_VAR, "0");
+	mPersist.SetValue(TW_VERIFY_DIGEST_INLINE_VAR, "0");
+	mPersist.SetValue(TW_VERIFY_INTERVAL_VAR, "30");
 	mPersist.SetValue(TW_SDEXT_SIZE, "0");
 	mPersist.SetValue(TW_SWAP_SIZE, "0");
 	mPersist.SetValue(TW_SDPART_FILE_SYSTEM, "ext3");
@@ -896,6 +1009,8 @@ void DataManager::SetDefaultValues()
 #endif
 
         mData.SetValue("tw_enable_adb_backup", "0");
+        mData.SetValue(TW_ADB_BACKUP_STREAMS_VAR, "1");
+        mData.SetValue(TW_ADB_AUTO_CODEC_VAR, "0");
 
 	pthread_mutex_unlock(&m_valuesLock);
 }
@@ -54,6 +54,7 @@ public:
 	static int ShowProgress(const float Portion, const float Seconds);
 
 	static void DumpValues();
+	static size_t GetMemoryUsage(); // Bytes held by all the variables
 	static void update_tz_environment_variables();
 	static void Vibrate(const string& varName);
 	static void SetBackupFolder();
@@ -64,6 +65,12 @@ public:
 	static string GetCurrentStoragePath(void);
 	static string GetSettingsStoragePath(void);
 
+	// Held while a partition with a settings file is unmounted or wiped, so
+	// a background save never checks it mounted and then writes to it
+	// halfway through the unmount or wipe
+	static void Lock_Settings_Storage();
+	static void Unlock_Settings_Storage();
+
 protected:
 	static string mBackingFile;
 	static int mInitialized;
@@ -74,7 +81,10 @@ protected:
 	static map<string, string> mConstValues;
 
 protected:
-	static int SaveValues();
+	// With mount false, only writes to storage that is already mounted
+	static int SaveValues(bool mount = true);
+	static void Schedule_Save();
+	static void* Save_Thread(void* cookie);
 
 	static int GetMagicValue(const string& varName, string& value);
 
@@ -83,6 +93,16 @@ private:
 	static void get_device_id(void);
 
 	static pthread_mutex_t m_valuesLock;
+
+	// Write-behind state for persisted values, guarded by m_saveLock
+	static pthread_mutex_t m_saveLock;
+	static pthread_cond_t m_saveCond;
+	static bool mSaveDirty;
+	static bool mSaveThreadStarted;
+	static struct timespec mSaveDeadline;
+	// Serializes settings file writes with each other and with unmounts and
+	// wipes of the settings storage, recursive as a wipe also unmounts
+	static pthread_mutex_t m_writeLock;
 };
 
 #endif // _DATAMANAGER_HPP_HEADER
@@ -1047,7 +1047,16 @@ static int scan_dir(DOS_FS * fs, DOS_FILE * this, FDSC ** cp)
 static int subdirs(DOS_FS * fs, DOS_FILE * parent, FDSC ** cp)
 {
     DOS_FILE *walk;
+    uint32_t start;
 
+    /* Queue the first cluster of every subdirectory before descending, so
+     * the device reads them while the earlier ones are being checked */
+    for (walk = parent ? parent->first : root; walk; walk = walk->next)
+	if (walk->dir_ent.attr & ATTR_DIR) {
+	    start = FSTART(walk, fs);
+	    if (start >= 2 && start < fs->clusters + 2)
+		fs_prefetch(cluster_start(fs, start), fs->cluster_size);
+	}
     for (walk = parent ? parent->first : root; walk; walk = walk->next)
 	if (walk->dir_ent.attr & ATTR_DIR)
 	    if (strncmp((const char *)walk->dir_ent.name, MSDOS_DOT, MSDOS_NAME)
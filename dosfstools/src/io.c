@@ -55,6 +55,14 @@ typedef struct _change {
 static CHANGE *changes, *last;
 static int fd, did_change = 0;
 
+/* Directory entries are read one at a time, so reads smaller than the window
+ * are served from an aligned block read around them */
+#define READ_WINDOW (64 * 1024)
+
+static char *window;
+static loff_t window_pos = -1;
+static int window_size;
+
 unsigned device_no;
 
 #ifdef __DJGPP__
@@ -87,6 +95,7 @@ void fs_open(char *path, int rw)
     }
     changes = last = NULL;
     did_change = 0;
+    window_pos = -1;
 
 #ifndef _DJGPP_
     if (fstat(fd, &stbuf) < 0)
@@ -117,9 +126,8 @@ void fs_open(char *path, int rw)
  * @param[in]   size    Number of bytes to read
  * @param[out]  data    Where to put the data read
  */
-void fs_read(loff_t pos, int size, void *data)
+static void read_device(loff_t pos, int size, void *data)
 {
-    CHANGE *walk;
     int got;
 
     if (llseek(fd, pos, 0) != pos)
@@ -128,6 +136,56 @@ void fs_read(loff_t pos, int size, void *data)
 	pdie("Read %d bytes at %lld", size, pos);
     if (got != size)
 	die("Got %d bytes instead of %d at %lld", got, size, pos);
+}
+
+/**
+ * Serve a small read from the read window, refilling it when the range
+ * is not inside. The window may end early at the end of the device.
+ *
+ * @return  0   Range was read into DATA
+ * @return  -1  Range could not be windowed, read it directly
+ */
+static int read_window(loff_t pos, int size, void *data)
+{
+    loff_t start;
+    int got;
+
+    if (size > READ_WINDOW / 2)
+	return -1;
+    if (window_pos < 0 || pos < window_pos ||
+	pos + size > window_pos + window_size) {
+	if (!window)
+	    window = alloc(READ_WINDOW);
+	start = pos & ~(loff_t) (READ_WINDOW - 1);
+	if (pos + size > start + READ_WINDOW)
+	    start = pos;
+	window_pos = -1;
+	if (llseek(fd, start, 0) != start)
+	    return -1;
+	if ((got = read(fd, window, READ_WINDOW)) < pos + size - start)
+	    return -1;
+	window_pos = start;
+	window_size = got;
+    }
+    memcpy(data, window + (pos - window_pos), size);
+    return 0;
+}
+
+/**
+ * Read data from the partition, accounting for any pending updates that are
+ * queued for writing.
+ *
+ * @param[in]   pos     Byte offset, relative to the beginning of the partition,
+ *                      at which to read
+ * @param[in]   size    Number of bytes to read
+ * @param[out]  data    Where to put the data read
+ */
+void fs_read(loff_t pos, int size, void *data)
+{
+    CHANGE *walk;
+
+    if (read_window(pos, size, data) < 0)
+	read_device(pos, size, data);
     for (walk = changes; walk; walk = walk->next) {
 	if (walk->pos < pos + size && walk->pos + walk->size > pos) {
 	    if (walk->pos < pos)
@@ -144,6 +202,13 @@ void fs_read(loff_t pos, int size, void *data)
     }
 }
 
+void fs_prefetch(loff_t pos, int size)
+{
+#ifndef __DJGPP__
+    posix_fadvise(fd, pos, size, POSIX_FADV_WILLNEED);
+#endif
+}
+
 int fs_test(loff_t pos, int size)
 {
     void *scratch;
@@ -164,6 +229,9 @@ void fs_write(loff_t pos, int size, void *data)
 
     if (write_immed) {
 	did_change = 1;
+	if (window_pos >= 0 && pos < window_pos + window_size &&
+	    pos + size > window_pos)
+	    window_pos = -1;
 	if (llseek(fd, pos, 0) != pos)
 	    pdie("Seek to %lld", pos);
 	if ((did = write(fd, data, size)) == size)
@@ -221,6 +289,9 @@ int fs_close(int write)
 	    free(changes);
 	    changes = next;
 	}
+    free(window);
+    window = NULL;
+    window_pos = -1;
     if (close(fd) < 0)
 	pdie("closing filesystem");
     return changed || did_change;
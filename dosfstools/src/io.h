@@ -43,6 +43,11 @@ void fs_read(loff_t pos, int size, void *data);
 /* Reads SIZE bytes starting at POS into DATA. Performs all applicable
    changes. */
 
+void fs_prefetch(loff_t pos, int size);
+
+/* Hints that SIZE bytes starting at POS will be read soon, so the device can
+   start reading them in the background. */
+
 int fs_test(loff_t pos, int size);
 
 /* Returns a non-zero integer if SIZE bytes starting at POS can be read without
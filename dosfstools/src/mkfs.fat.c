@@ -80,6 +80,7 @@
 #define FALSE 0
 
 #define TEST_BUFFER_BLOCKS 16
+#define BLANK_RUN (1024 * 1024)	/* Bytes of zeros written at a time */
 #define HARD_SECTOR_SIZE   512
 #define SECTORS_PER_BLOCK ( BLOCK_SIZE / HARD_SECTOR_SIZE )
 
@@ -252,7 +253,8 @@ static struct msdos_dir_entry *root_dir;	/* Root directory */
 static int size_root_dir;	/* Size of the root directory in bytes */
 static int sectors_per_cluster = 0;	/* Number of sectors per disk cluster */
 static int root_dir_entries = 0;	/* Number of root directory entries */
-static char *blank_sector;	/* Blank sector - all zeros */
+static char *blank_sector;	/* Blank sectors - all zeros */
+static int blank_size;		/* Size of the blank sectors buffer in bytes */
 static int hidden_sectors = 0;	/* Number of hidden sectors */
 static int hidden_sectors_by_user = 0;	/* -h option invoked */
 static int drive_number_option = 0;	/* drive number */
@@ -264,6 +266,8 @@ static int orphaned_sectors = 0;	/* Sectors that exist in the last block of file
 static int invariant = 0;		/* Whether to set normally randomized or
 					   current time based values to
 					   constants */
+static int discard = 0;		/* Whether to discard the device and zero the
+				   tables with BLKZEROOUT */
 
 /* Function prototype definitions */
 
@@ -1263,9 +1267,12 @@ static void setup_tables(void)
 	*(uint16_t *) (info_sector + 0x1fe) = htole16(BOOT_SIGN);
     }
 
-    if (!(blank_sector = malloc(sector_size)))
+    /* Zeroed sectors are written in large runs, a FAT32 FAT on a big card
+     * is hundreds of thousands of sectors */
+    blank_size = sector_size * ((BLANK_RUN + sector_size - 1) / sector_size);
+    if (!(blank_sector = malloc(blank_size)))
 	die("Out of memory");
-    memset(blank_sector, 0, sector_size);
+    memset(blank_sector, 0, blank_size);
 }
 
 /* Write the new filesystem's data tables to wherever they're going to end up! */
@@ -1292,6 +1299,33 @@ static void setup_tables(void)
 	error ("failed whilst writing " errstr);	\
   } while(0)
 
+/* Zero COUNT sectors from the current position and leave the position after
+ * them. Returns non-zero on failure. */
+static int write_blank(int count)
+{
+    loff_t pos = llseek(dev, 0, SEEK_CUR);
+    loff_t size = (loff_t) count * sector_size;
+    int chunk;
+
+    if (pos < 0)
+	return -1;
+#ifdef BLKZEROOUT
+    if (discard) {
+	uint64_t range[2] = { pos, size };
+
+	if (size > 0 && ioctl(dev, BLKZEROOUT, range) == 0)
+	    return llseek(dev, pos + size, SEEK_SET) == pos + size ? 0 : -1;
+    }
+#endif
+    while (size > 0) {
+	chunk = size < blank_size ? size : blank_size;
+	if (write(dev, blank_sector, chunk) != chunk)
+	    return -1;
+	size -= chunk;
+    }
+    return 0;
+}
+
 static void write_tables(void)
 {
     int x;
@@ -1300,10 +1334,21 @@ static void write_tables(void)
     fat_length = (size_fat == 32) ?
 	le32toh(bs.fat32.fat32_length) : le16toh(bs.fat_length);
 
+#ifdef BLKDISCARD
+    if (discard) {
+	/* Trim the whole filesystem so the card does not carry the old data
+	 * around; not every device supports it */
+	uint64_t range[2] = { 0, blocks * BLOCK_SIZE };
+
+	if (ioctl(dev, BLKDISCARD, range) != 0 && verbose)
+	    printf("Discard not supported: %s\n", strerror(errno));
+    }
+#endif
+
     seekto(0, "start of device");
     /* clear all reserved sectors */
-    for (x = 0; x < reserved_sectors; ++x)
-	writebuf(blank_sector, sector_size, "reserved sector");
+    if (write_blank(reserved_sectors))
+	error("failed whilst writing reserved sector");
     /* seek back to sector 0 and write the boot sector */
     seekto(0, "boot sector");
     writebuf((char *)&bs, sizeof(struct msdos_boot_sector), "boot sector");
@@ -1320,11 +1365,10 @@ static void write_tables(void)
     /* seek to start of FATS and write them all */
     seekto(reserved_sectors * sector_size, "first FAT");
     for (x = 1; x <= nr_fats; x++) {
-	int y;
 	int blank_fat_length = fat_length - alloced_fat_length;
 	writebuf(fat, alloced_fat_length * sector_size, "FAT");
-	for (y = 0; y < blank_fat_length; y++)
-	    writebuf(blank_sector, sector_size, "FAT");
+	if (write_blank(blank_fat_length))
+	    error("failed whilst writing FAT");
     }
     /* Write the root directory directly after the last FAT. This is the root
      * dir area on FAT12/16, and the first cluster on FAT32. */
@@ -1348,7 +1392,7 @@ Usage: mkfs.fat [-a][-A][-c][-C][-v][-I][-l bad-block-file][-b backup-boot-secto
        [-s sectors-per-cluster][-S logical-sector-size][-f number-of-FATs]\n\
        [-h hidden-sectors][-F fat-size][-r root-dir-entries][-R reserved-sectors]\n\
        [-M FAT-media-byte][-D drive_number]\n\
-       [--invariant]\n\
+       [--invariant][--discard]\n\
        [--help]\n\
        /dev/name [blocks]\n");
     exit(exitval);
@@ -1399,10 +1443,11 @@ int main(int argc, char **argv)
     int bad_block_count = 0;
     struct timeval create_timeval;
 
-    enum {OPT_HELP=1000, OPT_INVARIANT,};
+    enum {OPT_HELP=1000, OPT_INVARIANT, OPT_DISCARD,};
     const struct option long_options[] = {
 	    {"help", no_argument, NULL, OPT_HELP},
 	    {"invariant", no_argument, NULL, OPT_INVARIANT},
+	    {"discard", no_argument, NULL, OPT_DISCARD},
 	    {0,}
     };
 
@@ -1640,6 +1685,10 @@ int main(int argc, char **argv)
 	    create_time = 1426325213;
 	    break;
 
+	case OPT_DISCARD:
+	    discard = 1;
+	    break;
+
 	default:
 	    printf("Unknown option: %c\n", c);
 	    usage(1);
@@ -47,6 +47,13 @@ bool Evaluate(State* state, const std::unique_ptr<Expr>& expr, std::string* resu
         return false;
     }
 
+    // Literals are most of the arguments in generated scripts; copy them straight from the tree
+    // instead of through a Value.
+    if (expr->fn == Literal) {
+        *result = expr->name;
+        return true;
+    }
+
     std::unique_ptr<Value> v(expr->fn(expr->name.c_str(), state, expr->argv));
     if (!v) {
         return false;
@@ -56,7 +63,7 @@ bool Evaluate(State* state, const std::unique_ptr<Expr>& expr, std::string* resu
         return false;
     }
 
-    *result = v->data;
+    *result = std::move(v->data);
     return true;
 }
 
@@ -362,13 +369,14 @@ bool ReadArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
     if (start + len > argv.size()) {
         return false;
     }
+    // Each argument is evaluated right into its slot.
+    args->reserve(args->size() + len);
     for (size_t i = start; i < start + len; ++i) {
-        std::string var;
-        if (!Evaluate(state, argv[i], &var)) {
+        args->emplace_back();
+        if (!Evaluate(state, argv[i], &args->back())) {
             args->clear();
             return false;
         }
-        args->push_back(var);
     }
     return true;
 }
@@ -388,6 +396,7 @@ bool ReadValueArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
     if (len == 0 || start + len > argv.size()) {
         return false;
     }
+    args->reserve(args->size() + len);
     for (size_t i = start; i < start + len; ++i) {
         std::unique_ptr<Value> v(EvaluateValue(state, argv[i]));
         if (!v) {
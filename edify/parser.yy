@@ -52,6 +52,21 @@ static Expr* Build(Function fn, YYLTYPE loc, size_t count, ...) {
     return e;
 }
 
+// Folds a concatenation of literals, such as "/system/" + "bin", into a single literal so that
+// it isn't rebuilt every time the script runs. Takes ownership of e.
+static Expr* FoldConcat(Expr* e) {
+    std::string folded;
+    for (const auto& arg : e->argv) {
+        if (arg->fn != Literal) {
+            return e;
+        }
+        folded += arg->name;
+    }
+    Expr* literal = new Expr(Literal, folded, e->start, e->end);
+    delete e;
+    return literal;
+}
+
 %}
 
 %locations
@@ -95,7 +110,7 @@ expr:  STRING {
 |  expr ';'                          { $$ = $1; $$->start=@1.start; $$->end=@1.end; }
 |  expr ';' expr                     { $$ = Build(SequenceFn, @$, 2, $1, $3); }
 |  error ';' expr                    { $$ = $3; $$->start=@$.start; $$->end=@$.end; }
-|  expr '+' expr                     { $$ = Build(ConcatFn, @$, 2, $1, $3); }
+|  expr '+' expr                     { $$ = FoldConcat(Build(ConcatFn, @$, 2, $1, $3)); }
 |  expr EQ expr                      { $$ = Build(EqualityFn, @$, 2, $1, $3); }
 |  expr NE expr                      { $$ = Build(InequalityFn, @$, 2, $1, $3); }
 |  expr AND expr                     { $$ = Build(LogicalAndFn, @$, 2, $1, $3); }
@@ -112,6 +127,9 @@ expr:  STRING {
     }
     $$ = new Expr(fn, $1, @$.start, @$.end);
     $$->argv = std::move(*$3);
+    if (fn == ConcatFn) {
+        $$ = FoldConcat($$);
+    }
 }
 ;
 
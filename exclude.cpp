@@ -23,6 +23,12 @@ extern "C" {
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include "exclude.hpp"
@@ -34,75 +40,352 @@ using namespace std;
 
 extern bool datamedia;
 
-TWExclude::TWExclude() {
+#define FOLDER_SIZE_MAX_THREADS 8
+
+#define EXCLUDE_SET_MIN_BUCKETS 16
+
+static uint32_t Exclude_Hash(uint32_t hash, const char* data, size_t len) {
+	// FNV-1a, can be continued over several pieces of the same string
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static uint32_t Exclude_Hash(const char* dir, size_t dir_len, const char* name, size_t name_len) {
+	uint32_t hash = Exclude_Hash(2166136261U, dir, dir_len);
+	if (name != NULL) {
+		hash = Exclude_Hash(hash, "/", 1);
+		hash = Exclude_Hash(hash, name, name_len);
+	}
+	return hash;
+}
+
+static bool Is_Glob(const string& item) {
+	return item.find_first_of("*?[") != string::npos;
+}
+
+TWExcludeSet::TWExcludeSet(int match_flags) {
+	flags = match_flags;
+}
+
+void TWExcludeSet::add(const string& item) {
+	if (Is_Glob(item)) {
+		if (std::find(globs.begin(), globs.end(), item) == globs.end())
+			globs.push_back(item);
+		return;
+	}
+	if (contains(item.c_str(), item.size()))
+		return;
+	items.push_back(item);
+	hashes.push_back(Exclude_Hash(item.c_str(), item.size(), NULL, 0));
+	rebuild();
+}
+
+void TWExcludeSet::remove(const string& item) {
+	globs.erase(std::remove(globs.begin(), globs.end(), item), globs.end());
+	for (size_t i = 0; i < items.size(); i++) {
+		if (items[i] == item) {
+			items.erase(items.begin() + i);
+			hashes.erase(hashes.begin() + i);
+			break;
+		}
+	}
+	rebuild();
+}
+
+void TWExcludeSet::rebuild() {
+	// Keep the table at most half full so probe runs stay short
+	size_t buckets = EXCLUDE_SET_MIN_BUCKETS;
+	while (buckets < items.size() * 2)
+		buckets *= 2;
+	table.assign(buckets, 0);
+	size_t mask = buckets - 1;
+	for (size_t i = 0; i < items.size(); i++) {
+		size_t bucket = hashes[i] & mask;
+		while (table[bucket] != 0)
+			bucket = (bucket + 1) & mask;
+		table[bucket] = i + 1;
+	}
+}
+
+bool TWExcludeSet::lookup(uint32_t hash, const char* dir, size_t dir_len, const char* name, size_t name_len) const {
+	if (items.empty())
+		return false;
+	size_t mask = table.size() - 1;
+	size_t total_len = name == NULL ? dir_len : dir_len + 1 + name_len;
+	for (size_t bucket = hash & mask; table[bucket] != 0; bucket = (bucket + 1) & mask) {
+		size_t idx = table[bucket] - 1;
+		const string& item = items[idx];
+		if (hashes[idx] != hash || item.size() != total_len)
+			continue;
+		if (memcmp(item.data(), dir, dir_len) != 0)
+			continue;
+		if (name == NULL || (item[dir_len] == '/' && memcmp(item.data() + dir_len + 1, name, name_len) == 0))
+			return true;
+	}
+	return false;
+}
+
+bool TWExcludeSet::contains(const char* item, size_t len) const {
+	if (lookup(Exclude_Hash(item, len, NULL, 0), item, len, NULL, 0))
+		return true;
+	for (vector<string>::const_iterator glob = globs.begin(); glob != globs.end(); glob++) {
+		if (fnmatch(glob->c_str(), item, flags) == 0)
+			return true;
+	}
+	return false;
+}
+
+bool TWExcludeSet::contains(const char* dir, size_t dir_len, const char* name, size_t name_len) const {
+	if (lookup(Exclude_Hash(dir, dir_len, name, name_len), dir, dir_len, name, name_len))
+		return true;
+	if (globs.empty())
+		return false;
+	string path(dir, dir_len);
+	path += '/';
+	path.append(name, name_len);
+	for (vector<string>::const_iterator glob = globs.begin(); glob != globs.end(); glob++) {
+		if (fnmatch(glob->c_str(), path.c_str(), flags) == 0)
+			return true;
+	}
+	return false;
+}
+
+TWExclude::TWExclude() : absolutedir(FNM_PATHNAME), relativedir(0) {
 	add_relative_dir(".");
 	add_relative_dir("..");
 	add_relative_dir("lost+found");
 }
 
 void TWExclude::add_relative_dir(const string& dir) {
-	relativedir.push_back(dir);
+	relativedir.add(dir);
 }
 
 void TWExclude::clear_relative_dir(string dir) {
-	vector<string>::iterator iter = relativedir.begin();
-	while (iter != relativedir.end()) {
-		if (*iter == dir)
-			iter = relativedir.erase(iter);
-		else
-			iter++;
-	}
+	relativedir.remove(dir);
 }
 
 void TWExclude::add_absolute_dir(const string& dir) {
-	absolutedir.push_back(TWFunc::Remove_Trailing_Slashes(dir));
+	absolutedir.add(TWFunc::Remove_Trailing_Slashes(dir));
 }
 
-uint64_t TWExclude::Get_Folder_Size(const string& Path) {
+struct folder_size_dir {
+	string path;
+	size_t total;                                          // index in folder_size_walk::totals the sizes are added to
+	bool top;                                              // subfolders of the walked folder each get their own total
+};
+
+struct folder_size_walk {
+	TWExclude *exclude;
+	vector<folder_size_dir> dirs;                          // folders waiting to be read
+	vector<uint64_t> totals;                               // [0] is the files of the walked folder itself
+	vector<string> total_paths;
+	unsigned active;                                       // threads currently reading a folder
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static uint64_t Read_Folder(struct folder_size_walk *walk, const folder_size_dir& dir, vector<folder_size_dir> *subdirs, vector<string> *top_paths) {
 	DIR* d;
 	struct dirent* de;
 	struct stat st;
 	uint64_t dusize = 0;
 	string FullPath;
+	unsigned char type;
 
-	d = opendir(Path.c_str());
+	d = opendir(dir.path.c_str());
 	if (d == NULL) {
-		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(dir.path)(strerror(errno)));
 		return 0;
 	}
 
 	while ((de = readdir(d)) != NULL) {
-		FullPath = Path + "/";
-		FullPath += de->d_name;
-		if (lstat(FullPath.c_str(), &st)) {
-			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(FullPath)(strerror(errno)));
-			LOGINFO("Real error: Unable to stat '%s'\n", FullPath.c_str());
+		// Excluded files are left out of the size too, like in the tar list
+		if (walk->exclude->check_skip_name(dir.path, de->d_name))
 			continue;
+		type = de->d_type;
+		if (type == DT_REG || type == DT_LNK || type == DT_UNKNOWN) {
+			// Only files need a stat, done relative to the open folder
+			if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+				FullPath = dir.path + "/" + de->d_name;
+				gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(FullPath)(strerror(errno)));
+				LOGINFO("Real error: Unable to stat '%s'\n", FullPath.c_str());
+				continue;
+			}
+			if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+				dusize += (uint64_t)(st.st_size);
+				continue;
+			}
+			if (!S_ISDIR(st.st_mode))
+				continue;
+			type = DT_DIR;
 		}
-		if ((st.st_mode & S_IFDIR) && !check_skip_dirs(FullPath) && de->d_type != DT_SOCK) {
-			dusize += Get_Folder_Size(FullPath);
-		} else if (st.st_mode & S_IFREG || st.st_mode & S_IFLNK) {
-			dusize += (uint64_t)(st.st_size);
-		}
+		if (type != DT_DIR)
+			continue;
+		FullPath = dir.path + "/" + de->d_name;
+		folder_size_dir subdir;
+		subdir.path = FullPath;
+		subdir.total = dir.total;
+		subdir.top = false;
+		if (dir.top)
+			top_paths->push_back(FullPath);
+		subdirs->push_back(subdir);
 	}
 	closedir(d);
 	return dusize;
 }
 
+static void* Folder_Size_Thread(void *cookie) {
+	struct folder_size_walk *walk = (struct folder_size_walk*) cookie;
+	vector<folder_size_dir> subdirs;
+	vector<string> top_paths;
+	folder_size_dir dir;
+	uint64_t dusize;
+	size_t i;
+
+	pthread_mutex_lock(&walk->lock);
+	for (;;) {
+		while (walk->dirs.empty() && walk->active > 0)
+			pthread_cond_wait(&walk->cond, &walk->lock);
+		if (walk->dirs.empty())
+			break;
+		dir = walk->dirs.back();
+		walk->dirs.pop_back();
+		walk->active++;
+		pthread_mutex_unlock(&walk->lock);
+
+		subdirs.clear();
+		top_paths.clear();
+		dusize = Read_Folder(walk, dir, &subdirs, &top_paths);
+
+		pthread_mutex_lock(&walk->lock);
+		walk->totals[dir.total] += dusize;
+		for (i = 0; i < subdirs.size(); i++) {
+			if (dir.top) {
+				subdirs[i].total = walk->totals.size();
+				walk->totals.push_back(0);
+				walk->total_paths.push_back(top_paths[i]);
+			}
+			walk->dirs.push_back(subdirs[i]);
+		}
+		walk->active--;
+		pthread_cond_broadcast(&walk->cond);
+	}
+	pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+	return NULL;
+}
+
+uint64_t TWExclude::Get_Folder_Size(const string& Path) {
+	struct folder_size_walk walk;
+	pthread_t threads[FOLDER_SIZE_MAX_THREADS];
+	unsigned thread_count, started = 0, i;
+	uint64_t dusize = 0;
+	string Root = TWFunc::Remove_Trailing_Slashes(Path);
+	folder_size_dir dir;
+
+	walk.exclude = this;
+	walk.active = 0;
+	walk.totals.push_back(0);
+	walk.total_paths.push_back(Root);
+	dir.path = Path;
+	dir.total = 0;
+	dir.top = true;
+	walk.dirs.push_back(dir);
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+
+	// Folders are read from a shared stack, the calling thread takes part too
+	thread_count = sysconf(_SC_NPROCESSORS_CONF);
+	if (thread_count > FOLDER_SIZE_MAX_THREADS)
+		thread_count = FOLDER_SIZE_MAX_THREADS;
+	for (i = 1; i < thread_count; i++) {
+		if (pthread_create(&threads[started], NULL, Folder_Size_Thread, (void*)&walk) != 0)
+			break;
+		started++;
+	}
+	Folder_Size_Thread((void*)&walk);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+
+	// Remember the result for this folder and each of its subfolders, createTarFork asks for those next
+	map<string, uint64_t> subfolder_sizes;
+	for (i = 0; i < walk.totals.size(); i++) {
+		dusize += walk.totals[i];
+		if (i > 0)
+			subfolder_sizes[walk.total_paths[i]] = walk.totals[i];
+	}
+	Set_Folder_Sizes(Root, dusize, subfolder_sizes);
+	return dusize;
+}
+
+void TWExclude::Set_Folder_Sizes(const string& Path, uint64_t size, const map<string, uint64_t>& subfolder_sizes) {
+	string Root = TWFunc::Remove_Trailing_Slashes(Path);
+	map<string, uint64_t>::iterator iter = size_cache.begin();
+
+	while (iter != size_cache.end()) {
+		if (iter->first == Root || iter->first.compare(0, Root.size() + 1, Root + "/") == 0)
+			size_cache.erase(iter++);
+		else
+			iter++;
+	}
+	size_cache.insert(subfolder_sizes.begin(), subfolder_sizes.end());
+	size_cache[Root] = size;
+}
+
+uint64_t TWExclude::Get_Cached_Folder_Size(const string& Path) {
+	map<string, uint64_t>::iterator iter = size_cache.find(TWFunc::Remove_Trailing_Slashes(Path));
+
+	if (iter != size_cache.end())
+		return iter->second;
+	return Get_Folder_Size(Path);
+}
+
 bool TWExclude::check_relative_skip_dirs(const string& dir) {
-	return std::find(relativedir.begin(), relativedir.end(), dir) != relativedir.end();
+	return relativedir.contains(dir.c_str(), dir.size());
 }
 
 bool TWExclude::check_absolute_skip_dirs(const string& path) {
-	return std::find(absolutedir.begin(), absolutedir.end(), path) != absolutedir.end();
+	return absolutedir.contains(path.c_str(), path.size());
 }
 
-bool TWExclude::check_skip_dirs(const string& path) {
-	string normalized = TWFunc::Remove_Trailing_Slashes(path);
-	size_t slashIdx = normalized.find_last_of('/');
-	if (slashIdx != std::string::npos && slashIdx+1 < normalized.size()) {
-		if (check_relative_skip_dirs(normalized.substr(slashIdx+1)))
+// True if path has no repeated or trailing slashes, so it is already in the
+// form Remove_Trailing_Slashes would give
+static bool Is_Normalized(const char* path, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		if (path[i] == '/' && (i + 1 == len || path[i + 1] == '/'))
+			return false;
+	}
+	return true;
+}
+
+bool TWExclude::check_skip_dirs(const char* path, size_t len) {
+	if (!Is_Normalized(path, len)) {
+		string normalized = TWFunc::Remove_Trailing_Slashes(string(path, len));
+		return check_skip_dirs(normalized.c_str(), normalized.size());
+	}
+	const char* name = (const char*)memrchr(path, '/', len);
+	if (name != NULL && name + 1 < path + len) {
+		name++;
+		if (relativedir.contains(name, path + len - name))
 			return true;
 	}
-	return check_absolute_skip_dirs(normalized);
+	return absolutedir.contains(path, len);
+}
+
+bool TWExclude::check_skip_dirs(const string& path) {
+	return check_skip_dirs(path.c_str(), path.size());
+}
+
+bool TWExclude::check_skip_name(const string& dir, const char* name) {
+	size_t name_len = strlen(name);
+	if (name_len == 0 || strchr(name, '/') != NULL || !Is_Normalized(dir.c_str(), dir.size()))
+		return check_skip_dirs(dir + "/" + name);
+	if (relativedir.contains(name, name_len))
+		return true;
+	return absolutedir.contains(dir.c_str(), dir.size(), name, name_len);
 }
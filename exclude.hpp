@@ -19,25 +19,55 @@
 #ifndef TWEXCLUDE_HPP
 #define TWEXCLUDE_HPP
 
+#include <stdint.h>
+#include <map>
 #include <string>
 #include <vector>
 
 using namespace std;
 
+// Set of exclusion names or paths. Plain entries are kept in an open addressing
+// hash table so a lookup costs one hash of the string that is passed in and does
+// not allocate. Entries containing *, ? or [ are glob patterns matched with
+// fnmatch, only these are checked one by one.
+class TWExcludeSet {
+
+public:
+	TWExcludeSet(int match_flags);
+	void add(const string& item);
+	void remove(const string& item);
+	bool contains(const char* item, size_t len) const; // item must be NUL terminated at len if globs are used
+	bool contains(const char* dir, size_t dir_len, const char* name, size_t name_len) const; // Checks dir + "/" + name
+	bool has_globs() const { return !globs.empty(); }
+private:
+	void rebuild();
+	bool lookup(uint32_t hash, const char* dir, size_t dir_len, const char* name, size_t name_len) const;
+	vector<string> items;
+	vector<uint32_t> hashes;                               // hash of each entry in items
+	vector<uint32_t> table;                                // index in items + 1, 0 for an empty bucket
+	vector<string> globs;
+	int flags;                                             // fnmatch flags used for globs
+};
+
 class TWExclude {
 
 public:
 	TWExclude();
-	uint64_t Get_Folder_Size(const string& Path); // Gets the folder's size using stat
+	uint64_t Get_Folder_Size(const string& Path); // Gets the folder's size using stat, walking the tree with several threads
+	uint64_t Get_Cached_Folder_Size(const string& Path); // Returns the size found by the last walk of Path or its parent, walks if there is none
+	void Set_Folder_Sizes(const string& Path, uint64_t size, const map<string, uint64_t>& subfolder_sizes); // Sizes found without a walk, for Get_Cached_Folder_Size
 	void add_absolute_dir(const string& Path);
 	void add_relative_dir(const string& Path);
 	bool check_relative_skip_dirs(const string& dir);
 	bool check_absolute_skip_dirs(const string& path);
 	bool check_skip_dirs(const string& path);
+	bool check_skip_name(const string& dir, const char* name); // Same as check_skip_dirs(dir + "/" + name) without building the path
 	void clear_relative_dir(string dir);
 private:
-	vector<string> absolutedir;
-	vector<string> relativedir;
+	bool check_skip_dirs(const char* path, size_t len);
+	TWExcludeSet absolutedir;
+	TWExcludeSet relativedir;
+	map<string, uint64_t> size_cache;                      // Sizes of the last walked folder and its direct subfolders
 };
 
 #endif
@@ -24,108 +24,393 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #define exfat_debug(format, ...)
 
+/* directories are checked by this many threads at most */
+#define FSCK_THREADS_MAX 4
+/* FAT is loaded with reads of this size */
+#define FAT_READ_SIZE (1024 * 1024)
+#define BITMAP_BITS (sizeof(bitmap_t) * 8)
+
 uint64_t files_count, directories_count;
 
+/* the whole FAT, NULL if it did not fit in memory */
+static le32_t* fat;
+static uint32_t fat_entries;
+/* clusters of the files checked so far, NULL if it did not fit in memory */
+static bitmap_t* used;
+
+/*
+ * libexfat keeps no locks of its own, so its calls are serialized, as are
+ * the counters and the error reports. Cluster chains are checked outside of
+ * it from the FAT loaded in memory.
+ */
+static pthread_mutex_t fsck_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+/* directories waiting to be checked, each one holds a node reference */
+static struct exfat_node** queue;
+static size_t queue_length, queue_capacity;
+static int busy_threads;
+
+/* what was found in the clusters of a node */
+struct chain_check
+{
+	uint32_t unallocated;
+	cluster_t first_unallocated;
+	uint32_t cross_linked;
+	cluster_t first_cross_linked;
+};
+
+static size_t bitmap_ctz(bitmap_t word)
+{
+	return __builtin_ctzll(word);
+}
+
+static size_t bitmap_popcount(bitmap_t word)
+{
+	return __builtin_popcountll(word);
+}
+
+static void load_fat(struct exfat* ef)
+{
+	const loff_t offset = (loff_t) le32_to_cpu(ef->sb->fat_sector_start)
+			<< ef->sb->sector_bits;
+	uint64_t size = (uint64_t) le32_to_cpu(ef->sb->fat_sector_count)
+			<< ef->sb->sector_bits;
+	uint64_t done;
+
+	size = MIN(size, ((uint64_t) ef->cmap.size + EXFAT_FIRST_DATA_CLUSTER) *
+			sizeof(le32_t));
+	if (size > SIZE_MAX || (fat = malloc(size)) == NULL)
+	{
+		exfat_warn("FAT does not fit in memory, reading it as needed");
+		return;
+	}
+	for (done = 0; done < size; done += FAT_READ_SIZE)
+	{
+		if (exfat_pread(ef->dev, (char*) fat + done,
+				MIN(FAT_READ_SIZE, size - done), offset + done) < 0)
+		{
+			exfat_warn("failed to load FAT, reading it as needed");
+			free(fat);
+			fat = NULL;
+			return;
+		}
+	}
+	fat_entries = size / sizeof(le32_t);
+}
+
+static bool cluster_valid(const struct exfat* ef, cluster_t c)
+{
+	return c >= EXFAT_FIRST_DATA_CLUSTER &&
+			c - EXFAT_FIRST_DATA_CLUSTER < ef->cmap.size;
+}
+
+static cluster_t next_cluster(struct exfat* ef, struct exfat_node* node,
+		cluster_t c)
+{
+	if (IS_CONTIGUOUS(*node))
+		return c + 1;
+	if (fat != NULL)
+		return c < fat_entries ? le32_to_cpu(fat[c]) : EXFAT_CLUSTER_BAD;
+	pthread_mutex_lock(&fsck_lock);
+	c = exfat_next_cluster(ef, node, c);
+	pthread_mutex_unlock(&fsck_lock);
+	return c;
+}
+
+/*
+ * Marks count valid clusters from first as used, a word of the bitmaps at a
+ * time, and notes the ones that another node has too or that are not
+ * allocated.
+ */
+static void use_clusters(struct exfat* ef, cluster_t first, uint32_t count,
+		struct chain_check* check)
+{
+	size_t index = first - EXFAT_FIRST_DATA_CLUSTER;
+	const size_t end = index + count;
+
+	while (index < end)
+	{
+		const size_t block = index / BITMAP_BITS;
+		const size_t bit = index % BITMAP_BITS;
+		const size_t n = MIN(BITMAP_BITS - bit, end - index);
+		const bitmap_t mask = (n == BITMAP_BITS ? ~(bitmap_t) 0 :
+				((bitmap_t) 1 << n) - 1) << bit;
+		bitmap_t bits;
+
+		if (used != NULL)
+		{
+			bits = __atomic_fetch_or(&used[block], mask, __ATOMIC_RELAXED) &
+					mask;
+			if (bits != 0)
+			{
+				if (check->cross_linked == 0)
+					check->first_cross_linked = block * BITMAP_BITS +
+							bitmap_ctz(bits) + EXFAT_FIRST_DATA_CLUSTER;
+				check->cross_linked += bitmap_popcount(bits);
+			}
+		}
+		bits = ~ef->cmap.chunk[block] & mask;
+		if (bits != 0)
+		{
+			if (check->unallocated == 0)
+				check->first_unallocated = block * BITMAP_BITS +
+						bitmap_ctz(bits) + EXFAT_FIRST_DATA_CLUSTER;
+			check->unallocated += bitmap_popcount(bits);
+		}
+		index += n;
+	}
+}
+
 static int nodeck(struct exfat* ef, struct exfat_node* node)
 {
 	const cluster_t cluster_size = CLUSTER_SIZE(*ef->sb);
 	cluster_t clusters = (node->size + cluster_size - 1) / cluster_size;
 	cluster_t c = node->start_cluster;
+	cluster_t invalid = 0;
+	bool valid = true;
+	struct chain_check check;
+	char name[UTF8_BYTES(EXFAT_NAME_MAX) + 1];
 	int rc = 0;
 
-	while (clusters--)
+	memset(&check, 0, sizeof(check));
+	if (IS_CONTIGUOUS(*node) && clusters != 0)
 	{
-		if (CLUSTER_INVALID(c))
+		/* the whole run at once, it is valid if both of its ends are */
+		valid = cluster_valid(ef, c) && cluster_valid(ef, c + clusters - 1) &&
+				c + clusters - 1 >= c;
+		if (!cluster_valid(ef, c))
+			invalid = c;
+		else if (!valid)
+			invalid = ef->cmap.size + EXFAT_FIRST_DATA_CLUSTER;
+		else
+			use_clusters(ef, c, clusters, &check);
+	}
+	else
+	{
+		while (clusters--)
 		{
-			char name[UTF8_BYTES(EXFAT_NAME_MAX) + 1];
-
-			exfat_get_name(node, name, sizeof(name) - 1);
-			exfat_error("file '%s' has invalid cluster 0x%x", name, c);
-			rc = 1;
-			break;
+			if (!cluster_valid(ef, c))
+			{
+				invalid = c;
+				valid = false;
+				break;
+			}
+			use_clusters(ef, c, 1, &check);
+			c = next_cluster(ef, node, c);
 		}
-		if (BMAP_GET(ef->cmap.chunk, c - EXFAT_FIRST_DATA_CLUSTER) == 0)
-		{
-			char name[UTF8_BYTES(EXFAT_NAME_MAX) + 1];
+	}
+	if (valid && check.unallocated == 0 &&
+			check.cross_linked == 0)
+		return 0;
 
-			exfat_get_name(node, name, sizeof(name) - 1);
-			exfat_error("cluster 0x%x of file '%s' is not allocated", c, name);
-			rc = 1;
-		}
-		c = exfat_next_cluster(ef, node, c);
+	exfat_get_name(node, name, sizeof(name) - 1);
+	pthread_mutex_lock(&fsck_lock);
+	if (!valid)
+	{
+		exfat_error("file '%s' has invalid cluster 0x%x", name, invalid);
+		rc = 1;
+	}
+	if (check.unallocated != 0)
+	{
+		exfat_error("%u clusters of file '%s' are not allocated, "
+				"the first is 0x%x", check.unallocated, name,
+				check.first_unallocated);
+		rc = 1;
 	}
+	if (check.cross_linked != 0)
+		exfat_error("%u clusters of file '%s' are used by another file too, "
+				"the first is 0x%x", check.cross_linked, name,
+				check.first_cross_linked);
+	pthread_mutex_unlock(&fsck_lock);
 	return rc;
 }
 
-static void dirck(struct exfat* ef, const char* path)
+/* Called with fsck_lock held, takes over the reference to dir */
+static bool queue_directory(struct exfat_node* dir)
+{
+	if (queue_length == queue_capacity)
+	{
+		size_t capacity = queue_capacity ? queue_capacity * 2 : 64;
+		struct exfat_node** grown = realloc(queue,
+				capacity * sizeof(struct exfat_node*));
+
+		if (grown == NULL)
+			return false;
+		queue = grown;
+		queue_capacity = capacity;
+	}
+	queue[queue_length++] = dir;
+	pthread_cond_signal(&queue_cond);
+	return true;
+}
+
+static void dirck(struct exfat* ef, struct exfat_node* parent)
 {
-	struct exfat_node* parent;
 	struct exfat_node* node;
 	struct exfat_iterator it;
 	int rc;
-	size_t path_length;
-	char* entry_path;
 
-	if (exfat_lookup(ef, &parent, path) != 0)
-		exfat_bug("directory '%s' is not found", path);
 	if (!(parent->flags & EXFAT_ATTRIB_DIR))
-		exfat_bug("'%s' is not a directory (0x%x)", path, parent->flags);
-	if (nodeck(ef, parent) != 0)
 	{
-		exfat_put_node(ef, parent);
-		return;
-	}
+		char name[UTF8_BYTES(EXFAT_NAME_MAX) + 1];
 
-	path_length = strlen(path);
-	entry_path = malloc(path_length + 1 + UTF8_BYTES(EXFAT_NAME_MAX) + 1);
-	if (entry_path == NULL)
+		exfat_get_name(parent, name, sizeof(name) - 1);
+		exfat_bug("'%s' is not a directory (0x%x)", name, parent->flags);
+	}
+	if (nodeck(ef, parent) != 0)
 	{
+		pthread_mutex_lock(&fsck_lock);
 		exfat_put_node(ef, parent);
-		exfat_error("out of memory");
+		pthread_mutex_unlock(&fsck_lock);
 		return;
 	}
-	strcpy(entry_path, path);
-	strcat(entry_path, "/");
 
+	pthread_mutex_lock(&fsck_lock);
 	rc = exfat_opendir(ef, parent, &it);
 	if (rc != 0)
 	{
-		free(entry_path);
 		exfat_put_node(ef, parent);
+		pthread_mutex_unlock(&fsck_lock);
 		return;
 	}
 	while ((node = exfat_readdir(ef, &it)))
 	{
-		exfat_get_name(node, entry_path + path_length + 1,
-				UTF8_BYTES(EXFAT_NAME_MAX));
-		exfat_debug("%s: %s, %"PRIu64" bytes, cluster %u", entry_path,
+		exfat_debug("%s, %"PRIu64" bytes, cluster %u",
 				IS_CONTIGUOUS(*node) ? "contiguous" : "fragmented",
 				node->size, node->start_cluster);
 		if (node->flags & EXFAT_ATTRIB_DIR)
 		{
 			directories_count++;
-			dirck(ef, entry_path);
-		}
-		else
-		{
-			files_count++;
-			nodeck(ef, node);
+			/* checked by whichever thread is free, or right here */
+			if (queue_directory(node))
+				continue;
+			pthread_mutex_unlock(&fsck_lock);
+			dirck(ef, node);
+			pthread_mutex_lock(&fsck_lock);
+			continue;
 		}
+		files_count++;
+		pthread_mutex_unlock(&fsck_lock);
+		nodeck(ef, node);
+		pthread_mutex_lock(&fsck_lock);
 		exfat_put_node(ef, node);
 	}
 	exfat_closedir(ef, &it);
 	exfat_put_node(ef, parent);
-	free(entry_path);
+	pthread_mutex_unlock(&fsck_lock);
+}
+
+static void* dirck_thread(void* arg)
+{
+	struct exfat* ef = arg;
+	struct exfat_node* dir;
+
+	pthread_mutex_lock(&fsck_lock);
+	for (;;)
+	{
+		while (queue_length == 0 && busy_threads > 0)
+			pthread_cond_wait(&queue_cond, &fsck_lock);
+		if (queue_length == 0)
+			break;
+		dir = queue[--queue_length];
+		busy_threads++;
+		pthread_mutex_unlock(&fsck_lock);
+		dirck(ef, dir);
+		pthread_mutex_lock(&fsck_lock);
+		if (--busy_threads == 0 && queue_length == 0)
+			pthread_cond_broadcast(&queue_cond);
+	}
+	pthread_mutex_unlock(&fsck_lock);
+	return NULL;
+}
+
+/*
+ * Clusters that are allocated but that no file, directory or system file
+ * has, a word of the bitmaps at a time.
+ */
+static void lostck(struct exfat* ef)
+{
+	const size_t words = ef->cmap.size / BITMAP_BITS;
+	const size_t tail = ef->cmap.size % BITMAP_BITS;
+	uint64_t lost = 0;
+	size_t i;
+
+	for (i = 0; i < words; i++)
+		lost += bitmap_popcount(ef->cmap.chunk[i] & ~used[i]);
+	if (tail != 0)
+		lost += bitmap_popcount(ef->cmap.chunk[words] & ~used[words] &
+				(((bitmap_t) 1 << tail) - 1));
+	if (lost != 0)
+		exfat_warn("%"PRIu64" clusters are allocated but not used by any file",
+				lost);
+}
+
+/* The clusters of the allocation bitmap and the upcase table */
+static void use_system_clusters(struct exfat* ef)
+{
+	const uint64_t cluster_size = CLUSTER_SIZE(*ef->sb);
+	const uint64_t bitmap_clusters =
+			DIV_ROUND_UP(DIV_ROUND_UP(ef->cmap.size, 8), cluster_size);
+	const uint64_t upcase_clusters =
+			DIV_ROUND_UP(ef->upcase_chars * sizeof(le16_t), cluster_size);
+	struct chain_check check;
+
+	memset(&check, 0, sizeof(check));
+	if (cluster_valid(ef, ef->cmap.start_cluster) && cluster_valid(ef,
+			ef->cmap.start_cluster + bitmap_clusters - 1))
+		use_clusters(ef, ef->cmap.start_cluster, bitmap_clusters, &check);
+	if (cluster_valid(ef, ef->upcase_start_cluster) && cluster_valid(ef,
+			ef->upcase_start_cluster + upcase_clusters - 1))
+		use_clusters(ef, ef->upcase_start_cluster, upcase_clusters, &check);
+	if (check.cross_linked != 0)
+		exfat_error("clusters bitmap and upcase table overlap at cluster 0x%x",
+				check.first_cross_linked);
+	if (check.unallocated != 0)
+		exfat_error("%u clusters of the clusters bitmap and the upcase table "
+				"are not allocated, the first is 0x%x", check.unallocated,
+				check.first_unallocated);
 }
 
 static void fsck(struct exfat* ef)
 {
+	pthread_t threads[FSCK_THREADS_MAX];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int count = MIN(cpus > 1 ? cpus : 1, FSCK_THREADS_MAX);
+	int started = 0;
+
 	exfat_print_info(ef->sb, exfat_count_free_clusters(ef));
-	dirck(ef, "");
+	load_fat(ef);
+	used = calloc(BMAP_SIZE(ef->cmap.size), 1);
+	if (used == NULL)
+		exfat_warn("not enough memory to look for cross-linked clusters");
+	else
+		use_system_clusters(ef);
+
+	if (!queue_directory(exfat_get_node(ef->root)))
+	{
+		exfat_put_node(ef, ef->root);
+		exfat_error("out of memory");
+		free(used);
+		free(fat);
+		return;
+	}
+	while (started < count - 1 && pthread_create(&threads[started], NULL,
+			dirck_thread, ef) == 0)
+		started++;
+	dirck_thread(ef);
+	while (started > 0)
+		pthread_join(threads[--started], NULL);
+
+	if (used != NULL)
+		lostck(ef);
+	free(queue);
+	free(used);
+	free(fat);
 }
 
 static void usage(const char* prog)
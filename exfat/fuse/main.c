@@ -33,6 +33,7 @@
 #include <sys/types.h>
 #include <pwd.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #ifndef DEBUG
 	#define exfat_debug(format, ...)
@@ -45,8 +46,18 @@
 const char* default_options = "ro_fallback,allow_other,blkdev,big_writes,"
 		"default_permissions";
 
+/* ranges mapped at a time by read and write */
+#define IO_RUNS 16
+
 struct exfat ef;
 
+/*
+   libexfat is not thread safe, so every handler holds this lock while it
+   uses libexfat. Read and write only map the clusters under it and move the
+   data without it, holding the lock of the node instead.
+*/
+static pthread_mutex_t ef_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct exfat_node* get_node(const struct fuse_file_info* fi)
 {
 	return (struct exfat_node*) (size_t) fi->fh;
@@ -65,13 +76,15 @@ static int fuse_exfat_getattr(const char* path, struct stat* stbuf)
 
 	exfat_debug("[%s] %s", __func__, path);
 
+	pthread_mutex_lock(&ef_lock);
 	rc = exfat_lookup(&ef, &node, path);
-	if (rc != 0)
-		return rc;
-
-	exfat_stat(&ef, node, stbuf);
-	exfat_put_node(&ef, node);
-	return 0;
+	if (rc == 0)
+	{
+		exfat_stat(&ef, node, stbuf);
+		exfat_put_node(&ef, node);
+	}
+	pthread_mutex_unlock(&ef_lock);
+	return rc;
 }
 
 static int fuse_exfat_truncate(const char* path, loff_t size)
@@ -81,19 +94,26 @@ static int fuse_exfat_truncate(const char* path, loff_t size)
 
 	exfat_debug("[%s] %s, %"PRId64, __func__, path, size);
 
+	pthread_mutex_lock(&ef_lock);
 	rc = exfat_lookup(&ef, &node, path);
+	pthread_mutex_unlock(&ef_lock);
 	if (rc != 0)
 		return rc;
 
+	/* wait for reads and writes of the clusters that may be freed */
+	pthread_rwlock_wrlock(&node->lock);
+	pthread_mutex_lock(&ef_lock);
 	rc = exfat_truncate(&ef, node, size, true);
 	if (rc != 0)
-	{
 		exfat_flush_node(&ef, node);	/* ignore return code */
-		exfat_put_node(&ef, node);
-		return rc;
-	}
-	rc = exfat_flush_node(&ef, node);
+	else
+		rc = exfat_flush_node(&ef, node);
+	pthread_mutex_unlock(&ef_lock);
+	pthread_rwlock_unlock(&node->lock);
+
+	pthread_mutex_lock(&ef_lock);
 	exfat_put_node(&ef, node);
+	pthread_mutex_unlock(&ef_lock);
 	return rc;
 }
 
@@ -108,12 +128,17 @@ static int fuse_exfat_readdir(const char* path, void* buffer,
 
 	exfat_debug("[%s] %s", __func__, path);
 
+	pthread_mutex_lock(&ef_lock);
 	rc = exfat_lookup(&ef, &parent, path);
 	if (rc != 0)
+	{
+		pthread_mutex_unlock(&ef_lock);
 		return rc;
+	}
 	if (!(parent->flags & EXFAT_ATTRIB_DIR))
 	{
 		exfat_put_node(&ef, parent);
+		pthread_mutex_unlock(&ef_lock);
 		exfat_error("'%s' is not a directory (0x%x)", path, parent->flags);
 		return -ENOTDIR;
 	}
@@ -125,6 +150,7 @@ static int fuse_exfat_readdir(const char* path, void* buffer,
 	if (rc != 0)
 	{
 		exfat_put_node(&ef, parent);
+		pthread_mutex_unlock(&ef_lock);
 		exfat_error("failed to open directory '%s'", path);
 		return rc;
 	}
@@ -139,6 +165,7 @@ static int fuse_exfat_readdir(const char* path, void* buffer,
 	}
 	exfat_closedir(&ef, &it);
 	exfat_put_node(&ef, parent);
+	pthread_mutex_unlock(&ef_lock);
 	return 0;
 }
 
@@ -149,7 +176,9 @@ static int fuse_exfat_open(const char* path, struct fuse_file_info* fi)
 
 	exfat_debug("[%s] %s", __func__, path);
 
+	pthread_mutex_lock(&ef_lock);
 	rc = exfat_lookup(&ef, &node, path);
+	pthread_mutex_unlock(&ef_lock);
 	if (rc != 0)
 		return rc;
 	set_node(fi, node);
@@ -164,10 +193,11 @@ static int fuse_exfat_create(const char* path, mode_t mode,
 
 	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
 
+	pthread_mutex_lock(&ef_lock);
 	rc = exfat_mknod(&ef, path);
-	if (rc != 0)
-		return rc;
-	rc = exfat_lookup(&ef, &node, path);
+	if (rc == 0)
+		rc = exfat_lookup(&ef, &node, path);
+	pthread_mutex_unlock(&ef_lock);
 	if (rc != 0)
 		return rc;
 	set_node(fi, node);
@@ -183,8 +213,10 @@ static int fuse_exfat_release(const char* path, struct fuse_file_info* fi)
 	   See fuse_exfat_flush() below.
 	*/
 	exfat_debug("[%s] %s", __func__, path);
+	pthread_mutex_lock(&ef_lock);
  	exfat_flush_node(&ef, get_node(fi));
 	exfat_put_node(&ef, get_node(fi));
+	pthread_mutex_unlock(&ef_lock);
 	return 0; /* FUSE ignores this return value */
 }
 
@@ -196,8 +228,13 @@ static int fuse_exfat_flush(const char* path, struct fuse_file_info* fi)
 	   only on rmdir and unlink. If the FUSE implementation does not call this
 	   handler we will flush node on release. See fuse_exfat_relase() above.
 	*/
+	int rc;
+
 	exfat_debug("[%s] %s", __func__, path);
-	return exfat_flush_node(&ef, get_node(fi));
+	pthread_mutex_lock(&ef_lock);
+	rc = exfat_flush_node(&ef, get_node(fi));
+	pthread_mutex_unlock(&ef_lock);
+	return rc;
 }
 
 static int fuse_exfat_fsync(const char* path, int datasync,
@@ -206,37 +243,158 @@ static int fuse_exfat_fsync(const char* path, int datasync,
 	int rc;
 
 	exfat_debug("[%s] %s", __func__, path);
+	pthread_mutex_lock(&ef_lock);
 	rc = exfat_flush_nodes(&ef);
-	if (rc != 0)
-		return rc;
-	rc = exfat_flush(&ef);
-	if (rc != 0)
-		return rc;
-	return exfat_fsync(ef.dev);
+	if (rc == 0)
+		rc = exfat_flush(&ef);
+	if (rc == 0)
+		rc = exfat_fsync(ef.dev);
+	pthread_mutex_unlock(&ef_lock);
+	return rc;
 }
 
 static int fuse_exfat_read(const char* path, char* buffer, size_t size,
 		loff_t offset, struct fuse_file_info* fi)
 {
-	ssize_t ret;
+	struct exfat_node* node = get_node(fi);
+	struct exfat_run runs[IO_RUNS];
+	size_t count;
+	size_t done = 0;
+	size_t i;
+	ssize_t mapped;
+	int rc = 0;
 
 	exfat_debug("[%s] %s (%zu bytes)", __func__, path, size);
-	ret = exfat_generic_pread(&ef, get_node(fi), buffer, size, offset);
-	if (ret < 0)
+
+	pthread_rwlock_rdlock(&node->lock);
+	pthread_mutex_lock(&ef_lock);
+	if (offset >= node->size)
+		size = 0;
+	else
+		size = MIN(size, node->size - offset);
+	pthread_mutex_unlock(&ef_lock);
+
+	while (rc == 0 && done < size)
+	{
+		count = IO_RUNS;
+		pthread_mutex_lock(&ef_lock);
+		mapped = exfat_map_range(&ef, node, offset + done, size - done, runs,
+				&count);
+		pthread_mutex_unlock(&ef_lock);
+		if (mapped < 0)
+		{
+			rc = -EIO;
+			break;
+		}
+		for (i = 0; i < count; i++)
+		{
+			if (exfat_pread(ef.dev, buffer + done, runs[i].size,
+					runs[i].offset) < 0)
+			{
+				exfat_error("failed to read %zu bytes at %"PRId64,
+						runs[i].size, runs[i].offset);
+				rc = -EIO;
+				break;
+			}
+			done += runs[i].size;
+		}
+	}
+
+	if (rc == 0 && !ef.ro && !ef.noatime)
+	{
+		pthread_mutex_lock(&ef_lock);
+		exfat_update_atime(node);
+		pthread_mutex_unlock(&ef_lock);
+	}
+	pthread_rwlock_unlock(&node->lock);
+	return rc != 0 ? rc : (int) done;
+}
+
+/*
+   Moves the next run->size bytes of buf to the device. When the data is in
+   the pipe the request was spliced into, it is spliced on to the device
+   without passing through memory.
+*/
+static int write_run(struct fuse_bufvec* buf, const struct exfat_run* run)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(run->size);
+	int fd = exfat_get_fd(ef.dev);
+	ssize_t res;
+
+	if (fd < 0)
+	{
+		dst.buf[0].mem = malloc(run->size);
+		if (dst.buf[0].mem == NULL)
+			return -ENOMEM;
+		res = fuse_buf_copy(&dst, buf, 0);
+		if (res == (ssize_t) run->size &&
+				exfat_pwrite(ef.dev, dst.buf[0].mem, run->size, run->offset) < 0)
+			res = -EIO;
+		free(dst.buf[0].mem);
+	}
+	else
+	{
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+		dst.buf[0].fd = fd;
+		dst.buf[0].pos = run->offset;
+		res = fuse_buf_copy(&dst, buf, 0);
+	}
+	if (res != (ssize_t) run->size)
+	{
+		exfat_error("failed to write %zu bytes at %"PRId64, run->size,
+				run->offset);
 		return -EIO;
-	return ret;
+	}
+	return 0;
 }
 
-static int fuse_exfat_write(const char* path, const char* buffer, size_t size,
+static int fuse_exfat_write_buf(const char* path, struct fuse_bufvec* buf,
 		loff_t offset, struct fuse_file_info* fi)
 {
-	ssize_t ret;
+	struct exfat_node* node = get_node(fi);
+	struct exfat_run runs[IO_RUNS];
+	size_t size = fuse_buf_size(buf);
+	size_t count;
+	size_t done = 0;
+	size_t i;
+	ssize_t mapped;
+	int rc = 0;
 
 	exfat_debug("[%s] %s (%zu bytes)", __func__, path, size);
-	ret = exfat_generic_pwrite(&ef, get_node(fi), buffer, size, offset);
-	if (ret < 0)
-		return -EIO;
-	return ret;
+
+	pthread_rwlock_wrlock(&node->lock);
+	pthread_mutex_lock(&ef_lock);
+	if (offset > node->size)
+		rc = exfat_truncate(&ef, node, offset, true);
+	if (rc == 0 && offset + size > node->size)
+		rc = exfat_truncate(&ef, node, offset + size, false);
+	pthread_mutex_unlock(&ef_lock);
+
+	while (rc == 0 && done < size)
+	{
+		count = IO_RUNS;
+		pthread_mutex_lock(&ef_lock);
+		mapped = exfat_map_range(&ef, node, offset + done, size - done, runs,
+				&count);
+		pthread_mutex_unlock(&ef_lock);
+		if (mapped < 0)
+		{
+			rc = -EIO;
+			break;
+		}
+		for (i = 0; i < count && rc == 0; i++)
+			rc = write_run(buf, &runs[i]);
+		done += mapped;
+	}
+
+	if (rc == 0)
+	{
+		pthread_mutex_lock(&ef_lock);
+		exfat_update_mtime(node);
+		pthread_mutex_unlock(&ef_lock);
+	}
+	pthread_rwlock_unlock(&node->lock);
+	return rc != 0 ? rc : (int) size;
 }
 
 static int fuse_exfat_unlink(const char* path)
@@ -246,15 +404,17 @@ static int fuse_exfat_unlink(const char* path)
 
 	exfat_debug("[%s] %s", __func__, path);
 
+	pthread_mutex_lock(&ef_lock);
 	rc = exfat_lookup(&ef, &node, path);
-	if (rc != 0)
-		return rc;
-
-	rc = exfat_unlink(&ef, node);
-	exfat_put_node(&ef, node);
-	if (rc != 0)
-		return rc;
-	return exfat_cleanup_node(&ef, node);
+	if (rc == 0)
+	{
+		rc = exfat_unlink(&ef, node);
+		exfat_put_node(&ef, node);
+		if (rc == 0)
+			rc = exfat_cleanup_node(&ef, node);
+	}
+	pthread_mutex_unlock(&ef_lock);
+	return rc;
 }
 
 static int fuse_exfat_rmdir(const char* path)
@@ -264,33 +424,50 @@ static int fuse_exfat_rmdir(const char* path)
 
 	exfat_debug("[%s] %s", __func__, path);
 
+	pthread_mutex_lock(&ef_lock);
 	rc = exfat_lookup(&ef, &node, path);
-	if (rc != 0)
-		return rc;
-
-	rc = exfat_rmdir(&ef, node);
-	exfat_put_node(&ef, node);
-	if (rc != 0)
-		return rc;
-	return exfat_cleanup_node(&ef, node);
+	if (rc == 0)
+	{
+		rc = exfat_rmdir(&ef, node);
+		exfat_put_node(&ef, node);
+		if (rc == 0)
+			rc = exfat_cleanup_node(&ef, node);
+	}
+	pthread_mutex_unlock(&ef_lock);
+	return rc;
 }
 
 static int fuse_exfat_mknod(const char* path, mode_t mode, dev_t dev)
 {
+	int rc;
+
 	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
-	return exfat_mknod(&ef, path);
+	pthread_mutex_lock(&ef_lock);
+	rc = exfat_mknod(&ef, path);
+	pthread_mutex_unlock(&ef_lock);
+	return rc;
 }
 
 static int fuse_exfat_mkdir(const char* path, mode_t mode)
 {
+	int rc;
+
 	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
-	return exfat_mkdir(&ef, path);
+	pthread_mutex_lock(&ef_lock);
+	rc = exfat_mkdir(&ef, path);
+	pthread_mutex_unlock(&ef_lock);
+	return rc;
 }
 
 static int fuse_exfat_rename(const char* old_path, const char* new_path)
 {
+	int rc;
+
 	exfat_debug("[%s] %s => %s", __func__, old_path, new_path);
-	return exfat_rename(&ef, old_path, new_path);
+	pthread_mutex_lock(&ef_lock);
+	rc = exfat_rename(&ef, old_path, new_path);
+	pthread_mutex_unlock(&ef_lock);
+	return rc;
 }
 
 static int fuse_exfat_utimens(const char* path, const struct timespec tv[2])
@@ -300,13 +477,15 @@ static int fuse_exfat_utimens(const char* path, const struct timespec tv[2])
 
 	exfat_debug("[%s] %s", __func__, path);
 
+	pthread_mutex_lock(&ef_lock);
 	rc = exfat_lookup(&ef, &node, path);
-	if (rc != 0)
-		return rc;
-
-	exfat_utimes(node, tv);
-	rc = exfat_flush_node(&ef, node);
-	exfat_put_node(&ef, node);
+	if (rc == 0)
+	{
+		exfat_utimes(node, tv);
+		rc = exfat_flush_node(&ef, node);
+		exfat_put_node(&ef, node);
+	}
+	pthread_mutex_unlock(&ef_lock);
 	return rc;
 }
 
@@ -336,7 +515,9 @@ static int fuse_exfat_statfs(const char* path, struct statvfs* sfs)
 	sfs->f_bsize = CLUSTER_SIZE(*ef.sb);
 	sfs->f_frsize = CLUSTER_SIZE(*ef.sb);
 	sfs->f_blocks = le64_to_cpu(ef.sb->sector_count) >> ef.sb->spc_bits;
+	pthread_mutex_lock(&ef_lock);
 	sfs->f_bavail = exfat_count_free_clusters(&ef);
+	pthread_mutex_unlock(&ef_lock);
 	sfs->f_bfree = sfs->f_bavail;
 	sfs->f_namemax = EXFAT_NAME_MAX;
 
@@ -358,6 +539,10 @@ static void* fuse_exfat_init(struct fuse_conn_info* fci)
 	exfat_debug("[%s]", __func__);
 #ifdef FUSE_CAP_BIG_WRITES
 	fci->want |= FUSE_CAP_BIG_WRITES;
+#endif
+#ifdef FUSE_CAP_SPLICE_READ
+	/* leave the data of writes in a pipe, see write_run() */
+	fci->want |= fci->capable & FUSE_CAP_SPLICE_READ;
 #endif
 	return NULL;
 }
@@ -386,7 +571,7 @@ static struct fuse_operations fuse_exfat_ops =
 	.fsync		= fuse_exfat_fsync,
 	.fsyncdir	= fuse_exfat_fsync,
 	.read		= fuse_exfat_read,
-	.write		= fuse_exfat_write,
+	.write_buf	= fuse_exfat_write_buf,
 	.unlink		= fuse_exfat_unlink,
 	.rmdir		= fuse_exfat_rmdir,
 	.mknod		= fuse_exfat_mknod,
@@ -604,7 +789,7 @@ int main(int argc, char* argv[])
 	   main loop */
 	if (fuse_daemonize(debug) == 0)
 	{
-		if (fuse_loop(fh) != 0)
+		if (fuse_loop_mt(fh) != 0)
 			exfat_error("FUSE loop failure");
 	}
 	else
@@ -70,70 +70,305 @@ static uint32_t bytes2clusters(const struct exfat* ef, uint64_t bytes)
 	return (bytes + cluster_size - 1) / cluster_size;
 }
 
+/*
+ * FAT is cached in pages that are mapped directly by their number, so the
+ * whole FAT of a card up to 32 GB with 32 KB clusters stays in memory.
+ * Changes are written back by exfat_flush() or when a dirty page is evicted.
+ */
+#define FAT_PAGE_SIZE 4096
+#define FAT_PAGE_ENTRIES (FAT_PAGE_SIZE / sizeof(le32_t))
+#define FAT_CACHE_PAGES 1024
+#define FAT_PAGE_NONE UINT32_MAX
+
+struct exfat_fat_page
+{
+	uint32_t index;
+	bool dirty;
+	le32_t entries[FAT_PAGE_ENTRIES];
+};
+
+struct exfat_fat_cache
+{
+	struct exfat_fat_page* pages[FAT_CACHE_PAGES];
+};
+
+static uint64_t fat_size(const struct exfat* ef)
+{
+	return (uint64_t) le32_to_cpu(ef->sb->fat_sector_count)
+		<< ef->sb->sector_bits;
+}
+
+int exfat_create_fat_cache(struct exfat* ef)
+{
+	ef->fat_cache = malloc(sizeof(struct exfat_fat_cache));
+	if (ef->fat_cache == NULL)
+	{
+		exfat_error("failed to allocate FAT cache");
+		return -ENOMEM;
+	}
+	memset(ef->fat_cache, 0, sizeof(struct exfat_fat_cache));
+	return 0;
+}
+
+void exfat_free_fat_cache(struct exfat* ef)
+{
+	size_t i;
+
+	if (ef->fat_cache == NULL)
+		return;
+	for (i = 0; i < FAT_CACHE_PAGES; i++)
+		free(ef->fat_cache->pages[i]);
+	free(ef->fat_cache);
+	ef->fat_cache = NULL;
+}
+
+static bool write_fat_page(const struct exfat* ef, struct exfat_fat_page* page)
+{
+	loff_t offset = (loff_t) page->index * FAT_PAGE_SIZE;
+
+	if (exfat_pwrite(ef->dev, page->entries,
+			MIN(FAT_PAGE_SIZE, fat_size(ef) - offset),
+			s2o(ef, le32_to_cpu(ef->sb->fat_sector_start)) + offset) < 0)
+	{
+		exfat_error("failed to write FAT at %"PRId64, offset);
+		return false;
+	}
+	page->dirty = false;
+	return true;
+}
+
+static struct exfat_fat_page* get_fat_page(const struct exfat* ef,
+		cluster_t cluster)
+{
+	const uint32_t index = cluster / FAT_PAGE_ENTRIES;
+	struct exfat_fat_page** slot =
+			&ef->fat_cache->pages[index % FAT_CACHE_PAGES];
+	struct exfat_fat_page* page = *slot;
+	loff_t offset = (loff_t) index * FAT_PAGE_SIZE;
+
+	if ((uint64_t) cluster * sizeof(cluster_t) >= fat_size(ef))
+	{
+		exfat_error("cluster 0x%x is beyond the end of FAT", cluster);
+		return NULL;
+	}
+	if (page != NULL && page->index == index)
+		return page;
+
+	if (page == NULL)
+	{
+		page = malloc(sizeof(struct exfat_fat_page));
+		if (page == NULL)
+		{
+			exfat_error("failed to allocate FAT page");
+			return NULL;
+		}
+		*slot = page;
+	}
+	else if (page->dirty && !write_fat_page(ef, page))
+		return NULL;
+
+	page->index = FAT_PAGE_NONE;
+	page->dirty = false;
+	if (exfat_pread(ef->dev, page->entries,
+			MIN(FAT_PAGE_SIZE, fat_size(ef) - offset),
+			s2o(ef, le32_to_cpu(ef->sb->fat_sector_start)) + offset) < 0)
+	{
+		exfat_error("failed to read FAT at %"PRId64, offset);
+		return NULL;
+	}
+	page->index = index;
+	return page;
+}
+
 cluster_t exfat_next_cluster(const struct exfat* ef,
 		const struct exfat_node* node, cluster_t cluster)
 {
-	le32_t next;
-	loff_t fat_offset;
+	struct exfat_fat_page* page;
 
 	if (cluster < EXFAT_FIRST_DATA_CLUSTER)
 		exfat_bug("bad cluster 0x%x", cluster);
 
 	if (IS_CONTIGUOUS(*node))
 		return cluster + 1;
-	fat_offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start))
-		+ cluster * sizeof(cluster_t);
-	if (exfat_pread(ef->dev, &next, sizeof(next), fat_offset) < 0)
+	page = get_fat_page(ef, cluster);
+	if (page == NULL)
 		return EXFAT_CLUSTER_BAD; /* the caller should handle this and print
 		                             appropriate error message */
-	return le32_to_cpu(next);
+	return le32_to_cpu(page->entries[cluster % FAT_PAGE_ENTRIES]);
 }
 
-cluster_t exfat_advance_cluster(const struct exfat* ef,
-		struct exfat_node* node, uint32_t count)
+void exfat_free_extents(struct exfat_node* node)
+{
+	free(node->extents);
+	node->extents = NULL;
+	node->extents_count = 0;
+	node->extents_allocated = 0;
+}
+
+static bool add_extent(struct exfat_node* node, uint32_t index,
+		cluster_t cluster)
+{
+	struct exfat_extent* extent;
+
+	if (node->extents_count == node->extents_allocated)
+	{
+		uint32_t allocated = MAX(node->extents_allocated * 2, 16);
+		extent = realloc(node->extents, allocated * sizeof(*extent));
+		if (extent == NULL)
+		{
+			exfat_error("failed to allocate %u extents", allocated);
+			return false;
+		}
+		node->extents = extent;
+		node->extents_allocated = allocated;
+	}
+	extent = &node->extents[node->extents_count++];
+	extent->index = index;
+	extent->cluster = cluster;
+	extent->count = 1;
+	return true;
+}
+
+/*
+ * Returns the cluster at the given index of a fragmented file. The chain is
+ * read from FAT only once, as runs of contiguous clusters, so later seeks are
+ * a binary search over the runs.
+ */
+static cluster_t map_cluster(const struct exfat* ef, struct exfat_node* node,
+		uint32_t index)
 {
-	uint32_t i;
+	struct exfat_extent* last;
+	cluster_t cluster;
+	cluster_t next;
+	uint32_t first = 0;
+	uint32_t end;
+
+	if (node->extents_count == 0)
+	{
+		if (CLUSTER_INVALID(node->start_cluster))
+			return node->start_cluster;
+		if (!add_extent(node, 0, node->start_cluster))
+			return EXFAT_CLUSTER_BAD;
+	}
 
-	if (node->fptr_index > count)
+	last = &node->extents[node->extents_count - 1];
+	while (last->index + last->count <= index)
 	{
-		node->fptr_index = 0;
-		node->fptr_cluster = node->start_cluster;
+		cluster = last->cluster + last->count - 1;
+		next = exfat_next_cluster(ef, node, cluster);
+		if (CLUSTER_INVALID(next))
+			return next; /* the caller should handle this and print
+			                appropriate error message */
+		if (next == cluster + 1)
+			last->count++;
+		else if (add_extent(node, last->index + last->count, next))
+			last = &node->extents[node->extents_count - 1];
+		else
+			return EXFAT_CLUSTER_BAD;
 	}
 
-	for (i = node->fptr_index; i < count; i++)
+	/* find the last extent that starts at or before the index */
+	end = node->extents_count;
+	while (end - first > 1)
 	{
-		node->fptr_cluster = exfat_next_cluster(ef, node, node->fptr_cluster);
-		if (CLUSTER_INVALID(node->fptr_cluster))
-			break; /* the caller should handle this and print appropriate 
-			          error message */
+		uint32_t middle = first + (end - first) / 2;
+		if (node->extents[middle].index <= index)
+			first = middle;
+		else
+			end = middle;
 	}
+	return node->extents[first].cluster + (index - node->extents[first].index);
+}
+
+cluster_t exfat_advance_cluster(const struct exfat* ef,
+		struct exfat_node* node, uint32_t count)
+{
+	if (IS_CONTIGUOUS(*node) && !CLUSTER_INVALID(node->start_cluster))
+		node->fptr_cluster = node->start_cluster + count;
+	else
+		node->fptr_cluster = map_cluster(ef, node, count);
 	node->fptr_index = count;
 	return node->fptr_cluster;
 }
 
+/*
+ * Bits are counted from the least significant one, so the lowest clear bit of
+ * a word is the first free cluster in it. GCC and Clang lower these builtins
+ * to CNT and to RBIT with CLZ on ARM.
+ */
+static size_t bitmap_ctz(bitmap_t word)
+{
+	return __builtin_ctzll(word);
+}
+
+static size_t bitmap_popcount(bitmap_t word)
+{
+	return __builtin_popcountll(word);
+}
+
 static cluster_t find_bit_and_set(bitmap_t* bitmap, size_t start, size_t end)
 {
-	const size_t start_index = start / sizeof(bitmap_t) / 8;
-	const size_t end_index = DIV_ROUND_UP(end, sizeof(bitmap_t) * 8);
+	const size_t bits = sizeof(bitmap_t) * 8;
+	const size_t start_index = start / bits;
+	const size_t end_index = DIV_ROUND_UP(end, bits);
 	size_t i;
-	size_t start_bitindex;
-	size_t end_bitindex;
 	size_t c;
 
 	for (i = start_index; i < end_index; i++)
 	{
-		if (bitmap[i] == ~((bitmap_t) 0))
+		bitmap_t free_bits = ~bitmap[i];
+
+		if (i == start_index)
+			free_bits &= (bitmap_t) (~((bitmap_t) 0) << (start % bits));
+		if (free_bits == 0)
 			continue;
-		start_bitindex = MAX(i * sizeof(bitmap_t) * 8, start);
-		end_bitindex = MIN((i + 1) * sizeof(bitmap_t) * 8, end);
-		for (c = start_bitindex; c < end_bitindex; c++)
-			if (BMAP_GET(bitmap, c) == 0)
+		c = i * bits + bitmap_ctz(free_bits);
+		if (c >= end)
+			break;
+		BMAP_SET(bitmap, c);
+		return c + EXFAT_FIRST_DATA_CLUSTER;
+	}
+	return EXFAT_CLUSTER_END;
+}
+
+/*
+ * Returns the first bit of a run of count clear bits between start and end,
+ * or end if there is no such run.
+ */
+static size_t find_free_run(const bitmap_t* bitmap, size_t start, size_t end,
+		size_t count)
+{
+	const size_t bits = sizeof(bitmap_t) * 8;
+	size_t run = 0;
+	size_t c = start;
+
+	while (c < end)
+	{
+		if (c % bits == 0 && c + bits <= end)
+		{
+			bitmap_t word = bitmap[c / bits];
+			if (word == ~((bitmap_t) 0))
 			{
-				BMAP_SET(bitmap, c);
-				return c + EXFAT_FIRST_DATA_CLUSTER;
+				run = 0;
+				c += bits;
+				continue;
 			}
+			if (word == 0)
+			{
+				run += bits;
+				c += bits;
+				if (run >= count)
+					return c - run;
+				continue;
+			}
+		}
+		if (BMAP_GET(bitmap, c))
+			run = 0;
+		else if (++run == count)
+			return c + 1 - count;
+		c++;
 	}
-	return EXFAT_CLUSTER_END;
+	return end;
 }
 
 static int flush_nodes(struct exfat* ef, struct exfat_node* node)
@@ -156,6 +391,15 @@ int exfat_flush_nodes(struct exfat* ef)
 
 int exfat_flush(struct exfat* ef)
 {
+	size_t i;
+
+	for (i = 0; i < FAT_CACHE_PAGES; i++)
+	{
+		struct exfat_fat_page* page = ef->fat_cache->pages[i];
+		if (page != NULL && page->dirty && !write_fat_page(ef, page))
+			return -EIO;
+	}
+
 	if (ef->cmap.dirty)
 	{
 		if (exfat_pwrite(ef->dev, ef->cmap.chunk,
@@ -174,31 +418,46 @@ int exfat_flush(struct exfat* ef)
 static bool set_next_cluster(const struct exfat* ef, bool contiguous,
 		cluster_t current, cluster_t next)
 {
-	loff_t fat_offset;
-	le32_t next_le32;
+	struct exfat_fat_page* page;
 
 	if (contiguous)
 		return true;
-	fat_offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start))
-		+ current * sizeof(cluster_t);
-	next_le32 = cpu_to_le32(next);
-	if (exfat_pwrite(ef->dev, &next_le32, sizeof(next_le32), fat_offset) < 0)
+	page = get_fat_page(ef, current);
+	if (page == NULL)
 	{
 		exfat_error("failed to write the next cluster %#x after %#x", next,
 				current);
 		return false;
 	}
+	page->entries[current % FAT_PAGE_ENTRIES] = cpu_to_le32(next);
+	page->dirty = true;
 	return true;
 }
 
-static cluster_t allocate_cluster(struct exfat* ef, cluster_t hint)
+/*
+ * Allocates the hint cluster if it is free. Otherwise when more clusters are
+ * about to be allocated the search starts at a free run long enough for all
+ * of them, so the file does not end up in the small holes left behind.
+ */
+static cluster_t allocate_cluster(struct exfat* ef, cluster_t hint,
+		uint32_t count)
 {
 	cluster_t cluster;
+	size_t run;
 
 	hint -= EXFAT_FIRST_DATA_CLUSTER;
 	if (hint >= ef->cmap.chunk_size)
 		hint = 0;
 
+	if (count > 1 && BMAP_GET(ef->cmap.chunk, hint) != 0)
+	{
+		run = find_free_run(ef->cmap.chunk, hint, ef->cmap.chunk_size, count);
+		if (run == ef->cmap.chunk_size)
+			run = find_free_run(ef->cmap.chunk, 0, hint, count);
+		if (run < ef->cmap.chunk_size)
+			hint = run;
+	}
+
 	cluster = find_bit_and_set(ef->cmap.chunk, hint, ef->cmap.chunk_size);
 	if (cluster == EXFAT_CLUSTER_END)
 		cluster = find_bit_and_set(ef->cmap.chunk, 0, hint);
@@ -208,6 +467,7 @@ static cluster_t allocate_cluster(struct exfat* ef, cluster_t hint)
 		return EXFAT_CLUSTER_END;
 	}
 
+	ef->cmap.free_count--;
 	ef->cmap.dirty = true;
 	return cluster;
 }
@@ -221,6 +481,7 @@ static void free_cluster(struct exfat* ef, cluster_t cluster)
 				ef->cmap.size);
 
 	BMAP_CLR(ef->cmap.chunk, cluster - EXFAT_FIRST_DATA_CLUSTER);
+	ef->cmap.free_count++;
 	ef->cmap.dirty = true;
 }
 
@@ -264,7 +525,7 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 			exfat_bug("non-zero pointer index (%u)", node->fptr_index);
 		/* file does not have clusters (i.e. is empty), allocate
 		   the first one for it */
-		previous = allocate_cluster(ef, 0);
+		previous = allocate_cluster(ef, 0, difference);
 		if (CLUSTER_INVALID(previous))
 			return -ENOSPC;
 		node->fptr_cluster = node->start_cluster = previous;
@@ -275,14 +536,14 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 
 	while (allocated < difference)
 	{
-		next = allocate_cluster(ef, previous + 1);
+		next = allocate_cluster(ef, previous + 1, difference - allocated);
 		if (CLUSTER_INVALID(next))
 		{
 			if (allocated != 0)
 				shrink_file(ef, node, current + allocated, allocated);
 			return -ENOSPC;
 		}
-		if (next != previous - 1 && IS_CONTIGUOUS(*node))
+		if (next != previous + 1 && IS_CONTIGUOUS(*node))
 		{
 			/* it's a pity, but we are not able to keep the file contiguous
 			   anymore */
@@ -339,6 +600,8 @@ static int shrink_file(struct exfat* ef, struct exfat_node* node,
 	}
 	node->fptr_index = 0;
 	node->fptr_cluster = node->start_cluster;
+	/* the freed clusters may be in the extent map */
+	exfat_free_extents(node);
 
 	/* free remaining clusters */
 	while (difference--)
@@ -438,15 +701,25 @@ int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 	return 0;
 }
 
-uint32_t exfat_count_free_clusters(const struct exfat* ef)
+void exfat_init_free_clusters(struct exfat* ef)
 {
-	uint32_t free_clusters = 0;
-	uint32_t i;
+	const size_t bits = sizeof(bitmap_t) * 8;
+	const size_t words = ef->cmap.size / bits;
+	uint32_t used = 0;
+	size_t i;
 
-	for (i = 0; i < ef->cmap.size; i++)
-		if (BMAP_GET(ef->cmap.chunk, i) == 0)
-			free_clusters++;
-	return free_clusters;
+	for (i = 0; i < words; i++)
+		used += bitmap_popcount(ef->cmap.chunk[i]);
+	/* bits past the last cluster are not counted */
+	if (ef->cmap.size % bits)
+		used += bitmap_popcount(ef->cmap.chunk[words] &
+				(bitmap_t) (((bitmap_t) 1 << (ef->cmap.size % bits)) - 1));
+	ef->cmap.free_count = ef->cmap.size - used;
+}
+
+uint32_t exfat_count_free_clusters(const struct exfat* ef)
+{
+	return ef->cmap.free_count;
 }
 
 static int find_used_clusters(const struct exfat* ef,
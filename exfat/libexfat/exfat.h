@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -69,6 +70,14 @@
    be corrupted with 32-bit off_t. So, we use loff_t here.*/
 STATIC_ASSERT(sizeof(loff_t) == 8);
 
+/* a run of clusters of a file that are contiguous on the disk */
+struct exfat_extent
+{
+	uint32_t index;				/* cluster number within the file */
+	cluster_t cluster;
+	uint32_t count;
+};
+
 struct exfat_node
 {
 	struct exfat_node* parent;
@@ -77,8 +86,12 @@ struct exfat_node
 	struct exfat_node* prev;
 
 	int references;
+	pthread_rwlock_t lock;		/* held by users doing I/O on the clusters */
 	uint32_t fptr_index;
 	cluster_t fptr_cluster;
+	struct exfat_extent* extents;	/* chain mapped so far, sorted by index */
+	uint32_t extents_count;
+	uint32_t extents_allocated;
 	cluster_t entry_cluster;
 	loff_t entry_offset;
 	cluster_t start_cluster;
@@ -88,6 +101,13 @@ struct exfat_node
 	le16_t name[EXFAT_NAME_MAX + 1];
 };
 
+/* a range of bytes that follow each other on the device */
+struct exfat_run
+{
+	loff_t offset;
+	size_t size;
+};
+
 enum exfat_mode
 {
 	EXFAT_MODE_RO,
@@ -96,6 +116,7 @@ enum exfat_mode
 };
 
 struct exfat_dev;
+struct exfat_fat_cache;
 
 struct exfat
 {
@@ -103,6 +124,7 @@ struct exfat
 	struct exfat_super_block* sb;
 	le16_t* upcase;
 	size_t upcase_chars;
+	cluster_t upcase_start_cluster;
 	struct exfat_node* root;
 	struct
 	{
@@ -110,9 +132,11 @@ struct exfat
 		uint32_t size;				/* in bits */
 		bitmap_t* chunk;
 		uint32_t chunk_size;		/* in bits */
+		uint32_t free_count;		/* clear bits in the chunk */
 		bool dirty;
 	}
 	cmap;
+	struct exfat_fat_cache* fat_cache;
 	char label[UTF8_BYTES(EXFAT_ENAME_MAX) + 1];
 	void* zero_cluster;
 	int dmask, fmask;
@@ -147,6 +171,7 @@ int exfat_close(struct exfat_dev* dev);
 int exfat_fsync(struct exfat_dev* dev);
 enum exfat_mode exfat_get_mode(const struct exfat_dev* dev);
 loff_t exfat_get_size(const struct exfat_dev* dev);
+int exfat_get_fd(const struct exfat_dev* dev);
 loff_t exfat_seek(struct exfat_dev* dev, loff_t offset, int whence);
 ssize_t exfat_read(struct exfat_dev* dev, void* buffer, size_t size);
 ssize_t exfat_write(struct exfat_dev* dev, const void* buffer, size_t size);
@@ -158,6 +183,8 @@ ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
 		void* buffer, size_t size, loff_t offset);
 ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 		const void* buffer, size_t size, loff_t offset);
+ssize_t exfat_map_range(const struct exfat* ef, struct exfat_node* node,
+		loff_t offset, size_t size, struct exfat_run* runs, size_t* count);
 
 int exfat_opendir(struct exfat* ef, struct exfat_node* dir,
 		struct exfat_iterator* it);
@@ -173,10 +200,14 @@ cluster_t exfat_next_cluster(const struct exfat* ef,
 		const struct exfat_node* node, cluster_t cluster);
 cluster_t exfat_advance_cluster(const struct exfat* ef,
 		struct exfat_node* node, uint32_t count);
+void exfat_free_extents(struct exfat_node* node);
+int exfat_create_fat_cache(struct exfat* ef);
+void exfat_free_fat_cache(struct exfat* ef);
 int exfat_flush_nodes(struct exfat* ef);
 int exfat_flush(struct exfat* ef);
 int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 		bool erase);
+void exfat_init_free_clusters(struct exfat* ef);
 uint32_t exfat_count_free_clusters(const struct exfat* ef);
 int exfat_find_used_sectors(const struct exfat* ef, loff_t* a, loff_t* b);
 
@@ -201,6 +232,7 @@ int utf8_to_utf16(le16_t* output, const char* input, size_t outsize,
 size_t utf16_length(const le16_t* str);
 
 struct exfat_node* exfat_get_node(struct exfat_node* node);
+void exfat_free_node(struct exfat_node* node);
 void exfat_put_node(struct exfat* ef, struct exfat_node* node);
 int exfat_cleanup_node(struct exfat* ef, struct exfat_node* node);
 int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir);
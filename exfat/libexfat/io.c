@@ -292,6 +292,19 @@ loff_t exfat_get_size(const struct exfat_dev* dev)
 	return dev->size;
 }
 
+/*
+ * For I/O that does not go through libexfat, such as splice(). With ublio
+ * the descriptor would bypass its cache, so none is returned.
+ */
+int exfat_get_fd(const struct exfat_dev* dev)
+{
+#ifdef USE_UBLIO
+	return -1;
+#else
+	return dev->fd;
+#endif
+}
+
 loff_t exfat_seek(struct exfat_dev* dev, loff_t offset, int whence)
 {
 #ifdef USE_UBLIO
@@ -350,6 +363,7 @@ ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
 		void* buffer, size_t size, loff_t offset)
 {
 	cluster_t cluster;
+	uint32_t index;
 	char* bufp = buffer;
 	loff_t lsize, loffset, remainder;
 
@@ -358,7 +372,8 @@ ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
 	if (size == 0)
 		return 0;
 
-	cluster = exfat_advance_cluster(ef, node, offset / CLUSTER_SIZE(*ef->sb));
+	index = offset / CLUSTER_SIZE(*ef->sb);
+	cluster = exfat_advance_cluster(ef, node, index);
 	if (CLUSTER_INVALID(cluster))
 	{
 		exfat_error("invalid cluster 0x%x while reading", cluster);
@@ -384,7 +399,8 @@ ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
 		bufp += lsize;
 		loffset = 0;
 		remainder -= lsize;
-		cluster = exfat_next_cluster(ef, node, cluster);
+		if (remainder > 0)
+			cluster = exfat_advance_cluster(ef, node, ++index);
 	}
 	if (!ef->ro && !ef->noatime)
 		exfat_update_atime(node);
@@ -395,6 +411,7 @@ ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 		const void* buffer, size_t size, loff_t offset)
 {
 	cluster_t cluster;
+	uint32_t index;
 	const char* bufp = buffer;
 	loff_t lsize, loffset, remainder;
 
@@ -407,7 +424,8 @@ ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 	if (size == 0)
 		return 0;
 
-	cluster = exfat_advance_cluster(ef, node, offset / CLUSTER_SIZE(*ef->sb));
+	index = offset / CLUSTER_SIZE(*ef->sb);
+	cluster = exfat_advance_cluster(ef, node, index);
 	if (CLUSTER_INVALID(cluster))
 	{
 		exfat_error("invalid cluster 0x%x while writing", cluster);
@@ -433,8 +451,54 @@ ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 		bufp += lsize;
 		loffset = 0;
 		remainder -= lsize;
-		cluster = exfat_next_cluster(ef, node, cluster);
+		if (remainder > 0)
+			cluster = exfat_advance_cluster(ef, node, ++index);
 	}
 	exfat_update_mtime(node);
 	return size - remainder;
 }
+
+/*
+ * Fills runs with the device ranges that hold size bytes of the node starting
+ * at offset, merging clusters that follow each other on the device. Stops
+ * early when all count runs are used. Returns the number of bytes mapped.
+ */
+ssize_t exfat_map_range(const struct exfat* ef, struct exfat_node* node,
+		loff_t offset, size_t size, struct exfat_run* runs, size_t* count)
+{
+	cluster_t cluster;
+	uint32_t index = offset / CLUSTER_SIZE(*ef->sb);
+	loff_t loffset = offset % CLUSTER_SIZE(*ef->sb);
+	loff_t device_offset;
+	size_t lsize;
+	size_t mapped = 0;
+	size_t used = 0;
+
+	while (mapped < size)
+	{
+		cluster = exfat_advance_cluster(ef, node, index);
+		if (CLUSTER_INVALID(cluster))
+		{
+			exfat_error("invalid cluster 0x%x while mapping", cluster);
+			return -EIO;
+		}
+		device_offset = exfat_c2o(ef, cluster) + loffset;
+		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, size - mapped);
+		if (used != 0 &&
+				runs[used - 1].offset + runs[used - 1].size == device_offset)
+			runs[used - 1].size += lsize;
+		else if (used == *count)
+			break;
+		else
+		{
+			runs[used].offset = device_offset;
+			runs[used].size = lsize;
+			used++;
+		}
+		mapped += lsize;
+		loffset = 0;
+		index++;
+	}
+	*count = used;
+	return mapped;
+}
@@ -277,9 +277,18 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 				exfat_get_size(ef->dev));
 	}
 
+	if (exfat_create_fat_cache(ef) != 0)
+	{
+		free(ef->zero_cluster);
+		exfat_close(ef->dev);
+		free(ef->sb);
+		return -ENOMEM;
+	}
+
 	ef->root = malloc(sizeof(struct exfat_node));
 	if (ef->root == NULL)
 	{
+		exfat_free_fat_cache(ef);
 		free(ef->zero_cluster);
 		exfat_close(ef->dev);
 		free(ef->sb);
@@ -287,6 +296,7 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 		return -ENOMEM;
 	}
 	memset(ef->root, 0, sizeof(struct exfat_node));
+	pthread_rwlock_init(&ef->root->lock, NULL);
 	ef->root->flags = EXFAT_ATTRIB_DIR;
 	ef->root->start_cluster = le32_to_cpu(ef->sb->rootdir_cluster);
 	ef->root->fptr_cluster = ef->root->start_cluster;
@@ -294,7 +304,8 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 	ef->root->size = rootdir_size(ef);
 	if (ef->root->size == 0)
 	{
-		free(ef->root);
+		exfat_free_node(ef->root);
+		exfat_free_fat_cache(ef);
 		free(ef->zero_cluster);
 		exfat_close(ef->dev);
 		free(ef->sb);
@@ -328,7 +339,8 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 error:
 	exfat_put_node(ef, ef->root);
 	exfat_reset_cache(ef);
-	free(ef->root);
+	exfat_free_node(ef->root);
+	exfat_free_fat_cache(ef);
 	free(ef->zero_cluster);
 	exfat_close(ef->dev);
 	free(ef->sb);
@@ -363,8 +375,9 @@ void exfat_unmount(struct exfat* ef)
 	exfat_flush(ef);		/* ignore return code */
 	exfat_put_node(ef, ef->root);
 	exfat_reset_cache(ef);
-	free(ef->root);
+	exfat_free_node(ef->root);
 	ef->root = NULL;
+	exfat_free_fat_cache(ef);
 	finalize_super_block(ef);
 	exfat_close(ef->dev);	/* close descriptor immediately after fsync */
 	ef->dev = NULL;
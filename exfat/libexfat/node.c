@@ -79,7 +79,7 @@ int exfat_cleanup_node(struct exfat* ef, struct exfat_node* node)
 		/* free all clusters and node structure itself */
 		rc = exfat_truncate(ef, node, 0, true);
 		/* free the node even in case of error or its memory will be lost */
-		free(node);
+		exfat_free_node(node);
 	}
 	return rc;
 }
@@ -163,9 +163,17 @@ static struct exfat_node* allocate_node(void)
 		return NULL;
 	}
 	memset(node, 0, sizeof(struct exfat_node));
+	pthread_rwlock_init(&node->lock, NULL);
 	return node;
 }
 
+void exfat_free_node(struct exfat_node* node)
+{
+	exfat_free_extents(node);
+	pthread_rwlock_destroy(&node->lock);
+	free(node);
+}
+
 static void init_node_meta1(struct exfat_node* node,
 		const struct exfat_entry_meta1* meta1)
 {
@@ -388,6 +396,7 @@ static int readdir(struct exfat* ef, const struct exfat_node* parent,
 				goto error;
 			}
 			ef->upcase_chars = le64_to_cpu(upcase->size) / sizeof(le16_t);
+			ef->upcase_start_cluster = le32_to_cpu(upcase->start_cluster);
 
 			if (exfat_pread(ef->dev, ef->upcase, le64_to_cpu(upcase->size),
 					exfat_c2o(ef, le32_to_cpu(upcase->start_cluster))) < 0)
@@ -439,6 +448,7 @@ static int readdir(struct exfat* ef, const struct exfat_node* parent,
 						le64_to_cpu(bitmap->size), ef->cmap.start_cluster);
 				goto error;
 			}
+			exfat_init_free_clusters(ef);
 			break;
 
 		case EXFAT_ENTRY_LABEL:
@@ -478,7 +488,8 @@ static int readdir(struct exfat* ef, const struct exfat_node* parent,
 	/* we never reach here */
 
 error:
-	free(*node);
+	if (*node != NULL)
+		exfat_free_node(*node);
 	*node = NULL;
 	return rc;
 }
@@ -517,7 +528,7 @@ int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
 		for (current = dir->child; current; current = node)
 		{
 			node = current->next;
-			free(current);
+			exfat_free_node(current);
 		}
 		dir->child = NULL;
 		return rc;
@@ -560,7 +571,7 @@ static void reset_cache(struct exfat* ef, struct exfat_node* node)
 		struct exfat_node* p = node->child;
 		reset_cache(ef, p);
 		tree_detach(p);
-		free(p);
+		exfat_free_node(p);
 	}
 	node->flags &= ~EXFAT_ATTRIB_CACHED;
 	if (node->references != 0)
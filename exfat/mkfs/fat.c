@@ -36,47 +36,48 @@ static loff_t fat_size(void)
 	return get_volume_size() / get_cluster_size() * sizeof(cluster_t);
 }
 
-static cluster_t fat_write_entry(struct exfat_dev* dev, cluster_t cluster,
-		cluster_t value)
-{
-	le32_t fat_entry = cpu_to_le32(value);
-	if (exfat_write(dev, &fat_entry, sizeof(fat_entry)) < 0)
-	{
-		exfat_error("failed to write FAT entry 0x%x", value);
-		return 0;
-	}
-	return cluster + 1;
-}
-
-static cluster_t fat_write_entries(struct exfat_dev* dev, cluster_t cluster,
-		uint64_t length)
+static cluster_t fat_entries(le32_t* fat, cluster_t cluster, uint64_t length)
 {
 	cluster_t end = cluster + DIV_ROUND_UP(length, get_cluster_size());
 
 	while (cluster < end - 1)
 	{
-		cluster = fat_write_entry(dev, cluster, cluster + 1);
-		if (cluster == 0)
-			return 0;
+		fat[cluster] = cpu_to_le32(cluster + 1);
+		cluster++;
 	}
-	return fat_write_entry(dev, cluster, EXFAT_CLUSTER_END);
+	fat[cluster] = cpu_to_le32(EXFAT_CLUSTER_END);
+	return cluster + 1;
 }
 
 static int fat_write(struct exfat_dev* dev)
 {
+	/* the chains are contiguous, so the used part of the FAT is built in
+	   memory and written at once */
+	cluster_t count = 2 +
+			DIV_ROUND_UP(cbm.get_size(), get_cluster_size()) +
+			DIV_ROUND_UP(uct.get_size(), get_cluster_size()) +
+			DIV_ROUND_UP(rootdir.get_size(), get_cluster_size());
+	le32_t* fat = malloc(count * sizeof(le32_t));
 	cluster_t c = 0;
 
-	if (!(c = fat_write_entry(dev, c, 0xfffffff8))) /* media type */
-		return 1;
-	if (!(c = fat_write_entry(dev, c, 0xffffffff))) /* some weird constant */
-		return 1;
-	if (!(c = fat_write_entries(dev, c, cbm.get_size())))
-		return 1;
-	if (!(c = fat_write_entries(dev, c, uct.get_size())))
-		return 1;
-	if (!(c = fat_write_entries(dev, c, rootdir.get_size())))
+	if (fat == NULL)
+	{
+		exfat_error("failed to allocate FAT of %u entries", count);
 		return 1;
+	}
+	fat[c++] = cpu_to_le32(0xfffffff8); /* media type */
+	fat[c++] = cpu_to_le32(0xffffffff); /* some weird constant */
+	c = fat_entries(fat, c, cbm.get_size());
+	c = fat_entries(fat, c, uct.get_size());
+	c = fat_entries(fat, c, rootdir.get_size());
 
+	if (exfat_write(dev, fat, c * sizeof(le32_t)) < 0)
+	{
+		free(fat);
+		exfat_error("failed to write FAT of %u entries", c);
+		return 1;
+	}
+	free(fat);
 	return 0;
 }
 
@@ -156,7 +156,7 @@ static uint32_t setup_volume_serial(uint32_t user_defined)
 
 static int setup(struct exfat_dev* dev, int sector_bits, int spc_bits,
 		const char* volume_label, uint32_t volume_serial,
-		uint64_t first_sector)
+		uint64_t first_sector, bool discard)
 {
 	param.sector_bits = sector_bits;
 	param.first_sector = first_sector;
@@ -173,7 +173,7 @@ static int setup(struct exfat_dev* dev, int sector_bits, int spc_bits,
 	if (param.volume_serial == 0)
 		return 1;
 
-	return mkfs(dev, param.volume_size);
+	return mkfs(dev, param.volume_size, discard);
 }
 
 static int logarithm2(int n)
@@ -188,7 +188,7 @@ static int logarithm2(int n)
 
 static void usage(const char* prog)
 {
-	fprintf(stderr, "Usage: %s [-i volume-id] [-n label] "
+	fprintf(stderr, "Usage: %s [-d] [-i volume-id] [-n label] "
 			"[-p partition-first-sector] "
 			"[-s sectors-per-cluster] [-V] <device>\n", prog);
 	exit(1);
@@ -202,14 +202,18 @@ int main(int argc, char* argv[])
 	const char* volume_label = NULL;
 	uint32_t volume_serial = 0;
 	uint64_t first_sector = 0;
+	bool discard = false;
 	struct exfat_dev* dev;
 
 	printf("mkexfatfs %s\n", VERSION);
 
-	while ((opt = getopt(argc, argv, "i:n:p:s:V")) != -1)
+	while ((opt = getopt(argc, argv, "di:n:p:s:V")) != -1)
 	{
 		switch (opt)
 		{
+		case 'd':
+			discard = true;
+			break;
 		case 'i':
 			volume_serial = strtol(optarg, NULL, 16);
 			break;
@@ -243,7 +247,7 @@ int main(int argc, char* argv[])
 	if (dev == NULL)
 		return 1;
 	if (setup(dev, 9, spc_bits, volume_label, volume_serial,
-				first_sector) != 0)
+				first_sector, discard) != 0)
 	{
 		exfat_close(dev);
 		return 1;
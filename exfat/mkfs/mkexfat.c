@@ -22,6 +22,8 @@
 
 #include "mkexfat.h"
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <stdio.h>
@@ -51,12 +53,38 @@ static int check_size(loff_t volume_size)
 
 }
 
+static int zero_range(struct exfat_dev* dev, loff_t start, loff_t size)
+{
+#ifdef BLKZEROOUT
+	uint64_t range[2] = {start, ROUND_UP(size, 512)};
+	int fd = exfat_get_fd(dev);
+
+	return fd >= 0 && ioctl(fd, BLKZEROOUT, range) == 0;
+#else
+	return 0;
+#endif
+}
+
+static void discard_volume(struct exfat_dev* dev, loff_t volume_size)
+{
+#ifdef BLKDISCARD
+	uint64_t range[2] = {0, volume_size};
+	int fd = exfat_get_fd(dev);
+
+	/* not every device supports discard, the volume is erased anyway */
+	if (fd >= 0)
+		ioctl(fd, BLKDISCARD, range);
+#endif
+}
+
 static int erase_object(struct exfat_dev* dev, const void* block,
-		size_t block_size, loff_t start, loff_t size)
+		size_t block_size, loff_t start, loff_t size, bool discard)
 {
 	const loff_t block_count = DIV_ROUND_UP(size, block_size);
 	loff_t i;
 
+	if (discard && zero_range(dev, start, size))
+		return 0;
 	if (exfat_seek(dev, start, SEEK_SET) == (loff_t) -1)
 	{
 		exfat_error("seek to 0x%"PRIx64" failed", start);
@@ -74,7 +102,7 @@ static int erase_object(struct exfat_dev* dev, const void* block,
 	return 0;
 }
 
-static int erase(struct exfat_dev* dev)
+static int erase(struct exfat_dev* dev, bool discard)
 {
 	const struct fs_object** pp;
 	loff_t position = 0;
@@ -92,7 +120,7 @@ static int erase(struct exfat_dev* dev)
 	{
 		position = ROUND_UP(position, (*pp)->get_alignment());
 		if (erase_object(dev, block, block_size, position,
-				(*pp)->get_size()) != 0)
+				(*pp)->get_size(), discard) != 0)
 		{
 			free(block);
 			return 1;
@@ -124,14 +152,16 @@ static int create(struct exfat_dev* dev)
 	return 0;
 }
 
-int mkfs(struct exfat_dev* dev, loff_t volume_size)
+int mkfs(struct exfat_dev* dev, loff_t volume_size, bool discard)
 {
 	if (check_size(volume_size) != 0)
 		return 1;
 
 	fputs("Creating... ", stdout);
 	fflush(stdout);
-	if (erase(dev) != 0)
+	if (discard)
+		discard_volume(dev, volume_size);
+	if (erase(dev, discard) != 0)
 		return 1;
 	if (create(dev) != 0)
 		return 1;
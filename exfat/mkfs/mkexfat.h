@@ -43,7 +43,7 @@ uint64_t get_first_sector(void);
 int get_sector_size(void);
 int get_cluster_size(void);
 
-int mkfs(struct exfat_dev* dev, loff_t volume_size);
+int mkfs(struct exfat_dev* dev, loff_t volume_size, bool discard);
 loff_t get_position(const struct fs_object* object);
 
 #endif /* ifndef MKFS_MKEXFAT_H_INCLUDED */
@@ -19,7 +19,12 @@
 #include <string>
 #include <vector>
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "find_file.hpp"
 #include "twrp-functions.hpp"
 #include "twcommon.h"
@@ -27,65 +32,104 @@
 using namespace std;
 
 string Find_File::Find(const string& file_name, const string& start_path) {
-	return Find_File().Find_Internal(file_name, start_path);
+	set<string> file_names;
+	map<string, string> found;
+
+	file_names.insert(file_name);
+	Find(file_names, start_path, &found);
+	map<string, string>::iterator it = found.find(file_name);
+	return it == found.end() ? "" : it->second;
+}
+
+void Find_File::Find(const set<string>& file_names, const string& start_path, map<string, string>* found) {
+	found->clear();
+	if (!file_names.empty())
+		Find_File(file_names, found).Search_Dir(start_path);
 }
 
-Find_File::Find_File() {
+Find_File::Find_File(const set<string>& file_names, map<string, string>* found) : targets(file_names), results(found) {
 }
 
-string Find_File::Find_Internal(const string& filename, const string& starting_path) {
+bool Find_File::Search_Dir(const string& path) {
+	int dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		LOGINFO("Find_File: Error opening '%s'\n", path.c_str());
+		return false;
+	}
+	return Find_Internal(dir_fd, path);
+}
+
+// Takes ownership of dir_fd. Returns true once every target was found.
+bool Find_File::Find_Internal(int dir_fd, const string& path) {
 	DIR *d;
-	string new_path, return_path;
+	struct stat st;
 	vector<string> dirs;
 	vector<string> symlinks;
 	unsigned index;
 
-	// Check to see if we have already searched this directory to prevent infinite loops
-	if (std::find(searched_dirs.begin(), searched_dirs.end(), starting_path) != searched_dirs.end()) {
-		return "";
+	// Check to see if we have already searched this directory to prevent
+	// infinite loops, symlinks can lead back to a folder under another name
+	if (fstat(dir_fd, &st) != 0 || !searched_dirs.insert(make_pair(st.st_dev, st.st_ino)).second) {
+		close(dir_fd);
+		return false;
 	}
-	searched_dirs.push_back(starting_path);
 
-	d = opendir(starting_path.c_str());
+	d = fdopendir(dir_fd);
 	if (d == NULL) {
-		LOGINFO("Find_File: Error opening '%s'\n", starting_path.c_str());
-		return "";
+		LOGINFO("Find_File: Error opening '%s'\n", path.c_str());
+		close(dir_fd);
+		return false;
 	}
 
 	struct dirent *p;
 	while ((p = readdir(d))) {
 		if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
 			continue;
-		new_path = starting_path + "/";
-		new_path.append(p->d_name);
-		if (p->d_type == DT_DIR) {
+		unsigned char type = p->d_type;
+		if (type == DT_UNKNOWN) {
+			if (fstatat(dirfd(d), p->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+				continue;
+			if (S_ISDIR(st.st_mode))
+				type = DT_DIR;
+			else if (S_ISLNK(st.st_mode))
+				type = DT_LNK;
+			else if (S_ISREG(st.st_mode))
+				type = DT_REG;
+		}
+		if (type == DT_DIR) {
 			// Add dir to search list for later
-			dirs.push_back(new_path);
-		} else if (p->d_type == DT_LNK) {
+			dirs.push_back(p->d_name);
+		} else if (type == DT_LNK) {
 			// Add symlink to search list for later
-			symlinks.push_back(new_path);
-		} else if (p->d_type == DT_REG && filename == p->d_name) {
+			symlinks.push_back(p->d_name);
+		} else if (type == DT_REG && targets.count(p->d_name) && !results->count(p->d_name)) {
 			// We found a match!
-			closedir(d);
-			return new_path;
+			(*results)[p->d_name] = path + "/" + p->d_name;
+			if (results->size() == targets.size()) {
+				closedir(d);
+				return true;
+			}
 		}
 	}
-	closedir(d);
 
-	// Scan real directories first if no match found in this path
+	// Scan real directories first if not everything was found in this path,
+	// opening them relative to this one saves the kernel the path lookup
 	for (index = 0; index < dirs.size(); index++) {
-		return_path = Find_Internal(filename, dirs.at(index));
-		if (!return_path.empty()) return return_path;
+		int fd = openat(dirfd(d), dirs.at(index).c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd >= 0 && Find_Internal(fd, path + "/" + dirs.at(index))) {
+			closedir(d);
+			return true;
+		}
 	}
+	closedir(d);
+
 	// Scan symlinks after scanning real directories
 	for (index = 0; index < symlinks.size(); index++) {
 		char buf[PATH_MAX];
 		// Resolve symlink to a real path
-		char* ret = realpath(symlinks.at(index).c_str(), buf);
-		if (ret) {
-			return_path = Find_Internal(filename, buf);
-			if (!return_path.empty()) return return_path;
-		}
+		char* ret = realpath((path + "/" + symlinks.at(index)).c_str(), buf);
+		if (ret && Search_Dir(buf))
+			return true;
 	}
-	return "";
+	return false;
 }
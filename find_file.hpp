@@ -19,8 +19,11 @@
 #ifndef Find_File_HPP
 #define Find_File_HPP
 
+#include <map>
+#include <set>
 #include <string>
-#include <vector>
+#include <unordered_set>
+#include <sys/types.h>
 
 using namespace std;
 
@@ -28,10 +31,23 @@ class Find_File {
 
 public:
 	static string Find(const string& file_name, const string& start_path);
+	// Looks for several files in one walk, found gets the first match of
+	// each name and the walk stops as soon as every name was found
+	static void Find(const set<string>& file_names, const string& start_path, map<string, string>* found);
 private:
-	Find_File();
-	string Find_Internal(const string& filename, const string& starting_path);
-	vector<string> searched_dirs;
+	Find_File(const set<string>& file_names, map<string, string>* found);
+	bool Find_Internal(int dir_fd, const string& path);
+	bool Search_Dir(const string& path);
+
+	struct Dir_Hash {
+		size_t operator()(const pair<dev_t, ino_t>& dir) const {
+			return (size_t)(dir.second * 31 + dir.first);
+		}
+	};
+
+	const set<string>& targets;
+	map<string, string>* results;
+	unordered_set<pair<dev_t, ino_t>, Dir_Hash> searched_dirs;
 };
 
 #endif
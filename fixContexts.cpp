@@ -17,7 +17,11 @@
 */
 
 #include <string>
+#include <map>
+#include <vector>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
@@ -25,65 +29,135 @@
 #include "fixContexts.hpp"
 #include "twrp-functions.hpp"
 #include "twcommon.h"
+#include "twrpSELabel.hpp"
 #include <selinux/selinux.h>
-#include <selinux/label.h>
-#include <selinux/android.h>
-#include <selinux/label.h>
 
 using namespace std;
 
-struct selabel_handle *sehandle;
-struct selinux_opt selinux_options[] = {
-	{ SELABEL_OPT_PATH, "/file_contexts" }
+// The log is shared by the relabel threads
+static pthread_mutex_t label_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define RELABEL_MAX_THREADS 8
+
+struct relabel_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	vector<string> dirs;	// used as a stack so the walk stays depth first
+	int busy;		// threads currently scanning a directory
 };
 
-int fixContexts::restorecon(string entry, struct stat *sb) {
-	char *oldcontext, *newcontext;
+int fixContexts::restorecon(const string& entry, mode_t mode, const char *newcontext) {
+	char *oldcontext;
+	string lookedup;
 
 	if (lgetfilecon(entry.c_str(), &oldcontext) < 0) {
 		LOGINFO("Couldn't get selinux context for %s\n", entry.c_str());
 		return -1;
 	}
-	if (selabel_lookup(sehandle, &newcontext, entry.c_str(), sb->st_mode) < 0) {
-		LOGINFO("Couldn't lookup selinux context for %s\n", entry.c_str());
-		return -1;
+	if (!newcontext) {
+		if (!twrpSELabel::Lookup(entry, mode, &lookedup)) {
+			LOGINFO("Couldn't lookup selinux context for %s\n", entry.c_str());
+			freecon(oldcontext);
+			return -1;
+		}
+		newcontext = lookedup.c_str();
 	}
 	if (strcmp(oldcontext, newcontext) != 0) {
+		pthread_mutex_lock(&label_lock);
 		LOGINFO("Relabeling %s from %s to %s\n", entry.c_str(), oldcontext, newcontext);
+		pthread_mutex_unlock(&label_lock);
 		if (lsetfilecon(entry.c_str(), newcontext) < 0) {
+			pthread_mutex_lock(&label_lock);
 			LOGINFO("Couldn't label %s with %s: %s\n", entry.c_str(), newcontext, strerror(errno));
+			pthread_mutex_unlock(&label_lock);
 		}
 	}
 	freecon(oldcontext);
-	freecon(newcontext);
 	return 0;
 }
 
-int fixContexts::fixContextsRecursively(string name, int level) {
-	DIR *d;
+// Relabels the entries of one directory and returns its subdirectories.
+// file_contexts does not tell media entries apart by name, so the label
+// service looks the label up once per file type in each directory and
+// shares it with the siblings.
+void fixContexts::relabelDir(const string& dir, vector<string>& subdirs) {
+	int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dirfd < 0)
+		return;
+	DIR *d = fdopendir(dirfd);
+	if (!d) {
+		close(dirfd);
+		return;
+	}
+
 	struct dirent *de;
 	struct stat sb;
-	string path;
-
-	if (!(d = opendir(name.c_str())))
-		return -1;
-	if (!(de = readdir(d)))
-		return -1;
-
-	do {
-		if (de->d_type ==  DT_DIR) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
-				continue;
-			path = name + "/" + de->d_name;
-			restorecon(path, &sb);
-			fixContextsRecursively(path, level + 1);
-		}
-		else {
-			path = name + "/" + de->d_name;
-			restorecon(path, &sb);
+	string path, context;
+	while ((de = readdir(d))) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (fstatat(dirfd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+		path = dir + "/" + de->d_name;
+		if (!twrpSELabel::Lookup_Entry(dir, de->d_name, sb.st_mode, &context)) {
+			LOGINFO("Couldn't lookup selinux context for %s\n", path.c_str());
+			continue;
 		}
-	} while ((de = readdir(d)));
+		restorecon(path, sb.st_mode, context.c_str());
+		if (S_ISDIR(sb.st_mode))
+			subdirs.push_back(path);
+	}
 	closedir(d);
+}
+
+void *fixContexts::relabelThread(void *cookie) {
+	relabel_queue *queue = (relabel_queue*)cookie;
+	vector<string> subdirs;
+
+	pthread_mutex_lock(&queue->lock);
+	for (;;) {
+		while (queue->dirs.empty() && queue->busy > 0)
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		if (queue->dirs.empty())
+			break;	// nothing queued and nobody left to queue more
+		string dir = queue->dirs.back();
+		queue->dirs.pop_back();
+		queue->busy++;
+		pthread_mutex_unlock(&queue->lock);
+
+		subdirs.clear();
+		relabelDir(dir, subdirs);
+
+		pthread_mutex_lock(&queue->lock);
+		queue->dirs.insert(queue->dirs.end(), subdirs.rbegin(), subdirs.rend());
+		queue->busy--;
+		pthread_cond_broadcast(&queue->cond);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return NULL;
+}
+
+int fixContexts::fixContextsRecursively(string name, int level __unused) {
+	relabel_queue queue;
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.cond, NULL);
+	queue.dirs.push_back(name);
+	queue.busy = 0;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int thread_count = cpus < 1 ? 1 : (cpus > RELABEL_MAX_THREADS ? RELABEL_MAX_THREADS : (int)cpus);
+	vector<pthread_t> threads;
+	for (int i = 1; i < thread_count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, relabelThread, &queue) == 0)
+			threads.push_back(thread);
+	}
+	relabelThread(&queue);	// this thread walks too
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&queue.cond);
+	pthread_mutex_destroy(&queue.lock);
 	return 0;
 }
 
@@ -94,9 +168,8 @@ int fixContexts::fixDataMediaContexts(string Mount_Point) {
 
 	LOGINFO("Fixing media contexts on '%s'\n", Mount_Point.c_str());
 
-	sehandle = selabel_open(SELABEL_CTX_FILE, selinux_options, 1);
-	if (!sehandle) {
-		LOGINFO("Unable to open /file_contexts\n");
+	if (!twrpSELabel::Handle()) {
+		LOGINFO("No file contexts loaded\n");
 		return 0;
 	}
 
@@ -128,18 +201,19 @@ int fixContexts::fixDataMediaContexts(string Mount_Point) {
 			if (is_numeric) {
 				dir = Mount_Point + "/media/";
 				dir += de->d_name;
-				restorecon(dir, &sb);
+				if (lstat(dir.c_str(), &sb) == 0)
+					restorecon(dir, sb.st_mode);
 				fixContextsRecursively(dir, 0);
 			}
 		} while ((de = readdir(d)));
 		closedir(d);
 	} else if (TWFunc::Path_Exists(Mount_Point + "/media")) {
-		restorecon(Mount_Point + "/media", &sb);
+		if (lstat((Mount_Point + "/media").c_str(), &sb) == 0)
+			restorecon(Mount_Point + "/media", sb.st_mode);
 		fixContextsRecursively(Mount_Point + "/media", 0);
 	} else {
 		LOGINFO("fixDataMediaContexts: %s/media does not exist!\n", Mount_Point.c_str());
 		return 0;
 	}
-	selabel_close(sehandle);
 	return 0;
 }
@@ -20,6 +20,8 @@
 #define __FIXCONTEXTS_HPP
 
 #include <string>
+#include <vector>
+#include <sys/types.h>
 
 using namespace std;
 
@@ -28,7 +30,9 @@ class fixContexts {
 		static int fixDataMediaContexts(string Mount_Point);
 
 	private:
-		static int restorecon(string entry, struct stat *sb);
+		static int restorecon(const string& entry, mode_t mode, const char *newcontext = NULL);
+		static void relabelDir(const string& dir, vector<string>& subdirs);
+		static void *relabelThread(void *cookie);
 		static int fixContextsRecursively(string path, int level);
 };
 
@@ -27,8 +27,6 @@
 
 #include <functional>
 
-#include <android-base/file.h>
-
 #include "fuse_sideload.h"
 
 struct file_data {
@@ -38,17 +36,22 @@ struct file_data {
   uint32_t block_size;
 };
 
+// The blocks are copied into the sideload cache and hashed there, a block served straight from a
+// mapping of the package could change between the hash check and the reply. The prefetch of
+// fuse_sideload asks for the blocks ahead in order, with the file marked sequential the kernel
+// reads the card ahead in large requests and these reads come from the page cache.
 static int read_block_file(const file_data& fd, uint32_t block, uint8_t* buffer,
                            uint32_t fetch_size) {
   off64_t offset = static_cast<off64_t>(block) * fd.block_size;
-  if (TEMP_FAILURE_RETRY(lseek64(fd.fd, offset, SEEK_SET)) == -1) {
-    fprintf(stderr, "seek on sdcard failed: %s\n", strerror(errno));
-    return -EIO;
-  }
-
-  if (!android::base::ReadFully(fd.fd, buffer, fetch_size)) {
-    fprintf(stderr, "read on sdcard failed: %s\n", strerror(errno));
-    return -EIO;
+  uint32_t done = 0;
+  while (done < fetch_size) {
+    ssize_t n = TEMP_FAILURE_RETRY(pread64(fd.fd, buffer + done, fetch_size - done, offset + done));
+    if (n <= 0) {
+      fprintf(stderr, "read on sdcard failed: %s\n",
+              n == 0 ? "unexpected end of file" : strerror(errno));
+      return -EIO;
+    }
+    done += n;
   }
 
   return 0;
@@ -62,11 +65,14 @@ bool start_sdcard_fuse(const char* path) {
   }
 
   file_data fd;
-  fd.fd = open(path, O_RDONLY);
+  fd.fd = open(path, O_RDONLY | O_CLOEXEC);
   if (fd.fd == -1) {
     fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
     return false;
   }
+  // Doubles the readahead window of the file, the package is read front to back but for the zip
+  // central directory
+  posix_fadvise(fd.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
   fd.file_size = sb.st_size;
   fd.block_size = 65536;
 
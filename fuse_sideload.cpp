@@ -40,6 +40,19 @@
 // Note that only the minimal set of file operations needed for these
 // two files is implemented.  In particular, you can't opendir() or
 // readdir() on the "/sideload" directory; ls on it won't work.
+//
+// Every fetch from the host is a round trip over adb, so verified blocks
+// are kept in a small LRU cache.  While the package is read sequentially
+// a background thread fetches the next few blocks ahead of the reader,
+// the window doubling with every sequential block up to
+// FUSE_PREFETCH_MAX_BLOCKS.  Prefetched blocks go through the same hash
+// check as any other fetch.  Reads of up to FUSE_SIDELOAD_MAX_READ are
+// answered from all the cached blocks they cover with a single writev().
+//
+// A provider that can split a fetch into sending the request and receiving
+// the answer gets the whole prefetch window requested at once.  Answers
+// come back in request order, whichever thread needs one next reads the
+// oldest, so the link never waits for a round trip per block.
 
 #include "fuse_sideload.h"
 
@@ -78,6 +91,45 @@ static constexpr uint64_t EXIT_FLAG_ID = FUSE_ROOT_ID + 2;
 static constexpr int NO_STATUS = 1;
 static constexpr int NO_STATUS_EXIT = 2;
 
+static constexpr uint32_t NO_BLOCK = UINT32_MAX;
+
+// The cache holds up to FUSE_CACHE_MAX_BLOCKS blocks and FUSE_CACHE_BYTES of data, but never
+// fewer than FUSE_CACHE_MIN_BLOCKS so a read spanning two blocks and the prefetcher always fit.
+static constexpr uint32_t FUSE_CACHE_MAX_BLOCKS = 32;
+static constexpr uint32_t FUSE_CACHE_MIN_BLOCKS = 4;
+static constexpr uint32_t FUSE_CACHE_BYTES = 8 << 20;
+static constexpr uint32_t FUSE_PREFETCH_MAX_BLOCKS = 16;
+
+// Largest read the kernel is asked to send, limited further so a reply and the prefetcher fit in
+// the cache together. Above 128 KiB this needs a kernel with FUSE protocol 7.28.
+static constexpr uint32_t FUSE_SIDELOAD_MAX_READ = 1 << 20;
+static constexpr uint32_t FUSE_PAGE_SIZE = 4096;
+static constexpr uint32_t FUSE_MAX_PAGES_FLAG = 1 << 22;  // FUSE_MAX_PAGES from protocol 7.28
+
+// fuse_init_out as of protocol 7.28, which added max_pages. Only sent to kernels that know it.
+struct fuse_init_out_7_28 {
+  fuse_init_out base;
+  uint32_t time_gran;
+  uint16_t max_pages;
+  uint16_t padding;
+  uint32_t unused[8];
+};
+
+enum cache_state {
+  CACHE_EMPTY,
+  CACHE_LOADING,  // being fetched from the host, wait on fuse_data::cond
+  CACHE_READY,
+};
+
+struct cache_entry {
+  uint32_t block;
+  cache_state state;
+  uint32_t pins;       // reads that are replying from this entry, it can't be evicted
+  uint64_t last_used;  // fuse_data::cache_tick when last used, 0 if empty
+  bool requested;      // the request was sent and is answered in order, pipelined providers only
+  uint8_t* data;
+};
+
 using SHA256Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
 
 #ifndef MIN
@@ -97,13 +149,35 @@ struct fuse_data {
   uid_t uid;
   gid_t gid;
 
-  uint32_t curr_block;  // cache the block most recently read from the host
-  uint8_t* block_data;
+  cache_entry* cache;  // blocks most recently read from the host
+  uint32_t cache_blocks;
+  uint64_t cache_tick;
 
-  uint8_t* extra_block;  // another block of storage for reads that span two blocks
+  uint8_t* zero_block;  // returned for blocks past the end of the file
+
+  uint32_t max_read;      // largest read request, a multiple of FUSE_PAGE_SIZE
+  struct iovec* reply;    // header plus one entry per block a read can cover
+  uint32_t prefetch_max;  // prefetch window limit, what is left of the cache after a reply
 
   uint8_t* hashes;        // SHA-256 hash of each block (all zeros
                           // if block hasn't been read yet)
+
+  pthread_mutex_t lock;     // protects the cache and the prefetch window
+  pthread_cond_t cond;      // an entry finished loading or was released, or the window moved
+  pthread_mutex_t io_lock;  // vtab.read_block is one request at a time, sending and the queue below
+  pthread_mutex_t recv_lock;  // one thread at a time receives the oldest answer
+  cache_entry** inflight;     // entries requested from the host, oldest first, a ring of cache_blocks
+  uint32_t inflight_head;
+  uint32_t inflight_count;
+  int io_error;               // the host link failed, every later fetch fails with it
+  pthread_t prefetch_thread;
+  bool prefetch_running;
+  bool prefetch_stop;
+
+  uint32_t last_block;     // last block requested by the kernel
+  uint32_t seq_run;        // number of sequential blocks requested in a row
+  uint32_t prefetch_next;  // next block for the prefetch thread
+  uint32_t prefetch_end;   // the prefetch thread stops before this block
 };
 
 static void fuse_reply(const fuse_data* fd, uint64_t unique, const void* data, size_t len) {
@@ -155,6 +229,17 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   out.max_background = 32;
   out.congestion_threshold = 32;
   out.max_write = 4096;
+
+  // Without max_pages the kernel splits reads into 32 pages no matter what max_read says.
+  if (req->minor >= 28 && (req->flags & FUSE_MAX_PAGES_FLAG)) {
+    fuse_init_out_7_28 out_7_28;
+    memset(&out_7_28, 0, sizeof(out_7_28));
+    out_7_28.base = out;
+    out_7_28.base.flags |= FUSE_MAX_PAGES_FLAG;
+    out_7_28.max_pages = fd->max_read / FUSE_PAGE_SIZE;
+    fuse_reply(fd, hdr->unique, &out_7_28, sizeof(out_7_28));
+    return NO_STATUS;
+  }
   fuse_reply(fd, hdr->unique, &out, fuse_struct_size);
 
   return NO_STATUS;
@@ -237,44 +322,74 @@ static int handle_release(void* /* data */, fuse_data* /* fd */, const fuse_in_h
   return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(fuse_data* fd, uint32_t block) {
-  if (block == fd->curr_block) {
-    return 0;
+// Returns the cache entry holding or loading block, nullptr if there is none. Called with
+// fd->lock held.
+static cache_entry* find_entry(fuse_data* fd, uint32_t block) {
+  for (uint32_t i = 0; i < fd->cache_blocks; ++i) {
+    if (fd->cache[i].state != CACHE_EMPTY && fd->cache[i].block == block) {
+      return &fd->cache[i];
+    }
   }
+  return nullptr;
+}
 
-  if (block >= fd->file_blocks) {
-    memset(fd->block_data, 0, fd->block_size);
-    fd->curr_block = block;
-    return 0;
+// Takes the least recently used entry that isn't in use and marks it as loading block. Returns
+// nullptr if every entry is in use. Called with fd->lock held.
+static cache_entry* claim_entry(fuse_data* fd, uint32_t block) {
+  cache_entry* victim = nullptr;
+  for (uint32_t i = 0; i < fd->cache_blocks; ++i) {
+    cache_entry* entry = &fd->cache[i];
+    if (entry->state == CACHE_LOADING || entry->pins != 0) continue;
+    if (victim == nullptr || entry->last_used < victim->last_used) victim = entry;
   }
-
-  size_t fetch_size = fd->block_size;
-  if (block * fd->block_size + fetch_size > fd->file_size) {
-    // If we're reading the last (partial) block of the file, expect a shorter response from the
-    // host, and pad the rest of the block with zeroes.
-    fetch_size = fd->file_size - (block * fd->block_size);
-    memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+  if (victim != nullptr) {
+    victim->block = block;
+    victim->state = CACHE_LOADING;
   }
+  return victim;
+}
 
-  int result = fd->vtab.read_block(block, fd->block_data, fetch_size);
-  if (result < 0) return result;
+// Marks a claimed entry as ready, or empties it if loading failed. Called with fd->lock held.
+static void finish_entry(fuse_data* fd, cache_entry* entry, int result) {
+  entry->requested = false;
+  if (result == 0) {
+    entry->state = CACHE_READY;
+    entry->last_used = ++fd->cache_tick;
+  } else {
+    entry->state = CACHE_EMPTY;
+    entry->block = NO_BLOCK;
+    entry->last_used = 0;
+  }
+  pthread_cond_broadcast(&fd->cond);
+}
 
-  fd->curr_block = block;
+// Returns how much of block the host sends. If we're reading the last (partial) block of the
+// file, expect a shorter response from the host, and pad the rest of the block with zeroes.
+static uint32_t fetch_size(const fuse_data* fd, uint32_t block, uint8_t* data) {
+  uint32_t size = fd->block_size;
+  if (block * fd->block_size + size > fd->file_size) {
+    size = fd->file_size - (block * fd->block_size);
+    memset(data + size, 0, fd->block_size - size);
+  }
+  return size;
+}
 
+// Check a block just fetched from the host against the hash of its first read.
+static int verify_block(fuse_data* fd, uint32_t block, const uint8_t* data) {
   // Verify the hash of the block we just got from the host.
   //
   // - If the hash of the just-received data matches the stored hash for the block, accept it.
   // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
   //   time we've read this block).
   // - Otherwise, return -EINVAL for the read.
+  //
+  // An entry is only loaded by one thread at a time, so nothing else touches this block's hash.
 
   uint8_t hash[SHA256_DIGEST_LENGTH];
 #ifdef USE_MINCRYPT
-  SHA256_hash(fd->block_data, fd->block_size, hash);
+  SHA256_hash(data, fd->block_size, hash);
 #else
-  SHA256(fd->block_data, fd->block_size, hash);
+  SHA256(data, fd->block_size, hash);
 #endif
   uint8_t* blockhash = fd->hashes + block * SHA256_DIGEST_LENGTH;
   if (memcmp(hash, blockhash, SHA256_DIGEST_LENGTH) == 0) {
@@ -284,7 +399,6 @@ static int fetch_block(fuse_data* fd, uint32_t block) {
   int i;
   for (i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
     if (blockhash[i] != 0) {
-      fd->curr_block = -1;
       return -EIO;
     }
   }
@@ -293,6 +407,251 @@ static int fetch_block(fuse_data* fd, uint32_t block) {
   return 0;
 }
 
+// Fetch a block from the host into data and check it.
+// Returns 0 on successful fetch, negative otherwise.
+static int load_block(fuse_data* fd, uint32_t block, uint8_t* data) {
+  uint32_t size = fetch_size(fd, block, data);
+
+  pthread_mutex_lock(&fd->io_lock);
+  int result = fd->vtab.read_block(block, data, size);
+  pthread_mutex_unlock(&fd->io_lock);
+  if (result < 0) return result;
+  return verify_block(fd, block, data);
+}
+
+// Asks the host for the block a claimed entry is loading and queues the entry for the answer.
+// On failure the entry is finished with the error.
+static int request_block(fuse_data* fd, cache_entry* entry) {
+  pthread_mutex_lock(&fd->io_lock);
+  int result = fd->io_error;
+  if (result == 0) {
+    result = fd->vtab.request_block(entry->block);
+    if (result == 0) {
+      fd->inflight[(fd->inflight_head + fd->inflight_count) % fd->cache_blocks] = entry;
+      fd->inflight_count++;
+    } else {
+      fd->io_error = result;
+    }
+  }
+  pthread_mutex_unlock(&fd->io_lock);
+
+  pthread_mutex_lock(&fd->lock);
+  if (result == 0) {
+    // The answer may already be in if another thread was receiving.
+    if (entry->state == CACHE_LOADING) entry->requested = true;
+    pthread_cond_broadcast(&fd->cond);
+  } else {
+    finish_entry(fd, entry, result);
+  }
+  pthread_mutex_unlock(&fd->lock);
+  return result;
+}
+
+// Receives the oldest outstanding answer into its entry. Called with fd->recv_lock held.
+static void receive_block(fuse_data* fd) {
+  pthread_mutex_lock(&fd->io_lock);
+  if (fd->inflight_count == 0) {
+    pthread_mutex_unlock(&fd->io_lock);
+    return;
+  }
+  cache_entry* entry = fd->inflight[fd->inflight_head];
+  fd->inflight_head = (fd->inflight_head + 1) % fd->cache_blocks;
+  fd->inflight_count--;
+  int result = fd->io_error;
+  pthread_mutex_unlock(&fd->io_lock);
+
+  if (result == 0) {
+    result = fd->vtab.receive_block(entry->data, fetch_size(fd, entry->block, entry->data));
+    if (result < 0) {
+      // Nothing after a lost answer can be matched to its request any more.
+      pthread_mutex_lock(&fd->io_lock);
+      fd->io_error = result;
+      pthread_mutex_unlock(&fd->io_lock);
+    } else {
+      result = verify_block(fd, entry->block, entry->data);
+    }
+  }
+
+  pthread_mutex_lock(&fd->lock);
+  finish_entry(fd, entry, result);
+  pthread_mutex_unlock(&fd->lock);
+}
+
+// Waits for a requested entry to finish loading, receiving answers while it is outstanding.
+// Returns with fd->lock held.
+static void wait_requested(fuse_data* fd, cache_entry* entry) {
+  pthread_mutex_lock(&fd->lock);
+  for (;;) {
+    if (entry->state != CACHE_LOADING) return;
+    if (!entry->requested) {
+      // Claimed by the prefetch thread, which hasn't sent the request yet.
+      pthread_cond_wait(&fd->cond, &fd->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&fd->lock);
+    pthread_mutex_lock(&fd->recv_lock);
+    pthread_mutex_lock(&fd->lock);
+    bool loading = entry->state == CACHE_LOADING;
+    pthread_mutex_unlock(&fd->lock);
+    if (loading) receive_block(fd);
+    pthread_mutex_unlock(&fd->recv_lock);
+    pthread_mutex_lock(&fd->lock);
+  }
+}
+
+// fetch_block() for pipelined providers. entry is loading block, pinned by the caller, and
+// fd->lock is held. The pin is dropped again if the block couldn't be loaded.
+static int fetch_requested(fuse_data* fd, cache_entry* entry, bool claimed, uint8_t** data) {
+  pthread_mutex_unlock(&fd->lock);
+  if (claimed) request_block(fd, entry);
+  wait_requested(fd, entry);
+
+  int result = 0;
+  if (entry->state == CACHE_READY) {
+    entry->last_used = ++fd->cache_tick;
+    *data = entry->data;
+  } else {
+    result = -EIO;
+    if (--entry->pins == 0) pthread_cond_broadcast(&fd->cond);
+  }
+  pthread_mutex_unlock(&fd->lock);
+  return result;
+}
+
+// Make a block available in the cache and set *data to it. The entry stays pinned until
+// release_block() so the reply can be sent straight from it.
+// Returns 0 on successful fetch, negative otherwise.
+static int fetch_block(fuse_data* fd, uint32_t block, uint8_t** data) {
+  if (block >= fd->file_blocks) {
+    *data = fd->zero_block;
+    return 0;
+  }
+
+  pthread_mutex_lock(&fd->lock);
+  cache_entry* entry;
+  for (;;) {
+    entry = find_entry(fd, block);
+    if (entry != nullptr && entry->state == CACHE_READY) {
+      entry->pins++;
+      entry->last_used = ++fd->cache_tick;
+      *data = entry->data;
+      pthread_mutex_unlock(&fd->lock);
+      return 0;
+    }
+    if (entry != nullptr && fd->vtab.request_block) {
+      // The prefetch thread is fetching this block, help receiving the answers before it.
+      entry->pins++;
+      return fetch_requested(fd, entry, false, data);
+    }
+    // Either the prefetch thread is already fetching this block or every entry is in use.
+    if (entry == nullptr) {
+      entry = claim_entry(fd, block);
+      if (entry != nullptr && fd->vtab.request_block) {
+        entry->pins++;
+        return fetch_requested(fd, entry, true, data);
+      }
+      if (entry != nullptr) break;
+    }
+    pthread_cond_wait(&fd->cond, &fd->lock);
+  }
+  pthread_mutex_unlock(&fd->lock);
+
+  int result = load_block(fd, block, entry->data);
+
+  pthread_mutex_lock(&fd->lock);
+  finish_entry(fd, entry, result);
+  if (result == 0) {
+    entry->pins++;
+    *data = entry->data;
+  }
+  pthread_mutex_unlock(&fd->lock);
+  return result;
+}
+
+static void release_block(fuse_data* fd, uint32_t block) {
+  if (block >= fd->file_blocks) return;
+
+  pthread_mutex_lock(&fd->lock);
+  cache_entry* entry = find_entry(fd, block);
+  if (entry != nullptr && entry->pins > 0 && --entry->pins == 0) {
+    pthread_cond_broadcast(&fd->cond);
+  }
+  pthread_mutex_unlock(&fd->lock);
+}
+
+// Moves the prefetch window after the kernel asked for first to block. The window grows while the
+// reads stay sequential and closes on a seek, e.g. when the zip central directory is looked up.
+static void update_prefetch(fuse_data* fd, uint32_t first, uint32_t block) {
+  pthread_mutex_lock(&fd->lock);
+  if (first == fd->last_block + 1 || (first == fd->last_block && block != first)) {
+    fd->seq_run++;
+  } else if (first != fd->last_block) {
+    fd->seq_run = 0;
+  }
+  fd->last_block = block;
+
+  uint32_t window = 0;
+  if (fd->seq_run > 0) {
+    window = 1U << MIN(fd->seq_run - 1, 5U);
+    window = MIN(window, fd->prefetch_max);
+  }
+  uint32_t end = (block + 1 + window < fd->file_blocks) ? block + 1 + window : fd->file_blocks;
+  if (window == 0 || block + 1 >= end) {
+    fd->prefetch_end = fd->prefetch_next;
+  } else {
+    if (fd->prefetch_next <= block || fd->prefetch_next > end) fd->prefetch_next = block + 1;
+    fd->prefetch_end = end;
+    pthread_cond_broadcast(&fd->cond);
+  }
+  pthread_mutex_unlock(&fd->lock);
+}
+
+static void* prefetch_thread(void* cookie) {
+  fuse_data* fd = static_cast<fuse_data*>(cookie);
+
+  pthread_mutex_lock(&fd->lock);
+  while (!fd->prefetch_stop) {
+    if (fd->prefetch_next >= fd->prefetch_end) {
+      if (fd->vtab.request_block) {
+        pthread_mutex_lock(&fd->io_lock);
+        bool waiting = fd->inflight_count > 0;
+        pthread_mutex_unlock(&fd->io_lock);
+        if (waiting) {
+          // The whole window is requested, collect the answers as they come in.
+          pthread_mutex_unlock(&fd->lock);
+          pthread_mutex_lock(&fd->recv_lock);
+          receive_block(fd);
+          pthread_mutex_unlock(&fd->recv_lock);
+          pthread_mutex_lock(&fd->lock);
+          continue;
+        }
+      }
+      pthread_cond_wait(&fd->cond, &fd->lock);
+      continue;
+    }
+    uint32_t block = fd->prefetch_next++;
+    if (find_entry(fd, block) != nullptr) continue;
+    // Never wait for room, the reader needs it more than the prefetcher.
+    cache_entry* entry = claim_entry(fd, block);
+    if (entry == nullptr) continue;
+    pthread_mutex_unlock(&fd->lock);
+
+    if (fd->vtab.request_block) {
+      // Sent without waiting, the next blocks of the window follow right away.
+      request_block(fd, entry);
+      pthread_mutex_lock(&fd->lock);
+      continue;
+    }
+
+    int result = load_block(fd, block, entry->data);
+
+    pthread_mutex_lock(&fd->lock);
+    finish_entry(fd, entry, result);
+  }
+  pthread_mutex_unlock(&fd->lock);
+  return nullptr;
+}
+
 static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   if (hdr->nodeid != PACKAGE_FILE_ID) return -ENOENT;
 
@@ -308,54 +667,50 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   // past the end of the file so we're always returning exactly as many bytes as were requested.
   // (Users of the mapped file have to know its real length anyway.)
 
+  if (size > fd->max_read) return -EINVAL;
+
   fuse_out_header outhdr;
   outhdr.len = sizeof(outhdr) + size;
   outhdr.error = 0;
   outhdr.unique = hdr->unique;
 
-  struct iovec vec[3];
+  struct iovec* vec = fd->reply;
   vec[0].iov_base = &outhdr;
   vec[0].iov_len = sizeof(outhdr);
 
-  uint32_t block = offset / fd->block_size;
-  int result = fetch_block(fd, block);
-  if (result != 0) return result;
-
-  // Two cases:
-  //
-  //   - the read request is entirely within this block. In this case we can reply immediately.
-  //
-  //   - the read request goes over into the next block. Note that since we mount the filesystem
-  //     with max_read=block_size, a read can never span more than two blocks. In this case we copy
-  //     the block to extra_block and issue a fetch for the following block.
+  // The reply is sent straight from the cache entries of every block the read covers, they stay
+  // pinned until writev() is done. Since max_read leaves room for the prefetcher, fetching them
+  // never waits for each other.
 
+  uint32_t block = offset / fd->block_size;
   uint32_t block_offset = offset - (block * fd->block_size);
+  uint32_t blocks = 0;
+  uint32_t remaining = size;
+  int result = 0;
+
+  while (remaining > 0 || blocks == 0) {
+    uint8_t* block_data;
+    result = fetch_block(fd, block + blocks, &block_data);
+    if (result != 0) break;
+    uint32_t len = MIN(remaining, fd->block_size - block_offset);
+    vec[blocks + 1].iov_base = block_data + block_offset;
+    vec[blocks + 1].iov_len = len;
+    remaining -= len;
+    block_offset = 0;
+    blocks++;
+  }
 
-  int vec_used;
-  if (size + block_offset <= fd->block_size) {
-    // First case: the read fits entirely in the first block.
-
-    vec[1].iov_base = fd->block_data + block_offset;
-    vec[1].iov_len = size;
-    vec_used = 2;
-  } else {
-    // Second case: the read spills over into the next block.
-
-    memcpy(fd->extra_block, fd->block_data + block_offset, fd->block_size - block_offset);
-    vec[1].iov_base = fd->extra_block;
-    vec[1].iov_len = fd->block_size - block_offset;
+  if (result == 0) {
+    if (fd->prefetch_running) update_prefetch(fd, block, block + blocks - 1);
 
-    result = fetch_block(fd, block + 1);
-    if (result != 0) return result;
-    vec[2].iov_base = fd->block_data;
-    vec[2].iov_len = size - vec[1].iov_len;
-    vec_used = 3;
+    if (writev(fd->ffd, vec, blocks + 1) == -1) {
+      printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
+    }
   }
-
-  if (writev(fd->ffd, vec, vec_used) == -1) {
-    printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
+  for (uint32_t i = 0; i < blocks; ++i) {
+    release_block(fd, block + i);
   }
-  return NO_STATUS;
+  return (result == 0) ? NO_STATUS : result;
 }
 
 int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
@@ -399,20 +754,58 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
   fd.uid = getuid();
   fd.gid = getgid();
 
-  fd.curr_block = -1;
-  fd.block_data = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.block_data == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
+  pthread_mutex_init(&fd.lock, nullptr);
+  pthread_cond_init(&fd.cond, nullptr);
+  pthread_mutex_init(&fd.io_lock, nullptr);
+  pthread_mutex_init(&fd.recv_lock, nullptr);
+  fd.last_block = NO_BLOCK;
+
+  fd.cache_blocks = MIN(FUSE_CACHE_MAX_BLOCKS, MAX(FUSE_CACHE_MIN_BLOCKS, FUSE_CACHE_BYTES / block_size));
+  fd.cache = static_cast<cache_entry*>(calloc(fd.cache_blocks, sizeof(cache_entry)));
+  if (fd.cache == nullptr) {
+    fprintf(stderr, "failed to allocate %u cache entries\n", fd.cache_blocks);
+    result = -1;
+    goto done;
+  }
+  for (uint32_t i = 0; i < fd.cache_blocks; ++i) {
+    fd.cache[i].block = NO_BLOCK;
+    fd.cache[i].data = static_cast<uint8_t*>(malloc(block_size));
+    if (fd.cache[i].data == nullptr) {
+      fprintf(stderr, "failed to allocate %d bites for the block cache\n", block_size);
+      result = -1;
+      goto done;
+    }
+  }
+  fd.inflight = static_cast<cache_entry**>(calloc(fd.cache_blocks, sizeof(cache_entry*)));
+  if (fd.inflight == nullptr) {
+    fprintf(stderr, "failed to allocate the request queue\n");
+    result = -1;
+    goto done;
+  }
+  fd.zero_block = static_cast<uint8_t*>(calloc(1, block_size));
+  if (fd.zero_block == nullptr) {
+    fprintf(stderr, "failed to allocate %d bites for zero_block\n", block_size);
     result = -1;
     goto done;
   }
-  fd.extra_block = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.extra_block == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for extra_block\n", block_size);
+
+  fd.max_read = MIN(FUSE_SIDELOAD_MAX_READ, (fd.cache_blocks - 2) * block_size);
+  fd.max_read = MAX(fd.max_read / FUSE_PAGE_SIZE * FUSE_PAGE_SIZE, block_size);
+  fd.prefetch_max = MIN(FUSE_PREFETCH_MAX_BLOCKS, fd.cache_blocks - (fd.max_read - 1) / block_size - 2);
+  fd.reply = static_cast<struct iovec*>(calloc(fd.max_read / block_size + 3, sizeof(struct iovec)));
+  if (fd.reply == nullptr) {
+    fprintf(stderr, "failed to allocate the reply vector\n");
     result = -1;
     goto done;
   }
 
+  // Without the thread every block is still cached, just not fetched ahead.
+  if (pthread_create(&fd.prefetch_thread, nullptr, prefetch_thread, &fd) == 0) {
+    fd.prefetch_running = true;
+  } else {
+    fprintf(stderr, "failed to start the prefetch thread\n");
+  }
+
   fd.ffd = open("/dev/fuse", O_RDWR);
   if (!fd.ffd) {
     perror("open /dev/fuse");
@@ -425,7 +818,7 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
   snprintf(opts, sizeof(opts),
           ("fd=%d,user_id=%d,group_id=%d,max_read=%u,"
            "allow_other,rootmode=040000"),
-           fd.ffd, fd.uid, fd.gid, block_size);
+           fd.ffd, fd.uid, fd.gid, fd.max_read);
 
   result = mount("/dev/fuse", FUSE_SIDELOAD_HOST_MOUNTPOINT, "fuse",
                  MS_NOSUID | MS_NODEV | MS_RDONLY | MS_NOEXEC, opts);
@@ -506,14 +899,36 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
   }
 
 done:
+  if (fd.prefetch_running) {
+    pthread_mutex_lock(&fd.lock);
+    fd.prefetch_stop = true;
+    pthread_cond_broadcast(&fd.cond);
+    pthread_mutex_unlock(&fd.lock);
+    pthread_join(fd.prefetch_thread, nullptr);
+  }
+
+  // Answers still on the way are read, so the host gets to the close right after its last one.
+  if (fd.inflight != nullptr) {
+    pthread_mutex_lock(&fd.recv_lock);
+    while (fd.inflight_count > 0) receive_block(&fd);
+    pthread_mutex_unlock(&fd.recv_lock);
+  }
+
   fd.vtab.close();
 
   if (umount2(mount_point, MNT_DETACH) == -1) {
     fprintf(stderr, "fuse_sideload umount failed: %s\n", strerror(errno));
   }
 
-  free(fd.block_data);
-  free(fd.extra_block);
+  if (fd.cache != nullptr) {
+    for (uint32_t i = 0; i < fd.cache_blocks; ++i) {
+      free(fd.cache[i].data);
+    }
+  }
+  free(fd.cache);
+  free(fd.inflight);
+  free(fd.zero_block);
+  free(fd.reply);
 
   return result;
 }
@@ -34,6 +34,11 @@ struct provider_vtab {
   // read a block
   std::function<int(uint32_t block, uint8_t* buffer, uint32_t fetch_size)> read_block;
 
+  // optional, read_block split in two so several requests can be in flight: ask for a block,
+  // then receive the answers in the order they were asked for
+  std::function<int(uint32_t block)> request_block;
+  std::function<int(uint8_t* buffer, uint32_t fetch_size)> receive_block;
+
   // close down
   std::function<void(void)> close;
 };
@@ -10,10 +10,12 @@ LOCAL_MODULE := libgpt_twrp
 LOCAL_MODULE_TAGS := optional
 
 LOCAL_SRC_FILES = \
-    gpt.c \
-    gptcrc32.c
+    gpt.c
+
+# CRC32 of util-linux, shared with libblkid
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../libblkid/include
 
 LOCAL_CFLAGS := -Wno-format
 
-LOCAL_SHARED_LIBRARIES := libc
+LOCAL_SHARED_LIBRARIES := libc libutil-linux
 include $(BUILD_SHARED_LIBRARY)
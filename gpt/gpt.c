@@ -36,7 +36,7 @@
 #include <sys/utsname.h>
 #include <asm/byteorder.h>
 #include "gpt.h"
-#include "gptcrc32.h"
+#include "crc32.h"
 
 #define BLKGETLASTSECT  _IO(0x12,108) /* get last sector of block device */
 #define BLKGETSIZE _IO(0x12,96)	/* return device size */
@@ -81,7 +81,7 @@ get_sector_size(int filedes)
 static inline uint32_t
 efi_crc32(const void *buf, unsigned long len)
 {
-	return (gptcrc32(buf, len, ~0L) ^ ~0L);
+	return (crc32(~0L, buf, len) ^ ~0L);
 }
 
 /**
@@ -248,8 +248,9 @@ read_lba(int fd, uint64_t lba, void *buffer, size_t bytes)
 	memset(aligned, 0, bytes);
 
 
-	lseek(fd, offset, SEEK_SET);
-	bytesread = read(fd, aligned, bytes);
+	bytesread = pread(fd, aligned, bytes, offset);
+	if (bytesread < 0)
+		bytesread = 0;
         memcpy(buffer, aligned, bytesread);
         free(unaligned);
 
@@ -320,6 +321,42 @@ alloc_read_gpt_header(int fd, uint64_t lba)
 	return gpt;
 }
 
+/**
+ * read_gpt_span(): reads a GPT header and the entry array next to it at once
+ * @fd  is an open file descriptor to the whole disk
+ * @lba is the Logical Block Address of the GPT header
+ * @first is filled with the first LBA read
+ * @bytesread is filled with the number of bytes read
+ *
+ * Description: returns a buffer on success, NULL on error.  The primary
+ * entries follow the primary header and the alternate entries precede the
+ * alternate header, so reading the default entry array size on the right
+ * side of the header usually gets both with one I/O.
+ * Note: remember to free the buffer when finished with it.
+ */
+static uint8_t *
+read_gpt_span(int fd, uint64_t lba, uint64_t *first, ssize_t *bytesread)
+{
+	int sector_size = get_sector_size(fd);
+	uint64_t span = GPT_DEFAULT_RESERVED_PARTITION_ENTRY_ARRAY_SIZE / sector_size;
+	size_t bytes = (span + 1) * sector_size;
+	uint8_t *buf;
+
+	if (lba == GPT_PRIMARY_PARTITION_TABLE_LBA || lba < span)
+		*first = lba;
+	else
+		*first = lba - span;
+	buf = malloc(bytes);
+	if (!buf)
+		return NULL;
+	*bytesread = read_lba(fd, *first, buf, bytes);
+	if (*bytesread < (ssize_t) ((lba - *first) * sector_size + sizeof (gpt_header))) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
 /**
  * is_gpt_valid() - tests one GPT header and PTEs for validity
  * @fd  is an open file descriptor to the whole disk
@@ -336,11 +373,27 @@ is_gpt_valid(int fd, uint64_t lba,
 {
 	int rc = 0;		/* default to not valid */
 	uint32_t crc, origcrc;
+	int sector_size = get_sector_size(fd);
+	uint8_t *span;
+	uint64_t first = 0, entry_lba;
+	ssize_t bytesread = 0;
+	size_t count;
 
 	if (!gpt || !ptes)
                 return 0;
-	if (!(*gpt = alloc_read_gpt_header(fd, lba)))
+	span = read_gpt_span(fd, lba, &first, &bytesread);
+	if (span) {
+		*gpt = (gpt_header *) malloc(sizeof (gpt_header));
+		if (*gpt)
+			memcpy(*gpt, span + (lba - first) * sector_size,
+			       sizeof (gpt_header));
+	} else {
+		*gpt = alloc_read_gpt_header(fd, lba);
+	}
+	if (!*gpt) {
+		free(span);
 		return 0;
+	}
 
 	/* Check the GUID Partition Table signature */
 	if (__le64_to_cpu((*gpt)->signature) != GPT_HEADER_SIGNATURE) {
@@ -348,6 +401,7 @@ is_gpt_valid(int fd, uint64_t lba,
 		   printf("GUID Partition Table Header signature is wrong: %" PRIx64" != %" PRIx64 "\n",
 		   __le64_to_cpu((*gpt)->signature), GUID_PT_HEADER_SIGNATURE);
 		 */
+		free(span);
 		free(*gpt);
 		*gpt = NULL;
 		return rc;
@@ -360,6 +414,7 @@ is_gpt_valid(int fd, uint64_t lba,
 	if (crc != origcrc) {
 		// printf( "GPTH CRC check failed, %x != %x.\n", origcrc, crc);
 		(*gpt)->header_crc32 = __cpu_to_le32(origcrc);
+		free(span);
 		free(*gpt);
 		*gpt = NULL;
 		return 0;
@@ -370,12 +425,27 @@ is_gpt_valid(int fd, uint64_t lba,
 	 * that contains the GPT we read */
 	if (__le64_to_cpu((*gpt)->my_lba) != lba) {
 		// printf( "my_lba % PRIx64 "x != lba %"PRIx64 "x.\n", __le64_to_cpu((*gpt)->my_lba), lba);
+		free(span);
 		free(*gpt);
 		*gpt = NULL;
 		return 0;
 	}
 
-	if (!(*ptes = alloc_read_gpt_entries(fd, *gpt))) {
+	/* The entries usually came with the header */
+	entry_lba = __le64_to_cpu((*gpt)->partition_entry_lba);
+	count = __le32_to_cpu((*gpt)->num_partition_entries) *
+		__le32_to_cpu((*gpt)->sizeof_partition_entry);
+	if (span && count && entry_lba >= first &&
+	    (entry_lba - first) * sector_size + count <= (uint64_t) bytesread) {
+		*ptes = (gpt_entry *) malloc(count);
+		if (*ptes)
+			memcpy(*ptes, span + (entry_lba - first) * sector_size,
+			       count);
+	} else {
+		*ptes = alloc_read_gpt_entries(fd, *gpt);
+	}
+	free(span);
+	if (!*ptes) {
 		free(*gpt);
 		*gpt = NULL;
 		return 0;
@@ -650,8 +720,12 @@ gpt_disk_get_partition_info(int fd, uint32_t num,
 		guid_to_ascii((char*)&p->unique_partition_guid, part);
 	} else {
 		fprintf (stderr,"partition %d is not valid\n", num);
+		free(gpt);
+		free(ptes);
 		return 1;
 	}
+	free(gpt);
+	free(ptes);
 	return 0;
 }
 
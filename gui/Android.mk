@@ -30,6 +30,9 @@ LOCAL_SRC_FILES := \
     patternpassword.cpp \
     textbox.cpp \
     terminal.cpp \
+    themecache.cpp \
+    arena.cpp \
+    benchmark.cpp \
     twmsg.cpp
 
 ifneq ($(TWRP_CUSTOM_KEYBOARD),)
@@ -80,6 +83,9 @@ endif
 ifeq ($(TW_ROUND_SCREEN), true)
     LOCAL_CFLAGS += -DTW_ROUND_SCREEN
 endif
+ifeq ($(TW_NO_THEME_CACHE), true)
+    LOCAL_CFLAGS += -DTW_NO_THEME_CACHE
+endif
 
 LOCAL_C_INCLUDES += \
     bionic \
@@ -34,6 +34,8 @@
 #include <dirent.h>
 #include <private/android_filesystem_config.h>
 
+#include <algorithm>
+#include <list>
 #include <string>
 #include <sstream>
 #include "../partitions.hpp"
@@ -57,6 +59,9 @@ extern "C" {
 #include "rapidxml.hpp"
 #include "objects.hpp"
 #include "../tw_atomic.hpp"
+#include "../twrpLog.hpp"
+#include "../twrpMemory.hpp"
+#include "../twrpPerf.hpp"
 
 GUIAction::mapFunc GUIAction::mf;
 std::set<string> GUIAction::setActionsRunningInCallerThread;
@@ -64,85 +69,178 @@ static string zip_queue[10];
 static int zip_queue_index;
 pid_t sideload_child_pid;
 
-static void *ActionThread_work_wrapper(void *data);
+// Threaded actions run as jobs on a small pool of worker threads. Each job
+// declares the resources its actions use, a job whose resources are held by a
+// running job waits in the queue instead of being dropped, and jobs that do
+// not conflict run side by side. Higher priority jobs start first.
+enum ActionResource {
+	ACTION_RES_OPERATION = 0x01,	// the operation state and progress bar of the action page
+	ACTION_RES_STORAGE = 0x02,	// mounting, wiping, backing up or otherwise changing partitions
+};
+
+enum ActionPriority {
+	ACTION_PRIO_NORMAL = 0,
+	ACTION_PRIO_CANCEL = 1,		// cancel actions must start while the job they cancel is running
+};
 
-class ActionThread
+#define ACTION_MAX_WORKERS 2
+
+class ActionQueue
 {
 public:
-	ActionThread();
-	~ActionThread();
+	ActionQueue();
+	~ActionQueue();
 
-	void threadActions(GUIAction *act);
-	void run(void *data);
+	void queueActions(GUIAction *act, int priority, int resources, bool cancellable);
+	int cancelQueued();	// drops the cancellable jobs that did not start yet
 private:
-	friend void *ActionThread_work_wrapper(void*);
-	struct ThreadData
+	struct Job
 	{
-		ActionThread *this_;
 		GUIAction *act;
-		ThreadData(ActionThread *this_, GUIAction *act) : this_(this_), act(act) {}
+		int priority;
+		int resources;
+		bool cancellable;
 	};
 
-	pthread_t m_thread;
-	bool m_thread_running;
-	pthread_mutex_t m_act_lock;
+	static void *worker(void *cookie);
+	bool takeJob(Job *job);
+	bool isKnown(GUIAction *act);
+
+	std::list<Job> m_queue;			// by priority, then in the order of queueing
+	std::vector<GUIAction*> m_running;
+	std::vector<pthread_t> m_workers;
+	int m_busy_resources;
+	unsigned m_idle;
+	bool m_shutdown;
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_cond;
 };
 
-static ActionThread action_thread;	// for all kinds of longer running actions
-static ActionThread cancel_thread;	// for longer running "cancel" actions
+static ActionQueue action_queue;	// for all kinds of longer running actions
 
-static void *ActionThread_work_wrapper(void *data)
+ActionQueue::ActionQueue()
 {
-	static_cast<ActionThread::ThreadData*>(data)->this_->run(data);
-	return NULL;
+	m_busy_resources = 0;
+	m_idle = 0;
+	m_shutdown = false;
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_cond, NULL);
 }
 
-ActionThread::ActionThread()
+ActionQueue::~ActionQueue()
 {
-	m_thread_running = false;
-	pthread_mutex_init(&m_act_lock, NULL);
+	pthread_mutex_lock(&m_lock);
+	m_shutdown = true;
+	m_queue.clear();
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_lock);
+	for (size_t i = 0; i < m_workers.size(); i++)
+		pthread_join(m_workers[i], NULL);
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_lock);
 }
 
-ActionThread::~ActionThread()
+bool ActionQueue::isKnown(GUIAction *act)
 {
-	pthread_mutex_lock(&m_act_lock);
-	if (m_thread_running) {
-		pthread_mutex_unlock(&m_act_lock);
-		pthread_join(m_thread, NULL);
-	} else {
-		pthread_mutex_unlock(&m_act_lock);
+	std::list<Job>::iterator it;
+	for (it = m_queue.begin(); it != m_queue.end(); ++it) {
+		if (it->act == act)
+			return true;
 	}
-	pthread_mutex_destroy(&m_act_lock);
+	return std::find(m_running.begin(), m_running.end(), act) != m_running.end();
 }
 
-void ActionThread::threadActions(GUIAction *act)
+void ActionQueue::queueActions(GUIAction *act, int priority, int resources, bool cancellable)
 {
-	pthread_mutex_lock(&m_act_lock);
-	if (m_thread_running) {
-		pthread_mutex_unlock(&m_act_lock);
-		LOGERR("Another threaded action is already running -- not running %u actions starting with '%s'\n",
+	pthread_mutex_lock(&m_lock);
+	if (isKnown(act)) {
+		pthread_mutex_unlock(&m_lock);
+		LOGERR("These threaded actions are already running -- not running %u actions starting with '%s' again\n",
 				act->mActions.size(), act->mActions[0].mFunction.c_str());
-	} else {
-		m_thread_running = true;
-		pthread_mutex_unlock(&m_act_lock);
-		ThreadData *d = new ThreadData(this, act);
-		pthread_create(&m_thread, NULL, &ActionThread_work_wrapper, d);
+		return;
+	}
+
+	Job job;
+	job.act = act;
+	job.priority = priority;
+	job.resources = resources;
+	job.cancellable = cancellable;
+	std::list<Job>::iterator it = m_queue.begin();
+	while (it != m_queue.end() && it->priority >= priority)
+		++it;
+	m_queue.insert(it, job);
+	if (m_idle == 0 && m_workers.size() < ACTION_MAX_WORKERS) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, &ActionQueue::worker, this) == 0)
+			m_workers.push_back(thread);
+		else if (m_workers.empty())
+			LOGERR("Unable to start the action thread\n");
 	}
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_lock);
 }
 
-void ActionThread::run(void *data)
+int ActionQueue::cancelQueued()
 {
-	ThreadData *d = (ThreadData*)data;
-	GUIAction* act = d->act;
+	int count = 0;
+
+	pthread_mutex_lock(&m_lock);
+	std::list<Job>::iterator it = m_queue.begin();
+	while (it != m_queue.end()) {
+		if (it->cancellable) {
+			LOGINFO("Cancelled queued actions starting with '%s'\n", it->act->mActions[0].mFunction.c_str());
+			it = m_queue.erase(it);
+			count++;
+		} else
+			++it;
+	}
+	pthread_mutex_unlock(&m_lock);
+	return count;
+}
+
+// Called with m_lock held, takes the first job that does not conflict with the running ones
+bool ActionQueue::takeJob(Job *job)
+{
+	std::list<Job>::iterator it;
+	for (it = m_queue.begin(); it != m_queue.end(); ++it) {
+		if ((it->resources & m_busy_resources) == 0) {
+			*job = *it;
+			m_queue.erase(it);
+			m_busy_resources |= job->resources;
+			m_running.push_back(job->act);
+			return true;
+		}
+	}
+	return false;
+}
 
-	std::vector<GUIAction::Action>::iterator it;
-	for (it = act->mActions.begin(); it != act->mActions.end(); ++it)
-		act->doAction(*it);
+void *ActionQueue::worker(void *cookie)
+{
+	ActionQueue *queue = (ActionQueue*) cookie;
+	Job job;
 
-	pthread_mutex_lock(&m_act_lock);
-	m_thread_running = false;
-	pthread_mutex_unlock(&m_act_lock);
-	delete d;
+	pthread_mutex_lock(&queue->m_lock);
+	while (!queue->m_shutdown) {
+		if (!queue->takeJob(&job)) {
+			queue->m_idle++;
+			pthread_cond_wait(&queue->m_cond, &queue->m_lock);
+			queue->m_idle--;
+			continue;
+		}
+		// The actions take DataManager and partition locks of their own, so run them unlocked
+		pthread_mutex_unlock(&queue->m_lock);
+		std::vector<GUIAction::Action>::iterator it;
+		for (it = job.act->mActions.begin(); it != job.act->mActions.end(); ++it)
+			job.act->doAction(*it);
+		pthread_mutex_lock(&queue->m_lock);
+
+		queue->m_busy_resources &= ~job.resources;
+		queue->m_running.erase(std::find(queue->m_running.begin(), queue->m_running.end(), job.act));
+		// Released resources may let queued jobs start on the other workers
+		pthread_cond_broadcast(&queue->m_cond);
+	}
+	pthread_mutex_unlock(&queue->m_lock);
+	return NULL;
 }
 
 GUIAction::GUIAction(xml_node<>* node)
@@ -225,6 +323,7 @@ GUIAction::GUIAction(xml_node<>* node)
 		ADD_ACTION(installsu);
 		ADD_ACTION(decrypt_backup);
 		ADD_ACTION(repair);
+		ADD_ACTION(verifybackups);
 		ADD_ACTION(resize);
 		ADD_ACTION(changefilesystem);
 		ADD_ACTION(flashimage);
@@ -361,7 +460,7 @@ void GUIAction::simulate_progress_bar(void)
 	}
 }
 
-int GUIAction::flash_zip(std::string filename, int* wipe_cache)
+int GUIAction::flash_zip(std::string filename, int* wipe_cache, Zip_Prefetch* prefetch)
 {
 	int ret_val = 0;
 
@@ -370,23 +469,27 @@ int GUIAction::flash_zip(std::string filename, int* wipe_cache)
 	if (filename.empty())
 	{
 		LOGERR("No file specified.\n");
+		TWinstall_Discard_Prefetch(prefetch);
 		return -1;
 	}
 
 	if (!TWFunc::Path_Exists(filename)) {
 		if (!PartitionManager.Mount_By_Path(filename, true)) {
+			TWinstall_Discard_Prefetch(prefetch);
 			return -1;
 		}
 		if (!TWFunc::Path_Exists(filename)) {
 			gui_msg(Msg(msg::kError, "unable_to_locate=Unable to locate {1}.")(filename));
+			TWinstall_Discard_Prefetch(prefetch);
 			return -1;
 		}
 	}
 
 	if (simulate) {
+		TWinstall_Discard_Prefetch(prefetch);
 		simulate_progress_bar();
 	} else {
-		ret_val = TWinstall_zip(filename.c_str(), wipe_cache);
+		ret_val = TWinstall_zip(filename.c_str(), wipe_cache, prefetch);
 
 		// Now, check if we need to ensure TWRP remains installed...
 		struct stat st;
@@ -446,12 +549,21 @@ int GUIAction::doActions()
 
 	// Now run the actions in the desired thread.
 	switch (threadType) {
-		case THREAD_ACTION:
-			action_thread.threadActions(this);
+		case THREAD_ACTION: {
+			// Every threaded action drives the operation page, so they run one
+			// after the other. A queued backup or restore can still be cancelled
+			// before it starts.
+			bool cancellable = false;
+			for (it = mActions.begin(); it != mActions.end(); ++it) {
+				if (gui_parse_text(it->mFunction) == "nandroid")
+					cancellable = true;
+			}
+			action_queue.queueActions(this, ACTION_PRIO_NORMAL, ACTION_RES_OPERATION | ACTION_RES_STORAGE, cancellable);
 			break;
+		}
 
 		case THREAD_CANCEL:
-			cancel_thread.threadActions(this);
+			action_queue.queueActions(this, ACTION_PRIO_CANCEL, 0, false);
 			break;
 
 		default: {
@@ -481,6 +593,9 @@ int GUIAction::doAction(Action action)
 	return -1;
 }
 
+// flash starts the operation again for each zip, they share one report
+static bool operation_perf = false;
+
 void GUIAction::operation_start(const string operation_name)
 {
 	LOGINFO("operation_start: '%s'\n", operation_name.c_str());
@@ -490,6 +605,9 @@ void GUIAction::operation_start(const string operation_name)
 	DataManager::SetValue("tw_operation", operation_name);
 	DataManager::SetValue("tw_operation_state", 0);
 	DataManager::SetValue("tw_operation_status", 0);
+	if (!operation_perf)
+		twrpPerf::Start(operation_name);
+	operation_perf = true;
 }
 
 void GUIAction::operation_end(const int operation_status)
@@ -506,11 +624,15 @@ void GUIAction::operation_end(const int operation_status)
 	} else {
 		if (operation_status != 0) {
 			DataManager::SetValue("tw_operation_status", 1);
+			twrpMemory::Dump(DataManager::GetStrValue("tw_operation"));
 		}
 		else {
 			DataManager::SetValue("tw_operation_status", 0);
 		}
 	}
+	if (operation_perf)
+		twrpPerf::Finish(operation_status);
+	operation_perf = false;
 	DataManager::SetValue("tw_operation_state", 1);
 	DataManager::SetValue(TW_ACTION_BUSY, 0);
 	blankTimer.resetTimerAndUnblank();
@@ -650,6 +772,7 @@ int GUIAction::copylog(std::string arg __unused)
 		PartitionManager.Mount_Current_Storage(true);
 		curr_storage = DataManager::GetCurrentStoragePath();
 		dst = curr_storage + "/recovery.log";
+		twrpLog::Flush();
 		TWFunc::copy_file("/tmp/recovery.log", dst.c_str(), 0755);
 		tw_set_default_metadata(dst.c_str());
 		if (copy_kernel_log)
@@ -905,22 +1028,18 @@ int GUIAction::getpartitiondetails(std::string arg)
 					DataManager::SetValue("tw_partition_can_resize", 1);
 				else
 					DataManager::SetValue("tw_partition_can_resize", 0);
-				if (TWFunc::Path_Exists("/sbin/mkfs.fat"))
-					DataManager::SetValue("tw_partition_vfat", 1);
-				else
-					DataManager::SetValue("tw_partition_vfat", 0);
-				if (TWFunc::Path_Exists("/sbin/mkexfatfs"))
-					DataManager::SetValue("tw_partition_exfat", 1);
-				else
-					DataManager::SetValue("tw_partition_exfat", 0);
-				if (TWFunc::Path_Exists("/sbin/mkfs.f2fs"))
-					DataManager::SetValue("tw_partition_f2fs", 1);
-				else
-					DataManager::SetValue("tw_partition_f2fs", 0);
-				if (TWFunc::Path_Exists("/sbin/mke2fs"))
-					DataManager::SetValue("tw_partition_ext", 1);
-				else
-					DataManager::SetValue("tw_partition_ext", 0);
+				// The formatters are part of the ramdisk, look for them once
+				static int mkfs_fat = -1, mkexfatfs, mkfs_f2fs, mke2fs;
+				if (mkfs_fat < 0) {
+					mkexfatfs = TWFunc::Path_Exists("/sbin/mkexfatfs");
+					mkfs_f2fs = TWFunc::Path_Exists("/sbin/mkfs.f2fs");
+					mke2fs = TWFunc::Path_Exists("/sbin/mke2fs");
+					mkfs_fat = TWFunc::Path_Exists("/sbin/mkfs.fat");
+				}
+				DataManager::SetValue("tw_partition_vfat", mkfs_fat);
+				DataManager::SetValue("tw_partition_exfat", mkexfatfs);
+				DataManager::SetValue("tw_partition_f2fs", mkfs_f2fs);
+				DataManager::SetValue("tw_partition_ext", mke2fs);
 				return 0;
 			} else {
 				LOGERR("Unable to locate partition: '%s'\n", part_path.c_str());
@@ -934,6 +1053,19 @@ int GUIAction::getpartitiondetails(std::string arg)
 	return 0;
 }
 
+// Called on the encoder thread once the PNG is written
+static void screenshot_done(const char *path, int res, void *cookie __unused)
+{
+	if (res == 0) {
+		chmod(path, 0666);
+		chown(path, AID_MEDIA_RW, AID_MEDIA_RW);
+		gui_msg(Msg("screenshot_saved=Screenshot was saved to {1}")(path));
+	} else {
+		unlink(path);
+		gui_err("screenshot_err=Failed to take a screenshot!");
+	}
+}
+
 int GUIAction::screenshot(std::string arg __unused)
 {
 	time_t tm;
@@ -958,13 +1090,9 @@ int GUIAction::screenshot(std::string arg __unused)
 	// Screenshot_2014-01-01-18-21-38.png
 	strftime(path+path_len, sizeof(path)-path_len, "Screenshot_%Y-%m-%d-%H-%M-%S.png", localtime(&tm));
 
-	int res = gr_save_screenshot(path);
+	// only the copy of the screen happens here, the PNG is written in the background
+	int res = gr_save_screenshot_async(path, screenshot_done, NULL);
 	if (res == 0) {
-		chmod(path, 0666);
-		chown(path, uid, gid);
-
-		gui_msg(Msg("screenshot_saved=Screenshot was saved to {1}")(path));
-
 		// blink to notify that the screenshow was taken
 		gr_color(255, 255, 255, 255);
 		gr_fill(0, 0, gr_fb_width(), gr_fb_height());
@@ -1016,6 +1144,7 @@ void GUIAction::reinject_after_flash()
 int GUIAction::flash(std::string arg)
 {
 	int i, ret_val = 0, wipe_cache = 0;
+	Zip_Prefetch *prefetch = NULL, *next_prefetch;
 	// We're going to jump to this page first, like a loading page
 	gui_changePage(arg);
 	for (i=0; i<zip_queue_index; i++) {
@@ -1026,24 +1155,37 @@ int GUIAction::flash(std::string arg)
 		DataManager::SetValue("tw_filename", zip_path);
 		DataManager::SetValue("tw_file", zip_filename);
 		DataManager::SetValue(TW_ZIP_INDEX, (i + 1));
+		twrpPerf::Phase("install");
 
 		TWFunc::SetPerformanceMode(true);
-		ret_val = flash_zip(zip_path, &wipe_cache);
+		// The next zip is checked and staged while this one installs, it is
+		// still installed only if this one succeeds
+		next_prefetch = NULL;
+		if (!simulate && i + 1 < zip_queue_index)
+			next_prefetch = TWinstall_Prefetch_Zip(zip_queue[i + 1].c_str());
+		ret_val = flash_zip(zip_path, &wipe_cache, prefetch);
+		prefetch = next_prefetch;
 		TWFunc::SetPerformanceMode(false);
 		if (ret_val != 0) {
 			gui_msg(Msg(msg::kError, "zip_err=Error installing zip file '{1}'")(zip_path));
 			ret_val = 1;
 			break;
 		}
+		twrpPerf::Add(TWFunc::Get_File_Size(zip_path), 1);
 	}
+	TWinstall_Discard_Prefetch(prefetch);
 	zip_queue_index = 0;
 
 	if (wipe_cache) {
+		twrpPerf::Phase("wipe cache");
 		gui_msg("zip_wipe_cache=One or more zip requested a cache wipe -- Wiping cache now.");
 		PartitionManager.Wipe_By_Path("/cache");
 	}
 
+	twrpPerf::Phase("finish");
 	reinject_after_flash();
+	// Zips flash the inactive slot on A/B devices
+	PartitionManager.Clear_Slot_Details();
 	PartitionManager.Update_System_Details();
 	operation_end(ret_val);
 	// This needs to be after the operation_end call so we change pages before we change variables that we display on the screen
@@ -1089,7 +1231,7 @@ int GUIAction::wipe(std::string arg)
 			ret_val = PartitionManager.Wipe_Android_Secure();
 		} else if (arg == "LIST") {
 			string Wipe_List, wipe_path;
-			bool skip = false;
+			std::vector<string> wipe_paths;
 			ret_val = true;
 
 			DataManager::GetValue("tw_wipe_list", Wipe_List);
@@ -1099,44 +1241,14 @@ int GUIAction::wipe(std::string arg)
 				while (end_pos != string::npos && start_pos < Wipe_List.size()) {
 					wipe_path = Wipe_List.substr(start_pos, end_pos - start_pos);
 					LOGINFO("wipe_path '%s'\n", wipe_path.c_str());
-					if (wipe_path == "/and-sec") {
-						if (!PartitionManager.Wipe_Android_Secure()) {
-							gui_msg("and_sec_wipe_err=Unable to wipe android secure");
-							ret_val = false;
-							break;
-						} else {
-							skip = true;
-						}
-					} else if (wipe_path == "DALVIK") {
-						if (!PartitionManager.Wipe_Dalvik_Cache()) {
-							gui_err("dalvik_wipe_err=Failed to wipe dalvik");
-							ret_val = false;
-							break;
-						} else {
-							skip = true;
-						}
-					} else if (wipe_path == "INTERNAL") {
-						if (!PartitionManager.Wipe_Media_From_Data()) {
-							ret_val = false;
-							break;
-						} else {
-							skip = true;
-						}
-					}
-					if (!skip) {
-						if (!PartitionManager.Wipe_By_Path(wipe_path)) {
-							gui_msg(Msg(msg::kError, "unable_to_wipe=Unable to wipe {1}.")(wipe_path));
-							ret_val = false;
-							break;
-						} else if (wipe_path == DataManager::GetSettingsStoragePath()) {
-							arg = wipe_path;
-						}
-					} else {
-						skip = false;
-					}
+					wipe_paths.push_back(wipe_path);
+					if (wipe_path == DataManager::GetSettingsStoragePath())
+						arg = wipe_path;
 					start_pos = end_pos + 1;
 					end_pos = Wipe_List.find(";", start_pos);
 				}
+				// Wipes of different partitions run at the same time
+				ret_val = PartitionManager.Wipe_Paths(wipe_paths);
 			}
 		} else
 			ret_val = PartitionManager.Wipe_By_Path(arg);
@@ -1241,6 +1353,7 @@ int GUIAction::nandroid(std::string arg)
 }
 
 int GUIAction::cancelbackup(std::string arg __unused) {
+	action_queue.cancelQueued();
 	if (simulate) {
 		PartitionManager.stop_backup.set_value(1);
 	}
@@ -1523,6 +1636,7 @@ int GUIAction::adbsideload(std::string arg __unused)
 		bool mtp_was_enabled = TWFunc::Toggle_MTP(false);
 
 		// wait for the adb connection
+		twrpPerf::Phase("connect");
 		int ret = apply_from_adb("/", &sideload_child_pid);
 		DataManager::SetValue("tw_has_cancel", 0); // Remove cancel button from gui now that the zip install is going to start
 
@@ -1535,7 +1649,10 @@ int GUIAction::adbsideload(std::string arg __unused)
 			int wipe_dalvik = 0;
 			DataManager::GetValue("tw_wipe_dalvik", wipe_dalvik);
 
+			twrpPerf::Phase("install");
 			if (TWinstall_zip(FUSE_SIDELOAD_HOST_PATHNAME, &wipe_cache) == 0) {
+				twrpPerf::Add(TWFunc::Get_File_Size(FUSE_SIDELOAD_HOST_PATHNAME), 1);
+				twrpPerf::Phase("wipe");
 				if (wipe_cache || DataManager::GetIntValue("tw_wipe_cache"))
 					PartitionManager.Wipe_By_Path("/cache");
 				if (wipe_dalvik)
@@ -1544,6 +1661,7 @@ int GUIAction::adbsideload(std::string arg __unused)
 				ret = 1; // failure
 			}
 		}
+		twrpPerf::Phase("finish");
 		if (sideload_child_pid) {
 			LOGINFO("Signaling child sideload process to exit.\n");
 			struct stat st;
@@ -1675,6 +1793,25 @@ int GUIAction::repair(std::string arg __unused)
 	return 0;
 }
 
+int GUIAction::verifybackups(std::string arg)
+{
+	int op_status = 0;
+
+	operation_start("Verify Backups");
+	if (simulate) {
+		simulate_progress_bar();
+	} else {
+		if (PartitionManager.Verify_Backups(arg == "force")) {
+			op_status = 0; // success
+		} else {
+			op_status = 1; // fail
+		}
+	}
+
+	operation_end(op_status);
+	return 0;
+}
+
 int GUIAction::resize(std::string arg __unused)
 {
 	int op_status = 0;
@@ -42,6 +42,7 @@ extern "C" {
 
 #include "rapidxml.hpp"
 #include "objects.hpp"
+#include "../twrp-functions.hpp"
 
 
 GUIAnimation::GUIAnimation(xml_node<>* node) : GUIObject(node)
@@ -53,7 +54,8 @@ GUIAnimation::GUIAnimation(xml_node<>* node) : GUIObject(node)
 	mFPS = 1;
 	mLoop = -1;
 	mRender = 1;
-	mUpdateCount = 0;
+	mFrameMs = 0;
+	mTiming = false;
 
 	if (!node)  return;
 
@@ -69,6 +71,10 @@ GUIAnimation::GUIAnimation(xml_node<>* node) : GUIObject(node)
 		mRender = LoadAttrInt(child, "render", mRender);
 	}
 	if (mFPS > 30)  mFPS = 30;
+	if (mFPS < 1)   mFPS = 1;
+	// Frames used to advance every 30 / fps + 1 updates of the 30 fps loop,
+	// the themes are tuned for that speed so the same period is kept
+	mFrameMs = (30 / mFPS + 1) * 1000 / 30;
 
 	child = FindNode(node, "loop");
 	if (child)
@@ -125,10 +131,38 @@ int GUIAnimation::Update(void)
 	// Handle the "end-of-animation" state
 	if (mLoop == -2)		return 0;
 
-	// Determine if we need the next frame yet...
-	if (++mUpdateCount > 30 / mFPS)
+	// Frames follow the clock rather than the number of updates, so a slow
+	// loop (a busy CPU during a backup) skips frames instead of slowing the
+	// animation down
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!mTiming)
+	{
+		mTiming = true;
+		mFrameTime = now;
+		return 0;
+	}
+	int32_t elapsed = TWFunc::timespec_diff_ms(mFrameTime, now);
+	if (elapsed < mFrameMs)
+		return 0;
+
+	int frames = elapsed / mFrameMs;
+	if (frames > 30)
+	{
+		// Not updated for a while (another page was shown), carry on from
+		// the current frame instead of jumping ahead
+		frames = 1;
+		mFrameTime = now;
+	}
+	else
+	{
+		long ns = mFrameTime.tv_nsec + (long)(frames * mFrameMs % 1000) * 1000000;
+		mFrameTime.tv_sec += frames * mFrameMs / 1000 + ns / 1000000000;
+		mFrameTime.tv_nsec = ns % 1000000000;
+	}
+
+	while (frames-- > 0 && mLoop != -2)
 	{
-		mUpdateCount = 0;
 		if (++mFrame >= mAnimation->GetResourceCount())
 		{
 			if (mLoop < 0)
@@ -139,9 +173,7 @@ int GUIAnimation::Update(void)
 			else
 				mFrame = mLoop;
 		}
-		if (mRender == 2)	return 2;
-		return (Render() == 0 ? 1 : -1);
 	}
-	return 0;
+	if (mRender == 2)	return 2;
+	return (Render() == 0 ? 1 : -1);
 }
-
@@ -0,0 +1,143 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// arena.cpp - Memory for the pages and objects of one page set
+
+#include <stdlib.h>
+#include <stddef.h>
+
+extern "C" {
+#include "../twcommon.h"
+}
+
+#include "arena.hpp"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// The strictest alignment any of the objects needs
+union Align {
+	long long l;
+	long double d;
+	void* p;
+};
+
+struct GUIArena::Block {
+	Block* next;
+	size_t used, size;
+	Align data[1];
+};
+
+struct GUIArena::Pool {
+	Block* blocks;
+	size_t live; // objects not deleted yet
+};
+
+// Every allocation is preceded by the pool it came from, NULL for the
+// heap, padded so the object keeps its alignment
+union GUIArena::Header {
+	Pool* pool;
+	Align align;
+};
+
+GUIArena* GUIArena::sActive = NULL;
+
+GUIArena::GUIArena()
+{
+	mPool = (Pool*) calloc(1, sizeof(Pool));
+}
+
+GUIArena::~GUIArena()
+{
+	if (sActive == this)
+		sActive = NULL;
+	if (!mPool)
+		return;
+	if (mPool->live) {
+		LOGERR("GUIArena: %zu objects still in use, not freeing the arena\n", mPool->live);
+		return;
+	}
+	while (mPool->blocks) {
+		Block* next = mPool->blocks->next;
+		free(mPool->blocks);
+		mPool->blocks = next;
+	}
+	free(mPool);
+}
+
+GUIArena* GUIArena::SetActive(GUIArena* arena)
+{
+	GUIArena* previous = sActive;
+	sActive = arena;
+	return previous;
+}
+
+void* GUIArena::Allocate(Pool* pool, size_t size)
+{
+	size = (size + sizeof(Align) - 1) & ~(sizeof(Align) - 1);
+	if (!pool->blocks || pool->blocks->size - pool->blocks->used < size) {
+		// Large objects get a block of their own behind the current one, so
+		// the space left in the current block is not wasted
+		size_t data_size = (size > ARENA_BLOCK_SIZE / 4 ? size : ARENA_BLOCK_SIZE);
+		Block* block = (Block*) malloc(offsetof(Block, data) + data_size);
+		if (!block)
+			return NULL;
+		block->size = data_size;
+		if (pool->blocks && data_size != ARENA_BLOCK_SIZE) {
+			block->next = pool->blocks->next;
+			pool->blocks->next = block;
+		} else {
+			block->next = pool->blocks;
+			pool->blocks = block;
+		}
+		block->used = size;
+		return block->data;
+	}
+	void* ptr = (char*) pool->blocks->data + pool->blocks->used;
+	pool->blocks->used += size;
+	return ptr;
+}
+
+void* GUIArena::New(size_t size)
+{
+	Pool* pool = (sActive ? sActive->mPool : NULL);
+	Header* header;
+
+	if (pool)
+		header = (Header*) Allocate(pool, sizeof(Header) + size);
+	else
+		header = (Header*) malloc(sizeof(Header) + size);
+	if (!header) {
+		LOGERR("GUIArena: out of memory\n");
+		abort();
+	}
+	header->pool = pool;
+	if (pool)
+		pool->live++;
+	return header + 1;
+}
+
+void GUIArena::Delete(void* ptr)
+{
+	if (!ptr)
+		return;
+	Header* header = (Header*) ptr - 1;
+	if (header->pool)
+		header->pool->live--;
+	else
+		free(header);
+}
@@ -0,0 +1,58 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// arena.hpp - Memory for the pages and objects of one page set
+
+#ifndef _ARENA_HEADER
+#define _ARENA_HEADER
+
+#include <stddef.h>
+
+// A theme has thousands of small objects that all go away together when it
+// is reloaded. While an arena is active, pages and GUI objects are carved
+// out of large blocks it owns instead of each getting its own heap chunk,
+// and the blocks are freed in one go with the arena. Deleting such an
+// object only runs its destructor. Objects made while no arena is active
+// come from the heap as usual.
+class GUIArena
+{
+public:
+	GUIArena();
+	// The objects must have been deleted already, if some were not the
+	// blocks are leaked rather than pulled from under them
+	~GUIArena();
+
+	// Makes arena the one new pages and objects come from, NULL for the
+	// heap. Returns the arena that was active.
+	static GUIArena* SetActive(GUIArena* arena);
+
+	// Used by operator new and delete of the arena allocated classes
+	static void* New(size_t size);
+	static void Delete(void* ptr);
+
+private:
+	struct Block;
+	struct Pool;
+	union Header;
+	static void* Allocate(Pool* pool, size_t size);
+
+	Pool* mPool; // apart from the arena so objects that outlive it can still be deleted
+	static GUIArena* sActive;
+};
+
+#endif  // _ARENA_HEADER
@@ -0,0 +1,281 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// benchmark.cpp - Frame times of scripted page visits and input
+//
+// recovery --gui_benchmark <script> [output] loads a theme into a surface in
+// memory, so it can run next to the recovery on the display, and replays
+// the script one frame at a time. Every frame is timed and the results go
+// to output (default /tmp/gui_benchmark.json) as JSON with a fixed layout,
+// so themes and builds can be compared. The script has one command per
+// line, # starts a comment:
+//
+//   screen <width> <height>   size of the surface, before anything else
+//   theme <path>              ui.xml or a theme zip, default the stock theme
+//   section <name>            starts a new set of results
+//   page <name>               changes the page and draws one frame
+//   frames <count>            draws count frames without input
+//   tap <x> <y>               touch and release, one frame each
+//   drag <x1> <y1> <x2> <y2> <frames>
+//   key <code>                key down and up, one frame each
+//   print <count> <text>      adds count lines to the console
+//   var <name> <value>        sets a variable
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "../twcommon.h"
+#include "gui.h"
+}
+#include "../minuitwrp/minui.h"
+
+#include "rapidxml.hpp"
+#include "objects.hpp"
+#include "../data.hpp"
+
+#define BENCHMARK_FORMAT_VERSION 1
+#define BENCHMARK_OUTPUT "/tmp/gui_benchmark.json"
+#define BENCHMARK_WIDTH 1080
+#define BENCHMARK_HEIGHT 1920
+
+namespace {
+
+struct Frame {
+	double wall_ms;
+	double cpu_ms;
+	long heap_bytes; // change of the allocated heap
+	bool full;       // the whole page was drawn
+};
+
+struct Section {
+	std::string name;
+	std::vector<Frame> frames;
+};
+
+double Now_Ms(clockid_t clock)
+{
+	timespec now;
+	clock_gettime(clock, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+void Run_Frame(Section& section)
+{
+	Frame frame;
+	long heap = mallinfo().uordblks;
+	double wall = Now_Ms(CLOCK_MONOTONIC);
+	double cpu = Now_Ms(CLOCK_PROCESS_CPUTIME_ID);
+
+	frame.full = (gui_runFrame() > 2);
+
+	frame.wall_ms = Now_Ms(CLOCK_MONOTONIC) - wall;
+	frame.cpu_ms = Now_Ms(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+	frame.heap_bytes = mallinfo().uordblks - heap;
+	section.frames.push_back(frame);
+}
+
+double Percentile(std::vector<double> values, unsigned percent)
+{
+	if (values.empty())
+		return 0;
+	std::sort(values.begin(), values.end());
+	return values[(values.size() - 1) * percent / 100];
+}
+
+void Write_Section(FILE* fp, const Section& section, bool last)
+{
+	std::vector<double> wall, cpu, heap;
+	double cpu_total = 0;
+	long heap_total = 0;
+	unsigned full = 0;
+
+	for (size_t i = 0; i < section.frames.size(); i++) {
+		const Frame& frame = section.frames[i];
+		wall.push_back(frame.wall_ms);
+		cpu.push_back(frame.cpu_ms);
+		heap.push_back(frame.heap_bytes);
+		cpu_total += frame.cpu_ms;
+		heap_total += frame.heap_bytes;
+		if (frame.full)
+			full++;
+	}
+	fprintf(fp, "    {\n");
+	fprintf(fp, "      \"name\": \"%s\",\n", section.name.c_str());
+	fprintf(fp, "      \"frames\": %zu,\n", section.frames.size());
+	fprintf(fp, "      \"full_renders\": %u,\n", full);
+	fprintf(fp, "      \"frame_ms\": { \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+		Percentile(wall, 50), Percentile(wall, 99), Percentile(wall, 100));
+	fprintf(fp, "      \"cpu_ms\": { \"p50\": %.3f, \"p99\": %.3f, \"total\": %.3f },\n",
+		Percentile(cpu, 50), Percentile(cpu, 99), cpu_total);
+	fprintf(fp, "      \"heap_bytes\": { \"p50\": %.0f, \"max\": %.0f, \"total\": %ld }\n",
+		Percentile(heap, 50), Percentile(heap, 100), heap_total);
+	fprintf(fp, "    }%s\n", last ? "" : ",");
+}
+
+bool Read_Script(const char* filename, std::vector<std::vector<std::string> >* commands)
+{
+	FILE* fp = fopen(filename, "r");
+	char* line = NULL;
+	size_t line_size = 0;
+
+	if (!fp) {
+		LOGERR("Unable to open benchmark script '%s'\n", filename);
+		return false;
+	}
+	while (getline(&line, &line_size, fp) > 0) {
+		std::vector<std::string> args;
+		char* save;
+		char* hash = strchr(line, '#');
+		if (hash)
+			*hash = 0;
+		for (char* arg = strtok_r(line, " \t\r\n", &save); arg; arg = strtok_r(NULL, " \t\r\n", &save)) {
+			// print keeps the rest of the line as its text
+			if (args.size() == 2 && args[0] == "print") {
+				std::string text = arg;
+				if (save && *save)
+					text += std::string(" ") + save;
+				text.erase(text.find_last_not_of("\r\n") + 1);
+				args.push_back(text);
+				break;
+			}
+			args.push_back(arg);
+		}
+		if (!args.empty())
+			commands->push_back(args);
+	}
+	free(line);
+	fclose(fp);
+	return true;
+}
+
+} // namespace
+
+extern "C" int gui_benchmark(const char* script, const char* output)
+{
+	std::vector<std::vector<std::string> > commands;
+	std::vector<Section> sections;
+	int width = BENCHMARK_WIDTH, height = BENCHMARK_HEIGHT;
+	std::string theme = TWRES "ui.xml";
+	size_t i;
+
+	if (!output)
+		output = BENCHMARK_OUTPUT;
+	if (!Read_Script(script, &commands))
+		return -1;
+	for (i = 0; i < commands.size() && (commands[i][0] == "screen" || commands[i][0] == "theme"); i++) {
+		if (commands[i][0] == "screen" && commands[i].size() == 3) {
+			width = atoi(commands[i][1].c_str());
+			height = atoi(commands[i][2].c_str());
+		} else if (commands[i][0] == "theme" && commands[i].size() == 2) {
+			theme = commands[i][1];
+		}
+	}
+
+	DataManager::SetDefaultValues();
+	gr_use_memory(width, height);
+	if (gui_init() != 0)
+		return -1;
+	double load = Now_Ms(CLOCK_MONOTONIC);
+	if (PageManager::LoadPackage("TWRP", theme, "main") != 0) {
+		LOGERR("Unable to load theme '%s'\n", theme.c_str());
+		return -1;
+	}
+	load = Now_Ms(CLOCK_MONOTONIC) - load;
+	PageManager::SelectPackage("TWRP");
+	gui_forceRender();
+
+	sections.push_back(Section());
+	sections.back().name = "start";
+	Run_Frame(sections.back());
+
+	for (; i < commands.size(); i++) {
+		const std::vector<std::string>& args = commands[i];
+		const std::string& cmd = args[0];
+		Section& section = sections.back();
+
+		if (cmd == "section" && args.size() == 2) {
+			sections.push_back(Section());
+			sections.back().name = args[1];
+		} else if (cmd == "page" && args.size() == 2) {
+			gui_changePage(args[1]);
+			Run_Frame(section);
+		} else if (cmd == "frames" && args.size() == 2) {
+			for (int n = atoi(args[1].c_str()); n > 0; n--)
+				Run_Frame(section);
+		} else if (cmd == "tap" && args.size() == 3) {
+			int x = atoi(args[1].c_str()), y = atoi(args[2].c_str());
+			PageManager::NotifyTouch(TOUCH_START, x, y);
+			Run_Frame(section);
+			PageManager::NotifyTouch(TOUCH_RELEASE, x, y);
+			Run_Frame(section);
+		} else if (cmd == "drag" && args.size() == 6) {
+			int x1 = atoi(args[1].c_str()), y1 = atoi(args[2].c_str());
+			int x2 = atoi(args[3].c_str()), y2 = atoi(args[4].c_str());
+			int steps = std::max(atoi(args[5].c_str()), 1);
+			PageManager::NotifyTouch(TOUCH_START, x1, y1);
+			Run_Frame(section);
+			// One drag notice per frame, like the input handler sends them
+			for (int n = 1; n <= steps; n++) {
+				PageManager::NotifyTouch(TOUCH_DRAG, x1 + (x2 - x1) * n / steps, y1 + (y2 - y1) * n / steps);
+				Run_Frame(section);
+			}
+			PageManager::NotifyTouch(TOUCH_RELEASE, x2, y2);
+			Run_Frame(section);
+		} else if (cmd == "key" && args.size() == 2) {
+			int key = atoi(args[1].c_str());
+			PageManager::NotifyKey(key, true);
+			Run_Frame(section);
+			PageManager::NotifyKey(key, false);
+			Run_Frame(section);
+		} else if (cmd == "print" && args.size() == 3) {
+			for (int n = atoi(args[1].c_str()); n > 0; n--)
+				gui_print("%s\n", args[2].c_str());
+		} else if (cmd == "var" && args.size() == 3) {
+			DataManager::SetValue(args[1], args[2]);
+		} else {
+			LOGERR("Unknown benchmark command '%s' with %zu arguments\n", cmd.c_str(), args.size() - 1);
+			return -1;
+		}
+	}
+
+	FILE* fp = fopen(output, "w");
+	if (!fp) {
+		LOGERR("Unable to write benchmark results to '%s'\n", output);
+		return -1;
+	}
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"format\": %d,\n", BENCHMARK_FORMAT_VERSION);
+	fprintf(fp, "  \"theme\": \"%s\",\n", theme.c_str());
+	fprintf(fp, "  \"screen\": { \"width\": %d, \"height\": %d },\n", width, height);
+	fprintf(fp, "  \"theme_load_ms\": %.3f,\n", load);
+	fprintf(fp, "  \"sections\": [\n");
+	for (i = 0; i < sections.size(); i++)
+		Write_Section(fp, sections[i], i + 1 == sections.size());
+	fprintf(fp, "  ]\n}\n");
+	fclose(fp);
+	gr_exit();
+	printf("GUI benchmark results written to '%s'\n", output);
+	return 0;
+}
@@ -189,6 +189,32 @@ int GUIButton::Update(void)
 	return ret;
 }
 
+int GUIButton::GetDamageRect(int& x, int& y, int& w, int& h)
+{
+	DamageRect damage;
+
+	if (RenderObject::GetDamageRect(x, y, w, h) == 0)
+		damage.Add(x, y, w, h);
+	if (mButtonImg) {
+		if (mButtonImg->GetDamageRect(x, y, w, h) != 0)
+			return -1;
+		damage.Add(x, y, w, h);
+	}
+	if (mButtonLabel) {
+		if (mButtonLabel->GetDamageRect(x, y, w, h) != 0)
+			return -1;
+		damage.Add(x, y, w, h);
+	}
+	if (damage.IsEmpty())
+		return -1;
+
+	x = damage.x;
+	y = damage.y;
+	w = damage.w;
+	h = damage.h;
+	return 0;
+}
+
 int GUIButton::SetRenderPos(int x, int y, int w, int h)
 {
 	mRenderX = x;
@@ -28,6 +28,9 @@
 #include <pthread.h>
 
 #include <string>
+#include <deque>
+#include <set>
+#include <algorithm>
 
 extern "C" {
 #include "../twcommon.h"
@@ -40,13 +43,26 @@ extern "C" {
 #include "twmsg.h"
 
 #define GUI_CONSOLE_BUFFER_SIZE 512
+// Lines and messages kept for the consoles, older ones are dropped
+#define GUI_CONSOLE_MAX_LINES 4096
 
-static pthread_mutex_t console_lock;
-static size_t last_message_count = 0;
-static std::vector<Message> gMessages;
+struct ConsoleLine
+{
+	std::string text;
+	const std::string* color; // interned, see intern_color()
+};
 
-static std::vector<std::string> gConsole;
-static std::vector<std::string> gConsoleColor;
+static pthread_mutex_t console_lock;
+static size_t last_message_count = 0; // messages in gMessages already added to gConsole
+static std::deque<Message> gMessages; // kept for retranslation
+
+// Ring of the last GUI_CONSOLE_MAX_LINES lines. Lines are numbered by
+// gConsoleSeq, which counts every line ever added, so consoles can tell
+// which lines they are missing and which ones were dropped already.
+static ConsoleLine gConsole[GUI_CONSOLE_MAX_LINES];
+static size_t gConsoleSeq = 0;
+static size_t gConsoleStart = 0; // first line after the last retranslation
+static std::set<std::string> gConsoleColors;
 static FILE* ors_file = NULL;
 
 struct InitMutex
@@ -54,6 +70,22 @@ struct InitMutex
 	InitMutex() { pthread_mutex_init(&console_lock, NULL); }
 } initMutex;
 
+// Must be called with console_lock held
+static const std::string* intern_color(const char* color)
+{
+	return &*gConsoleColors.insert(color).first;
+}
+
+// Must be called with console_lock held. Swaps the text into the ring so
+// the allocation of the line that falls out is freed by the caller.
+static void add_console_line(std::string& text, const std::string* color)
+{
+	ConsoleLine& line = gConsole[gConsoleSeq % GUI_CONSOLE_MAX_LINES];
+	line.text.swap(text);
+	line.color = color;
+	gConsoleSeq++;
+}
+
 static void internal_gui_print(const char *color, char *buf)
 {
 	// make sure to flush any outstanding messages first to preserve order of outputs
@@ -72,14 +104,13 @@ static void internal_gui_print(const char *color, char *buf)
 		return;
 	}
 
-	pthread_mutex_lock(&console_lock);
+	std::vector<std::string> lines;
 	for (start = next = buf; *next != '\0';)
 	{
 		if (*next == '\n')
 		{
 			*next = '\0';
-			gConsole.push_back(start);
-			gConsoleColor.push_back(color);
+			lines.push_back(start);
 
 			start = ++next;
 		}
@@ -88,10 +119,13 @@ static void internal_gui_print(const char *color, char *buf)
 	}
 
 	// The text after last \n (or whole string if there is no \n)
-	if (*start) {
-		gConsole.push_back(start);
-		gConsoleColor.push_back(color);
-	}
+	if (*start)
+		lines.push_back(start);
+
+	pthread_mutex_lock(&console_lock);
+	const std::string* line_color = intern_color(color);
+	for (size_t i = 0; i < lines.size(); i++)
+		add_console_line(lines[i], line_color);
 	pthread_mutex_unlock(&console_lock);
 }
 
@@ -167,6 +201,11 @@ void gui_msg(Message msg)
 	}
 	pthread_mutex_lock(&console_lock);
 	gMessages.push_back(msg);
+	if (gMessages.size() > GUI_CONSOLE_MAX_LINES) {
+		gMessages.pop_front();
+		if (last_message_count > 0)
+			last_message_count--;
+	}
 	pthread_mutex_unlock(&console_lock);
 }
 
@@ -182,15 +221,14 @@ void GUIConsole::Translate_Now()
 
 	for (size_t m = last_message_count; m < message_count; m++) {
 		std::string message = gMessages[m];
-		std::string color = "normal";
+		const char* color = "normal";
 		if (gMessages[m].GetKind() == msg::kError)
 			color = "error";
 		else if (gMessages[m].GetKind() == msg::kHighlight)
 			color = "highlight";
 		else if (gMessages[m].GetKind() == msg::kWarning)
 			color = "warning";
-		gConsole.push_back(message);
-		gConsoleColor.push_back(color);
+		add_console_line(message, intern_color(color));
 	}
 	last_message_count = message_count;
 	pthread_mutex_unlock(&console_lock);
@@ -200,8 +238,7 @@ void GUIConsole::Clear_For_Retranslation()
 {
 	pthread_mutex_lock(&console_lock);
 	last_message_count = 0;
-	gConsole.clear();
-	gConsoleColor.clear();
+	gConsoleStart = gConsoleSeq;
 	pthread_mutex_unlock(&console_lock);
 }
 
@@ -210,6 +247,7 @@ GUIConsole::GUIConsole(xml_node<>* node) : GUIScrollList(node)
 	xml_node<>* child;
 
 	mLastCount = 0;
+	mLastColorName = NULL;
 	scrollToEnd = true;
 	mSlideoutX = mSlideoutY = mSlideoutW = mSlideoutH = 0;
 	mSlideout = 0;
@@ -270,9 +308,7 @@ int GUIConsole::RenderSlideout(void)
 int GUIConsole::RenderConsole(void)
 {
 	Translate_Now();
-	pthread_mutex_lock(&console_lock);
-	AddLines(&gConsole, &gConsoleColor, &mLastCount, &rConsole, &rConsoleColor);
-	pthread_mutex_unlock(&console_lock);
+	AddConsoleLines();
 	GUIScrollList::Render();
 
 	// if last line is fully visible, keep tracking the last line when new lines are added
@@ -323,9 +359,7 @@ int GUIConsole::Update(void)
 		scrollToEnd = true;
 	}
 
-	pthread_mutex_lock(&console_lock);
-	bool addedNewText = AddLines(&gConsole, &gConsoleColor, &mLastCount, &rConsole, &rConsoleColor);
-	pthread_mutex_unlock(&console_lock);
+	bool addedNewText = AddConsoleLines();
 	if (addedNewText) {
 		// someone added new text
 		// at least the scrollbar must be updated, even if the new lines are currently not visible
@@ -384,6 +418,41 @@ int GUIConsole::NotifyTouch(TOUCH_STATE state, int x, int y)
 	return GUIScrollList::NotifyTouch(state, x, y);
 }
 
+// Word wraps the lines added to gConsole since the last call
+bool GUIConsole::AddConsoleLines(void)
+{
+	if (!mFont || !mFont->GetResource())
+		return false;
+
+	std::vector<std::string> wrapped;
+	pthread_mutex_lock(&console_lock);
+	size_t first = gConsoleSeq > GUI_CONSOLE_MAX_LINES ? gConsoleSeq - GUI_CONSOLE_MAX_LINES : 0;
+	if (first < gConsoleStart)
+		first = gConsoleStart;
+	if (mLastCount < first)
+		mLastCount = first; // skip what was dropped or retranslated
+	if (mLastCount == gConsoleSeq) {
+		pthread_mutex_unlock(&console_lock);
+		return false; // nothing to add
+	}
+	for (; mLastCount < gConsoleSeq; mLastCount++) {
+		const ConsoleLine& line = gConsole[mLastCount % GUI_CONSOLE_MAX_LINES];
+		size_t count = WrapLine(line.text, wrapped);
+		rConsoleColor.insert(rConsoleColor.end(), count, line.color);
+	}
+	pthread_mutex_unlock(&console_lock);
+
+	rConsole.insert(rConsole.end(), wrapped.begin(), wrapped.end());
+	if (rConsole.size() > GUI_CONSOLE_MAX_LINES) {
+		size_t drop = rConsole.size() - GUI_CONSOLE_MAX_LINES;
+		rConsole.erase(rConsole.begin(), rConsole.begin() + drop);
+		rConsoleColor.erase(rConsoleColor.begin(), rConsoleColor.begin() + drop);
+		// keep showing the same lines if the user scrolled back
+		firstDisplayedItem = std::max(firstDisplayedItem - (int)drop, 0);
+	}
+	return true;
+}
+
 size_t GUIConsole::GetItemCount()
 {
 	return rConsole.size();
@@ -392,14 +461,17 @@ size_t GUIConsole::GetItemCount()
 void GUIConsole::RenderItem(size_t itemindex, int yPos, bool selected __unused)
 {
 	// Set the color for the font
-	if (rConsoleColor[itemindex] == "normal") {
+	const std::string* color = rConsoleColor[itemindex];
+	if (*color == "normal") {
 		gr_color(mFontColor.red, mFontColor.green, mFontColor.blue, mFontColor.alpha);
 	} else {
-		COLOR FontColor;
-		std::string color = rConsoleColor[itemindex];
-		ConvertStrToColor(color, &FontColor);
-		FontColor.alpha = 255;
-		gr_color(FontColor.red, FontColor.green, FontColor.blue, FontColor.alpha);
+		// lines usually come in runs of the same color, parse it only once
+		if (color != mLastColorName) {
+			mLastColorName = color;
+			ConvertStrToColor(*color, &mLastColor);
+			mLastColor.alpha = 255;
+		}
+		gr_color(mLastColor.red, mLastColor.green, mLastColor.blue, mLastColor.alpha);
 	}
 
 	// render text
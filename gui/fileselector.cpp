@@ -32,6 +32,9 @@ extern "C" {
 #include "../twrp-functions.hpp"
 #include "../adbbu/libtwadbbu.hpp"
 
+// Entries the list thread reads before handing them to the GUI
+#define LIST_BATCH_SIZE 256
+
 int GUIFileSelector::mSortOrder = 0;
 
 GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
@@ -44,6 +47,7 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 	mUpdate = 0;
 	mPathVar = "cwd";
 	updateFileList = false;
+	mListJob = NULL;
 
 	// Load filter for filtering files (e.g. *.zip for only zips)
 	child = FindNode(node, "filter");
@@ -74,6 +78,7 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 			DataManager::SetValue(mPathVar, attr->value());
 		}
 	}
+	WatchVar(mPathVar);
 
 	// Handle the result variable
 	child = FindNode(node, "data");
@@ -92,6 +97,7 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 		attr = child->first_attribute("name");
 		if (attr)
 			mSortVariable = attr->value();
+		WatchVar(mSortVariable);
 		attr = child->first_attribute("default");
 		if (attr)
 			DataManager::SetValue(mSortVariable, attr->value());
@@ -133,6 +139,7 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 
 GUIFileSelector::~GUIFileSelector()
 {
+	CancelFileList();
 }
 
 int GUIFileSelector::Update(void)
@@ -152,6 +159,8 @@ int GUIFileSelector::Update(void)
 		} else
 			return 0;
 	}
+	if (mListJob && MergeFileList())
+		mUpdate = 1;
 
 	if (mUpdate) {
 		mUpdate = 0;
@@ -188,7 +197,7 @@ int GUIFileSelector::NotifyVarChange(const std::string& varName, const std::stri
 	return 0;
 }
 
-bool GUIFileSelector::fileSort(FileData d1, FileData d2)
+bool GUIFileSelector::fileSort(const FileData& d1, const FileData& d2)
 {
 	if (d1.fileName == ".")
 		return -1;
@@ -224,46 +233,68 @@ bool GUIFileSelector::fileSort(FileData d1, FileData d2)
 	return 0;
 }
 
+// Starts reading folder in the background; Update() shows the entries as
+// they arrive
 int GUIFileSelector::GetFileList(const std::string folder)
 {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
+	CancelFileList();
 
 	// Clear all data
 	mFolderList.clear();
 	mFileList.clear();
 
-	d = opendir(folder.c_str());
-	if (d == NULL) {
-		LOGINFO("Unable to open '%s'\n", folder.c_str());
-		if (folder != "/" && (mShowNavFolders != 0 || mShowFiles != 0)) {
-			size_t found;
-			found = folder.find_last_of('/');
-			if (found != string::npos) {
-				string new_folder = folder.substr(0, found);
-
-				if (new_folder.length() < 2)
-					new_folder = "/";
-				DataManager::SetValue(mPathVar, new_folder);
-			}
-		}
+	ListJob* job = new ListJob;
+	job->folder = folder;
+	job->extn = mExtn;
+	job->showNavFolders = mShowNavFolders != 0;
+	job->needStat = mSortOrder == 2 || mSortOrder == -2 || mSortOrder == 3 || mSortOrder == -3;
+	pthread_mutex_init(&job->lock, NULL);
+	job->done = job->failed = job->cancel = false;
+
+	if (pthread_create(&mListThread, NULL, ListThread, job) != 0) {
+		LOGERR("Unable to create thread to list '%s'\n", folder.c_str());
+		pthread_mutex_destroy(&job->lock);
+		delete job;
 		return -1;
 	}
+	mListJob = job;
+	return 0;
+}
+
+void* GUIFileSelector::ListThread(void* cookie)
+{
+	ListJob* job = (ListJob*) cookie;
+	DIR* d;
+	struct dirent* de;
+	struct stat st;
+	std::vector<FileData> folders, files;
+
+	d = opendir(job->folder.c_str());
+	if (d == NULL) {
+		LOGINFO("Unable to open '%s'\n", job->folder.c_str());
+		pthread_mutex_lock(&job->lock);
+		job->failed = job->done = true;
+		pthread_mutex_unlock(&job->lock);
+		return NULL;
+	}
 
-	while ((de = readdir(d)) != NULL) {
+	bool cancelled = false;
+	while (!cancelled && (de = readdir(d)) != NULL) {
 		FileData data;
 
 		data.fileName = de->d_name;
 		if (data.fileName == ".")
 			continue;
-		if (data.fileName == ".." && folder == "/")
+		if (data.fileName == ".." && job->folder == "/")
 			continue;
 
 		data.fileType = de->d_type;
 
-		std::string path = folder + "/" + data.fileName;
-		stat(path.c_str(), &st);
+		// Only sorting by size or date needs more than the name and type
+		std::string path = job->folder + "/" + data.fileName;
+		memset(&st, 0, sizeof(st));
+		if (job->needStat)
+			stat(path.c_str(), &st);
 		data.protection = st.st_mode;
 		data.userId = st.st_uid;
 		data.groupId = st.st_gid;
@@ -276,23 +307,99 @@ int GUIFileSelector::GetFileList(const std::string folder)
 			data.fileType = TWFunc::Get_D_Type_From_Stat(path);
 		}
 		if (data.fileType == DT_DIR) {
-			if (mShowNavFolders || (data.fileName != "." && data.fileName != ".."))
-				mFolderList.push_back(data);
+			if (job->showNavFolders || (data.fileName != "." && data.fileName != ".."))
+				folders.push_back(data);
 		} else if (data.fileType == DT_REG || data.fileType == DT_LNK || data.fileType == DT_BLK) {
-			if (mExtn.empty() || (data.fileName.length() > mExtn.length() && data.fileName.substr(data.fileName.length() - mExtn.length()) == mExtn)) {
-				if (mExtn == ".ab" && twadbbu::Check_ADB_Backup_File(path))
-					mFolderList.push_back(data);
+			const std::string& extn = job->extn;
+			if (extn.empty() || (data.fileName.length() > extn.length() && data.fileName.substr(data.fileName.length() - extn.length()) == extn)) {
+				if (extn == ".ab" && twadbbu::Check_ADB_Backup_File(path))
+					folders.push_back(data);
 				else
-					mFileList.push_back(data);
+					files.push_back(data);
 			}
 		}
+		if (folders.size() + files.size() >= LIST_BATCH_SIZE)
+			cancelled = !HandOver(job, folders, files);
 	}
 	closedir(d);
 
-	std::sort(mFolderList.begin(), mFolderList.end(), fileSort);
-	std::sort(mFileList.begin(), mFileList.end(), fileSort);
+	HandOver(job, folders, files);
+	pthread_mutex_lock(&job->lock);
+	job->done = true;
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
 
-	return 0;
+// Moves a batch to the job, returns false if the listing was cancelled
+bool GUIFileSelector::HandOver(ListJob* job, std::vector<FileData>& folders, std::vector<FileData>& files)
+{
+	pthread_mutex_lock(&job->lock);
+	bool cancel = job->cancel;
+	if (!cancel) {
+		job->folders.insert(job->folders.end(), folders.begin(), folders.end());
+		job->files.insert(job->files.end(), files.begin(), files.end());
+	}
+	pthread_mutex_unlock(&job->lock);
+	folders.clear();
+	files.clear();
+	return !cancel;
+}
+
+void GUIFileSelector::MergeSorted(std::vector<FileData>& list, std::vector<FileData>& batch)
+{
+	if (batch.empty())
+		return;
+	std::sort(batch.begin(), batch.end(), fileSort);
+	size_t start = list.size();
+	list.insert(list.end(), batch.begin(), batch.end());
+	std::inplace_merge(list.begin(), list.begin() + start, list.end(), fileSort);
+}
+
+// Takes what the list thread has read so far, returns true if the lists changed
+bool GUIFileSelector::MergeFileList()
+{
+	std::vector<FileData> folders, files;
+	pthread_mutex_lock(&mListJob->lock);
+	folders.swap(mListJob->folders);
+	files.swap(mListJob->files);
+	bool done = mListJob->done;
+	bool failed = mListJob->failed;
+	pthread_mutex_unlock(&mListJob->lock);
+
+	MergeSorted(mFolderList, folders);
+	MergeSorted(mFileList, files);
+	bool changed = !folders.empty() || !files.empty();
+
+	if (done) {
+		std::string folder = mListJob->folder;
+		CancelFileList();
+		if (failed && folder != "/" && (mShowNavFolders != 0 || mShowFiles != 0)) {
+			size_t found;
+			found = folder.find_last_of('/');
+			if (found != string::npos) {
+				string new_folder = folder.substr(0, found);
+
+				if (new_folder.length() < 2)
+					new_folder = "/";
+				DataManager::SetValue(mPathVar, new_folder);
+			}
+		}
+		changed = true;
+	}
+	return changed;
+}
+
+void GUIFileSelector::CancelFileList()
+{
+	if (!mListJob)
+		return;
+	pthread_mutex_lock(&mListJob->lock);
+	mListJob->cancel = true;
+	pthread_mutex_unlock(&mListJob->lock);
+	pthread_join(mListThread, NULL);
+	pthread_mutex_destroy(&mListJob->lock);
+	delete mListJob;
+	mListJob = NULL;
 }
 
 void GUIFileSelector::SetPageFocus(int inFocus)
@@ -31,6 +31,7 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <poll.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -47,6 +48,7 @@ extern "C"
 #include "../variables.h"
 #include "../partitions.hpp"
 #include "../twrp-functions.hpp"
+#include "../twrpTrace.hpp"
 #include "../openrecoveryscript.hpp"
 #include "../orscmd/orscmd.h"
 #include "blanktimer.hpp"
@@ -65,6 +67,7 @@ using namespace rapidxml;
 
 // Global values
 static int gGuiInitialized = 0;
+static int gHeadless = 0;
 static TWAtomicInt gForceRender;
 blanktimer blankTimer;
 int ors_read_fd = -1;
@@ -74,6 +77,7 @@ static float scale_theme_h = 1;
 
 // Needed by pages.cpp too
 int gGuiRunning = 0;
+pthread_t gGuiThread; // runs runPages() while gGuiRunning is set
 
 int g_pty_fd = -1;  // set by terminal on init
 void terminal_pty_read();
@@ -93,7 +97,12 @@ static void flip(void)
 		write(gRecorder, &time, sizeof(timespec));
 		gr_write_frame_to_file(gRecorder);
 	}
-	gr_flip();
+
+	int x, y, w, h;
+	if (PageManager::GetFlipRegion(x, y, w, h))
+		gr_flip_region(x, y, w, h);
+	else
+		gr_flip();
 }
 
 void rapidxml::parse_error_handler(const char *what, void *where)
@@ -434,6 +443,7 @@ static void setup_ors_command()
 static void ors_command_done()
 {
 	gui_set_FILE(NULL);
+	OpenRecoveryScript::Set_Result_File(NULL);
 	fclose(orsout);
 	orsout = NULL;
 
@@ -470,10 +480,19 @@ static void ors_command_read()
 			LOGINFO("Command cannot be performed, operation in progress.\n");
 			fclose(orsout);
 		} else {
+			OpenRecoveryScript::Set_Result_File(orsout);
 			if (strlen(command) == 11 && strncmp(command, "dumpstrings", 11) == 0) {
 				gui_set_FILE(orsout);
-				PageManager::GetResources()->DumpStrings();
+				if (PageManager::GetResources())
+					PageManager::GetResources()->DumpStrings();
 				ors_command_done();
+			} else if (gHeadless) {
+				// nothing else runs on this thread without pages, so run it here
+				gui_set_FILE(orsout);
+				OpenRecoveryScript::Call_After_CLI_Command(ors_command_done);
+				DataManager::SetValue(TW_ACTION_BUSY, 1);
+				OpenRecoveryScript::Run_CLI_Command(command);
+				DataManager::SetValue(TW_ACTION_BUSY, 0);
 			} else {
 				// mirror output messages
 				gui_set_FILE(orsout);
@@ -497,10 +516,31 @@ static void ors_command_read()
 	}
 }
 
+// Fill in the fds that runPages() services besides the input devices
+static unsigned get_misc_fds(struct pollfd* fds)
+{
+	unsigned count = 0;
+	if (g_pty_fd > 0)
+		fds[count++].fd = g_pty_fd;
+	if (PartitionManager.uevent_pfd.fd > 0)
+		fds[count++].fd = PartitionManager.uevent_pfd.fd;
+#ifndef TW_OEM_BUILD
+	if (ors_read_fd > 0 && !orsout) // orsout is non-NULL if a command is still running
+		fds[count++].fd = ors_read_fd;
+#endif
+	for (unsigned i = 0; i < count; i++) {
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+	}
+	return count;
+}
+
 // Get and dispatch input events until it's time to draw the next frame
 // This special function will return immediately the first time, but then
 // always returns 1/30th of a second (or immediately if called later) from
 // the last time it was called
+// While nothing is queued it sleeps in poll() on the input devices and the
+// pty, uevent and ORS fds, and returns early when one of those has data.
 static void loopTimer(int input_timeout_ms)
 {
 	static timespec lastCall;
@@ -513,9 +553,12 @@ static void loopTimer(int input_timeout_ms)
 		return;
 	}
 
+	struct pollfd misc_fds[3];
+	unsigned misc_count = get_misc_fds(misc_fds);
+
 	do
 	{
-		bool got_event = input_handler.processInput(input_timeout_ms); // get inputs but don't send drag notices
+		bool got_event = input_handler.processInput(0); // get inputs but don't send drag notices
 		timespec curTime;
 		clock_gettime(CLOCK_MONOTONIC, &curTime);
 
@@ -534,11 +577,23 @@ static void loopTimer(int input_timeout_ms)
 			input_handler.handleDrag(); // send only drag notices if needed
 			return;
 		}
+		if (got_event)
+			continue; // there might be more in the queue
 
-		// We need to sleep some period time microseconds
-		//unsigned int sleepTime = 33333 -(diff.tv_nsec / 1000);
-		//usleep(sleepTime); // removed so we can scan for input
+		// Sleep until the frame is due, or longer when the pages are idle
+		int wait_ms = (33333333 - diff.tv_nsec) / 1000000 + 1;
+		if (input_timeout_ms > wait_ms)
+			wait_ms = input_timeout_ms;
 		input_timeout_ms = 0;
+		if (ev_poll(misc_fds, misc_count, wait_ms) > 0) {
+			for (unsigned i = 0; i < misc_count; i++) {
+				if (misc_fds[i].revents & POLLIN)
+					return; // runPages() reads it right away
+				// a hung up fifo stays ready, don't let it wake us again
+				if (misc_fds[i].revents)
+					misc_fds[i].fd = -1;
+			}
+		}
 	} while (1);
 }
 
@@ -552,6 +607,7 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 		gui_changePage(page_name);
 	}
 
+	gGuiThread = pthread_self();
 	gGuiRunning = 1;
 
 	DataManager::SetValue("tw_loaded", 1);
@@ -591,7 +647,11 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 				ors_command_read();
 		}
 
-		if (!gForceRender.get_value())
+		PageManager::FlushVarChanges();
+
+		// Clearing the flag before the check keeps a request made while this
+		// frame renders for the next one
+		if (!gForceRender.exchange(0))
 		{
 			int ret = PageManager::Update();
 			if (ret == 0)
@@ -604,18 +664,22 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 			input_timeout_ms = idle_frames > 15 ? 1000 : 0;
 
 #ifndef PRINT_RENDER_TIME
-			if (ret > 1)
-				PageManager::Render();
+			if (ret > 1) {
+				twrpTraceScope trace("ui", "RenderDamage");
+				PageManager::RenderDamage();
+			}
 
-			if (ret > 0)
+			if (ret > 0) {
+				twrpTraceScope trace("ui", "flip");
 				flip();
+			}
 #else
 			if (ret > 1)
 			{
 				timespec start, end;
 				int32_t render_t, flip_t;
 				clock_gettime(CLOCK_MONOTONIC, &start);
-				PageManager::Render();
+				PageManager::RenderDamage();
 				clock_gettime(CLOCK_MONOTONIC, &end);
 				render_t = TWFunc::timespec_diff_ms(start, end);
 
@@ -623,7 +687,7 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 				clock_gettime(CLOCK_MONOTONIC, &start);
 				flip_t = TWFunc::timespec_diff_ms(end, start);
 
-				LOGINFO("Render(): %u ms, flip(): %u ms, total: %u ms\n", render_t, flip_t, render_t+flip_t);
+				LOGINFO("RenderDamage(): %u ms, flip(): %u ms, total: %u ms\n", render_t, flip_t, render_t+flip_t);
 			}
 			else if (ret > 0)
 				flip();
@@ -631,7 +695,7 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 		}
 		else
 		{
-			gForceRender.set_value(0);
+			twrpTraceScope trace("ui", "Render");
 			PageManager::Render();
 			flip();
 			input_timeout_ms = 0;
@@ -654,6 +718,23 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 	return 0;
 }
 
+int gui_runFrame(void)
+{
+	PageManager::FlushVarChanges();
+	if (gForceRender.exchange(0))
+	{
+		PageManager::Render();
+		flip();
+		return 3;
+	}
+	int ret = PageManager::Update();
+	if (ret > 1)
+		PageManager::RenderDamage();
+	if (ret > 0)
+		flip();
+	return ret;
+}
+
 int gui_forceRender(void)
 {
 	gForceRender.set_value(1);
@@ -676,10 +757,9 @@ int gui_changeOverlay(std::string overlay)
 	return 0;
 }
 
-std::string gui_parse_text(std::string str)
+// Replaces string resources ({@resource_name} or {@resource_name=default})
+static void gui_expand_resources(std::string& str)
 {
-	// This function parses text for DataManager values encompassed by %value% in the XML
-	// and string resources (%@resource_name%)
 	size_t pos = 0, next, end;
 
 	while (1)
@@ -697,15 +777,24 @@ std::string gui_parse_text(std::string str)
 
 		size_t default_loc = var.find('=', 0);
 		std::string lookup;
+		const ResourceManager* res = PageManager::GetResources();
 		if (default_loc == std::string::npos) {
-			str.insert(next, PageManager::GetResources()->FindString(var));
+			str.insert(next, res ? res->FindString(var) : "[" + var + "]");
 		} else {
 			lookup = var.substr(0, default_loc);
 			std::string default_string = var.substr(default_loc + 1, var.size() - default_loc - 1);
-			str.insert(next, PageManager::GetResources()->FindString(lookup, default_string));
+			str.insert(next, res ? res->FindString(lookup, default_string) : default_string);
 		}
 	}
-	pos = 0;
+}
+
+std::string gui_parse_text(std::string str)
+{
+	// This function parses text for DataManager values encompassed by %value% in the XML
+	// and string resources (%@resource_name%)
+	size_t pos = 0, next, end;
+
+	gui_expand_resources(str);
 	while (1)
 	{
 		next = str.find('%', pos);
@@ -727,7 +816,8 @@ std::string gui_parse_text(std::string str)
 			std::string value;
 			if (var.size() > 0 && var[0] == '@') {
 				// this is a string resource ("%@string_name%")
-				value = PageManager::GetResources()->FindString(var.substr(1));
+				const ResourceManager* res = PageManager::GetResources();
+				value = res ? res->FindString(var.substr(1)) : "[" + var.substr(1) + "]";
 				str.insert(next, value);
 			}
 			else if (DataManager::GetValue(var, value) == 0)
@@ -738,8 +828,123 @@ std::string gui_parse_text(std::string str)
 	}
 }
 
+void gui_text_vars(std::string str, std::set<std::string>& vars)
+{
+	size_t pos = 0, next, end;
+
+	// Translated strings can refer to variables too
+	gui_expand_resources(str);
+	while ((next = str.find('%', pos)) != std::string::npos)
+	{
+		end = str.find('%', next + 1);
+		if (end == std::string::npos)
+			break;
+
+		// "%%" is a literal '%' and "%@name%" a string resource
+		if (next + 1 != end && str[next + 1] != '@')
+			vars.insert(str.substr(next + 1, (end - next) - 1));
+		pos = end + 1;
+	}
+}
+
+std::string gui_resolve_resources(std::string str)
+{
+	size_t pos = 0, next, end;
+
+	gui_expand_resources(str);
+	while ((next = str.find('%', pos)) != std::string::npos)
+	{
+		end = str.find('%', next + 1);
+		if (end == std::string::npos)
+			break;
+
+		if (next + 1 != end && str[next + 1] == '@') {
+			std::string var = str.substr(next + 2, (end - next) - 2);
+			const ResourceManager* res = PageManager::GetResources();
+			std::string value = res ? res->FindString(var) : "[" + var + "]";
+			str.replace(next, (end - next) + 1, value);
+			pos = next + value.size();
+		} else {
+			// keep "%%" and variables for gui_parse_text
+			pos = end + 1;
+		}
+	}
+	return str;
+}
+
+void GUITextTemplate::Compile(const std::string& text)
+{
+	size_t pos = 0, next, end;
+	Segment literal;
+
+	mSegments.clear();
+	mVarCount = 0;
+	literal.variable = false;
+	literal.resource = false;
+	while ((next = text.find('%', pos)) != std::string::npos)
+	{
+		end = text.find('%', next + 1);
+		if (end == std::string::npos)
+			break;
+
+		literal.text.append(text, pos, next - pos);
+		if (next + 1 == end) {
+			literal.text += '%';
+		} else {
+			if (!literal.text.empty()) {
+				mSegments.push_back(literal);
+				literal.text.clear();
+			}
+			Segment var;
+			var.variable = true;
+			var.resource = text[next + 1] == '@';
+			var.text = text.substr(next + 1 + var.resource, end - next - 1 - var.resource);
+			mSegments.push_back(var);
+			mVarCount++;
+		}
+		pos = end + 1;
+	}
+	literal.text.append(text, pos, std::string::npos);
+	if (!literal.text.empty())
+		mSegments.push_back(literal);
+}
+
+bool GUITextTemplate::Evaluate(std::string& out, bool force)
+{
+	bool changed = force;
+	std::string value;
+
+	for (std::vector<Segment>::iterator it = mSegments.begin(); it != mSegments.end(); ++it) {
+		if (!it->variable)
+			continue;
+		if (it->resource) {
+			const ResourceManager* res = PageManager::GetResources();
+			value = res ? res->FindString(it->text) : "[" + it->text + "]";
+		} else if (DataManager::GetValue(it->text, value) != 0)
+			value.clear();
+		if (value != it->value) {
+			it->value.swap(value);
+			changed = true;
+		}
+	}
+	if (!changed)
+		return false;
+
+	out.clear();
+	for (std::vector<Segment>::const_iterator it = mSegments.begin(); it != mSegments.end(); ++it)
+		out += it->variable ? it->value : it->text;
+	return true;
+}
+
+unsigned gui_string_generation()
+{
+	const ResourceManager* res = PageManager::GetResources();
+	return res ? res->GetStringGeneration() : 0;
+}
+
 std::string gui_lookup(const std::string& resource_name, const std::string& default_value) {
-	return PageManager::GetResources()->FindString(resource_name, default_value);
+	const ResourceManager* res = PageManager::GetResources();
+	return res ? res->FindString(resource_name, default_value) : default_value;
 }
 
 extern "C" int gui_init(void)
@@ -886,6 +1091,49 @@ extern "C" int gui_startPage(const char *page_name, const int allow_commands, in
 	return runPages(page_name, stop_on_page_done);
 }
 
+// Serves the ORS command pipe without pages, a theme or the display, for
+// recovery driven only by scripts and adb backup. Returns once tw_gui_done
+// is set; the commands themselves usually end in a reboot.
+extern "C" int gui_startHeadless(void)
+{
+	gHeadless = 1;
+	DataManager::SetValue("tw_page_done", 0);
+	DataManager::SetValue("tw_gui_done", 0);
+	DataManager::SetValue("tw_loaded", 1);
+#ifndef TW_OEM_BUILD
+	if (ors_read_fd < 0)
+		setup_ors_command();
+#endif
+
+	struct pollfd fds[3];
+	while (DataManager::GetIntValue("tw_gui_done") == 0) {
+		unsigned count = get_misc_fds(fds);
+		// wake up now and then in case tw_gui_done was set by another thread
+		if (poll(fds, count, 1000) <= 0)
+			continue;
+		for (unsigned i = 0; i < count; i++) {
+			if (fds[i].fd == ors_read_fd && fds[i].revents && !(fds[i].revents & POLLIN)) {
+				// a writer hung up without a command, the fifo would stay ready
+				close(ors_read_fd);
+				setup_ors_command();
+			} else if (!(fds[i].revents & POLLIN))
+				continue;
+			else if (fds[i].fd == g_pty_fd)
+				terminal_pty_read();
+			else if (fds[i].fd == PartitionManager.uevent_pfd.fd)
+				PartitionManager.read_uevent();
+			else if (fds[i].fd == ors_read_fd && !orsout)
+				ors_command_read();
+		}
+	}
+
+	if (ors_read_fd > 0)
+		close(ors_read_fd);
+	ors_read_fd = -1;
+	set_select_fd();
+	gHeadless = 0;
+	return 0;
+}
 
 extern "C" void set_scale_values(float w, float h)
 {
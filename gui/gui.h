@@ -26,6 +26,9 @@ int gui_loadResources();
 int gui_loadCustomResources();
 int gui_start();
 int gui_startPage(const char* page_name, const int allow_comands, int stop_on_page_done);
+int gui_startHeadless();
+// Loads theme off-screen, runs the script and writes the frame times to output
+int gui_benchmark(const char* script, const char* output);
 void gui_print(const char *fmt, ...);
 void gui_print_color(const char *color, const char *fmt, ...);
 void gui_set_FILE(FILE* f);
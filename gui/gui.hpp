@@ -19,6 +19,10 @@
 #ifndef _GUI_HPP_HEADER
 #define _GUI_HPP_HEADER
 
+#include <set>
+#include <string>
+#include <vector>
+
 #include "twmsg.h"
 
 void set_select_fd();
@@ -30,6 +34,39 @@ void gui_highlight(const char* text);
 void gui_msg(Message msg);
 
 std::string gui_parse_text(std::string inText);
+// Adds the DataManager variables gui_parse_text would read for inText to vars
+void gui_text_vars(std::string inText, std::set<std::string>& vars);
 std::string gui_lookup(const std::string& resource_name, const std::string& default_value);
+// Looks up only the string resources in inText ({@name}, {@name=default} and
+// %@name%), leaving the variables for gui_parse_text
+std::string gui_resolve_resources(std::string inText);
+// Changes whenever string resources are added or replaced, e.g. on a language change
+unsigned gui_string_generation();
+
+// A text split once into literal parts and %variable% references, so that
+// evaluating it reads the variables without scanning the text again and only
+// rebuilds the result when one of them changed. Gives the same result as
+// gui_parse_text for a text whose string resources are already resolved.
+class GUITextTemplate
+{
+public:
+	GUITextTemplate() : mVarCount(0) {}
+	void Compile(const std::string& text);
+	bool HasVars() const { return mVarCount > 0; }
+	// Brings out up to date, returns true if it was rebuilt. force rebuilds
+	// out even if no variable changed, e.g. after Compile.
+	bool Evaluate(std::string& out, bool force);
+
+private:
+	struct Segment
+	{
+		std::string text; // literal text, or the name of the variable
+		std::string value; // last value of the variable
+		bool variable;
+		bool resource; // %@name% that only showed up after resolving
+	};
+	std::vector<Segment> mSegments;
+	unsigned mVarCount;
+};
 
 #endif //_GUI_HPP_HEADER
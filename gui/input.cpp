@@ -132,6 +132,7 @@ GUIInput::GUIInput(xml_node<>* node)
 		attr = child->first_attribute("name");
 		if (attr)
 			mVariable = attr->value();
+		WatchVar(mVariable);
 		attr = child->first_attribute("default");
 		if (attr)
 			DataManager::SetValue(mVariable, attr->value());
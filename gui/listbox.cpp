@@ -63,6 +63,7 @@ GUIListBox::GUIListBox(xml_node<>* node) : GUIScrollList(node)
 		attr = child->first_attribute("name");
 		if (attr)
 			mVariable = attr->value();
+		WatchVar(mVariable);
 		attr = child->first_attribute("default");
 		if (attr)
 			DataManager::SetValue(mVariable, attr->value());
@@ -111,6 +112,7 @@ GUIListBox::GUIListBox(xml_node<>* node) : GUIScrollList(node)
 			attr = variable_name->first_attribute("variable");
 			if (attr) {
 				item.variableName = attr->value();
+				WatchVar(item.variableName);
 				item.selected = (DataManager::GetIntValue(item.variableName) != 0);
 				allowSelection = true;
 				isCheckList = true;
@@ -118,6 +120,7 @@ GUIListBox::GUIListBox(xml_node<>* node) : GUIScrollList(node)
 		}
 
 		LoadConditions(child, item.mConditions);
+		WatchConditionVars(item.mConditions);
 
 		mListItems.push_back(item);
 		mVisibleItems.push_back(mListItems.size()-1);
@@ -32,11 +32,15 @@ extern "C" {
 #include "objects.hpp"
 #include "../data.hpp"
 
+unsigned GUIObject::mWatchGeneration = 0;
+
 GUIObject::GUIObject(xml_node<>* node)
 {
 	mConditionsResult = true;
+	mWatchAllVars = false;
 	if (node)
 		LoadConditions(node, mConditions);
+	WatchConditionVars(mConditions);
 }
 
 void GUIObject::LoadConditions(xml_node<>* node, std::vector<Condition>& conditions)
@@ -169,6 +173,47 @@ int GUIObject::NotifyVarChange(const std::string& varName, const std::string& va
 	return 0;
 }
 
+void GUIObject::WatchVar(const std::string& varName)
+{
+	if (!varName.empty() && mWatchedVars.insert(varName).second)
+		mWatchGeneration++;
+}
+
+void GUIObject::WatchVars(const GUIObject* other)
+{
+	if (other->mWatchAllVars)
+		WatchAllVars();
+	std::set<std::string>::const_iterator iter;
+	for (iter = other->mWatchedVars.begin(); iter != other->mWatchedVars.end(); ++iter)
+		WatchVar(*iter);
+}
+
+void GUIObject::WatchConditionVars(const std::vector<Condition>& conditions)
+{
+	std::vector<Condition>::const_iterator iter;
+	for (iter = conditions.begin(); iter != conditions.end(); ++iter)
+	{
+		WatchVar(iter->mVar1);
+		WatchVar(iter->mVar2);
+	}
+}
+
+void GUIObject::WatchTextVars(const std::string& text)
+{
+	std::set<std::string> vars;
+	gui_text_vars(text, vars);
+	std::set<std::string>::iterator iter;
+	for (iter = vars.begin(); iter != vars.end(); ++iter)
+		WatchVar(*iter);
+}
+
+void GUIObject::WatchAllVars()
+{
+	if (!mWatchAllVars)
+		mWatchGeneration++;
+	mWatchAllVars = true;
+}
+
 bool GUIObject::UpdateConditions(std::vector<Condition>& conditions, const std::string& varName)
 {
 	bool result = true;
@@ -26,14 +26,18 @@
 #include <string>
 #include <map>
 #include <set>
+#include <deque>
 #include <time.h>
+#include <pthread.h>
 
 using namespace rapidxml;
 
 #include "../data.hpp"
+#include "gui.hpp"
 #include "resources.hpp"
 #include "pages.hpp"
 #include "../partitions.hpp"
+#include "../twinstall.h"
 #include "placement.h"
 
 #ifndef TW_X_OFFSET
@@ -67,6 +71,14 @@ public:
 	// GetRenderPos - Returns the current position of the object
 	virtual int GetRenderPos(int& x, int& y, int& w, int& h) { x = mRenderX; y = mRenderY; w = mRenderW; h = mRenderH; return 0; }
 
+	// GetDamageRect - Returns the area the object may draw into
+	//  Return 0 on success, <0 if the area is unknown and a full render is required
+	virtual int GetDamageRect(int& x, int& y, int& w, int& h) { GetRenderPos(x, y, w, h); return (w > 0 && h > 0) ? 0 : -1; }
+
+	// GetUpdateDamage - Returns the part of the damage rect changed by the last Update, if the object did not move
+	//  Return 0 on success, <0 if the area is unknown and a full render is required
+	virtual int GetUpdateDamage(int& x, int& y, int& w, int& h) { return GetDamageRect(x, y, w, h); }
+
 	// SetRenderPos - Update the position of the object
 	//  Return 0 on success, <0 on error
 	virtual int SetRenderPos(int x, int y, int w = 0, int h = 0) { mRenderX = x; mRenderY = y; if (w || h) { mRenderW = w; mRenderH = h; } return 0; }
@@ -120,6 +132,10 @@ public:
 	GUIObject(xml_node<>* node);
 	virtual ~GUIObject();
 
+	// Objects made while a page set loads come from its arena
+	static void* operator new(size_t size) { return GUIArena::New(size); }
+	static void operator delete(void* ptr) { GUIArena::Delete(ptr); }
+
 public:
 	bool IsConditionVariable(std::string var);
 	bool isConditionTrue();
@@ -129,6 +145,13 @@ public:
 	//  Returns 0 on success, <0 on error
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
 
+	// Variables this object gets NotifyVarChange calls for. Every object
+	// still gets the "" broadcast sent when a page is shown.
+	bool WatchesAllVars() const { return mWatchAllVars; }
+	const std::set<std::string>& GetWatchedVars() const { return mWatchedVars; }
+	// Changes whenever any object's watch list changes
+	static unsigned GetWatchGeneration() { return mWatchGeneration; }
+
 protected:
 	class Condition
 	{
@@ -152,7 +175,18 @@ protected:
 	static bool isConditionTrue(Condition* condition);
 	static bool UpdateConditions(std::vector<Condition>& conditions, const std::string& varName);
 
+	void WatchVar(const std::string& varName);
+	void WatchVars(const GUIObject* other);
+	void WatchConditionVars(const std::vector<Condition>& conditions);
+	void WatchTextVars(const std::string& text);
+	void WatchAllVars();
+
 	bool mConditionsResult;
+
+private:
+	std::set<std::string> mWatchedVars;
+	bool mWatchAllVars;
+	static unsigned mWatchGeneration;
 };
 
 class InputObject
@@ -192,6 +226,9 @@ public:
 	// Retrieve the size of the current string (dynamic strings may change per call)
 	virtual int GetCurrentBounds(int& w, int& h);
 
+	// Text can be drawn outside of its render position, depending on placement and scaling
+	virtual int GetDamageRect(int& x, int& y, int& w, int& h);
+
 	// Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
 
@@ -206,7 +243,14 @@ public:
 	unsigned maxWidth;
 
 protected:
+	// Looks up the string resources of mText if it changed or the strings did,
+	// returns true if mTemplate was compiled again
+	bool ResolveText();
+	// Brings mLastValue up to date, returns true if it changed
+	bool UpdateValue();
+
 	std::string mText;
+	GUITextTemplate mTemplate; // mText with its string resources looked up
 	std::string mLastValue;
 	COLOR mColor;
 	COLOR mHighlightColor;
@@ -214,6 +258,8 @@ protected:
 	int mIsStatic;
 	int mVarChanged;
 	int mFontHeight;
+	unsigned mResolvedGeneration;
+	bool mResolved;
 };
 
 // GUIImage - Used for static image
@@ -257,7 +303,7 @@ protected:
 // GUIAction - Used for standard actions
 class GUIAction : public GUIObject, public ActionObject
 {
-	friend class ActionThread;
+	friend class ActionQueue;
 
 public:
 	GUIAction(xml_node<>* node);
@@ -287,7 +333,7 @@ protected:
 	int doAction(Action action);
 	ThreadType getThreadType(const Action& action);
 	void simulate_progress_bar(void);
-	int flash_zip(std::string filename, int* wipe_cache);
+	int flash_zip(std::string filename, int* wipe_cache, Zip_Prefetch* prefetch = NULL);
 	void reinject_after_flash();
 	void operation_start(const string operation_name);
 	void operation_end(const int operation_status);
@@ -354,6 +400,7 @@ protected:
 	int fixsu(std::string arg);
 	int decrypt_backup(std::string arg);
 	int repair(std::string arg);
+	int verifybackups(std::string arg);
 	int resize(std::string arg);
 	int changefilesystem(std::string arg);
 	int startmtp(std::string arg);
@@ -390,6 +437,9 @@ public:
 	//  Return 0 on success, <0 on error
 	virtual int SetRenderPos(int x, int y, int w = 0, int h = 0);
 
+	// GetDamageRect - Includes the image and label, which may extend past the button
+	virtual int GetDamageRect(int& x, int& y, int& w, int& h);
+
 	// NotifyTouch - Notify of a touch event
 	//  Return 0 on success, >0 to ignore remainder of touch, and <0 on error
 	virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
@@ -557,6 +607,8 @@ protected:
 	int fastScroll; // indicates that the inital touch was inside the fastscroll region - makes for easier fast scrolling as the touches don't have to stay within the fast scroll region and you drag your finger
 	int mUpdate; // indicates that a change took place and we need to re-render
 	bool AddLines(std::vector<std::string>* origText, std::vector<std::string>* origColor, size_t* lastCount, std::vector<std::string>* rText, std::vector<std::string>* rColor);
+	// Word wraps a line to the list width, returns the number of lines added to rText
+	size_t WrapLine(std::string line, std::vector<std::string>& rText);
 };
 
 class GUIFileSelector : public GUIScrollList
@@ -593,13 +645,32 @@ protected:
 		time_t lastStatChange;	  // Uses time_t format from stat
 	};
 
+	// A directory being read by a background thread. Entries are handed
+	// over in batches and merged into the sorted lists by Update().
+	struct ListJob {
+		std::string folder;
+		std::string extn;
+		bool showNavFolders;
+		bool needStat; // sorting by size or date
+		pthread_mutex_t lock;
+		std::vector<FileData> folders, files; // not merged yet
+		bool done, failed, cancel;
+	};
+
 protected:
 	virtual int GetFileList(const std::string folder);
-	static bool fileSort(FileData d1, FileData d2);
+	bool MergeFileList();
+	void CancelFileList();
+	static void* ListThread(void* cookie);
+	static bool HandOver(ListJob* job, std::vector<FileData>& folders, std::vector<FileData>& files);
+	static void MergeSorted(std::vector<FileData>& list, std::vector<FileData>& batch);
+	static bool fileSort(const FileData& d1, const FileData& d2);
 
 protected:
 	std::vector<FileData> mFolderList;
 	std::vector<FileData> mFileList;
+	ListJob* mListJob; // NULL when no listing is in progress
+	pthread_t mListThread;
 	std::string mPathVar; // current path displayed, saved in the data manager
 	std::string mPathDefault; // default value for the path if none is set in mPathVar
 	std::string mExtn; // used for filtering the file list, for example, *.zip
@@ -680,9 +751,11 @@ public:
 protected:
 	void MatchList();
 	void SetPosition();
+	void RefreshList();
 
 protected:
 	std::vector<PartitionList> mList;
+	unsigned int listVersion; // partition manager state the list was built from
 	std::string ListType;
 	std::string mVariable;
 	std::string selectedList;
@@ -759,17 +832,20 @@ protected:
 	};
 
 	ImageResource* mSlideoutImage;
-	size_t mLastCount; // lines from gConsole that are already split and copied into rConsole
+	size_t mLastCount; // sequence number of the first line in gConsole not yet split and copied into rConsole
 	bool scrollToEnd; // true if we want to keep tracking the last line
 	int mSlideoutX, mSlideoutY, mSlideoutW, mSlideoutH;
 	int mSlideout;
 	SlideoutState mSlideoutState;
-	std::vector<std::string> rConsole;
-	std::vector<std::string> rConsoleColor;
+	std::deque<std::string> rConsole; // the last GUI_CONSOLE_MAX_LINES word wrapped lines
+	std::deque<const std::string*> rConsoleColor; // interned color names
+	const std::string* mLastColorName; // last non-normal line color, parsed into mLastColor
+	COLOR mLastColor;
 
 protected:
 	int RenderSlideout(void);
 	int RenderConsole(void);
+	bool AddConsoleLines(void);
 };
 
 class TerminalEngine;
@@ -797,16 +873,28 @@ public:
 	// SetPageFocus - Notify when a page gains or loses focus
 	virtual void SetPageFocus(int inFocus);
 
+	// GetUpdateDamage - Only the lines changed since the last update, unless the view scrolled
+	virtual int GetUpdateDamage(int& x, int& y, int& w, int& h);
+
 	// ScrollList interface
 	virtual size_t GetItemCount();
 	virtual void RenderItem(size_t itemindex, int yPos, bool selected);
 	virtual void NotifySelect(size_t item_selected);
 protected:
 	void InitAndResize();
+	void TrackDamage();
 
 	TerminalEngine* engine; // non-visual parts of the terminal (text buffer etc.), not owned
 	int updateCounter; // to track if anything changed in the back-end
 	bool lastCondition; // to track if the condition became true and we might need to resize the terminal engine
+	std::string mCursorLeft, mCursorChar; // reused while rendering the cursor line
+
+	// what the last update showed, to find the lines that need a redraw
+	bool mDrawnValid;
+	int mDrawnFirst, mDrawnOffset, mDrawnCursorY;
+	size_t mDrawnCount;
+	bool mDamageKnown;
+	int mDamageY, mDamageH;
 };
 
 // GUIAnimation - Used for animations
@@ -830,7 +918,9 @@ protected:
 	int mFPS;
 	int mLoop;
 	int mRender;
-	int mUpdateCount;
+	int mFrameMs; // time each frame is shown
+	timespec mFrameTime; // when the current frame was due
+	bool mTiming;
 };
 
 class GUIProgressBar : public GUIObject, public RenderObject, public ActionObject
@@ -861,6 +951,7 @@ protected:
 	float mSlideInc;
 	int mSlideFrames;
 	int mLastPos;
+	bool mVarChanged; // one of the data variables changed since the last Update
 
 protected:
 	virtual int RenderInternal(void);	   // Does the actual render
@@ -62,12 +62,39 @@ extern "C" {
 #define TW_THEME_VER_ERR -2
 
 extern int gGuiRunning;
+extern pthread_t gGuiThread;
+
+// Variables changed by other threads since the last FlushVarChanges, in
+// the order of their first change, with their latest value
+static pthread_mutex_t gVarChangeLock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<std::pair<std::string, std::string> > gVarChanges;
+static std::map<std::string, size_t> gVarChangeIndex;
+
+// Held while the page sets or their strings change. Other threads translate
+// console messages through the current set, they only try to take it and use
+// the default text while a package loads; the console is translated again
+// once the theme and language are in place.
+#ifndef PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+static pthread_mutex_t gSetLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
+#else
+static pthread_mutex_t gSetLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#endif
+
+class SetLock
+{
+public:
+	SetLock() { pthread_mutex_lock(&gSetLock); }
+	~SetLock() { pthread_mutex_unlock(&gSetLock); }
+};
 
 std::map<std::string, PageSet*> PageManager::mPageSets;
 PageSet* PageManager::mCurrentSet;
 MouseCursor *PageManager::mMouseCursor = NULL;
 HardwareKeyboard *PageManager::mHardwareKeyboard = NULL;
 bool PageManager::mReloadTheme = false;
+bool PageManager::mPartialFlip = false;
+DamageRect PageManager::mRenderDamage;
+DamageRect PageManager::mFlipRegion;
 std::string PageManager::mStartPage = "main";
 std::vector<language_struct> Language_List;
 
@@ -76,6 +103,22 @@ int tw_y_offset = 0;
 int tw_w_offset = 0;
 int tw_h_offset = 0;
 
+void DamageRect::Add(int ax, int ay, int aw, int ah)
+{
+	if (aw <= 0 || ah <= 0)
+		return;
+	if (IsEmpty()) {
+		x = ax; y = ay; w = aw; h = ah;
+		return;
+	}
+	int right = std::max(x + w, ax + aw);
+	int bottom = std::max(y + h, ay + ah);
+	x = std::min(x, ax);
+	y = std::min(y, ay);
+	w = right - x;
+	h = bottom - y;
+}
+
 // Helper routine to convert a string to a color declaration
 int ConvertStrToColor(std::string str, COLOR* color)
 {
@@ -287,6 +330,9 @@ int ActionObject::SetActionPos(int x, int y, int w, int h)
 Page::Page(xml_node<>* page, std::vector<xml_node<>*> *templates)
 {
 	mTouchStart = NULL;
+	mDamageUnknown = true;
+	mVarWatchGeneration = 0;
+	mVarWatchersValid = false;
 
 	// We can memset the whole structure, because the alpha channel is ignored
 	memset(&mBackground, 0, sizeof(COLOR));
@@ -538,23 +584,80 @@ int Page::Render(void)
 	return 0;
 }
 
+int Page::RenderDamage(const DamageRect& area)
+{
+	// Objects still render in order so overlapping ones blend the same as in
+	// Render(), but nothing outside of the area is touched
+	gr_set_damage_clip(area.x, area.y, area.w, area.h);
+	gr_color(mBackground.red, mBackground.green, mBackground.blue, mBackground.alpha);
+	gr_fill(area.x, area.y, area.w, area.h);
+
+	std::vector<RenderObject*>::iterator iter;
+	for (iter = mRenders.begin(); iter != mRenders.end(); iter++)
+	{
+		int x, y, w, h;
+		if ((*iter)->GetDamageRect(x, y, w, h) == 0 && !area.Intersects(x, y, w, h))
+			continue;
+		if ((*iter)->Render())
+			LOGERR("A render request has failed.\n");
+	}
+	gr_clear_damage_clip();
+	return 0;
+}
+
 int Page::Update(void)
 {
 	int retCode = 0;
 
+	mRenderDamage.Clear();
+	mFlipDamage.Clear();
+	mDamageUnknown = false;
+
 	std::vector<RenderObject*>::iterator iter;
 	for (iter = mRenders.begin(); iter != mRenders.end(); iter++)
 	{
+		int x, y, w, h;
+		bool known = ((*iter)->GetDamageRect(x, y, w, h) == 0);
 		int ret = (*iter)->Update();
 		if (ret < 0)
 			LOGERR("An update request has failed.\n");
 		else if (ret > retCode)
 			retCode = ret;
+		if (ret <= 0)
+			continue;
+
+		// An object may move while updating, which damages both areas
+		DamageRect& damage = (ret > 1 ? mRenderDamage : mFlipDamage);
+		if (known) {
+			int nx, ny, nw, nh;
+			known = ((*iter)->GetDamageRect(nx, ny, nw, nh) == 0);
+			if (known && nx == x && ny == y && nw == w && nh == h) {
+				// Still in place, so only the part it changed needs a redraw
+				known = ((*iter)->GetUpdateDamage(x, y, w, h) == 0);
+			} else if (known) {
+				damage.Add(x, y, w, h);
+				x = nx; y = ny; w = nw; h = nh;
+			}
+		}
+		if (known)
+			damage.Add(x, y, w, h);
+		else
+			mDamageUnknown = true;
 	}
 
 	return retCode;
 }
 
+bool Page::GetDamage(DamageRect& render, DamageRect& flip)
+{
+	if (mDamageUnknown)
+		return false;
+	render = mRenderDamage;
+	flip = mFlipDamage;
+	flip.Add(render);
+	return true;
+}
+
 int Page::NotifyTouch(TOUCH_STATE state, int x, int y)
 {
 	// By default, return 1 to ignore further touches if nobody is listening
@@ -654,10 +757,53 @@ void Page::SetPageFocus(int inFocus)
 	return;
 }
 
-int Page::NotifyVarChange(std::string varName, std::string value)
+void Page::UpdateVarWatchers()
 {
+	if (mVarWatchersValid && mVarWatchGeneration == GUIObject::GetWatchGeneration())
+		return;
+
+	mVarWatchers.clear();
+	mAllVarWatchers.clear();
 	std::vector<GUIObject*>::iterator iter;
 	for (iter = mObjects.begin(); iter != mObjects.end(); ++iter)
+	{
+		if ((*iter)->WatchesAllVars()) {
+			mAllVarWatchers.push_back(*iter);
+			continue;
+		}
+		const std::set<std::string>& vars = (*iter)->GetWatchedVars();
+		std::set<std::string>::const_iterator var;
+		for (var = vars.begin(); var != vars.end(); ++var)
+			mVarWatchers[*var].push_back(*iter);
+	}
+	mVarWatchGeneration = GUIObject::GetWatchGeneration();
+	mVarWatchersValid = true;
+}
+
+int Page::NotifyVarChange(std::string varName, std::string value)
+{
+	std::vector<GUIObject*>::iterator iter;
+
+	// An empty name is the page change broadcast, every object gets it
+	if (varName.empty())
+	{
+		for (iter = mObjects.begin(); iter != mObjects.end(); ++iter)
+		{
+			if ((*iter)->NotifyVarChange(varName, value))
+				LOGERR("An action handler errored on NotifyVarChange.\n");
+		}
+		return 0;
+	}
+
+	UpdateVarWatchers();
+
+	// Copy the list, a handler may change watch lists and rebuild the index
+	std::vector<GUIObject*> watchers(mAllVarWatchers);
+	std::map<std::string, std::vector<GUIObject*> >::iterator found = mVarWatchers.find(varName);
+	if (found != mVarWatchers.end())
+		watchers.insert(watchers.end(), found->second.begin(), found->second.end());
+
+	for (iter = watchers.begin(); iter != watchers.end(); ++iter)
 	{
 		if ((*iter)->NotifyVarChange(varName, value))
 			LOGERR("An action handler errored on NotifyVarChange.\n");
@@ -933,6 +1079,7 @@ int PageSet::SetPage(std::string page)
 	{
 		if (mCurrentPage)   mCurrentPage->SetPageFocus(0);
 		mCurrentPage = tmp;
+		mResources->PageChanged();
 		mCurrentPage->SetPageFocus(1);
 		mCurrentPage->NotifyVarChange("", "");
 		return 0;
@@ -1140,6 +1287,18 @@ int PageSet::Update(void)
 	return ret;
 }
 
+bool PageSet::GetDamage(DamageRect& render, DamageRect& flip)
+{
+	if (!mCurrentPage || !mOverlays.empty())
+		return false;
+	return mCurrentPage->GetDamage(render, flip);
+}
+
+int PageSet::RenderDamage(const DamageRect& area)
+{
+	return (mCurrentPage ? mCurrentPage->RenderDamage(area) : -1);
+}
+
 int PageSet::NotifyTouch(TOUCH_STATE state, int x, int y)
 {
 	if (!mOverlays.empty())
@@ -1187,6 +1346,18 @@ void PageSet::AddStringResource(std::string resource_source, std::string resourc
 	mResources->AddStringResource(resource_source, resource_name, value);
 }
 
+void PageSet::BeginLoad(const std::string& package, const unsigned char* zip, size_t zip_length, bool use_cache)
+{
+	mResources->BeginLoad(package, zip, zip_length, use_cache);
+	GUIArena::SetActive(&mArena);
+}
+
+void PageSet::EndLoad()
+{
+	GUIArena::SetActive(NULL);
+	mResources->EndLoad();
+}
+
 char* PageManager::LoadFileToBuffer(std::string filename, ZipWrap* package) {
 	size_t len;
 	char* buffer = NULL;
@@ -1315,6 +1486,7 @@ void PageManager::LoadLanguageList(ZipWrap* package) {
 }
 
 void PageManager::LoadLanguage(string filename) {
+	SetLock set_lock;
 	string actual_filename;
 	if (TWFunc::Path_Exists(TWRES "customlanguages/" + filename + ".xml"))
 		actual_filename = TWRES "customlanguages/" + filename + ".xml";
@@ -1339,6 +1511,7 @@ int PageManager::LoadPackage(std::string name, std::string package, std::string
 	PageSet* pageSet = NULL;
 	int ret;
 	MemMapping map;
+	SetLock set_lock;
 
 	mReloadTheme = false;
 	mStartPage = startpage;
@@ -1396,6 +1569,10 @@ int PageManager::LoadPackage(std::string name, std::string package, std::string
 	pageSet = mCurrentSet;
 	mCurrentSet = new PageSet();
 
+	// Images are decoded on first use after loading, and kept on settings
+	// storage for the next boot
+	mCurrentSet->BeginLoad(package, ctx.zip ? map.addr : NULL, ctx.zip ? map.length : 0, name != "splash");
+
 	if (baseLanguageFile) {
 		mCurrentSet->LoadLanguage(baseLanguageFile, NULL);
 		free(baseLanguageFile);
@@ -1410,6 +1587,7 @@ int PageManager::LoadPackage(std::string name, std::string package, std::string
 	currentLoadingContext = &ctx; // required to find styles
 	ret = mCurrentSet->Load(ctx, mainxmlfilename);
 	currentLoadingContext = NULL;
+	mCurrentSet->EndLoad();
 
 	if (ret == 0) {
 		mCurrentSet->SetPage(startpage);
@@ -1456,6 +1634,7 @@ PageSet* PageManager::FindPackage(std::string name)
 PageSet* PageManager::SelectPackage(std::string name)
 {
 	LOGINFO("Switching packages (%s)\n", name.c_str());
+	SetLock set_lock;
 	PageSet* tmp;
 
 	tmp = FindPackage(name);
@@ -1474,6 +1653,7 @@ PageSet* PageManager::SelectPackage(std::string name)
 int PageManager::ReloadPackage(std::string name, std::string package)
 {
 	std::map<std::string, PageSet*>::iterator iter;
+	SetLock set_lock;
 
 	mReloadTheme = false;
 
@@ -1503,6 +1683,7 @@ int PageManager::ReloadPackage(std::string name, std::string package)
 void PageManager::ReleasePackage(std::string name)
 {
 	std::map<std::string, PageSet*>::iterator iter;
+	SetLock set_lock;
 
 	iter = mPageSets.find(name);
 	if (iter == mPageSets.end())
@@ -1590,6 +1771,21 @@ const ResourceManager* PageManager::GetResources()
 	return (mCurrentSet ? mCurrentSet->GetResources() : NULL);
 }
 
+bool PageManager::TranslateString(const std::string& name, const std::string& default_value, std::string* value)
+{
+	if (pthread_mutex_trylock(&gSetLock) != 0)
+		return false;
+	const ResourceManager* res = GetResources();
+	if (res) {
+		if (default_value.empty())
+			*value = res->FindString(name);
+		else
+			*value = res->FindString(name, default_value);
+	}
+	pthread_mutex_unlock(&gSetLock);
+	return res != NULL;
+}
+
 int PageManager::IsCurrentPage(Page* page)
 {
 	return (mCurrentSet ? mCurrentSet->IsCurrentPage(page) : 0);
@@ -1597,6 +1793,7 @@ int PageManager::IsCurrentPage(Page* page)
 
 int PageManager::Render(void)
 {
+	mPartialFlip = false;
 	if (blankTimer.isScreenOff())
 		return 0;
 
@@ -1660,16 +1857,46 @@ int PageManager::Update(void)
 		return -2;
 
 	int res = (mCurrentSet ? mCurrentSet->Update() : -1);
+	bool cursor = false;
 
 	if (mMouseCursor)
 	{
 		int c_res = mMouseCursor->Update();
 		if (c_res > res)
 			res = c_res;
+		// The cursor is drawn over everything, so a partial render would cut into it
+		cursor = (c_res > 0 || ev_has_mouse());
 	}
+
+	mPartialFlip = false;
+	if (res > 0 && !cursor && gr_has_flip_region())
+		mPartialFlip = mCurrentSet->GetDamage(mRenderDamage, mFlipRegion);
 	return res;
 }
 
+int PageManager::RenderDamage(void)
+{
+	if (!mPartialFlip)
+		return Render();
+	if (blankTimer.isScreenOff() || mRenderDamage.IsEmpty())
+		return 0;
+	return mCurrentSet->RenderDamage(mRenderDamage);
+}
+
+bool PageManager::GetFlipRegion(int& x, int& y, int& w, int& h)
+{
+	// Only good for the flip that follows the Update() it was computed in
+	bool partial = mPartialFlip;
+	mPartialFlip = false;
+	if (!partial || mFlipRegion.IsEmpty())
+		return false;
+	x = mFlipRegion.x;
+	y = mFlipRegion.y;
+	w = mFlipRegion.w;
+	h = mFlipRegion.h;
+	return true;
+}
+
 int PageManager::NotifyTouch(TOUCH_STATE state, int x, int y)
 {
 	return (mCurrentSet ? mCurrentSet->NotifyTouch(state, x, y) : -1);
@@ -1697,14 +1924,42 @@ int PageManager::NotifyVarChange(std::string varName, std::string value)
 
 void PageManager::AddStringResource(std::string resource_source, std::string resource_name, std::string value)
 {
+	SetLock set_lock;
 	if (mCurrentSet)
 		mCurrentSet->AddStringResource(resource_source, resource_name, value);
 }
 
+void PageManager::FlushVarChanges()
+{
+	std::vector<std::pair<std::string, std::string> > changes;
+	pthread_mutex_lock(&gVarChangeLock);
+	changes.swap(gVarChanges);
+	gVarChangeIndex.clear();
+	pthread_mutex_unlock(&gVarChangeLock);
+
+	for (size_t i = 0; i < changes.size(); i++)
+		NotifyVarChange(changes[i].first, changes[i].second);
+}
+
 extern "C" void gui_notifyVarChange(const char *name, const char* value)
 {
 	if (!gGuiRunning)
 		return;
 
-	PageManager::NotifyVarChange(name, value);
+	if (pthread_equal(pthread_self(), gGuiThread)) {
+		PageManager::NotifyVarChange(name, value);
+		return;
+	}
+
+	// Don't walk the page objects from worker threads while the GUI draws
+	// them. Repeated changes, like progress, are sent once per frame.
+	pthread_mutex_lock(&gVarChangeLock);
+	std::map<std::string, size_t>::iterator it = gVarChangeIndex.find(name);
+	if (it != gVarChangeIndex.end()) {
+		gVarChanges[it->second].second = value;
+	} else {
+		gVarChangeIndex[name] = gVarChanges.size();
+		gVarChanges.push_back(std::make_pair(std::string(name), std::string(value)));
+	}
+	pthread_mutex_unlock(&gVarChangeLock);
 }
@@ -27,6 +27,7 @@
 #include <string>
 #include "rapidxml.hpp"
 #include "gui.hpp"
+#include "arena.hpp"
 using namespace rapidxml;
 
 enum TOUCH_STATE {
@@ -47,6 +48,18 @@ struct COLOR {
 		: red(r), green(g), blue(b), alpha(a) {}
 };
 
+// Screen area changed by a frame, empty while w or h is 0
+struct DamageRect {
+	int x, y, w, h;
+	DamageRect() : x(0), y(0), w(0), h(0) {}
+	bool IsEmpty() const { return w <= 0 || h <= 0; }
+	bool Intersects(int ox, int oy, int ow, int oh) const
+		{ return !IsEmpty() && ow > 0 && oh > 0 && ox < x + w && x < ox + ow && oy < y + h && y < oy + oh; }
+	void Clear() { x = y = w = h = 0; }
+	void Add(int ax, int ay, int aw, int ah);
+	void Add(const DamageRect& rect) { Add(rect.x, rect.y, rect.w, rect.h); }
+};
+
 struct language_struct {
 	std::string filename;
 	std::string displayvalue;
@@ -62,6 +75,9 @@ extern std::vector<language_struct> Language_List;
 // Utility Functions
 int ConvertStrToColor(std::string str, COLOR* color);
 int gui_forceRender(void);
+// Updates and draws one frame the way the GUI loop does, without waiting for
+// input. Returns 3 for a full render, else what PageManager::Update returned.
+int gui_runFrame(void);
 int gui_changePage(std::string newPage);
 int gui_changeOverlay(std::string newPage);
 
@@ -80,6 +96,9 @@ public:
 	Page(xml_node<>* page, std::vector<xml_node<>*> *templates);
 	virtual ~Page();
 
+	static void* operator new(size_t size) { return GUIArena::New(size); }
+	static void operator delete(void* ptr) { GUIArena::Delete(ptr); }
+
 	std::string GetName(void)   { return mName; }
 
 public:
@@ -92,6 +111,12 @@ public:
 	virtual int NotifyVarChange(std::string varName, std::string value);
 	virtual void SetPageFocus(int inFocus);
 
+	// Areas changed by the last Update(): objects that need a render, and
+	// objects that drew themselves. Returns false if an area is unknown.
+	virtual bool GetDamage(DamageRect& render, DamageRect& flip);
+	// Render() limited to the given area
+	virtual int RenderDamage(const DamageRect& area);
+
 protected:
 	std::string mName;
 	std::vector<GUIObject*> mObjects;
@@ -102,8 +127,20 @@ protected:
 	ActionObject* mTouchStart;
 	COLOR mBackground;
 
+	DamageRect mRenderDamage;
+	DamageRect mFlipDamage;
+	bool mDamageUnknown;
+
+	// Objects by the variables they watch, so a change only reaches the
+	// objects that care about it. Rebuilt when a watch list changes.
+	std::map<std::string, std::vector<GUIObject*> > mVarWatchers;
+	std::vector<GUIObject*> mAllVarWatchers;
+	unsigned mVarWatchGeneration;
+	bool mVarWatchersValid;
+
 protected:
 	bool ProcessNode(xml_node<>* page, std::vector<xml_node<>*> *templates, int depth);
+	void UpdateVarWatchers();
 };
 
 struct LoadingContext;
@@ -137,7 +174,14 @@ public:
 	int SetKeyBoardFocus(int inFocus);
 	int NotifyVarChange(std::string varName, std::string value);
 
+	// Damage of the current page, unavailable while an overlay is shown
+	bool GetDamage(DamageRect& render, DamageRect& flip);
+	int RenderDamage(const DamageRect& area);
+
 	void AddStringResource(std::string resource_source, std::string resource_name, std::string value);
+	// BeginLoad also makes the set's arena active until EndLoad
+	void BeginLoad(const std::string& package, const unsigned char* zip, size_t zip_length, bool use_cache);
+	void EndLoad();
 
 protected:
 	int LoadDetails(LoadingContext& ctx, xml_node<>* root);
@@ -149,6 +193,7 @@ protected:
 	std::vector<Page*> mPages;
 	Page* mCurrentPage;
 	std::vector<Page*> mOverlays; // Special case for popup dialogs and the lock screen
+	GUIArena mArena; // pages and objects made while loading, freed after the destructor deleted them
 };
 
 class PageManager
@@ -170,6 +215,7 @@ public:
 	static int ChangePage(std::string name);
 	static int ChangeOverlay(std::string name);
 	static const ResourceManager* GetResources();
+	static bool TranslateString(const std::string& name, const std::string& default_value, std::string* value); // Safe from any thread, false without resources or while a package loads
 	static std::string GetCurrentPage();
 
 	// Helper to identify if a particular page is the active page
@@ -183,6 +229,13 @@ public:
 	static int NotifyCharInput(int ch);
 	static int SetKeyBoardFocus(int inFocus);
 	static int NotifyVarChange(std::string varName, std::string value);
+	// Sends the variable changes queued by other threads, GUI thread only
+	static void FlushVarChanges();
+
+	// Renders only the area changed by the last Update(), or everything if that isn't possible
+	static int RenderDamage(void);
+	// Returns the area that needs to be flipped for the last frame, false if it is the whole screen
+	static bool GetFlipRegion(int& x, int& y, int& w, int& h);
 
 	static MouseCursor *GetMouseCursor();
 	static void LoadCursorData(xml_node<>* node);
@@ -204,6 +257,9 @@ protected:
 	static PageSet* mCurrentSet;
 	static MouseCursor *mMouseCursor;
 	static HardwareKeyboard *mHardwareKeyboard;
+	static bool mPartialFlip;
+	static DamageRect mRenderDamage;
+	static DamageRect mFlipRegion;
 	static bool mReloadTheme;
 	static std::string mStartPage;
 	static LoadingContext* currentLoadingContext;
@@ -19,6 +19,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <set>
 
 extern "C" {
 #include "../twcommon.h"
@@ -38,6 +39,7 @@ GUIPartitionList::GUIPartitionList(xml_node<>* node) : GUIScrollList(node)
 	mIconSelected = mIconUnselected = NULL;
 	mUpdate = 0;
 	updateList = false;
+	listVersion = 0;
 
 	child = FindNode(node, "icon");
 	if (child)
@@ -53,6 +55,7 @@ GUIPartitionList::GUIPartitionList(xml_node<>* node) : GUIScrollList(node)
 		attr = child->first_attribute("name");
 		if (attr)
 			mVariable = attr->value();
+		WatchVar(mVariable);
 		attr = child->first_attribute("selectedlist");
 		if (attr)
 			selectedList = attr->value();
@@ -91,26 +94,13 @@ int GUIPartitionList::Update(void)
 	if (!isConditionTrue())
 		return 0;
 
-	// Check for changes in mount points if the list type is mount and update the list and render if needed
-	if (ListType == "mount") {
-		int listSize = mList.size();
-		for (int i = 0; i < listSize; i++) {
-			if (PartitionManager.Is_Mounted_By_Path(mList.at(i).Mount_Point) && !mList.at(i).selected) {
-				mList.at(i).selected = 1;
-				mUpdate = 1;
-			} else if (!PartitionManager.Is_Mounted_By_Path(mList.at(i).Mount_Point) && mList.at(i).selected) {
-				mList.at(i).selected = 0;
-				mUpdate = 1;
-			}
-		}
-	}
-
 	GUIScrollList::Update();
 
 	if (updateList) {
 		// Completely update the list if needed -- Used primarily for
 		// restore as the list for restore will change depending on what
 		// partitions were backed up
+		listVersion = PartitionManager.State_Version();
 		mList.clear();
 		PartitionManager.Get_Partition_List(ListType, &mList);
 		SetVisibleListLocation(0);
@@ -118,6 +108,10 @@ int GUIPartitionList::Update(void)
 		mUpdate = 1;
 		if (ListType == "backup" || ListType == "flashimg")
 			MatchList();
+	} else if (ListType != "restore" && PartitionManager.State_Version() != listVersion) {
+		// Something was mounted, unmounted, sized or renamed since, the
+		// restore list only follows the backup that was picked
+		RefreshList();
 	}
 
 	if (mUpdate) {
@@ -167,6 +161,39 @@ void GUIPartitionList::SetPageFocus(int inFocus)
 	}
 }
 
+// Rebuilds the list after the partitions changed, keeping the selection and
+// the scroll position. Only renders again if a row looks different.
+void GUIPartitionList::RefreshList(void) {
+	std::vector<PartitionList> list;
+	size_t i;
+
+	listVersion = PartitionManager.State_Version();
+	PartitionManager.Get_Partition_List(ListType, &list);
+	if (ListType != "mount" && ListType != "storage") {
+		// The mount and storage lists select what is mounted and the current
+		// storage, the others what the user picked
+		std::set<std::string> picked;
+		for (i = 0; i < mList.size(); i++) {
+			if (mList[i].selected)
+				picked.insert(mList[i].Mount_Point);
+		}
+		for (i = 0; i < list.size(); i++)
+			list[i].selected = picked.count(list[i].Mount_Point) ? 1 : 0;
+	}
+
+	bool changed = list.size() != mList.size();
+	for (i = 0; !changed && i < list.size(); i++) {
+		changed = list[i].selected != mList[i].selected || list[i].Display_Name != mList[i].Display_Name
+				|| list[i].Mount_Point != mList[i].Mount_Point;
+	}
+	if (!changed)
+		return;
+	if (list.size() != mList.size())
+		SetVisibleListLocation(0);
+	mList.swap(list);
+	mUpdate = 1;
+}
+
 void GUIPartitionList::MatchList(void) {
 	int i, listSize = mList.size();
 	string variablelist, searchvalue;
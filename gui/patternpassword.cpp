@@ -95,6 +95,7 @@ GUIPatternPassword::GUIPatternPassword(xml_node<>* node)
 	child = FindNode(node, "size");
 	if (child) {
 		mSizeVar = LoadAttrString(child, "name", "");
+		WatchVar(mSizeVar);
 
 		// Use the configured default, if set.
 		size_t size = LoadAttrInt(child, "default", mGridSize);
@@ -52,6 +52,8 @@ GUIProgressBar::GUIProgressBar(xml_node<>* node) : GUIObject(node)
 	mLastPos = 0;
 	mSlide = 0.0;
 	mSlideInc = 0.0;
+	mSlideFrames = 0;
+	mVarChanged = true;
 
 	if (!node)
 	{
@@ -77,6 +79,13 @@ GUIProgressBar::GUIProgressBar(xml_node<>* node) : GUIObject(node)
 		mMaxValVar = LoadAttrString(child, "max");
 		mCurValVar = LoadAttrString(child, "name");
 	}
+	if (atoi(mMinValVar.c_str()) == 0)
+		WatchVar(mMinValVar);
+	if (atoi(mMaxValVar.c_str()) == 0)
+		WatchVar(mMaxValVar);
+	WatchVar(mCurValVar);
+	WatchVar("ui_progress_portion");
+	WatchVar("ui_progress_frames");
 
 	if (mEmptyBar && mEmptyBar->GetResource()) {
 		mRenderW = mEmptyBar->GetWidth();
@@ -114,6 +123,11 @@ int GUIProgressBar::Update(void)
 	if (!isConditionTrue())
 		return 0;
 
+	// Nothing to re-read until a variable changes or a slide is running
+	if (!mVarChanged && !mSlideFrames)
+		return 0;
+	mVarChanged = false;
+
 	std::string str;
 	int min, max, cur, pos;
 
@@ -185,6 +199,7 @@ int GUIProgressBar::Update(void)
 int GUIProgressBar::NotifyVarChange(const std::string& varName, const std::string& value)
 {
 	GUIObject::NotifyVarChange(varName, value);
+	mVarChanged = true;
 
 	if (!isConditionTrue())
 		return 0;
@@ -29,19 +29,27 @@
 #include <iostream>
 #include <iomanip>
 #include <fcntl.h>
+#include <pixelflinger/pixelflinger.h>
 
 #include "../zipwrap.hpp"
 extern "C" {
 #include "../twcommon.h"
+#include "../twrpMemory.hpp"
 #include "gui.h"
 }
 #include "../minuitwrp/minui.h"
 
 #include "rapidxml.hpp"
 #include "objects.hpp"
+#include "themecache.hpp"
 
 #define TMP_RESOURCE_NAME   "/tmp/extract.bin"
 
+// Below this much available memory, page changes drop unused images
+#ifndef RESOURCE_EVICT_AVAILABLE_KB
+#define RESOURCE_EVICT_AVAILABLE_KB (64 * 1024)
+#endif
+
 Resource::Resource(xml_node<>* node, ZipWrap* pZip __unused)
 {
 	if (node && node->first_attribute("name"))
@@ -82,20 +90,13 @@ void Resource::LoadImage(ZipWrap* pZip, std::string file, gr_surface* surface)
 		LOGINFO("Failed to load image from %s%s, error %d\n", file.c_str(), pZip ? " (zip)" : "", rc);
 }
 
-void Resource::CheckAndScaleImage(gr_surface source, gr_surface* destination, int retain_aspect)
+void Resource::CheckAndScaleImage(gr_surface source, gr_surface* destination, int retain_aspect, float scale_w, float scale_h)
 {
 	if (!source) {
 		*destination = NULL;
 		return;
 	}
-	if (get_scale_w() != 0 && get_scale_h() != 0) {
-		float scale_w = get_scale_w(), scale_h = get_scale_h();
-		if (retain_aspect) {
-			if (scale_w < scale_h)
-				scale_h = scale_w;
-			else
-				scale_w = scale_h;
-		}
+	if (scale_w != 0 && scale_h != 0) {
 		if (res_scale_surface(source, destination, scale_w, scale_h)) {
 			LOGINFO("Error scaling image, using regular size.\n");
 			*destination = source;
@@ -105,6 +106,177 @@ void Resource::CheckAndScaleImage(gr_surface source, gr_surface* destination, in
 	}
 }
 
+static bool ReadPngSize(const unsigned char* header, size_t length, int* width, int* height)
+{
+	static const unsigned char png_sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	if (length < 24 || memcmp(header, png_sig, 8) != 0 || memcmp(header + 12, "IHDR", 4) != 0)
+		return false;
+	*width = (header[16] << 24) | (header[17] << 16) | (header[18] << 8) | header[19];
+	*height = (header[20] << 24) | (header[21] << 16) | (header[22] << 8) | header[23];
+	return *width > 0 && *height > 0;
+}
+
+bool Resource::ReadImageSize(ZipWrap* pZip, std::string file, int* width, int* height)
+{
+	unsigned char header[24];
+	if (pZip) {
+		std::string src = "images/" + file + ".png";
+		if (!pZip->EntryExists(src))
+			src = "images/" + file;
+		long size = pZip->GetUncompressedSize(src);
+		if (size < (long)sizeof(header))
+			return false;
+		// entries are deflated, so the header only comes with the whole file
+		std::vector<uint8_t> buffer(size);
+		if (!pZip->ExtractToBuffer(src, &buffer[0]))
+			return false;
+		return ReadPngSize(&buffer[0], buffer.size(), width, height);
+	}
+
+	// Same lookup as res_create_surface
+	std::string path = std::string(TWRES "images/") + file + ".png";
+	FILE* fp = fopen(path.c_str(), "rb");
+	if (!fp)
+		fp = fopen(file.c_str(), "rb");
+	if (!fp)
+		return false;
+	size_t len = fread(header, 1, sizeof(header), fp);
+	fclose(fp);
+	return ReadPngSize(header, len, width, height);
+}
+
+// Pixels of a decoded surface, surfaces from the theme cache are mapped
+// from the cache file and not counted
+static int64_t SurfaceBytes(gr_surface surface)
+{
+	GGLSurface* s = (GGLSurface*)surface;
+	return (int64_t)s->stride * s->height * (s->format == GGL_PIXEL_FORMAT_RGB_565 ? 2 : 4);
+}
+
+Resource::LazyImage::LazyImage(ResourceManager* manager, const std::string& file, int retain_aspect)
+{
+	mManager = manager;
+	mFile = file;
+	mRetainAspect = retain_aspect;
+	mScaleW = get_scale_w();
+	mScaleH = get_scale_h();
+	if (mScaleW != 0 && mScaleH != 0 && retain_aspect) {
+		if (mScaleW < mScaleH)
+			mScaleH = mScaleW;
+		else
+			mScaleW = mScaleH;
+	}
+	mWidth = mHeight = 0;
+	mSurface = NULL;
+	mPlaceholder = NULL;
+	mFailed = false;
+	mLastUse = manager ? manager->GetGeneration() : 0;
+	mAccounted = 0;
+}
+
+Resource::LazyImage::~LazyImage()
+{
+	if (mSurface)
+		res_free_surface(mSurface);
+	twrpMemory::Add(MEMORY_GUI, -mAccounted);
+	free(mPlaceholder);
+}
+
+bool Resource::LazyImage::Probe(ZipWrap* pZip)
+{
+	ThemeCache* cache = mManager ? mManager->GetThemeCache() : NULL;
+	if (cache) {
+		mSurface = cache->Find(ThemeCache::GetKey(mFile, mRetainAspect, mScaleW, mScaleH));
+		if (mSurface) {
+			mWidth = gr_get_width(mSurface);
+			mHeight = gr_get_height(mSurface);
+			return true;
+		}
+	}
+
+	int width, height;
+	if (mManager && mManager->IsLoading() && ReadImageSize(pZip, mFile, &width, &height)) {
+		if (mScaleW != 0 && mScaleH != 0) {
+			// same rounding as res_scale_surface
+			width = (int)((float)width * mScaleW);
+			height = (int)((float)height * mScaleH);
+		}
+		mWidth = width;
+		mHeight = height;
+		return true;
+	}
+
+	// No size in the header (JPEG) or not loading a package: decode now
+	return Decode(pZip);
+}
+
+gr_surface Resource::LazyImage::Get()
+{
+	if (mManager)
+		mLastUse = mManager->GetGeneration();
+	if (mSurface || mFailed || !mManager)
+		return mSurface;
+
+	if (mManager->IsLoading()) {
+		// Objects only look at the size while they are being created
+		if (!mPlaceholder) {
+			GGLSurface* placeholder = (GGLSurface*)calloc(1, sizeof(GGLSurface));
+			if (!placeholder)
+				return NULL;
+			placeholder->version = sizeof(GGLSurface);
+			placeholder->width = mWidth;
+			placeholder->height = mHeight;
+			placeholder->stride = mWidth;
+			mPlaceholder = placeholder;
+		}
+		return mPlaceholder;
+	}
+
+	ThemeCache* cache = mManager->GetThemeCache();
+	if (cache) {
+		mSurface = cache->Find(ThemeCache::GetKey(mFile, mRetainAspect, mScaleW, mScaleH));
+		if (mSurface)
+			return mSurface;
+	}
+
+	ZipWrap* zip = mManager->GetZip();
+	if (!zip && mManager->IsZipTheme()) {
+		mFailed = true;
+		return NULL;
+	}
+	Decode(zip);
+	return mSurface;
+}
+
+bool Resource::LazyImage::Decode(ZipWrap* pZip)
+{
+	gr_surface surface = NULL;
+	LoadImage(pZip, mFile, &surface);
+	CheckAndScaleImage(surface, &mSurface, mRetainAspect, mScaleW, mScaleH);
+	if (!mSurface) {
+		mFailed = true;
+		return false;
+	}
+	mWidth = gr_get_width(mSurface);
+	mHeight = gr_get_height(mSurface);
+	mAccounted = SurfaceBytes(mSurface);
+	twrpMemory::Add(MEMORY_GUI, mAccounted);
+	if (mManager)
+		mManager->ImageDecoded();
+	return true;
+}
+
+bool Resource::LazyImage::Evict(unsigned generation)
+{
+	if (!mSurface || mLastUse >= generation)
+		return false;
+	res_free_surface(mSurface);
+	mSurface = NULL;
+	twrpMemory::Add(MEMORY_GUI, -mAccounted);
+	mAccounted = 0;
+	return true;
+}
+
 FontResource::FontResource(xml_node<>* node, ZipWrap* pZip)
  : Resource(node, pZip)
 {
@@ -193,13 +365,12 @@ FontResource::~FontResource()
 	DeleteFont();
 }
 
-ImageResource::ImageResource(xml_node<>* node, ZipWrap* pZip)
+ImageResource::ImageResource(xml_node<>* node, ZipWrap* pZip, ResourceManager* manager)
  : Resource(node, pZip)
 {
 	std::string file;
-	gr_surface temp_surface = NULL;
 
-	mSurface = NULL;
+	mImage = NULL;
 	if (!node) {
 		LOGERR("ImageResource node is NULL\n");
 		return;
@@ -214,17 +385,19 @@ ImageResource::ImageResource(xml_node<>* node, ZipWrap* pZip)
 
 	bool retain_aspect = (node->first_attribute("retainaspect") != NULL);
 	// the value does not matter, if retainaspect is present, we assume that we want to retain it
-	LoadImage(pZip, file, &temp_surface);
-	CheckAndScaleImage(temp_surface, &mSurface, retain_aspect);
+	mImage = new LazyImage(manager, file, retain_aspect);
+	if (!mImage->Probe(pZip)) {
+		delete mImage;
+		mImage = NULL;
+	}
 }
 
 ImageResource::~ImageResource()
 {
-	if (mSurface)
-		res_free_surface(mSurface);
+	delete mImage;
 }
 
-AnimationResource::AnimationResource(xml_node<>* node, ZipWrap* pZip)
+AnimationResource::AnimationResource(xml_node<>* node, ZipWrap* pZip, ResourceManager* manager)
  : Resource(node, pZip)
 {
 	std::string file;
@@ -247,25 +420,38 @@ AnimationResource::AnimationResource(xml_node<>* node, ZipWrap* pZip)
 		std::ostringstream fileName;
 		fileName << file << std::setfill ('0') << std::setw (3) << fileNum;
 
-		gr_surface surface, temp_surface = NULL;
-		LoadImage(pZip, fileName.str(), &temp_surface);
-		CheckAndScaleImage(temp_surface, &surface, retain_aspect);
-		if (surface) {
-			mSurfaces.push_back(surface);
+		LazyImage* image = new LazyImage(manager, fileName.str(), retain_aspect);
+		if (image->Probe(pZip)) {
+			mImages.push_back(image);
 			fileNum++;
-		} else
+		} else {
+			delete image;
 			break; // Done loading animation images
+		}
 	}
 }
 
 AnimationResource::~AnimationResource()
 {
-	std::vector<gr_surface>::iterator it;
+	std::vector<LazyImage*>::iterator it;
+
+	for (it = mImages.begin(); it != mImages.end(); ++it)
+		delete *it;
+
+	mImages.clear();
+}
 
-	for (it = mSurfaces.begin(); it != mSurfaces.end(); ++it)
-		res_free_surface(*it);
+void AnimationResource::Evict(unsigned generation)
+{
+	for (std::vector<LazyImage*>::iterator it = mImages.begin(); it != mImages.end(); ++it)
+		(*it)->Evict(generation);
+}
 
-	mSurfaces.clear();
+void AnimationResource::GetLoaded(std::vector<const LazyImage*>& images) const
+{
+	for (std::vector<LazyImage*>::const_iterator it = mImages.begin(); it != mImages.end(); ++it)
+		if ((*it)->GetLoaded())
+			images.push_back(*it);
 }
 
 FontResource* ResourceManager::FindFont(const std::string& name) const
@@ -335,6 +521,99 @@ void ResourceManager::DumpStrings() const
 
 ResourceManager::ResourceManager()
 {
+	mThemeCache = NULL;
+	mZipOpen = false;
+	mLoading = false;
+	mDecoded = false;
+	mGeneration = 0;
+	mStringGeneration = 0;
+}
+
+void ResourceManager::BeginLoad(const std::string& package, const unsigned char* zip, size_t zip_length, bool use_cache)
+{
+	mLoading = true;
+	if (zip)
+		mZipPath = package;
+#ifndef TW_NO_THEME_CACHE
+	if (use_cache) {
+		if (!mThemeCache)
+			mThemeCache = new ThemeCache;
+		mThemeCache->Open(package, zip, zip_length);
+	}
+#else
+	(void)zip_length;
+	(void)use_cache;
+#endif
+}
+
+void ResourceManager::EndLoad()
+{
+	mLoading = false;
+	SaveThemeCache();
+}
+
+ZipWrap* ResourceManager::GetZip()
+{
+	if (mZipPath.empty())
+		return NULL;
+	if (!mZipOpen) {
+		mZipOpen = mZip.Open(mZipPath.c_str());
+		if (!mZipOpen)
+			LOGERR("Unable to open zip archive '%s'\n", mZipPath.c_str());
+	}
+	return mZipOpen ? &mZip : NULL;
+}
+
+// MemAvailable needs Linux 3.14, older kernels never count as low
+static bool IsMemoryLow()
+{
+	FILE* fp = fopen("/proc/meminfo", "r");
+	if (!fp)
+		return false;
+	char line[128];
+	long available = -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "MemAvailable: %ld kB", &available) == 1)
+			break;
+	}
+	fclose(fp);
+	return available >= 0 && available < RESOURCE_EVICT_AVAILABLE_KB;
+}
+
+void ResourceManager::PageChanged()
+{
+	++mGeneration;
+	SaveThemeCache();
+	if (mGeneration < 2 || !IsMemoryLow())
+		return;
+
+	// Keep what the previous and the new page use
+	unsigned evict_before = mGeneration - 1;
+	for (std::vector<ImageResource*>::iterator it = mImages.begin(); it != mImages.end(); ++it)
+		(*it)->Evict(evict_before);
+	for (std::vector<AnimationResource*>::iterator it = mAnimations.begin(); it != mAnimations.end(); ++it)
+		(*it)->Evict(evict_before);
+}
+
+void ResourceManager::SaveThemeCache()
+{
+	if (!mThemeCache || !mDecoded)
+		return;
+	mDecoded = false;
+
+	std::vector<const Resource::LazyImage*> loaded;
+	for (std::vector<ImageResource*>::const_iterator it = mImages.begin(); it != mImages.end(); ++it)
+		(*it)->GetLoaded(loaded);
+	for (std::vector<AnimationResource*>::const_iterator it = mAnimations.begin(); it != mAnimations.end(); ++it)
+		(*it)->GetLoaded(loaded);
+
+	std::vector<std::pair<std::string, gr_surface> > images;
+	for (std::vector<const Resource::LazyImage*>::const_iterator it = loaded.begin(); it != loaded.end(); ++it) {
+		const Resource::LazyImage* image = *it;
+		std::string key = ThemeCache::GetKey(image->GetFile(), image->GetRetainAspect(), image->GetScaleW(), image->GetScaleH());
+		images.push_back(std::make_pair(key, image->GetLoaded()));
+	}
+	mThemeCache->Save(images);
 }
 
 void ResourceManager::AddStringResource(std::string resource_source, std::string resource_name, std::string value)
@@ -343,6 +622,7 @@ void ResourceManager::AddStringResource(std::string resource_source, std::string
 	res.source = resource_source;
 	res.value = value;
 	mStrings[resource_name] = res;
+	mStringGeneration++;
 }
 
 void ResourceManager::LoadResources(xml_node<>* resList, ZipWrap* pZip, std::string resource_source)
@@ -392,8 +672,8 @@ void ResourceManager::LoadResources(xml_node<>* resList, ZipWrap* pZip, std::str
 		}
 		else if (type == "image")
 		{
-			ImageResource* res = new ImageResource(child, pZip);
-			if (res && res->GetResource())
+			ImageResource* res = new ImageResource(child, pZip, this);
+			if (res && res->IsValid())
 				mImages.push_back(res);
 			else {
 				error = true;
@@ -402,7 +682,7 @@ void ResourceManager::LoadResources(xml_node<>* resList, ZipWrap* pZip, std::str
 		}
 		else if (type == "animation")
 		{
-			AnimationResource* res = new AnimationResource(child, pZip);
+			AnimationResource* res = new AnimationResource(child, pZip, this);
 			if (res && res->GetResourceCount())
 				mAnimations.push_back(res);
 			else {
@@ -417,6 +697,7 @@ void ResourceManager::LoadResources(xml_node<>* resList, ZipWrap* pZip, std::str
 				res.source = resource_source;
 				res.value = child->value();
 				mStrings[attr->value()] = res;
+				mStringGeneration++;
 			} else
 				error = true;
 		}
@@ -452,4 +733,6 @@ ResourceManager::~ResourceManager()
 
 	for (std::vector<AnimationResource*>::iterator it = mAnimations.begin(); it != mAnimations.end(); ++it)
 		delete *it;
+
+	delete mThemeCache;
 }
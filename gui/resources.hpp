@@ -31,6 +31,9 @@ extern "C" {
 #include "../minuitwrp/minui.h"
 }
 
+class ThemeCache;
+class ResourceManager;
+
 // Base Objects
 class Resource
 {
@@ -47,7 +50,46 @@ private:
 protected:
 	static int ExtractResource(ZipWrap* pZip, std::string folderName, std::string fileName, std::string fileExtn, std::string destFile);
 	static void LoadImage(ZipWrap* pZip, std::string file, gr_surface* surface);
-	static void CheckAndScaleImage(gr_surface source, gr_surface* destination, int retain_aspect);
+	static void CheckAndScaleImage(gr_surface source, gr_surface* destination, int retain_aspect, float scale_w, float scale_h);
+	static bool ReadImageSize(ZipWrap* pZip, std::string file, int* width, int* height);
+
+public:
+	// One image of a resource. It is decoded on first use after its package
+	// has finished loading, and can be dropped again when memory runs low.
+	class LazyImage
+	{
+	public:
+		LazyImage(ResourceManager* manager, const std::string& file, int retain_aspect);
+		~LazyImage();
+
+		// Checks that the image exists and gets its size, from the theme
+		// cache or the file header where possible, else by decoding it
+		bool Probe(ZipWrap* pZip);
+		// Returns a size-only placeholder while the package is loading
+		gr_surface Get();
+		gr_surface GetLoaded() const { return mSurface; }
+		int GetWidth() const { return mWidth; }
+		int GetHeight() const { return mHeight; }
+		const std::string& GetFile() const { return mFile; }
+		int GetRetainAspect() const { return mRetainAspect; }
+		float GetScaleW() const { return mScaleW; }
+		float GetScaleH() const { return mScaleH; }
+		bool Evict(unsigned generation);
+
+	private:
+		bool Decode(ZipWrap* pZip);
+
+		ResourceManager* mManager;
+		std::string mFile;
+		int mRetainAspect;
+		float mScaleW, mScaleH; // theme scale when the package was loaded
+		int mWidth, mHeight;
+		gr_surface mSurface;
+		gr_surface mPlaceholder;
+		bool mFailed;
+		unsigned mLastUse; // ResourceManager generation of the last Get
+		int64_t mAccounted; // decoded bytes counted in MEMORY_GUI
+	};
 };
 
 class FontResource : public Resource
@@ -76,33 +118,38 @@ private:
 class ImageResource : public Resource
 {
 public:
-	ImageResource(xml_node<>* node, ZipWrap* pZip);
+	ImageResource(xml_node<>* node, ZipWrap* pZip, ResourceManager* manager = NULL);
 	virtual ~ImageResource();
 
 public:
-	gr_surface GetResource() { return mSurface; }
-	int GetWidth() { return gr_get_width(mSurface); }
-	int GetHeight() { return gr_get_height(mSurface); }
+	gr_surface GetResource() { return mImage ? mImage->Get() : NULL; }
+	int GetWidth() { return mImage ? mImage->GetWidth() : 0; }
+	int GetHeight() { return mImage ? mImage->GetHeight() : 0; }
+	bool IsValid() { return mImage != NULL; }
+	void Evict(unsigned generation) { if (mImage) mImage->Evict(generation); }
+	void GetLoaded(std::vector<const LazyImage*>& images) const { if (mImage && mImage->GetLoaded()) images.push_back(mImage); }
 
 protected:
-	gr_surface mSurface;
+	LazyImage* mImage;
 };
 
 class AnimationResource : public Resource
 {
 public:
-	AnimationResource(xml_node<>* node, ZipWrap* pZip);
+	AnimationResource(xml_node<>* node, ZipWrap* pZip, ResourceManager* manager = NULL);
 	virtual ~AnimationResource();
 
 public:
-	gr_surface GetResource() { return mSurfaces.empty() ? NULL : mSurfaces.at(0); }
-	gr_surface GetResource(int entry) { return mSurfaces.empty() ? NULL : mSurfaces.at(entry); }
-	int GetWidth() { return gr_get_width(GetResource()); }
-	int GetHeight() { return gr_get_height(GetResource()); }
-	int GetResourceCount() { return mSurfaces.size(); }
+	gr_surface GetResource() { return mImages.empty() ? NULL : mImages.at(0)->Get(); }
+	gr_surface GetResource(int entry) { return mImages.empty() ? NULL : mImages.at(entry)->Get(); }
+	int GetWidth() { return mImages.empty() ? 0 : mImages.at(0)->GetWidth(); }
+	int GetHeight() { return mImages.empty() ? 0 : mImages.at(0)->GetHeight(); }
+	int GetResourceCount() { return mImages.size(); }
+	void Evict(unsigned generation);
+	void GetLoaded(std::vector<const LazyImage*>& images) const;
 
 protected:
-	std::vector<gr_surface> mSurfaces;
+	std::vector<LazyImage*> mImages;
 };
 
 class ResourceManager
@@ -113,6 +160,23 @@ public:
 	void AddStringResource(std::string resource_source, std::string resource_name, std::string value);
 	void LoadResources(xml_node<>* resList, ZipWrap* pZip, std::string resource_source);
 
+	// Brackets the loading of a package. Images are only probed in between
+	// and decoded on first use afterwards. zip is the mapped theme zip, or
+	// NULL for the stock theme; use_cache enables the theme image cache.
+	void BeginLoad(const std::string& package, const unsigned char* zip, size_t zip_length, bool use_cache);
+	void EndLoad();
+	// Called on page changes: drops images unused since the last change if
+	// memory is low, and saves newly decoded images to the theme cache
+	void PageChanged();
+
+	bool IsLoading() const { return mLoading; }
+	unsigned GetGeneration() const { return mGeneration; }
+	ThemeCache* GetThemeCache() { return mThemeCache; }
+	void ImageDecoded() { mDecoded = true; }
+	// The theme zip for images decoded after loading, NULL for the stock theme
+	ZipWrap* GetZip();
+	bool IsZipTheme() const { return !mZipPath.empty(); }
+
 public:
 	FontResource* FindFont(const std::string& name) const;
 	ImageResource* FindImage(const std::string& name) const;
@@ -120,6 +184,7 @@ public:
 	std::string FindString(const std::string& name) const;
 	std::string FindString(const std::string& name, const std::string& default_string) const;
 	void DumpStrings() const;
+	unsigned GetStringGeneration() const { return mStringGeneration; }
 
 private:
 	struct string_resource_struct {
@@ -130,6 +195,16 @@ private:
 	std::vector<ImageResource*> mImages;
 	std::vector<AnimationResource*> mAnimations;
 	std::map<std::string, string_resource_struct> mStrings;
+	ThemeCache* mThemeCache; // backs the pixels of cached images, freed last
+	std::string mZipPath; // empty for the stock theme
+	ZipWrap mZip;
+	bool mZipOpen;
+	bool mLoading;
+	bool mDecoded; // images were decoded since the theme cache was saved
+	unsigned mGeneration;
+	unsigned mStringGeneration; // bumped whenever mStrings changes
+
+	void SaveThemeCache();
 };
 
 #endif  // _RESOURCE_HEADER
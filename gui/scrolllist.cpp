@@ -64,6 +64,8 @@ GUIScrollList::GUIScrollList(xml_node<>* node) : GUIObject(node)
 	// Simple way to check for static state
 	mLastHeaderValue = gui_parse_text(mHeaderText);
 	mHeaderIsStatic = (mLastHeaderValue == mHeaderText);
+	if (!mHeaderIsStatic)
+		WatchTextVars(mHeaderText);
 
 	mHighlightColor = LoadAttrColor(FindNode(node, "highlight"), "color", &hasHighlightColor);
 
@@ -625,33 +627,34 @@ bool GUIScrollList::AddLines(std::vector<std::string>* origText, std::vector<std
 	// Note, that multiple consoles on different GUI pages may be different widths or use different fonts, so the word wrapping
 	// may different in different console windows
 	for (size_t i = prevCount; i < *lastCount; i++) {
-		string curr_line = origText->at(i);
-		string curr_color;
+		size_t count = WrapLine(origText->at(i), *rText);
 		if (origColor)
-			curr_color = origColor->at(i);
-		for (;;) {
-			size_t line_char_width = gr_ttf_maxExW(curr_line.c_str(), mFont->GetResource(), mRenderW);
-			if (line_char_width < curr_line.size()) {
-				//string left = curr_line.substr(0, line_char_width);
-				size_t wrap_pos = curr_line.find_last_of(" ,./:-_;", line_char_width - 1);
-				if (wrap_pos == string::npos)
-					wrap_pos = line_char_width;
-				else if (wrap_pos < line_char_width - 1)
-					wrap_pos++;
-				rText->push_back(curr_line.substr(0, wrap_pos));
-				if (origColor)
-					rColor->push_back(curr_color);
-				curr_line = curr_line.substr(wrap_pos);
-				/* After word wrapping, delete any leading spaces. Note that the word wrapping is not smart enough to know not
-				 * to wrap in the middle of something like ... so some of the ... could appear on the following line. */
-				curr_line.erase(0, curr_line.find_first_not_of(" "));
-			} else {
-				rText->push_back(curr_line);
-				if (origColor)
-					rColor->push_back(curr_color);
-				break;
-			}
-		}
+			rColor->insert(rColor->end(), count, origColor->at(i));
 	}
 	return true;
 }
+
+size_t GUIScrollList::WrapLine(std::string curr_line, std::vector<std::string>& rText)
+{
+	size_t count = 0;
+	for (;;) {
+		count++;
+		size_t line_char_width = gr_ttf_maxExW(curr_line.c_str(), mFont->GetResource(), mRenderW);
+		if (line_char_width < curr_line.size()) {
+			//string left = curr_line.substr(0, line_char_width);
+			size_t wrap_pos = curr_line.find_last_of(" ,./:-_;", line_char_width - 1);
+			if (wrap_pos == string::npos)
+				wrap_pos = line_char_width;
+			else if (wrap_pos < line_char_width - 1)
+				wrap_pos++;
+			rText.push_back(curr_line.substr(0, wrap_pos));
+			curr_line = curr_line.substr(wrap_pos);
+			/* After word wrapping, delete any leading spaces. Note that the word wrapping is not smart enough to know not
+			 * to wrap in the middle of something like ... so some of the ... could appear on the following line. */
+			curr_line.erase(0, curr_line.find_first_not_of(" "));
+		} else {
+			rText.push_back(curr_line);
+			return count;
+		}
+	}
+}
@@ -85,6 +85,8 @@ GUISliderValue::GUISliderValue(xml_node<>* node) : GUIObject(node)
 		delete mLabel;
 		mLabel = NULL;
 	}
+	else
+		WatchVars(mLabel); // NotifyVarChange passes changes on to the label
 
 	mAction = new GUIAction(node);
 
@@ -119,6 +121,7 @@ GUISliderValue::GUISliderValue(xml_node<>* node) : GUIObject(node)
 		attr = child->first_attribute("variable");
 		if (attr)
 			mVariable = attr->value();
+		WatchVar(mVariable);
 
 		attr = child->first_attribute("min");
 		if (attr)
@@ -24,8 +24,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <termio.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <cctype>
 #include <linux/input.h>
 #include <sys/wait.h>
@@ -47,14 +51,23 @@ extern "C" {
 
 extern int g_pty_fd; // in gui.cpp where the select is
 
+#define PTY_RING_SIZE (256 * 1024) // must be a power of 2
+#define PTY_READ_BATCH (128 * 1024) // most output parsed per frame
+
 /*
 Pseudoterminal handler.
+A reader thread keeps the pty drained into a ring buffer, so fast output is
+never limited to one small read per GUI frame. The GUI thread selects on a
+wake pipe instead of the pty and parses what has arrived once per frame.
 */
 class Pseudoterminal
 {
 public:
-	Pseudoterminal() : fdMaster(0), pid(0)
+	Pseudoterminal() : fdMaster(0), pid(0), readerStarted(false),
+		ringHead(0), ringTail(0), readerError(0), wakePending(0)
 	{
+		wakePipe[0] = wakePipe[1] = -1;
+		quitPipe[0] = quitPipe[1] = -1;
 	}
 
 	bool started() const { return pid > 0; }
@@ -82,8 +95,9 @@ public:
 		else if (pid) {
 			// child started, now someone needs to periodically read from fdMaster
 			// and write it to the terminal
-			// this currently works through gui.cpp calling terminal_pty_read below
-			g_pty_fd = fdMaster;
+			// this currently works through gui.cpp calling terminal_pty_read below,
+			// either for the wake pipe of the reader thread or for fdMaster itself
+			g_pty_fd = startReader() ? wakePipe[0] : fdMaster;
 			set_select_fd();
 			return true;
 		}
@@ -118,12 +132,15 @@ public:
 		_exit(127);
 	}
 
+	// Returns 0 when the reader thread has nothing buffered right now
 	int read(char* buffer, size_t size)
 	{
 		if (!started()) {
 			LOGERR("someone tried to read from pty, but it was not started\n");
 			return -1;
 		}
+		if (readerStarted)
+			return readRing(buffer, size);
 		int rc = ::read(fdMaster, buffer, size);
 		debug_printf("pty read: %d bytes\n", rc);
 		if (rc < 0) {
@@ -168,12 +185,33 @@ public:
 			LOGERR("failed to set window size, error %d\n", errno);
 	}
 
+	bool threaded() const { return readerStarted; }
+
+	// Called before reading a batch, so output that arrives while parsing wakes the next frame
+	void ackWake()
+	{
+		if (!readerStarted)
+			return;
+		char buf[64];
+		while (::read(wakePipe[0], buf, sizeof(buf)) > 0)
+			;
+		__atomic_store_n(&wakePending, 0, __ATOMIC_SEQ_CST);
+	}
+
+	// Makes the select in gui.cpp return on the next frame
+	void wake()
+	{
+		if (readerStarted)
+			signalWake();
+	}
+
 	void stop()
 	{
 		if (!started()) {
 			LOGERR("someone tried to stop pty, but it was not started\n");
 			return;
 		}
+		stopReader();
 		close(fdMaster);
 		g_pty_fd = fdMaster = -1;
 		set_select_fd();
@@ -183,8 +221,151 @@ public:
 	}
 
 private:
+	bool startReader()
+	{
+		if (pipe2(wakePipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+			LOGERR("pty wake pipe failed: %d\n", errno);
+			return false;
+		}
+		if (pipe2(quitPipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+			LOGERR("pty quit pipe failed: %d\n", errno);
+			closePipes();
+			return false;
+		}
+		ring.resize(PTY_RING_SIZE);
+		ringHead = ringTail = 0;
+		readerError = 0;
+		wakePending = 0;
+		readerStarted = true;
+		if (pthread_create(&reader, NULL, readerThread, this) != 0) {
+			LOGERR("pty reader thread failed: %d\n", errno);
+			readerStarted = false;
+			closePipes();
+			return false;
+		}
+		return true;
+	}
+
+	void stopReader()
+	{
+		if (!readerStarted)
+			return;
+		char c = 0;
+		if (::write(quitPipe[1], &c, 1) < 0)
+			LOGERR("pty quit failed: %d\n", errno);
+		pthread_join(reader, NULL);
+		readerStarted = false;
+		closePipes();
+		std::vector<char>().swap(ring);
+	}
+
+	void closePipes()
+	{
+		for (int i = 0; i < 2; ++i) {
+			if (wakePipe[i] >= 0)
+				close(wakePipe[i]);
+			if (quitPipe[i] >= 0)
+				close(quitPipe[i]);
+			wakePipe[i] = quitPipe[i] = -1;
+		}
+	}
+
+	static void* readerThread(void* cookie)
+	{
+		((Pseudoterminal*)cookie)->readLoop();
+		return NULL;
+	}
+
+	// Runs on the reader thread, the only writer of ringHead
+	void readLoop()
+	{
+		for (;;) {
+			size_t head = __atomic_load_n(&ringHead, __ATOMIC_RELAXED);
+			size_t space = PTY_RING_SIZE - (head - __atomic_load_n(&ringTail, __ATOMIC_ACQUIRE));
+			struct pollfd fds[2];
+			fds[0].fd = quitPipe[0];
+			fds[0].events = POLLIN;
+			fds[0].revents = 0;
+			fds[1].fd = fdMaster;
+			fds[1].events = POLLIN;
+			fds[1].revents = 0;
+			// with a full ring the child blocks until the GUI catches up, which it doesn't announce
+			int rc = poll(fds, space ? 2 : 1, space ? -1 : 10);
+			if (rc < 0 && errno != EINTR) {
+				LOGERR("pty poll failed: %d\n", errno);
+				finishReader(errno);
+				return;
+			}
+			if (fds[0].revents)
+				return; // stop() wants us gone
+			if (rc <= 0 || !fds[1].revents)
+				continue;
+
+			size_t offset = head & (PTY_RING_SIZE - 1);
+			ssize_t n = ::read(fdMaster, &ring[offset], std::min(space, (size_t)PTY_RING_SIZE - offset));
+			debug_printf("pty read: %d bytes\n", (int)n);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				// assume child has died (usual errno when shell exits seems to be EIO == 5)
+				finishReader(n < 0 ? errno : EIO);
+				return;
+			}
+			__atomic_store_n(&ringHead, head + n, __ATOMIC_RELEASE);
+			signalWake();
+		}
+	}
+
+	void finishReader(int error)
+	{
+		__atomic_store_n(&readerError, error, __ATOMIC_RELEASE);
+		signalWake();
+	}
+
+	void signalWake()
+	{
+		if (!__atomic_exchange_n(&wakePending, 1, __ATOMIC_SEQ_CST)) {
+			char c = 0;
+			if (::write(wakePipe[1], &c, 1) < 0 && errno != EAGAIN)
+				LOGERR("pty wake failed: %d\n", errno);
+		}
+	}
+
+	// Runs on the GUI thread, the only writer of ringTail
+	int readRing(char* buffer, size_t size)
+	{
+		// the error is set after the last data, so check it first
+		int error = __atomic_load_n(&readerError, __ATOMIC_ACQUIRE);
+		size_t tail = __atomic_load_n(&ringTail, __ATOMIC_RELAXED);
+		size_t avail = __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE) - tail;
+		if (!avail) {
+			if (!error)
+				return 0;
+			if (error != EIO)
+				LOGERR("pty read failed: %d\n", error);
+			stop();
+			return -1;
+		}
+		size_t n = std::min(avail, size);
+		size_t offset = tail & (PTY_RING_SIZE - 1);
+		size_t first = std::min(n, (size_t)PTY_RING_SIZE - offset);
+		memcpy(buffer, &ring[offset], first);
+		memcpy(buffer + first, &ring[0], n - first);
+		__atomic_store_n(&ringTail, tail + n, __ATOMIC_RELEASE);
+		return n;
+	}
+
 	int fdMaster;
 	pid_t pid;
+
+	pthread_t reader;
+	bool readerStarted;
+	int wakePipe[2]; // written by the reader thread when data arrives, selected in gui.cpp
+	int quitPipe[2]; // written by stop() to end the reader thread
+	std::vector<char> ring;
+	size_t ringHead, ringTail; // free running, only the low bits index the ring
+	int readerError; // errno that ended the reader thread, 0 while it runs
+	int wakePending; // a byte is or will be in the wake pipe
 };
 
 // UTF-8 decoder
@@ -300,6 +481,13 @@ public:
 		}
 
 		std::string substr(size_t start, size_t n) const
+		{
+			std::string out;
+			substr(start, n, out);
+			return out;
+		}
+		// same as above, but reuses the storage of out
+		void substr(size_t start, size_t n, std::string& out) const
 		{
 			size_t i = 0;
 			for (; start && i < text.size(); i = utf8forward(i))
@@ -307,7 +495,7 @@ public:
 			size_t s = i;
 			for (; n && i < text.size(); i = utf8forward(i))
 				--n;
-			return text.substr(s, i - s);
+			out.assign(text, s, i - s);
 		}
 		size_t length() const
 		{
@@ -351,6 +539,7 @@ public:
 		height = 10;
 
 		clear();
+		clearDamage();
 		updateCounter = 0;
 		state = kStateGround;
 		utf8state = utf8codepoint = 0;
@@ -376,14 +565,27 @@ public:
 
 	void readPty()
 	{
-		char buffer[1024];
-		int rc = pty.read(buffer, sizeof(buffer));
-		debug_printf("readPty: %d bytes\n", rc);
-		if (rc < 0)
-			output("\r\nChild process exited.\r\n");	// TODO: maybe exit terminal here
-		else
-			for (int i = 0; i < rc; ++i)
-				output(buffer[i]);
+		char buffer[4096];
+		size_t total = 0;
+		pty.ackWake();
+		for (;;) {
+			int rc = pty.read(buffer, sizeof(buffer));
+			debug_printf("readPty: %d bytes\n", rc);
+			if (rc < 0) {
+				output("\r\nChild process exited.\r\n");	// TODO: maybe exit terminal here
+				return;
+			}
+			output(buffer, rc);
+			total += rc;
+			// without the reader thread, another read could block
+			if (rc == 0 || !pty.threaded())
+				return;
+			if (total >= PTY_READ_BATCH) {
+				// leave the rest for the next frame, so the screen keeps updating
+				pty.wake();
+				return;
+			}
+		}
 	}
 
 	void clear()
@@ -393,6 +595,7 @@ public:
 		setY(0);
 		unpackLine(0);
 		linewrap = false;
+		damageAll = true;
 		++updateCounter;
 	}
 
@@ -402,6 +605,22 @@ public:
 			output(*p);
 	}
 
+	void output(const char *buf, size_t size)
+	{
+		size_t i = 0;
+		while (i < size) {
+			// runs of printable ASCII go straight into the line instead of through the decoder
+			if (state == kStateGround && utf8state == UTF8_ACCEPT && isPrintableAscii(buf[i])) {
+				size_t end = i + 1;
+				while (end < size && isPrintableAscii(buf[end]))
+					++end;
+				i += processText(buf + i, end - i);
+			}
+			else
+				output(buf[i++]);
+		}
+	}
+
 	void output(const char ch)
 	{
 		char debug[2]; debug[0] = ch; debug[1] = 0;
@@ -484,12 +703,62 @@ public:
 		++updateCounter;
 	}
 
+	// Lines changed since clearDamage(), false if any line may have changed or moved
+	bool getDamage(size_t& first, size_t& last) const
+	{
+		if (damageAll)
+			return false;
+		first = damageFirst;
+		last = damageLast;
+		return true;
+	}
+
+	void clearDamage()
+	{
+		damageAll = false;
+		damageFirst = (size_t)-1;
+		damageLast = 0;
+	}
+
 	void up(int n = 1) { setY(cursorY - n); }
 	void down(int n = 1) { setY(cursorY + n); }
 	void left(int n = 1) { setX(cursorX - n); }
 	void right(int n = 1) { setX(cursorX + n); }
 
 private:
+	static bool isPrintableAscii(char ch) { return ch >= ' ' && ch < 127; }
+
+	void damageLine(size_t y)
+	{
+		damageFirst = std::min(damageFirst, y);
+		damageLast = std::max(damageLast, y);
+	}
+
+	// Same as processChar for each character, but at most up to the end of the line
+	size_t processText(const char* text, size_t size)
+	{
+		if (linewrap) {
+			down();
+			setX(0);
+		}
+		if (cursorX >= width) {
+			processChar((unsigned char)*text);
+			return 1;
+		}
+		size_t n = std::min(size, (size_t)(width - cursorX));
+		ensureUnpacked(cursorY);
+		if (unpackedLine.cells.size() < (size_t)cursorX + n)
+			unpackedLine.cells.resize(cursorX + n);
+		for (size_t i = 0; i < n; ++i)
+			unpackedLine.cells[cursorX + i].cp = (unsigned char)text[i];
+		damageLine(cursorY);
+
+		setX(cursorX + n);
+		if (cursorX >= width)
+			linewrap = true;
+		return n;
+	}
+
 	void packLine()
 	{
 		std::string& s = lines[unpackedY].text;
@@ -596,6 +865,7 @@ private:
 		if (unpackedLine.cells.size() <= (size_t)cursorX)
 			unpackedLine.cells.resize(cursorX+1);
 		unpackedLine.cells[cursorX].cp = cp;
+		damageLine(cursorY);
 
 		right(); // also bumps updateCounter
 
@@ -700,6 +970,7 @@ private:
 				{
 					int param = parseArg(ctlseq, 0);
 					ensureUnpacked(cursorY);
+					damageAll = true;
 					switch (param) {
 						default:
 						case 0:
@@ -725,6 +996,7 @@ private:
 				{
 					int param = parseArg(ctlseq, 0);
 					ensureUnpacked(cursorY);
+					damageLine(cursorY);
 					switch (param) {
 						default:
 						case 0:
@@ -755,6 +1027,8 @@ private:
 	UnpackedLine unpackedLine; // current line for editing
 	size_t unpackedY; // number of current line
 	int updateCounter; // changes whenever terminal could require redraw
+	bool damageAll; // lines were added, removed or cleared
+	size_t damageFirst, damageLast; // range of lines written to, empty if first > last
 
 	Pseudoterminal pty;
 	enum { kStateGround, kStateEsc, kStateCsi } state;
@@ -790,6 +1064,8 @@ GUITerminal::GUITerminal(xml_node<>* node) : GUIScrollList(node)
 
 	engine = &gEngine;
 	updateCounter = 0;
+	mDrawnValid = false;
+	mDamageKnown = false;
 }
 
 int GUITerminal::Update(void)
@@ -803,6 +1079,7 @@ int GUITerminal::Update(void)
 		lastCondition = true;
 		// we're becoming visible, so we might need to resize the terminal content
 		InitAndResize();
+		mDrawnValid = false;
 	}
 
 	if (updateCounter != engine->getUpdateCounter()) {
@@ -814,10 +1091,52 @@ int GUITerminal::Update(void)
 	GUIScrollList::Update();
 
 	if (mUpdate) {
+		// the page renders us once for the frame, only where the damage is
 		mUpdate = 0;
-		if (Render() == 0)
-			return 2;
+		TrackDamage();
+		return 2;
+	}
+	return 0;
+}
+
+void GUITerminal::TrackDamage()
+{
+	size_t first, last;
+	int cursorY = engine->getCursorY();
+	size_t count = engine->getLinesCount();
+
+	// scrolling or adding lines moves everything, otherwise only the written lines
+	// and the old and new cursor line need a redraw
+	mDamageKnown = mDrawnValid && firstDisplayedItem == mDrawnFirst && y_offset == mDrawnOffset
+		&& count == mDrawnCount && engine->getDamage(first, last);
+	if (mDamageKnown) {
+		first = std::min(first, (size_t)std::min(cursorY, mDrawnCursorY));
+		last = std::max(last, (size_t)std::max(cursorY, mDrawnCursorY));
+		int listY = mRenderY + mHeaderH;
+		int top = listY + y_offset + ((int)first - firstDisplayedItem) * actualItemHeight;
+		int bottom = listY + y_offset + ((int)last + 1 - firstDisplayedItem) * actualItemHeight;
+		top = std::max(top, listY);
+		bottom = std::min(bottom, mRenderY + mRenderH);
+		mDamageY = top;
+		mDamageH = std::max(bottom - top, 0);
 	}
+
+	mDrawnValid = true;
+	mDrawnFirst = firstDisplayedItem;
+	mDrawnOffset = y_offset;
+	mDrawnCursorY = cursorY;
+	mDrawnCount = count;
+	engine->clearDamage();
+}
+
+int GUITerminal::GetUpdateDamage(int& x, int& y, int& w, int& h)
+{
+	if (!mDamageKnown)
+		return GUIScrollList::GetUpdateDamage(x, y, w, h);
+	x = mRenderX;
+	y = mDamageY;
+	w = mRenderW;
+	h = mDamageH;
 	return 0;
 }
 
@@ -878,15 +1197,18 @@ void GUITerminal::RenderItem(size_t itemindex, int yPos, bool selected __unused)
 	if (itemindex == (size_t) engine->getCursorY()) {
 		// render cursor
 		int cursorX = engine->getCursorX();
-		std::string leftOfCursor = line.substr(0, cursorX);
-		int x = gr_ttf_measureEx(leftOfCursor.c_str(), mFont->GetResource());
+		line.substr(0, cursorX, mCursorLeft);
+		int x = gr_ttf_measureEx(mCursorLeft.c_str(), mFont->GetResource());
 		// note that this single character can be a UTF-8 sequence
-		std::string atCursor = (size_t)cursorX < line.length() ? line.substr(cursorX, 1) : " ";
-		int w = gr_ttf_measureEx(atCursor.c_str(), mFont->GetResource());
+		if ((size_t)cursorX < line.length())
+			line.substr(cursorX, 1, mCursorChar);
+		else
+			mCursorChar.assign(1, ' ');
+		int w = gr_ttf_measureEx(mCursorChar.c_str(), mFont->GetResource());
 		gr_color(mFontColor.red, mFontColor.green, mFontColor.blue, mFontColor.alpha);
 		gr_fill(mRenderX + x, yPos, w, actualItemHeight);
 		gr_color(mBackgroundColor.red, mBackgroundColor.green, mBackgroundColor.blue, mBackgroundColor.alpha);
-		gr_textEx_scaleW(mRenderX + x, yPos, atCursor.c_str(), mFont->GetResource(), mRenderW, TOP_LEFT, 0);
+		gr_textEx_scaleW(mRenderX + x, yPos, mCursorChar.c_str(), mFont->GetResource(), mRenderW, TOP_LEFT, 0);
 	}
 }
 
@@ -54,6 +54,8 @@ GUIText::GUIText(xml_node<>* node)
 	scaleWidth = true;
 	isHighlighted = false;
 	mText = "";
+	mResolvedGeneration = 0;
+	mResolved = false;
 
 	if (!node)
 		return;
@@ -95,6 +97,8 @@ GUIText::GUIText(xml_node<>* node)
 	// Simple way to check for static state
 	mLastValue = gui_parse_text(mText);
 	if (mLastValue != mText)   mIsStatic = 0;
+	if (!mIsStatic)
+		WatchTextVars(mText);
 
 	mFontHeight = mFont->GetHeight();
 }
@@ -110,7 +114,8 @@ int GUIText::Render(void)
 	else
 		return -1;
 
-	mLastValue = gui_parse_text(mText);
+	// Text is only parsed again when the language changes, and rebuilt when one of its variables did
+	UpdateValue();
 
 	mVarChanged = 0;
 
@@ -142,11 +147,8 @@ int GUIText::Update(void)
 	if (mIsStatic || !mVarChanged)
 		return 0;
 
-	std::string newValue = gui_parse_text(mText);
-	if (mLastValue == newValue)
+	if (!UpdateValue())
 		return 0;
-	else
-		mLastValue = newValue;
 	return 2;
 }
 
@@ -158,11 +160,37 @@ int GUIText::GetCurrentBounds(int& w, int& h)
 		fontResource = mFont->GetResource();
 
 	h = mFontHeight;
-	mLastValue = gui_parse_text(mText);
+	UpdateValue();
 	w = gr_ttf_measureEx(mLastValue.c_str(), fontResource);
 	return 0;
 }
 
+int GUIText::GetDamageRect(int& x, int& y, int& w, int& h)
+{
+	// Scaled strings shrink to fit maxWidth, unscaled ones may span the screen
+	if (scaleWidth && maxWidth) {
+		w = maxWidth;
+		if (mPlacement == TOP_LEFT || mPlacement == BOTTOM_LEFT || mPlacement == TEXT_ONLY_RIGHT)
+			x = mRenderX;
+		else if (mPlacement == CENTER || mPlacement == CENTER_X_ONLY)
+			x = mRenderX - (w / 2);
+		else
+			x = mRenderX - w;
+	} else {
+		x = 0;
+		w = gr_fb_width();
+	}
+
+	h = mFontHeight;
+	y = mRenderY;
+	if (mPlacement == CENTER || mPlacement == TEXT_ONLY_RIGHT)
+		y -= (h / 2);
+	else if (mPlacement == BOTTOM_LEFT || mPlacement == BOTTOM_RIGHT)
+		y -= h;
+
+	return (mFont && h > 0) ? 0 : -1;
+}
+
 int GUIText::NotifyVarChange(const std::string& varName, const std::string& value)
 {
 	GUIObject::NotifyVarChange(varName, value);
@@ -183,4 +211,23 @@ int GUIText::SetMaxWidth(unsigned width)
 void GUIText::SetText(string newtext)
 {
 	mText = newtext;
+	mResolved = false;
+}
+
+bool GUIText::ResolveText()
+{
+	unsigned generation = gui_string_generation();
+
+	if (mResolved && generation == mResolvedGeneration)
+		return false;
+	mTemplate.Compile(gui_resolve_resources(mText));
+	mResolvedGeneration = generation;
+	mResolved = true;
+	return true;
+}
+
+bool GUIText::UpdateValue()
+{
+	bool compiled = ResolveText();
+	return mTemplate.Evaluate(mLastValue, compiled);
 }
@@ -49,8 +49,10 @@ GUITextBox::GUITextBox(xml_node<>* node) : GUIScrollList(node)
 		string txt = child->value();
 		mText.push_back(txt);
 		string lookup = gui_parse_text(txt);
-		if (lookup != txt)
+		if (lookup != txt) {
 			mIsStatic = false;
+			WatchTextVars(txt);
+		}
 		mLastValue.push_back(lookup);
 		child = child->next_sibling("text");
 	}
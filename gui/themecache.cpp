@@ -0,0 +1,362 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// themecache.cpp - Decoded theme images kept on storage between boots
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+
+#include <pixelflinger/pixelflinger.h>
+
+#include "../data.hpp"
+#include "../partitions.hpp"
+#include "../twrp-functions.hpp"
+#include "../variables.h"
+extern "C" {
+#include "../twcommon.h"
+#include "gui.h"
+}
+#include "themecache.hpp"
+
+#define THEME_CACHE_DIR "/TWRP/.themecache/"
+#define THEME_CACHE_MAGIC 0x43545754 // "TWTC"
+#define THEME_CACHE_VERSION 1
+#define THEME_CACHE_ALIGNMENT 8
+
+// File layout: header, entries, keys, then the pixels of every entry
+struct ThemeCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t hash;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct ThemeCache::Entry
+{
+	uint32_t key_offset;
+	uint32_t key_length;
+	uint32_t data_offset;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride; // in pixels, all cached surfaces are 32 bpp
+	uint32_t format;
+	uint32_t reserved;
+};
+
+// 64bit FNV-1a
+static uint64_t fnv_hash(uint64_t hash, const void* data, size_t len)
+{
+	const unsigned char* p = (const unsigned char*) data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static const uint64_t fnv_offset_basis = 14695981039346656037ULL;
+
+static uint32_t read_le32(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+ThemeCache::ThemeCache()
+{
+	mHash = 0;
+	mMap = NULL;
+	mMapLength = 0;
+}
+
+ThemeCache::~ThemeCache()
+{
+	Close();
+}
+
+void ThemeCache::Close()
+{
+	mEntries.clear();
+	if (mMap)
+		munmap(mMap, mMapLength);
+	mMap = NULL;
+	mMapLength = 0;
+}
+
+std::string ThemeCache::GetKey(const std::string& file, bool retain_aspect, float scale_w, float scale_h)
+{
+	// the same file may be loaded with and without retaining the aspect
+	char scale[64];
+	snprintf(scale, sizeof(scale), ":%g:%g:%d", scale_w, scale_h, retain_aspect ? 1 : 0);
+	return file + scale;
+}
+
+uint64_t ThemeCache::HashZip(const unsigned char* zip, size_t zip_length)
+{
+	// The central directory holds the CRC and size of every entry, which is
+	// enough to notice any change without reading the whole zip
+	const size_t eocd_size = 22;
+	if (zip_length >= eocd_size) {
+		size_t min_pos = zip_length > 0xffff + eocd_size ? zip_length - 0xffff - eocd_size : 0;
+		for (size_t pos = zip_length - eocd_size; ; pos--) {
+			if (read_le32(zip + pos) == 0x06054b50) {
+				uint32_t cd_size = read_le32(zip + pos + 12);
+				uint32_t cd_offset = read_le32(zip + pos + 16);
+				if (cd_offset <= pos && cd_size <= pos - cd_offset)
+					return fnv_hash(fnv_offset_basis, zip + cd_offset, cd_size);
+				break;
+			}
+			if (pos == min_pos)
+				break;
+		}
+	}
+	return fnv_hash(fnv_offset_basis, zip, zip_length);
+}
+
+uint64_t ThemeCache::HashDir(const std::string& dir)
+{
+	std::vector<std::string> names;
+	DIR* d = opendir(dir.c_str());
+	if (!d)
+		return 0;
+	struct dirent* de;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_type == DT_REG)
+			names.push_back(de->d_name);
+	}
+	closedir(d);
+	std::sort(names.begin(), names.end());
+
+	uint64_t hash = fnv_offset_basis;
+	char buf[16384];
+	for (std::vector<std::string>::iterator it = names.begin(); it != names.end(); ++it) {
+		hash = fnv_hash(hash, it->c_str(), it->size() + 1);
+		int fd = open((dir + *it).c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		ssize_t len;
+		while ((len = read(fd, buf, sizeof(buf))) > 0)
+			hash = fnv_hash(hash, buf, len);
+		close(fd);
+	}
+	return hash;
+}
+
+void ThemeCache::Open(const std::string& package, const unsigned char* zip, size_t zip_length)
+{
+	Close();
+	mPath.clear();
+
+	std::string storage = DataManager::GetSettingsStoragePath();
+	if (storage.empty() || !PartitionManager.Is_Mounted_By_Path(storage)) {
+		LOGINFO("Settings storage is not mounted, not caching theme images.\n");
+		return;
+	}
+	mPath = storage + THEME_CACHE_DIR + TWFunc::Get_Filename(package) + ".cache";
+
+	mHash = zip ? HashZip(zip, zip_length) : HashDir(TWRES "images/");
+	// the pixels depend on the build and the screen, not just the theme
+	char build[128];
+	snprintf(build, sizeof(build), "%s:%s:%dx%d", TW_VERSION_STR, res_pixel_order(), gr_fb_width(), gr_fb_height());
+	mHash = fnv_hash(mHash, build, strlen(build));
+
+	int fd = open(mPath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		mMapLength = st.st_size;
+		mMap = mmap(NULL, mMapLength, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mMap == MAP_FAILED) {
+			mMap = NULL;
+			mMapLength = 0;
+		}
+	}
+	close(fd);
+
+	if (!mMap)
+		return;
+	if (!Validate()) {
+		LOGINFO("Theme image cache '%s' is stale.\n", mPath.c_str());
+		Close();
+		return;
+	}
+	LOGINFO("Using theme image cache '%s' with %zu images.\n", mPath.c_str(), mEntries.size());
+}
+
+bool ThemeCache::Validate()
+{
+	const unsigned char* base = (const unsigned char*) mMap;
+	if (mMapLength < sizeof(ThemeCacheHeader))
+		return false;
+	const ThemeCacheHeader* header = (const ThemeCacheHeader*) base;
+	if (header->magic != THEME_CACHE_MAGIC || header->version != THEME_CACHE_VERSION || header->hash != mHash)
+		return false;
+	if (header->count > (mMapLength - sizeof(ThemeCacheHeader)) / sizeof(Entry))
+		return false;
+
+	const Entry* entries = (const Entry*) (base + sizeof(ThemeCacheHeader));
+	for (uint32_t i = 0; i < header->count; i++) {
+		const Entry* e = &entries[i];
+		uint64_t data_length = (uint64_t) e->stride * e->height * 4;
+		if (e->key_offset > mMapLength || e->key_length > mMapLength - e->key_offset
+				|| e->data_offset % THEME_CACHE_ALIGNMENT || e->data_offset > mMapLength
+				|| data_length > mMapLength - e->data_offset || e->width > e->stride) {
+			mEntries.clear();
+			return false;
+		}
+		mEntries[std::string((const char*) base + e->key_offset, e->key_length)] = e;
+	}
+	return true;
+}
+
+gr_surface ThemeCache::Find(const std::string& key)
+{
+	if (mEntries.empty())
+		return NULL;
+
+	std::map<std::string, const Entry*>::iterator it = mEntries.find(key);
+	if (it == mEntries.end())
+		return NULL;
+
+	// only the header is allocated, res_free_surface leaves the pixels alone
+	const Entry* e = it->second;
+	GGLSurface* surface = (GGLSurface*) malloc(sizeof(GGLSurface));
+	if (!surface)
+		return NULL;
+	memset(surface, 0, sizeof(GGLSurface));
+	surface->version = sizeof(GGLSurface);
+	surface->width = e->width;
+	surface->height = e->height;
+	surface->stride = e->stride;
+	surface->format = e->format;
+	surface->data = (GGLubyte*) mMap + e->data_offset;
+	return surface;
+}
+
+void ThemeCache::Save(const std::vector<std::pair<std::string, gr_surface> >& loaded)
+{
+	if (mPath.empty())
+		return;
+
+	// drop duplicates and formats other than 32 bpp, the first surface for
+	// a key wins
+	std::vector<std::pair<std::string, GGLSurface> > images;
+	std::set<std::string> keys;
+	for (size_t i = 0; i < loaded.size(); i++) {
+		GGLSurface* s = (GGLSurface*) loaded[i].second;
+		if (s->format != GGL_PIXEL_FORMAT_RGBX_8888 && s->format != GGL_PIXEL_FORMAT_RGBA_8888 && s->format != GGL_PIXEL_FORMAT_BGRA_8888)
+			continue;
+		if (keys.insert(loaded[i].first).second)
+			images.push_back(std::make_pair(loaded[i].first, *s));
+	}
+	// keep what the current file has for images that were not used
+	for (std::map<std::string, const Entry*>::iterator it = mEntries.begin(); it != mEntries.end(); ++it) {
+		if (!keys.insert(it->first).second)
+			continue;
+		const Entry* e = it->second;
+		GGLSurface s;
+		memset(&s, 0, sizeof(s));
+		s.width = e->width;
+		s.height = e->height;
+		s.stride = e->stride;
+		s.format = e->format;
+		s.data = (GGLubyte*) mMap + e->data_offset;
+		images.push_back(std::make_pair(it->first, s));
+	}
+
+	ThemeCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = THEME_CACHE_MAGIC;
+	header.version = THEME_CACHE_VERSION;
+	header.hash = mHash;
+	header.count = images.size();
+
+	std::vector<Entry> entries(images.size());
+	std::string key_data;
+	uint64_t offset = sizeof(header) + entries.size() * sizeof(Entry);
+	for (size_t i = 0; i < images.size(); i++) {
+		entries[i].key_offset = offset + key_data.size();
+		entries[i].key_length = images[i].first.size();
+		key_data += images[i].first;
+	}
+	offset += key_data.size();
+	for (size_t i = 0; i < images.size(); i++) {
+		GGLSurface* s = &images[i].second;
+		offset = (offset + THEME_CACHE_ALIGNMENT - 1) & ~(uint64_t) (THEME_CACHE_ALIGNMENT - 1);
+		entries[i].data_offset = offset;
+		entries[i].width = s->width;
+		entries[i].height = s->height;
+		entries[i].stride = s->stride;
+		entries[i].format = s->format;
+		entries[i].reserved = 0;
+		offset += (uint64_t) s->stride * s->height * 4;
+	}
+	if (offset > UINT32_MAX) {
+		LOGINFO("Theme images are too large to cache.\n");
+		return;
+	}
+
+	if (!TWFunc::Recursive_Mkdir(TWFunc::Get_Path(mPath))) {
+		LOGINFO("Unable to create '%s'\n", TWFunc::Get_Path(mPath).c_str());
+		return;
+	}
+	std::string tmp = mPath + ".tmp";
+	FILE* fp = fopen(tmp.c_str(), "wb");
+	if (!fp) {
+		LOGINFO("Unable to write theme image cache '%s': %s\n", tmp.c_str(), strerror(errno));
+		return;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	if (ok && !entries.empty())
+		ok = fwrite(&entries[0], sizeof(Entry), entries.size(), fp) == entries.size();
+	if (ok && !key_data.empty())
+		ok = fwrite(key_data.data(), key_data.size(), 1, fp) == 1;
+	for (size_t i = 0; ok && i < images.size(); i++) {
+		static const char padding[THEME_CACHE_ALIGNMENT] = { 0 };
+		long pad = entries[i].data_offset - ftell(fp);
+		if (pad > 0)
+			ok = fwrite(padding, pad, 1, fp) == 1;
+		GGLSurface* s = &images[i].second;
+		size_t length = (size_t) s->stride * s->height * 4;
+		if (ok && length)
+			ok = fwrite(s->data, length, 1, fp) == 1;
+	}
+	if (fclose(fp) != 0)
+		ok = false;
+
+	// the surfaces mapped from the current file stay valid after the rename
+	if (!ok || rename(tmp.c_str(), mPath.c_str()) != 0) {
+		LOGINFO("Unable to write theme image cache '%s'\n", mPath.c_str());
+		unlink(tmp.c_str());
+		return;
+	}
+	LOGINFO("Saved %zu images to theme image cache '%s'\n", images.size(), mPath.c_str());
+}
@@ -0,0 +1,73 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// themecache.hpp - Decoded theme images kept on storage between boots
+
+#ifndef _THEMECACHE_HEADER
+#define _THEMECACHE_HEADER
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+extern "C" {
+#include "../minuitwrp/minui.h"
+}
+
+// Keeps the images of one theme decoded, scaled and in the framebuffer's
+// pixel format in a single file on settings storage. Later boots map that
+// file and hand out surfaces pointing straight into it, for as long as the
+// hash of the theme's sources matches.
+class ThemeCache
+{
+public:
+	ThemeCache();
+	~ThemeCache();
+
+	// Maps the cache of package. zip is the mapped theme zip, or NULL for
+	// the stock theme in TWRES.
+	void Open(const std::string& package, const unsigned char* zip, size_t zip_length);
+
+	// Identifies an image file at a given theme scale
+	static std::string GetKey(const std::string& file, bool retain_aspect, float scale_w, float scale_h);
+
+	// Returns a new surface for the image or NULL if it is not cached. The
+	// pixels belong to the cache, so the surface must not outlive it.
+	gr_surface Find(const std::string& key);
+
+	// Rewrites the cache file with images, plus the images of the current
+	// file that are not among them
+	void Save(const std::vector<std::pair<std::string, gr_surface> >& images);
+
+private:
+	struct Entry;
+
+	static uint64_t HashZip(const unsigned char* zip, size_t zip_length);
+	static uint64_t HashDir(const std::string& dir);
+	void Close();
+	bool Validate();
+
+	std::string mPath; // empty if caching is off
+	uint64_t mHash;
+	void* mMap;
+	size_t mMapLength;
+	std::map<std::string, const Entry*> mEntries; // in the mapped file
+};
+
+#endif  // _THEMECACHE_HEADER
@@ -90,13 +90,9 @@ public:
 			default_value = name.substr(pos + 1);
 		}
 #ifndef BUILD_TWRPTAR_MAIN
-		const ResourceManager* res = PageManager::GetResources();
-		if (res) {
-			if (default_value.empty())
-				return res->FindString(resname);
-			else
-				return res->FindString(resname, default_value);
-		}
+		std::string value;
+		if (PageManager::TranslateString(resname, default_value, &value))
+			return value;
 #endif
 		if (!default_value.empty()) {
 			return default_value;
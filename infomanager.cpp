@@ -20,6 +20,8 @@
 #include <map>
 #include <fstream>
 #include <sstream>
+#include <stdio.h>
+#include <unistd.h>
 
 #include "infomanager.hpp"
 #include "twcommon.h"
@@ -59,6 +61,14 @@ void InfoManager::Clear(void) {
 	mValues.clear();
 }
 
+size_t InfoManager::GetMemoryUsage(const map<string, string>& values) {
+	size_t bytes = 0;
+
+	for (map<string, string>::const_iterator it = values.begin(); it != values.end(); ++it)
+		bytes += sizeof(*it) + 4 * sizeof(void*) + it->first.capacity() + it->second.capacity();
+	return bytes;
+}
+
 int InfoManager::LoadValues(void) {
 	string str;
 
@@ -113,39 +123,50 @@ error:
 	return 0;
 }
 
-int InfoManager::SaveValues(void) {
+int InfoManager::SaveValues(bool mount /* = true */) {
 	if (File.empty())
 		return -1;
 
-	PartitionManager.Mount_By_Path(File, true);
+	if (mount)
+		PartitionManager.Mount_By_Path(File, true);
 	LOGINFO("InfoManager saving '%s'\n", File.c_str());
-	FILE* out = fopen(File.c_str(), "wb");
+
+	// Write a temporary file and rename it over the old one, so a power
+	// loss never leaves a truncated settings file behind
+	string tmpFile = File + ".tmp";
+	FILE* out = fopen(tmpFile.c_str(), "wb");
 	if (!out)
 		return -1;
 
+	bool ok = true;
 	if (file_version) {
-		fwrite(&file_version, 1, sizeof(int), out);
+		ok = fwrite(&file_version, 1, sizeof(int), out) == sizeof(int);
 	}
 
 	map<string, string>::iterator iter;
-	for (iter = mValues.begin(); iter != mValues.end(); ++iter) {
+	for (iter = mValues.begin(); ok && iter != mValues.end(); ++iter) {
 		unsigned short length = (unsigned short) iter->first.length() + 1;
-		fwrite(&length, 1, sizeof(unsigned short), out);
-		fwrite(iter->first.c_str(), 1, length, out);
+		ok = fwrite(&length, 1, sizeof(unsigned short), out) == sizeof(unsigned short)
+			&& fwrite(iter->first.c_str(), 1, length, out) == length;
 		length = (unsigned short) iter->second.length() + 1;
-		fwrite(&length, 1, sizeof(unsigned short), out);
-		fwrite(iter->second.c_str(), 1, length, out);
+		ok = ok && fwrite(&length, 1, sizeof(unsigned short), out) == sizeof(unsigned short)
+			&& fwrite(iter->second.c_str(), 1, length, out) == length;
+	}
+	ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0;
+	if (fclose(out) != 0)
+		ok = false;
+	if (!ok || rename(tmpFile.c_str(), File.c_str()) != 0) {
+		LOGERR("InfoManager failed to save '%s'\n", File.c_str());
+		unlink(tmpFile.c_str());
+		return -1;
 	}
-	fclose(out);
 	tw_set_default_metadata(File.c_str());
 	return 0;
 }
 
 int InfoManager::GetValue(const string& varName, string& value) {
-	string localStr = varName;
-
 	map<string, string>::iterator pos;
-	pos = mValues.find(localStr);
+	pos = mValues.find(varName);
 	if (pos == mValues.end())
 		return -1;
 
@@ -153,6 +174,11 @@ int InfoManager::GetValue(const string& varName, string& value) {
 	return 0;
 }
 
+bool InfoManager::HasValue(const string& varName, const string& value) const {
+	map<string, string>::const_iterator pos = mValues.find(varName);
+	return pos != mValues.end() && pos->second == value;
+}
+
 int InfoManager::GetValue(const string& varName, int& value) {
 	string data;
 
@@ -36,9 +36,12 @@ public:
 	void SetConst();
 	void Clear();
 	int LoadValues();
-	int SaveValues();
+	// With mount false, the file's storage has to be mounted already
+	int SaveValues(bool mount = true);
 
 	// Core get routines
+	bool Exists(const string& varName) const { return mValues.find(varName) != mValues.end(); }
+	bool HasValue(const string& varName, const string& value) const;
 	int GetValue(const string& varName, string& value);
 	int GetValue(const string& varName, int& value);
 	int GetValue(const string& varName, float& value);
@@ -53,6 +56,10 @@ public:
 	int SetValue(const string& varName, const float value);
 	int SetValue(const string& varName, const unsigned long long& value);
 
+	// Bytes of heap the values take, with an estimate for the map nodes
+	size_t GetMemoryUsage() const { return GetMemoryUsage(mValues); }
+	static size_t GetMemoryUsage(const map<string, string>& values);
+
 private:
 	string File;
 	map<string, string> mValues;
@@ -40,7 +40,14 @@
 #define INT32_MAX	(2147483647)
 #endif
 
+#ifdef HAVE_PROPERTY_AREA_SERIAL
+/* bumped by init whenever a property is added or changed */
+extern "C" unsigned int __system_property_area_serial();
+#endif
+
 static int property_area_inited = 0;
+static int property_area_filled = 0;
+static unsigned property_area_serial;
 
 typedef struct {
     void *data;
@@ -99,8 +106,6 @@ prop_area *__legacy_property_area__;
 
 static int init_property_area(void)
 {
-    prop_area *pa;
-
     if(pa_info_array)
         return -1;
 
@@ -111,13 +116,8 @@ static int init_property_area(void)
 
     pa_info_array = (prop_info*) (((char*) pa_workspace.data) + PA_INFO_START);
 
-    pa = (prop_area*)(pa_workspace.data);
-    memset(pa, 0, PA_SIZE);
-    pa->magic = PROP_AREA_MAGIC;
-    pa->version = PROP_AREA_VERSION;
-
     /* plug into the lib property services */
-    __legacy_property_area__ = pa;
+    __legacy_property_area__ = (prop_area*)(pa_workspace.data);
     property_area_inited = 1;
     return 0;
 }
@@ -205,12 +205,50 @@ static void copy_property_to_legacy(const char *key, const char *value, void *co
     legacy_property_set(key, value);
 }
 
+/* whether the properties may have changed since the area was filled */
+static int properties_changed(void)
+{
+#ifdef HAVE_PROPERTY_AREA_SERIAL
+    unsigned serial = __system_property_area_serial();
+
+    if(property_area_filled && serial == property_area_serial)
+        return 0;
+    /* taken before the copy, a change made meanwhile shows up next time */
+    property_area_serial = serial;
+#endif
+    return 1;
+}
+
+/* The area is only written here and stays read-only in between, the
+ * update-binaries of earlier installs that mapped it have exited by now.
+ */
+static int fill_property_area(void)
+{
+    prop_area *pa = __legacy_property_area__;
+    int ret;
+
+    if(mprotect(pa_workspace.data, pa_workspace.size, PROT_READ | PROT_WRITE) != 0)
+        return -1;
+
+    memset(pa, 0, PA_SIZE);
+    pa->magic = PROP_AREA_MAGIC;
+    pa->version = PROP_AREA_VERSION;
+    ret = property_list(copy_property_to_legacy, 0);
+
+    mprotect(pa_workspace.data, pa_workspace.size, PROT_READ);
+    property_area_filled = (ret == 0);
+    return ret;
+}
+
 int legacy_properties_init()
 {
-    if(init_property_area() != 0)
+    if(!property_area_inited && init_property_area() != 0)
         return -1;
 
-    if(property_list(copy_property_to_legacy, 0) != 0)
+    if(!properties_changed())
+        return 0;
+
+    if(fill_property_area() != 0)
         return -1;
 
     return 0;
@@ -20,6 +20,10 @@
 #include <stdbool.h>
 
 void legacy_get_property_workspace(int *fd, int *sz);
+/* Sets up the legacy property area on the first call and copies the
+ * properties into it again only when they changed since, so it can be
+ * called before every update-binary that wants legacy properties.
+ */
 int legacy_properties_init();
 
 #endif	/* _LEGACY_PROPERTY_H */
@@ -364,6 +364,7 @@ extern blkid_partition blkid_parttable_get_parent(blkid_parttable tab);
 extern int blkid_do_probe(blkid_probe pr);
 extern int blkid_do_safeprobe(blkid_probe pr);
 extern int blkid_do_fullprobe(blkid_probe pr);
+extern int blkid_do_fullprobe_hint(blkid_probe pr, const char *type);
 
 extern int blkid_probe_numof_values(blkid_probe pr);
 extern int blkid_probe_get_value(blkid_probe pr, int num, const char **name,
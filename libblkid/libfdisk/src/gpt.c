@@ -680,9 +680,7 @@ static ssize_t read_lba(struct fdisk_context *cxt, uint64_t lba,
 {
 	off_t offset = lba * cxt->sector_size;
 
-	if (lseek(cxt->dev_fd, offset, SEEK_SET) == (off_t) -1)
-		return -1;
-	return read(cxt->dev_fd, buffer, bytes) != bytes;
+	return pread(cxt->dev_fd, buffer, bytes, offset) != (ssize_t) bytes;
 }
 
 
@@ -706,9 +704,7 @@ static struct gpt_entry *gpt_read_entries(struct fdisk_context *cxt,
 	offset = le64_to_cpu(header->partition_entry_lba) *
 		       cxt->sector_size;
 
-	if (offset != lseek(cxt->dev_fd, offset, SEEK_SET))
-		goto fail;
-	if (sz != read(cxt->dev_fd, ret, sz))
+	if (sz != pread(cxt->dev_fd, ret, sz, offset))
 		goto fail;
 
 	return ret;
@@ -1619,13 +1615,9 @@ static int gpt_write_partitions(struct fdisk_context *cxt,
 	uint32_t totwrite = nparts * le32_to_cpu(header->sizeof_partition_entry);
 	ssize_t rc;
 
-	if (offset != lseek(cxt->dev_fd, offset, SEEK_SET))
-		goto fail;
-
-	rc = write(cxt->dev_fd, ents, totwrite);
+	rc = pwrite(cxt->dev_fd, ents, totwrite, offset);
 	if (rc > 0 && totwrite == (uint32_t) rc)
 		return 0;
-fail:
 	return -errno;
 }
 
@@ -1638,12 +1630,9 @@ static int gpt_write_header(struct fdisk_context *cxt,
 {
 	off_t offset = lba * cxt->sector_size;
 
-	if (offset != lseek(cxt->dev_fd, offset, SEEK_SET))
-		goto fail;
 	if (cxt->sector_size ==
-	    (size_t) write(cxt->dev_fd, header, cxt->sector_size))
+	    (size_t) pwrite(cxt->dev_fd, header, cxt->sector_size, offset))
 		return 0;
-fail:
 	return -errno;
 }
 
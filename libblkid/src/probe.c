@@ -132,6 +132,14 @@ static const struct blkid_chaindrv *chains_drvs[] = {
 static void blkid_probe_reset_vals(blkid_probe pr);
 static void blkid_probe_reset_buffer(blkid_probe pr);
 
+/*
+ * Reads within the head of the device are rounded out to aligned windows,
+ * so the magic strings of all the probers at small offsets come from a few
+ * large reads rather than one small read per prober.
+ */
+#define BLKID_PREFETCH_AREA	(4 * 1024 * 1024)
+#define BLKID_PREFETCH_WINDOW	(256 * 1024)
+
 /**
  * blkid_new_probe:
  *
@@ -568,41 +576,64 @@ unsigned char *blkid_probe_get_buffer(blkid_probe pr,
 	}
 	if (!bf) {
 		ssize_t ret;
+		blkid_loff_t rd_off = off, rd_len = len;
 
-		if (blkid_llseek(pr->fd, pr->off + off, SEEK_SET) < 0) {
-			errno = 0;
-			return NULL;
+		if (off + len <= BLKID_PREFETCH_AREA && off + len <= pr->size) {
+			blkid_loff_t end = (off + len + BLKID_PREFETCH_WINDOW - 1) &
+					~((blkid_loff_t) BLKID_PREFETCH_WINDOW - 1);
+
+			if (end > pr->size)
+				end = pr->size;
+			rd_off = off & ~((blkid_loff_t) BLKID_PREFETCH_WINDOW - 1);
+			rd_len = end - rd_off;
 		}
 
 		/* someone trying to overflow some buffers? */
-		if (len > ULONG_MAX - sizeof(struct blkid_bufinfo)) {
+		if (rd_len > ULONG_MAX - sizeof(struct blkid_bufinfo)) {
 			errno = ENOMEM;
 			return NULL;
 		}
 
 		/* allocate info and space for data by why call */
-		bf = calloc(1, sizeof(struct blkid_bufinfo) + len);
+		bf = calloc(1, sizeof(struct blkid_bufinfo) + rd_len);
 		if (!bf) {
 			errno = ENOMEM;
 			return NULL;
 		}
 
 		bf->data = ((unsigned char *) bf) + sizeof(struct blkid_bufinfo);
-		bf->len = len;
-		bf->off = off;
 		INIT_LIST_HEAD(&bf->bufs);
 
 		DBG(LOWPROBE, ul_debug("\tbuffer read: off=%jd len=%jd pr=%p",
-				off, len, pr));
-
-		ret = read(pr->fd, bf->data, len);
-		if (ret != (ssize_t) len) {
+				rd_off, rd_len, pr));
+
+		if (blkid_llseek(pr->fd, pr->off + rd_off, SEEK_SET) < 0)
+			ret = -1;
+		else
+			ret = read(pr->fd, bf->data, rd_len);
+		if (ret != (ssize_t) rd_len && rd_len != len) {
+			/* a bad sector elsewhere in the window, read just the
+			 * requested area */
+			DBG(LOWPROBE, ul_debug("\twindow read failed, read off=%jd len=%jd",
+					off, len));
+			rd_off = off;
+			rd_len = len;
+			if (blkid_llseek(pr->fd, pr->off + rd_off, SEEK_SET) < 0) {
+				free(bf);
+				errno = 0;
+				return NULL;
+			}
+			ret = read(pr->fd, bf->data, rd_len);
+		}
+		if (ret != (ssize_t) rd_len) {
 			DBG(LOWPROBE, ul_debug("\tbuffer read: return %zd error %m", ret));
 			free(bf);
 			if (ret >= 0)
 				errno = 0;
 			return NULL;
 		}
+		bf->len = rd_len;
+		bf->off = rd_off;
 		list_add_tail(&bf->bufs, &pr->buffers);
 	}
 
@@ -1251,6 +1282,41 @@ done:
 	return count ? 0 : 1;
 }
 
+/**
+ * blkid_do_fullprobe_hint:
+ * @pr: prober
+ * @type: expected superblock type (e.g. "ext4") or NULL
+ *
+ * Same as blkid_do_fullprobe(), but the superblocks chain first probes only
+ * for @type and falls back to all the enabled superblock types when @type
+ * is not found on the device. The buffers read by the first pass are
+ * reused by the fallback.
+ *
+ * Note that the superblocks filter is reset by this function.
+ *
+ * Returns: 0 on success, 1 if nothing is detected or -1 on case of error.
+ */
+int blkid_do_fullprobe_hint(blkid_probe pr, const char *type)
+{
+	char *names[] = { (char *) type, NULL };
+	int rc;
+
+	if (!pr)
+		return -1;
+	if (!type || !blkid_known_fstype(type) ||
+	    !pr->chains[BLKID_CHAIN_SUBLKS].enabled)
+		return blkid_do_fullprobe(pr);
+
+	if (blkid_probe_filter_superblocks_type(pr, BLKID_FLTR_ONLYIN, names) == 0) {
+		rc = blkid_do_fullprobe(pr);
+		blkid_probe_reset_superblocks_filter(pr);
+		if (rc < 0 || (rc == 0 && blkid_probe_has_value(pr, "TYPE")))
+			return rc;
+		DBG(LOWPROBE, ul_debug("hint %s not found, full probe", type));
+	}
+	return blkid_do_fullprobe(pr);
+}
+
 /* same sa blkid_probe_get_buffer() but works with 512-sectors */
 unsigned char *blkid_probe_get_sector(blkid_probe pr, unsigned int sector)
 {
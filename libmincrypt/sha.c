@@ -28,61 +28,74 @@
 // Optimized for minimal code size.
 
 #include "mincrypt/sha.h"
+#include "sha_blocks.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 
 #define rol(bits, value) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
-static void SHA1_Transform(SHA_CTX* ctx) {
-    uint32_t W[80];
-    uint32_t A, B, C, D, E;
-    uint8_t* p = ctx->buf;
-    int t;
-
-    for(t = 0; t < 16; ++t) {
-        uint32_t tmp =  *p++ << 24;
-        tmp |= *p++ << 16;
-        tmp |= *p++ << 8;
-        tmp |= *p++;
-        W[t] = tmp;
-    }
+static void SHA1_Transform(uint32_t* state, const uint8_t* p, size_t blocks) {
+    while (blocks--) {
+        uint32_t W[80];
+        uint32_t A, B, C, D, E;
+        int t;
+
+        for(t = 0; t < 16; ++t) {
+            uint32_t tmp =  *p++ << 24;
+            tmp |= *p++ << 16;
+            tmp |= *p++ << 8;
+            tmp |= *p++;
+            W[t] = tmp;
+        }
 
-    for(; t < 80; t++) {
-        W[t] = rol(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
-    }
+        for(; t < 80; t++) {
+            W[t] = rol(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
+        }
+
+        A = state[0];
+        B = state[1];
+        C = state[2];
+        D = state[3];
+        E = state[4];
+
+        for(t = 0; t < 80; t++) {
+            uint32_t tmp = rol(5,A) + E + W[t];
+
+            if (t < 20)
+                tmp += (D^(B&(C^D))) + 0x5A827999;
+            else if ( t < 40)
+                tmp += (B^C^D) + 0x6ED9EBA1;
+            else if ( t < 60)
+                tmp += ((B&C)|(D&(B|C))) + 0x8F1BBCDC;
+            else
+                tmp += (B^C^D) + 0xCA62C1D6;
+
+            E = D;
+            D = C;
+            C = rol(30,B);
+            B = A;
+            A = tmp;
+        }
 
-    A = ctx->state[0];
-    B = ctx->state[1];
-    C = ctx->state[2];
-    D = ctx->state[3];
-    E = ctx->state[4];
-
-    for(t = 0; t < 80; t++) {
-        uint32_t tmp = rol(5,A) + E + W[t];
-
-        if (t < 20)
-            tmp += (D^(B&(C^D))) + 0x5A827999;
-        else if ( t < 40)
-            tmp += (B^C^D) + 0x6ED9EBA1;
-        else if ( t < 60)
-            tmp += ((B&C)|(D&(B|C))) + 0x8F1BBCDC;
-        else
-            tmp += (B^C^D) + 0xCA62C1D6;
-
-        E = D;
-        D = C;
-        C = rol(30,B);
-        B = A;
-        A = tmp;
+        state[0] += A;
+        state[1] += B;
+        state[2] += C;
+        state[3] += D;
+        state[4] += E;
     }
+}
+
+// The ARMv8 SHA instructions are used when the CPU has them
+static sha_blocks_fn SHA1_Blocks = SHA1_Transform;
+static pthread_once_t SHA1_Blocks_once = PTHREAD_ONCE_INIT;
 
-    ctx->state[0] += A;
-    ctx->state[1] += B;
-    ctx->state[2] += C;
-    ctx->state[3] += D;
-    ctx->state[4] += E;
+static void SHA1_Pick_Blocks(void) {
+    sha_blocks_fn blocks = mincrypt_sha1_armv8();
+    if (blocks != NULL)
+        SHA1_Blocks = blocks;
 }
 
 static const HASH_VTAB SHA_VTAB = {
@@ -94,6 +107,7 @@ static const HASH_VTAB SHA_VTAB = {
 };
 
 void SHA_init(SHA_CTX* ctx) {
+    pthread_once(&SHA1_Blocks_once, SHA1_Pick_Blocks);
     ctx->f = &SHA_VTAB;
     ctx->state[0] = 0x67452301;
     ctx->state[1] = 0xEFCDAB89;
@@ -110,13 +124,22 @@ void SHA_update(SHA_CTX* ctx, const void* data, int len) {
 
     ctx->count += len;
 
-    while (len--) {
-        ctx->buf[i++] = *p++;
-        if (i == 64) {
-            SHA1_Transform(ctx);
-            i = 0;
-        }
+    // Fill up the buffered block, whole blocks are hashed straight from data
+    if (i > 0) {
+        int n = len < 64 - i ? len : 64 - i;
+        memcpy(ctx->buf + i, p, n);
+        if (i + n < 64)
+            return;
+        SHA1_Blocks(ctx->state, ctx->buf, 1);
+        p += n;
+        len -= n;
+    }
+    if (len >= 64) {
+        SHA1_Blocks(ctx->state, p, len / 64);
+        p += len & ~63;
+        len &= 63;
     }
+    memcpy(ctx->buf, p, len);
 }
 
 
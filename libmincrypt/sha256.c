@@ -28,7 +28,9 @@
 // Optimized for minimal code size.
 
 #include "mincrypt/sha256.h"
+#include "sha_blocks.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
@@ -54,61 +56,72 @@ static const uint32_t K[64] = {
     0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
     0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
 
-static void SHA256_Transform(SHA256_CTX* ctx) {
-    uint32_t W[64];
-    uint32_t A, B, C, D, E, F, G, H;
-    uint8_t* p = ctx->buf;
-    int t;
-
-    for(t = 0; t < 16; ++t) {
-        uint32_t tmp =  *p++ << 24;
-        tmp |= *p++ << 16;
-        tmp |= *p++ << 8;
-        tmp |= *p++;
-        W[t] = tmp;
-    }
+static void SHA256_Transform(uint32_t* state, const uint8_t* p, size_t blocks) {
+    while (blocks--) {
+        uint32_t W[64];
+        uint32_t A, B, C, D, E, F, G, H;
+        int t;
+
+        for(t = 0; t < 16; ++t) {
+            uint32_t tmp =  *p++ << 24;
+            tmp |= *p++ << 16;
+            tmp |= *p++ << 8;
+            tmp |= *p++;
+            W[t] = tmp;
+        }
 
-    for(; t < 64; t++) {
-        uint32_t s0 = ror(W[t-15], 7) ^ ror(W[t-15], 18) ^ shr(W[t-15], 3);
-        uint32_t s1 = ror(W[t-2], 17) ^ ror(W[t-2], 19) ^ shr(W[t-2], 10);
-        W[t] = W[t-16] + s0 + W[t-7] + s1;
-    }
+        for(; t < 64; t++) {
+            uint32_t s0 = ror(W[t-15], 7) ^ ror(W[t-15], 18) ^ shr(W[t-15], 3);
+            uint32_t s1 = ror(W[t-2], 17) ^ ror(W[t-2], 19) ^ shr(W[t-2], 10);
+            W[t] = W[t-16] + s0 + W[t-7] + s1;
+        }
+
+        A = state[0];
+        B = state[1];
+        C = state[2];
+        D = state[3];
+        E = state[4];
+        F = state[5];
+        G = state[6];
+        H = state[7];
+
+        for(t = 0; t < 64; t++) {
+            uint32_t s0 = ror(A, 2) ^ ror(A, 13) ^ ror(A, 22);
+            uint32_t maj = (A & B) ^ (A & C) ^ (B & C);
+            uint32_t t2 = s0 + maj;
+            uint32_t s1 = ror(E, 6) ^ ror(E, 11) ^ ror(E, 25);
+            uint32_t ch = (E & F) ^ ((~E) & G);
+            uint32_t t1 = H + s1 + ch + K[t] + W[t];
+
+            H = G;
+            G = F;
+            F = E;
+            E = D + t1;
+            D = C;
+            C = B;
+            B = A;
+            A = t1 + t2;
+        }
 
-    A = ctx->state[0];
-    B = ctx->state[1];
-    C = ctx->state[2];
-    D = ctx->state[3];
-    E = ctx->state[4];
-    F = ctx->state[5];
-    G = ctx->state[6];
-    H = ctx->state[7];
-
-    for(t = 0; t < 64; t++) {
-        uint32_t s0 = ror(A, 2) ^ ror(A, 13) ^ ror(A, 22);
-        uint32_t maj = (A & B) ^ (A & C) ^ (B & C);
-        uint32_t t2 = s0 + maj;
-        uint32_t s1 = ror(E, 6) ^ ror(E, 11) ^ ror(E, 25);
-        uint32_t ch = (E & F) ^ ((~E) & G);
-        uint32_t t1 = H + s1 + ch + K[t] + W[t];
-
-        H = G;
-        G = F;
-        F = E;
-        E = D + t1;
-        D = C;
-        C = B;
-        B = A;
-        A = t1 + t2;
+        state[0] += A;
+        state[1] += B;
+        state[2] += C;
+        state[3] += D;
+        state[4] += E;
+        state[5] += F;
+        state[6] += G;
+        state[7] += H;
     }
+}
+
+// The ARMv8 SHA instructions are used when the CPU has them
+static sha_blocks_fn SHA256_Blocks = SHA256_Transform;
+static pthread_once_t SHA256_Blocks_once = PTHREAD_ONCE_INIT;
 
-    ctx->state[0] += A;
-    ctx->state[1] += B;
-    ctx->state[2] += C;
-    ctx->state[3] += D;
-    ctx->state[4] += E;
-    ctx->state[5] += F;
-    ctx->state[6] += G;
-    ctx->state[7] += H;
+static void SHA256_Pick_Blocks(void) {
+    sha_blocks_fn blocks = mincrypt_sha256_armv8();
+    if (blocks != NULL)
+        SHA256_Blocks = blocks;
 }
 
 static const HASH_VTAB SHA256_VTAB = {
@@ -120,6 +133,7 @@ static const HASH_VTAB SHA256_VTAB = {
 };
 
 void SHA256_init(SHA256_CTX* ctx) {
+    pthread_once(&SHA256_Blocks_once, SHA256_Pick_Blocks);
     ctx->f = &SHA256_VTAB;
     ctx->state[0] = 0x6a09e667;
     ctx->state[1] = 0xbb67ae85;
@@ -139,13 +153,22 @@ void SHA256_update(SHA256_CTX* ctx, const void* data, int len) {
 
     ctx->count += len;
 
-    while (len--) {
-        ctx->buf[i++] = *p++;
-        if (i == 64) {
-            SHA256_Transform(ctx);
-            i = 0;
-        }
+    // Fill up the buffered block, whole blocks are hashed straight from data
+    if (i > 0) {
+        int n = len < 64 - i ? len : 64 - i;
+        memcpy(ctx->buf + i, p, n);
+        if (i + n < 64)
+            return;
+        SHA256_Blocks(ctx->state, ctx->buf, 1);
+        p += n;
+        len -= n;
+    }
+    if (len >= 64) {
+        SHA256_Blocks(ctx->state, p, len / 64);
+        p += len & ~63;
+        len &= 63;
     }
+    memcpy(ctx->buf, p, len);
 }
 
 
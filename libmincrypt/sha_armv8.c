@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2018 TeamWin
+ * This file is part of TWRP/TeamWin Recovery Project.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// SHA-1 and SHA-256 block functions using the ARMv8 cryptography extensions.
+// Each step of the loops below does four rounds with one quad of the message
+// schedule, which is extended in place four words ahead of its use.
+
+#include "sha_blocks.h"
+
+#if defined(__aarch64__) && defined(MINCRYPT_ARMV8_SHA)
+
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+
+static const uint32_t K1[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+static uint32x4_t load_be(const uint8_t* data) {
+    return vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data)));
+}
+
+static void sha1_blocks_armv8(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t e = state[4];
+
+    while (blocks--) {
+        uint32x4_t abcd_saved = abcd;
+        uint32_t e_saved = e;
+        uint32x4_t msg[4];
+        int i;
+
+        for (i = 0; i < 4; i++)
+            msg[i] = load_be(data + 16 * i);
+
+        for (i = 0; i < 20; i++) {
+            uint32x4_t wk = vaddq_u32(msg[i & 3], vdupq_n_u32(K1[i / 5]));
+            uint32_t e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+
+            if (i < 5)
+                abcd = vsha1cq_u32(abcd, e, wk);
+            else if (i < 10 || i >= 15)
+                abcd = vsha1pq_u32(abcd, e, wk);
+            else
+                abcd = vsha1mq_u32(abcd, e, wk);
+            e = e_next;
+
+            if (i < 16)
+                msg[i & 3] = vsha1su1q_u32(vsha1su0q_u32(msg[i & 3], msg[(i + 1) & 3],
+                                                         msg[(i + 2) & 3]), msg[(i + 3) & 3]);
+        }
+
+        abcd = vaddq_u32(abcd, abcd_saved);
+        e += e_saved;
+        data += 64;
+    }
+    vst1q_u32(state, abcd);
+    state[4] = e;
+}
+
+static void sha256_blocks_armv8(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32x4_t efgh = vld1q_u32(state + 4);
+
+    while (blocks--) {
+        uint32x4_t abcd_saved = abcd, efgh_saved = efgh;
+        uint32x4_t msg[4];
+        int i;
+
+        for (i = 0; i < 4; i++)
+            msg[i] = load_be(data + 16 * i);
+
+        for (i = 0; i < 16; i++) {
+            uint32x4_t wk = vaddq_u32(msg[i & 3], vld1q_u32(K256 + 4 * i));
+            uint32x4_t abcd_in = abcd;
+
+            abcd = vsha256hq_u32(abcd, efgh, wk);
+            efgh = vsha256h2q_u32(efgh, abcd_in, wk);
+
+            if (i < 12)
+                msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]),
+                                             msg[(i + 2) & 3], msg[(i + 3) & 3]);
+        }
+
+        abcd = vaddq_u32(abcd, abcd_saved);
+        efgh = vaddq_u32(efgh, efgh_saved);
+        data += 64;
+    }
+    vst1q_u32(state, abcd);
+    vst1q_u32(state + 4, efgh);
+}
+
+sha_blocks_fn mincrypt_sha1_armv8(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_SHA1) ? sha1_blocks_armv8 : NULL;
+}
+
+sha_blocks_fn mincrypt_sha256_armv8(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_SHA2) ? sha256_blocks_armv8 : NULL;
+}
+
+#else
+
+sha_blocks_fn mincrypt_sha1_armv8(void) {
+    return NULL;
+}
+
+sha_blocks_fn mincrypt_sha256_armv8(void) {
+    return NULL;
+}
+
+#endif
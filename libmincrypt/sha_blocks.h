@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2018 TeamWin
+ * This file is part of TWRP/TeamWin Recovery Project.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBMINCRYPT_SHA_BLOCKS_H_
+#define LIBMINCRYPT_SHA_BLOCKS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hashes 'blocks' 64 byte blocks of 'data' into 'state'.
+typedef void (*sha_blocks_fn)(uint32_t* state, const uint8_t* data, size_t blocks);
+
+// Block functions using the ARMv8 SHA instructions, NULL if the CPU does not
+// have them or they are not built in.
+sha_blocks_fn mincrypt_sha1_armv8(void);
+sha_blocks_fn mincrypt_sha256_armv8(void);
+
+#endif  // LIBMINCRYPT_SHA_BLOCKS_H_
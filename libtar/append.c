@@ -42,27 +42,69 @@
 #endif
 #include "android_utils.h"
 
-struct tar_dev
+static int tar_append_regfd(TAR *t, int filefd);
+
+
+#define TAR_XATTR_LIST_SIZE 1024
+
+/*
+** returns nonzero if name is in the list of xattr names from listxattr(),
+** or if the list is not known (len < 0)
+*/
+static int
+xattr_listed(const char *list, ssize_t len, const char *name)
 {
-	dev_t td_dev;
-	libtar_hash_t *td_h;
-};
-typedef struct tar_dev tar_dev_t;
+	const char *p;
+
+	if (len < 0)
+		return 1;
+	for (p = list; p < list + len; p += strlen(p) + 1)
+	{
+		if (strcmp(p, name) == 0)
+			return 1;
+	}
+	return 0;
+}
+
 
-struct tar_ino
+/* reads an xattr through fd if the file is open, by path otherwise */
+static ssize_t
+tar_getxattr(int fd, const char *realname, const char *name, void *value,
+	     size_t size)
 {
-	ino_t ti_ino;
-	char ti_name[MAXPATHLEN];
-};
-typedef struct tar_ino tar_ino_t;
+	if (fd >= 0)
+		return fgetxattr(fd, name, value, size);
+	return lgetxattr(realname, name, value, size);
+}
 
 
-/* free memory associated with a tar_dev_t */
-void
-tar_dev_free(tar_dev_t *tdp)
+/* returns the selinux context of a file in a malloc()ed string, or NULL */
+static char *
+tar_get_selinux_context(int fd, const char *realname)
 {
-	libtar_hash_free(tdp->td_h, free);
-	free(tdp);
+	char buf[256];
+	security_context_t selinux_context = NULL;
+	char *ret = NULL;
+	ssize_t len;
+
+	len = tar_getxattr(fd, realname, XATTR_NAME_SELINUX, buf,
+			   sizeof(buf) - 1);
+	if (len > 0)
+	{
+		buf[len] = '\0';
+		return strdup(buf);
+	}
+	if (len < 0 && errno == ERANGE)
+	{
+		/* unusually long context, let libselinux size it */
+		if ((fd >= 0 ? fgetfilecon(fd, &selinux_context)
+			     : lgetfilecon(realname, &selinux_context)) >= 0)
+		{
+			ret = strdup(selinux_context);
+			freecon(selinux_context);
+		}
+	}
+	return ret;
 }
 
 
@@ -72,10 +114,11 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 {
 	struct stat s;
 	int i;
-	libtar_hashptr_t hp;
-	tar_dev_t *td = NULL;
-	tar_ino_t *ti = NULL;
 	char path[MAXPATHLEN];
+	char xattrs[TAR_XATTR_LIST_SIZE];
+	ssize_t xattrs_len = 0;
+	int fd = -1;
+	int rv = -1;
 
 #ifdef DEBUG
 	printf("==> tar_append_file(TAR=0x%lx (\"%s\"), realname=\"%s\", "
@@ -91,6 +134,27 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 		return -1;
 	}
 
+	/*
+	** Regular files and directories are opened once and the same fd is
+	** used for their xattrs, encryption policy and contents. Anything
+	** else could block or have side effects when opened, so it is looked
+	** up by path. If the open fails, everything falls back to the path.
+	*/
+	if (S_ISREG(s.st_mode))
+		fd = open(realname, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+	else if (S_ISDIR(s.st_mode))
+		fd = open(realname, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+	/* one listxattr, then only the xattrs that exist are read */
+	if (t->options & (TAR_STORE_SELINUX | TAR_STORE_POSIX_CAP | TAR_STORE_ANDROID_USER_XATTR))
+	{
+		xattrs_len = (fd >= 0 ? flistxattr(fd, xattrs, sizeof(xattrs))
+				      : llistxattr(realname, xattrs, sizeof(xattrs)));
+		if (xattrs_len < 0 && errno != ERANGE)
+			xattrs_len = 0;
+		/* on ERANGE the list is too long and every xattr is probed */
+	}
+
 	/* set header block */
 #ifdef DEBUG
 	puts("tar_append_file(): setting header block...");
@@ -113,12 +177,13 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 			t->th_buf.selinux_context = NULL;
 		}
 
-		security_context_t selinux_context = NULL;
-		if (lgetfilecon(realname, &selinux_context) >= 0)
+		if (xattr_listed(xattrs, xattrs_len, XATTR_NAME_SELINUX))
+			t->th_buf.selinux_context = tar_get_selinux_context(fd, realname);
+		if (t->th_buf.selinux_context != NULL)
 		{
-			t->th_buf.selinux_context = strdup(selinux_context);
-			printf("  ==> set selinux context: %s\n", selinux_context);
-			freecon(selinux_context);
+#ifdef DEBUG
+			printf("  ==> set selinux context: %s\n", t->th_buf.selinux_context);
+#endif
 		}
 		else
 		{
@@ -140,22 +205,25 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 		t->th_buf.eep = (struct ext4_encryption_policy*)malloc(sizeof(struct ext4_encryption_policy));
 		if (!t->th_buf.eep) {
 			printf("malloc ext4_encryption_policy\n");
-			return -1;
+			goto out;
 		}
-		if (e4crypt_policy_get_struct(realname, t->th_buf.eep))
+		if (fd >= 0 ? e4crypt_policy_get_struct_fd(fd, t->th_buf.eep)
+			    : e4crypt_policy_get_struct(realname, t->th_buf.eep))
 		{
 			char tar_policy[EXT4_KEY_DESCRIPTOR_SIZE];
 			memset(tar_policy, 0, sizeof(tar_policy));
 			char policy_hex[EXT4_KEY_DESCRIPTOR_SIZE_HEX];
 			policy_to_hex(t->th_buf.eep->master_key_descriptor, policy_hex);
 			if (lookup_ref_key(t->th_buf.eep->master_key_descriptor, &tar_policy[0])) {
+#ifdef DEBUG
 				printf("found policy '%s' - '%s' - '%s'\n", realname, tar_policy, policy_hex);
+#endif
 				memcpy(t->th_buf.eep->master_key_descriptor, tar_policy, EXT4_KEY_DESCRIPTOR_SIZE);
 			} else {
 				printf("failed to lookup tar policy for '%s' - '%s'\n", realname, policy_hex);
 				free(t->th_buf.eep);
 				t->th_buf.eep = NULL;
-				return -1;
+				goto out;
 			}
 		}
 		else
@@ -176,10 +244,11 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 			t->th_buf.has_cap_data = 0;
 		}
 
-		if (getxattr(realname, XATTR_NAME_CAPS, &t->th_buf.cap_data, sizeof(struct vfs_cap_data)) >= 0)
+		if (xattr_listed(xattrs, xattrs_len, XATTR_NAME_CAPS) &&
+		    tar_getxattr(fd, realname, XATTR_NAME_CAPS, &t->th_buf.cap_data, sizeof(struct vfs_cap_data)) >= 0)
 		{
 			t->th_buf.has_cap_data = 1;
-#if 1 //def DEBUG
+#ifdef DEBUG
 			print_caps(&t->th_buf.cap_data);
 #endif
 		}
@@ -188,77 +257,51 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 	/* get android user.default xattr */
 	if (TH_ISDIR(t) && t->options & TAR_STORE_ANDROID_USER_XATTR)
 	{
-		if (getxattr(realname, "user.default", NULL, 0) >= 0)
+		/* only presence is stored, a known list answers without probing */
+		if (xattr_listed(xattrs, xattrs_len, "user.default") &&
+		    (xattrs_len >= 0 || tar_getxattr(fd, realname, "user.default", NULL, 0) >= 0))
 		{
 			t->th_buf.has_user_default = 1;
-#if 1 //def DEBUG
+#ifdef DEBUG
 			printf("storing xattr user.default\n");
 #endif
 		}
-		if (getxattr(realname, "user.inode_cache", NULL, 0) >= 0)
+		if (xattr_listed(xattrs, xattrs_len, "user.inode_cache") &&
+		    (xattrs_len >= 0 || tar_getxattr(fd, realname, "user.inode_cache", NULL, 0) >= 0))
 		{
 			t->th_buf.has_user_cache = 1;
-#if 1 //def DEBUG
+#ifdef DEBUG
 			printf("storing xattr user.inode_cache\n");
 #endif
 		}
-		if (getxattr(realname, "user.inode_code_cache", NULL, 0) >= 0)
+		if (xattr_listed(xattrs, xattrs_len, "user.inode_code_cache") &&
+		    (xattrs_len >= 0 || tar_getxattr(fd, realname, "user.inode_code_cache", NULL, 0) >= 0))
 		{
 			t->th_buf.has_user_code_cache = 1;
-#if 1 //def DEBUG
+#ifdef DEBUG
 			printf("storing xattr user.inode_code_cache\n");
 #endif
 		}
 	}
 
-	/* check if it's a hardlink */
-#ifdef DEBUG
-	puts("tar_append_file(): checking inode cache for hardlink...");
-#endif
-	libtar_hashptr_reset(&hp);
-	if (libtar_hash_getkey(t->h, &hp, &(s.st_dev),
-			       (libtar_matchfunc_t)dev_match) != 0)
-		td = (tar_dev_t *)libtar_hashptr_data(&hp);
-	else
-	{
-#ifdef DEBUG
-		printf("+++ adding hash for device (0x%lx, 0x%lx)...\n",
-		       major(s.st_dev), minor(s.st_dev));
-#endif
-		td = (tar_dev_t *)calloc(1, sizeof(tar_dev_t));
-		td->td_dev = s.st_dev;
-		td->td_h = libtar_hash_new(256, (libtar_hashfunc_t)ino_hash);
-		if (td->td_h == NULL)
-			return -1;
-		if (libtar_hash_add(t->h, td) == -1)
-			return -1;
-	}
-	libtar_hashptr_reset(&hp);
-	if (libtar_hash_getkey(td->td_h, &hp, &(s.st_ino),
-			       (libtar_matchfunc_t)ino_match) != 0)
-	{
-		ti = (tar_ino_t *)libtar_hashptr_data(&hp);
-#ifdef DEBUG
-		printf("    tar_append_file(): encoding hard link \"%s\" "
-		       "to \"%s\"...\n", realname, ti->ti_name);
-#endif
-		t->th_buf.typeflag = LNKTYPE;
-		th_set_link(t, ti->ti_name);
-	}
-	else
+	/* check if it's a hardlink, only files with other names can be */
+	if (!S_ISDIR(s.st_mode) && s.st_nlink > 1)
 	{
+		const char *linkname;
+
+		i = tar_links_find(t, s.st_dev, s.st_ino,
+				   savename ? savename : realname, &linkname);
+		if (i == -1)
+			goto out;
+		if (i == 1)
+		{
 #ifdef DEBUG
-		printf("+++ adding entry: device (0x%lx,0x%lx), inode %ld "
-		       "(\"%s\")...\n", major(s.st_dev), minor(s.st_dev),
-		       s.st_ino, realname);
+			printf("    tar_append_file(): encoding hard link \"%s\" "
+			       "to \"%s\"...\n", realname, linkname);
 #endif
-		ti = (tar_ino_t *)calloc(1, sizeof(tar_ino_t));
-		if (ti == NULL)
-			return -1;
-		ti->ti_ino = s.st_ino;
-		snprintf(ti->ti_name, sizeof(ti->ti_name), "%s",
-			 savename ? savename : realname);
-		libtar_hash_add(td->td_h, ti);
+			t->th_buf.typeflag = LNKTYPE;
+			th_set_link(t, linkname);
+		}
 	}
 
 	/* check if it's a symlink */
@@ -266,7 +309,7 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 	{
 		i = readlink(realname, path, sizeof(path));
 		if (i == -1)
-			return -1;
+			goto out;
 		if (i >= MAXPATHLEN)
 			i = MAXPATHLEN - 1;
 		path[i] = '\0';
@@ -290,17 +333,25 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 #ifdef DEBUG
 		printf("t->fd = %d\n", t->fd);
 #endif
-		return -1;
+		goto out;
 	}
 #ifdef DEBUG
 	puts("tar_append_file(): back from th_write()");
 #endif
 
 	/* if it's a regular file, write the contents as well */
-	if (TH_ISREG(t) && tar_append_regfile(t, realname) != 0)
-		return -1;
+	if (TH_ISREG(t))
+	{
+		if ((fd >= 0 ? tar_append_regfd(t, fd)
+			     : tar_append_regfile(t, realname)) != 0)
+			goto out;
+	}
 
-	return 0;
+	rv = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	return rv;
 }
 
 
@@ -331,11 +382,8 @@ tar_append_eof(TAR *t)
 int
 tar_append_regfile(TAR *t, const char *realname)
 {
-	char block[T_BLOCKSIZE];
 	int filefd;
-	int64_t i, size;
-	ssize_t j;
-	int rv = -1;
+	int rv;
 
 #if defined(O_BINARY)
 	filefd = open(realname, O_RDONLY|O_BINARY);
@@ -350,6 +398,21 @@ tar_append_regfile(TAR *t, const char *realname)
 		return -1;
 	}
 
+	rv = tar_append_regfd(t, filefd);
+	close(filefd);
+
+	return rv;
+}
+
+
+/* add the contents of an open file to a tarchive */
+static int
+tar_append_regfd(TAR *t, int filefd)
+{
+	char block[T_BLOCKSIZE];
+	int64_t i, size;
+	ssize_t j;
+
 	size = th_get_size(t);
 	for (i = size; i > T_BLOCKSIZE; i -= T_BLOCKSIZE)
 	{
@@ -358,28 +421,23 @@ tar_append_regfile(TAR *t, const char *realname)
 		{
 			if (j != -1)
 				errno = EINVAL;
-			goto fail;
+			return -1;
 		}
 		if (tar_block_write(t, &block) == -1)
-			goto fail;
+			return -1;
 	}
 
 	if (i > 0)
 	{
 		j = read(filefd, &block, i);
 		if (j == -1)
-			goto fail;
+			return -1;
 		memset(&(block[i]), 0, T_BLOCKSIZE - i);
 		if (tar_block_write(t, &block) == -1)
-			goto fail;
+			return -1;
 	}
 
-	/* success! */
-	rv = 0;
-fail:
-	close(filefd);
-
-	return rv;
+	return 0;
 }
 
 
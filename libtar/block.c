@@ -12,6 +12,7 @@
 
 #include <internal.h>
 #include <errno.h>
+#include <stdio.h>
 
 #ifdef STDC_HEADERS
 # include <string.h>
@@ -49,6 +50,108 @@
 #define ANDROID_USER_CODE_CACHE_TAG "ANDROID.user.inode_code_cache"
 #define ANDROID_USER_CODE_CACHE_TAG_LEN strlen(ANDROID_USER_CODE_CACHE_TAG)
 
+// Defines an index of the extended header dictionary in extended ('x'),
+// always the first record. See xdict.c
+#define XDICT_TAG "TWRP.xdict="
+#define XDICT_TAG_LEN strlen(XDICT_TAG)
+
+// Refers to an index of the extended header dictionary in the ustar padding
+// of entries that have no extended header of their own
+#define XDICT_REF "TWX"
+#define XDICT_REF_LEN 3
+
+/*
+** Archives are read through a large buffer instead of one read() per
+** block, which matters most for the pipes of the decompressing and
+** decrypting streams. Headers are copied out of it a block at a time and
+** file data is handed out in spans as large as what is buffered.
+*/
+#define TAR_READ_BUFFER (1024 * 1024)
+
+/* reads until at least want bytes are buffered or the archive ends */
+static int
+tar_read_fill(TAR *t, size_t want)
+{
+	ssize_t n;
+
+	if (t->rbuf == NULL)
+	{
+		t->rbuf = (char *)malloc(TAR_READ_BUFFER);
+		if (t->rbuf == NULL)
+			return -1;
+	}
+	if (t->rbuf_pos > 0)
+	{
+		memmove(t->rbuf, t->rbuf + t->rbuf_pos, t->rbuf_len - t->rbuf_pos);
+		t->rbuf_len -= t->rbuf_pos;
+		t->rbuf_pos = 0;
+	}
+	while (t->rbuf_len < want)
+	{
+		n = (*(t->type->readfunc))(t->fd, t->rbuf + t->rbuf_len,
+					   TAR_READ_BUFFER - t->rbuf_len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		t->rbuf_len += n;
+	}
+	return 0;
+}
+
+
+ssize_t
+tar_block_read(TAR *t, void *buf)
+{
+	size_t avail = t->rbuf_len - t->rbuf_pos;
+
+	if (avail < T_BLOCKSIZE)
+	{
+		if (tar_read_fill(t, T_BLOCKSIZE) == -1)
+			return -1;
+		avail = t->rbuf_len;
+		if (avail > T_BLOCKSIZE)
+			avail = T_BLOCKSIZE;
+	}
+	else
+		avail = T_BLOCKSIZE;
+
+	/* short only at the end of the archive */
+	memcpy(buf, t->rbuf + t->rbuf_pos, avail);
+	t->rbuf_pos += avail;
+	return avail;
+}
+
+
+ssize_t
+tar_read_span(TAR *t, char **span, size_t max)
+{
+	size_t avail = t->rbuf_len - t->rbuf_pos;
+
+	if (avail == 0)
+	{
+		if (tar_read_fill(t, T_BLOCKSIZE) == -1)
+			return -1;
+		avail = t->rbuf_len;
+	}
+	if (avail > max)
+		avail = max;
+	*span = t->rbuf + t->rbuf_pos;
+	t->rbuf_pos += avail;
+	return avail;
+}
+
+
+void
+tar_read_discard(TAR *t)
+{
+	t->rbuf_pos = 0;
+	t->rbuf_len = 0;
+}
+
+
 /* read a header block */
 /* FIXME: the return value of this function should match the return value
 	  of tar_block_read(), which is a macro which references a prototype
@@ -130,6 +233,7 @@ th_read(TAR *t)
 	int i;
 	size_t sz, j, blocks;
 	char *ptr;
+	int xdict_index, has_extended;
 
 #ifdef DEBUG
 	printf("==> th_read(t=0x%lx)\n", t);
@@ -267,8 +371,11 @@ th_read(TAR *t)
 	}
 
 	// Extended headers (selinux contexts, posix file capabilities, ext4 encryption policies)
+	xdict_index = -1;
+	has_extended = 0;
 	while(TH_ISEXTHEADER(t) || TH_ISPOLHEADER(t))
 	{
+		has_extended = 1;
 		sz = th_get_size(t);
 
 		if(sz >= T_BLOCKSIZE) // Not supported
@@ -292,8 +399,12 @@ th_read(TAR *t)
 			buf[T_BLOCKSIZE-1] = 0;
 
 			int len = strlen(buf);
+			// extended header dictionary definition
+			char *start = strstr(buf, XDICT_TAG);
+			if (start && start+XDICT_TAG_LEN < buf+len)
+				xdict_index = atoi(start + XDICT_TAG_LEN);
 			// posix capabilities
-			char *start = strstr(buf, CAPABILITIES_TAG);
+			start = strstr(buf, CAPABILITIES_TAG);
 			if (start && start+CAPABILITIES_TAG_LEN < buf+len)
 			{
 				start += CAPABILITIES_TAG_LEN;
@@ -397,6 +508,25 @@ th_read(TAR *t)
 		}
 	}
 
+	if (xdict_index >= 0)
+	{
+		if (tar_xdict_store(t, xdict_index) != 0)
+			return -1;
+	}
+	else if (!has_extended
+		 && memcmp(t->th_buf.padding, XDICT_REF, XDICT_REF_LEN) == 0)
+	{
+		char ref[sizeof(t->th_buf.padding) - XDICT_REF_LEN + 1];
+		memcpy(ref, t->th_buf.padding + XDICT_REF_LEN, sizeof(ref) - 1);
+		ref[sizeof(ref) - 1] = '\0';
+		xdict_index = strtol(ref, NULL, 8);
+		if (tar_xdict_apply(t, xdict_index) != 0)
+		{
+			fprintf(stderr, "th_read(): unknown extended header index %d\n", xdict_index);
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -446,6 +576,42 @@ th_write_extended(TAR *t, char* buf, uint64_t sz)
 	return 0;
 }
 
+/*
+** Looks up the records of an extended header in the dictionary. Returns 0
+** and sets a reference in the header if they are known. Otherwise returns
+** the size of the extended header to write, which defines a new index if
+** the dictionary and the block have room for it.
+*/
+static uint64_t
+th_write_xdict(TAR *t, char *buf, uint64_t sz)
+{
+	char record[32];
+	int index, added, len;
+
+	/* "NN TWRP.xdict=IIII\n" for up to 4 digits */
+	if (sz + XDICT_TAG_LEN + 8 >= T_BLOCKSIZE)
+		return sz;
+	index = tar_xdict_intern(t, buf, sz, &added);
+	if (index < 0)
+		return sz;
+
+	if (!added)
+	{
+		snprintf(t->th_buf.padding, sizeof(t->th_buf.padding), XDICT_REF"%o", index);
+#ifdef DEBUG
+		printf("th_write(): using extended header index %d\n", index);
+#endif
+		return 0;
+	}
+
+	/* the size counts its own digits, which stay at 2 below 100 */
+	len = snprintf(NULL, 0, "00 "XDICT_TAG"%d\n", index);
+	snprintf(record, sizeof(record), "%d "XDICT_TAG"%d\n", len, index);
+	memmove(buf + len, buf, sz);
+	memcpy(buf, record, len);
+	return sz + len;
+}
+
 /* write a header block */
 int
 th_write(TAR *t)
@@ -455,12 +621,16 @@ th_write(TAR *t)
 	uint64_t sz, sz2, total_sz = 0;
 	char *ptr;
 	char buf[T_BLOCKSIZE];
+	int split = 0;
 
 #ifdef DEBUG
 	printf("==> th_write(TAR=\"%s\")\n", t->pathname);
 	th_print(t);
 #endif
 
+	/* only th_write_xdict() uses the padding */
+	memset(t->th_buf.padding, 0, sizeof(t->th_buf.padding));
+
 	if ((t->options & TAR_GNU) && t->th_buf.gnu_longlink != NULL)
 	{
 #ifdef DEBUG
@@ -604,6 +774,7 @@ th_write(TAR *t)
 				return -1;
 			ptr = buf;
 			total_sz = sz;
+			split = 1;
 		}
 		else
 			total_sz += sz;
@@ -632,6 +803,7 @@ th_write(TAR *t)
 				return -1;
 			ptr = buf;
 			total_sz = sz;
+			split = 1;
 		}
 		else
 			total_sz += sz;
@@ -656,6 +828,7 @@ th_write(TAR *t)
 					return -1;
 				ptr = buf;
 				total_sz = sz;
+				split = 1;
 			}
 			else
 				total_sz += sz;
@@ -677,6 +850,7 @@ th_write(TAR *t)
 					return -1;
 				ptr = buf;
 				total_sz = sz;
+				split = 1;
 			}
 			else
 				total_sz += sz;
@@ -698,6 +872,7 @@ th_write(TAR *t)
 					return -1;
 				ptr = buf;
 				total_sz = sz;
+				split = 1;
 			}
 			else
 				total_sz += sz;
@@ -708,6 +883,8 @@ th_write(TAR *t)
 			ptr += sz;
 		}
 	}
+	if (total_sz > 0 && !split && (t->options & TAR_STORE_XDICT))
+		total_sz = th_write_xdict(t, buf, total_sz);
 	if (total_sz > 0 && th_write_extended(t, &buf[0], total_sz)) // write any outstanding tar extended header
 		return -1;
 
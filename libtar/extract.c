@@ -40,7 +40,8 @@
 #endif
 #include "android_utils.h"
 
-const unsigned long long progress_size = (unsigned long long)(T_BLOCKSIZE);
+/* files larger than one span of the read buffer get their space up front */
+#define TAR_PREALLOC_MIN	(1024 * 1024)
 
 static int
 tar_set_file_perms(TAR *t, const char *realname)
@@ -108,7 +109,7 @@ tar_set_file_perms(TAR *t, const char *realname)
 
 /* switchboard */
 int
-tar_extract_file(TAR *t, const char *realname, const char *prefix, const int *progress_fd)
+tar_extract_file(TAR *t, const char *realname, const char *prefix, struct tar_progress_slot *progress)
 {
 	int i;
 #ifdef LIBTAR_FILE_HASH
@@ -146,7 +147,7 @@ tar_extract_file(TAR *t, const char *realname, const char *prefix, const int *pr
 	else if (TH_ISFIFO(t))
 		i = tar_extract_fifo(t, realname);
 	else /* if (TH_ISREG(t)) */
-		i = tar_extract_regfile(t, realname, progress_fd);
+		i = tar_extract_regfile(t, realname, progress);
 
 	if (i != 0) {
 		fprintf(stderr, "tar_extract_file(): failed to extract %s !!!\n", realname);
@@ -202,12 +203,12 @@ tar_extract_file(TAR *t, const char *realname, const char *prefix, const int *pr
 
 /* extract regular file */
 int
-tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
+tar_extract_regfile(TAR *t, const char *realname, struct tar_progress_slot *progress)
 {
-	int64_t size, i;
-	ssize_t k;
+	int64_t size, i, left;
+	ssize_t k, j, w;
 	int fdout;
-	char buf[T_BLOCKSIZE];
+	char *span, *p;
 	const char *filename;
 	char *pn;
 
@@ -244,11 +245,20 @@ tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
 		return -1;
 	}
 
-	/* extract the file */
-	for (i = size; i > 0; i -= T_BLOCKSIZE)
+	/*
+	** Large files are written in many spans, allocating their blocks at
+	** once keeps them in few extents on ext4 and f2fs. Filesystems that
+	** can't do it just allocate as they are written.
+	*/
+	if (size > TAR_PREALLOC_MIN && (off_t)size == size)
+		fallocate(fdout, 0, 0, (off_t)size);
+
+	/* extract the file straight from the read buffer, padding included */
+	for (i = size, left = (size + T_BLOCKSIZE - 1) / T_BLOCKSIZE * T_BLOCKSIZE;
+	     left > 0; left -= k)
 	{
-		k = tar_block_read(t, buf);
-		if (k != T_BLOCKSIZE)
+		k = tar_read_span(t, &span, left);
+		if (k <= 0)
 		{
 			if (k != -1)
 				errno = EINVAL;
@@ -256,18 +266,22 @@ tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
 			return -1;
 		}
 
-		/* write block to output file */
-		if (write(fdout, buf,
-			  ((i > T_BLOCKSIZE) ? T_BLOCKSIZE : i)) == -1)
+		/* write the data, not the padding, to the output file */
+		for (w = (i < k ? i : k), p = span; w > 0; w -= j, p += j, i -= j)
 		{
-			close(fdout);
-			return -1;
-		}
-		else
-		{
-			if (*progress_fd != 0)
-				write(*progress_fd, &progress_size, sizeof(progress_size));
+			j = write(fdout, p, w);
+			if (j == -1 && errno == EINTR)
+			{
+				j = 0;
+				continue;
+			}
+			if (j <= 0)
+			{
+				close(fdout);
+				return -1;
+			}
 		}
+		tar_progress_add(progress, k, 0);
 	}
 
 	/* close output file */
@@ -288,7 +302,7 @@ tar_skip_regfile(TAR *t)
 {
 	int64_t size, i;
 	ssize_t k;
-	char buf[T_BLOCKSIZE];
+	char *span;
 
 	if (!TH_ISREG(t))
 	{
@@ -297,10 +311,11 @@ tar_skip_regfile(TAR *t)
 	}
 
 	size = th_get_size(t);
-	for (i = size; i > 0; i -= T_BLOCKSIZE)
+	for (i = (size + T_BLOCKSIZE - 1) / T_BLOCKSIZE * T_BLOCKSIZE; i > 0;
+	     i -= k)
 	{
-		k = tar_block_read(t, buf);
-		if (k != T_BLOCKSIZE)
+		k = tar_read_span(t, &span, i);
+		if (k <= 0)
 		{
 			if (k != -1)
 				errno = EINVAL;
@@ -478,6 +493,7 @@ tar_extract_dir(TAR *t, const char *realname)
 	mode_t mode;
 	const char *filename;
 	char *pn;
+	int existing = 0;
 
 	if (!TH_ISDIR(t))
 	{
@@ -510,7 +526,12 @@ tar_extract_dir(TAR *t, const char *realname)
 #if 1 //def DEBUG
 				puts("  *** using existing directory");
 #endif
-				return 1;
+				/*
+				 * The directory may have been created already by a
+				 * child extracted from another archive, so still
+				 * restore its xattrs below.
+				 */
+				existing = 1;
 			}
 		}
 		else
@@ -572,7 +593,7 @@ tar_extract_dir(TAR *t, const char *realname)
 	}
 #endif
 
-	return 0;
+	return existing;
 }
 
 
@@ -0,0 +1,416 @@
+/*
+**  extract_batch.c - extract an archive with a pool of writer threads
+**
+**  Restoring app data means hundreds of thousands of small files, and the
+**  time goes into the open/write/chown/chmod/utime/setfilecon round trips of
+**  each one, not into the data. The thread reading the archive hands small
+**  regular files with their metadata to writer threads, which apply it on
+**  the open fd. Directories are still created in archive order, but their
+**  owner, mode and mtime are set once everything below them was written.
+*/
+
+#include <internal.h>
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <utime.h>
+
+#include <sys/capability.h>
+#include <sys/xattr.h>
+#include <linux/xattr.h>
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include <selinux/selinux.h>
+
+#define BATCH_MAX_WRITERS	8
+#define BATCH_MAX_FILE		(1024 * 1024)		/* larger files are written by the reading thread */
+#define BATCH_MAX_QUEUED	(16 * 1024 * 1024)	/* file data waiting for a writer */
+
+struct batch_job
+{
+	struct batch_job *next;
+	char *filename;
+	char *data;
+	size_t size;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	time_t mtime;
+	char *selinux_context;
+	int has_cap_data;
+	struct vfs_cap_data cap_data;
+};
+
+struct batch_dir
+{
+	char *filename;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	time_t mtime;
+};
+
+struct batch_pool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* a job was queued or the pool stops */
+	pthread_cond_t room;		/* a job finished */
+	struct batch_job *head;
+	struct batch_job *tail;
+	size_t queued;			/* bytes of the queued and running jobs */
+	int pending;			/* queued and running jobs */
+	int stop;
+	int error;
+};
+
+
+static void
+batch_free_job(struct batch_job *job)
+{
+	free(job->filename);
+	free(job->data);
+	free(job->selinux_context);
+	free(job);
+}
+
+
+static int
+batch_write_job(struct batch_job *job)
+{
+	struct timespec times[2];
+	size_t done = 0;
+	ssize_t written;
+	int fd;
+
+	fd = open(job->filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd == -1)
+	{
+		fprintf(stderr, "tar_extract_all_batched(): unable to create %s: %s\n", job->filename, strerror(errno));
+		return -1;
+	}
+	while (done < job->size)
+	{
+		written = write(fd, job->data + done, job->size - done);
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written <= 0)
+		{
+			fprintf(stderr, "tar_extract_all_batched(): unable to write %s: %s\n", job->filename, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		done += written;
+	}
+
+	/* same order as tar_set_file_perms(), a chown drops setuid bits and capabilities */
+	if (geteuid() == 0 && fchown(fd, job->uid, job->gid) == -1)
+	{
+		fprintf(stderr, "tar_extract_file(): failed to set permissions on %s !!!\n", job->filename);
+		close(fd);
+		return -1;
+	}
+	times[0].tv_sec = times[1].tv_sec = job->mtime;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	if (futimens(fd, times) == -1 || fchmod(fd, job->mode) == -1)
+	{
+		fprintf(stderr, "tar_extract_file(): failed to set permissions on %s !!!\n", job->filename);
+		close(fd);
+		return -1;
+	}
+	if (job->selinux_context != NULL && fsetfilecon(fd, job->selinux_context) < 0)
+		fprintf(stderr, "tar_extract_file(): failed to restore SELinux context %s to file %s !!!\n", job->selinux_context, job->filename);
+	if (job->has_cap_data && fsetxattr(fd, XATTR_NAME_CAPS, &job->cap_data, sizeof(struct vfs_cap_data), 0) < 0)
+		fprintf(stderr, "tar_extract_file(): failed to restore posix capabilities to file %s !!!\n", job->filename);
+
+	if (close(fd) == -1)
+		return -1;
+	return 0;
+}
+
+
+static void *
+batch_writer(void *cookie)
+{
+	struct batch_pool *pool = (struct batch_pool *)cookie;
+	struct batch_job *job;
+	size_t size;
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;)
+	{
+		while (pool->head == NULL && !pool->stop)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->head == NULL)
+			break;
+		job = pool->head;
+		pool->head = job->next;
+		if (pool->head == NULL)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		/* after a failure the queue is only emptied */
+		ret = (pool->error ? 0 : batch_write_job(job));
+		size = job->size;
+		batch_free_job(job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (ret != 0)
+			pool->error = 1;
+		pool->queued -= size;
+		pool->pending--;
+		pthread_cond_broadcast(&pool->room);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+
+/* wait until at most max_jobs jobs and max_bytes bytes are left */
+static int
+batch_wait(struct batch_pool *pool, int max_jobs, size_t max_bytes)
+{
+	int error;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->error && (pool->pending > max_jobs || pool->queued > max_bytes))
+		pthread_cond_wait(&pool->room, &pool->lock);
+	error = pool->error;
+	pthread_mutex_unlock(&pool->lock);
+	return (error ? -1 : 0);
+}
+
+
+static int
+batch_queue_regfile(TAR *t, const char *realname, struct batch_pool *pool,
+		    struct tar_progress_slot *progress)
+{
+	struct batch_job *job;
+	int64_t size, i;
+	char *p;
+
+	size = th_get_size(t);
+	if (mkdirhier(dirname(realname)) == -1)
+		return -1;
+
+	printf("  ==> extracting: %s (file size %" PRId64 " bytes)\n",
+			realname, size);
+
+	/* keep memory bounded, the writers may be behind */
+	if (batch_wait(pool, INT_MAX, BATCH_MAX_QUEUED - (size_t)size) != 0)
+		return -1;
+
+	job = (struct batch_job *)calloc(1, sizeof(struct batch_job));
+	if (job == NULL)
+		return -1;
+	job->filename = strdup(realname);
+	/* whole blocks, tar_block_read() always fills one */
+	job->data = (char *)malloc(size > 0 ? (size + T_BLOCKSIZE - 1) / T_BLOCKSIZE * T_BLOCKSIZE : 1);
+	if (job->filename == NULL || job->data == NULL)
+	{
+		batch_free_job(job);
+		return -1;
+	}
+	for (i = size, p = job->data; i > 0; i -= T_BLOCKSIZE, p += T_BLOCKSIZE)
+	{
+		if (tar_block_read(t, p) != T_BLOCKSIZE)
+		{
+			batch_free_job(job);
+			return -1;
+		}
+		tar_progress_add(progress, T_BLOCKSIZE, 0);
+	}
+	job->size = size;
+	job->mode = th_get_mode(t);
+	job->uid = th_get_uid(t);
+	job->gid = th_get_gid(t);
+	job->mtime = th_get_mtime(t);
+	if ((t->options & TAR_STORE_SELINUX) && t->th_buf.selinux_context != NULL)
+	{
+		job->selinux_context = strdup(t->th_buf.selinux_context);
+		if (job->selinux_context == NULL)
+		{
+			batch_free_job(job);
+			return -1;
+		}
+	}
+	if ((t->options & TAR_STORE_POSIX_CAP) && t->th_buf.has_cap_data)
+	{
+		job->has_cap_data = 1;
+		memcpy(&job->cap_data, &t->th_buf.cap_data, sizeof(struct vfs_cap_data));
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail != NULL)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+	pool->tail = job;
+	pool->queued += job->size;
+	pool->pending++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+
+static int
+batch_extract_dir(TAR *t, const char *realname, struct batch_dir **dirs,
+		  size_t *dir_count, size_t *dir_alloc)
+{
+	struct batch_dir *dir;
+	int i;
+
+	i = tar_extract_dir(t, realname);
+	if (i != 0 && i != 1)
+		return -1;
+
+	/* labels and xattrs go on right away, new entries below may inherit them */
+	if ((t->options & TAR_STORE_SELINUX) && t->th_buf.selinux_context != NULL &&
+	    lsetfilecon(realname, t->th_buf.selinux_context) < 0)
+		fprintf(stderr, "tar_extract_file(): failed to restore SELinux context %s to file %s !!!\n", t->th_buf.selinux_context, realname);
+	if ((t->options & TAR_STORE_POSIX_CAP) && t->th_buf.has_cap_data &&
+	    setxattr(realname, XATTR_NAME_CAPS, &t->th_buf.cap_data, sizeof(struct vfs_cap_data), 0) < 0)
+		fprintf(stderr, "tar_extract_file(): failed to restore posix capabilities to file %s !!!\n", realname);
+
+	if (*dir_count == *dir_alloc)
+	{
+		size_t alloc = (*dir_alloc ? *dir_alloc * 2 : 256);
+
+		dir = (struct batch_dir *)realloc(*dirs, alloc * sizeof(struct batch_dir));
+		if (dir == NULL)
+			return -1;
+		*dirs = dir;
+		*dir_alloc = alloc;
+	}
+	dir = &(*dirs)[*dir_count];
+	dir->filename = strdup(realname);
+	if (dir->filename == NULL)
+		return -1;
+	dir->mode = th_get_mode(t);
+	dir->uid = th_get_uid(t);
+	dir->gid = th_get_gid(t);
+	dir->mtime = th_get_mtime(t);
+	(*dir_count)++;
+	return 0;
+}
+
+
+/* children come after their parent in the archive, so the list is walked backwards */
+static int
+batch_set_dir_perms(struct batch_dir *dirs, size_t dir_count)
+{
+	struct utimbuf ut;
+	size_t i;
+	int ret = 0;
+
+	for (i = dir_count; i > 0; i--)
+	{
+		struct batch_dir *dir = &dirs[i - 1];
+
+		ut.modtime = ut.actime = dir->mtime;
+		if ((geteuid() == 0 && lchown(dir->filename, dir->uid, dir->gid) == -1) ||
+		    utime(dir->filename, &ut) == -1 ||
+		    chmod(dir->filename, dir->mode) == -1)
+		{
+			fprintf(stderr, "tar_extract_file(): failed to set permissions on %s !!!\n", dir->filename);
+			ret = -1;
+			break;
+		}
+	}
+	return ret;
+}
+
+
+int
+tar_extract_all_batched(TAR *t, char *prefix, struct tar_progress_slot *progress, int writers)
+{
+	struct batch_pool pool;
+	struct batch_dir *dirs = NULL;
+	size_t dir_count = 0, dir_alloc = 0, d;
+	pthread_t threads[BATCH_MAX_WRITERS];
+	char *filename;
+	char buf[MAXPATHLEN];
+	int i, n, started = 0, ret = 0;
+
+	if (writers > BATCH_MAX_WRITERS)
+		writers = BATCH_MAX_WRITERS;
+	if (writers < 1 || (t->options & TAR_NOOVERWRITE))
+		return tar_extract_all(t, prefix, progress);
+
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.room, NULL);
+	for (n = 0; n < writers; n++)
+	{
+		if (pthread_create(&threads[n], NULL, batch_writer, &pool) != 0)
+			break;
+		started++;
+	}
+
+	while ((i = th_read(t)) == 0)
+	{
+		filename = th_get_pathname(t);
+		if (t->options & TAR_VERBOSE)
+			th_print_long_ls(t);
+		if (prefix != NULL)
+			snprintf(buf, sizeof(buf), "%s/%s", prefix, filename);
+		else
+			strlcpy(buf, filename, sizeof(buf));
+
+		if (TH_ISDIR(t))
+			ret = batch_extract_dir(t, buf, &dirs, &dir_count, &dir_alloc);
+		else if (TH_ISREG(t) && started > 0 && th_get_size(t) <= BATCH_MAX_FILE)
+			ret = batch_queue_regfile(t, buf, &pool, progress);
+		else
+		{
+			/* a hard link needs its target on disk */
+			if (TH_ISLNK(t))
+				ret = batch_wait(&pool, 0, 0);
+			if (ret == 0)
+				ret = tar_extract_file(t, buf, prefix, progress);
+		}
+		if (ret != 0)
+		{
+			fprintf(stderr, "tar_extract_file(): failed to extract %s !!!\n", buf);
+			break;
+		}
+		tar_progress_add(progress, 0, 1);
+	}
+	if (ret == 0 && i != 1)
+		ret = -1;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	if (ret != 0)
+		pool.error = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+	for (n = 0; n < started; n++)
+		pthread_join(threads[n], NULL);
+	if (pool.error)
+		ret = -1;
+
+	if (ret == 0)
+		ret = batch_set_dir_perms(dirs, dir_count);
+	for (d = 0; d < dir_count; d++)
+		free(dirs[d].filename);
+	free(dirs);
+	pthread_cond_destroy(&pool.room);
+	pthread_cond_destroy(&pool.work);
+	pthread_mutex_destroy(&pool.lock);
+	return ret;
+}
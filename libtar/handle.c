@@ -49,15 +49,16 @@ tar_init(TAR **t, const char *pathname, tartype_t *type,
 	(*t)->type = (type ? type : &default_type);
 	(*t)->oflags = oflags;
 
+	/* hardlinks are tracked in a map of their own, see hardlink.c */
 	if ((oflags & O_ACCMODE) == O_RDONLY)
+	{
 		(*t)->h = libtar_hash_new(256,
 					  (libtar_hashfunc_t)path_hashfunc);
-	else
-		(*t)->h = libtar_hash_new(16, (libtar_hashfunc_t)dev_hash);
-	if ((*t)->h == NULL)
-	{
-		free(*t);
-		return -1;
+		if ((*t)->h == NULL)
+		{
+			free(*t);
+			return -1;
+		}
 	}
 
 	return 0;
@@ -82,7 +83,8 @@ tar_open(TAR **t, const char *pathname, tartype_t *type,
 	(*t)->fd = (*((*t)->type->openfunc))(pathname, oflags, mode);
 	if ((*t)->fd == -1)
 	{
-		libtar_hash_free((*t)->h, NULL);
+		if ((*t)->h != NULL)
+			libtar_hash_free((*t)->h, NULL);
 		free(*t);
 		return -1;
 	}
@@ -119,11 +121,12 @@ tar_close(TAR *t)
 	i = (*(t->type->closefunc))(t->fd);
 
 	if (t->h != NULL)
-		libtar_hash_free(t->h, ((t->oflags & O_ACCMODE) == O_RDONLY
-					? free
-					: (libtar_freefunc_t)tar_dev_free));
+		libtar_hash_free(t->h, free);
 	if (t->th_pathname != NULL)
 		free(t->th_pathname);
+	tar_xdict_free(t);
+	tar_links_free(t);
+	free(t->rbuf);
 	free(t);
 
 	return i;
@@ -0,0 +1,166 @@
+/*
+**  hardlink.c - map of the inodes already written to an archive
+**
+**  A file with more than one link is archived once, later names of the same
+**  (device, inode) are written as hardlinks to the first name. The map used
+**  to be a hash of devices holding a hash of inodes, with a list node and a
+**  MAXPATHLEN name buffer for every file of the archive. It is now one open
+**  addressing table that only holds the files that can have other names,
+**  with the names in a single string arena.
+*/
+
+#include <internal.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define LINKS_MIN_SLOTS		64
+#define LINKS_MIN_ARENA		4096
+
+struct link_slot
+{
+	uint64_t dev;
+	uint64_t ino;
+	size_t name;			/* arena offset + 1, 0 if free */
+};
+
+struct tar_links
+{
+	struct link_slot *slots;
+	size_t mask;
+	size_t count;
+	char *arena;
+	size_t arena_len;
+	size_t arena_size;
+};
+
+
+static size_t
+links_hash(uint64_t dev, uint64_t ino)
+{
+	uint64_t h = (ino ^ (dev << 32) ^ (dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+
+	return (size_t)(h ^ (h >> 29));
+}
+
+
+static struct link_slot *
+links_slot(struct link_slot *slots, size_t mask, uint64_t dev, uint64_t ino)
+{
+	size_t i;
+
+	for (i = links_hash(dev, ino) & mask; slots[i].name;
+	     i = (i + 1) & mask)
+	{
+		if (slots[i].ino == ino && slots[i].dev == dev)
+			break;
+	}
+	return &slots[i];
+}
+
+
+/* resizes the table to hold at least count inodes at up to 50% load */
+static int
+links_grow(struct tar_links *l, size_t count)
+{
+	struct link_slot *slots, *s;
+	size_t size, i;
+
+	for (size = LINKS_MIN_SLOTS; size < count * 2; size *= 2)
+		;
+	if (l->slots != NULL && size <= l->mask + 1)
+		return 0;
+
+	slots = (struct link_slot *)calloc(size, sizeof(struct link_slot));
+	if (slots == NULL)
+		return -1;
+	if (l->slots != NULL)
+	{
+		for (i = 0; i <= l->mask; i++)
+		{
+			if (!l->slots[i].name)
+				continue;
+			s = links_slot(slots, size - 1, l->slots[i].dev,
+				       l->slots[i].ino);
+			*s = l->slots[i];
+		}
+		free(l->slots);
+	}
+	l->slots = slots;
+	l->mask = size - 1;
+	return 0;
+}
+
+
+static struct tar_links *
+links_get(TAR *t)
+{
+	if (t->links == NULL)
+		t->links = (struct tar_links *)calloc(1, sizeof(struct tar_links));
+	return t->links;
+}
+
+
+int
+tar_links_reserve(TAR *t, size_t count)
+{
+	struct tar_links *l = links_get(t);
+
+	if (l == NULL)
+		return -1;
+	return links_grow(l, count);
+}
+
+
+int
+tar_links_find(TAR *t, dev_t dev, ino_t ino, const char *savename,
+	       const char **linkname)
+{
+	struct tar_links *l = links_get(t);
+	struct link_slot *s;
+	size_t len, size;
+	char *arena;
+
+	if (l == NULL || links_grow(l, l->count + 1) == -1)
+		return -1;
+
+	s = links_slot(l->slots, l->mask, dev, ino);
+	if (s->name)
+	{
+		*linkname = l->arena + s->name - 1;
+		return 1;
+	}
+
+	len = strlen(savename) + 1;
+	if (l->arena_len + len > l->arena_size)
+	{
+		for (size = l->arena_size ? l->arena_size : LINKS_MIN_ARENA;
+		     size < l->arena_len + len; size *= 2)
+			;
+		arena = (char *)realloc(l->arena, size);
+		if (arena == NULL)
+			return -1;
+		l->arena = arena;
+		l->arena_size = size;
+	}
+	memcpy(l->arena + l->arena_len, savename, len);
+	s->dev = dev;
+	s->ino = ino;
+	s->name = l->arena_len + 1;
+	l->arena_len += len;
+	l->count++;
+	return 0;
+}
+
+
+void
+tar_links_free(TAR *t)
+{
+	if (t->links == NULL)
+		return;
+	free(t->links->slots);
+	free(t->links->arena);
+	free(t->links);
+	t->links = NULL;
+}
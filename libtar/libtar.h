@@ -19,6 +19,7 @@
 #include "tar.h"
 
 #include "libtar_listhash.h"
+#include "tar_progress.h"
 
 #ifdef HAVE_EXT4_CRYPT
 # include "ext4crypt_tar.h"
@@ -107,6 +108,17 @@ typedef struct
 
 	/* introduced in libtar 1.2.21 */
 	char *th_pathname;
+
+	/* extended header dictionary, see xdict.c */
+	struct tar_xdict *xdict;
+
+	/* inodes with more than one link written so far, see hardlink.c */
+	struct tar_links *links;
+
+	/* read buffer, see tar_block_read() */
+	char *rbuf;
+	size_t rbuf_pos;
+	size_t rbuf_len;
 }
 TAR;
 
@@ -123,6 +135,7 @@ TAR;
 #define TAR_STORE_EXT4_POL	512	/* store ext4 crypto policy */
 #define TAR_STORE_POSIX_CAP	1024	/* store posix file capabilities */
 #define TAR_STORE_ANDROID_USER_XATTR	2048	/* store android user.* xattr */
+#define TAR_STORE_XDICT		4096	/* share repeated extended headers */
 
 /* this is obsolete - it's here for backwards-compatibility only */
 #define TAR_IGNORE_MAGIC	0
@@ -147,12 +160,6 @@ int tar_close(TAR *t);
 
 /***** append.c ************************************************************/
 
-/* forward declaration to appease the compiler */
-struct tar_dev;
-
-/* cleanup function */
-void tar_dev_free(struct tar_dev *tdp);
-
 /* Appends a file to the tar archive.
  * Arguments:
  *    t        = TAR handle to append to
@@ -183,9 +190,16 @@ int tar_append_buffer(TAR *t, void *buf, size_t len);
 
 /***** block.c *************************************************************/
 
-/* macros for reading/writing tarchive blocks */
-#define tar_block_read(t, buf) \
-	(*((t)->type->readfunc))((t)->fd, (char *)(buf), T_BLOCKSIZE)
+/* reads a tarchive block through the read buffer */
+ssize_t tar_block_read(TAR *t, void *buf);
+
+/* returns up to max bytes of the archive in place in *span, 0 at the end */
+ssize_t tar_read_span(TAR *t, char **span, size_t max);
+
+/* drops buffered data, for callers that move the read position of t->fd */
+void tar_read_discard(TAR *t);
+
+/* macro for writing tarchive blocks */
 #define tar_block_write(t, buf) \
 	(*((t)->type->writefunc))((t)->fd, (char *)(buf), T_BLOCKSIZE)
 
@@ -194,6 +208,34 @@ int th_read(TAR *t);
 int th_write(TAR *t);
 
 
+/***** xdict.c *************************************************************/
+
+/* returns the dictionary index of a set of extended header records, *added
+   is set if it is new, -1 if the dictionary is full */
+int tar_xdict_intern(TAR *t, const char *records, size_t len, int *added);
+
+/* keeps the extended header metadata th_read() parsed for an index */
+int tar_xdict_store(TAR *t, int index);
+
+/* sets the extended header metadata of an index in th_buf */
+int tar_xdict_apply(TAR *t, int index);
+
+void tar_xdict_free(TAR *t);
+
+
+/***** hardlink.c **********************************************************/
+
+/* makes room for count inodes with more than one link */
+int tar_links_reserve(TAR *t, size_t count);
+
+/* returns 1 and sets *linkname if the inode was already written, otherwise
+   remembers it under savename and returns 0, -1 on error */
+int tar_links_find(TAR *t, dev_t dev, ino_t ino, const char *savename,
+		   const char **linkname);
+
+void tar_links_free(TAR *t);
+
+
 /***** decode.c ************************************************************/
 
 /* determine file type */
@@ -261,7 +303,7 @@ void th_finish(TAR *t);
 /***** extract.c ***********************************************************/
 
 /* sequentially extract next file from t */
-int tar_extract_file(TAR *t, const char *realname, const char *prefix, const int *progress_fd);
+int tar_extract_file(TAR *t, const char *realname, const char *prefix, struct tar_progress_slot *progress);
 
 /* extract different file types */
 int tar_extract_dir(TAR *t, const char *realname);
@@ -272,7 +314,7 @@ int tar_extract_blockdev(TAR *t, const char *realname);
 int tar_extract_fifo(TAR *t, const char *realname);
 
 /* for regfiles, we need to extract the content blocks as well */
-int tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd);
+int tar_extract_regfile(TAR *t, const char *realname, struct tar_progress_slot *progress);
 int tar_skip_regfile(TAR *t);
 
 /* extract regfile to buffer */
@@ -336,7 +378,13 @@ void print_caps(struct vfs_cap_data *cap_data);
 
 /* extract groups of files */
 int tar_extract_glob(TAR *t, char *globname, char *prefix);
-int tar_extract_all(TAR *t, char *prefix, const int *progress_fd);
+int tar_extract_all(TAR *t, char *prefix, struct tar_progress_slot *progress);
+
+
+/***** extract_batch.c ****************************************************/
+
+/* extract everything, small files are written by a pool of writer threads */
+int tar_extract_all_batched(TAR *t, char *prefix, struct tar_progress_slot *progress, int writers);
 
 /* add a whole tree of files */
 int tar_append_tree(TAR *t, char *realdir, char *savedir);
@@ -0,0 +1,58 @@
+/*
+**  tar_progress.h - progress counters shared between a twrpTar fork
+**  and the recovery process
+**
+**  The block is mapped MAP_SHARED before fork(). Every worker adds to its
+**  own cache line with relaxed atomics, the parent polls the sum at its
+**  display rate, so reporting progress never costs a syscall.
+*/
+
+#ifndef LIBTAR_TAR_PROGRESS_H
+#define LIBTAR_TAR_PROGRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TAR_PROGRESS_SLOTS	16
+
+struct tar_progress_slot
+{
+	uint64_t bytes;
+	uint64_t files;
+	char pad[64 - 2 * sizeof(uint64_t)];
+};
+
+struct tar_progress
+{
+	uint64_t file_count;			/* files the backup will add */
+	uint64_t total_size;			/* bytes the backup will add */
+	uint32_t ready;				/* file_count and total_size are set */
+	struct tar_progress_slot slot[TAR_PROGRESS_SLOTS] __attribute__((aligned(64)));
+};
+
+static inline void
+tar_progress_add(struct tar_progress_slot *slot, uint64_t bytes, uint64_t files)
+{
+	if (slot == NULL)
+		return;
+	if (bytes)
+		__atomic_fetch_add(&slot->bytes, bytes, __ATOMIC_RELAXED);
+	if (files)
+		__atomic_fetch_add(&slot->files, files, __ATOMIC_RELAXED);
+}
+
+static inline void
+tar_progress_sum(struct tar_progress *progress, uint64_t *bytes, uint64_t *files)
+{
+	int i;
+
+	*bytes = 0;
+	*files = 0;
+	for (i = 0; i < TAR_PROGRESS_SLOTS; i++)
+	{
+		*bytes += __atomic_load_n(&progress->slot[i].bytes, __ATOMIC_RELAXED);
+		*files += __atomic_load_n(&progress->slot[i].files, __ATOMIC_RELAXED);
+	}
+}
+
+#endif /* ! LIBTAR_TAR_PROGRESS_H */
@@ -0,0 +1,222 @@
+/*
+**  xdict.c - dictionary of the extended headers in an archive
+**
+**  Most files of a partition share one of a few dozen selinux contexts and
+**  otherwise carry the same xattrs, yet each of them used to get its own
+**  extended header, two blocks that take up more space than a small file's
+**  data. The first entry with a given set of extended header records still
+**  gets a normal extended header, which also defines a dictionary index with
+**  a TWRP.xdict record. Later entries with the same records only refer to
+**  that index in the otherwise unused padding of their ustar header, and
+**  the reader reuses what it parsed for the index instead of parsing and
+**  copying the records again. A later definition of an index replaces the
+**  earlier one, so appending to an archive starts over at index 0.
+*/
+
+#include <internal.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_EXT4_CRYPT
+# include "ext4crypt_tar.h"
+#endif
+
+#define XDICT_MAX	4096		/* indexes per archive */
+#define XDICT_SLOTS	(XDICT_MAX * 2)	/* hash slots for writing, a power of 2 */
+
+struct xdict_entry
+{
+	/* writing: the extended header records */
+	char *records;
+	size_t len;
+	uint32_t hash;
+
+	/* reading: what th_read() parsed from them */
+	int defined;
+	char *selinux_context;
+	int has_cap_data;
+	struct vfs_cap_data cap_data;
+	int has_user_default;
+	int has_user_cache;
+	int has_user_code_cache;
+#ifdef HAVE_EXT4_CRYPT
+	int has_eep;
+	struct ext4_encryption_policy eep;
+#endif
+};
+
+struct tar_xdict
+{
+	struct xdict_entry *entries;
+	int count;
+	int *slots;			/* writing: entry index + 1, 0 if free */
+};
+
+
+/* FNV-1a */
+static uint32_t
+xdict_hash(const char *data, size_t len)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+static struct tar_xdict *
+xdict_get(TAR *t)
+{
+	if (t->xdict == NULL)
+	{
+		t->xdict = (struct tar_xdict *)calloc(1, sizeof(struct tar_xdict));
+		if (t->xdict == NULL)
+			return NULL;
+		t->xdict->entries = (struct xdict_entry *)calloc(XDICT_MAX, sizeof(struct xdict_entry));
+		if (t->xdict->entries == NULL)
+		{
+			free(t->xdict);
+			t->xdict = NULL;
+		}
+	}
+	return t->xdict;
+}
+
+
+int
+tar_xdict_intern(TAR *t, const char *records, size_t len, int *added)
+{
+	struct tar_xdict *d = xdict_get(t);
+	struct xdict_entry *e;
+	uint32_t hash, slot;
+
+	*added = 0;
+	if (d == NULL)
+		return -1;
+	if (d->slots == NULL)
+	{
+		d->slots = (int *)calloc(XDICT_SLOTS, sizeof(int));
+		if (d->slots == NULL)
+			return -1;
+	}
+
+	hash = xdict_hash(records, len);
+	for (slot = hash & (XDICT_SLOTS - 1); d->slots[slot];
+	     slot = (slot + 1) & (XDICT_SLOTS - 1))
+	{
+		e = &d->entries[d->slots[slot] - 1];
+		if (e->hash == hash && e->len == len
+		    && memcmp(e->records, records, len) == 0)
+			return d->slots[slot] - 1;
+	}
+
+	if (d->count >= XDICT_MAX)
+		return -1;
+	e = &d->entries[d->count];
+	e->records = (char *)malloc(len);
+	if (e->records == NULL)
+		return -1;
+	memcpy(e->records, records, len);
+	e->len = len;
+	e->hash = hash;
+	d->slots[slot] = ++d->count;
+	*added = 1;
+	return d->count - 1;
+}
+
+
+int
+tar_xdict_store(TAR *t, int index)
+{
+	struct tar_xdict *d;
+	struct xdict_entry *e;
+
+	if (index < 0 || index >= XDICT_MAX || (d = xdict_get(t)) == NULL)
+		return -1;
+
+	e = &d->entries[index];
+	free(e->selinux_context);
+	e->selinux_context = NULL;
+	if (t->th_buf.selinux_context != NULL)
+	{
+		e->selinux_context = strdup(t->th_buf.selinux_context);
+		if (e->selinux_context == NULL)
+			return -1;
+	}
+	e->has_cap_data = t->th_buf.has_cap_data;
+	memcpy(&e->cap_data, &t->th_buf.cap_data, sizeof(struct vfs_cap_data));
+	e->has_user_default = t->th_buf.has_user_default;
+	e->has_user_cache = t->th_buf.has_user_cache;
+	e->has_user_code_cache = t->th_buf.has_user_code_cache;
+#ifdef HAVE_EXT4_CRYPT
+	e->has_eep = (t->th_buf.eep != NULL);
+	if (e->has_eep)
+		memcpy(&e->eep, t->th_buf.eep, sizeof(struct ext4_encryption_policy));
+#endif
+	e->defined = 1;
+	return 0;
+}
+
+
+int
+tar_xdict_apply(TAR *t, int index)
+{
+	struct xdict_entry *e;
+
+	if (index < 0 || index >= XDICT_MAX || t->xdict == NULL
+	    || !t->xdict->entries[index].defined)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	e = &t->xdict->entries[index];
+	if (e->selinux_context != NULL)
+	{
+		t->th_buf.selinux_context = strdup(e->selinux_context);
+		if (t->th_buf.selinux_context == NULL)
+			return -1;
+	}
+	t->th_buf.has_cap_data = e->has_cap_data;
+	memcpy(&t->th_buf.cap_data, &e->cap_data, sizeof(struct vfs_cap_data));
+	t->th_buf.has_user_default = e->has_user_default;
+	t->th_buf.has_user_cache = e->has_user_cache;
+	t->th_buf.has_user_code_cache = e->has_user_code_cache;
+#ifdef HAVE_EXT4_CRYPT
+	if (e->has_eep)
+	{
+		t->th_buf.eep = (struct ext4_encryption_policy *)malloc(sizeof(struct ext4_encryption_policy));
+		if (t->th_buf.eep == NULL)
+			return -1;
+		memcpy(t->th_buf.eep, &e->eep, sizeof(struct ext4_encryption_policy));
+	}
+#endif
+	return 0;
+}
+
+
+void
+tar_xdict_free(TAR *t)
+{
+	int i;
+
+	if (t->xdict == NULL)
+		return;
+	for (i = 0; i < XDICT_MAX; i++)
+	{
+		free(t->xdict->entries[i].records);
+		free(t->xdict->entries[i].selinux_context);
+	}
+	free(t->xdict->entries);
+	free(t->xdict->slots);
+	free(t->xdict);
+	t->xdict = NULL;
+}
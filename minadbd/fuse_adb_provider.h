@@ -27,6 +27,8 @@ struct adb_data {
 };
 
 int read_block_adb(const adb_data& ad, uint32_t block, uint8_t* buffer, uint32_t fetch_size);
+int request_block_adb(const adb_data& ad, uint32_t block);
+int receive_block_adb(const adb_data& ad, uint8_t* buffer, uint32_t fetch_size);
 int run_adb_fuse(int sfd, uint64_t file_size, uint32_t block_size);
 
 #endif
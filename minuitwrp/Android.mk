@@ -5,6 +5,8 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := \
     graphics.cpp \
     graphics_fbdev.cpp \
+    graphics_memory.cpp \
+    graphics_neon.cpp \
     resources.cpp \
     truetype.cpp \
     graphics_utils.cpp \
@@ -88,6 +90,10 @@ ifeq ($(RECOVERY_GRAPHICS_FORCE_SINGLE_BUFFER), true)
 LOCAL_CFLAGS += -DRECOVERY_GRAPHICS_FORCE_SINGLE_BUFFER
 endif
 
+ifeq ($(RECOVERY_GRAPHICS_DRAW_TO_FRAMEBUFFER), true)
+LOCAL_CFLAGS += -DRECOVERY_GRAPHICS_DRAW_TO_FRAMEBUFFER
+endif
+
 #Remove the # from the line below to enable event logging
 #TWRP_EVENT_LOGGING := true
 ifeq ($(TWRP_EVENT_LOGGING), true)
@@ -19,6 +19,7 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
 #include <limits.h>
 #include <linux/input.h>
 #include <sys/types.h>
@@ -35,6 +36,8 @@
 //#define _EVENT_LOGGING
 
 #define MAX_DEVICES         32
+#define MAX_EXTRA_FDS       8
+#define EV_BATCH            64  // events read from a device at once
 
 #define VIBRATOR_TIMEOUT_FILE	"/sys/class/timed_output/vibrator/enable"
 #define VIBRATOR_TIME_MS    50
@@ -95,9 +98,15 @@ struct ev {
 
     struct position p, mt_p;
     int down;
+
+    /* Events read but not handed out yet, a touch frame is usually read
+     * whole up to its SYN_REPORT instead of one event per read() */
+    struct input_event queue[EV_BATCH];
+    unsigned queue_head, queue_len;
 };
 
 static struct pollfd ev_fds[MAX_DEVICES];
+static int ev_epoll_fd = -1;
 static struct ev evs[MAX_DEVICES];
 static unsigned ev_count = 0;
 static struct timeval lastInputStat;
@@ -314,6 +323,10 @@ int ev_init(void)
 
     has_mouse = 0;
 
+    /* All devices are waited on through one epoll fd, ev_poll() adds only
+     * that one to the GUI's other fds */
+    ev_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
 	dir = opendir("/dev/input");
     if(dir != 0) {
         while((de = readdir(dir))) {
@@ -327,6 +340,7 @@ int ev_init(void)
 			ev_fds[ev_count].fd = fd;
             ev_fds[ev_count].events = POLLIN;
             evs[ev_count].fd = &ev_fds[ev_count];
+            evs[ev_count].queue_head = evs[ev_count].queue_len = 0;
 
             /* Load virtualkeys if there are any */
             vk_init(&evs[ev_count]);
@@ -334,6 +348,13 @@ int ev_init(void)
             if (!evs[ev_count].ignored)
                 check_mouse(fd, evs[ev_count].deviceName);
 
+            if (ev_epoll_fd >= 0) {
+                struct epoll_event ee;
+                ee.events = EPOLLIN;
+                ee.data.u32 = ev_count;
+                epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, fd, &ee);
+            }
+
             ev_count++;
             if(ev_count == MAX_DEVICES) break;
         }
@@ -358,6 +379,9 @@ void ev_exit(void)
 		close(ev_fds[ev_count].fd);
 	}
 	ev_count = 0;
+	if (ev_epoll_fd >= 0)
+		close(ev_epoll_fd);
+	ev_epoll_fd = -1;
 }
 
 /*static int vk_inside_display(__s32 value, struct input_absinfo *info, int screen_size)
@@ -743,6 +767,24 @@ static int vk_modify(struct ev *e, struct input_event *ev)
     return 0;
 }
 
+/* Passes queued events through vk_modify until one is left for the caller,
+ * returns 1 with it in ev or 0 once every queue is empty */
+static int ev_dequeue(struct input_event *ev, int *consumed)
+{
+    unsigned n;
+
+    for (n = 0; n < ev_count; n++) {
+        struct ev *e = &evs[n];
+        while (e->queue_head < e->queue_len) {
+            *ev = e->queue[e->queue_head++];
+            *consumed = 1;
+            if (!vk_modify(e, ev))
+                return 1;
+        }
+    }
+    return 0;
+}
+
 int ev_get(struct input_event *ev, int timeout_ms)
 {
     int r;
@@ -764,22 +806,66 @@ int ev_get(struct input_event *ev, int timeout_ms)
         lastInputStat = curr;
     }
 
-    r = poll(ev_fds, ev_count, timeout_ms);
+    /* Hand out what earlier reads queued before asking the kernel again */
+    int consumed = 0;
+    if (ev_dequeue(ev, &consumed))
+        return 0;
 
-    if(r > 0) {
-        for(n = 0; n < ev_count; n++) {
-            if(ev_fds[n].revents & POLLIN) {
-                r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                if(r == sizeof(*ev)) {
-                    if (!vk_modify(&evs[n], ev))
-                        return 0;
-                }
-            }
+    /* Events were looked at, so the caller comes back right away anyway */
+    if (consumed)
+        timeout_ms = 0;
+
+    struct epoll_event ready[MAX_DEVICES];
+    r = epoll_wait(ev_epoll_fd, ready, MAX_DEVICES, timeout_ms);
+    if (r <= 0)
+        return consumed ? -1 : -2;
+
+    int i;
+    for (i = 0; i < r; i++) {
+        n = ready[i].data.u32;
+        if (n >= ev_count)
+            continue;
+        struct ev *e = &evs[n];
+        if (!(ready[i].events & EPOLLIN)) {
+            /* The device is gone, stop waking up for it until the reload */
+            if (ready[i].events & (EPOLLERR | EPOLLHUP))
+                epoll_ctl(ev_epoll_fd, EPOLL_CTL_DEL, e->fd->fd, NULL);
+            continue;
         }
-        return -1;
+        ssize_t len = read(e->fd->fd, e->queue, sizeof(e->queue));
+        if (len < (ssize_t)sizeof(*ev))
+            continue;
+        e->queue_head = 0;
+        e->queue_len = len / sizeof(*ev);
+    }
+
+    if (ev_dequeue(ev, &consumed))
+        return 0;
+    return -1;
+}
+
+int ev_poll(struct pollfd *extra, unsigned extra_count, int timeout_ms)
+{
+    struct pollfd fds[1 + MAX_EXTRA_FDS];
+    unsigned n;
+    int r;
+
+    if (extra_count > MAX_EXTRA_FDS)
+        extra_count = MAX_EXTRA_FDS;
+
+    /* Queued events are ready without waiting */
+    for (n = 0; n < ev_count; n++) {
+        if (evs[n].queue_head < evs[n].queue_len)
+            timeout_ms = 0;
     }
 
-    return -2;
+    fds[0].fd = ev_epoll_fd;
+    fds[0].events = POLLIN;
+    memcpy(fds + 1, extra, extra_count * sizeof(fds[0]));
+    r = poll(fds, 1 + extra_count, timeout_ms);
+    for (n = 0; n < extra_count; n++)
+        extra[n].revents = (r > 0) ? fds[1 + n].revents : 0;
+    return r;
 }
 
 int ev_wait(int timeout __unused)
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -54,9 +56,105 @@ static unsigned char gr_current_b = 255;
 
 GRSurface* gr_draw = NULL;
 
+// While set, every gr_clip() is limited to this area and gr_noclip() returns to it
+static bool gr_damage_active = false;
+static int gr_damage_x, gr_damage_y, gr_damage_w, gr_damage_h;
+
+// Set while gr_clip() limits drawing to gr_clip_x, gr_clip_y, gr_clip_w, gr_clip_h
+static bool gr_clip_active = false;
+static int gr_clip_x, gr_clip_y, gr_clip_w, gr_clip_h;
+// Set after a flip until the backend's sync_draw has been called
+static bool gr_draw_stale = false;
+
+void gr_prepare_draw(bool overwrite)
+{
+    if (!gr_draw_stale)
+        return;
+    gr_draw_stale = false;
+    gr_backend->sync_draw(gr_backend, overwrite);
+}
+
 static GGLContext *gr_context = 0;
 GGLSurface gr_mem_surface;
 static int gr_is_curr_clr_opaque = 0;
+// The last gr_color(), in the component order handed to pixelflinger
+static unsigned char gr_current_color[4] = { 255, 255, 255, 255 };
+
+// Returns true if drawing into the current surface can use the row kernels,
+// and sets bgr if its pixels are stored blue first
+static bool gr_fast_target(bool* bgr)
+{
+    if (!gr_has_fast_paths())
+        return false;
+    switch (gr_mem_surface.format) {
+        case GGL_PIXEL_FORMAT_RGBA_8888:
+        case GGL_PIXEL_FORMAT_RGBX_8888:
+            *bgr = false;
+            return true;
+        case GGL_PIXEL_FORMAT_BGRA_8888:
+            *bgr = true;
+            return true;
+    }
+    return false;
+}
+
+// Clips a destination area to the surface and the current scissor, like
+// pixelflinger would. Returns false if nothing is left.
+static bool gr_fast_clip(int* x, int* y, int* w, int* h)
+{
+    int left = std::max(*x, 0);
+    int top = std::max(*y, 0);
+    int right = std::min(*x + *w, (int)gr_mem_surface.width);
+    int bottom = std::min(*y + *h, (int)gr_mem_surface.height);
+    if (gr_clip_active) {
+        left = std::max(left, gr_clip_x);
+        top = std::max(top, gr_clip_y);
+        right = std::min(right, gr_clip_x + gr_clip_w);
+        bottom = std::min(bottom, gr_clip_y + gr_clip_h);
+    }
+    if (left >= right || top >= bottom)
+        return false;
+    *x = left;
+    *y = top;
+    *w = right - left;
+    *h = bottom - top;
+    return true;
+}
+
+static unsigned char* gr_fast_pixel(int x, int y)
+{
+    return (unsigned char*)gr_mem_surface.data + (y * gr_mem_surface.stride + x) * 4;
+}
+
+static void gr_fast_color(bool bgr, unsigned char color[4])
+{
+    color[0] = gr_current_color[bgr ? 2 : 0];
+    color[1] = gr_current_color[1];
+    color[2] = gr_current_color[bgr ? 0 : 2];
+    color[3] = gr_current_color[3];
+}
+
+bool gr_fast_text(const GGLSurface* mask, int sx, int sy, int w, int h, int x, int y)
+{
+    bool bgr;
+    // Pixelflinger takes the alpha from the glyphs alone, so only match it
+    // for opaque colors
+    if (!gr_is_curr_clr_opaque || mask->format != GGL_PIXEL_FORMAT_A_8 || !gr_fast_target(&bgr))
+        return false;
+
+    gr_prepare_draw(false);
+    int dx = x, dy = y;
+    if (!gr_fast_clip(&dx, &dy, &w, &h))
+        return true;
+
+    unsigned char color[4];
+    gr_fast_color(bgr, color);
+    for (int row = 0; row < h; row++) {
+        const unsigned char* src = (const unsigned char*)mask->data + (sy + dy + row - y) * mask->stride + (sx + dx - x);
+        gr_fast_mask_row(gr_fast_pixel(dx, dy + row), src, w, color);
+    }
+    return true;
+}
 
 int gr_textEx_scaleW(int x, int y, const char *s, void* pFont, int max_width, int placement, int scale)
 {
@@ -105,21 +203,62 @@ int gr_textEx_scaleW(int x, int y, const char *s, void* pFont, int max_width, in
         else if (placement == BOTTOM_LEFT || placement == BOTTOM_RIGHT)
             y -= measured_height;
     }
+    gr_prepare_draw(false);
     return gr_ttf_textExWH(gl, x, y + y_scale, s, vfont, measured_width + x, -1);
 }
 
 void gr_clip(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
+    if (gr_damage_active) {
+        int right = std::min(x + w, gr_damage_x + gr_damage_w);
+        int bottom = std::min(y + h, gr_damage_y + gr_damage_h);
+        x = std::max(x, gr_damage_x);
+        y = std::max(y, gr_damage_y);
+        w = std::max(right - x, 0);
+        h = std::max(bottom - y, 0);
+    }
     gl->scissor(gl, x, y, w, h);
     gl->enable(gl, GGL_SCISSOR_TEST);
+    gr_clip_active = true;
+    gr_clip_x = x;
+    gr_clip_y = y;
+    gr_clip_w = w;
+    gr_clip_h = h;
 }
 
 void gr_noclip()
 {
     GGLContext *gl = gr_context;
+    if (gr_damage_active) {
+        gl->scissor(gl, gr_damage_x, gr_damage_y, gr_damage_w, gr_damage_h);
+        gl->enable(gl, GGL_SCISSOR_TEST);
+        gr_clip_x = gr_damage_x;
+        gr_clip_y = gr_damage_y;
+        gr_clip_w = gr_damage_w;
+        gr_clip_h = gr_damage_h;
+        return;
+    }
     gl->scissor(gl, 0, 0, gr_fb_width(), gr_fb_height());
     gl->disable(gl, GGL_SCISSOR_TEST);
+    gr_clip_active = false;
+}
+
+void gr_set_damage_clip(int x, int y, int w, int h)
+{
+    gr_damage_active = false;
+    gr_clip(x, y, w, h);
+    gr_damage_x = x;
+    gr_damage_y = y;
+    gr_damage_w = w;
+    gr_damage_h = h;
+    gr_damage_active = true;
+}
+
+void gr_clear_damage_clip(void)
+{
+    gr_damage_active = false;
+    gr_noclip();
 }
 
 void gr_line(int x0, int y0, int x1, int y1, int width)
@@ -129,6 +268,7 @@ void gr_line(int x0, int y0, int x1, int y1, int width)
     if(gr_is_curr_clr_opaque)
         gl->disable(gl, GGL_BLEND);
 
+    gr_prepare_draw(false);
     const int coords0[2] = { x0 << 4, y0 << 4 };
     const int coords1[2] = { x1 << 4, y1 << 4 };
     gl->linex(gl, coords0, coords1, width << 4);
@@ -184,6 +324,8 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
 #endif
     gl->color4xv(gl, color);
 
+    for (int i = 0; i < 4; i++)
+        gr_current_color[i] = (color[i] - 1) >> 8;
     gr_is_curr_clr_opaque = (a == 255);
 }
 
@@ -194,6 +336,8 @@ void gr_clear()
         return;
     }
 
+    gr_prepare_draw(true);
+
     // This code only works on 32bpp devices
     if (gr_current_r == gr_current_g && gr_current_r == gr_current_b) {
         memset(gr_draw->data, gr_current_r, gr_draw->height * gr_draw->row_bytes);
@@ -215,6 +359,26 @@ void gr_fill(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
 
+    // An opaque fill of the whole surface, like a page background, doesn't
+    // need the last frame underneath it
+    gr_prepare_draw(gr_is_curr_clr_opaque && !gr_clip_active && x <= 0 && y <= 0 &&
+                    x + w >= (int)gr_draw->width && y + h >= (int)gr_draw->height);
+
+    bool bgr;
+    if (gr_fast_target(&bgr)) {
+        unsigned char color[4];
+        gr_fast_color(bgr, color);
+        if (!gr_fast_clip(&x, &y, &w, &h))
+            return;
+        for (int row = y; row < y + h; row++) {
+            if (gr_is_curr_clr_opaque)
+                gr_fast_fill_row(gr_fast_pixel(x, row), w, color);
+            else
+                gr_fast_blend_fill_row(gr_fast_pixel(x, row), w, color);
+        }
+        return;
+    }
+
     if(gr_is_curr_clr_opaque)
         gl->disable(gl, GGL_BLEND);
 
@@ -232,6 +396,29 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     GGLContext *gl = gr_context;
     GGLSurface *surface = (GGLSurface*)source;
 
+    gr_prepare_draw(false);
+
+    bool bgr;
+    bool copy = (surface->format == GGL_PIXEL_FORMAT_RGBX_8888);
+    if ((copy || surface->format == GGL_PIXEL_FORMAT_RGBA_8888 || surface->format == GGL_PIXEL_FORMAT_BGRA_8888) &&
+            sx >= 0 && sy >= 0 && sx + w <= (int)surface->width && sy + h <= (int)surface->height &&
+            gr_fast_target(&bgr)) {
+        int x = dx, y = dy;
+        if (!gr_fast_clip(&x, &y, &w, &h))
+            return;
+        sx += x - dx;
+        sy += y - dy;
+        bool rb_swap = ((surface->format == GGL_PIXEL_FORMAT_BGRA_8888) != bgr);
+        for (int row = 0; row < h; row++) {
+            const unsigned char* src = (const unsigned char*)surface->data + ((sy + row) * surface->stride + sx) * 4;
+            if (copy)
+                gr_fast_copy_row(gr_fast_pixel(x, y + row), src, w, rb_swap);
+            else
+                gr_fast_blend_row(gr_fast_pixel(x, y + row), src, w, rb_swap);
+        }
+        return;
+    }
+
     if(surface->format == GGL_PIXEL_FORMAT_RGBX_8888)
         gl->disable(gl, GGL_BLEND);
 
@@ -263,13 +450,35 @@ unsigned int gr_get_height(gr_surface surface) {
 }
 
 void gr_flip() {
+    // A frame with nothing drawn still has to show the last one
+    gr_prepare_draw(false);
     gr_draw = gr_backend->flip(gr_backend);
+    gr_draw_stale = (gr_backend->sync_draw != NULL);
     // On double buffered back ends, when we flip, we need to tell
     // pixel flinger to draw to the other buffer
     gr_mem_surface.data = (GGLubyte*)gr_draw->data;
     gr_context->colorBuffer(gr_context, &gr_mem_surface);
 }
 
+void gr_flip_region(int x __unused, int y, int w __unused, int h) {
+    // Backends copy whole rows, so only the vertical extent matters
+    int top = std::max(y, 0);
+    int bottom = std::min(y + h, (int)gr_draw->height);
+    if (!gr_backend->flip_region || top >= bottom) {
+        gr_flip();
+        return;
+    }
+    gr_prepare_draw(false);
+    gr_draw = gr_backend->flip_region(gr_backend, top, bottom - top);
+    gr_draw_stale = (gr_backend->sync_draw != NULL);
+    gr_mem_surface.data = (GGLubyte*)gr_draw->data;
+    gr_context->colorBuffer(gr_context, &gr_mem_surface);
+}
+
+int gr_has_flip_region(void) {
+    return gr_backend && gr_backend->flip_region;
+}
+
 static void get_memory_surface(GGLSurface* ms) {
     ms->version = sizeof(*ms);
     ms->width = gr_draw->width;
@@ -283,9 +492,18 @@ int gr_init(void)
 {
     gr_draw = NULL;
 
-#ifdef MSM_BSP
-    gr_backend = open_overlay();
+    gr_backend = open_memory();
     if (gr_backend) {
+        gr_draw = gr_backend->init(gr_backend);
+        if (!gr_draw)
+            return -1;
+        printf("Using memory graphics.\n");
+    }
+
+#ifdef MSM_BSP
+    if (!gr_draw)
+        gr_backend = open_overlay();
+    if (!gr_draw && gr_backend) {
         gr_draw = gr_backend->init(gr_backend);
         if (!gr_draw) {
             gr_backend->exit(gr_backend);
@@ -388,6 +606,7 @@ int gr_get_surface(gr_surface* surface)
     ms->data = (GGLubyte*)malloc(ms->stride * ms->height * gr_draw->pixel_bytes);
 
     // Now, copy the data
+    gr_prepare_draw(false);
     memcpy(ms->data, gr_mem_surface.data, gr_draw->width * gr_draw->height * gr_draw->pixel_bytes / 8);
 
     *surface = (gr_surface*) ms;
@@ -407,5 +626,6 @@ int gr_free_surface(gr_surface surface)
 
 void gr_write_frame_to_file(int fd)
 {
+    gr_prepare_draw(false);
     write(fd, gr_mem_surface.data, gr_draw->width * gr_draw->height * gr_draw->pixel_bytes / 8);
 }
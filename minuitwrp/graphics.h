@@ -18,6 +18,7 @@
 #define _GRAPHICS_H_
 
 #include "minui.h"
+#include <pixelflinger/pixelflinger.h>
 
 // TODO: lose the function pointers.
 struct minui_backend {
@@ -34,11 +35,54 @@ struct minui_backend {
 
     // Device cleanup when drawing is done.
     void (*exit)(minui_backend*);
+
+    // Like flip(), but only rows [y, y + h) of the drawing surface have
+    // changed since the previous flip. NULL if the backend can't tell.
+    GRSurface* (*flip_region)(minui_backend*, int y, int h);
+
+    // Set by backends that draw straight into the next scanout buffer.
+    // Called before the first drawing after a flip to bring that buffer up
+    // to date with the last frame, which can be skipped if the caller is
+    // about to overwrite all of it. NULL if the drawing surface always
+    // holds the last frame.
+    void (*sync_draw)(minui_backend*, bool overwrite);
 };
 
+// Row kernels in graphics_neon.cpp for 32 bpp pixels with alpha in the
+// last byte. rb_swap exchanges the first and third byte of source pixels.
+// gr_has_fast_paths() is false where they would be no faster than
+// pixelflinger.
+bool gr_has_fast_paths(void);
+void gr_fast_fill_row(unsigned char* dst, int count, const unsigned char color[4]);
+void gr_fast_blend_fill_row(unsigned char* dst, int count, const unsigned char color[4]);
+void gr_fast_copy_row(unsigned char* dst, const unsigned char* src, int count, bool rb_swap);
+void gr_fast_blend_row(unsigned char* dst, const unsigned char* src, int count, bool rb_swap);
+void gr_fast_mask_row(unsigned char* dst, const unsigned char* mask, int count, const unsigned char color[4]);
+
+// Pixel format conversions shared by the backends, the screenshots and
+// image loading. Unlike the kernels above they are always available, with
+// plain loops where there is no NEON.
+void gr_fast_rgb_row(unsigned char* dst, const unsigned char* src, int count, bool rb_swap);       // 32 bpp to 24 bpp
+void gr_fast_rgbx_row(unsigned char* dst, const unsigned char* src, int count, bool rb_swap);      // 24 bpp to opaque 32 bpp
+void gr_fast_gray_row(unsigned char* dst, const unsigned char* src, int count);                    // 8 bit gray to opaque 32 bpp
+void gr_fast_565_to_rgb_row(unsigned char* dst, const unsigned char* src, int count);              // RGB565 to 24 bpp
+void gr_fast_swap_rb_row(unsigned char* px, int count);                                            // 32 bpp in place
+void gr_fast_reverse_row(unsigned char* dst, const unsigned char* src, int count, int pixel_bytes); // Mirrors 16 or 32 bpp pixels
+
+// Resizes a 32 bpp image, bilinear when enlarging and averaging the covered
+// area when shrinking, each axis on its own. Strides are in bytes. Returns
+// false if it runs out of memory.
+bool gr_fast_scale(unsigned char* dst, int dst_w, int dst_h, int dst_stride,
+                   const unsigned char* src, int src_w, int src_h, int src_stride);
+
+// Draws the w x h area at (sx, sy) of an alpha-8 surface at (x, y) in the
+// current color. Returns false if it has to go through pixelflinger instead.
+bool gr_fast_text(const GGLSurface* mask, int sx, int sy, int w, int h, int x, int y);
+
 minui_backend* open_fbdev();
 minui_backend* open_adf();
 minui_backend* open_drm();
 minui_backend* open_overlay();
+minui_backend* open_memory();
 
 #endif
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+
 #include <drm_fourcc.h>
 #include <fcntl.h>
 #include <stdbool.h>
@@ -44,6 +46,20 @@ static drm_surface *drm_surfaces[2];
 static int current_buffer;
 static GRSurface *draw_buf = NULL;
 
+// Either draw_buf is an in-memory copy of the frame, and rows
+// [stale_top, stale_bottom) of each scanout buffer are older than it, or
+// drawing goes straight into drm_surfaces[current_buffer], and the rows are
+// those older than the last frame.
+#ifdef RECOVERY_GRAPHICS_DRAW_TO_FRAMEBUFFER
+static const bool draw_direct = true;
+#else
+static const bool draw_direct = false;
+#endif
+static int stale_top[2];
+static int stale_bottom[2];
+
+static void drm_sync_draw(minui_backend* backend, bool overwrite);
+
 static drmModeCrtc *main_monitor_crtc;
 static drmModeConnector *main_monitor_connector;
 
@@ -363,7 +379,7 @@ static void disable_non_main_crtcs(int fd,
     }
 }
 
-static GRSurface* drm_init(minui_backend* backend __unused) {
+static GRSurface* drm_init(minui_backend* backend) {
     drmModeRes *res = NULL;
     uint32_t selected_mode;
     char *dev_name;
@@ -451,6 +467,16 @@ static GRSurface* drm_init(minui_backend* backend __unused) {
         return NULL;
     }
 
+    current_buffer = 0;
+    if (draw_direct) {
+        stale_top[0] = stale_top[1] = 0;
+        stale_bottom[0] = stale_bottom[1] = 0;
+        backend->sync_draw = drm_sync_draw;
+
+        drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[1]);
+        return &drm_surfaces[0]->base;
+    }
+
     draw_buf = (GRSurface *)malloc(sizeof(GRSurface));
     if (!draw_buf) {
         printf("failed to alloc draw_buf\n");
@@ -473,18 +499,48 @@ static GRSurface* drm_init(minui_backend* backend __unused) {
         return NULL;
     }
 
-    current_buffer = 0;
+    stale_top[0] = stale_top[1] = 0;
+    stale_bottom[0] = stale_bottom[1] = draw_buf->height;
 
     drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[1]);
 
     return draw_buf;
 }
 
-static GRSurface* drm_flip(minui_backend* backend __unused) {
-    int ret;
-    memcpy(drm_surfaces[current_buffer]->base.data,
-            draw_buf->data, draw_buf->height * draw_buf->row_bytes);
+static void add_stale_rows(int n, int top, int bottom) {
+    if (stale_top[n] >= stale_bottom[n]) {
+        stale_top[n] = top;
+        stale_bottom[n] = bottom;
+    } else {
+        stale_top[n] = std::min(stale_top[n], top);
+        stale_bottom[n] = std::max(stale_bottom[n], bottom);
+    }
+}
+
+static void copy_stale_rows(GRSurface* dst, const GRSurface* src, int n) {
+    if (stale_top[n] < stale_bottom[n]) {
+        size_t offset = stale_top[n] * dst->row_bytes;
+        memcpy(dst->data + offset, src->data + offset,
+                (stale_bottom[n] - stale_top[n]) * dst->row_bytes);
+    }
+    stale_top[n] = stale_bottom[n] = 0;
+}
 
+static GRSurface* drm_flip_region(minui_backend* backend __unused, int y, int h) {
+    int ret;
+    int other = 1 - current_buffer;
+
+    if (draw_direct) {
+        // The frame is already in the buffer we are about to scan out, so
+        // only the one on screen now falls behind
+        add_stale_rows(other, y, y + h);
+    } else {
+        // Bring the buffer we are about to scan out up to date with draw_buf.
+        // The other buffer keeps its stale rows until its next turn.
+        add_stale_rows(0, y, y + h);
+        add_stale_rows(1, y, y + h);
+        copy_stale_rows(&drm_surfaces[current_buffer]->base, draw_buf, current_buffer);
+    }
 
     ret = drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id,
                           drm_surfaces[current_buffer]->fb_id, 0, NULL);
@@ -492,8 +548,20 @@ static GRSurface* drm_flip(minui_backend* backend __unused) {
         printf("drmModePageFlip failed ret=%d\n", ret);
         return NULL;
     }
-    current_buffer = 1 - current_buffer;
-    return draw_buf;
+    current_buffer = other;
+    return draw_direct ? &drm_surfaces[current_buffer]->base : draw_buf;
+}
+
+static GRSurface* drm_flip(minui_backend* backend) {
+    return drm_flip_region(backend, 0, drm_surfaces[current_buffer]->base.height);
+}
+
+static void drm_sync_draw(minui_backend* backend __unused, bool overwrite) {
+    if (overwrite)
+        stale_top[current_buffer] = stale_bottom[current_buffer] = 0;
+    else
+        copy_stale_rows(&drm_surfaces[current_buffer]->base,
+                &drm_surfaces[1 - current_buffer]->base, current_buffer);
 }
 
 static void drm_exit(minui_backend* backend __unused) {
@@ -511,6 +579,7 @@ static minui_backend drm_backend = {
     .flip = drm_flip,
     .blank = drm_blank,
     .exit = drm_exit,
+    .flip_region = drm_flip_region,
 };
 
 minui_backend* open_drm() {
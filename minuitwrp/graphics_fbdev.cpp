@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,11 +41,30 @@ static GRSurface* fbdev_flip(minui_backend*);
 static void fbdev_blank(minui_backend*, bool);
 static void fbdev_exit(minui_backend*);
 
+// Byte swapping and rotation rewrite the whole frame, so only plain copies
+// can be limited to the rows that changed.
+#if !defined(RECOVERY_BGRA) && !defined(BOARD_HAS_FLIPPED_SCREEN)
+#define FBDEV_FLIP_REGION
+static GRSurface* fbdev_flip_region(minui_backend*, int, int);
+#ifdef RECOVERY_GRAPHICS_DRAW_TO_FRAMEBUFFER
+static void fbdev_sync_draw(minui_backend*, bool);
+#endif
+#endif
+
 static GRSurface gr_framebuffer[2];
 static bool double_buffered;
 static GRSurface* gr_draw = NULL;
 static int displayed_buffer;
 
+#ifdef FBDEV_FLIP_REGION
+// Either gr_draw is in memory and rows [stale_top, stale_bottom) of each
+// framebuffer are older than it, or gr_draw points straight at the hidden
+// framebuffer and the rows are those older than the last frame.
+static bool draw_direct;
+static int stale_top[2];
+static int stale_bottom[2];
+#endif
+
 static fb_var_screeninfo vi;
 static int fb_fd = -1;
 static __u32 smem_len;
@@ -53,6 +74,9 @@ static minui_backend my_backend = {
     .flip = fbdev_flip,
     .blank = fbdev_blank,
     .exit = fbdev_exit,
+#ifdef FBDEV_FLIP_REGION
+    .flip_region = fbdev_flip_region,
+#endif
 };
 
 minui_backend* open_fbdev() {
@@ -271,6 +295,22 @@ static GRSurface* fbdev_init(minui_backend* backend) {
 #endif
     fb_fd = fd;
     set_displayed_framebuffer(0);
+#ifdef FBDEV_FLIP_REGION
+    stale_top[0] = stale_top[1] = 0;
+    stale_bottom[0] = stale_bottom[1] = gr_draw->height;
+#ifdef RECOVERY_GRAPHICS_DRAW_TO_FRAMEBUFFER
+    // Saves a copy per frame where framebuffer memory is cached well
+    // enough for blending to read from it
+    if (double_buffered) {
+        free(gr_draw->data);
+        gr_draw->data = gr_framebuffer[1].data;
+        memset(gr_draw->data, 0, gr_draw->height * gr_draw->row_bytes);
+        stale_bottom[1] = 0;
+        draw_direct = true;
+        backend->sync_draw = fbdev_sync_draw;
+    }
+#endif
+#endif
 
     printf("framebuffer: %d (%d x %d)\n", fb_fd, gr_draw->width, gr_draw->height);
 
@@ -282,18 +322,65 @@ static GRSurface* fbdev_init(minui_backend* backend) {
     return gr_draw;
 }
 
+#ifdef FBDEV_FLIP_REGION
+static void add_stale_rows(int n, int top, int bottom) {
+    if (stale_top[n] >= stale_bottom[n]) {
+        stale_top[n] = top;
+        stale_bottom[n] = bottom;
+    } else {
+        stale_top[n] = std::min(stale_top[n], top);
+        stale_bottom[n] = std::max(stale_bottom[n], bottom);
+    }
+}
+
+static void copy_stale_rows(GRSurface* dst, const GRSurface* src, int n) {
+    if (stale_top[n] < stale_bottom[n]) {
+        size_t offset = stale_top[n] * dst->row_bytes;
+        memcpy(dst->data + offset, src->data + offset,
+               (stale_bottom[n] - stale_top[n]) * dst->row_bytes);
+    }
+    stale_top[n] = stale_bottom[n] = 0;
+}
+
+static GRSurface* fbdev_flip_region(minui_backend* backend __unused, int y, int h) {
+    if (draw_direct) {
+        // The frame is already in the hidden framebuffer, so only the one
+        // displayed now falls behind
+        add_stale_rows(displayed_buffer, y, y + h);
+        set_displayed_framebuffer(1 - displayed_buffer);
+        gr_draw->data = gr_framebuffer[1 - displayed_buffer].data;
+        return gr_draw;
+    }
+
+    // Copy from the in-memory surface to the framebuffer, leaving the other
+    // buffer's stale rows for when it is next drawn to.
+    add_stale_rows(0, y, y + h);
+    add_stale_rows(1, y, y + h);
+    int n = double_buffered ? 1 - displayed_buffer : 0;
+    copy_stale_rows(&gr_framebuffer[n], gr_draw, n);
+    if (double_buffered)
+        set_displayed_framebuffer(n);
+    return gr_draw;
+}
+
+#ifdef RECOVERY_GRAPHICS_DRAW_TO_FRAMEBUFFER
+static void fbdev_sync_draw(minui_backend* backend __unused, bool overwrite) {
+    int n = 1 - displayed_buffer;
+    if (overwrite)
+        stale_top[n] = stale_bottom[n] = 0;
+    else
+        copy_stale_rows(gr_draw, &gr_framebuffer[displayed_buffer], n);
+}
+#endif
+#endif
+
 static GRSurface* fbdev_flip(minui_backend* backend __unused) {
+#ifdef FBDEV_FLIP_REGION
+    return fbdev_flip_region(backend, 0, gr_draw->height);
+#else
 #if defined(RECOVERY_BGRA)
     // In case of BGRA, do some byte swapping
-    unsigned int idx;
-    unsigned char tmp;
-    unsigned char* ucfb_vaddr = (unsigned char*)gr_draw->data;
-    for (idx = 0 ; idx < (gr_draw->height * gr_draw->row_bytes);
-            idx += 4) {
-        tmp = ucfb_vaddr[idx];
-        ucfb_vaddr[idx    ] = ucfb_vaddr[idx + 2];
-        ucfb_vaddr[idx + 2] = tmp;
-    }
+    gr_fast_swap_rb_row(gr_draw->data, gr_draw->height * gr_draw->row_bytes / 4);
 #endif
 #ifndef BOARD_HAS_FLIPPED_SCREEN
     if (double_buffered) {
@@ -312,27 +399,17 @@ static GRSurface* fbdev_flip(minui_backend* backend __unused) {
         gr_active_fb = 1-displayed_buffer;
 
     /* flip buffer 180 degrees for devices with physically inverted screens */
-    unsigned int row_pixels = gr_draw->row_bytes / gr_framebuffer[0].pixel_bytes;
-    if (gr_framebuffer[0].pixel_bytes == 4) {
-        for (unsigned int y = 0; y < gr_draw->height; ++y) {
-            uint32_t* dst = reinterpret_cast<uint32_t*>(gr_framebuffer[gr_active_fb].data) + y * row_pixels;
-            uint32_t* src = reinterpret_cast<uint32_t*>(gr_draw->data) + (gr_draw->height - y - 1) * row_pixels + gr_draw->width;
-            for (unsigned int x = 0; x < gr_draw->width; ++x)
-                *(dst++) = *(--src);
-        }
-    } else {
-        for (unsigned int y = 0; y < gr_draw->height; ++y) {
-            uint16_t* dst = reinterpret_cast<uint16_t*>(gr_framebuffer[gr_active_fb].data) + y * row_pixels;
-            uint16_t* src = reinterpret_cast<uint16_t*>(gr_draw->data) + (gr_draw->height - y - 1) * row_pixels + gr_draw->width;
-            for (unsigned int x = 0; x < gr_draw->width; ++x)
-                 *(dst++) = *(--src);
-        }
+    for (unsigned int y = 0; y < gr_draw->height; ++y) {
+        gr_fast_reverse_row(gr_framebuffer[gr_active_fb].data + y * gr_draw->row_bytes,
+                            gr_draw->data + (gr_draw->height - y - 1) * gr_draw->row_bytes,
+                            gr_draw->width, gr_framebuffer[0].pixel_bytes);
     }
 
     if (double_buffered)
         set_displayed_framebuffer(1-displayed_buffer);
 #endif
     return gr_draw;
+#endif
 }
 
 static void fbdev_exit(minui_backend* backend __unused) {
@@ -340,7 +417,10 @@ static void fbdev_exit(minui_backend* backend __unused) {
     fb_fd = -1;
 
     if (gr_draw) {
-        free(gr_draw->data);
+#ifdef FBDEV_FLIP_REGION
+        if (!draw_direct)
+#endif
+            free(gr_draw->data);
         free(gr_draw);
     }
     gr_draw = NULL;
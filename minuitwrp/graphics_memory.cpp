@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2018 The Team Win Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Off-screen backend for the GUI benchmark. Frames are drawn into memory
+// and flips do nothing, so the display of a running recovery is untouched.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "minui.h"
+#include "graphics.h"
+
+static GRSurface gr_memory;
+static int memory_width = 0;
+static int memory_height = 0;
+
+static GRSurface* memory_init(minui_backend* backend __unused) {
+    gr_memory.width = memory_width;
+    gr_memory.height = memory_height;
+    gr_memory.pixel_bytes = 4;
+    gr_memory.row_bytes = memory_width * 4;
+    gr_memory.format = GGL_PIXEL_FORMAT_RGBX_8888;
+    gr_memory.data = (unsigned char*) calloc(gr_memory.row_bytes, memory_height);
+    if (!gr_memory.data) {
+        printf("Unable to allocate %dx%d memory surface\n", memory_width, memory_height);
+        return NULL;
+    }
+    return &gr_memory;
+}
+
+static GRSurface* memory_flip(minui_backend* backend __unused) {
+    return &gr_memory;
+}
+
+static GRSurface* memory_flip_region(minui_backend* backend __unused, int y __unused, int h __unused) {
+    return &gr_memory;
+}
+
+static void memory_blank(minui_backend* backend __unused, bool blank __unused) {
+}
+
+static void memory_exit(minui_backend* backend __unused) {
+    free(gr_memory.data);
+    gr_memory.data = NULL;
+}
+
+static minui_backend memory_backend = {
+    .init = memory_init,
+    .flip = memory_flip,
+    .blank = memory_blank,
+    .exit = memory_exit,
+    .flip_region = memory_flip_region,
+    .sync_draw = NULL,
+};
+
+void gr_use_memory(int width, int height) {
+    memory_width = width;
+    memory_height = height;
+}
+
+minui_backend* open_memory() {
+    if (memory_width <= 0 || memory_height <= 0)
+        return NULL;
+    return &memory_backend;
+}
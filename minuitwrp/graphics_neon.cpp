@@ -0,0 +1,476 @@
+/*
+ * Copyright 2018 TeamWin
+ * This file is part of TWRP/TeamWin Recovery Project.
+ *
+ * TWRP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * TWRP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Row kernels for the common fills and blits on 32 bpp surfaces. They
+// follow pixelflinger's GGL_SRC_ALPHA, GGL_ONE_MINUS_SRC_ALPHA blending so
+// graphics.cpp can skip the generic scanline pipeline for them.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/types.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+#endif
+
+#include "graphics.h"
+
+// x / 255, rounded, for x <= 255 * 255
+static inline unsigned char div255(unsigned x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+#ifdef HAVE_NEON_KERNELS
+static inline uint8x8_t div255_neon(uint16x8_t x)
+{
+    return vraddhn_u16(x, vrshrq_n_u16(x, 8));
+}
+
+static inline void swap_rb(uint8x8x4_t& px)
+{
+    uint8x8_t tmp = px.val[0];
+    px.val[0] = px.val[2];
+    px.val[2] = tmp;
+}
+#endif
+
+bool gr_has_fast_paths(void)
+{
+#ifdef HAVE_NEON_KERNELS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void gr_fast_fill_row(unsigned char* dst, int count, const unsigned char color[4])
+{
+    uint32_t pixel;
+    memcpy(&pixel, color, 4);
+    uint32_t* out = reinterpret_cast<uint32_t*>(dst);
+    int i = 0;
+#ifdef HAVE_NEON_KERNELS
+    uint32x4_t v = vdupq_n_u32(pixel);
+    for (; i + 8 <= count; i += 8) {
+        vst1q_u32(out + i, v);
+        vst1q_u32(out + i + 4, v);
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = pixel;
+}
+
+void gr_fast_blend_fill_row(unsigned char* dst, int count, const unsigned char color[4])
+{
+    unsigned a = color[3], ia = 255 - a;
+    unsigned src[4] = { color[0] * a, color[1] * a, color[2] * a, a * a };
+    int i = 0;
+#ifdef HAVE_NEON_KERNELS
+    uint8x8_t via = vdup_n_u8(ia);
+    uint16x8_t vsrc[4];
+    for (int c = 0; c < 4; c++)
+        vsrc[c] = vdupq_n_u16(src[c]);
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t d = vld4_u8(dst + i * 4);
+        for (int c = 0; c < 4; c++)
+            d.val[c] = div255_neon(vmlal_u8(vsrc[c], d.val[c], via));
+        vst4_u8(dst + i * 4, d);
+    }
+#endif
+    for (; i < count; i++) {
+        unsigned char* d = dst + i * 4;
+        for (int c = 0; c < 4; c++)
+            d[c] = div255(src[c] + d[c] * ia);
+    }
+}
+
+void gr_fast_copy_row(unsigned char* dst, const unsigned char* src, int count, bool rb_swap)
+{
+    int i = 0;
+#ifdef HAVE_NEON_KERNELS
+    uint8x8_t opaque = vdup_n_u8(0xff);
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t s = vld4_u8(src + i * 4);
+        if (rb_swap)
+            swap_rb(s);
+        s.val[3] = opaque;
+        vst4_u8(dst + i * 4, s);
+    }
+#endif
+    for (; i < count; i++) {
+        const unsigned char* s = src + i * 4;
+        unsigned char* d = dst + i * 4;
+        d[0] = s[rb_swap ? 2 : 0];
+        d[1] = s[1];
+        d[2] = s[rb_swap ? 0 : 2];
+        d[3] = 0xff;
+    }
+}
+
+void gr_fast_blend_row(unsigned char* dst, const unsigned char* src, int count, bool rb_swap)
+{
+    int i = 0;
+#ifdef HAVE_NEON_KERNELS
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t s = vld4_u8(src + i * 4);
+        uint8x8x4_t d = vld4_u8(dst + i * 4);
+        if (rb_swap)
+            swap_rb(s);
+        uint8x8_t a = s.val[3];
+        uint8x8_t ia = vmvn_u8(a);
+        for (int c = 0; c < 4; c++)
+            d.val[c] = div255_neon(vmlal_u8(vmull_u8(s.val[c], a), d.val[c], ia));
+        vst4_u8(dst + i * 4, d);
+    }
+#endif
+    for (; i < count; i++) {
+        const unsigned char* s = src + i * 4;
+        unsigned char* d = dst + i * 4;
+        unsigned a = s[3], ia = 255 - a;
+        unsigned char r = s[rb_swap ? 2 : 0], b = s[rb_swap ? 0 : 2];
+        d[0] = div255(r * a + d[0] * ia);
+        d[1] = div255(s[1] * a + d[1] * ia);
+        d[2] = div255(b * a + d[2] * ia);
+        d[3] = div255(a * a + d[3] * ia);
+    }
+}
+
+void gr_fast_mask_row(unsigned char* dst, const unsigned char* mask, int count, const unsigned char color[4])
+{
+    int i = 0;
+#ifdef HAVE_NEON_KERNELS
+    uint8x8_t vcolor[3];
+    for (int c = 0; c < 3; c++)
+        vcolor[c] = vdup_n_u8(color[c]);
+    for (; i + 8 <= count; i += 8) {
+        uint8x8_t m = vld1_u8(mask + i);
+        uint8x8_t im = vmvn_u8(m);
+        uint8x8x4_t d = vld4_u8(dst + i * 4);
+        for (int c = 0; c < 3; c++)
+            d.val[c] = div255_neon(vmlal_u8(vmull_u8(vcolor[c], m), d.val[c], im));
+        d.val[3] = div255_neon(vmlal_u8(vmull_u8(m, m), d.val[3], im));
+        vst4_u8(dst + i * 4, d);
+    }
+#endif
+    for (; i < count; i++) {
+        unsigned m = mask[i], im = 255 - m;
+        unsigned char* d = dst + i * 4;
+        for (int c = 0; c < 3; c++)
+            d[c] = div255(color[c] * m + d[c] * im);
+        d[3] = div255(m * m + d[3] * im);
+    }
+}
+
+void gr_fast_rgb_row(unsigned char* dst, const unsigned char* src, int count, bool rb_swap)
+{
+    int i = 0;
+#ifdef HAVE_NEON_KERNELS
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t s = vld4_u8(src + i * 4);
+        if (rb_swap)
+            swap_rb(s);
+        uint8x8x3_t d = { { s.val[0], s.val[1], s.val[2] } };
+        vst3_u8(dst + i * 3, d);
+    }
+#endif
+    for (; i < count; i++) {
+        const unsigned char* s = src + i * 4;
+        unsigned char* d = dst + i * 3;
+        d[0] = s[rb_swap ? 2 : 0];
+        d[1] = s[1];
+        d[2] = s[rb_swap ? 0 : 2];
+    }
+}
+
+void gr_fast_rgbx_row(unsigned char* dst, const unsigned char* src, int count, bool rb_swap)
+{
+    int i = 0;
+#ifdef HAVE_NEON_KERNELS
+    uint8x8_t opaque = vdup_n_u8(0xff);
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x3_t s = vld3_u8(src + i * 3);
+        uint8x8x4_t d = { { s.val[rb_swap ? 2 : 0], s.val[1], s.val[rb_swap ? 0 : 2], opaque } };
+        vst4_u8(dst + i * 4, d);
+    }
+#endif
+    for (; i < count; i++) {
+        const unsigned char* s = src + i * 3;
+        unsigned char* d = dst + i * 4;
+        d[0] = s[rb_swap ? 2 : 0];
+        d[1] = s[1];
+        d[2] = s[rb_swap ? 0 : 2];
+        d[3] = 0xff;
+    }
+}
+
+void gr_fast_gray_row(unsigned char* dst, const unsigned char* src, int count)
+{
+    int i = 0;
+#ifdef HAVE_NEON_KERNELS
+    uint8x8_t opaque = vdup_n_u8(0xff);
+    for (; i + 8 <= count; i += 8) {
+        uint8x8_t g = vld1_u8(src + i);
+        uint8x8x4_t d = { { g, g, g, opaque } };
+        vst4_u8(dst + i * 4, d);
+    }
+#endif
+    for (; i < count; i++) {
+        unsigned char* d = dst + i * 4;
+        d[0] = d[1] = d[2] = src[i];
+        d[3] = 0xff;
+    }
+}
+
+void gr_fast_565_to_rgb_row(unsigned char* dst, const unsigned char* src, int count)
+{
+    int i = 0;
+#ifdef HAVE_NEON_KERNELS
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t px = vld1q_u16(reinterpret_cast<const uint16_t*>(src + i * 2));
+        // Each channel is widened by repeating its top bits
+        uint8x8_t r = vmovn_u16(vshrq_n_u16(px, 8));
+        uint8x8_t g = vmovn_u16(vshrq_n_u16(px, 3));
+        uint8x8_t b = vmovn_u16(vshlq_n_u16(px, 3));
+        r = vand_u8(r, vdup_n_u8(0xf8));
+        g = vand_u8(g, vdup_n_u8(0xfc));
+        uint8x8x3_t d = { { vorr_u8(r, vshr_n_u8(r, 5)), vorr_u8(g, vshr_n_u8(g, 6)), vorr_u8(b, vshr_n_u8(b, 5)) } };
+        vst3_u8(dst + i * 3, d);
+    }
+#endif
+    for (; i < count; i++) {
+        uint16_t px;
+        memcpy(&px, src + i * 2, 2);
+        unsigned r = px >> 11, g = (px >> 5) & 0x3f, b = px & 0x1f;
+        unsigned char* d = dst + i * 3;
+        d[0] = (r << 3) | (r >> 2);
+        d[1] = (g << 2) | (g >> 4);
+        d[2] = (b << 3) | (b >> 2);
+    }
+}
+
+void gr_fast_swap_rb_row(unsigned char* px, int count)
+{
+    int i = 0;
+#ifdef HAVE_NEON_KERNELS
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t p = vld4_u8(px + i * 4);
+        swap_rb(p);
+        vst4_u8(px + i * 4, p);
+    }
+#endif
+    for (; i < count; i++) {
+        unsigned char* p = px + i * 4;
+        unsigned char tmp = p[0];
+        p[0] = p[2];
+        p[2] = tmp;
+    }
+}
+
+void gr_fast_reverse_row(unsigned char* dst, const unsigned char* src, int count, int pixel_bytes)
+{
+    int i = 0;
+    if (pixel_bytes == 4) {
+        const uint32_t* s = reinterpret_cast<const uint32_t*>(src) + count;
+        uint32_t* d = reinterpret_cast<uint32_t*>(dst);
+#ifdef HAVE_NEON_KERNELS
+        for (; i + 4 <= count; i += 4) {
+            uint32x4_t p = vrev64q_u32(vld1q_u32(s - i - 4));
+            vst1q_u32(d + i, vcombine_u32(vget_high_u32(p), vget_low_u32(p)));
+        }
+#endif
+        for (; i < count; i++)
+            d[i] = *(s - i - 1);
+    } else {
+        const uint16_t* s = reinterpret_cast<const uint16_t*>(src) + count;
+        uint16_t* d = reinterpret_cast<uint16_t*>(dst);
+#ifdef HAVE_NEON_KERNELS
+        for (; i + 8 <= count; i += 8) {
+            uint16x8_t p = vrev64q_u16(vld1q_u16(s - i - 8));
+            vst1q_u16(d + i, vcombine_u16(vget_high_u16(p), vget_low_u16(p)));
+        }
+#endif
+        for (; i < count; i++)
+            d[i] = *(s - i - 1);
+    }
+}
+
+// Weights of the source pixels behind each destination pixel along one axis
+// in 2.14 fixed point, each run summing to exactly 1 << 14
+struct scale_taps {
+    int* start;
+    int* count;
+    uint16_t* weights; // max_count per destination pixel
+    int max_count;
+};
+
+#define SCALE_ONE (1 << 14)
+
+static void free_taps(scale_taps* t)
+{
+    free(t->start);
+    free(t->count);
+    free(t->weights);
+}
+
+static bool init_taps(scale_taps* t, int src_len, int dst_len)
+{
+    double ratio = (double)src_len / dst_len;
+    // Bilinear when enlarging, the average of the covered area when shrinking
+    bool area = ratio > 1.0;
+    t->max_count = area ? (int)ratio + 2 : 2;
+    t->start = (int*)malloc(dst_len * sizeof(int));
+    t->count = (int*)malloc(dst_len * sizeof(int));
+    t->weights = (uint16_t*)malloc((size_t)dst_len * t->max_count * sizeof(uint16_t));
+    if (!t->start || !t->count || !t->weights) {
+        free_taps(t);
+        return false;
+    }
+
+    for (int i = 0; i < dst_len; i++) {
+        uint16_t* w = t->weights + i * t->max_count;
+        int first, n = 0;
+        if (area) {
+            double lo = i * ratio, hi = (i + 1) * ratio;
+            if (hi > src_len)
+                hi = src_len;
+            first = (int)lo;
+            int sum = 0, largest = 0;
+            for (int s = first; s < hi && n < t->max_count; s++, n++) {
+                double a = (s < lo ? s + 1 - lo : (s + 1 > hi ? hi - s : 1.0));
+                w[n] = (uint16_t)(a / ratio * SCALE_ONE + 0.5);
+                sum += w[n];
+                if (w[n] > w[largest])
+                    largest = n;
+            }
+            w[largest] += SCALE_ONE - sum;
+        } else {
+            double center = (i + 0.5) * ratio - 0.5;
+            if (center < 0)
+                center = 0;
+            first = (int)center;
+            if (first >= src_len - 1) {
+                first = src_len - 1;
+                center = first;
+            }
+            w[0] = (uint16_t)((1.0 - (center - first)) * SCALE_ONE + 0.5);
+            w[1] = SCALE_ONE - w[0];
+            n = w[1] ? 2 : 1;
+        }
+        t->start[i] = first;
+        t->count[i] = n;
+    }
+    return true;
+}
+
+// dst[x] = sum of rows[k][x] * weights[k] over count bytes
+static void scale_rows(unsigned char* dst, const unsigned char* const* rows, const uint16_t* weights, int rows_count, int count)
+{
+    int x = 0;
+#ifdef HAVE_NEON_KERNELS
+    for (; x + 8 <= count; x += 8) {
+        uint32x4_t lo = vdupq_n_u32(0), hi = vdupq_n_u32(0);
+        for (int k = 0; k < rows_count; k++) {
+            uint16x8_t px = vmovl_u8(vld1_u8(rows[k] + x));
+            lo = vmlal_n_u16(lo, vget_low_u16(px), weights[k]);
+            hi = vmlal_n_u16(hi, vget_high_u16(px), weights[k]);
+        }
+        uint16x8_t sum = vcombine_u16(vqrshrn_n_u32(lo, 14), vqrshrn_n_u32(hi, 14));
+        vst1_u8(dst + x, vqmovn_u16(sum));
+    }
+#endif
+    for (; x < count; x++) {
+        unsigned sum = SCALE_ONE / 2;
+        for (int k = 0; k < rows_count; k++)
+            sum += rows[k][x] * weights[k];
+        sum >>= 14;
+        dst[x] = sum > 255 ? 255 : sum;
+    }
+}
+
+// Filters one row of 32 bpp pixels horizontally
+static void scale_columns(unsigned char* dst, const unsigned char* src, const scale_taps* t, int count)
+{
+    for (int i = 0; i < count; i++) {
+        const unsigned char* s = src + t->start[i] * 4;
+        const uint16_t* w = t->weights + i * t->max_count;
+        int n = t->count[i];
+#ifdef HAVE_NEON_KERNELS
+        uint32x4_t acc = vdupq_n_u32(0);
+        for (int k = 0; k < n; k++) {
+            uint32_t p;
+            memcpy(&p, s + k * 4, 4);
+            uint16x4_t px = vget_low_u16(vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(p))));
+            acc = vmlal_n_u16(acc, px, w[k]);
+        }
+        uint16x4_t sum = vqrshrn_n_u32(acc, 14);
+        uint32_t out = vget_lane_u32(vreinterpret_u32_u8(vqmovn_u16(vcombine_u16(sum, sum))), 0);
+        memcpy(dst + i * 4, &out, 4);
+#else
+        for (int c = 0; c < 4; c++) {
+            unsigned sum = SCALE_ONE / 2;
+            for (int k = 0; k < n; k++)
+                sum += s[k * 4 + c] * w[k];
+            sum >>= 14;
+            dst[i * 4 + c] = sum > 255 ? 255 : sum;
+        }
+#endif
+    }
+}
+
+bool gr_fast_scale(unsigned char* dst, int dst_w, int dst_h, int dst_stride,
+                   const unsigned char* src, int src_w, int src_h, int src_stride)
+{
+    if (dst_w <= 0 || dst_h <= 0 || src_w <= 0 || src_h <= 0)
+        return false;
+
+    scale_taps tx, ty;
+    if (!init_taps(&tx, src_w, dst_w))
+        return false;
+    if (!init_taps(&ty, src_h, dst_h)) {
+        free_taps(&tx);
+        return false;
+    }
+    // The vertical pass goes straight to dst if the width stays the same
+    bool same_width = (src_w == dst_w);
+    unsigned char* row = same_width ? NULL : (unsigned char*)malloc(src_w * 4);
+    const unsigned char** rows = (const unsigned char**)malloc(ty.max_count * sizeof(*rows));
+    bool ok = rows && (same_width || row);
+    for (int y = 0; ok && y < dst_h; y++) {
+        unsigned char* out = dst + (size_t)y * dst_stride;
+        int n = ty.count[y];
+        for (int k = 0; k < n; k++)
+            rows[k] = src + (size_t)(ty.start[y] + k) * src_stride;
+        const uint16_t* w = ty.weights + y * ty.max_count;
+        unsigned char* target = same_width ? out : row;
+        if (n == 1)
+            memcpy(target, rows[0], src_w * 4);
+        else
+            scale_rows(target, rows, w, n, src_w * 4);
+        if (!same_width)
+            scale_columns(out, row, &tx, dst_w);
+    }
+    free(rows);
+    free(row);
+    free_taps(&tx);
+    free_taps(&ty);
+    return ok;
+}
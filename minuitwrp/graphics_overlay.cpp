@@ -491,15 +491,7 @@ int overlay_display_frame(int fd, void* data, size_t size)
 static GRSurface* overlay_flip(minui_backend* backend __unused) {
 #if defined(RECOVERY_BGRA)
     // In case of BGRA, do some byte swapping
-    unsigned int idx;
-    unsigned char tmp;
-    unsigned char* ucfb_vaddr = (unsigned char*)gr_draw->data;
-    for (idx = 0 ; idx < (gr_draw->height * gr_draw->row_bytes);
-            idx += 4) {
-        tmp = ucfb_vaddr[idx];
-        ucfb_vaddr[idx    ] = ucfb_vaddr[idx + 2];
-        ucfb_vaddr[idx + 2] = tmp;
-    }
+    gr_fast_swap_rb_row(gr_draw->data, gr_draw->height * gr_draw->row_bytes / 4);
 #endif
     // Copy from the in-memory surface to the framebuffer.
     overlay_display_frame(fb_fd, gr_draw->data, frame_size);
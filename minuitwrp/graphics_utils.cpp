@@ -16,43 +16,65 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <png.h>
 #include <pixelflinger/pixelflinger.h>
 #include <linux/fb.h>
 
 #include "minui.h"
+#include "graphics.h"
+
+// Copies of the screen allowed to wait for the encoder at once, further
+// screenshots are encoded by the caller
+#define SCREENSHOT_MAX_PENDING 2
 
 struct fb_var_screeninfo vi;
 extern GGLSurface gr_mem_surface;
 extern GRSurface* gr_draw;
+extern void gr_prepare_draw(bool overwrite);
+
+struct screenshot {
+    char *dest;
+    FILE *fp;
+    uint8_t *data;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride_bytes;
+    int format; // GGL_PIXEL_FORMAT_* of data
+    gr_screenshot_done done;
+    void *cookie;
+};
+
+static int screenshots_pending = 0;
+
+static void free_screenshot(struct screenshot *shot)
+{
+    if (shot->fp)
+        fclose(shot->fp);
+    free(shot->data);
+    free(shot->dest);
+    free(shot);
+}
 
-int gr_save_screenshot(const char *dest)
+// Converts a copy of the screen that is not in one of the formats below to
+// RGBA through pixelflinger
+static bool convert_screenshot(struct screenshot *shot)
 {
-    uint32_t y, stride_bytes;
-    volatile int res = -1;
     GGLContext *gl = NULL;
     GGLSurface surface;
-    uint8_t * volatile img_data = NULL;
-    uint8_t *ptr;
-    FILE * volatile fp = NULL;
-    png_structp png_ptr = NULL;
-    png_infop info_ptr = NULL;
-
-    fp = fopen(dest, "wb");
-    if(!fp)
-        goto exit;
 
-    img_data = (uint8_t *)malloc(gr_mem_surface.stride * gr_mem_surface.height * gr_draw->pixel_bytes);
-    if (!img_data) {
-        printf("gr_save_screenshot failed to malloc img_data\n");
-        goto exit;
-    }
+    shot->stride_bytes = gr_mem_surface.stride * 4;
+    shot->data = (uint8_t *)malloc(shot->stride_bytes * shot->height);
+    if (!shot->data)
+        return false;
     surface.version = sizeof(surface);
     surface.width = gr_mem_surface.width;
     surface.height = gr_mem_surface.height;
     surface.stride = gr_mem_surface.stride;
-    surface.data = img_data;
+    surface.data = shot->data;
     surface.format = GGL_PIXEL_FORMAT_RGBA_8888;
+    shot->format = GGL_PIXEL_FORMAT_RGBA_8888;
 
     gglInit(&gl);
     gl->colorBuffer(gl, &surface);
@@ -70,7 +92,77 @@ int gr_save_screenshot(const char *dest)
     gl->recti(gl, 0, 0, gr_mem_surface.width, gr_mem_surface.height);
 
     gglUninit(gl);
-    gl = NULL;
+    return true;
+}
+
+// Opens dest and copies the drawing surface, which holds the last frame,
+// with one memcpy. Everything else is left to encode_screenshot so it can
+// run on another thread.
+static struct screenshot *capture_screenshot(const char *dest)
+{
+    struct screenshot *shot = (struct screenshot *)calloc(1, sizeof(*shot));
+    if (!shot)
+        return NULL;
+    shot->dest = strdup(dest);
+    shot->fp = fopen(dest, "wb");
+    if (!shot->dest || !shot->fp) {
+        free_screenshot(shot);
+        return NULL;
+    }
+
+    gr_prepare_draw(false);
+    shot->width = gr_mem_surface.width;
+    shot->height = gr_mem_surface.height;
+    shot->format = gr_mem_surface.format;
+    switch (shot->format) {
+        case GGL_PIXEL_FORMAT_RGBA_8888:
+        case GGL_PIXEL_FORMAT_RGBX_8888:
+        case GGL_PIXEL_FORMAT_BGRA_8888:
+        case GGL_PIXEL_FORMAT_RGB_565:
+            shot->stride_bytes = gr_mem_surface.stride * gr_draw->pixel_bytes;
+            shot->data = (uint8_t *)malloc(shot->stride_bytes * shot->height);
+            if (shot->data)
+                memcpy(shot->data, gr_mem_surface.data, shot->stride_bytes * shot->height);
+            break;
+        default:
+            convert_screenshot(shot);
+            break;
+    }
+    if (!shot->data) {
+        printf("gr_save_screenshot failed to malloc img_data\n");
+        free_screenshot(shot);
+        return NULL;
+    }
+    return shot;
+}
+
+static void screenshot_rgb_row(const struct screenshot *shot, uint32_t y, uint8_t *row)
+{
+    const uint8_t *src = shot->data + y * shot->stride_bytes;
+    switch (shot->format) {
+        case GGL_PIXEL_FORMAT_RGB_565:
+            gr_fast_565_to_rgb_row(row, src, shot->width);
+            break;
+        case GGL_PIXEL_FORMAT_BGRA_8888:
+            gr_fast_rgb_row(row, src, shot->width, true);
+            break;
+        default:
+            gr_fast_rgb_row(row, src, shot->width, false);
+            break;
+    }
+}
+
+static int encode_screenshot(struct screenshot *shot)
+{
+    uint32_t y;
+    volatile int res = -1;
+    uint8_t * volatile row = NULL;
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+
+    row = (uint8_t *)malloc(shot->width * 3);
+    if (!row)
+        goto exit;
 
     png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png_ptr)
@@ -83,21 +175,20 @@ int gr_save_screenshot(const char *dest)
     if (setjmp(png_jmpbuf(png_ptr)))
         goto exit;
 
-    png_init_io(png_ptr, fp);
-    png_set_IHDR(png_ptr, info_ptr, surface.width, surface.height,
+    png_init_io(png_ptr, shot->fp);
+    // Screens are mostly flat areas and text, which compress about as well
+    // with the fastest zlib level and the cheap SUB filter
+    png_set_compression_level(png_ptr, 1);
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+    png_set_IHDR(png_ptr, info_ptr, shot->width, shot->height,
          8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
          PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
     png_write_info(png_ptr, info_ptr);
 
-    // To remove the alpha channel for PNG_COLOR_TYPE_RGB format,
-    png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
-
-    ptr = img_data;
-    stride_bytes = surface.stride*4;
-    for(y = 0; y < surface.height; ++y)
+    for(y = 0; y < shot->height; ++y)
     {
-        png_write_row(png_ptr, ptr);
-        ptr += stride_bytes;
+        screenshot_rgb_row(shot, y, row);
+        png_write_row(png_ptr, row);
     }
 
     png_write_end(png_ptr, NULL);
@@ -108,11 +199,54 @@ exit:
         png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
     if(png_ptr)
         png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-    if(gl)
-        gglUninit(gl);
-    if(img_data)
-        free(img_data);
-    if(fp)
-        fclose(fp);
+    free(row);
+    if (shot->fp) {
+        if (fclose(shot->fp) != 0)
+            res = -1;
+        shot->fp = NULL;
+    }
     return res;
 }
+
+static void *screenshot_thread(void *cookie)
+{
+    struct screenshot *shot = (struct screenshot *)cookie;
+    int res = encode_screenshot(shot);
+    if (shot->done)
+        shot->done(shot->dest, res, shot->cookie);
+    free_screenshot(shot);
+    __atomic_sub_fetch(&screenshots_pending, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+int gr_save_screenshot(const char *dest)
+{
+    struct screenshot *shot = capture_screenshot(dest);
+    if (!shot)
+        return -1;
+    int res = encode_screenshot(shot);
+    free_screenshot(shot);
+    return res;
+}
+
+int gr_save_screenshot_async(const char *dest, gr_screenshot_done done, void *cookie)
+{
+    struct screenshot *shot = capture_screenshot(dest);
+    if (!shot)
+        return -1;
+    shot->done = done;
+    shot->cookie = cookie;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    bool started = false;
+    if (__atomic_add_fetch(&screenshots_pending, 1, __ATOMIC_SEQ_CST) <= SCREENSHOT_MAX_PENDING) {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        started = (pthread_create(&thread, &attr, screenshot_thread, shot) == 0);
+        pthread_attr_destroy(&attr);
+    }
+    if (!started)
+        screenshot_thread(shot);
+    return 0;
+}
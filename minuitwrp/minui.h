@@ -37,16 +37,23 @@ typedef unsigned short gr_pixel;
 
 int gr_init(void);
 void gr_exit(void);
+// Makes gr_init draw into a width x height surface in memory instead of the
+// display, for benchmarks
+void gr_use_memory(int width, int height);
 
 int gr_fb_width(void);
 int gr_fb_height(void);
 gr_pixel *gr_fb_data(void);
 void gr_flip(void);
+void gr_flip_region(int x, int y, int w, int h);
+int gr_has_flip_region(void);
 void gr_fb_blank(bool blank);
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_clip(int x, int y, int w, int h);
 void gr_noclip();
+void gr_set_damage_clip(int x, int y, int w, int h);
+void gr_clear_damage_clip(void);
 void gr_fill(int x, int y, int w, int h);
 void gr_line(int x0, int y0, int x1, int y1, int width);
 gr_surface gr_render_circle(int radius, unsigned char r, unsigned char g, unsigned char b, unsigned char a);
@@ -72,6 +79,11 @@ int gr_free_surface(gr_surface surface);
 
 // Functions in graphics_utils.c
 int gr_save_screenshot(const char *dest);
+// Copies the screen right away and writes the PNG on a background thread,
+// which calls done with the result (0 on success). Returns -1 if the screen
+// could not be copied, done is not called then.
+typedef void (*gr_screenshot_done)(const char *dest, int res, void *cookie);
+int gr_save_screenshot_async(const char *dest, gr_screenshot_done done, void *cookie);
 
 // input event structure, include <linux/input.h> for the definition.
 // see http://www.mjmwired.net/kernel/Documentation/input/ for info.
@@ -80,6 +92,10 @@ struct input_event;
 int ev_init(void);
 void ev_exit(void);
 int ev_get(struct input_event *ev, int timeout_ms);
+// Waits up to timeout_ms for an input device or one of the extra fds to be
+// readable; fills in the revents of extra and returns the result of poll().
+struct pollfd;
+int ev_poll(struct pollfd *extra, unsigned extra_count, int timeout_ms);
 int ev_has_mouse(void);
 
 // Resources
@@ -88,6 +104,8 @@ int ev_has_mouse(void);
 int res_create_surface(const char* name, gr_surface* pSurface);
 void res_free_surface(gr_surface surface);
 int res_scale_surface(gr_surface source, gr_surface* destination, float scale_w, float scale_h);
+// Channel order res_create_surface decodes images to, "rgba" or "bgra"
+const char* res_pixel_order(void);
 
 int vibrate(int timeout_ms);
 
@@ -37,6 +37,7 @@ extern "C" {
 }
 #endif
 #include "minui.h"
+#include "graphics.h"
 
 #define SURFACE_DATA_ALIGNMENT 8
 
@@ -169,30 +170,15 @@ static GGLSurface* init_display_surface(png_uint_32 width, png_uint_32 height) {
 static void transform_rgb_to_draw(unsigned char* input_row,
                                   unsigned char* output_row,
                                   int channels, int width) {
-    int x;
-    unsigned char* ip = input_row;
-    unsigned char* op = output_row;
-
     switch (channels) {
         case 1:
             // expand gray level to RGBX
-            for (x = 0; x < width; ++x) {
-                *op++ = *ip;
-                *op++ = *ip;
-                *op++ = *ip;
-                *op++ = 0xff;
-                ip++;
-            }
+            gr_fast_gray_row(output_row, input_row, width);
             break;
 
         case 3:
-            // expand RGBA to RGBX
-            for (x = 0; x < width; ++x) {
-                *op++ = *ip++;
-                *op++ = *ip++;
-                *op++ = *ip++;
-                *op++ = 0xff;
-            }
+            // expand RGB to RGBX
+            gr_fast_rgbx_row(output_row, input_row, width, false);
             break;
 
         case 4:
@@ -228,16 +214,22 @@ int res_create_surface_png(const char* name, gr_surface* pSurface) {
     png_set_bgr(png_ptr);
 #endif
 
-    p_row = reinterpret_cast<unsigned char*>(malloc(width * 4));
-    if (p_row == NULL) {
-        result = -9;
-        goto exit;
-    }
-    for (y = 0; y < height; ++y) {
-        png_read_row(png_ptr, p_row, NULL);
-        transform_rgb_to_draw(p_row, surface->data + y * width * 4, channels, width);
+    if (channels == 4) {
+        // already in the surface format, so decode straight into it
+        for (y = 0; y < height; ++y)
+            png_read_row(png_ptr, surface->data + y * width * 4, NULL);
+    } else {
+        p_row = reinterpret_cast<unsigned char*>(malloc(width * 4));
+        if (p_row == NULL) {
+            result = -9;
+            goto exit;
+        }
+        for (y = 0; y < height; ++y) {
+            png_read_row(png_ptr, p_row, NULL);
+            transform_rgb_to_draw(p_row, surface->data + y * width * 4, channels, width);
+        }
+        free(p_row);
     }
-    free(p_row);
 
     if (channels == 3)
         surface->format = GGL_PIXEL_FORMAT_RGBX_8888;
@@ -260,6 +252,7 @@ int res_create_surface_jpg(const char* name, gr_surface* pSurface) {
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr jerr;
     unsigned char* pData;
+    unsigned char* pRow = NULL;
     size_t width, height, stride, pixelSize;
 
     FILE* fp = fopen(name, "rb");
@@ -308,34 +301,23 @@ int res_create_surface_jpg(const char* name, gr_surface* pSurface) {
     surface->data = pData;
     surface->format = GGL_PIXEL_FORMAT_RGBX_8888;
 
+    pRow = reinterpret_cast<unsigned char*>(malloc(width * 3));
+    if (pRow == NULL) {
+        result = -9;
+        goto exit;
+    }
     for (y = 0; y < (int) height; ++y) {
-        unsigned char* pRow = pData + y * stride;
         jpeg_read_scanlines(&cinfo, &pRow, 1);
-
-        int x;
-        for(x = width - 1; x >= 0; x--) {
-            int sx = x * 3;
-            int dx = x * 4;
-            unsigned char r = pRow[sx];
-            unsigned char g = pRow[sx + 1];
-            unsigned char b = pRow[sx + 2];
-            unsigned char a = 0xff;
 #if defined(RECOVERY_ABGR) || defined(RECOVERY_BGRA)
-            pRow[dx    ] = b; // r
-            pRow[dx + 1] = g; // g
-            pRow[dx + 2] = r; // b
-            pRow[dx + 3] = a;
+        gr_fast_rgbx_row(pData + y * stride, pRow, width, true);
 #else
-            pRow[dx    ] = r; // r
-            pRow[dx + 1] = g; // g
-            pRow[dx + 2] = b; // b
-            pRow[dx + 3] = a;
+        gr_fast_rgbx_row(pData + y * stride, pRow, width, false);
 #endif
-        }
     }
     *pSurface = (gr_surface) surface;
 
 exit:
+    free(pRow);
     if (fp != NULL)
     {
         if (surface)
@@ -372,6 +354,14 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
     return ret;
 }
 
+const char* res_pixel_order(void) {
+#if defined(RECOVERY_ABGR) || defined(RECOVERY_BGRA)
+    return "bgra";
+#else
+    return "rgba";
+#endif
+}
+
 void res_free_surface(gr_surface surface) {
     GGLSurface* pSurface = (GGLSurface*) surface;
     if (pSurface) {
@@ -398,6 +388,16 @@ int res_scale_surface(gr_surface source, gr_surface* destination, float scale_w,
     }
     sc_mem_surface->format = surface->format;
 
+    // Theme images are 32 bpp, which doesn't need pixelflinger's texture path
+    if ((surface->format == GGL_PIXEL_FORMAT_RGBX_8888 || surface->format == GGL_PIXEL_FORMAT_RGBA_8888 ||
+            surface->format == GGL_PIXEL_FORMAT_BGRA_8888) &&
+            gr_fast_scale(sc_mem_surface->data, sc_mem_surface->width, sc_mem_surface->height, sc_mem_surface->stride * 4,
+                          surface->data, w, h, surface->stride * 4)) {
+        *destination = (gr_surface*) sc_mem_surface;
+        res_free_surface(source);
+        return 0;
+    }
+
     // Initialize the context
     gglInit(&gl);
     gl->colorBuffer(gl, sc_mem_surface);
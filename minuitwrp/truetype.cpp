@@ -3,20 +3,31 @@
 #include <unistd.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "minui.h"
+#include "graphics.h"
 
 #include <cutils/hashmap.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_GLYPH_H
+#include FT_SIZES_H
 
 #include <pixelflinger/pixelflinger.h>
 #include <pthread.h>
+#include <vector>
 
-#define STRING_CACHE_MAX_ENTRIES 400
-#define STRING_CACHE_TRUNCATE_ENTRIES 150
+#define LAYOUT_CACHE_MAX_ENTRIES 256
+
+// Glyphs of one font are packed into a single alpha-8 atlas, row by row.
+// It grows in height until GLYPH_ATLAS_MAX_BYTES and starts over when full.
+#define GLYPH_ATLAS_MIN_WIDTH 512
+#define GLYPH_ATLAS_MIN_HEIGHT 64
+#define GLYPH_ATLAS_MAX_BYTES (2*1024*1024)
 
 typedef struct
 {
@@ -25,6 +36,19 @@ typedef struct
     char *path;
 } TrueTypeFontKey;
 
+// A font file mapped once and opened as one FT_Face, shared by every size
+// loaded from it. The face is used by one size at a time, the mutex is held
+// while a size is active.
+typedef struct
+{
+    char *path;
+    int refcount;
+    void *data;
+    size_t length;
+    FT_Face face;
+    pthread_mutex_t mutex;
+} TrueTypeFile;
+
 typedef struct
 {
     int type;
@@ -33,12 +57,19 @@ typedef struct
     int dpi;
     int max_height;
     int base;
-    FT_Face face;
+    TrueTypeFile *file;
+    FT_Face face; // file->face, used with gr_ttf_lock held
+    FT_Size ft_size;
+    Hashmap *scaled; // smaller sizes of the same font made by gr_ttf_scaleFont, by size
     Hashmap *glyph_cache;
-    Hashmap *string_cache;
-    struct StringCacheEntry *string_cache_head;
-    struct StringCacheEntry *string_cache_tail;
-    pthread_mutex_t mutex;
+    Hashmap *layout_cache;
+    struct LayoutCacheEntry *layout_cache_head;
+    struct LayoutCacheEntry *layout_cache_tail;
+    GGLSurface atlas;
+    int atlas_x; // packing cursor within the current shelf
+    int atlas_y; // top of the current shelf
+    int atlas_shelf_h;
+    unsigned atlas_gen; // bumped whenever the atlas starts over
     TrueTypeFontKey *key;
 } TrueTypeFont;
 
@@ -46,6 +77,9 @@ typedef struct
 {
     FT_BBox bbox;
     FT_BitmapGlyph glyph;
+    int atlas_x;
+    int atlas_y;
+    unsigned atlas_gen; // glyph is in the atlas only if this matches the font's
 } TrueTypeCacheEntry;
 
 typedef struct
@@ -54,27 +88,41 @@ typedef struct
     int max_width;
 } StringCacheKey;
 
-struct StringCacheEntry
+typedef struct
+{
+    TrueTypeCacheEntry *glyph;
+    int x; // pen position of the glyph origin
+} LayoutGlyph;
+
+// Glyph positions of one line. Evicted entries are reused in place, so a
+// steady stream of new lines (console, terminal) does not hit malloc.
+struct LayoutCacheEntry
 {
-    GGLSurface surface;
+    StringCacheKey key; // key.text is owned, text_cap bytes long
+    size_t text_cap;
+    LayoutGlyph *glyphs;
+    int glyph_count;
+    int glyph_cap;
+    int width;
     int rendered_bytes; // number of bytes from C string rendered, not number of UTF8 characters!
-    StringCacheKey *key;
-    struct StringCacheEntry *prev;
-    struct StringCacheEntry *next;
+    struct LayoutCacheEntry *prev;
+    struct LayoutCacheEntry *next;
 };
 
-typedef struct StringCacheEntry StringCacheEntry;
+typedef struct LayoutCacheEntry LayoutCacheEntry;
 
 typedef struct
 {
     FT_Library ft_library;
     Hashmap *fonts;
+    Hashmap *files;
     pthread_mutex_t mutex;
 } FontData;
 
 static FontData font_data = {
     .ft_library = NULL,
     .fonts = NULL,
+    .files = NULL,
     .mutex = PTHREAD_MUTEX_INITIALIZER,
 };
 
@@ -155,14 +203,14 @@ int utf8_to_unicode(const char* pIn, unsigned int *pOut)
     return utf_bytes;
 }
 
-static bool gr_ttf_string_cache_equals(void *keyA, void *keyB)
+static bool gr_ttf_layout_cache_equals(void *keyA, void *keyB)
 {
     StringCacheKey *a = (StringCacheKey *)keyA;
     StringCacheKey *b = (StringCacheKey *)keyB;
     return a->max_width == b->max_width && strcmp(a->text, b->text) == 0;
 }
 
-static int gr_ttf_string_cache_hash(void *key)
+static int gr_ttf_layout_cache_hash(void *key)
 {
     StringCacheKey *k = (StringCacheKey *)key;
     return fnv_hash(k->text, strlen(k->text));
@@ -185,11 +233,117 @@ static int gr_ttf_font_cache_hash(void *key)
     return hash;
 }
 
+static bool gr_ttf_file_cache_equals(void *keyA, void *keyB)
+{
+    return strcmp((char *)keyA, (char *)keyB) == 0;
+}
+
+static int gr_ttf_file_cache_hash(void *key)
+{
+    return fnv_hash(key, strlen((char *)key));
+}
+
+// Called with font_data.mutex held
+static TrueTypeFile *gr_ttf_openFile(const char *filename)
+{
+    TrueTypeFile *file = NULL;
+    struct stat st;
+    void *data;
+    int fd, error;
+    FT_Face face;
+
+    if(font_data.files)
+    {
+        file = (TrueTypeFile *)hashmapGet(font_data.files, (void *)filename);
+        if(file)
+        {
+            ++file->refcount;
+            return file;
+        }
+    }
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Failed to open truetype font %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        fprintf(stderr, "Failed to stat truetype font %s\n", filename);
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map truetype font %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+
+    error = FT_New_Memory_Face(font_data.ft_library, (const FT_Byte *)data, st.st_size, 0, &face);
+    if(error)
+    {
+        fprintf(stderr, "Failed to load truetype face %s: %d\n", filename, error);
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    file = (TrueTypeFile *)malloc(sizeof(TrueTypeFile));
+    memset(file, 0, sizeof(TrueTypeFile));
+    file->path = strdup(filename);
+    file->refcount = 1;
+    file->data = data;
+    file->length = st.st_size;
+    file->face = face;
+    pthread_mutex_init(&file->mutex, 0);
+
+    if(!font_data.files)
+        font_data.files = hashmapCreate(4, gr_ttf_file_cache_hash, gr_ttf_file_cache_equals);
+    hashmapPut(font_data.files, file->path, file);
+    return file;
+}
+
+// Called with font_data.mutex held
+static void gr_ttf_closeFile(TrueTypeFile *file)
+{
+    if(--file->refcount > 0)
+        return;
+
+    hashmapRemove(font_data.files, file->path);
+    if(hashmapSize(font_data.files) == 0)
+    {
+        hashmapFree(font_data.files);
+        font_data.files = NULL;
+    }
+
+    FT_Done_Face(file->face);
+    munmap(file->data, file->length);
+    pthread_mutex_destroy(&file->mutex);
+    free(file->path);
+    free(file);
+}
+
+// Takes the face of the font's file and makes the font's size the active one
+static void gr_ttf_lock(TrueTypeFont *f)
+{
+    pthread_mutex_lock(&f->file->mutex);
+    FT_Activate_Size(f->ft_size);
+}
+
+static void gr_ttf_unlock(TrueTypeFont *f)
+{
+    pthread_mutex_unlock(&f->file->mutex);
+}
+
 void *gr_ttf_loadFont(const char *filename, int size, int dpi)
 {
     int error;
     TrueTypeFont *res = NULL;
     TrueTypeFontKey *key = NULL;
+    TrueTypeFile *file;
+    FT_Size ft_size;
 
     pthread_mutex_lock(&font_data.mutex);
 
@@ -219,19 +373,24 @@ void *gr_ttf_loadFont(const char *filename, int size, int dpi)
         }
     }
 
-    FT_Face face;
-    error = FT_New_Face(font_data.ft_library, filename, 0, &face);
-    if(error)
-    {
-        fprintf(stderr, "Failed to load truetype face %s: %d\n", filename, error);
+    file = gr_ttf_openFile(filename);
+    if(!file)
         goto exit;
-    }
 
-    error = FT_Set_Char_Size(face, 0, size*16, dpi, dpi);
+    pthread_mutex_lock(&file->mutex);
+    error = FT_New_Size(file->face, &ft_size);
+    if(!error)
+    {
+        FT_Activate_Size(ft_size);
+        error = FT_Set_Char_Size(file->face, 0, size*16, dpi, dpi);
+        if(error)
+            FT_Done_Size(ft_size);
+    }
+    pthread_mutex_unlock(&file->mutex);
     if(error)
     {
          fprintf(stderr, "Failed to set truetype face size to %d, dpi %d: %d\n", size, dpi, error);
-         FT_Done_Face(face);
+         gr_ttf_closeFile(file);
          goto exit;
     }
 
@@ -240,13 +399,17 @@ void *gr_ttf_loadFont(const char *filename, int size, int dpi)
     res->type = FONT_TYPE_TTF;
     res->size = size;
     res->dpi = dpi;
-    res->face = face;
+    res->file = file;
+    res->face = file->face;
+    res->ft_size = ft_size;
     res->max_height = -1;
     res->base = -1;
     res->refcount = 1;
     res->glyph_cache = hashmapCreate(32, hashmapIntHash, hashmapIntEquals);
-    res->string_cache = hashmapCreate(128, gr_ttf_string_cache_hash, gr_ttf_string_cache_equals);
-    pthread_mutex_init(&res->mutex, 0);
+    res->layout_cache = hashmapCreate(128, gr_ttf_layout_cache_hash, gr_ttf_layout_cache_equals);
+    res->atlas.version = sizeof(res->atlas);
+    res->atlas.format = GGL_PIXEL_FORMAT_A_8;
+    res->atlas_gen = 1;
 
     if(!font_data.fonts)
         font_data.fonts = hashmapCreate(4, gr_ttf_font_cache_hash, gr_ttf_font_cache_equals);
@@ -276,9 +439,39 @@ void *gr_ttf_scaleFont(void *font, int max_width, int measured_width)
     int new_size = ((int)((float)f->size * scale_value)) - 1;
     if (new_size < 1)
         new_size = 1;
-    const char* file = f->key->path;
-    int dpi = f->dpi;
-    return gr_ttf_loadFont(file, new_size, dpi);
+    if (new_size == f->size)
+        return font;
+
+    // The scaled font is kept with the font it came from, drawing the same
+    // text again finds it without taking another reference
+    pthread_mutex_lock(&font_data.mutex);
+    TrueTypeFont *res = f->scaled ? (TrueTypeFont *)hashmapGet(f->scaled, &new_size) : NULL;
+    pthread_mutex_unlock(&font_data.mutex);
+    if (res)
+        return res;
+
+    res = (TrueTypeFont *)gr_ttf_loadFont(f->key->path, new_size, f->dpi);
+    if (!res)
+        return NULL;
+
+    pthread_mutex_lock(&font_data.mutex);
+    if (!f->scaled)
+        f->scaled = hashmapCreate(4, hashmapIntHash, hashmapIntEquals);
+    TrueTypeFont *had = (TrueTypeFont *)hashmapGet(f->scaled, &new_size);
+    if (!had)
+    {
+        int *key = (int *)malloc(sizeof(int));
+        *key = new_size;
+        hashmapPut(f->scaled, key, res);
+    }
+    pthread_mutex_unlock(&font_data.mutex);
+    if (had)
+    {
+        // Another thread scaled it meanwhile
+        gr_ttf_freeFont(res);
+        res = had;
+    }
+    return res;
 }
 
 static bool gr_ttf_freeFontCache(void *key, void *value, void *context __unused)
@@ -290,20 +483,27 @@ static bool gr_ttf_freeFontCache(void *key, void *value, void *context __unused)
     return true;
 }
 
-static bool gr_ttf_freeStringCache(void *key, void *value, void *context __unused)
+static bool gr_ttf_freeLayoutCache(void *key __unused, void *value, void *context __unused)
 {
-    StringCacheKey *k = (StringCacheKey *)key;
-    free(k->text);
-    free(k);
-
-    StringCacheEntry *e = (StringCacheEntry *)value;
-    free(e->surface.data);
+    LayoutCacheEntry *e = (LayoutCacheEntry *)value;
+    free(e->key.text);
+    free(e->glyphs);
     free(e);
     return true;
 }
 
+static bool gr_ttf_freeScaled(void *key, void *value, void *context)
+{
+    std::vector<void *> *fonts = (std::vector<void *> *)context;
+    fonts->push_back(value);
+    free(key);
+    return true;
+}
+
 void gr_ttf_freeFont(void *font)
 {
+    std::vector<void *> scaled;
+
     pthread_mutex_lock(&font_data.mutex);
 
     TrueTypeFont *d = (TrueTypeFont *)font;
@@ -321,16 +521,28 @@ void gr_ttf_freeFont(void *font)
         free(d->key->path);
         free(d->key);
 
-        FT_Done_Face(d->face);
-        hashmapForEach(d->string_cache, gr_ttf_freeStringCache, NULL);
-        hashmapFree(d->string_cache);
+        if(d->scaled)
+        {
+            hashmapForEach(d->scaled, gr_ttf_freeScaled, &scaled);
+            hashmapFree(d->scaled);
+        }
+
+        pthread_mutex_lock(&d->file->mutex);
+        FT_Done_Size(d->ft_size);
+        pthread_mutex_unlock(&d->file->mutex);
+        gr_ttf_closeFile(d->file);
+        hashmapForEach(d->layout_cache, gr_ttf_freeLayoutCache, NULL);
+        hashmapFree(d->layout_cache);
         hashmapForEach(d->glyph_cache, gr_ttf_freeFontCache, NULL);
         hashmapFree(d->glyph_cache);
-        pthread_mutex_destroy(&d->mutex);
+        free(d->atlas.data);
         free(d);
     }
 
     pthread_mutex_unlock(&font_data.mutex);
+
+    for(size_t i = 0; i < scaled.size(); i++)
+        gr_ttf_freeFont(scaled[i]);
 }
 
 static TrueTypeCacheEntry *gr_ttf_glyph_cache_peek(TrueTypeFont *font, int char_index)
@@ -372,32 +584,79 @@ static TrueTypeCacheEntry *gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_i
     return res;
 }
 
-static int gr_ttf_copy_glyph_to_surface(GGLSurface *dest, FT_BitmapGlyph glyph, int offX, int offY, int base)
+// Makes sure the glyph bitmap is in the font's atlas. Returns false for
+// glyphs that cannot be drawn from it.
+static bool gr_ttf_atlas_add(TrueTypeFont *font, TrueTypeCacheEntry *ent)
 {
+    FT_Bitmap *bitmap = &ent->glyph->bitmap;
+    int w = bitmap->width, h = bitmap->rows;
     unsigned y;
-    uint8_t *src_itr = glyph->bitmap.buffer;
-    uint8_t *dest_itr = dest->data;
 
-    if(glyph->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY)
+    if(ent->atlas_gen == font->atlas_gen)
+        return true;
+
+    if(bitmap->pixel_mode != FT_PIXEL_MODE_GRAY)
     {
-        fprintf(stderr, "Unsupported pixel mode in FT_BitmapGlyph %d\n", glyph->bitmap.pixel_mode);
-        return -1;
+        fprintf(stderr, "Unsupported pixel mode in FT_BitmapGlyph %d\n", bitmap->pixel_mode);
+        return false;
+    }
+
+    if(!font->atlas.data)
+    {
+        font->atlas.width = MAX(GLYPH_ATLAS_MIN_WIDTH, font->max_height*16);
+        font->atlas.stride = font->atlas.width;
+        font->atlas.height = GLYPH_ATLAS_MIN_HEIGHT;
+        font->atlas.data = (GGLubyte*)malloc(font->atlas.stride*font->atlas.height);
+    }
+
+    if(w > (int)font->atlas.width)
+        return false;
+
+    // one pixel of padding keeps neighbours apart
+    if(font->atlas_x + w > (int)font->atlas.width)
+    {
+        font->atlas_x = 0;
+        font->atlas_y += font->atlas_shelf_h + 1;
+        font->atlas_shelf_h = 0;
     }
 
-    dest_itr += (offY + base - glyph->top)*dest->stride + (offX + glyph->left);
+    while(font->atlas_y + h > (int)font->atlas.height)
+    {
+        int new_height = font->atlas.height*2;
+        if(font->atlas.stride*new_height > GLYPH_ATLAS_MAX_BYTES)
+        {
+            if(font->atlas_y == 0)
+                return false;
 
-    // FIXME: if glyph->left is negative and everything else is 0 (e.g. letter 'j' in Roboto-Regular),
-    // the result might end up being before the buffer - I'm not sure how to properly handle this.
-    if(dest_itr < dest->data)
-        dest_itr = dest->data;
+            // Full: start over, glyphs still in use get packed again
+            ++font->atlas_gen;
+            font->atlas_x = font->atlas_y = font->atlas_shelf_h = 0;
+            continue;
+        }
 
-    for(y = 0; y < glyph->bitmap.rows; ++y)
+        GGLubyte *data = (GGLubyte*)realloc(font->atlas.data, font->atlas.stride*new_height);
+        if(!data)
+            return false;
+        font->atlas.data = data;
+        font->atlas.height = new_height;
+    }
+
+    uint8_t *src_itr = bitmap->buffer;
+    uint8_t *dest_itr = font->atlas.data + font->atlas_y*font->atlas.stride + font->atlas_x;
+    for(y = 0; y < bitmap->rows; ++y)
     {
-        memcpy(dest_itr, src_itr, glyph->bitmap.width);
-        src_itr += glyph->bitmap.pitch;
-        dest_itr += dest->stride;
+        memcpy(dest_itr, src_itr, w);
+        src_itr += bitmap->pitch;
+        dest_itr += font->atlas.stride;
     }
-    return 0;
+
+    ent->atlas_x = font->atlas_x;
+    ent->atlas_y = font->atlas_y;
+    ent->atlas_gen = font->atlas_gen;
+
+    font->atlas_x += w + 1;
+    font->atlas_shelf_h = MAX(font->atlas_shelf_h, h);
+    return true;
 }
 
 static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
@@ -452,23 +711,46 @@ static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
     f->base += f->size / 4;
 }
 
-// returns number of bytes from const char *text rendered to fit max_width, not number of UTF8 characters!
-static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const char *text, int max_width)
+// Lays out text into e. Returns number of bytes from const char *text
+// rendered to fit max_width, not number of UTF8 characters!
+static int gr_ttf_layout_text(TrueTypeFont *font, LayoutCacheEntry *e, const char *text, int max_width)
 {
     TrueTypeFont *f = font;
     TrueTypeCacheEntry *ent;
     int bytes_rendered = 0, total_w = 0;
     int utf_bytes = 0;
     unsigned int unicode = 0;
-    int i, x, diff, char_idx, prev_idx = 0;
-    int height;
+    int diff, char_idx, prev_idx = 0;
     FT_Vector delta;
-    uint8_t *data = NULL;
     const char *text_itr = text;
-    int *char_idxs;
-    int char_idxs_len = 0;
+    size_t len = strlen(text);
+
+    if(font->max_height == -1)
+        gr_ttf_calcMaxFontHeight(font);
+
+    if(font->max_height == -1)
+        return -1;
 
-    char_idxs = (int *)malloc(strlen(text) * sizeof(int));
+    // reuse the buffers of an evicted entry where they are big enough
+    if(e->text_cap < len + 1)
+    {
+        char *text_buf = (char *)realloc(e->key.text, len + 1);
+        if(!text_buf)
+            return -1;
+        e->key.text = text_buf;
+        e->text_cap = len + 1;
+    }
+    if(e->glyph_cap < (int)len)
+    {
+        LayoutGlyph *glyphs = (LayoutGlyph *)realloc(e->glyphs, len * sizeof(LayoutGlyph));
+        if(!glyphs)
+            return -1;
+        e->glyphs = glyphs;
+        e->glyph_cap = len;
+    }
+    memcpy(e->key.text, text, len + 1);
+    e->key.max_width = max_width;
+    e->glyph_count = 0;
 
     while(*text_itr)
     {
@@ -477,157 +759,108 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
         bytes_rendered += utf_bytes;
 
         char_idx = FT_Get_Char_Index(f->face, unicode);
-        char_idxs[char_idxs_len] = char_idx;
 
         ent = gr_ttf_glyph_cache_get(f, char_idx);
         if(ent)
         {
             diff = ent->glyph->root.advance.x >> 16;
 
+            int kern = 0;
             if(FT_HAS_KERNING(f->face) && prev_idx && char_idx)
             {
                 FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
-                diff += delta.x >> 6;
+                kern = delta.x >> 6;
             }
 
-            if(max_width != -1 && total_w + diff > max_width)
+            if(max_width != -1 && total_w + kern + diff > max_width)
                 break;
 
-            total_w += diff;
-        }
-        prev_idx = char_idx;
-        ++char_idxs_len;
-    }
-
-    if(font->max_height == -1)
-        gr_ttf_calcMaxFontHeight(font);
+            e->glyphs[e->glyph_count].glyph = ent;
+            e->glyphs[e->glyph_count].x = total_w + kern;
+            ++e->glyph_count;
 
-    if(font->max_height == -1)
-    {
-        free(char_idxs);
-        return -1;
-    }
-
-    height = font->max_height;
-
-    data = (uint8_t *)malloc(total_w*height);
-    memset(data, 0, total_w*height);
-    x = 0;
-    prev_idx = 0;
-
-    surface->version = sizeof(*surface);
-    surface->width = total_w;
-    surface->height = height;
-    surface->stride = total_w;
-    surface->data = (GGLubyte*)data;
-    surface->format = GGL_PIXEL_FORMAT_A_8;
-
-    for(i = 0; i < char_idxs_len; ++i)
-    {
-        char_idx = char_idxs[i];
-        if(FT_HAS_KERNING(f->face) && prev_idx && char_idx)
-        {
-            FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
-            x += delta.x >> 6;
+            total_w += kern + diff;
         }
-
-        ent = gr_ttf_glyph_cache_get(f, char_idx);
-        if(ent)
-        {
-            gr_ttf_copy_glyph_to_surface(surface, ent->glyph, x, 0, font->base);
-            x += ent->glyph->root.advance.x >> 16;
-        }
-
         prev_idx = char_idx;
     }
 
-    free(char_idxs);
+    e->width = total_w;
+    e->rendered_bytes = bytes_rendered;
     return bytes_rendered;
 }
 
-static StringCacheEntry *gr_ttf_string_cache_peek(TrueTypeFont *font, const char *text, int max_width)
+static LayoutCacheEntry *gr_ttf_layout_cache_peek(TrueTypeFont *font, const char *text, int max_width)
 {
     StringCacheKey k = {
         .text = (char*)text,
         .max_width = max_width
     };
 
-    return (StringCacheEntry *)hashmapGet(font->string_cache, &k);
+    return (LayoutCacheEntry *)hashmapGet(font->layout_cache, &k);
 }
 
-static StringCacheEntry *gr_ttf_string_cache_get(TrueTypeFont *font, const char *text, int max_width)
+static void gr_ttf_layout_cache_unlink(TrueTypeFont *font, LayoutCacheEntry *e)
 {
-    StringCacheEntry *res;
-    StringCacheKey k = {
-        .text = (char*)text,
-        .max_width = max_width
-    };
-
-    res = (StringCacheEntry *)hashmapGet(font->string_cache, &k);
-    if(!res)
-    {
-        res = (StringCacheEntry *)malloc(sizeof(StringCacheEntry));
-        memset(res, 0, sizeof(StringCacheEntry));
-        res->rendered_bytes = gr_ttf_render_text(font, &res->surface, text, max_width);
-        if(res->rendered_bytes < 0)
-        {
-            free(res);
-            return NULL;
-        }
+    if(e->prev)
+        e->prev->next = e->next;
+    else
+        font->layout_cache_head = e->next;
 
-        StringCacheKey *new_key = (StringCacheKey *)malloc(sizeof(StringCacheKey));
-        memset(new_key, 0, sizeof(StringCacheKey));
-        new_key->max_width = max_width;
-        new_key->text = strdup(text);
+    if(e->next)
+        e->next->prev = e->prev;
+    else
+        font->layout_cache_tail = e->prev;
 
-        res->key = new_key;
+    e->prev = e->next = NULL;
+}
 
-        if(font->string_cache_tail)
-        {
-            res->prev = font->string_cache_tail;
-            res->prev->next = res;
-        }
-        else
-            font->string_cache_head = res;
-        font->string_cache_tail = res;
+static void gr_ttf_layout_cache_append(TrueTypeFont *font, LayoutCacheEntry *e)
+{
+    e->next = NULL;
+    e->prev = font->layout_cache_tail;
+    if(e->prev)
+        e->prev->next = e;
+    else
+        font->layout_cache_head = e;
+    font->layout_cache_tail = e;
+}
 
-        hashmapPut(font->string_cache, new_key, res);
-    }
-    else if(res->next)
+static LayoutCacheEntry *gr_ttf_layout_cache_get(TrueTypeFont *font, const char *text, int max_width)
+{
+    LayoutCacheEntry *res = gr_ttf_layout_cache_peek(font, text, max_width);
+    if(res)
     {
         // move this entry to the tail of the linked list
         // if it isn't already there
-        if(res->prev)
-            res->prev->next = res->next;
-
-        res->next->prev = res->prev;
-
-        if(!res->prev)
-            font->string_cache_head = res->next;
-
-        res->next = NULL;
-        res->prev = font->string_cache_tail;
-        res->prev->next = res;
-        font->string_cache_tail = res;
-
-        // truncate old entries
-        if(hashmapSize(font->string_cache) >= STRING_CACHE_MAX_ENTRIES)
+        if(res->next)
         {
-            printf("Truncating string cache entries.\n");
-            int i;
-            StringCacheEntry *ent;
-            for(i = 0; i < STRING_CACHE_TRUNCATE_ENTRIES; ++i)
-            {
-                ent = font->string_cache_head;
-                font->string_cache_head = ent->next;
-                font->string_cache_head->prev = NULL;
+            gr_ttf_layout_cache_unlink(font, res);
+            gr_ttf_layout_cache_append(font, res);
+        }
+        return res;
+    }
 
-                hashmapRemove(font->string_cache, ent->key);
+    if(hashmapSize(font->layout_cache) >= LAYOUT_CACHE_MAX_ENTRIES)
+    {
+        // recycle the least recently used entry
+        res = font->layout_cache_head;
+        hashmapRemove(font->layout_cache, &res->key);
+        gr_ttf_layout_cache_unlink(font, res);
+    }
+    else
+    {
+        res = (LayoutCacheEntry *)malloc(sizeof(LayoutCacheEntry));
+        memset(res, 0, sizeof(LayoutCacheEntry));
+    }
 
-                gr_ttf_freeStringCache(ent->key, ent, NULL);
-            }
-        }
+    if(gr_ttf_layout_text(font, res, text, max_width) < 0)
+    {
+        gr_ttf_freeLayoutCache(NULL, res, NULL);
+        return NULL;
     }
+
+    gr_ttf_layout_cache_append(font, res);
+    hashmapPut(font->layout_cache, &res->key, res);
     return res;
 }
 
@@ -636,11 +869,11 @@ int gr_ttf_measureEx(const char *s, void *font)
     TrueTypeFont *f = (TrueTypeFont *)font;
     int res = -1;
 
-    pthread_mutex_lock(&f->mutex);
-    StringCacheEntry *e = gr_ttf_string_cache_get(f, s, -1);
+    gr_ttf_lock(f);
+    LayoutCacheEntry *e = gr_ttf_layout_cache_get(f, s, -1);
     if(e)
-        res = e->surface.width;
-    pthread_mutex_unlock(&f->mutex);
+        res = e->width;
+    gr_ttf_unlock(f);
 
     return res;
 }
@@ -654,15 +887,15 @@ int gr_ttf_maxExW(const char *s, void *font, int max_width)
     unsigned int unicode = 0;
     int char_idx, prev_idx = 0;
     FT_Vector delta;
-    StringCacheEntry *e;
+    LayoutCacheEntry *e;
 
-    pthread_mutex_lock(&f->mutex);
+    gr_ttf_lock(f);
 
-    e = gr_ttf_string_cache_peek(f, s, max_width);
+    e = gr_ttf_layout_cache_peek(f, s, max_width);
     if(e)
     {
         max_bytes = e->rendered_bytes;
-        pthread_mutex_unlock(&f->mutex);
+        gr_ttf_unlock(f);
         return max_bytes;
     }
 
@@ -693,7 +926,7 @@ int gr_ttf_maxExW(const char *s, void *font, int max_width)
         total_w += ent->glyph->root.advance.x >> 16;
         max_bytes += utf_bytes;
     }
-    pthread_mutex_unlock(&f->mutex);
+    gr_ttf_unlock(f);
     return max_bytes;
 }
 
@@ -710,16 +943,21 @@ int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int
             return 0;
     }
 
-    pthread_mutex_lock(&font->mutex);
+    gr_ttf_lock(font);
 
-    StringCacheEntry *e = gr_ttf_string_cache_get(font, s, max_width);
+    // gr_textEx_scaleW measures first and then draws with the measured
+    // width, so the unlimited layout usually fits and saves a second entry
+    LayoutCacheEntry *e = gr_ttf_layout_cache_get(font, s, -1);
+    if(e && max_width != -1 && e->width > max_width)
+        e = gr_ttf_layout_cache_get(font, s, max_width);
     if(!e)
     {
-        pthread_mutex_unlock(&font->mutex);
+        gr_ttf_unlock(font);
         return -1;
     }
 
-    int y_bottom = y + e->surface.height;
+    int y_bottom = y + font->max_height;
+    int x_right = x + e->width;
     int res = e->rendered_bytes;
 
     if(max_height != -1 && max_height < y_bottom)
@@ -727,22 +965,71 @@ int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int
         y_bottom = max_height;
         if(y_bottom <= y)
         {
-            pthread_mutex_unlock(&font->mutex);
+            gr_ttf_unlock(font);
             return 0;
         }
     }
 
-    gl->bindTexture(gl, &e->surface);
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    GGLubyte *bound_data = NULL;
+    unsigned bound_height = 0;
+    int i;
+    for(i = 0; i < e->glyph_count; ++i)
+    {
+        TrueTypeCacheEntry *ent = e->glyphs[i].glyph;
+        if(!ent->glyph->bitmap.width || !ent->glyph->bitmap.rows)
+            continue;
 
-    gl->enable(gl, GGL_TEXTURE_2D);
-    gl->texCoord2i(gl, -x, -y);
-    gl->recti(gl, x, y, x + e->surface.width, y_bottom);
-    gl->disable(gl, GGL_TEXTURE_2D);
+        if(!gr_ttf_atlas_add(font, ent))
+            continue;
 
-    pthread_mutex_unlock(&font->mutex);
+        // clip each glyph to the line box
+        int gx = x + e->glyphs[i].x + ent->glyph->left;
+        int gy = y + font->base - ent->glyph->top;
+        int sx = ent->atlas_x, sy = ent->atlas_y;
+        int gw = ent->glyph->bitmap.width, gh = ent->glyph->bitmap.rows;
+        if(gx < x)
+        {
+            sx += x - gx;
+            gw -= x - gx;
+            gx = x;
+        }
+        if(gy < y)
+        {
+            sy += y - gy;
+            gh -= y - gy;
+            gy = y;
+        }
+        gw = MIN(gw, x_right - gx);
+        gh = MIN(gh, y_bottom - gy);
+        if(gw <= 0 || gh <= 0)
+            continue;
+
+        if(gr_fast_text(&font->atlas, sx, sy, gw, gh, gx, gy))
+            continue;
+
+        // rebind if the atlas grew since
+        if(bound_data != font->atlas.data || bound_height != font->atlas.height)
+        {
+            if(!bound_data)
+            {
+                gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
+                gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+                gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+                gl->enable(gl, GGL_TEXTURE_2D);
+            }
+            gl->bindTexture(gl, &font->atlas);
+            bound_data = font->atlas.data;
+            bound_height = font->atlas.height;
+        }
+
+        gl->texCoord2i(gl, sx - gx, sy - gy);
+        gl->recti(gl, gx, gy, gx + gw, gy + gh);
+    }
+
+    if(bound_data)
+        gl->disable(gl, GGL_TEXTURE_2D);
+
+    gr_ttf_unlock(font);
     return res;
 }
 
@@ -751,21 +1038,21 @@ int gr_ttf_getMaxFontHeight(void *font)
     int res;
     TrueTypeFont *f = (TrueTypeFont *)font;
 
-    pthread_mutex_lock(&f->mutex);
+    gr_ttf_lock(f);
 
     if(f->max_height == -1)
         gr_ttf_calcMaxFontHeight(f);
     res = f->max_height;
 
-    pthread_mutex_unlock(&f->mutex);
+    gr_ttf_unlock(f);
     return res;
 }
 
-static bool gr_ttf_dump_stats_count_string_cache(void *key __unused, void *value, void *context)
+static bool gr_ttf_dump_stats_count_layout_cache(void *key __unused, void *value, void *context)
 {
-    int *string_cache_size = (int *)context;
-    StringCacheEntry *e = (StringCacheEntry *)value;
-    *string_cache_size += e->surface.height*e->surface.width + sizeof(StringCacheEntry);
+    int *layout_cache_size = (int *)context;
+    LayoutCacheEntry *e = (LayoutCacheEntry *)value;
+    *layout_cache_size += e->text_cap + e->glyph_cap*sizeof(LayoutGlyph) + sizeof(LayoutCacheEntry);
     return true;
 }
 
@@ -773,27 +1060,32 @@ static bool gr_ttf_dump_stats_font(void *key, void *value, void *context)
 {
     TrueTypeFontKey *k = (TrueTypeFontKey *)key;
     TrueTypeFont *f = (TrueTypeFont *)value;
-    int *total_string_cache_size = (int *)context;
-    int string_cache_size = 0;
+    int *total_cache_size = (int *)context;
+    int layout_cache_size = 0;
+    int atlas_size;
+
+    gr_ttf_lock(f);
 
-    pthread_mutex_lock(&f->mutex);
+    atlas_size = f->atlas.data ? f->atlas.stride*f->atlas.height : 0;
 
-    hashmapForEach(f->string_cache, gr_ttf_dump_stats_count_string_cache, &string_cache_size);
+    hashmapForEach(f->layout_cache, gr_ttf_dump_stats_count_layout_cache, &layout_cache_size);
 
     printf("  Font %s (size %d, dpi %d):\n"
             "    refcount: %d\n"
             "    max_height: %d\n"
             "    base: %d\n"
             "    glyph_cache: %zu entries\n"
-            "    string_cache: %zu entries (%.2f kB)\n",
+            "    glyph_atlas: %dx%d (%.2f kB)\n"
+            "    layout_cache: %zu entries (%.2f kB)\n",
             k->path, k->size, k->dpi,
             f->refcount, f->max_height, f->base,
             hashmapSize(f->glyph_cache),
-            hashmapSize(f->string_cache), ((double)string_cache_size)/1024);
+            f->atlas.width, f->atlas.height, ((double)atlas_size)/1024,
+            hashmapSize(f->layout_cache), ((double)layout_cache_size)/1024);
 
-    pthread_mutex_unlock(&f->mutex);
+    gr_ttf_unlock(f);
 
-    *total_string_cache_size += string_cache_size;
+    *total_cache_size += layout_cache_size + atlas_size;
     return true;
 }
 
@@ -806,10 +1098,10 @@ void gr_ttf_dump_stats(void)
         printf("no truetype fonts loaded.\n");
     else
     {
-        int total_string_cache_size = 0;
+        int total_cache_size = 0;
         printf("%zu fonts loaded.\n", hashmapSize(font_data.fonts));
-        hashmapForEach(font_data.fonts, gr_ttf_dump_stats_font, &total_string_cache_size);
-        printf("  Total string cache size: %.2f kB\n", ((double)total_string_cache_size)/1024);
+        hashmapForEach(font_data.fonts, gr_ttf_dump_stats_font, &total_cache_size);
+        printf("  Total glyph atlas and layout cache size: %.2f kB\n", ((double)total_cache_size)/1024);
     }
 
     pthread_mutex_unlock(&font_data.mutex);
@@ -97,34 +97,27 @@ static void dumpEntry(const ZipEntry* pEntry)
 #endif
 
 /*
- * (This is a mzHashTableLookup callback.)
+ * (This is a qsort callback.)
  *
- * Compare two ZipEntry structs, by name.
+ * Compare two ZipEntry structs by name.  Entries with the same name keep
+ * their central directory order, which is also the order of their names
+ * in the mapping.
  */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
+static int compareZipEntries(const void* ventry1, const void* ventry2)
 {
     const ZipEntry* entry1 = (const ZipEntry*) ventry1;
     const ZipEntry* entry2 = (const ZipEntry*) ventry2;
-
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
-}
-
-/*
- * (This is a mzHashTableLookup callback.)
- *
- * find a ZipEntry struct by name.
- */
-static int hashcmpZipName(const void* ventry, const void* vname)
-{
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
-
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
+    unsigned int len = entry1->fileNameLen < entry2->fileNameLen ?
+            entry1->fileNameLen : entry2->fileNameLen;
+    int diff;
+
+    diff = memcmp(entry1->fileName, entry2->fileName, len);
+    if (diff == 0)
+        diff = (int) entry1->fileNameLen - (int) entry2->fileNameLen;
+    if (diff == 0)
+        diff = (entry1->fileName > entry2->fileName) -
+                (entry1->fileName < entry2->fileName);
+    return diff;
 }
 
 /*
@@ -143,18 +136,61 @@ static unsigned int computeHash(const char* name, int nameLen)
     return hash;
 }
 
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
+/*
+ * Find the index slot of a name: the one holding it, or the free slot
+ * where it would go.
+ */
+static ZipIndexSlot* findIndexSlot(const ZipArchive* pArchive,
+        unsigned int hash, const char* name, unsigned int nameLen)
 {
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
+    unsigned int i = hash & pArchive->indexMask;
+
+    while (pArchive->pIndex[i].entry != 0) {
+        const ZipIndexSlot* pSlot = &pArchive->pIndex[i];
+        const ZipEntry* pEntry = &pArchive->pEntries[pSlot->entry - 1];
 
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
+        if (pSlot->hash == hash && pEntry->fileNameLen == nameLen &&
+                memcmp(pEntry->fileName, name, nameLen) == 0)
+            break;
+        i = (i + 1) & pArchive->indexMask;
     }
+    return &pArchive->pIndex[i];
+}
+
+/*
+ * Build the name index over the (sorted) entries.  The table is a flat
+ * array of at least twice as many slots as entries, so lookups usually
+ * touch a single cache line and don't chase pointers.  With duplicate
+ * names the first entry wins.
+ */
+static bool buildEntryIndex(ZipArchive* pArchive)
+{
+    unsigned int size = 16;
+    unsigned int i;
+
+    while (size < pArchive->numEntries * 2)
+        size <<= 1;
+    pArchive->pIndex = (ZipIndexSlot*) calloc(size, sizeof(ZipIndexSlot));
+    if (pArchive->pIndex == NULL)
+        return false;
+    pArchive->indexMask = size - 1;
+
+    for (i = 0; i < pArchive->numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        unsigned int hash = computeHash(pEntry->fileName, pEntry->fileNameLen);
+        ZipIndexSlot* pSlot = findIndexSlot(pArchive, hash,
+                pEntry->fileName, pEntry->fileNameLen);
+
+        if (pSlot->entry != 0) {
+            LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+                pEntry->fileNameLen, pEntry->fileName);
+            /* keep going */
+            continue;
+        }
+        pSlot->hash = hash;
+        pSlot->entry = i + 1;
+    }
+    return true;
 }
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
@@ -241,8 +277,7 @@ static bool parseZipArchive(ZipArchive* pArchive)
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL)
         goto bail;
 
     ptr = pArchive->addr + cdOffset;
@@ -275,58 +310,7 @@ static bool parseZipArchive(ZipArchive* pArchive)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
         pEntry->fileNameLen = fileNameLen;
         pEntry->fileName = fileName;
 
@@ -375,36 +359,29 @@ static bool parseZipArchive(ZipArchive* pArchive)
             goto bail;
         }
 
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
-
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
 #if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
+    /* Sort once all entries are read, rather than moving the tail of the
+     * array for every insertion.
      */
-    for (i = 0; i < numEntries; i++) {
-        /* Add to hash table; no need to lock here.
-         */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
-    }
+    qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry), compareZipEntries);
 #endif
 
+    /* The index points at entries by position, so it has to be built
+     * after they are in their final places.
+     */
+    if (!buildEntryIndex(pArchive))
+        goto bail;
+
     result = true;
 
 bail:
     if (!result) {
-        mzHashTableFree(pArchive->pHash);
-        pArchive->pHash = NULL;
+        free(pArchive->pIndex);
+        pArchive->pIndex = NULL;
     }
     return result;
 }
@@ -463,9 +440,9 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 
     free(pArchive->pEntries);
 
-    mzHashTableFree(pArchive->pHash);
+    free(pArchive->pIndex);
 
-    pArchive->pHash = NULL;
+    pArchive->pIndex = NULL;
     pArchive->pEntries = NULL;
 }
 
@@ -477,10 +454,16 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
-
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+    unsigned int nameLen = strlen(entryName);
+    const ZipIndexSlot* pSlot;
+
+    if (pArchive->pIndex == NULL)
+        return NULL;
+    pSlot = findIndexSlot(pArchive, computeHash(entryName, nameLen),
+            entryName, nameLen);
+    if (pSlot->entry == 0)
+        return NULL;
+    return &pArchive->pEntries[pSlot->entry - 1];
 }
 
 /*
@@ -621,22 +604,74 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     return ret;
 }
 
-typedef struct {
-    char *buf;
-    int bufLen;
-} CopyProcessArgs;
+/*
+ * Return the data of a STORED entry in place.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive* pArchive,
+        const ZipEntry* pEntry)
+{
+    if (pEntry->compression != STORED || pEntry->uncompLen != pEntry->compLen)
+        return NULL;
+    return pArchive->addr + pEntry->offset;
+}
 
-static bool copyProcessFunction(const unsigned char *data, int dataLen,
-        void *cookie)
+/*
+ * Uncompress an entry straight into "buf", which holds at least
+ * pEntry->uncompLen bytes: STORED entries are copied from the mapping,
+ * DEFLATED ones are inflated in a single pass without an intermediate
+ * buffer.
+ */
+static bool readEntryToBuffer(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *buf)
 {
-    CopyProcessArgs *args = (CopyProcessArgs *)cookie;
-    if (dataLen <= args->bufLen) {
-        memcpy(args->buf, data, dataLen);
-        args->buf += dataLen;
-        args->bufLen -= dataLen;
+    z_stream zstream;
+    int zerr;
+    const unsigned char* data;
+
+    if (pEntry->compression == STORED) {
+        data = mzGetStoredZipEntryData(pArchive, pEntry);
+        if (data == NULL) {
+            LOGW("Size mismatch on stored file (%ld vs %ld)\n",
+                pEntry->compLen, pEntry->uncompLen);
+            return false;
+        }
+        memcpy(buf, data, pEntry->uncompLen);
         return true;
     }
-    return false;
+    if (pEntry->compression != DEFLATED) {
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.zalloc = Z_NULL;
+    zstream.zfree = Z_NULL;
+    zstream.opaque = Z_NULL;
+    zstream.next_in = pArchive->addr + pEntry->offset;
+    zstream.avail_in = pEntry->compLen;
+    zstream.next_out = (Bytef*) buf;
+    zstream.avail_out = pEntry->uncompLen;
+    zstream.data_type = Z_UNKNOWN;
+
+    /* Raw deflate data, as in processDeflatedEntry(). */
+    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        return false;
+    }
+    zerr = inflate(&zstream, Z_FINISH);
+    inflateEnd(&zstream);
+    if (zerr != Z_STREAM_END) {
+        LOGW("zlib inflate call failed (zerr=%d)\n", zerr);
+        return false;
+    }
+    if ((long) zstream.total_out != pEntry->uncompLen) {
+        LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
+            (long) zstream.total_out, pEntry->uncompLen);
+        return false;
+    }
+    return true;
 }
 
 /*
@@ -645,14 +680,8 @@ static bool copyProcessFunction(const unsigned char *data, int dataLen,
 bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
         char *buf, int bufLen)
 {
-    CopyProcessArgs args;
-    bool ret;
-
-    args.buf = buf;
-    args.bufLen = bufLen;
-    ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
-            (void *)&args);
-    if (!ret) {
+    if (pEntry->uncompLen > bufLen ||
+            !readEntryToBuffer(pArchive, pEntry, (unsigned char*) buf)) {
         LOGE("Can't extract entry to buffer.\n");
         return false;
     }
@@ -700,22 +729,6 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     return true;
 }
 
-typedef struct {
-    unsigned char* buffer;
-    long len;
-} BufferExtractCookie;
-
-static bool bufferProcessFunction(const unsigned char *data, int dataLen,
-    void *cookie) {
-    BufferExtractCookie *bec = (BufferExtractCookie*)cookie;
-
-    memmove(bec->buffer, data, dataLen);
-    bec->buffer += dataLen;
-    bec->len -= dataLen;
-
-    return true;
-}
-
 /*
  * Uncompress "pEntry" in "pArchive" to buffer, which must be large
  * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.
@@ -723,13 +736,7 @@ static bool bufferProcessFunction(const unsigned char *data, int dataLen,
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char *buffer)
 {
-    BufferExtractCookie bec;
-    bec.buffer = buffer;
-    bec.len = mzGetZipEntryUncompLen(pEntry);
-
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry,
-        bufferProcessFunction, (void*)&bec);
-    if (!ret || bec.len != 0) {
+    if (!readEntryToBuffer(pArchive, pEntry, buffer)) {
         LOGE("Can't extract entry to memory buffer.\n");
         return false;
     }
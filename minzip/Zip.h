@@ -42,13 +42,22 @@ typedef struct ZipEntry {
     long         externalFileAttributes;
 } ZipEntry;
 
+/*
+ * One slot of the name index, an open-addressing table with linear probing.
+ */
+typedef struct ZipIndexSlot {
+    unsigned int hash;
+    unsigned int entry;            // index into pEntries plus one, 0 if free
+} ZipIndexSlot;
+
 /*
  * One Zip archive.  Treat as opaque.
  */
 typedef struct ZipArchive {
     unsigned int   numEntries;
     ZipEntry*      pEntries;
-    HashTable*     pHash;          // maps file name to ZipEntry
+    ZipIndexSlot*  pIndex;         // maps file name to ZipEntry
+    unsigned int   indexMask;      // number of slots in pIndex minus one
     unsigned char* addr;
     size_t         length;
 } ZipArchive;
@@ -113,6 +122,15 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie);
 
+/*
+ * Return the data of a STORED entry in place, inside the archive's
+ * mapping, so it can be used without copying.  The data is
+ * mzGetZipEntryUncompLen(pEntry) bytes long and valid until the archive
+ * is closed.  Returns NULL for compressed entries.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive* pArchive,
+        const ZipEntry* pEntry);
+
 /*
  * Read an entry into a buffer allocated by the caller.
  */
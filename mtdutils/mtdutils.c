@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,17 +38,28 @@ static const char mtdprefix[] = "/dev/block/mtd/by-name/";
 #define MTD_BASENAME_OFFSET (sizeof(mtdprefix)-1)
 #endif
 
+/* Erase blocks that are read, erased or written with one call to the driver.
+ * A batch stops early at a bad block or at the end of the partition.
+ */
+#define MTD_BATCH_BLOCKS 16
+
 struct MtdReadContext {
     const MtdPartition *partition;
-    char *buffer;
+    const unsigned char *bad_blocks;
+    char *buffer;       // MTD_BATCH_BLOCKS erase blocks
+    size_t buffered;    // bytes read into buffer
     size_t consumed;
+    loff_t pos;         // next offset to read from the partition
     int fd;
 };
 
 struct MtdWriteContext {
     const MtdPartition *partition;
-    char *buffer;
+    const unsigned char *bad_blocks;
+    char *buffer;       // MTD_BATCH_BLOCKS erase blocks
+    char *verify;       // one erase block to read back into
     size_t stored;
+    loff_t pos;         // next offset to write to the partition
     int fd;
 
     off_t* bad_block_offsets;
@@ -101,6 +113,8 @@ mtd_scan_partitions()
             free(p->name);
             p->name = NULL;
         }
+        free(p->bad_blocks);
+        p->bad_blocks = NULL;
         p->device_index = -1;
     }
 
@@ -265,12 +279,53 @@ mtd_partition_info(const MtdPartition *partition,
     return 0;
 }
 
+/* Returns the bad block table of the partition, one byte per erase block
+ * that is 1 for a bad block. It is read with MEMGETBADBLOCK the first time
+ * the partition is opened after a scan, instead of once for every block
+ * that is read or written.
+ */
+static const unsigned char *mtd_bad_blocks(const MtdPartition *partition, int fd)
+{
+    MtdPartition *p = (MtdPartition *) partition;
+    if (p->bad_blocks != NULL) return p->bad_blocks;
+
+    size_t count = partition->size / partition->erase_size;
+    unsigned char *table = calloc(count > 0 ? count : 1, 1);
+    if (table == NULL) return NULL;
+
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        loff_t bpos = (loff_t) i * partition->erase_size;
+        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
+        if (ret == -1 && errno == EOPNOTSUPP) break;  // no bad blocks on NOR
+        if (ret != 0) {
+            fprintf(stderr, "mtd: MEMGETBADBLOCK returned %d at 0x%08llx\n",
+                    ret, (long long) bpos);
+            table[i] = 1;
+        }
+    }
+    p->bad_blocks = table;
+    return table;
+}
+
+/* Number of good erase blocks in a row from pos, at most max */
+static size_t good_run(const MtdPartition *partition,
+        const unsigned char *bad_blocks, loff_t pos, size_t max)
+{
+    size_t block = pos / partition->erase_size;
+    size_t count = partition->size / partition->erase_size;
+    size_t run = 0;
+    if (max > MTD_BATCH_BLOCKS) max = MTD_BATCH_BLOCKS;
+    while (run < max && block + run < count && !bad_blocks[block + run]) ++run;
+    return run;
+}
+
 MtdReadContext *mtd_read_partition(const MtdPartition *partition)
 {
     MtdReadContext *ctx = (MtdReadContext*) malloc(sizeof(MtdReadContext));
     if (ctx == NULL) return NULL;
 
-    ctx->buffer = malloc(partition->erase_size);
+    ctx->buffer = malloc(partition->erase_size * MTD_BATCH_BLOCKS);
     if (ctx->buffer == NULL) {
         free(ctx);
         return NULL;
@@ -285,34 +340,44 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
         return NULL;
     }
 
+    ctx->bad_blocks = mtd_bad_blocks(partition, ctx->fd);
+    if (ctx->bad_blocks == NULL) {
+        close(ctx->fd);
+        free(ctx->buffer);
+        free(ctx);
+        return NULL;
+    }
+
     ctx->partition = partition;
-    ctx->consumed = partition->erase_size;
+    ctx->buffered = 0;
+    ctx->consumed = 0;
+    ctx->pos = 0;
     return ctx;
 }
 
-static int read_block(const MtdPartition *partition, int fd, char *data)
+/* Reads the next erase block that reads without errors into data. This is
+ * the slow path for a batch that had an error somewhere.
+ */
+static int read_block(MtdReadContext *ctx, char *data)
 {
+    const MtdPartition *partition = ctx->partition;
     struct mtd_ecc_stats before, after;
-    if (ioctl(fd, ECCGETSTATS, &before)) {
+    if (ioctl(ctx->fd, ECCGETSTATS, &before)) {
         printf("mtd: ECCGETSTATS error (%s)\n", strerror(errno));
         return -1;
     }
 
-    loff_t pos = TEMP_FAILURE_RETRY(lseek64(fd, 0, SEEK_CUR));
-    if (pos == -1) {
-        printf("mtd: read_block: couldn't SEEK_CUR: %s\n", strerror(errno));
-        return -1;
-    }
-
     ssize_t size = partition->erase_size;
-    int mgbb;
 
-    while (pos + size <= (int) partition->size) {
-        if (TEMP_FAILURE_RETRY(lseek64(fd, pos, SEEK_SET)) != pos ||
-                    TEMP_FAILURE_RETRY(read(fd, data, size)) != size) {
+    while (ctx->pos + size <= (loff_t) partition->size) {
+        loff_t pos = ctx->pos;
+        ctx->pos += size;
+        if (ctx->bad_blocks[pos / size]) {
+            continue;
+        } else if (TEMP_FAILURE_RETRY(pread64(ctx->fd, data, size, pos)) != size) {
             printf("mtd: read error at 0x%08llx (%s)\n",
                    (long long)pos, strerror(errno));
-        } else if (ioctl(fd, ECCGETSTATS, &after)) {
+        } else if (ioctl(ctx->fd, ECCGETSTATS, &after)) {
             printf("mtd: ECCGETSTATS error (%s)\n", strerror(errno));
             return -1;
         } else if (after.failed != before.failed) {
@@ -321,27 +386,68 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
                    after.failed - before.failed, (long long)pos);
             // copy the comparison baseline for the next read.
             memcpy(&before, &after, sizeof(struct mtd_ecc_stats));
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
-            fprintf(stderr,
-                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx: %s\n",
-                    mgbb, (long long)pos, strerror(errno));
         } else {
             return 0;  // Success!
         }
-
-        pos += partition->erase_size;
     }
 
     errno = ENOSPC;
     return -1;
 }
 
+/* Reads up to max erase blocks into data, skipping the bad ones. Each run
+ * of good blocks is one read with one ECC check; a run with an error is
+ * read again block by block so only the failing blocks are skipped.
+ * Returns the bytes read, -1 if there was nothing left to read.
+ */
+static ssize_t read_blocks(MtdReadContext *ctx, char *data, size_t max)
+{
+    const MtdPartition *partition = ctx->partition;
+    size_t size = partition->erase_size;
+    size_t done = 0;
+
+    while (done < max) {
+        while (ctx->pos + size <= partition->size && ctx->bad_blocks[ctx->pos / size])
+            ctx->pos += size;
+
+        size_t run = good_run(partition, ctx->bad_blocks, ctx->pos, max - done);
+        if (run == 0) break;
+
+        struct mtd_ecc_stats before, after;
+        ssize_t len = run * size;
+        if (ioctl(ctx->fd, ECCGETSTATS, &before) == 0 &&
+                TEMP_FAILURE_RETRY(pread64(ctx->fd, data + done * size, len, ctx->pos)) == len &&
+                ioctl(ctx->fd, ECCGETSTATS, &after) == 0 &&
+                after.failed == before.failed) {
+            ctx->pos += len;
+            done += run;
+            continue;
+        }
+
+        size_t i;
+        for (i = 0; i < run; ++i) {
+            if (read_block(ctx, data + done * size)) {
+                if (done > 0) return done * size;
+                return -1;
+            }
+            ++done;
+        }
+    }
+
+    if (done == 0) {
+        errno = ENOSPC;
+        return -1;
+    }
+    return done * size;
+}
+
 ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 {
+    size_t size = ctx->partition->erase_size;
     ssize_t read = 0;
     while (read < (int) len) {
-        if (ctx->consumed < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->consumed;
+        if (ctx->consumed < ctx->buffered) {
+            size_t avail = ctx->buffered - ctx->consumed;
             size_t copy = len - read < avail ? len - read : avail;
             memcpy(data + read, ctx->buffer + ctx->consumed, copy);
             ctx->consumed += copy;
@@ -349,19 +455,21 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
         }
 
         // Read complete blocks directly into the user's buffer
-        while (ctx->consumed == ctx->partition->erase_size &&
-               len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
-            read += ctx->partition->erase_size;
+        while (ctx->consumed == ctx->buffered && len - read >= size) {
+            ssize_t got = read_blocks(ctx, data + read, (len - read) / size);
+            if (got < 0) return -1;
+            read += got;
         }
 
         if (read >= (int)len) {
             return read;
         }
 
-        // Read the next block into the buffer
-        if (ctx->consumed == ctx->partition->erase_size && read < (int) len) {
-            if (read_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
+        // Read the next batch into the buffer
+        if (ctx->consumed == ctx->buffered && read < (int) len) {
+            ssize_t got = read_blocks(ctx, ctx->buffer, MTD_BATCH_BLOCKS);
+            if (got < 0) return -1;
+            ctx->buffered = got;
             ctx->consumed = 0;
         }
     }
@@ -369,6 +477,17 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
     return read;
 }
 
+size_t mtd_read_size(const MtdReadContext *ctx)
+{
+    size_t count = ctx->partition->size / ctx->partition->erase_size;
+    size_t good = 0;
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        if (!ctx->bad_blocks[i]) ++good;
+    }
+    return good * ctx->partition->erase_size;
+}
+
 void mtd_read_close(MtdReadContext *ctx)
 {
     close(ctx->fd);
@@ -385,8 +504,11 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     ctx->bad_block_alloc = 0;
     ctx->bad_block_count = 0;
 
-    ctx->buffer = malloc(partition->erase_size);
-    if (ctx->buffer == NULL) {
+    ctx->buffer = malloc(partition->erase_size * MTD_BATCH_BLOCKS);
+    ctx->verify = malloc(partition->erase_size);
+    if (ctx->buffer == NULL || ctx->verify == NULL) {
+        free(ctx->buffer);
+        free(ctx->verify);
         free(ctx);
         return NULL;
     }
@@ -396,12 +518,23 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     ctx->fd = open(mtddevname, O_RDWR);
     if (ctx->fd < 0) {
         free(ctx->buffer);
+        free(ctx->verify);
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->bad_blocks = mtd_bad_blocks(partition, ctx->fd);
+    if (ctx->bad_blocks == NULL) {
+        close(ctx->fd);
+        free(ctx->buffer);
+        free(ctx->verify);
         free(ctx);
         return NULL;
     }
 
     ctx->partition = partition;
     ctx->stored = 0;
+    ctx->pos = 0;
     return ctx;
 }
 
@@ -414,84 +547,137 @@ static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
     ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
 }
 
-static int write_block(MtdWriteContext *ctx, const char *data)
+static int erase_run(MtdWriteContext *ctx, loff_t pos, size_t blocks)
 {
-    const MtdPartition *partition = ctx->partition;
-    int fd = ctx->fd;
+    size_t len = blocks * ctx->partition->erase_size;
+#ifdef RK3X
+    return rk30_zero_out(ctx->fd, pos, len);
+#else
+    struct erase_info_user erase_info;
+    erase_info.start = pos;
+    erase_info.length = len;
+    return ioctl(ctx->fd, MEMERASE, &erase_info);
+#endif
+}
+
+/* FNV-1a over 64 bit words, to compare what reads back after a write with
+ * what was written without keeping a second copy of the batch. Erase
+ * blocks are always a multiple of 8 bytes.
+ */
+#define MTD_HASH_INIT 0xcbf29ce484222325ULL
 
-    off_t pos = TEMP_FAILURE_RETRY(lseek(fd, 0, SEEK_CUR));
-    if (pos == (off_t) -1) {
-        printf("mtd: write_block: couldn't SEEK_CUR: %s\n", strerror(errno));
+static uint64_t mtd_hash(uint64_t hash, const char *data, size_t len)
+{
+    size_t i;
+    for (i = 0; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Erases and writes a run of good blocks at ctx->pos with one call each,
+ * then reads it back into a hash. Returns 0 if the run verified.
+ */
+static int write_run(MtdWriteContext *ctx, const char *data, size_t blocks)
+{
+    ssize_t size = ctx->partition->erase_size;
+    ssize_t len = blocks * size;
+    loff_t pos = ctx->pos;
+
+    if (erase_run(ctx, pos, blocks) < 0) {
+        printf("mtd: erase failure at 0x%08llx (%s)\n",
+                (long long)pos, strerror(errno));
+        return -1;
+    }
+    if (TEMP_FAILURE_RETRY(pwrite64(ctx->fd, data, len, pos)) != len) {
+        printf("mtd: write error at 0x%08llx (%s)\n",
+                (long long)pos, strerror(errno));
         return -1;
     }
 
+    struct mtd_ecc_stats before, after;
+    if (ioctl(ctx->fd, ECCGETSTATS, &before)) {
+        printf("mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+        return -1;
+    }
+    uint64_t written = mtd_hash(MTD_HASH_INIT, data, len);
+    uint64_t verified = MTD_HASH_INIT;
+    size_t i;
+    for (i = 0; i < blocks; ++i) {
+        if (TEMP_FAILURE_RETRY(pread64(ctx->fd, ctx->verify, size, pos + i * size)) != size) {
+            printf("mtd: re-read error at 0x%08llx (%s)\n",
+                    (long long)(pos + i * size), strerror(errno));
+            return -1;
+        }
+        verified = mtd_hash(verified, ctx->verify, size);
+    }
+    if (ioctl(ctx->fd, ECCGETSTATS, &after)) {
+        printf("mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+        return -1;
+    }
+    if (after.failed != before.failed || verified != written) {
+        printf("mtd: verification error in %zu blocks at 0x%08llx\n",
+                blocks, (long long)pos);
+        return -1;
+    }
+    return 0;
+}
+
+/* Writes one block at the next good offset, retrying and skipping the
+ * blocks that fail. This is the slow path for a run that failed.
+ */
+static int write_block(MtdWriteContext *ctx, const char *data)
+{
+    const MtdPartition *partition = ctx->partition;
+    int fd = ctx->fd;
+
     ssize_t size = partition->erase_size;
-    while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
-        if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
+    while (ctx->pos + size <= (loff_t) partition->size) {
+        loff_t pos = ctx->pos;
+        ctx->pos += size;
+        if (ctx->bad_blocks[pos / size]) {
             add_bad_block_offset(ctx, pos);
-            fprintf(stderr,
-                    "mtd: not writing bad block at 0x%08lx (ret %d): %s\n",
-                    pos, ret, strerror(errno));
-            pos += partition->erase_size;
+            fprintf(stderr, "mtd: not writing bad block at 0x%08llx\n",
+                    (long long)pos);
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = size;
         int retry;
         for (retry = 0; retry < 2; ++retry) {
-#ifdef RK3X
-            if (rk30_zero_out(fd, pos, size) < 0) {
-                fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
+            if (erase_run(ctx, pos, 1) < 0) {
+                printf("mtd: erase failure at 0x%08llx (%s)\n",
+                        (long long)pos, strerror(errno));
                 continue;
             }
-#else
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
-                printf("mtd: erase failure at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
-            }
-#endif
-            if (TEMP_FAILURE_RETRY(lseek(fd, pos, SEEK_SET)) != pos ||
-                TEMP_FAILURE_RETRY(write(fd, data, size)) != size) {
-                printf("mtd: write error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
+            if (TEMP_FAILURE_RETRY(pwrite64(fd, data, size, pos)) != size) {
+                printf("mtd: write error at 0x%08llx (%s)\n",
+                        (long long)pos, strerror(errno));
             }
 
-            char verify[size];
-            if (TEMP_FAILURE_RETRY(lseek(fd, pos, SEEK_SET)) != pos ||
-                TEMP_FAILURE_RETRY(read(fd, verify, size)) != size) {
-                printf("mtd: re-read error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
+            if (TEMP_FAILURE_RETRY(pread64(fd, ctx->verify, size, pos)) != size) {
+                printf("mtd: re-read error at 0x%08llx (%s)\n",
+                        (long long)pos, strerror(errno));
                 continue;
             }
-            if (memcmp(data, verify, size) != 0) {
-                printf("mtd: verification error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
+            if (memcmp(data, ctx->verify, size) != 0) {
+                printf("mtd: verification error at 0x%08llx (%s)\n",
+                        (long long)pos, strerror(errno));
                 continue;
             }
 
             if (retry > 0) {
                 printf("mtd: wrote block after %d retries\n", retry);
             }
-            printf("mtd: successfully wrote block at %lx\n", pos);
+            printf("mtd: successfully wrote block at %llx\n", (long long)pos);
             return 0;  // Success!
         }
 
         // Try to erase it once more as we give up on this block
         add_bad_block_offset(ctx, pos);
-        printf("mtd: skipping write block at 0x%08lx\n", pos);
-#ifdef RK3X
-        rk30_zero_out(fd, pos, size);
-#else
-
-        ioctl(fd, MEMERASE, &erase_info);
-#endif
-        pos += partition->erase_size;
+        printf("mtd: skipping write block at 0x%08llx\n", (long long)pos);
+        erase_run(ctx, pos, 1);
     }
 
     // Ran out of space on the device
@@ -499,29 +685,71 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     return -1;
 }
 
+/* Writes whole erase blocks from data in runs of good blocks, falling
+ * back to write_block for the blocks of a run that did not verify.
+ */
+static int write_blocks(MtdWriteContext *ctx, const char *data, size_t blocks)
+{
+    const MtdPartition *partition = ctx->partition;
+    size_t size = partition->erase_size;
+
+    while (blocks > 0) {
+        while (ctx->pos + size <= partition->size && ctx->bad_blocks[ctx->pos / size]) {
+            add_bad_block_offset(ctx, ctx->pos);
+            fprintf(stderr, "mtd: not writing bad block at 0x%08llx\n",
+                    (long long)ctx->pos);
+            ctx->pos += size;
+        }
+
+        size_t run = good_run(partition, ctx->bad_blocks, ctx->pos, blocks);
+        if (run == 0) {
+            // Ran out of space on the device
+            errno = ENOSPC;
+            return -1;
+        }
+
+        if (write_run(ctx, data, run) == 0) {
+            ctx->pos += run * size;
+        } else {
+            printf("mtd: writing %zu blocks at 0x%08llx one at a time\n",
+                    run, (long long)ctx->pos);
+            size_t i;
+            for (i = 0; i < run; ++i) {
+                if (write_block(ctx, data + i * size)) return -1;
+            }
+        }
+        data += run * size;
+        blocks -= run;
+    }
+    return 0;
+}
+
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
+    size_t size = ctx->partition->erase_size;
+    size_t batch = size * MTD_BATCH_BLOCKS;
     size_t wrote = 0;
     while (wrote < len) {
-        // Coalesce partial writes into complete blocks
-        if (ctx->stored > 0 || len - wrote < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->stored;
+        // Coalesce partial writes into complete batches
+        if (ctx->stored > 0 || len - wrote < batch) {
+            size_t avail = batch - ctx->stored;
             size_t copy = len - wrote < avail ? len - wrote : avail;
             memcpy(ctx->buffer + ctx->stored, data + wrote, copy);
             ctx->stored += copy;
             wrote += copy;
         }
 
-        // If a complete block was accumulated, write it
-        if (ctx->stored == ctx->partition->erase_size) {
-            if (write_block(ctx, ctx->buffer)) return -1;
+        // If a complete batch was accumulated, write it
+        if (ctx->stored == batch) {
+            if (write_blocks(ctx, ctx->buffer, MTD_BATCH_BLOCKS)) return -1;
             ctx->stored = 0;
         }
 
         // Write complete blocks directly from the user's buffer
-        while (ctx->stored == 0 && len - wrote >= ctx->partition->erase_size) {
-            if (write_block(ctx, data + wrote)) return -1;
-            wrote += ctx->partition->erase_size;
+        if (ctx->stored == 0 && len - wrote >= batch) {
+            size_t blocks = (len - wrote) / size;
+            if (write_blocks(ctx, data + wrote, blocks)) return -1;
+            wrote += blocks * size;
         }
     }
 
@@ -530,49 +758,40 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 
 off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 {
+    size_t size = ctx->partition->erase_size;
+
     // Zero-pad and write any pending data to get us to a block boundary
     if (ctx->stored > 0) {
-        size_t zero = ctx->partition->erase_size - ctx->stored;
+        size_t pending = (ctx->stored + size - 1) / size;
+        size_t zero = pending * size - ctx->stored;
         memset(ctx->buffer + ctx->stored, 0, zero);
-        if (write_block(ctx, ctx->buffer)) return -1;
+        if (write_blocks(ctx, ctx->buffer, pending)) return -1;
         ctx->stored = 0;
     }
 
-    off_t pos = TEMP_FAILURE_RETRY(lseek(ctx->fd, 0, SEEK_CUR));
-    if ((off_t) pos == (off_t) -1) {
-        printf("mtd_erase_blocks: couldn't SEEK_CUR: %s\n", strerror(errno));
-        return -1;
-    }
-
-    const int total = (ctx->partition->size - pos) / ctx->partition->erase_size;
+    loff_t pos = ctx->pos;
+    const int total = (ctx->partition->size - pos) / size;
     if (blocks < 0) blocks = total;
     if (blocks > total) {
         errno = ENOSPC;
         return -1;
     }
 
-    // Erase the specified number of blocks
-    while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
-            printf("mtd: not erasing bad block at 0x%08lx\n", pos);
-            pos += ctx->partition->erase_size;
+    // Erase the specified number of blocks, a run of good ones at a time
+    while (blocks > 0) {
+        if (ctx->bad_blocks[pos / size]) {
+            printf("mtd: not erasing bad block at 0x%08llx\n", (long long)pos);
+            pos += size;
+            --blocks;
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = ctx->partition->erase_size;
-#ifdef RK3X
-        if (rk30_zero_out(ctx->fd, pos, ctx->partition->erase_size) < 0) {
-            fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
+        size_t run = good_run(ctx->partition, ctx->bad_blocks, pos, blocks);
+        if (erase_run(ctx, pos, run) < 0) {
+            printf("mtd: erase failure at 0x%08llx\n", (long long)pos);
         }
-#else
-        if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
-            printf("mtd: erase failure at 0x%08lx\n", pos);
-        }
-#endif
-        pos += ctx->partition->erase_size;
+        pos += run * size;
+        blocks -= run;
     }
 
     return pos;
@@ -586,6 +805,7 @@ int mtd_write_close(MtdWriteContext *ctx)
     if (close(ctx->fd)) r = -1;
     free(ctx->bad_block_offsets);
     free(ctx->buffer);
+    free(ctx->verify);
     free(ctx);
     return r;
 }
@@ -49,6 +49,10 @@ typedef struct MtdWriteContext MtdWriteContext;
 MtdReadContext *mtd_read_partition(const MtdPartition *);
 ssize_t mtd_read_data(MtdReadContext *, char *data, size_t data_len);
 void mtd_read_close(MtdReadContext *);
+/* bytes in the good blocks of the partition, which is what mtd_read_data
+ * returns for the whole partition unless some blocks fail to read.
+ */
+size_t mtd_read_size(const MtdReadContext *);
 
 MtdWriteContext *mtd_write_partition(const MtdPartition *);
 ssize_t mtd_write_data(MtdWriteContext *, const char *data, size_t data_len);
@@ -60,6 +64,7 @@ struct MtdPartition {
     unsigned int size;
     unsigned int erase_size;
     char *name;
+    unsigned char *bad_blocks;  /* one byte per erase block, read once per scan */
 };
 
 #ifdef __cplusplus
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <string.h>
 
 #include <usbhost/usbhost.h>
 
@@ -330,6 +331,14 @@ void MtpDataPacket::putString(const char* s) {
 	string.writeToPacket(this);
 }
 
+void MtpDataPacket::putData(const void* data, size_t length) {
+	allocate(mOffset + length);
+	memcpy(mBuffer + mOffset, data, length);
+	mOffset += length;
+	if (mPacketSize < mOffset)
+		mPacketSize = mOffset;
+}
+
 void MtpDataPacket::putString(const uint16_t* string) {
 	int count = 0;
 	for (int i = 0; i < 256; i++) {
@@ -53,7 +53,10 @@ void MtpPacket::reset() {
 
 void MtpPacket::allocate(int length) {
 	if (length > mBufferSize) {
+		// Grow by at least half, large property lists are built a few bytes at a time
 		int newLength = length + mAllocationIncrement;
+		if (newLength < mBufferSize + mBufferSize / 2)
+			newLength = mBufferSize + mBufferSize / 2;
 		mBuffer = (uint8_t *)realloc(mBuffer, newLength);
 		if (!mBuffer) {
 			MTPE("out of memory!");
@@ -25,6 +25,9 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
 #include "../twcommon.h"
 #include "../set_metadata.h"
 #include <cutils/properties.h>
@@ -96,6 +99,85 @@ static const MtpEventCode kSupportedEventCodes[] = {
 	MTP_EVENT_OBJECT_PROP_CHANGED,
 };
 
+#define MTP_FILE_COPY_SIZE (256 * 1024)
+
+// The f_mtp driver moves file data between the file and the host itself.
+// Any other fd, like the socket tests/benchmark/mtp_benchmark.cpp drives the
+// server through, fails the ioctls with ENOTTY and the data is copied here.
+static int writeFully(int fd, const char* buffer, size_t length) {
+	while (length > 0) {
+		ssize_t ret = ::write(fd, buffer, length);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buffer += ret;
+		length -= ret;
+	}
+	return 0;
+}
+
+static int sendFileWithHeader(int fd, mtp_file_range* mfr) {
+	int ret = ioctl(fd, MTP_SEND_FILE_WITH_HEADER, (unsigned long)mfr);
+	if (ret >= 0 || errno != ENOTTY)
+		return ret;
+
+	std::vector<char> buffer(MTP_FILE_COPY_SIZE);
+	uint64_t total = mfr->length + MTP_CONTAINER_HEADER_SIZE;
+	uint32_t length = (total > 0xFFFFFFFFULL ? 0xFFFFFFFF : (uint32_t)total);
+	unsigned char header[MTP_CONTAINER_HEADER_SIZE] = {
+		(unsigned char)length, (unsigned char)(length >> 8), (unsigned char)(length >> 16), (unsigned char)(length >> 24),
+		MTP_CONTAINER_TYPE_DATA, 0,
+		(unsigned char)mfr->command, (unsigned char)(mfr->command >> 8),
+		(unsigned char)mfr->transaction_id, (unsigned char)(mfr->transaction_id >> 8),
+		(unsigned char)(mfr->transaction_id >> 16), (unsigned char)(mfr->transaction_id >> 24),
+	};
+	if (writeFully(fd, (const char*)header, sizeof(header)) < 0)
+		return -1;
+	for (uint64_t done = 0; done < (uint64_t)mfr->length;) {
+		size_t chunk = (size_t)std::min((uint64_t)buffer.size(), (uint64_t)mfr->length - done);
+		ssize_t len = pread(mfr->fd, &buffer[0], chunk, mfr->offset + done);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0 || writeFully(fd, &buffer[0], len) < 0)
+			return -1;
+		done += len;
+	}
+	return 0;
+}
+
+// A length of 0xFFFFFFFF reads until the other end closes
+static int receiveFile(int fd, mtp_file_range* mfr) {
+	int ret = ioctl(fd, MTP_RECEIVE_FILE, (unsigned long)mfr);
+	if (ret >= 0 || errno != ENOTTY)
+		return ret;
+
+	std::vector<char> buffer(MTP_FILE_COPY_SIZE);
+	bool unbounded = (mfr->length == 0xFFFFFFFF);
+	for (uint64_t done = 0; unbounded || done < (uint64_t)mfr->length;) {
+		size_t chunk = buffer.size();
+		if (!unbounded)
+			chunk = (size_t)std::min((uint64_t)chunk, (uint64_t)mfr->length - done);
+		ssize_t len = ::read(fd, &buffer[0], chunk);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len == 0 && unbounded)
+			break;
+		if (len <= 0)
+			return -1;
+		for (ssize_t written = 0; written < len;) {
+			ssize_t w = pwrite(mfr->fd, &buffer[written], len - written, mfr->offset + done + written);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w <= 0)
+				return -1;
+			written += w;
+		}
+		done += len;
+	}
+	return 0;
+}
+
 MtpServer::MtpServer(MtpDatabase* database, bool ptp,
 					int fileGroup, int filePerm, int directoryPerm)
 	:	mDatabase(database),
@@ -202,6 +284,11 @@ void MtpServer::run(int fd) {
 			MTPE("request read returned %d, errno: %d, exiting MtpServer::run loop\n", ret, errno);
 			break;
 		}
+		if (ret == 0) {
+			// only a socket standing in for the driver reaches the end
+			MTPI("end of file on fd %d, exiting MtpServer::run loop\n", fd);
+			break;
+		}
 		MtpOperationCode operation = mRequest.getOperationCode();
 		MtpTransactionID transaction = mRequest.getTransactionID();
 
@@ -854,11 +941,13 @@ MtpResponseCode MtpServer::doGetObject() {
 	mfr.offset = 0;
 	mfr.length = fileLength;
 	MTPD("mfr.length: %lld\n", mfr.length);
+	// the driver reads the file in bulk-sized chunks, let readahead run far ahead of it
+	posix_fadvise(mfr.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 	mfr.command = mRequest.getOperationCode();
 	mfr.transaction_id = mRequest.getTransactionID();
 
 	// then transfer the file
-	int ret = ioctl(mFD, MTP_SEND_FILE_WITH_HEADER, (unsigned long)&mfr);
+	int ret = sendFileWithHeader(mFD, &mfr);
 	MTPD("MTP_SEND_FILE_WITH_HEADER returned %d\n", ret);
 	close(mfr.fd);
 	if (ret < 0) {
@@ -928,9 +1017,10 @@ MtpResponseCode MtpServer::doGetPartialObject(MtpOperationCode operation) {
 	mfr.command = mRequest.getOperationCode();
 	mfr.transaction_id = mRequest.getTransactionID();
 	mResponse.setParameter(1, length);
+	posix_fadvise(mfr.fd, offset, length, POSIX_FADV_SEQUENTIAL);
 
 	// transfer the file
-	int ret = ioctl(mFD, MTP_SEND_FILE_WITH_HEADER, (unsigned long)&mfr);
+	int ret = sendFileWithHeader(mFD, &mfr);
 	MTPD("MTP_SEND_FILE_WITH_HEADER returned %d\n", ret);
 	close(mfr.fd);
 	if (ret < 0) {
@@ -1090,6 +1180,11 @@ MtpResponseCode MtpServer::doSendObject() {
 	fchmod(mfr.fd, mFilePermission);
 	umask(mask);
 
+	// Reserve the whole file up front when the size is known, so the
+	// driver's chunked writes don't allocate and fragment block by block
+	if (mSendObjectFileSize != 0xFFFFFFFF && mSendObjectFileSize > 0)
+		fallocate(mfr.fd, FALLOC_FL_KEEP_SIZE, 0, mSendObjectFileSize);
+
 	if (initialData > 0)
 		ret = write(mfr.fd, mData.getData(), initialData);
 
@@ -1104,7 +1199,7 @@ MtpResponseCode MtpServer::doSendObject() {
 
 		MTPD("receiving %s\n", (const char *)mSendObjectFilePath);
 		// transfer the file
-		ret = ioctl(mFD, MTP_RECEIVE_FILE, (unsigned long)&mfr);
+		ret = receiveFile(mFD, &mfr);
 	}
 	close(mfr.fd);
 	tw_set_default_metadata((const char *)mSendObjectFilePath);
@@ -1298,7 +1393,7 @@ MtpResponseCode MtpServer::doSendPartialObject() {
 		mfr.length = length;
 
 		// transfer the file
-		ret = ioctl(mFD, MTP_RECEIVE_FILE, (unsigned long)&mfr);
+		ret = receiveFile(mFD, &mfr);
 		MTPD("MTP_RECEIVE_FILE returned %d", ret);
 	}
 	if (ret < 0) {
@@ -38,6 +38,10 @@
 #include <fcntl.h>
 #include "../tw_atomic.hpp"
 
+#ifndef FUSE_SUPER_MAGIC
+#define FUSE_SUPER_MAGIC 0x65735546
+#endif
+
 #define WATCH_FLAGS ( IN_CREATE | IN_DELETE | IN_MOVE | IN_MODIFY )
 
 MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
@@ -64,8 +68,8 @@ MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
 		MTPE("Failed to init mtpMutex\n");
 		use_mutex = false;
 	}
-	if (pthread_mutex_init(&inMutex, NULL) != 0) {
-		MTPE("Failed to init inMutex\n");
+	if (pthread_mutex_init(&pendingMutex, NULL) != 0) {
+		MTPE("Failed to init pendingMutex\n");
 		pthread_mutex_destroy(&mtpMutex);
 		use_mutex = false;
 	}
@@ -88,11 +92,13 @@ MtpStorage::~MtpStorage() {
 	// deleting all of the trees and nodes.
 	delete mtpmap[0];
 	mtpmap.clear();
+	nodemap.clear();
+	proplistcache.clear();
 	if (use_mutex) {
 		use_mutex = false;
 		MTPD("~MtpStorage destroying mutexes\n");
 		pthread_mutex_destroy(&mtpMutex);
-		pthread_mutex_destroy(&inMutex);
+		pthread_mutex_destroy(&pendingMutex);
 	}
 }
 
@@ -255,6 +261,7 @@ void MtpStorage::endSendObject(const char* path, MtpObjectHandle handle, MtpObje
 		return;	// just ignore if this is for another storage
 
 	node->addProperties(path, mStorageID);
+	invalidatePropList(node->getMtpParentId());
 	handleCurrentlySending = 0;
 	// TODO: are we supposed to send an event about an upload by the initiator?
 	if (sendEvents)
@@ -284,7 +291,6 @@ int MtpStorage::getObjectFilePath(MtpObjectHandle handle, MtpString& outFilePath
 int MtpStorage::readDir(const std::string& path, Tree* tree)
 {
 	struct dirent *de;
-	int storageID = getStorageID();
 	MtpObjectHandle parent = tree->Mtpid();
 
 	DIR *d = opendir(path.c_str());
@@ -293,23 +299,33 @@ int MtpStorage::readDir(const std::string& path, Tree* tree)
 		MTPE("error opening '%s' -- error: %s\n", path.c_str(), strerror(errno));
 		return -1;
 	}
+	// Because exfat-fuse causes issues with dirent, we use stat on fuse
+	// for things that dirent should be able to do
+	struct statfs fs;
+	bool trustDType = fstatfs(dirfd(d), &fs) == 0 && fs.f_type != FUSE_SUPER_MAGIC;
+	std::string item;
 	// TODO: for refreshing dirs: capture old entries here
 	while ((de = readdir(d)) != NULL) {
-		// Because exfat-fuse causes issues with dirent, we will use stat
-		// for some things that dirent should be able to do
-		std::string item = path + "/" + de->d_name;
-		struct stat st;
-		if (lstat(item.c_str(), &st)) {
-			MTPE("Error running lstat on '%s'\n", item.c_str());
-			return -1;
-		}
 		// TODO: if we want to use this for refreshing dirs too, first find existing name and overwrite
 		if (strcmp(de->d_name, ".") == 0)
 			continue;
 		if (strcmp(de->d_name, "..") == 0)
 			continue;
-		Node* node = addNewNode(st.st_mode & S_IFDIR, tree, de->d_name);
-		node->addProperties(item, storageID);
+		bool isDir;
+		if (trustDType && de->d_type != DT_UNKNOWN) {
+			isDir = de->d_type == DT_DIR;
+		} else {
+			item = path + "/" + de->d_name;
+			struct stat st;
+			if (lstat(item.c_str(), &st)) {
+				MTPE("Error running lstat on '%s'\n", item.c_str());
+				closedir(d);
+				return -1;
+			}
+			isDir = S_ISDIR(st.st_mode);
+		}
+		// properties are read when they are first asked for, see loadProperties
+		addNewNode(isDir, tree, de->d_name);
 		//if (sendEvents)
 		//	mServer->sendObjectAdded(node->Mtpid());
 		//	sending events here makes simple-mtpfs very slow, and it is probably the wrong thing to do anyway
@@ -334,10 +350,8 @@ int MtpStorage::deleteFile(MtpObjectHandle handle) {
 		MTPE("parent tree for handle %u not found\n", parent);
 		return -1;
 	}
-	if (node->isDir()) {
-		MTPD("deleting tree from mtpmap: %u\n", handle);
-		mtpmap.erase(handle);
-	}
+	forgetNode(node);
+	invalidatePropList(parent);
 
 	MTPD("deleting handle: %u\n", handle);
 	tree->deleteNode(handle);
@@ -356,7 +370,8 @@ void MtpStorage::queryNodeProperties(std::vector<MtpStorage::PropEntry>& results
 	{
 		// add all properties
 		MTPD("MtpStorage::queryNodeProperties for all properties\n");
-		std::vector<Node::mtpProperty> mtpprop = node->getMtpProps();
+		loadProperties(node);
+		const std::vector<Node::mtpProperty>& mtpprop = node->getMtpProps();
 		for (size_t i = 0; i < mtpprop.size(); ++i) {
 			pe.property = mtpprop[i].property;
 			pe.datatype = mtpprop[i].dataType;
@@ -401,6 +416,7 @@ void MtpStorage::queryNodeProperties(std::vector<MtpStorage::PropEntry>& results
 
 		default:
 		{
+			loadProperties(node);
 			const Node::mtpProperty& prop = node->getProperty(property);
 			if (prop.property != property)
 			{
@@ -434,94 +450,147 @@ int MtpStorage::getObjectPropertyList(MtpObjectHandle handle, uint32_t format, u
 	// depth == 0xffffffff -> all objects incl. and below handle
 
 	std::vector<PropEntry> results;
+	Tree* dir = NULL;
 
 	if (handle == 0xffffffff) {
 		// TODO: all object on all storages (needs a different design, result packet needs to be built by server instead of storage)
 	} else if (handle == 0)	{
 		// all objects at the root level
-		Tree* root = mtpmap[0];
+		dir = mtpmap[0];
+	} else {
+		Node* node = findNode(handle);
+		if (!node) {
+			// Item is not on this storage device
+			return -1;
+		}
+		if (depth == 1 && node->isDir()) {
+			// the children of a directory
+			dir = static_cast<Tree*>(node);
+		} else {
+			// single object
+			queryNodeProperties(results, node, property, groupCode, mStorageID);
+		}
+	}
+
+	if (dir) {
+		if (!dir->wasAlreadyRead())
+			readDir(getNodePath(dir), dir);
+		if (property == 0xffffffff) {
+			// hosts enumerating a tree ask for this a lot, send the cached list
+			const PropListCache& cache = getPropListCache(dir);
+			MTPD("count: %u (cached)\n", cache.count);
+			packet.putUInt32(cache.count);
+			if (!cache.data.empty())
+				packet.putData(&cache.data[0], cache.data.size());
+			return 0;
+		}
 		MtpObjectHandleList list;
-		root->getmtpids(&list);
+		dir->getmtpids(&list);
 		for (MtpObjectHandleList::iterator it = list.begin(); it != list.end(); ++it) {
-			Node* node = root->findNode(*it);
+			Node* node = dir->findNode(*it);
 			if (!node) {
-				MTPE("BUG: node not found for root entry with handle %u\n", *it);
+				MTPE("BUG: node not found for entry with handle %u\n", *it);
 				break;
 			}
 			queryNodeProperties(results, node, property, groupCode, mStorageID);
 		}
-	} else {
-		// single object
-		Node* node = findNode(handle);
-		if (!node) {
-			// Item is not on this storage device
-			return -1;
-		}
-		queryNodeProperties(results, node, property, groupCode, mStorageID);
 	}
 
 	MTPD("count: %u\n", results.size());
 	packet.putUInt32(results.size());
+	for (size_t i = 0; i < results.size(); ++i)
+		putPropEntry(packet, results[i]);
+	return 0;
+}
 
-	for (size_t i = 0; i < results.size(); ++i) {
-		PropEntry& p = results[i];
-		MTPD("handle: %u, propertyCode: %x = %s, datatype: %x, value: %llu\n",
-				p.handle, p.property, MtpDebug::getObjectPropCodeName(p.property),
-				p.datatype, p.intvalue);
-		packet.putUInt32(p.handle);
-		packet.putUInt16(p.property);
-		packet.putUInt16(p.datatype);
-		switch (p.datatype) {
-			case MTP_TYPE_INT8:
-				MTPD("MTP_TYPE_INT8\n");
-				packet.putInt8(p.intvalue);
-				break;
-			case MTP_TYPE_UINT8:
-				MTPD("MTP_TYPE_UINT8\n");
-				packet.putUInt8(p.intvalue);
-				break;
-			case MTP_TYPE_INT16:
-				MTPD("MTP_TYPE_INT16\n");
-				packet.putInt16(p.intvalue);
-				break;
-			case MTP_TYPE_UINT16:
-				MTPD("MTP_TYPE_UINT16\n");
-				packet.putUInt16(p.intvalue);
-				break;
-			case MTP_TYPE_INT32:
-				MTPD("MTP_TYPE_INT32\n");
-				packet.putInt32(p.intvalue);
-				break;
-			case MTP_TYPE_UINT32:
-				MTPD("MTP_TYPE_UINT32\n");
-				packet.putUInt32(p.intvalue);
-				break;
-			case MTP_TYPE_INT64:
-				MTPD("MTP_TYPE_INT64\n");
-				packet.putInt64(p.intvalue);
-				break;
-			case MTP_TYPE_UINT64:
-				MTPD("MTP_TYPE_UINT64\n");
-				packet.putUInt64(p.intvalue);
-				break;
-			case MTP_TYPE_INT128:
-				MTPD("MTP_TYPE_INT128\n");
-				packet.putInt128(p.intvalue);
-				break;
-			case MTP_TYPE_UINT128:
-				MTPD("MTP_TYPE_UINT128\n");
-				packet.putUInt128(p.intvalue);
-				break;
-			case MTP_TYPE_STR:
-				MTPD("MTP_TYPE_STR: %s\n", p.strvalue.c_str());
-				packet.putString(p.strvalue.c_str());
-				break;
-			default:
-				MTPE("bad or unsupported data type: %x in MyMtpDatabase::getObjectPropertyList", p.datatype);
-				break;
-		}
+const MtpStorage::PropListCache& MtpStorage::getPropListCache(Tree* tree) {
+	PropListCache& cache = proplistcache[tree->Mtpid()];
+	if (cache.valid)
+		return cache;
+
+	std::vector<PropEntry> results;
+	MtpObjectHandleList list;
+	tree->getmtpids(&list);
+	for (MtpObjectHandleList::iterator it = list.begin(); it != list.end(); ++it) {
+		Node* node = tree->findNode(*it);
+		if (node)
+			queryNodeProperties(results, node, 0xffffffff, 0, mStorageID);
+	}
+
+	MtpDataPacket scratch;
+	for (size_t i = 0; i < results.size(); ++i)
+		putPropEntry(scratch, results[i]);
+	int length;
+	uint8_t* data = (uint8_t*)scratch.getData(length);
+	cache.data.assign(data, data + length);
+	free(data);
+	cache.count = results.size();
+	cache.valid = true;
+	return cache;
+}
+
+void MtpStorage::invalidatePropList(MtpObjectHandle parent) {
+	std::unordered_map<MtpObjectHandle, PropListCache>::iterator it = proplistcache.find(parent);
+	if (it != proplistcache.end())
+		proplistcache.erase(it);
+}
+
+void MtpStorage::putPropEntry(MtpDataPacket& packet, const PropEntry& p) {
+	MTPD("handle: %u, propertyCode: %x = %s, datatype: %x, value: %llu\n",
+			p.handle, p.property, MtpDebug::getObjectPropCodeName(p.property),
+			p.datatype, p.intvalue);
+	packet.putUInt32(p.handle);
+	packet.putUInt16(p.property);
+	packet.putUInt16(p.datatype);
+	switch (p.datatype) {
+		case MTP_TYPE_INT8:
+			MTPD("MTP_TYPE_INT8\n");
+			packet.putInt8(p.intvalue);
+			break;
+		case MTP_TYPE_UINT8:
+			MTPD("MTP_TYPE_UINT8\n");
+			packet.putUInt8(p.intvalue);
+			break;
+		case MTP_TYPE_INT16:
+			MTPD("MTP_TYPE_INT16\n");
+			packet.putInt16(p.intvalue);
+			break;
+		case MTP_TYPE_UINT16:
+			MTPD("MTP_TYPE_UINT16\n");
+			packet.putUInt16(p.intvalue);
+			break;
+		case MTP_TYPE_INT32:
+			MTPD("MTP_TYPE_INT32\n");
+			packet.putInt32(p.intvalue);
+			break;
+		case MTP_TYPE_UINT32:
+			MTPD("MTP_TYPE_UINT32\n");
+			packet.putUInt32(p.intvalue);
+			break;
+		case MTP_TYPE_INT64:
+			MTPD("MTP_TYPE_INT64\n");
+			packet.putInt64(p.intvalue);
+			break;
+		case MTP_TYPE_UINT64:
+			MTPD("MTP_TYPE_UINT64\n");
+			packet.putUInt64(p.intvalue);
+			break;
+		case MTP_TYPE_INT128:
+			MTPD("MTP_TYPE_INT128\n");
+			packet.putInt128(p.intvalue);
+			break;
+		case MTP_TYPE_UINT128:
+			MTPD("MTP_TYPE_UINT128\n");
+			packet.putUInt128(p.intvalue);
+			break;
+		case MTP_TYPE_STR:
+			MTPD("MTP_TYPE_STR: %s\n", p.strvalue.c_str());
+			packet.putString(p.strvalue.c_str());
+			break;
+		default:
+			MTPE("bad or unsupported data type: %x in MyMtpDatabase::getObjectPropertyList", p.datatype);
+			break;
 	}
-	return 0;
 }
 
 int MtpStorage::renameObject(MtpObjectHandle handle, std::string newName) {
@@ -529,48 +598,48 @@ int MtpStorage::renameObject(MtpObjectHandle handle, std::string newName) {
 	if (handle == MTP_PARENT_ROOT) {
 		MTPE("parent == MTP_PARENT_ROOT, cannot rename root\n");
 		return -1;
-	} else {
-		for (iter i = mtpmap.begin(); i != mtpmap.end(); i++) {
-			Node* node = i->second->findNode(handle);
-			if (node != NULL) {
-				std::string oldName = getNodePath(node);
-				std::string parentdir = oldName.substr(0, oldName.find_last_of('/'));
-				std::string newFullName = parentdir + "/" + newName;
-				MTPD("old: '%s', new: '%s'\n", oldName.c_str(), newFullName.c_str());
-				if (rename(oldName.c_str(), newFullName.c_str()) == 0) {
-					node->rename(newName);
-					return 0;
-				} else {
-					MTPE("MtpStorage::renameObject failed, handle: %u, new name: '%s'\n", handle, newName.c_str());
-					return -1;
-				}
-			}
-		}
 	}
-	// handle not found on this storage
+	Node* node = findNode(handle);
+	if (node == NULL) {
+		// handle not found on this storage
+		return -1;
+	}
+	iter parent = mtpmap.find(node->getMtpParentId());
+	if (parent == mtpmap.end()) {
+		MTPE("parent tree for handle %u not found\n", node->getMtpParentId());
+		return -1;
+	}
+	std::string oldName = getNodePath(node);
+	std::string newFullName(oldName, 0, oldName.find_last_of('/') + 1);
+	newFullName += newName;
+	MTPD("old: '%s', new: '%s'\n", oldName.c_str(), newFullName.c_str());
+	if (rename(oldName.c_str(), newFullName.c_str()) == 0) {
+		parent->second->renameEntry(node, newName);
+		invalidatePropList(parent->first);
+		return 0;
+	}
+	MTPE("MtpStorage::renameObject failed, handle: %u, new name: '%s'\n", handle, newName.c_str());
 	return -1;
 }
 
 int MtpStorage::getObjectPropertyValue(MtpObjectHandle handle, MtpObjectProperty property, MtpStorage::PropEntry& pe) {
-	Node *node;
-	for (iter i = mtpmap.begin(); i != mtpmap.end(); i++) {
-		node = i->second->findNode(handle);
-		if (node != NULL) {
-			const Node::mtpProperty& prop = node->getProperty(property);
-			if (prop.property != property) {
-				MTPD("getObjectPropertyValue: unknown property %x for handle %u\n", property, handle);
-				return -1;
-			}
-			pe.datatype = prop.dataType;
-			pe.intvalue = prop.valueInt;
-			pe.strvalue = prop.valueStr;
-			pe.handle = handle;
-			pe.property = property;
-			return 0;
-		}
+	Node* node = findNode(handle);
+	if (node == NULL) {
+		// handle not found on this storage
+		return -1;
 	}
-	// handle not found on this storage
-	return -1;
+	loadProperties(node);
+	const Node::mtpProperty& prop = node->getProperty(property);
+	if (prop.property != property) {
+		MTPD("getObjectPropertyValue: unknown property %x for handle %u\n", property, handle);
+		return -1;
+	}
+	pe.datatype = prop.dataType;
+	pe.intvalue = prop.valueInt;
+	pe.strvalue = prop.valueStr;
+	pe.handle = handle;
+	pe.property = property;
+	return 0;
 }
 
 pthread_t MtpStorage::inotify(void) {
@@ -610,65 +679,105 @@ int MtpStorage::addInotify(Tree* tree) {
 	return 0;
 }
 
-void MtpStorage::handleInotifyEvent(struct inotify_event* event)
+// Called on the inotify thread. Repeated events for the same entry are
+// folded together so that a burst of writes costs a single update.
+void MtpStorage::queueInotifyEvent(const struct inotify_event* event)
+{
+	std::pair<int, std::string> key(event->wd, event->name);
+	pthread_mutex_lock(&pendingMutex);
+	std::map<std::pair<int, std::string>, size_t>::iterator it = pendingIndex.find(key);
+	if (it != pendingIndex.end()) {
+		PendingEvent& last = pendingEvents[it->second];
+		if (event->mask & IN_MODIFY) {
+			// a queued create or modify already reports the change
+			if (last.mask & (IN_CREATE | IN_MOVED_TO | IN_MODIFY)) {
+				pthread_mutex_unlock(&pendingMutex);
+				return;
+			}
+		} else if (last.mask & IN_MODIFY) {
+			// the delete or create supersedes the pending modify
+			last.mask = event->mask;
+			pthread_mutex_unlock(&pendingMutex);
+			return;
+		}
+	}
+	PendingEvent pe;
+	pe.wd = event->wd;
+	pe.mask = event->mask;
+	pe.name = event->name;
+	pendingEvents.push_back(pe);
+	pendingIndex[key] = pendingEvents.size() - 1;
+	pthread_mutex_unlock(&pendingMutex);
+}
+
+// Must be called with mtpMutex held
+void MtpStorage::applyPendingEvents()
 {
-	std::map<int, Tree*>::iterator it = inotifymap.find(event->wd);
+	std::vector<PendingEvent> events;
+	pthread_mutex_lock(&pendingMutex);
+	events.swap(pendingEvents);
+	pendingIndex.clear();
+	pthread_mutex_unlock(&pendingMutex);
+	if (events.empty())
+		return;
+	MTPD("applying %zu inotify events\n", events.size());
+	for (std::vector<PendingEvent>::iterator it = events.begin(); it != events.end(); ++it)
+		handleInotifyEvent(*it);
+}
+
+void MtpStorage::handleInotifyEvent(const PendingEvent& event)
+{
+	std::map<int, Tree*>::iterator it = inotifymap.find(event.wd);
 	if (it == inotifymap.end()) {
-		MTPE("Unable to locate inotify_wd: %i\n", event->wd);
+		// the watched directory may have been deleted since the event was queued
+		MTPD("Unable to locate inotify_wd: %i\n", event.wd);
 		return;
 	}
 	Tree* tree = it->second;
 	MTPD("inotify_t tree: %x '%s'\n", tree, tree->getName().c_str());
-	Node* node = tree->findEntryByName(basename(event->name));
+	Node* node = tree->findEntryByName(event.name);
 	if (node && node->Mtpid() == handleCurrentlySending) {
 		MTPD("ignoring inotify event for currently uploading file, handle: %u\n", node->Mtpid());
 		return;
 	}
-	if (event->mask & IN_CREATE || event->mask & IN_MOVED_TO) {
-		if (event->mask & IN_ISDIR) {
+	if (event.mask & IN_CREATE || event.mask & IN_MOVED_TO) {
+		if (event.mask & IN_ISDIR) {
 			MTPD("inotify_t create is dir\n");
 		} else {
 			MTPD("inotify_t create is file\n");
 		}
 		if (node == NULL) {
-			node = addNewNode(event->mask & IN_ISDIR, tree, event->name);
-			std::string item = getNodePath(tree) + "/" + event->name;
-			node->addProperties(item, getStorageID());
+			node = addNewNode(event.mask & IN_ISDIR, tree, event.name);
 			mServer->sendObjectAdded(node->Mtpid());
 		} else {
 			MTPD("inotify_t item already exists.\n");
 		}
-		if (event->mask & IN_ISDIR) {
+		if (event.mask & IN_ISDIR) {
 			// TODO: do we need to do anything here? probably not until someone reads from the dir...
 		}
-	} else if (event->mask & IN_DELETE || event->mask & IN_MOVED_FROM) {
-		if (event->mask & IN_ISDIR) {
-			MTPD("inotify_t Directory %s deleted\n", event->name);
+	} else if (event.mask & IN_DELETE || event.mask & IN_MOVED_FROM) {
+		if (event.mask & IN_ISDIR) {
+			MTPD("inotify_t Directory %s deleted\n", event.name.c_str());
 		} else {
-			MTPD("inotify_t File %s deleted\n", event->name);
+			MTPD("inotify_t File %s deleted\n", event.name.c_str());
 		}
 		if (node)
 		{
-			if (event->mask & IN_ISDIR) {
-				for (std::map<int, Tree*>::iterator it = inotifymap.begin(); it != inotifymap.end(); ++it) {
-					if (it->second == node) {
-						inotify_rm_watch(inotify_fd, it->first);
-						MTPD("inotify_t removing watch on '%s'\n", getNodePath(it->second).c_str());
-						inotifymap.erase(it->first);
-						break;
-					}
-
-				}
-			}
+			// deleteFile also removes the inotify watches of deleted dirs
 			MtpObjectHandle handle = node->Mtpid();
 			deleteFile(handle);
 			mServer->sendObjectRemoved(handle);
 		} else {
 			MTPD("inotify_t already removed.\n");
 		}
-	} else if (event->mask & IN_MODIFY) {
-		MTPD("inotify_t item %s modified.\n", event->name);
-		if (node != NULL) {
+	} else if (event.mask & IN_MODIFY) {
+		MTPD("inotify_t item %s modified.\n", event.name.c_str());
+		if (node != NULL && !node->hasProperties()) {
+			// nothing was read yet to compare with, report it as changed
+			loadProperties(node);
+			invalidatePropList(tree->Mtpid());
+			mServer->sendObjectUpdated(node->Mtpid());
+		} else if (node != NULL) {
 			uint64_t orig_size = node->getProperty(MTP_PROPERTY_OBJECT_SIZE).valueInt;
 			struct stat st;
 			uint64_t new_size = 0;
@@ -677,12 +786,13 @@ void MtpStorage::handleInotifyEvent(struct inotify_event* event)
 			if (orig_size != new_size) {
 				MTPD("size changed from %llu to %llu on mtpid: %u\n", orig_size, new_size, node->Mtpid());
 				node->updateProperty(MTP_PROPERTY_OBJECT_SIZE, new_size, "", MTP_TYPE_UINT64);
+				invalidatePropList(tree->Mtpid());
 				mServer->sendObjectUpdated(node->Mtpid());
 			}
 		} else {
 			MTPE("inotify_t modified item not found\n");
 		}
-	} else if (event->mask & IN_DELETE_SELF || event->mask & IN_MOVE_SELF) {
+	} else if (event.mask & IN_DELETE_SELF || event.mask & IN_MOVE_SELF) {
 		// TODO: is this always already handled by IN_DELETE for the parent dir?
 	}
 }
@@ -703,8 +813,13 @@ int MtpStorage::inotify_t(void) {
 		seltmout.tv_sec = 0;
 		seltmout.tv_usec = 25000;
 		sel_ret = select(inotify_fd + 1, &fdset, NULL, NULL, &seltmout);
-		if (sel_ret == 0)
+		if (sel_ret == 0) {
+			if (pthread_mutex_trylock(&mtpMutex) == 0) {
+				applyPendingEvents();
+				pthread_mutex_unlock(&mtpMutex);
+			}
 			continue;
+		}
 		int i = 0;
 		int len = read(inotify_fd, buf, EVENT_BUF_LEN);
 
@@ -718,12 +833,17 @@ int MtpStorage::inotify_t(void) {
 			struct inotify_event *event = (struct inotify_event *) &buf[i];
 			if (event->len) {
 				MTPD("inotify event: wd: %i, mask: %x, name: %s\n", event->wd, event->mask, event->name);
-				lockMutex(1);
-				handleInotifyEvent(event);
-				unlockMutex(1);
+				queueInotifyEvent(event);
 			}
 			i += EVENT_SIZE + event->len;
 		}
+		// Apply the batch now if the server is idle; otherwise it picks
+		// the events up before its next request, or we retry on the next
+		// select timeout.
+		if (pthread_mutex_trylock(&mtpMutex) == 0) {
+			applyPendingEvents();
+			pthread_mutex_unlock(&mtpMutex);
+		}
 	}
 	MTPD("inotify_thread_kill received!\n");
 	// This cleanup is handled in the destructor.
@@ -736,29 +856,24 @@ int MtpStorage::inotify_t(void) {
 
 Node* MtpStorage::findNodeByPath(const std::string& path) {
 	MTPD("findNodeByPath: %s\n", path.c_str());
-	std::string match = path.substr(0, mtpstorageparent.size());
-	if (match != mtpstorageparent) {
+	if (path.compare(0, mtpstorageparent.size(), mtpstorageparent) != 0) {
 		// not on this device
-		MTPD("no match: %s is not on storage %s\n", match.c_str(), mtpstorageparent.c_str());
+		MTPD("no match: %s is not on storage %s\n", path.c_str(), mtpstorageparent.c_str());
 		return NULL;
 	}
 
-	// TODO: fix and test this
-	std::string p = path.substr(mtpstorageparent.size()+1);	// cut off "/" after storage root too
 	Tree* tree = mtpmap[0]; // start at storage root
-
 	Node* node = NULL;
-	while (!p.empty()) {
-		size_t slashpos = p.find('/');
-		std::string e;
-		if (slashpos != std::string::npos) {
-			e = p;
-			p.clear();
-		} else {
-			e = p.substr(0, slashpos);
-			p = p.substr(slashpos + 1);
-		}
-		MTPD("path element: %s, rest: %s\n", e.c_str(), p.c_str());
+	std::string e;	// reused for each path element
+	size_t pos = mtpstorageparent.size() + 1;	// skip "/" after storage root too
+	while (pos < path.size()) {
+		size_t slashpos = path.find('/', pos);
+		if (slashpos == std::string::npos)
+			slashpos = path.size();
+		e.assign(path, pos, slashpos - pos);
+		pos = slashpos + 1;
+		if (e.empty())
+			continue;
 		node = tree->findEntryByName(e);
 		if (!node) {
 			MTPE("path element of %s not found: %s\n", path.c_str(), e.c_str());
@@ -766,12 +881,13 @@ Node* MtpStorage::findNodeByPath(const std::string& path) {
 		}
 		if (node->isDir())
 			tree = static_cast<Tree*>(node);
-		else if (!p.empty()) {
+		else if (pos < path.size()) {
 			MTPE("path element of %s is not a directory: %s node: %p\n", path.c_str(), e.c_str(), node);
 			return NULL;
 		}
 	}
-	MTPD("findNodeByPath: found node %p, handle: %u, name: %s\n", node, node->Mtpid(), node->getName().c_str());
+	if (node)
+		MTPD("findNodeByPath: found node %p, handle: %u, name: %s\n", node, node->Mtpid(), node->getName().c_str());
 	return node;
 }
 
@@ -789,68 +905,91 @@ Node* MtpStorage::addNewNode(bool isDir, Tree* tree, const std::string& name)
 		node = mtpmap[mtpid] = new Tree(mtpid, parent, name);
 	else
 		node = new Node(mtpid, parent, name);
+	nodemap[mtpid] = node;
 	tree->addEntry(node);
+	invalidatePropList(parent);
 	return node;
 }
 
 Node* MtpStorage::findNode(MtpObjectHandle handle) {
-	for (iter i = mtpmap.begin(); i != mtpmap.end(); i++) {
-		Node* node = i->second->findNode(handle);
-		if (node != NULL) {
-			MTPD("findNode: found node %p for handle %u, name: %s\n", node, handle, node->getName().c_str());
-			if (node->Mtpid() != handle)
-			{
-				MTPE("BUG: entry for handle %u points to node with handle %u\n", handle, node->Mtpid());
-			}
-			return node;
-		}
+	std::unordered_map<MtpObjectHandle, Node*>::iterator it = nodemap.find(handle);
+	if (it != nodemap.end()) {
+		MTPD("findNode: found node %p for handle %u, name: %s\n", it->second, handle, it->second->getName().c_str());
+		return it->second;
 	}
 	// Item is not on this storage device
-	MTPD("MtpStorage::findNode: no node found for handle %u on storage %u, searched %u trees\n", handle, mStorageID, mtpmap.size());
+	MTPD("MtpStorage::findNode: no node found for handle %u on storage %u\n", handle, mStorageID);
 	return NULL;
 }
 
+// Drops node and everything below it from the indexes, before the tree
+// that owns it deletes it
+void MtpStorage::forgetNode(Node* node) {
+	if (node->isDir()) {
+		Tree* tree = static_cast<Tree*>(node);
+		MtpObjectHandleList children;
+		tree->getmtpids(&children);
+		for (MtpObjectHandleList::iterator it = children.begin(); it != children.end(); ++it) {
+			Node* child = tree->findNode(*it);
+			if (child)
+				forgetNode(child);
+		}
+		for (std::map<int, Tree*>::iterator it = inotifymap.begin(); it != inotifymap.end(); ++it) {
+			if (it->second == tree) {
+				inotify_rm_watch(inotify_fd, it->first);
+				inotifymap.erase(it);
+				break;
+			}
+		}
+		MTPD("deleting tree from mtpmap: %u\n", node->Mtpid());
+		mtpmap.erase(node->Mtpid());
+		invalidatePropList(node->Mtpid());
+	}
+	nodemap.erase(node->Mtpid());
+}
+
+void MtpStorage::loadProperties(Node* node) {
+	if (!node->hasProperties())
+		node->addProperties(getNodePath(node), mStorageID);
+}
+
 std::string MtpStorage::getNodePath(Node* node) {
-	std::string path;
 	MTPD("getNodePath: node %p, handle %u\n", node, node->Mtpid());
+	// Collect the names up to the root, then build the path once
+	std::vector<const std::string*> names;
+	size_t length = mtpstorageparent.size();
 	while (node)
 	{
-		path = "/" + node->getName() + path;
+		names.push_back(&node->getName());
+		length += node->getName().size() + 1;
 		MtpObjectHandle parent = node->getMtpParentId();
 		if (parent == 0)	// root
 			break;
 		node = findNode(parent);
 	}
-	path = mtpstorageparent + path;
+	std::string path;
+	path.reserve(length);
+	path = mtpstorageparent;
+	for (std::vector<const std::string*>::reverse_iterator it = names.rbegin(); it != names.rend(); ++it) {
+		path += '/';
+		path += **it;
+	}
 	MTPD("getNodePath: path %s\n", path.c_str());
 	return path;
 }
 
+// Only the server thread takes mtpMutex blocking; the inotify thread
+// never holds it for longer than one batch of queued events.
 void MtpStorage::lockMutex(int thread_type) {
 	if (!use_mutex)
 		return; // mutex is disabled
-	if (thread_type) {
-		// inotify thread
-		pthread_mutex_lock(&inMutex);
-		while (pthread_mutex_trylock(&mtpMutex)) {
-			pthread_mutex_unlock(&inMutex);
-			usleep(32000);
-			pthread_mutex_lock(&inMutex);
-		}
-	} else {
-		// main mtp thread
-		pthread_mutex_lock(&mtpMutex);
-		while (pthread_mutex_trylock(&inMutex)) {
-			pthread_mutex_unlock(&mtpMutex);
-			usleep(13000);
-			pthread_mutex_lock(&mtpMutex);
-		}
-	}
+	pthread_mutex_lock(&mtpMutex);
+	if (!thread_type)
+		applyPendingEvents();	// let the request see the current tree
 }
 
-void MtpStorage::unlockMutex(int thread_type) {
+void MtpStorage::unlockMutex(int thread_type __unused) {
 	if (!use_mutex)
 		return; // mutex is disabled
-	pthread_mutex_unlock(&inMutex);
 	pthread_mutex_unlock(&mtpMutex);
 }
@@ -24,6 +24,8 @@
 #include <string>
 #include <deque>
 #include <map>
+#include <unordered_map>
+#include <vector>
 #include <libgen.h>
 #include <pthread.h>
 #include "btree.hpp"
@@ -45,9 +47,10 @@ private:
     uint64_t                mReserveSpace;
     bool                    mRemovable;
 	MtpServer*				mServer;
-    typedef std::map<int, Tree*> maptree;
+    typedef std::unordered_map<MtpObjectHandle, Tree*> maptree;
     typedef maptree::iterator iter;
-    maptree mtpmap;
+    maptree mtpmap;	// directories by handle
+    std::unordered_map<MtpObjectHandle, Node*> nodemap;	// all nodes but the root by handle
 	std::string mtpstorageparent;
 	android::Mutex           mMutex;
 
@@ -99,7 +102,18 @@ private:
 	pthread_t inotify_thread;
 	int inotify_fd;
 	int addInotify(Tree* tree);
-	void handleInotifyEvent(struct inotify_event* event);
+
+	// An inotify event waiting to be applied to the tree
+	struct PendingEvent {
+		int wd;
+		uint32_t mask;
+		std::string name;
+	};
+	std::vector<PendingEvent> pendingEvents;	// in arrival order, guarded by pendingMutex
+	std::map<std::pair<int, std::string>, size_t> pendingIndex;	// (wd, name) -> last queued event
+	void queueInotifyEvent(const struct inotify_event* event);
+	void applyPendingEvents();
+	void handleInotifyEvent(const PendingEvent& event);
 
 	bool sendEvents;
 	MtpObjectHandle handleCurrentlySending;
@@ -107,13 +121,28 @@ private:
 	Node* addNewNode(bool isDir, Tree* tree, const std::string& name);
 	Node* findNode(MtpObjectHandle handle);
 	Node* findNodeByPath(const std::string& path);
+	void forgetNode(Node* node);
+	void loadProperties(Node* node);
+
+	// All properties of a directory's children, serialized as in an
+	// ObjectPropList dataset without its element count
+	struct PropListCache {
+		bool valid;
+		uint32_t count;
+		std::vector<uint8_t> data;
+		PropListCache() : valid(false), count(0) {}
+	};
+	std::unordered_map<MtpObjectHandle, PropListCache> proplistcache;	// by directory handle
+	const PropListCache& getPropListCache(Tree* tree);
+	void invalidatePropList(MtpObjectHandle parent);
+	static void putPropEntry(MtpDataPacket& packet, const PropEntry& p);
 	std::string getNodePath(Node* node);
 
 	void queryNodeProperties(std::vector<PropEntry>& results, Node* node, uint32_t property, int groupCode, MtpStorageID storageID);
 
 	bool use_mutex;
-	pthread_mutex_t inMutex; // inotify mutex
-	pthread_mutex_t mtpMutex; // main mtp mutex
+	pthread_mutex_t pendingMutex; // inotify event queue
+	pthread_mutex_t mtpMutex; // node tree
 	TWAtomicInt inotify_thread_kill;
 };
 
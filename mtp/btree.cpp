@@ -18,13 +18,18 @@
 #include "btree.hpp"
 #include "MtpDebug.h"
 
+// An entry in both maps of a Tree, with the hash bucket
+#define TREE_ENTRY_BYTES 96
+
 // Constructor
 Tree::Tree(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& name)
 	: Node(handle, parent, name), alreadyRead(false) {
+	twrpMemory_Add(memoryCounter, sizeof(Tree) - sizeof(Node));
 }
 
 // Destructor
 Tree::~Tree() {
+	twrpMemory_Add(memoryCounter, -(int64_t)(entries.size() * TREE_ENTRY_BYTES + sizeof(Tree) - sizeof(Node)));
 	for (std::map<MtpObjectHandle, Node*>::iterator it = entries.begin(); it != entries.end(); ++it)
 		delete it->second;
 	entries.clear();
@@ -45,19 +50,28 @@ void Tree::addEntry(Node* node) {
 		MTPE("Tree::addEntry: not adding node with handle %u == parent.\n", node->Mtpid());
 		return;
 	}
-	entries[node->Mtpid()] = node;
+	Node*& entry = entries[node->Mtpid()];
+	if (!entry)
+		twrpMemory_Add(memoryCounter, TREE_ENTRY_BYTES);
+	entry = node;
+	names[node->getName()] = node;
 }
 
-Node* Tree::findEntryByName(std::string name) {
-	for (std::map<MtpObjectHandle, Node*>::iterator it = entries.begin(); it != entries.end(); ++it)
-	{
-		Node* node = it->second;
-		if (node->getName().compare(name) == 0 && node->Mtpid() > 0)
-			return node;
-	}
+Node* Tree::findEntryByName(const std::string& name) {
+	std::unordered_map<std::string, Node*>::iterator it = names.find(name);
+	if (it != names.end())
+		return it->second;
 	return NULL;
 }
 
+void Tree::renameEntry(Node* node, const std::string& newName) {
+	std::unordered_map<std::string, Node*>::iterator it = names.find(node->getName());
+	if (it != names.end() && it->second == node)
+		names.erase(it);
+	node->rename(newName);
+	names[newName] = node;
+}
+
 Node* Tree::findNode(MtpObjectHandle handle) {
 	std::map<MtpObjectHandle, Node*>::iterator it = entries.find(handle);
 	if (it != entries.end())
@@ -73,7 +87,11 @@ void Tree::getmtpids(MtpObjectHandleList* mtpids) {
 void Tree::deleteNode(MtpObjectHandle handle) {
 	std::map<MtpObjectHandle, Node*>::iterator it = entries.find(handle);
 	if (it != entries.end()) {
+		std::unordered_map<std::string, Node*>::iterator name = names.find(it->second->getName());
+		if (name != names.end() && name->second == it->second)
+			names.erase(name);
 		delete it->second;
 		entries.erase(it);
+		twrpMemory_Add(memoryCounter, -TREE_ENTRY_BYTES);
 	}
 }
@@ -20,7 +20,9 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <unordered_map>
 #include "MtpTypes.h"
+#include "../twrpMemory.hpp"
 
 // A directory entry
 class Node {
@@ -31,7 +33,7 @@ class Node {
 public:
 	Node();
 	Node(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& name);
-	virtual ~Node() {}
+	virtual ~Node();
 
 	virtual bool isDir() const { return false; }
 
@@ -43,6 +45,7 @@ public:
 	void addProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType);
 	void updateProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType);
 	void addProperties(const std::string& path, int storageID);
+	bool hasProperties() const { return !mtpProp.empty(); }
 	uint64_t getIntProperty(MtpPropertyCode property);
 	struct mtpProperty {
 		MtpPropertyCode property;
@@ -54,11 +57,23 @@ public:
 	std::vector<mtpProperty>& getMtpProps();
 	std::vector<mtpProperty> mtpProp;
 	const mtpProperty& getProperty(MtpPropertyCode property);
+
+	// Counter of the recovery that every node adds its bytes to, NULL if none
+	static twrpMemory_Counter* memoryCounter;
+
+private:
+	int64_t accounted;	// bytes added to memoryCounter for this node
+	void account();
+
+	// Index of the property in mtpProp if it was added by addProperties
+	static int propertySlot(MtpPropertyCode property);
+	mtpProperty* findProperty(MtpPropertyCode property);
 };
 
 // A directory
 class Tree : public Node {
 	std::map<MtpObjectHandle, Node*> entries;
+	std::unordered_map<std::string, Node*> names;	// entries by name
 	bool alreadyRead;
 public:
 	Tree(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& name);
@@ -73,7 +88,8 @@ public:
 	std::string getPath(Node* node);
 	int getMtpParentId() { return Node::getMtpParentId(); }
 	int getMtpParentId(Node* node);
-	Node* findEntryByName(std::string name);
+	Node* findEntryByName(const std::string& name);
+	void renameEntry(Node* node, const std::string& newName);
 	int getCount();
 	bool wasAlreadyRead() const { return alreadyRead; }
 	void setAlreadyRead(bool b) { alreadyRead = b; }
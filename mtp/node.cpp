@@ -31,18 +31,41 @@
 #include "MtpDebug.h"
 
 
+twrpMemory_Counter* Node::memoryCounter = NULL;
+
 Node::Node()
-	: handle(-1), parent(0), name("")
+	: handle(-1), parent(0), name(""), accounted(0)
 {
+	account();
 }
 
 Node::Node(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& name)
-	: handle(handle), parent(parent), name(name)
+	: handle(handle), parent(parent), name(name), accounted(0)
 {
+	account();
+}
+
+Node::~Node() {
+	twrpMemory_Add(memoryCounter, -accounted);
+}
+
+// Brings memoryCounter up to date with what the node holds now
+void Node::account() {
+	if (!memoryCounter)
+		return;
+	int64_t bytes = sizeof(Node) + name.capacity() + mtpProp.capacity() * sizeof(mtpProperty);
+	for (size_t i = 0; i < mtpProp.size(); ++i)
+		bytes += mtpProp[i].valueStr.capacity();
+	twrpMemory_Add(memoryCounter, bytes - accounted);
+	accounted = bytes;
 }
 
 void Node::rename(const std::string& newName) {
 	name = newName;
+	account();
+	// properties that weren't read yet will get the new name when they are
+	if (!hasProperties())
+		return;
 	updateProperty(MTP_PROPERTY_OBJECT_FILE_NAME, 0, name.c_str(), MTP_TYPE_STR);
 	updateProperty(MTP_PROPERTY_NAME, 0, name.c_str(), MTP_TYPE_STR);
 	updateProperty(MTP_PROPERTY_DISPLAY_NAME, 0, name.c_str(), MTP_TYPE_STR);
@@ -52,21 +75,58 @@ MtpObjectHandle Node::Mtpid() const { return handle; }
 MtpObjectHandle Node::getMtpParentId() const { return parent; }
 const std::string& Node::getName() const { return name; }
 
-uint64_t Node::getIntProperty(MtpPropertyCode property) {
-	for (unsigned index = 0; index < mtpProp.size(); ++index) {
-		if (mtpProp[index].property == property)
-			return mtpProp[index].valueInt;
+// Must match the order of the addProperty calls in addProperties
+int Node::propertySlot(MtpPropertyCode property) {
+	switch (property) {
+		case MTP_PROPERTY_STORAGE_ID:				return 0;
+		case MTP_PROPERTY_OBJECT_FORMAT:			return 1;
+		case MTP_PROPERTY_PROTECTION_STATUS:		return 2;
+		case MTP_PROPERTY_OBJECT_SIZE:				return 3;
+		case MTP_PROPERTY_OBJECT_FILE_NAME:			return 4;
+		case MTP_PROPERTY_DATE_MODIFIED:			return 5;
+		case MTP_PROPERTY_PARENT_OBJECT:			return 6;
+		case MTP_PROPERTY_PERSISTENT_UID:			return 7;
+		case MTP_PROPERTY_NAME:						return 8;
+		case MTP_PROPERTY_DISPLAY_NAME:				return 9;
+		case MTP_PROPERTY_DATE_ADDED:				return 10;
+		case MTP_PROPERTY_DESCRIPTION:				return 11;
+		case MTP_PROPERTY_ARTIST:					return 12;
+		case MTP_PROPERTY_ALBUM_NAME:				return 13;
+		case MTP_PROPERTY_ALBUM_ARTIST:				return 14;
+		case MTP_PROPERTY_TRACK:					return 15;
+		case MTP_PROPERTY_ORIGINAL_RELEASE_DATE:	return 16;
+		case MTP_PROPERTY_DURATION:					return 17;
+		case MTP_PROPERTY_GENRE:					return 18;
+		case MTP_PROPERTY_COMPOSER:					return 19;
+		default:									return -1;
+	}
+}
+
+Node::mtpProperty* Node::findProperty(MtpPropertyCode property) {
+	int slot = propertySlot(property);
+	if (slot >= 0 && (size_t)slot < mtpProp.size() && mtpProp[slot].property == property)
+		return &mtpProp[slot];
+	// not added by addProperties, or added out of order
+	for (size_t i = 0; i < mtpProp.size(); ++i) {
+		if (mtpProp[i].property == property)
+			return &mtpProp[i];
 	}
+	return NULL;
+}
+
+uint64_t Node::getIntProperty(MtpPropertyCode property) {
+	const mtpProperty* prop = findProperty(property);
+	if (prop)
+		return prop->valueInt;
 	MTPE("Node::getIntProperty failed to find property %x, returning -1\n", (unsigned)property);
 	return -1;
 }
 
 const Node::mtpProperty& Node::getProperty(MtpPropertyCode property) {
 	static const mtpProperty dummyProp;
-	for (size_t i = 0; i < mtpProp.size(); ++i) {
-		if (mtpProp[i].property == property)
-			return mtpProp[i];
-	}
+	const mtpProperty* prop = findProperty(property);
+	if (prop)
+		return *prop;
 	MTPE("Node::getProperty failed to find property %x, returning dummy property\n", (unsigned)property);
 	return dummyProp;
 }
@@ -82,15 +142,16 @@ void Node::addProperty(MtpPropertyCode property, uint64_t valueInt, std::string
 }
 
 void Node::updateProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType) {
-	for (unsigned i = 0; i < mtpProp.size(); i++) {
-		if (mtpProp[i].property == property) {
-			mtpProp[i].valueInt = valueInt;
-			mtpProp[i].valueStr = valueStr;
-			mtpProp[i].dataType = dataType;
-			return;
-		}
+	mtpProperty* prop = findProperty(property);
+	if (prop) {
+		prop->valueInt = valueInt;
+		prop->valueStr = valueStr;
+		prop->dataType = dataType;
+		account();
+		return;
 	}
 	addProperty(property, valueInt, valueStr, dataType);
+	account();
 }
 
 std::vector<Node::mtpProperty>& Node::getMtpProps() {
@@ -99,6 +160,9 @@ std::vector<Node::mtpProperty>& Node::getMtpProps() {
 
 void Node::addProperties(const std::string& path, int storageID) {
 	MTPD("addProperties: handle: %u, filename: '%s'\n", handle, getName().c_str());
+	// Keep this order in sync with propertySlot()
+	mtpProp.clear();
+	mtpProp.reserve(20);
 	struct stat st;
 	int mFormat = 0;
 	uint64_t puid = ((uint64_t)storageID << 32) + handle;
@@ -136,8 +200,5 @@ void Node::addProperties(const std::string& path, int storageID) {
 	addProperty(MTP_PROPERTY_DURATION, 0, "", MTP_TYPE_UINT32);
 	addProperty(MTP_PROPERTY_GENRE, 0, "", MTP_TYPE_STR);
 	addProperty(MTP_PROPERTY_COMPOSER, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_ARTIST, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_ALBUM_NAME, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_DURATION, 0, "", MTP_TYPE_UINT32);
-	addProperty(MTP_PROPERTY_DESCRIPTION, 0, "", MTP_TYPE_STR);
+	account();
 }
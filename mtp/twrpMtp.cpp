@@ -30,6 +30,7 @@
 #include "mtp_MtpDatabase.hpp"
 #include "mtp_MtpServer.hpp"
 #include "twrpMtp.hpp"
+#include "btree.hpp"
 #include "MtpDebug.h"
 
 #ifdef TWRPMTP
@@ -92,6 +93,10 @@ pthread_t twrpMtp::threadserver(void) {
 	return thread;
 }
 
+void twrpMtp::setMemoryCounter(twrpMemory_Counter* counter) {
+	Node::memoryCounter = counter;
+}
+
 pid_t twrpMtp::forkserver(int mtppipe[2]) {
 	pid_t pid;
 	if ((pid = fork()) == -1) {
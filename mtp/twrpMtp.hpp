@@ -24,6 +24,7 @@
 #include <vector>
 #include <pthread.h>
 #include "MtpTypes.h"
+#include "../twrpMemory.hpp"
 #include "MtpPacket.h"
 #include "MtpDataPacket.h"
 #include "MtpDatabase.h"
@@ -37,6 +38,7 @@ class twrpMtp {
 		pthread_t threadserver(void);
 		pid_t forkserver(int mtppipe[2]);
 		void addStorage(std::string display, std::string path, int mtpid, uint64_t maxFileSize);
+		static void setMemoryCounter(twrpMemory_Counter* counter);	// Counts the bytes of the object tree, call before forkserver
 	private:
 		int start(void);
 		typedef int (twrpMtp::*ThreadPtr)(void);
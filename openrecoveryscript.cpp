@@ -43,6 +43,7 @@
 #include "twcommon.h"
 #include "openrecoveryscript.hpp"
 #include "progresstracking.hpp"
+#include "twrpPerf.hpp"
 #include "variables.h"
 #include "adb_install.h"
 #include "data.hpp"
@@ -52,12 +53,15 @@
 #include "gui/pages.hpp"
 #include "orscmd/orscmd.h"
 #include "twinstall.h"
+#include "adbbu/libtwadbbu.hpp"
 extern "C" {
 	#include "gui/gui.h"
 	#include "cutils/properties.h"
 }
 
 OpenRecoveryScript::VoidFunction OpenRecoveryScript::call_after_cli_command;
+FILE* OpenRecoveryScript::result_file = NULL;
+bool OpenRecoveryScript::batch_results = false;
 
 #define SCRIPT_COMMAND_SIZE 512
 
@@ -92,8 +96,63 @@ int OpenRecoveryScript::copy_script_file(string filename) {
 	return 0;
 }
 
+// runbatch reports each command of the script as a JSON object on a line of
+// its own in the output of the twrp command, so tools running many commands
+// per session can follow them without parsing the console messages:
+//   {"ors":"start","line":3,"command":"backup"}
+//   {"ors":"result","line":3,"command":"backup","status":0,"seconds":42,"perf":{...}}
+//   {"ors":"done","status":0,"commands":5}
+// perf is the twrpPerf report of the command. Values are left out, they may
+// hold passwords.
+void OpenRecoveryScript::Report_Command(const char* event, int line, const char* command, int status, time_t start) {
+	char number[64];
+
+	if (!batch_results || !result_file)
+		return;
+
+	string json = "{\"ors\":\"";
+	json += event;
+	json += "\"";
+	if (command) {
+		sprintf(number, "%i", line);
+		json += ",\"line\":";
+		json += number;
+		json += ",\"command\":\"";
+		for (const char* c = command; *c; c++) {
+			if (*c == '"' || *c == '\\')
+				json += '\\';
+			if ((unsigned char) *c >= 0x20)
+				json += *c;
+		}
+		json += "\"";
+	}
+	if (strcmp(event, "start") != 0) {
+		sprintf(number, ",\"status\":%i", status);
+		json += number;
+	}
+	if (command && strcmp(event, "result") == 0) {
+		sprintf(number, ",\"seconds\":%li", (long) (time(NULL) - start));
+		json += number;
+		string perf = twrpPerf::Last_Json();
+		if (!perf.empty()) {
+			json += ",\"perf\":";
+			json += perf;
+		}
+	}
+	if (!command) {
+		sprintf(number, ",\"commands\":%i", line);
+		json += number;
+	}
+	json += "}\n";
+	fputs(json.c_str(), result_file);
+	fflush(result_file);
+}
+
 int OpenRecoveryScript::run_script_file(void) {
 	int ret_val = 0, cindex, line_len, i, remove_nl, install_cmd = 0, sideload = 0;
+	int line_number = 0, command_count = 0;
+	bool command_perf = false;
+	time_t command_start = 0;
 	char script_line[SCRIPT_COMMAND_SIZE], command[SCRIPT_COMMAND_SIZE],
 	     value[SCRIPT_COMMAND_SIZE], mount[SCRIPT_COMMAND_SIZE],
 	     value1[SCRIPT_COMMAND_SIZE], value2[SCRIPT_COMMAND_SIZE];
@@ -104,6 +163,7 @@ int OpenRecoveryScript::run_script_file(void) {
 		DataManager::SetValue(TW_SIMULATE_ACTIONS, 0);
 		DataManager::SetValue("ui_progress", 0); // Reset the progress bar
 		while (fgets(script_line, SCRIPT_COMMAND_SIZE, fp) != NULL && ret_val == 0) {
+			line_number++;
 			cindex = 0;
 			line_len = strlen(script_line);
 			if (line_len < 2)
@@ -138,6 +198,11 @@ int OpenRecoveryScript::run_script_file(void) {
 				strncpy(command, script_line, line_len - remove_nl + 1);
 				gui_print("command is: '%s' and there is no value\n", command);
 			}
+			command_count++;
+			command_start = time(NULL);
+			Report_Command("start", line_number, command, 0, command_start);
+			twrpPerf::Start(command);
+			command_perf = true;
 			if (strcmp(command, "install") == 0) {
 				// Install Zip
 				DataManager::SetValue("tw_action_text2", "Installing Zip");
@@ -187,6 +252,27 @@ int OpenRecoveryScript::run_script_file(void) {
 					DataManager::SetValue(TW_BACKUP_NAME, empt);
 				}
 				ret_val = Backup_Command(value1);
+			} else if (strcmp(command, "backupplan") == 0) {
+				// Dry run of a backup, the plan is written instead
+				string plan_file = "/tmp/backup_plan.json";
+				tok = strtok(value, " \r\n");
+				if (tok == NULL) {
+					LOGERR("backupplan needs the partitions to plan\n");
+					ret_val = 1;
+					continue;
+				}
+				strcpy(value1, tok);
+				tok = strtok(NULL, " \r\n");
+				if (tok != NULL)
+					plan_file = tok;
+				DataManager::SetValue(TW_BACKUP_NAME, "(Current Date)");
+				ret_val = Backup_Command(value1, plan_file);
+			} else if (strcmp(command, "verify") == 0) {
+				// Checks the digests of every backup, force also checks the recently verified ones
+				DataManager::SetValue("tw_action_text2", gui_parse_text("{@verify_backups}"));
+				PartitionManager.Mount_All_Storage();
+				if (!PartitionManager.Verify_Backups(strncmp(value, "force", 5) == 0))
+					ret_val = 1;
 			} else if (strcmp(command, "restore") == 0) {
 				// Restore
 				DataManager::SetValue("tw_action_text2", gui_parse_text("{@restore}"));
@@ -391,6 +477,14 @@ int OpenRecoveryScript::run_script_file(void) {
 				ret_val = PartitionManager.Fix_Contexts();
 				if (ret_val != 0)
 					ret_val = 1; // failure
+			} else if (strcmp(command, "adbresume") == 0) {
+				// the next adb restore skips what the interrupted one restored
+				if (twadbbu::Resume_Restore())
+					gui_msg("adb_resume_ready=The next adb restore resumes the interrupted one.");
+				else {
+					gui_err("adb_no_checkpoint=No interrupted adb restore to resume.");
+					ret_val = 1; // failure
+				}
 			} else if (strcmp(command, "decrypt") == 0) {
 				if (*value) {
 					ret_val = PartitionManager.Decrypt_Device(value);
@@ -404,7 +498,13 @@ int OpenRecoveryScript::run_script_file(void) {
 				LOGERR("Unrecognized script command: '%s'\n", command);
 				ret_val = 1;
 			}
+			twrpPerf::Finish(ret_val);
+			command_perf = false;
+			Report_Command("result", line_number, command, ret_val, command_start);
 		}
+		if (command_perf)
+			twrpPerf::Finish(ret_val); // the command failed early
+		Report_Command("done", command_count, NULL, ret_val, 0);
 		fclose(fp);
 		unlink(SCRIPT_FILE_TMP);
 		gui_msg("done_ors=Done processing script file");
@@ -488,12 +588,19 @@ int OpenRecoveryScript::Install_Command(string Zip) {
 			gui_msg(Msg("installing_zip=Installing zip file '{1}'")(Zip));
 	}
 
+	twrpPerf::Phase("install");
 	ret_val = TWinstall_zip(Zip.c_str(), &wipe_cache);
 	if (ret_val != 0) {
 		gui_msg(Msg(msg::kError, "zip_err=Error installing zip file '{1}'")(Zip));
 		ret_val = 1;
-	} else if (wipe_cache)
-		PartitionManager.Wipe_By_Path("/cache");
+	} else {
+		// The size of a block map is not the one of the zip it maps
+		twrpPerf::Add(Zip.substr(0, 1) == "@" ? 0 : TWFunc::Get_File_Size(Zip), 1);
+		if (wipe_cache) {
+			twrpPerf::Phase("wipe cache");
+			PartitionManager.Wipe_By_Path("/cache");
+		}
+	}
 
 	return ret_val;
 }
@@ -522,7 +629,7 @@ string OpenRecoveryScript::Locate_Zip_File(string Zip, string Storage_Root) {
 	return "";
 }
 
-int OpenRecoveryScript::Backup_Command(string Options) {
+int OpenRecoveryScript::Backup_Command(string Options, string Plan_File) {
 	char value1[SCRIPT_COMMAND_SIZE];
 	int line_len, i;
 	string Backup_List;
@@ -530,6 +637,10 @@ int OpenRecoveryScript::Backup_Command(string Options) {
 	strcpy(value1, Options.c_str());
 
 	DataManager::SetValue(TW_USE_COMPRESSION_VAR, 0);
+	DataManager::SetValue(TW_USE_LZ4_VAR, 0);
+	DataManager::SetValue(TW_INCREMENTAL_BACKUP_VAR, 0);
+	DataManager::SetValue(TW_DEDUP_BACKUP_VAR, 0);
+	DataManager::SetValue(TW_SNAPSHOT_BACKUP_VAR, 0);
 	DataManager::SetValue(TW_SKIP_DIGEST_GENERATE_VAR, 0);
 
 	gui_msg("select_backup_opt=Setting backup options:");
@@ -565,12 +676,32 @@ int OpenRecoveryScript::Backup_Command(string Options) {
 		} else if (Options.substr(i, 1) == "O" || Options.substr(i, 1) == "o") {
 			DataManager::SetValue(TW_USE_COMPRESSION_VAR, 1);
 			gui_msg("compression_on=Compression is on");
+		} else if (Options.substr(i, 1) == "L" || Options.substr(i, 1) == "l") {
+			DataManager::SetValue(TW_USE_COMPRESSION_VAR, 1);
+			DataManager::SetValue(TW_USE_LZ4_VAR, 1);
+			gui_msg("compression_lz4_on=LZ4 compression is on");
+		} else if (Options.substr(i, 1) == "I" || Options.substr(i, 1) == "i") {
+			DataManager::SetValue(TW_INCREMENTAL_BACKUP_VAR, 1);
+			gui_msg("incremental_on=Incremental backup is on");
+		} else if (Options.substr(i, 1) == "U" || Options.substr(i, 1) == "u") {
+			DataManager::SetValue(TW_DEDUP_BACKUP_VAR, 1);
+			gui_msg("dedup_on=Deduplicated backup is on");
+		} else if (Options.substr(i, 1) == "P" || Options.substr(i, 1) == "p") {
+			DataManager::SetValue(TW_SNAPSHOT_BACKUP_VAR, 1);
+			gui_msg("snapshot_on=Backing up snapshots of the file systems");
 		} else if (Options.substr(i, 1) == "M" || Options.substr(i, 1) == "m") {
 			DataManager::SetValue(TW_SKIP_DIGEST_GENERATE_VAR, 1);
 			gui_msg("digest_off=Digest Generation is off");
 		}
 	}
 	DataManager::SetValue("tw_backup_list", Backup_List);
+	if (!Plan_File.empty()) {
+		if (!PartitionManager.Run_Backup(false, Plan_File)) {
+			gui_err("backup_plan_fail=The backup would fail, see the plan");
+			return 1;
+		}
+		return 0;
+	}
 	if (!PartitionManager.Run_Backup(false)) {
 		gui_err("backup_fail=Backup Failed");
 		return 1;
@@ -645,6 +776,17 @@ void OpenRecoveryScript::Run_CLI_Command(const char* command) {
 		} else {
 			OpenRecoveryScript::run_script_file();
 		}
+	} else if (strlen(command) > 10 && strncmp(command, "runbatch", 8) == 0) {
+		// A whole script in one round trip through the command pipe and the
+		// action page, with a result line for every command
+		const char* filename = command + 9;
+		if (OpenRecoveryScript::copy_script_file(filename) == 0) {
+			LOGINFO("Unable to copy script file\n");
+		} else {
+			batch_results = true;
+			OpenRecoveryScript::run_script_file();
+			batch_results = false;
+		}
 	} else if (strlen(command) > 5 && strncmp(command, "get", 3) == 0) {
 		const char* varname = command + 4;
 		string value;
@@ -19,6 +19,8 @@
 #ifndef _OPENRECOVERYSCRIPT_HPP
 #define _OPENRECOVERYSCRIPT_HPP
 
+#include <stdio.h>
+#include <time.h>
 #include <string>
 
 using namespace std;
@@ -27,18 +29,22 @@ class OpenRecoveryScript
 {
 	typedef void (*VoidFunction)();
 	static VoidFunction call_after_cli_command;                                    // callback to GUI after Run_CLI_Command
+	static FILE* result_file;                                                      // output of the CLI command that gets the results of runbatch
+	static bool batch_results;                                                     // run_script_file reports every command to result_file
 
 	static int check_for_script_file();                                            // Checks to see if the ORS file is present in /cache
 	static int copy_script_file(string filename);                                  // Copies a script file to the temp folder
 	static int run_script_file();                                                  // Executes the commands in the ORS file
 	static int Install_Command(string Zip);                                        // Installs a zip
 	static string Locate_Zip_File(string Path, string File);                       // Attempts to locate the zip file in storage
-	static int Backup_Command(string Options);                                     // Runs a backup
+	static int Backup_Command(string Options, string Plan_File = "");              // Runs a backup, or only writes its plan to Plan_File
+	static void Report_Command(const char* event, int line, const char* command, int status, time_t start);  // Writes a runbatch result line
 public:
 	static int Insert_ORS_Command(string Command);                                 // Inserts the Command into the SCRIPT_FILE_TMP file
 	static void Run_OpenRecoveryScript();                                          // Starts the GUI Page for running OpenRecoveryScript
 	static int Run_OpenRecoveryScript_Action();                                    // Actually runs the ORS scripts for the GUI action
 	static void Call_After_CLI_Command(VoidFunction fn) { call_after_cli_command = fn; }
+	static void Set_Result_File(FILE* fp) { result_file = fp; }                    // Where Run_CLI_Command writes runbatch results
 	static void Run_CLI_Command(const char* command);                              // Runs a command for orscmd (twrp binary)
 	static int remountrw();                                                        // Remount system and vendor rw
 };
@@ -40,10 +40,15 @@ void print_usage(void) {
 	printf("Allows command line usage of TWRP via openrecoveryscript commands.\n");
 	printf("Some common commands include:\n");
 	printf("  install /path/to/update.zip\n");
+	printf("  runscript /path/to/script\n");
+	printf("  runbatch /path/to/script (one JSON result line per command)\n");
 	printf("  backup <SDCRBAEM> [backupname]\n");
+	printf("    (O/L compress, I incremental, U dedup, P snapshot so storage stays online)\n");
+	printf("  backupplan <SDCRBAEM> [/path/to/plan.json] (dry run, writes the plan only)\n");
 	printf("  restore <SDCRBAEM> [backupname]\n");
 	printf("  wipe <partition name>\n");
 	printf("  sideload\n");
+	printf("  adbresume\n");
 	printf("  set <variable> [value]\n");
 	printf("  decrypt <password>\n");
 	printf("  remountrw\n");
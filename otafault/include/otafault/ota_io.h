@@ -24,6 +24,7 @@
 #define _UPDATER_OTA_IO_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>  // mode_t
 
@@ -51,6 +52,13 @@ ssize_t ota_write(int fd, const void* buf, size_t nbyte);
 
 int ota_fsync(int fd);
 
+// Counts the files opened for writing through ota_open() and ota_fopen(), and the writes noted
+// with ota_note_write() by code that modifies files or block devices some other way. Anything
+// that caches what it read can check whether this changed in between.
+uint64_t ota_write_generation();
+
+void ota_note_write();
+
 struct OtaCloser {
   static void Close(int);
 };
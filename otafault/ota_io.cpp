@@ -20,10 +20,12 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <map>
 #include <mutex>
 #include <string>
@@ -58,7 +60,24 @@ void ota_set_fault_files() {
 
 bool have_eio_error = false;
 
+static std::atomic<uint64_t> write_generation(0);
+
+uint64_t ota_write_generation() {
+    return write_generation.load();
+}
+
+void ota_note_write() {
+    write_generation++;
+}
+
+static void note_open_flags(int oflags) {
+    if ((oflags & O_ACCMODE) != O_RDONLY || (oflags & (O_CREAT | O_TRUNC)) != 0) {
+        ota_note_write();
+    }
+}
+
 int ota_open(const char* path, int oflags) {
+    note_open_flags(oflags);
     // Let the caller handle errors; we do not care if open succeeds or fails
     int fd = open(path, oflags);
     std::lock_guard<std::mutex> lock(filename_mutex);
@@ -67,6 +86,7 @@ int ota_open(const char* path, int oflags) {
 }
 
 int ota_open(const char* path, int oflags, mode_t mode) {
+    note_open_flags(oflags);
     int fd = open(path, oflags, mode);
     std::lock_guard<std::mutex> lock(filename_mutex);
     filename_cache[fd] = path;
@@ -74,6 +94,9 @@ int ota_open(const char* path, int oflags, mode_t mode) {
 }
 
 FILE* ota_fopen(const char* path, const char* mode) {
+    if (strpbrk(mode, "wa+") != nullptr) {
+        ota_note_write();
+    }
     FILE* fh = fopen(path, mode);
     std::lock_guard<std::mutex> lock(filename_mutex);
     filename_cache[(intptr_t)fh] = path;
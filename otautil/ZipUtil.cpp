@@ -20,7 +20,12 @@
 #include <fcntl.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/unique_fd.h>
@@ -33,6 +38,60 @@
 static constexpr mode_t UNZIP_DIRMODE = 0755;
 static constexpr mode_t UNZIP_FILEMODE = 0644;
 
+// Entries are extracted by up to this many threads; independent small files are inflate bound.
+static constexpr size_t MAX_EXTRACT_THREADS = 4;
+
+struct ExtractJob {
+    ZipEntry entry;
+    std::string path;
+    std::unique_ptr<char, decltype(&freecon)> secontext;
+};
+
+// Extracts one entry to its target file. Runs on the extraction threads: libziparchive reads the
+// entries with pread, and the fs create context is per thread.
+static bool ExtractJobToFile(ZipArchiveHandle zip, ExtractJob* job,
+                             const struct utimbuf* timestamp) {
+    const std::string& path = job->path;
+    if (job->secontext) {
+        setfscreatecon(job->secontext.get());
+    }
+    android::base::unique_fd fd(open(path.c_str(), O_CREAT|O_WRONLY|O_TRUNC, UNZIP_FILEMODE));
+    int open_errno = errno;
+    if (job->secontext) {
+        setfscreatecon(NULL);
+    }
+    if (fd == -1) {
+        errno = open_errno;
+        PLOG(ERROR) << "Can't create target file \"" << path << "\"";
+        return false;
+    }
+
+    // Allocate the whole file up front from the size in the central directory, so the writes
+    // don't keep extending it; failing that is harmless.
+    if (job->entry.uncompressed_length > 0) {
+        fallocate(fd, 0, 0, job->entry.uncompressed_length);
+    }
+
+    int err = ExtractEntryToFile(zip, &job->entry, fd);
+    if (err != 0) {
+        LOG(ERROR) << "Error extracting \"" << path << "\" : " << ErrorCodeString(err);
+        return false;
+    }
+
+    if (fsync(fd) != 0) {
+        PLOG(ERROR) << "Error syncing file descriptor when extracting \"" << path << "\"";
+        return false;
+    }
+
+    if (timestamp != nullptr && utime(path.c_str(), timestamp)) {
+        PLOG(ERROR) << "Error touching \"" << path << "\"";
+        return false;
+    }
+
+    LOG(INFO) << "Extracted file \"" << path << "\"";
+    return true;
+}
+
 bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
                              const std::string& dest_path, const struct utimbuf* timestamp,
                              struct selabel_handle* sehnd) {
@@ -63,9 +122,12 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
     }
 
     std::unique_ptr<void, decltype(&EndIteration)> guard(cookie, EndIteration);
+    // Collect the entries first, creating the directories and looking up the SELinux labels in
+    // one pass, then extract the files in parallel.
+    std::vector<ExtractJob> jobs;
+    std::string last_dir;
     ZipEntry entry;
     ZipString name;
-    int extractCount = 0;
     while (Next(cookie, &entry, &name) == 0) {
         std::string entry_name(name.name, name.name + name.name_length);
         CHECK_LE(prefix_path.size(), entry_name.size());
@@ -76,46 +138,48 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
         }
         //TODO(b/31917448) handle the symlink.
 
-        if (dirCreateHierarchy(path.c_str(), UNZIP_DIRMODE, timestamp, true, sehnd) != 0) {
-            LOG(ERROR) << "failed to create dir for " << path;
-            return false;
+        // Entries of one directory are usually stored together, so its hierarchy only needs to
+        // be checked once for all of them.
+        std::string dir = path.substr(0, path.rfind('/') + 1);
+        if (dir != last_dir) {
+            if (dirCreateHierarchy(path.c_str(), UNZIP_DIRMODE, timestamp, true, sehnd) != 0) {
+                LOG(ERROR) << "failed to create dir for " << path;
+                return false;
+            }
+            last_dir = dir;
         }
 
         char *secontext = NULL;
         if (sehnd) {
             selabel_lookup(sehnd, &secontext, path.c_str(), UNZIP_FILEMODE);
-            setfscreatecon(secontext);
-        }
-        android::base::unique_fd fd(open(path.c_str(), O_CREAT|O_WRONLY|O_TRUNC, UNZIP_FILEMODE));
-        if (fd == -1) {
-            PLOG(ERROR) << "Can't create target file \"" << path << "\"";
-            return false;
-        }
-        if (secontext) {
-            freecon(secontext);
-            setfscreatecon(NULL);
-        }
-
-        int err = ExtractEntryToFile(zip, &entry, fd);
-        if (err != 0) {
-            LOG(ERROR) << "Error extracting \"" << path << "\" : " << ErrorCodeString(err);
-            return false;
-        }
-
-        if (fsync(fd) != 0) {
-            PLOG(ERROR) << "Error syncing file descriptor when extracting \"" << path << "\"";
-            return false;
         }
+        jobs.push_back({ entry, path, std::unique_ptr<char, decltype(&freecon)>(secontext, freecon) });
+    }
 
-        if (timestamp != nullptr && utime(path.c_str(), timestamp)) {
-            PLOG(ERROR) << "Error touching \"" << path << "\"";
-            return false;
+    std::atomic<size_t> next_job(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+        for (size_t i = next_job++; i < jobs.size() && !failed; i = next_job++) {
+            if (!ExtractJobToFile(zip, &jobs[i], timestamp)) {
+                failed = true;
+            }
         }
+    };
 
-        LOG(INFO) << "Extracted file \"" << path << "\"";
-        ++extractCount;
+    size_t num_threads = std::min<size_t>(
+            { MAX_EXTRACT_THREADS, std::max(1u, std::thread::hardware_concurrency()), jobs.size() });
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (failed) {
+        return false;
     }
 
-    LOG(INFO) << "Extracted " << extractCount << " file(s)";
+    LOG(INFO) << "Extracted " << jobs.size() << " file(s)";
     return true;
 }
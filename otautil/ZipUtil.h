@@ -48,6 +48,9 @@
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
+ * The files are extracted by several threads, so zip must not be used
+ * elsewhere until this returns.
+ *
  * Returns true on success, false on failure.
  */
 bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
@@ -26,7 +26,7 @@ using Range = std::pair<size_t, size_t>;
 
 class RangeSet {
  public:
-  RangeSet() : blocks_(0) {}
+  RangeSet() : blocks_(0), sorted_(true) {}
 
   explicit RangeSet(std::vector<Range>&& pairs);
 
@@ -42,11 +42,12 @@ class RangeSet {
 
   std::string ToString() const;
 
-  // Gets the block number for the i-th (starting from 0) block in the RangeSet.
+  // Gets the block number for the i-th (starting from 0) block in the RangeSet. O(log n).
   size_t GetBlockNumber(size_t idx) const;
 
   // Returns whether the current RangeSet overlaps with other. RangeSet has half-closed half-open
   // bounds. For example, "3,5" contains blocks 3 and 4. So "3,5" and "5,7" are not overlapped.
+  // Ranges of the smaller set are binary searched in the larger one when that one is sorted.
   bool Overlaps(const RangeSet& other) const;
 
   // Returns a vector of RangeSets that contain the same set of blocks represented by the current
@@ -119,9 +120,23 @@ class RangeSet {
   }
 
  protected:
+  // Validates the range that follows the ones already indexed, and adds it to blocks_, offsets_
+  // and sorted_.
+  bool Index(const Range& range);
+
+  // Rebuilds blocks_, offsets_ and sorted_ after ranges_ has been modified directly.
+  void Reindex();
+
+  // Returns whether [start, end) overlaps any range. Requires sorted_.
+  bool OverlapsSorted(size_t start, size_t end) const;
+
   // Actual limit for each value and the total number are both INT_MAX.
   std::vector<Range> ranges_;
   size_t blocks_;
+  // offsets_[i] is the number of blocks in the ranges before ranges_[i].
+  std::vector<size_t> offsets_;
+  // Whether the ranges are in ascending order and don't overlap each other.
+  bool sorted_;
 };
 
 // The class is a sorted version of a RangeSet; and it's useful in imgdiff to split the input
@@ -29,15 +29,16 @@
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
-RangeSet::RangeSet(std::vector<Range>&& pairs) {
-  blocks_ = 0;
+RangeSet::RangeSet(std::vector<Range>&& pairs) : blocks_(0), sorted_(true) {
   if (pairs.empty()) {
     LOG(ERROR) << "Invalid number of tokens";
     return;
   }
 
-  for (const auto& range : pairs) {
-    if (!PushBack(range)) {
+  ranges_ = std::move(pairs);
+  offsets_.reserve(ranges_.size());
+  for (const auto& range : ranges_) {
+    if (!Index(range)) {
       Clear();
       return;
     }
@@ -45,14 +46,28 @@ RangeSet::RangeSet(std::vector<Range>&& pairs) {
 }
 
 RangeSet RangeSet::Parse(const std::string& range_text) {
-  std::vector<std::string> pieces = android::base::Split(range_text, ",");
-  if (pieces.size() < 3) {
+  // Walk the comma separated tokens in place. The token buffer is reused, so short tokens don't
+  // allocate.
+  size_t pieces = std::count(range_text.begin(), range_text.end(), ',') + 1;
+  if (pieces < 3) {
     LOG(ERROR) << "Invalid range text: " << range_text;
     return {};
   }
 
+  std::string token;
+  size_t pos = 0;
+  auto next_token = [&range_text, &token, &pos]() {
+    size_t end = range_text.find(',', pos);
+    if (end == std::string::npos) {
+      end = range_text.size();
+    }
+    token.assign(range_text, pos, end - pos);
+    pos = end + 1;
+    return token.c_str();
+  };
+
   size_t num;
-  if (!android::base::ParseUint(pieces[0], &num, static_cast<size_t>(INT_MAX))) {
+  if (!android::base::ParseUint(next_token(), &num, static_cast<size_t>(INT_MAX))) {
     LOG(ERROR) << "Failed to parse the number of tokens: " << range_text;
     return {};
   }
@@ -64,17 +79,18 @@ RangeSet RangeSet::Parse(const std::string& range_text) {
     LOG(ERROR) << "Number of tokens must be even: " << range_text;
     return {};
   }
-  if (num != pieces.size() - 1) {
+  if (num != pieces - 1) {
     LOG(ERROR) << "Mismatching number of tokens: " << range_text;
     return {};
   }
 
   std::vector<Range> pairs;
+  pairs.reserve(num / 2);
   for (size_t i = 0; i < num; i += 2) {
     size_t first;
     size_t second;
-    if (!android::base::ParseUint(pieces[i + 1], &first, static_cast<size_t>(INT_MAX)) ||
-        !android::base::ParseUint(pieces[i + 2], &second, static_cast<size_t>(INT_MAX))) {
+    if (!android::base::ParseUint(next_token(), &first, static_cast<size_t>(INT_MAX)) ||
+        !android::base::ParseUint(next_token(), &second, static_cast<size_t>(INT_MAX))) {
       return {};
     }
     pairs.emplace_back(first, second);
@@ -82,7 +98,7 @@ RangeSet RangeSet::Parse(const std::string& range_text) {
   return RangeSet(std::move(pairs));
 }
 
-bool RangeSet::PushBack(Range range) {
+bool RangeSet::Index(const Range& range) {
   if (range.first >= range.second) {
     LOG(ERROR) << "Empty or negative range: " << range.first << ", " << range.second;
     return false;
@@ -93,14 +109,37 @@ bool RangeSet::PushBack(Range range) {
     return false;
   }
 
-  ranges_.push_back(std::move(range));
+  if (!offsets_.empty() && ranges_[offsets_.size() - 1].second > range.first) {
+    sorted_ = false;
+  }
+  offsets_.push_back(blocks_);
   blocks_ += sz;
   return true;
 }
 
+void RangeSet::Reindex() {
+  blocks_ = 0;
+  offsets_.clear();
+  sorted_ = true;
+  for (const auto& range : ranges_) {
+    CHECK(Index(range));
+  }
+}
+
+bool RangeSet::PushBack(Range range) {
+  if (!Index(range)) {
+    return false;
+  }
+
+  ranges_.push_back(std::move(range));
+  return true;
+}
+
 void RangeSet::Clear() {
   ranges_.clear();
   blocks_ = 0;
+  offsets_.clear();
+  sorted_ = true;
 }
 
 std::vector<RangeSet> RangeSet::Split(size_t groups) const {
@@ -159,30 +198,45 @@ std::string RangeSet::ToString() const {
 size_t RangeSet::GetBlockNumber(size_t idx) const {
   CHECK_LT(idx, blocks_) << "Out of bound index " << idx << " (total blocks: " << blocks_ << ")";
 
-  for (const auto& range : ranges_) {
-    if (idx < range.second - range.first) {
-      return range.first + idx;
-    }
-    idx -= (range.second - range.first);
-  }
+  // The last range that starts at or before idx.
+  size_t i = std::upper_bound(offsets_.cbegin(), offsets_.cend(), idx) - offsets_.cbegin() - 1;
+  return ranges_[i].first + (idx - offsets_[i]);
+}
 
-  CHECK(false) << "Failed to find block number for index " << idx;
-  return 0;  // Unreachable, but to make compiler happy.
+bool RangeSet::OverlapsSorted(size_t start, size_t end) const {
+  // The first range that ends after start; the ends are ascending too when sorted_.
+  auto it = std::upper_bound(ranges_.cbegin(), ranges_.cend(), start,
+                             [](size_t value, const Range& range) { return value < range.second; });
+  return it != ranges_.cend() && it->first < end;
 }
 
 // RangeSet has half-closed half-open bounds. For example, "3,5" contains blocks 3 and 4. So "3,5"
 // and "5,7" are not overlapped.
 bool RangeSet::Overlaps(const RangeSet& other) const {
-  for (const auto& range : ranges_) {
-    size_t start = range.first;
-    size_t end = range.second;
-    for (const auto& other_range : other.ranges_) {
-      size_t other_start = other_range.first;
-      size_t other_end = other_range.second;
-      // [start, end) vs [other_start, other_end)
-      if (!(other_start >= end || start >= other_end)) {
-        return true;
-      }
+  const RangeSet& smaller = size() <= other.size() ? *this : other;
+  const RangeSet& larger = size() <= other.size() ? other : *this;
+  if (!smaller) {
+    return false;
+  }
+
+  // Look up each range of one set in the other, sorted, set.
+  const RangeSet* lookup = &larger;
+  const RangeSet* scan = &smaller;
+  if (!larger.sorted_ && smaller.sorted_) {
+    std::swap(lookup, scan);
+  }
+
+  SortedRangeSet sorted_lookup;
+  if (!lookup->sorted_) {
+    // Neither set is sorted; sort and merge a copy of the smaller one.
+    std::swap(lookup, scan);
+    sorted_lookup.Insert(SortedRangeSet(std::vector<Range>(lookup->cbegin(), lookup->cend())));
+    lookup = &sorted_lookup;
+  }
+
+  for (const auto& range : *scan) {
+    if (lookup->OverlapsSorted(range.first, range.second)) {
+      return true;
     }
   }
   return false;
@@ -190,7 +244,10 @@ bool RangeSet::Overlaps(const RangeSet& other) const {
 
 // Ranges in the the set should be mutually exclusive; and they're sorted by the start block.
 SortedRangeSet::SortedRangeSet(std::vector<Range>&& pairs) : RangeSet(std::move(pairs)) {
-  std::sort(ranges_.begin(), ranges_.end());
+  if (!sorted_) {
+    std::sort(ranges_.begin(), ranges_.end());
+    Reindex();
+  }
 }
 
 void SortedRangeSet::Insert(const Range& to_insert) {
@@ -203,25 +260,24 @@ void SortedRangeSet::Insert(const SortedRangeSet& rs) {
   if (rs.size() == 0) {
     return;
   }
-  // Merge and sort the two RangeSets.
-  std::vector<Range> temp = std::move(ranges_);
-  std::copy(rs.begin(), rs.end(), std::back_inserter(temp));
-  std::sort(temp.begin(), temp.end());
+  // Merge the two sorted RangeSets in linear time.
+  std::vector<Range> temp;
+  temp.reserve(ranges_.size() + rs.size());
+  std::merge(ranges_.cbegin(), ranges_.cend(), rs.cbegin(), rs.cend(), std::back_inserter(temp));
 
-  Clear();
   // Trim overlaps and insert the result back to ranges_.
+  ranges_.clear();
   Range to_insert = temp.front();
   for (auto it = temp.cbegin() + 1; it != temp.cend(); it++) {
     if (it->first <= to_insert.second) {
       to_insert.second = std::max(to_insert.second, it->second);
     } else {
       ranges_.push_back(to_insert);
-      blocks_ += (to_insert.second - to_insert.first);
       to_insert = *it;
     }
   }
   ranges_.push_back(to_insert);
-  blocks_ += (to_insert.second - to_insert.first);
+  Reindex();
 }
 
 // Compute the block range the file occupies, and insert that range.
@@ -231,7 +287,12 @@ void SortedRangeSet::Insert(size_t start, size_t len) {
 }
 
 bool SortedRangeSet::Overlaps(size_t start, size_t len) const {
-  RangeSet rs({ { start / kBlockSize, (start + len - 1) / kBlockSize + 1 } });
+  size_t start_block = start / kBlockSize;
+  size_t end_block = (start + len - 1) / kBlockSize + 1;
+  if (sorted_) {
+    return OverlapsSorted(start_block, end_block);
+  }
+  RangeSet rs({ { start_block, end_block } });
   return Overlaps(rs);
 }
 
@@ -247,21 +308,20 @@ bool SortedRangeSet::Overlaps(size_t start, size_t len) const {
 // + 10) in a range represented by this SortedRangeSet.
 size_t SortedRangeSet::GetOffsetInRangeSet(size_t old_offset) const {
   size_t old_block_start = old_offset / kBlockSize;
-  size_t new_block_start = 0;
-  for (const auto& range : ranges_) {
-    // Find the index of old_block_start.
-    if (old_block_start >= range.second) {
-      new_block_start += (range.second - range.first);
-    } else if (old_block_start >= range.first) {
-      new_block_start += (old_block_start - range.first);
-      return (new_block_start * kBlockSize + old_offset % kBlockSize);
-    } else {
-      CHECK(false) << "block_start " << old_block_start
-                   << " is missing between two ranges: " << this->ToString();
-      return 0;
-    }
+  // The first range that ends after old_block_start.
+  auto it = std::upper_bound(
+      ranges_.cbegin(), ranges_.cend(), old_block_start,
+      [](size_t value, const Range& range) { return value < range.second; });
+  if (it == ranges_.cend()) {
+    CHECK(false) << "block_start " << old_block_start
+                 << " exceeds the limit of current RangeSet: " << this->ToString();
+    return 0;
+  }
+  if (old_block_start < it->first) {
+    CHECK(false) << "block_start " << old_block_start
+                 << " is missing between two ranges: " << this->ToString();
+    return 0;
   }
-  CHECK(false) << "block_start " << old_block_start
-               << " exceeds the limit of current RangeSet: " << this->ToString();
-  return 0;
+  size_t new_block_start = offsets_[it - ranges_.cbegin()] + (old_block_start - it->first);
+  return (new_block_start * kBlockSize + old_offset % kBlockSize);
 }
@@ -22,6 +22,7 @@
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <sys/mount.h>
+#include <linux/fs.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <libgen.h>
@@ -39,7 +40,18 @@
 #include "data.hpp"
 #include "twrp-functions.hpp"
 #include "twrpTar.hpp"
+#include "twrpRawTransfer.hpp"
+#include "twrpBlockMap.hpp"
+#include "twrpChunkStore.hpp"
+#include "twrpMediaIndex.hpp"
+#include "twrpDigestDriver.hpp"
+#include "twrpTrace.hpp"
+#include "twrpLog.hpp"
+#include "twrpSnapshot.hpp"
+#include "twrpSELabel.hpp"
+#include "twrpBackupMeta.hpp"
 #include "exclude.hpp"
+#include "twrpManifest.hpp"
 #include "infomanager.hpp"
 #include "set_metadata.h"
 #include "gui/gui.hpp"
@@ -76,9 +88,37 @@ using namespace std;
 
 static int auto_index = 0; // v2 fstab allows you to specify a mount point of "auto" with no /. These items are given a mount point of /auto* where * == auto_index
 
-extern struct selabel_handle *selinux_handle;
 extern bool datamedia;
 
+// File system types found by earlier blkid probes, by block device. An entry
+// is used while the device number, size and first block still match and no
+// format, restore, decrypt or uevent has happened since it was stored.
+struct FS_Type_Cache_Entry {
+	dev_t rdev;
+	uint64_t size;
+	uint32_t head_sum;                                 // FNV-1a of the first 4KB, where every supported superblock lives
+	unsigned generation;
+	string type;                                       // Empty when blkid found no file system
+};
+
+static std::map<string, FS_Type_Cache_Entry> fs_type_cache;
+static pthread_mutex_t fs_type_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned fs_type_generation = 0;
+
+// Holds off the background settings save while a partition with a settings
+// file on it is unmounted or wiped
+struct Settings_Storage_Lock {
+	bool held;
+	explicit Settings_Storage_Lock(bool Settings) : held(Settings) {
+		if (held)
+			DataManager::Lock_Settings_Storage();
+	}
+	~Settings_Storage_Lock() {
+		if (held)
+			DataManager::Unlock_Settings_Storage();
+	}
+};
+
 struct flag_list {
 	const char *name;
 	unsigned long flag;
@@ -200,6 +240,51 @@ const struct flag_list tw_flags[] = {
 	{ 0,                        0 },
 };
 
+#define TW_FLAG_SLOTS 128                                                       // power of two, well above the number of tw_flags
+
+// tw_flags by name, open addressed on an FNV-1a hash of the name without the
+// trailing '=' of flags taking an argument. Filled in once before main runs.
+static const struct flag_list* tw_flag_slots[TW_FLAG_SLOTS];
+
+static size_t TW_Flag_Name_Length(const char *name) {
+	size_t len = strlen(name);
+	return (len && name[len - 1] == '=') ? len - 1 : len;
+}
+
+static unsigned TW_Flag_Hash(const char *name, size_t len) {
+	unsigned hash = 2166136261u;
+
+	while (len--)
+		hash = (hash ^ (unsigned char) *name++) * 16777619u;
+	return hash;
+}
+
+static bool TW_Flag_Index() {
+	for (const struct flag_list* tw_flag = tw_flags; tw_flag->name; tw_flag++) {
+		unsigned slot = TW_Flag_Hash(tw_flag->name, TW_Flag_Name_Length(tw_flag->name));
+		while (tw_flag_slots[slot & (TW_FLAG_SLOTS - 1)])
+			slot++;
+		tw_flag_slots[slot & (TW_FLAG_SLOTS - 1)] = tw_flag;
+	}
+	return true;
+}
+
+static const bool tw_flag_indexed = TW_Flag_Index();
+
+// Returns the tw_flags entry for the len characters at name, NULL if none
+static const struct flag_list* Find_TW_Flag(const char *name, size_t len) {
+	unsigned slot = TW_Flag_Hash(name, len);
+	const struct flag_list* tw_flag;
+
+	(void) tw_flag_indexed;
+	while ((tw_flag = tw_flag_slots[slot & (TW_FLAG_SLOTS - 1)]) != NULL) {
+		if (TW_Flag_Name_Length(tw_flag->name) == len && strncmp(tw_flag->name, name, len) == 0)
+			return tw_flag;
+		slot++;
+	}
+	return NULL;
+}
+
 TWPartition::TWPartition() {
 	Can_Be_Mounted = false;
 	Can_Be_Wiped = false;
@@ -226,6 +311,8 @@ TWPartition::TWPartition() {
 	Used = 0;
 	Free = 0;
 	Backup_Size = 0;
+	Restore_Size = 0;
+	Restore_File_Count = 0;
 	Can_Be_Encrypted = false;
 	Is_Encrypted = false;
 	Is_Decrypted = false;
@@ -260,10 +347,13 @@ TWPartition::TWPartition() {
 	Is_Adopted_Storage = false;
 	Adopted_GUID = "";
 	SlotSelect = false;
+	Media_Index = NULL;
+	Slot_Cache[0].Valid = false;
+	Slot_Cache[1].Valid = false;
 }
 
 TWPartition::~TWPartition(void) {
-	// Do nothing
+	delete Media_Index;
 }
 
 bool TWPartition::Process_Fstab_Line(const char *fstab_line, bool Display_Error, std::map<string, Flags_Map> *twrp_flags) {
@@ -627,6 +717,7 @@ void TWPartition::Setup_Data_Partition(bool Display_Error) {
 		Is_FBE = false;
 		DataManager::SetValue(TW_IS_FBE, 0);
 		Decrypted_Block_Device = crypto_blkdev;
+		Invalidate_FS_Types();
 		LOGINFO("Data already decrypted, new block device: '%s'\n", crypto_blkdev);
 	} else if (!Mount(false)) {
 		if (Is_Present) {
@@ -913,90 +1004,66 @@ void TWPartition::Apply_TW_Flag(const unsigned flag, const char* str, const bool
 }
 
 void TWPartition::Process_TW_Flags(char *flags, bool Display_Error, int fstab_ver) {
-	char separator[2] = {'\n', 0};
-	char *ptr, *savep;
 	char source_separator = ';';
+	char *ptr = flags, *end;
+	bool quoted, last = false;
 
 	if (fstab_ver == 2)
 		source_separator = ',';
 
-	// Semicolons within double-quotes are not forbidden, so replace
-	// only the semicolons intended as separators with '\n' for strtok
-	for (unsigned i = 0, skip = 0; i < strlen(flags); i++) {
-		if (flags[i] == '\"')
-			skip = !skip;
-		if (!skip && flags[i] == source_separator)
-			flags[i] = separator[0];
+	while (!last) {
+		// Separators within double-quotes are not forbidden, so only the
+		// ones outside of quotes end a flag
+		for (end = ptr, quoted = false; *end && *end != '\n'; end++) {
+			if (*end == '\"')
+				quoted = !quoted;
+			else if (!quoted && *end == source_separator)
+				break;
+		}
+		last = (*end == 0);
+		*end = 0;
+		if (*ptr)
+			Process_TW_Flag(ptr, Display_Error);
+		ptr = end + 1;
 	}
+}
 
-	// Avoid issues with potentially nested strtok by using strtok_r
-	ptr = strtok_r(flags, separator, &savep);
-	while (ptr) {
-		int ptr_len = strlen(ptr);
-		const struct flag_list* tw_flag = tw_flags;
-
-		for (; tw_flag->name; tw_flag++) {
-			int flag_len = strlen(tw_flag->name);
-
-			if (strncmp(ptr, tw_flag->name, flag_len) == 0) {
-				bool flag_val = false;
-
-				if (ptr_len > flag_len && (tw_flag->name)[flag_len-1] != '='
-						&& ptr[flag_len] != '=') {
-					// Handle flags with same starting string
-					// (e.g. backup and backupname)
-					continue;
-				} else if (ptr_len > flag_len && ptr[flag_len] == '=') {
-					// Handle flags with dual format: Part 1
-					// (e.g. backup and backup=y. backup=y handled here)
-					ptr += flag_len + 1;
-					TWFunc::Strip_Quotes(ptr);
-					// Skip flags with empty argument
-					// (e.g. backup=)
-					if (strlen(ptr) == 0) {
-						LOGINFO("Flag missing argument or should not include '=': %s=\n", tw_flag->name);
-						break;
-					}
-					flag_val = strchr("yY1", *ptr) != NULL;
-				} else if (ptr_len == flag_len
-						&& (tw_flag->name)[flag_len-1] == '=') {
-					// Skip flags missing argument after =
-					// (e.g. backupname=)
-					LOGINFO("Flag missing argument: %s\n", tw_flag->name);
-					break;
-				} else if (ptr_len > flag_len
-						&& (tw_flag->name)[flag_len-1] == '=') {
-					// Handle arguments to flags
-					// (e.g. backupname="My Stuff")
-					ptr += flag_len;
-					TWFunc::Strip_Quotes(ptr);
-					// Skip flags with empty argument
-					// (e.g. backupname="")
-					if (strlen(ptr) == 0) {
-						LOGINFO("Flag missing argument: %s\n", tw_flag->name);
-						break;
-					}
-				} else if (ptr_len == flag_len) {
-					// Handle flags with dual format: Part 2
-					// (e.g. backup and backup=y. backup handled here)
-					flag_val = true;
-				} else {
-					LOGINFO("Flag matched, but could not be processed: %s\n", ptr);
-					break;
-				}
+void TWPartition::Process_TW_Flag(char *ptr, bool Display_Error) {
+	char *equals = strchr(ptr, '=');
+	size_t name_len = equals ? (size_t)(equals - ptr) : strlen(ptr);
+	const struct flag_list* tw_flag = Find_TW_Flag(ptr, name_len);
+	bool has_arg = tw_flag && (tw_flag->name)[name_len] == '=';
+	bool flag_val = false;
 
-				Apply_TW_Flag(tw_flag->flag, ptr, flag_val);
-				break;
-			}
-		}
-		if (tw_flag->name == 0) {
-			if (Display_Error)
-				LOGERR("Unhandled flag: '%s'\n", ptr);
+	if (tw_flag == NULL || (has_arg && !equals)) {
+		if (Display_Error)
+			LOGERR("Unhandled flag: '%s'\n", ptr);
+		else
+			LOGINFO("Unhandled flag: '%s'\n", ptr);
+		return;
+	}
+
+	if (equals) {
+		// Arguments to flags (e.g. backupname="My Stuff") and flags with
+		// dual format (e.g. backup=y)
+		ptr = equals + 1;
+		TWFunc::Strip_Quotes(ptr);
+		// Skip flags with empty argument (e.g. backupname= or backup=)
+		if (*ptr == 0) {
+			if (has_arg)
+				LOGINFO("Flag missing argument: %s\n", tw_flag->name);
 			else
-				LOGINFO("Unhandled flag: '%s'\n", ptr);
+				LOGINFO("Flag missing argument or should not include '=': %s=\n", tw_flag->name);
+			return;
 		}
-		ptr = strtok_r(NULL, separator, &savep);
+		if (!has_arg)
+			flag_val = strchr("yY1", *ptr) != NULL;
+	} else {
+		// Flags with dual format (e.g. backup)
+		flag_val = true;
 	}
+
+	Apply_TW_Flag(tw_flag->flag, ptr, flag_val);
 }
 
 bool TWPartition::Is_File_System(string File_System) {
@@ -1214,54 +1281,22 @@ bool TWPartition::Get_Size_Via_statfs(bool Display_Error) {
 	return true;
 }
 
+// The numbers df prints, read in-process instead of running df. The mount
+// point itself is used since statfs on a path inside it already failed.
 bool TWPartition::Get_Size_Via_df(bool Display_Error) {
-	FILE* fp;
-	char command[255], line[512];
-	int include_block = 1;
-	unsigned int min_len;
+	struct statfs st;
 
 	if (!Mount(Display_Error))
 		return false;
 
-	min_len = Actual_Block_Device.size() + 2;
-	sprintf(command, "df %s > /tmp/dfoutput.txt", Mount_Point.c_str());
-	TWFunc::Exec_Cmd(command);
-	fp = fopen("/tmp/dfoutput.txt", "rt");
-	if (fp == NULL) {
-		LOGINFO("Unable to open /tmp/dfoutput.txt.\n");
+	if (statfs(Mount_Point.c_str(), &st) != 0) {
+		LOGINFO("Unable to statfs '%s': %s\n", Mount_Point.c_str(), strerror(errno));
 		return false;
 	}
-
-	while (fgets(line, sizeof(line), fp) != NULL)
-	{
-		unsigned long blocks, used, available;
-		char device[64];
-		char tmpString[64];
-
-		if (strncmp(line, "Filesystem", 10) == 0)
-			continue;
-		if (strlen(line) < min_len) {
-			include_block = 0;
-			continue;
-		}
-		if (include_block) {
-			sscanf(line, "%s %lu %lu %lu", device, &blocks, &used, &available);
-		} else {
-			// The device block string is so long that the df information is on the next line
-			int space_count = 0;
-			sprintf(tmpString, "/dev/block/%s", Actual_Block_Device.c_str());
-			while (tmpString[space_count] == 32)
-				space_count++;
-			sscanf(line + space_count, "%lu %lu %lu", &blocks, &used, &available);
-		}
-
-		// Adjust block size to byte size
-		Size = blocks * 1024ULL;
-		Used = used * 1024ULL;
-		Free = available * 1024ULL;
-		Backup_Size = Used;
-	}
-	fclose(fp);
+	Size = (unsigned long long) st.f_blocks * st.f_bsize;
+	Used = (unsigned long long) (st.f_blocks - st.f_bfree) * st.f_bsize;
+	Free = (unsigned long long) st.f_bavail * st.f_bsize;
+	Backup_Size = Used;
 	return true;
 }
 
@@ -1335,21 +1370,18 @@ bool TWPartition::Is_Mounted(void) {
 	if (!Can_Be_Mounted)
 		return false;
 
-	struct stat st1, st2;
-	string test_path;
-
-	// Check to see if the mount point directory exists
-	test_path = Mount_Point + "/.";
-	if (stat(test_path.c_str(), &st1) != 0)  return false;
-
-	// Check to see if the directory above the mount point exists
-	test_path = Mount_Point + "/../.";
-	if (stat(test_path.c_str(), &st2) != 0)  return false;
-
-	// Compare the device IDs -- if they match then we're (probably) using tmpfs instead of an actual device
-	int ret = (st1.st_dev != st2.st_dev) ? true : false;
+	if (PartitionManager.Is_Mount_Point(Mount_Point))
+		return true;
 
-	return ret;
+	// The mount table holds resolved paths, check where a symlinked mount
+	// point really leads
+	struct stat st;
+	if (lstat(Mount_Point.c_str(), &st) != 0 || !S_ISLNK(st.st_mode))
+		return false;
+	char real[PATH_MAX];
+	if (realpath(Mount_Point.c_str(), real) == NULL)
+		return false;
+	return PartitionManager.Is_Mount_Point(real);
 }
 
 bool TWPartition::Is_File_System_Writable(void) {
@@ -1370,6 +1402,8 @@ bool TWPartition::Mount(bool Display_Error) {
 		return false;
 	}
 
+	twrpTraceScope trace("mount", "Mount");
+
 	Find_Actual_Block_Device();
 
 	// Check the current file system before mounting
@@ -1499,7 +1533,13 @@ bool TWPartition::Mount(bool Display_Error) {
 	return true;
 }
 
+bool TWPartition::Has_Settings_File() {
+	return Is_Settings_Storage || Mount_Point == "/persist";
+}
+
 bool TWPartition::UnMount(bool Display_Error) {
+	Settings_Storage_Lock settings_lock(Has_Settings_File());
+
 	if (Is_Mounted()) {
 		int never_unmount_system;
 
@@ -1510,8 +1550,12 @@ bool TWPartition::UnMount(bool Display_Error) {
 		if (Is_Storage && MTP_Storage_ID > 0)
 			PartitionManager.Remove_MTP_Storage(MTP_Storage_ID);
 
-		if (!Symlink_Mount_Point.empty())
+		// A kept open log copy would make the unmount fail with EBUSY
+		twrpLog::Release_Copies(Mount_Point);
+		if (!Symlink_Mount_Point.empty()) {
+			twrpLog::Release_Copies(Symlink_Mount_Point);
 			umount(Symlink_Mount_Point.c_str());
+		}
 
 		umount(Mount_Point.c_str());
 		if (Is_Mounted()) {
@@ -1557,6 +1601,9 @@ bool TWPartition::Wipe(string New_File_System) {
 	bool wiped = false, update_crypt = false, recreate_media = true;
 	int check;
 	string Layout_Filename = Mount_Point + "/.layout_version";
+	// One copy per partition, partitions may be wiped at the same time
+	string Layout_Copy = "/.layout_version_" + Backup_Name;
+	Settings_Storage_Lock settings_lock(Has_Settings_File());
 
 	if (!Can_Be_Wiped) {
 		gui_msg(Msg(msg::kError, "cannot_wipe=Partition {1} cannot be wiped.")(Display_Name));
@@ -1567,9 +1614,9 @@ bool TWPartition::Wipe(string New_File_System) {
 		Log_Offset = 0;
 
 	if (Retain_Layout_Version && Mount(false) && TWFunc::Path_Exists(Layout_Filename))
-		TWFunc::copy_file(Layout_Filename, "/.layout_version", 0600);
+		TWFunc::copy_file(Layout_Filename, Layout_Copy, 0600);
 	else
-		unlink("/.layout_version");
+		unlink(Layout_Copy.c_str());
 
 	if (Has_Data_Media && Current_File_System == New_File_System) {
 		wiped = Wipe_Data_Without_Wiping_Media();
@@ -1595,18 +1642,19 @@ bool TWPartition::Wipe(string New_File_System) {
 			wiped = Wipe_NTFS();
 		else {
 			LOGERR("Unable to wipe '%s' -- unknown file system '%s'\n", Mount_Point.c_str(), New_File_System.c_str());
-			unlink("/.layout_version");
+			unlink(Layout_Copy.c_str());
 			return false;
 		}
 		update_crypt = wiped;
 	}
+	Invalidate_FS_Types();
 
 	if (wiped) {
 		if (Mount_Point == "/cache")
 			DataManager::Output_Version();
 
-		if (TWFunc::Path_Exists("/.layout_version") && Mount(false))
-			TWFunc::copy_file("/.layout_version", Layout_Filename, 0600);
+		if (TWFunc::Path_Exists(Layout_Copy) && Mount(false))
+			TWFunc::copy_file(Layout_Copy, Layout_Filename, 0600);
 
 		if (update_crypt) {
 			Setup_File_System(false);
@@ -1651,6 +1699,60 @@ bool TWPartition::Wipe_AndSec(void) {
 	return true;
 }
 
+enum Tool_Progress_Format {
+	TOOL_PROGRESS_NONE = 0,
+	TOOL_PROGRESS_E2FSCK,                              // "pass current max device" lines of e2fsck -C 1
+	TOOL_PROGRESS_RESIZE2FS,                           // "Begin pass N" lines of resize2fs -p
+};
+
+struct Tool_Progress {
+	Tool_Progress_Format format;
+	ProgressTracking *progress;
+	unsigned long long size;                           // bytes the progress bar stands for
+};
+
+// Logs the output of a file system tool as it comes and moves the progress
+// bar along with the passes the tool reports
+static void Tool_Output_Line(const string& line, void *cookie) {
+	// Share of the run each pass ends at, pass 1 of e2fsck reads every inode
+	static const int e2fsck_pass_end[] = {0, 70, 90, 92, 97, 100};
+	Tool_Progress *tool = (Tool_Progress*) cookie;
+	unsigned long current, max;
+	int pass;
+
+	if (tool->format == TOOL_PROGRESS_E2FSCK && sscanf(line.c_str(), "%d %lu %lu", &pass, &current, &max) == 3) {
+		if (pass >= 1 && pass <= 5 && max > 0 && current <= max) {
+			double percent = e2fsck_pass_end[pass - 1] + (e2fsck_pass_end[pass] - e2fsck_pass_end[pass - 1]) * (double) current / max;
+			tool->progress->UpdateSize(tool->size * percent / 100);
+		}
+		return;
+	}
+	// The bars of the passes have no newlines, only the start of each pass is known
+	if (tool->format == TOOL_PROGRESS_RESIZE2FS && sscanf(line.c_str(), "Begin pass %d", &pass) == 1 && pass >= 1 && pass <= 5)
+		tool->progress->UpdateSize(tool->size * (pass - 1) / 5);
+	if (!line.empty())
+		LOGINFO("%s\n", line.c_str());
+}
+
+// Runs a file system tool without a shell, streaming its output to the log
+static int Run_Tool(const string& command, Tool_Progress_Format format, unsigned long long size) {
+	Tool_Progress tool;
+	ProgressTracking progress(size);
+	int status;
+
+	tool.format = format;
+	tool.progress = &progress;
+	tool.size = size;
+	if (format != TOOL_PROGRESS_NONE)
+		progress.SetPartitionSize(size);
+	status = TWFunc::Exec_Args(TWFunc::split_string(command, ' ', true), NULL, 0, Tool_Output_Line, &tool);
+	if (status == -1)
+		return -1;
+	if (format != TOOL_PROGRESS_NONE && status == 0)
+		progress.UpdateSize(size);
+	return TWFunc::Check_Child_Status(status, command);
+}
+
 bool TWPartition::Can_Repair() {
 	if (Mount_Read_Only)
 		return false;
@@ -1681,7 +1783,7 @@ bool TWPartition::Repair() {
 		Find_Actual_Block_Device();
 		command = "/sbin/fsck.fat -y " + Actual_Block_Device;
 		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		if (Run_Tool(command, TOOL_PROGRESS_NONE, 0) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1698,9 +1800,9 @@ bool TWPartition::Repair() {
 			return false;
 		gui_msg(Msg("repairing_using=Repairing {1} using {2}...")(Display_Name)("e2fsck"));
 		Find_Actual_Block_Device();
-		command = "/sbin/e2fsck -fp " + Actual_Block_Device;
+		command = "/sbin/e2fsck -fp -C 1 " + Actual_Block_Device;
 		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		if (Run_Tool(command, TOOL_PROGRESS_E2FSCK, IOCTL_Get_Block_Size()) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1719,7 +1821,7 @@ bool TWPartition::Repair() {
 		Find_Actual_Block_Device();
 		command = "/sbin/fsck.exfat " + Actual_Block_Device;
 		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		if (Run_Tool(command, TOOL_PROGRESS_NONE, 0) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1738,7 +1840,7 @@ bool TWPartition::Repair() {
 		Find_Actual_Block_Device();
 		command = "/sbin/fsck.f2fs " + Actual_Block_Device;
 		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		if (Run_Tool(command, TOOL_PROGRESS_NONE, 0) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1762,7 +1864,7 @@ bool TWPartition::Repair() {
 		Find_Actual_Block_Device();
 		command = "/sbin/" + Ntfsfix_Binary + " " + Actual_Block_Device;
 		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		if (Run_Tool(command, TOOL_PROGRESS_NONE, 0) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1801,7 +1903,7 @@ bool TWPartition::Resize() {
 			return false;
 		gui_msg(Msg("resizing=Resizing {1} using {2}...")(Display_Name)("resize2fs"));
 		Find_Actual_Block_Device();
-		command = "/sbin/resize2fs " + Actual_Block_Device;
+		command = "/sbin/resize2fs -p " + Actual_Block_Device;
 		if (Length != 0) {
 			unsigned long long Actual_Size = IOCTL_Get_Block_Size();
 			if (Actual_Size == 0)
@@ -1822,7 +1924,7 @@ bool TWPartition::Resize() {
 			command += "K";
 		}
 		LOGINFO("Resize command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		if (Run_Tool(command, TOOL_PROGRESS_RESIZE2FS, IOCTL_Get_Block_Size()) == 0) {
 			Update_Size(true);
 			gui_msg("done=Done.");
 			return true;
@@ -1836,7 +1938,9 @@ bool TWPartition::Resize() {
 }
 
 bool TWPartition::Backup(PartitionSettings *part_settings, pid_t *tar_fork_pid) {
-	if (Backup_Method == BM_FILES)
+	if (Backup_Method == BM_FILES && Can_Backup_Used_Blocks(part_settings))
+		return Backup_Used_Blocks(part_settings, tar_fork_pid);
+	else if (Backup_Method == BM_FILES)
 		return Backup_Tar(part_settings, tar_fork_pid);
 	else if (Backup_Method == BM_DD)
 		return Backup_Image(part_settings);
@@ -1852,7 +1956,10 @@ bool TWPartition::Restore(PartitionSettings *part_settings) {
 
 	string Restore_File_System = Get_Restore_File_System(part_settings);
 
-	if (Is_File_System(Restore_File_System))
+	// Used blocks backups of file systems are sparse images, tar archives never start like one
+	if (Is_File_System(Restore_File_System) && !part_settings->adbbackup && Is_Sparse_Image(part_settings->Backup_Folder + "/" + Backup_FileName))
+		return Restore_Used_Blocks(part_settings);
+	else if (Is_File_System(Restore_File_System))
 		return Restore_Tar(part_settings);
 	else if (Is_Image(Restore_File_System))
 		return Restore_Image(part_settings);
@@ -1904,6 +2011,7 @@ bool TWPartition::Decrypt(string Password) {
 
 bool TWPartition::Wipe_Encryption() {
 	bool Save_Data_Media = Has_Data_Media;
+	Settings_Storage_Lock settings_lock(Has_Settings_File());
 
 	if (!UnMount(true))
 		return false;
@@ -1989,9 +2097,39 @@ bool TWPartition::Wipe_Encryption() {
 	return false;
 }
 
+// Reads what identifies the current contents of a block device for the type cache
+static bool Get_FS_Type_Key(const string& Block_Device, FS_Type_Cache_Entry *key) {
+	unsigned char head[4096];
+	struct stat st;
+	bool ret = false;
+	int fd;
+
+	fd = open(Block_Device.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &key->size) == 0 && read(fd, head, sizeof(head)) == (ssize_t)sizeof(head)) {
+		key->rdev = st.st_rdev;
+		key->head_sum = 2166136261u;
+		for (size_t i = 0; i < sizeof(head); i++)
+			key->head_sum = (key->head_sum ^ head[i]) * 16777619u;
+		ret = true;
+	}
+	close(fd);
+	return ret;
+}
+
+void TWPartition::Invalidate_FS_Types() {
+	pthread_mutex_lock(&fs_type_cache_lock);
+	fs_type_generation++;
+	pthread_mutex_unlock(&fs_type_cache_lock);
+}
+
 void TWPartition::Check_FS_Type() {
 	const char* type;
 	blkid_probe pr;
+	FS_Type_Cache_Entry key;
+	std::map<string, FS_Type_Cache_Entry>::iterator cached;
+	bool use_cache, found = false;
 
 	if (Fstab_File_System == "yaffs2" || Fstab_File_System == "mtd" || Fstab_File_System == "bml" || Ignore_Blkid)
 		return; // Running blkid on some mtd devices causes a massive crash or needs to be skipped
@@ -2000,21 +2138,44 @@ void TWPartition::Check_FS_Type() {
 	if (!Is_Present)
 		return;
 
-	pr = blkid_new_probe_from_filename(Actual_Block_Device.c_str());
-	if (blkid_do_fullprobe(pr)) {
-		blkid_free_probe(pr);
-		LOGINFO("Can't probe device %s\n", Actual_Block_Device.c_str());
-		return;
+	use_cache = Get_FS_Type_Key(Actual_Block_Device, &key);
+	if (use_cache) {
+		pthread_mutex_lock(&fs_type_cache_lock);
+		key.generation = fs_type_generation;
+		cached = fs_type_cache.find(Actual_Block_Device);
+		if (cached != fs_type_cache.end() && cached->second.rdev == key.rdev && cached->second.size == key.size
+			&& cached->second.head_sum == key.head_sum && cached->second.generation == key.generation) {
+			key.type = cached->second.type;
+			found = true;
+		}
+		pthread_mutex_unlock(&fs_type_cache_lock);
 	}
 
-	if (blkid_probe_lookup_value(pr, "TYPE", &type, NULL) < 0) {
+	if (!found) {
+		pr = blkid_new_probe_from_filename(Actual_Block_Device.c_str());
+		if (blkid_do_fullprobe_hint(pr, Fstab_File_System.c_str())) {
+			blkid_free_probe(pr);
+			LOGINFO("Can't probe device %s\n", Actual_Block_Device.c_str());
+			return;
+		}
+		if (blkid_probe_lookup_value(pr, "TYPE", &type, NULL) < 0) {
+			LOGINFO("can't find filesystem on device %s\n", Actual_Block_Device.c_str());
+			key.type = "";
+		} else {
+			key.type = type;
+		}
 		blkid_free_probe(pr);
-		LOGINFO("can't find filesystem on device %s\n", Actual_Block_Device.c_str());
-		return;
+		if (use_cache) {
+			pthread_mutex_lock(&fs_type_cache_lock);
+			// The generation is from before the probe, a wipe that finished meanwhile leaves the entry stale
+			fs_type_cache[Actual_Block_Device] = key;
+			pthread_mutex_unlock(&fs_type_cache_lock);
+		}
 	}
+	if (key.type.empty())
+		return;
 
-	Current_File_System = type;
-	blkid_free_probe(pr);
+	Current_File_System = key.type;
 	if (fs_flags.size() > 1) {
 		std::vector<partition_fs_flags_struct>::iterator iter;
 		std::vector<partition_fs_flags_struct>::iterator found = fs_flags.begin();
@@ -2045,7 +2206,7 @@ bool TWPartition::Wipe_EXT23(string File_System) {
 		Find_Actual_Block_Device();
 		command = "mke2fs -t " + File_System + " -m 0 " + Actual_Block_Device;
 		LOGINFO("mke2fs command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		if (Run_Tool(command, TOOL_PROGRESS_NONE, 0) == 0) {
 			Current_File_System = File_System;
 			Recreate_AndSec_Folder();
 			gui_msg("done=Done.");
@@ -2060,6 +2221,29 @@ bool TWPartition::Wipe_EXT23(string File_System) {
 	return false;
 }
 
+// Discards the range the new file system will cover before it is created so
+// the flash does not carry the old data around. A crypto footer reserved with
+// a negative length is left alone.
+void TWPartition::Discard_Block_Device() {
+	uint64_t range[2] = {0, 0};
+	int fd;
+
+	fd = open(Actual_Block_Device.c_str(), O_RDWR);
+	if (fd < 0) {
+		LOGINFO("Unable to open '%s' to discard: %s\n", Actual_Block_Device.c_str(), strerror(errno));
+		return;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &range[1]) == 0) {
+		if (!Is_Decrypted && Length > 0 && (uint64_t)Length < range[1])
+			range[1] = Length;
+		else if (!Is_Decrypted && Length < 0)
+			range[1] = (uint64_t)-Length < range[1] ? range[1] + Length : 0;
+		if (range[1] > 0 && ioctl(fd, BLKDISCARD, &range) != 0)
+			LOGINFO("Discard of '%s' not done: %s\n", Actual_Block_Device.c_str(), strerror(errno));
+	}
+	close(fd);
+}
+
 bool TWPartition::Wipe_EXT4() {
 	Find_Actual_Block_Device();
 	if (!Is_Present) {
@@ -2069,18 +2253,19 @@ bool TWPartition::Wipe_EXT4() {
 	}
 	if (!UnMount(true))
 		return false;
+	Discard_Block_Device();
 
 #if defined(USE_EXT4)
 	int ret;
-	char *secontext = NULL;
+	string secontext;
 
 	gui_msg(Msg("formatting_using=Formatting {1} using {2}...")(Display_Name)("make_ext4fs"));
 
-	if (!selinux_handle || selabel_lookup(selinux_handle, &secontext, Mount_Point.c_str(), S_IFDIR) < 0) {
+	if (!twrpSELabel::Lookup(Mount_Point, S_IFDIR, &secontext)) {
 		LOGINFO("Cannot lookup security context for '%s'\n", Mount_Point.c_str());
 		ret = make_ext4fs(Actual_Block_Device.c_str(), Length, Mount_Point.c_str(), NULL);
 	} else {
-		ret = make_ext4fs(Actual_Block_Device.c_str(), Length, Mount_Point.c_str(), selinux_handle);
+		ret = make_ext4fs(Actual_Block_Device.c_str(), Length, Mount_Point.c_str(), twrpSELabel::Handle());
 	}
 	if (ret != 0) {
 		gui_msg(Msg(msg::kError, "unable_to_wipe=Unable to wipe {1}.")(Display_Name));
@@ -2111,7 +2296,7 @@ bool TWPartition::Wipe_EXT4() {
 		}
 		Command += " -a " + Mount_Point + " " + Actual_Block_Device;
 		LOGINFO("make_ext4fs command: %s\n", Command.c_str());
-		if (TWFunc::Exec_Cmd(Command) == 0) {
+		if (Run_Tool(Command, TOOL_PROGRESS_NONE, 0) == 0) {
 			Current_File_System = "ext4";
 			Recreate_AndSec_Folder();
 			gui_msg("done=Done.");
@@ -2135,7 +2320,7 @@ bool TWPartition::Wipe_FAT() {
 
 		gui_msg(Msg("formatting_using=Formatting {1} using {2}...")(Display_Name)("mkfs.fat"));
 		Find_Actual_Block_Device();
-		command = "mkfs.fat " + Actual_Block_Device;
+		command = "mkfs.fat --discard " + Actual_Block_Device;
 		if (TWFunc::Exec_Cmd(command) == 0) {
 			Current_File_System = "vfat";
 			Recreate_AndSec_Folder();
@@ -2162,7 +2347,7 @@ bool TWPartition::Wipe_EXFAT() {
 
 		gui_msg(Msg("formatting_using=Formatting {1} using {2}...")(Display_Name)("mkexfatfs"));
 		Find_Actual_Block_Device();
-		command = "mkexfatfs " + Actual_Block_Device;
+		command = "mkexfatfs -d " + Actual_Block_Device;
 		if (TWFunc::Exec_Cmd(command) == 0) {
 			Recreate_AndSec_Folder();
 			gui_msg("done=Done.");
@@ -2219,7 +2404,9 @@ bool TWPartition::Wipe_RMRF() {
 		PartitionManager.Remove_MTP_Storage(MTP_Storage_ID);
 
 	gui_msg(Msg("remove_all=Removing all files under '{1}'")(Mount_Point));
-	TWFunc::removeDir(Mount_Point, true);
+	ProgressTracking progress(Used);
+	progress.SetPartitionSize(Used);
+	TWFunc::removeDir(Mount_Point, true, NULL, &progress);
 	Recreate_AndSec_Folder();
 	return true;
 }
@@ -2233,6 +2420,7 @@ bool TWPartition::Wipe_F2FS() {
 
 		gui_msg(Msg("formatting_using=Formatting {1} using {2}...")(Display_Name)("mkfs.f2fs"));
 		Find_Actual_Block_Device();
+		Discard_Block_Device(); // mkfs.f2fs is still run with -t 0, it would trim the whole device
 		command = "mkfs.f2fs -t 0";
 		if (!Is_Decrypted && Length != 0) {
 			// Only use length if we're not decrypted
@@ -2245,7 +2433,7 @@ bool TWPartition::Wipe_F2FS() {
 			command += len;
 		}
 		command += " " + Actual_Block_Device;
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		if (Run_Tool(command, TOOL_PROGRESS_NONE, 0) == 0) {
 			Recreate_AndSec_Folder();
 			gui_msg("done=Done.");
 			return true;
@@ -2307,83 +2495,104 @@ bool TWPartition::Wipe_Data_Without_Wiping_Media() {
 #endif // ifdef TW_OEM_BUILD
 }
 
-bool TWPartition::Wipe_Data_Without_Wiping_Media_Func(const string& parent __unused) {
-	string dir;
+bool TWPartition::Wipe_Data_Without_Wiping_Media_Func(const string& parent) {
+	ProgressTracking progress(Used);
+	progress.SetPartitionSize(Used);
+	return TWFunc::removeDir(TWFunc::Remove_Trailing_Slashes(parent), true, &wipe_exclusions, &progress) == 0;
+}
 
-	DIR* d;
-	d = opendir(parent.c_str());
-	if (d != NULL) {
-		struct dirent* de;
-		while ((de = readdir(d)) != NULL) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)	 continue;
+void TWPartition::Setup_Backup_Tar(twrpTar *tar, PartitionSettings *part_settings) {
+	DataManager::GetValue(TW_USE_COMPRESSION_VAR, tar->use_compression);
+	tar->use_lz4 = part_settings->use_lz4;
 
-			dir = parent;
-			dir.append(de->d_name);
-			if (wipe_exclusions.check_skip_dirs(dir)) {
-				LOGINFO("skipped '%s'\n", dir.c_str());
-				continue;
-			}
-			if (de->d_type == DT_DIR) {
-				dir.append("/");
-				if (!Wipe_Data_Without_Wiping_Media_Func(dir)) {
-					closedir(d);
-					return false;
-				}
-				rmdir(dir.c_str());
-			} else if (de->d_type == DT_REG || de->d_type == DT_LNK || de->d_type == DT_FIFO || de->d_type == DT_SOCK) {
-				if (unlink(dir.c_str()) != 0)
-					LOGINFO("Unable to unlink '%s': %s\n", dir.c_str(), strerror(errno));
-			}
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	if (Can_Encrypt_Backup) {
+		DataManager::GetValue("tw_encrypt_backup", tar->use_encryption);
+		if (tar->use_encryption) {
+			if (Use_Userdata_Encryption)
+				tar->userdata_encryption = tar->use_encryption;
+			string Password;
+			DataManager::GetValue("tw_backup_password", Password);
+			tar->setpassword(Password);
+		} else {
+			tar->use_encryption = 0;
 		}
-		closedir(d);
-
-		return true;
 	}
-	gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Mount_Point)(strerror(errno)));
-	return false;
+#endif
+
+	Backup_FileName = Backup_Name + "." + Current_File_System + ".win";
+	tar->part_settings = part_settings;
+	tar->backup_exclusions = &backup_exclusions;
+	tar->setdir(Backup_Path);
+	tar->setfn(part_settings->Backup_Folder + "/" + Backup_FileName);
+	tar->setsize(Backup_Size);
+	tar->partition_name = Backup_Name;
+	tar->backup_folder = part_settings->Backup_Folder;
+	DataManager::GetValue(TW_DEDUP_BACKUP_VAR, tar->use_dedup);
+	DataManager::GetValue(TW_INCREMENTAL_BACKUP_VAR, tar->incremental);
+	// The snapshot is the whole file system, so it can only stand in for a backup of all of it
+	if (DataManager::GetIntValue(TW_SNAPSHOT_BACKUP_VAR) != 0 && twrpSnapshot::Supported(Current_File_System) && Backup_Path == Mount_Point)
+		tar->use_snapshot = 1;
+	if (part_settings->adbbackup && DataManager::GetIntValue(TW_ADB_AUTO_CODEC_VAR) != 0)
+		tar->Select_Adb_Codec();
+	if (tar->incremental && !part_settings->adbbackup)
+		tar->incremental_base = twrpManifest::Find_Base(part_settings->Backup_Folder, Backup_FileName);
+}
+
+twrpTar* TWPartition::Plan_Backup_Tar(PartitionSettings *part_settings) {
+	if (!Mount(true))
+		return NULL;
+	twrpTar* tar = new twrpTar;
+	Setup_Backup_Tar(tar, part_settings);
+	if (tar->Plan() != 0)
+		LOGINFO("%s is listed in the tar fork\n", Backup_Display_Name.c_str());
+	return tar;
 }
 
 bool TWPartition::Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_pid) {
-	string Full_FileName;
-	twrpTar tar;
+	twrpTar* tar = part_settings->plan != NULL ? part_settings->plan->Take_Tar(this) : NULL;
 
-	if (!Mount(true))
+	if (!Mount(true)) {
+		delete tar;
 		return false;
+	}
 
 	TWFunc::GUI_Operation_Text(TW_BACKUP_TEXT, Backup_Display_Name, "Backing Up");
 	gui_msg(Msg("backing_up=Backing up {1}...")(Backup_Display_Name));
 
-	DataManager::GetValue(TW_USE_COMPRESSION_VAR, tar.use_compression);
+	// A planned tar is set up already and has usually listed its files
+	if (tar == NULL) {
+		tar = new twrpTar;
+		Setup_Backup_Tar(tar, part_settings);
+	}
+	if (Has_Data_Media)
+		gui_msg(Msg(msg::kWarning, "backup_storage_warning=Backups of {1} do not include any files in internal storage such as pictures or downloads.")(Display_Name));
 
-#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
-	if (Can_Encrypt_Backup) {
-		DataManager::GetValue("tw_encrypt_backup", tar.use_encryption);
-		if (tar.use_encryption) {
-			if (Use_Userdata_Encryption)
-				tar.userdata_encryption = tar.use_encryption;
-			string Password;
-			DataManager::GetValue("tw_backup_password", Password);
-			tar.setpassword(Password);
+	// Released, and checkpoints turned back on, once the tar fork is done
+	twrpSnapshot snapshot;
+	if (tar->use_snapshot) {
+		if (snapshot.Hold(Mount_Point) && snapshot.Mount(Actual_Block_Device, Backup_Name))
+			tar->snapshot_dir = snapshot.Path();
+		else
+			gui_msg(Msg(msg::kWarning, "snapshot_fail=Unable to take a snapshot of {1}, backing up the live file system")(Display_Name));
+	}
+	bool ret = (tar->createTarFork(tar_fork_pid) == 0);
+	delete tar;
+	if (ret && part_settings->generate_digest && !part_settings->adbbackup) {
+		// The tar fork hashes every archive as it writes it, but the records it
+		// makes stay in the fork
+		string Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
+		if (TWFunc::Path_Exists(Full_FileName)) {
+			twrpDigestDriver::Digested_Inline(Full_FileName);
 		} else {
-			tar.use_encryption = 0;
+			std::vector<std::vector<string> > threads = twrpTar::List_Archives(Full_FileName);
+			for (size_t i = 0; i < threads.size(); i++) {
+				for (size_t j = 0; j < threads[i].size(); j++)
+					twrpDigestDriver::Digested_Inline(threads[i][j]);
+			}
 		}
 	}
-#endif
-
-	Backup_FileName = Backup_Name + "." + Current_File_System + ".win";
-	Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
-	if (Has_Data_Media)
-		gui_msg(Msg(msg::kWarning, "backup_storage_warning=Backups of {1} do not include any files in internal storage such as pictures or downloads.")(Display_Name));
-	tar.part_settings = part_settings;
-	tar.backup_exclusions = &backup_exclusions;
-	tar.setdir(Backup_Path);
-	tar.setfn(Full_FileName);
-	tar.setsize(Backup_Size);
-	tar.partition_name = Backup_Name;
-	tar.backup_folder = part_settings->Backup_Folder;
-	if (tar.createTarFork(tar_fork_pid) != 0)
-		return false;
-	return true;
+	return ret;
 }
 
 bool TWPartition::Backup_Image(PartitionSettings *part_settings) {
@@ -2395,7 +2604,7 @@ bool TWPartition::Backup_Image(PartitionSettings *part_settings) {
 	Backup_FileName = Backup_Name + "." + Current_File_System + ".win";
 
 	if (part_settings->adbbackup) {
-		Full_FileName = TW_ADB_BACKUP;
+		Full_FileName = twadbbu::Stream_Fifo(TW_ADB_BACKUP, part_settings->adb_stream);
 		adb_file_name  = part_settings->Backup_Folder + "/" + Backup_FileName;
 	}
 	else
@@ -2404,7 +2613,7 @@ bool TWPartition::Backup_Image(PartitionSettings *part_settings) {
 	part_settings->total_restore_size = Backup_Size;
 
 	if (part_settings->adbbackup) {
-		if (!twadbbu::Write_TWIMG(adb_file_name, Backup_Size))
+		if (!twadbbu::Write_TWIMG(adb_file_name, Backup_Size, part_settings->adb_stream))
 			return false;
 	}
 
@@ -2412,25 +2621,28 @@ bool TWPartition::Backup_Image(PartitionSettings *part_settings) {
 		return false;
 
 	if (part_settings->adbbackup) {
-		if (!twadbbu::Write_TWEOF())
+		if (!twadbbu::Write_TWEOF(part_settings->adb_stream))
 			return false;
 	}
 	return true;
 }
 
 bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
-	unsigned long long RW_Block_Size, Remain = Backup_Size;
-	int src_fd = -1, dest_fd = -1;
-	ssize_t bs;
-	bool ret = false;
-	void* buffer = NULL;
-	unsigned long long backedup_size = 0;
-	string srcfn, destfn;
+	unsigned long long Remain = Backup_Size;
+	int src_fd = -1, dest_fd = -1, sparse_backup = 0, sparse_restore = 0, use_dedup = 0;
+	bool ret = false, use_sha2 = false;
+	twrpDigest *digest = NULL;
+	twrpChunkStore *chunks = NULL;
+	twrpSnapshot snapshot;
+	string srcfn, destfn, expected_digest;
 
 	if (part_settings->PM_Method == PM_BACKUP) {
 		srcfn = Actual_Block_Device;
+		// The block device keeps the last checkpoint while the file system is written to
+		if (DataManager::GetIntValue(TW_SNAPSHOT_BACKUP_VAR) != 0 && twrpSnapshot::Supported(Current_File_System) && Is_Mounted() && !snapshot.Hold(Mount_Point))
+			gui_msg(Msg(msg::kWarning, "snapshot_fail=Unable to take a snapshot of {1}, backing up the live file system")(Display_Name));
 		if (part_settings->adbbackup)
-			destfn = TW_ADB_BACKUP;
+			destfn = twadbbu::Stream_Fifo(TW_ADB_BACKUP, part_settings->adb_stream);
 		else {
 			destfn = part_settings->Backup_Folder + "/" + Backup_FileName;
 		}
@@ -2438,20 +2650,36 @@ bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 	else {
 		destfn = Actual_Block_Device;
 		if (part_settings->adbbackup) {
-			srcfn = TW_ADB_RESTORE;
+			srcfn = twadbbu::Stream_Fifo(TW_ADB_RESTORE, part_settings->adb_stream);
 		} else {
 			srcfn = part_settings->Backup_Folder + "/" + Backup_FileName;
-			Remain = TWFunc::Get_File_Size(srcfn);
+			Remain = twrpChunkStore::Get_Size(srcfn);
+			// Images written with tw_sparse_image_backup or flashed from a sparse file are expanded as they are read
+			sparse_restore = Is_Sparse_Image(srcfn);
 		}
 	}
+	if (part_settings->PM_Method == PM_BACKUP && !part_settings->adbbackup) {
+		DataManager::GetValue(TW_SPARSE_IMAGE_BACKUP_VAR, sparse_backup);
+		// Sparse images skip the zeroes on their own and are flashed from the file
+		if (!sparse_backup)
+			DataManager::GetValue(TW_DEDUP_BACKUP_VAR, use_dedup);
+	}
 
-	src_fd = open(srcfn.c_str(), O_RDONLY | O_LARGEFILE);
+	if (part_settings->PM_Method == PM_RESTORE && !part_settings->adbbackup)
+		src_fd = twrpChunkStore::Open_File(srcfn, &chunks);
+	else
+		src_fd = open(srcfn.c_str(), O_RDONLY | O_LARGEFILE);
 	if (src_fd < 0) {
 		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(srcfn.c_str())(strerror(errno)));
 		return false;
 	}
 
-	dest_fd = open(destfn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR);
+	if (use_dedup && twrpChunkStore::Available()) {
+		chunks = new twrpChunkStore();
+		dest_fd = chunks->Open_Write(destfn);
+	} else {
+		dest_fd = open(destfn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR);
+	}
 	if (dest_fd < 0) {
 		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(destfn.c_str())(strerror(errno)));
 		goto exit;
@@ -2459,106 +2687,412 @@ bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 
 	LOGINFO("Reading '%s', writing '%s'\n", srcfn.c_str(), destfn.c_str());
 
-	if (part_settings->adbbackup) {
-		RW_Block_Size = MAX_ADB_READ;
-		bs = MAX_ADB_READ;
-	}
-	else {
-		RW_Block_Size = 1048576LLU; // 1MB
-		bs = (ssize_t)(RW_Block_Size);
-	}
-
-	buffer = malloc((size_t)bs);
-	if (!buffer) {
-		LOGINFO("Raw_Read_Write failed to malloc\n");
-		goto exit;
+	if (part_settings->PM_Method == PM_RESTORE && part_settings->adbbackup && part_settings->adb_resume_offset > 0) {
+		// adb backup only sends the image from the last checkpoint the interrupted restore reached
+		if (part_settings->adb_resume_offset > Remain || lseek64(dest_fd, part_settings->adb_resume_offset, SEEK_SET) < 0) {
+			gui_msg(Msg(msg::kError, "adb_resume_seek_err=Unable to resume {1} at {2}")(Display_Name)(part_settings->adb_resume_offset));
+			goto exit;
+		}
+		gui_msg(Msg("adb_resume_image=Resuming {1} at {2} MB")(Display_Name)(part_settings->adb_resume_offset / 1048576));
+		Remain -= part_settings->adb_resume_offset;
 	}
 
 	if (part_settings->progress)
 		part_settings->progress->SetPartitionSize(part_settings->total_restore_size);
 
-	while (Remain > 0) {
-		if (Remain < RW_Block_Size)
-			bs = (ssize_t)(Remain);
-		if (read(src_fd, buffer, bs) != bs) {
-			LOGINFO("Error reading source fd (%s)\n", strerror(errno));
-			goto exit;
-		}
-		if (write(dest_fd, buffer, bs) != bs) {
-			LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
-			goto exit;
+	{
+		twrpRawTransfer transfer(src_fd, dest_fd, Remain, part_settings->progress);
+		if (part_settings->adbbackup)
+			transfer.Set_Stream_Only(MAX_ADB_READ);
+		else if (part_settings->PM_Method == PM_BACKUP) {
+			if (sparse_backup)
+				transfer.Set_Sparse_Output();
+			else if (part_settings->generate_digest) {
+				// Hash the image while it is written instead of reading it back afterwards
+				digest = twrpDigestDriver::New_Backup_Digest(&use_sha2);
+				transfer.Set_Digest(digest);
+			}
+		} else if (part_settings->verify_digest) {
+			// Check the image as it is flashed, the restore fails if it does not match
+			digest = twrpDigestDriver::New_Restore_Digest(srcfn, &expected_digest, &use_sha2);
+			if (digest == NULL)
+				goto exit;
+			transfer.Set_Digest(digest);
 		}
-		backedup_size += (unsigned long long)(bs);
-		Remain -= (unsigned long long)(bs);
-		if (part_settings->progress)
-			part_settings->progress->UpdateSize(backedup_size);
-		if (PartitionManager.Check_Backup_Cancel() != 0)
+		if (part_settings->PM_Method == PM_RESTORE)
+			transfer.Set_Zero_Discard(); // Blank stretches of the image are zeroed by the device instead of written
+		if (sparse_restore)
+			transfer.Set_Sparse_Input();
+		if (!transfer.Transfer())
 			goto exit;
 	}
 	if (part_settings->progress)
 		part_settings->progress->UpdateDisplayDetails(true);
-	fsync(dest_fd);
+	if (chunks != NULL) {
+		// The chunk thread has to see the end of the data before the image is complete
+		if (part_settings->PM_Method == PM_BACKUP) {
+			close(dest_fd);
+			dest_fd = -1;
+		} else {
+			close(src_fd);
+			src_fd = -1;
+		}
+		if (!chunks->Finish())
+			goto exit;
+	}
+	if (dest_fd >= 0)
+		fsync(dest_fd);
 
 	if (!part_settings->adbbackup && part_settings->PM_Method == PM_BACKUP) {
 		tw_set_default_metadata(destfn.c_str());
 		LOGINFO("Restored default metadata for %s\n", destfn.c_str());
 	}
 
+	if (digest != NULL && part_settings->PM_Method == PM_BACKUP) {
+		if (!twrpDigestDriver::Write_Digest_File(destfn, digest, use_sha2))
+			goto exit;
+		twrpDigestDriver::Digested_Inline(destfn);
+	}
+	if (digest != NULL && part_settings->PM_Method == PM_RESTORE && !twrpDigestDriver::Compare_Digest(srcfn, digest, expected_digest, use_sha2))
+		goto exit;
+
 	ret = true;
 exit:
 	if (src_fd >= 0)
 		close(src_fd);
 	if (dest_fd >= 0)
 		close(dest_fd);
-	if (buffer)
-		free(buffer);
+	if (part_settings->PM_Method == PM_RESTORE)
+		Invalidate_FS_Types(); // Even a failed restore may have overwritten the superblock
+	delete chunks;
+	delete digest;
 	return ret;
 }
 
-bool TWPartition::Backup_Dump_Image(PartitionSettings *part_settings) {
-	string Full_FileName, Command;
+bool TWPartition::Remount_Read_Only(bool Read_Only) {
+	unsigned long flags = MS_REMOUNT | (Mount_Flags & ~MS_RDONLY);
 
-	TWFunc::GUI_Operation_Text(TW_BACKUP_TEXT, Display_Name, gui_parse_text("{@backing}"));
-	gui_msg(Msg("backing_up=Backing up {1}...")(Backup_Display_Name));
+	if (Read_Only)
+		flags |= MS_RDONLY;
+	if (mount(NULL, Mount_Point.c_str(), NULL, flags, Mount_Options.c_str()) != 0 &&
+		mount(NULL, Mount_Point.c_str(), NULL, flags, NULL) != 0) {
+		LOGINFO("Unable to remount '%s' %s (%s)\n", Mount_Point.c_str(), Read_Only ? "read only" : "read/write", strerror(errno));
+		return false;
+	}
+	return true;
+}
 
-	if (part_settings->progress)
-		part_settings->progress->SetPartitionSize(Backup_Size);
+bool TWPartition::Can_Backup_Used_Blocks(PartitionSettings *part_settings) {
+	struct stat part_st, folder_st;
+
+	if (Backup_Method != BM_FILES || DataManager::GetIntValue(TW_USED_BLOCKS_BACKUP_VAR) == 0 || !twrpBlockMap::Supported(Current_File_System))
+		return false;
+	// The image is the whole file system, so backups of part of it or of its files for a later increment stay with tar
+	if (part_settings->adbbackup || Has_Data_Media || Backup_Path != Mount_Point || DataManager::GetIntValue(TW_INCREMENTAL_BACKUP_VAR) != 0)
+		return false;
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	if (Can_Encrypt_Backup && DataManager::GetIntValue("tw_encrypt_backup") != 0)
+		return false;
+#endif
+	// The file system is read only while it is copied, the backup has to go somewhere else
+	if (!Mount(false) || stat(Mount_Point.c_str(), &part_st) != 0 || stat(part_settings->Backup_Folder.c_str(), &folder_st) != 0 || part_st.st_dev == folder_st.st_dev)
+		return false;
+	return true;
+}
+
+bool TWPartition::Backup_Used_Blocks(PartitionSettings *part_settings, pid_t *tar_fork_pid) {
+	twrpBlockMap map;
+	TWPartition* storage;
+	string Full_FileName;
+	struct stat st;
+	char info[128];
+	uint64_t max_size = 0;
+	int src_fd = -1, dest_fd = -1;
+	bool ret = false, writable;
 
+	// A tar planned before the setting changed is not needed
+	if (part_settings->plan != NULL)
+		delete part_settings->plan->Take_Tar(this);
+	if (!Mount(true))
+		return false;
+	// Read only the file system writes out its journal or checkpoint, and nothing moves while the blocks are copied
+	writable = Is_File_System_Writable();
+	if (writable && !Remount_Read_Only(true)) {
+		LOGINFO("%s is in use, backing up its files instead of its blocks\n", Mount_Point.c_str());
+		return Backup_Tar(part_settings, tar_fork_pid);
+	}
+	storage = PartitionManager.Find_Partition_By_Path(part_settings->Backup_Folder);
+	if (storage != NULL)
+		max_size = storage->Get_Max_FileSize();
+	if (!map.Read(Actual_Block_Device, Current_File_System) || (max_size != 0 && map.Used_Bytes() > max_size)) {
+		LOGINFO("Unable to back up the used blocks of %s, backing up its files instead\n", Mount_Point.c_str());
+		if (writable)
+			Remount_Read_Only(false);
+		return Backup_Tar(part_settings, tar_fork_pid);
+	}
+
+	TWFunc::GUI_Operation_Text(TW_BACKUP_TEXT, Backup_Display_Name, gui_parse_text("{@backing}"));
+	gui_msg(Msg("backing_up_blocks=Backing up {1}MB of used blocks of {2}...")(map.Used_Bytes() / 1048576)(Backup_Display_Name));
 	Backup_FileName = Backup_Name + "." + Current_File_System + ".win";
 	Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
 
-	Command = "dump_image " + MTD_Name + " '" + Full_FileName + "'";
+	src_fd = open(Actual_Block_Device.c_str(), O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+	if (src_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Actual_Block_Device)(strerror(errno)));
+		goto exit;
+	}
+	dest_fd = open(Full_FileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (dest_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Full_FileName)(strerror(errno)));
+		goto exit;
+	}
+	LOGINFO("Reading the used blocks of '%s', writing '%s'\n", Actual_Block_Device.c_str(), Full_FileName.c_str());
 
-	LOGINFO("Backup command: '%s'\n", Command.c_str());
-	TWFunc::Exec_Cmd(Command);
+	part_settings->total_restore_size = map.Used_Bytes();
+	if (part_settings->progress)
+		part_settings->progress->SetPartitionSize(part_settings->total_restore_size);
+	{
+		twrpRawTransfer transfer(src_fd, dest_fd, map.Device_Size(), part_settings->progress);
+		transfer.Set_Used_Blocks(&map.Get_Runs());
+		if (!transfer.Transfer())
+			goto exit;
+	}
+	if (part_settings->progress)
+		part_settings->progress->UpdateDisplayDetails(true);
+	if (fsync(dest_fd) != 0 || fstat(dest_fd, &st) != 0) {
+		LOGINFO("Unable to sync '%s' (%s)\n", Full_FileName.c_str(), strerror(errno));
+		goto exit;
+	}
 	tw_set_default_metadata(Full_FileName.c_str());
-	if (TWFunc::Get_File_Size(Full_FileName) == 0) {
-		// Actual size may not match backup size due to bad blocks on MTD devices so just check for 0 bytes
-		gui_msg(Msg(msg::kError, "backup_size=Backup file size for '{1}' is 0 bytes.")(Full_FileName));
-		return false;
+
+	// Restores size their progress by the image, there is no file count
+	snprintf(info, sizeof(info), "backup_size=%llu\nbackup_type=%d\nfile_count=0\n", (unsigned long long)st.st_size, UNCOMPRESSED);
+	if (!twrpBackupMeta::Add(part_settings->Backup_Folder, BACKUP_META_INFO, Backup_Name, info)) {
+		InfoManager backup_info(part_settings->Backup_Folder + "/" + Backup_Name + ".info");
+		backup_info.SetValue("backup_size", (unsigned long long)st.st_size);
+		backup_info.SetValue("backup_type", (int)UNCOMPRESSED);
+		backup_info.SetValue("file_count", 0);
+		backup_info.SaveValues();
+	}
+	ret = true;
+
+exit:
+	if (src_fd >= 0)
+		close(src_fd);
+	if (dest_fd >= 0)
+		close(dest_fd);
+	if (writable && !Remount_Read_Only(false))
+		gui_msg(Msg(msg::kError, "remount_rw_err=Unable to remount {1} read/write")(Mount_Point));
+	return ret;
+}
+
+#define MTD_FEED_SIZE (1024 * 1024)
+
+// libmtdutils skips the bad blocks of an MTD partition, which reading the
+// mtd device does not. The thread reads the partition with it into a pipe
+// that twrpRawTransfer copies from like from any other source.
+struct MTD_Feed {
+	MtdReadContext *ctx;
+	int pipe_fd;                                                             // write end, closed by the thread
+	unsigned long long size;
+	unsigned long long padded;                                               // bytes that failed to read
+};
+
+static void* MTD_Feed_Thread(void *cookie) {
+	MTD_Feed *feed = (MTD_Feed*)cookie;
+	unsigned long long remain = feed->size;
+	char *buf = (char*)malloc(MTD_FEED_SIZE);
+
+	while (buf && remain > 0) {
+		size_t len = remain < MTD_FEED_SIZE ? remain : MTD_FEED_SIZE;
+		ssize_t got = mtd_read_data(feed->ctx, buf, len);
+		if (got <= 0) {
+			// Keep the size the transfer expects, erased flash reads as 0xFF
+			memset(buf, 0xFF, len);
+			feed->padded += len;
+			got = len;
+		}
+		const char *p = buf;
+		ssize_t left = got;
+		while (left > 0) {
+			ssize_t wrote = write(feed->pipe_fd, p, left);
+			if (wrote < 0 && errno == EINTR)
+				continue;
+			if (wrote <= 0)
+				goto done; // the transfer stopped reading
+			p += wrote;
+			left -= wrote;
+		}
+		remain -= got;
+	}
+done:
+	free(buf);
+	close(feed->pipe_fd);
+	return NULL;
+}
+
+bool TWPartition::Backup_Dump_Image(PartitionSettings *part_settings) {
+	string Full_FileName, adb_file_name;
+	unsigned long long image_size = 0;
+	int src_fd = -1, dest_fd = -1;
+	bool ret = false, use_sha2 = false, feeding = false;
+	const MtdPartition *mtd = NULL;
+	MTD_Feed feed;
+	pthread_t feed_thread;
+	twrpDigest *digest = NULL;
+
+	TWFunc::GUI_Operation_Text(TW_BACKUP_TEXT, Display_Name, gui_parse_text("{@backing}"));
+	gui_msg(Msg("backing_up=Backing up {1}...")(Backup_Display_Name));
+
+	Backup_FileName = Backup_Name + "." + Current_File_System + ".win";
+	if (part_settings->adbbackup) {
+		Full_FileName = twadbbu::Stream_Fifo(TW_ADB_BACKUP, part_settings->adb_stream);
+		adb_file_name = part_settings->Backup_Folder + "/" + Backup_FileName;
+	} else
+		Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
+
+	memset(&feed, 0, sizeof(feed));
+	if (Current_File_System == "mtd") {
+		int fds[2];
+
+		if (mtd_scan_partitions() <= 0 || (mtd = mtd_find_partition_by_name(MTD_Name.c_str())) == NULL) {
+			LOGERR("Unable to find MTD partition '%s'\n", MTD_Name.c_str());
+			return false;
+		}
+		feed.ctx = mtd_read_partition(mtd);
+		if (feed.ctx == NULL) {
+			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(MTD_Name)(strerror(errno)));
+			return false;
+		}
+		if (pipe2(fds, O_CLOEXEC) != 0) {
+			LOGERR("Unable to create pipe: %s\n", strerror(errno));
+			goto exit;
+		}
+		src_fd = fds[0];
+		feed.pipe_fd = fds[1];
+		feed.size = image_size = mtd_read_size(feed.ctx);
+		if (pthread_create(&feed_thread, NULL, MTD_Feed_Thread, &feed) != 0) {
+			LOGERR("Unable to start MTD reader thread\n");
+			close(feed.pipe_fd);
+			goto exit;
+		}
+		feeding = true;
+	} else {
+		// BML partitions are block devices that handle their own bad blocks
+		src_fd = open(Actual_Block_Device.c_str(), O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+		if (src_fd < 0) {
+			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Actual_Block_Device)(strerror(errno)));
+			return false;
+		}
+		off64_t end = lseek64(src_fd, 0, SEEK_END);
+		if (end <= 0 || lseek64(src_fd, 0, SEEK_SET) != 0) {
+			LOGERR("Unable to get the size of '%s'\n", Actual_Block_Device.c_str());
+			goto exit;
+		}
+		image_size = end;
+	}
+	part_settings->total_restore_size = image_size;
+
+	if (part_settings->adbbackup && !twadbbu::Write_TWIMG(adb_file_name, image_size, part_settings->adb_stream))
+		goto exit;
+
+	dest_fd = open(Full_FileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR);
+	if (dest_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Full_FileName)(strerror(errno)));
+		goto exit;
 	}
+	LOGINFO("Reading %s '%s', writing '%s'\n", Current_File_System.c_str(), Current_File_System == "mtd" ? MTD_Name.c_str() : Actual_Block_Device.c_str(), Full_FileName.c_str());
+
 	if (part_settings->progress)
-		part_settings->progress->UpdateSize(Backup_Size);
+		part_settings->progress->SetPartitionSize(image_size);
+	{
+		// Images from dump_image were never sparse or deduplicated, flash_image restores the file as it is
+		twrpRawTransfer transfer(src_fd, dest_fd, image_size, part_settings->progress);
+		if (part_settings->adbbackup)
+			transfer.Set_Stream_Only(MAX_ADB_READ);
+		else if (part_settings->generate_digest) {
+			digest = twrpDigestDriver::New_Backup_Digest(&use_sha2);
+			transfer.Set_Digest(digest);
+		}
+		if (!transfer.Transfer())
+			goto exit;
+	}
+	if (part_settings->progress)
+		part_settings->progress->UpdateDisplayDetails(true);
+	if (!part_settings->adbbackup) {
+		fsync(dest_fd);
+		tw_set_default_metadata(Full_FileName.c_str());
+		if (TWFunc::Get_File_Size(Full_FileName) == 0) {
+			gui_msg(Msg(msg::kError, "backup_size=Backup file size for '{1}' is 0 bytes.")(Full_FileName));
+			goto exit;
+		}
+	}
+	if (digest != NULL) {
+		if (!twrpDigestDriver::Write_Digest_File(Full_FileName, digest, use_sha2))
+			goto exit;
+		twrpDigestDriver::Digested_Inline(Full_FileName);
+	}
+	if (part_settings->adbbackup && !twadbbu::Write_TWEOF(part_settings->adb_stream))
+		goto exit;
+	ret = true;
 
-	return true;
+exit:
+	if (src_fd >= 0)
+		close(src_fd); // the reader thread gets EPIPE if the transfer stopped early
+	if (feeding)
+		pthread_join(feed_thread, NULL);
+	if (feed.ctx != NULL)
+		mtd_read_close(feed.ctx);
+	if (feed.padded > 0)
+		gui_msg(Msg(msg::kWarning, "mtd_unreadable={1} MB of {2} could not be read and were filled with 0xFF")(feed.padded / 1048576)(Display_Name));
+	if (dest_fd >= 0)
+		close(dest_fd);
+	delete digest;
+	return ret;
 }
 
 unsigned long long TWPartition::Get_Restore_Size(PartitionSettings *part_settings) {
+	std::vector<string> chain;
+	unsigned long long total = 0;
+
+	if (part_settings->adbbackup || Is_Image(Get_Restore_File_System(part_settings)))
+		return Get_Restore_Size(part_settings, part_settings->Backup_Folder);
+
+	// An incremental backup restores every backup it is based on as well
+	if (!twrpManifest::Get_Restore_Chain(part_settings->Backup_Folder, Backup_FileName, &chain))
+		chain.assign(1, part_settings->Backup_Folder);
+	for (size_t i = 0; i < chain.size(); i++)
+		total += Get_Restore_Size(part_settings, chain[i]);
+	Restore_Size = total;
+	return Restore_Size;
+}
+
+unsigned long long TWPartition::Get_Restore_Size(PartitionSettings *part_settings, const string& Backup_Folder) {
+	InfoManager restore_info(Backup_Folder + "/" + Backup_Name + ".info");
+	string info;
+
+	Restore_File_Count = 0;
 	if (!part_settings->adbbackup) {
-		InfoManager restore_info(part_settings->Backup_Folder + "/" + Backup_Name + ".info");
+		if (twrpBackupMeta::Find(Backup_Folder, BACKUP_META_INFO, Backup_Name, &info) &&
+				sscanf(info.c_str(), "backup_size=%llu backup_type=%*d file_count=%llu", &Restore_Size, &Restore_File_Count) >= 1) {
+			LOGINFO("Read backup metadata, restore size is %llu, %llu files\n", Restore_Size, Restore_File_Count);
+			return Restore_Size;
+		}
 		if (restore_info.LoadValues() == 0) {
 			if (restore_info.GetValue("backup_size", Restore_Size) == 0) {
-				LOGINFO("Read info file, restore size is %llu\n", Restore_Size);
+				// Backups made before file counts were recorded leave it at 0
+				restore_info.GetValue("file_count", Restore_File_Count);
+				LOGINFO("Read info file, restore size is %llu, %llu files\n", Restore_Size, Restore_File_Count);
 				return Restore_Size;
 			}
 		}
 	}
 
-	string Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
+	string Full_FileName = Backup_Folder + "/" + Backup_FileName;
 	string Restore_File_System = Get_Restore_File_System(part_settings);
 
-	if (Is_Image(Restore_File_System)) {
-		Restore_Size = TWFunc::Get_File_Size(Full_FileName);
+	if (Is_Image(Restore_File_System) || Is_Sparse_Image(Full_FileName)) {
+		Restore_Size = twrpChunkStore::Get_Size(Full_FileName);
 		return Restore_Size;
 	}
 
@@ -2573,9 +3107,19 @@ unsigned long long TWPartition::Get_Restore_Size(PartitionSettings *part_setting
 		tar.setpassword(Password);
 #endif
 	tar.partition_name = Backup_Name;
-	tar.backup_folder = part_settings->Backup_Folder;
+	tar.backup_folder = Backup_Folder;
 	tar.part_settings = part_settings;
 	Restore_Size = tar.get_size();
+	if (!part_settings->adbbackup && Restore_Size > 0) {
+		// Older backups have no size in the info file, keep it for the next
+		// restore unless the backup is on read-only or write-protected media
+		if (access(Backup_Folder.c_str(), W_OK) == 0) {
+			restore_info.SetValue("backup_size", Restore_Size);
+			restore_info.SaveValues();
+		} else {
+			LOGINFO("Not storing the restore size, '%s' is not writable: %s\n", Backup_Folder.c_str(), strerror(errno));
+		}
+	}
 	return Restore_Size;
 }
 
@@ -2583,6 +3127,12 @@ bool TWPartition::Restore_Tar(PartitionSettings *part_settings) {
 	string Full_FileName;
 	bool ret = false;
 	string Restore_File_System = Get_Restore_File_System(part_settings);
+	std::vector<string> chain;
+
+	if (!part_settings->adbbackup && !twrpManifest::Get_Restore_Chain(part_settings->Backup_Folder, Backup_FileName, &chain))
+		return false;
+	if (chain.empty())
+		chain.push_back(part_settings->Backup_Folder);
 
 	if (Has_Android_Secure) {
 		if (!Wipe_AndSec())
@@ -2605,23 +3155,38 @@ bool TWPartition::Restore_Tar(PartitionSettings *part_settings) {
 	if (!ReMount_RW(true))
 		return false;
 
-	Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
-	twrpTar tar;
-	tar.part_settings = part_settings;
-	tar.setdir(Backup_Path);
-	tar.setfn(Full_FileName);
-	tar.backup_name = Backup_Name;
+	if (chain.size() > 1)
+		gui_msg(Msg("incremental_restore=Restoring {1} backups in order")(chain.size()));
+	// The full backup is extracted first, then each increment after removing what it deleted or replaced
+	ret = true;
+	for (size_t i = 0; i < chain.size() && ret; i++) {
+		Full_FileName = chain[i] + "/" + Backup_FileName;
+		if (i > 0 && !twrpManifest::Apply_Deletions(Full_FileName + MANIFEST_DELETED_EXTENSION)) {
+			ret = false;
+			break;
+		}
+		twrpTar tar;
+		tar.part_settings = part_settings;
+		tar.setdir(Backup_Path);
+		tar.setfn(Full_FileName);
+		tar.backup_name = Backup_Name;
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
-	string Password;
-	DataManager::GetValue("tw_restore_password", Password);
-	if (!Password.empty())
-		tar.setpassword(Password);
+		string Password;
+		DataManager::GetValue("tw_restore_password", Password);
+		if (!Password.empty())
+			tar.setpassword(Password);
 #endif
-	part_settings->progress->SetPartitionSize(Get_Restore_Size(part_settings));
-	if (tar.extractTarFork() != 0)
-		ret = false;
-	else
-		ret = true;
+		unsigned long long restore_size = Get_Restore_Size(part_settings, chain[i]);
+		if (Restore_File_Count > 0) {
+			// extractTarFork sets the size together with the file count
+			tar.setsize(restore_size);
+			tar.restore_file_count = Restore_File_Count;
+		} else {
+			part_settings->progress->SetPartitionSize(restore_size);
+		}
+		if (tar.extractTarFork() != 0)
+			ret = false;
+	}
 #ifdef HAVE_CAPABILITIES
 	// Restore capabilities to the run-as binary
 	if (Mount_Point == "/system" && Mount(true) && TWFunc::Path_Exists("/system/bin/run-as")) {
@@ -2648,6 +3213,22 @@ bool TWPartition::Restore_Tar(PartitionSettings *part_settings) {
 	return ret;
 }
 
+bool TWPartition::Restore_Used_Blocks(PartitionSettings *part_settings) {
+	string Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
+
+	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Backup_Display_Name, gui_parse_text("{@restoring_hdr}"));
+	gui_msg(Msg("restoring=Restoring {1}...")(Backup_Display_Name));
+
+	// The image brings its own file system, nothing of the old one is kept
+	if (!UnMount(true))
+		return false;
+	part_settings->total_restore_size = twrpChunkStore::Get_Size(Full_FileName);
+	if (!Raw_Read_Write(part_settings))
+		return false;
+	Check_FS_Type();
+	return Mount(true);
+}
+
 bool TWPartition::Restore_Image(PartitionSettings *part_settings) {
 	string Full_FileName;
 	string Restore_File_System = Get_Restore_File_System(part_settings);
@@ -2656,13 +3237,18 @@ bool TWPartition::Restore_Image(PartitionSettings *part_settings) {
 	gui_msg(Msg("restoring=Restoring {1}...")(Backup_Display_Name));
 
 	if (part_settings->adbbackup)
-		Full_FileName = TW_ADB_RESTORE;
+		Full_FileName = twadbbu::Stream_Fifo(TW_ADB_RESTORE, part_settings->adb_stream);
 	else
 		Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
 
+	if (part_settings->verify_digest && !part_settings->adbbackup && Restore_File_System != "emmc") {
+		// Only raw copies are hashed while they are written, check these images first
+		if (!twrpDigestDriver::Check_Digest(Full_FileName))
+			return false;
+	}
 	if (Restore_File_System == "emmc") {
 		if (!part_settings->adbbackup)
-			part_settings->total_restore_size = (uint64_t)(TWFunc::Get_File_Size(Full_FileName));
+			part_settings->total_restore_size = (uint64_t)(twrpChunkStore::Get_Size(Full_FileName));
 		if (!Raw_Read_Write(part_settings))
 			return false;
 	} else if (Restore_File_System == "mtd" || Restore_File_System == "bml") {
@@ -2671,13 +3257,33 @@ bool TWPartition::Restore_Image(PartitionSettings *part_settings) {
 	}
 
 	if (part_settings->adbbackup) {
-		if (!twadbbu::Write_TWEOF())
+		if (!twadbbu::Write_TWEOF(part_settings->adb_stream))
 			return false;
 	}
 	return true;
 }
 
-bool TWPartition::Update_Size(bool Display_Error) {
+uint64_t TWPartition::Get_Data_Media_Size() {
+	std::map<string, uint64_t> subfolder_sizes;
+	uint64_t size;
+
+	if (Media_Index == NULL)
+		Media_Index = new twrpMediaIndex(&backup_exclusions);
+	if (!Media_Index->Get_Size(Mount_Point, &size, &subfolder_sizes))
+		return backup_exclusions.Get_Folder_Size(Mount_Point);
+	// createTarFork sizes the folders of the backup from these
+	backup_exclusions.Set_Folder_Sizes(Mount_Point, size, subfolder_sizes);
+	return size;
+}
+
+bool TWPartition::Update_Size(bool Display_Error, bool Defer_Data_Media) {
+	bool ret = Read_Size(Display_Error, Defer_Data_Media);
+
+	PartitionManager.State_Changed();
+	return ret;
+}
+
+bool TWPartition::Read_Size(bool Display_Error, bool Defer_Data_Media) {
 	bool ret = false, Was_Already_Mounted = false;
 
 	Find_Actual_Block_Device();
@@ -2707,9 +3313,12 @@ bool TWPartition::Update_Size(bool Display_Error) {
 		}
 	}
 
-	if (Has_Data_Media) {
+	if (Has_Data_Media && Defer_Data_Media) {
+		// Use the file system's figure until the folder walk is done
+		Backup_Size = Used;
+	} else if (Has_Data_Media) {
 		if (Mount(Display_Error)) {
-			Used = backup_exclusions.Get_Folder_Size(Mount_Point);
+			Used = Get_Data_Media_Size();
 			Backup_Size = Used;
 			int bak = (int)(Used / 1048576LLU);
 			int fre = (int)(Free / 1048576LLU);
@@ -2830,6 +3439,48 @@ void TWPartition::Find_Actual_Block_Device(void) {
 	}
 }
 
+void TWPartition::Save_Slot_Details(int Slot) {
+	Slot_Details& Details = Slot_Cache[Slot];
+
+	Details.Valid = true;
+	Details.Is_Present = Is_Present;
+	Details.Actual_Block_Device = Actual_Block_Device;
+	Details.Current_File_System = Current_File_System;
+	Details.Size = Size;
+	Details.Used = Used;
+	Details.Free = Free;
+	Details.Backup_Size = Backup_Size;
+}
+
+void TWPartition::Switch_Slot(int Old_Slot, int New_Slot) {
+	bool Was_Mounted = Can_Be_Mounted && Is_Mounted();
+
+	Save_Slot_Details(Old_Slot);
+	if (Was_Mounted && !UnMount(true))
+		return;
+
+	const Slot_Details& Details = Slot_Cache[New_Slot];
+	if (!Details.Valid) {
+		// Update_Size resolves the new slot's device through Find_Actual_Block_Device
+		Update_Size(false);
+	} else {
+		Is_Present = Details.Is_Present;
+		Actual_Block_Device = Details.Actual_Block_Device;
+		Current_File_System = Details.Current_File_System;
+		Size = Details.Size;
+		Used = Details.Used;
+		Free = Details.Free;
+		Backup_Size = Details.Backup_Size;
+		if (Is_Present) {
+			unlink(Primary_Block_Device.c_str());
+			symlink(Actual_Block_Device.c_str(), Primary_Block_Device.c_str());
+		}
+		PartitionManager.State_Changed();
+	}
+	if (Was_Mounted)
+		Mount(true);
+}
+
 void TWPartition::Recreate_Media_Folder(void) {
 	string Command;
 	string Media_Path = Mount_Point + "/media";
@@ -2928,11 +3579,6 @@ bool TWPartition::Flash_Image(PartitionSettings *part_settings) {
 			return false;
 		}
 		if (Backup_Method == BM_DD) {
-			if (!part_settings->adbbackup) {
-				if (Is_Sparse_Image(full_filename)) {
-					return Flash_Sparse_Image(full_filename);
-				}
-			}
 			return Raw_Read_Write(part_settings);
 		} else if (Backup_Method == BM_FLASH_UTILS) {
 			return Flash_Image_FI(full_filename, NULL);
@@ -2962,17 +3608,6 @@ bool TWPartition::Is_Sparse_Image(const string& Filename) {
 	return false;
 }
 
-bool TWPartition::Flash_Sparse_Image(const string& Filename) {
-	string Command;
-
-	gui_msg(Msg("flashing=Flashing {1}...")(Display_Name));
-
-	Command = "simg2img '" + Filename + "' '" + Actual_Block_Device + "'";
-	LOGINFO("Flash command: '%s'\n", Command.c_str());
-	TWFunc::Exec_Cmd(Command);
-	return true;
-}
-
 bool TWPartition::Flash_Image_FI(const string& Filename, ProgressTracking *progress) {
 	string Command;
 	unsigned long long file_size;
@@ -3103,6 +3738,7 @@ int TWPartition::Decrypt_Adopted() {
 			Decrypted_Block_Device = crypto_blkdev;
 			Is_Decrypted = true;
 			Is_Encrypted = true;
+			Invalidate_FS_Types();
 			Find_Actual_Block_Device();
 			if (!Mount_Storage_Retry(false)) {
 				LOGERR("Failed to mount decrypted adopted storage device\n");
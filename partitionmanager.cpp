@@ -19,7 +19,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/vfs.h>
 #include <unistd.h>
 #include <map>
@@ -31,7 +33,9 @@
 #include <zlib.h>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 #include <sys/wait.h>
+#include <pthread.h>
 #include <linux/fs.h>
 #include <sys/mount.h>
 
@@ -47,13 +51,25 @@
 #include "twrp-functions.hpp"
 #include "fixContexts.hpp"
 #include "exclude.hpp"
+#include "twrpManifest.hpp"
+#include "twrpTar.hpp"
 #include "set_metadata.h"
 #include "tw_atomic.hpp"
 #include "gui/gui.hpp"
 #include "progresstracking.hpp"
 #include "twrpDigestDriver.hpp"
+#include "twrpBackupCatalog.hpp"
+#include "twrpBackupMeta.hpp"
+#include "twrpTrace.hpp"
+#include "twrpMemory.hpp"
+#include "twrpPerf.hpp"
+#include "twrpLog.hpp"
 #include "adbbu/libtwadbbu.hpp"
 
+#ifdef TW_USB_STORAGE_FFS
+#include "twrpUsbDisk.hpp"
+#endif
+
 #ifdef TW_HAS_MTP
 #include "mtp/mtp_MtpServer.hpp"
 #include "mtp/twrpMtp.hpp"
@@ -84,9 +100,83 @@ extern "C" {
 
 extern bool datamedia;
 
+// Partitions backed up on their own thread: the images of a normal backup,
+// which overlap with the file systems, or those on a second adb stream
+struct Adb_Backup_Stream {
+	TWPartitionManager *manager;
+	PartitionSettings part_settings;
+	std::vector<TWPartition*> parts;
+	pthread_t thread;
+	bool running;
+	bool ret;
+};
+
+#define UPDATE_SIZE_MAX_THREADS 8
+
+// Partitions whose sizes are updated together on one thread, because they
+// mount on or bind into the same top level folder or share a block device
+struct Update_Size_Group {
+	std::vector<TWPartition*> parts;
+};
+
+struct Update_Size_Work {
+	std::vector<Update_Size_Group> groups;
+	size_t next;                                                              // next group to be taken by a thread
+	bool defer_data_media;
+	pthread_mutex_t lock;
+};
+
+// Returns the first component of a path, e.g. /data for /data/media/0
+static string Top_Folder(const string& Path) {
+	if (Path.empty() || Path[0] != '/')
+		return "";
+	size_t slash = Path.find('/', 1);
+	return slash == string::npos ? Path : Path.substr(0, slash);
+}
+
+// Flash storage queues commands, a second format or rm -rf on a device keeps
+// it busy while the other one writes its metadata or waits on the CPU. More
+// than that only share the same bandwidth.
+#define WIPE_JOBS_PER_DISK 2
+
+// Readers of a card or USB drive only share its bandwidth, and more of them make it seek
+#define VERIFY_MAX_THREADS 8
+#define VERIFY_REMOVABLE_THREADS 2
+
+struct Wipe_Job {
+	TWPartitionManager *manager;
+	Wipe_Kind kind;
+	TWPartition* part;                                                        // NULL for the wipes of several partitions
+	string path;
+	string name;                                                              // Shown in the progress
+	std::set<string> resources;                                               // Top folders and block devices it changes, jobs sharing one run in list order
+	string disk;                                                              // Physical device, at most WIPE_JOBS_PER_DISK run on one
+	pthread_t thread;
+	bool started;
+	bool done;
+	bool ret;
+	bool reported;                                                            // Its progress was shown
+	pthread_mutex_t *lock;
+	pthread_cond_t *cond;
+};
+
+static size_t Find_Group(std::vector<size_t>& parent, size_t i) {
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
 TWPartitionManager::TWPartitionManager(void) {
 	mtp_was_enabled = false;
 	mtp_write_fd = -1;
+	data_media_size_running = false;
+	mountinfo_fd = -1;
+	state_version = 0;
+	pthread_mutex_init(&mount_table_lock, NULL);
+	pthread_mutex_init(&index_lock, NULL);
+	pthread_mutex_init(&backup_timings_lock, NULL);
 	uevent_pfd.fd = -1;
 	stop_backup.set_value(0);
 #ifdef AB_OTA_UPDATER
@@ -102,7 +192,7 @@ TWPartitionManager::TWPartitionManager(void) {
 #endif
 }
 
-int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error) {
+int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error, bool Update_Details) {
 	FILE *fstabFile;
 	char fstab_line[MAX_FSTAB_LINE_LENGTH];
 	TWPartition* settings_partition = NULL;
@@ -305,12 +395,14 @@ int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error)
 		Decrypt_Adopted();
 	}
 #endif
-	Update_System_Details();
+	if (Update_Details)
+		Update_System_Details(true);
 	UnMount_Main_Partitions();
 #ifdef AB_OTA_UPDATER
 	DataManager::SetValue("tw_active_slot", Get_Active_Slot_Display());
 #endif
 	setup_uevent();
+	State_Changed();
 	return true;
 }
 
@@ -523,6 +615,105 @@ int TWPartitionManager::UnMount_By_Path(string Path, bool Display_Error) {
 	return false;
 }
 
+// Mount points in mountinfo escape space, tab, newline and backslash as \ooo
+static string Unescape_Mount_Path(const char* start, size_t len) {
+	string path;
+	path.reserve(len);
+	for (size_t i = 0; i < len; i++) {
+		if (start[i] == '\\' && i + 3 < len && isdigit(start[i + 1]) && isdigit(start[i + 2]) && isdigit(start[i + 3])) {
+			path += (char)((start[i + 1] - '0') * 64 + (start[i + 2] - '0') * 8 + (start[i + 3] - '0'));
+			i += 3;
+		} else {
+			path += start[i];
+		}
+	}
+	return path;
+}
+
+bool TWPartitionManager::Read_Mount_Table(void) {
+	string contents;
+	char buf[4096];
+	ssize_t len;
+
+	if (lseek(mountinfo_fd, 0, SEEK_SET) != 0)
+		return false;
+	while ((len = read(mountinfo_fd, buf, sizeof(buf))) > 0)
+		contents.append(buf, len);
+	if (len < 0)
+		return false;
+
+	// Each line is: id parent major:minor root mount_point options ...
+	mount_points.clear();
+	size_t pos = 0;
+	while (pos < contents.size()) {
+		size_t eol = contents.find('\n', pos);
+		if (eol == string::npos)
+			eol = contents.size();
+		size_t field = pos;
+		for (int i = 0; i < 4 && field < eol; i++) {
+			field = contents.find(' ', field);
+			if (field == string::npos || field >= eol)
+				break;
+			field++;
+		}
+		if (field != string::npos && field < eol) {
+			size_t end = contents.find(' ', field);
+			if (end == string::npos || end > eol)
+				end = eol;
+			mount_points.insert(Unescape_Mount_Path(contents.c_str() + field, end - field));
+		}
+		pos = eol + 1;
+	}
+	State_Changed();
+	return true;
+}
+
+bool TWPartitionManager::Refresh_Mount_Table(void) {
+	if (mountinfo_fd < 0) {
+		mountinfo_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+		if (mountinfo_fd < 0 || !Read_Mount_Table()) {
+			LOGINFO("Unable to read /proc/self/mountinfo: %s\n", strerror(errno));
+			if (mountinfo_fd >= 0)
+				close(mountinfo_fd);
+			mountinfo_fd = -1;
+			return false;
+		}
+	} else {
+		// The kernel flags the file with POLLPRI | POLLERR after any mount
+		// or unmount, the table is only parsed again then
+		struct pollfd pfd;
+		pfd.fd = mountinfo_fd;
+		pfd.events = POLLPRI;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR)))
+			Read_Mount_Table();
+	}
+	return true;
+}
+
+bool TWPartitionManager::Is_Mount_Point(const string& Path) {
+	bool ret;
+
+	pthread_mutex_lock(&mount_table_lock);
+	ret = Refresh_Mount_Table() && mount_points.find(Path) != mount_points.end();
+	pthread_mutex_unlock(&mount_table_lock);
+	return ret;
+}
+
+// Views that keep partition details, like the partition lists of the GUI,
+// compare this with the version they were built at instead of asking every
+// partition again on each frame
+unsigned int TWPartitionManager::State_Version(void) {
+	pthread_mutex_lock(&mount_table_lock);
+	Refresh_Mount_Table();
+	pthread_mutex_unlock(&mount_table_lock);
+	return __atomic_load_n(&state_version, __ATOMIC_ACQUIRE);
+}
+
+void TWPartitionManager::State_Changed(void) {
+	__atomic_add_fetch(&state_version, 1, __ATOMIC_RELEASE);
+}
+
 int TWPartitionManager::Is_Mounted_By_Path(string Path) {
 	TWPartition* Part = Find_Partition_By_Path(Path);
 
@@ -549,23 +740,102 @@ int TWPartitionManager::Mount_Settings_Storage(bool Display_Error) {
 	return Mount_By_Path(DataManager::GetSettingsStoragePath(), Display_Error);
 }
 
-TWPartition* TWPartitionManager::Find_Partition_By_Path(const string& Path) {
+static uint32_t Partition_Key_Hash(const char* data, size_t len) {
+	uint32_t hash = 2166136261U; // FNV-1a
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static uint32_t Partition_Key_Hash(const string& key) {
+	return Partition_Key_Hash(key.c_str(), key.size());
+}
+
+static bool Key_Equals(const string& key, const char* data, size_t len) {
+	return !key.empty() && key.size() == len && key.compare(0, len, data, len) == 0;
+}
+
+// The keys of a partition can change after it was indexed (the actual
+// block device, the MTP id, the symlink mount point), so every hit is
+// checked and a miss falls back to a scan that refreshes the index.
+void TWPartitionManager::Rebuild_Partition_Index(void) {
 	std::vector<TWPartition*>::iterator iter;
-	string Local_Path = TWFunc::Get_Root_Path(Path);
+
+	pthread_mutex_lock(&index_lock);
+	path_index.clear();
+	block_device_index.clear();
+	mtp_index.clear();
+	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+		TWPartition* Part = *iter;
+		path_index.insert(std::make_pair(Partition_Key_Hash(Part->Mount_Point), Part));
+		if (!Part->Symlink_Mount_Point.empty())
+			path_index.insert(std::make_pair(Partition_Key_Hash(Part->Symlink_Mount_Point), Part));
+		block_device_index.insert(std::make_pair(Partition_Key_Hash(Part->Primary_Block_Device), Part));
+		if (!Part->Actual_Block_Device.empty() && Part->Actual_Block_Device != Part->Primary_Block_Device)
+			block_device_index.insert(std::make_pair(Partition_Key_Hash(Part->Actual_Block_Device), Part));
+		if (Part->MTP_Storage_ID != 0 && mtp_index.find(Part->MTP_Storage_ID) == mtp_index.end())
+			mtp_index[Part->MTP_Storage_ID] = Part;
+	}
+	pthread_mutex_unlock(&index_lock);
+}
+
+TWPartition* TWPartitionManager::Find_Partition_By_Root(const char* Root, size_t Root_Len) {
+	std::vector<TWPartition*>::iterator iter;
+	TWPartition* found = NULL;
+
+	pthread_mutex_lock(&index_lock);
+	std::pair<std::unordered_multimap<uint32_t, TWPartition*>::iterator, std::unordered_multimap<uint32_t, TWPartition*>::iterator> range = path_index.equal_range(Partition_Key_Hash(Root, Root_Len));
+	for (std::unordered_multimap<uint32_t, TWPartition*>::iterator it = range.first; it != range.second; it++) {
+		// The index is in no particular order, the first match in Partitions wins
+		if ((Key_Equals(it->second->Mount_Point, Root, Root_Len) || Key_Equals(it->second->Symlink_Mount_Point, Root, Root_Len))
+				&& (found == NULL || std::find(Partitions.begin(), Partitions.end(), it->second) < std::find(Partitions.begin(), Partitions.end(), found)))
+			found = it->second;
+	}
+	pthread_mutex_unlock(&index_lock);
+	if (found)
+		return found;
 
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
-		if ((*iter)->Mount_Point == Local_Path || (!(*iter)->Symlink_Mount_Point.empty() && (*iter)->Symlink_Mount_Point == Local_Path))
+		if (Key_Equals((*iter)->Mount_Point, Root, Root_Len) || Key_Equals((*iter)->Symlink_Mount_Point, Root, Root_Len)) {
+			Rebuild_Partition_Index();
 			return (*iter);
+		}
 	}
 	return NULL;
 }
 
+TWPartition* TWPartitionManager::Find_Partition_By_Path(const string& Path) {
+	if (Path.empty() || Path[0] != '/') {
+		string Local_Path = TWFunc::Get_Root_Path(Path);
+		return Find_Partition_By_Root(Local_Path.c_str(), Local_Path.size());
+	}
+	// Same as Get_Root_Path: everything up to the second slash
+	size_t position = Path.size() > 2 ? Path.find('/', 2) : string::npos;
+	return Find_Partition_By_Root(Path.c_str(), position == string::npos ? Path.size() : position);
+}
+
 TWPartition* TWPartitionManager::Find_Partition_By_Block_Device(const string& Block_Device) {
 	std::vector<TWPartition*>::iterator iter;
+	TWPartition* found = NULL;
+
+	pthread_mutex_lock(&index_lock);
+	std::pair<std::unordered_multimap<uint32_t, TWPartition*>::iterator, std::unordered_multimap<uint32_t, TWPartition*>::iterator> range = block_device_index.equal_range(Partition_Key_Hash(Block_Device));
+	for (std::unordered_multimap<uint32_t, TWPartition*>::iterator it = range.first; it != range.second; it++) {
+		if ((it->second->Primary_Block_Device == Block_Device || (!it->second->Actual_Block_Device.empty() && it->second->Actual_Block_Device == Block_Device))
+				&& (found == NULL || std::find(Partitions.begin(), Partitions.end(), it->second) < std::find(Partitions.begin(), Partitions.end(), found)))
+			found = it->second;
+	}
+	pthread_mutex_unlock(&index_lock);
+	if (found)
+		return found;
 
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
-		if ((*iter)->Primary_Block_Device == Block_Device || (!(*iter)->Actual_Block_Device.empty() && (*iter)->Actual_Block_Device == Block_Device))
+		if ((*iter)->Primary_Block_Device == Block_Device || (!(*iter)->Actual_Block_Device.empty() && (*iter)->Actual_Block_Device == Block_Device)) {
+			Rebuild_Partition_Index();
 			return (*iter);
+		}
 	}
 	return NULL;
 }
@@ -622,8 +892,212 @@ int TWPartitionManager::Check_Backup_Name(bool Display_Error) {
 	return 0;
 }
 
+string TWPartitionManager::Backup_Rate_Key(TWPartition* Part) {
+	string device = Part->Actual_Block_Device;
+	if (device.empty())
+		device = Part->Primary_Block_Device;
+	device = device.empty() ? Part->Backup_Name : TWFunc::Get_Filename(device);
+
+	string type = "img";
+	if (Part->Backup_Method == BM_FILES) {
+		int use_compression = 0;
+		DataManager::GetValue(TW_USE_COMPRESSION_VAR, use_compression);
+		type = use_compression ? "tgz" : "tar";
+	}
+	return "tw_backup_rate_" + device + "_" + type;
+}
+
+void TWPartitionManager::Record_Backup_Timing(TWPartition* Part, double backup_seconds, double digest_seconds) {
+	Backup_Timing timing;
+
+	timing.Backup_Name = Part->Backup_Name;
+	timing.Block_Device = Part->Actual_Block_Device;
+	timing.Rate_Key = Backup_Rate_Key(Part);
+	timing.bytes = Part->Backup_Size;
+	timing.backup_seconds = backup_seconds;
+	timing.digest_seconds = digest_seconds;
+	LOGINFO("%s: backup %.2fs, digest %.2fs\n", Part->Backup_Name.c_str(), backup_seconds, digest_seconds);
+
+	pthread_mutex_lock(&backup_timings_lock);
+	backup_timings.push_back(timing);
+	pthread_mutex_unlock(&backup_timings_lock);
+}
+
+void TWPartitionManager::Write_Backup_Timings(const string& Backup_Folder) {
+	string report = Backup_Folder + "/backup_timings.json";
+	FILE* out = NULL;
+
+	if (!Backup_Folder.empty()) {
+		out = fopen(report.c_str(), "w");
+		if (!out)
+			LOGINFO("Unable to write '%s': %s\n", report.c_str(), strerror(errno));
+	}
+	if (out)
+		fprintf(out, "{\n\t\"partitions\": [");
+
+	pthread_mutex_lock(&backup_timings_lock);
+	for (size_t i = 0; i < backup_timings.size(); i++) {
+		Backup_Timing& timing = backup_timings[i];
+		unsigned long long rate = 0;
+
+		// Tiny partitions finish within the clock's resolution and say
+		// nothing about the device, so only time a second or more counts
+		if (timing.backup_seconds >= 1) {
+			unsigned long long measured = (unsigned long long)(timing.bytes / timing.backup_seconds);
+			DataManager::GetValue(timing.Rate_Key, rate);
+			if (rate == 0)
+				rate = measured;
+			else
+				rate = (measured + rate * 4) / 5;
+			DataManager::SetValue(timing.Rate_Key, rate, 1);
+		}
+
+		if (out) {
+			fprintf(out, "%s\n\t\t{\"name\": \"%s\", \"block_device\": \"%s\", \"model\": \"%s\", \"bytes\": %llu, \"backup_seconds\": %.3f, \"digest_seconds\": %.3f, \"bytes_per_second\": %llu}",
+				i ? "," : "", timing.Backup_Name.c_str(), timing.Block_Device.c_str(), timing.Rate_Key.c_str(), (unsigned long long)timing.bytes,
+				timing.backup_seconds, timing.digest_seconds,
+				timing.backup_seconds > 0 ? (unsigned long long)(timing.bytes / timing.backup_seconds) : 0ULL);
+		}
+	}
+	backup_timings.clear();
+	pthread_mutex_unlock(&backup_timings_lock);
+
+	if (out) {
+		fprintf(out, "\n\t]\n}\n");
+		fclose(out);
+		tw_set_default_metadata(report.c_str());
+	}
+}
+
+Backup_Plan::Backup_Plan() {
+	file_bytes = 0;
+	img_bytes = 0;
+	free_space = 0;
+	main_seconds = 0;
+	image_seconds = 0;
+	time_known = true;
+	fits = true;
+}
+
+Backup_Plan::~Backup_Plan() {
+	for (size_t i = 0; i < items.size(); i++)
+		delete items[i].tar;
+}
+
+twrpTar* Backup_Plan::Take_Tar(TWPartition* Part) {
+	for (size_t i = 0; i < items.size(); i++) {
+		if (items[i].Part == Part) {
+			twrpTar* tar = items[i].tar;
+			items[i].tar = NULL;
+			return tar;
+		}
+	}
+	return NULL;
+}
+
+void TWPartitionManager::Add_Plan_Item(TWPartition* Part, PartitionSettings *part_settings, bool image_stream, Backup_Plan *plan) {
+	Backup_Plan_Item item;
+	unsigned long long rate = 0;
+
+	item.Part = Part;
+	item.image_stream = image_stream;
+	item.bytes = Part->Backup_Size;
+	item.file_count = 0;
+	item.threads = 1;
+	item.archives = 1;
+	item.codec = "raw";
+	item.tar = NULL;
+	// Used blocks are copied like an image, there are no files to list
+	if (Part->Backup_Method == BM_FILES && !Part->Can_Backup_Used_Blocks(part_settings)) {
+		item.tar = Part->Plan_Backup_Tar(part_settings);
+		item.threads = 0;
+		item.archives = 0;
+		if (item.tar != NULL) {
+			item.codec = item.tar->Codec_Name();
+			if (item.tar->Is_Planned()) {
+				item.bytes = item.tar->Planned_Size();
+				item.file_count = item.tar->Planned_Files();
+				item.threads = item.tar->Planned_Threads();
+				item.archives = item.tar->Planned_Archives();
+			}
+		}
+		plan->file_bytes += item.bytes;
+	} else {
+		plan->img_bytes += item.bytes;
+	}
+
+	DataManager::GetValue(Backup_Rate_Key(Part), rate);
+	item.seconds = rate ? (double)item.bytes / (double)rate : 0;
+	if (rate == 0)
+		plan->time_known = false;
+	else if (image_stream)
+		plan->image_seconds += item.seconds;
+	else
+		plan->main_seconds += item.seconds;
+	plan->items.push_back(item);
+}
+
+// The listing and sizing pass of a backup. File systems that can be are
+// listed here, and their tar takes the list into its fork instead of walking
+// the file system a second time.
+bool TWPartitionManager::Plan_Backup(const string& Backup_List, PartitionSettings *part_settings, bool image_thread, Backup_Plan *plan) {
+	size_t start_pos = 0, end_pos = Backup_List.find(";");
+
+	while (end_pos != string::npos && start_pos < Backup_List.size()) {
+		string backup_path = Backup_List.substr(start_pos, end_pos - start_pos);
+		TWPartition* Part = Find_Partition_By_Path(backup_path);
+		if (Part != NULL) {
+			// Subpartitions are backed up right after their parent on the same thread
+			bool image_stream = image_thread && Part->Backup_Method == BM_DD;
+			Add_Plan_Item(Part, part_settings, image_stream, plan);
+			if (Part->Has_SubPartition) {
+				std::vector<TWPartition*>::iterator subpart;
+
+				for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
+					if ((*subpart)->Can_Be_Backed_Up && (*subpart)->Is_Present && (*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == Part->Mount_Point)
+						Add_Plan_Item(*subpart, part_settings, image_stream, plan);
+				}
+			}
+		} else {
+			gui_msg(Msg(msg::kError, "unable_to_locate_partition=Unable to locate '{1}' partition for backup calculations.")(backup_path));
+		}
+		start_pos = end_pos + 1;
+		end_pos = Backup_List.find(";", start_pos);
+	}
+	return !plan->items.empty();
+}
+
+bool TWPartitionManager::Write_Backup_Plan(const Backup_Plan& plan, const string& Backup_Folder, const string& Plan_File) {
+	FILE* out = fopen(Plan_File.c_str(), "w");
+	if (!out) {
+		LOGINFO("Unable to write '%s': %s\n", Plan_File.c_str(), strerror(errno));
+		return false;
+	}
+
+	fprintf(out, "{\n\t\"backup_folder\": \"%s\",\n\t\"file_bytes\": %llu,\n\t\"img_bytes\": %llu,\n\t\"free_space\": %llu,\n\t\"fits\": %s,\n",
+		Backup_Folder.c_str(), (unsigned long long)plan.file_bytes, (unsigned long long)plan.img_bytes,
+		(unsigned long long)plan.free_space, plan.fits ? "true" : "false");
+	if (plan.time_known)
+		fprintf(out, "\t\"expected_seconds\": {\"main\": %.0f, \"images\": %.0f},\n", plan.main_seconds, plan.image_seconds);
+	else
+		fprintf(out, "\t\"expected_seconds\": null,\n");
+	fprintf(out, "\t\"partitions\": [");
+	for (size_t i = 0; i < plan.items.size(); i++) {
+		const Backup_Plan_Item& item = plan.items[i];
+		fprintf(out, "%s\n\t\t{\"name\": \"%s\", \"method\": \"%s\", \"thread\": \"%s\", \"bytes\": %llu, \"files\": %llu, \"archive_threads\": %u, \"archives\": %u, \"codec\": \"%s\", \"expected_seconds\": %.0f}",
+			i ? "," : "", item.Part->Backup_Name.c_str(), item.Part->Backup_Method == BM_FILES ? "files" : "image",
+			item.image_stream ? "images" : "main", (unsigned long long)item.bytes, (unsigned long long)item.file_count,
+			item.threads, item.archives, item.codec.c_str(), item.seconds);
+	}
+	fprintf(out, "\n\t]\n}\n");
+	fclose(out);
+	return true;
+}
+
 bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 	time_t start, stop;
+	timespec phase_start, phase_stop;
+	double backup_seconds, digest_seconds;
 	int use_compression;
 	string backup_log = part_settings->Backup_Folder + "/recovery.log";
 
@@ -635,14 +1109,26 @@ bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 	TWFunc::SetPerformanceMode(true);
 	time(&start);
 
+	if (part_settings->progress) {
+		unsigned long long rate = 0;
+		DataManager::GetValue(Backup_Rate_Key(part_settings->Part), rate);
+		part_settings->progress->SetPartitionRate(rate);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &phase_start);
 	if (part_settings->Part->Backup(part_settings, &tar_fork_pid)) {
 		sync();
 		sync();
+		clock_gettime(CLOCK_MONOTONIC, &phase_stop);
+		backup_seconds = TWFunc::timespec_diff_ms(phase_start, phase_stop) / 1000.0;
+		phase_start = phase_stop;
 		string Full_Filename = part_settings->Backup_Folder + "/" + part_settings->Part->Backup_FileName;
 		if (!part_settings->adbbackup && part_settings->generate_digest) {
 			if (!twrpDigestDriver::Make_Digest(Full_Filename))
 				goto backup_error;
 		}
+		clock_gettime(CLOCK_MONOTONIC, &phase_stop);
+		digest_seconds = TWFunc::timespec_diff_ms(phase_start, phase_stop) / 1000.0;
+		Record_Backup_Timing(part_settings->Part, backup_seconds, digest_seconds);
 
 		if (part_settings->Part->Has_SubPartition) {
 			std::vector<TWPartition*>::iterator subpart;
@@ -651,16 +1137,28 @@ bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 			for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
 				if ((*subpart)->Can_Be_Backed_Up && (*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == parentPart->Mount_Point) {
 					part_settings->Part = *subpart;
+					if (part_settings->progress) {
+						unsigned long long rate = 0;
+						DataManager::GetValue(Backup_Rate_Key(*subpart), rate);
+						part_settings->progress->SetPartitionRate(rate);
+					}
+					clock_gettime(CLOCK_MONOTONIC, &phase_start);
 					if (!(*subpart)->Backup(part_settings, &tar_fork_pid)) {
 						goto backup_error;
 					}
 					sync();
 					sync();
+					clock_gettime(CLOCK_MONOTONIC, &phase_stop);
+					backup_seconds = TWFunc::timespec_diff_ms(phase_start, phase_stop) / 1000.0;
+					phase_start = phase_stop;
 					if (!part_settings->adbbackup && part_settings->generate_digest) {
 						if (!twrpDigestDriver::Make_Digest(Full_Filename)) {
 							goto backup_error;
 						}
 					}
+					clock_gettime(CLOCK_MONOTONIC, &phase_stop);
+					digest_seconds = TWFunc::timespec_diff_ms(phase_start, phase_stop) / 1000.0;
+					Record_Backup_Timing(*subpart, backup_seconds, digest_seconds);
 				}
 			}
 		}
@@ -681,6 +1179,7 @@ bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 	}
 backup_error:
 	Clean_Backup_Folder(part_settings->Backup_Folder);
+	twrpLog::Flush();
 	TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
 	tw_set_default_metadata(backup_log.c_str());
 	TWFunc::SetPerformanceMode(false);
@@ -700,6 +1199,7 @@ void TWPartitionManager::Clean_Backup_Folder(string Backup_Folder) {
 	ext.push_back("info");
 
 	gui_msg("backup_clean=Backup Failed. Cleaning Backup Folder.");
+	twrpBackupMeta::Discard();
 
 	if (d == NULL) {
 		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Backup_Folder)(strerror(errno)));
@@ -751,9 +1251,41 @@ int TWPartitionManager::Cancel_Backup() {
 	return 0;
 }
 
-int TWPartitionManager::Run_Backup(bool adbbackup) {
+void* TWPartitionManager::Backup_Stream_Thread(void *cookie) {
+	Adb_Backup_Stream *stream = (Adb_Backup_Stream*) cookie;
+
+	stream->ret = true;
+	for (size_t i = 0; i < stream->parts.size() && stream->ret; i++) {
+		if (stream->manager->stop_backup.get_value() != 0) {
+			stream->ret = false;
+			break;
+		}
+		stream->part_settings.Part = stream->parts[i];
+		stream->ret = stream->manager->Backup_Partition(&stream->part_settings);
+	}
+	return NULL;
+}
+
+void* TWPartitionManager::Restore_Stream_Thread(void *cookie) {
+	Adb_Backup_Stream *stream = (Adb_Backup_Stream*) cookie;
+
+	stream->ret = true;
+	for (size_t i = 0; i < stream->parts.size() && stream->ret; i++) {
+		if (stream->manager->stop_backup.get_value() != 0) {
+			stream->ret = false;
+			break;
+		}
+		stream->part_settings.Part = stream->parts[i];
+		stream->ret = stream->manager->Restore_Partition(&stream->part_settings);
+	}
+	return NULL;
+}
+
+int TWPartitionManager::Run_Backup(bool adbbackup, const string& Plan_File) {
 	PartitionSettings part_settings;
-	int partition_count = 0, disable_free_space_check = 0, skip_digest = 0;
+	Backup_Plan plan;
+	Adb_Backup_Stream image_stream;
+	int partition_count = 0, disable_free_space_check = 0, skip_digest = 0, adb_streams = 1, backup_ret = true;
 	string Backup_Name, Backup_List, backup_path;
 	unsigned long long total_bytes = 0, free_space = 0;
 	TWPartition* storage = NULL;
@@ -761,6 +1293,10 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 	struct tm *t;
 	time_t seconds, total_start, total_stop;
 	size_t start_pos = 0, end_pos = 0;
+
+	twrpPerf::Phase("plan");
+	Wait_For_Data_Media_Size();
+
 	stop_backup.set_value(0);
 	seconds = time(0);
 	t = localtime(&seconds);
@@ -774,6 +1310,12 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 	part_settings.PM_Method = PM_BACKUP;
 
 	part_settings.adbbackup = adbbackup;
+	part_settings.use_lz4 = DataManager::GetIntValue(TW_USE_LZ4_VAR) != 0;
+	part_settings.adb_stream = 0;
+	part_settings.adb_resume_offset = 0;
+	part_settings.verify_digest = false;
+	part_settings.plan = &plan;
+	image_stream.running = false;
 	time(&total_start);
 
 	Update_System_Details();
@@ -803,42 +1345,20 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 
 	LOGINFO("Calculating backup details...\n");
 	DataManager::GetValue("tw_backup_list", Backup_List);
-	if (!Backup_List.empty()) {
-		end_pos = Backup_List.find(";", start_pos);
-		while (end_pos != string::npos && start_pos < Backup_List.size()) {
-			backup_path = Backup_List.substr(start_pos, end_pos - start_pos);
-			part_settings.Part = Find_Partition_By_Path(backup_path);
-			if (part_settings.Part != NULL) {
-				partition_count++;
-				if (part_settings.Part->Backup_Method == BM_FILES)
-					part_settings.file_bytes += part_settings.Part->Backup_Size;
-				else
-					part_settings.img_bytes += part_settings.Part->Backup_Size;
-				if (part_settings.Part->Has_SubPartition) {
-					std::vector<TWPartition*>::iterator subpart;
-
-					for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
-						if ((*subpart)->Can_Be_Backed_Up && (*subpart)->Is_Present && (*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == part_settings.Part->Mount_Point) {
-							partition_count++;
-							if ((*subpart)->Backup_Method == BM_FILES)
-								part_settings.file_bytes += (*subpart)->Backup_Size;
-							else
-								part_settings.img_bytes += (*subpart)->Backup_Size;
-						}
-					}
-				}
-			} else {
-				gui_msg(Msg(msg::kError, "unable_to_locate_partition=Unable to locate '{1}' partition for backup calculations.")(backup_path));
-			}
-			start_pos = end_pos + 1;
-			end_pos = Backup_List.find(";", start_pos);
-		}
+	if (adbbackup) {
+		DataManager::GetValue(TW_ADB_BACKUP_STREAMS_VAR, adb_streams);
+		if (adb_streams > ADB_BACKUP_MAX_STREAMS)
+			adb_streams = ADB_BACKUP_MAX_STREAMS;
+		else if (adb_streams < 1)
+			adb_streams = 1;
 	}
-
-	if (partition_count == 0) {
+	if (!Plan_Backup(Backup_List, &part_settings, adb_streams > 1 || !adbbackup, &plan)) {
 		gui_msg("no_partition_selected=No partitions selected for backup.");
 		return false;
 	}
+	partition_count = plan.items.size();
+	part_settings.file_bytes = plan.file_bytes;
+	part_settings.img_bytes = plan.img_bytes;
 	if (adbbackup) {
 		if (twadbbu::Write_ADB_Stream_Header(partition_count) == false) {
 			return false;
@@ -864,12 +1384,19 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 	if (adbbackup)
 		disable_free_space_check = true;
 
-	if (!disable_free_space_check) {
-		if (free_space - (32 * 1024 * 1024) < total_bytes) {
-			// We require an extra 32MB just in case
-			gui_err("no_space=Not enough free space on storage.");
+	// We require an extra 32MB just in case
+	plan.free_space = free_space;
+	plan.fits = disable_free_space_check || free_space - (32 * 1024 * 1024) >= total_bytes;
+	if (!Plan_File.empty()) {
+		// Dry run, nothing is written but the plan
+		if (!Write_Backup_Plan(plan, part_settings.Backup_Folder, Plan_File))
 			return false;
-		}
+		gui_msg(Msg("backup_plan_written=Backup plan written to {1}")(Plan_File));
+		return plan.fits;
+	}
+	if (!plan.fits) {
+		gui_err("no_space=Not enough free space on storage.");
+		return false;
 	}
 	part_settings.img_bytes_remaining = part_settings.img_bytes;
 	part_settings.file_bytes_remaining = part_settings.file_bytes;
@@ -880,19 +1407,78 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		gui_err("fail_backup_folder=Failed to make backup folder.");
 		return false;
 	}
+	if (!adbbackup)
+		twrpBackupMeta::Open(part_settings.Backup_Folder);
 
 	DataManager::SetProgress(0.0);
+	pthread_mutex_lock(&backup_timings_lock);
+	backup_timings.clear();
+	pthread_mutex_unlock(&backup_timings_lock);
+	twrpDigestDriver::Forget_Inline();
+
+	twrpPerf::Phase("backup");
+	uint64_t file_count = 0;
+	for (size_t i = 0; i < plan.items.size(); i++)
+		file_count += plan.items[i].file_count;
+	twrpPerf::Add(total_bytes, file_count);
+	ProgressTracking image_progress(&progress);
+	if (adb_streams > 1 || !adbbackup) {
+		// Images are read from their own block devices while the file
+		// systems are mostly bound by tar's compression and the storage
+		// writes, so the images are backed up on a thread of their own,
+		// one at a time. Over adb they go on stream 1 and the file systems
+		// on stream 0.
+		image_stream.manager = this;
+		image_stream.part_settings = part_settings;
+		if (adbbackup) {
+			image_stream.part_settings.adb_stream = 1;
+			image_stream.part_settings.progress = NULL; // the progress bar follows stream 0
+		} else {
+			image_stream.part_settings.progress = &image_progress;
+		}
+		for (size_t i = 0; i < plan.items.size(); i++) {
+			if (plan.items[i].image_stream && !plan.items[i].Part->Is_SubPartition)
+				image_stream.parts.push_back(plan.items[i].Part);
+		}
+		if (!image_stream.parts.empty()) {
+			LOGINFO("Backing up %zu images on a separate %s\n", image_stream.parts.size(), adbbackup ? "adb stream" : "thread");
+			image_stream.running = (pthread_create(&image_stream.thread, NULL, Backup_Stream_Thread, &image_stream) == 0);
+		}
+	}
+
+	// With a measured rate for every partition, the thread expected to
+	// finish last decides the time remaining shown during the backup
+	double main_time = plan.main_seconds, image_time = plan.image_seconds;
+	bool model_known = plan.time_known;
+	if (!image_stream.running) {
+		main_time += image_time;
+		image_time = 0;
+	}
+	if (model_known) {
+		LOGINFO("Expected backup time: %.0fs file systems, %.0fs images\n", main_time, image_time);
+		progress.SetExpectedTime(main_time);
+		if (image_stream.running && !adbbackup)
+			image_progress.SetExpectedTime(image_time);
+	} else {
+		DataManager::SetValue("tw_time_remaining", "");
+	}
 
 	start_pos = 0;
 	end_pos = Backup_List.find(";", start_pos);
 	while (end_pos != string::npos && start_pos < Backup_List.size()) {
-		if (stop_backup.get_value() != 0)
-			return -1;
+		if (stop_backup.get_value() != 0) {
+			backup_ret = -1;
+			break;
+		}
 		backup_path = Backup_List.substr(start_pos, end_pos - start_pos);
 		part_settings.Part = Find_Partition_By_Path(backup_path);
 		if (part_settings.Part != NULL) {
-			if (!Backup_Partition(&part_settings))
-				return false;
+			if (image_stream.running && part_settings.Part->Backup_Method == BM_DD) {
+				// Sent by the image stream
+			} else if (!Backup_Partition(&part_settings)) {
+				backup_ret = false;
+				break;
+			}
 		} else {
 			gui_msg(Msg(msg::kError, "unable_to_locate_partition=Unable to locate '{1}' partition for backup calculations.")(backup_path));
 		}
@@ -900,6 +1486,21 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		end_pos = Backup_List.find(";", start_pos);
 	}
 
+	if (image_stream.running) {
+		twrpPerf::Phase("images");
+		if (backup_ret == false)
+			stop_backup.set_value(1); // don't leave the images running into a cleaned up backup folder
+		pthread_join(image_stream.thread, NULL);
+		part_settings.img_time += image_stream.part_settings.img_time;
+		if (backup_ret == true && !image_stream.ret)
+			backup_ret = (stop_backup.get_value() != 0 ? -1 : false);
+	}
+	if (backup_ret != true) {
+		twrpBackupMeta::Discard();
+		return backup_ret;
+	}
+	twrpPerf::Phase("finish");
+
 	// Average BPS
 	if (part_settings.img_time == 0)
 		part_settings.img_time = 1;
@@ -944,13 +1545,27 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 	else
 		DataManager::SetValue(TW_BACKUP_AVG_FILE_RATE, file_bps);
 
+	Write_Backup_Timings(adbbackup ? "" : part_settings.Backup_Folder);
+	if (!adbbackup) {
+		twrpBackupCatalog catalog;
+		if (catalog.Create(part_settings.Backup_Folder))
+			catalog.Write(part_settings.Backup_Folder);
+	}
+
 	gui_msg(Msg("total_backed_size=[{1} MB TOTAL BACKED UP]")(actual_backup_size));
 	Update_System_Details();
 	UnMount_Main_Partitions();
 	gui_msg(Msg(msg::kHighlight, "backup_completed=[BACKUP COMPLETED IN {1} SECONDS]")(total_time)); // the end
+	string perf = twrpPerf::Json();
+	if (!perf.empty())
+		twrpBackupMeta::Add(part_settings.Backup_Folder, BACKUP_META_PERF, "backup", perf);
 	string backup_log = part_settings.Backup_Folder + "/recovery.log";
-	TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
-	tw_set_default_metadata(backup_log.c_str());
+	twrpLog::Flush();
+	if (!twrpBackupMeta::Add_File(part_settings.Backup_Folder, BACKUP_META_LOG, "recovery.log", "/tmp/recovery.log")) {
+		TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
+		tw_set_default_metadata(backup_log.c_str());
+	}
+	twrpBackupMeta::Close();
 
 	if (part_settings.adbbackup) {
 		if (twadbbu::Write_ADB_Stream_Trailer() == false) {
@@ -1005,7 +1620,11 @@ bool TWPartitionManager::Restore_Partition(PartitionSettings *part_settings) {
 
 int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 	PartitionSettings part_settings;
-	int check_digest;
+	int check_digest, verify_inline;
+	std::vector<string> digest_files;
+
+	twrpPerf::Phase("plan");
+	Wait_For_Data_Media_Size();
 
 	time_t rStart, rStop;
 	time(&rStart);
@@ -1017,7 +1636,12 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 	part_settings.partition_count = 0;
 	part_settings.total_restore_size = 0;
 	part_settings.adbbackup = false;
+	part_settings.use_lz4 = false;
+	part_settings.adb_stream = 0;
+	part_settings.adb_resume_offset = 0;
+	part_settings.verify_digest = false;
 	part_settings.PM_Method = PM_RESTORE;
+	part_settings.plan = NULL;
 
 	gui_msg("restore_started=[RESTORE STARTED]");
 	gui_msg(Msg("restore_folder=Restore folder: '{1}'")(Restore_Name));
@@ -1026,7 +1650,13 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 		return false;
 
 	DataManager::GetValue(TW_SKIP_DIGEST_CHECK_VAR, check_digest);
-	if (check_digest > 0) {
+	DataManager::GetValue(TW_VERIFY_DIGEST_INLINE_VAR, verify_inline);
+	if (check_digest > 0 && verify_inline > 0) {
+		// Digests are checked as each backup file is read, a mismatch fails the restore of that partition
+		LOGINFO("Verifying digests during restore\n");
+		part_settings.verify_digest = true;
+		check_digest = 0;
+	} else if (check_digest > 0) {
 		// Check Digest files first before restoring to ensure that all of them match before starting a restore
 		TWFunc::GUI_Operation_Text(TW_VERIFY_DIGEST_TEXT, gui_parse_text("{@verifying_digest}"));
 		gui_msg("verifying_digest=Verifying Digest");
@@ -1049,8 +1679,14 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 
 				string Full_Filename = part_settings.Backup_Folder + "/" + part_settings.Part->Backup_FileName;
 
-				if (check_digest > 0 && !twrpDigestDriver::Check_Digest(Full_Filename))
-					return false;
+				if (check_digest > 0) {
+					// Incremental backups also need the archives of the backups they are based on
+					std::vector<string> chain;
+					if (!twrpManifest::Get_Restore_Chain(part_settings.Backup_Folder, part_settings.Part->Backup_FileName, &chain))
+						return false;
+					for (size_t i = 0; i < chain.size(); i++)
+						digest_files.push_back(chain[i] + "/" + part_settings.Part->Backup_FileName);
+				}
 				part_settings.partition_count++;
 				part_settings.total_restore_size += part_settings.Part->Get_Restore_Size(&part_settings);
 				if (part_settings.Part->Has_SubPartition) {
@@ -1060,8 +1696,8 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 					for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
 						part_settings.Part = *subpart;
 						if ((*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == parentPart->Mount_Point) {
-							if (check_digest > 0 && !twrpDigestDriver::Check_Digest(Full_Filename))
-								return false;
+							if (check_digest > 0)
+								digest_files.push_back(Full_Filename);
 							part_settings.total_restore_size += (*subpart)->Get_Restore_Size(&part_settings);
 						}
 					}
@@ -1079,30 +1715,93 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 		return false;
 	}
 
+	// All backup files are verified together so the archives can be hashed in parallel
+	if (check_digest > 0) {
+		twrpPerf::Phase("verify");
+		if (!twrpDigestDriver::Check_Digests(digest_files))
+			return false;
+	}
+
 	gui_msg(Msg("restore_part_count=Restoring {1} partitions...")(part_settings.partition_count));
 	gui_msg(Msg("total_restore_size=Total restore size is {1}MB")(part_settings.total_restore_size / 1048576));
 	DataManager::SetProgress(0.0);
 	ProgressTracking progress(part_settings.total_restore_size);
 	part_settings.progress = &progress;
+	stop_backup.set_value(0);
 
+	twrpPerf::Phase("restore");
+	twrpPerf::Add(part_settings.total_restore_size, 0);
+	std::vector<TWPartition*> restore_parts;
 	start_pos = 0;
 	if (!Restore_List.empty()) {
 		end_pos = Restore_List.find(";", start_pos);
 		while (end_pos != string::npos && start_pos < Restore_List.size()) {
 			restore_path = Restore_List.substr(start_pos, end_pos - start_pos);
-
-			part_settings.Part = Find_Partition_By_Path(restore_path);
-			if (part_settings.Part != NULL) {
-				part_settings.partition_count++;
-				if (!Restore_Partition(&part_settings))
-					return false;
-			} else {
+			TWPartition* Part = Find_Partition_By_Path(restore_path);
+			if (Part != NULL)
+				restore_parts.push_back(Part);
+			else
 				gui_msg(Msg(msg::kError, "restore_unable_locate=Unable to locate '{1}' partition for restoring.")(restore_path));
-			}
 			start_pos = end_pos + 1;
 			end_pos = Restore_List.find(";", start_pos);
 		}
 	}
+
+	// Images are written to their own block devices while the file systems
+	// are mostly bound by decompression, so the images are restored on a
+	// thread of their own, one at a time. An image sharing a block device
+	// with a file system in this restore stays in order on this thread.
+	Adb_Backup_Stream image_stream;
+	ProgressTracking image_progress(&progress);
+	std::set<string> file_system_devices;
+	std::vector<TWPartition*>::iterator iter;
+	image_stream.running = false;
+	image_stream.manager = this;
+	image_stream.part_settings = part_settings;
+	image_stream.part_settings.progress = &image_progress;
+	for (iter = restore_parts.begin(); iter != restore_parts.end(); iter++) {
+		if (!(*iter)->Is_Image((*iter)->Get_Restore_File_System(&part_settings)) || (*iter)->Has_SubPartition) {
+			if (!(*iter)->Primary_Block_Device.empty())
+				file_system_devices.insert((*iter)->Primary_Block_Device);
+			if (!(*iter)->Actual_Block_Device.empty())
+				file_system_devices.insert((*iter)->Actual_Block_Device);
+		}
+	}
+	if (restore_parts.size() > 1) {
+		for (iter = restore_parts.begin(); iter != restore_parts.end(); iter++) {
+			if ((*iter)->Is_Image((*iter)->Get_Restore_File_System(&part_settings)) && !(*iter)->Has_SubPartition
+					&& file_system_devices.count((*iter)->Primary_Block_Device) == 0 && file_system_devices.count((*iter)->Actual_Block_Device) == 0)
+				image_stream.parts.push_back(*iter);
+		}
+	}
+	if (!image_stream.parts.empty()) {
+		LOGINFO("Restoring %zu images on a separate thread\n", image_stream.parts.size());
+		image_stream.running = (pthread_create(&image_stream.thread, NULL, Restore_Stream_Thread, &image_stream) == 0);
+	}
+
+	bool restore_ret = true;
+	for (iter = restore_parts.begin(); iter != restore_parts.end(); iter++) {
+		if (image_stream.running && std::find(image_stream.parts.begin(), image_stream.parts.end(), *iter) != image_stream.parts.end())
+			continue; // restored by the image thread
+		part_settings.Part = *iter;
+		part_settings.partition_count++;
+		if (!Restore_Partition(&part_settings)) {
+			restore_ret = false;
+			break;
+		}
+	}
+	if (image_stream.running) {
+		twrpPerf::Phase("images");
+		if (!restore_ret)
+			stop_backup.set_value(1); // stop the images too
+		pthread_join(image_stream.thread, NULL);
+		stop_backup.set_value(0);
+		if (!image_stream.ret)
+			restore_ret = false;
+	}
+	if (!restore_ret)
+		return false;
+	twrpPerf::Phase("finish");
 	TWFunc::GUI_Operation_Text(TW_UPDATE_SYSTEM_DETAILS_TEXT, gui_parse_text("{@updating_system_details}"));
 	UnMount_By_Path("/system", false);
 	Update_System_Details();
@@ -1114,11 +1813,134 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 	return true;
 }
 
+// Files of a backup folder that have a digest, the digest files themselves have none
+static void Find_Verify_Files(const string& Folder, std::vector<string> *files) {
+	std::vector<string> names;
+	struct dirent *de;
+	struct stat st;
+
+	DIR *d = opendir(Folder.c_str());
+	if (d == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		string name = de->d_name;
+		if (name == "." || name == "..")
+			continue;
+		string path = Folder + "/" + name;
+		if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && twrpDigestDriver::Has_Digest(path))
+			names.push_back(path);
+	}
+	closedir(d);
+	sort(names.begin(), names.end());
+	files->insert(files->end(), names.begin(), names.end());
+}
+
+int TWPartitionManager::Verify_Backups(bool Force) {
+	twrpTraceScope trace("verify", "Verify_Backups");
+	string Backups_Folder;
+	std::vector<string> folders, files;
+	std::vector<size_t> first_file;
+	std::vector<int> results;
+	int interval_days = 0;
+	unsigned max_threads = VERIFY_MAX_THREADS;
+	struct dirent *de;
+	struct stat st;
+	time_t now = time(NULL);
+
+	if (!Mount_Current_Storage(true))
+		return false;
+	DataManager::GetValue(TW_BACKUPS_FOLDER_VAR, Backups_Folder);
+	DataManager::GetValue(TW_VERIFY_INTERVAL_VAR, interval_days);
+	gui_msg("verify_backups_started=[VERIFY BACKUPS STARTED]");
+	TWFunc::GUI_Operation_Text(TW_VERIFY_DIGEST_TEXT, gui_parse_text("{@verifying_digest}"));
+
+	DIR *d = opendir(Backups_Folder.c_str());
+	if (d == NULL) {
+		gui_msg(Msg(msg::kError, "verify_backups_none=No backups found in '{1}'.")(Backups_Folder));
+		return false;
+	}
+	while ((de = readdir(d)) != NULL) {
+		string name = de->d_name;
+		if (name == "." || name == "..")
+			continue;
+		string folder = Backups_Folder + "/" + name;
+		if (stat(folder.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+			folders.push_back(folder);
+	}
+	closedir(d);
+	sort(folders.begin(), folders.end());
+
+	for (std::vector<string>::iterator folder = folders.begin(); folder != folders.end();) {
+		string record;
+		long long last = 0;
+		char result[16];
+
+		// Only a good result is trusted for the interval, damaged backups are checked every time
+		if (!Force && interval_days > 0 && twrpBackupMeta::Find(*folder, BACKUP_META_VERIFY, BACKUP_META_VERIFY_LAST, &record) &&
+				sscanf(record.c_str(), "time=%lld result=%15s", &last, result) == 2 && strcmp(result, "ok") == 0 &&
+				last <= now && now - last < (long long) interval_days * 24 * 60 * 60) {
+			gui_msg(Msg("verify_backup_skip=Skipping '{1}', verified {2} days ago.")(TWFunc::Get_Filename(*folder))((now - last) / (24 * 60 * 60)));
+			folder = folders.erase(folder);
+			continue;
+		}
+		size_t count = files.size();
+		Find_Verify_Files(*folder, &files);
+		if (files.size() == count) {
+			LOGINFO("No backup files with digests in '%s'\n", folder->c_str());
+			folder = folders.erase(folder);
+			continue;
+		}
+		first_file.push_back(count);
+		folder++;
+	}
+	first_file.push_back(files.size());
+	if (files.empty()) {
+		gui_msg("verify_backups_nothing=No backups need to be verified.");
+		return true;
+	}
+
+	// The archives of every backup share one pool
+	TWPartition* storage = Find_Partition_By_Path(Backups_Folder);
+	if (storage != NULL && storage->Removable)
+		max_threads = VERIFY_REMOVABLE_THREADS;
+	gui_msg(Msg("verify_backups_count=Verifying {1} files in {2} backups...")(files.size())(folders.size()));
+	DataManager::SetProgress(0.0);
+	twrpDigestDriver::Check_Files(files, max_threads, &results);
+
+	size_t total_failed = 0;
+	for (size_t i = 0; i < folders.size(); i++) {
+		unsigned long long bytes = 0;
+		size_t failed = 0;
+		char record[256];
+
+		for (size_t f = first_file[i]; f < first_file[i + 1]; f++) {
+			if (stat(files[f].c_str(), &st) == 0)
+				bytes += st.st_size;
+			if (!results[f])
+				failed++;
+		}
+		snprintf(record, sizeof(record), "time=%lld\nresult=%s\nfiles=%zu\nfailed=%zu\nbytes=%llu\n",
+			(long long) time(NULL), failed ? "failed" : "ok", first_file[i + 1] - first_file[i], failed, bytes);
+		twrpBackupMeta::Append(folders[i], BACKUP_META_VERIFY, BACKUP_META_VERIFY_LAST, record);
+		if (failed)
+			gui_msg(Msg(msg::kError, "verify_backup_failed=Backup '{1}' has {2} damaged files.")(TWFunc::Get_Filename(folders[i]))(failed));
+		else
+			gui_msg(Msg("verify_backup_ok=Backup '{1}' verified.")(TWFunc::Get_Filename(folders[i])));
+		total_failed += failed;
+	}
+	DataManager::SetProgress(1.0);
+	if (total_failed)
+		return false;
+	gui_msg(Msg(msg::kHighlight, "verify_backups_completed=[VERIFY BACKUPS COMPLETED IN {1} SECONDS]")((int) difftime(time(NULL), now)));
+	return true;
+}
+
 void TWPartitionManager::Set_Restore_Files(string Restore_Name) {
 	// Start with the default values
 	string Restore_List;
 	bool get_date = true, check_encryption = true;
 	bool adbbackup = false;
+	twrpBackupCatalog catalog;
 
 	DataManager::SetValue("tw_restore_encrypted", 0);
 	if (twadbbu::Check_ADB_Backup_File(Restore_Name)) {
@@ -1135,6 +1957,32 @@ void TWPartitionManager::Set_Restore_Files(string Restore_Name) {
 		}
 		DataManager::SetValue("tw_enable_adb_backup", 1);
 	}
+	else if (catalog.Load(Restore_Name)) {
+		// Written at the end of the backup, nothing in the folder needs to be opened
+		time_t created = catalog.Get_Created();
+		DataManager::SetValue(TW_RESTORE_FILE_DATE, string(ctime(&created)));
+		if (catalog.Is_Encrypted()) {
+			LOGINFO("'%s' is encrypted\n", Restore_Name.c_str());
+			DataManager::SetValue("tw_restore_encrypted", 1);
+		}
+
+		const vector<twrpBackupCatalog::Partition>& parts = catalog.Get_Partitions();
+		for (size_t i = 0; i < parts.size(); i++) {
+			string label, backup_filename;
+			if (!twrpBackupCatalog::Split_Archive_Name(parts[i].backup_filename, &label, &backup_filename))
+				continue;
+			TWPartition* Part = Find_Partition_By_Path(label);
+			if (Part == NULL)
+			{
+				gui_msg(Msg(msg::kError, "unable_locate_part_backup_name=Unable to locate partition by backup name: '{1}'")(label));
+				continue;
+			}
+
+			Part->Backup_FileName = backup_filename;
+			if (!Part->Is_SubPartition)
+				Restore_List += Part->Backup_Path + ";";
+		}
+	}
 	else {
 		DIR* d;
 		d = opendir(Restore_Name.c_str());
@@ -1237,6 +2085,9 @@ int TWPartitionManager::Wipe_By_Path(string Path) {
 	std::vector<TWPartition*>::iterator iter;
 	int ret = false;
 	bool found = false;
+
+	Wait_For_Data_Media_Size();
+
 	string Local_Path = TWFunc::Get_Root_Path(Path);
 
 	// Iterate through all partitions
@@ -1262,6 +2113,9 @@ int TWPartitionManager::Wipe_By_Path(string Path, string New_File_System) {
 	std::vector<TWPartition*>::iterator iter;
 	int ret = false;
 	bool found = false;
+
+	Wait_For_Data_Media_Size();
+
 	string Local_Path = TWFunc::Get_Root_Path(Path);
 
 	// Iterate through all partitions
@@ -1285,26 +2139,23 @@ int TWPartitionManager::Wipe_By_Path(string Path, string New_File_System) {
 
 int TWPartitionManager::Factory_Reset(void) {
 	std::vector<TWPartition*>::iterator iter;
-	int ret = true;
+	std::vector<Wipe_Job> jobs;
+	int ret;
 
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
 		if ((*iter)->Wipe_During_Factory_Reset && (*iter)->Is_Present) {
 #ifdef TW_OEM_BUILD
 			if ((*iter)->Mount_Point == "/data") {
-				if (!(*iter)->Wipe_Encryption())
-					ret = false;
-			} else {
-#endif
-				if (!(*iter)->Wipe())
-					ret = false;
-#ifdef TW_OEM_BUILD
+				Add_Wipe_Job(&jobs, WIPE_ENCRYPTION, *iter, (*iter)->Mount_Point);
+				continue;
 			}
 #endif
+			Add_Wipe_Job(&jobs, WIPE_PARTITION, *iter, (*iter)->Mount_Point);
 		} else if ((*iter)->Has_Android_Secure) {
-			if (!(*iter)->Wipe_AndSec())
-				ret = false;
+			Add_Wipe_Job(&jobs, WIPE_PARTITION_ANDSEC, *iter, (*iter)->Mount_Point);
 		}
 	}
+	ret = Run_Wipes(&jobs, false);
 	TWFunc::check_and_run_script("/sbin/factoryreset.sh", "Factory Reset Script");
 	return ret;
 }
@@ -1390,6 +2241,8 @@ int TWPartitionManager::Wipe_Android_Secure(void) {
 int TWPartitionManager::Format_Data(void) {
 	TWPartition* dat = Find_Partition_By_Path("/data");
 
+	Wait_For_Data_Media_Size();
+
 	if (dat != NULL) {
 		if (!dat->UnMount(true))
 			return false;
@@ -1405,6 +2258,8 @@ int TWPartitionManager::Format_Data(void) {
 int TWPartitionManager::Wipe_Media_From_Data(void) {
 	TWPartition* dat = Find_Partition_By_Path("/data");
 
+	Wait_For_Data_Media_Size();
+
 	if (dat != NULL) {
 		if (!dat->Has_Data_Media) {
 			LOGERR("This device does not have /data/media\n");
@@ -1426,10 +2281,254 @@ int TWPartitionManager::Wipe_Media_From_Data(void) {
 	return false;
 }
 
+// The disk a block device is on, following device mapper devices to the
+// device below them, so wipes can be limited per physical device
+static string Wipe_Disk(const string& Block_Device) {
+	struct stat st;
+	char sys_path[64], real_path[PATH_MAX];
+
+	if (Block_Device.empty() || stat(Block_Device.c_str(), &st) != 0 || !S_ISBLK(st.st_mode))
+		return Block_Device;
+	snprintf(sys_path, sizeof(sys_path), "/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+	if (!realpath(sys_path, real_path))
+		return Block_Device;
+	string device = real_path;
+	for (int depth = 0; depth < 4; depth++) {
+		string slave;
+		DIR* d = opendir((device + "/slaves").c_str());
+		if (d == NULL)
+			break;
+		struct dirent* de;
+		while ((de = readdir(d)) != NULL) {
+			if (de->d_name[0] != '.')
+				slave = de->d_name;
+		}
+		closedir(d);
+		if (slave.empty() || !realpath((device + "/slaves/" + slave).c_str(), real_path))
+			break;
+		device = real_path;
+	}
+	// A partition is a folder inside the folder of its disk
+	if (TWFunc::Path_Exists(device + "/partition"))
+		device = TWFunc::Get_Path(device);
+	return device;
+}
+
+void TWPartitionManager::Add_Wipe_Job(std::vector<Wipe_Job>* jobs, Wipe_Kind Kind, TWPartition* Part, const string& Path) {
+	std::vector<TWPartition*> parts;
+	Wipe_Job job;
+
+	job.manager = this;
+	job.kind = Kind;
+	job.part = Part;
+	job.path = Path;
+	job.started = job.done = job.ret = job.reported = false;
+	if (Kind == WIPE_PATH) {
+		string Local_Path = TWFunc::Get_Root_Path(Path);
+		for (std::vector<TWPartition*>::iterator iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+			if ((*iter)->Mount_Point == Local_Path || (*iter)->Symlink_Mount_Point == Local_Path || ((*iter)->Is_SubPartition && (*iter)->SubPartition_Of == Local_Path))
+				parts.push_back(*iter);
+		}
+	} else if (Kind == WIPE_DALVIK) {
+		const char* paths[] = { "/data", "/cache", "/sd-ext" };
+		for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+			TWPartition* found = Find_Partition_By_Path(paths[i]);
+			if (found)
+				parts.push_back(found);
+			job.resources.insert(paths[i]);
+		}
+	} else if (Kind == WIPE_MEDIA) {
+		TWPartition* found = Find_Partition_By_Path("/data");
+		if (found)
+			parts.push_back(found);
+		job.resources.insert("/data");
+	} else if (Kind == WIPE_ANDSEC) {
+		for (std::vector<TWPartition*>::iterator iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+			if ((*iter)->Has_Android_Secure)
+				parts.push_back(*iter);
+		}
+	} else if (Part) {
+		parts.push_back(Part);
+	}
+	for (size_t i = 0; i < parts.size(); i++) {
+		job.resources.insert(Top_Folder(parts[i]->Mount_Point));
+		if (!parts[i]->Symlink_Mount_Point.empty())
+			job.resources.insert(Top_Folder(parts[i]->Symlink_Mount_Point));
+		if (!parts[i]->Actual_Block_Device.empty())
+			job.resources.insert(parts[i]->Actual_Block_Device);
+	}
+	job.name = Path;
+	if (!parts.empty()) {
+		job.disk = Wipe_Disk(parts[0]->Actual_Block_Device);
+		if (Kind != WIPE_DALVIK && Kind != WIPE_MEDIA && Kind != WIPE_ANDSEC)
+			job.name = parts[0]->Display_Name;
+	}
+	if (job.disk.empty())
+		job.disk = Path;
+	jobs->push_back(job);
+}
+
+bool TWPartitionManager::Run_Wipe_Job(Wipe_Job* job) {
+	switch (job->kind) {
+		case WIPE_PARTITION:
+			return job->part->Wipe();
+		case WIPE_ENCRYPTION:
+			return job->part->Wipe_Encryption();
+		case WIPE_PARTITION_ANDSEC:
+			return job->part->Wipe_AndSec();
+		case WIPE_PATH:
+			if (!Wipe_By_Path(job->path)) {
+				gui_msg(Msg(msg::kError, "unable_to_wipe=Unable to wipe {1}.")(job->path));
+				return false;
+			}
+			return true;
+		case WIPE_DALVIK:
+			if (!Wipe_Dalvik_Cache()) {
+				gui_err("dalvik_wipe_err=Failed to wipe dalvik");
+				return false;
+			}
+			return true;
+		case WIPE_MEDIA:
+			return Wipe_Media_From_Data();
+		case WIPE_ANDSEC:
+			if (!Wipe_Android_Secure()) {
+				gui_msg("and_sec_wipe_err=Unable to wipe android secure");
+				return false;
+			}
+			return true;
+	}
+	return false;
+}
+
+void* TWPartitionManager::Wipe_Job_Thread(void *cookie) {
+	Wipe_Job* job = (Wipe_Job*) cookie;
+	bool ret = job->manager->Run_Wipe_Job(job);
+
+	pthread_mutex_lock(job->lock);
+	job->ret = ret;
+	job->done = true;
+	pthread_cond_broadcast(job->cond);
+	pthread_mutex_unlock(job->lock);
+	return NULL;
+}
+
+bool TWPartitionManager::Run_Wipes(std::vector<Wipe_Job>* jobs, bool Stop_On_Error) {
+	twrpTraceScope trace("wipe", "Run_Wipes");
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+	size_t finished, running;
+	bool ret = true, failed = false;
+
+	if (jobs->empty())
+		return true;
+	// The size walk mounts data media partitions, the wipes must not race it
+	Wait_For_Data_Media_Size();
+	DataManager::SetProgress(0.0);
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		std::map<string, unsigned> disk_jobs;
+		std::set<string> busy;
+
+		finished = running = 0;
+		for (size_t i = 0; i < jobs->size(); i++) {
+			Wipe_Job& job = jobs->at(i);
+			if (job.done) {
+				finished++;
+				if (!job.ret)
+					failed = true;
+			} else if (job.started) {
+				running++;
+				disk_jobs[job.disk]++;
+			}
+		}
+		for (size_t i = 0; i < jobs->size(); i++) {
+			Wipe_Job& job = jobs->at(i);
+			if (job.done && !job.reported) {
+				job.reported = true;
+				if (job.ret)
+					gui_msg(Msg("wipe_job_done=Wiped {1} ({2} of {3})")(job.name)(finished)(jobs->size()));
+				DataManager::SetProgress((float) finished / (float) jobs->size());
+			}
+		}
+		if (finished == jobs->size() || (failed && Stop_On_Error && running == 0))
+			break;
+
+		// A job waits for every earlier one that changes the same folders or
+		// block devices, e.g. /data/media is only removed once /data is done
+		for (size_t i = 0; i < jobs->size() && !(failed && Stop_On_Error); i++) {
+			Wipe_Job& job = jobs->at(i);
+			if (job.done)
+				continue;
+			bool blocked = job.started || disk_jobs[job.disk] >= WIPE_JOBS_PER_DISK;
+			for (std::set<string>::iterator it = job.resources.begin(); !blocked && it != job.resources.end(); it++)
+				blocked = busy.count(*it) > 0;
+			busy.insert(job.resources.begin(), job.resources.end());
+			if (blocked)
+				continue;
+
+			LOGINFO("Wiping %s on %s\n", job.path.c_str(), job.disk.c_str());
+			job.lock = &lock;
+			job.cond = &cond;
+			job.started = true;
+			if (pthread_create(&job.thread, NULL, Wipe_Job_Thread, &job) == 0) {
+				disk_jobs[job.disk]++;
+				running++;
+			} else {
+				// Run it here instead, nothing else is started meanwhile
+				LOGINFO("Unable to start a wipe thread: %s\n", strerror(errno));
+				pthread_mutex_unlock(&lock);
+				job.ret = Run_Wipe_Job(&job);
+				pthread_mutex_lock(&lock);
+				job.done = true;
+				job.thread = 0;
+				break;
+			}
+		}
+		if (running)
+			pthread_cond_wait(&cond, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	for (size_t i = 0; i < jobs->size(); i++) {
+		Wipe_Job& job = jobs->at(i);
+		if (job.started && job.thread)
+			pthread_join(job.thread, NULL);
+		if (!job.ret)
+			ret = false;
+	}
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+	return ret;
+}
+
+int TWPartitionManager::Wipe_Paths(const std::vector<string>& Paths) {
+	std::vector<Wipe_Job> jobs;
+
+	for (size_t i = 0; i < Paths.size(); i++) {
+		if (Paths[i] == "/and-sec") {
+			Add_Wipe_Job(&jobs, WIPE_ANDSEC, NULL, Paths[i]);
+		} else if (Paths[i] == "DALVIK") {
+			Add_Wipe_Job(&jobs, WIPE_DALVIK, NULL, Paths[i]);
+		} else if (Paths[i] == "INTERNAL") {
+			Add_Wipe_Job(&jobs, WIPE_MEDIA, NULL, Paths[i]);
+		} else if (Find_Partition_By_Path(Paths[i]) == NULL) {
+			gui_msg(Msg(msg::kError, "unable_find_part_path=Unable to find partition for path '{1}'")(TWFunc::Get_Root_Path(Paths[i])));
+			return false;
+		} else {
+			Add_Wipe_Job(&jobs, WIPE_PATH, NULL, Paths[i]);
+		}
+	}
+	return Run_Wipes(&jobs, true);
+}
+
 int TWPartitionManager::Repair_By_Path(string Path, bool Display_Error) {
 	std::vector<TWPartition*>::iterator iter;
 	int ret = false;
 	bool found = false;
+
+	Wait_For_Data_Media_Size();
+
 	string Local_Path = TWFunc::Get_Root_Path(Path);
 
 	if (Local_Path == "/tmp" || Local_Path == "/")
@@ -1458,6 +2557,9 @@ int TWPartitionManager::Resize_By_Path(string Path, bool Display_Error) {
 	std::vector<TWPartition*>::iterator iter;
 	int ret = false;
 	bool found = false;
+
+	Wait_For_Data_Media_Size();
+
 	string Local_Path = TWFunc::Get_Root_Path(Path);
 
 	if (Local_Path == "/tmp" || Local_Path == "/")
@@ -1482,19 +2584,72 @@ int TWPartitionManager::Resize_By_Path(string Path, bool Display_Error) {
 	return false;
 }
 
-void TWPartitionManager::Update_System_Details(void) {
+void* TWPartitionManager::Update_Size_Thread(void *cookie) {
+	Update_Size_Work *work = (Update_Size_Work*) cookie;
+
+	for (;;) {
+		pthread_mutex_lock(&work->lock);
+		size_t group = work->next++;
+		pthread_mutex_unlock(&work->lock);
+		if (group >= work->groups.size())
+			break;
+		std::vector<TWPartition*>& parts = work->groups[group].parts;
+		for (size_t i = 0; i < parts.size(); i++)
+			parts[i]->Update_Size(true, work->defer_data_media);
+	}
+	return NULL;
+}
+
+void* TWPartitionManager::Data_Media_Size_Thread(void *cookie) {
+	TWPartitionManager *manager = (TWPartitionManager*) cookie;
+	std::vector<TWPartition*>::iterator iter;
+
+	for (iter = manager->Partitions.begin(); iter != manager->Partitions.end(); iter++) {
+		TWPartition *Part = *iter;
+		if (!Part->Has_Data_Media)
+			continue;
+		bool Was_Already_Mounted = Part->Is_Mounted();
+		if (!Part->Mount(false))
+			continue;
+		Part->Used = Part->Get_Data_Media_Size();
+		Part->Backup_Size = Part->Used;
+		LOGINFO("Data backup size is %iMB, free: %iMB.\n", (int)(Part->Used / 1048576LLU), (int)(Part->Free / 1048576LLU));
+		if (!Was_Already_Mounted)
+			Part->UnMount(false);
+	}
+	manager->Set_Data_Size_Value();
+	manager->State_Changed();
+	return NULL;
+}
+
+void TWPartitionManager::Wait_For_Data_Media_Size(void) {
+	if (!data_media_size_running)
+		return;
+	pthread_join(data_media_size_thread, NULL);
+	data_media_size_running = false;
+}
+
+void TWPartitionManager::Set_Data_Size_Value(void) {
 	std::vector<TWPartition*>::iterator iter;
 	int data_size = 0;
 
-	gui_msg("update_part_details=Updating partition details...");
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
-		(*iter)->Update_Size(true);
+		if ((*iter)->Mount_Point == "/data" || ((*iter)->Can_Be_Mounted && (*iter)->Mount_Point == "/datadata"))
+			data_size += (int)((*iter)->Backup_Size / 1048576LLU);
+	}
+	DataManager::SetValue(TW_BACKUP_DATA_SIZE, data_size);
+}
+
+void TWPartitionManager::Set_Backup_Size_Values() {
+	std::vector<TWPartition*>::iterator iter;
+
+	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
 		if ((*iter)->Can_Be_Mounted) {
 			if ((*iter)->Mount_Point == "/system") {
 				int backup_display_size = (int)((*iter)->Backup_Size / 1048576LLU);
 				DataManager::SetValue(TW_BACKUP_SYSTEM_SIZE, backup_display_size);
 			} else if ((*iter)->Mount_Point == "/data" || (*iter)->Mount_Point == "/datadata") {
-				data_size += (int)((*iter)->Backup_Size / 1048576LLU);
+				// Summed up by Set_Data_Size_Value
 			} else if ((*iter)->Mount_Point == "/cache") {
 				int backup_display_size = (int)((*iter)->Backup_Size / 1048576LLU);
 				DataManager::SetValue(TW_BACKUP_CACHE_SIZE, backup_display_size);
@@ -1541,13 +2696,87 @@ void TWPartitionManager::Update_System_Details(void) {
 					DataManager::SetValue(TW_BACKUP_RECOVERY_VAR, 0);
 				} else
 					DataManager::SetValue(TW_HAS_RECOVERY_PARTITION, 1);
-			} else if ((*iter)->Mount_Point == "/data") {
-				data_size += (int)((*iter)->Backup_Size / 1048576LLU);
 			}
 		}
 	}
+}
+
+void TWPartitionManager::Update_System_Details(bool Defer_Data_Media) {
+	std::vector<TWPartition*>::iterator iter;
+	size_t i;
+
+	gui_msg("update_part_details=Updating partition details...");
+	Wait_For_Data_Media_Size();
+
+	// Group the partitions that may mount or bind on top of each other, the
+	// groups are then sized in parallel and each group in fstab order
+	std::vector<size_t> parent(Partitions.size());
+	std::map<string, size_t> owner;
+	for (i = 0; i < Partitions.size(); i++) {
+		TWPartition *Part = Partitions[i];
+		string keys[4] = {
+			Top_Folder(Part->Mount_Point),
+			Top_Folder(Part->Symlink_Mount_Point),
+			Part->Is_SubPartition ? Top_Folder(Part->SubPartition_Of) : "",
+			Part->Primary_Block_Device.empty() ? "" : "dev:" + Part->Primary_Block_Device
+		};
+		parent[i] = i;
+		for (int k = 0; k < 4; k++) {
+			if (keys[k].empty())
+				continue;
+			std::map<string, size_t>::iterator found = owner.find(keys[k]);
+			if (found == owner.end())
+				owner[keys[k]] = i;
+			else
+				parent[Find_Group(parent, i)] = Find_Group(parent, found->second);
+		}
+	}
+	Update_Size_Work work;
+	std::map<size_t, size_t> group_index;
+	for (i = 0; i < Partitions.size(); i++) {
+		size_t root = Find_Group(parent, i);
+		std::map<size_t, size_t>::iterator found = group_index.find(root);
+		if (found == group_index.end()) {
+			group_index[root] = work.groups.size();
+			work.groups.push_back(Update_Size_Group());
+			work.groups.back().parts.push_back(Partitions[i]);
+		} else {
+			work.groups[found->second].parts.push_back(Partitions[i]);
+		}
+	}
+	work.next = 0;
+	work.defer_data_media = Defer_Data_Media;
+	pthread_mutex_init(&work.lock, NULL);
+
+	pthread_t threads[UPDATE_SIZE_MAX_THREADS];
+	unsigned thread_count = sysconf(_SC_NPROCESSORS_CONF), started = 0;
+	if (thread_count > UPDATE_SIZE_MAX_THREADS)
+		thread_count = UPDATE_SIZE_MAX_THREADS;
+	if (thread_count > work.groups.size())
+		thread_count = work.groups.size();
+	for (i = 1; i < thread_count; i++) {
+		if (pthread_create(&threads[started], NULL, Update_Size_Thread, &work) != 0)
+			break;
+		started++;
+	}
+	Update_Size_Thread(&work);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&work.lock);
+
+	Set_Backup_Size_Values();
 	gui_msg("update_part_details_done=...done");
-	DataManager::SetValue(TW_BACKUP_DATA_SIZE, data_size);
+	Set_Data_Size_Value();
+	if (Defer_Data_Media) {
+		for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+			if ((*iter)->Has_Data_Media) {
+				data_media_size_running = (pthread_create(&data_media_size_thread, NULL, Data_Media_Size_Thread, this) == 0);
+				if (!data_media_size_running)
+					Data_Media_Size_Thread(this);
+				break;
+			}
+		}
+	}
 	string current_storage_path = DataManager::GetCurrentStoragePath();
 	TWPartition* FreeStorage = Find_Partition_By_Path(current_storage_path);
 	if (FreeStorage != NULL) {
@@ -1571,6 +2800,7 @@ void TWPartitionManager::Post_Decrypt(const string& Block_Device) {
 	if (dat != NULL) {
 		DataManager::SetValue(TW_IS_DECRYPTED, 1);
 		dat->Is_Decrypted = true;
+		TWPartition::Invalidate_FS_Types();
 		if (!Block_Device.empty()) {
 			dat->Decrypted_Block_Device = Block_Device;
 			gui_msg(Msg("decrypt_success_dev=Data successfully decrypted, new block device: '{1}'")(Block_Device));
@@ -1756,10 +2986,66 @@ int TWPartitionManager::Open_Lun_File(string Partition_Path, string Lun_File) {
 	return true;
 }
 
+#ifdef TW_USB_STORAGE_FFS
+int TWPartitionManager::Usb_Disk_Enable() {
+	string Storage_Path = DataManager::GetCurrentStoragePath();
+	TWPartition* Part = Find_Partition_By_Path(Storage_Path);
+	string Backing;
+
+	mtp_was_enabled = TWFunc::Toggle_MTP(false); // Must disable MTP for USB Storage
+	if (Part == NULL) {
+		gui_err("unable_locate_storage=Unable to locate storage device.");
+		goto error_handle;
+	}
+	if (Part->Has_Data_Media) {
+		// /data cannot be handed to the host, an image file on it is exported instead
+		Backing = Storage_Path + "/TWRP/" USB_DISK_IMAGE_FILE;
+		if (!TWFunc::Path_Exists(Backing)) {
+			LOGERR("Internal storage can only be shared as the image '%s'\n", Backing.c_str());
+			goto error_handle;
+		}
+	} else {
+		if (!Part->UnMount(true) || !Part->Is_Present)
+			goto error_handle;
+		Backing = Part->Actual_Block_Device;
+	}
+	if (!twrpUsbDisk::Start(Backing)) {
+		Mount_All_Storage();
+		goto error_handle;
+	}
+	property_set("sys.storage.ums_enabled", "1");
+	property_set("sys.usb.config", "ums,adb");
+	return true;
+error_handle:
+	if (mtp_was_enabled)
+		if (!Enable_MTP())
+			Disable_MTP();
+	return false;
+}
+
+int TWPartitionManager::Usb_Disk_Disable() {
+	// The function leaves the gadget first so the host stops sending commands
+	property_set("sys.usb.config", "adb");
+	twrpUsbDisk::Stop();
+	Mount_All_Storage();
+	Update_System_Details();
+	UnMount_Main_Partitions();
+	property_set("sys.storage.ums_enabled", "0");
+	if (mtp_was_enabled)
+		if (!Enable_MTP())
+			Disable_MTP();
+	return true;
+}
+#endif
+
 int TWPartitionManager::usb_storage_enable(void) {
 	char lun_file[255];
 	bool has_multiple_lun = false;
 
+#ifdef TW_USB_STORAGE_FFS
+	if (TWFunc::Path_Exists(USB_DISK_FFS_EP0))
+		return Usb_Disk_Enable();
+#endif
 	string Lun_File_str = CUSTOM_LUN_FILE;
 	size_t found = Lun_File_str.find("%");
 	if (found != string::npos) {
@@ -1819,6 +3105,10 @@ int TWPartitionManager::usb_storage_disable(void) {
 	char lun_file[255], ch[2] = {0, 0};
 	string str = ch;
 
+#ifdef TW_USB_STORAGE_FFS
+	if (twrpUsbDisk::Is_Running())
+		return Usb_Disk_Disable();
+#endif
 	for (index=0; index<2; index++) {
 		sprintf(lun_file, CUSTOM_LUN_FILE, index);
 		ret = TWFunc::write_to_file(lun_file, str);
@@ -2203,6 +3493,7 @@ TWPartition *TWPartitionManager::Get_Default_Storage_Partition()
 }
 
 bool TWPartitionManager::Enable_MTP(void) {
+	twrpTraceScope trace("mtp", "Enable_MTP");
 #ifdef TW_HAS_MTP
 	if (mtppid) {
 		gui_err("mtp_already_enabled=MTP already enabled");
@@ -2234,6 +3525,7 @@ bool TWPartitionManager::Enable_MTP(void) {
 	 * twrp set tw_mtp_debug 1
 	 */
 	twrpMtp *mtp = new twrpMtp(DataManager::GetIntValue("tw_mtp_debug"));
+	twrpMtp::setMemoryCounter(twrpMemory::Get_Counter(MEMORY_MTP));
 	mtppid = mtp->forkserver(mtppipe);
 	if (mtppid) {
 		close(mtppipe[0]); // Host closes read side
@@ -2271,6 +3563,7 @@ void TWPartitionManager::Add_All_MTP_Storage(void) {
 }
 
 bool TWPartitionManager::Disable_MTP(void) {
+	twrpTraceScope trace("mtp", "Disable_MTP");
 	char old_value[PROPERTY_VALUE_MAX];
 	property_get("sys.usb.config", old_value, "");
 	if (strcmp(old_value, "adb") != 0) {
@@ -2291,6 +3584,8 @@ bool TWPartitionManager::Disable_MTP(void) {
 		int status;
 		kill(mtppid, SIGKILL);
 		mtppid = 0;
+		// The killed server never took its tree off the counter
+		twrpMemory::Set(MEMORY_MTP, 0);
 		// We don't care about the exit value, but this prevents a zombie process
 		waitpid(mtppid, &status, 0);
 		close(mtp_write_fd);
@@ -2307,15 +3602,27 @@ bool TWPartitionManager::Disable_MTP(void) {
 
 TWPartition* TWPartitionManager::Find_Partition_By_MTP_Storage_ID(unsigned int Storage_ID) {
 	std::vector<TWPartition*>::iterator iter;
+	TWPartition* found = NULL;
+
+	pthread_mutex_lock(&index_lock);
+	std::unordered_map<unsigned int, TWPartition*>::iterator it = mtp_index.find(Storage_ID);
+	if (it != mtp_index.end() && it->second->MTP_Storage_ID == Storage_ID)
+		found = it->second;
+	pthread_mutex_unlock(&index_lock);
+	if (found)
+		return found;
 
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
-		if ((*iter)->MTP_Storage_ID == Storage_ID)
+		if ((*iter)->MTP_Storage_ID == Storage_ID) {
+			Rebuild_Partition_Index();
 			return (*iter);
+		}
 	}
 	return NULL;
 }
 
 bool TWPartitionManager::Add_Remove_MTP_Storage(TWPartition* Part, int message_type) {
+	twrpTraceScope trace("mtp", "Add_Remove_MTP_Storage");
 #ifdef TW_HAS_MTP
 	struct mtpmsg mtp_message;
 
@@ -2454,7 +3761,12 @@ bool TWPartitionManager::Flash_Image(string& path, string& filename) {
 	ProgressTracking progress(total_bytes);
 	part_settings.progress = &progress;
 	part_settings.adbbackup = false;
+	part_settings.use_lz4 = false;
+	part_settings.adb_stream = 0;
+	part_settings.adb_resume_offset = 0;
+	part_settings.verify_digest = false;
 	part_settings.PM_Method = PM_RESTORE;
+	part_settings.plan = NULL;
 
 	gui_msg("calc_restore=Calculating restore details...");
 	DataManager::GetValue("tw_flash_partition", Flash_List);
@@ -2579,6 +3891,7 @@ void TWPartitionManager::Translate_Partition_Display_Names() {
 
 	// This updates the text on all of the storage selection buttons in the GUI
 	DataManager::SetBackupFolder();
+	State_Changed();
 }
 
 bool TWPartitionManager::Decrypt_Adopted() {
@@ -2678,6 +3991,8 @@ void TWPartitionManager::Remove_Partition_By_Path(string Path) {
 		if ((*iter)->Mount_Point == Local_Path || (!(*iter)->Symlink_Mount_Point.empty() && (*iter)->Symlink_Mount_Point == Local_Path)) {
 			LOGINFO("Found and erasing '%s' from partition list\n", Local_Path.c_str());
 			Partitions.erase(iter);
+			Rebuild_Partition_Index();
+			State_Changed();
 			return;
 		}
 	}
@@ -2713,9 +4028,31 @@ void TWPartitionManager::Set_Active_Slot(const string& Slot) {
 #else
 	LOGERR("Boot slot feature not present\n");
 #endif
+	string Old_Slot = Active_Slot_Display;
 	Active_Slot_Display = Slot;
-	if (Fstab_Processed())
+	if (!Fstab_Processed())
+		return;
+	if (Old_Slot.empty()) {
 		Update_System_Details();
+		return;
+	}
+
+	// Only the partitions with slots change, each keeps what was found for
+	// the slot it leaves so switching back needs no probing
+	gui_msg("update_part_details=Updating partition details...");
+	for (std::vector<TWPartition*>::iterator iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+		if ((*iter)->SlotSelect)
+			(*iter)->Switch_Slot(Old_Slot == "B", Slot == "B");
+	}
+	Set_Backup_Size_Values();
+	gui_msg("update_part_details_done=...done");
+}
+
+void TWPartitionManager::Clear_Slot_Details() {
+	for (std::vector<TWPartition*>::iterator iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+		(*iter)->Slot_Cache[0].Valid = false;
+		(*iter)->Slot_Cache[1].Valid = false;
+	}
 }
 string TWPartitionManager::Get_Active_Slot_Suffix() {
 	if (Active_Slot_Display == "A")
@@ -2736,6 +4073,7 @@ void TWPartitionManager::Remove_Uevent_Devices(const string& Mount_Point) {
 			(*iter)->UnMount(false);
 			rmdir((*iter)->Mount_Point.c_str());
 			iter = Partitions.erase(iter);
+			Rebuild_Partition_Index();
 			delete part;
 		} else {
 			iter++;
@@ -2746,6 +4084,8 @@ void TWPartitionManager::Remove_Uevent_Devices(const string& Mount_Point) {
 void TWPartitionManager::Handle_Uevent(const Uevent_Block_Data& uevent_data) {
 	std::vector<TWPartition*>::iterator iter;
 
+	TWPartition::Invalidate_FS_Types(); // A card may have been swapped for another one
+
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
 		if (!(*iter)->Sysfs_Entry.empty()) {
 			string device;
@@ -2766,12 +4106,14 @@ void TWPartitionManager::Handle_Uevent(const Uevent_Block_Data& uevent_data) {
 						LOGINFO("No adopted storage so finding actual block device\n");
 						(*iter)->Find_Actual_Block_Device();
 					}
+					State_Changed();
 					return;
 				} else if (uevent_data.action == "remove") {
 					(*iter)->Is_Present = false;
 					(*iter)->Primary_Block_Device = "";
 					(*iter)->Actual_Block_Device = "";
 					Remove_Uevent_Devices((*iter)->Mount_Point);
+					State_Changed();
 					return;
 				}
 			}
@@ -2847,19 +4189,24 @@ Uevent_Block_Data TWPartitionManager::get_event_block_values(char *buf, int len)
 void TWPartitionManager::read_uevent() {
 	char buf[1024];
 
-	int len = recv(uevent_pfd.fd, buf, sizeof(buf), MSG_DONTWAIT);
-	if (len == -1) {
-		LOGERR("recv error on uevent\n");
-		return;
-	}
-	/*int i = 0; // Print all uevent output for test /debug
-	while (i<len) {
-		printf("%s\n", buf+i);
-		i += strlen(buf+i)+1;
-	}*/
-	Uevent_Block_Data uevent_data = get_event_block_values(buf, len);
-	if (uevent_data.subsystem == "block" && uevent_data.type == "disk") {
-		PartitionManager.Handle_Uevent(uevent_data);
+	// Handle everything that is queued, a coldboot or a card being
+	// inserted sends a burst of events at once
+	for (int count = 0; count < 64; count++) {
+		int len = recv(uevent_pfd.fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				LOGERR("recv error on uevent\n");
+			return;
+		}
+		/*int i = 0; // Print all uevent output for test /debug
+		while (i<len) {
+			printf("%s\n", buf+i);
+			i += strlen(buf+i)+1;
+		}*/
+		Uevent_Block_Data uevent_data = get_event_block_values(buf, len);
+		if (uevent_data.subsystem == "block" && uevent_data.type == "disk") {
+			PartitionManager.Handle_Uevent(uevent_data);
+		}
 	}
 }
 
@@ -2871,56 +4218,100 @@ void TWPartitionManager::close_uevent() {
 
 void TWPartitionManager::Add_Partition(TWPartition* Part) {
 	Partitions.push_back(Part);
+	Rebuild_Partition_Index();
+	State_Changed();
 }
 
-void TWPartitionManager::Coldboot_Scan(std::vector<string> *sysfs_entries, const string& Path, int depth) {
-	string Real_Path = Path;
-	char real_path[PATH_MAX];
-	if (realpath(Path.c_str(), &real_path[0])) {
-		string Real_Path = real_path;
-		std::vector<string>::iterator iter;
-		for (iter = sysfs_entries->begin(); iter != sysfs_entries->end(); iter++) {
-			if (Real_Path.find((*iter)) != string::npos) {
-				string Write_Path = Real_Path + "/uevent";
-				if (TWFunc::Path_Exists(Write_Path)) {
-					const char* write_val = "add\n";
-					TWFunc::write_to_file(Write_Path, write_val);
-					break;
-				}
+// Prefix trie of the Sysfs_Entry patterns so each device path is matched
+// against all of them in one pass
+struct Sysfs_Trie {
+	struct Node {
+		std::map<char, size_t> next;
+		bool terminal;
+		Node() : terminal(false) {}
+	};
+	std::vector<Node> nodes;
+
+	Sysfs_Trie() : nodes(1) {}
+
+	void add(const string& pattern) {
+		size_t node = 0;
+		for (size_t i = 0; i < pattern.size(); i++) {
+			std::map<char, size_t>::iterator it = nodes[node].next.find(pattern[i]);
+			if (it == nodes[node].next.end()) {
+				nodes.push_back(Node());
+				nodes[node].next[pattern[i]] = nodes.size() - 1;
+				node = nodes.size() - 1;
+			} else {
+				node = it->second;
 			}
 		}
+		nodes[node].terminal = true;
 	}
 
-	DIR* d = opendir(Path.c_str());
-	if (d != NULL) {
-		struct dirent* de;
-		while ((de = readdir(d)) != NULL) {
-			if (de->d_name[0] == '.' || (de->d_type != DT_DIR && depth > 0))
-				continue;
-			if (strlen(de->d_name) >= 4 && (strncmp(de->d_name, "ram", 3) == 0 || strncmp(de->d_name, "loop", 4) == 0))
-				continue;
-
-			string item = Path + "/";
-			item.append(de->d_name);
-			Coldboot_Scan(sysfs_entries, item, depth + 1);
+	// True if any pattern occurs in path, same as path.find(pattern) for each
+	bool matches(const char* path) const {
+		for (const char* start = path; *start; start++) {
+			size_t node = 0;
+			for (const char* c = start; ; c++) {
+				if (nodes[node].terminal)
+					return true;
+				if (!*c)
+					break;
+				std::map<char, size_t>::const_iterator it = nodes[node].next.find(*c);
+				if (it == nodes[node].next.end())
+					break;
+				node = it->second;
+			}
 		}
-		closedir(d);
+		return false;
 	}
-}
+};
 
 void TWPartitionManager::Coldboot() {
 	std::vector<TWPartition*>::iterator iter;
-	std::vector<string> sysfs_entries;
+	Sysfs_Trie patterns;
+	bool have_patterns = false;
 
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
 		if (!(*iter)->Sysfs_Entry.empty()) {
 			size_t wildcard_pos = (*iter)->Sysfs_Entry.find("*");
 			if (wildcard_pos == string::npos)
 				wildcard_pos = (*iter)->Sysfs_Entry.size();
-			sysfs_entries.push_back((*iter)->Sysfs_Entry.substr(0, wildcard_pos));
+			patterns.add((*iter)->Sysfs_Entry.substr(0, wildcard_pos));
+			have_patterns = true;
 		}
 	}
+	if (!have_patterns)
+		return;
 
-	if (sysfs_entries.size() > 0)
-		Coldboot_Scan(&sysfs_entries, "/sys/block", 0);
+	// /sys/class/block links every disk and partition to its device folder,
+	// so one listing replaces walking the whole /sys/block tree
+	DIR* d = opendir("/sys/class/block");
+	if (d == NULL) {
+		LOGINFO("Unable to open /sys/class/block: %s\n", strerror(errno));
+		return;
+	}
+	char real_path[PATH_MAX];
+	string item;
+	struct dirent* de;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (strncmp(de->d_name, "ram", 3) == 0 || strncmp(de->d_name, "loop", 4) == 0)
+			continue;
+		item = "/sys/class/block/";
+		item += de->d_name;
+		if (!realpath(item.c_str(), real_path) || !patterns.matches(real_path))
+			continue;
+		item = real_path;
+		item += "/uevent";
+		int fd = open(item.c_str(), O_WRONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			if (write(fd, "add\n", 4) != 4)
+				LOGINFO("Unable to trigger '%s': %s\n", item.c_str(), strerror(errno));
+			close(fd);
+		}
+	}
+	closedir(d);
 }
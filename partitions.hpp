@@ -20,8 +20,11 @@
 #define __TWRP_Partition_Manager
 
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <vector>
 #include <string>
+#include <pthread.h>
 #include <sys/poll.h>
 #include "exclude.hpp"
 #include "tw_atomic.hpp"
@@ -61,14 +64,22 @@ enum PartitionManager_Op {                                                    //
 };
 
 class TWPartition;
+class twrpMediaIndex;
+class twrpTar;
+struct Backup_Plan;
+struct Wipe_Job;
 
 struct PartitionSettings {                                                    // Settings for backup session
 	TWPartition* Part;                                                        // Partition to pass to the partition backup loop
 	std::string Backup_Folder;                                                // Path to restore folder
 	bool adbbackup;                                                           // tell the system we are backing up over adb
-	bool adb_compression;                                                     // 0 == uncompressed, 1 == compressed
+	uint64_t adb_compression;                                                 // codec in the adb file header, 0 == uncompressed, 1 == gzip, 2 == LZ4
+	bool use_lz4;                                                             // compressed tar backups use LZ4 instead of gzip
+	uint32_t adb_stream;                                                      // adb backup stream the partition is sent on
+	uint64_t adb_resume_offset;                                               // where a resumed adb restore continues the image
 	bool generate_digest;                                                      // tell system to create digest for partitions
 	bool generate_md5;                                                        // tell system to create md5 for partitions
+	bool verify_digest;                                                       // check digests while the backup is read during restore
 	uint64_t total_restore_size;                                              // Total size of restored backup
 	uint64_t img_bytes_remaining;                                             // remaining img/emmc bytes to backup for progress indicator
 	uint64_t file_bytes_remaining;                                            // remaining file bytes to backup for progress indicator
@@ -79,6 +90,57 @@ struct PartitionSettings {                                                    //
 	int partition_count;                                                      // Number of partitions to restore
 	ProgressTracking *progress;                                               // Keep track of progress in GUI
 	enum PartitionManager_Op PM_Method;                                       // Current operation of backup or restore
+	Backup_Plan *plan;                                                        // Plan of the running backup, NULL if there is none
+};
+
+struct Backup_Timing {                                                        // Phase timings of one partition in a backup, for backup_timings.json
+	std::string Backup_Name;
+	std::string Block_Device;
+	std::string Rate_Key;                                                     // Settings variable holding the throughput model of this device and archive type
+	uint64_t bytes;
+	double backup_seconds;
+	double digest_seconds;
+};
+
+struct Backup_Plan_Item {                                                     // One partition of a backup plan
+	TWPartition* Part;
+	bool image_stream;                                                        // Backed up on the image thread or adb stream 1
+	uint64_t bytes;                                                           // Listed size of a file system, Backup_Size otherwise
+	uint64_t file_count;                                                      // 0 if the file system is listed in the tar fork
+	unsigned threads;                                                         // Archive threads, 0 if the tar fork decides
+	unsigned archives;                                                        // Files the partition should be written to, 0 if the tar fork decides
+	std::string codec;
+	double seconds;                                                           // From the measured rate of the device, 0 if not known yet
+	twrpTar* tar;                                                             // Set up tar of a file system, with its file list if it was listed
+};
+
+struct Backup_Plan {                                                          // What a backup will do, worked out before anything is written
+	Backup_Plan();
+	~Backup_Plan();
+	twrpTar* Take_Tar(TWPartition* Part);                                     // The listed tar of Part, owned by the caller from then on
+
+	std::vector<Backup_Plan_Item> items;                                      // In backup order, subpartitions after their parent
+	uint64_t file_bytes;
+	uint64_t img_bytes;
+	uint64_t free_space;                                                      // Of the current storage
+	double main_seconds;                                                      // Expected time of the calling thread
+	double image_seconds;                                                     // Expected time of the image thread
+	bool time_known;                                                          // Every partition has a measured rate
+	bool fits;                                                                // The backup fits the free space, or the check is off
+
+private:
+	Backup_Plan(const Backup_Plan&);
+	Backup_Plan& operator=(const Backup_Plan&);
+};
+
+enum Wipe_Kind {                                                              // What one wipe of Run_Wipes does
+	WIPE_PARTITION,                                                           // Wipe of the partition alone
+	WIPE_ENCRYPTION,                                                          // Wipe_Encryption of the partition
+	WIPE_PARTITION_ANDSEC,                                                    // .android_secure of the partition
+	WIPE_PATH,                                                                // Wipe_By_Path, with the sub-partitions
+	WIPE_DALVIK,
+	WIPE_MEDIA,                                                               // /data/media
+	WIPE_ANDSEC,                                                              // .android_secure of every partition that has one
 };
 
 enum Backup_Method_enum {
@@ -112,12 +174,14 @@ public:
 	bool Resize();                                                            // Resizes the current file system
 	bool Backup(PartitionSettings *part_settings, pid_t *tar_fork_pid);       // Backs up the partition to the folder specified
 	bool Restore(PartitionSettings *part_settings);                           // Restores the partition using the backup folder provided
+	bool Can_Backup_Used_Blocks(PartitionSettings *part_settings);            // Backup of a file system copies its used blocks instead of its files
 	unsigned long long Get_Restore_Size(PartitionSettings *part_settings);    // Returns the overall restore size of the backup
 	string Backup_Method_By_Name();                                           // Returns a string of the backup method for human readable output
 	bool Decrypt(string Password);                                            // Decrypts the partition, return 0 for failure and -1 for success
 	bool Wipe_Encryption();                                                   // Ignores wipe commands for /data/media devices and formats the original block device
 	void Check_FS_Type();                                                     // Checks the fs type using blkid, does not do anything on MTD / yaffs2 because this crashes on some devices
-	bool Update_Size(bool Display_Error);                                     // Updates size information
+	static void Invalidate_FS_Types();                                        // Forgets the cached blkid results after the contents of a device changed
+	bool Update_Size(bool Display_Error, bool Defer_Data_Media = false);      // Updates size information, Defer_Data_Media leaves the data media folder walk to Update_Data_Media_Size
 	void Recreate_Media_Folder();                                             // Recreates the /data/media folder
 	bool Flash_Image(PartitionSettings *part_settings);                                        // Flashes an image to the partition
 	void Change_Mount_Read_Only(bool new_value);                              // Changes Mount_Read_Only to new_value
@@ -151,7 +215,10 @@ private:
 	void Find_Actual_Block_Device();                                          // Determines the correct block device and stores it in Actual_Block_Device
 
 	void Apply_TW_Flag(const unsigned flag, const char* str, const bool val); // Apply custom twrp fstab flags
+	void Save_Slot_Details(int Slot);                                         // Keeps the resolved device, file system and sizes of the slot
+	void Switch_Slot(int Old_Slot, int New_Slot);                             // Swaps in the details of New_Slot, remounting if mounted
 	void Process_TW_Flags(char *flags, bool Display_Error, int fstab_ver);    // Process custom twrp fstab flags
+	void Process_TW_Flag(char *flag, bool Display_Error);                     // Process one flag of Process_TW_Flags
 	void Process_FS_Flags(const char *str);                                   // Process standard fstab fs flags
 	void Save_FS_Flags(const string& local_File_System, int local_Mount_Flags, const string& local_Mount_Options); // Saves fs flags to a vector in case there are multiple lines in a v2 fstab with different mount flags for different file systems
 	bool Is_File_System(string File_System);                                  // Checks to see if the file system given is considered a file system
@@ -163,7 +230,9 @@ private:
 	unsigned long long IOCTL_Get_Block_Size();                                // Finds the partition size using ioctl
 	bool Find_Partition_Size();                                               // Finds the partition size from /proc/partitions
 	unsigned long long Get_Size_Via_du(string Path, bool Display_Error);      // Uses du to get sizes
+	uint64_t Get_Data_Media_Size();                                           // Backup size of data media from Media_Index, walked when it cannot be watched
 	bool Wipe_EXT23(string File_System);                                      // Formats as ext3 or ext2
+	void Discard_Block_Device();                                              // Discards the part of the block device the file system will cover
 	bool Wipe_EXT4();                                                         // Formats using ext4, uses make_ext4fs when present
 	bool Wipe_FAT();                                                          // Formats as FAT if mkfs.fat exits otherwise rm -rf wipe
 	bool Wipe_EXFAT();                                                        // Formats as EXFAT
@@ -174,21 +243,28 @@ private:
 	bool Wipe_Data_Without_Wiping_Media();                                    // Uses rm -rf to wipe but does not wipe /data/media
 	bool Wipe_Data_Without_Wiping_Media_Func(const string& parent);           // Uses rm -rf to wipe but does not wipe /data/media
 	bool Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_pid);   // Backs up using tar for file systems
+	void Setup_Backup_Tar(twrpTar *tar, PartitionSettings *part_settings);    // Sets up tar to back up this partition
+	twrpTar* Plan_Backup_Tar(PartitionSettings *part_settings);               // Sets up the tar ahead and lists the files if it can, NULL if not mounted
 	bool Backup_Image(PartitionSettings *part_settings);                      // Backs up using raw read/write for emmc memory types
 	bool Raw_Read_Write(PartitionSettings *part_settings);
+	bool Backup_Used_Blocks(PartitionSettings *part_settings, pid_t *tar_fork_pid); // Sparse image of the used blocks, falls back to tar if they can't be read
+	bool Restore_Used_Blocks(PartitionSettings *part_settings);               // Flashes the sparse image of a used blocks backup
+	bool Remount_Read_Only(bool Read_Only);                                   // Switches a mounted file system between read only and read/write in place
 	bool Backup_Dump_Image(PartitionSettings *part_settings);                 // Backs up using dump_image for MTD memory types
 	string Get_Restore_File_System(PartitionSettings *part_settings);         // Returns the file system that was in place at the time of the backup
+	unsigned long long Get_Restore_Size(PartitionSettings *part_settings, const string& Backup_Folder); // Restore size of the archive in one backup folder
 	bool Restore_Tar(PartitionSettings *part_settings);                       // Restore using tar for file systems
 	bool Restore_Image(PartitionSettings *part_settings);                     // Restore using dd for images
 	bool Check_Restore_File_MD5(const string& Filename);                      // Verifies MD5 matches for a file before restoration
 	bool Get_Size_Via_statfs(bool Display_Error);                             // Get Partition size, used, and free space using statfs
-	bool Get_Size_Via_df(bool Display_Error);                                 // Get Partition size, used, and free space using df command
+	bool Get_Size_Via_df(bool Display_Error);                                 // Get Partition size, used, and free space like df does, from statfs on the mount point
+	bool Read_Size(bool Display_Error, bool Defer_Data_Media);                // Update_Size without telling the partition manager
 	bool Make_Dir(string Path, bool Display_Error);                           // Creates a directory if it doesn't already exist
+	bool Has_Settings_File();                                                 // The settings storage or /persist, which DataManager saves to
 	bool Find_MTD_Block_Device(string MTD_Name);                              // Finds the mtd block device based on the name from the fstab
 	void Recreate_AndSec_Folder(void);                                        // Recreates the .android_secure folder
 	bool Mount_Storage_Retry(bool Display_Error);                             // Tries multiple times with a half second delay to mount a device in case storage is slow to mount
 	bool Is_Sparse_Image(const string& Filename);                             // Determines if a file is in sparse image format
-	bool Flash_Sparse_Image(const string& Filename);                          // Flashes a sparse image using simg2img
 	bool Flash_Image_FI(const string& Filename, ProgressTracking *progress);  // Flashes an image to the partition using flash_image for mtd nand
 	void ExcludeAll(const string& path);                                      // Adds an exclusion for path to both the backup and wipe exclusion lists
 
@@ -218,6 +294,7 @@ private:
 	unsigned long long Free;                                                  // Overall free space
 	unsigned long long Backup_Size;                                           // Backup size -- may be different than used space especially when /data/media is present
 	unsigned long long Restore_Size;                                          // Restore size of the current restore operation
+	unsigned long long Restore_File_Count;                                    // Files in the archive of the current restore operation, 0 if the backup did not record it
 	bool Can_Be_Encrypted;                                                    // This partition might be encrypted, affects error handling, can only be true if crypto support is compiled in
 	bool Is_Encrypted;                                                        // This partition is thought to be encrypted -- it wouldn't mount for some reason, only avialble with crypto support
 	bool Is_Decrypted;                                                        // This partition has successfully been decrypted
@@ -244,7 +321,17 @@ private:
 	bool Mount_Read_Only;                                                     // Only mount this partition as read-only
 	bool Is_Adopted_Storage;                                                  // Indicates that this partition is for adopted storage (android_expand)
 	bool SlotSelect;                                                          // Partition has A/B slots
+
+	struct Slot_Details {                                                     // What Update_Size found for one slot of a SlotSelect partition
+		bool Valid;
+		bool Is_Present;
+		string Actual_Block_Device;
+		string Current_File_System;
+		unsigned long long Size, Used, Free, Backup_Size;
+	};
+	Slot_Details Slot_Cache[2];                                               // Index 0 is slot A, 1 is slot B
 	TWExclude backup_exclusions;                                              // Exclusions for file based backups
+	twrpMediaIndex* Media_Index;                                              // Keeps the data media size current, created on first use
 	TWExclude wipe_exclusions;                                                // Exclusions for file based wipes (data/media devices only)
 
 	struct partition_fs_flags_struct {                                        // This struct is used to store mount flags and options for different file systems for the same partition
@@ -269,7 +356,7 @@ public:
 	~TWPartitionManager() {}
 
 public:
-	int Process_Fstab(string Fstab_Filename, bool Display_Error);             // Parses the fstab and populates the partitions
+	int Process_Fstab(string Fstab_Filename, bool Display_Error, bool Update_Details = true); // Parses the fstab and populates the partitions, Update_Details false leaves the sizing to the caller
 	int Write_Fstab();                                                        // Creates /etc/fstab file that's used by the command line for mount commands
 	void Output_Partition_Logging();                                          // Outputs partition information to the log
 	void Output_Partition(TWPartition* Part);                                 // Outputs partition details to the log
@@ -281,8 +368,9 @@ public:
 	TWPartition* Find_Partition_By_Path(const string& Path);                  // Returns a pointer to a partition based on path
 	TWPartition* Find_Partition_By_Block_Device(const string& Block_Device);  // Returns a pointer to a partition based on block device
 	int Check_Backup_Name(bool Display_Error);                                // Checks the current backup name to ensure that it is valid
-	int Run_Backup(bool adbbackup);                                           // Initiates a backup in the current storage
+	int Run_Backup(bool adbbackup, const string& Plan_File = "");             // Initiates a backup in the current storage, only writes its plan to Plan_File if one is given
 	int Run_Restore(const string& Restore_Name);                              // Restores a backup
+	int Verify_Backups(bool Force);                                           // Checks the digests of every backup in the backups folder, skipping recently verified ones unless Force
 	bool Write_ADB_Stream_Header(uint64_t partition_count);                   // Write ADB header over twrpbu FIFO
 	bool Write_ADB_Stream_Trailer();                                          // Write ADB trailer over twrpbu FIFO
 	void Set_Restore_Files(string Restore_Name);                              // Used to gather a list of available backup partitions for the user to select for a restore
@@ -295,9 +383,11 @@ public:
 	int Wipe_Android_Secure();                                                // Wipes android secure
 	int Format_Data();                                                        // Really formats data on /data/media devices -- also removes encryption
 	int Wipe_Media_From_Data();                                               // Removes and recreates the media folder on /data/media devices
+	int Wipe_Paths(const std::vector<string>& Paths);                         // Wipes an advanced wipe list, the entries that do not depend on each other at the same time
 	int Repair_By_Path(string Path, bool Display_Error);                      // Repairs a partition based on path
 	int Resize_By_Path(string Path, bool Display_Error);                      // Resizes a partition based on path
-	void Update_System_Details();                                             // Updates fstab, file systems, sizes, etc.
+	void Update_System_Details(bool Defer_Data_Media = false);                // Updates fstab, file systems, sizes, etc. with data media sized in the background if Defer_Data_Media is set
+	void Wait_For_Data_Media_Size();                                          // Waits for a background data media size walk to finish
 	int Decrypt_Device(string Password);                                      // Attempt to decrypt any encrypted partitions
 	int usb_storage_enable(void);                                             // Enable USB storage mode
 	int usb_storage_disable(void);                                            // Disable USB storage mode
@@ -332,6 +422,7 @@ public:
 	void Set_Active_Slot(const string& Slot);                                 // Sets the active slot to A or B
 	string Get_Active_Slot_Suffix();                                          // Returns active slot _a or _b
 	string Get_Active_Slot_Display();                                         // Returns active slot A or B for display purposes
+	void Clear_Slot_Details();                                                // Forgets the cached details of both slots, after the other slot may have been flashed
 	struct pollfd uevent_pfd;                                                 // Used for uevent code
 	void Remove_Uevent_Devices(const string& sysfs_path);                     // Removes subpartitions from the Partitions vector for a matched uevent device
 	void Handle_Uevent(const Uevent_Block_Data& uevent_data);                 // Handle uevent data
@@ -340,26 +431,62 @@ public:
 	void read_uevent();                                                       // Reads uevent data into a buffer
 	void close_uevent();                                                      // Closes the uevent netlink socket
 	void Add_Partition(TWPartition* Part);                                    // Adds a new partition to the Partitions vector
+	bool Is_Mount_Point(const string& Path);                                  // Checks the kernel's mount table for something mounted on Path
+	unsigned int State_Version();                                             // Changes whenever partitions are mounted, unmounted, sized, found or renamed
+	void State_Changed();                                                     // Bumps State_Version after details of the partitions changed
 
 private:
 	void Setup_Settings_Storage_Partition(TWPartition* Part);                 // Sets up settings storage
 	void Setup_Android_Secure_Location(TWPartition* Part);                    // Sets up .android_secure if needed
 	bool Backup_Partition(struct PartitionSettings *part_settings);           // Backup the partitions based on type
+	string Backup_Rate_Key(TWPartition* Part);                                // Settings variable of the measured throughput for the partition's device and archive type
+	bool Plan_Backup(const string& Backup_List, PartitionSettings *part_settings, bool image_thread, Backup_Plan *plan);  // Lists and sizes the partitions once, false if none were found
+	void Add_Plan_Item(TWPartition* Part, PartitionSettings *part_settings, bool image_thread, Backup_Plan *plan);
+	bool Write_Backup_Plan(const Backup_Plan& plan, const string& Backup_Folder, const string& Plan_File);  // JSON for dry runs
+	void Record_Backup_Timing(TWPartition* Part, double backup_seconds, double digest_seconds);
+	void Write_Backup_Timings(const string& Backup_Folder);                   // Writes backup_timings.json and folds the rates into the model
+	void Add_Wipe_Job(std::vector<Wipe_Job>* jobs, Wipe_Kind Kind, TWPartition* Part, const string& Path);
+	bool Run_Wipes(std::vector<Wipe_Job>* jobs, bool Stop_On_Error);          // Runs the wipes that change different mount points at the same time
+	bool Run_Wipe_Job(Wipe_Job* job);
+	static void* Wipe_Job_Thread(void *cookie);
+	static void* Backup_Stream_Thread(void *cookie);                          // Backs up the partitions of an adb backup stream other than 0
+	static void* Restore_Stream_Thread(void *cookie);                         // Restores images while the file systems are restored on the calling thread
+	static void* Update_Size_Thread(void *cookie);                            // Updates the sizes of groups of partitions that do not share a mount
+	static void* Data_Media_Size_Thread(void *cookie);                        // Walks the data media partitions to find their backup sizes
+	void Set_Backup_Size_Values();                                            // Sets the backup size variables of the GUI from the partitions
+	void Set_Data_Size_Value();                                               // Sets TW_BACKUP_DATA_SIZE from the data partitions
 	TWPartition* Find_Partition_By_MTP_Storage_ID(unsigned int Storage_ID);   // Returns a pointer to a partition based on MTP Storage ID
 	bool Add_Remove_MTP_Storage(TWPartition* Part, int message_type);         // Adds or removes an MTP Storage partition
 	TWPartition* Find_Next_Storage(string Path, bool Exclude_Data_Media);
 	int Open_Lun_File(string Partition_Path, string Lun_File);
+	int Usb_Disk_Enable();                                                    // USB storage mode served from recovery through FunctionFS
+	int Usb_Disk_Disable();
 	void Post_Decrypt(const string& Block_Device);                            // Completes various post-decrypt tasks
-	void Coldboot_Scan(std::vector<string> *sysfs_entries, const string& Path, int depth); // Scans subfolders to find matches to the paths stored in sysfs_entries so we can trigger the uevent system to "re-add" devices
-	void Coldboot();                                                          // Starts the scan of the /sys/block folder
+	void Coldboot();                                                          // Triggers the uevent system to "re-add" the block devices matching a Sysfs_Entry
 	pid_t mtppid;
 	bool mtp_was_enabled;
 	int mtp_write_fd;
 	pid_t tar_fork_pid;                                                       // PID of twrpTar fork
 	Backup_Method_enum Backup_Method;                                         // Method used for backup
+	bool Read_Mount_Table();                                                  // Rereads /proc/self/mountinfo into mount_points, must hold mount_table_lock
+	bool Refresh_Mount_Table();                                               // Rereads the mount table if the kernel flagged a change, must hold mount_table_lock
+	unsigned int state_version;                                               // See State_Version
+	int mountinfo_fd;                                                         // Kept open, polls with POLLPRI when the mount table changes
+	std::set<string> mount_points;                                            // Mount points from the last read of mountinfo
+	pthread_mutex_t mount_table_lock;
+	pthread_t data_media_size_thread;
+	bool data_media_size_running;                                             // data_media_size_thread has been started and not joined yet
 
 private:
 	std::vector<TWPartition*> Partitions;                                     // Vector list of all partitions
+	void Rebuild_Partition_Index();                                           // Refills the lookup indexes below from Partitions
+	TWPartition* Find_Partition_By_Root(const char* Root, size_t Root_Len);    // Finds by mount point or symlink mount point without building a string
+	std::unordered_multimap<uint32_t, TWPartition*> path_index;               // Hash of Mount_Point and Symlink_Mount_Point
+	std::unordered_multimap<uint32_t, TWPartition*> block_device_index;       // Hash of Primary_Block_Device and Actual_Block_Device
+	std::unordered_map<unsigned int, TWPartition*> mtp_index;                 // MTP_Storage_ID
+	pthread_mutex_t index_lock;                                               // Lookups may come from several threads and rebuild the indexes
+	std::vector<Backup_Timing> backup_timings;                                // Partitions of the running backup, both threads
+	pthread_mutex_t backup_timings_lock;
 	string Active_Slot_Display;                                               // Current Active Slot (A or B) for display purposes
 };
 
@@ -196,8 +196,11 @@
    deflate streams for that purpose.  As a result, pigz uses a single thread
    (the main thread) for decompression, but will create three other threads for
    reading, writing, and check calculation, which can speed up decompression
-   under some circumstances.  Parallel decompression can be turned off by
-   specifying one process (-dp 1 or -tp 1).
+   under some circumstances.  The exception is a backup written by TWRP, which
+   is a series of independent gzip members with a table of them at the end.
+   Those members are decompressed in parallel by as many threads as there are
+   processes, and written in order.  Parallel decompression can be turned off
+   by specifying one process (-dp 1 or -tp 1).
 
    pigz requires zlib 1.2.1 or later to allow setting the dictionary when doing
    raw deflate.  Since zlib 1.2.3 corrects security vulnerabilities in zlib
@@ -2613,6 +2616,267 @@ local int outb(void *desc, unsigned char *buf, unsigned len)
     return 0;
 }
 
+#ifndef NOTHREAD
+/* --- parallel decompression of TWRP framed archives --- */
+
+/* TWRP writes its compressed backups as a series of independent gzip members,
+   or frames, each holding a few megabytes of the tar stream, followed by a
+   table of the frames and a footer.  The table and the footer are empty gzip
+   members that carry their data in an extra field, so that any gunzip just
+   sees more members and writes nothing for them.  When an input file has
+   such a footer, the frames are decompressed in parallel by procs threads,
+   and the output is written in order by the main thread.  The table entries
+   are the compressed length, uncompressed length, and crc-32 of each frame,
+   all little-endian four-byte values. */
+#define FRAME_ENTRY 12          /* length of one table entry */
+#define FRAME_FOOTER 16         /* "TWFT", version, frame count, table size */
+#define FRAME_RECORD 26         /* empty gzip member around an extra field */
+#define FRAME_VERSION 1
+
+/* a frame from the table */
+struct frame {
+    off_t at;                   /* offset of the gzip member in the input */
+    unsigned long len;          /* compressed length (whole gzip member) */
+    unsigned long ulen;         /* uncompressed length */
+    unsigned long check;        /* crc-32 of the uncompressed data */
+};
+
+/* a decompressed frame waiting to be written */
+struct frame_slot {
+    lock *ready;                /* frame number + 1 when out holds the frame */
+    int ok;                     /* true if the frame decompressed correctly */
+    unsigned char *in;          /* compressed data (allocated) */
+    size_t in_size;             /* allocated size of in */
+    unsigned char *out;         /* uncompressed data (allocated) */
+    size_t out_size;            /* allocated size of out */
+};
+
+local struct frame *frames = NULL;  /* table of frames (allocated) */
+local unsigned long frame_count;    /* number of frames in the table */
+local struct frame_slot *frame_slots;   /* frames in progress (allocated) */
+local unsigned long frame_ahead;    /* number of slots in frame_slots */
+local lock *frame_take;             /* number of the next frame to take */
+local lock *frame_room;             /* frames written + frame_ahead */
+
+/* get a little-endian four-byte value */
+#define LE4(p) ((p)[0] + ((unsigned)((p)[1]) << 8) + \
+                ((unsigned long)((p)[2]) << 16) + \
+                ((unsigned long)((p)[3]) << 24))
+
+/* return the length of the payload of the record at buf with the subfield id
+   'T', id, or 0 if there isn't one there */
+local size_t frame_record(unsigned char *buf, size_t len, int id)
+{
+    size_t xlen, sublen;
+
+    if (len < FRAME_RECORD || buf[0] != 0x1f || buf[1] != 0x8b ||
+            buf[2] != 8 || buf[3] != 4)
+        return 0;
+    xlen = buf[10] + ((size_t)(buf[11]) << 8);
+    sublen = buf[14] + ((size_t)(buf[15]) << 8);
+    if (buf[12] != 'T' || buf[13] != id || xlen != sublen + 4 ||
+            len < FRAME_RECORD + sublen || buf[12 + xlen] != 3 ||
+            buf[13 + xlen] != 0)
+        return 0;
+    return sublen;
+}
+
+/* read the frame table of the regular file ind into frames[], return the
+   number of frames, or 0 if ind is not a framed archive */
+local unsigned long frame_load(void)
+{
+    unsigned char foot[FRAME_RECORD + FRAME_FOOTER], *table, *entry;
+    unsigned long count, size, pos, sub, n;
+    off_t at;
+    struct stat st;
+
+    if (fstat(ind, &st) || (st.st_mode & S_IFMT) != S_IFREG ||
+            st.st_size < (off_t)sizeof(foot) ||
+            pread(ind, foot, sizeof(foot), st.st_size - sizeof(foot)) !=
+                (ssize_t)sizeof(foot) ||
+            frame_record(foot, sizeof(foot), 'F') != FRAME_FOOTER ||
+            memcmp(foot + 16, "TWFT", 4) || LE4(foot + 20) != FRAME_VERSION)
+        return 0;
+    count = LE4(foot + 24);
+    size = LE4(foot + 28);
+    if (count == 0 || size > st.st_size - sizeof(foot) ||
+            size / FRAME_ENTRY < count)
+        return 0;
+
+    /* read the table records and collect their entries */
+    table = malloc(size);
+    RELEASE(frames);
+    frames = malloc(count * sizeof(struct frame));
+    if (table == NULL || frames == NULL)
+        bail("not enough memory", "");
+    if (pread(ind, table, size, st.st_size - sizeof(foot) - size) !=
+            (ssize_t)size) {
+        free(table);
+        return 0;
+    }
+    at = 0;
+    n = 0;
+    for (pos = 0; pos < size; pos += FRAME_RECORD + sub) {
+        sub = frame_record(table + pos, size - pos, 'W');
+        if (sub == 0 || sub % FRAME_ENTRY || n + sub / FRAME_ENTRY > count)
+            break;
+        for (entry = table + pos + 16; entry < table + pos + 16 + sub;
+             entry += FRAME_ENTRY) {
+            frames[n].at = at;
+            frames[n].len = LE4(entry);
+            frames[n].ulen = LE4(entry + 4);
+            frames[n].check = LE4(entry + 8);
+            at += frames[n].len;
+            n++;
+        }
+    }
+    free(table);
+
+    /* the frames must cover the file up to the table */
+    if (pos != size || n != count ||
+            at + (off_t)size + (off_t)sizeof(foot) != st.st_size) {
+        complain("%s has a damaged frame table -- decoding serially", in);
+        return 0;
+    }
+    return count;
+}
+
+/* decompress frames until there are none left to take */
+local void frame_inflate(void *dummy)
+{
+    int ret;
+    unsigned long n;
+    struct frame *f;
+    struct frame_slot *s;
+    z_stream strm;
+
+    (void)dummy;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    if (inflateInit2(&strm, 15 + 16) != Z_OK)
+        bail("not enough memory", "");
+    for (;;) {
+        /* take the next frame, then wait for its slot to be written */
+        possess(frame_take);
+        n = peek_lock(frame_take);
+        twist(frame_take, BY, n < frame_count ? 1 : 0);
+        if (n >= frame_count)
+            break;
+        possess(frame_room);
+        wait_for(frame_room, TO_BE_MORE_THAN, n);
+        release(frame_room);
+        f = frames + n;
+        s = frame_slots + n % frame_ahead;
+
+        /* read and decompress the frame (one extra byte of output space
+           catches a frame that is longer than its table entry says) */
+        if (s->in_size < f->len) {
+            free(s->in);
+            s->in_size = f->len;
+            s->in = malloc(s->in_size);
+        }
+        if (s->out_size < f->ulen + 1) {
+            free(s->out);
+            s->out_size = f->ulen + 1;
+            s->out = malloc(s->out_size);
+        }
+        if (s->in == NULL || s->out == NULL)
+            bail("not enough memory", "");
+        s->ok = 0;
+        if (pread(ind, s->in, f->len, f->at) == (ssize_t)f->len &&
+                inflateReset(&strm) == Z_OK) {
+            strm.next_in = s->in;
+            strm.avail_in = f->len;
+            strm.next_out = s->out;
+            strm.avail_out = f->ulen + 1;
+            ret = inflate(&strm, Z_FINISH);
+            s->ok = ret == Z_STREAM_END && strm.avail_in == 0 &&
+                    strm.total_out == f->ulen && strm.adler == f->check;
+        }
+        Trace(("-- decompressed frame %lu", n));
+
+        /* hand the frame to the writer */
+        possess(s->ready);
+        twist(s->ready, TO, n + 1);
+    }
+    inflateEnd(&strm);
+}
+
+/* decompress or test a framed archive using procs threads, return true if
+   done, false if ind is not framed -- get_header(1) has been called */
+local int frame_infchk(void)
+{
+    int k;
+    unsigned long n;
+    struct frame_slot *s;
+
+    if (procs < 2 || list || (frame_count = frame_load()) == 0)
+        return 0;
+    Trace(("-- decompressing %lu frames in parallel", frame_count));
+
+    /* the frames are read with pread(), stop the read-ahead thread of
+       get_header() -- with ind at end of file its next read returns zero */
+    if (in_which != -1) {
+        possess(load_state);
+        wait_for(load_state, TO_BE, 0);
+        lseek(ind, 0, SEEK_END);
+        twist(load_state, TO, 1);
+        join(load_thread);
+        free_lock(load_state);
+        in_which = -1;
+    }
+
+    /* set up a few more slots than threads to keep the threads busy while
+       the frames are being written */
+    frame_ahead = procs * 2;
+    frame_slots = malloc(frame_ahead * sizeof(struct frame_slot));
+    if (frame_slots == NULL)
+        bail("not enough memory", "");
+    for (n = 0; n < frame_ahead; n++) {
+        frame_slots[n].ready = new_lock(0);
+        frame_slots[n].in = NULL;
+        frame_slots[n].in_size = 0;
+        frame_slots[n].out = NULL;
+        frame_slots[n].out_size = 0;
+    }
+    frame_take = new_lock(0);
+    frame_room = new_lock(frame_ahead);
+    for (k = 0; k < procs; k++)
+        launch(frame_inflate, NULL);
+
+    /* write the frames in order as they are completed */
+    out_tot = 0;
+    for (n = 0; n < frame_count; n++) {
+        s = frame_slots + n % frame_ahead;
+        possess(s->ready);
+        wait_for(s->ready, TO_BE, n + 1);
+        release(s->ready);
+        if (!s->ok)
+            bail("corrupted input -- invalid frame data: ", in);
+        if (decode == 1)
+            writen(outd, s->out, frames[n].ulen);
+        out_tot += frames[n].ulen;
+        possess(frame_room);
+        twist(frame_room, BY, 1);
+    }
+
+    /* join the threads and release the frame resources */
+    join_all();
+    free_lock(frame_room);
+    free_lock(frame_take);
+    for (n = 0; n < frame_ahead; n++) {
+        free_lock(frame_slots[n].ready);
+        free(frame_slots[n].out);
+        free(frame_slots[n].in);
+    }
+    free(frame_slots);
+    RELEASE(frames);
+    return 1;
+}
+#endif
+
 /* inflate for decompression or testing -- decompress from ind to outd unless
    decode != 1, in which case just test ind, and then also list if list != 0;
    look for and decode multiple, concatenated gzip and/or zlib streams;
@@ -2626,6 +2890,12 @@ local void infchk(void)
     unsigned long tmp4;
     off_t clen;
 
+#ifndef NOTHREAD
+    /* decompress TWRP framed archives in parallel */
+    if (frame_infchk())
+        return;
+#endif
+
     cont = 0;
     do {
         /* header already read -- set up for decompression */
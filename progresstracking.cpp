@@ -28,7 +28,7 @@
 #include "twrp-functions.hpp"
 #include <time.h>
 
-const int32_t update_interval_ms = 200; // Update interval in ms
+const int32_t update_interval_ms = PROGRESS_UPDATE_INTERVAL_MS; // Update interval in ms
 
 ProgressTracking::ProgressTracking(const unsigned long long backup_size) {
 	total_backup_size = backup_size;
@@ -39,15 +39,85 @@ ProgressTracking::ProgressTracking(const unsigned long long backup_size) {
 	previous_partitions_size = 0;
 	display_file_count = false;
 	clock_gettime(CLOCK_MONOTONIC, &last_update);
+	parent = NULL;
+	reported_size = 0;
+	reported_time = 0;
+	background_size = 0;
+	background_time = 0;
+	background_expected_time = 0;
+	expected_time = 0;
+	previous_partitions_time = 0;
+	partition_rate = 0;
+	next_partition_rate = 0;
+	pthread_mutex_init(&background_lock, NULL);
+}
+
+ProgressTracking::ProgressTracking(ProgressTracking *parent_progress) {
+	total_backup_size = 0;
+	partition_size = 0;
+	file_count = 0;
+	current_size = 0;
+	current_count = 0;
+	previous_partitions_size = 0;
+	display_file_count = false;
+	clock_gettime(CLOCK_MONOTONIC, &last_update);
+	parent = parent_progress;
+	reported_size = 0;
+	reported_time = 0;
+	background_size = 0;
+	background_time = 0;
+	background_expected_time = 0;
+	expected_time = 0;
+	previous_partitions_time = 0;
+	partition_rate = 0;
+	next_partition_rate = 0;
+	pthread_mutex_init(&background_lock, NULL);
+}
+
+ProgressTracking::~ProgressTracking() {
+	pthread_mutex_destroy(&background_lock);
+}
+
+void ProgressTracking::Add_Background_Progress(unsigned long long size, double time) {
+	pthread_mutex_lock(&background_lock);
+	background_size += size;
+	background_time += time;
+	pthread_mutex_unlock(&background_lock);
+}
+
+void ProgressTracking::SetExpectedTime(const double seconds) {
+	if (parent) {
+		pthread_mutex_lock(&parent->background_lock);
+		parent->background_expected_time = seconds;
+		pthread_mutex_unlock(&parent->background_lock);
+		return;
+	}
+	expected_time = seconds;
+}
+
+void ProgressTracking::SetPartitionRate(const unsigned long long rate) {
+	next_partition_rate = rate;
+}
+
+double ProgressTracking::Done_Time() {
+	if (partition_rate == 0)
+		return previous_partitions_time;
+	return previous_partitions_time + (double)current_size / (double)partition_rate;
 }
 
 void ProgressTracking::SetPartitionSize(const unsigned long long part_size) {
+	if (partition_rate != 0)
+		previous_partitions_time += (double)partition_size / (double)partition_rate;
+	partition_rate = next_partition_rate;
 	previous_partitions_size += partition_size;
 	partition_size = part_size;
 	UpdateDisplayDetails(true);
 }
 
 void ProgressTracking::SetSizeCount(const unsigned long long part_size, unsigned long long f_count) {
+	if (partition_rate != 0)
+		previous_partitions_time += (double)partition_size / (double)partition_rate;
+	partition_rate = next_partition_rate;
 	previous_partitions_size += partition_size;
 	partition_size = part_size;
 	file_count = f_count;
@@ -72,6 +142,17 @@ void ProgressTracking::DisplayFileCount(const bool display) {
 }
 
 void ProgressTracking::UpdateDisplayDetails(const bool force) {
+	if (parent) {
+		// Hand the progress of this job to the thread that owns the GUI
+		unsigned long long done = previous_partitions_size + current_size;
+		double done_time = Done_Time();
+		if (done > reported_size || done_time > reported_time) {
+			parent->Add_Background_Progress(done > reported_size ? done - reported_size : 0, done_time > reported_time ? done_time - reported_time : 0);
+			reported_size = done;
+			reported_time = done_time;
+		}
+		return;
+	}
 #ifndef BUILD_TWRPTAR_MAIN
 	if (!force) {
 		// Do something to check the time frame and only update periodically to reduce the total number of GUI updates
@@ -83,17 +164,31 @@ void ProgressTracking::UpdateDisplayDetails(const bool force) {
 			return;
 	}
 	clock_gettime(CLOCK_MONOTONIC, &last_update);
+	pthread_mutex_lock(&background_lock);
+	unsigned long long done_size = current_size + previous_partitions_size + background_size;
+	double remaining = expected_time - Done_Time();
+	if (background_expected_time - background_time > remaining)
+		remaining = background_expected_time - background_time; // the slower thread decides
+	bool have_estimate = expected_time > 0 || background_expected_time > 0;
+	pthread_mutex_unlock(&background_lock);
 	double display_percent = 0.0, progress_percent;
 	string size_prog = gui_lookup("size_progress", "%lluMB of %lluMB, %i%%");
 	char size_progress[1024];
 
 	if (total_backup_size != 0) // prevent division by 0
-		display_percent = (double)(current_size + previous_partitions_size) / (double)(total_backup_size) * 100;
-	sprintf(size_progress, size_prog.c_str(), (current_size + previous_partitions_size) / 1048576, total_backup_size / 1048576, (int)(display_percent));
+		display_percent = (double)(done_size) / (double)(total_backup_size) * 100;
+	sprintf(size_progress, size_prog.c_str(), done_size / 1048576, total_backup_size / 1048576, (int)(display_percent));
 	DataManager::SetValue("tw_size_progress", size_progress);
 	progress_percent = (display_percent / 100);
 	DataManager::SetProgress((float)(progress_percent));
 
+	if (have_estimate) {
+		char time_remaining[32];
+		int seconds = remaining > 0 ? (int)(remaining + 0.5) : 0;
+		sprintf(time_remaining, "%i:%02i", seconds / 60, seconds % 60);
+		DataManager::SetValue("tw_time_remaining", time_remaining);
+	}
+
 	if (!display_file_count || file_count == 0) {
 		DataManager::SetValue("tw_file_progress", "");
 	} else {
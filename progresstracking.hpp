@@ -20,12 +20,18 @@
 #define __PROGRESSTRACKING_HPP
 
 #include <time.h>
+#include <pthread.h>
+
+#define PROGRESS_UPDATE_INTERVAL_MS 200                                        // Display update interval, also the rate tar progress counters are polled at
 
 // Progress tracking class for tracking backup progess and updating the progress bar as appropriate
+
 class ProgressTracking
 {
 public:
 	ProgressTracking(const unsigned long long backup_size);
+	ProgressTracking(ProgressTracking *parent_progress);                     // Tracks a job running on another thread, only adds its bytes to parent_progress
+	~ProgressTracking();
 
 	void SetPartitionSize(const unsigned long long part_size);
 	void SetSizeCount(const unsigned long long part_size, unsigned long long f_count);
@@ -36,6 +42,9 @@ public:
 	void DisplayFileCount(const bool display);
 	void UpdateDisplayDetails(const bool force);
 
+	void SetExpectedTime(const double seconds);                              // Time the jobs on this thread should take by the throughput model, shown as tw_time_remaining
+	void SetPartitionRate(const unsigned long long rate);                    // Expected bytes per second of the partitions that follow, 0 if unknown
+
 private:
 	unsigned long long total_backup_size;              // Overall size (for the progress bar)
 
@@ -49,6 +58,21 @@ private:
 
 	bool display_file_count;                           // Inidicates if we will display the file count text
 	timespec last_update;                              // Tracks last update of the displayed progress (frequent updates tax the CPU and slow us down)
+
+	double expected_time;                              // Expected seconds for all partitions on this thread, 0 if unknown
+	double previous_partitions_time;                   // Expected seconds of the partitions already done
+	unsigned long long partition_rate;                 // Expected bytes per second of the current partition
+	unsigned long long next_partition_rate;            // Rate set for the partitions that follow
+	double Done_Time();                                // Expected seconds of the work done so far
+
+	void Add_Background_Progress(unsigned long long size, double time);
+	ProgressTracking *parent;                          // Set for a job on another thread, which never updates the GUI itself
+	unsigned long long reported_size;                  // Bytes of this job already added to the parent
+	double reported_time;                              // Expected seconds of this job already added to the parent
+	unsigned long long background_size;                // Bytes done by jobs on other threads, guarded by background_lock
+	double background_time;                            // Expected seconds of the work done on other threads
+	double background_expected_time;                   // Expected seconds of all jobs on other threads
+	pthread_mutex_t background_lock;
 };
 
 #endif //__PROGRESSTRACKING_HPP
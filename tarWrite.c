@@ -17,75 +17,145 @@
 */
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "libtar/libtar.h"
+#include "tarWrite.h"
 #include "twcommon.h"
 
-int flush = 0, eot_count = -1;
-unsigned char *write_buffer;
-unsigned buffer_size = 4096;
-unsigned buffer_loc = 0;
-int buffer_status = 0;
-int prog_pipe = -1;
-const unsigned long long progress_size = (unsigned long long)(T_BLOCKSIZE);
-
-void reinit_libtar_buffer(void) {
-	flush = 0;
-	eot_count = -1;
-	buffer_loc = 0;
-	buffer_status = 1;
+#define TAR_WRITE_MAX_FD 1024
+
+/* Buffer state of one archive, looked up by the fd libtar writes to so
+   each thread can have its own buffered archive */
+struct libtar_buffer {
+	unsigned char *data;
+	unsigned size;
+	unsigned loc;
+	int flush;
+	int eot_count;
+	struct tar_progress_slot *progress;
+};
+
+static struct libtar_buffer *buffer_table[TAR_WRITE_MAX_FD];
+static pthread_mutex_t buffer_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct libtar_buffer* find_libtar_buffer(int fd) {
+	struct libtar_buffer *buf = NULL;
+
+	if (fd < 0 || fd >= TAR_WRITE_MAX_FD)
+		return NULL;
+	pthread_mutex_lock(&buffer_table_lock);
+	buf = buffer_table[fd];
+	pthread_mutex_unlock(&buffer_table_lock);
+	return buf;
 }
 
-void init_libtar_buffer(unsigned new_buff_size, int pipe_fd) {
-	if (new_buff_size != 0)
-		buffer_size = new_buff_size;
+static int add_libtar_buffer(int fd, unsigned size, struct tar_progress_slot *progress) {
+	struct libtar_buffer *buf;
+	void *data = NULL;
+
+	if (fd < 0 || fd >= TAR_WRITE_MAX_FD) {
+		LOGERR("Invalid tar fd %i\n", fd);
+		return -1;
+	}
+	buf = (struct libtar_buffer*) calloc(1, sizeof(struct libtar_buffer));
+	if (buf == NULL)
+		return -1;
+	if (size != 0 && posix_memalign(&data, TAR_WRITE_BUFFER_ALIGN, size) != 0) {
+		LOGERR("Unable to allocate %u byte tar buffer\n", size);
+		free(buf);
+		return -1;
+	}
+	buf->data = (unsigned char*) data;
+	buf->size = size;
+	buf->eot_count = -1;
+	buf->progress = progress;
 
-	reinit_libtar_buffer();
-	write_buffer = (unsigned char*) malloc(sizeof(char *) * buffer_size);
-	prog_pipe = pipe_fd;
+	pthread_mutex_lock(&buffer_table_lock);
+	if (buffer_table[fd] != NULL) {
+		free(buffer_table[fd]->data);
+		free(buffer_table[fd]);
+	}
+	buffer_table[fd] = buf;
+	pthread_mutex_unlock(&buffer_table_lock);
+	return 0;
 }
 
-void free_libtar_buffer(void) {
-	if (buffer_status > 0)
-		free(write_buffer);
-	buffer_status = 0;
-	prog_pipe = -1;
+void reinit_libtar_buffer(int fd) {
+	struct libtar_buffer *buf = find_libtar_buffer(fd);
+
+	if (buf == NULL)
+		return;
+	buf->flush = 0;
+	buf->eot_count = -1;
+	buf->loc = 0;
+}
+
+int init_libtar_buffer(int fd, unsigned new_buff_size, struct tar_progress_slot *progress) {
+	if (new_buff_size == 0)
+		new_buff_size = TAR_WRITE_BUFFER_SIZE;
+	if (new_buff_size < TAR_WRITE_BUFFER_MIN)
+		new_buff_size = TAR_WRITE_BUFFER_MIN;
+	if (new_buff_size > TAR_WRITE_BUFFER_MAX)
+		new_buff_size = TAR_WRITE_BUFFER_MAX;
+	// Whole pages and whole tar blocks, so a block never straddles a flush
+	new_buff_size = (new_buff_size + TAR_WRITE_BUFFER_ALIGN - 1) & ~(TAR_WRITE_BUFFER_ALIGN - 1);
+	return add_libtar_buffer(fd, new_buff_size, progress);
+}
+
+void free_libtar_buffer(int fd) {
+	struct libtar_buffer *buf = NULL;
+
+	if (fd < 0 || fd >= TAR_WRITE_MAX_FD)
+		return;
+	pthread_mutex_lock(&buffer_table_lock);
+	buf = buffer_table[fd];
+	buffer_table[fd] = NULL;
+	pthread_mutex_unlock(&buffer_table_lock);
+	if (buf != NULL) {
+		free(buf->data);
+		free(buf);
+	}
 }
 
 ssize_t write_libtar_buffer(int fd, const void *buffer, size_t size) {
-	void* ptr;
-
-	if (flush == 0) {
-		ptr = write_buffer + buffer_loc;
-		memcpy(ptr, buffer, size);
-		buffer_loc += size;
-		if (eot_count >= 0 && eot_count < 2)
-			eot_count++;
+	struct libtar_buffer *buf = find_libtar_buffer(fd);
+
+	if (buf == NULL || buf->data == NULL)
+		return write(fd, buffer, size);
+	if (buf->loc + size > buf->size) {
+		LOGERR("Tar write of %zu bytes does not fit the buffer\n", size);
+		return -1;
+	}
+	if (buf->flush == 0) {
+		memcpy(buf->data + buf->loc, buffer, size);
+		buf->loc += size;
+		if (buf->eot_count >= 0 && buf->eot_count < 2)
+			buf->eot_count++;
 			/* At the end of the tar file, libtar will add 2 blank blocks.
 			   Once we have received both EOT blocks, we will immediately
 			   write anything in the buffer to the file.
 			*/
 
-		if (buffer_loc >= buffer_size || eot_count >= 2) {
-			flush = 1;
+		if (buf->loc >= buf->size || buf->eot_count >= 2) {
+			buf->flush = 1;
 		}
 	}
-	if (flush == 1) {
-		flush = 0;
-		if (buffer_loc == 0) {
+	if (buf->flush == 1) {
+		buf->flush = 0;
+		if (buf->loc == 0) {
 			// nothing to write
 			return 0;
 		}
-		if (write(fd, write_buffer, buffer_loc) != (int)buffer_loc) {
+		if (write(fd, buf->data, buf->loc) != (ssize_t)buf->loc) {
 			LOGERR("Error writing tar file!\n");
-			buffer_loc = 0;
+			buf->loc = 0;
 			return -1;
 		} else {
-			unsigned long long fs = (unsigned long long)(buffer_loc);
-			write(prog_pipe, &fs, sizeof(fs));
-			buffer_loc = 0;
+			tar_progress_add(buf->progress, buf->loc, 0);
+			buf->loc = 0;
 			return size;
 		}
 	} else {
@@ -96,18 +166,20 @@ ssize_t write_libtar_buffer(int fd, const void *buffer, size_t size) {
 }
 
 void flush_libtar_buffer(int fd) {
-	eot_count = 0;
-	if (buffer_status)
-		buffer_status = 2;
+	struct libtar_buffer *buf = find_libtar_buffer(fd);
+
+	if (buf != NULL)
+		buf->eot_count = 0;
 }
 
-void init_libtar_no_buffer(int pipe_fd) {
-	buffer_size = T_BLOCKSIZE;
-	prog_pipe = pipe_fd;
-	buffer_status = 0;
+int init_libtar_no_buffer(int fd, struct tar_progress_slot *progress) {
+	return add_libtar_buffer(fd, 0, progress);
 }
 
 ssize_t write_libtar_no_buffer(int fd, const void *buffer, size_t size) {
-	write(prog_pipe, &progress_size, sizeof(progress_size));
+	struct libtar_buffer *buf = find_libtar_buffer(fd);
+
+	if (buf != NULL)
+		tar_progress_add(buf->progress, T_BLOCKSIZE, 0);
 	return write(fd, buffer, size);
 }
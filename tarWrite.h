@@ -19,13 +19,26 @@
 #ifndef _TARWRITE_HEADER
 #define _TARWRITE_HEADER
 
-void reinit_libtar_buffer();
-void init_libtar_buffer(unsigned new_buff_size, int pipe_fd);
-void free_libtar_buffer();
-writefunc_t write_libtar_buffer(int fd, const void *buffer, size_t size);
+#ifndef TW_TAR_BUFFER_SIZE_MB
+#define TW_TAR_BUFFER_SIZE_MB 1
+#endif
+#if TW_TAR_BUFFER_SIZE_MB < 1 || TW_TAR_BUFFER_SIZE_MB > 8
+#error "TW_TAR_BUFFER_SIZE_MB must be between 1 and 8"
+#endif
+
+#define TAR_WRITE_BUFFER_SIZE (TW_TAR_BUFFER_SIZE_MB * 1024 * 1024) // Default buffer size of an archive
+#define TAR_WRITE_BUFFER_MIN (1024 * 1024)
+#define TAR_WRITE_BUFFER_MAX (8 * 1024 * 1024)
+#define TAR_WRITE_BUFFER_ALIGN 4096
+
+/* Buffers are kept per fd, every archive open at the same time gets its own */
+void reinit_libtar_buffer(int fd);
+int init_libtar_buffer(int fd, unsigned new_buff_size, struct tar_progress_slot *progress);
+void free_libtar_buffer(int fd);
+ssize_t write_libtar_buffer(int fd, const void *buffer, size_t size);
 void flush_libtar_buffer(int fd);
 
-void init_libtar_no_buffer(int pipe_fd);
-writefunc_t write_libtar_no_buffer(int fd, const void *buffer, size_t size);
+int init_libtar_no_buffer(int fd, struct tar_progress_slot *progress);
+ssize_t write_libtar_no_buffer(int fd, const void *buffer, size_t size);
 
 #endif  // _TARWRITE_HEADER
@@ -222,3 +222,90 @@ LOCAL_STATIC_LIBRARIES := \
 LOCAL_SHARED_LIBRARIES := \
     liblog
 include $(BUILD_HOST_NATIVE_TEST)
+
+# Benchmarks, run against a host build of twrpTar
+include $(CLEAR_VARS)
+LOCAL_CFLAGS := -Wall -Werror -D_FILE_OFFSET_BITS=64
+LOCAL_MODULE := recovery_tar_benchmark
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_C_INCLUDES := \
+    bootable/recovery \
+    bootable/recovery/twrpDigest
+LOCAL_SRC_FILES := \
+    benchmark/tar_benchmark.cpp \
+    benchmark/benchmark_util.cpp \
+    ../twrpDigest/twrpDigest.cpp \
+    ../twrpDigest/twrpMD5.cpp \
+    ../twrpDigest/twrpSHA.cpp \
+    ../twrpDigest/digest/md5/md5.c
+LOCAL_STATIC_LIBRARIES := \
+    libcrypto
+include $(BUILD_HOST_EXECUTABLE)
+
+# MTP benchmark, drives libtwrpmtp in process over a socket pair
+include $(CLEAR_VARS)
+LOCAL_CFLAGS := -Wall -Werror -D_FILE_OFFSET_BITS=64 -DMTP_DEVICE -DMTP_HOST
+LOCAL_MODULE := recovery_mtp_benchmark
+LOCAL_MODULE_TAGS := optional
+LOCAL_C_INCLUDES := \
+    bootable/recovery \
+    bootable/recovery/mtp \
+    frameworks/base/include \
+    system/core/include
+LOCAL_SRC_FILES := \
+    benchmark/mtp_benchmark.cpp \
+    benchmark/benchmark_util.cpp
+LOCAL_SHARED_LIBRARIES := \
+    libtwrpmtp \
+    libutils \
+    libcutils
+include $(BUILD_EXECUTABLE)
+
+# blockimg benchmark, replays synthetic or real transfer lists on file backed images
+include $(CLEAR_VARS)
+LOCAL_CFLAGS := -Wall -Werror -D_FILE_OFFSET_BITS=64
+LOCAL_MODULE := recovery_blockimg_benchmark
+LOCAL_MODULE_TAGS := optional
+LOCAL_C_INCLUDES := bootable/recovery
+LOCAL_SRC_FILES := \
+    benchmark/blockimg_benchmark.cpp \
+    benchmark/benchmark_util.cpp
+LOCAL_SHARED_LIBRARIES := \
+    libhidlbase
+LOCAL_STATIC_LIBRARIES := \
+    libapplypatch \
+    libedify \
+    libimgdiff \
+    libimgpatch \
+    libbsdiff \
+    libbspatch \
+    libotafault \
+    libupdater \
+    libotautil \
+    libmounts \
+    libdivsufsort \
+    libdivsufsort64 \
+    libfs_mgr \
+    libvintf_recovery \
+    libvintf \
+    libhidl-gen-utils \
+    libtinyxml2 \
+    libselinux \
+    libext4_utils \
+    libsparse \
+    libcrypto_utils \
+    libcrypto \
+    libbz \
+    libziparchive \
+    liblog \
+    libutils \
+    libz \
+    libbase \
+    libtune2fs \
+    libfec \
+    libfec_rs \
+    libsquashfs_utils \
+    libcutils \
+    libbrotli \
+    $(tune2fs_static_libraries)
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,99 @@
+/*
+	Copyright 2012 to 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+
+#include "benchmark_util.h"
+
+#define BENCHMARK_WRITE_SIZE (256 * 1024)
+
+uint64_t Next_Random(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+double Now(void) {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double Median(std::vector<double> values) {
+	if (values.empty())
+		return 0;
+	std::sort(values.begin(), values.end());
+	size_t mid = values.size() / 2;
+	if (values.size() % 2)
+		return values[mid];
+	return (values[mid - 1] + values[mid]) / 2;
+}
+
+double Percentile(std::vector<double> values, unsigned percent) {
+	if (values.empty())
+		return 0;
+	std::sort(values.begin(), values.end());
+	return values[(values.size() - 1) * percent / 100];
+}
+
+static int Remove_Entry(const char *path, const struct stat *st __attribute__((unused)), int flag __attribute__((unused)), struct FTW *ftw __attribute__((unused))) {
+	return remove(path);
+}
+
+void Remove_Tree(const std::string& path) {
+	struct stat st;
+	if (lstat(path.c_str(), &st) == 0)
+		nftw(path.c_str(), Remove_Entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+bool Make_Dir(const std::string& path) {
+	return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+bool Write_File(const std::string& path, uint64_t size, const std::function<void(unsigned char*, size_t)>& fill) {
+	static unsigned char buffer[BENCHMARK_WRITE_SIZE];
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to create '%s': %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	while (size > 0) {
+		size_t len = (size_t)std::min(size, (uint64_t)sizeof(buffer));
+		fill(buffer, len);
+		if (write(fd, buffer, len) != (ssize_t)len) {
+			fprintf(stderr, "Unable to write '%s': %s\n", path.c_str(), strerror(errno));
+			close(fd);
+			return false;
+		}
+		size -= len;
+	}
+	return close(fd) == 0;
+}
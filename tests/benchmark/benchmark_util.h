@@ -0,0 +1,42 @@
+/*
+	Copyright 2012 to 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __TWRP_BENCHMARK_UTIL
+#define __TWRP_BENCHMARK_UTIL
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Helpers shared by the benchmarks in this folder. Every benchmark writes its
+// results to stdout as JSON with a fixed layout and a format version, so runs
+// from different releases can be compared, and its progress to stderr.
+
+uint64_t Next_Random(uint64_t *state);                                   // xorshift, the same seed gives the same data
+double Now(void);                                                        // Monotonic clock, in seconds
+double Median(std::vector<double> values);                               // 0 when there are no values
+double Percentile(std::vector<double> values, unsigned percent);         // Nearest rank, 0 when there are no values
+void Remove_Tree(const std::string& path);                               // Does nothing if path is missing
+bool Make_Dir(const std::string& path);                                  // Also true if path already exists
+bool Write_File(const std::string& path, uint64_t size,
+	const std::function<void(unsigned char*, size_t)>& fill);             // fill provides the data in chunks of up to 256 KiB
+
+#endif // __TWRP_BENCHMARK_UTIL
@@ -0,0 +1,653 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Replay speed of block_image_update, the engine of block based OTAs. A
+// synthetic source image and a transfer list with every kind of command
+// (new, zero, move, stash, bsdiff, imgdiff) are generated in the work
+// folder, or a transfer list from a real package is replayed against a copy
+// of its source image. Every run verifies and updates the image in a child
+// process, so the peak memory of the update is the child's rusage. The time
+// per command type, the hash time and the stash I/O are the statistics
+// blockimg logs to the command pipe.
+//
+//   recovery_blockimg_benchmark --blocks 32768 --runs 3 > bench.json
+//   recovery_blockimg_benchmark --replay system.transfer.list system.new.dat.br system.patch.dat system.img
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <android-base/stringprintf.h>
+#include <bsdiff/bsdiff.h>
+#include <openssl/sha.h>
+#include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
+#include <zlib.h>
+
+#include "applypatch/imgdiff.h"
+#include "benchmark_util.h"
+#include "edify/expr.h"
+#include "otautil/SysUtil.h"
+#include "otautil/cache_location.h"
+#include "otautil/print_sha1.h"
+#include "updater/blockimg.h"
+#include "updater/install.h"
+#include "updater/updater.h"
+
+#define BENCHMARK_FORMAT_VERSION 1
+#define BENCHMARK_BLOCK_SIZE 4096
+#define BENCHMARK_IMAGE "system"                   // blockimg names its statistics after the image
+#define BENCHMARK_WINDOW 16                         // Sources are at most this many chunks away
+
+struct selabel_handle *sehandle = nullptr;
+
+enum Command_Type {
+	CMD_NEW,
+	CMD_ZERO,
+	CMD_MOVE,
+	CMD_BSDIFF,
+	CMD_IMGDIFF,
+	CMD_TYPES
+};
+
+static const char* command_names[CMD_TYPES] = { "new", "zero", "move", "bsdiff", "imgdiff" };
+
+struct Benchmark_Options {
+	std::string workdir;                               // Images, packages and stashes are made in here
+	unsigned blocks;                                   // Size of the synthetic image
+	unsigned chunk;                                    // Blocks written by each synthetic command
+	unsigned mix[CMD_TYPES];                           // Weight of each command type
+	unsigned stash;                                    // Percent of the sources that are stashed first
+	int runs;                                          // Each result is the median of this many runs
+	bool keep;                                         // Leave the work folder behind
+	std::vector<std::string> replay;                   // transfer list, new data, patch data, source image
+};
+
+struct Benchmark_Package {
+	std::string name;
+	std::string zip;
+	std::string source;                                // Copied over the image before each run
+	std::string transfer_list;                         // Entry names in the zip
+	std::string new_data;
+	std::string patch_data;
+	std::string target_hash;                           // Empty when replaying
+	unsigned commands[CMD_TYPES];
+	uint64_t blocks;
+};
+
+struct Run_Result {
+	bool ok;
+	double verify_ms;
+	double update_ms;
+	long peak_kb;
+	bool verified;
+	std::map<std::string, uint64_t> stats;             // blockimg statistics without the image suffix
+};
+
+static void Fill_Text(unsigned char *buffer, size_t len, uint64_t *state) {
+	static const char* words[] = {
+		"recovery", "system", "vendor", "block", "image", "update", "android", "partition",
+		"library", "framework", "resource", "the", "of", "and", "0x00", "data", "class", "init",
+	};
+	size_t pos = 0;
+
+	while (pos < len) {
+		uint64_t r = Next_Random(state);
+		const char* word = words[r % (sizeof(words) / sizeof(words[0]))];
+		for (const char* c = word; *c && pos < len; c++)
+			buffer[pos++] = *c;
+		if (pos < len)
+			buffer[pos++] = (r >> 32) % 7 ? ' ' : (unsigned char)(r >> 40);
+	}
+}
+
+// Rewrites a few short runs and swaps two regions, the length stays the same
+static void Mutate(std::vector<unsigned char> *data, uint64_t *state) {
+	size_t len = data->size();
+
+	for (size_t n = len / 2048; n > 0; n--) {
+		size_t pos = Next_Random(state) % len;
+		size_t run = std::min<size_t>(1 + Next_Random(state) % 16, len - pos);
+		Fill_Text(data->data() + pos, run, state);
+	}
+	if (len >= 4 * BENCHMARK_BLOCK_SIZE) {
+		size_t half = len / 2;
+		std::rotate(data->begin(), data->begin() + half / 2, data->begin() + half);
+	}
+}
+
+static std::string Sha1(const unsigned char *data, size_t len) {
+	uint8_t digest[SHA_DIGEST_LENGTH];
+	SHA1(data, len, digest);
+	return print_sha1(digest);
+}
+
+static std::string Range(uint64_t start, uint64_t blocks) {
+	return android::base::StringPrintf("2,%" PRIu64 ",%" PRIu64, start, start + blocks);
+}
+
+// Gzip member of text, zero padded to len, in the form imgdiff splits out
+static bool Gzip(const std::vector<unsigned char>& text, size_t len, std::vector<unsigned char> *out) {
+	z_stream strm;
+
+	memset(&strm, 0, sizeof(strm));
+	if (deflateInit2(&strm, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+	out->assign(len, 0);
+	strm.next_in = const_cast<unsigned char*>(text.data());
+	strm.avail_in = text.size();
+	strm.next_out = out->data();
+	strm.avail_out = len;
+	int ret = deflate(&strm, Z_FINISH);
+	deflateEnd(&strm);
+	return ret == Z_STREAM_END;
+}
+
+static bool Bsdiff(const std::vector<unsigned char>& src, const std::vector<unsigned char>& tgt, const std::string& workdir, std::string *patch) {
+	std::string path = workdir + "/patch.tmp";
+
+	if (bsdiff::bsdiff(src.data(), src.size(), tgt.data(), tgt.size(), path.c_str(), nullptr) != 0)
+		return false;
+	return android::base::ReadFileToString(path, patch);
+}
+
+static bool Imgdiff(const std::vector<unsigned char>& src, const std::vector<unsigned char>& tgt, const std::string& workdir, std::string *patch) {
+	std::string src_path = workdir + "/src.tmp", tgt_path = workdir + "/tgt.tmp", patch_path = workdir + "/patch.tmp";
+
+	if (!android::base::WriteStringToFile(std::string(src.begin(), src.end()), src_path) ||
+		!android::base::WriteStringToFile(std::string(tgt.begin(), tgt.end()), tgt_path))
+		return false;
+	std::vector<const char*> args = { "imgdiff", src_path.c_str(), tgt_path.c_str(), patch_path.c_str() };
+	if (imgdiff(args.size(), args.data()) != 0)
+		return false;
+	return android::base::ReadFileToString(patch_path, patch);
+}
+
+static bool Write_Package(const std::string& path, const std::vector<std::pair<std::string, std::string> >& entries) {
+	FILE* fp = fopen(path.c_str(), "wb");
+	if (!fp)
+		return false;
+	ZipWriter writer(fp);
+	for (size_t i = 0; i < entries.size(); i++) {
+		// Stored, blockimg maps patch data straight out of the package
+		if (writer.StartEntry(entries[i].first.c_str(), 0) != 0 ||
+			(!entries[i].second.empty() && writer.WriteBytes(entries[i].second.data(), entries[i].second.size()) != 0) ||
+			writer.FinishEntry() != 0) {
+			fclose(fp);
+			return false;
+		}
+	}
+	bool ok = writer.Finish() == 0;
+	return fclose(fp) == 0 && ok;
+}
+
+// The commands run in chunk order and each writes its own chunk, so a source
+// at or after the chunk being written still has its original contents. An
+// earlier source was overwritten already and is stashed before its own
+// command runs, the way real transfer lists keep moved data around.
+static bool Generate_Package(const Benchmark_Options& options, Benchmark_Package *package) {
+	unsigned chunks = options.blocks / options.chunk;
+	size_t chunk_bytes = (size_t)options.chunk * BENCHMARK_BLOCK_SIZE;
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	unsigned weights = 0, i;
+	std::vector<unsigned> type(chunks), source(chunks);
+	std::vector<bool> stashed(chunks, false);
+	std::vector<std::vector<unsigned char> > text(chunks);
+	std::vector<unsigned char> image, target;
+	std::string new_data, patch_data;
+	std::vector<std::string> lines;
+	unsigned stash_blocks = 0, max_stash_blocks = options.chunk, stash_entries = 0, max_stash_entries = 1;
+
+	for (i = 0; i < CMD_TYPES; i++)
+		weights += options.mix[i];
+	if (chunks < 2 || weights == 0)
+		return false;
+	for (i = 0; i < chunks; i++) {
+		unsigned pick = Next_Random(&state) % weights, t = 0;
+		while (pick >= options.mix[t])
+			pick -= options.mix[t++];
+		type[i] = t;
+	}
+
+	// imgdiff sources are gzip members of text, every other chunk is text
+	image.resize(chunks * chunk_bytes);
+	for (i = 0; i < chunks; i++) {
+		unsigned char *chunk = image.data() + i * chunk_bytes;
+		if (type[i] != CMD_IMGDIFF) {
+			Fill_Text(chunk, chunk_bytes, &state);
+			continue;
+		}
+		std::vector<unsigned char> gzip;
+		size_t len = chunk_bytes * 2;
+		do {
+			len -= len / 8;
+			text[i].resize(len);
+			Fill_Text(text[i].data(), len, &state);
+		} while (!Gzip(text[i], chunk_bytes * 7 / 8, &gzip));
+		memcpy(chunk, gzip.data(), gzip.size());
+		memset(chunk + gzip.size(), 0, chunk_bytes - gzip.size());
+	}
+
+	// Sources: imgdiff diffs another gzip chunk, move and bsdiff read any text
+	// chunk nearby, move never reads its own chunk since that would be a no-op
+	for (i = 0; i < chunks; i++) {
+		unsigned t = type[i];
+		source[i] = i;
+		if (t != CMD_MOVE && t != CMD_BSDIFF && t != CMD_IMGDIFF)
+			continue;
+		unsigned first = i >= BENCHMARK_WINDOW ? i - BENCHMARK_WINDOW : 0;
+		unsigned last = std::min(chunks, i + BENCHMARK_WINDOW);
+		bool back = i > 0 && Next_Random(&state) % 100 < options.stash;
+		for (unsigned tries = 0; tries < BENCHMARK_WINDOW; tries++) {
+			unsigned j = back ? first + Next_Random(&state) % (i - first) : i + Next_Random(&state) % (last - i);
+			if ((type[j] == CMD_IMGDIFF) != (t == CMD_IMGDIFF) || (back && stashed[j]) || (t == CMD_MOVE && j == i))
+				continue;
+			source[i] = j;
+			break;
+		}
+		if (source[i] < i)
+			stashed[source[i]] = true;
+		else if (t == CMD_MOVE && source[i] == i)
+			type[i] = CMD_NEW;
+	}
+
+	target = image;
+	memset(package->commands, 0, sizeof(package->commands));
+	for (i = 0; i < chunks; i++) {
+		unsigned t = type[i], j = source[i];
+		unsigned char *tgt = target.data() + i * chunk_bytes;
+		const unsigned char *src = image.data() + j * chunk_bytes;
+		std::string tgt_range = Range((uint64_t)i * options.chunk, options.chunk);
+		std::string src_hash = Sha1(src, chunk_bytes);
+		std::string src_range = Range((uint64_t)j * options.chunk, options.chunk);
+		std::string patch;
+
+		if (stashed[i]) {
+			lines.push_back("stash " + Sha1(image.data() + i * chunk_bytes, chunk_bytes) + " " + Range((uint64_t)i * options.chunk, options.chunk));
+			stash_blocks += options.chunk;
+			stash_entries++;
+			max_stash_entries = std::max(max_stash_entries, stash_entries);
+		}
+		max_stash_blocks = std::max(max_stash_blocks, stash_blocks + options.chunk);
+		if (j < i)
+			src_range = "- " + src_hash + ":" + Range(0, options.chunk);
+		std::string blocks = android::base::StringPrintf("%u", options.chunk);
+
+		if (t == CMD_NEW) {
+			Fill_Text(tgt, chunk_bytes, &state);
+			new_data.append((const char*)tgt, chunk_bytes);
+			lines.push_back("new " + tgt_range);
+		} else if (t == CMD_ZERO) {
+			memset(tgt, 0, chunk_bytes);
+			lines.push_back("zero " + tgt_range);
+		} else if (t == CMD_MOVE) {
+			memcpy(tgt, src, chunk_bytes);
+			lines.push_back("move " + src_hash + " " + tgt_range + " " + blocks + " " + src_range);
+		} else {
+			std::vector<unsigned char> before(src, src + chunk_bytes), after;
+			bool ok;
+			if (t == CMD_BSDIFF) {
+				after = before;
+				Mutate(&after, &state);
+				ok = Bsdiff(before, after, options.workdir, &patch);
+			} else {
+				std::vector<unsigned char> changed = text[j];
+				Mutate(&changed, &state);
+				ok = Gzip(changed, chunk_bytes, &after) && Imgdiff(before, after, options.workdir, &patch);
+			}
+			if (!ok) {
+				fprintf(stderr, "Unable to make the %s patch of chunk %u\n", command_names[t], i);
+				return false;
+			}
+			memcpy(tgt, after.data(), chunk_bytes);
+			lines.push_back(android::base::StringPrintf("%s %zu %zu ", command_names[t], patch_data.size(), patch.size()) +
+				src_hash + " " + Sha1(tgt, chunk_bytes) + " " + tgt_range + " " + blocks + " " + src_range);
+			patch_data += patch;
+		}
+		package->commands[t]++;
+		if (j < i) {
+			lines.push_back("free " + src_hash);
+			stash_blocks -= options.chunk;
+			stash_entries--;
+		}
+	}
+
+	lines.insert(lines.begin(), android::base::StringPrintf("%u", max_stash_blocks));
+	lines.insert(lines.begin(), android::base::StringPrintf("%u", max_stash_entries));
+	lines.insert(lines.begin(), android::base::StringPrintf("%u", chunks * options.chunk));
+	lines.insert(lines.begin(), "4");
+
+	unlink((options.workdir + "/patch.tmp").c_str());
+	unlink((options.workdir + "/src.tmp").c_str());
+	unlink((options.workdir + "/tgt.tmp").c_str());
+
+	package->name = "synthetic";
+	package->blocks = chunks * options.chunk;
+	package->source = options.workdir + "/source.img";
+	package->zip = options.workdir + "/synthetic.zip";
+	package->transfer_list = BENCHMARK_IMAGE ".transfer.list";
+	package->new_data = BENCHMARK_IMAGE ".new.dat";
+	package->patch_data = BENCHMARK_IMAGE ".patch.dat";
+	package->target_hash = Sha1(target.data(), target.size());
+	std::vector<std::pair<std::string, std::string> > entries;
+	entries.push_back(std::make_pair(package->transfer_list, android::base::Join(lines, '\n')));
+	entries.push_back(std::make_pair(package->new_data, new_data));
+	entries.push_back(std::make_pair(package->patch_data, patch_data));
+	return android::base::WriteStringToFile(std::string(image.begin(), image.end()), package->source) &&
+		Write_Package(package->zip, entries);
+}
+
+// --replay takes the entries of a real package and the image it applies to
+static bool Load_Package(const Benchmark_Options& options, Benchmark_Package *package) {
+	std::vector<std::pair<std::string, std::string> > entries;
+	std::string transfer_list;
+	struct stat st;
+
+	memset(package->commands, 0, sizeof(package->commands));
+	for (size_t i = 0; i < 3; i++) {
+		std::string data, name = options.replay[i].substr(options.replay[i].rfind('/') + 1);
+		if (!android::base::ReadFileToString(options.replay[i], &data)) {
+			fprintf(stderr, "Unable to read '%s': %s\n", options.replay[i].c_str(), strerror(errno));
+			return false;
+		}
+		if (i == 0)
+			transfer_list = data;
+		entries.push_back(std::make_pair(name, data));
+	}
+	std::vector<std::string> lines = android::base::Split(transfer_list, "\n");
+	for (size_t i = 4; i < lines.size(); i++) {
+		for (unsigned t = 0; t < CMD_TYPES; t++) {
+			if (android::base::StartsWith(lines[i], std::string(command_names[t]) + " "))
+				package->commands[t]++;
+		}
+	}
+	if (stat(options.replay[3].c_str(), &st) != 0) {
+		fprintf(stderr, "Unable to stat '%s': %s\n", options.replay[3].c_str(), strerror(errno));
+		return false;
+	}
+
+	package->name = "replay";
+	package->blocks = st.st_size / BENCHMARK_BLOCK_SIZE;
+	package->source = options.replay[3];
+	package->zip = options.workdir + "/replay.zip";
+	package->transfer_list = entries[0].first;
+	package->new_data = entries[1].first;
+	package->patch_data = entries[2].first;
+	package->target_hash.clear();
+	return Write_Package(package->zip, entries);
+}
+
+static bool Run_Script(const std::string& script, UpdaterInfo *info) {
+	std::unique_ptr<Expr> e;
+	int error_count = 0;
+	std::string result;
+
+	if (parse_string(script.c_str(), &e, &error_count) != 0 || error_count != 0)
+		return false;
+	State state(script, info);
+	return Evaluate(&state, e, &result) && result == "t";
+}
+
+// Runs in the child, verify then update like an OTA package does
+static int Child_Update(const Benchmark_Options& options, const Benchmark_Package& package, const std::string& image, const std::string& pipe_path) {
+	FILE* cmd_pipe = fopen(pipe_path.c_str(), "we");
+	MemMapping map;
+	ZipArchiveHandle handle;
+
+	if (!cmd_pipe || !map.MapFile(package.zip))
+		return 1;
+	if (OpenArchiveFromMemory(map.addr, map.length, package.zip.c_str(), &handle) != 0)
+		return 1;
+	RegisterBuiltins();
+	RegisterInstallFunctions();
+	RegisterBlockImageFunctions();
+	CacheLocation::location().set_cache_temp_source(options.workdir + "/saved_source");
+	CacheLocation::location().set_last_command_file(options.workdir + "/last_command");
+	CacheLocation::location().set_stash_directory_base(options.workdir + "/stash");
+
+	UpdaterInfo info = {};
+	info.cmd_pipe = cmd_pipe;
+	info.package_zip = handle;
+	info.package_zip_addr = map.addr;
+	info.package_zip_len = map.length;
+	std::string args = "(\"" + image + "\", package_extract_file(\"" + package.transfer_list + "\"), \"" +
+		package.new_data + "\", \"" + package.patch_data + "\")";
+
+	double start = Now();
+	bool ok = Run_Script("block_image_verify" + args, &info);
+	fprintf(cmd_pipe, "benchmark verify_us: %.0f\n", (Now() - start) * 1000000);
+	if (ok) {
+		start = Now();
+		ok = Run_Script("block_image_update" + args, &info);
+		fprintf(cmd_pipe, "benchmark update_us: %.0f\n", (Now() - start) * 1000000);
+	}
+	fclose(cmd_pipe);
+	CloseArchive(handle);
+	return ok ? 0 : 1;
+}
+
+static Run_Result Run_Package(const Benchmark_Options& options, const Benchmark_Package& package) {
+	std::string image = options.workdir + "/" BENCHMARK_IMAGE;
+	std::string pipe_path = options.workdir + "/cmd_pipe";
+	std::string source, log;
+	Run_Result result;
+	struct rusage usage;
+	int status;
+
+	result.ok = false;
+	result.verified = false;
+	result.verify_ms = result.update_ms = 0;
+	result.peak_kb = 0;
+	Remove_Tree(options.workdir + "/stash");
+	unlink((options.workdir + "/last_command").c_str());
+	if (!android::base::ReadFileToString(package.source, &source) || !android::base::WriteStringToFile(source, image))
+		return result;
+	source.clear();
+	source.shrink_to_fit();
+	fflush(NULL);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		_exit(Child_Update(options, package, image, pipe_path));
+	}
+	if (pid < 0 || wait4(pid, &status, 0, &usage) != pid)
+		return result;
+	result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	result.peak_kb = usage.ru_maxrss;
+
+	// "log time_us_move_system: 1234" from blockimg, "benchmark update_us: 1234" from the child
+	android::base::ReadFileToString(pipe_path, &log);
+	std::vector<std::string> lines = android::base::Split(log, "\n");
+	for (size_t i = 0; i < lines.size(); i++) {
+		std::vector<std::string> words = android::base::Split(lines[i], " ");
+		if (words.size() != 3 || words[1].empty() || words[1].back() != ':')
+			continue;
+		std::string key = words[1].substr(0, words[1].size() - 1);
+		uint64_t value = strtoull(words[2].c_str(), NULL, 10);
+		if (words[0] == "benchmark" && key == "verify_us") {
+			result.verify_ms = value / 1000.0;
+		} else if (words[0] == "benchmark" && key == "update_us") {
+			result.update_ms = value / 1000.0;
+		} else if (words[0] == "log" && android::base::EndsWith(key, "_" BENCHMARK_IMAGE)) {
+			result.stats[key.substr(0, key.size() - strlen("_" BENCHMARK_IMAGE))] = value;
+		}
+	}
+	if (result.ok && !package.target_hash.empty()) {
+		std::string updated;
+		result.verified = android::base::ReadFileToString(image, &updated) &&
+			Sha1((const unsigned char*)updated.data(), updated.size()) == package.target_hash;
+	}
+	return result;
+}
+
+static double Median_Stat(const std::vector<Run_Result>& runs, const std::string& key) {
+	std::vector<double> values;
+	for (size_t i = 0; i < runs.size(); i++) {
+		std::map<std::string, uint64_t>::const_iterator it = runs[i].stats.find(key);
+		values.push_back(it == runs[i].stats.end() ? 0 : it->second);
+	}
+	return Median(values);
+}
+
+static void Benchmark_Update(const Benchmark_Options& options, const Benchmark_Package& package, bool *first) {
+	std::vector<Run_Result> runs;
+	std::vector<double> verify, update, peak;
+	const char* status = "ok";
+
+	for (int run = 0; run < options.runs; run++) {
+		runs.push_back(Run_Package(options, package));
+		const Run_Result& result = runs.back();
+		if (!result.ok)
+			status = "failed";
+		else if (!package.target_hash.empty() && !result.verified)
+			status = "mismatch";
+		verify.push_back(result.verify_ms);
+		update.push_back(result.update_ms);
+		peak.push_back(result.peak_kb);
+	}
+
+	printf("%s\n\t\t{\"package\": \"%s\", \"blocks\": %llu, \"verify_ms\": %.3f, \"update_ms\": %.3f, \"peak_rss_kb\": %.0f, \"hash_ms\": %.3f, \"fsync_ms\": %.3f, \"bytes_written\": %.0f, \"bytes_stashed\": %.0f, \"stash_read_bytes\": %.0f, \"stash_written_bytes\": %.0f, \"commands\": {",
+		*first ? "" : ",", package.name.c_str(), (unsigned long long)package.blocks, Median(verify), Median(update), Median(peak),
+		Median_Stat(runs, "time_us_hash") / 1000, Median_Stat(runs, "time_us_fsync") / 1000, Median_Stat(runs, "bytes_written"),
+		Median_Stat(runs, "bytes_stashed"), Median_Stat(runs, "bytes_stash_read"), Median_Stat(runs, "bytes_stash_written"));
+	for (unsigned t = 0; t < CMD_TYPES; t++) {
+		std::string name = command_names[t];
+		printf("%s\"%s\": {\"count\": %u, \"ms\": %.3f}", t ? ", " : "", name.c_str(), package.commands[t], Median_Stat(runs, "time_us_" + name) / 1000);
+	}
+	printf(", \"stash\": {\"count\": %.0f, \"ms\": %.3f}, \"free\": {\"count\": %.0f, \"ms\": %.3f}}, \"status\": \"%s\"}",
+		Median_Stat(runs, "commands_stash"), Median_Stat(runs, "time_us_stash") / 1000,
+		Median_Stat(runs, "commands_free"), Median_Stat(runs, "time_us_free") / 1000, status);
+	*first = false;
+	fprintf(stderr, "%-9s %8llu blocks verify %.3fs update %.3fs peak %.0f kB %s\n", package.name.c_str(), (unsigned long long)package.blocks,
+		Median(verify) / 1000, Median(update) / 1000, Median(peak), status);
+}
+
+static bool Parse_Mix(const std::string& list, unsigned *mix) {
+	std::vector<std::string> items = android::base::Split(list, ",");
+	memset(mix, 0, sizeof(unsigned) * CMD_TYPES);
+	for (size_t i = 0; i < items.size(); i++) {
+		size_t equals = items[i].find('=');
+		unsigned t;
+		for (t = 0; t < CMD_TYPES; t++) {
+			if (items[i].compare(0, equals, command_names[t]) == 0)
+				break;
+		}
+		if (equals == std::string::npos || t == CMD_TYPES)
+			return false;
+		mix[t] = strtoul(items[i].c_str() + equals + 1, NULL, 10);
+	}
+	return true;
+}
+
+static void usage(void) {
+	fprintf(stderr, "recovery_blockimg_benchmark [options] > results.json\n\n");
+	fprintf(stderr, " --workdir <path>     folder for the images, packages and stashes (default: /data/local/tmp/blockimg_benchmark)\n");
+	fprintf(stderr, " --blocks <count>     4k blocks in the synthetic image (default: 32768)\n");
+	fprintf(stderr, " --chunk <count>      blocks written by each synthetic command (default: 64)\n");
+	fprintf(stderr, " --mix <list>         command weights (default: new=20,zero=5,move=30,bsdiff=35,imgdiff=10)\n");
+	fprintf(stderr, " --stash <percent>    sources stashed before they are overwritten (default: 20)\n");
+	fprintf(stderr, " --replay <transfer list> <new data> <patch data> <source image>\n");
+	fprintf(stderr, "                      replay a real package instead of the synthetic one\n");
+	fprintf(stderr, " --runs <count>       runs per result, the median is reported (default: 3)\n");
+	fprintf(stderr, " --keep               leave the work folder behind\n");
+}
+
+int main(int argc, char **argv) {
+	Benchmark_Options options;
+	Benchmark_Package package;
+	options.workdir = "/data/local/tmp/blockimg_benchmark";
+	options.blocks = 32768;
+	options.chunk = 64;
+	Parse_Mix("new=20,zero=5,move=30,bsdiff=35,imgdiff=10", options.mix);
+	options.stash = 20;
+	options.runs = 3;
+	options.keep = false;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--keep") {
+			options.keep = true;
+		} else if (i + 1 < argc && arg == "--workdir") {
+			options.workdir = argv[++i];
+		} else if (i + 1 < argc && arg == "--blocks") {
+			options.blocks = strtoul(argv[++i], NULL, 10);
+		} else if (i + 1 < argc && arg == "--chunk") {
+			options.chunk = std::max(1UL, strtoul(argv[++i], NULL, 10));
+		} else if (i + 1 < argc && arg == "--mix" && Parse_Mix(argv[i + 1], options.mix)) {
+			i++;
+		} else if (i + 1 < argc && arg == "--stash") {
+			options.stash = strtoul(argv[++i], NULL, 10);
+		} else if (i + 4 < argc && arg == "--replay") {
+			options.replay.assign(argv + i + 1, argv + i + 5);
+			i += 4;
+		} else if (i + 1 < argc && arg == "--runs") {
+			options.runs = std::max(1, atoi(argv[++i]));
+		} else {
+			usage();
+			return -1;
+		}
+	}
+
+	// imgdiff prints to stdout while the package is made
+	int output = dup(STDOUT_FILENO);
+	if (output < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		fprintf(stderr, "Unable to move stdout aside: %s\n", strerror(errno));
+		return -1;
+	}
+	Remove_Tree(options.workdir);
+	if (mkdir(options.workdir.c_str(), 0700) != 0) {
+		fprintf(stderr, "Unable to create '%s': %s\n", options.workdir.c_str(), strerror(errno));
+		return -1;
+	}
+	bool ok = options.replay.empty() ? Generate_Package(options, &package) : Load_Package(options, &package);
+	if (!ok) {
+		fprintf(stderr, "Unable to set up the %s package\n", options.replay.empty() ? "synthetic" : "replay");
+		return -1;
+	}
+	fflush(stdout);
+	dup2(output, STDOUT_FILENO);
+	close(output);
+
+	printf("{\n\t\"version\": %i,\n\t\"runs\": %i,\n\t\"results\": [", BENCHMARK_FORMAT_VERSION, options.runs);
+	bool first = true;
+	Benchmark_Update(options, package, &first);
+	printf("\n\t]\n}\n");
+
+	if (!options.keep)
+		Remove_Tree(options.workdir);
+	return 0;
+}
@@ -0,0 +1,749 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Enumeration, transfer and change tracking speed of the MTP responder on
+// synthetic trees. The MtpServer runs in process on one end of a socket
+// pair and this plays the host on the other end, so the requests go through
+// the same code as with a USB host; the server copies the file data itself
+// when its fd is not the f_mtp driver.
+//
+//   recovery_mtp_benchmark --workdir /data/media/mtp_benchmark > bench.json
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "benchmark_util.h"
+#include "mtp.h"
+#include "MtpServer.h"
+#include "MtpStorage.h"
+#include "mtp_MtpDatabase.hpp"
+
+#define BENCHMARK_FORMAT_VERSION 1
+#define BENCHMARK_STORAGE_ID 0x00010001
+#define BENCHMARK_FOLDER_FILES 500                     // Files in each folder of a tree
+#define BENCHMARK_GROUP_FOLDERS 50                     // Folders in each top level folder
+#define BENCHMARK_PATTERN_SIZE (1024 * 1024)
+#define BENCHMARK_MAX_OBJECTS 2000                     // Objects sent for one file size
+#define BENCHMARK_UPDATE_TIMEOUT 10.0                  // Seconds to wait for changes to show up
+#define BENCHMARK_CHURN_FOLDER "churn"
+
+struct Benchmark_Options {
+	std::string workdir;                               // Trees and transfers are made in here
+	std::vector<unsigned> trees;                       // File counts of the enumerated trees
+	std::vector<unsigned> sizes;                       // File sizes sent and read back
+	uint64_t transfer_bytes;                           // Bytes moved for each file size
+	std::vector<unsigned> churn;                       // Files created and deleted per churn round
+	int runs;                                          // Each result is the median of this many runs
+	bool keep;                                         // Leave the work folder behind
+};
+
+// One MtpServer with a single storage, and the host end of its socket
+struct Benchmark_Session {
+	MyMtpDatabase* database;
+	MtpServer* server;
+	int fd;
+	int server_fd;
+	uint32_t transaction;
+	pthread_t thread;
+};
+
+struct Prop_Entry {
+	uint32_t handle;
+	uint16_t property;
+	uint64_t value;                                    // Integer properties
+	std::string text;                                  // String properties, ASCII only
+};
+
+struct Phase_Result {
+	double seconds;
+	unsigned requests;
+	uint64_t objects;
+	std::vector<double> latencies;                     // Of each request, in seconds
+	const char* status;
+};
+
+static std::vector<char> pattern;
+static FILE *output;                                   // stdout, the MTP code logs to stdout too
+
+// Tree and churn files, their data is the start of the pattern
+static bool Write_Pattern(const std::string& path, uint64_t size) {
+	return Write_File(path, size, [](unsigned char *buffer, size_t len) { memcpy(buffer, &pattern[0], std::min(len, pattern.size())); });
+}
+
+// Small files in folders of BENCHMARK_FOLDER_FILES, grouped two levels deep
+// like a camera or messenger folder, and an empty folder for the churn
+static bool Make_Tree(const std::string& path, unsigned files, uint64_t *state) {
+	if (!Make_Dir(path) || !Make_Dir(path + "/" BENCHMARK_CHURN_FOLDER))
+		return false;
+	for (unsigned i = 0; i < files; i++) {
+		unsigned folder = i / BENCHMARK_FOLDER_FILES;
+		std::string group = path + "/group" + std::to_string(folder / BENCHMARK_GROUP_FOLDERS);
+		std::string dir = group + "/dir" + std::to_string(folder);
+		if (i % BENCHMARK_FOLDER_FILES == 0) {
+			if (folder % BENCHMARK_GROUP_FOLDERS == 0 && !Make_Dir(group))
+				return false;
+			if (!Make_Dir(dir))
+				return false;
+		}
+		if (!Write_Pattern(dir + "/IMG_" + std::to_string(i) + ".jpg", Next_Random(state) % 4096))
+			return false;
+	}
+	return true;
+}
+
+static void Put_UInt16(unsigned char *buffer, uint16_t value) {
+	buffer[0] = value;
+	buffer[1] = value >> 8;
+}
+
+static void Put_UInt32(unsigned char *buffer, uint32_t value) {
+	for (int i = 0; i < 4; i++)
+		buffer[i] = value >> (8 * i);
+}
+
+static uint64_t Get_UInt(const unsigned char *buffer, size_t bytes) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < bytes && i < 8; i++)
+		value |= (uint64_t)buffer[i] << (8 * i);
+	return value;
+}
+
+static void Put_Header(unsigned char *buffer, uint32_t length, uint16_t type, uint16_t code, uint32_t transaction) {
+	Put_UInt32(buffer, length);
+	Put_UInt16(buffer + 4, type);
+	Put_UInt16(buffer + 6, code);
+	Put_UInt32(buffer + 8, transaction);
+}
+
+static bool Write_Fully(int fd, const void *data, size_t length) {
+	const char *buffer = (const char*) data;
+	while (length > 0) {
+		ssize_t ret = write(fd, buffer, length);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		buffer += ret;
+		length -= ret;
+	}
+	return true;
+}
+
+static bool Read_Fully(int fd, void *data, size_t length) {
+	char *buffer = (char*) data;
+	while (length > 0) {
+		ssize_t ret = read(fd, buffer, length);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		buffer += ret;
+		length -= ret;
+	}
+	return true;
+}
+
+// The server reads the command and its data with separate reads like the
+// driver delivers them, on a stream the data must not arrive before the
+// command was taken
+static void Wait_Taken(int fd) {
+	int queued;
+	while (ioctl(fd, SIOCOUTQ, &queued) == 0 && queued > 0)
+		usleep(20);
+}
+
+// Runs one transaction and returns the response code, 0 if the socket
+// failed. out_length bytes of out are sent as data, repeated if out is
+// shorter; data the server sends goes to in, or is only counted in in_bytes.
+static uint16_t Transact(Benchmark_Session *session, uint16_t code, const std::vector<uint32_t>& params, const void *out, size_t out_size, uint64_t out_length, std::vector<unsigned char> *in, uint64_t *in_bytes, std::vector<uint32_t> *results) {
+	unsigned char header[MTP_CONTAINER_HEADER_SIZE + 5 * 4];
+	uint32_t transaction = ++session->transaction;
+	size_t length = MTP_CONTAINER_HEADER_SIZE + std::min(params.size(), (size_t)5) * 4;
+
+	Put_Header(header, length, MTP_CONTAINER_TYPE_COMMAND, code, transaction);
+	for (size_t i = 0; i < params.size() && i < 5; i++)
+		Put_UInt32(header + MTP_CONTAINER_HEADER_SIZE + i * 4, params[i]);
+	if (!Write_Fully(session->fd, header, length))
+		return 0;
+	if (out) {
+		// like a USB transfer the header and the start of the data arrive
+		// together, the server reads small data sets with a single read
+		uint64_t total = out_length + MTP_CONTAINER_HEADER_SIZE;
+		size_t chunk = std::min((uint64_t)out_size, out_length);
+		std::vector<unsigned char> first(MTP_CONTAINER_HEADER_SIZE + chunk);
+		Put_Header(&first[0], total > 0xFFFFFFFFULL ? 0xFFFFFFFF : total, MTP_CONTAINER_TYPE_DATA, code, transaction);
+		memcpy(&first[MTP_CONTAINER_HEADER_SIZE], out, chunk);
+		Wait_Taken(session->fd);
+		if (!Write_Fully(session->fd, &first[0], first.size()))
+			return 0;
+		for (uint64_t done = chunk; done < out_length;) {
+			chunk = std::min((uint64_t)out_size, out_length - done);
+			if (!Write_Fully(session->fd, out, chunk))
+				return 0;
+			done += chunk;
+		}
+	}
+	if (in)
+		in->clear();
+	if (in_bytes)
+		*in_bytes = 0;
+
+	std::vector<unsigned char> body;
+	for (;;) {
+		if (!Read_Fully(session->fd, header, MTP_CONTAINER_HEADER_SIZE))
+			return 0;
+		uint32_t container_length = Get_UInt(header, 4);
+		uint16_t type = Get_UInt(header + 4, 2);
+		if (container_length < MTP_CONTAINER_HEADER_SIZE)
+			return 0;
+		uint64_t remaining = container_length - MTP_CONTAINER_HEADER_SIZE;
+		if (type == MTP_CONTAINER_TYPE_DATA && in) {
+			in->resize(remaining);
+			if (remaining && !Read_Fully(session->fd, &(*in)[0], remaining))
+				return 0;
+		} else {
+			// file data is only counted, through a buffer of the pattern's size
+			body.resize(std::min(remaining, (uint64_t)BENCHMARK_PATTERN_SIZE));
+			for (uint64_t done = 0; done < remaining;) {
+				size_t chunk = std::min((uint64_t)body.size(), remaining - done);
+				if (!Read_Fully(session->fd, &body[0], chunk))
+					return 0;
+				done += chunk;
+			}
+		}
+		if (type == MTP_CONTAINER_TYPE_DATA && in_bytes)
+			*in_bytes += remaining;
+		if (type != MTP_CONTAINER_TYPE_RESPONSE)
+			continue; // events do not reach a socket, but skip them anyway
+		if (results) {
+			results->clear();
+			for (size_t i = 0; i + 4 <= remaining && i < body.size(); i += 4)
+				results->push_back(Get_UInt(&body[i], 4));
+		}
+		return Get_UInt(header + 6, 2);
+	}
+}
+
+static uint16_t Transact(Benchmark_Session *session, uint16_t code, const std::vector<uint32_t>& params, std::vector<unsigned char> *in = NULL, std::vector<uint32_t> *results = NULL) {
+	return Transact(session, code, params, NULL, 0, 0, in, NULL, results);
+}
+
+static void* Server_Thread(void *cookie) {
+	Benchmark_Session *session = (Benchmark_Session*) cookie;
+	session->server->run(session->server_fd);
+	return NULL;
+}
+
+static void Remove_Session(Benchmark_Session *session) {
+	close(session->fd);
+	MtpStorage *storage = session->server->getStorage(BENCHMARK_STORAGE_ID);
+	if (storage)
+		session->server->removeStorage(storage);
+	delete session->server;
+	delete session->database;
+}
+
+static void Stop_Session(Benchmark_Session *session) {
+	Transact(session, MTP_OPERATION_CLOSE_SESSION, std::vector<uint32_t>());
+	// the server leaves its loop at the end of file and closes its end
+	shutdown(session->fd, SHUT_WR);
+	pthread_join(session->thread, NULL);
+	Remove_Session(session);
+}
+
+// A fresh server for every tree, so the first walk reads the folders like
+// after a cable is plugged in
+static bool Start_Session(Benchmark_Session *session, const std::string& path) {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+		fprintf(stderr, "Unable to create a socket pair: %s\n", strerror(errno));
+		return false;
+	}
+	session->fd = fds[0];
+	session->server_fd = fds[1];
+	session->transaction = 0;
+	session->database = new MyMtpDatabase();
+	session->server = new MtpServer(session->database, false, 0, 0664, 0775);
+	session->server->addStorage(new MtpStorage(BENCHMARK_STORAGE_ID, path.c_str(), "Benchmark", 1, false, 0, session->server));
+	if (pthread_create(&session->thread, NULL, Server_Thread, session) != 0) {
+		fprintf(stderr, "Unable to start the server thread\n");
+		close(session->server_fd);
+		Remove_Session(session);
+		return false;
+	}
+	std::vector<uint32_t> params(1, 1);
+	if (Transact(session, MTP_OPERATION_OPEN_SESSION, params) != MTP_RESPONSE_OK) {
+		fprintf(stderr, "Unable to open an MTP session\n");
+		Stop_Session(session);
+		return false;
+	}
+	return true;
+}
+
+// Entries of a GetObjectPropList data set, false if it does not parse
+static bool Parse_Prop_List(const std::vector<unsigned char>& data, std::vector<Prop_Entry> *entries) {
+	size_t pos = 4;
+	entries->clear();
+	if (data.size() < 4)
+		return false;
+	uint32_t count = Get_UInt(&data[0], 4);
+	for (uint32_t i = 0; i < count; i++) {
+		Prop_Entry entry;
+		if (pos + 8 > data.size())
+			return false;
+		entry.handle = Get_UInt(&data[pos], 4);
+		entry.property = Get_UInt(&data[pos + 4], 2);
+		uint16_t type = Get_UInt(&data[pos + 6], 2);
+		entry.value = 0;
+		pos += 8;
+		if (type == MTP_TYPE_STR) {
+			if (pos + 1 > data.size())
+				return false;
+			size_t chars = data[pos++];
+			if (pos + chars * 2 > data.size())
+				return false;
+			for (size_t c = 0; c + 1 < chars; c++)
+				entry.text += (char)data[pos + c * 2];
+			pos += chars * 2;
+		} else {
+			// the integer types are 1 to 16 bytes, the arrays are prefixed by a count
+			static const size_t type_sizes[] = { 0, 1, 1, 2, 2, 4, 4, 8, 8, 16, 16 };
+			size_t element = type_sizes[std::min((size_t)(type & 0xFF), (size_t)10)];
+			if (element == 0 || (type & 0xFF) > 10)
+				return false;
+			size_t bytes = element;
+			if (type & 0x4000) {
+				if (pos + 4 > data.size())
+					return false;
+				bytes = 4 + Get_UInt(&data[pos], 4) * element;
+			} else if (pos + bytes <= data.size()) {
+				entry.value = Get_UInt(&data[pos], bytes);
+			}
+			if (pos + bytes > data.size())
+				return false;
+			pos += bytes;
+		}
+		entries->push_back(entry);
+	}
+	return true;
+}
+
+// Walks the whole tree with GetObjectPropList for all properties of the
+// children of each folder, the way Windows enumerates, and collects the
+// folders and the handles of the entries at the top
+static Phase_Result Walk_Prop_List(Benchmark_Session *session, std::vector<uint32_t> *folders, std::vector<Prop_Entry> *top) {
+	Phase_Result result;
+	std::vector<uint32_t> pending(1, 0);
+	std::vector<unsigned char> data;
+	std::vector<Prop_Entry> entries;
+
+	result.requests = 0;
+	result.objects = 0;
+	result.status = "ok";
+	folders->clear();
+	double start = Now();
+	while (!pending.empty()) {
+		uint32_t handle = pending.back();
+		pending.pop_back();
+		folders->push_back(handle);
+
+		std::vector<uint32_t> params;
+		params.push_back(handle);
+		params.push_back(0);
+		params.push_back(0xFFFFFFFF);
+		params.push_back(0);
+		params.push_back(1);
+		double request = Now();
+		uint16_t response = Transact(session, MTP_OPERATION_GET_OBJECT_PROP_LIST, params, &data);
+		result.latencies.push_back(Now() - request);
+		result.requests++;
+		if (response != MTP_RESPONSE_OK || !Parse_Prop_List(data, &entries)) {
+			result.status = "request_failed";
+			break;
+		}
+		for (size_t i = 0; i < entries.size(); i++) {
+			if (entries[i].property == MTP_PROPERTY_OBJECT_FORMAT) {
+				result.objects++;
+				if (entries[i].value == MTP_FORMAT_ASSOCIATION)
+					pending.push_back(entries[i].handle);
+			}
+			if (handle == 0 && top && entries[i].property == MTP_PROPERTY_OBJECT_FILE_NAME)
+				top->push_back(entries[i]);
+		}
+	}
+	result.seconds = Now() - start;
+	return result;
+}
+
+// Lists every folder found by the property walk with GetObjectHandles, the
+// way libmtp and macOS enumerate
+static Phase_Result Walk_Handles(Benchmark_Session *session, const std::vector<uint32_t>& folders) {
+	Phase_Result result;
+	std::vector<unsigned char> data;
+
+	result.requests = 0;
+	result.objects = 0;
+	result.status = "ok";
+	double start = Now();
+	for (size_t i = 0; i < folders.size(); i++) {
+		std::vector<uint32_t> params;
+		params.push_back(BENCHMARK_STORAGE_ID);
+		params.push_back(0);
+		params.push_back(folders[i] == 0 ? MTP_PARENT_ROOT : folders[i]);
+		double request = Now();
+		uint16_t response = Transact(session, MTP_OPERATION_GET_OBJECT_HANDLES, params, &data);
+		result.latencies.push_back(Now() - request);
+		result.requests++;
+		if (response != MTP_RESPONSE_OK || data.size() < 4) {
+			result.status = "request_failed";
+			break;
+		}
+		result.objects += Get_UInt(&data[0], 4);
+	}
+	result.seconds = Now() - start;
+	return result;
+}
+
+static void Print_Enumeration(bool *first, unsigned files, const char* phase, const std::vector<Phase_Result>& runs) {
+	std::vector<double> seconds, latencies;
+	const char* status = "ok";
+	uint64_t objects = 0;
+	unsigned requests = 0;
+
+	for (size_t i = 0; i < runs.size(); i++) {
+		seconds.push_back(runs[i].seconds);
+		latencies.insert(latencies.end(), runs[i].latencies.begin(), runs[i].latencies.end());
+		objects = runs[i].objects;
+		requests = runs[i].requests;
+		if (strcmp(runs[i].status, "ok") != 0)
+			status = runs[i].status;
+	}
+	double median = Median(seconds);
+	double per_sec = median > 0 ? objects / median : 0;
+	fprintf(output, "%s\n\t\t{\"test\": \"enumerate\", \"files\": %u, \"phase\": \"%s\", \"seconds\": %.3f, \"requests\": %u, \"objects\": %llu, \"objects_per_sec\": %.0f, \"request_p50_ms\": %.3f, \"request_p99_ms\": %.3f, \"status\": \"%s\"}",
+		*first ? "" : ",", files, phase, median, requests, (unsigned long long)objects, per_sec, Percentile(latencies, 50) * 1000, Percentile(latencies, 99) * 1000, status);
+	*first = false;
+	fprintf(stderr, "enumerate %7u files %-14s %.3fs %.0f objects/s %s\n", files, phase, median, per_sec, status);
+}
+
+// Number of objects in a folder, -1 if the request failed
+static int Count_Objects(Benchmark_Session *session, uint32_t folder) {
+	std::vector<uint32_t> params, results;
+	params.push_back(BENCHMARK_STORAGE_ID);
+	params.push_back(0);
+	params.push_back(folder);
+	if (Transact(session, MTP_OPERATION_GET_NUM_OBJECTS, params, NULL, &results) != MTP_RESPONSE_OK || results.empty())
+		return -1;
+	return results[0];
+}
+
+// Creates or deletes count files in the churn folder, then times how long
+// the server takes to show the folder as it is now. The first request after
+// the churn applies the queued inotify events, so its time is reported too.
+static void Benchmark_Churn(const Benchmark_Options& options, Benchmark_Session *session, const std::string& path, uint32_t folder, unsigned files, unsigned count, bool *first) {
+	static const char* phases[] = { "create", "delete" };
+
+	for (int phase = 0; phase < 2; phase++) {
+		std::vector<double> churn_times, update_times, first_times;
+		const char* status = "ok";
+		unsigned polls = 0;
+
+		for (int run = 0; run < options.runs && strcmp(status, "ok") == 0; run++) {
+			if (phase == 1) {
+				for (unsigned i = 0; i < count; i++)
+					Write_Pattern(path + "/churn" + std::to_string(i), 16);
+				double wait = Now();
+				while (Count_Objects(session, folder) != (int)count && Now() - wait < BENCHMARK_UPDATE_TIMEOUT)
+					usleep(1000);
+			}
+			double start = Now();
+			for (unsigned i = 0; i < count; i++) {
+				std::string file = path + "/churn" + std::to_string(i);
+				if (phase == 0)
+					Write_Pattern(file, 16);
+				else
+					unlink(file.c_str());
+			}
+			double churned = Now();
+			churn_times.push_back(churned - start);
+
+			int expected = (phase == 0 ? count : 0);
+			int objects = -1;
+			double first_request = 0;
+			for (polls = 0; objects != expected; polls++) {
+				double request = Now();
+				objects = Count_Objects(session, folder);
+				if (polls == 0)
+					first_request = Now() - request;
+				if (objects < 0) {
+					status = "request_failed";
+					break;
+				}
+				if (Now() - churned > BENCHMARK_UPDATE_TIMEOUT) {
+					status = "update_timeout";
+					break;
+				}
+			}
+			update_times.push_back(Now() - churned);
+			first_times.push_back(first_request);
+			if (phase == 0) {
+				for (unsigned i = 0; i < count; i++)
+					unlink((path + "/churn" + std::to_string(i)).c_str());
+				double wait = Now();
+				while (Count_Objects(session, folder) != 0 && Now() - wait < BENCHMARK_UPDATE_TIMEOUT)
+					usleep(1000);
+			}
+		}
+		fprintf(output, "%s\n\t\t{\"test\": \"churn\", \"files\": %u, \"phase\": \"%s\", \"changes\": %u, \"churn_seconds\": %.3f, \"update_ms\": %.3f, \"first_request_ms\": %.3f, \"polls\": %u, \"status\": \"%s\"}",
+			*first ? "" : ",", files, phases[phase], count, Median(churn_times), Median(update_times) * 1000, Median(first_times) * 1000, polls, status);
+		*first = false;
+		fprintf(stderr, "churn     %7u files %-6s %6u changes: update %.3fms first request %.3fms %s\n", files, phases[phase], count, Median(update_times) * 1000, Median(first_times) * 1000, status);
+	}
+}
+
+static void Benchmark_Tree(const Benchmark_Options& options, unsigned files, bool *first) {
+	std::string path = options.workdir + "/tree" + std::to_string(files);
+	std::vector<Phase_Result> cold, warm, handles;
+	std::vector<uint32_t> folders;
+	std::vector<Prop_Entry> top;
+	Benchmark_Session session;
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+	fprintf(stderr, "Creating a tree of %u files\n", files);
+	if (!Make_Tree(path, files, &state))
+		return;
+	sync();
+
+	for (int run = 0; run < options.runs; run++) {
+		if (!Start_Session(&session, path))
+			break;
+		top.clear();
+		cold.push_back(Walk_Prop_List(&session, &folders, &top));
+		warm.push_back(Walk_Prop_List(&session, &folders, NULL));
+		handles.push_back(Walk_Handles(&session, folders));
+		// the churn runs on the last session, its folder is watched by now
+		if (run + 1 < options.runs)
+			Stop_Session(&session);
+	}
+	Print_Enumeration(first, files, "proplist_cold", cold);
+	Print_Enumeration(first, files, "proplist_warm", warm);
+	Print_Enumeration(first, files, "handles_warm", handles);
+	if (handles.size() < (size_t)options.runs) {
+		Remove_Tree(path);
+		return;
+	}
+
+	uint32_t churn = 0;
+	for (size_t i = 0; i < top.size(); i++) {
+		if (top[i].text == BENCHMARK_CHURN_FOLDER)
+			churn = top[i].handle;
+	}
+	if (churn) {
+		for (size_t i = 0; i < options.churn.size(); i++)
+			Benchmark_Churn(options, &session, path + "/" BENCHMARK_CHURN_FOLDER, churn, files, options.churn[i], first);
+	} else {
+		fprintf(stderr, "The churn folder was not found in the tree\n");
+	}
+	Stop_Session(&session);
+	if (!options.keep)
+		Remove_Tree(path);
+}
+
+// The ObjectInfo data set of a plain file in the storage root
+static std::vector<unsigned char> Object_Info(const std::string& name, uint32_t size) {
+	std::vector<unsigned char> info(52, 0);
+	Put_UInt32(&info[0], BENCHMARK_STORAGE_ID);
+	Put_UInt16(&info[4], MTP_FORMAT_UNDEFINED);
+	Put_UInt32(&info[8], size);
+	Put_UInt32(&info[38], MTP_PARENT_ROOT);
+	info.push_back(name.size() + 1);
+	for (size_t i = 0; i <= name.size(); i++) {
+		info.push_back(i < name.size() ? name[i] : 0);
+		info.push_back(0);
+	}
+	// no dates and no keywords
+	info.push_back(0);
+	info.push_back(0);
+	info.push_back(0);
+	return info;
+}
+
+static void Benchmark_Transfer(const Benchmark_Options& options, unsigned size, bool *first) {
+	std::string path = options.workdir + "/transfer";
+	unsigned count = std::max((uint64_t)1, std::min((uint64_t)BENCHMARK_MAX_OBJECTS, options.transfer_bytes / size));
+	std::vector<double> send_times, get_times;
+	const char* status = "ok";
+	Benchmark_Session session;
+
+	for (int run = 0; run < options.runs && strcmp(status, "ok") == 0; run++) {
+		Remove_Tree(path);
+		if (!Make_Dir(path) || !Start_Session(&session, path)) {
+			status = "session_failed";
+			break;
+		}
+		std::vector<uint32_t> handles, results;
+		double start = Now();
+		for (unsigned i = 0; i < count && strcmp(status, "ok") == 0; i++) {
+			std::vector<unsigned char> info = Object_Info("object" + std::to_string(i) + ".bin", size);
+			std::vector<uint32_t> params;
+			params.push_back(BENCHMARK_STORAGE_ID);
+			params.push_back(MTP_PARENT_ROOT);
+			if (Transact(&session, MTP_OPERATION_SEND_OBJECT_INFO, params, &info[0], info.size(), info.size(), NULL, NULL, &results) != MTP_RESPONSE_OK || results.size() < 3)
+				status = "send_info_failed";
+			else if (Transact(&session, MTP_OPERATION_SEND_OBJECT, std::vector<uint32_t>(), &pattern[0], pattern.size(), size, NULL, NULL, NULL) != MTP_RESPONSE_OK)
+				status = "send_failed";
+			else
+				handles.push_back(results[2]);
+		}
+		sync();
+		send_times.push_back(Now() - start);
+
+		start = Now();
+		for (size_t i = 0; i < handles.size() && strcmp(status, "ok") == 0; i++) {
+			std::vector<uint32_t> params(1, handles[i]);
+			uint64_t bytes = 0;
+			if (Transact(&session, MTP_OPERATION_GET_OBJECT, params, NULL, 0, 0, NULL, &bytes, NULL) != MTP_RESPONSE_OK)
+				status = "get_failed";
+			else if (bytes != size)
+				status = "get_mismatch";
+		}
+		get_times.push_back(Now() - start);
+		Stop_Session(&session);
+	}
+	Remove_Tree(path);
+
+	static const char* phases[] = { "send", "get" };
+	for (int phase = 0; phase < 2; phase++) {
+		double seconds = Median(phase == 0 ? send_times : get_times);
+		uint64_t bytes = (uint64_t)size * count;
+		double mb_per_sec = seconds > 0 ? bytes / seconds / (1024 * 1024) : 0;
+		fprintf(output, "%s\n\t\t{\"test\": \"transfer\", \"size\": %u, \"phase\": \"%s\", \"objects\": %u, \"seconds\": %.3f, \"bytes\": %llu, \"mb_per_sec\": %.2f, \"objects_per_sec\": %.0f, \"status\": \"%s\"}",
+			*first ? "" : ",", size, phases[phase], count, seconds, (unsigned long long)bytes, mb_per_sec, seconds > 0 ? count / seconds : 0, status);
+		*first = false;
+		fprintf(stderr, "transfer  %9u bytes %-4s %u objects: %.3fs %.2f MB/s %s\n", size, phases[phase], count, seconds, mb_per_sec, status);
+	}
+}
+
+static void Parse_List(const std::string& list, std::vector<unsigned> *values) {
+	size_t pos = 0;
+	values->clear();
+	while (pos < list.size()) {
+		size_t end = list.find(',', pos);
+		if (end == std::string::npos)
+			end = list.size();
+		unsigned value = strtoul(list.substr(pos, end - pos).c_str(), NULL, 10);
+		if (value > 0)
+			values->push_back(value);
+		pos = end + 1;
+	}
+}
+
+static void usage(void) {
+	printf("recovery_mtp_benchmark [options] > results.json\n\n");
+	printf(" --workdir <path>     folder for the trees and transfers (default: /data/media/mtp_benchmark)\n");
+	printf(" --files <list>       comma separated file counts of the enumerated trees (default: 10000,100000)\n");
+	printf(" --sizes <list>       comma separated file sizes to send and get (default: 4096,65536,1048576,16777216)\n");
+	printf(" --transfer-mb <mb>   data moved for each file size (default: 64)\n");
+	printf(" --churn <list>       comma separated files created and deleted per churn round (default: 100,1000,10000)\n");
+	printf(" --runs <count>       runs per result, the median is reported (default: 3)\n");
+	printf(" --keep               leave the trees behind\n");
+}
+
+int main(int argc, char **argv) {
+	Benchmark_Options options;
+	options.workdir = "/data/media/mtp_benchmark";
+	Parse_List("10000,100000", &options.trees);
+	Parse_List("4096,65536,1048576,16777216", &options.sizes);
+	Parse_List("100,1000,10000", &options.churn);
+	options.transfer_bytes = 64 * 1024 * 1024;
+	options.runs = 3;
+	options.keep = false;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--keep") {
+			options.keep = true;
+		} else if (i + 1 < argc && arg == "--workdir") {
+			options.workdir = argv[++i];
+		} else if (i + 1 < argc && arg == "--files") {
+			Parse_List(argv[++i], &options.trees);
+		} else if (i + 1 < argc && arg == "--sizes") {
+			Parse_List(argv[++i], &options.sizes);
+		} else if (i + 1 < argc && arg == "--transfer-mb") {
+			options.transfer_bytes = strtoull(argv[++i], NULL, 10) * 1024 * 1024;
+		} else if (i + 1 < argc && arg == "--churn") {
+			Parse_List(argv[++i], &options.churn);
+		} else if (i + 1 < argc && arg == "--runs") {
+			options.runs = std::max(1, atoi(argv[++i]));
+		} else {
+			usage();
+			return -1;
+		}
+	}
+
+	// the server's messages go with the progress
+	output = fdopen(dup(STDOUT_FILENO), "w");
+	if (!output || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		fprintf(stderr, "Unable to move stdout aside: %s\n", strerror(errno));
+		return -1;
+	}
+	// a server that dies mid transfer must not take the benchmark with it
+	signal(SIGPIPE, SIG_IGN);
+	uint64_t state = 0x2545f4914f6cdd1dULL;
+	pattern.resize(BENCHMARK_PATTERN_SIZE);
+	for (size_t i = 0; i < pattern.size(); i += 8) {
+		uint64_t r = Next_Random(&state);
+		memcpy(&pattern[i], &r, 8);
+	}
+
+	Remove_Tree(options.workdir);
+	if (!Make_Dir(options.workdir)) {
+		fprintf(stderr, "Unable to create '%s': %s\n", options.workdir.c_str(), strerror(errno));
+		return -1;
+	}
+
+	fprintf(output, "{\n\t\"version\": %i,\n\t\"runs\": %i,\n\t\"results\": [", BENCHMARK_FORMAT_VERSION, options.runs);
+	bool first = true;
+	for (size_t i = 0; i < options.trees.size(); i++)
+		Benchmark_Tree(options, options.trees[i], &first);
+	for (size_t i = 0; i < options.sizes.size(); i++)
+		Benchmark_Transfer(options, options.sizes[i], &first);
+	fprintf(output, "\n\t]\n}\n");
+	fclose(output);
+
+	if (!options.keep)
+		Remove_Tree(options.workdir);
+	return 0;
+}
@@ -0,0 +1,471 @@
+/*
+	Copyright 2012 to 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Backup, restore and digest throughput of the TWRP engines on synthetic
+// trees. Backups and restores run a host build of twrpTar (twrpTarMain)
+// for every archive type; digests run in process with the same
+// twrpDigest classes recovery uses.
+//
+//   recovery_tar_benchmark --twrptar out/host/linux-x86/bin/twrpTar > bench.json
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "benchmark_util.h"
+#include "twrpDigest/twrpDigest.hpp"
+#include "twrpDigest/twrpMD5.hpp"
+#include "twrpDigest/twrpSHA.hpp"
+
+#define BENCHMARK_FORMAT_VERSION 1
+#define BENCHMARK_PASSWORD "twrp-benchmark"
+
+struct Benchmark_Options {
+	std::string twrptar;                               // twrpTar binary to run
+	std::string workdir;                               // Trees, archives and restores are made in here
+	double scale;                                      // Multiplies the file counts and sizes of every tree
+	int runs;                                          // Each result is the median of this many runs
+	std::vector<unsigned> threads;                     // Thread counts for twrpTar and the digests
+	bool encryption;                                   // Also time encrypted archives
+	bool keep;                                         // Leave the work folder behind
+};
+
+struct Benchmark_Tree {
+	std::string name;
+	std::string path;
+	std::vector<std::string> files;                    // Regular files, for the digests
+	uint64_t bytes;
+};
+
+struct Archive_Type {
+	const char* name;
+	const char* flags[3];                              // Extra twrpTar options for the backup
+};
+
+static const Archive_Type archive_types[] = {
+	{ "tar", { NULL, NULL, NULL } },
+	{ "tar.gz", { "-z", NULL, NULL } },
+	{ "tar.enc", { "-e", BENCHMARK_PASSWORD, NULL } },
+};
+
+static bool xattr_warned = false;
+
+// Every other 4 KiB block is text, the rest random, so the compressed
+// archives come out at about half size like typical user data
+static void Fill_Buffer(unsigned char *buffer, size_t len, uint64_t *state) {
+	static const char text[] = "The quick brown fox jumps over the lazy dog. ";
+	for (size_t block = 0; block < len; block += 4096) {
+		size_t end = std::min(len, block + 4096);
+		if ((block / 4096) % 2 == 0) {
+			for (size_t i = block; i < end; i += 8) {
+				uint64_t r = Next_Random(state);
+				memcpy(buffer + i, &r, std::min((size_t)8, end - i));
+			}
+		} else {
+			for (size_t i = block; i < end; i++)
+				buffer[i] = text[i % (sizeof(text) - 1)];
+		}
+	}
+}
+
+// A file of Fill_Buffer data
+static bool Write_Sample(const std::string& path, uint64_t size, uint64_t *state) {
+	return Write_File(path, size, [state](unsigned char *buffer, size_t len) { Fill_Buffer(buffer, len, state); });
+}
+
+// Labels like the ones on /data; setting security.selinux needs the
+// privilege to relabel, without it the tree only has user xattrs
+static void Set_Xattrs(const std::string& path, unsigned n) {
+	char value[32];
+	snprintf(value, sizeof(value), "benchmark-%u", n);
+	if (lsetxattr(path.c_str(), "user.twrp_benchmark", value, strlen(value), 0) != 0 && !xattr_warned) {
+		fprintf(stderr, "Unable to set user xattrs in the work folder: %s\n", strerror(errno));
+		xattr_warned = true;
+	}
+	const char *context = n % 2 ? "u:object_r:media_rw_data_file:s0" : "u:object_r:app_data_file:s0";
+	lsetxattr(path.c_str(), "security.selinux", context, strlen(context) + 1, 0);
+}
+
+static bool Make_Small_Tree(Benchmark_Tree *tree, double scale, uint64_t *state) {
+	unsigned count = std::max(1u, (unsigned)(20000 * scale));
+	for (unsigned i = 0; i < count; i++) {
+		std::string dir = tree->path + "/dir" + std::to_string(i / 100);
+		if (i % 100 == 0 && !Make_Dir(dir))
+			return false;
+		if (!Write_Sample(dir + "/file" + std::to_string(i), 512 + Next_Random(state) % 7681, state))
+			return false;
+	}
+	return true;
+}
+
+static bool Make_Large_Tree(Benchmark_Tree *tree, double scale, uint64_t *state) {
+	uint64_t size = std::max((uint64_t)1024 * 1024, (uint64_t)(64 * 1024 * 1024 * scale));
+	for (unsigned i = 0; i < 4; i++) {
+		if (!Write_Sample(tree->path + "/large" + std::to_string(i) + ".bin", size, state))
+			return false;
+	}
+	return true;
+}
+
+static bool Make_Mixed_Tree(Benchmark_Tree *tree, double scale, uint64_t *state) {
+	unsigned count = std::max(1u, (unsigned)(2000 * scale));
+	for (unsigned i = 0; i < count; i++) {
+		std::string dir = tree->path + "/app" + std::to_string(i / 50);
+		if (i % 50 == 0) {
+			if (!Make_Dir(dir) || !Make_Dir(dir + "/cache"))
+				return false;
+			Set_Xattrs(dir, i);
+		}
+		std::string file = dir + "/data" + std::to_string(i);
+		uint64_t size = (i % 20 == 0) ? 1024 * 1024 : 1024 + Next_Random(state) % (64 * 1024);
+		if (!Write_Sample(file, size, state))
+			return false;
+		Set_Xattrs(file, i);
+		if (i % 10 == 0)
+			symlink(("data" + std::to_string(i)).c_str(), (file + ".lnk").c_str());
+		if (i % 25 == 0)
+			link(file.c_str(), (file + ".hard").c_str());
+	}
+	return true;
+}
+
+static std::vector<std::string>* walk_files;
+static uint64_t walk_bytes;
+
+static int Walk_Entry(const char *path, const struct stat *st, int flag, struct FTW *ftw __attribute__((unused))) {
+	if (flag == FTW_F && S_ISREG(st->st_mode)) {
+		if (walk_files)
+			walk_files->push_back(path);
+		walk_bytes += st->st_size;
+	}
+	return 0;
+}
+
+// Bytes of the regular files under path, hard links counted each time like twrpTar's size
+static uint64_t Folder_Bytes(const std::string& path, std::vector<std::string> *files) {
+	walk_files = files;
+	walk_bytes = 0;
+	nftw(path.c_str(), Walk_Entry, 64, FTW_PHYS);
+	walk_files = NULL;
+	return walk_bytes;
+}
+
+// Runs twrpTar with its output thrown away, returns its exit status
+static int Run_TwrpTar(const Benchmark_Options& options, std::vector<const char*> args) {
+	args.insert(args.begin(), options.twrptar.c_str());
+	args.push_back(NULL);
+
+	pid_t pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			close(fd);
+		}
+		execv(args[0], (char* const*)&args[0]);
+		_exit(127);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+static void Print_Result(bool *first, const std::string& tree, const char* engine, const char* archive, const char* phase, unsigned threads, double seconds, uint64_t bytes, uint64_t archive_bytes, const char* status) {
+	double mb_per_sec = seconds > 0 ? bytes / seconds / (1024 * 1024) : 0;
+	printf("%s\n\t\t{\"tree\": \"%s\", \"engine\": \"%s\", \"archive\": \"%s\", \"phase\": \"%s\", \"threads\": %u, \"seconds\": %.3f, \"bytes\": %llu, \"archive_bytes\": %llu, \"mb_per_sec\": %.2f, \"status\": \"%s\"}",
+		*first ? "" : ",", tree.c_str(), engine, archive, phase, threads, seconds, (unsigned long long)bytes, (unsigned long long)archive_bytes, mb_per_sec, status);
+	*first = false;
+	fprintf(stderr, "%-6s %-8s %-8s %-8s threads %u: %.3fs %.2f MB/s %s\n", tree.c_str(), engine, archive, phase, threads, seconds, mb_per_sec, status);
+}
+
+static void Benchmark_Archive(const Benchmark_Options& options, const Benchmark_Tree& tree, const Archive_Type& type, unsigned thread_count, bool *first) {
+	std::string archive_dir = options.workdir + "/archive";
+	std::string archive = archive_dir + "/" + tree.name + "." + type.name;
+	std::string restore = options.workdir + "/restore";
+	std::vector<double> backup_times, restore_times;
+	uint64_t archive_bytes = 0, restored_bytes = 0;
+	const char* status = "ok";
+	char thread_arg[16];
+	snprintf(thread_arg, sizeof(thread_arg), "%u", thread_count);
+
+	for (int run = 0; run < options.runs && strcmp(status, "ok") == 0; run++) {
+		Remove_Tree(archive_dir);
+		Remove_Tree(restore);
+		Make_Dir(archive_dir);
+		Make_Dir(restore);
+
+		std::vector<const char*> args;
+		args.push_back("-c");
+		args.push_back("-j");
+		args.push_back(thread_arg);
+		args.push_back("-d");
+		args.push_back(tree.path.c_str());
+		args.push_back("-t");
+		args.push_back(archive.c_str());
+		for (int i = 0; i < 3 && type.flags[i]; i++)
+			args.push_back(type.flags[i]);
+		double start = Now();
+		if (Run_TwrpTar(options, args) != 0) {
+			status = "backup_failed";
+			break;
+		}
+		sync();
+		backup_times.push_back(Now() - start);
+		archive_bytes = Folder_Bytes(archive_dir, NULL);
+
+		args.clear();
+		args.push_back("-x");
+		args.push_back("-j");
+		args.push_back(thread_arg);
+		args.push_back("-d");
+		args.push_back(restore.c_str());
+		args.push_back("-t");
+		args.push_back(archive.c_str());
+		if (type.flags[0] && strcmp(type.flags[0], "-e") == 0) {
+			args.push_back("-e");
+			args.push_back(BENCHMARK_PASSWORD);
+		}
+		start = Now();
+		if (Run_TwrpTar(options, args) != 0) {
+			status = "restore_failed";
+			break;
+		}
+		sync();
+		restore_times.push_back(Now() - start);
+		restored_bytes = Folder_Bytes(restore, NULL);
+		if (restored_bytes != tree.bytes)
+			status = "restore_mismatch";
+	}
+
+	Print_Result(first, tree.name, "twrpTar", type.name, "backup", thread_count, Median(backup_times), tree.bytes, archive_bytes, backup_times.empty() ? status : "ok");
+	Print_Result(first, tree.name, "twrpTar", type.name, "restore", thread_count, Median(restore_times), tree.bytes, archive_bytes, status);
+	Remove_Tree(archive_dir);
+	Remove_Tree(restore);
+}
+
+struct Digest_Work {
+	const std::vector<std::string>* files;
+	bool sha256;
+	size_t next;                                       // Next file to hash, guarded by lock
+	pthread_mutex_t lock;
+	bool ret;
+};
+
+static void* Digest_Thread(void *cookie) {
+	Digest_Work* work = (Digest_Work*) cookie;
+
+	for (;;) {
+		pthread_mutex_lock(&work->lock);
+		size_t i = work->next++;
+		pthread_mutex_unlock(&work->lock);
+		if (i >= work->files->size())
+			break;
+
+		int fd = open((*work->files)[i].c_str(), O_RDONLY);
+		if (fd < 0) {
+			work->ret = false;
+			continue;
+		}
+		twrpDigest* digest;
+		if (work->sha256)
+			digest = new twrpSHA256();
+		else
+			digest = new twrpMD5();
+		uint64_t bytes_read;
+		if (digest->update_from_fd(fd, &bytes_read) != 0)
+			work->ret = false;
+		digest->return_digest_string();
+		delete digest;
+		close(fd);
+	}
+	return NULL;
+}
+
+// The tree was just written or read back, so these measure the hashing
+// itself rather than the storage
+static void Benchmark_Digest(const Benchmark_Options& options, const Benchmark_Tree& tree, bool sha256, bool *first) {
+	for (size_t t = 0; t < options.threads.size(); t++) {
+		unsigned thread_count = options.threads[t];
+		std::vector<double> times;
+		bool ret = true;
+
+		for (int run = 0; run < options.runs && ret; run++) {
+			Digest_Work work;
+			work.files = &tree.files;
+			work.sha256 = sha256;
+			work.next = 0;
+			work.ret = true;
+			pthread_mutex_init(&work.lock, NULL);
+
+			std::vector<pthread_t> threads;
+			double start = Now();
+			for (unsigned i = 1; i < thread_count; i++) {
+				pthread_t thread;
+				if (pthread_create(&thread, NULL, Digest_Thread, &work) == 0)
+					threads.push_back(thread);
+			}
+			Digest_Thread(&work); // the calling thread hashes too
+			for (size_t i = 0; i < threads.size(); i++)
+				pthread_join(threads[i], NULL);
+			times.push_back(Now() - start);
+			pthread_mutex_destroy(&work.lock);
+			ret = work.ret;
+		}
+		Print_Result(first, tree.name, "digest", sha256 ? "sha256" : "md5", "digest", thread_count, Median(times), tree.bytes, 0, ret ? "ok" : "read_failed");
+	}
+}
+
+static void usage(void) {
+	printf("recovery_tar_benchmark [options] > results.json\n\n");
+	printf(" --twrptar <path>     twrpTar binary to time (default: twrpTar next to this binary)\n");
+	printf(" --workdir <path>     folder for the trees and archives (default: /tmp/twrp_benchmark)\n");
+	printf(" --scale <factor>     size of the trees, 1.0 is about 360MB (default: 1.0)\n");
+	printf(" --runs <count>       runs per result, the median is reported (default: 3)\n");
+	printf(" --threads <list>     comma separated twrpTar and digest thread counts (default: 1,2,4)\n");
+	printf(" --no-encryption      skip encrypted archives\n");
+	printf(" --keep               leave the work folder behind\n");
+}
+
+int main(int argc, char **argv) {
+	Benchmark_Options options;
+	options.workdir = "/tmp/twrp_benchmark";
+	options.scale = 1.0;
+	options.runs = 3;
+	options.encryption = true;
+	options.keep = false;
+
+	char self[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len > 0) {
+		self[len] = '\0';
+		options.twrptar = std::string(self);
+		options.twrptar = options.twrptar.substr(0, options.twrptar.find_last_of('/') + 1) + "twrpTar";
+	}
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--no-encryption") {
+			options.encryption = false;
+		} else if (arg == "--keep") {
+			options.keep = true;
+		} else if (i + 1 < argc && arg == "--twrptar") {
+			options.twrptar = argv[++i];
+		} else if (i + 1 < argc && arg == "--workdir") {
+			options.workdir = argv[++i];
+		} else if (i + 1 < argc && arg == "--scale") {
+			options.scale = atof(argv[++i]);
+		} else if (i + 1 < argc && arg == "--runs") {
+			options.runs = std::max(1, atoi(argv[++i]));
+		} else if (i + 1 < argc && arg == "--threads") {
+			std::string list = argv[++i];
+			size_t pos = 0;
+			while (pos < list.size()) {
+				size_t end = list.find(',', pos);
+				if (end == std::string::npos)
+					end = list.size();
+				unsigned count = atoi(list.substr(pos, end - pos).c_str());
+				if (count > 0)
+					options.threads.push_back(count);
+				pos = end + 1;
+			}
+		} else {
+			usage();
+			return -1;
+		}
+	}
+	if (options.threads.empty()) {
+		options.threads.push_back(1);
+		options.threads.push_back(2);
+		options.threads.push_back(4);
+	}
+	if (access(options.twrptar.c_str(), X_OK) != 0) {
+		fprintf(stderr, "twrpTar not found at '%s', use --twrptar\n", options.twrptar.c_str());
+		return -1;
+	}
+
+	Remove_Tree(options.workdir);
+	if (!Make_Dir(options.workdir)) {
+		fprintf(stderr, "Unable to create '%s': %s\n", options.workdir.c_str(), strerror(errno));
+		return -1;
+	}
+
+	static const char* tree_names[] = { "small", "large", "mixed" };
+	std::vector<Benchmark_Tree> trees;
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	for (unsigned i = 0; i < 3; i++) {
+		Benchmark_Tree tree;
+		tree.name = tree_names[i];
+		tree.path = options.workdir + "/" + tree.name;
+		fprintf(stderr, "Creating the %s tree\n", tree.name.c_str());
+		bool ret = Make_Dir(tree.path);
+		if (ret && i == 0)
+			ret = Make_Small_Tree(&tree, options.scale, &state);
+		else if (ret && i == 1)
+			ret = Make_Large_Tree(&tree, options.scale, &state);
+		else if (ret)
+			ret = Make_Mixed_Tree(&tree, options.scale, &state);
+		if (!ret) {
+			if (!options.keep)
+				Remove_Tree(options.workdir);
+			return -1;
+		}
+		tree.bytes = Folder_Bytes(tree.path, &tree.files);
+		trees.push_back(tree);
+	}
+	sync();
+
+	printf("{\n\t\"version\": %i,\n\t\"scale\": %.3f,\n\t\"runs\": %i,\n\t\"trees\": [", BENCHMARK_FORMAT_VERSION, options.scale, options.runs);
+	for (size_t i = 0; i < trees.size(); i++)
+		printf("%s\n\t\t{\"name\": \"%s\", \"files\": %zu, \"bytes\": %llu}", i ? "," : "", trees[i].name.c_str(), trees[i].files.size(), (unsigned long long)trees[i].bytes);
+	printf("\n\t],\n\t\"results\": [");
+
+	bool first = true;
+	for (size_t i = 0; i < trees.size(); i++) {
+		for (size_t a = 0; a < sizeof(archive_types) / sizeof(archive_types[0]); a++) {
+			if (!options.encryption && strcmp(archive_types[a].flags[0] ? archive_types[a].flags[0] : "", "-e") == 0)
+				continue;
+			for (size_t t = 0; t < options.threads.size(); t++)
+				Benchmark_Archive(options, trees[i], archive_types[a], options.threads[t], &first);
+		}
+		Benchmark_Digest(options, trees[i], false, &first);
+		Benchmark_Digest(options, trees[i], true, &first);
+	}
+	printf("\n\t]\n}\n");
+
+	if (!options.keep)
+		Remove_Tree(options.workdir);
+	return 0;
+}
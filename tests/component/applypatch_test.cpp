@@ -316,6 +316,58 @@ TEST_F(ApplyPatchModesTest, PatchModeEmmcTargetWithBsdiffPatch) {
   ASSERT_EQ(recovery_img_sha1, tgt_file_sha1);
 }
 
+TEST_F(ApplyPatchModesTest, PatchModeEmmcTargetMismatchKeepsBackup) {
+  std::string boot_img_file = from_testdata_base("boot.img");
+  std::string boot_img_sha1;
+  size_t boot_img_size;
+  sha1sum(boot_img_file, &boot_img_sha1, &boot_img_size);
+
+  std::string recovery_img_file = from_testdata_base("recovery.img");
+  std::string recovery_img_sha1;
+  size_t recovery_img_size;
+  sha1sum(recovery_img_file, &recovery_img_sha1, &recovery_img_size);
+
+  std::string src_content;
+  ASSERT_TRUE(android::base::ReadFileToString(boot_img_file, &src_content));
+  std::string tgt_content;
+  ASSERT_TRUE(android::base::ReadFileToString(recovery_img_file, &tgt_content));
+
+  TemporaryFile patch_file;
+  ASSERT_EQ(0,
+            bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(src_content.data()), src_content.size(),
+                           reinterpret_cast<const uint8_t*>(tgt_content.data()), tgt_content.size(),
+                           patch_file.path, nullptr));
+
+  // The output is streamed to the target, so a patch that doesn't produce the expected SHA-1 leaves
+  // the target overwritten; the source backup on cache must survive for the retry.
+  std::string src_file_arg =
+      "EMMC:" + boot_img_file + ":" + std::to_string(boot_img_size) + ":" + boot_img_sha1;
+  TemporaryFile tgt_file;
+  std::string tgt_file_arg = "EMMC:"s + tgt_file.path;
+  std::string bad_sha1 = std::string(40, '0');
+  std::string recovery_img_size_arg = std::to_string(recovery_img_size);
+  std::string patch_arg = boot_img_sha1 + ":" + patch_file.path;
+  std::vector<const char*> args = { "applypatch",
+                                    src_file_arg.c_str(),
+                                    tgt_file_arg.c_str(),
+                                    bad_sha1.c_str(),
+                                    recovery_img_size_arg.c_str(),
+                                    patch_arg.c_str() };
+  ASSERT_NE(0, applypatch_modes(args.size(), args.data()));
+
+  std::string backup_sha1;
+  sha1sum(cache_source.path, &backup_sha1);
+  ASSERT_EQ(boot_img_sha1, backup_sha1);
+
+  // Running again with the right SHA-1 still produces the target.
+  args[3] = recovery_img_sha1.c_str();
+  ASSERT_EQ(0, applypatch_modes(args.size(), args.data()));
+
+  std::string tgt_file_sha1;
+  sha1sum(tgt_file.path, &tgt_file_sha1);
+  ASSERT_EQ(recovery_img_sha1, tgt_file_sha1);
+}
+
 TEST_F(ApplyPatchModesTest, PatchModeInvalidArgs) {
   // Invalid bonus file.
   ASSERT_NE(0, applypatch_modes(3, (const char* []){ "applypatch", "-b", "/doesntexist" }));
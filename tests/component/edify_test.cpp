@@ -75,6 +75,20 @@ TEST_F(EdifyTest, concat) {
     expect("\"concat\"(a + b,\nc,\"d\")", "abcd");
 }
 
+TEST_F(EdifyTest, concat_folding) {
+    // Concatenations of literals become a single literal at parse time.
+    std::unique_ptr<Expr> e;
+    int error_count = 0;
+    ASSERT_EQ(0, parse_string("a + b + concat(c, \"d\")", &e, &error_count));
+    EXPECT_EQ(Literal, e->fn);
+    EXPECT_EQ("abcd", e->name);
+
+    // Anything else is still evaluated when the script runs.
+    ASSERT_EQ(0, parse_string("a + concat(b, stdout(c))", &e, &error_count));
+    EXPECT_EQ(ConcatFn, e->fn);
+    expect("a + concat(b, \"\") + ifelse(\"\", x, c)", "abc");
+}
+
 TEST_F(EdifyTest, logical) {
     // logical and
     expect("a && b", "b");
@@ -17,6 +17,7 @@
 #include <stdio.h>
 
 #include <algorithm>
+#include <atomic>
 #include <string>
 #include <tuple>
 #include <vector>
@@ -26,6 +27,7 @@
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/test_utils.h>
+#include <applypatch/deflate_backend.h>
 #include <applypatch/imgdiff.h>
 #include <applypatch/imgdiff_image.h>
 #include <applypatch/imgpatch.h>
@@ -1070,3 +1072,265 @@ TEST(ImgdiffTest, zip_mode_large_apk_skipped_small_target_chunk) {
   // src_piece 1: a-0 1 block, CD
   GenerateAndCheckSplitTarget(debug_dir.path, 2, tgt);
 }
+
+static void GenerateZipPatchWithJobs(const std::string& src_path, const std::string& tgt_path,
+                                     const std::vector<const char*>& extra_args,
+                                     std::string* patch) {
+  TemporaryFile patch_file;
+  std::vector<const char*> args = { "imgdiff", "-z" };
+  args.insert(args.end(), extra_args.begin(), extra_args.end());
+  args.insert(args.end(), { src_path.c_str(), tgt_path.c_str(), patch_file.path });
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, patch));
+}
+
+TEST(ImgdiffTest, zip_mode_jobs_deterministic) {
+  std::string tgt_path = from_testdata_base("deflate_tgt.zip");
+  std::string src_path = from_testdata_base("deflate_src.zip");
+
+  std::string patch_serial;
+  GenerateZipPatchWithJobs(src_path, tgt_path, {}, &patch_serial);
+
+  // The patch must not depend on the number of jobs or on the memory budget.
+  std::string patch_parallel;
+  GenerateZipPatchWithJobs(src_path, tgt_path, { "-j", "4" }, &patch_parallel);
+  ASSERT_EQ(patch_serial, patch_parallel);
+
+  std::string patch_budget;
+  GenerateZipPatchWithJobs(src_path, tgt_path, { "--jobs=4", "--memory-budget=1" }, &patch_budget);
+  ASSERT_EQ(patch_serial, patch_budget);
+
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_path, &src));
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_path, &tgt));
+  verify_patched_image(src, patch_parallel, tgt);
+}
+
+TEST(ImgdiffTest, image_mode_jobs_deterministic) {
+  // Three gzipped chunks separated by normal data, so that image mode has several chunk patches to
+  // compute.
+  // gzipped "xyz" (echo -n "xyz" | gzip -f | hd).
+  const std::vector<char> gzipped_xyz = { '\x1f', '\x8b', '\x08', '\x00', '\xc4', '\x1e', '\x53',
+                                          '\x58', '\x00', '\x03', '\xab', '\xa8', '\xac', '\x02',
+                                          '\x00', '\x67', '\xba', '\x8e', '\xeb', '\x03', '\x00',
+                                          '\x00', '\x00' };
+  // gzipped "xxyyzz".
+  const std::vector<char> gzipped_xxyyzz = {
+    '\x1f', '\x8b', '\x08', '\x00', '\x62', '\x1f', '\x53', '\x58', '\x00', '\x03', '\xab', '\xa8',
+    '\xa8', '\xac', '\xac', '\xaa', '\x02', '\x00', '\x96', '\x30', '\x06', '\xb7', '\x06', '\x00',
+    '\x00', '\x00'
+  };
+
+  std::string src;
+  std::string tgt;
+  for (size_t i = 0; i < 3; i++) {
+    src += std::string(100, static_cast<char>('a' + i));
+    src.append(gzipped_xyz.cbegin(), gzipped_xyz.cend());
+    tgt += std::string(100, static_cast<char>('a' + i)) + "ghi";
+    tgt.append(gzipped_xxyyzz.cbegin(), gzipped_xxyyzz.cend());
+  }
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file_serial;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file_serial.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  TemporaryFile patch_file_parallel;
+  args = {
+    "imgdiff", "-j", "3", src_file.path, tgt_file.path, patch_file_parallel.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string patch_serial;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file_serial.path, &patch_serial));
+  std::string patch_parallel;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file_parallel.path, &patch_parallel));
+  ASSERT_EQ(patch_serial, patch_parallel);
+
+  size_t num_deflate;
+  verify_patch_header(patch_parallel, nullptr, nullptr, &num_deflate);
+  ASSERT_EQ(3U, num_deflate);
+
+  verify_patched_image(src, patch_parallel, tgt);
+}
+
+TEST(ImgdiffTest, invalid_jobs) {
+  TemporaryFile src_file;
+  TemporaryFile tgt_file;
+  TemporaryFile patch_file;
+
+  std::vector<const char*> args = {
+    "imgdiff", "-j", "0", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(1, imgdiff(args.size(), args.data()));
+
+  args = {
+    "imgdiff", "--memory-budget=abc", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(1, imgdiff(args.size(), args.data()));
+}
+
+TEST(ImgdiffTest, zip_mode_suffix_array_cache) {
+  std::string tgt_path = from_testdata_base("deflate_tgt.zip");
+  std::string src_path = from_testdata_base("deflate_src.zip");
+
+  TemporaryFile split_info_file;
+  std::string split_info_arg = android::base::StringPrintf("--split-info=%s", split_info_file.path);
+  const char* split_arg = split_info_arg.c_str();
+
+  std::string patch;
+  GenerateZipPatchWithJobs(src_path, tgt_path, { "--block-limit=10", split_arg }, &patch);
+
+  // Reusing the suffix arrays, with or without threads, must not change the patch; neither must a
+  // small cache that keeps evicting them.
+  std::string patch_cached;
+  GenerateZipPatchWithJobs(src_path, tgt_path,
+                           { "--block-limit=10", split_arg, "--suffix-array-cache=64" },
+                           &patch_cached);
+  ASSERT_EQ(patch, patch_cached);
+
+  std::string patch_cached_parallel;
+  GenerateZipPatchWithJobs(src_path, tgt_path,
+                           { "--block-limit=10", split_arg, "--suffix-array-cache=64", "-j", "4" },
+                           &patch_cached_parallel);
+  ASSERT_EQ(patch, patch_cached_parallel);
+
+  std::string patch_small_cache;
+  GenerateZipPatchWithJobs(src_path, tgt_path,
+                           { "--block-limit=10", split_arg, "--suffix-array-cache=1" },
+                           &patch_small_cache);
+  ASSERT_EQ(patch, patch_small_cache);
+}
+
+// Input with long matches, short matches, literals and runs, so that every encoder path of deflate
+// gets used.
+static std::string DeflateTestInput() {
+  std::string data;
+  for (int i = 0; i < 2000; i++) {
+    data += android::base::StringPrintf("line %d: the quick brown fox %d\n", i % 37, i * 7919);
+  }
+  data.append(20000, '\0');
+  for (int i = 0; i < 30000; i++) {
+    data += static_cast<char>((i * 1103515245 + 12345) >> 16);
+  }
+  data += data.substr(1000, 40000);
+  return data;
+}
+
+// Puts zlib back when a test that installed a backend ends, also when an assertion failed.
+struct DeflateBackendReset {
+  ~DeflateBackendReset() {
+    SetDeflateBackend(nullptr);
+  }
+};
+
+// A backend that always compresses at level 1, so it is only exact for level 1. It stands in for
+// a faster encoder that matches zlib for some of the parameters only.
+static int LevelOneInit(z_stream* strm, int, int method, int window_bits, int mem_level,
+                        int strategy) {
+  return ZlibDeflateBackend().init(strm, 1, method, window_bits, mem_level, strategy);
+}
+
+static bool LevelOneExact(int level, int, int, int, int) {
+  return level == 1;
+}
+
+TEST(DeflateBackendTest, installed_backend_matches_zlib) {
+  const DeflateBackend& zlib = ZlibDeflateBackend();
+  const DeflateBackend level_one = {
+    "level_one", LevelOneInit, zlib.deflate, zlib.end, LevelOneExact,
+  };
+  const std::string data = DeflateTestInput();
+  const uint8_t* input = reinterpret_cast<const uint8_t*>(data.data());
+
+  // The backend is really different from zlib where it is not exact, so picking it there would
+  // show up below.
+  std::string zlib_level9;
+  ASSERT_EQ(Z_OK, DeflateWith(zlib, input, data.size(), 9, Z_DEFLATED, -15, 8,
+                              Z_DEFAULT_STRATEGY, &zlib_level9));
+  std::string backend_level9;
+  ASSERT_EQ(Z_OK, DeflateWith(level_one, input, data.size(), 9, Z_DEFLATED, -15, 8,
+                              Z_DEFAULT_STRATEGY, &backend_level9));
+  ASSERT_NE(zlib_level9, backend_level9);
+
+  DeflateBackendReset reset;
+  SetDeflateBackend(&level_one);
+  for (int window_bits : { -15, 15, 31 }) {
+    for (int mem_level : { 8, 9 }) {
+      for (int strategy : { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE }) {
+        for (int level = 0; level <= 9; level++) {
+          const DeflateBackend& backend =
+              GetDeflateBackend(level, Z_DEFLATED, window_bits, mem_level, strategy);
+          ASSERT_EQ(level == 1 ? &level_one : &zlib, &backend) << "level " << level;
+          std::string expected;
+          ASSERT_EQ(Z_OK, DeflateWith(zlib, input, data.size(), level, Z_DEFLATED, window_bits,
+                                      mem_level, strategy, &expected));
+          std::string actual;
+          ASSERT_EQ(Z_OK, DeflateWith(backend, input, data.size(), level, Z_DEFLATED, window_bits,
+                                      mem_level, strategy, &actual));
+          ASSERT_EQ(expected, actual) << backend.name << " level " << level << " window_bits "
+                                      << window_bits << " mem_level " << mem_level << " strategy "
+                                      << strategy;
+        }
+      }
+    }
+  }
+}
+
+static std::atomic<int> counting_backend_calls(0);
+
+static int CountingInit(z_stream* strm, int level, int method, int window_bits, int mem_level,
+                        int strategy) {
+  counting_backend_calls++;
+  return ZlibDeflateBackend().init(strm, level, method, window_bits, mem_level, strategy);
+}
+
+static bool CountingExact(int level, int, int, int, int) {
+  return level == 6;
+}
+
+TEST(DeflateBackendTest, zip_mode_with_backend) {
+  const DeflateBackend& zlib = ZlibDeflateBackend();
+  const DeflateBackend counting = {
+    "counting", CountingInit, zlib.deflate, zlib.end, CountingExact,
+  };
+
+  std::string tgt_path = from_testdata_base("deflate_tgt.zip");
+  std::string src_path = from_testdata_base("deflate_src.zip");
+  std::string patch;
+  GenerateZipPatchWithJobs(src_path, tgt_path, {}, &patch);
+
+  // The backend only gets the parameters it is exact for, and neither imgdiff nor imgpatch may
+  // produce anything different with it.
+  DeflateBackendReset reset;
+  SetDeflateBackend(&counting);
+  ASSERT_EQ(&counting, &GetDeflateBackend(6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY));
+  ASSERT_EQ(&zlib, &GetDeflateBackend(9, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY));
+
+  counting_backend_calls = 0;
+  std::string patch_backend;
+  GenerateZipPatchWithJobs(src_path, tgt_path, {}, &patch_backend);
+  int imgdiff_calls = counting_backend_calls;
+
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_path, &src));
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_path, &tgt));
+  counting_backend_calls = 0;
+  std::string patched;
+  GenerateTarget(src, patch_backend, &patched);
+  int imgpatch_calls = counting_backend_calls;
+  SetDeflateBackend(nullptr);
+
+  ASSERT_EQ(&zlib, &GetDeflateBackend(6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY));
+  ASSERT_GT(imgdiff_calls, 0);
+  ASSERT_GT(imgpatch_calls, 0);
+  ASSERT_EQ(patch, patch_backend);
+  ASSERT_EQ(tgt, patched);
+}
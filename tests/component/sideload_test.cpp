@@ -14,14 +14,19 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
+#include <stdlib.h>
 #include <unistd.h>
 
+#include <deque>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/strings.h>
 #include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
 
 #include "fuse_sideload.h"
@@ -96,3 +101,144 @@ TEST(SideloadTest, run_fuse_sideload) {
   ASSERT_EQ(0, WEXITSTATUS(status));
   ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
 }
+
+TEST(SideloadTest, run_fuse_sideload_random_reads) {
+  // 64 blocks so the cache has to evict, and reads that jump around and span two blocks.
+  static constexpr uint32_t kBlockSize = 4096;
+  static constexpr uint32_t kBlocks = 64;
+  std::string content;
+  for (uint32_t i = 0; i < kBlocks * kBlockSize; ++i) {
+    content.push_back(static_cast<char>((i * 7 + i / kBlockSize) & 0xff));
+  }
+
+  provider_vtab vtab;
+  vtab.close = [](void) {};
+  vtab.read_block = [&content](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    if (block >= kBlocks) return -1;
+    content.copy(reinterpret_cast<char*>(buffer), fetch_size, block * kBlockSize);
+    return 0;
+  };
+
+  TemporaryDir mount_point;
+  pid_t pid = fork();
+  if (pid == 0) {
+    ASSERT_EQ(0, run_fuse_sideload(vtab, content.size(), kBlockSize, mount_point.path));
+    _exit(EXIT_SUCCESS);
+  }
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  int status;
+  static constexpr int kSideloadInstallTimeout = 10;
+  for (int i = 0; i < kSideloadInstallTimeout; ++i) {
+    ASSERT_NE(-1, waitpid(pid, &status, WNOHANG));
+
+    struct stat sb;
+    if (stat(package.c_str(), &sb) == 0) {
+      break;
+    }
+
+    if (errno == ENOENT && i < kSideloadInstallTimeout - 1) {
+      sleep(1);
+      continue;
+    }
+    FAIL() << "Timed out waiting for the fuse-provided package.";
+  }
+
+  android::base::unique_fd package_fd(open(package.c_str(), O_RDONLY));
+  ASSERT_NE(-1, package_fd.get());
+  unsigned int seed = 42;
+  for (int i = 0; i < 500; ++i) {
+    off_t offset = rand_r(&seed) % content.size();
+    size_t size = 1 + rand_r(&seed) % kBlockSize;
+    if (offset + size > content.size()) size = content.size() - offset;
+    std::string buffer(size, '\0');
+    ASSERT_EQ(static_cast<ssize_t>(size), pread(package_fd.get(), &buffer[0], size, offset));
+    ASSERT_EQ(content.substr(offset, size), buffer);
+  }
+  package_fd.reset();
+
+  std::string exit_flag = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
+  struct stat sb;
+  ASSERT_EQ(0, stat(exit_flag.c_str(), &sb));
+
+  waitpid(pid, &status, 0);
+  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+}
+
+TEST(SideloadTest, run_fuse_sideload_pipelined) {
+  // Requests and answers are split, answers have to come back in request order.
+  static constexpr uint32_t kBlockSize = 4096;
+  static constexpr uint32_t kBlocks = 64;
+  std::string content;
+  for (uint32_t i = 0; i < kBlocks * kBlockSize - 100; ++i) {
+    content.push_back(static_cast<char>((i * 13 + i / kBlockSize) & 0xff));
+  }
+
+  std::mutex queue_lock;
+  std::deque<uint32_t> requested;
+  provider_vtab vtab;
+  vtab.close = [](void) {};
+  vtab.read_block = [](uint32_t, uint8_t*, uint32_t) { return -1; };
+  vtab.request_block = [&](uint32_t block) {
+    if (block >= kBlocks) return -1;
+    std::lock_guard<std::mutex> lock(queue_lock);
+    requested.push_back(block);
+    return 0;
+  };
+  vtab.receive_block = [&](uint8_t* buffer, uint32_t fetch_size) {
+    std::lock_guard<std::mutex> lock(queue_lock);
+    if (requested.empty()) return -1;
+    content.copy(reinterpret_cast<char*>(buffer), fetch_size, requested.front() * kBlockSize);
+    requested.pop_front();
+    return 0;
+  };
+
+  TemporaryDir mount_point;
+  pid_t pid = fork();
+  if (pid == 0) {
+    ASSERT_EQ(0, run_fuse_sideload(vtab, content.size(), kBlockSize, mount_point.path));
+    _exit(EXIT_SUCCESS);
+  }
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  int status;
+  static constexpr int kSideloadInstallTimeout = 10;
+  for (int i = 0; i < kSideloadInstallTimeout; ++i) {
+    ASSERT_NE(-1, waitpid(pid, &status, WNOHANG));
+
+    struct stat sb;
+    if (stat(package.c_str(), &sb) == 0) {
+      break;
+    }
+
+    if (errno == ENOENT && i < kSideloadInstallTimeout - 1) {
+      sleep(1);
+      continue;
+    }
+    FAIL() << "Timed out waiting for the fuse-provided package.";
+  }
+
+  // A sequential pass opens the prefetch window, then a few seeks close it again.
+  std::string content_read;
+  ASSERT_TRUE(android::base::ReadFileToString(package, &content_read));
+  ASSERT_EQ(content, content_read);
+  android::base::unique_fd package_fd(open(package.c_str(), O_RDONLY));
+  ASSERT_NE(-1, package_fd.get());
+  unsigned int seed = 7;
+  for (int i = 0; i < 100; ++i) {
+    off_t offset = rand_r(&seed) % content.size();
+    size_t size = 1 + rand_r(&seed) % (2 * kBlockSize);
+    if (offset + size > content.size()) size = content.size() - offset;
+    std::string buffer(size, '\0');
+    ASSERT_EQ(static_cast<ssize_t>(size), pread(package_fd.get(), &buffer[0], size, offset));
+    ASSERT_EQ(content.substr(offset, size), buffer);
+  }
+  package_fd.reset();
+
+  std::string exit_flag = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
+  struct stat sb;
+  ASSERT_EQ(0, stat(exit_flag.c_str(), &sb));
+
+  waitpid(pid, &status, 0);
+  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+}
@@ -721,6 +721,120 @@ TEST_F(UpdaterTest, block_image_update_patch_data) {
   CloseArchive(handle);
 }
 
+TEST_F(UpdaterTest, block_image_update_read_ahead) {
+  std::string block_a(4096, 'a');
+  std::string block_b(4096, 'b');
+  std::string block_c(4096, 'c');
+  std::string block_d(4096, 'd');
+  std::string a_hash = get_sha1(block_a);
+  std::string b_hash = get_sha1(block_b);
+
+  // The second move reads the block written by the first one, so it must not be read ahead. The
+  // third move doesn't touch block 3 that the second one writes.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "3",
+    "0",
+    "0",
+    "move " + a_hash + " 2,2,3 1 2,0,1",
+    "move " + a_hash + " 2,3,4 1 2,2,3",
+    "move " + b_hash + " 2,0,1 1 2,1,2",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(
+      android::base::WriteStringToFile(block_a + block_b + block_c + block_d, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(block_b + block_b + block_a + block_a, updated_content);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_stash_source_overwritten) {
+  std::string block1(4096, '1');
+  std::string block2(4096, '2');
+  std::string block1_hash = get_sha1(block1);
+  std::string block2_hash = get_sha1(block2);
+
+  // The first move overwrites the source of the stash, which must be written out before, and the
+  // second move only reads from the stash.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "2",
+    "0",
+    "1",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block2_hash + " 2,0,1 1 2,1,2",
+    "move " + block1_hash + " 2,1,2 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(block2 + block1, updated_content);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
 TEST_F(UpdaterTest, block_image_update_fail) {
   std::string src_content(4096 * 2, 'e');
   std::string src_hash = get_sha1(src_content);
@@ -123,6 +123,21 @@ TEST(RangeSetTest, Overlaps) {
   ASSERT_FALSE(RangeSet::Parse("2,5,7").Overlaps(RangeSet::Parse("2,3,5")));
 }
 
+TEST(RangeSetTest, Overlaps_Unsorted) {
+  RangeSet sorted = RangeSet::Parse("6,1,3,10,12,20,30");
+  RangeSet unsorted = RangeSet::Parse("4,15,20,3,10");
+  ASSERT_FALSE(sorted.Overlaps(unsorted));
+  ASSERT_FALSE(unsorted.Overlaps(sorted));
+
+  unsorted = RangeSet::Parse("6,15,20,3,10,29,40");
+  ASSERT_TRUE(sorted.Overlaps(unsorted));
+  ASSERT_TRUE(unsorted.Overlaps(sorted));
+
+  // Neither is sorted.
+  ASSERT_TRUE(RangeSet::Parse("4,8,10,1,3").Overlaps(RangeSet::Parse("6,20,22,12,14,2,3")));
+  ASSERT_FALSE(RangeSet::Parse("4,8,10,1,3").Overlaps(RangeSet::Parse("6,20,22,12,14,3,8")));
+}
+
 TEST(RangeSetTest, Split) {
   RangeSet rs1 = RangeSet::Parse("2,1,2");
   ASSERT_TRUE(rs1);
@@ -211,6 +226,11 @@ TEST(RangeSetTest, GetBlockNumber) {
 
   // Out of bound.
   ASSERT_EXIT(rs.GetBlockNumber(9), ::testing::KilledBySignal(SIGABRT), "");
+
+  RangeSet rs2 = RangeSet::Parse("6,20,22,1,3,10,11");
+  ASSERT_EQ(static_cast<size_t>(21), rs2.GetBlockNumber(1));
+  ASSERT_EQ(static_cast<size_t>(1), rs2.GetBlockNumber(2));
+  ASSERT_EQ(static_cast<size_t>(10), rs2.GetBlockNumber(4));
 }
 
 TEST(RangeSetTest, equality) {
@@ -14,55 +14,35 @@
  * limitations under the License.
  */
 
-#include <pthread.h>
-#include <stdio.h>
 #include "tw_atomic.hpp"
 
 /*
- * According to this documentation:
- * https://developer.android.com/training/articles/smp.html
- * it is recommended to use mutexes instead of atomics. This class
- * provides us with a wrapper to make "atomic" variables easy to use.
+ * The compiler builtins are used rather than std::atomic so this also builds
+ * against stlport on older trees. Each operation is a single instruction or
+ * an ll/sc loop, a reader never waits for a writer the way it did when every
+ * access took a mutex.
  */
 
 TWAtomicInt::TWAtomicInt(int initial_value /* = 0 */) {
-	if (pthread_mutex_init(&mutex_lock, NULL) != 0) {
-		// This should hopefully never happen. If it does, the
-		// operations will not be atomic, but we will allow things to
-		// continue anyway after logging the issue and just hope for
-		// the best.
-		printf("TWAtomic error initializing mutex.\n");
-		use_mutex = false;
-	} else {
-		use_mutex = true;
-	}
 	value = initial_value;
 }
 
-TWAtomicInt::~TWAtomicInt() {
-	if (use_mutex)
-		pthread_mutex_destroy(&mutex_lock);
-}
-
 void TWAtomicInt::set_value(int new_value) {
-	if (use_mutex) {
-		pthread_mutex_lock(&mutex_lock);
-		value = new_value;
-		pthread_mutex_unlock(&mutex_lock);
-	} else {
-		value = new_value;
-	}
+	__atomic_store_n(&value, new_value, __ATOMIC_RELEASE);
 }
 
 int TWAtomicInt::get_value(void) {
-	int ret_val;
+	return __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+}
+
+int TWAtomicInt::exchange(int new_value) {
+	return __atomic_exchange_n(&value, new_value, __ATOMIC_ACQ_REL);
+}
+
+int TWAtomicInt::add(int delta) {
+	return __atomic_add_fetch(&value, delta, __ATOMIC_ACQ_REL);
+}
 
-	if (use_mutex) {
-		pthread_mutex_lock(&mutex_lock);
-		ret_val = value;
-		pthread_mutex_unlock(&mutex_lock);
-	} else {
-		ret_val = value;
-	}
-	return ret_val;
+bool TWAtomicInt::compare_exchange(int expected, int new_value) {
+	return __atomic_compare_exchange_n(&value, &expected, new_value, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
 }
@@ -17,20 +17,22 @@
 #ifndef _TWATOMIC_HPP_HEADER
 #define _TWATOMIC_HPP_HEADER
 
-#include <pthread.h>
-
+// An int shared between threads. Loads and stores are single atomic
+// instructions, with acquire and release ordering so data written before
+// set_value is visible to the thread that reads the new value. Holds the
+// GUI's render request, the backup cancel flag and the MTP inotify stop flag.
 class TWAtomicInt
 {
 public:
 	TWAtomicInt(int initial_value = 0);
-	~TWAtomicInt();
 	void set_value(int new_value);
 	int get_value();
+	int exchange(int new_value);                      // Returns the previous value
+	int add(int delta);                               // Returns the new value
+	bool compare_exchange(int expected, int new_value); // True if the value was expected and is now new_value
 
 private:
 	int value;
-	bool use_mutex;
-	pthread_mutex_t mutex_lock;
 };
 
 #endif //_TWATOMIC_HPP_HEADER
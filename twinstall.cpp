@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -32,6 +33,8 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <map>
+#include <utility>
 
 #include "twcommon.h"
 #include "mtdutils/mounts.h"
@@ -79,13 +82,46 @@ enum zip_type {
 	TWRP_THEME_ZIP_TYPE
 };
 
+enum zip_digest_result {
+	ZIP_DIGEST_NONE = 0,		// no digest file next to the zip
+	ZIP_DIGEST_UNREADABLE,
+	ZIP_DIGEST_FAILED,		// the zip could not be read
+	ZIP_DIGEST_MISMATCH,
+	ZIP_DIGEST_MATCHED
+};
+
+// Digest and signature check of the next queued zip and the extraction of its
+// update binary, done while the zip before it installs
+struct Zip_Prefetch {
+	string path;
+	struct stat st;			// the zip when it was checked
+	string binary;			// where the update binary is staged
+	pthread_t thread;
+	bool joined;
+	int zip_verify;
+	int digest;
+	int verify_ret;
+	bool binary_staged;
+	bool legacy_props;		// the staged binary wants legacy properties
+};
+
+// Signature check of a zip running alongside the start of the install
+struct Zip_Verify_Job {
+	string path;
+	pthread_t thread;
+	bool running;
+	int ret;
+};
+
 // to support pre-KitKat update-binaries that expect properties in the legacy format
 static int switch_to_legacy_properties()
 {
-	if (!legacy_props_env_initd) {
-		if (legacy_properties_init() != 0)
-			return -1;
+	// The area is kept for the following installs and only copied again
+	// when the properties changed
+	if (legacy_properties_init() != 0)
+		return -1;
 
+	if (!legacy_props_env_initd) {
 		char tmp[32];
 		int propfd, propsz;
 		legacy_get_property_workspace(&propfd, &propsz);
@@ -150,12 +186,6 @@ static int Install_Theme(const char* path, ZipWrap *Zip) {
 }
 
 static int Prepare_Update_Binary(const char *path, ZipWrap *Zip, int* wipe_cache) {
-	if (!Zip->ExtractEntry(ASSUMED_UPDATE_BINARY_NAME, TMP_UPDATER_BINARY_PATH, 0755)) {
-		Zip->Close();
-		LOGERR("Could not extract '%s'\n", ASSUMED_UPDATE_BINARY_NAME);
-		return INSTALL_ERROR;
-	}
-
 	// If exists, extract file_contexts from the zip file
 	if (!Zip->EntryExists("file_contexts")) {
 		Zip->Close();
@@ -206,13 +236,50 @@ static bool update_binary_has_legacy_properties(const char *binary) {
 	return found;
 }
 
-static int Run_Update_Binary(const char *path, ZipWrap *Zip, int* wipe_cache, zip_type ztype) {
+// Whether the update binary of Zip, extracted to binary, wants legacy
+// properties. The answers are kept by the CRC-32 and size the zip records for
+// the binary, so a binary shipped in several zips is only scanned once.
+static bool Update_Binary_Uses_Legacy_Props(ZipWrap *Zip, const char *binary) {
+#ifdef TW_NO_LEGACY_PROPS
+	return false;
+#else
+	static std::map<std::pair<uint32_t, long>, bool> scanned;
+	static pthread_mutex_t scanned_lock = PTHREAD_MUTEX_INITIALIZER;
+	uint32_t crc32;
+
+	if (!Zip->GetEntryCrc32(ASSUMED_UPDATE_BINARY_NAME, &crc32))
+		return update_binary_has_legacy_properties(binary);
+	std::pair<uint32_t, long> key(crc32, Zip->GetUncompressedSize(ASSUMED_UPDATE_BINARY_NAME));
+	pthread_mutex_lock(&scanned_lock);
+	std::map<std::pair<uint32_t, long>, bool>::iterator it = scanned.find(key);
+	bool known = it != scanned.end(), found = known && it->second;
+	pthread_mutex_unlock(&scanned_lock);
+	if (known)
+		return found;
+	found = update_binary_has_legacy_properties(binary);
+	pthread_mutex_lock(&scanned_lock);
+	scanned[key] = found;
+	pthread_mutex_unlock(&scanned_lock);
+	return found;
+#endif
+}
+
+static bool Stage_Update_Binary(ZipWrap *Zip, const char *binary, bool *legacy_props) {
+	if (!Zip->ExtractEntry(ASSUMED_UPDATE_BINARY_NAME, binary, 0755)) {
+		LOGERR("Could not extract '%s'\n", ASSUMED_UPDATE_BINARY_NAME);
+		return false;
+	}
+	*legacy_props = Update_Binary_Uses_Legacy_Props(Zip, binary);
+	return true;
+}
+
+static int Run_Update_Binary(const char *path, ZipWrap *Zip, int* wipe_cache, zip_type ztype, bool legacy_props) {
 	int ret_val, pipe_fd[2], status, zip_verify;
 	char buffer[1024];
 	FILE* child_data;
 
 #ifndef TW_NO_LEGACY_PROPS
-	if (!update_binary_has_legacy_properties(TMP_UPDATER_BINARY_PATH)) {
+	if (!legacy_props) {
 		LOGINFO("Legacy property environment not used in updater.\n");
 	} else if (switch_to_legacy_properties() != 0) { /* Set legacy properties */
 		LOGERR("Legacy property environment did not initialize successfully. Properties may not be detected.\n");
@@ -314,130 +381,307 @@ static int Run_Update_Binary(const char *path, ZipWrap *Zip, int* wipe_cache, zi
 	return INSTALL_SUCCESS;
 }
 
-int TWinstall_zip(const char* path, int* wipe_cache) {
+// quiet leaves the progress bar and the console to the install running meanwhile
+static int Verify_Zip_Signature(const char* path, bool quiet) {
+	int ret_val;
+
+#ifdef USE_OLD_VERIFIER
+	MemMapping map;
+	if (sysMapFile(path, &map) != 0) {
+		gui_msg(Msg(msg::kError, "fail_sysmap=Failed to map file '{1}'")(path));
+		return VERIFY_FAILURE;
+	}
+	ret_val = verify_file(map.addr, map.length);
+	sysReleaseMap(&map);
+#else
+	std::vector<Certificate> loadedKeys;
+	if (!load_keys("/res/keys", loadedKeys)) {
+		LOGINFO("Failed to load keys");
+		if (!quiet)
+			gui_err("verify_zip_fail=Zip signature verification failed!");
+		return VERIFY_FAILURE;
+	}
+	// The package is hashed through a bounded read window instead of being mapped
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (!quiet)
+			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(path)(strerror(errno)));
+		if (fd >= 0)
+			close(fd);
+		return VERIFY_FAILURE;
+	}
+	std::function<void(float)> set_progress;
+	if (!quiet)
+		set_progress = std::bind(&DataManager::SetProgress, std::placeholders::_1);
+	ret_val = verify_file(fd, st.st_size, loadedKeys, set_progress);
+	close(fd);
+#endif
+	if (ret_val != VERIFY_SUCCESS) {
+		LOGINFO("Zip signature verification failed: %i\n", ret_val);
+		if (!quiet)
+			gui_err("verify_zip_fail=Zip signature verification failed!");
+	}
+	return ret_val;
+}
+
+static void* Zip_Verify_Thread(void* cookie) {
+	Zip_Verify_Job* job = (Zip_Verify_Job*) cookie;
+
+	job->ret = Verify_Zip_Signature(job->path.c_str(), false);
+	return NULL;
+}
+
+static void Start_Zip_Verify(Zip_Verify_Job* job, const char* path) {
+	gui_msg("verify_zip_sig=Verifying zip signature...");
+	job->path = path;
+	job->running = (pthread_create(&job->thread, NULL, Zip_Verify_Thread, job) == 0);
+	if (!job->running) {
+		LOGINFO("Unable to start zip verification thread, verifying first\n");
+		job->ret = Verify_Zip_Signature(path, false);
+	}
+}
+
+static int Finish_Zip_Verify(Zip_Verify_Job* job) {
+	if (job->running) {
+		pthread_join(job->thread, NULL);
+		job->running = false;
+	}
+	if (job->ret == VERIFY_SUCCESS)
+		gui_msg("verify_zip_done=Zip signature verified successfully.");
+	return job->ret;
+}
+
+static int Check_Zip_Digest(const char* path) {
+	string digest_str;
+	string Full_Filename = path;
+	string digest_file = path;
+	string defmd5file = digest_file + ".md5sum";
+
+	if (TWFunc::Path_Exists(defmd5file)) {
+		digest_file += ".md5sum";
+	}
+	else {
+		digest_file += ".md5";
+	}
+	if (!TWFunc::Path_Exists(digest_file))
+		return ZIP_DIGEST_NONE;
+	if (TWFunc::read_file(digest_file, digest_str) != 0)
+		return ZIP_DIGEST_UNREADABLE;
+
+	int ret = ZIP_DIGEST_FAILED;
+	twrpDigest *digest = new twrpMD5();
+	if (twrpDigestDriver::stream_file_to_digest(Full_Filename, digest))
+		ret = (digest_str == digest->return_digest_string() ? ZIP_DIGEST_MATCHED : ZIP_DIGEST_MISMATCH);
+	delete digest;
+	return ret;
+}
+
+// Shows the result of Check_Zip_Digest, false if the install has to stop
+static bool Report_Zip_Digest(const char* path, int result) {
+	gui_msg("check_for_digest=Checking for Digest file...");
+	switch (result) {
+		case ZIP_DIGEST_NONE:
+			gui_msg("no_digest=Skipping Digest check: no Digest file found");
+			return true;
+		case ZIP_DIGEST_UNREADABLE:
+			LOGERR("Skipping MD5 check: MD5 file unreadable\n");
+			return true;
+		case ZIP_DIGEST_MATCHED:
+			gui_msg(Msg("digest_matched=Digest matched for '{1}'.")(path));
+			return true;
+		case ZIP_DIGEST_MISMATCH:
+			LOGERR("Aborting zip install: Digest verification failed\n");
+			return false;
+	}
+	return false;
+}
+
+static bool Is_Sideload_Path(const char* path) {
+	return strlen(path) >= 9 && strncmp(path, "/sideload", 9) == 0;
+}
+
+static void* Zip_Prefetch_Thread(void* cookie) {
+	Zip_Prefetch* prefetch = (Zip_Prefetch*) cookie;
+	const char* path = prefetch->path.c_str();
+
+	prefetch->digest = Check_Zip_Digest(path);
+	if (prefetch->digest == ZIP_DIGEST_FAILED || prefetch->digest == ZIP_DIGEST_MISMATCH)
+		return NULL;
+	if (prefetch->zip_verify) {
+		prefetch->verify_ret = Verify_Zip_Signature(path, true);
+		if (prefetch->verify_ret != VERIFY_SUCCESS)
+			return NULL;
+	}
+	// The zip is closed again so the storage it is on can be unmounted by the
+	// install running meanwhile, only the update binary is kept
+	ZipWrap Zip;
+	if (Zip.Open(path)) {
+		if (Zip.EntryExists(ASSUMED_UPDATE_BINARY_NAME))
+			prefetch->binary_staged = Stage_Update_Binary(&Zip, prefetch->binary.c_str(), &prefetch->legacy_props);
+		Zip.Close();
+	}
+	return NULL;
+}
+
+Zip_Prefetch* TWinstall_Prefetch_Zip(const char* path) {
+	static unsigned prefetch_count;
+
+	if (Is_Sideload_Path(path))
+		return NULL;
+	Zip_Prefetch* prefetch = new Zip_Prefetch;
+	// Only a zip that is reachable now is read, mounting is left to its own install
+	if (stat(path, &prefetch->st) != 0) {
+		delete prefetch;
+		return NULL;
+	}
+	prefetch->path = path;
+	prefetch->zip_verify = 1;
+#ifndef TW_OEM_BUILD
+	DataManager::GetValue(TW_SIGNED_ZIP_VERIFY_VAR, prefetch->zip_verify);
+#endif
+	prefetch->digest = ZIP_DIGEST_FAILED;
+	prefetch->verify_ret = VERIFY_FAILURE;
+	prefetch->binary_staged = false;
+	prefetch->legacy_props = false;
+	prefetch->joined = false;
+	// Each prefetch stages to its own file, the one before may not be installed yet
+	prefetch->binary = TMP_UPDATER_BINARY_PATH ".next" + TWFunc::to_string(prefetch_count++);
+	unlink(prefetch->binary.c_str());
+	if (pthread_create(&prefetch->thread, NULL, Zip_Prefetch_Thread, prefetch) != 0) {
+		delete prefetch;
+		return NULL;
+	}
+	LOGINFO("Checking '%s' while the zip before it installs\n", path);
+	return prefetch;
+}
+
+void TWinstall_Discard_Prefetch(Zip_Prefetch* prefetch) {
+	if (!prefetch)
+		return;
+	if (!prefetch->joined)
+		pthread_join(prefetch->thread, NULL);
+	if (prefetch->binary_staged)
+		unlink(prefetch->binary.c_str());
+	delete prefetch;
+}
+
+// Waits for the prefetch of path, false if it has to be checked again because
+// it belongs to another file or the file changed since
+static bool Finish_Zip_Prefetch(Zip_Prefetch* prefetch, const char* path) {
+	struct stat st;
+
+	pthread_join(prefetch->thread, NULL);
+	prefetch->joined = true;
+	if (prefetch->path != path || stat(path, &st) != 0 || st.st_dev != prefetch->st.st_dev || st.st_ino != prefetch->st.st_ino
+			|| st.st_size != prefetch->st.st_size || st.st_mtime != prefetch->st.st_mtime) {
+		LOGINFO("'%s' changed since it was checked, checking it again\n", path);
+		return false;
+	}
+	return true;
+}
+
+int TWinstall_zip(const char* path, int* wipe_cache, Zip_Prefetch* prefetch) {
 	int ret_val, zip_verify = 1;
 
 	if (strcmp(path, "error") == 0) {
 		LOGERR("Failed to get adb sideload file: '%s'\n", path);
+		TWinstall_Discard_Prefetch(prefetch);
 		return INSTALL_CORRUPT;
 	}
 
 	gui_msg(Msg("installing_zip=Installing zip file '{1}'")(path));
-	if (strlen(path) < 9 || strncmp(path, "/sideload", 9) != 0) {
-		string digest_str;
-		string Full_Filename = path;
-		string digest_file = path;
-		string defmd5file = digest_file + ".md5sum";
-
-		if (TWFunc::Path_Exists(defmd5file)) {
-			digest_file += ".md5sum";
-		}
-		else {
-			digest_file += ".md5";
-		}
-
-		gui_msg("check_for_digest=Checking for Digest file...");
-		if (!TWFunc::Path_Exists(digest_file)) {
-			gui_msg("no_digest=Skipping Digest check: no Digest file found");
-		}
-		else {
-			if (TWFunc::read_file(digest_file, digest_str) != 0) {
-				LOGERR("Skipping MD5 check: MD5 file unreadable\n");
-			}
-			else {
-				twrpDigest *digest = new twrpMD5();
-				if (!twrpDigestDriver::stream_file_to_digest(Full_Filename, digest)) {
-					delete digest;
-					return INSTALL_CORRUPT;
-				}
-				string digest_check = digest->return_digest_string();
-				if (digest_str == digest_check) {
-					gui_msg(Msg("digest_matched=Digest matched for '{1}'.")(path));
-				}
-				else {
-					LOGERR("Aborting zip install: Digest verification failed\n");
-					delete digest;
-					return INSTALL_CORRUPT;
-				}
-				delete digest;
-			}
+	if (prefetch && !Finish_Zip_Prefetch(prefetch, path)) {
+		TWinstall_Discard_Prefetch(prefetch);
+		prefetch = NULL;
+	}
+	if (prefetch) {
+		if (!Report_Zip_Digest(path, prefetch->digest)) {
+			TWinstall_Discard_Prefetch(prefetch);
+			return INSTALL_CORRUPT;
 		}
+		zip_verify = prefetch->zip_verify;
+	} else if (!Is_Sideload_Path(path)) {
+		if (!Report_Zip_Digest(path, Check_Zip_Digest(path)))
+			return INSTALL_CORRUPT;
 	}
 
 #ifndef TW_OEM_BUILD
-	DataManager::GetValue(TW_SIGNED_ZIP_VERIFY_VAR, zip_verify);
+	if (!prefetch)
+		DataManager::GetValue(TW_SIGNED_ZIP_VERIFY_VAR, zip_verify);
 #endif
 	DataManager::SetProgress(0);
 
-	MemMapping map;
-#ifdef USE_MINZIP
-	if (sysMapFile(path, &map) != 0) {
-#else
-	if (!map.MapFile(path)) {
-#endif
-		gui_msg(Msg(msg::kError, "fail_sysmap=Failed to map file '{1}'")(path));
-		return -1;
-	}
-
-	if (zip_verify) {
+	Zip_Verify_Job verify_job;
+	verify_job.running = false;
+	verify_job.ret = VERIFY_SUCCESS;
+	if (zip_verify && prefetch) {
+		// Checked while the zip before this one installed
 		gui_msg("verify_zip_sig=Verifying zip signature...");
-#ifdef USE_OLD_VERIFIER
-		ret_val = verify_file(map.addr, map.length);
-#else
-		std::vector<Certificate> loadedKeys;
-		if (!load_keys("/res/keys", loadedKeys)) {
-			LOGINFO("Failed to load keys");
-			gui_err("verify_zip_fail=Zip signature verification failed!");
-#ifdef USE_MINZIP
-			sysReleaseMap(&map);
-#endif
-			return -1;
-		}
-		ret_val = verify_file(map.addr, map.length, loadedKeys, std::bind(&DataManager::SetProgress, std::placeholders::_1));
-#endif
-		if (ret_val != VERIFY_SUCCESS) {
-			LOGINFO("Zip signature verification failed: %i\n", ret_val);
+		verify_job.ret = prefetch->verify_ret;
+		if (verify_job.ret != VERIFY_SUCCESS)
 			gui_err("verify_zip_fail=Zip signature verification failed!");
-#ifdef USE_MINZIP
-			sysReleaseMap(&map);
-#endif
-			return -1;
-		} else {
-			gui_msg("verify_zip_done=Zip signature verified successfully.");
-		}
-	}
+	} else if (zip_verify)
+		Start_Zip_Verify(&verify_job, path);
+
+	// The central directory is read and the update binary extracted while the
+	// signature is checked, nothing else is taken from the zip until it matched
 	ZipWrap Zip;
-	if (!Zip.Open(path, &map)) {
+	zip_type ztype = UNKNOWN_ZIP_TYPE;
+	bool zip_opened = Zip.Open(path), binary_staged = false, legacy_props = false;
+	if (zip_opened) {
+		if (Zip.EntryExists(ASSUMED_UPDATE_BINARY_NAME))
+			ztype = UPDATE_BINARY_ZIP_TYPE;
+		else if (Zip.EntryExists(AB_OTA))
+			ztype = AB_OTA_ZIP_TYPE;
+		else if (Zip.EntryExists("ui.xml"))
+			ztype = TWRP_THEME_ZIP_TYPE;
+	}
+	if (ztype == UPDATE_BINARY_ZIP_TYPE) {
+		if (prefetch && prefetch->binary_staged && rename(prefetch->binary.c_str(), TMP_UPDATER_BINARY_PATH) == 0) {
+			binary_staged = true;
+			legacy_props = prefetch->legacy_props;
+		} else
+			binary_staged = Stage_Update_Binary(&Zip, TMP_UPDATER_BINARY_PATH, &legacy_props);
+	}
+	if (prefetch) {
+		prefetch->binary_staged = false;
+		TWinstall_Discard_Prefetch(prefetch);
+	}
+
+	if (zip_verify && Finish_Zip_Verify(&verify_job) != VERIFY_SUCCESS) {
+		Zip.Close();
+		unlink(TMP_UPDATER_BINARY_PATH);
+		return -1;
+	}
+	if (!zip_opened) {
 		gui_err("zip_corrupt=Zip file is corrupt!");
-#ifdef USE_MINZIP
-			sysReleaseMap(&map);
-#endif
 		return INSTALL_CORRUPT;
 	}
 
 	time_t start, stop;
 	time(&start);
-	if (Zip.EntryExists(ASSUMED_UPDATE_BINARY_NAME)) {
+	if (ztype == UPDATE_BINARY_ZIP_TYPE) {
 		LOGINFO("Update binary zip\n");
 		// Additionally verify the compatibility of the package.
 		if (!verify_package_compatibility(&Zip)) {
 			gui_err("zip_compatible_err=Zip Treble compatibility error!");
 			Zip.Close();
-#ifdef USE_MINZIP
-			sysReleaseMap(&map);
-#endif
 			ret_val = INSTALL_CORRUPT;
+		} else if (!binary_staged) {
+			Zip.Close();
+			ret_val = INSTALL_ERROR;
 		} else {
 			ret_val = Prepare_Update_Binary(path, &Zip, wipe_cache);
 			if (ret_val == INSTALL_SUCCESS)
-				ret_val = Run_Update_Binary(path, &Zip, wipe_cache, UPDATE_BINARY_ZIP_TYPE);
+				ret_val = Run_Update_Binary(path, &Zip, wipe_cache, UPDATE_BINARY_ZIP_TYPE, legacy_props);
 		}
 	} else {
-		if (Zip.EntryExists(AB_OTA)) {
+		if (ztype == AB_OTA_ZIP_TYPE) {
 			LOGINFO("AB zip\n");
-			ret_val = Run_Update_Binary(path, &Zip, wipe_cache, AB_OTA_ZIP_TYPE);
+			ret_val = Run_Update_Binary(path, &Zip, wipe_cache, AB_OTA_ZIP_TYPE, false);
 		} else {
-			if (Zip.EntryExists("ui.xml")) {
+			if (ztype == TWRP_THEME_ZIP_TYPE) {
 				LOGINFO("TWRP theme zip\n");
 				ret_val = Install_Theme(path, &Zip);
 			} else {
@@ -453,8 +697,5 @@ int TWinstall_zip(const char* path, int* wipe_cache) {
 	} else {
 		LOGINFO("Install took %i second(s).\n", total_time);
 	}
-#ifdef USE_MINZIP
-	sysReleaseMap(&map);
-#endif
 	return ret_val;
 }
@@ -1,6 +1,13 @@
 #ifndef RECOVERY_TWINSTALL_H_
 #define RECOVERY_TWINSTALL_H_
 
-int TWinstall_zip(const char* path, int* wipe_cache);
+struct Zip_Prefetch;
+
+// prefetch is the result of TWinstall_Prefetch_Zip for path or NULL, it is consumed
+int TWinstall_zip(const char* path, int* wipe_cache, Zip_Prefetch* prefetch = NULL);
+// Checks the digest and signature of a zip and stages its update binary on a
+// thread, so that overlaps with the install of the zip queued before it
+Zip_Prefetch* TWinstall_Prefetch_Zip(const char* path);
+void TWinstall_Discard_Prefetch(Zip_Prefetch* prefetch);
 
 #endif  // RECOVERY_TWINSTALL_H_
@@ -25,13 +25,18 @@
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/mount.h>
 #include <sys/reboot.h>
+#include <sys/klog.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -48,52 +53,181 @@
 #include "cutils/properties.h"
 #include "cutils/android_reboot.h"
 #include <sys/reboot.h>
+#include "twrpBackupCatalog.hpp"
 #endif // ndef BUILD_TWRPTAR_MAIN
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	#include "openaes/inc/oaes_lib.h"
 #endif
 #include "set_metadata.h"
+#include "twrpTrace.hpp"
+#include "twrpMemory.hpp"
+#include "twrpLog.hpp"
+#include "twrpTarCrypt.hpp"
+#include "exclude.hpp"
+#include "progresstracking.hpp"
 
 extern "C" {
 	#include "libcrecovery/common.h"
 }
 
-/* Execute a command */
-int TWFunc::Exec_Cmd(const string& cmd, string &result) {
-	FILE* exec;
-	char buffer[130];
-	int ret = 0;
-	exec = __popen(cmd.c_str(), "r");
-	if (!exec) return -1;
-	while (!feof(exec)) {
-		if (fgets(buffer, 128, exec) != NULL) {
-			result += buffer;
+// Only bionic names the klogctl actions
+#ifndef KLOG_READ_ALL
+#define KLOG_READ_ALL 3
+#endif
+#ifndef KLOG_SIZE_BUFFER
+#define KLOG_SIZE_BUFFER 10
+#endif
+
+// Splits a command line into arguments, shell syntax still goes through sh
+static vector<string> Command_Args(const string& cmd) {
+	vector<string> args;
+	string arg;
+
+	for (size_t i = 0; i < cmd.size(); i++) {
+		char c = cmd[i];
+		if (strchr("|&;<>()$`\\\"'*?[]~{}#\n", c) != NULL || (c == '=' && args.empty())) {
+			args.clear();
+			args.push_back("/sbin/sh");
+			args.push_back("-c");
+			args.push_back(cmd);
+			return args;
 		}
+		if (c == ' ' || c == '\t') {
+			if (!arg.empty())
+				args.push_back(arg);
+			arg.clear();
+		} else
+			arg += c;
 	}
-	ret = __pclose(exec);
-	return ret;
+	if (!arg.empty())
+		args.push_back(arg);
+	return args;
 }
 
-int TWFunc::Exec_Cmd(const string& cmd) {
+// Starts args[0] from the PATH, with its stdout on a pipe if out_fd is given.
+// Only dup2 and exec run in the child, so vfork is safe and skips copying the
+// page tables of recovery like a fork would.
+static pid_t Spawn_Process(const vector<string>& args, int *out_fd) {
+	vector<char*> argv;
+	int pipe_fd[2] = {-1, -1};
 	pid_t pid;
-	int status;
-	switch(pid = fork())
-	{
-		case -1:
-			LOGERR("Exec_Cmd(): vfork failed: %d!\n", errno);
-			return -1;
-		case 0: // child
-			execl("/sbin/sh", "sh", "-c", cmd.c_str(), NULL);
-			_exit(127);
-			break;
-		default:
-		{
-			if (TWFunc::Wait_For_Child(pid, &status, cmd) != 0)
+
+	if (args.empty())
+		return -1;
+	for (size_t i = 0; i < args.size(); i++)
+		argv.push_back(const_cast<char*>(args[i].c_str()));
+	argv.push_back(NULL);
+	if (out_fd != NULL && pipe2(pipe_fd, O_CLOEXEC) != 0) {
+		LOGERR("Unable to create pipe for '%s': %s\n", args[0].c_str(), strerror(errno));
+		return -1;
+	}
+	pid = vfork();
+	if (pid == 0) {
+		if (out_fd != NULL)
+			dup2(pipe_fd[1], STDOUT_FILENO);
+		execvp(argv[0], argv.data());
+		_exit(127);
+	}
+	if (pid < 0)
+		LOGERR("Exec_Cmd(): vfork failed: %d!\n", errno);
+	if (out_fd != NULL) {
+		close(pipe_fd[1]);
+		if (pid < 0)
+			close(pipe_fd[0]);
+		else
+			*out_fd = pipe_fd[0];
+	}
+	return pid;
+}
+
+int TWFunc::Exec_Args(const vector<string>& args, string *output, int timeout, Exec_Line_Callback callback, void *cookie) {
+	bool capture = (output != NULL || callback != NULL);
+	bool timed_out = false;
+	char buffer[4096];
+	string line;
+	timespec start, now;
+	int fd = -1, status = -1;
+	pid_t pid;
+
+	pid = Spawn_Process(args, capture ? &fd : NULL);
+	if (pid < 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		int wait_ms = -1;
+		if (timeout > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait_ms = timeout * 1000 - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+			if (wait_ms <= 0) {
+				timed_out = true;
+				break;
+			}
+		}
+		if (!capture) {
+			// Nothing to read, check for the exit every 10ms until the timeout
+			pid_t rc_pid = waitpid(pid, &status, timeout > 0 ? WNOHANG : 0);
+			if (rc_pid == pid)
+				return status;
+			if (rc_pid < 0 && errno != EINTR)
 				return -1;
-			else
-				return 0;
+			if (rc_pid == 0)
+				usleep(10000);
+			continue;
 		}
+		pollfd pfd = {fd, POLLIN, 0};
+		int ret = poll(&pfd, 1, wait_ms);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret == 0)
+			continue;
+		ssize_t bytes = (ret < 0 ? -1 : read(fd, buffer, sizeof(buffer)));
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			break;
+		if (output != NULL)
+			output->append(buffer, bytes);
+		if (callback != NULL) {
+			// Progress bars without newlines are cut into lines, so memory stays bounded
+			for (ssize_t i = 0; i < bytes; i++) {
+				if (buffer[i] == '\n' || line.size() >= sizeof(buffer)) {
+					callback(line, cookie);
+					line.clear();
+				}
+				if (buffer[i] != '\n')
+					line += buffer[i];
+			}
+		}
+	}
+	if (callback != NULL && !line.empty())
+		callback(line, cookie);
+	if (fd >= 0)
+		close(fd);
+	if (timed_out) {
+		LOGERR("%s took too long, killing process\n", args[0].c_str());
+		kill(pid, SIGKILL);
 	}
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+	return timed_out ? -1 : status;
+}
+
+/* Execute a command */
+int TWFunc::Exec_Cmd(const string& cmd, string &result) {
+	return Exec_Args(Command_Args(cmd), &result);
+}
+
+int TWFunc::Exec_Cmd(const string& cmd) {
+	int status;
+	pid_t pid = Spawn_Process(Command_Args(cmd), NULL);
+
+	if (pid < 0)
+		return -1;
+	if (TWFunc::Wait_For_Child(pid, &status, cmd) != 0)
+		return -1;
+	return 0;
 }
 
 // Returns "file.name" from a full /path/to/file.name
@@ -118,20 +252,29 @@ string TWFunc::Get_Path(const string& Path) {
 		return Path;
 }
 
+int TWFunc::Check_Child_Status(int status, const string& Child_Name) {
+	if (WIFSIGNALED(status)) {
+		gui_msg(Msg(msg::kError, "pid_signal={1} process ended with signal: {2}")(Child_Name)(WTERMSIG(status))); // Seg fault or some other non-graceful termination
+		twrpMemory::Dump(Child_Name); // SIGKILL is often the low memory killer
+		return -1;
+	} else if (WEXITSTATUS(status) == 0) {
+		LOGINFO("%s process ended with RC=%d\n", Child_Name.c_str(), WEXITSTATUS(status)); // Success
+	} else {
+		gui_msg(Msg(msg::kError, "pid_error={1} process ended with ERROR: {2}")(Child_Name)(WEXITSTATUS(status))); // Graceful exit, but there was an error
+		return -1;
+	}
+	return 0;
+}
+
 int TWFunc::Wait_For_Child(pid_t pid, int *status, string Child_Name) {
 	pid_t rc_pid;
+	struct rusage usage;
 
-	rc_pid = waitpid(pid, status, 0);
+	// wait4 for the peak RSS, which is how much the updater and its applypatch buffers took
+	rc_pid = wait4(pid, status, 0, &usage);
 	if (rc_pid > 0) {
-		if (WIFSIGNALED(*status)) {
-			gui_msg(Msg(msg::kError, "pid_signal={1} process ended with signal: {2}")(Child_Name)(WTERMSIG(*status))); // Seg fault or some other non-graceful termination
-			return -1;
-		} else if (WEXITSTATUS(*status) == 0) {
-			LOGINFO("%s process ended with RC=%d\n", Child_Name.c_str(), WEXITSTATUS(*status)); // Success
-		} else {
-			gui_msg(Msg(msg::kError, "pid_error={1} process ended with ERROR: {2}")(Child_Name)(WEXITSTATUS(*status))); // Graceful exit, but there was an error
-			return -1;
-		}
+		twrpMemory::Child_Exited(Child_Name, usage.ru_maxrss);
+		return Check_Child_Status(*status, Child_Name);
 	} else { // no PID returned
 		if (errno == ECHILD)
 			LOGERR("%s no child process exist\n", Child_Name.c_str());
@@ -186,14 +329,19 @@ bool TWFunc::Path_Exists(string Path) {
 }
 
 Archive_Type TWFunc::Get_File_Type(string fn) {
-	string::size_type i = 0;
-	int firstbyte = 0, secondbyte = 0;
-	char header[3];
+	unsigned char header[4] = {0, 0, 0, 0};
 
 	ifstream f;
 	f.open(fn.c_str(), ios::in | ios::binary);
-	f.get(header, 3);
+	f.read((char*)header, sizeof(header));
 	f.close();
+	return Get_Header_Type(header);
+}
+
+Archive_Type TWFunc::Get_Header_Type(const unsigned char *header) {
+	string::size_type i = 0;
+	int firstbyte = 0, secondbyte = 0;
+
 	firstbyte = header[i] & 0xff;
 	secondbyte = header[++i] & 0xff;
 
@@ -201,6 +349,10 @@ Archive_Type TWFunc::Get_File_Type(string fn) {
 		return COMPRESSED;
 	else if (firstbyte == 0x4f && secondbyte == 0x41)
 		return ENCRYPTED;
+	else if (twrpTarCrypt::Is_Header(header))
+		return ENCRYPTED; // AES-GCM chunks
+	else if (header[0] == 0x04 && header[1] == 0x22 && header[2] == 0x4d && header[3] == 0x18)
+		return COMPRESSED_LZ4; // LZ4 frame magic 0x184D2204
 	return UNCOMPRESSED; // default
 }
 
@@ -216,6 +368,32 @@ int TWFunc::Try_Decrypting_File(string fn, string password) {
 	int firstbyte = 0, secondbyte = 0;
 	size_t _j = 0;
 	size_t _key_data_len = 0;
+	unsigned char header[4] = {0, 0, 0, 0};
+
+	f = fopen(fn.c_str(), "rb");
+	if (f == NULL) {
+		LOGERR("Failed to open '%s' to try decrypt: %s\n", fn.c_str(), strerror(errno));
+		return -1;
+	}
+	read_len = fread(header, 1, sizeof(header), f);
+	fclose(f);
+	if (twrpTarCrypt::Is_Header(header)) {
+		bool gzip = false;
+
+		if (!twrpTarCrypt::Available()) {
+			LOGERR("'%s' uses AES-GCM encryption which is not included in this build.\n", fn.c_str());
+			return -1;
+		}
+		// One key derivation and a compare against the check value in the header
+		int ret = twrpTarCrypt::Check_Password(fn, password, &gzip);
+		if (ret <= 0) {
+			if (ret == 0)
+				LOGERR("Failed to decrypt file '%s'\n", fn.c_str());
+			return ret;
+		}
+		LOGINFO("Password matches '%s'%s.\n", fn.c_str(), gzip ? " and file is compressed" : "");
+		return gzip ? 3 : 2; // Compressed or tar
+	}
 
 	// mostly kanged from OpenAES oaes.c
 	for ( _j = 0; _j < 32; _j++ )
@@ -386,6 +564,190 @@ int32_t TWFunc::timespec_diff_ms(timespec& start, timespec& end)
 			((start.tv_sec * 1000) + start.tv_nsec/1000000);
 }
 
+int TWFunc::Recursive_Mkdir(string Path) {
+	vector<string> parts = split_string(Path, '/', true);
+	std::string cur_path;
+	for (size_t i = 0; i < parts.size(); ++i) {
+		cur_path += "/" + parts[i];
+		if (!TWFunc::Path_Exists(cur_path)) {
+			if (mkdir(cur_path.c_str(), 0777)) {
+				gui_msg(Msg(msg::kError, "create_folder_strerr=Can not create '{1}' folder ({2}).")(cur_path)(strerror(errno)));
+				return false;
+			} else {
+#ifndef BUILD_TWRPTAR_MAIN
+				tw_set_default_metadata(cur_path.c_str());
+#endif
+			}
+		}
+	}
+	return true;
+}
+
+#define REMOVE_DIR_MAX_THREADS 8
+
+struct remove_dir_walk {
+	TWExclude *exclude;
+	vector<string> dirs;                                   // folders waiting to be emptied
+	vector<string> removed_dirs;                           // every folder found, parents before their subfolders
+	unsigned active;                                       // threads currently emptying a folder
+	bool failed;
+	ProgressTracking *progress;
+	pthread_t progress_thread;                             // only this thread may update the GUI
+	string fs_path;
+	unsigned long long start_used;                         // used bytes on the file system before the wipe
+	timespec last_progress;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static unsigned long long Used_Bytes(const string& path) {
+	struct statfs st;
+	if (statfs(path.c_str(), &st) != 0)
+		return 0;
+	return (unsigned long long)(st.f_blocks - st.f_bfree) * st.f_bsize;
+}
+
+// Unlinks everything in the folder except subfolders, which are returned to
+// be emptied next. Returns false if anything could not be removed.
+static bool Empty_Folder(struct remove_dir_walk *walk, const string& path, vector<string> *subdirs) {
+	struct dirent* de;
+	struct stat st;
+	bool ret = true;
+	unsigned char type;
+
+	DIR* d = opendir(path.c_str());
+	if (d == NULL) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(path)(strerror(errno)));
+		return false;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (walk->exclude && walk->exclude->check_skip_name(path, de->d_name)) {
+			LOGINFO("skipped '%s/%s'\n", path.c_str(), de->d_name);
+			continue;
+		}
+		type = de->d_type;
+		if (type == DT_UNKNOWN) {
+			if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+				continue;
+			type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+		}
+		if (type == DT_DIR) {
+			subdirs->push_back(path + "/" + de->d_name);
+		} else if (unlinkat(dirfd(d), de->d_name, 0) != 0) {
+			LOGINFO("Unable to unlink '%s/%s': %s\n", path.c_str(), de->d_name, strerror(errno));
+			ret = false;
+		}
+	}
+	closedir(d);
+	return ret;
+}
+
+static void Update_Remove_Progress(struct remove_dir_walk *walk) {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (TWFunc::timespec_diff_ms(walk->last_progress, now) < PROGRESS_UPDATE_INTERVAL_MS)
+		return;
+	walk->last_progress = now;
+	unsigned long long used = Used_Bytes(walk->fs_path);
+	walk->progress->UpdateSize(used < walk->start_used ? walk->start_used - used : 0);
+}
+
+static void* Remove_Dir_Thread(void *cookie) {
+	struct remove_dir_walk *walk = (struct remove_dir_walk*) cookie;
+	vector<string> subdirs;
+	string dir;
+	bool ok;
+
+	pthread_mutex_lock(&walk->lock);
+	for (;;) {
+		while (walk->dirs.empty() && walk->active > 0)
+			pthread_cond_wait(&walk->cond, &walk->lock);
+		if (walk->dirs.empty())
+			break;
+		dir = walk->dirs.back();
+		walk->dirs.pop_back();
+		walk->active++;
+		pthread_mutex_unlock(&walk->lock);
+
+		subdirs.clear();
+		ok = Empty_Folder(walk, dir, &subdirs);
+		if (walk->progress && pthread_equal(pthread_self(), walk->progress_thread))
+			Update_Remove_Progress(walk);
+
+		pthread_mutex_lock(&walk->lock);
+		if (!ok)
+			walk->failed = true;
+		walk->dirs.insert(walk->dirs.end(), subdirs.begin(), subdirs.end());
+		walk->removed_dirs.insert(walk->removed_dirs.end(), subdirs.begin(), subdirs.end());
+		walk->active--;
+		pthread_cond_broadcast(&walk->cond);
+	}
+	pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+	return NULL;
+}
+
+int TWFunc::removeDir(const string path, bool skipParent, TWExclude *exclusions, ProgressTracking *progress) {
+	struct remove_dir_walk walk;
+	pthread_t threads[REMOVE_DIR_MAX_THREADS];
+	unsigned thread_count, started = 0, i;
+
+	walk.exclude = exclusions;
+	walk.active = 0;
+	walk.failed = false;
+	walk.progress = progress;
+	walk.progress_thread = pthread_self();
+	walk.fs_path = path;
+	walk.start_used = progress ? Used_Bytes(path) : 0;
+	clock_gettime(CLOCK_MONOTONIC, &walk.last_progress);
+	walk.dirs.push_back(path);
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+
+	// Files are unlinked by several threads sharing a stack of folders, the
+	// calling thread takes part too and is the one updating the progress
+	thread_count = sysconf(_SC_NPROCESSORS_CONF);
+	if (thread_count > REMOVE_DIR_MAX_THREADS)
+		thread_count = REMOVE_DIR_MAX_THREADS;
+	for (i = 1; i < thread_count; i++) {
+		if (pthread_create(&threads[started], NULL, Remove_Dir_Thread, (void*)&walk) != 0)
+			break;
+		started++;
+	}
+	Remove_Dir_Thread((void*)&walk);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+
+	// Subfolders were found after their parents, remove them deepest first.
+	// Folders holding excluded entries are expected to stay.
+	for (vector<string>::reverse_iterator it = walk.removed_dirs.rbegin(); it != walk.removed_dirs.rend(); ++it) {
+		if (rmdir(it->c_str()) != 0 && !(exclusions && errno == ENOTEMPTY)) {
+			LOGINFO("Unable to remove '%s': %s\n", it->c_str(), strerror(errno));
+			walk.failed = true;
+		}
+	}
+	if (progress) {
+		unsigned long long used = Used_Bytes(path);
+		progress->UpdateSize(used < walk.start_used ? walk.start_used - used : 0);
+	}
+	if (walk.failed)
+		return -1;
+	if (!skipParent)
+		return rmdir(path.c_str());
+	return 0;
+}
+
+std::string TWFunc::to_string(unsigned long value) {
+	std::ostringstream os;
+	os << value;
+	return os.str();
+}
+
 #ifndef BUILD_TWRPTAR_MAIN
 
 // Returns "/path" from a full /path/to/file.name
@@ -459,23 +821,6 @@ void TWFunc::htc_dumlock_reflash_recovery_to_boot(void) {
 	gui_msg("done=Done.");
 }
 
-int TWFunc::Recursive_Mkdir(string Path) {
-	std::vector<std::string> parts = Split_String(Path, "/", true);
-	std::string cur_path;
-	for (size_t i = 0; i < parts.size(); ++i) {
-		cur_path += "/" + parts[i];
-		if (!TWFunc::Path_Exists(cur_path)) {
-			if (mkdir(cur_path.c_str(), 0777)) {
-				gui_msg(Msg(msg::kError, "create_folder_strerr=Can not create '{1}' folder ({2}).")(cur_path)(strerror(errno)));
-				return false;
-			} else {
-				tw_set_default_metadata(cur_path.c_str());
-			}
-		}
-	}
-	return true;
-}
-
 void TWFunc::GUI_Operation_Text(string Read_Value, string Default_Text) {
 	string Display_Text;
 
@@ -500,22 +845,11 @@ void TWFunc::GUI_Operation_Text(string Read_Value, string Partition_Name, string
 
 void TWFunc::Copy_Log(string Source, string Destination) {
 	PartitionManager.Mount_By_Path(Destination, false);
-	FILE *destination_log = fopen(Destination.c_str(), "a");
-	if (destination_log == NULL) {
-		LOGERR("TWFunc::Copy_Log -- Can't open destination log file: '%s'\n", Destination.c_str());
+	// Only what was logged since the last copy
+	if (!twrpLog::Append_Delta(Source, Destination, &Log_Offset)) {
+		LOGERR("TWFunc::Copy_Log -- Can't copy log file to: '%s'\n", Destination.c_str());
 	} else {
-		FILE *source_log = fopen(Source.c_str(), "r");
-		if (source_log != NULL) {
-			fseek(source_log, Log_Offset, SEEK_SET);
-			char buffer[4096];
-			while (fgets(buffer, sizeof(buffer), source_log))
-				fputs(buffer, destination_log); // Buffered write of log file
-			Log_Offset = ftell(source_log);
-			fflush(source_log);
-			fclose(source_log);
-		}
-		fflush(destination_log);
-		fclose(destination_log);
+		twrpTrace::Dump_With_Log(Destination);
 	}
 }
 
@@ -528,13 +862,15 @@ void TWFunc::Update_Log_File(void) {
 				LOGINFO("Unable to create /cache/recovery folder.\n");
 		}
 		Copy_Log(TMP_LOG_FILE, "/cache/recovery/log");
-		copy_file("/cache/recovery/log", "/cache/recovery/last_log", 600);
+		if (!twrpLog::Copy("/cache/recovery/log", "/cache/recovery/last_log"))
+			LOGINFO("Unable to copy /cache/recovery/log to last_log\n");
 		chown("/cache/recovery/log", 1000, 1000);
 		chmod("/cache/recovery/log", 0600);
 		chmod("/cache/recovery/last_log", 0640);
 	} else if (PartitionManager.Mount_By_Path("/data", false) && TWFunc::Path_Exists("/data/cache/recovery/.")) {
 		Copy_Log(TMP_LOG_FILE, "/data/cache/recovery/log");
-		copy_file("/data/cache/recovery/log", "/data/cache/recovery/last_log", 600);
+		if (!twrpLog::Copy("/data/cache/recovery/log", "/data/cache/recovery/last_log"))
+			LOGINFO("Unable to copy /data/cache/recovery/log to last_log\n");
 		chown("/data/cache/recovery/log", 1000, 1000);
 		chmod("/data/cache/recovery/log", 0600);
 		chmod("/data/cache/recovery/last_log", 0640);
@@ -561,7 +897,8 @@ void TWFunc::Update_Log_File(void) {
 		}
 	}
 
-	sync();
+	// Only the log copies and /cache/recovery, a full sync waits for whatever the last operation left in the page cache
+	twrpLog::Sync_Copies();
 }
 
 void TWFunc::Update_Intent_File(string Intent) {
@@ -639,60 +976,24 @@ void TWFunc::check_and_run_script(const char* script_file, const char* display_n
 	}
 }
 
-int TWFunc::removeDir(const string path, bool skipParent) {
-	DIR *d = opendir(path.c_str());
-	int r = 0;
-	string new_path;
-
-	if (d == NULL) {
-		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(path)(strerror(errno)));
-		return -1;
-	}
-
-	if (d) {
-		struct dirent *p;
-		while (!r && (p = readdir(d))) {
-			if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
-				continue;
-			new_path = path + "/";
-			new_path.append(p->d_name);
-			if (p->d_type == DT_DIR) {
-				r = removeDir(new_path, true);
-				if (!r) {
-					if (p->d_type == DT_DIR)
-						r = rmdir(new_path.c_str());
-					else
-						LOGINFO("Unable to removeDir '%s': %s\n", new_path.c_str(), strerror(errno));
-				}
-			} else if (p->d_type == DT_REG || p->d_type == DT_LNK || p->d_type == DT_FIFO || p->d_type == DT_SOCK) {
-				r = unlink(new_path.c_str());
-				if (r != 0) {
-					LOGINFO("Unable to unlink '%s: %s'\n", new_path.c_str(), strerror(errno));
-				}
-			}
-		}
-		closedir(d);
-
-		if (!r) {
-			if (skipParent)
-				return 0;
-			else
-				r = rmdir(path.c_str());
-		}
-	}
-	return r;
-}
-
 int TWFunc::copy_file(string src, string dst, int mode) {
 	LOGINFO("Copying file %s to %s\n", src.c_str(), dst.c_str());
-	ifstream srcfile(src.c_str(), ios::binary);
-	ofstream dstfile(dst.c_str(), ios::binary);
-	dstfile << srcfile.rdbuf();
-	srcfile.close();
-	dstfile.close();
-	if (chmod(dst.c_str(), mode) != 0)
+	int src_fd = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+	if (src_fd < 0)
 		return -1;
-	return 0;
+	int dst_fd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (dst_fd < 0) {
+		close(src_fd);
+		return -1;
+	}
+	off64_t offset = 0;
+	bool ok = twrpLog::Copy_Fd(src_fd, &offset, dst_fd);
+	close(src_fd);
+	if (fchmod(dst_fd, mode) != 0)
+		ok = false;
+	if (close(dst_fd) != 0)
+		ok = false;
+	return ok ? 0 : -1;
 }
 
 unsigned int TWFunc::Get_D_Type_From_Stat(string Path) {
@@ -772,8 +1073,26 @@ int TWFunc::write_to_file(const string& fn, const string& line) {
 
 bool TWFunc::Try_Decrypting_Backup(string Restore_Path, string Password) {
 	DIR* d;
+	twrpBackupCatalog catalog;
 
 	string Filename;
+	if (catalog.Load(Restore_Path)) {
+		// The catalog knows which archives are encrypted, nothing else is opened
+		const vector<twrpBackupCatalog::Partition>& parts = catalog.Get_Partitions();
+		for (size_t i = 0; i < parts.size(); i++) {
+			for (size_t j = 0; j < parts[i].archives.size(); j++) {
+				if (parts[i].archives[j].type != ENCRYPTED)
+					continue;
+				Filename = Restore_Path + "/" + parts[i].archives[j].filename;
+				if (TWFunc::Try_Decrypting_File(Filename, Password) < 2) {
+					DataManager::SetValue("tw_restore_password", ""); // Clear the bad password
+					DataManager::SetValue("tw_restore_display", "");  // Also clear the display mask
+					return false;
+				}
+			}
+		}
+		return true;
+	}
 	Restore_Path += "/";
 	d = opendir(Restore_Path.c_str());
 	if (d == NULL) {
@@ -1088,12 +1407,6 @@ void TWFunc::SetPerformanceMode(bool mode) {
 	usleep(500000);
 }
 
-std::string TWFunc::to_string(unsigned long value) {
-	std::ostringstream os;
-	os << value;
-	return os.str();
-}
-
 void TWFunc::Disable_Stock_Recovery_Replace(void) {
 	if (PartitionManager.Mount_By_Path("/system", false)) {
 		// Disable flashing of stock recovery
@@ -1125,12 +1438,45 @@ unsigned long long TWFunc::IOCTL_Get_Block_Size(const char* block_device) {
 	return 0;
 }
 
+// The kernel log with the <level> prefixes taken off, like dmesg prints it
+static bool Read_Kernel_Log(std::string& log) {
+	int size = klogctl(KLOG_SIZE_BUFFER, NULL, 0);
+	if (size <= 0)
+		return false;
+	log.resize(size);
+	int len = klogctl(KLOG_READ_ALL, &log[0], size);
+	if (len < 0)
+		return false;
+
+	size_t out = 0;
+	for (size_t in = 0; in < (size_t)len;) {
+		if (log[in] == '<') {
+			size_t end = in + 1;
+			while (end < (size_t)len && isdigit(log[end]))
+				end++;
+			if (end < (size_t)len && end > in + 1 && log[end] == '>')
+				in = end + 1;
+		}
+		while (in < (size_t)len) {
+			char c = log[in++];
+			log[out++] = c;
+			if (c == '\n')
+				break;
+		}
+	}
+	log.resize(out);
+	return true;
+}
+
 void TWFunc::copy_kernel_log(string curr_storage) {
 	std::string dmesgDst = curr_storage + "/dmesg.log";
-	std::string dmesgCmd = "/sbin/dmesg";
-
 	std::string result;
-	Exec_Cmd(dmesgCmd, result);
+
+	// One read of the whole ring buffer, the dmesg binary is the fallback
+	if (!Read_Kernel_Log(result)) {
+		result.clear();
+		Exec_Cmd("/sbin/dmesg", result);
+	}
 	write_to_file(dmesgDst, result);
 	gui_msg(Msg("copy_kernel_log=Copied kernel log to {1}")(dmesgDst));
 	tw_set_default_metadata(dmesgDst.c_str());
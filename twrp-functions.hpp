@@ -26,6 +26,9 @@
 
 using namespace std;
 
+class TWExclude;
+class ProgressTracking;
+
 typedef enum
 {
 	rb_current = 0,
@@ -40,9 +43,12 @@ enum Archive_Type {
 	UNCOMPRESSED = 0,
 	COMPRESSED,
 	ENCRYPTED,
-	COMPRESSED_ENCRYPTED
+	COMPRESSED_ENCRYPTED,
+	COMPRESSED_LZ4
 };
 
+typedef void (*Exec_Line_Callback)(const string& line, void *cookie);      // Gets each line of output of Exec_Args without the newline
+
 // Partition class
 class TWFunc
 {
@@ -53,10 +59,13 @@ public:
 
 	static int Exec_Cmd(const string& cmd, string &result);                     //execute a command and return the result as a string by reference
 	static int Exec_Cmd(const string& cmd);                                     //execute a command
+	static int Exec_Args(const vector<string>& args, string *output, int timeout = 0, Exec_Line_Callback callback = NULL, void *cookie = NULL); // Runs args[0] from the PATH without a shell, returns the wait status or -1, stdout goes to output and callback, a timeout in seconds kills it
 	static int Wait_For_Child(pid_t pid, int *status, string Child_Name);       // Waits for pid to exit and checks exit status
+	static int Check_Child_Status(int status, const string& Child_Name);      // Logs how a child ended, 0 if it exited with 0 and -1 otherwise
 	static int Wait_For_Child_Timeout(pid_t pid, int *status, const string& Child_Name, int timeout); // Waits for a pid to exit until the timeout is hit. If timeout is hit, kill the chilld.
 	static bool Path_Exists(string Path);                                       // Returns true if the path exists
-	static Archive_Type Get_File_Type(string fn);                               // Determines file type, 0 for unknown, 1 for gzip, 2 for OAES encrypted
+	static Archive_Type Get_File_Type(string fn);                               // Determines file type, 0 for unknown, 1 for gzip, 2 for OAES encrypted, 4 for LZ4
+	static Archive_Type Get_Header_Type(const unsigned char *header);           // Same as Get_File_Type from the first 4 bytes of the file
 	static int Try_Decrypting_File(string fn, string password); // -1 for some error, 0 for failed to decrypt, 1 for decrypted, 3 for decrypted and found gzip format
 	static unsigned long Get_File_Size(const string& Path);                            // Returns the size of a file
 	static std::string Remove_Trailing_Slashes(const std::string& path, bool leaveLast = false); // Normalizes the path, e.g /data//media/ -> /data/media
@@ -64,19 +73,20 @@ public:
 	static vector<string> split_string(const string &in, char del, bool skip_empty);
 	static timespec timespec_diff(timespec& start, timespec& end);	            // Return a diff for 2 times
 	static int32_t timespec_diff_ms(timespec& start, timespec& end);            // Returns diff in ms
+	static std::string to_string(unsigned long value); //convert ul to string
+	static int removeDir(const string path, bool removeParent, TWExclude *exclusions = NULL, ProgressTracking *progress = NULL); //recursively remove a directory with several threads, leaving out excluded paths
+	static int Recursive_Mkdir(string Path);                                    // Recursively makes the entire path
 
 #ifndef BUILD_TWRPTAR_MAIN
 	static void install_htc_dumlock(void);                                      // Installs HTC Dumlock
 	static void htc_dumlock_restore_original_boot(void);                        // Restores the backup of boot from HTC Dumlock
 	static void htc_dumlock_reflash_recovery_to_boot(void);                     // Reflashes the current recovery to boot
-	static int Recursive_Mkdir(string Path);                                    // Recursively makes the entire path
 	static void GUI_Operation_Text(string Read_Value, string Default_Text);     // Updates text for display in the GUI, e.g. Backing up %partition name%
 	static void GUI_Operation_Text(string Read_Value, string Partition_Name, string Default_Text); // Same as above but includes partition name
 	static void Update_Log_File(void);                                          // Writes the log to last_log
 	static void Update_Intent_File(string Intent);                              // Updates intent file
 	static int tw_reboot(RebootCommand command);                                // Prepares the device for rebooting
 	static void check_and_run_script(const char* script_file, const char* display_name); // checks for the existence of a script, chmods it to 755, then runs it
-	static int removeDir(const string path, bool removeParent); //recursively remove a directory
 	static int copy_file(string src, string dst, int mode); //copy file from src to dst with mode permissions
 	static unsigned int Get_D_Type_From_Stat(string Path);                      // Returns a dirent dt_type value using stat instead of dirent
 	static int read_file(string fn, vector<string>& results); //read from file
@@ -92,7 +102,6 @@ public:
 	static bool Create_Dir_Recursive(const std::string& path, mode_t mode = 0755, uid_t uid = -1, gid_t gid = -1);  // Create directory and it's parents, if they don't exist. mode, uid and gid are set to all _newly_ created folders. If whole path exists, do nothing.
 	static int Set_Brightness(std::string brightness_value); // Well, you can read, it does what it says, passing return int from TWFunc::Write_File ;)
 	static bool Toggle_MTP(bool enable);                                        // Disables MTP if enable is false and re-enables MTP if enable is true and it was enabled the last time it was toggled off
-	static std::string to_string(unsigned long value); //convert ul to string
 	static void SetPerformanceMode(bool mode); // support recovery.perf.mode
 	static void Disable_Stock_Recovery_Replace(); // Disable stock ROMs from replacing TWRP with stock recovery
 	static unsigned long long IOCTL_Get_Block_Size(const char* block_device);
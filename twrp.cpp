@@ -46,6 +46,9 @@ extern "C" {
 #include "openrecoveryscript.hpp"
 #include "variables.h"
 #include "twrpAdbBuFifo.hpp"
+#include "twrpTrace.hpp"
+#include "twrpMemory.hpp"
+#include "twrpLog.hpp"
 #ifdef TW_USE_NEW_MINADBD
 #include "minadbd/minadbd.h"
 #else
@@ -54,8 +57,8 @@ extern "C" {
 }
 #endif
 
-#include <selinux/label.h>
-struct selabel_handle *selinux_handle;
+#include "twrpSELabel.hpp"
+#include "twrpStartup.hpp"
 
 //extern int adb_server_main(int is_daemon, int server_port, int /* reply_fd */);
 
@@ -67,6 +70,63 @@ static void Print_Prop(const char *key, const char *name, void *cookie) {
 	printf("%s=%s\n", key, name);
 }
 
+// Headless mode brings up no display or theme and only serves ORS commands.
+// It is chosen with androidboot.twrp.headless=1 on the kernel command line,
+// the twrp.headless property or --headless in the BCB.
+static bool Headless_Requested(void) {
+	char value[PROPERTY_VALUE_MAX];
+	property_get("ro.boot.twrp.headless", value, "0");
+	if (strcmp(value, "1") == 0)
+		return true;
+	property_get("twrp.headless", value, "0");
+	return strcmp(value, "1") == 0;
+}
+
+// Startup stages, see the graph in main
+static void Stage_SELinux(void *cookie) {
+	if (TWFunc::Path_Exists("/prebuilt_file_contexts")) {
+		if (TWFunc::Path_Exists("/file_contexts")) {
+			printf("Renaming regular /file_contexts -> /file_contexts.bak\n");
+			rename("/file_contexts", "/file_contexts.bak");
+		}
+		printf("Moving /prebuilt_file_contexts -> /file_contexts\n");
+		rename("/prebuilt_file_contexts", "/file_contexts");
+	}
+	if (!twrpSELabel::Open("/file_contexts"))
+		printf("No file contexts for SELinux\n");
+	else
+		printf("SELinux contexts loaded from /file_contexts\n");
+}
+
+static void Stage_Display(void *cookie) {
+	printf("Starting the UI...\n");
+	gui_init();
+}
+
+static void Stage_Fstab(void *cookie) {
+	bool *fstab_ok = (bool*) cookie;
+
+	printf("=> Linking mtab\n");
+	symlink("/proc/mounts", "/etc/mtab");
+	std::string fstab_filename = "/etc/twrp.fstab";
+	if (!TWFunc::Path_Exists(fstab_filename)) {
+		fstab_filename = "/etc/recovery.fstab";
+	}
+	printf("=> Processing %s\n", fstab_filename.c_str());
+	// The partitions are sized later, once we know whether a script runs first
+	*fstab_ok = PartitionManager.Process_Fstab(fstab_filename, 1, false);
+	if (*fstab_ok)
+		PartitionManager.Output_Partition_Logging();
+}
+
+static void Stage_Resources(void *cookie) {
+	bool *fstab_ok = (bool*) cookie;
+
+	// The theme comes from settings storage unless the device is encrypted
+	if (*fstab_ok)
+		gui_loadResources();
+}
+
 int main(int argc, char **argv) {
 	// Recovery needs to install world-readable files, so clear umask
 	// set by init
@@ -94,6 +154,14 @@ int main(int argc, char **argv) {
 		return 0;
 	}
 
+	// Off-screen GUI benchmark, see gui/benchmark.cpp
+	if ((argc == 3 || argc == 4) && strcmp(argv[1], "--gui_benchmark") == 0)
+		return gui_benchmark(argv[2], argc == 4 ? argv[3] : NULL) == 0 ? 0 : 1;
+
+	// From here on the log is written by a thread, anything logged before stays in order
+	twrpLog::Start();
+	twrpMemory::Init();
+
 #ifdef RECOVERY_SDCARD_ON_DATA
 	datamedia = true;
 #endif
@@ -107,44 +175,43 @@ int main(int argc, char **argv) {
 	property_set("ro.twrp.boot", "1");
 	property_set("ro.twrp.version", TW_VERSION_STR);
 
+	// Early enough to trace the startup stages, tw_trace is read with the settings
+	char trace_prop[PROPERTY_VALUE_MAX];
+	property_get("twrp.trace", trace_prop, "0");
+	twrpTrace::Set_Enabled(strcmp(trace_prop, "1") == 0);
+
 	time_t StartupTime = time(NULL);
 	printf("Starting TWRP %s-%s on %s (pid %d)\n", TW_VERSION_STR, TW_GIT_REVISION, ctime(&StartupTime), getpid());
 
 	// Load default values to set DataManager constants and handle ifdefs
 	DataManager::SetDefaultValues();
-	printf("Starting the UI...\n");
-	gui_init();
-	printf("=> Linking mtab\n");
-	symlink("/proc/mounts", "/etc/mtab");
-	std::string fstab_filename = "/etc/twrp.fstab";
-	if (!TWFunc::Path_Exists(fstab_filename)) {
-		fstab_filename = "/etc/recovery.fstab";
+	bool Headless = Headless_Requested();
+	// the BCB is only read later, so --headless there still loads the theme
+	bool Gui_Loaded = !Headless;
+	if (Headless)
+		printf("Running headless, not starting the UI\n");
+
+	// The display and splash, the fstab and the file contexts don't need each
+	// other and come up side by side, the splash stays up until the theme is
+	// loaded. The theme needs the fstab for the encryption state and settings
+	// storage. Console messages printed by one stage while another loads a
+	// package keep their default text, see PageManager::TranslateString.
+	bool fstab_ok = false;
+	twrpStartup startup;
+	startup.Add("selinux", Stage_SELinux, NULL);
+	int fstab_stage = startup.Add("fstab", Stage_Fstab, &fstab_ok);
+	if (Gui_Loaded) {
+		int display_stage = startup.Add("display", Stage_Display, NULL);
+		int resources_stage = startup.Add("resources", Stage_Resources, &fstab_ok);
+		startup.Depends(resources_stage, display_stage);
+		startup.Depends(resources_stage, fstab_stage);
 	}
-	printf("=> Processing %s\n", fstab_filename.c_str());
-	if (!PartitionManager.Process_Fstab(fstab_filename, 1)) {
+	startup.Run();
+	if (!fstab_ok) {
 		LOGERR("Failing out of recovery due to problem with fstab.\n");
 		return -1;
 	}
-	PartitionManager.Output_Partition_Logging();
-	// Load up all the resources
-	gui_loadResources();
 
-	if (TWFunc::Path_Exists("/prebuilt_file_contexts")) {
-		if (TWFunc::Path_Exists("/file_contexts")) {
-			printf("Renaming regular /file_contexts -> /file_contexts.bak\n");
-			rename("/file_contexts", "/file_contexts.bak");
-		}
-		printf("Moving /prebuilt_file_contexts -> /file_contexts\n");
-		rename("/prebuilt_file_contexts", "/file_contexts");
-	}
-	struct selinux_opt selinux_options[] = {
-		{ SELABEL_OPT_PATH, "/file_contexts" }
-	};
-	selinux_handle = selabel_open(SELABEL_CTX_FILE, selinux_options, 1);
-	if (!selinux_handle)
-		printf("No file contexts for SELinux\n");
-	else
-		printf("SELinux contexts loaded from /file_contexts\n");
 	{ // Check to ensure SELinux can be supported by the kernel
 		char *contexts = NULL;
 
@@ -221,11 +288,14 @@ int main(int argc, char **argv) {
 				}
 				// Other 'w' items are wipe_ab and wipe_package_size which are related to bricking the device remotely. We will not bother to suppor these as having TWRP probably makes "bricking" the device in this manner useless
 			} else if (*argptr == 'n') {
-				DataManager::SetValue(TW_BACKUP_NAME, gui_parse_text("{@auto_generate}"));
+				DataManager::SetValue(TW_BACKUP_NAME, gui_lookup("auto_generate", "(Auto Generate)"));
 				if (!OpenRecoveryScript::Insert_ORS_Command("backup BSDCAE\n"))
 					break;
 			} else if (*argptr == 'p') {
 				Shutdown = true;
+			} else if (*argptr == 'h') {
+				if (strncmp(argptr, "headless", strlen("headless")) == 0)
+					Headless = true;
 			} else if (*argptr == 's') {
 				if (strncmp(argptr, "send_intent", strlen("send_intent")) == 0) {
 					ptr = argptr + strlen("send_intent") + 1;
@@ -277,6 +347,8 @@ int main(int argc, char **argv) {
 	if (DataManager::GetIntValue(TW_IS_ENCRYPTED) != 0) {
 		if (SkipDecryption) {
 			LOGINFO("Skipping decryption\n");
+		} else if (Headless) {
+			LOGINFO("Is encrypted, headless so decrypt with the ORS decrypt command\n");
 		} else {
 			LOGINFO("Is encrypted, do decrypt page first\n");
 			if (gui_startPage("decrypt", 1, 1) != 0) {
@@ -287,6 +359,7 @@ int main(int argc, char **argv) {
 			}
 		}
 	} else if (datamedia) {
+		PartitionManager.Mount_Settings_Storage(false);
 		if (tw_get_default_metadata(DataManager::GetSettingsStoragePath().c_str()) != 0) {
 			LOGINFO("Failed to get default contexts and file mode for storage files.\n");
 		} else {
@@ -296,17 +369,34 @@ int main(int argc, char **argv) {
 
 	// Read the settings file
 	DataManager::ReadSettingsFile();
-	PageManager::LoadLanguage(DataManager::GetStrValue("tw_language"));
-	GUIConsole::Translate_Now();
+	twrpTrace::Set_Enabled(DataManager::GetIntValue(TW_TRACE_VAR) == 1 || strcmp(trace_prop, "1") == 0);
+	twrpMemory::Start_Sampler();
+	if (Gui_Loaded) {
+		PageManager::LoadLanguage(DataManager::GetStrValue("tw_language"));
+		GUIConsole::Translate_Now();
+	}
 
 	// Fixup the RTC clock on devices which require it
 	if (crash_counter == 0)
 		TWFunc::Fixup_Time_On_Boot();
 
-	// Run any outstanding OpenRecoveryScript
+	// Run any outstanding OpenRecoveryScript. It starts before the partitions
+	// are sized, that walks every file system and the commands that need the
+	// sizes (backup, restore) update them on their own. Scripts usually end in
+	// a reboot, otherwise the sizing is done before the GUI comes up.
+	bool Ran_Script = false;
 	if ((DataManager::GetIntValue(TW_IS_ENCRYPTED) == 0 || SkipDecryption) && (TWFunc::Path_Exists(SCRIPT_FILE_TMP) || TWFunc::Path_Exists(SCRIPT_FILE_CACHE))) {
-		OpenRecoveryScript::Run_OpenRecoveryScript();
+		LOGINFO("Running OpenRecoveryScript before sizing partitions\n");
+		Ran_Script = true;
+		if (Headless)
+			OpenRecoveryScript::Run_OpenRecoveryScript_Action();
+		else
+			OpenRecoveryScript::Run_OpenRecoveryScript();
 	}
+	PartitionManager.Update_System_Details(true);
+	// leave mounted what the script mounted
+	if (!Ran_Script)
+		PartitionManager.UnMount_Main_Partitions();
 
 #ifdef TW_HAS_MTP
 	char mtp_crash_check[PROPERTY_VALUE_MAX];
@@ -338,7 +428,9 @@ int main(int argc, char **argv) {
 
 	if (sys) {
 		if ((DataManager::GetIntValue("tw_mount_system_ro") == 0 && sys->Check_Lifetime_Writes() == 0) || DataManager::GetIntValue("tw_mount_system_ro") == 2) {
-			if (DataManager::GetIntValue("tw_never_show_system_ro_page") == 0) {
+			if (Headless) {
+				// leave system read only, scripts can use the remountrw command
+			} else if (DataManager::GetIntValue("tw_never_show_system_ro_page") == 0) {
 				DataManager::SetValue("tw_back", "main");
 				if (gui_startPage("system_readonly", 1, 1) != 0) {
 					LOGERR("Failed to start system_readonly GUI page.\n");
@@ -361,7 +453,10 @@ int main(int argc, char **argv) {
 	adb_bu_fifo->threadAdbBuFifo();
 
 	// Launch the main GUI
-	gui_start();
+	if (Headless)
+		gui_startHeadless();
+	else
+		gui_start();
 
 #ifndef TW_OEM_BUILD
 	// Disable flashing of stock recovery
@@ -34,6 +34,49 @@
 #include "gui/pages.hpp"
 #include "adbbu/twadbstream.h"
 #include "adbbu/libtwadbbu.hpp"
+#include "progresstracking.hpp"
+#include "twrpTrace.hpp"
+#include "twrpPerf.hpp"
+
+// Partition restored on its own thread while the commands of the other streams are handled
+struct Adb_Restore_Stream {
+	PartitionSettings part_settings;
+	pthread_t thread;
+	bool running;
+	bool done;
+	bool ret;
+};
+
+static void* Restore_Stream_Thread(void *cookie) {
+	Adb_Restore_Stream *stream = (Adb_Restore_Stream*) cookie;
+	ProgressTracking progress(stream->part_settings.total_restore_size);
+
+	stream->part_settings.progress = &progress;
+	stream->ret = PartitionManager.Restore_Partition(&stream->part_settings);
+	if (!stream->ret)
+		LOGERR("ADB Restore failed.\n");
+	__atomic_store_n(&stream->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static bool Start_Restore_Stream(Adb_Restore_Stream *stream, const PartitionSettings& part_settings) {
+	// adb backup sends the next file of a stream once the last one sent TWEOF
+	if (stream->running) {
+		pthread_join(stream->thread, NULL);
+		stream->running = false;
+		if (!stream->ret)
+			return false;
+	}
+	stream->part_settings = part_settings;
+	stream->done = false;
+	stream->ret = false;
+	if (pthread_create(&stream->thread, NULL, Restore_Stream_Thread, stream) != 0) {
+		LOGERR("Unable to start ADB restore stream.\n");
+		return false;
+	}
+	stream->running = true;
+	return true;
+}
 
 twrpAdbBuFifo::twrpAdbBuFifo(void) {
 	unlink(TW_ADB_FIFO);
@@ -50,10 +93,12 @@ void twrpAdbBuFifo::Check_Adb_Fifo_For_Events(void) {
 		cmdcheck = cmdcheck.substr(0, strlen(ADB_BACKUP_OP));
 		std::string Options(cmd);
 		Options = Options.substr(strlen(ADB_BACKUP_OP) + 1, strlen(cmd));
-		if (cmdcheck == ADB_BACKUP_OP)
-			Backup_ADB_Command(Options);
-		else {
-			Restore_ADB_Backup();
+		if (cmdcheck == ADB_BACKUP_OP) {
+			twrpPerf::Start("ADB Backup");
+			twrpPerf::Finish(Backup_ADB_Command(Options) ? 0 : 1);
+		} else {
+			twrpPerf::Start("ADB Restore");
+			twrpPerf::Finish(Restore_ADB_Backup() ? 0 : 1);
 		}
 	}
 }
@@ -89,6 +134,7 @@ pthread_t twrpAdbBuFifo::threadAdbBuFifo(void) {
 }
 
 bool twrpAdbBuFifo::Backup_ADB_Command(std::string Options) {
+	twrpTraceScope trace("adb", "Backup_ADB_Command");
 	std::vector<std::string> args;
 	std::string Backup_List;
 	bool adbbackup = true, ret = false;
@@ -99,6 +145,8 @@ bool twrpAdbBuFifo::Backup_ADB_Command(std::string Options) {
 
 	DataManager::SetValue(TW_USE_COMPRESSION_VAR, 0);
 	DataManager::SetValue(TW_SKIP_DIGEST_GENERATE_VAR, 0);
+	DataManager::SetValue(TW_ADB_BACKUP_STREAMS_VAR, 1);
+	DataManager::SetValue(TW_ADB_AUTO_CODEC_VAR, 0);
 
 	if (args[1].compare("--twrp") != 0) {
 		gui_err("twrp_adbbu_option=--twrp option is required to enable twrp adb backup");
@@ -120,6 +168,16 @@ bool twrpAdbBuFifo::Backup_ADB_Command(std::string Options) {
 			DataManager::SetValue(TW_USE_COMPRESSION_VAR, 1);
 			continue;
 		}
+		if (args[i].compare("autocompress") == 0) {
+			gui_msg("adb_autocompress_on=Compression is picked for each partition");
+			DataManager::SetValue(TW_ADB_AUTO_CODEC_VAR, 1);
+			continue;
+		}
+		if (args[i].compare("multistream") == 0) {
+			gui_msg("adb_multistream_on=Images are sent alongside the file systems");
+			DataManager::SetValue(TW_ADB_BACKUP_STREAMS_VAR, ADB_BACKUP_MAX_STREAMS);
+			continue;
+		}
 		DataManager::GetValue(TW_USE_COMPRESSION_VAR, compress);
 		gui_print("%s\n", args[i].c_str());
 		std::string path;
@@ -166,15 +224,24 @@ bool twrpAdbBuFifo::Backup_ADB_Command(std::string Options) {
 }
 
 bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
+	twrpTraceScope trace("adb", "Restore_ADB_Backup");
 	int partition_count = 0;
 	std::string Restore_Name;
 	struct AdbBackupFileTrailer adbmd5;
 	struct PartitionSettings part_settings;
+	Adb_Restore_Stream streams[ADB_BACKUP_MAX_STREAMS];
 	int adb_control_twrp_fd;
 	int adb_control_bu_fd, ret = 0;
 	char cmd[512];
 
 	part_settings.total_restore_size = 0;
+	part_settings.adb_stream = 0;
+	part_settings.adb_resume_offset = 0;
+	part_settings.verify_digest = false;
+	part_settings.use_lz4 = false;
+	part_settings.plan = NULL;
+	for (int i = 0; i < ADB_BACKUP_MAX_STREAMS; i++)
+		streams[i].running = false;
 
 	PartitionManager.Mount_All_Storage();
 	DataManager::SetValue(TW_SKIP_DIGEST_CHECK_VAR, 0);
@@ -202,7 +269,7 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 				memcpy(&twhdr, cmd, sizeof(cmd));
 				LOGINFO("ADB Partition count: %" PRIu64 "\n", twhdr.partition_count);
 				LOGINFO("ADB version: %" PRIu64 "\n", twhdr.version);
-				if (twhdr.version != ADB_BACKUP_VERSION) {
+				if (twhdr.version < ADB_BACKUP_VERSION || twhdr.version > ADB_BACKUP_CHECKPOINT_VERSION) {
 					LOGERR("Incompatible adb backup version!\n");
 					ret = false;
 					break;
@@ -255,11 +322,17 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 				std::string cmdstr(twimghdr.type);
 				Restore_Name = twimghdr.name;
 				part_settings.total_restore_size = twimghdr.size;
+				part_settings.adb_stream = twimghdr.stream_id;
+				if (part_settings.adb_stream >= ADB_BACKUP_MAX_STREAMS) {
+					LOGERR("Invalid ADB stream for '%s'\n", Restore_Name.c_str());
+					ret = false;
+					break;
+				}
 				if (cmdtype == TWIMG) {
 					LOGINFO("ADB Type: %s\n", twimghdr.type);
 					LOGINFO("ADB Restore_Name: %s\n", Restore_Name.c_str());
 					LOGINFO("ADB Restore_size: %" PRIu64 "\n", part_settings.total_restore_size);
-					string compression = (twimghdr.compressed == 1) ? "compressed" : "uncompressed";
+					string compression = (twimghdr.compressed == ADB_CODEC_LZ4) ? "LZ4" : (twimghdr.compressed == ADB_CODEC_GZIP) ? "gzip" : "uncompressed";
 					LOGINFO("ADB compression: %s\n", compression.c_str());
 					std::string Backup_FileName;
 					std::size_t pos = Restore_Name.find_last_of("/");
@@ -278,11 +351,9 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 					part_settings.partition_count = partition_count;
 					part_settings.adbbackup = true;
 					part_settings.adb_compression = twimghdr.compressed;
+					part_settings.adb_resume_offset = twimghdr.resume_offset;
 					part_settings.PM_Method = PM_RESTORE;
-					ProgressTracking progress(part_settings.total_restore_size);
-					part_settings.progress = &progress;
-					if (!PartitionManager.Restore_Partition(&part_settings)) {
-						LOGERR("ADB Restore failed.\n");
+					if (!Start_Restore_Stream(&streams[part_settings.adb_stream], part_settings)) {
 						ret = false;
 						break;
 					}
@@ -291,7 +362,7 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 					LOGINFO("ADB Type: %s\n", twimghdr.type);
 					LOGINFO("ADB Restore_Name: %s\n", Restore_Name.c_str());
 					LOGINFO("ADB Restore_size: %" PRIi64 "\n", part_settings.total_restore_size);
-					string compression = (twimghdr.compressed == 1) ? "compressed" : "uncompressed";
+					string compression = (twimghdr.compressed == ADB_CODEC_LZ4) ? "LZ4" : (twimghdr.compressed == ADB_CODEC_GZIP) ? "gzip" : "uncompressed";
 					LOGINFO("ADB compression: %s\n", compression.c_str());
 					std::string Backup_FileName;
 					std::size_t pos = Restore_Name.find_last_of("/");
@@ -322,17 +393,38 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 					part_settings.partition_count = partition_count;
 					part_settings.adbbackup = true;
 					part_settings.adb_compression = twimghdr.compressed;
+					part_settings.adb_resume_offset = 0;
 					part_settings.total_restore_size += part_settings.Part->Get_Restore_Size(&part_settings);
 					part_settings.PM_Method = PM_RESTORE;
-					ProgressTracking progress(part_settings.total_restore_size);
-					part_settings.progress = &progress;
-					if (!PartitionManager.Restore_Partition(&part_settings)) {
-						LOGERR("ADB Restore failed.\n");
+					if (!Start_Restore_Stream(&streams[part_settings.adb_stream], part_settings)) {
 						ret = false;
 						break;
 					}
 				}
 			}
+		} else {
+			bool failed = false;
+
+			for (int i = 0; i < ADB_BACKUP_MAX_STREAMS; i++) {
+				if (streams[i].running && __atomic_load_n(&streams[i].done, __ATOMIC_ACQUIRE) && !streams[i].ret)
+					failed = true;
+			}
+			if (failed) {
+				ret = false;
+				break;
+			}
+			usleep(1000);
+		}
+	}
+
+	// Stops adb backup, which ends streams that are still waiting for data
+	if (!twadbbu::Write_TWENDADB())
+		ret = false;
+	for (int i = 0; i < ADB_BACKUP_MAX_STREAMS; i++) {
+		if (streams[i].running) {
+			pthread_join(streams[i].thread, NULL);
+			if (!streams[i].ret)
+				ret = false;
 		}
 	}
 
@@ -341,8 +433,6 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 	else
 		gui_err("restore_error=Error during restore process.");
 
-	if (!twadbbu::Write_TWENDADB())
-		ret = false;
 	sleep(2); //give time for user to see messages on console
 	DataManager::SetValue("ui_progress", 100);
 	gui_changePage("main");
@@ -0,0 +1,266 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "twrpBackupCatalog.hpp"
+#include "twrpBackupMeta.hpp"
+#include "twcommon.h"
+#include "set_metadata.h"
+
+#define BACKUP_CATALOG_HEADER "twrp_catalog 1"
+
+using namespace std;
+
+static const char* Type_Name(Archive_Type type) {
+	switch (type) {
+		case COMPRESSED:
+			return "gzip";
+		case ENCRYPTED:
+			return "encrypted";
+		case COMPRESSED_ENCRYPTED:
+			return "gzip_encrypted";
+		case COMPRESSED_LZ4:
+			return "lz4";
+		default:
+			return "plain";
+	}
+}
+
+static Archive_Type Type_From_Name(const char *name) {
+	if (strcmp(name, "gzip") == 0)
+		return COMPRESSED;
+	if (strcmp(name, "encrypted") == 0)
+		return ENCRYPTED;
+	if (strcmp(name, "gzip_encrypted") == 0)
+		return COMPRESSED_ENCRYPTED;
+	if (strcmp(name, "lz4") == 0)
+		return COMPRESSED_LZ4;
+	return UNCOMPRESSED;
+}
+
+twrpBackupCatalog::twrpBackupCatalog() {
+	created = 0;
+}
+
+bool twrpBackupCatalog::Split_Archive_Name(const string& filename, string *label, string *backup_filename) {
+	size_t first = filename.find('.');
+	if (first == string::npos || first == 0)
+		return false;
+	size_t second = filename.find('.', first + 1);
+	if (second == string::npos)
+		return false;
+	string fstype = filename.substr(first + 1, second - first - 1);
+	string extn = filename.substr(second + 1);
+	if (fstype == "log" || (extn.size() != 3 && extn.size() != 6) || extn.compare(0, 3, "win") != 0)
+		return false;
+	*label = filename.substr(0, first);
+	*backup_filename = filename.substr(0, second + 4);
+	return true;
+}
+
+bool twrpBackupCatalog::Create(const string& folder) {
+	DIR *d;
+	struct dirent *de;
+	set<string> names;
+	map<string, size_t> part_index;
+	struct stat st;
+
+	partitions.clear();
+	created = time(NULL);
+	d = opendir(folder.c_str());
+	if (d == NULL) {
+		LOGINFO("Unable to open backup folder '%s': %s\n", folder.c_str(), strerror(errno));
+		return false;
+	}
+	while ((de = readdir(d)) != NULL)
+		names.insert(de->d_name);
+
+	// The set is sorted, so split archives come in order
+	for (set<string>::iterator it = names.begin(); it != names.end(); it++) {
+		string label, backup_filename;
+		if (!Split_Archive_Name(*it, &label, &backup_filename))
+			continue;
+		if (fstatat(dirfd(d), it->c_str(), &st, 0) != 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		Archive archive;
+		archive.filename = *it;
+		archive.size = st.st_size;
+		archive.type = TWFunc::Get_File_Type(folder + "/" + *it);
+		string digest;
+		if (names.count(*it + ".sha2") || twrpBackupMeta::Find(folder, BACKUP_META_DIGEST, *it + ".sha2", &digest))
+			archive.digest = "sha2";
+		else if (names.count(*it + ".md5") || twrpBackupMeta::Find(folder, BACKUP_META_DIGEST, *it + ".md5", &digest))
+			archive.digest = "md5";
+
+		map<string, size_t>::iterator part = part_index.find(backup_filename);
+		if (part == part_index.end()) {
+			Partition partition;
+			partition.backup_filename = backup_filename;
+			part = part_index.insert(make_pair(backup_filename, partitions.size())).first;
+			partitions.push_back(partition);
+		}
+		partitions[part->second].archives.push_back(archive);
+	}
+	closedir(d);
+	return true;
+}
+
+bool twrpBackupCatalog::Write(const string& folder) {
+	string filename = folder + "/" + BACKUP_CATALOG_FILE;
+	string temp = filename + ".tmp";
+	string text;
+	char line[512];
+	size_t count = 0;
+	FILE *fp;
+	bool ret;
+
+	text = BACKUP_CATALOG_HEADER "\n";
+	snprintf(line, sizeof(line), "created %lld\n", (long long) created);
+	text += line;
+	for (size_t i = 0; i < partitions.size(); i++) {
+		snprintf(line, sizeof(line), "partition %zu %s\n", partitions[i].archives.size(), partitions[i].backup_filename.c_str());
+		text += line;
+		for (size_t j = 0; j < partitions[i].archives.size(); j++) {
+			const Archive& archive = partitions[i].archives[j];
+			snprintf(line, sizeof(line), "archive %llu %s %s %s\n", archive.size, Type_Name(archive.type), archive.digest.empty() ? "-" : archive.digest.c_str(), archive.filename.c_str());
+			text += line;
+			count++;
+		}
+	}
+	snprintf(line, sizeof(line), "end %zu\n", count);
+	text += line;
+	if (twrpBackupMeta::Add(folder, BACKUP_META_CATALOG, BACKUP_CATALOG_FILE, text))
+		return true;
+
+	fp = fopen(temp.c_str(), "w");
+	if (fp == NULL) {
+		LOGINFO("Unable to create backup catalog '%s': %s\n", temp.c_str(), strerror(errno));
+		return false;
+	}
+	ret = fwrite(text.data(), 1, text.size(), fp) == text.size();
+	if (fclose(fp) != 0)
+		ret = false;
+	if (ret && rename(temp.c_str(), filename.c_str()) != 0)
+		ret = false;
+	if (!ret) {
+		LOGINFO("Unable to write backup catalog '%s'\n", filename.c_str());
+		unlink(temp.c_str());
+		return false;
+	}
+	tw_set_default_metadata(filename.c_str());
+	return true;
+}
+
+bool twrpBackupCatalog::Load(const string& folder) {
+	string filename = folder + "/" + BACKUP_CATALOG_FILE;
+	FILE *fp;
+	string text;
+	char buffer[4096];
+	size_t n, count = 0, expected, end_count;
+	vector<size_t> expected_counts;
+	long long when;
+	unsigned long long size;
+	char type[32], digest[16];
+	int name_pos;
+	bool header = true, complete = false;
+
+	partitions.clear();
+	created = 0;
+	if (!twrpBackupMeta::Find(folder, BACKUP_META_CATALOG, BACKUP_CATALOG_FILE, &text)) {
+		// Backups from before the metadata container have the catalog on its own
+		fp = fopen(filename.c_str(), "r");
+		if (fp == NULL)
+			return false;
+		while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+			text.append(buffer, n);
+		fclose(fp);
+	}
+	for (size_t pos = 0, next; pos < text.size(); pos = next + 1) {
+		next = text.find('\n', pos);
+		if (next == string::npos)
+			next = text.size();
+		string current = text.substr(pos, next - pos);
+		const char *line = current.c_str();
+		if (header) {
+			header = false;
+			if (strcmp(line, BACKUP_CATALOG_HEADER) != 0)
+				break;
+		} else if (sscanf(line, "created %lld", &when) == 1) {
+			created = (time_t) when;
+		} else if (sscanf(line, "partition %zu %n", &expected, &name_pos) == 1 && line[name_pos]) {
+			Partition partition;
+			partition.backup_filename = line + name_pos;
+			partitions.push_back(partition);
+			expected_counts.push_back(expected);
+		} else if (sscanf(line, "archive %llu %31s %15s %n", &size, type, digest, &name_pos) == 3 && line[name_pos] && !partitions.empty()) {
+			Archive archive;
+			archive.filename = line + name_pos;
+			archive.size = size;
+			archive.type = Type_From_Name(type);
+			if (strcmp(digest, "-") != 0)
+				archive.digest = digest;
+			partitions.back().archives.push_back(archive);
+			count++;
+		} else if (sscanf(line, "end %zu", &end_count) == 1) {
+			complete = (end_count == count);
+			break;
+		}
+	}
+
+	// Archives that were removed or replaced since the backup was made make
+	// the catalog useless, the folder is scanned instead
+	for (size_t i = 0; complete && i < partitions.size(); i++) {
+		if (partitions[i].archives.size() != expected_counts[i])
+			complete = false;
+		for (size_t j = 0; complete && j < partitions[i].archives.size(); j++) {
+			struct stat st;
+			const Archive& archive = partitions[i].archives[j];
+			if (stat((folder + "/" + archive.filename).c_str(), &st) != 0 || (unsigned long long) st.st_size != archive.size)
+				complete = false;
+		}
+	}
+	if (!complete) {
+		LOGINFO("Backup catalog '%s' does not match the folder, ignoring it\n", filename.c_str());
+		partitions.clear();
+		return false;
+	}
+	return true;
+}
+
+bool twrpBackupCatalog::Is_Encrypted() {
+	for (size_t i = 0; i < partitions.size(); i++) {
+		for (size_t j = 0; j < partitions[i].archives.size(); j++) {
+			if (partitions[i].archives[j].type == ENCRYPTED)
+				return true;
+		}
+	}
+	return false;
+}
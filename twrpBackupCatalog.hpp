@@ -0,0 +1,68 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPBACKUPCATALOG_HPP
+#define __TWRPBACKUPCATALOG_HPP
+
+#include <time.h>
+#include <string>
+#include <vector>
+#include "twrp-functions.hpp"
+
+#define BACKUP_CATALOG_FILE "backup.catalog"                                   // Record in the backup metadata, a file of its own in older backups
+
+// Catalog of one backup folder, added to the backup metadata when a backup
+// completes. It lists the partitions in the backup with each of their
+// archives, the size, type and digest of every archive and when the backup
+// was made. Selecting a backup to restore reads it instead of parsing every
+// file name in the folder and opening each archive to find out whether it is
+// encrypted. The catalog is only trusted while every archive it lists still
+// has the recorded size, a folder that was changed by hand is scanned as
+// before.
+class twrpBackupCatalog
+{
+public:
+	struct Archive {
+		std::string filename;
+		unsigned long long size;
+		Archive_Type type;                                                     // from the archive header
+		std::string digest;                                                    // "sha2", "md5" or empty
+	};
+
+	struct Partition {
+		std::string backup_filename;                                           // e.g. data.ext4.win, the name restore uses
+		std::vector<Archive> archives;                                         // data.ext4.win000, data.ext4.win001, ... or the single image
+	};
+
+	twrpBackupCatalog();
+
+	bool Create(const std::string& folder);                                    // Scans a finished backup folder
+	bool Write(const std::string& folder);
+	bool Load(const std::string& folder);                                      // False if there is no catalog or it does not match the folder
+	bool Is_Encrypted();                                                       // Any archive needs the backup password
+	time_t Get_Created() { return created; }
+	const std::vector<Partition>& Get_Partitions() { return partitions; }
+
+	static bool Split_Archive_Name(const std::string& filename, std::string *label, std::string *backup_filename); // label.fstype.win or label.fstype.winNNN
+
+private:
+	time_t created;
+	std::vector<Partition> partitions;
+};
+
+#endif // __TWRPBACKUPCATALOG_HPP
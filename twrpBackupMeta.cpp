@@ -0,0 +1,283 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <map>
+#include <string>
+#include <zlib.h>
+#include "twrpBackupMeta.hpp"
+#include "twcommon.h"
+#include "set_metadata.h"
+
+#define BACKUP_META_HEADER "twrp_meta 1"
+#define BACKUP_META_MAX_RECORD (16 * 1024 * 1024)                              // Anything bigger is a damaged length
+
+using namespace std;
+
+static int meta_fd = -1;                                                       // Container of the running backup
+static string meta_folder;
+static string cache_folder;                                                    // Last container Find read
+static off_t cache_size = -1;
+static ino_t cache_ino = 0;
+static map<string, string> cache_records;                                      // by "kind name"
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t meta_once = PTHREAD_ONCE_INIT;
+
+// The tar fork adds digests, it must not start with the lock held by a thread it does not have
+static void Meta_Fork_Prepare() {
+	pthread_mutex_lock(&meta_lock);
+}
+
+static void Meta_Fork_Done() {
+	pthread_mutex_unlock(&meta_lock);
+}
+
+static void Meta_Init() {
+	pthread_atfork(Meta_Fork_Prepare, Meta_Fork_Done, Meta_Fork_Done);
+}
+
+// Backup_Folder and the path of a backup file name the same folder with and without the slash
+static string Folder_Key(const string& folder) {
+	size_t end = folder.find_last_not_of('/');
+	return end == string::npos ? folder : folder.substr(0, end + 1);
+}
+
+static bool Write_All(int fd, const char* data, size_t size) {
+	while (size) {
+		ssize_t n = write(fd, data, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+static void Sync_Folder(const string& folder) {
+	int fd = open(folder.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+static void Read_Records(const string& filename, map<string, string> *records) {
+	FILE *fp;
+	char *line = NULL;
+	size_t line_size = 0;
+	bool header = true;
+
+	records->clear();
+	fp = fopen(filename.c_str(), "re");
+	if (fp == NULL)
+		return;
+	while (getline(&line, &line_size, fp) > 0) {
+		char kind[32];
+		size_t length;
+		unsigned long crc;
+		int name_pos = 0;
+
+		line[strcspn(line, "\n")] = 0;
+		if (header) {
+			header = false;
+			if (strcmp(line, BACKUP_META_HEADER) != 0)
+				break;
+			continue;
+		}
+		if (sscanf(line, "%31s %zu %lx %n", kind, &length, &crc, &name_pos) < 3 || !line[name_pos] || length > BACKUP_META_MAX_RECORD) {
+			LOGINFO("Damaged record in '%s', using the records before it\n", filename.c_str());
+			break;
+		}
+		if (strcmp(kind, BACKUP_META_LOG) == 0) {
+			// Only there for people reading the file
+			if (fseeko(fp, length + 1, SEEK_CUR) != 0)
+				break;
+			continue;
+		}
+		string data(length, '\0');
+		if ((length && fread(&data[0], 1, length, fp) != length) || fgetc(fp) != '\n' ||
+				crc32(crc32(0L, Z_NULL, 0), (const Bytef*) data.data(), length) != crc) {
+			LOGINFO("Damaged record in '%s', using the records before it\n", filename.c_str());
+			break;
+		}
+		(*records)[string(kind) + " " + (line + name_pos)] = data;
+	}
+	free(line);
+	fclose(fp);
+}
+
+bool twrpBackupMeta::Open(const string& folder) {
+	string filename = folder + "/" + BACKUP_META_FILE;
+	string header = BACKUP_META_HEADER "\n";
+
+	pthread_once(&meta_once, Meta_Init);
+	int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		LOGINFO("Unable to create '%s': %s\n", filename.c_str(), strerror(errno));
+		return false;
+	}
+	if (!Write_All(fd, header.data(), header.size())) {
+		LOGINFO("Unable to write '%s': %s\n", filename.c_str(), strerror(errno));
+		close(fd);
+		unlink(filename.c_str());
+		return false;
+	}
+	tw_set_default_metadata(filename.c_str());
+	pthread_mutex_lock(&meta_lock);
+	if (meta_fd >= 0)
+		close(meta_fd);
+	meta_fd = fd;
+	meta_folder = Folder_Key(folder);
+	pthread_mutex_unlock(&meta_lock);
+	return true;
+}
+
+static string Make_Record(const string& kind, const string& name, const string& data) {
+	char header[64];
+	string record;
+
+	snprintf(header, sizeof(header), "%s %zu %08lx ", kind.c_str(), data.size(), crc32(crc32(0L, Z_NULL, 0), (const Bytef*) data.data(), data.size()));
+	record.reserve(strlen(header) + name.size() + data.size() + 2);
+	record.append(header).append(name).append(1, '\n').append(data).append(1, '\n');
+	return record;
+}
+
+bool twrpBackupMeta::Add(const string& folder, const string& kind, const string& name, const string& data) {
+	string record = Make_Record(kind, name, data);
+	bool ret = false;
+
+	// One write per record, so the tar fork and the recovery can append at the same time
+	pthread_mutex_lock(&meta_lock);
+	if (meta_fd >= 0 && meta_folder == Folder_Key(folder)) {
+		ret = Write_All(meta_fd, record.data(), record.size());
+		if (!ret)
+			LOGINFO("Unable to add %s '%s' to the backup metadata: %s\n", kind.c_str(), name.c_str(), strerror(errno));
+	}
+	pthread_mutex_unlock(&meta_lock);
+	return ret;
+}
+
+bool twrpBackupMeta::Add_File(const string& folder, const string& kind, const string& name, const string& filename) {
+	char buffer[64 * 1024];
+	string data;
+	size_t n;
+	bool ret;
+
+	FILE *fp = fopen(filename.c_str(), "re");
+	if (fp == NULL)
+		return false;
+	while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+		data.append(buffer, n);
+	ret = !ferror(fp);
+	fclose(fp);
+	return ret && Add(folder, kind, name, data);
+}
+
+bool twrpBackupMeta::Append(const string& folder, const string& kind, const string& name, const string& data) {
+	string key = Folder_Key(folder);
+	string filename = key + "/" + BACKUP_META_FILE;
+	string record = Make_Record(kind, name, data);
+	bool created = false;
+
+	int fd = open(filename.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (fd < 0 && errno == ENOENT) {
+		// Backups made before the container get one that only has these records
+		fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+		if (fd >= 0) {
+			created = true;
+			record = BACKUP_META_HEADER "\n" + record;
+		}
+	}
+	if (fd < 0) {
+		LOGINFO("Unable to open '%s': %s\n", filename.c_str(), strerror(errno));
+		return false;
+	}
+	bool ret = Write_All(fd, record.data(), record.size()) && fsync(fd) == 0;
+	if (!ret)
+		LOGINFO("Unable to add %s '%s' to '%s': %s\n", kind.c_str(), name.c_str(), filename.c_str(), strerror(errno));
+	close(fd);
+	if (created) {
+		tw_set_default_metadata(filename.c_str());
+		Sync_Folder(key);
+	}
+	return ret;
+}
+
+bool twrpBackupMeta::Close() {
+	pthread_mutex_lock(&meta_lock);
+	int fd = meta_fd;
+	string folder = meta_folder;
+	meta_fd = -1;
+	meta_folder.clear();
+	pthread_mutex_unlock(&meta_lock);
+	if (fd < 0)
+		return false;
+
+	bool ret = (fsync(fd) == 0);
+	if (!ret)
+		LOGINFO("Unable to sync '%s/%s': %s\n", folder.c_str(), BACKUP_META_FILE, strerror(errno));
+	if (close(fd) != 0)
+		ret = false;
+	Sync_Folder(folder);
+	return ret;
+}
+
+void twrpBackupMeta::Discard() {
+	pthread_mutex_lock(&meta_lock);
+	if (meta_fd >= 0) {
+		close(meta_fd);
+		unlink((meta_folder + "/" + BACKUP_META_FILE).c_str());
+	}
+	meta_fd = -1;
+	meta_folder.clear();
+	pthread_mutex_unlock(&meta_lock);
+}
+
+bool twrpBackupMeta::Find(const string& folder, const string& kind, const string& name, string *data) {
+	string key = Folder_Key(folder);
+	string filename = key + "/" + BACKUP_META_FILE;
+	struct stat st;
+	bool ret = false;
+
+	if (stat(filename.c_str(), &st) != 0)
+		return false;
+	// Records are only ever appended, a container of the same size has not changed
+	pthread_mutex_lock(&meta_lock);
+	if (cache_folder != key || cache_ino != st.st_ino || cache_size != st.st_size) {
+		Read_Records(filename, &cache_records);
+		cache_folder = key;
+		cache_ino = st.st_ino;
+		cache_size = st.st_size;
+	}
+	map<string, string>::iterator it = cache_records.find(kind + " " + name);
+	if (it != cache_records.end()) {
+		*data = it->second;
+		ret = true;
+	}
+	pthread_mutex_unlock(&meta_lock);
+	return ret;
+}
@@ -0,0 +1,54 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPBACKUPMETA_HPP
+#define __TWRPBACKUPMETA_HPP
+
+#include <string>
+
+#define BACKUP_META_FILE "backup.meta"                                         // In each backup folder, next to the archives
+#define BACKUP_META_INFO "info"                                                // Size, type and file count of a partition, by backup name
+#define BACKUP_META_DIGEST "digest"                                            // Contents of the old .sha2 or .md5 file, by that file's name
+#define BACKUP_META_CATALOG "catalog"                                          // The backup catalog
+#define BACKUP_META_LOG "log"                                                  // recovery.log of the backup, never read back
+#define BACKUP_META_VERIFY "verify"                                            // Result of the last verify backups run, name BACKUP_META_VERIFY_LAST
+#define BACKUP_META_VERIFY_LAST "last"
+#define BACKUP_META_PERF "perf"                                                // Performance report of the backup, name "backup"
+
+// All the small metadata of one backup folder in a single file, instead of an
+// info file and a digest file for every partition and archive plus the log.
+// On FAT and exFAT cards each of those cost a cluster and directory updates.
+// Records are appended with one write each while the backup runs, from the
+// tar fork as well, and each has a CRC32 of its data. The container is synced
+// once, when the backup is done. A later record replaces an earlier one of the
+// same kind and name, and a damaged or cut off record ends the file while the
+// records before it are still used. Backups made before the container, and
+// records that could not be added, are read from the separate files as before.
+class twrpBackupMeta
+{
+public:
+	static bool Open(const std::string& folder);                               // Starts the container of the backup that is running
+	static bool Add(const std::string& folder, const std::string& kind, const std::string& name, const std::string& data); // False if folder has no open container or the write failed
+	static bool Add_File(const std::string& folder, const std::string& kind, const std::string& name, const std::string& filename);
+	static bool Append(const std::string& folder, const std::string& kind, const std::string& name, const std::string& data); // Adds to a finished backup, creating the container of an old one
+	static bool Close();                                                       // The only fsync of the container
+	static void Discard();                                                     // Closes and removes the container of a failed backup
+	static bool Find(const std::string& folder, const std::string& kind, const std::string& name, std::string *data); // The folder is read once and kept until the container changes
+};
+
+#endif // __TWRPBACKUPMETA_HPP
@@ -0,0 +1,373 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "twrpBlockMap.hpp"
+#include "twcommon.h"
+
+#define BLOCK_MAP_HEAD (64 * 1024)                                             // Boot sectors and superblocks, always copied
+
+#define EXT4_SUPER_OFFSET 1024
+#define EXT4_SUPER_MAGIC 0xEF53
+#define EXT4_COMPAT_RESIZE_INODE 0x10
+#define EXT4_COMPAT_SPARSE_SUPER2 0x200
+#define EXT4_INCOMPAT_RECOVER 0x4
+#define EXT4_INCOMPAT_META_BG 0x10
+#define EXT4_INCOMPAT_64BIT 0x80
+#define EXT4_RO_COMPAT_SPARSE_SUPER 0x1
+#define EXT4_RO_COMPAT_GDT_CSUM 0x10
+#define EXT4_RO_COMPAT_BIGALLOC 0x200
+#define EXT4_RO_COMPAT_METADATA_CSUM 0x400
+#define EXT4_BG_BLOCK_UNINIT 0x2
+
+#define F2FS_SUPER_OFFSET 1024
+#define F2FS_SUPER_MAGIC 0xF2F52010
+#define F2FS_LOG_BLOCKSIZE 12
+#define F2FS_LOG_BLOCKS_PER_SEG 9
+#define F2FS_SEGMENT_MAP 64                                                    // Bytes of valid block bitmap per segment
+
+static uint16_t Le16(const unsigned char *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t Le32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool Read_At(int fd, void *data, size_t len, unsigned long long offset) {
+	char *pos = (char*) data;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pread64(fd, pos, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			LOGINFO("Unable to read the block map at %llu (%s)\n", offset, ret == 0 ? "end of device" : strerror(errno));
+			return false;
+		}
+		pos += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return true;
+}
+
+static bool Ext4_Is_Power(unsigned long long group, unsigned base) {
+	while (group > 1 && group % base == 0)
+		group /= base;
+	return group == 1;
+}
+
+twrpBlockMap::twrpBlockMap() {
+	used_bytes = 0;
+	device_size = 0;
+}
+
+bool twrpBlockMap::Supported(const std::string& File_System) {
+	return File_System == "ext2" || File_System == "ext3" || File_System == "ext4" || File_System == "f2fs";
+}
+
+bool twrpBlockMap::Read(const std::string& Block_Device, const std::string& File_System) {
+	uint64_t size = 0;
+	bool ret;
+
+	runs.clear();
+	used_bytes = 0;
+	device_size = 0;
+	int fd = open(Block_Device.c_str(), O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+	if (fd < 0) {
+		LOGINFO("Unable to open '%s' (%s)\n", Block_Device.c_str(), strerror(errno));
+		return false;
+	}
+	// The image covers the whole device in sparse blocks
+	if (ioctl(fd, BLKGETSIZE64, &size) != 0 || size == 0 || size % BLOCK_MAP_BLOCK != 0) {
+		LOGINFO("'%s' has no size usable for a block map\n", Block_Device.c_str());
+		close(fd);
+		return false;
+	}
+	device_size = size;
+	Add(0, BLOCK_MAP_HEAD);
+	if (File_System == "f2fs")
+		ret = Read_F2fs(fd, Block_Device);
+	else
+		ret = Read_Ext4(fd);
+	close(fd);
+	if (!ret) {
+		runs.clear();
+		return false;
+	}
+	Finish();
+	LOGINFO("%s uses %llu of %llu bytes in %zu runs\n", Block_Device.c_str(), used_bytes, device_size, runs.size());
+	return true;
+}
+
+void twrpBlockMap::Add(unsigned long long offset, unsigned long long length) {
+	unsigned long long start = offset & ~(unsigned long long)(BLOCK_MAP_BLOCK - 1);
+	unsigned long long end = (offset + length + BLOCK_MAP_BLOCK - 1) & ~(unsigned long long)(BLOCK_MAP_BLOCK - 1);
+
+	if (length == 0)
+		return;
+	// Bitmaps are walked in order, so most runs continue the last one
+	if (!runs.empty() && start >= runs.back().offset && start <= runs.back().offset + runs.back().length) {
+		if (end > runs.back().offset + runs.back().length)
+			runs.back().length = end - runs.back().offset;
+		return;
+	}
+	twrpBlockMap_Run run;
+	run.offset = start;
+	run.length = end - start;
+	runs.push_back(run);
+}
+
+static bool Run_Before(const twrpBlockMap_Run& a, const twrpBlockMap_Run& b) {
+	return a.offset < b.offset;
+}
+
+void twrpBlockMap::Finish() {
+	std::vector<twrpBlockMap_Run> merged;
+
+	std::sort(runs.begin(), runs.end(), Run_Before);
+	for (size_t i = 0; i < runs.size(); i++) {
+		twrpBlockMap_Run run = runs[i];
+		if (run.offset >= device_size)
+			break;
+		if (run.offset + run.length > device_size)
+			run.length = device_size - run.offset;
+		if (!merged.empty() && run.offset <= merged.back().offset + merged.back().length) {
+			if (run.offset + run.length > merged.back().offset + merged.back().length)
+				merged.back().length = run.offset + run.length - merged.back().offset;
+			continue;
+		}
+		merged.push_back(run);
+	}
+	runs.swap(merged);
+	used_bytes = 0;
+	for (size_t i = 0; i < runs.size(); i++)
+		used_bytes += runs[i].length;
+}
+
+// Adds the set bits of an ext4 block bitmap, bit 0 is the lowest bit of the first byte
+bool twrpBlockMap::Read_Bitmap(int fd, unsigned long long offset, unsigned long long first_block, unsigned long long blocks, unsigned long long block_size) {
+	std::vector<unsigned char> bitmap((size_t)((blocks + 7) / 8));
+	unsigned long long bit = 0, start;
+
+	if (!Read_At(fd, &bitmap[0], bitmap.size(), offset))
+		return false;
+	while (bit < blocks) {
+		if (bit % 8 == 0 && bitmap[bit / 8] == 0) {
+			bit += 8;
+			continue;
+		}
+		if (!(bitmap[bit / 8] & (1 << (bit % 8)))) {
+			bit++;
+			continue;
+		}
+		start = bit;
+		while (bit < blocks && (bitmap[bit / 8] & (1 << (bit % 8))))
+			bit++;
+		Add((first_block + start) * block_size, (bit - start) * block_size);
+	}
+	return true;
+}
+
+bool twrpBlockMap::Read_Ext4(int fd) {
+	unsigned char sb[1024];
+
+	if (!Read_At(fd, sb, sizeof(sb), EXT4_SUPER_OFFSET))
+		return false;
+	if (Le16(sb + 0x38) != EXT4_SUPER_MAGIC) {
+		LOGINFO("No ext4 superblock found\n");
+		return false;
+	}
+	uint32_t log_block_size = Le32(sb + 0x18);
+	uint32_t compat = Le32(sb + 0x5C);
+	uint32_t incompat = Le32(sb + 0x60);
+	uint32_t ro_compat = Le32(sb + 0x64);
+	// A journal that still has to be replayed changes the bitmaps, the others lay the groups out differently
+	if (log_block_size > 6 || (incompat & (EXT4_INCOMPAT_RECOVER | EXT4_INCOMPAT_META_BG)) || (ro_compat & EXT4_RO_COMPAT_BIGALLOC)) {
+		LOGINFO("ext4 features 0x%x 0x%x 0x%x are not supported by the block map\n", compat, incompat, ro_compat);
+		return false;
+	}
+	unsigned long long block_size = 1024ULL << log_block_size;
+	unsigned long long blocks = Le32(sb + 0x4);
+	size_t desc_size = 32;
+	if (incompat & EXT4_INCOMPAT_64BIT) {
+		blocks |= (unsigned long long)Le32(sb + 0x150) << 32;
+		desc_size = Le16(sb + 0xFE);
+	}
+	unsigned long long first_data_block = Le32(sb + 0x14);
+	unsigned long long blocks_per_group = Le32(sb + 0x20);
+	unsigned long long inodes_per_group = Le32(sb + 0x28);
+	unsigned long long inode_size = Le32(sb + 0x4C) ? Le16(sb + 0x58) : 128;
+	unsigned long long reserved_gdt = (compat & EXT4_COMPAT_RESIZE_INODE) ? Le16(sb + 0xCE) : 0;
+	uint32_t backup_groups[2] = { Le32(sb + 0x24C), Le32(sb + 0x250) };
+	if (blocks_per_group == 0 || blocks_per_group > block_size * 8 || blocks <= first_data_block || desc_size < 32 || desc_size > block_size || inode_size == 0) {
+		LOGINFO("Invalid ext4 superblock\n");
+		return false;
+	}
+	unsigned long long groups = (blocks - first_data_block + blocks_per_group - 1) / blocks_per_group;
+	unsigned long long gdt_blocks = (groups * desc_size + block_size - 1) / block_size;
+	unsigned long long table_blocks = (inodes_per_group * inode_size + block_size - 1) / block_size;
+	// Without group checksums the kernel ignores the uninit flags, so every group has a bitmap
+	bool uninit = (ro_compat & (EXT4_RO_COMPAT_GDT_CSUM | EXT4_RO_COMPAT_METADATA_CSUM)) != 0;
+
+	std::vector<unsigned char> gdt((size_t)(groups * desc_size));
+	if (!Read_At(fd, &gdt[0], gdt.size(), (first_data_block + 1) * block_size))
+		return false;
+	for (unsigned long long group = 0; group < groups; group++) {
+		const unsigned char *desc = &gdt[(size_t)(group * desc_size)];
+		unsigned long long first_block = first_data_block + group * blocks_per_group;
+		unsigned long long group_blocks = std::min(blocks_per_group, blocks - first_block);
+		unsigned long long block_bitmap = Le32(desc);
+		unsigned long long inode_bitmap = Le32(desc + 0x4);
+		unsigned long long inode_table = Le32(desc + 0x8);
+		if (desc_size >= 64) {
+			block_bitmap |= (unsigned long long)Le32(desc + 0x20) << 32;
+			inode_bitmap |= (unsigned long long)Le32(desc + 0x24) << 32;
+			inode_table |= (unsigned long long)Le32(desc + 0x28) << 32;
+		}
+		if (block_bitmap >= blocks || inode_bitmap >= blocks || inode_table + table_blocks > blocks) {
+			LOGINFO("ext4 group %llu has an invalid descriptor\n", group);
+			return false;
+		}
+		// With flex_bg these sit in another group, whose bitmap has them as well
+		Add(block_bitmap * block_size, block_size);
+		Add(inode_bitmap * block_size, block_size);
+		Add(inode_table * block_size, table_blocks * block_size);
+
+		if (!uninit || !(Le16(desc + 0x12) & EXT4_BG_BLOCK_UNINIT)) {
+			if (!Read_Bitmap(fd, block_bitmap * block_size, first_block, group_blocks, block_size))
+				return false;
+			continue;
+		}
+		// A group that was never written only holds its superblock backup, if it has one
+		bool has_super;
+		if (group <= 1)
+			has_super = true;
+		else if (compat & EXT4_COMPAT_SPARSE_SUPER2)
+			has_super = group == backup_groups[0] || group == backup_groups[1];
+		else if (ro_compat & EXT4_RO_COMPAT_SPARSE_SUPER)
+			has_super = Ext4_Is_Power(group, 3) || Ext4_Is_Power(group, 5) || Ext4_Is_Power(group, 7);
+		else
+			has_super = true;
+		if (has_super)
+			Add(first_block * block_size, std::min(1 + gdt_blocks + reserved_gdt, group_blocks) * block_size);
+	}
+	return true;
+}
+
+bool twrpBlockMap::Read_F2fs(int fd, const std::string& Block_Device) {
+	unsigned char sb[1024];
+	char device[PATH_MAX];
+	char *line = NULL;
+	size_t line_size = 0;
+	unsigned long long segments = 0;
+	bool ret = true;
+
+	if (!Read_At(fd, sb, sizeof(sb), F2FS_SUPER_OFFSET))
+		return false;
+	if (Le32(sb) != F2FS_SUPER_MAGIC) {
+		LOGINFO("No f2fs superblock found\n");
+		return false;
+	}
+	if (Le32(sb + 16) != F2FS_LOG_BLOCKSIZE || Le32(sb + 20) != F2FS_LOG_BLOCKS_PER_SEG) {
+		LOGINFO("f2fs block size 2^%u and 2^%u blocks per segment are not supported by the block map\n", Le32(sb + 16), Le32(sb + 20));
+		return false;
+	}
+	unsigned long long segment_count_main = Le32(sb + 68);
+	unsigned long long main_blkaddr = Le32(sb + 92);
+	unsigned long long segment_size = (1ULL << F2FS_LOG_BLOCKS_PER_SEG) << F2FS_LOG_BLOCKSIZE;
+	// Checkpoints, SIT, NAT and SSA
+	Add(0, main_blkaddr << F2FS_LOG_BLOCKSIZE);
+
+	// The kernel names the folder after the block device the file system is on
+	if (realpath(Block_Device.c_str(), device) == NULL) {
+		LOGINFO("Unable to resolve '%s' (%s)\n", Block_Device.c_str(), strerror(errno));
+		return false;
+	}
+	const char *name = strrchr(device, '/');
+	std::string proc = std::string("/proc/fs/f2fs/") + (name ? name + 1 : device) + "/segment_bits";
+	FILE *fp = fopen(proc.c_str(), "re");
+	if (fp == NULL) {
+		LOGINFO("Unable to open '%s' (%s)\n", proc.c_str(), strerror(errno));
+		return false;
+	}
+	// Lines are "segno type|valid_blocks| xx xx ..." with the valid map of the segment, highest bit first
+	while (getline(&line, &line_size, fp) > 0) {
+		unsigned segno, type, valid;
+		unsigned char map[F2FS_SEGMENT_MAP];
+		int pos = 0;
+		bool damaged = false;
+
+		if (sscanf(line, "%u %u|%u|%n", &segno, &type, &valid, &pos) < 3 || pos == 0)
+			continue;
+		if (segno != segments) {
+			LOGINFO("Unexpected segment %u in '%s'\n", segno, proc.c_str());
+			ret = false;
+			break;
+		}
+		segments++;
+		if (valid == 0)
+			continue;
+		unsigned long long segment_offset = (main_blkaddr << F2FS_LOG_BLOCKSIZE) + segno * segment_size;
+		char *p = line + pos;
+		for (int i = 0; i < F2FS_SEGMENT_MAP && !damaged; i++) {
+			char *end;
+			unsigned long byte = strtoul(p, &end, 16);
+			if (end == p || byte > 0xFF)
+				damaged = true;
+			map[i] = (unsigned char)byte;
+			p = end;
+		}
+		if (damaged) {
+			Add(segment_offset, segment_size);
+			continue;
+		}
+		unsigned bit = 0, start;
+		while (bit < F2FS_SEGMENT_MAP * 8) {
+			if (!(map[bit / 8] & (0x80 >> (bit % 8)))) {
+				bit++;
+				continue;
+			}
+			start = bit;
+			while (bit < F2FS_SEGMENT_MAP * 8 && (map[bit / 8] & (0x80 >> (bit % 8))))
+				bit++;
+			Add(segment_offset + ((unsigned long long)start << F2FS_LOG_BLOCKSIZE), (unsigned long long)(bit - start) << F2FS_LOG_BLOCKSIZE);
+		}
+	}
+	free(line);
+	fclose(fp);
+	if (ret && segments != segment_count_main) {
+		LOGINFO("'%s' has %llu of %llu segments\n", proc.c_str(), segments, segment_count_main);
+		ret = false;
+	}
+	return ret;
+}
@@ -0,0 +1,65 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPBLOCKMAP_HPP
+#define __TWRPBLOCKMAP_HPP
+
+#include <string>
+#include <vector>
+
+#define BLOCK_MAP_BLOCK 4096                                                   // Runs are whole blocks of this size, the block size of sparse images
+
+struct twrpBlockMap_Run {
+	unsigned long long offset;                                                 // bytes from the start of the block device
+	unsigned long long length;
+};
+
+// The blocks of an ext2/3/4 or f2fs file system that are in use, so a backup
+// can copy only those and leave the free space out of the image. ext4 marks
+// its blocks in the block bitmap of each group. Groups that were never used
+// have no bitmap, their superblock backup, descriptors and the tables of every
+// group are added from the group descriptors instead. f2fs keeps its metadata
+// in front of the main area, which is taken whole, and the valid blocks of
+// each main area segment in the SIT. The kernel has the current SIT in memory
+// and shows it in /proc/fs/f2fs, so f2fs has to be mounted. Either way the
+// file system must not change while the map is read and the blocks copied,
+// which remounting it read only takes care of. Taking a block that is free
+// is always safe, so anything unclear is included.
+class twrpBlockMap
+{
+public:
+	twrpBlockMap();
+	static bool Supported(const std::string& File_System);
+	bool Read(const std::string& Block_Device, const std::string& File_System); // False if the map is incomplete, the blocks can't be trusted then
+	const std::vector<twrpBlockMap_Run>& Get_Runs() { return runs; }           // Sorted, merged and inside the device
+	unsigned long long Used_Bytes() { return used_bytes; }
+	unsigned long long Device_Size() { return device_size; }
+
+private:
+	bool Read_Ext4(int fd);
+	bool Read_F2fs(int fd, const std::string& Block_Device);
+	bool Read_Bitmap(int fd, unsigned long long offset, unsigned long long first_block, unsigned long long blocks, unsigned long long block_size);
+	void Add(unsigned long long offset, unsigned long long length);           // Rounded out to whole BLOCK_MAP_BLOCKs
+	void Finish();
+
+	std::vector<twrpBlockMap_Run> runs;
+	unsigned long long used_bytes;
+	unsigned long long device_size;
+};
+
+#endif // __TWRPBLOCKMAP_HPP
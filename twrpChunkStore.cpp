@@ -0,0 +1,491 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <string>
+#include <vector>
+#include "twrpChunkStore.hpp"
+#ifndef TW_NO_SHA2_LIBRARY
+#include "twrpDigest/twrpSHA.hpp"
+#endif
+#include "twcommon.h"
+#include "gui/gui.hpp"
+
+using namespace std;
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+void twrpChunkStore::Init_Gear() {
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+	// splitmix64, the table has to be the same on every build so chunks keep their cut points
+	for (int i = 0; i < 256; i++) {
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+size_t twrpChunkStore::Find_Cut(const unsigned char *data, size_t len) {
+	uint64_t hash = 0;
+
+	if (len <= CHUNK_MIN_SIZE)
+		return len;
+	if (len > CHUNK_MAX_SIZE)
+		len = CHUNK_MAX_SIZE;
+	// The top bits of the gear hash depend on the last 64 bytes only
+	for (size_t i = CHUNK_MIN_SIZE; i < len; i++) {
+		hash = (hash << 1) + gear[data[i]];
+		if ((hash & CHUNK_CUT_MASK) == 0)
+			return i + 1;
+	}
+	return len;
+}
+
+static bool Write_All(int fd, const unsigned char *data, size_t len) {
+	while (len > 0) {
+		ssize_t written = write(fd, data, len);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		data += written;
+		len -= written;
+	}
+	return true;
+}
+
+static ssize_t Read_All(int fd, unsigned char *data, size_t len) {
+	size_t total = 0;
+
+	while (total < len) {
+		ssize_t bytes = read(fd, data + total, len - total);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes < 0)
+			return -1;
+		if (bytes == 0)
+			break;
+		total += bytes;
+	}
+	return total;
+}
+
+twrpChunkStore::twrpChunkStore() {
+	pipe_fd = -1;
+	index_fd = -1;
+	running = false;
+	ok = true;
+	total_size = 0;
+	new_size = 0;
+	head_len = 0;
+	digest = NULL;
+	pthread_once(&gear_once, Init_Gear);
+}
+
+twrpChunkStore::~twrpChunkStore() {
+	Finish();
+	if (pipe_fd >= 0)
+		close(pipe_fd);
+	if (index_fd >= 0)
+		close(index_fd);
+	delete digest;
+}
+
+bool twrpChunkStore::Available() {
+#ifdef TW_NO_SHA2_LIBRARY
+	return false;
+#else
+	return true;
+#endif
+}
+
+string twrpChunkStore::Chunk_Path(const string& hash) {
+	return store + "/" + hash.substr(0, 2) + "/" + hash;
+}
+
+int twrpChunkStore::Open_Write(const string& filename) {
+	int fds[2];
+
+	if (!Available()) {
+		LOGERR("Deduplicated backups need SHA-256 support\n");
+		return -1;
+	}
+#ifndef TW_NO_SHA2_LIBRARY
+	digest = new twrpSHA256();
+#endif
+	archive = filename;
+	store = TWFunc::Get_Path(filename) + CHUNK_STORE_DIR;
+	if (!TWFunc::Recursive_Mkdir(store)) {
+		gui_msg(Msg(msg::kError, "create_folder_strerr=Can not create '{1}' folder ({2}).")(store)(strerror(errno)));
+		return -1;
+	}
+	// Created now so an existing archive fails the backup before anything is stored
+	index_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (index_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(filename)(strerror(errno)));
+		return -1;
+	}
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		LOGERR("Unable to create chunk pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(fds[1], F_SETPIPE_SZ, CHUNK_PIPE_SIZE);
+	pipe_fd = fds[0];
+	if (pthread_create(&thread, NULL, Writer_Thread, this) != 0) {
+		LOGERR("Unable to start chunk thread\n");
+		close(fds[1]);
+		return -1;
+	}
+	running = true;
+	return fds[1];
+}
+
+int twrpChunkStore::Open_Read(const string& filename) {
+	int fds[2];
+
+	if (!Available()) {
+		LOGERR("'%s' is a deduplicated backup which needs SHA-256 support\n", filename.c_str());
+		return -1;
+	}
+#ifndef TW_NO_SHA2_LIBRARY
+	digest = new twrpSHA256();
+#endif
+	archive = filename;
+	if (!Load_Index(filename))
+		return -1;
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		LOGERR("Unable to create chunk pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(fds[1], F_SETPIPE_SZ, CHUNK_PIPE_SIZE);
+	pipe_fd = fds[1];
+	if (pthread_create(&thread, NULL, Reader_Thread, this) != 0) {
+		LOGERR("Unable to start chunk thread\n");
+		close(fds[0]);
+		return -1;
+	}
+	running = true;
+	return fds[0];
+}
+
+bool twrpChunkStore::Finish() {
+	if (running) {
+		pthread_join(thread, NULL);
+		running = false;
+	}
+	return ok;
+}
+
+void* twrpChunkStore::Writer_Thread(void *cookie) {
+	twrpChunkStore *chunk_store = (twrpChunkStore*)cookie;
+
+	if (!chunk_store->Write_Chunks())
+		chunk_store->ok = false;
+	close(chunk_store->pipe_fd);
+	chunk_store->pipe_fd = -1;
+	return NULL;
+}
+
+void* twrpChunkStore::Reader_Thread(void *cookie) {
+	twrpChunkStore *chunk_store = (twrpChunkStore*)cookie;
+	sigset_t mask;
+
+	// A reader that stops early closes its end, we want EPIPE instead of the signal
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	if (!chunk_store->Read_Chunks())
+		chunk_store->ok = false;
+	close(chunk_store->pipe_fd);
+	chunk_store->pipe_fd = -1;
+	return NULL;
+}
+
+bool twrpChunkStore::Write_Chunks() {
+	size_t capacity = CHUNK_MAX_SIZE * 2, start = 0, end = 0, cut;
+	unsigned char *buf;
+	bool eof = false, stored = true;
+	ssize_t bytes;
+
+	buf = (unsigned char*)malloc(capacity);
+	if (buf == NULL) {
+		LOGERR("Unable to allocate chunk buffer\n");
+		return false;
+	}
+	for (;;) {
+		if (!eof && end - start < CHUNK_MAX_SIZE) {
+			if (capacity - end < CHUNK_MAX_SIZE) {
+				memmove(buf, buf + start, end - start);
+				end -= start;
+				start = 0;
+			}
+			bytes = read(pipe_fd, buf + end, capacity - end);
+			if (bytes < 0 && errno == EINTR)
+				continue;
+			if (bytes < 0) {
+				LOGERR("Error reading chunk pipe: %s\n", strerror(errno));
+				stored = false;
+				break;
+			}
+			if (bytes == 0)
+				eof = true;
+			end += bytes;
+			continue;
+		}
+		if (start == end)
+			break;
+		cut = Find_Cut(buf + start, end - start);
+		// After a failure the rest is still read so the writer never blocks on a full pipe
+		if (stored && !Store_Chunk(buf + start, cut))
+			stored = false;
+		start += cut;
+		if (!stored) {
+			start = end = 0;
+			if (eof)
+				break;
+		}
+	}
+	free(buf);
+	if (!stored)
+		return false;
+	LOGINFO("%s: %llu MB in %zu chunks, %llu MB new\n", TWFunc::Get_Filename(archive).c_str(), total_size / 1048576, chunks.size(), new_size / 1048576);
+	return Write_Index();
+}
+
+bool twrpChunkStore::Store_Chunk(const unsigned char *data, size_t len) {
+	Chunk_Ref ref;
+	struct stat st;
+	string path, dir, temp;
+	int fd;
+
+	if (head_len == 0) {
+		head_len = len < sizeof(head) ? len : sizeof(head);
+		memcpy(head, data, head_len);
+	}
+	digest->init();
+	digest->update(data, len);
+	ref.hash = digest->return_digest_string();
+	ref.len = len;
+	chunks.push_back(ref);
+	total_size += len;
+
+	path = Chunk_Path(ref.hash);
+	if (stat(path.c_str(), &st) == 0 && (size_t)st.st_size == len)
+		return true; // already stored by an earlier backup
+	dir = TWFunc::Get_Path(path);
+	if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		gui_msg(Msg(msg::kError, "create_folder_strerr=Can not create '{1}' folder ({2}).")(dir)(strerror(errno)));
+		return false;
+	}
+	// Written under a temporary name so a cancelled backup never leaves a partial chunk behind
+	temp = path + ".tmp" + TWFunc::to_string(getpid()) + "_" + TWFunc::to_string(syscall(SYS_gettid));
+	fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(temp)(strerror(errno)));
+		return false;
+	}
+	if (!Write_All(fd, data, len) || close(fd) != 0) {
+		gui_msg(Msg(msg::kError, "error_writing_strerr=Error writing: '{1}' ({2})")(temp)(strerror(errno)));
+		unlink(temp.c_str());
+		return false;
+	}
+	if (rename(temp.c_str(), path.c_str()) != 0) {
+		gui_msg(Msg(msg::kError, "error_writing_strerr=Error writing: '{1}' ({2})")(path)(strerror(errno)));
+		unlink(temp.c_str());
+		return false;
+	}
+	new_size += len;
+	return true;
+}
+
+bool twrpChunkStore::Write_Index() {
+	FILE *fp;
+	char hex[sizeof(head) * 2 + 1];
+	bool ret;
+
+	fp = fdopen(index_fd, "w");
+	if (fp == NULL)
+		return false;
+	index_fd = -1;
+	for (size_t i = 0; i < sizeof(head); i++)
+		sprintf(hex + i * 2, "%02x", i < head_len ? head[i] : 0);
+	fprintf(fp, "%s\nstore %s\nhead %s\nsize %llu\n", CHUNK_INDEX_MAGIC, CHUNK_STORE_DIR, hex, total_size);
+	for (size_t i = 0; i < chunks.size(); i++)
+		fprintf(fp, "chunk %s %zu\n", chunks[i].hash.c_str(), chunks[i].len);
+	fprintf(fp, "end %zu\n", chunks.size());
+	ret = !ferror(fp);
+	if (fclose(fp) != 0)
+		ret = false;
+	if (!ret)
+		gui_msg(Msg(msg::kError, "error_writing_strerr=Error writing: '{1}' ({2})")(archive)(strerror(errno)));
+	return ret;
+}
+
+bool twrpChunkStore::Load_Index(const string& filename) {
+	FILE *fp;
+	char line[512], value[256], hex[16];
+	unsigned long long size = 0, sum = 0;
+	size_t len, count;
+	bool header = true, complete = false;
+
+	fp = fopen(filename.c_str(), "r");
+	if (fp == NULL) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(filename)(strerror(errno)));
+		return false;
+	}
+	chunks.clear();
+	store = TWFunc::Get_Path(filename) + CHUNK_STORE_DIR;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (header) {
+			header = false;
+			if (strncmp(line, CHUNK_INDEX_MAGIC, strlen(CHUNK_INDEX_MAGIC)) != 0)
+				break;
+		} else if (sscanf(line, "chunk %255s %zu", value, &len) == 2) {
+			Chunk_Ref ref;
+			ref.hash = value;
+			ref.len = len;
+			chunks.push_back(ref);
+			sum += len;
+		} else if (sscanf(line, "store %255s", value) == 1) {
+			store = TWFunc::Get_Path(filename) + value;
+		} else if (sscanf(line, "head %15s", hex) == 1) {
+			for (head_len = 0; head_len < sizeof(head) && hex[head_len * 2] && hex[head_len * 2 + 1]; head_len++)
+				sscanf(hex + head_len * 2, "%2hhx", &head[head_len]);
+		} else if (sscanf(line, "size %llu", &size) == 1) {
+			continue;
+		} else if (sscanf(line, "end %zu", &count) == 1) {
+			complete = (count == chunks.size() && sum == size);
+			break;
+		}
+	}
+	fclose(fp);
+	if (!complete) {
+		LOGERR("'%s' is not a complete chunk index\n", filename.c_str());
+		return false;
+	}
+	total_size = size;
+	return true;
+}
+
+bool twrpChunkStore::Read_Chunks() {
+	unsigned char *buf;
+	string path;
+	bool ret = true;
+	int fd;
+
+	buf = (unsigned char*)malloc(CHUNK_MAX_SIZE);
+	if (buf == NULL) {
+		LOGERR("Unable to allocate chunk buffer\n");
+		return false;
+	}
+	for (size_t i = 0; i < chunks.size() && ret; i++) {
+		path = Chunk_Path(chunks[i].hash);
+		if (chunks[i].len > CHUNK_MAX_SIZE) {
+			ret = false;
+			break;
+		}
+		fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			gui_msg(Msg(msg::kError, "chunk_missing=Backup data '{1}' is missing or damaged.")(path));
+			ret = false;
+			break;
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		// A chunk must still have its size and hash, it is shared with other backups
+		if (Read_All(fd, buf, chunks[i].len) != (ssize_t)chunks[i].len) {
+			gui_msg(Msg(msg::kError, "chunk_missing=Backup data '{1}' is missing or damaged.")(path));
+			ret = false;
+		} else {
+			digest->init();
+			digest->update(buf, chunks[i].len);
+			if (digest->return_digest_string() != chunks[i].hash) {
+				gui_msg(Msg(msg::kError, "chunk_missing=Backup data '{1}' is missing or damaged.")(path));
+				ret = false;
+			}
+		}
+		close(fd);
+		if (ret && !Write_All(pipe_fd, buf, chunks[i].len)) {
+			if (errno != EPIPE)
+				ret = false;
+			break; // the reader is done
+		}
+	}
+	free(buf);
+	return ret;
+}
+
+bool twrpChunkStore::Is_Chunked(const string& filename) {
+	char magic[sizeof(CHUNK_INDEX_MAGIC)];
+	int fd;
+	ssize_t bytes;
+
+	fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	bytes = Read_All(fd, (unsigned char*)magic, sizeof(magic) - 1);
+	close(fd);
+	return bytes == (ssize_t)sizeof(magic) - 1 && memcmp(magic, CHUNK_INDEX_MAGIC, sizeof(magic) - 1) == 0;
+}
+
+unsigned long long twrpChunkStore::Get_Size(const string& filename) {
+	twrpChunkStore index;
+
+	if (!Is_Chunked(filename))
+		return TWFunc::Get_File_Size(filename);
+	if (!index.Load_Index(filename))
+		return 0;
+	return index.total_size;
+}
+
+Archive_Type twrpChunkStore::Get_File_Type(const string& filename) {
+	twrpChunkStore index;
+	unsigned char header[4] = {0, 0, 0, 0};
+
+	if (!Is_Chunked(filename))
+		return TWFunc::Get_File_Type(filename);
+	if (index.Load_Index(filename))
+		memcpy(header, index.head, index.head_len);
+	return TWFunc::Get_Header_Type(header);
+}
+
+int twrpChunkStore::Open_File(const string& filename, twrpChunkStore **chunk_store) {
+	int fd;
+
+	*chunk_store = NULL;
+	if (!Is_Chunked(filename))
+		return open(filename.c_str(), O_RDONLY | O_LARGEFILE);
+	*chunk_store = new twrpChunkStore();
+	fd = (*chunk_store)->Open_Read(filename);
+	if (fd < 0) {
+		delete *chunk_store;
+		*chunk_store = NULL;
+	}
+	return fd;
+}
@@ -0,0 +1,93 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPCHUNKSTORE_HPP
+#define __TWRPCHUNKSTORE_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include "twrpDigest/twrpDigest.hpp"
+#include "twrp-functions.hpp"
+
+#define CHUNK_STORE_DIR "../../../CHUNKS"                                       // Relative to a backup folder, <storage>/TWRP/CHUNKS next to BACKUPS
+#define CHUNK_INDEX_MAGIC "TWRP_CHUNKS 1"
+#define CHUNK_MIN_SIZE (256 * 1024)                                             // No cut point is looked for before this
+#define CHUNK_MAX_SIZE (4 * 1024 * 1024)
+#define CHUNK_CUT_MASK (0xfffffULL << 44)                                       // 20 bits of the gear hash, about 1MB between cut points
+#define CHUNK_PIPE_SIZE (1024 * 1024)
+
+// Deduplicated storage of backup archives and images. The data written to the
+// fd from Open_Write is cut into chunks at content defined points with a gear
+// hash, so an insertion only changes the chunks around it. Every chunk is named
+// by its SHA-256 and stored once in a chunk folder shared by all backups on the
+// storage. Chunks that are already there are skipped after hashing. In place of
+// the archive an index listing the chunks is written. Open_Read gives an fd
+// that streams the original data back from the chunks, so tar, the raw image
+// restore and digest checks read it like a normal file.
+class twrpChunkStore
+{
+public:
+	twrpChunkStore();
+	~twrpChunkStore();
+
+	int Open_Write(const std::string& filename);                               // Returns the fd to write the archive to, -1 on error
+	int Open_Read(const std::string& filename);                                // Returns an fd the archive can be read from, -1 on error
+	bool Finish();                                                             // Waits for the chunk thread after the fd was closed, false if it failed
+
+	static bool Available();                                                   // Chunks are named by SHA-256, builds without it can only use normal files
+	static bool Is_Chunked(const std::string& filename);                       // True if filename is a chunk index
+	static unsigned long long Get_Size(const std::string& filename);           // Size of the stored data, also works for normal files
+	static Archive_Type Get_File_Type(const std::string& filename);            // TWFunc::Get_File_Type that looks through chunk indexes
+	static int Open_File(const std::string& filename, twrpChunkStore **store);  // Opens a chunked or normal file for reading, *store is NULL for a normal file
+
+private:
+	struct Chunk_Ref {
+		std::string hash;
+		size_t len;
+	};
+
+	static void* Writer_Thread(void *cookie);
+	static void* Reader_Thread(void *cookie);
+	static void Init_Gear();
+	static size_t Find_Cut(const unsigned char *data, size_t len);
+	bool Write_Chunks();
+	bool Read_Chunks();
+	bool Store_Chunk(const unsigned char *data, size_t len);
+	bool Write_Index();
+	bool Load_Index(const std::string& filename);
+	std::string Chunk_Path(const std::string& hash);
+
+	std::string archive;
+	std::string store;                                                         // chunk folder of this archive
+	int pipe_fd;                                                               // the end of the pipe the chunk thread uses
+	int index_fd;                                                              // index being written, created with O_EXCL when the backup starts
+	pthread_t thread;
+	bool running;
+	bool ok;
+	std::vector<Chunk_Ref> chunks;
+	unsigned long long total_size;
+	unsigned long long new_size;                                               // bytes that were not in the store yet
+	unsigned char head[4];                                                     // first bytes of the data so the archive type can be detected
+	size_t head_len;
+	twrpDigest *digest;
+};
+
+#endif // __TWRPCHUNKSTORE_HPP
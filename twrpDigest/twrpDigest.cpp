@@ -18,9 +18,40 @@
 
 #include <vector>
 #include <string>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "twrpDigest.hpp"
 
+int twrpDigest::update_from_fd(int fd, uint64_t *bytes_read) {
+	void *buf;
+	ssize_t bytes;
+	int err = 0;
+
+	*bytes_read = 0;
+	if (posix_memalign(&buf, DIGEST_STREAM_ALIGN, DIGEST_STREAM_BUFFER_SIZE) != 0)
+		return ENOMEM;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (;;) {
+		bytes = read(fd, buf, DIGEST_STREAM_BUFFER_SIZE);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			break;
+		}
+		if (bytes == 0)
+			break;
+		update((unsigned char*) buf, bytes);
+		*bytes_read += bytes;
+	}
+	// The data is not read again, keep it from pushing other files out of the cache
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	free(buf);
+	return err;
+}
+
 std::string twrpDigest::hexify(uint8_t* hash, size_t len) {
 	char hex[3];
 	std::string digest_string;
@@ -19,6 +19,11 @@
 #ifndef __TWRPDIGEST_H
 #define __TWRPDIGEST_H
 
+#include <stdint.h>
+
+#define DIGEST_STREAM_BUFFER_SIZE (1024 * 1024)                            // Read size used when hashing a whole file
+#define DIGEST_STREAM_ALIGN 4096
+
 class twrpDigest {
 public:
 	twrpDigest() {};
@@ -26,6 +31,7 @@ public:
 	virtual void init() = 0;                                         // Initialize the digest according to the algorithm
 	virtual void update(const unsigned char* stream, size_t len) = 0;         // Update the digest with new data
 	virtual std::string return_digest_string() = 0;                  // Returns the digest of the file as a string.
+	int update_from_fd(int fd, uint64_t *bytes_read);                // Hash fd until EOF, returns 0 or the errno of the failed read
 
 protected:
 	virtual void finalize() = 0;                                     // Finalize the digest input for creating the final digest
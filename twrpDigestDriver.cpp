@@ -18,13 +18,26 @@
 
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <set>
 #include <string>
+#include <vector>
 #include <unistd.h>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 #include "data.hpp"
 #include "partitions.hpp"
+#include "twrpBackupMeta.hpp"
 #include "set_metadata.h"
 #include "twrpDigestDriver.hpp"
+#include "twrpChunkStore.hpp"
+#include "twrpTar.hpp"
 #include "twrp-functions.hpp"
+#include "twrpTrace.hpp"
 #include "twcommon.h"
 #include "variables.h"
 #include "gui/gui.hpp"
@@ -33,144 +46,302 @@
 #include "twrpDigest/twrpSHA.hpp"
 
 
-bool twrpDigestDriver::Check_Restore_File_Digest(const string& Filename) {
+#define DIGEST_MAX_THREADS 8
+
+struct digest_pool_struct {
+	const std::vector<string> *files;
+	std::vector<int> *results;                                                 // Per file, only when every file is checked
+	size_t next;
+	size_t done;
+	size_t failed;
+	pthread_mutex_t lock;
+};
+
+// The digest of a backup file, from the backup metadata or the old digest file
+static bool Find_Digest(const string& digestfile, string *expected_digest) {
+	string contents;
+
+	if (twrpBackupMeta::Find(TWFunc::Get_Path(digestfile), BACKUP_META_DIGEST, TWFunc::Get_Filename(digestfile), &contents)) {
+		if (expected_digest)
+			*expected_digest = contents.substr(0, contents.find_first_of(" \t\n"));
+		return true;
+	}
+	if (!TWFunc::Path_Exists(digestfile))
+		return false;
+	if (expected_digest && TWFunc::read_file(digestfile, *expected_digest) != 0)
+		expected_digest->clear();
+	return true;
+}
+
+twrpDigest* twrpDigestDriver::New_Restore_Digest(const string& Filename, string *expected_digest, bool *use_sha2) {
 	twrpDigest *digest;
-	string digestfile = Filename, file_name = Filename;
-	string digest_str;
-	bool use_sha2 = false;
+	string digestfile;
 
 #ifndef TW_NO_SHA2_LIBRARY
 
-	digestfile += ".sha2";
-	if (TWFunc::Path_Exists(digestfile)) {
+	digestfile = Filename + ".sha2";
+	if (Find_Digest(digestfile, expected_digest)) {
 		digest = new twrpSHA256();
-		use_sha2 = true;
+		*use_sha2 = true;
 	}
 	else {
 		digest = new twrpMD5();
 		digestfile = Filename + ".md5";
-
+		*use_sha2 = false;
 	}
 #else
 	digest = new twrpMD5();
 	digestfile = Filename + ".md5";
-
+	*use_sha2 = false;
 #endif
 
-	if (!TWFunc::Path_Exists(digestfile)) {
+	if (!Find_Digest(digestfile, expected_digest)) {
 		gui_msg(Msg(msg::kError, "no_digest_found=No digest file found for '{1}'. Please unselect Enable Digest verification to restore.")(Filename));
 		delete digest;
-		return false;
+		return NULL;
 	}
-
-
-	if (TWFunc::read_file(digestfile, digest_str) != 0) {
+	if (expected_digest->empty()) {
 		gui_msg("digest_error=Digest Error!");
 		delete digest;
-		return false;
+		return NULL;
 	}
+	return digest;
+}
 
-	if (!stream_file_to_digest(file_name, digest)) {
-		delete digest;
-		return false;
-	}
+bool twrpDigestDriver::Compare_Digest(const string& Filename, twrpDigest* digest, const string& expected_digest, bool use_sha2) {
 	string digest_check = digest->return_digest_string();
-	if (digest_check == digest_str) {
+	if (digest_check == expected_digest) {
 		if (use_sha2)
-			LOGINFO("SHA2 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Filename).c_str());
+			LOGINFO("SHA2 Digest: %s  %s\n", expected_digest.c_str(), TWFunc::Get_Filename(Filename).c_str());
 		else
-			LOGINFO("MD5 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Filename).c_str());
-		delete digest;
+			LOGINFO("MD5 Digest: %s  %s\n", expected_digest.c_str(), TWFunc::Get_Filename(Filename).c_str());
 		return true;
 	}
 
 	gui_msg(Msg(msg::kError, "digest_fail_match=Digest failed to match on '{1}'.")(Filename));
-	delete digest;
 	return false;
-
 }
 
-bool twrpDigestDriver::Check_Digest(string Full_Filename) {
-	char split_filename[512];
-	int index = 0;
+bool twrpDigestDriver::Check_Restore_File_Digest(const string& Filename) {
+	twrpDigest *digest;
+	string digest_str;
+	bool use_sha2 = false, ret;
 
-	sync();
-	if (!TWFunc::Path_Exists(Full_Filename)) {
-		// This is a split archive, we presume
-		memset(split_filename, 0, sizeof(split_filename));
-		while (index < 1000) {
-			sprintf(split_filename, "%s%03i", Full_Filename.c_str(), index);
-			if (!TWFunc::Path_Exists(split_filename))
-				break;
-				LOGINFO("split_filename: %s\n", split_filename);
-				if (!Check_Restore_File_Digest(split_filename))
-					return false;
-				index++;
+	digest = New_Restore_Digest(Filename, &digest_str, &use_sha2);
+	if (digest == NULL)
+		return false;
+	if (!stream_file_to_digest(Filename, digest)) {
+		delete digest;
+		return false;
+	}
+	ret = Compare_Digest(Filename, digest, digest_str, use_sha2);
+	delete digest;
+	return ret;
+}
+
+static void Find_Archive_Files(const string& Full_Filename, std::vector<string> *files) {
+	if (TWFunc::Path_Exists(Full_Filename)) {
+		files->push_back(Full_Filename); // Single file archive
+		return;
+	}
+	// This is a split archive, we presume
+	std::vector<std::vector<string> > threads = twrpTar::List_Archives(Full_Filename);
+	for (size_t i = 0; i < threads.size(); i++) {
+		for (size_t j = 0; j < threads[i].size(); j++) {
+			LOGINFO("split_filename: %s\n", threads[i][j].c_str());
+			files->push_back(threads[i][j]);
 		}
-		return true;
 	}
-	return Check_Restore_File_Digest(Full_Filename); // Single file archive
 }
 
-bool twrpDigestDriver::Write_Digest(string Full_Filename) {
-	twrpDigest *digest;
-	string digest_filename, digest_str;
-	int use_sha2;
+static void* Check_Digest_Thread(void *cookie) {
+	struct digest_pool_struct *pool = (struct digest_pool_struct*) cookie;
+	size_t index;
+	bool ret;
 
-#ifdef TW_NO_SHA2_LIBRARY
-	use_sha2 = 0;
-#else
-	DataManager::GetValue(TW_USE_SHA2, use_sha2);
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		if ((pool->failed && !pool->results) || pool->next >= pool->files->size()) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		index = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		ret = twrpDigestDriver::Check_Restore_File_Digest(pool->files->at(index));
+		pthread_mutex_lock(&pool->lock);
+		if (pool->results)
+			pool->results->at(index) = ret;
+		if (!ret)
+			pool->failed++;
+		pool->done++;
+		DataManager::SetProgress((float) pool->done / (float) pool->files->size());
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+static void Log_Digest_Acceleration() {
+#if defined(__aarch64__) && defined(HWCAP_SHA2)
+	// libcrypto picks the ARMv8 SHA-256 instructions itself when the CPU has them
+	if (getauxval(AT_HWCAP) & HWCAP_SHA2)
+		LOGINFO("Using ARMv8 crypto extensions for SHA2 digests\n");
+	else
+		LOGINFO("No ARMv8 crypto extensions, SHA2 digests are computed in software\n");
 #endif
+}
 
-	if (use_sha2) {
-#ifndef TW_NO_SHA2_LIBRARY
-		digest = new twrpSHA256();
-		digest_filename = Full_Filename + ".sha2";
-		if (!stream_file_to_digest(Full_Filename, digest)) {
-			delete digest;
-			return false;
-		}
-		digest_str = digest->return_digest_string();
-		if (digest_str.empty()) {
-			delete digest;
-			return false;
+// Each archive is hashed on its own, so they can all be checked at the same time
+static size_t Run_Digest_Pool(const std::vector<string>& files, unsigned max_threads, std::vector<int> *results) {
+	struct digest_pool_struct pool;
+	pthread_t digest_thread[DIGEST_MAX_THREADS];
+	unsigned thread_count, started = 0, i;
+
+	thread_count = sysconf(_SC_NPROCESSORS_CONF);
+	if (thread_count > max_threads)
+		thread_count = max_threads;
+	if (thread_count > DIGEST_MAX_THREADS)
+		thread_count = DIGEST_MAX_THREADS;
+	if (thread_count > files.size())
+		thread_count = files.size();
+	if (thread_count < 1)
+		thread_count = 1;
+	LOGINFO("Checking %zu digests with %u threads\n", files.size(), thread_count);
+	Log_Digest_Acceleration();
+
+	pool.files = &files;
+	pool.results = results;
+	pool.next = 0;
+	pool.done = 0;
+	pool.failed = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	for (i = 1; i < thread_count; i++) {
+		if (pthread_create(&digest_thread[started], NULL, Check_Digest_Thread, (void*)&pool) != 0) {
+			LOGINFO("Unable to create digest thread %u, continuing with %u threads.\n", i, started + 1);
+			break;
 		}
-		LOGINFO("SHA2 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Full_Filename).c_str());
-#endif
+		started++;
 	}
-	else  {
-		digest = new twrpMD5();
-		digest_filename = Full_Filename + ".md5";
-		if (!stream_file_to_digest(Full_Filename, digest)) {
-			delete digest;
-			return false;
-		}
-		digest_str = digest->return_digest_string();
-		if (digest_str.empty()) {
-			delete digest;
-			return false;
-		}
-		LOGINFO("MD5 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Full_Filename).c_str());
+	Check_Digest_Thread((void*)&pool);
+	for (i = 0; i < started; i++)
+		pthread_join(digest_thread[i], NULL);
+	pthread_mutex_destroy(&pool.lock);
+	return pool.failed;
+}
+
+bool twrpDigestDriver::Check_Digests(const std::vector<string>& Full_Filenames) {
+	twrpTraceScope trace("digest", "Check_Digests");
+	std::vector<string> files;
+
+	sync();
+	for (size_t i = 0; i < Full_Filenames.size(); i++)
+		Find_Archive_Files(Full_Filenames[i], &files);
+	if (files.empty())
+		return true;
+	return Run_Digest_Pool(files, DIGEST_MAX_THREADS, NULL) == 0;
+}
+
+size_t twrpDigestDriver::Check_Files(const std::vector<string>& Files, unsigned Max_Threads, std::vector<int> *Results) {
+	twrpTraceScope trace("digest", "Check_Files");
+
+	Results->assign(Files.size(), 0);
+	if (Files.empty())
+		return 0;
+	return Run_Digest_Pool(Files, Max_Threads, Results);
+}
+
+bool twrpDigestDriver::Has_Digest(const string& Filename) {
+	return Find_Digest(Filename + ".sha2", NULL) || Find_Digest(Filename + ".md5", NULL);
+}
+
+bool twrpDigestDriver::Check_Digest(string Full_Filename) {
+	return Check_Digests(std::vector<string>(1, Full_Filename));
+}
+
+twrpDigest* twrpDigestDriver::New_Backup_Digest(bool *use_sha2) {
+	int sha2 = 0;
+
+#ifndef TW_NO_SHA2_LIBRARY
+	DataManager::GetValue(TW_USE_SHA2, sha2);
+	if (sha2) {
+		*use_sha2 = true;
+		return new twrpSHA256();
 	}
+#endif
+	*use_sha2 = false;
+	return new twrpMD5();
+}
+
+string twrpDigestDriver::Digest_Filename(string Full_Filename, bool use_sha2) {
+	return Full_Filename + (use_sha2 ? ".sha2" : ".md5");
+}
+
+bool twrpDigestDriver::Write_Digest_File(string Full_Filename, twrpDigest* digest, bool use_sha2) {
+	string digest_filename = Digest_Filename(Full_Filename, use_sha2);
+	string digest_str = digest->return_digest_string();
+
+	if (digest_str.empty())
+		return false;
+	LOGINFO("%s Digest: %s  %s\n", use_sha2 ? "SHA2" : "MD5", digest_str.c_str(), TWFunc::Get_Filename(Full_Filename).c_str());
 
 	digest_str = digest_str + "  " + TWFunc::Get_Filename(Full_Filename) + "\n";
 	LOGINFO("digest_filename: %s\n", digest_filename.c_str());
 
-	if (TWFunc::write_to_file(digest_filename, digest_str) == 0) {
+	if (twrpBackupMeta::Add(TWFunc::Get_Path(Full_Filename), BACKUP_META_DIGEST, TWFunc::Get_Filename(digest_filename), digest_str)) {
+		gui_msg("digest_created= * Digest Created.");
+	}
+	else if (TWFunc::write_to_file(digest_filename, digest_str) == 0) {
 		tw_set_default_metadata(digest_filename.c_str());
 		gui_msg("digest_created= * Digest Created.");
 	}
 	else {
 		gui_err("digest_error= * Digest Error!");
+		return false;
+	}
+	return true;
+}
+
+// Backup files of the running backup whose digest was written inline. An
+// existing digest file is not enough, it may be left from an earlier backup
+// to the same folder.
+static std::set<string> inline_digests;
+static pthread_mutex_t inline_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void twrpDigestDriver::Digested_Inline(const string& Full_Filename) {
+	pthread_mutex_lock(&inline_lock);
+	inline_digests.insert(Full_Filename);
+	pthread_mutex_unlock(&inline_lock);
+}
+
+void twrpDigestDriver::Forget_Inline() {
+	pthread_mutex_lock(&inline_lock);
+	inline_digests.clear();
+	pthread_mutex_unlock(&inline_lock);
+}
+
+bool twrpDigestDriver::Write_Digest(string Full_Filename) {
+	twrpDigest *digest;
+	bool use_sha2, ret, written;
+
+	pthread_mutex_lock(&inline_lock);
+	written = (inline_digests.erase(Full_Filename) > 0);
+	pthread_mutex_unlock(&inline_lock);
+	if (written) {
+		LOGINFO("Digest for '%s' was created during backup\n", Full_Filename.c_str());
+		return true;
+	}
+	digest = New_Backup_Digest(&use_sha2);
+	if (!stream_file_to_digest(Full_Filename, digest)) {
 		delete digest;
 		return false;
 	}
+	ret = Write_Digest_File(Full_Filename, digest, use_sha2);
 	delete digest;
-	return true;
+	return ret;
 }
 
 bool twrpDigestDriver::Make_Digest(string Full_Filename) {
+	twrpTraceScope trace("digest", "Make_Digest");
 	string command, result;
 
 	TWFunc::GUI_Operation_Text(TW_GENERATE_DIGEST_TEXT, gui_parse_text("{@generating_digest1}"));
@@ -179,40 +350,49 @@ bool twrpDigestDriver::Make_Digest(string Full_Filename) {
 		if (!Write_Digest(Full_Filename))
 			return false;
 	} else {
-		char filename[512];
-		int index = 0;
-		sprintf(filename, "%s%03i", Full_Filename.c_str(), index);
-		while (index < 1000) {
-			string digest_src(filename);
-			if (TWFunc::Path_Exists(filename)) {
-				if (!Write_Digest(filename))
-					return false;
-				}
-				else
-					break;
-				index++;
-				sprintf(filename, "%s%03i", Full_Filename.c_str(), index);
-			}
-			if (index == 0) {
-				LOGERR("Backup file: '%s' not found!\n", filename);
-					return false;
-			}
-			gui_msg("digest_created= * Digest Created.");
+		std::vector<string> files;
+		Find_Archive_Files(Full_Filename, &files);
+		if (files.empty()) {
+			LOGERR("Backup file: '%s' not found!\n", twrpTar::Archive_Name(Full_Filename, 0, 0).c_str());
+			return false;
+		}
+		for (size_t i = 0; i < files.size(); i++) {
+			if (!Write_Digest(files[i]))
+				return false;
+		}
+		gui_msg("digest_created= * Digest Created.");
 	}
 	return true;
 }
 
 bool twrpDigestDriver::stream_file_to_digest(string filename, twrpDigest* digest) {
-	char buf[4096];
-	int bytes;
+	timespec start, end;
+	uint64_t bytes_read;
+	int32_t ms;
+	int err;
+	twrpChunkStore *chunks;
 
-	int fd = open(filename.c_str(), O_RDONLY);
+	// A deduplicated archive is hashed from its data, the same digest as a normal file
+	int fd = twrpChunkStore::Open_File(filename, &chunks);
 	if (fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(filename)(strerror(errno)));
 		return false;
 	}
-	while ((bytes = read(fd, &buf, sizeof(buf))) != 0) {
-		digest->update((unsigned char*)buf, bytes);
-	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	err = digest->update_from_fd(fd, &bytes_read);
+	clock_gettime(CLOCK_MONOTONIC, &end);
 	close(fd);
+	if (chunks != NULL) {
+		if (!chunks->Finish() && err == 0)
+			err = EIO;
+		delete chunks;
+	}
+	if (err != 0) {
+		gui_msg(Msg(msg::kError, "error_reading_strerr=Error reading: '{1}' ({2})")(filename)(strerror(err)));
+		return false;
+	}
+	ms = TWFunc::timespec_diff_ms(start, end);
+	LOGINFO("Digest read %llu bytes of '%s' in %i ms (%llu MB/s)\n", (unsigned long long)bytes_read, TWFunc::Get_Filename(filename).c_str(), ms,
+		ms > 0 ? (unsigned long long)(bytes_read * 1000 / ms / 1048576) : 0ULL);
 	return true;
 }
@@ -19,6 +19,7 @@
 #ifndef __TWRP_DIGEST_DRIVER
 #define __TWRP_DIGEST_DRIVER
 #include <string>
+#include <vector>
 #include "twrpDigest/twrpDigest.hpp"
 
 class twrpDigestDriver {
@@ -26,7 +27,17 @@ public:
 
 	static bool Check_Restore_File_Digest(const string& Filename);		//Check the digest of a TWRP partition backup
 	static bool Check_Digest(string Full_Filename);				//Check to make sure the digest is correct
-	static bool Write_Digest(string Full_Filename);				//Write the digest to a file
+	static bool Check_Digests(const std::vector<string>& Full_Filenames);	//Check the digests of several partition backups in parallel
+	static size_t Check_Files(const std::vector<string>& Files, unsigned Max_Threads, std::vector<int> *Results); //Check every file in parallel, even after a mismatch, and return how many failed
+	static bool Has_Digest(const string& Filename);				//Check if a backup file has a digest to check against
+	static twrpDigest* New_Restore_Digest(const string& Filename, string *expected_digest, bool *use_sha2); //Create the digest matching a backup file's digest file, NULL if there is none
+	static bool Compare_Digest(const string& Filename, twrpDigest* digest, const string& expected_digest, bool use_sha2); //Compare a digest that was fed the whole file
+	static bool Write_Digest(string Full_Filename);				//Write the digest to a file, unless it was written inline in this backup
+	static void Digested_Inline(const string& Full_Filename);		//Record that the digest of a backup file was written while the file was
+	static void Forget_Inline();						//Drop the records of an earlier backup
+	static twrpDigest* New_Backup_Digest(bool *use_sha2);			//Create the digest type new backups use (MD5 or SHA2)
+	static string Digest_Filename(string Full_Filename, bool use_sha2);	//Name of the digest file for a backup file
+	static bool Write_Digest_File(string Full_Filename, twrpDigest* digest, bool use_sha2); //Write a digest that was already fed the whole file
 	static bool Make_Digest(string Full_Filename);				//Create the digest for a partition backup
 	static bool stream_file_to_digest(string filename, twrpDigest* digest); //Stream the file to twrpDigest
 };
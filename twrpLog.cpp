@@ -0,0 +1,322 @@
+/*
+	Copyright 2012 to 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "twrpLog.hpp"
+
+#define LOG_PIPE_SIZE (1024 * 1024)                        // Room for bursts while the writer catches up
+#define LOG_WRITE_SIZE (64 * 1024)
+#define LOG_FLUSH_TIMEOUT_S 2                              // Flush gives up if the writer is stuck
+
+static int log_fd = -1;                                    // The log file
+static int log_pipe_fd = -1;                               // Read end of the pipe behind stdout and stderr
+static pid_t log_pid = 0;                                  // Forked children don't have the writer thread
+static bool log_busy = false;                              // The writer took data out of the pipe and has not written it yet
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+struct Log_Copy {
+	int fd;
+	dev_t dev;                                             // Which file fd is, to notice when the path gets a new one
+	ino_t ino;
+	bool dirty;                                            // Written since the last Sync_Copies
+};
+static std::map<std::string, Log_Copy> log_copies;         // Kept open between copies, by path
+static pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool Write_All(int fd, const char* data, size_t size) {
+	while (size) {
+		ssize_t n = write(fd, data, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+static void Set_Busy(bool busy) {
+	pthread_mutex_lock(&log_lock);
+	log_busy = busy;
+	if (!busy)
+		pthread_cond_broadcast(&log_cond);
+	pthread_mutex_unlock(&log_lock);
+}
+
+static void* Writer_Thread(void* cookie __unused) {
+	std::vector<char> buffer(LOG_WRITE_SIZE);
+	for (;;) {
+		struct pollfd pfd;
+		pfd.fd = log_pipe_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		// Busy before the read, so Flush never sees an empty pipe with data still on the way
+		Set_Busy(true);
+		ssize_t n = read(log_pipe_fd, &buffer[0], buffer.size());
+		if (n > 0)
+			Write_All(log_fd, &buffer[0], n); // A full /tmp drops the log instead of blocking everyone that logs
+		Set_Busy(false);
+		if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN))
+			break;
+	}
+
+	// Should never happen, but don't let the pipe fill up and block every thread that logs
+	dup2(log_fd, STDOUT_FILENO);
+	dup2(log_fd, STDERR_FILENO);
+	ssize_t n;
+	while ((n = read(log_pipe_fd, &buffer[0], buffer.size())) > 0)
+		Write_All(log_fd, &buffer[0], n);
+	fprintf(stderr, "twrpLog: writer thread stopped, logging directly\n");
+	pthread_mutex_lock(&log_lock);
+	log_pid = 0;
+	pthread_cond_broadcast(&log_cond);
+	pthread_mutex_unlock(&log_lock);
+	return NULL;
+}
+
+bool twrpLog::Start() {
+	if (log_pid)
+		return true;
+	int fds[2];
+	log_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+	if (log_fd < 0) {
+		printf("twrpLog: unable to dup stdout: %s\n", strerror(errno));
+		return false;
+	}
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		printf("twrpLog: unable to create pipe: %s\n", strerror(errno));
+		close(log_fd);
+		log_fd = -1;
+		return false;
+	}
+#ifdef F_SETPIPE_SZ
+	fcntl(fds[1], F_SETPIPE_SZ, LOG_PIPE_SIZE);
+#endif
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	log_pipe_fd = fds[0];
+
+	// Children started from now on inherit the pipe through dup2, which clears O_CLOEXEC
+	fflush(stdout);
+	fflush(stderr);
+	dup2(fds[1], STDOUT_FILENO);
+	dup2(fds[1], STDERR_FILENO);
+	close(fds[1]);
+
+	log_pid = getpid();
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int ret = pthread_create(&thread, &attr, Writer_Thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		dup2(log_fd, STDOUT_FILENO);
+		dup2(log_fd, STDERR_FILENO);
+		close(log_pipe_fd);
+		log_pipe_fd = -1;
+		log_pid = 0;
+		printf("twrpLog: unable to start writer thread: %s\n", strerror(ret));
+		return false;
+	}
+	return true;
+}
+
+void twrpLog::Flush() {
+	if (!log_pid || log_pid != getpid())
+		return;
+	fflush(stdout);
+	fflush(stderr);
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += LOG_FLUSH_TIMEOUT_S;
+	pthread_mutex_lock(&log_lock);
+	while (log_pid) {
+		int pending = 0;
+		if (!log_busy && (ioctl(log_pipe_fd, FIONREAD, &pending) != 0 || pending <= 0))
+			break;
+		if (pthread_cond_timedwait(&log_cond, &log_lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+bool twrpLog::Copy_Fd(int Source_Fd, off64_t* Offset, int Dest_Fd) {
+#ifdef __NR_copy_file_range
+	for (;;) {
+		ssize_t n = syscall(__NR_copy_file_range, Source_Fd, Offset, Dest_Fd, NULL, LOG_WRITE_SIZE * 16, 0);
+		if (n > 0)
+			continue;
+		if (n == 0)
+			return true;
+		if (errno == EINTR)
+			continue;
+		// Older kernels lack it or only copy within one file system, which the log never is
+		if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+			return false;
+		break;
+	}
+#endif
+	for (;;) {
+		ssize_t n = sendfile64(Dest_Fd, Source_Fd, Offset, LOG_WRITE_SIZE * 16);
+		if (n > 0)
+			continue;
+		if (n == 0)
+			return true;
+		if (errno == EINTR)
+			continue;
+		if (errno != ENOSYS && errno != EINVAL)
+			return false;
+		break;
+	}
+
+	std::vector<char> buffer(LOG_WRITE_SIZE);
+	for (;;) {
+		ssize_t n = pread64(Source_Fd, &buffer[0], buffer.size(), *Offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n == 0;
+		if (!Write_All(Dest_Fd, &buffer[0], n))
+			return false;
+		*Offset += n;
+	}
+}
+
+// The fd of a copy, opened again when the file at Path is no longer the one it was opened on
+static int Open_Copy(const std::string& Path) {
+	struct stat st;
+	std::map<std::string, Log_Copy>::iterator it = log_copies.find(Path);
+	if (it != log_copies.end()) {
+		if (stat(Path.c_str(), &st) == 0 && st.st_dev == it->second.dev && st.st_ino == it->second.ino)
+			return it->second.fd;
+		close(it->second.fd);
+		log_copies.erase(it);
+	}
+
+	// copy_file_range refuses O_APPEND destinations, so appends seek to the end
+	int fd = open(Path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	Log_Copy copy;
+	copy.fd = fd;
+	copy.dev = st.st_dev;
+	copy.ino = st.st_ino;
+	copy.dirty = false;
+	log_copies[Path] = copy;
+	return fd;
+}
+
+static bool Copy_To(const std::string& Source, const std::string& Destination, off64_t* Offset, bool Truncate) {
+	int source_fd = open(Source.c_str(), O_RDONLY | O_CLOEXEC);
+	if (source_fd < 0)
+		return false;
+	pthread_mutex_lock(&copy_lock);
+	bool ok = false;
+	int dest_fd = Open_Copy(Destination);
+	if (dest_fd >= 0) {
+		if (Truncate)
+			ok = ftruncate(dest_fd, 0) == 0 && lseek(dest_fd, 0, SEEK_SET) == 0;
+		else
+			ok = lseek(dest_fd, 0, SEEK_END) >= 0;
+		if (ok)
+			ok = twrpLog::Copy_Fd(source_fd, Offset, dest_fd);
+		log_copies[Destination].dirty = true;
+	}
+	pthread_mutex_unlock(&copy_lock);
+	close(source_fd);
+	return ok;
+}
+
+bool twrpLog::Append_Delta(const std::string& Source, const std::string& Destination, int* Offset) {
+	Flush();
+	off64_t offset = *Offset;
+	bool ok = Copy_To(Source, Destination, &offset, false);
+	*Offset = (int)offset;
+	return ok;
+}
+
+bool twrpLog::Copy(const std::string& Source, const std::string& Destination) {
+	off64_t offset = 0;
+	return Copy_To(Source, Destination, &offset, true);
+}
+
+void twrpLog::Sync_Copies() {
+	std::set<std::string> folders;
+	pthread_mutex_lock(&copy_lock);
+	for (std::map<std::string, Log_Copy>::iterator it = log_copies.begin(); it != log_copies.end(); it++) {
+		if (!it->second.dirty)
+			continue;
+		if (fsync(it->second.fd) != 0)
+			printf("twrpLog: unable to sync '%s': %s\n", it->first.c_str(), strerror(errno));
+		it->second.dirty = false;
+		folders.insert(it->first.substr(0, it->first.find_last_of('/') + 1));
+	}
+	pthread_mutex_unlock(&copy_lock);
+
+	// Makes the new copies and anything else created or removed next to them stick
+	for (std::set<std::string>::iterator it = folders.begin(); it != folders.end(); it++) {
+		int fd = open(it->c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd >= 0) {
+			fsync(fd);
+			close(fd);
+		}
+	}
+}
+
+void twrpLog::Release_Copies(const std::string& Mount_Point) {
+	pthread_mutex_lock(&copy_lock);
+	std::map<std::string, Log_Copy>::iterator it = log_copies.begin();
+	while (it != log_copies.end()) {
+		const std::string& path = it->first;
+		if (path.compare(0, Mount_Point.size(), Mount_Point) == 0 && (path.size() == Mount_Point.size() || path[Mount_Point.size()] == '/' || Mount_Point == "/")) {
+			close(it->second.fd);
+			log_copies.erase(it++);
+		} else {
+			it++;
+		}
+	}
+	pthread_mutex_unlock(&copy_lock);
+}
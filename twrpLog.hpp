@@ -0,0 +1,48 @@
+/*
+	Copyright 2012 to 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_LOG
+#define __TWRP_LOG
+
+#include <sys/types.h>
+#include <string>
+
+// Moves the writes to the log file off the threads that log. stdout and
+// stderr, which point at the log, are redirected into a pipe that a writer
+// thread drains into the log file with large writes. The pipe keeps the
+// order of lines from every thread and from the forked and executed children
+// that inherit stdout, and a log line is written by one write() so lines of
+// different threads are not mixed. Anything that reads the log file from
+// within TWRP has to call Flush first.
+//
+// The copies of the log on /cache are kept open between copies and are only
+// fsynced by Sync_Copies, once for all of them. A copy is reopened when its
+// file was deleted or replaced, and Release_Copies closes the ones on a file
+// system before it is unmounted.
+class twrpLog {
+public:
+	static bool Start();                                                      // Call once stdout and stderr point at the log file
+	static void Flush();                                                      // Waits until everything logged so far is in the log file
+	static bool Append_Delta(const std::string& Source, const std::string& Destination, int* Offset);  // Appends Source from Offset on and moves Offset to its end
+	static bool Copy(const std::string& Source, const std::string& Destination);  // Replaces the contents of a kept open copy with Source
+	static bool Copy_Fd(int Source_Fd, off64_t* Offset, int Dest_Fd);         // Source from Offset to its end, at the position of Dest_Fd
+	static void Sync_Copies();                                                // fsyncs the copies written since the last call and their folders
+	static void Release_Copies(const std::string& Mount_Point);               // Closes the copies on Mount_Point
+};
+
+#endif // __TWRP_LOG
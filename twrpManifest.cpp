@@ -0,0 +1,357 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <string>
+#include <vector>
+#include "twrpManifest.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+#include "gui/gui.hpp"
+
+#define MANIFEST_HEADER "twrp_manifest 1"
+
+using namespace std;
+
+twrpManifest::twrpManifest() {
+	out = NULL;
+	write_error = false;
+}
+
+twrpManifest::~twrpManifest() {
+	if (out != NULL)
+		fclose(out);
+}
+
+string twrpManifest::Escape(const string& path) {
+	string ret;
+
+	// Paths are stored one per line, so newlines in names need escaping
+	ret.reserve(path.size());
+	for (size_t i = 0; i < path.size(); i++) {
+		if (path[i] == '\\')
+			ret += "\\\\";
+		else if (path[i] == '\n')
+			ret += "\\n";
+		else
+			ret += path[i];
+	}
+	return ret;
+}
+
+string twrpManifest::Unescape(const char *path) {
+	string ret;
+
+	for (; *path != 0 && *path != '\n'; path++) {
+		if (*path == '\\' && path[1] == 'n') {
+			ret += '\n';
+			path++;
+		} else if (*path == '\\' && path[1] == '\\') {
+			ret += '\\';
+			path++;
+		} else {
+			ret += *path;
+		}
+	}
+	return ret;
+}
+
+uint32_t twrpManifest::Xattr_Hash(const string& path) {
+	ssize_t list_len, value_len;
+	uint32_t hash = 2166136261U;
+	vector<char> names, value;
+
+	list_len = llistxattr(path.c_str(), NULL, 0);
+	if (list_len <= 0)
+		return 0;
+	names.resize(list_len);
+	list_len = llistxattr(path.c_str(), &names[0], names.size());
+	if (list_len <= 0)
+		return 0;
+
+	// FNV-1a over every name and value
+	for (ssize_t pos = 0; pos < list_len; pos += strlen(&names[pos]) + 1) {
+		const char *name = &names[pos];
+		for (const char *c = name; *c; c++) {
+			hash ^= (unsigned char)*c;
+			hash *= 16777619U;
+		}
+		value_len = lgetxattr(path.c_str(), name, NULL, 0);
+		if (value_len <= 0)
+			continue;
+		value.resize(value_len);
+		value_len = lgetxattr(path.c_str(), name, &value[0], value.size());
+		for (ssize_t i = 0; i < value_len; i++) {
+			hash ^= (unsigned char)value[i];
+			hash *= 16777619U;
+		}
+	}
+	return hash;
+}
+
+bool twrpManifest::Fill_Entry(const string& path, const struct stat *st, Entry *entry) {
+	if (S_ISDIR(st->st_mode))
+		entry->type = 'd';
+	else if (S_ISLNK(st->st_mode))
+		entry->type = 'l';
+	else if (S_ISREG(st->st_mode))
+		entry->type = 'f';
+	else
+		return false;
+	entry->size = entry->type == 'd' ? 0 : (uint64_t)st->st_size;
+	entry->mtime_sec = (int64_t)st->st_mtime;
+	entry->mtime_nsec = st->st_mtim.tv_nsec;
+	entry->inode = (uint64_t)st->st_ino;
+	entry->mode = st->st_mode;
+	entry->uid = st->st_uid;
+	entry->gid = st->st_gid;
+	entry->xattr_hash = entry->type == 'd' ? 0 : Xattr_Hash(path); // folders are archived anyway
+	entry->seen = false;
+	return true;
+}
+
+bool twrpManifest::Load(const string& filename) {
+	FILE *fp;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	bool header = true;
+
+	fp = fopen(filename.c_str(), "r");
+	if (fp == NULL) {
+		LOGINFO("Unable to open manifest '%s': %s\n", filename.c_str(), strerror(errno));
+		return false;
+	}
+	base.clear();
+	while ((len = getline(&line, &line_size, fp)) > 0) {
+		Entry entry;
+		int path_pos = 0;
+
+		if (header) {
+			header = false;
+			if (strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) != 0) {
+				LOGINFO("'%s' is not a backup manifest\n", filename.c_str());
+				break;
+			}
+			continue;
+		}
+		if (strncmp(line, "base ", 5) == 0)
+			continue;
+		if (sscanf(line, "%c %" SCNu64 " %" SCNd64 " %ld %" SCNu64 " %u %u %u %" SCNx32 " %n",
+				&entry.type, &entry.size, &entry.mtime_sec, &entry.mtime_nsec, &entry.inode,
+				&entry.mode, &entry.uid, &entry.gid, &entry.xattr_hash, &path_pos) < 9 || path_pos == 0) {
+			LOGINFO("Invalid line in manifest '%s'\n", filename.c_str());
+			base.clear();
+			break;
+		}
+		entry.seen = false;
+		base[Unescape(line + path_pos)] = entry;
+	}
+	free(line);
+	fclose(fp);
+	if (base.empty())
+		return false;
+	LOGINFO("Loaded %zu entries from manifest '%s'\n", base.size(), filename.c_str());
+	return true;
+}
+
+bool twrpManifest::Create(const string& filename, const string& base_name) {
+	out = fopen(filename.c_str(), "w");
+	if (out == NULL) {
+		gui_msg(Msg(msg::kError, "error_creating_strerr=Error creating: '{1}' ({2})")(filename)(strerror(errno)));
+		return false;
+	}
+	out_filename = filename;
+	write_error = false;
+	fprintf(out, "%s\n", MANIFEST_HEADER);
+	if (!base_name.empty())
+		fprintf(out, "base %s\n", Escape(base_name).c_str());
+	return true;
+}
+
+int twrpManifest::Add_Entry(const string& path, const struct stat *st) {
+	Entry entry;
+	std::map<string, Entry>::iterator base_entry;
+
+	if (!Fill_Entry(path, st, &entry))
+		return 1;
+	if (out != NULL && fprintf(out, "%c %" PRIu64 " %" PRId64 " %ld %" PRIu64 " %u %u %u %" PRIx32 " %s\n",
+			entry.type, entry.size, entry.mtime_sec, entry.mtime_nsec, entry.inode,
+			entry.mode, entry.uid, entry.gid, entry.xattr_hash, Escape(path).c_str()) < 0) {
+		write_error = true;
+		return -1;
+	}
+	if (base.empty())
+		return 1;
+	base_entry = base.find(path);
+	if (base_entry == base.end() || base_entry->second.type != entry.type)
+		return 1;
+	if (entry.type == 'd') {
+		// Folders are always archived, they only need to survive the deletion list
+		base_entry->second.seen = true;
+		return 1;
+	}
+	const Entry& old = base_entry->second;
+	if (old.size != entry.size || old.mtime_sec != entry.mtime_sec || old.mtime_nsec != entry.mtime_nsec ||
+			old.inode != entry.inode || old.mode != entry.mode || old.uid != entry.uid || old.gid != entry.gid ||
+			old.xattr_hash != entry.xattr_hash)
+		return 1; // changed files are removed before the new copy is extracted so hardlinks in the base are not overwritten
+	base_entry->second.seen = true;
+	return 0;
+}
+
+bool twrpManifest::Close(const string& deleted_filename) {
+	FILE *fp;
+	unsigned long long deleted = 0;
+
+	if (out == NULL)
+		return false;
+	if (fclose(out) != 0)
+		write_error = true;
+	out = NULL;
+	if (write_error) {
+		gui_msg(Msg(msg::kError, "error_writing_strerr=Error writing: '{1}' ({2})")(out_filename)(strerror(errno)));
+		return false;
+	}
+	if (base.empty())
+		return true;
+
+	// Everything in the base that is gone, changed or of another type now
+	fp = fopen(deleted_filename.c_str(), "w");
+	if (fp == NULL) {
+		gui_msg(Msg(msg::kError, "error_creating_strerr=Error creating: '{1}' ({2})")(deleted_filename)(strerror(errno)));
+		return false;
+	}
+	for (std::map<string, Entry>::iterator iter = base.begin(); iter != base.end(); iter++) {
+		if (iter->second.seen)
+			continue;
+		if (fprintf(fp, "%s\n", Escape(iter->first).c_str()) < 0)
+			write_error = true;
+		deleted++;
+	}
+	if (fclose(fp) != 0 || write_error) {
+		gui_msg(Msg(msg::kError, "error_writing_strerr=Error writing: '{1}' ({2})")(deleted_filename)(strerror(errno)));
+		return false;
+	}
+	LOGINFO("%llu entries of the base backup are removed or replaced\n", deleted);
+	return true;
+}
+
+string twrpManifest::Read_Base_Folder(const string& filename) {
+	FILE *fp;
+	char *line = NULL;
+	size_t line_size = 0;
+	string base_name;
+
+	fp = fopen(filename.c_str(), "r");
+	if (fp == NULL)
+		return "";
+	if (getline(&line, &line_size, fp) > 0 && strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) == 0) {
+		if (getline(&line, &line_size, fp) > 0 && strncmp(line, "base ", 5) == 0)
+			base_name = Unescape(line + 5);
+	}
+	free(line);
+	fclose(fp);
+	return base_name;
+}
+
+string twrpManifest::Find_Base(const string& current_folder, const string& backup_filename) {
+	DIR *d;
+	struct dirent *de;
+	struct stat st;
+	string backups_folder = TWFunc::Get_Path(current_folder), current_name = TWFunc::Get_Filename(current_folder);
+	string folder, best;
+	time_t best_time = 0;
+
+	// The newest other backup of this device with a manifest for the same archive
+	d = opendir(backups_folder.c_str());
+	if (d == NULL)
+		return "";
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_type != DT_DIR || strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 || current_name == de->d_name)
+			continue;
+		folder = backups_folder + de->d_name;
+		if (stat((folder + "/" + backup_filename + MANIFEST_EXTENSION).c_str(), &st) != 0)
+			continue;
+		if (best.empty() || st.st_mtime > best_time) {
+			best = folder;
+			best_time = st.st_mtime;
+		}
+	}
+	closedir(d);
+	return best;
+}
+
+bool twrpManifest::Get_Restore_Chain(const string& folder, const string& backup_filename, vector<string> *folders) {
+	string current = folder, base_name;
+
+	folders->clear();
+	for (;;) {
+		folders->insert(folders->begin(), current);
+		base_name = Read_Base_Folder(current + "/" + backup_filename + MANIFEST_EXTENSION);
+		if (base_name.empty())
+			return true;
+		if (folders->size() >= MANIFEST_MAX_CHAIN) {
+			LOGERR("Too many incremental backups on top of each other in '%s'\n", folder.c_str());
+			return false;
+		}
+		// Bases are stored by name so the backups can be moved together
+		current = TWFunc::Get_Path(current) + base_name;
+		if (!TWFunc::Path_Exists(current + "/" + backup_filename + MANIFEST_EXTENSION)) {
+			gui_msg(Msg(msg::kError, "incremental_base_missing=Unable to find '{1}', the base of this incremental backup.")(current));
+			return false;
+		}
+		LOGINFO("'%s' is based on '%s'\n", folders->front().c_str(), current.c_str());
+	}
+}
+
+bool twrpManifest::Apply_Deletions(const string& deleted_filename) {
+	FILE *fp;
+	char *line = NULL;
+	size_t line_size = 0;
+	struct stat st;
+	string path;
+	bool ret = true;
+
+	fp = fopen(deleted_filename.c_str(), "r");
+	if (fp == NULL)
+		return errno == ENOENT;
+	while (ret && getline(&line, &line_size, fp) > 0) {
+		path = Unescape(line);
+		if (lstat(path.c_str(), &st) != 0)
+			continue; // already gone with a removed folder
+		if (S_ISDIR(st.st_mode)) {
+			if (TWFunc::removeDir(path, false) != 0)
+				ret = false;
+		} else if (unlink(path.c_str()) != 0) {
+			ret = false;
+		}
+		if (!ret)
+			gui_msg(Msg(msg::kError, "error_removing_strerr=Error removing: '{1}' ({2})")(path)(strerror(errno)));
+	}
+	free(line);
+	fclose(fp);
+	return ret;
+}
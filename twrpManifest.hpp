@@ -0,0 +1,82 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPMANIFEST_HPP
+#define __TWRPMANIFEST_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <string>
+#include <map>
+#include <vector>
+
+#define MANIFEST_EXTENSION ".manifest"                                          // Appended to the archive name, e.g. data.ext4.win.manifest
+#define MANIFEST_DELETED_EXTENSION ".deleted"                                   // Paths an increment removes before it is extracted
+#define MANIFEST_MAX_CHAIN 64                                                   // Most increments stacked on one full backup
+
+// Manifest of the files in one tar backup of a partition, used for incremental
+// backups. Every file, link and folder is recorded with its size, mtime, inode,
+// owner, mode and a hash of its xattrs. A backup that is made against the
+// manifest of an earlier one only archives folders and the files that are new
+// or differ from it. Everything in the base that is gone or was replaced goes
+// into a deletion list which is applied before the increment is extracted, so
+// a restore extracts the full backup and then each increment after it.
+class twrpManifest
+{
+public:
+	twrpManifest();
+	~twrpManifest();
+
+	bool Load(const std::string& filename);                                    // Reads the manifest of the base backup
+	bool Create(const std::string& filename, const std::string& base_folder);  // Starts the manifest of the backup being made
+	int Add_Entry(const std::string& path, const struct stat *st);             // Returns 1 if path must be archived, 0 if it is unchanged since the base, -1 on error
+	bool Close(const std::string& deleted_filename);                           // Finishes the manifest and writes the deletion list if there is a base
+	bool Has_Base() { return !base.empty(); }
+
+	static std::string Find_Base(const std::string& current_folder, const std::string& backup_filename); // Newest other backup next to current_folder with a manifest
+	static bool Get_Restore_Chain(const std::string& folder, const std::string& backup_filename, std::vector<std::string> *folders); // Backup folders to restore in order, the full backup first
+	static bool Apply_Deletions(const std::string& deleted_filename);         // Removes what an increment deleted or replaced since its base
+	static std::string Escape(const std::string& path);                        // Escapes newlines so paths can be stored one per line
+	static std::string Unescape(const char *path);
+
+private:
+	struct Entry {
+		char type;                                                             // 'f' file, 'l' symlink, 'd' folder
+		uint64_t size;
+		int64_t mtime_sec;
+		long mtime_nsec;
+		uint64_t inode;
+		unsigned mode;
+		unsigned uid;
+		unsigned gid;
+		uint32_t xattr_hash;
+		bool seen;                                                             // present and unchanged in the new backup
+	};
+
+	static bool Fill_Entry(const std::string& path, const struct stat *st, Entry *entry);
+	static uint32_t Xattr_Hash(const std::string& path);
+	static std::string Read_Base_Folder(const std::string& filename);
+
+	std::map<std::string, Entry> base;
+	FILE *out;
+	std::string out_filename;
+	bool write_error;
+};
+
+#endif // __TWRPMANIFEST_HPP
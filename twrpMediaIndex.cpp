@@ -0,0 +1,289 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <set>
+#include "twrpMediaIndex.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+
+#define MEDIA_INDEX_MAX_THREADS 8
+#define MEDIA_INDEX_EVENTS (IN_CREATE | IN_DELETE | IN_MOVE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+using namespace std;
+
+twrpMediaIndex::twrpMediaIndex(TWExclude *exclusions) {
+	exclude = exclusions;
+	inotify_fd = -1;
+	unwatchable = false;
+	pthread_mutex_init(&lock, NULL);
+}
+
+twrpMediaIndex::~twrpMediaIndex() {
+	Stop();
+	pthread_mutex_destroy(&lock);
+}
+
+void twrpMediaIndex::Stop() {
+	if (inotify_fd >= 0)
+		close(inotify_fd);
+	inotify_fd = -1;
+	folders.clear();
+	watches.clear();
+}
+
+bool twrpMediaIndex::Get_Size(const string& Path, uint64_t *size, map<string, uint64_t> *subfolder_sizes) {
+	string Root = TWFunc::Remove_Trailing_Slashes(Path);
+	bool ret = true;
+
+	pthread_mutex_lock(&lock);
+	if (Root != root) {
+		Stop();
+		root = Root;
+		unwatchable = false;
+	}
+	if (unwatchable) {
+		ret = false;
+	} else if (inotify_fd < 0 || !Read_Events()) {
+		ret = Start(Root);
+	}
+	if (ret) {
+		// Files directly in root only count towards root, every other folder
+		// towards the subfolder of root it is in as well
+		*size = 0;
+		subfolder_sizes->clear();
+		for (map<string, Folder>::iterator it = folders.begin(); it != folders.end(); it++) {
+			*size += it->second.size;
+			if (it->first.size() <= root.size())
+				continue;
+			size_t end = it->first.find('/', root.size() + 1);
+			(*subfolder_sizes)[it->first.substr(0, end)] += it->second.size;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+bool twrpMediaIndex::Start(const string& Path) {
+	Stop();
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		LOGINFO("twrpMediaIndex inotify_init1 failed: %s\n", strerror(errno));
+		unwatchable = true;
+		return false;
+	}
+	if (!Scan_Tree(Path, true)) {
+		LOGINFO("twrpMediaIndex unable to watch every folder in '%s', sizes will be walked\n", Path.c_str());
+		Stop();
+		unwatchable = true;
+		return false;
+	}
+	LOGINFO("twrpMediaIndex watching %zu folders in '%s'\n", folders.size(), Path.c_str());
+	return true;
+}
+
+bool twrpMediaIndex::Read_Folder(const string& Path, Folder *folder, vector<string> *subdirs) {
+	DIR *d;
+	struct dirent *de;
+	struct stat st;
+
+	// The watch goes on before the folder is read so no change is missed,
+	// watching a folder that already is returns the same descriptor
+	folder->size = 0;
+	folder->wd = inotify_add_watch(inotify_fd, Path.c_str(), MEDIA_INDEX_EVENTS);
+	if (folder->wd < 0)
+		return errno != ENOSPC && errno != ENOMEM;
+
+	d = opendir(Path.c_str());
+	if (d == NULL)
+		return true;
+	while ((de = readdir(d)) != NULL) {
+		if (exclude->check_skip_name(Path, de->d_name))
+			continue;
+		unsigned char type = de->d_type;
+		if (type == DT_REG || type == DT_LNK || type == DT_UNKNOWN) {
+			if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+				continue;
+			if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+				folder->size += (uint64_t)(st.st_size);
+				continue;
+			}
+			if (!S_ISDIR(st.st_mode))
+				continue;
+			type = DT_DIR;
+		}
+		if (type == DT_DIR && subdirs)
+			subdirs->push_back(Path + "/" + de->d_name);
+	}
+	closedir(d);
+	return true;
+}
+
+void* twrpMediaIndex::Scan_Thread(void *cookie) {
+	Walk *walk = (Walk*) cookie;
+	twrpMediaIndex *index = walk->index;
+	vector<string> subdirs;
+	string path;
+	Folder folder;
+
+	pthread_mutex_lock(&walk->lock);
+	for (;;) {
+		while (walk->dirs.empty() && walk->active > 0 && !walk->failed)
+			pthread_cond_wait(&walk->cond, &walk->lock);
+		if (walk->dirs.empty() || walk->failed)
+			break;
+		path = walk->dirs.back();
+		walk->dirs.pop_back();
+		walk->active++;
+		pthread_mutex_unlock(&walk->lock);
+
+		subdirs.clear();
+		bool watched = index->Read_Folder(path, &folder, &subdirs);
+
+		pthread_mutex_lock(&walk->lock);
+		if (!watched) {
+			walk->failed = true;
+		} else if (folder.wd >= 0) {
+			index->folders[path] = folder;
+			index->watches[folder.wd] = path;
+			walk->dirs.insert(walk->dirs.end(), subdirs.begin(), subdirs.end());
+		}
+		walk->active--;
+		pthread_cond_broadcast(&walk->cond);
+	}
+	pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+	return NULL;
+}
+
+bool twrpMediaIndex::Scan_Tree(const string& Path, bool threaded) {
+	Walk walk;
+	pthread_t threads[MEDIA_INDEX_MAX_THREADS];
+	unsigned thread_count = 1, started = 0, i;
+
+	walk.index = this;
+	walk.active = 0;
+	walk.failed = false;
+	walk.dirs.push_back(Path);
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+
+	// Folders found through events are usually small, only the first walk
+	// of the whole tree is worth the threads
+	if (threaded)
+		thread_count = sysconf(_SC_NPROCESSORS_CONF);
+	if (thread_count > MEDIA_INDEX_MAX_THREADS)
+		thread_count = MEDIA_INDEX_MAX_THREADS;
+	for (i = 1; i < thread_count; i++) {
+		if (pthread_create(&threads[started], NULL, Scan_Thread, (void*)&walk) != 0)
+			break;
+		started++;
+	}
+	Scan_Thread((void*)&walk);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+	return !walk.failed;
+}
+
+void twrpMediaIndex::Remove_Folder(map<string, Folder>::iterator folder) {
+	inotify_rm_watch(inotify_fd, folder->second.wd);
+	watches.erase(folder->second.wd);
+	folders.erase(folder);
+}
+
+void twrpMediaIndex::Remove_Tree(const string& Path) {
+	map<string, Folder>::iterator it = folders.find(Path);
+	string prefix = Path + "/";
+
+	if (it != folders.end())
+		Remove_Folder(it);
+	// Path-x sorts between Path and Path/, so the subfolders are looked up by prefix
+	it = folders.lower_bound(prefix);
+	while (it != folders.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+		Remove_Folder(it++);
+}
+
+bool twrpMediaIndex::Read_Events() {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	set<string> changed;
+	ssize_t len;
+
+	for (;;) {
+		len = read(inotify_fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			break;
+		if (len <= 0)
+			return false;
+		for (char *ptr = buf; ptr < buf + len;) {
+			struct inotify_event *event = (struct inotify_event*) ptr;
+			ptr += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & (IN_Q_OVERFLOW | IN_UNMOUNT))
+				return false;
+			map<int, string>::iterator watch = watches.find(event->wd);
+			if (watch == watches.end())
+				continue;
+			if (event->mask & IN_IGNORED) {
+				// The folder is gone, its parent's event removes it from the tree
+				if (watch->second == root)
+					return false;
+				continue;
+			}
+			if (event->len == 0 || exclude->check_skip_name(watch->second, event->name))
+				continue;
+			string dir = watch->second;
+			if (!(event->mask & IN_ISDIR)) {
+				changed.insert(dir);
+				continue;
+			}
+			string path = dir + "/" + event->name;
+			if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				Remove_Tree(path);
+			} else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+				Remove_Tree(path);
+				if (!Scan_Tree(path, false))
+					return false;
+			}
+		}
+	}
+
+	// Each folder with changed files is read once however many events it had
+	for (set<string>::iterator it = changed.begin(); it != changed.end(); it++) {
+		map<string, Folder>::iterator folder = folders.find(*it);
+		if (folder == folders.end())
+			continue;
+		Folder updated;
+		if (!Read_Folder(*it, &updated, NULL))
+			return false;
+		if (updated.wd < 0)
+			Remove_Tree(*it);
+		else
+			folder->second.size = updated.size;
+	}
+	return true;
+}
@@ -0,0 +1,76 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPMEDIAINDEX_HPP
+#define __TWRPMEDIAINDEX_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "exclude.hpp"
+
+// Size of a folder tree kept current with inotify, for data media that is
+// otherwise walked every time partition sizes are refreshed. The first query
+// walks the tree with several threads and puts a watch on every folder, later
+// queries only read the queued events and re-read the folders that changed.
+// The sizes match TWExclude::Get_Folder_Size, files the exclusions skip are
+// left out. When the file system is unmounted or the event queue overflows
+// the next query walks the tree again.
+class twrpMediaIndex
+{
+public:
+	twrpMediaIndex(TWExclude *exclusions);
+	~twrpMediaIndex();
+	bool Get_Size(const std::string& Path, uint64_t *size, std::map<std::string, uint64_t> *subfolder_sizes); // False if Path cannot be watched, the caller walks it instead
+	void Stop();                                                               // Drops the watches, the next query walks again
+
+private:
+	struct Folder {
+		uint64_t size;                                                         // files directly in the folder
+		int wd;
+	};
+
+	struct Walk {
+		twrpMediaIndex *index;
+		std::vector<std::string> dirs;                                         // folders waiting to be read
+		unsigned active;                                                       // threads currently reading a folder
+		bool failed;                                                           // a watch could not be added
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+	};
+
+	bool Start(const std::string& Path);
+	bool Read_Events();                                                        // Applies the queued events, false if the tree has to be walked again
+	bool Scan_Tree(const std::string& Path, bool threaded);
+	static void* Scan_Thread(void *cookie);
+	bool Read_Folder(const std::string& Path, Folder *folder, std::vector<std::string> *subdirs); // Watches and sizes one folder, false if the watch cannot be added
+	void Remove_Tree(const std::string& Path);
+	void Remove_Folder(std::map<std::string, Folder>::iterator folder);
+
+	TWExclude *exclude;
+	std::string root;
+	int inotify_fd;
+	bool unwatchable;                                                          // root has more folders than inotify allows
+	std::map<std::string, Folder> folders;
+	std::map<int, std::string> watches;                                        // watch descriptor to folder
+	pthread_mutex_t lock;                                                      // held by a query, the walk threads take Walk::lock
+};
+
+#endif // __TWRPMEDIAINDEX_HPP
@@ -0,0 +1,238 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <map>
+#include <string>
+
+#include "twrpMemory.hpp"
+#include "twrpTrace.hpp"
+#include "twcommon.h"
+#ifndef BUILD_TWRPTAR_MAIN
+#include "data.hpp"
+#endif
+
+#define MEMORY_SAMPLE_INTERVAL_MS 1000
+#define MEMORY_TRACE_INTERVAL_MS 100
+#define MEMORY_LOW_KB (32 * 1024)                  // MemAvailable that gets the counters logged
+
+static const char* subsystem_names[MEMORY_SUBSYSTEMS] = { "gui", "tar_lists", "mtp", "data" };
+
+static twrpMemory_Counter* counters = NULL;
+static std::map<std::string, long> child_peaks;    // kB, by the name Wait_For_Child got
+static std::map<std::string, uint64_t> variables;  // last values given to DataManager
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void twrpMemory::Init() {
+	if (counters)
+		return;
+	void* block = mmap(NULL, sizeof(twrpMemory_Counter) * MEMORY_SUBSYSTEMS, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (block == MAP_FAILED) {
+		LOGINFO("Unable to map the memory counters: %s\n", strerror(errno));
+		return;
+	}
+	counters = (twrpMemory_Counter*) block;
+}
+
+void twrpMemory::Add(twrpMemory_Subsystem subsystem, int64_t bytes) {
+	twrpMemory_Add(Get_Counter(subsystem), bytes);
+}
+
+void twrpMemory::Set(twrpMemory_Subsystem subsystem, int64_t bytes) {
+	twrpMemory_Counter* counter = Get_Counter(subsystem);
+	if (counter)
+		twrpMemory_Add(counter, bytes - __atomic_load_n(&counter->current, __ATOMIC_RELAXED));
+}
+
+int64_t twrpMemory::Get(twrpMemory_Subsystem subsystem) {
+	twrpMemory_Counter* counter = Get_Counter(subsystem);
+	return counter ? __atomic_load_n(&counter->current, __ATOMIC_RELAXED) : 0;
+}
+
+twrpMemory_Counter* twrpMemory::Get_Counter(twrpMemory_Subsystem subsystem) {
+	if (!counters || subsystem >= MEMORY_SUBSYSTEMS)
+		return NULL;
+	return &counters[subsystem];
+}
+
+void twrpMemory::Child_Exited(const std::string& Child_Name, long peak_rss_kb) {
+	pthread_mutex_lock(&memory_lock);
+	long& peak = child_peaks[Child_Name];
+	if (peak_rss_kb > peak)
+		peak = peak_rss_kb;
+	pthread_mutex_unlock(&memory_lock);
+}
+
+// Adds the "Name:   1234 kB" lines of a /proc file to the matching fields
+static bool Read_Proc_Kb(const char* path, const char** names, uint64_t** values, size_t count) {
+	char line[128];
+	FILE* fp = fopen(path, "re");
+	if (!fp)
+		return false;
+	while (fgets(line, sizeof(line), fp)) {
+		for (size_t i = 0; i < count; i++) {
+			size_t len = strlen(names[i]);
+			if (strncmp(line, names[i], len) == 0 && line[len] == ':') {
+				*values[i] = strtoull(line + len + 1, NULL, 10);
+				break;
+			}
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+bool twrpMemory::Sample(twrpMemory_Sample* sample) {
+	memset(sample, 0, sizeof(*sample));
+	const char* rollup_names[] = { "Rss", "Pss", "Anonymous", "Swap" };
+	uint64_t* rollup_values[] = { &sample->rss_kb, &sample->pss_kb, &sample->anon_kb, &sample->swap_kb };
+	bool rollup = Read_Proc_Kb("/proc/self/smaps_rollup", rollup_names, rollup_values, 4);
+
+	// Kernels before 4.14 have no smaps_rollup, and reading all of smaps is too slow to sample
+	const char* status_names[] = { "VmHWM", "VmRSS", "RssAnon", "VmSwap" };
+	uint64_t* status_values[] = { &sample->peak_rss_kb, &sample->rss_kb, &sample->anon_kb, &sample->swap_kb };
+	if (!Read_Proc_Kb("/proc/self/status", status_names, status_values, rollup ? 1 : 4))
+		return false;
+
+	const char* meminfo_names[] = { "MemAvailable" };
+	uint64_t* meminfo_values[] = { &sample->available_kb };
+	Read_Proc_Kb("/proc/meminfo", meminfo_names, meminfo_values, 1);
+	return true;
+}
+
+// DataManager is measured when it is looked at instead of on every change
+static void Measure_Data() {
+#ifndef BUILD_TWRPTAR_MAIN
+	twrpMemory::Set(MEMORY_DATA, DataManager::GetMemoryUsage());
+#endif
+}
+
+void twrpMemory::Update_Variables() {
+#ifndef BUILD_TWRPTAR_MAIN
+	twrpMemory_Sample sample;
+	std::map<std::string, uint64_t> values;
+	long child_peak = 0;
+
+	if (!Sample(&sample))
+		return;
+	Measure_Data();
+	values["tw_mem_rss_kb"] = sample.rss_kb;
+	values["tw_mem_pss_kb"] = sample.pss_kb;
+	values["tw_mem_peak_kb"] = sample.peak_rss_kb;
+	values["tw_mem_available_kb"] = sample.available_kb;
+	for (int i = 0; i < MEMORY_SUBSYSTEMS; i++) {
+		twrpMemory_Counter* counter = Get_Counter((twrpMemory_Subsystem) i);
+		if (!counter)
+			break;
+		values[std::string("tw_mem_") + subsystem_names[i] + "_kb"] = __atomic_load_n(&counter->current, __ATOMIC_RELAXED) / 1024;
+		values[std::string("tw_mem_") + subsystem_names[i] + "_peak_kb"] = __atomic_load_n(&counter->peak, __ATOMIC_RELAXED) / 1024;
+	}
+
+	// Only the changed values are set, every set redraws what shows the variable
+	pthread_mutex_lock(&memory_lock);
+	for (std::map<std::string, long>::iterator it = child_peaks.begin(); it != child_peaks.end(); it++) {
+		if (it->second > child_peak)
+			child_peak = it->second;
+	}
+	values["tw_mem_child_peak_kb"] = child_peak;
+	std::map<std::string, uint64_t> changed;
+	for (std::map<std::string, uint64_t>::iterator it = values.begin(); it != values.end(); it++) {
+		std::map<std::string, uint64_t>::iterator last = variables.find(it->first);
+		if (last == variables.end() || last->second != it->second) {
+			variables[it->first] = it->second;
+			changed.insert(*it);
+		}
+	}
+	pthread_mutex_unlock(&memory_lock);
+	for (std::map<std::string, uint64_t>::iterator it = changed.begin(); it != changed.end(); it++)
+		DataManager::SetValue(it->first, (unsigned long long) it->second);
+#endif
+}
+
+void twrpMemory::Dump(const std::string& Reason) {
+	twrpMemory_Sample sample;
+
+	Measure_Data();
+	if (Sample(&sample)) {
+		LOGINFO("Memory at %s: rss %llu kB, pss %llu kB, anon %llu kB, swap %llu kB, peak rss %llu kB, available %llu kB\n", Reason.c_str(),
+			(unsigned long long) sample.rss_kb, (unsigned long long) sample.pss_kb, (unsigned long long) sample.anon_kb,
+			(unsigned long long) sample.swap_kb, (unsigned long long) sample.peak_rss_kb, (unsigned long long) sample.available_kb);
+	}
+	for (int i = 0; i < MEMORY_SUBSYSTEMS; i++) {
+		twrpMemory_Counter* counter = Get_Counter((twrpMemory_Subsystem) i);
+		if (!counter)
+			break;
+		LOGINFO("  %-10s %lld kB, peak %lld kB\n", subsystem_names[i],
+			(long long) __atomic_load_n(&counter->current, __ATOMIC_RELAXED) / 1024,
+			(long long) __atomic_load_n(&counter->peak, __ATOMIC_RELAXED) / 1024);
+	}
+	pthread_mutex_lock(&memory_lock);
+	for (std::map<std::string, long>::iterator it = child_peaks.begin(); it != child_peaks.end(); it++)
+		LOGINFO("  child %s peak rss %ld kB\n", it->first.c_str(), it->second);
+	pthread_mutex_unlock(&memory_lock);
+}
+
+void* twrpMemory::Sampler_Thread(void* cookie __unused) {
+	bool low = false;
+
+	for (;;) {
+		bool tracing = twrpTrace::Is_Enabled();
+		twrpMemory_Sample sample;
+
+		if (tracing && Sample(&sample)) {
+			twrpTrace::Counter("memory", "rss_kb", sample.rss_kb);
+			twrpTrace::Counter("memory", "pss_kb", sample.pss_kb);
+			twrpTrace::Counter("memory", "anon_kb", sample.anon_kb);
+			for (int i = 0; i < MEMORY_SUBSYSTEMS; i++) {
+				twrpMemory_Counter* counter = Get_Counter((twrpMemory_Subsystem) i);
+				if (counter)
+					twrpTrace::Counter("memory", subsystem_names[i], __atomic_load_n(&counter->current, __ATOMIC_RELAXED));
+			}
+		}
+		Update_Variables();
+
+		// Logged once when memory runs low, again after it recovered
+		if (Sample(&sample) && sample.available_kb) {
+			if (!low && sample.available_kb < MEMORY_LOW_KB) {
+				low = true;
+				Dump("low memory");
+			} else if (low && sample.available_kb > 2 * MEMORY_LOW_KB) {
+				low = false;
+			}
+		}
+		usleep((tracing ? MEMORY_TRACE_INTERVAL_MS : MEMORY_SAMPLE_INTERVAL_MS) * 1000);
+	}
+	return NULL;
+}
+
+void twrpMemory::Start_Sampler() {
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, Sampler_Thread, NULL) != 0) {
+		LOGINFO("Unable to start the memory sampler: %s\n", strerror(errno));
+		return;
+	}
+	pthread_detach(thread);
+}
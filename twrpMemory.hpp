@@ -0,0 +1,80 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_MEMORY
+#define __TWRP_MEMORY
+
+#include <stdint.h>
+#include <string>
+
+// The big memory users of the recovery, each counting the bytes it holds
+enum twrpMemory_Subsystem {
+	MEMORY_GUI,                                        // decoded theme images
+	MEMORY_TAR_LISTS,                                  // backup file lists, built in the tar fork
+	MEMORY_MTP,                                        // object tree of the MTP server
+	MEMORY_DATA,                                       // DataManager variables
+	MEMORY_SUBSYSTEMS
+};
+
+// Bytes held by one subsystem and the most it ever held. The counters are
+// mapped MAP_SHARED before the first fork, so the tar and MTP forks add to
+// the same ones the recovery reads. Code outside the recovery binary, such
+// as libtwrpmtp, gets a pointer to its counter and only needs this header.
+struct twrpMemory_Counter {
+	int64_t current;
+	int64_t peak;
+};
+
+static inline void twrpMemory_Add(twrpMemory_Counter* counter, int64_t bytes) {
+	if (counter == NULL || bytes == 0)
+		return;
+	int64_t now = __atomic_add_fetch(&counter->current, bytes, __ATOMIC_RELAXED);
+	int64_t peak = __atomic_load_n(&counter->peak, __ATOMIC_RELAXED);
+	while (now > peak && !__atomic_compare_exchange_n(&counter->peak, &peak, now, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+// Memory of the whole process, from /proc/self/smaps_rollup where the kernel
+// has it and /proc/self/status otherwise (no PSS then)
+struct twrpMemory_Sample {
+	uint64_t rss_kb;
+	uint64_t pss_kb;
+	uint64_t anon_kb;
+	uint64_t swap_kb;
+	uint64_t peak_rss_kb;                              // VmHWM, the kernel's high water mark
+	uint64_t available_kb;                             // MemAvailable of the system
+};
+
+class twrpMemory {
+public:
+	static void Init();                                                      // Maps the counters, before anything forks
+	static void Start_Sampler();                                             // Samples into DataManager and, while tracing, the trace
+	static void Add(twrpMemory_Subsystem subsystem, int64_t bytes);          // Negative when the memory is freed
+	static void Set(twrpMemory_Subsystem subsystem, int64_t bytes);          // For subsystems that are measured instead of counted
+	static int64_t Get(twrpMemory_Subsystem subsystem);                      // Bytes held now, 0 before Init
+	static twrpMemory_Counter* Get_Counter(twrpMemory_Subsystem subsystem);  // NULL before Init
+	static void Child_Exited(const std::string& Child_Name, long peak_rss_kb); // Keeps the largest peak of each child process
+	static bool Sample(twrpMemory_Sample* sample);
+	static void Update_Variables();                                          // Copies the sample and the counters to the tw_mem_ variables
+	static void Dump(const std::string& Reason);                             // Logs everything, on failures and low memory
+
+private:
+	static void* Sampler_Thread(void* cookie);
+};
+
+#endif // __TWRP_MEMORY
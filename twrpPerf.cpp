@@ -0,0 +1,349 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <string>
+#include <vector>
+
+#include "twrpPerf.hpp"
+#include "twrpTrace.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+#include "data.hpp"
+#include "gui/gui.hpp"
+
+struct Perf_Sample {
+	double wall;                                       // seconds of CLOCK_MONOTONIC
+	double cpu;                                        // user and system seconds of the recovery and its waited for children
+	uint64_t busy;                                     // jiffies of the whole system from /proc/stat
+	uint64_t iowait;
+	uint64_t total;
+};
+
+struct Perf_Span {
+	const char* name;
+	double seconds;
+	double cpu;
+	uint64_t busy;
+	uint64_t iowait;
+	uint64_t total;
+	uint64_t bytes;
+	uint64_t files;
+};
+
+struct Perf_Report {
+	std::string operation;
+	Perf_Sample start;
+	Perf_Sample phase_start;
+	std::vector<Perf_Span> phases;                     // in the order they first ran, a phase run again adds to its span
+	int running;                                       // index of the running phase, -1 between phases
+	uint64_t bytes;
+	uint64_t files;
+	bool held_reports;                                 // reports nested in this one were shown instead
+};
+
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<Perf_Report> perf_reports;      // innermost last
+static std::string last_json;
+
+static double Seconds(const timeval& tv) {
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void Take_Sample(Perf_Sample* sample) {
+	timespec now;
+	struct rusage usage;
+	unsigned long long user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0, softirq = 0, steal = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sample->wall = now.tv_sec + now.tv_nsec / 1000000000.0;
+	sample->cpu = 0;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		sample->cpu += Seconds(usage.ru_utime) + Seconds(usage.ru_stime);
+	if (getrusage(RUSAGE_CHILDREN, &usage) == 0)
+		sample->cpu += Seconds(usage.ru_utime) + Seconds(usage.ru_stime);
+
+	sample->busy = sample->iowait = sample->total = 0;
+	FILE* fp = fopen("/proc/stat", "r");
+	if (fp == NULL)
+		return;
+	if (fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal) >= 5) {
+		sample->busy = user + nice + system + irq + softirq + steal;
+		sample->iowait = iowait;
+		sample->total = sample->busy + idle + iowait;
+	}
+	fclose(fp);
+}
+
+static void Add_Span(Perf_Span* span, const Perf_Sample& from, const Perf_Sample& to) {
+	span->seconds += to.wall - from.wall;
+	span->cpu += to.cpu - from.cpu;
+	span->busy += to.busy - from.busy;
+	span->iowait += to.iowait - from.iowait;
+	span->total += to.total - from.total;
+}
+
+// Called with perf_lock held
+static void End_Running_Phase(Perf_Report* report, const Perf_Sample& now, bool trace) {
+	if (report->running < 0)
+		return;
+	Perf_Span* span = &report->phases[report->running];
+	Add_Span(span, report->phase_start, now);
+	if (trace)
+		twrpTrace::End("perf", span->name);
+	report->running = -1;
+}
+
+// What held a span up: waiting for storage when the CPUs sat in I/O wait
+// more than they worked, waiting for something else (the user, adb, a
+// network share) when neither the recovery nor the system did much, and
+// the CPU otherwise
+static const char* Bound(const Perf_Span& span) {
+	if (span.total > 0 && span.iowait > span.busy)
+		return "io";
+	if (span.seconds > 0 && span.cpu < span.seconds / 10 && span.busy * 10 < span.total)
+		return "wait";
+	return "cpu";
+}
+
+static double Percent(double part, double whole) {
+	return whole > 0 ? part * 100 / whole : 0;
+}
+
+static void Json_String(std::string* json, const std::string& value) {
+	*json += '"';
+	for (size_t i = 0; i < value.size(); i++) {
+		if (value[i] == '"' || value[i] == '\\')
+			*json += '\\';
+		if ((unsigned char) value[i] >= 0x20)
+			*json += value[i];
+	}
+	*json += '"';
+}
+
+static void Json_Span(std::string* json, const Perf_Span& span) {
+	char buf[512];
+
+	snprintf(buf, sizeof(buf), "\"seconds\":%.3f,\"bytes\":%llu,\"files\":%llu,\"bytes_per_second\":%llu,\"cpu_percent\":%.1f,\"system_busy_percent\":%.1f,\"iowait_percent\":%.1f,\"bound\":\"%s\"",
+		span.seconds, (unsigned long long) span.bytes, (unsigned long long) span.files,
+		(unsigned long long) (span.seconds > 0 ? span.bytes / span.seconds : 0),
+		Percent(span.cpu, span.seconds), Percent(span.busy, span.total), Percent(span.iowait, span.total), Bound(span));
+	*json += buf;
+}
+
+// The whole operation as one span
+static Perf_Span Total_Span(const Perf_Report& report, const Perf_Sample& now) {
+	Perf_Span total;
+
+	memset(&total, 0, sizeof(total));
+	Add_Span(&total, report.start, now);
+	total.bytes = report.bytes;
+	total.files = report.files;
+	return total;
+}
+
+// The longest phase, or the whole operation when it had no phases
+static Perf_Span Bottleneck(const Perf_Report& report, const Perf_Sample& now) {
+	if (report.phases.empty()) {
+		Perf_Span total = Total_Span(report, now);
+		total.name = NULL;
+		return total;
+	}
+	size_t longest = 0;
+	for (size_t i = 1; i < report.phases.size(); i++) {
+		if (report.phases[i].seconds > report.phases[longest].seconds)
+			longest = i;
+	}
+	return report.phases[longest];
+}
+
+// {"operation":"Backup","status":0,"seconds":42.108,"bytes":...,"bound":"io",
+//  "bottleneck":"backup","phases":[{"name":"plan","seconds":0.512,...},...]}
+// Running reports have no status yet.
+static std::string Report_Json(const Perf_Report& report, const Perf_Sample& now, bool finished, int status) {
+	char buf[64];
+	std::string json = "{\"operation\":";
+
+	Json_String(&json, report.operation);
+	if (finished) {
+		snprintf(buf, sizeof(buf), ",\"status\":%i", status);
+		json += buf;
+	}
+	json += ",";
+	Json_Span(&json, Total_Span(report, now));
+	Perf_Span bottleneck = Bottleneck(report, now);
+	json += ",\"bottleneck\":";
+	Json_String(&json, bottleneck.name ? bottleneck.name : report.operation);
+	json += ",\"bottleneck_bound\":\"";
+	json += Bound(bottleneck);
+	json += "\",\"phases\":[";
+	for (size_t i = 0; i < report.phases.size(); i++) {
+		if (i > 0)
+			json += ",";
+		json += "{\"name\":";
+		Json_String(&json, report.phases[i].name);
+		json += ",";
+		Json_Span(&json, report.phases[i]);
+		json += "}";
+	}
+	json += "]}";
+	return json;
+}
+
+static void Show_Report(const Perf_Report& report, const Perf_Sample& now) {
+	Perf_Span total = Total_Span(report, now);
+	Perf_Span bottleneck = Bottleneck(report, now);
+	char seconds[32], mb[32], rate[32], cpu[32], iowait[32];
+
+	snprintf(seconds, sizeof(seconds), "%.1f", total.seconds);
+	snprintf(mb, sizeof(mb), "%llu", (unsigned long long) (total.bytes / 1048576));
+	snprintf(rate, sizeof(rate), "%.1f", total.seconds > 0 ? total.bytes / total.seconds / 1048576 : 0);
+	snprintf(cpu, sizeof(cpu), "%.0f", Percent(total.cpu, total.seconds));
+	snprintf(iowait, sizeof(iowait), "%.0f", Percent(total.iowait, total.total));
+
+	std::string summary;
+	if (total.bytes > 0)
+		summary = Msg("perf_summary={1}: {2}s, {3} MB at {4} MB/s, CPU {5}%, I/O wait {6}%")(report.operation)(seconds)(mb)(rate)(cpu)(iowait);
+	else
+		summary = Msg("perf_summary_time={1}: {2}s, CPU {3}%, I/O wait {4}%")(report.operation)(seconds)(cpu)(iowait);
+	if (report.phases.size() > 1) {
+		const char* bound = Bound(bottleneck);
+		snprintf(seconds, sizeof(seconds), "%.1f", bottleneck.seconds);
+		summary += "\n";
+		if (strcmp(bound, "io") == 0)
+			summary += Msg("perf_slowest_io=Slowest phase: {1} ({2}s), waiting for storage")(bottleneck.name)(seconds);
+		else if (strcmp(bound, "wait") == 0)
+			summary += Msg("perf_slowest_wait=Slowest phase: {1} ({2}s), waiting for input or the connection")(bottleneck.name)(seconds);
+		else
+			summary += Msg("perf_slowest_cpu=Slowest phase: {1} ({2}s), CPU bound")(bottleneck.name)(seconds);
+	}
+	DataManager::SetValue("tw_perf_summary", summary);
+	// Quick operations would only clutter the console of the completion page
+	if (total.seconds >= 1)
+		gui_print("%s\n", summary.c_str());
+}
+
+void twrpPerf::Start(const std::string& Operation) {
+	Perf_Report report;
+
+	report.operation = Operation;
+	report.running = -1;
+	report.bytes = 0;
+	report.files = 0;
+	report.held_reports = false;
+	Take_Sample(&report.start);
+	report.phase_start = report.start;
+	pthread_mutex_lock(&perf_lock);
+	perf_reports.push_back(report);
+	pthread_mutex_unlock(&perf_lock);
+}
+
+void twrpPerf::Phase(const char* Name) {
+	Perf_Sample now;
+
+	Take_Sample(&now);
+	pthread_mutex_lock(&perf_lock);
+	if (perf_reports.empty()) {
+		pthread_mutex_unlock(&perf_lock);
+		return;
+	}
+	Perf_Report* report = &perf_reports.back();
+	End_Running_Phase(report, now, true);
+	size_t i;
+	for (i = 0; i < report->phases.size(); i++) {
+		if (strcmp(report->phases[i].name, Name) == 0)
+			break;
+	}
+	if (i == report->phases.size()) {
+		Perf_Span span;
+		memset(&span, 0, sizeof(span));
+		span.name = Name;
+		report->phases.push_back(span);
+	}
+	report->running = i;
+	report->phase_start = now;
+	twrpTrace::Begin("perf", Name);
+	pthread_mutex_unlock(&perf_lock);
+}
+
+void twrpPerf::Add(uint64_t Bytes, uint64_t Files) {
+	pthread_mutex_lock(&perf_lock);
+	if (!perf_reports.empty()) {
+		Perf_Report* report = &perf_reports.back();
+		report->bytes += Bytes;
+		report->files += Files;
+		if (report->running >= 0) {
+			report->phases[report->running].bytes += Bytes;
+			report->phases[report->running].files += Files;
+		}
+	}
+	pthread_mutex_unlock(&perf_lock);
+}
+
+std::string twrpPerf::Json() {
+	Perf_Sample now;
+	std::string json;
+
+	Take_Sample(&now);
+	pthread_mutex_lock(&perf_lock);
+	if (!perf_reports.empty()) {
+		Perf_Report report = perf_reports.back();
+		End_Running_Phase(&report, now, false);
+		json = Report_Json(report, now, false, 0);
+	}
+	pthread_mutex_unlock(&perf_lock);
+	return json;
+}
+
+void twrpPerf::Finish(int Status) {
+	Perf_Sample now;
+
+	Take_Sample(&now);
+	pthread_mutex_lock(&perf_lock);
+	if (perf_reports.empty()) {
+		pthread_mutex_unlock(&perf_lock);
+		return;
+	}
+	Perf_Report report = perf_reports.back();
+	perf_reports.pop_back();
+	End_Running_Phase(&report, now, true);
+	if (!perf_reports.empty())
+		perf_reports.back().held_reports = true;
+	std::string json = Report_Json(report, now, true, Status);
+	if (!report.held_reports)
+		last_json = json;
+	pthread_mutex_unlock(&perf_lock);
+
+	LOGINFO("Performance: %s\n", json.c_str());
+	if (report.held_reports)
+		return;
+	Show_Report(report, now);
+	TWFunc::write_to_file(PERF_REPORT_FILE, json + "\n");
+}
+
+std::string twrpPerf::Last_Json() {
+	pthread_mutex_lock(&perf_lock);
+	std::string json = last_json;
+	pthread_mutex_unlock(&perf_lock);
+	return json;
+}
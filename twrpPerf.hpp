@@ -0,0 +1,44 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_PERF
+#define __TWRP_PERF
+
+#include <stdint.h>
+#include <string>
+
+#define PERF_REPORT_FILE "/tmp/recovery_perf.json"
+
+// Where the time of an operation went. Each phase keeps its wall time, the
+// bytes and files it handled, the CPU time of the recovery and of the
+// children it waited for, and how the system's CPU time split between work
+// and waiting for I/O. The longest phase is named as the bottleneck. Phases
+// are also traced in the "perf" category. Operations nest, so an ORS command
+// gets its own report inside the one of the script; counts given outside of
+// any operation are dropped.
+class twrpPerf {
+public:
+	static void Start(const std::string& Operation);
+	static void Phase(const char* Name);                                     // Ends the running phase, Name must be a string literal
+	static void Add(uint64_t Bytes, uint64_t Files);                         // To the running phase, or the operation when none runs
+	static std::string Json();                                               // The innermost running operation so far, empty if none
+	static void Finish(int Status);                                          // Logs the report, shows and stores it unless it held other reports
+	static std::string Last_Json();                                          // The report last shown, for ORS results
+};
+
+#endif // __TWRP_PERF
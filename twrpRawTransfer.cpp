@@ -0,0 +1,818 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <vector>
+#include <sparse_format.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "twrpRawTransfer.hpp"
+#include "partitions.hpp"
+#include "twcommon.h"
+
+twrpRawTransfer::twrpRawTransfer(int src_fd, int dest_fd, unsigned long long size, ProgressTracking *progress) {
+	src = src_fd;
+	dest = dest_fd;
+	remain = size;
+	transferred = 0;
+	prog = progress;
+	stream_only = false;
+	block_size = RAW_TRANSFER_CHUNK;
+	digest = NULL;
+	stop_reader = false;
+	slots[0].data = slots[1].data = NULL;
+	sparse = false;
+	sparse_chunks = 0;
+	sparse_total_blocks = 0;
+	sparse_zero_blocks = 0;
+	sparse_pos = 0;
+	used_runs = NULL;
+	run_index = 0;
+	run_pos = 0;
+	zero_discard = false;
+	zero_request = 0;
+	dest_offset = 0;
+	zero_run = 0;
+	zero_buffer = NULL;
+	sparse_input = false;
+	input_pending = 0;
+}
+
+void twrpRawTransfer::Set_Stream_Only(size_t size) {
+	stream_only = true;
+	block_size = size;
+}
+
+void twrpRawTransfer::Set_Sparse_Output() {
+	sparse = true;
+}
+
+void twrpRawTransfer::Set_Digest(twrpDigest *output_digest) {
+	digest = output_digest;
+}
+
+void twrpRawTransfer::Set_Zero_Discard() {
+	zero_discard = true;
+}
+
+void twrpRawTransfer::Set_Sparse_Input() {
+	sparse_input = true;
+}
+
+void twrpRawTransfer::Set_Used_Blocks(const std::vector<twrpBlockMap_Run> *runs) {
+	used_runs = runs;
+}
+
+bool twrpRawTransfer::Transfer() {
+	Transfer_Result result;
+	off64_t offset;
+
+	if (used_runs != NULL) {
+		if (stream_only || remain % RAW_SPARSE_BLOCK != 0) {
+			LOGINFO("Size %llu can not be written as a sparse image\n", remain);
+			return false;
+		}
+		sparse = true;
+		sparse_total_blocks = remain / RAW_SPARSE_BLOCK;
+		remain = 0;
+		for (size_t i = 0; i < used_runs->size(); i++)
+			remain += (*used_runs)[i].length;
+		return Buffered();
+	}
+	if (sparse && (stream_only || remain % RAW_SPARSE_BLOCK != 0)) {
+		LOGINFO("Size %llu can not be written as a sparse image, writing a raw image\n", remain);
+		sparse = false;
+	}
+	if (sparse) {
+		sparse_total_blocks = remain / RAW_SPARSE_BLOCK;
+		return Buffered();
+	}
+	if (zero_discard) {
+		struct stat st;
+		unsigned int zeroes = 0;
+
+		offset = lseek64(dest, 0, SEEK_CUR);
+		// The ioctls take 512 byte aligned ranges, blocks are counted from where the write starts
+		if (fstat(dest, &st) != 0 || !S_ISBLK(st.st_mode) || offset < 0 || offset % 512 != 0) {
+			zero_discard = false;
+		} else {
+			dest_offset = (unsigned long long)offset;
+			// Discard is only usable where the device reads discarded blocks back as zeroes
+			if (ioctl(dest, BLKDISCARDZEROES, &zeroes) == 0 && zeroes != 0)
+				zero_request = BLKDISCARD;
+			else
+				zero_request = BLKZEROOUT;
+			if (!sparse_input)
+				return Buffered();
+		}
+	}
+	if (sparse_input) {
+		offset = lseek64(dest, 0, SEEK_CUR);
+		if (offset < 0) {
+			LOGINFO("Sparse images can only be written to a seekable destination\n");
+			return false;
+		}
+		dest_offset = (unsigned long long)offset;
+		return Sparse_Input();
+	}
+	if (!stream_only && digest == NULL) {
+		result = Copy_File_Range();
+		if (result != TRANSFER_UNSUPPORTED)
+			return result == TRANSFER_DONE;
+		LOGINFO("copy_file_range not available for this transfer, trying splice\n");
+		result = Splice();
+		if (result != TRANSFER_UNSUPPORTED)
+			return result == TRANSFER_DONE;
+		LOGINFO("splice not available for this transfer, using buffered copy\n");
+	}
+	return Buffered();
+}
+
+bool twrpRawTransfer::Update_Progress(unsigned long long bytes) {
+	transferred += bytes;
+	remain -= bytes < remain ? bytes : remain;
+	if (prog)
+		prog->UpdateSize(transferred);
+	return PartitionManager.Check_Backup_Cancel() == 0;
+}
+
+bool twrpRawTransfer::Write_Fully(const void *data, size_t len) {
+	const char *pos = (const char*) data;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(dest, pos, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
+			return false;
+		}
+		pos += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+bool twrpRawTransfer::Is_Zero_Block(const void *data) {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	const uint8_t *p = (const uint8_t*) data;
+	uint8x16_t acc = vdupq_n_u8(0);
+	for (size_t i = 0; i < RAW_SPARSE_BLOCK; i += 64) {
+		acc = vorrq_u8(acc, vld1q_u8(p + i));
+		acc = vorrq_u8(acc, vld1q_u8(p + i + 16));
+		acc = vorrq_u8(acc, vld1q_u8(p + i + 32));
+		acc = vorrq_u8(acc, vld1q_u8(p + i + 48));
+	}
+	uint64x2_t acc64 = vreinterpretq_u64_u8(acc);
+	return (vgetq_lane_u64(acc64, 0) | vgetq_lane_u64(acc64, 1)) == 0;
+#elif defined(__SSE2__)
+	const __m128i *p = (const __m128i*) data;
+	__m128i acc = _mm_setzero_si128();
+	for (size_t i = 0; i < RAW_SPARSE_BLOCK / 16; i += 4) {
+		acc = _mm_or_si128(acc, _mm_load_si128(p + i));
+		acc = _mm_or_si128(acc, _mm_load_si128(p + i + 1));
+		acc = _mm_or_si128(acc, _mm_load_si128(p + i + 2));
+		acc = _mm_or_si128(acc, _mm_load_si128(p + i + 3));
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+#else
+	const uint64_t *p = (const uint64_t*) data;
+	uint64_t acc = 0;
+	for (size_t i = 0; i < RAW_SPARSE_BLOCK / sizeof(uint64_t); i++)
+		acc |= p[i];
+	return acc == 0;
+#endif
+}
+
+bool twrpRawTransfer::Write_Sparse_Header(unsigned total_chunks) {
+	sparse_header_t header;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = SPARSE_HEADER_MAGIC;
+	header.major_version = 1;
+	header.minor_version = 0;
+	header.file_hdr_sz = sizeof(sparse_header_t);
+	header.chunk_hdr_sz = sizeof(chunk_header_t);
+	header.blk_sz = RAW_SPARSE_BLOCK;
+	header.total_blks = (uint32_t)sparse_total_blocks;
+	header.total_chunks = total_chunks;
+	header.image_checksum = 0;
+	return Write_Fully(&header, sizeof(header));
+}
+
+bool twrpRawTransfer::Flush_Zero_Chunk() {
+	chunk_header_t chunk;
+	uint32_t fill = 0;
+
+	if (sparse_zero_blocks == 0)
+		return true;
+	// Zero blocks are stored as fill chunks rather than don't care chunks so they
+	// overwrite whatever is on the partition when the image is restored
+	chunk.chunk_type = CHUNK_TYPE_FILL;
+	chunk.reserved1 = 0;
+	chunk.chunk_sz = (uint32_t)sparse_zero_blocks;
+	chunk.total_sz = sizeof(chunk) + sizeof(fill);
+	sparse_zero_blocks = 0;
+	sparse_chunks++;
+	return Write_Fully(&chunk, sizeof(chunk)) && Write_Fully(&fill, sizeof(fill));
+}
+
+bool twrpRawTransfer::Skip_To(unsigned long long offset) {
+	chunk_header_t chunk;
+
+	if (offset <= sparse_pos)
+		return true;
+	if (!Flush_Zero_Chunk())
+		return false;
+	chunk.chunk_type = CHUNK_TYPE_DONT_CARE;
+	chunk.reserved1 = 0;
+	chunk.chunk_sz = (uint32_t)((offset - sparse_pos) / RAW_SPARSE_BLOCK);
+	chunk.total_sz = sizeof(chunk);
+	sparse_pos = offset;
+	sparse_chunks++;
+	return Write_Fully(&chunk, sizeof(chunk));
+}
+
+bool twrpRawTransfer::Flush_Zero_Run() {
+	uint64_t range[2];
+	size_t len;
+
+	if (zero_run == 0)
+		return true;
+	if (zero_run >= RAW_DISCARD_MIN && zero_request != 0) {
+		range[0] = dest_offset;
+		range[1] = zero_run;
+		if (ioctl(dest, zero_request, &range) == 0) {
+			dest_offset += zero_run;
+			zero_run = 0;
+			return lseek64(dest, dest_offset, SEEK_SET) == (off64_t)dest_offset;
+		}
+		LOGINFO("%s failed (%s), writing zeroes instead\n", zero_request == BLKDISCARD ? "BLKDISCARD" : "BLKZEROOUT", strerror(errno));
+		zero_request = 0;
+	}
+	if (zero_buffer == NULL && (zero_buffer = calloc(1, RAW_DISCARD_MIN)) == NULL)
+		return false;
+	while (zero_run > 0) {
+		len = zero_run < RAW_DISCARD_MIN ? (size_t)zero_run : RAW_DISCARD_MIN;
+		if (!Write_Fully(zero_buffer, len))
+			return false;
+		dest_offset += len;
+		zero_run -= len;
+	}
+	return true;
+}
+
+bool twrpRawTransfer::Write_Discard(const unsigned char *data, size_t len) {
+	size_t pos = 0, raw_start;
+
+	while (pos < len) {
+		if (len - pos >= RAW_SPARSE_BLOCK && Is_Zero_Block(data + pos)) {
+			zero_run += RAW_SPARSE_BLOCK;
+			pos += RAW_SPARSE_BLOCK;
+			continue;
+		}
+		if (!Flush_Zero_Run())
+			return false;
+		raw_start = pos;
+		do {
+			pos += len - pos < RAW_SPARSE_BLOCK ? len - pos : RAW_SPARSE_BLOCK;
+		} while (pos < len && (len - pos < RAW_SPARSE_BLOCK || !Is_Zero_Block(data + pos)));
+		if (!Write_Fully(data + raw_start, pos - raw_start))
+			return false;
+		dest_offset += pos - raw_start;
+	}
+	return true;
+}
+
+bool twrpRawTransfer::Write_Data(const void *data, size_t len) {
+	if (zero_discard)
+		return Write_Discard((const unsigned char*) data, len);
+	if (!Write_Fully(data, len))
+		return false;
+	dest_offset += len;
+	return true;
+}
+
+bool twrpRawTransfer::Write_Output(const void *data, size_t len) {
+	if (sparse)
+		return Write_Sparse((const unsigned char*) data, len);
+	if (!Write_Data(data, len))
+		return false;
+	if (digest != NULL)
+		digest->update((const unsigned char*) data, len);
+	return true;
+}
+
+bool twrpRawTransfer::Write_Sparse(const unsigned char *data, size_t len) {
+	chunk_header_t chunk;
+	size_t pos = 0, raw_start;
+
+	sparse_pos += len;
+	while (pos < len) {
+		if (Is_Zero_Block(data + pos)) {
+			sparse_zero_blocks++;
+			pos += RAW_SPARSE_BLOCK;
+			continue;
+		}
+		if (!Flush_Zero_Chunk())
+			return false;
+		raw_start = pos;
+		pos += RAW_SPARSE_BLOCK;
+		while (pos < len && !Is_Zero_Block(data + pos))
+			pos += RAW_SPARSE_BLOCK;
+		chunk.chunk_type = CHUNK_TYPE_RAW;
+		chunk.reserved1 = 0;
+		chunk.chunk_sz = (uint32_t)((pos - raw_start) / RAW_SPARSE_BLOCK);
+		chunk.total_sz = (uint32_t)(sizeof(chunk) + pos - raw_start);
+		sparse_chunks++;
+		if (!Write_Fully(&chunk, sizeof(chunk)) || !Write_Fully(data + raw_start, pos - raw_start))
+			return false;
+	}
+	return true;
+}
+
+bool twrpRawTransfer::Read_Input(void *data, size_t len) {
+	char *pos = (char*) data;
+	size_t left = len;
+	ssize_t ret;
+
+	while (left > 0) {
+		ret = read(src, pos, left);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			LOGINFO("Error reading sparse image (%s)\n", ret == 0 ? "end of file" : strerror(errno));
+			return false;
+		}
+		pos += ret;
+		left -= ret;
+	}
+	if (digest != NULL)
+		digest->update((const unsigned char*) data, len);
+	input_pending += len;
+	return true;
+}
+
+bool twrpRawTransfer::Write_Fill(uint32_t fill, unsigned long long len) {
+	uint32_t *words = (uint32_t*) slots[0].data;
+	size_t count;
+
+	if (fill == 0 && zero_discard) {
+		zero_run += len;
+		return true;
+	}
+	count = len < RAW_TRANSFER_CHUNK ? (size_t)len : RAW_TRANSFER_CHUNK;
+	for (size_t i = 0; i < count / sizeof(uint32_t); i++)
+		words[i] = fill;
+	while (len > 0) {
+		count = len < RAW_TRANSFER_CHUNK ? (size_t)len : RAW_TRANSFER_CHUNK;
+		if (!Write_Data(words, count))
+			return false;
+		len -= count;
+	}
+	return true;
+}
+
+bool twrpRawTransfer::Skip_Dont_Care(unsigned long long len) {
+	uint64_t range[2];
+
+	if (!Flush_Zero_Run())
+		return false;
+	// Whatever is on the partition may stay, so the blocks are discarded where possible for the wear leveling
+	if (zero_discard && len >= RAW_DISCARD_MIN) {
+		range[0] = dest_offset;
+		range[1] = len;
+		ioctl(dest, BLKDISCARD, &range);
+	}
+	dest_offset += len;
+	return lseek64(dest, dest_offset, SEEK_SET) == (off64_t)dest_offset;
+}
+
+bool twrpRawTransfer::Sparse_Input() {
+	sparse_header_t header;
+	chunk_header_t chunk;
+	unsigned long long blocks = 0, len;
+	uint64_t device_size;
+	uint32_t fill;
+	char skip[64];
+	size_t count;
+	bool ret = false;
+	struct stat st;
+
+	if (posix_memalign(&slots[0].data, RAW_TRANSFER_ALIGN, RAW_TRANSFER_CHUNK) != 0) {
+		LOGINFO("twrpRawTransfer failed to allocate buffers\n");
+		slots[0].data = NULL;
+		return false;
+	}
+	if (!Read_Input(&header, sizeof(header)))
+		goto exit;
+	if (header.magic != SPARSE_HEADER_MAGIC || header.major_version != 1 || header.file_hdr_sz < sizeof(header) || header.file_hdr_sz - sizeof(header) > sizeof(skip)
+		|| header.chunk_hdr_sz < sizeof(chunk) || header.chunk_hdr_sz - sizeof(chunk) > sizeof(skip) || header.blk_sz == 0 || header.blk_sz % sizeof(uint32_t) != 0) {
+		LOGINFO("Invalid sparse image header\n");
+		goto exit;
+	}
+	if (!Read_Input(skip, header.file_hdr_sz - sizeof(header)))
+		goto exit;
+	if (fstat(dest, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(dest, BLKGETSIZE64, &device_size) == 0
+		&& dest_offset + (unsigned long long)header.total_blks * header.blk_sz > device_size) {
+		LOGINFO("Sparse image of %llu bytes does not fit the partition\n", (unsigned long long)header.total_blks * header.blk_sz);
+		goto exit;
+	}
+
+	for (uint32_t i = 0; i < header.total_chunks; i++) {
+		if (!Read_Input(&chunk, sizeof(chunk)) || !Read_Input(skip, header.chunk_hdr_sz - sizeof(chunk)))
+			goto exit;
+		len = (unsigned long long)chunk.chunk_sz * header.blk_sz;
+		blocks += chunk.chunk_sz;
+		if (blocks > header.total_blks) {
+			LOGINFO("Sparse chunk %u runs past the end of the image\n", i);
+			goto exit;
+		}
+		switch (chunk.chunk_type) {
+		case CHUNK_TYPE_RAW:
+			if (chunk.total_sz != header.chunk_hdr_sz + len) {
+				LOGINFO("Sparse raw chunk %u has a bad size\n", i);
+				goto exit;
+			}
+			while (len > 0) {
+				count = len < RAW_TRANSFER_CHUNK ? (size_t)len : RAW_TRANSFER_CHUNK;
+				if (!Read_Input(slots[0].data, count) || !Write_Data(slots[0].data, count))
+					goto exit;
+				len -= count;
+				if (!Update_Progress(input_pending))
+					goto exit;
+				input_pending = 0;
+			}
+			break;
+		case CHUNK_TYPE_FILL:
+			if (chunk.total_sz != header.chunk_hdr_sz + sizeof(fill) || !Read_Input(&fill, sizeof(fill)) || !Write_Fill(fill, len))
+				goto exit;
+			break;
+		case CHUNK_TYPE_DONT_CARE:
+			if (chunk.total_sz != header.chunk_hdr_sz || !Skip_Dont_Care(len))
+				goto exit;
+			break;
+		case CHUNK_TYPE_CRC32:
+			// The digest covers the image, the checksum of the expanded data is not checked
+			if (chunk.total_sz != header.chunk_hdr_sz + sizeof(fill) || !Read_Input(&fill, sizeof(fill)))
+				goto exit;
+			break;
+		default:
+			LOGINFO("Unknown sparse chunk type 0x%x\n", chunk.chunk_type);
+			goto exit;
+		}
+		if (!Update_Progress(input_pending))
+			goto exit;
+		input_pending = 0;
+	}
+	if (blocks != header.total_blks) {
+		LOGINFO("Sparse image ended after %llu of %u blocks\n", blocks, header.total_blks);
+		goto exit;
+	}
+	if (!Flush_Zero_Run())
+		goto exit;
+	// A trailing don't care chunk on a regular file only moved the offset
+	if (fstat(dest, &st) == 0 && S_ISREG(st.st_mode) && (unsigned long long)st.st_size < dest_offset && ftruncate64(dest, dest_offset) != 0)
+		goto exit;
+	LOGINFO("Wrote sparse image of %u chunks for %u blocks\n", header.total_chunks, header.total_blks);
+	ret = true;
+
+exit:
+	free(slots[0].data);
+	slots[0].data = NULL;
+	free(zero_buffer);
+	zero_buffer = NULL;
+	return ret;
+}
+
+twrpRawTransfer::Transfer_Result twrpRawTransfer::Copy_File_Range() {
+#ifdef __NR_copy_file_range
+	ssize_t ret;
+	size_t len;
+
+	while (remain > 0) {
+		len = remain < RAW_TRANSFER_CHUNK ? (size_t)remain : RAW_TRANSFER_CHUNK;
+		ret = syscall(__NR_copy_file_range, src, NULL, dest, NULL, len, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			// Block devices, pipes and older kernels end up here, the file offsets are still consistent
+			if (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)
+				return TRANSFER_UNSUPPORTED;
+			LOGINFO("copy_file_range failed (%s)\n", strerror(errno));
+			return TRANSFER_ERROR;
+		}
+		if (ret == 0) {
+			LOGINFO("Unexpected end of source with %llu bytes left\n", remain);
+			return TRANSFER_ERROR;
+		}
+		if (!Update_Progress((unsigned long long)ret))
+			return TRANSFER_ERROR;
+	}
+	return TRANSFER_DONE;
+#else
+	return TRANSFER_UNSUPPORTED;
+#endif
+}
+
+twrpRawTransfer::Transfer_Result twrpRawTransfer::Splice() {
+	Transfer_Result result = TRANSFER_DONE;
+	int pipefd[2];
+	ssize_t in, out, ret;
+	size_t len, pending;
+
+	if (pipe(pipefd) < 0)
+		return TRANSFER_UNSUPPORTED;
+#ifdef F_SETPIPE_SZ
+	fcntl(pipefd[1], F_SETPIPE_SZ, RAW_TRANSFER_CHUNK); // a bigger pipe means fewer syscalls, the default still works
+#endif
+
+	while (remain > 0) {
+		len = remain < RAW_TRANSFER_CHUNK ? (size_t)remain : RAW_TRANSFER_CHUNK;
+		in = splice(src, NULL, pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (in < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL || errno == ENOSYS) {
+				result = TRANSFER_UNSUPPORTED; // the pipe is empty, nothing is lost
+			} else {
+				LOGINFO("splice from source failed (%s)\n", strerror(errno));
+				result = TRANSFER_ERROR;
+			}
+			break;
+		}
+		if (in == 0) {
+			LOGINFO("Unexpected end of source with %llu bytes left\n", remain);
+			result = TRANSFER_ERROR;
+			break;
+		}
+		pending = (size_t)in;
+		while (pending > 0) {
+			out = splice(pipefd[0], NULL, dest, NULL, pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (out < 0 && errno == EINTR)
+				continue;
+			if (out < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				// The destination does not take splice, hand what is already in the pipe over by hand
+				std::vector<char> drain(pending);
+				size_t got = 0;
+				while (got < pending) {
+					ret = read(pipefd[0], &drain[got], pending - got);
+					if (ret <= 0)
+						break;
+					got += ret;
+				}
+				if (got != pending || !Write_Fully(&drain[0], pending)) {
+					result = TRANSFER_ERROR;
+					break;
+				}
+				pending = 0;
+				result = TRANSFER_UNSUPPORTED;
+				break;
+			}
+			if (out <= 0) {
+				LOGINFO("splice to destination failed (%s)\n", strerror(errno));
+				result = TRANSFER_ERROR;
+				break;
+			}
+			pending -= out;
+		}
+		if (result == TRANSFER_ERROR)
+			break;
+		if (!Update_Progress((unsigned long long)in)) {
+			result = TRANSFER_ERROR;
+			break;
+		}
+		if (result == TRANSFER_UNSUPPORTED)
+			break;
+	}
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return result;
+}
+
+size_t twrpRawTransfer::Next_Read(unsigned long long left, unsigned long long *offset) {
+	size_t want = left < block_size ? (size_t)left : block_size;
+
+	if (used_runs == NULL)
+		return want;
+	// A read never spans two runs
+	while (run_pos >= (*used_runs)[run_index].length) {
+		run_index++;
+		run_pos = 0;
+	}
+	const twrpBlockMap_Run& run = (*used_runs)[run_index];
+	if (run.length - run_pos < want)
+		want = (size_t)(run.length - run_pos);
+	*offset = run.offset + run_pos;
+	run_pos += want;
+	return want;
+}
+
+void* twrpRawTransfer::Reader_Thread(void *cookie) {
+	twrpRawTransfer *rt = (twrpRawTransfer*) cookie;
+	unsigned long long left = rt->remain, offset = 0;
+	Buffer_Slot *slot;
+	size_t want, got;
+	ssize_t ret;
+	int i = 0, flags;
+
+	while (left > 0) {
+		slot = &rt->slots[i];
+		pthread_mutex_lock(&rt->slot_lock);
+		while (slot->full && !rt->stop_reader)
+			pthread_cond_wait(&rt->slot_cond, &rt->slot_lock);
+		if (rt->stop_reader) {
+			pthread_mutex_unlock(&rt->slot_lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&rt->slot_lock);
+
+		want = rt->Next_Read(left, &offset);
+		got = 0;
+		while (got < want) {
+			if (rt->used_runs != NULL)
+				ret = pread64(rt->src, (char*)slot->data + got, want - got, offset + got);
+			else
+				ret = read(rt->src, (char*)slot->data + got, want - got);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0 && errno == EINVAL) {
+				// A short read left us unaligned, finish without O_DIRECT
+				flags = fcntl(rt->src, F_GETFL);
+				if (flags >= 0 && (flags & O_DIRECT) && fcntl(rt->src, F_SETFL, flags & ~O_DIRECT) == 0)
+					continue;
+			}
+			if (ret <= 0) {
+				LOGINFO("Error reading source fd (%s)\n", ret == 0 ? "end of file" : strerror(errno));
+				break;
+			}
+			got += ret;
+		}
+
+		pthread_mutex_lock(&rt->slot_lock);
+		slot->len = (got == want) ? (ssize_t)got : -1;
+		slot->offset = offset;
+		slot->full = true;
+		pthread_cond_broadcast(&rt->slot_cond);
+		pthread_mutex_unlock(&rt->slot_lock);
+		if (got != want)
+			return NULL;
+		left -= got;
+		i ^= 1;
+	}
+	return NULL;
+}
+
+bool twrpRawTransfer::Buffered() {
+	pthread_t reader;
+	struct stat st;
+	Buffer_Slot *slot;
+	unsigned long long offset = 0;
+	size_t want, got;
+	ssize_t rd = 0;
+	int i = 0, flags = -1;
+	bool ret = true;
+	size_t alloc_size = (block_size + RAW_TRANSFER_ALIGN - 1) & ~(size_t)(RAW_TRANSFER_ALIGN - 1);
+
+	if (remain == 0 && used_runs == NULL)
+		return true;
+	for (i = 0; i < 2; i++) {
+		if (posix_memalign(&slots[i].data, RAW_TRANSFER_ALIGN, alloc_size) != 0) {
+			LOGINFO("twrpRawTransfer failed to allocate buffers\n");
+			free(slots[0].data);
+			slots[0].data = NULL;
+			return false;
+		}
+		slots[i].len = 0;
+		slots[i].full = false;
+	}
+
+	// Reading the block device around the page cache keeps a full partition read from evicting everything else
+	if (!stream_only && fstat(src, &st) == 0 && S_ISBLK(st.st_mode) && block_size % RAW_TRANSFER_ALIGN == 0 && remain % RAW_TRANSFER_ALIGN == 0 && transferred % RAW_TRANSFER_ALIGN == 0) {
+		flags = fcntl(src, F_GETFL);
+		if (flags >= 0 && fcntl(src, F_SETFL, flags | O_DIRECT) == 0)
+			LOGINFO("Using O_DIRECT reads\n");
+		else
+			flags = -1;
+	}
+
+	if (sparse && !Write_Sparse_Header(0)) {
+		ret = false;
+		goto exit;
+	}
+
+	stop_reader = false;
+	pthread_mutex_init(&slot_lock, NULL);
+	pthread_cond_init(&slot_cond, NULL);
+	if (pthread_create(&reader, NULL, Reader_Thread, (void*)this) != 0) {
+		// Without a reader thread just alternate reading and writing
+		LOGINFO("Unable to create reader thread, copying without read ahead\n");
+		while (ret && remain > 0) {
+			want = Next_Read(remain, &offset);
+			got = 0;
+			while (got < want) {
+				if (used_runs != NULL)
+					rd = pread64(src, (char*)slots[0].data + got, want - got, offset + got);
+				else
+					rd = read(src, (char*)slots[0].data + got, want - got);
+				if (rd < 0 && errno == EINTR)
+					continue;
+				if (rd < 0 && errno == EINVAL && flags >= 0 && fcntl(src, F_SETFL, flags) == 0) {
+					flags = -1;
+					continue;
+				}
+				if (rd <= 0)
+					break;
+				got += rd;
+			}
+			if (got != want) {
+				LOGINFO("Error reading source fd (%s)\n", rd == 0 ? "end of file" : strerror(errno));
+				ret = false;
+			} else if ((used_runs != NULL && !Skip_To(offset)) || !Write_Output(slots[0].data, got) || !Update_Progress(got)) {
+				ret = false;
+			}
+		}
+	} else {
+		i = 0;
+		while (remain > 0) {
+			slot = &slots[i];
+			pthread_mutex_lock(&slot_lock);
+			while (!slot->full)
+				pthread_cond_wait(&slot_cond, &slot_lock);
+			pthread_mutex_unlock(&slot_lock);
+			if (slot->len < 0) {
+				ret = false;
+				break;
+			}
+			if ((used_runs != NULL && !Skip_To(slot->offset)) || !Write_Output(slot->data, (size_t)slot->len) || !Update_Progress((unsigned long long)slot->len)) {
+				ret = false;
+				break;
+			}
+			pthread_mutex_lock(&slot_lock);
+			slot->full = false;
+			pthread_cond_broadcast(&slot_cond);
+			pthread_mutex_unlock(&slot_lock);
+			i ^= 1;
+		}
+		pthread_mutex_lock(&slot_lock);
+		stop_reader = true;
+		pthread_cond_broadcast(&slot_cond);
+		pthread_mutex_unlock(&slot_lock);
+		pthread_join(reader, NULL);
+	}
+	pthread_cond_destroy(&slot_cond);
+	pthread_mutex_destroy(&slot_lock);
+
+	if (ret && zero_discard && !Flush_Zero_Run()) {
+		LOGINFO("Error zeroing the end of the destination (%s)\n", strerror(errno));
+		ret = false;
+	}
+
+	if (ret && sparse) {
+		// Now that the chunk count is known go back and fill in the header
+		if (!Flush_Zero_Chunk() || (used_runs != NULL && !Skip_To(sparse_total_blocks * RAW_SPARSE_BLOCK)) || lseek64(dest, 0, SEEK_SET) != 0 || !Write_Sparse_Header(sparse_chunks)) {
+			LOGINFO("Error finishing sparse image (%s)\n", strerror(errno));
+			ret = false;
+		} else {
+			LOGINFO("Wrote sparse image with %u chunks for %llu blocks\n", sparse_chunks, sparse_total_blocks);
+		}
+	}
+
+exit:
+	if (flags >= 0)
+		fcntl(src, F_SETFL, flags);
+	for (i = 0; i < 2; i++) {
+		free(slots[i].data);
+		slots[i].data = NULL;
+	}
+	free(zero_buffer);
+	zero_buffer = NULL;
+	return ret;
+}
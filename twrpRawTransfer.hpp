@@ -0,0 +1,138 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPRAWTRANSFER_HPP
+#define __TWRPRAWTRANSFER_HPP
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include "progresstracking.hpp"
+#include "twrpBlockMap.hpp"
+#include "twrpDigest/twrpDigest.hpp"
+
+#define RAW_TRANSFER_CHUNK (1024 * 1024)                                        // Bytes moved between progress updates and cancel checks
+#define RAW_TRANSFER_ALIGN 4096                                                 // Buffer and length alignment needed for O_DIRECT
+#define RAW_SPARSE_BLOCK 4096                                                   // Block size of sparse image output
+#define RAW_DISCARD_MIN (64 * 1024)                                             // Shorter zero runs are cheaper to write than to discard
+
+// Copies a block device to an image file or back for raw partition backups.
+// The kernel moves the data itself with copy_file_range or splice when both
+// ends allow it. Otherwise a reader thread fills two aligned buffers (with
+// O_DIRECT on block devices) while the calling thread writes the other one.
+// Progress and backup cancel are handled once per chunk on the calling thread.
+// With sparse output the image is written in Android sparse format instead,
+// with every run of all-zero blocks stored as a single fill chunk.
+// When restoring to a block device, runs of zero blocks can be handed to the
+// device as BLKZEROOUT or BLKDISCARD requests instead of being written.
+// A sparse image source is expanded on the fly. Progress and the digest then
+// follow the bytes of the image, and the source never needs to seek, so it
+// may be a pipe.
+// With a list of used blocks only those are read, and the sparse image has
+// don't care chunks for the rest, so it still covers the whole source.
+// A digest of the raw data can be computed on the way, which needs the data in
+// user space and so always uses the buffered copy.
+class twrpRawTransfer
+{
+public:
+	twrpRawTransfer(int src_fd, int dest_fd, unsigned long long size, ProgressTracking *progress);
+	bool Transfer();
+	void Set_Stream_Only(size_t block_size);                                   // Plain read/write in blocks of block_size, used for adb backups
+	void Set_Sparse_Output();                                                  // Write an Android sparse image, dest must be seekable
+	void Set_Digest(twrpDigest *output_digest);                                // Digest of the copied data, not used with sparse output
+	void Set_Zero_Discard();                                                   // Zero out runs of zero blocks on a block device dest instead of writing them
+	void Set_Sparse_Input();                                                   // The source is an Android sparse image, size is the size of the image
+	void Set_Used_Blocks(const std::vector<twrpBlockMap_Run> *runs);          // Copy only these runs into a sparse image, size is the size of the source
+	unsigned long long Transferred() { return transferred; }
+
+private:
+	enum Transfer_Result {
+		TRANSFER_DONE,
+		TRANSFER_UNSUPPORTED,                                                  // Nothing failed yet, try the next method from the current offsets
+		TRANSFER_ERROR,
+	};
+
+	struct Buffer_Slot {
+		void *data;
+		ssize_t len;                                                           // -1 on read error
+		unsigned long long offset;                                             // where data was read in the source, used blocks only
+		bool full;
+	};
+
+	Transfer_Result Copy_File_Range();
+	Transfer_Result Splice();
+	bool Buffered();
+	bool Write_Fully(const void *data, size_t len);
+	bool Write_Output(const void *data, size_t len);                            // Writes raw or sparse depending on the output mode
+	bool Write_Sparse(const unsigned char *data, size_t len);
+	bool Write_Sparse_Header(unsigned total_chunks);
+	bool Flush_Zero_Chunk();
+	bool Skip_To(unsigned long long offset);                                   // Don't care chunk up to offset of the source
+	size_t Next_Read(unsigned long long left, unsigned long long *offset);     // Length of the next read, and where used blocks continue
+	bool Write_Discard(const unsigned char *data, size_t len);
+	bool Write_Data(const void *data, size_t len);                              // Raw or zero discard, keeps dest_offset
+	bool Flush_Zero_Run();
+	bool Sparse_Input();
+	bool Read_Input(void *data, size_t len);                                    // Reads and hashes the sparse image
+	bool Write_Fill(uint32_t fill, unsigned long long len);
+	bool Skip_Dont_Care(unsigned long long len);
+	static bool Is_Zero_Block(const void *data);
+	bool Update_Progress(unsigned long long bytes);                            // Returns false if the backup was cancelled
+	static void* Reader_Thread(void *cookie);
+
+	int src;
+	int dest;
+	unsigned long long remain;
+	unsigned long long transferred;
+	ProgressTracking *prog;
+	bool stream_only;
+	size_t block_size;
+	twrpDigest *digest;
+
+	// Sparse output state
+	bool sparse;
+	unsigned sparse_chunks;
+	unsigned long long sparse_total_blocks;
+	unsigned long long sparse_zero_blocks;                                     // zero blocks not yet written as a fill chunk
+	unsigned long long sparse_pos;                                             // bytes of the source the image covers so far
+
+	// Used blocks state
+	const std::vector<twrpBlockMap_Run> *used_runs;
+	size_t run_index;
+	unsigned long long run_pos;                                                // bytes of the current run already read
+
+	// Zero discard state
+	bool zero_discard;
+	unsigned long zero_request;                                                // BLKDISCARD or BLKZEROOUT, 0 once the device refused one
+	unsigned long long dest_offset;
+	unsigned long long zero_run;                                               // zero bytes at dest_offset not yet written
+	void *zero_buffer;
+
+	// Sparse input state
+	bool sparse_input;
+	unsigned long long input_pending;                                          // bytes read but not yet reported as progress
+
+	// Double buffer state
+	Buffer_Slot slots[2];
+	pthread_mutex_t slot_lock;
+	pthread_cond_t slot_cond;
+	bool stop_reader;
+};
+
+#endif // __TWRPRAWTRANSFER_HPP
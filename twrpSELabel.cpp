@@ -0,0 +1,89 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <selinux/selinux.h>
+#include <selinux/label.h>
+#include "twrpSELabel.hpp"
+#include "twcommon.h"
+
+#define SELABEL_CACHE_MAX 8192                                                 // Labels kept per cache, the cache starts over when full
+
+typedef std::map<std::pair<std::string, mode_t>, std::string> label_cache;
+
+static struct selabel_handle *label_handle = NULL;
+static label_cache path_labels;                                                // by path and file type
+static label_cache entry_labels;                                               // by directory and file type
+static pthread_mutex_t label_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool twrpSELabel::Open(const std::string& File_Contexts) {
+	struct selinux_opt options[] = {
+		{ SELABEL_OPT_PATH, File_Contexts.c_str() }
+	};
+	struct selabel_handle *handle = selabel_open(SELABEL_CTX_FILE, options, 1);
+
+	pthread_mutex_lock(&label_lock);
+	if (label_handle)
+		selabel_close(label_handle);
+	label_handle = handle;
+	path_labels.clear();
+	entry_labels.clear();
+	pthread_mutex_unlock(&label_lock);
+	return handle != NULL;
+}
+
+struct selabel_handle* twrpSELabel::Handle() {
+	return label_handle;
+}
+
+// Called with label_lock held
+static bool Cached_Lookup(label_cache *cache, const std::pair<std::string, mode_t>& key, const std::string& Path, mode_t Mode, std::string *Context) {
+	label_cache::iterator it = cache->find(key);
+	char *context = NULL;
+
+	if (it != cache->end()) {
+		*Context = it->second;
+		return true;
+	}
+	if (!label_handle || selabel_lookup(label_handle, &context, Path.c_str(), Mode) < 0)
+		return false;
+	*Context = context;
+	freecon(context);
+	if (cache->size() >= SELABEL_CACHE_MAX)
+		cache->clear();
+	cache->insert(std::make_pair(key, *Context));
+	return true;
+}
+
+bool twrpSELabel::Lookup(const std::string& Path, mode_t Mode, std::string *Context) {
+	pthread_mutex_lock(&label_lock);
+	bool ret = Cached_Lookup(&path_labels, std::make_pair(Path, Mode & S_IFMT), Path, Mode, Context);
+	pthread_mutex_unlock(&label_lock);
+	return ret;
+}
+
+bool twrpSELabel::Lookup_Entry(const std::string& Dir, const std::string& Name, mode_t Mode, std::string *Context) {
+	pthread_mutex_lock(&label_lock);
+	bool ret = Cached_Lookup(&entry_labels, std::make_pair(Dir, Mode & S_IFMT), Dir + "/" + Name, Mode, Context);
+	pthread_mutex_unlock(&label_lock);
+	return ret;
+}
@@ -0,0 +1,44 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPSELABEL_HPP
+#define __TWRPSELABEL_HPP
+
+#include <sys/types.h>
+#include <string>
+
+struct selabel_handle;
+
+// The file_contexts of the recovery, loaded once for the whole process
+// instead of by every operation that labels files. Each selabel_lookup
+// matches the path against the regexes of file_contexts, so the results are
+// kept: by path and file type for single lookups, and by directory and file
+// type for the entries of trees whose file_contexts does not tell names
+// apart, like internal storage, so a tree relabel looks up each directory
+// once. Lookups are serialized, libselinux does not promise that threads
+// can share a handle.
+class twrpSELabel
+{
+public:
+	static bool Open(const std::string& File_Contexts);                        // At startup once the contexts file is in place, drops the cached labels
+	static struct selabel_handle* Handle();                                    // NULL without file contexts, for libraries that take the handle
+	static bool Lookup(const std::string& Path, mode_t Mode, std::string *Context);
+	static bool Lookup_Entry(const std::string& Dir, const std::string& Name, mode_t Mode, std::string *Context); // The label is shared by the entries of Dir with the same file type
+};
+
+#endif // __TWRPSELABEL_HPP
@@ -0,0 +1,207 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <linux/loop.h>
+#include <string>
+#include "twrpSnapshot.hpp"
+#include "twcommon.h"
+
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
+twrpSnapshot::twrpSnapshot() {
+	loop_fd = -1;
+}
+
+twrpSnapshot::~twrpSnapshot() {
+	Release();
+}
+
+bool twrpSnapshot::Supported(const std::string& File_System) {
+	return File_System == "f2fs";
+}
+
+bool twrpSnapshot::Remount(const std::string& Mount_Point, const char* options) {
+	struct statvfs st;
+	unsigned long flags = MS_REMOUNT;
+
+	if (statvfs(Mount_Point.c_str(), &st) != 0)
+		return false;
+	// A remount resets the flags it is not given
+	if (st.f_flag & ST_NOSUID)
+		flags |= MS_NOSUID;
+	if (st.f_flag & ST_NODEV)
+		flags |= MS_NODEV;
+	if (st.f_flag & ST_NOEXEC)
+		flags |= MS_NOEXEC;
+	if (st.f_flag & ST_NOATIME)
+		flags |= MS_NOATIME;
+	if (st.f_flag & ST_NODIRATIME)
+		flags |= MS_NODIRATIME;
+#ifdef ST_RELATIME
+	if (st.f_flag & ST_RELATIME)
+		flags |= MS_RELATIME;
+#endif
+	if (mount(NULL, Mount_Point.c_str(), NULL, flags, options) != 0) {
+		LOGINFO("Unable to remount '%s' with %s: %s\n", Mount_Point.c_str(), options, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool twrpSnapshot::Hold(const std::string& Mount_Point) {
+	if (!held_mount_point.empty())
+		return true;
+
+	// The snapshot is the last checkpoint, so make that as recent as possible
+	int fd = open(Mount_Point.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	syncfs(fd);
+	close(fd);
+	// Kernels before 4.20 don't know the option and refuse the remount, as
+	// does one that can't free enough space to run without checkpoints
+	if (!Remount(Mount_Point, "checkpoint=disable"))
+		return false;
+	held_mount_point = Mount_Point;
+	LOGINFO("Checkpoints of '%s' are off for the snapshot\n", Mount_Point.c_str());
+	return true;
+}
+
+int twrpSnapshot::Open_Loop(std::string *device) {
+	int control = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+	if (control < 0)
+		return -1;
+	int number = ioctl(control, LOOP_CTL_GET_FREE);
+	close(control);
+	if (number < 0)
+		return -1;
+
+	// ueventd puts loop devices in /dev/block, a plain kernel in /dev
+	const char* formats[] = { "/dev/block/loop%d", "/dev/loop%d" };
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		char path[64];
+		snprintf(path, sizeof(path), formats[i], number);
+		int fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd >= 0) {
+			*device = path;
+			return fd;
+		}
+	}
+	return -1;
+}
+
+bool twrpSnapshot::Mount(const std::string& Block_Device, const std::string& Name) {
+	struct loop_info64 info;
+	std::string loop_device;
+
+	if (held_mount_point.empty() || !mount_path.empty())
+		return !mount_path.empty();
+
+	int backing_fd = open(Block_Device.c_str(), O_RDONLY | O_CLOEXEC);
+	if (backing_fd < 0) {
+		LOGINFO("Unable to open '%s' for the snapshot: %s\n", Block_Device.c_str(), strerror(errno));
+		return false;
+	}
+	loop_fd = Open_Loop(&loop_device);
+	if (loop_fd < 0 || ioctl(loop_fd, LOOP_SET_FD, backing_fd) != 0) {
+		LOGINFO("Unable to set up a loop device for the snapshot: %s\n", strerror(errno));
+		close(backing_fd);
+		Release();
+		return false;
+	}
+	close(backing_fd);
+	memset(&info, 0, sizeof(info));
+	info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR;
+	strncpy((char*) info.lo_file_name, Block_Device.c_str(), LO_NAME_SIZE - 1);
+	if (ioctl(loop_fd, LOOP_SET_STATUS64, &info) != 0)
+		LOGINFO("Unable to set the loop device of the snapshot read only: %s\n", strerror(errno));
+	// Reads then skip the page cache of the loop device, nothing in it can be older than the blocks
+	ioctl(loop_fd, LOOP_SET_DIRECT_IO, 1);
+
+	std::string path = std::string(SNAPSHOT_FOLDER) + "/" + Name;
+	mkdir(SNAPSHOT_FOLDER, 0700);
+	mkdir(path.c_str(), 0700);
+	// norecovery skips the roll forward of what was fsynced after the checkpoint
+	if (mount(loop_device.c_str(), path.c_str(), "f2fs", MS_RDONLY | MS_NOSUID | MS_NODEV | MS_NOATIME, "norecovery") != 0) {
+		LOGINFO("Unable to mount the snapshot of '%s': %s\n", held_mount_point.c_str(), strerror(errno));
+		rmdir(path.c_str());
+		Release();
+		return false;
+	}
+	mount_path = path;
+	LOGINFO("Snapshot of '%s' mounted on '%s' from %s\n", held_mount_point.c_str(), mount_path.c_str(), loop_device.c_str());
+	return true;
+}
+
+void twrpSnapshot::Release() {
+	if (!mount_path.empty()) {
+		if (umount(mount_path.c_str()) != 0) {
+			LOGINFO("Unable to unmount the snapshot '%s': %s\n", mount_path.c_str(), strerror(errno));
+			umount2(mount_path.c_str(), MNT_DETACH);
+		}
+		rmdir(mount_path.c_str());
+		mount_path.clear();
+	}
+	if (loop_fd >= 0) {
+		close(loop_fd);
+		loop_fd = -1;
+	}
+	if (!held_mount_point.empty()) {
+		// Turning checkpoints back on writes one of everything since Hold
+		if (!Remount(held_mount_point, "checkpoint=enable"))
+			LOGERR("Unable to turn the checkpoints of '%s' back on, reboot to have them back\n", held_mount_point.c_str());
+		held_mount_point.clear();
+	}
+}
+
+bool twrpSnapshot::Enter(const std::string& Snapshot_Path, const std::string& Mount_Point, const std::string& Keep_Live) {
+	if (unshare(CLONE_NEWNS) != 0) {
+		LOGINFO("Unable to unshare the mount namespace: %s\n", strerror(errno));
+		return false;
+	}
+	// Nothing done in this namespace may reach the recovery's mounts
+	if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+		LOGINFO("Unable to make the mounts private: %s\n", strerror(errno));
+		return false;
+	}
+	// The live folder goes on its own place in the snapshot first and comes along with it
+	if (Keep_Live.compare(0, Mount_Point.size() + 1, Mount_Point + "/") == 0) {
+		std::string inside = Snapshot_Path + Keep_Live.substr(Mount_Point.size());
+		if (mount(Keep_Live.c_str(), inside.c_str(), NULL, MS_BIND, NULL) != 0) {
+			LOGINFO("Unable to keep '%s' live in the snapshot: %s\n", Keep_Live.c_str(), strerror(errno));
+			return false;
+		}
+	}
+	if (mount(Snapshot_Path.c_str(), Mount_Point.c_str(), NULL, MS_BIND | MS_REC, NULL) != 0) {
+		LOGINFO("Unable to bind the snapshot over '%s': %s\n", Mount_Point.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,62 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPSNAPSHOT_HPP
+#define __TWRPSNAPSHOT_HPP
+
+#include <string>
+
+#define SNAPSHOT_FOLDER "/tmp/snapshots"                                        // Snapshots are mounted in folders named after the partition here
+
+// Point in time view of a mounted f2fs file system, so backups can run while
+// MTP and adb keep writing to it. Hold remounts the file system with
+// checkpoint=disable, after which f2fs never overwrites a block the last
+// checkpoint still uses, so the block device keeps the file system exactly
+// as it was at that checkpoint. Images read the block device as usual.
+// Mount makes the checkpointed file system readable as files, read only from
+// a loop device over the same block device, and Enter binds it over the real
+// mount point for a forked tar only, so the paths it archives don't change.
+// A backup folder on the same file system stays live for the tar to write to.
+// Release unmounts and turns checkpoints back on.
+// ext4 keeps no such state, and a dm-snapshot needs the writes of the mounted
+// file system to pass through device mapper, so only f2fs is supported.
+class twrpSnapshot
+{
+public:
+	twrpSnapshot();
+	~twrpSnapshot();                                                           // Releases whatever is still held
+	static bool Supported(const std::string& File_System);
+	bool Hold(const std::string& Mount_Point);                                 // Syncs and stops the checkpoints of the file system at Mount_Point
+	bool Mount(const std::string& Block_Device, const std::string& Name);      // Mounts the held state in SNAPSHOT_FOLDER/Name, after Hold
+	void Release();
+	const std::string& Path() { return mount_path; }                           // Where Mount put the snapshot, empty before
+	static bool Enter(const std::string& Snapshot_Path, const std::string& Mount_Point, const std::string& Keep_Live);  // In a fork, shows the snapshot at Mount_Point to this process only, except for Keep_Live below it
+
+private:
+	twrpSnapshot(const twrpSnapshot&);
+	twrpSnapshot& operator=(const twrpSnapshot&);
+
+	static bool Remount(const std::string& Mount_Point, const char* options);  // Keeps the flags the file system is mounted with
+	int Open_Loop(std::string *device);
+
+	std::string held_mount_point;                                              // Has checkpoint=disable, empty if nothing is held
+	std::string mount_path;
+	int loop_fd;                                                               // Kept open, the loop device clears itself once it is closed and unmounted
+};
+
+#endif // __TWRPSNAPSHOT_HPP
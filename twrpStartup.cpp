@@ -0,0 +1,111 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <time.h>
+#include "twrpStartup.hpp"
+#include "twrpWorkPool.hpp"
+#include "twrpTrace.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+
+twrpStartup::twrpStartup() {
+	remaining = 0;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+twrpStartup::~twrpStartup() {
+	pthread_mutex_destroy(&lock);
+	pthread_cond_destroy(&cond);
+}
+
+int twrpStartup::Add(const char *Name, Stage_Func func, void *cookie) {
+	Stage stage;
+
+	stage.name = Name;
+	stage.func = func;
+	stage.cookie = cookie;
+	stage.waiting = 0;
+	stages.push_back(stage);
+	return stages.size() - 1;
+}
+
+void twrpStartup::Depends(int Stage, int On) {
+	if (On >= Stage) {
+		LOGERR("Startup stage %s can not wait for %s, it was added later\n", stages[Stage].name, stages[On].name);
+		return;
+	}
+	stages[On].next.push_back(Stage);
+	stages[Stage].waiting++;
+}
+
+void twrpStartup::Execute(Stage *stage) {
+	timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	{
+		twrpTraceScope trace("startup", stage->name);
+		stage->func(stage->cookie);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	LOGINFO("Startup stage %s took %d ms\n", stage->name, TWFunc::timespec_diff_ms(start, end));
+}
+
+void twrpStartup::Run_Stage(void *owner, void *job) {
+	twrpStartup *startup = (twrpStartup*) owner;
+	Stage *stage = (Stage*) job;
+
+	startup->Execute(stage);
+	pthread_mutex_lock(&startup->lock);
+	startup->Finished(stage);
+	pthread_mutex_unlock(&startup->lock);
+}
+
+void twrpStartup::Finished(Stage *stage) {
+	for (size_t i = 0; i < stage->next.size(); i++) {
+		Stage *next = &stages[stage->next[i]];
+		if (--next->waiting == 0)
+			twrpWorkPool::Submit(this, Run_Stage, next);
+	}
+	remaining--;
+	pthread_cond_broadcast(&cond);
+}
+
+void twrpStartup::Run() {
+	timespec start, end;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!twrpWorkPool::Start()) {
+		for (i = 0; i < stages.size(); i++)
+			Execute(&stages[i]);
+	} else {
+		pthread_mutex_lock(&lock);
+		remaining = stages.size();
+		for (i = 0; i < stages.size(); i++) {
+			if (stages[i].waiting == 0)
+				twrpWorkPool::Submit(this, Run_Stage, &stages[i]);
+		}
+		while (remaining > 0)
+			pthread_cond_wait(&cond, &lock);
+		pthread_mutex_unlock(&lock);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	LOGINFO("Startup stages done in %d ms\n", TWFunc::timespec_diff_ms(start, end));
+}
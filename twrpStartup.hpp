@@ -0,0 +1,60 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPSTARTUP_HPP
+#define __TWRPSTARTUP_HPP
+
+#include <pthread.h>
+#include <vector>
+
+// The stages of startup and what each of them has to wait for. Stages whose
+// dependencies are done run side by side on the work pool, every stage is
+// traced in the "startup" category and its time is logged. Dependencies must
+// be added before the stages that need them, so without a pool the stages
+// simply run one after the other in the order they were added.
+class twrpStartup
+{
+public:
+	typedef void (*Stage_Func)(void *cookie);
+
+	twrpStartup();
+	~twrpStartup();
+	int Add(const char *Name, Stage_Func func, void *cookie);                 // Name must be a string literal, returns the stage for Depends()
+	void Depends(int Stage, int On);                                           // Stage starts once On is done
+	void Run();                                                                // Returns when every stage is done
+
+private:
+	struct Stage {
+		const char *name;
+		Stage_Func func;
+		void *cookie;
+		std::vector<int> next;                                             // stages that depend on this one
+		unsigned waiting;                                                  // dependencies not done yet
+	};
+
+	static void Run_Stage(void *owner, void *job);
+	void Execute(Stage *stage);
+	void Finished(Stage *stage);                                               // Called with lock held, submits the stages that were waiting for it
+
+	std::vector<Stage> stages;
+	unsigned remaining;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+#endif // __TWRPSTARTUP_HPP
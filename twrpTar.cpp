@@ -32,12 +32,15 @@ extern "C" {
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <fnmatch.h>
 #include <vector>
+#include <algorithm>
 #include <csignal>
 #include <dirent.h>
 #include <libgen.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <zlib.h>
 #include <semaphore.h>
 #include "twrpTar.hpp"
@@ -47,17 +50,24 @@ extern "C" {
 #include "twrp-functions.hpp"
 #include "gui/gui.hpp"
 #include "progresstracking.hpp"
+#include "twrpTarStream.hpp"
+#include "twrpManifest.hpp"
+#include "twrpTarIndex.hpp"
 #ifndef BUILD_TWRPTAR_MAIN
 #include "data.hpp"
 #include "infomanager.hpp"
 #include "set_metadata.h"
+#include "twrpBackupMeta.hpp"
+#include "twrpDigestDriver.hpp"
 #endif //ndef BUILD_TWRPTAR_MAIN
+#include "twrpTrace.hpp"
+#include "twrpMemory.hpp"
 
 #ifdef TW_INCLUDE_FBE
 #include "crypto/ext4crypt/ext4crypt_tar.h"
-#define TWTAR_FLAGS TAR_GNU | TAR_STORE_SELINUX | TAR_STORE_POSIX_CAP | TAR_STORE_ANDROID_USER_XATTR |TAR_STORE_EXT4_POL
+#define TWTAR_FLAGS TAR_GNU | TAR_STORE_SELINUX | TAR_STORE_POSIX_CAP | TAR_STORE_ANDROID_USER_XATTR |TAR_STORE_EXT4_POL | TAR_STORE_XDICT
 #else
-#define TWTAR_FLAGS TAR_GNU | TAR_STORE_SELINUX | TAR_STORE_POSIX_CAP | TAR_STORE_ANDROID_USER_XATTR
+#define TWTAR_FLAGS TAR_GNU | TAR_STORE_SELINUX | TAR_STORE_POSIX_CAP | TAR_STORE_ANDROID_USER_XATTR | TAR_STORE_XDICT
 #endif
 
 using namespace std;
@@ -66,25 +76,48 @@ twrpTar::twrpTar(void) {
 	use_encryption = 0;
 	userdata_encryption = 0;
 	use_compression = 0;
+	use_lz4 = 0;
 	split_archives = 0;
-	pigz_pid = 0;
-	oaes_pid = 0;
+	stream_threads = 0;
+	link_count = 0;
 	Total_Backup_Size = 0;
+	restore_file_count = 0;
 	Archive_Current_Size = 0;
 	include_root_dir = true;
 	tar_type.openfunc = open;
 	tar_type.closefunc = close;
 	tar_type.readfunc = read;
 	input_fd = -1;
+	progress_slot = NULL;
 	output_fd = -1;
 	backup_exclusions = NULL;
+	ItemList = NULL;
+	work_queue = NULL;
+	archive_digest = NULL;
+	archive_digest_sha2 = false;
+	incremental = 0;
+	manifest = NULL;
+	use_dedup = 0;
+	max_threads = 0;
+	split_size = MAX_ARCHIVE_SIZE;
+	chunks = NULL;
+	extract_writers = TAR_EXTRACT_WRITERS;
+	index = NULL;
+	seekable = false;
+	planned = false;
+	archive_threads = 1;
+	use_snapshot = 0;
 #ifdef TW_INCLUDE_FBE
 	e4crypt_set_mode();
 #endif
 }
 
 twrpTar::~twrpTar(void) {
-	// Do nothing
+	twrpMemory::Add(MEMORY_TAR_LISTS, -(int64_t)(file_list.capacity() * sizeof(TarListStruct)));
+	delete archive_digest;
+	delete manifest;
+	delete chunks;
+	delete index;
 }
 
 void twrpTar::setfn(string fn) {
@@ -111,11 +144,166 @@ void twrpTar::Set_Archive_Type(Archive_Type archive_type) {
 	current_archive_type = archive_type;
 }
 
+Tar_Stream_Codec twrpTar::Get_Stream_Codec() {
+	if (!use_compression)
+		return TAR_STREAM_PLAIN;
+	// LZ4 is not used for encrypted backups since they can't flag it
+	if (use_lz4 && !use_encryption) {
+		if (twrpTarStream::Codec_Available(TAR_STREAM_LZ4))
+			return TAR_STREAM_LZ4;
+		LOGINFO("LZ4 is not available in this build, using gzip\n");
+	}
+	return TAR_STREAM_GZIP;
+}
+
+#ifndef BUILD_TWRPTAR_MAIN
+void twrpTar::Read_Sample(const string& Path, std::vector<unsigned char> *sample) {
+	DIR *d;
+	struct dirent *de;
+
+	d = opendir(Path.c_str());
+	if (d == NULL)
+		return;
+	while ((de = readdir(d)) != NULL && sample->size() < TAR_ADB_SAMPLE_BYTES) {
+		string FileName = Path + "/" + de->d_name;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 || backup_exclusions->check_skip_name(Path, de->d_name))
+			continue;
+		if (de->d_type == DT_DIR) {
+			Read_Sample(FileName, sample);
+		} else if (de->d_type == DT_REG) {
+			int file_fd = open(FileName.c_str(), O_RDONLY);
+			if (file_fd < 0)
+				continue;
+			size_t start = sample->size();
+			sample->resize(start + std::min((size_t) TAR_ADB_SAMPLE_FILE_BYTES, TAR_ADB_SAMPLE_BYTES - start));
+			ssize_t len = read(file_fd, sample->data() + start, sample->size() - start);
+			sample->resize(start + (len > 0 ? len : 0));
+			close(file_fd);
+		}
+	}
+	closedir(d);
+}
+
+/*
+The device compresses for the host, so compressing only pays off when the
+link is the slower part. The codecs are tried on a sample of the files on one
+thread, across the cores that gives how fast each one could feed the link.
+The link rate is what twrpback measured for the earlier files of this backup.
+gzip and LZ4 are compared by how much of the partition reaches the host each
+second, sending raw wins ties and data that barely compresses.
+*/
+void twrpTar::Select_Adb_Codec() {
+	std::vector<unsigned char> sample;
+	Tar_Stream_Codec codecs[] = { TAR_STREAM_GZIP, TAR_STREAM_LZ4 };
+	Tar_Stream_Codec best = TAR_STREAM_PLAIN;
+	double link, best_rate, speed, ratio;
+	unsigned threads = stream_threads;
+
+	if (threads == 0)
+		threads = twrpWorkPool::CPU_Count();
+	link = twadbbu::Get_Link_Rate();
+	if (link <= 0)
+		link = TAR_ADB_LINK_RATE;
+	best_rate = link * TAR_ADB_MIN_GAIN;
+
+	Read_Sample(tardir, &sample);
+	for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]) && use_encryption == 0; i++) {
+		if (!twrpTarStream::Measure_Codec(codecs[i], sample, &speed, &ratio))
+			continue;
+		double rate = std::min(speed * threads, link / ratio);
+		LOGINFO("adb codec %i on %s: %.1f MB/s per thread, ratio %.2f, %.1f MB/s over %.1f MB/s link\n", codecs[i], tardir.c_str(), speed / 1048576, ratio, rate / 1048576, link / 1048576);
+		if (ratio <= TAR_ADB_MAX_RATIO && rate > best_rate) {
+			best = codecs[i];
+			best_rate = rate;
+		}
+	}
+	use_compression = (best != TAR_STREAM_PLAIN);
+	use_lz4 = (best == TAR_STREAM_LZ4);
+	if (best == TAR_STREAM_LZ4)
+		gui_msg(Msg("adb_codec_lz4=Sending {1} with LZ4 compression")(partition_name));
+	else if (best == TAR_STREAM_GZIP)
+		gui_msg(Msg("adb_codec_gzip=Sending {1} with gzip compression")(partition_name));
+	else
+		gui_msg(Msg("adb_codec_none=Sending {1} uncompressed")(partition_name));
+}
+#endif //ndef BUILD_TWRPTAR_MAIN
+
+Archive_Type twrpTar::Get_Archive_Type(const string& filename) {
+#ifndef BUILD_TWRPTAR_MAIN
+	return twrpChunkStore::Get_File_Type(filename);
+#else
+	return TWFunc::Get_File_Type(filename);
+#endif
+}
+
+bool twrpTar::Finish_Chunks() {
+	bool ret;
+
+	if (chunks == NULL)
+		return true;
+	ret = chunks->Finish();
+	delete chunks;
+	chunks = NULL;
+	if (!ret)
+		LOGINFO("Chunk store failed for '%s'\n", tarfn.c_str());
+	return ret;
+}
+
+static struct tar_progress* Map_Progress() {
+	// Shared with the tar fork, the pages start out zeroed
+	void *progress = mmap(NULL, sizeof(struct tar_progress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (progress == MAP_FAILED)
+		return NULL;
+	return (struct tar_progress*) progress;
+}
+
+static void Set_Progress_Totals(struct tar_progress *progress, unsigned long long count, unsigned long long size) {
+	progress->file_count = count;
+	progress->total_size = size;
+	__atomic_store_n(&progress->ready, 1, __ATOMIC_RELEASE);
+}
+
+void twrpTar::Track_Progress(pid_t pid, struct tar_progress *progress, bool count_files, unsigned long long *size, unsigned long long *files) {
+	siginfo_t info;
+	uint64_t bytes = 0, count = 0;
+	bool totals_set = false, exited;
+	int ret;
+
+	// Poll the counters until the child exits, WNOWAIT leaves it for Wait_For_Child to reap
+	for (;;) {
+		memset(&info, 0, sizeof(info));
+		ret = waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT);
+		exited = (ret == 0 && info.si_pid == pid) || (ret != 0 && errno != EINTR);
+		if (count_files && !totals_set && __atomic_load_n(&progress->ready, __ATOMIC_ACQUIRE)) {
+			unsigned long long file_total = progress->file_count;
+			if (file_total == 0)
+				file_total = 1; // prevent division by 0 in the file progress
+			part_settings->progress->SetSizeCount(progress->total_size, file_total);
+			totals_set = true;
+		}
+		tar_progress_sum(progress, &bytes, &count);
+		if (!count_files)
+			part_settings->progress->UpdateSize(bytes);
+		else if (totals_set)
+			part_settings->progress->UpdateSizeCount(bytes, count);
+		if (exited)
+			break;
+		usleep(PROGRESS_UPDATE_INTERVAL_MS * 1000);
+	}
+	*size = bytes;
+	*files = count;
+}
+
 int twrpTar::createTarFork(pid_t *tar_fork_pid) {
+	twrpTraceScope trace("tar", "createTarFork");
 	int status = 0;
-	int progress_pipe[2];
+	struct tar_progress *progress;
 
-	file_count = 0;
+	if (!planned)
+		file_count = 0;
+	link_count = 0;
 	if (backup_exclusions == NULL) {
 		LOGINFO("backup_exclusions is NULL\n");
 		return -1;
@@ -124,30 +312,37 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 #ifndef BUILD_TWRPTAR_MAIN
 	if (part_settings->adbbackup) {
 		std::string Backup_FileName(tarfn);
-		if (!twadbbu::Write_TWFN(Backup_FileName, Total_Backup_Size, use_compression))
+		if (!twadbbu::Write_TWFN(Backup_FileName, Total_Backup_Size, Get_Stream_Codec(), part_settings->adb_stream))
 			return -1;
 	}
 #endif
 
-	if (pipe(progress_pipe) < 0) {
-		LOGINFO("Error creating progress tracking pipe\n");
+	progress = Map_Progress();
+	if (progress == NULL) {
+		LOGINFO("Error creating progress tracking block\n");
 		gui_err("backup_error=Error creating backup.");
 		return -1;
 	}
+	// Lists Plan made stay in the parent and are counted there, whatever the fork adds is not
+	int64_t parent_lists = twrpMemory::Get(MEMORY_TAR_LISTS);
 	if ((*tar_fork_pid = fork()) == -1) {
 		LOGINFO("create tar failed to fork.\n");
 		gui_err("backup_error=Error creating backup.");
-		close(progress_pipe[0]);
-		close(progress_pipe[1]);
+		munmap(progress, sizeof(struct tar_progress));
 		return -1;
 	}
 
 	if (*tar_fork_pid == 0) {
 		// Child process
-		// Child closes input side of progress pipe
 		signal(SIGUSR2, twrpTar::Signal_Kill);
-		close(progress_pipe[0]);
-		progress_pipe_fd = progress_pipe[1];
+
+		if (!snapshot_dir.empty() && !twrpSnapshot::Enter(snapshot_dir, tardir, backup_folder))
+			gui_msg(Msg(msg::kWarning, "snapshot_enter_fail=Unable to use the snapshot, backing up the live file system"));
+
+		if (incremental && !part_settings->adbbackup && Open_Manifest() != 0) {
+			gui_err("backup_error=Error creating backup.");
+			_exit(-1);
+		}
 
 		if (use_encryption || userdata_encryption) {
 			LOGINFO("Using encryption\n");
@@ -155,27 +350,25 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 			struct dirent* de;
 			unsigned long long regular_size = 0, encrypt_size = 0, target_size = 0, total_size;
 			unsigned enc_thread_id = 1, regular_thread_id = 0, i, start_thread_id = 1, core_count = 1;
-			int item_len, ret, thread_error = 0;
+			int item_len, ret;
 			std::vector<TarListStruct> RegularList;
 			std::vector<TarListStruct> EncryptList;
 			string FileName;
 			struct TarListStruct TarItem;
-			twrpTar reg, enc[9];
+			twrpTar reg, enc[TAR_MAX_ARCHIVE_THREADS + 1];
 			struct stat st;
-			pthread_t enc_thread[9];
-			pthread_attr_t tattr;
-			void *thread_return;
 
-			core_count = sysconf(_SC_NPROCESSORS_CONF);
-			if (core_count > 8)
-				core_count = 8;
+			core_count = twrpWorkPool::CPU_Count();
+			if (max_threads)
+				core_count = max_threads;
+			if (core_count > TAR_MAX_ARCHIVE_THREADS)
+				core_count = TAR_MAX_ARCHIVE_THREADS;
 			LOGINFO("   Core Count      : %u\n", core_count);
 			Archive_Current_Size = 0;
 
 			d = opendir(tardir.c_str());
 			if (d == NULL) {
 				gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tardir)(strerror(errno)));
-				close(progress_pipe[1]);
 				_exit(-1);
 			}
 			// Figure out the size of all data to be encrypted and create a list of unencrypted files
@@ -192,14 +385,12 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 							LOGINFO("Error in Generate_TarList with regular list!\n");
 							gui_err("backup_error=Error creating backup.");
 							closedir(d);
-							close(progress_pipe_fd);
-							close(progress_pipe[1]);
 							_exit(-1);
 						}
 						file_count = (unsigned long long)(ret);
-						regular_size += backup_exclusions->Get_Folder_Size(FileName);
+						regular_size += backup_exclusions->Get_Cached_Folder_Size(FileName);
 					} else {
-						encrypt_size += backup_exclusions->Get_Folder_Size(FileName);
+						encrypt_size += backup_exclusions->Get_Cached_Folder_Size(FileName);
 					}
 				} else if (de->d_type == DT_REG) {
 					stat(FileName.c_str(), &st);
@@ -223,7 +414,6 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 			d = opendir(tardir.c_str());
 			if (d == NULL) {
 				gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tardir)(strerror(errno)));
-				close(progress_pipe[1]);
 				_exit(-1);
 			}
 			// Divide up the encrypted file list for threading
@@ -232,6 +422,17 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 
 				if (de->d_type == DT_BLK || de->d_type == DT_CHR || backup_exclusions->check_skip_dirs(FileName))
 					continue;
+				if (manifest != NULL && (de->d_type == DT_DIR || de->d_type == DT_REG || de->d_type == DT_LNK)) {
+					lstat(FileName.c_str(), &st);
+					ret = manifest->Add_Entry(FileName, &st);
+					if (ret < 0) {
+						gui_err("backup_error=Error creating backup.");
+						closedir(d);
+						_exit(-1);
+					}
+					if (ret == 0)
+						continue; // unchanged since the base backup
+				}
 				if (de->d_type == DT_DIR) {
 					item_len = strlen(de->d_name);
 					if (userdata_encryption && ((item_len >= 3 && strncmp(de->d_name, "app", 3) == 0) || (item_len >= 6 && strncmp(de->d_name, "dalvik", 6) == 0))) {
@@ -243,7 +444,6 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 							LOGINFO("Error in Generate_TarList with encrypted list!\n");
 							gui_err("backup_error=Error creating backup.");
 							closedir(d);
-							close(progress_pipe[1]);
 							_exit(-1);
 						}
 						file_count += (unsigned long long)(ret);
@@ -252,29 +452,32 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 					stat(FileName.c_str(), &st);
 					if (de->d_type == DT_REG)
 						Archive_Current_Size += (unsigned long long)(st.st_size);
-					TarItem.fn = FileName;
+					TarItem.fn = list_paths.Add(FileName.c_str(), FileName.size());
+					if (TarItem.fn == NULL) {
+						gui_err("backup_error=Error creating backup.");
+						closedir(d);
+						_exit(-1);
+					}
 					TarItem.thread_id = enc_thread_id;
+					TarItem.size = (de->d_type == DT_REG) ? (unsigned long long)(st.st_size) : 0;
 					EncryptList.push_back(TarItem);
 					file_count++;
 				}
 			}
 			closedir(d);
-			if (enc_thread_id != core_count) {
-				LOGINFO("Error dividing up threads for encryption, %u threads for %u cores!\n", enc_thread_id, core_count);
-				if (enc_thread_id > core_count) {
+			Balance_TarList(&EncryptList, start_thread_id, core_count);
+
+			// Tell the parent the file count and backup size
+			total_size = regular_size + encrypt_size;
+			if (manifest != NULL) {
+				if (!manifest->Close(tarfn + MANIFEST_DELETED_EXTENSION)) {
 					gui_err("backup_error=Error creating backup.");
-					close(progress_pipe[1]);
 					_exit(-1);
-				} else {
-					LOGINFO("Continuining anyway.");
 				}
+				if (manifest->Has_Base())
+					total_size = List_Size(&RegularList) + List_Size(&EncryptList);
 			}
-
-			// Send file count to parent
-			write(progress_pipe_fd, &file_count, sizeof(file_count));
-			// Send backup size to parent
-			total_size = regular_size + encrypt_size;
-			write(progress_pipe_fd, &total_size, sizeof(total_size));
+			Set_Progress_Totals(progress, file_count, total_size);
 
 			if (userdata_encryption) {
 				// Create a backup of unencrypted data
@@ -283,175 +486,116 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 				reg.thread_id = 0;
 				reg.use_encryption = 0;
 				reg.use_compression = use_compression;
+				reg.use_lz4 = use_lz4;
+				reg.use_dedup = use_dedup;
 				reg.split_archives = 1;
-				reg.progress_pipe_fd = progress_pipe_fd;
+				reg.split_size = split_size;
+				reg.progress_slot = &progress->slot[0];
 				reg.part_settings = part_settings;
 				LOGINFO("Creating unencrypted backup...\n");
 				if (createList((void*)&reg) != 0) {
 					LOGINFO("Error creating unencrypted backup.\n");
 					gui_err("backup_error=Error creating backup.");
-					close(progress_pipe[1]);
 					_exit(-1);
 				}
 			}
 
-			if (pthread_attr_init(&tattr)) {
-				LOGINFO("Unable to pthread_attr_init\n");
-				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
-				_exit(-1);
-			}
-			if (pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_JOINABLE)) {
-				LOGINFO("Error setting pthread_attr_setdetachstate\n");
-				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
-				_exit(-1);
-			}
-			if (pthread_attr_setscope(&tattr, PTHREAD_SCOPE_SYSTEM)) {
-				LOGINFO("Error setting pthread_attr_setscope\n");
-				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
-				_exit(-1);
-			}
-			/*if (pthread_attr_setstacksize(&tattr, 524288)) {
-				LOGERR("Error setting pthread_attr_setstacksize\n");
-				_exit(-1);
-			}*/
-
-			// Create threads for the divided up encryption lists
+			// Set up the archive threads for the divided up encryption lists
+			twrpTarQueue EncryptQueue(&EncryptList, start_thread_id, core_count);
+			unsigned stream_share = (twrpWorkPool::CPU_Count() + core_count - start_thread_id) / (core_count - start_thread_id + 1);
 			for (i = start_thread_id; i <= core_count; i++) {
 				enc[i].setdir(tardir);
 				enc[i].setfn(tarfn);
 				enc[i].ItemList = &EncryptList;
+				enc[i].work_queue = &EncryptQueue;
 				enc[i].thread_id = i;
 				enc[i].use_encryption = use_encryption;
 				enc[i].setpassword(password);
 				enc[i].use_compression = use_compression;
+				enc[i].use_lz4 = use_lz4;
+				enc[i].use_dedup = use_dedup;
+				enc[i].stream_threads = stream_share; // jobs queued on the shared pool
 				enc[i].split_archives = 1;
-				enc[i].progress_pipe_fd = progress_pipe_fd;
+				enc[i].split_size = split_size;
+				enc[i].progress_slot = &progress->slot[i % TAR_PROGRESS_SLOTS];
 				enc[i].part_settings = part_settings;
-				LOGINFO("Start encryption thread %i\n", i);
-				ret = pthread_create(&enc_thread[i], &tattr, createList, (void*)&enc[i]);
-				if (ret) {
-					LOGINFO("Unable to create %i thread for encryption! %i\nContinuing in same thread (backup will be slower).\n", i, ret);
-					if (createList((void*)&enc[i]) != 0) {
-						LOGINFO("Error creating encrypted backup %i.\n", i);
-						gui_err("backup_error=Error creating backup.");
-						close(progress_pipe[1]);
-						_exit(-1);
-					} else {
-						enc[i].thread_id = i + 1;
-					}
-				}
-				usleep(100000); // Need a short delay before starting the next thread or the threads will never finish for some reason.
-			}
-			if (pthread_attr_destroy(&tattr)) {
-				LOGINFO("Failed to pthread_attr_destroy\n");
-			}
-			for (i = start_thread_id; i <= core_count; i++) {
-				if (enc[i].thread_id == i) {
-					if (pthread_join(enc_thread[i], &thread_return)) {
-						LOGINFO("Error joining thread %i\n", i);
-						gui_err("backup_error=Error creating backup.");
-						close(progress_pipe[1]);
-						_exit(-1);
-					} else {
-						LOGINFO("Joined thread %i.\n", i);
-						ret = (int)(intptr_t)thread_return;
-						if (ret != 0) {
-							thread_error = 1;
-							LOGINFO("Thread %i returned an error %i.\n", i, ret);
-							gui_err("backup_error=Error creating backup.");
-							close(progress_pipe[1]);
-							_exit(-1);
-						}
-					}
-				} else {
-					LOGINFO("Skipping joining thread %i because of pthread failure.\n", i);
-				}
 			}
-			if (thread_error) {
-				LOGINFO("Error returned by one or more threads.\n");
+			if (createListThreads(enc, start_thread_id, core_count) != 0) {
 				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
 				_exit(-1);
 			}
 			LOGINFO("Finished encrypted backup.\n");
-			close(progress_pipe[1]);
 			_exit(0);
 		} else {
 			// Not encrypted
-			std::vector<TarListStruct> FileList;
-			unsigned thread_id = 0;
-			unsigned long long target_size = 0;
-			twrpTar reg;
-			int ret;
-
-			// Generate list of files to back up
-			ret = Generate_TarList(tardir, &FileList, &target_size, &thread_id);
-			if (ret < 0) {
-				LOGINFO("Error in Generate_TarList!\n");
+			unsigned thread_count, i;
+			twrpTar reg, tars[TAR_MAX_ARCHIVE_THREADS];
+
+			// Plan already listed the files before the fork
+			if (!planned && List_Files(false) != 0) {
 				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
 				_exit(-1);
 			}
-			file_count = (unsigned long long)(ret);
+			thread_count = archive_threads;
+			LOGINFO("Creating backup...\n");
+			Set_Progress_Totals(progress, file_count, Total_Backup_Size);
+
+			if (thread_count > 1) {
+				LOGINFO("Using %u archive threads\n", thread_count);
+				twrpTarQueue FileQueue(&file_list, 0, thread_count - 1);
+				for (i = 0; i < thread_count; i++) {
+					tars[i].setfn(tarfn);
+					tars[i].ItemList = &file_list;
+					tars[i].work_queue = &FileQueue;
+					tars[i].thread_id = i;
+					tars[i].use_encryption = 0;
+					tars[i].use_compression = use_compression;
+					tars[i].use_lz4 = use_lz4;
+					tars[i].use_dedup = use_dedup;
+					tars[i].stream_threads = (twrpWorkPool::CPU_Count() + thread_count - 1) / thread_count; // jobs queued on the shared pool
+					tars[i].split_archives = 1;
+					tars[i].split_size = split_size;
+					tars[i].progress_slot = &progress->slot[i % TAR_PROGRESS_SLOTS];
+					tars[i].part_settings = part_settings;
+				}
+				if (createListThreads(tars, 0, thread_count - 1) != 0) {
+					gui_err("backup_error=Error creating backup.");
+					_exit(-1);
+				}
+				_exit(0);
+			}
+
 			// Create a backup
 			reg.setfn(tarfn);
-			reg.ItemList = &FileList;
+			reg.ItemList = &file_list;
 			reg.thread_id = 0;
 			reg.use_encryption = 0;
 			reg.use_compression = use_compression;
+			reg.use_lz4 = use_lz4;
+			reg.use_dedup = use_dedup;
 			reg.setsize(Total_Backup_Size);
-			reg.progress_pipe_fd = progress_pipe_fd;
+			reg.stream_threads = max_threads;
+			reg.split_size = split_size;
+			reg.progress_slot = &progress->slot[0];
 			reg.part_settings = part_settings;
-			if (Total_Backup_Size > MAX_ARCHIVE_SIZE && !part_settings->adbbackup) {
+			if (Total_Backup_Size > split_size && !part_settings->adbbackup) {
 				gui_msg("split_backup=Breaking backup file into multiple archives...");
 				reg.split_archives = 1;
 			} else {
 				reg.split_archives = 0;
 			}
-			LOGINFO("Creating backup...\n");
-			write(progress_pipe_fd, &file_count, sizeof(file_count));
-			write(progress_pipe_fd, &Total_Backup_Size, sizeof(Total_Backup_Size));
 			if (createList((void*)&reg) != 0) {
 				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
 				_exit(-1);
 			}
-			close(progress_pipe[1]);
 			_exit(0);
 		}
 	} else {
 		// Parent side
-		unsigned long long fs, size_backup = 0, files_backup = 0, file_count = 0;
-		int first_data = 0;
-
-		// Parent closes output side
-		close(progress_pipe[1]);
-
-		// Read progress data from children
-		while (read(progress_pipe[0], &fs, sizeof(fs)) > 0) {
-			if (first_data == 0) {
-				// First incoming data is the file count
-				file_count = fs;
-				if (file_count == 0) file_count = 1; // prevent division by 0 below
-				first_data = 1;
-			} else if (first_data == 1) {
-				// Second incoming data is total size
-				first_data = 2;
-				part_settings->progress->SetSizeCount(fs, file_count);
-			} else {
-				if (fs > 0) {
-					size_backup += fs;
-					part_settings->progress->UpdateSize(size_backup);
-				} else { // fs == 0 increments the file counter
-					files_backup++;
-					part_settings->progress->UpdateSizeCount(size_backup, files_backup);
-				}
-			}
-		}
-		close(progress_pipe[0]);
+		unsigned long long size_backup = 0, files_backup = 0;
+
+		Track_Progress(*tar_fork_pid, progress, true, &size_backup, &files_backup);
+		munmap(progress, sizeof(struct tar_progress));
 #ifndef BUILD_TWRPTAR_MAIN
 		DataManager::SetValue("tw_file_progress", "");
 		DataManager::SetValue("tw_size_progress", "");
@@ -459,44 +603,60 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 		part_settings->progress->UpdateDisplayDetails(true);
 
 		if (!part_settings->adbbackup) {
-			InfoManager backup_info(backup_folder + "/" + partition_name + ".info");
-			backup_info.SetValue("backup_size", size_backup);
+			int backup_type;
+			char info[128];
 			if (use_compression && use_encryption)
-				backup_info.SetValue("backup_type", COMPRESSED_ENCRYPTED);
+				backup_type = COMPRESSED_ENCRYPTED;
 			else if (use_encryption)
-				backup_info.SetValue("backup_type", ENCRYPTED);
+				backup_type = ENCRYPTED;
+			else if (Get_Stream_Codec() == TAR_STREAM_LZ4)
+				backup_type = COMPRESSED_LZ4;
 			else if (use_compression)
-				backup_info.SetValue("backup_type", COMPRESSED);
+				backup_type = COMPRESSED;
 			else
-				backup_info.SetValue("backup_type", UNCOMPRESSED);
-			backup_info.SetValue("file_count", files_backup);
-			backup_info.SaveValues();
+				backup_type = UNCOMPRESSED;
+			snprintf(info, sizeof(info), "backup_size=%llu\nbackup_type=%d\nfile_count=%llu\n", size_backup, backup_type, files_backup);
+			if (!twrpBackupMeta::Add(backup_folder, BACKUP_META_INFO, partition_name, info)) {
+				InfoManager backup_info(backup_folder + "/" + partition_name + ".info");
+				backup_info.SetValue("backup_size", size_backup);
+				backup_info.SetValue("backup_type", backup_type);
+				backup_info.SetValue("file_count", files_backup);
+				backup_info.SaveValues();
+			}
 		}
 #endif //ndef BUILD_TWRPTAR_MAIN
-		if (TWFunc::Wait_For_Child(*tar_fork_pid, &status, "createTarFork()") != 0)
+		int child_ret = TWFunc::Wait_For_Child(*tar_fork_pid, &status, "createTarFork()");
+		// The fork exits without running the destructors that take its lists off the counter
+		twrpMemory::Set(MEMORY_TAR_LISTS, parent_lists);
+		if (child_ret != 0)
 			return -1;
 	}
 	return 0;
 }
 
 int twrpTar::extractTarFork() {
+	twrpTraceScope trace("tar", "extractTarFork");
 	int status = 0;
 	pid_t tar_fork_pid;
-	int progress_pipe[2];
+	struct tar_progress *progress;
 
-	if (pipe(progress_pipe) < 0) {
-		LOGINFO("Error creating progress tracking pipe\n");
+	progress = Map_Progress();
+	if (progress == NULL) {
+		LOGINFO("Error creating progress tracking block\n");
 		gui_err("restore_error=Error during restore process.");
 		return -1;
 	}
+	// With the totals known up front the restore shows files as well as bytes
+	if (restore_file_count > 0)
+		Set_Progress_Totals(progress, restore_file_count, Total_Backup_Size);
 
 	tar_fork_pid = fork();
 	if (tar_fork_pid >= 0) // fork was successful
 	{
 		if (tar_fork_pid == 0) // child process
 		{
-			close(progress_pipe[0]);
-			progress_pipe_fd = progress_pipe[1];
+			progress_slot = &progress->slot[0];
+			stream_threads = max_threads;
 			if (TWFunc::Path_Exists(tarfn) || part_settings->adbbackup) {
 				LOGINFO("Single archive\n");
 				if (extract() != 0)
@@ -506,214 +666,364 @@ int twrpTar::extractTarFork() {
 				}
 			} else {
 				LOGINFO("Multiple archives\n");
-				string temp;
-				char actual_filename[255];
-				twrpTar tars[9];
-				pthread_t tar_thread[9];
-				pthread_attr_t tattr;
-				unsigned thread_count = 0, i, start_thread_id = 1;
-				int ret, thread_error = 0;
-				void *thread_return;
-
 				basefn = tarfn;
-				temp = basefn + "%i%02i";
-				tarfn += "000";
-				if (!TWFunc::Path_Exists(tarfn)) {
-					LOGINFO("Unable to locate '%s' or '%s'\n", basefn.c_str(), tarfn.c_str());
-					gui_err("restore_error=Error during restore process.");
-					close(progress_pipe_fd);
-					_exit(-1);
-				}
-				if (TWFunc::Get_File_Type(tarfn) != 2) {
-					LOGINFO("First tar file '%s' not encrypted\n", tarfn.c_str());
-					tars[0].basefn = basefn;
-					tars[0].thread_id = 0;
-					tars[0].progress_pipe_fd = progress_pipe_fd;
-					tars[0].part_settings = part_settings;
-					if (extractMulti((void*)&tars[0]) != 0) {
-						LOGINFO("Error extracting split archive.\n");
-						gui_err("restore_error=Error during restore process.");
-						close(progress_pipe_fd);
-						_exit(-1);
-					}
-				} else {
-					start_thread_id = 0;
-				}
-				// Start threading encrypted restores
-				if (pthread_attr_init(&tattr)) {
-					LOGINFO("Unable to pthread_attr_init\n");
-					gui_err("restore_error=Error during restore process.");
-					close(progress_pipe_fd);
-					_exit(-1);
-				}
-				if (pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_JOINABLE)) {
-					LOGINFO("Error setting pthread_attr_setdetachstate\n");
-					gui_err("restore_error=Error during restore process.");
-					close(progress_pipe_fd);
-					_exit(-1);
-				}
-				if (pthread_attr_setscope(&tattr, PTHREAD_SCOPE_SYSTEM)) {
-					LOGINFO("Error setting pthread_attr_setscope\n");
-					gui_err("restore_error=Error during restore process.");
-					close(progress_pipe_fd);
-					_exit(-1);
-				}
-				/*if (pthread_attr_setstacksize(&tattr, 524288)) {
-					LOGERR("Error setting pthread_attr_setstacksize\n");
-					close(progress_pipe_fd);
-					_exit(-1);
-				}*/
-				for (i = start_thread_id; i < 9; i++) {
-					sprintf(actual_filename, temp.c_str(), i, 0);
-					if (TWFunc::Path_Exists(actual_filename)) {
-						thread_count++;
-						tars[i].basefn = basefn;
-						tars[i].setpassword(password);
-						tars[i].thread_id = i;
-						tars[i].progress_pipe_fd = progress_pipe_fd;
-						tars[i].part_settings = part_settings;
-						LOGINFO("Creating extract thread ID %i\n", i);
-						ret = pthread_create(&tar_thread[i], &tattr, extractMulti, (void*)&tars[i]);
-						if (ret) {
-							LOGINFO("Unable to create %i thread for extraction! %i\nContinuing in same thread (restore will be slower).\n", i, ret);
-							if (extractMulti((void*)&tars[i]) != 0) {
-								LOGINFO("Error extracting backup in thread %i.\n", i);
-								gui_err("restore_error=Error during restore process.");
-								close(progress_pipe_fd);
-								_exit(-1);
-							} else {
-								tars[i].thread_id = i + 1;
-							}
-						}
-						usleep(100000); // Need a short delay before starting the next thread or the threads will never finish for some reason.
-					} else {
-						break;
-					}
-				}
-				for (i = start_thread_id; i < thread_count + start_thread_id; i++) {
-					if (tars[i].thread_id == i) {
-						if (pthread_join(tar_thread[i], &thread_return)) {
-							LOGINFO("Error joining thread %i\n", i);
-							gui_err("restore_error=Error during restore process.");
-							close(progress_pipe_fd);
-							_exit(-1);
-						} else {
-							LOGINFO("Joined thread %i.\n", i);
-							ret = (int)(intptr_t)thread_return;
-							if (ret != 0) {
-								thread_error = 1;
-								LOGINFO("Thread %i returned an error %i.\n", i, ret);
-								gui_err("restore_error=Error during restore process.");
-								close(progress_pipe_fd);
-								_exit(-1);
-							}
-						}
-					} else {
-						LOGINFO("Skipping joining thread %i because of pthread failure.\n", i);
-					}
-				}
-				if (thread_error) {
-					LOGINFO("Error returned by one or more threads.\n");
+				if (extractArchives(progress) != 0) {
 					gui_err("restore_error=Error during restore process.");
-					close(progress_pipe_fd);
 					_exit(-1);
 				}
-				LOGINFO("Finished encrypted restore.\n");
-				close(progress_pipe_fd);
+				LOGINFO("Finished multiple archive restore.\n");
 				_exit(0);
 			}
 		}
 		else // parent process
 		{
-			unsigned long long fs, size_backup = 0;
-
-			// Parent closes output side
-			close(progress_pipe[1]);
+			unsigned long long size_backup = 0, files_backup = 0;
 
-			// Read progress data from children
-			while (read(progress_pipe[0], &fs, sizeof(fs)) > 0) {
-				size_backup += fs;
-				part_settings->progress->UpdateSize(size_backup);
-			}
-			close(progress_pipe[0]);
+			Track_Progress(tar_fork_pid, progress, restore_file_count > 0, &size_backup, &files_backup);
+			munmap(progress, sizeof(struct tar_progress));
 			part_settings->progress->UpdateDisplayDetails(true);
 
-			if (TWFunc::Wait_For_Child(tar_fork_pid, &status, "extractTarFork()") != 0)
+			int child_ret = TWFunc::Wait_For_Child(tar_fork_pid, &status, "extractTarFork()");
+			twrpMemory::Set(MEMORY_TAR_LISTS, 0);
+			if (child_ret != 0)
 				return -1;
 		}
 	}
 	else // fork has failed
 	{
-		close(progress_pipe[0]);
-		close(progress_pipe[1]);
+		munmap(progress, sizeof(struct tar_progress));
 		LOGINFO("extract tar failed to fork.\n");
 		return -1;
 	}
 	return 0;
 }
 
+// State of one Generate_TarList walk, shared by the directories it recurses into
+struct tar_list_walk {
+	std::vector<TarListStruct> *list;
+	unsigned long long *target_size;
+	unsigned *thread_id;
+	string path;                                                                    // path of the current entry, built up in place
+	std::vector<char*> dents;                                                       // one getdents64 buffer per directory level
+};
+
 int twrpTar::Generate_TarList(string Path, std::vector<TarListStruct> *TarList, unsigned long long *Target_Size, unsigned *thread_id) {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
-	string FileName;
-	struct TarListStruct TarItem;
-	int ret, file_count;
-	file_count = 0;
+	struct tar_list_walk walk;
+	int dir_fd, ret;
 
-	d = opendir(Path.c_str());
-	if (d == NULL) {
+	dir_fd = open(Path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
 		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
-		closedir(d);
 		return -1;
 	}
-	while ((de = readdir(d)) != NULL) {
-		FileName = Path + "/" + de->d_name;
+	walk.list = TarList;
+	walk.target_size = Target_Size;
+	walk.thread_id = thread_id;
+	walk.path = Path;
+	size_t capacity = TarList->capacity();
+	ret = Generate_TarList_Dir(&walk, dir_fd, 0);
+	close(dir_fd);
+	twrpMemory::Add(MEMORY_TAR_LISTS, (int64_t)(TarList->capacity() - capacity) * sizeof(TarListStruct));
+	for (size_t i = 0; i < walk.dents.size(); i++)
+		free(walk.dents[i]);
+	return ret;
+}
 
-		if (de->d_type == DT_BLK || de->d_type == DT_CHR || backup_exclusions->check_skip_dirs(FileName))
-			continue;
-		TarItem.fn = FileName;
-		TarItem.thread_id = *thread_id;
-		if (de->d_type == DT_DIR) {
-			TarList->push_back(TarItem);
-			ret = Generate_TarList(FileName, TarList, Target_Size, thread_id);
-			if (ret < 0)
-				return -1;
-			file_count += ret;
-		} else if (de->d_type == DT_REG || de->d_type == DT_LNK) {
-			stat(FileName.c_str(), &st);
-			TarList->push_back(TarItem);
-			if (de->d_type == DT_REG) {
-				file_count++;
-				Archive_Current_Size += st.st_size;
+// Lists the directory walk->path, open as dir_fd, and everything below it. The
+// entries are read with getdents64 and stat'ed relative to dir_fd, so the kernel
+// does not resolve the full path of every file again.
+int twrpTar::Generate_TarList_Dir(struct tar_list_walk *walk, int dir_fd, unsigned depth) {
+	struct dirent64* de;
+	struct stat st;
+	struct TarListStruct TarItem;
+	size_t base_len = walk->path.size();
+	int ret, sub_fd, file_count = 0;
+	char* dents;
+	long len, pos;
+
+	if (walk->dents.size() <= depth) {
+		dents = (char*)malloc(TAR_LIST_DENTS_SIZE);
+		if (dents == NULL)
+			return -1;
+		walk->dents.push_back(dents);
+	}
+	dents = walk->dents[depth];
+
+	while ((len = syscall(__NR_getdents64, dir_fd, dents, TAR_LIST_DENTS_SIZE)) > 0) {
+		for (pos = 0; pos < len; pos += de->d_reclen) {
+			de = (struct dirent64*)(dents + pos);
+			walk->path.resize(base_len);
+			walk->path += '/';
+			walk->path += de->d_name;
+
+			if (de->d_type == DT_BLK || de->d_type == DT_CHR || backup_exclusions->check_skip_dirs(walk->path))
+				continue;
+			TarItem.thread_id = *walk->thread_id;
+			TarItem.size = 0;
+			if (manifest != NULL && (de->d_type == DT_DIR || de->d_type == DT_REG || de->d_type == DT_LNK)) {
+				if (fstatat(dir_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+					memset(&st, 0, sizeof(st));
+				ret = manifest->Add_Entry(walk->path, &st);
+				if (ret < 0)
+					return -1;
+				if (ret == 0)
+					continue; // unchanged since the base backup
 			}
-			if (Archive_Current_Size != 0 && *Target_Size != 0 && Archive_Current_Size > *Target_Size) {
-				*thread_id = *thread_id + 1;
-				Archive_Current_Size = 0;
+			if (de->d_type == DT_DIR) {
+				TarItem.fn = list_paths.Add(walk->path.c_str(), walk->path.size());
+				if (TarItem.fn == NULL)
+					return -1;
+				walk->list->push_back(TarItem);
+				sub_fd = openat(dir_fd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				if (sub_fd < 0) {
+					gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(walk->path)(strerror(errno)));
+					return -1;
+				}
+				ret = Generate_TarList_Dir(walk, sub_fd, depth + 1);
+				close(sub_fd);
+				if (ret < 0)
+					return -1;
+				file_count += ret;
+			} else if (de->d_type == DT_REG || de->d_type == DT_LNK) {
+				if (manifest == NULL && de->d_type == DT_REG && fstatat(dir_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+					memset(&st, 0, sizeof(st));
+				TarItem.fn = list_paths.Add(walk->path.c_str(), walk->path.size());
+				if (TarItem.fn == NULL)
+					return -1;
+				if (de->d_type == DT_REG)
+					TarItem.size = (unsigned long long)(st.st_size);
+				walk->list->push_back(TarItem);
+				if (de->d_type == DT_REG) {
+					file_count++;
+					if (st.st_nlink > 1)
+						link_count++;
+					Archive_Current_Size += st.st_size;
+				}
+				if (Archive_Current_Size != 0 && *walk->target_size != 0 && Archive_Current_Size > *walk->target_size) {
+					*walk->thread_id = *walk->thread_id + 1;
+					Archive_Current_Size = 0;
+				}
 			}
 		}
 	}
-	closedir(d);
+	if (len < 0) {
+		walk->path.resize(base_len);
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(walk->path)(strerror(errno)));
+		return -1;
+	}
 	return file_count;
 }
 
+int twrpTar::Open_Manifest() {
+	string archive_name = TWFunc::Get_Filename(tarfn), base_name;
+
+	manifest = new twrpManifest();
+	if (!incremental_base.empty()) {
+		if (manifest->Load(incremental_base + "/" + archive_name + MANIFEST_EXTENSION)) {
+			base_name = TWFunc::Get_Filename(incremental_base);
+			gui_msg(Msg("incremental_backup=Backing up changes since {1}")(base_name));
+		} else {
+			LOGINFO("Unable to use '%s' as base, making a full backup\n", incremental_base.c_str());
+		}
+	}
+	if (!manifest->Create(tarfn + MANIFEST_EXTENSION, base_name))
+		return -1;
+	return 0;
+}
+
+// Spreads a file list over the archive threads first_thread to last_thread.
+// Consecutive entries of one directory are kept together in a unit, and a
+// unit is capped so it stays a small share of a thread's data. Files above
+// the cap are units of their own. The units go largest first to the thread
+// with the least data so far, so a few big files or one huge directory no
+// longer leave one archive much larger than the others. Every thread still
+// gets its entries in list order.
+void twrpTar::Balance_TarList(std::vector<TarListStruct> *TarList, unsigned first_thread, unsigned last_thread) {
+	struct balance_unit {
+		size_t first, end;
+		unsigned long long weight;
+		bool operator<(const balance_unit& other) const { return weight > other.weight; }
+	};
+	std::vector<balance_unit> units;
+	std::vector<unsigned long long> loads(last_thread - first_thread + 1, 0);
+	unsigned long long total = 0, cap, weight;
+	const char *dir, *prev_dir = NULL;
+	size_t i, j, dir_len, prev_len = 0;
+	unsigned thread;
+
+	for (i = 0; i < TarList->size(); i++)
+		total += TarList->at(i).size + TAR_BALANCE_ENTRY_COST;
+	cap = total / (loads.size() * TAR_BALANCE_UNITS);
+	if (cap < TAR_BALANCE_MIN_UNIT)
+		cap = TAR_BALANCE_MIN_UNIT;
+
+	for (i = 0; i < TarList->size(); i++) {
+		weight = TarList->at(i).size + TAR_BALANCE_ENTRY_COST;
+		dir = TarList->at(i).fn;
+		dir_len = strrchr(dir, '/') != NULL ? strrchr(dir, '/') - dir : 0;
+		if (units.empty() || weight > cap || units.back().weight + weight > cap
+			|| dir_len != prev_len || memcmp(dir, prev_dir, dir_len) != 0) {
+			balance_unit unit = { i, i, 0 };
+			units.push_back(unit);
+		}
+		units.back().end = i + 1;
+		units.back().weight += weight;
+		prev_dir = dir;
+		prev_len = dir_len;
+	}
+
+	std::stable_sort(units.begin(), units.end());
+	for (i = 0; i < units.size(); i++) {
+		thread = 0;
+		for (j = 1; j < loads.size(); j++) {
+			if (loads[j] < loads[thread])
+				thread = j;
+		}
+		loads[thread] += units[i].weight;
+		for (j = units[i].first; j < units[i].end; j++)
+			TarList->at(j).thread_id = first_thread + thread;
+	}
+	for (i = 0; i < loads.size(); i++)
+		LOGINFO("   Thread %u: %llu bytes\n", first_thread + (unsigned)i, loads[i]);
+}
+
+unsigned long long twrpTar::List_Size(std::vector<TarListStruct> *TarList) {
+	unsigned long long size = 0;
+
+	for (size_t i = 0; i < TarList->size(); i++)
+		size += TarList->at(i).size;
+	return size;
+}
+
+// One archive thread per core as long as each thread has enough data to be
+// worth it. adb backups are a single stream.
+unsigned twrpTar::Archive_Threads() {
+	unsigned thread_count = 1;
+
+	if (!part_settings->adbbackup) {
+		thread_count = twrpWorkPool::CPU_Count();
+		if (thread_count > Total_Backup_Size / MIN_THREAD_ARCHIVE_SIZE)
+			thread_count = Total_Backup_Size / MIN_THREAD_ARCHIVE_SIZE;
+		if (max_threads)
+			thread_count = max_threads;
+		if (thread_count > TAR_MAX_ARCHIVE_THREADS)
+			thread_count = TAR_MAX_ARCHIVE_THREADS;
+		if (thread_count < 1)
+			thread_count = 1;
+	}
+	return thread_count;
+}
+
+// Lists everything a backup that is not encrypted archives and spreads it
+// over the archive threads. With exact_size the threads follow the listed
+// size instead of the estimate from setsize.
+int twrpTar::List_Files(bool exact_size) {
+	unsigned thread_id = 0;
+	unsigned long long target_size = 0;
+	int ret;
+
+	Archive_Current_Size = 0;
+	ret = Generate_TarList(tardir, &file_list, &target_size, &thread_id);
+	if (ret < 0) {
+		LOGINFO("Error in Generate_TarList!\n");
+		return -1;
+	}
+	file_count = (unsigned long long)(ret);
+	if (manifest != NULL) {
+		if (!manifest->Close(tarfn + MANIFEST_DELETED_EXTENSION))
+			return -1;
+		if (manifest->Has_Base())
+			exact_size = true;
+	}
+	if (exact_size)
+		Total_Backup_Size = List_Size(&file_list);
+	archive_threads = Archive_Threads();
+	if (archive_threads > 1)
+		Balance_TarList(&file_list, 0, archive_threads - 1);
+	return 0;
+}
+
+int twrpTar::Plan() {
+	// Encrypted backups split the folder into several lists and incremental
+	// ones filter it through the manifest, both only in the fork. A snapshot
+	// is only taken when the backup of the partition starts.
+	if (use_encryption || userdata_encryption || incremental || use_snapshot)
+		return -1;
+	if (List_Files(true) != 0) {
+		file_list.clear(); // the fork starts over
+		return -1;
+	}
+	planned = true;
+	return 0;
+}
+
+unsigned twrpTar::Planned_Archives() {
+	std::vector<unsigned long long> thread_bytes(archive_threads, 0);
+	unsigned archives = 0;
+
+	for (size_t i = 0; i < file_list.size(); i++)
+		thread_bytes[file_list[i].thread_id % archive_threads] += file_list[i].size;
+	for (size_t i = 0; i < thread_bytes.size(); i++) {
+		// A single thread only splits when the whole backup is too large, and adb never
+		if (part_settings->adbbackup || (archive_threads == 1 && Total_Backup_Size <= split_size))
+			archives++;
+		else
+			archives += 1 + (thread_bytes[i] ? (unsigned)((thread_bytes[i] - 1) / split_size) : 0);
+	}
+	return archives;
+}
+
+string twrpTar::Codec_Name() {
+	string name;
+
+	switch (Get_Stream_Codec()) {
+		case TAR_STREAM_GZIP:
+			name = "gzip";
+			break;
+		case TAR_STREAM_LZ4:
+			name = "lz4";
+			break;
+		default:
+			name = "none";
+			break;
+	}
+	if (use_encryption || userdata_encryption)
+		name += "+aes";
+	return name;
+}
+
 int twrpTar::extractTar() {
 	char* charRootDir = (char*) tardir.c_str();
+#ifndef BUILD_TWRPTAR_MAIN
+	if (part_settings->verify_digest && !part_settings->adbbackup) {
+		// Hash the archive while it is extracted instead of reading it twice
+		archive_digest = twrpDigestDriver::New_Restore_Digest(tarfn, &archive_expected_digest, &archive_digest_sha2);
+		if (archive_digest == NULL)
+			return -1;
+	}
+#endif
 	if (openTar() == -1)
 		return -1;
-	if (tar_extract_all(t, charRootDir, &progress_pipe_fd) != 0) {
+	if (tar_extract_all_batched(t, charRootDir, progress_slot, extract_writers) != 0) {
 		LOGINFO("Unable to extract tar archive '%s'\n", tarfn.c_str());
 		gui_err("restore_error=Error during restore process.");
 		return -1;
 	}
-	if (tar_close(t) != 0) {
+	if (tar_close(t) != 0 || !Finish_Chunks()) {
 		LOGINFO("Unable to close tar file\n");
 		gui_err("restore_error=Error during restore process.");
 		return -1;
 	}
 #ifndef BUILD_TWRPTAR_MAIN
+	if (archive_digest != NULL) {
+		bool digest_ok = twrpDigestDriver::Compare_Digest(tarfn, archive_digest, archive_expected_digest, archive_digest_sha2);
+		delete archive_digest;
+		archive_digest = NULL;
+		if (!digest_ok)
+			return -1;
+	}
 	if (part_settings->adbbackup) {
-		if (!twadbbu::Write_TWEOF())
+		if (!twadbbu::Write_TWEOF(part_settings->adb_stream))
 			return -1;
 	}
 #endif
@@ -723,10 +1033,12 @@ int twrpTar::extractTar() {
 int twrpTar::extract() {
 	if (!part_settings->adbbackup)  {
 		LOGINFO("Setting archive type\n");
-		Set_Archive_Type(TWFunc::Get_File_Type(tarfn));
+		Set_Archive_Type(Get_Archive_Type(tarfn));
 	}
 	else {
-		if (part_settings->adb_compression == 1) 
+		if (part_settings->adb_compression == ADB_CODEC_LZ4)
+			current_archive_type = COMPRESSED_LZ4;
+		else if (part_settings->adb_compression == ADB_CODEC_GZIP)
 			current_archive_type = COMPRESSED;
 		else
 			current_archive_type = UNCOMPRESSED;
@@ -737,6 +1049,9 @@ int twrpTar::extract() {
 		LOGINFO("Extracting gzipped tar\n");
 		int ret = extractTar();
 		return ret;
+	} else if (current_archive_type == COMPRESSED_LZ4) {
+		LOGINFO("Extracting LZ4 compressed tar\n");
+		return extractTar();
 	} else if (current_archive_type == ENCRYPTED) {
 		int ret = TWFunc::Try_Decrypting_File(tarfn, password);
 		if (ret < 1) {
@@ -763,16 +1078,18 @@ int twrpTar::extract() {
 int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 	struct stat st;
 	char buf[PATH_MAX];
-	int list_size = TarList->size(), i = 0, archive_count = 0;
-	string temp;
-	char actual_filename[PATH_MAX];
+	int archive_count = 0;
+	size_t i;
 	unsigned long long fs;
+	twrpTarQueue own_queue(TarList, thread_id, thread_id);
+	twrpTarQueue *queue = (work_queue != NULL ? work_queue : &own_queue);
+	twrpTarPrefetch prefetch;
+	std::deque<size_t> ahead;
+	unsigned long long ahead_size = 0;
 
 	if (split_archives) {
 		basefn = tarfn;
-		temp = basefn + "%i%02i";
-		sprintf(actual_filename, temp.c_str(), thread_id, archive_count);
-		tarfn = actual_filename;
+		tarfn = Archive_Name(basefn, thread_id, archive_count);
 		include_root_dir = true;
 	} else {
 		include_root_dir = false;
@@ -790,46 +1107,53 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 	}
 	Archive_Current_Size = 0;
 
-	while (i < list_size) {
-		if (TarList->at(i).thread_id == thread_id) {
-			strcpy(buf, TarList->at(i).fn.c_str());
-			lstat(buf, &st);
-			if (S_ISREG(st.st_mode)) { // item is a regular file
-				fs = (unsigned long long)(st.st_size);
-				if (split_archives && Archive_Current_Size + fs > MAX_ARCHIVE_SIZE) {
-					if (closeTar() != 0) {
-						LOGINFO("Error closing '%s' on thread %i\n", tarfn.c_str(), thread_id);
-						gui_err("backup_error=Error creating backup.");
-						return -3;
-					}
-					archive_count++;
-					gui_msg(Msg("split_thread=Splitting thread ID {1} into archive {2}")(thread_id)(archive_count + 1));
-					if (archive_count > 99) {
-						LOGINFO("Too many archives for thread %i\n", thread_id);
-						gui_err("backup_error=Error creating backup.");
-						return -4;
-					}
-					sprintf(actual_filename, temp.c_str(), thread_id, archive_count);
-					tarfn = actual_filename;
-					if (createTar() != 0) {
-						LOGINFO("Error creating tar '%s' for thread %i\n", tarfn.c_str(), thread_id);
-						gui_err("backup_error=Error creating backup.");
-						return -2;
-					}
-					Archive_Current_Size = 0;
+	for (;;) {
+		// Claim a few items ahead so their reads are already queued when libtar gets to them
+		while (ahead.size() < TAR_PREFETCH_FILES && (ahead.empty() || ahead_size < TAR_PREFETCH_BYTES) && queue->Next(thread_id, &i)) {
+			ahead.push_back(i);
+			ahead_size += TarList->at(i).size;
+			prefetch.Add(TarList->at(i).fn, TarList->at(i).size);
+		}
+		if (ahead.empty())
+			break;
+		i = ahead.front();
+		ahead.pop_front();
+		ahead_size -= TarList->at(i).size;
+		prefetch.Consumed();
+		strcpy(buf, TarList->at(i).fn);
+		lstat(buf, &st);
+		if (S_ISREG(st.st_mode)) { // item is a regular file
+			fs = (unsigned long long)(st.st_size);
+			if (split_archives && Archive_Current_Size + fs > split_size) {
+				if (closeTar() != 0) {
+					LOGINFO("Error closing '%s' on thread %i\n", tarfn.c_str(), thread_id);
+					gui_err("backup_error=Error creating backup.");
+					return -3;
 				}
-				Archive_Current_Size += fs;
-				fs = 0; // Sending a 0 size to the pipe tells it to increment the file counter
-				write(progress_pipe_fd, &fs, sizeof(fs));
-			}
-			LOGINFO("addFile '%s' including root: %i\n", buf, include_root_dir);
-			if (addFile(buf, include_root_dir) != 0) {
-				LOGINFO("Error adding file '%s' to '%s'\n", buf, tarfn.c_str());
-				gui_err("backup_error=Error creating backup.");
-				return -1;
+				archive_count++;
+				gui_msg(Msg("split_thread=Splitting thread ID {1} into archive {2}")(thread_id)(archive_count + 1));
+				if (archive_count >= TAR_MAX_SPLIT_ARCHIVES) {
+					LOGINFO("Too many archives for thread %i\n", thread_id);
+					gui_err("backup_error=Error creating backup.");
+					return -4;
+				}
+				tarfn = Archive_Name(basefn, thread_id, archive_count);
+				if (createTar() != 0) {
+					LOGINFO("Error creating tar '%s' for thread %i\n", tarfn.c_str(), thread_id);
+					gui_err("backup_error=Error creating backup.");
+					return -2;
+				}
+				Archive_Current_Size = 0;
 			}
+			Archive_Current_Size += fs;
+			tar_progress_add(progress_slot, 0, 1);
+		}
+		LOGINFO("addFile '%s' including root: %i\n", buf, include_root_dir);
+		if (addFile(buf, include_root_dir) != 0) {
+			LOGINFO("Error adding file '%s' to '%s'\n", buf, tarfn.c_str());
+			gui_err("backup_error=Error creating backup.");
+			return -1;
 		}
-		i++;
 	}
 	if (closeTar() != 0) {
 		LOGINFO("Error closing '%s' on thread %i\n", tarfn.c_str(), thread_id);
@@ -850,487 +1174,541 @@ void* twrpTar::createList(void *cookie) {
 	return (void*)0;
 }
 
-void* twrpTar::extractMulti(void *cookie) {
-	twrpTar* threadTar = (twrpTar*) cookie;
-	int archive_count = 0;
-	string temp = threadTar->basefn + "%i%02i";
-	char actual_filename[255];
-	sprintf(actual_filename, temp.c_str(), threadTar->thread_id, archive_count);
-	while (TWFunc::Path_Exists(actual_filename)) {
-		threadTar->tarfn = actual_filename;
-		if (threadTar->extract() != 0) {
-			LOGINFO("Error extracting '%s' in thread ID %i\n", actual_filename, threadTar->thread_id);
-			return (void*)-2;
-		}
-		archive_count++;
-		if (archive_count > 99)
-			break;
-		sprintf(actual_filename, temp.c_str(), threadTar->thread_id, archive_count);
-	}
-	LOGINFO("Thread ID %i finished successfully.\n", threadTar->thread_id);
-	return (void*)0;
-}
-
-int twrpTar::addFilesToExistingTar(vector <string> files, string fn) {
-	char* charTarFile = (char*) fn.c_str();
+int twrpTar::createListThreads(twrpTar *tars, unsigned first_thread, unsigned last_thread) {
+	pthread_t tar_thread[TAR_MAX_ARCHIVE_THREADS + 1];
+	pthread_attr_t tattr;
+	bool joinable[TAR_MAX_ARCHIVE_THREADS + 1];
+	void *thread_return;
+	unsigned i;
+	int ret, thread_error = 0;
 
-	if (tar_open(&t, charTarFile, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) == -1)
+	if (last_thread > TAR_MAX_ARCHIVE_THREADS) {
+		LOGINFO("Too many archive threads (%u)\n", last_thread + 1);
 		return -1;
-	removeEOT(charTarFile);
-	if (tar_open(&t, charTarFile, NULL, O_WRONLY | O_APPEND | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) == -1)
+	}
+	if (pthread_attr_init(&tattr)) {
+		LOGINFO("Unable to pthread_attr_init\n");
 		return -1;
-	for (unsigned int i = 0; i < files.size(); ++i) {
-		char* file = (char*) files.at(i).c_str();
-		if (tar_append_file(t, file, file) == -1)
-			return -1;
 	}
-	if (tar_append_eof(t) == -1)
+	if (pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_JOINABLE)) {
+		LOGINFO("Error setting pthread_attr_setdetachstate\n");
 		return -1;
-	if (tar_close(t) == -1)
+	}
+	if (pthread_attr_setscope(&tattr, PTHREAD_SCOPE_SYSTEM)) {
+		LOGINFO("Error setting pthread_attr_setscope\n");
+		return -1;
+	}
+	/*if (pthread_attr_setstacksize(&tattr, 524288)) {
+		LOGERR("Error setting pthread_attr_setstacksize\n");
+		return -1;
+	}*/
+
+	for (i = first_thread; i <= last_thread; i++) {
+		LOGINFO("Start archive thread %i\n", i);
+		ret = pthread_create(&tar_thread[i], &tattr, createList, (void*)&tars[i]);
+		joinable[i] = (ret == 0);
+		if (ret) {
+			LOGINFO("Unable to create %i thread for backup! %i\nContinuing in same thread (backup will be slower).\n", i, ret);
+			if (createList((void*)&tars[i]) != 0) {
+				LOGINFO("Error creating backup in thread %i.\n", i);
+				return -1;
+			}
+		}
+		usleep(100000); // Need a short delay before starting the next thread or the threads will never finish for some reason.
+	}
+	if (pthread_attr_destroy(&tattr)) {
+		LOGINFO("Failed to pthread_attr_destroy\n");
+	}
+	for (i = first_thread; i <= last_thread; i++) {
+		if (!joinable[i]) {
+			LOGINFO("Skipping joining thread %i because of pthread failure.\n", i);
+			continue;
+		}
+		if (pthread_join(tar_thread[i], &thread_return)) {
+			LOGINFO("Error joining thread %i\n", i);
+			return -1;
+		}
+		LOGINFO("Joined thread %i.\n", i);
+		ret = (int)(intptr_t)thread_return;
+		if (ret != 0) {
+			thread_error = 1;
+			LOGINFO("Thread %i returned an error %i.\n", i, ret);
+		}
+	}
+	if (thread_error) {
+		LOGINFO("Error returned by one or more threads.\n");
 		return -1;
+	}
 	return 0;
 }
 
-int twrpTar::createTar() {
-	char* charTarFile = (char*) tarfn.c_str();
-	char* charRootDir = (char*) tardir.c_str();
+twrpTarPaths::twrpTarPaths() {
+	used = TAR_LIST_PATH_BLOCK;
+	allocated = 0;
+}
 
-	if (use_encryption && use_compression) {
-		// Compressed and encrypted
-		current_archive_type = COMPRESSED_ENCRYPTED;
-		LOGINFO("Using encryption and compression...\n");
-		int i, pipes[4];
+twrpTarPaths::~twrpTarPaths() {
+	for (size_t i = 0; i < blocks.size(); i++)
+		free(blocks[i]);
+	twrpMemory::Add(MEMORY_TAR_LISTS, -(int64_t)allocated);
+}
 
-		if (pipe(pipes) < 0) {
-			LOGINFO("Error creating first pipe\n");
-			gui_err("backup_error=Error creating backup.");
-			return -1;
-		}
-		if (pipe(pipes + 2) < 0) {
-			LOGINFO("Error creating second pipe\n");
-			gui_err("backup_error=Error creating backup.");
-			return -1;
+const char* twrpTarPaths::Add(const char* path, size_t len) {
+	char* block;
+
+	if (used + len + 1 > TAR_LIST_PATH_BLOCK) {
+		// Paths longer than a block get a block of their own
+		size_t block_size = len + 1 > TAR_LIST_PATH_BLOCK ? len + 1 : TAR_LIST_PATH_BLOCK;
+		block = (char*)malloc(block_size);
+		if (block == NULL)
+			return NULL;
+		blocks.push_back(block);
+		used = 0;
+		allocated += block_size;
+		twrpMemory::Add(MEMORY_TAR_LISTS, block_size);
+	}
+	block = blocks.back() + used;
+	memcpy(block, path, len);
+	block[len] = '\0';
+	used += len + 1;
+	return block;
+}
+
+twrpTarQueue::twrpTarQueue(std::vector<TarListStruct> *TarList, unsigned first_thread, unsigned last_thread) {
+	List = TarList;
+	first_id = first_thread;
+	items.resize(last_thread - first_thread + 1);
+	remaining.resize(last_thread - first_thread + 1, 0);
+	for (size_t i = 0; i < List->size(); i++) {
+		unsigned id = List->at(i).thread_id;
+		if (id < first_thread || id > last_thread)
+			continue;
+		items[id - first_id].push_back(i);
+		remaining[id - first_id] += List->at(i).size;
+	}
+	pthread_mutex_init(&lock, NULL);
+}
+
+twrpTarQueue::~twrpTarQueue() {
+	pthread_mutex_destroy(&lock);
+}
+
+bool twrpTarQueue::Next(unsigned thread_id, size_t *index) {
+	size_t slot = thread_id - first_id, victim, i;
+
+	pthread_mutex_lock(&lock);
+	if (slot < items.size() && !items[slot].empty()) {
+		*index = items[slot].front();
+		items[slot].pop_front();
+	} else {
+		// Out of work, steal from the end of whichever thread has the most
+		// data queued. This follows the timing of the threads, so the
+		// archive a stolen file lands in is not the same from run to run.
+		victim = items.size();
+		for (i = 0; i < items.size(); i++) {
+			if (items[i].empty())
+				continue;
+			if (victim == items.size() || remaining[i] > remaining[victim])
+				victim = i;
 		}
-		output_fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-		if (output_fd < 0) {
-			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
-			for (i = 0; i < 4; i++)
-				close(pipes[i]); // close all
-			return -1;
+		if (victim == items.size()) {
+			pthread_mutex_unlock(&lock);
+			return false;
 		}
-		pigz_pid = fork();
+		slot = victim;
+		*index = items[slot].back();
+		items[slot].pop_back();
+	}
+	remaining[slot] -= List->at(*index).size;
+	pthread_mutex_unlock(&lock);
+	return true;
+}
 
-		if (pigz_pid < 0) {
-			LOGINFO("pigz fork() failed\n");
-			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			for (i = 0; i < 4; i++)
-				close(pipes[i]); // close all
-			return -1;
-		} else if (pigz_pid == 0) {
-			// pigz Child
-			close(pipes[1]);
-			close(pipes[2]);
-			int stdinfd = fileno(stdin);
-			int stdoutfd = fileno(stdout);
-			close(stdinfd);
-			dup2(pipes[0], stdinfd);
-			close(stdoutfd);
-			dup2(pipes[3], stdoutfd);
-			if (execlp("pigz", "pigz", "-", NULL) < 0) {
-				LOGINFO("execlp pigz ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				close(pipes[0]);
-				close(pipes[3]);
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			oaes_pid = fork();
+twrpTarPrefetch::twrpTarPrefetch() {
+	added = 0;
+	consumed = 0;
+	stop = false;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+	started = (pthread_create(&thread, NULL, Prefetch_Thread, this) == 0);
+	if (!started)
+		LOGINFO("Unable to start prefetch thread, files are read without it\n");
+}
 
-			if (oaes_pid < 0) {
-				LOGINFO("openaes fork() failed\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				for (i = 0; i < 4; i++)
-					close(pipes[i]); // close all
-				return -1;
-			} else if (oaes_pid == 0) {
-				// openaes Child
-				close(pipes[0]);
-				close(pipes[1]);
-				close(pipes[3]);
-				int stdinfd = fileno(stdin);
-				int stdoutfd = fileno(stdout);
-				close(stdinfd);
-				dup2(pipes[2], stdinfd);
-				close(stdoutfd);
-				dup2(output_fd, stdoutfd);
-				if (execlp("openaes", "openaes", "enc", "--key", password.c_str(), NULL) < 0) {
-					LOGINFO("execlp openaes ERROR!\n");
-					gui_err("backup_error=Error creating backup.");
-					close(pipes[2]);
-					close(output_fd);
-					_exit(-1);
-				}
-			} else {
-				// Parent
-				close(pipes[0]);
-				close(pipes[2]);
-				close(pipes[3]);
-				fd = pipes[1];
-				init_libtar_no_buffer(progress_pipe_fd);
-				tar_type.writefunc = write_tar_no_buffer;
-				if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-					close(fd);
-					LOGINFO("tar_fdopen failed\n");
-					gui_err("backup_error=Error creating backup.");
-					return -1;
-				}
-				return 0;
-			}
+twrpTarPrefetch::~twrpTarPrefetch() {
+	pthread_mutex_lock(&lock);
+	stop = true;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	if (started)
+		pthread_join(thread, NULL);
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void twrpTarPrefetch::Add(const std::string& path, unsigned long long size) {
+	Item item;
+
+	if (!started)
+		return;
+	item.path = path;
+	item.size = size;
+	pthread_mutex_lock(&lock);
+	item.seq = added++;
+	items.push_back(item);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpTarPrefetch::Consumed() {
+	pthread_mutex_lock(&lock);
+	consumed++;
+	pthread_mutex_unlock(&lock);
+}
+
+void* twrpTarPrefetch::Prefetch_Thread(void *cookie) {
+	twrpTarPrefetch *prefetch = (twrpTarPrefetch*)cookie;
+	struct stat st;
+	Item item;
+	int fd;
+
+	for (;;) {
+		pthread_mutex_lock(&prefetch->lock);
+		while (!prefetch->stop && prefetch->items.empty())
+			pthread_cond_wait(&prefetch->cond, &prefetch->lock);
+		if (prefetch->stop) {
+			pthread_mutex_unlock(&prefetch->lock);
+			break;
 		}
-	} else if (use_compression) {
-		// Compressed
-		current_archive_type = COMPRESSED;
-		LOGINFO("Using compression...\n");
-		int pigzfd[2];
-		if (part_settings->adbbackup) {
-			LOGINFO("opening TW_ADB_BACKUP compressed stream\n");
-			output_fd = open(TW_ADB_BACKUP, O_WRONLY);
+		item = prefetch->items.front();
+		prefetch->items.pop_front();
+		// Nothing is gained once libtar got to the file first
+		if (item.seq < prefetch->consumed) {
+			pthread_mutex_unlock(&prefetch->lock);
+			continue;
 		}
-		else {
-			output_fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		pthread_mutex_unlock(&prefetch->lock);
+
+		if (item.size == 0) {
+			// Folders and links only need their inode, libtar lstats them
+			lstat(item.path.c_str(), &st);
+			continue;
 		}
-		if (output_fd < 0) {
-			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
-			close(pigzfd[0]);
-			return -1;
+		fd = open(item.path.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		posix_fadvise(fd, 0, item.size < TAR_PREFETCH_FILE_BYTES ? item.size : TAR_PREFETCH_FILE_BYTES, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+	return NULL;
+}
+
+int twrpTar::extractArchives(struct tar_progress *progress) {
+	struct extract_pool_struct pool;
+	std::vector<std::vector<string> > threads = List_Archives(basefn);
+	pthread_t tar_thread[TAR_MAX_ARCHIVE_THREADS + 1];
+	unsigned worker_count, started = 0, i, archive_total = 0;
+
+	for (i = 0; i < threads.size(); i++) {
+#ifdef TW_INCLUDE_FBE
+		// Encryption policies can only be set on empty directories, so the split
+		// archives of one thread keep their order: each may hold the parents of
+		// the next one.
+		pool.groups.push_back(threads[i]);
+#else
+		// Split archives hold disjoint paths and hardlinks never cross an archive,
+		// each archive can be extracted on its own.
+		for (size_t j = 0; j < threads[i].size(); j++)
+			pool.groups.push_back(std::vector<std::string>(1, threads[i][j]));
+#endif
+		archive_total += threads[i].size();
+	}
+	if (archive_total == 0) {
+		LOGINFO("Unable to locate '%s' or '%s000'\n", basefn.c_str(), basefn.c_str());
+		return -1;
+	}
+
+	worker_count = twrpWorkPool::CPU_Count();
+	if (max_threads)
+		worker_count = max_threads;
+	if (worker_count > TAR_MAX_ARCHIVE_THREADS)
+		worker_count = TAR_MAX_ARCHIVE_THREADS;
+	if (worker_count > pool.groups.size())
+		worker_count = pool.groups.size();
+	if (worker_count < 1)
+		worker_count = 1;
+	LOGINFO("Extracting %u archives with %u threads\n", archive_total, worker_count);
+
+	pool.next = 0;
+	pool.error = 0;
+	pool.password = password;
+	pool.progress = progress;
+	pool.part_settings = part_settings;
+	pool.stream_threads = (twrpWorkPool::CPU_Count() + worker_count - 1) / worker_count;
+	pthread_mutex_init(&pool.lock, NULL);
+	for (i = 0; i < worker_count; i++) {
+		if (pthread_create(&tar_thread[i], NULL, extractMulti, (void*)&pool) != 0) {
+			LOGINFO("Unable to create extract thread %i, continuing with %i threads.\n", i, started);
+			break;
 		}
+		started++;
+	}
+	if (started == 0)
+		extractMulti((void*)&pool);
+	for (i = 0; i < started; i++) {
+		if (pthread_join(tar_thread[i], NULL)) {
+			LOGINFO("Error joining thread %i\n", i);
+			pool.error = 1;
+		}
+	}
+	pthread_mutex_destroy(&pool.lock);
+	if (pool.error) {
+		LOGINFO("Error returned by one or more threads.\n");
+		return -1;
+	}
+	return 0;
+}
 
-		if (pipe(pigzfd) < 0) {
-			LOGINFO("Error creating pipe\n");
-			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			return -1;
+void* twrpTar::extractMulti(void *cookie) {
+	struct extract_pool_struct *pool = (struct extract_pool_struct*) cookie;
+	size_t group, i;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->error || pool->next >= pool->groups.size()) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
 		}
-		pigz_pid = fork();
+		group = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		for (i = 0; i < pool->groups[group].size(); i++) {
+			twrpTar tar;
+			tar.setpassword(pool->password);
+			tar.progress_slot = &pool->progress->slot[group % TAR_PROGRESS_SLOTS];
+			tar.part_settings = pool->part_settings;
+			tar.tarfn = pool->groups[group][i];
+			tar.extract_writers = TAR_EXTRACT_WRITERS / 2; // the archives already run in parallel
+			tar.stream_threads = pool->stream_threads;
+			if (tar.extract() != 0) {
+				LOGINFO("Error extracting '%s'\n", tar.tarfn.c_str());
+				pthread_mutex_lock(&pool->lock);
+				pool->error = 1;
+				pthread_mutex_unlock(&pool->lock);
+				return (void*)-2;
+			}
+		}
+	}
+	return (void*)0;
+}
 
-		if (pigz_pid < 0) {
-			LOGINFO("fork() failed\n");
-			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			close(pigzfd[0]);
-			close(pigzfd[1]);
+int twrpTar::addFilesToExistingTar(vector <string> files, string fn) {
+	char* charTarFile = (char*) fn.c_str();
+
+	if (tar_open(&t, charTarFile, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) == -1)
+		return -1;
+	removeEOT(charTarFile);
+	if (tar_open(&t, charTarFile, NULL, O_WRONLY | O_APPEND | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) == -1)
+		return -1;
+	for (unsigned int i = 0; i < files.size(); ++i) {
+		char* file = (char*) files.at(i).c_str();
+		if (tar_append_file(t, file, file) == -1)
 			return -1;
-		} else if (pigz_pid == 0) {
-			// Child
-			close(pigzfd[1]);   // close unused output pipe
-			dup2(pigzfd[0], fileno(stdin)); // remap stdin
-			dup2(output_fd, fileno(stdout)); // remap stdout to output file
-			if (execlp("pigz", "pigz", "-", NULL) < 0) {
-				LOGINFO("execlp pigz ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				close(pigzfd[0]);
-				_exit(-1);
-			}
+	}
+	if (tar_append_eof(t) == -1)
+		return -1;
+	if (tar_close(t) == -1)
+		return -1;
+	return 0;
+}
+
+int twrpTar::createTar() {
+	char* charRootDir = (char*) tardir.c_str();
+
+	if (use_encryption || use_compression || !part_settings->adbbackup) {
+		twrpTarStream* stream;
+		string stream_password;
+		Tar_Stream_Codec codec = Get_Stream_Codec();
+
+		if (!use_encryption && !use_compression) {
+			current_archive_type = UNCOMPRESSED;
+		} else if (use_encryption && use_compression) {
+			current_archive_type = COMPRESSED_ENCRYPTED;
+			LOGINFO("Using encryption and compression...\n");
+		} else if (codec == TAR_STREAM_LZ4) {
+			current_archive_type = COMPRESSED_LZ4;
+			LOGINFO("Using LZ4 compression...\n");
+		} else if (use_compression) {
+			current_archive_type = COMPRESSED;
+			LOGINFO("Using compression...\n");
 		} else {
-			// Parent
-			close(pigzfd[0]); // close parent input
-			fd = pigzfd[1];   // copy parent output
-			init_libtar_no_buffer(progress_pipe_fd);
-			tar_type.writefunc = write_tar_no_buffer;
-			if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("backup_error=Error creating backup.");
+			current_archive_type = ENCRYPTED;
+			LOGINFO("Using encryption...\n");
+		}
+		if (use_encryption)
+			stream_password = password;
+
+		if (part_settings->adbbackup && !use_encryption) {
+			LOGINFO("opening TW_ADB_BACKUP compressed stream\n");
+			output_fd = open(twadbbu::Stream_Fifo(TW_ADB_BACKUP, part_settings->adb_stream).c_str(), O_WRONLY);
+#ifndef BUILD_TWRPTAR_MAIN
+		} else if (use_dedup && !use_encryption && twrpChunkStore::Available()) {
+			// Encrypted archives never share chunks, the same data is different every time
+			chunks = new twrpChunkStore();
+			output_fd = chunks->Open_Write(tarfn);
+			if (output_fd < 0) {
+				delete chunks;
+				chunks = NULL;
 				return -1;
 			}
+#endif
+		} else {
+			output_fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 		}
-	} else if (use_encryption) {
-		// Encrypted
-		current_archive_type = ENCRYPTED;
-		LOGINFO("Using encryption...\n");
-		int oaesfd[2];
-		output_fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 		if (output_fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
-		if (pipe(oaesfd) < 0) {
-			LOGINFO("Error creating pipe\n");
+
+		// Compression and encryption run in-process, libtar blocks go straight into the stream
+		stream = new twrpTarStream();
+		if (!stream->Open_Write(output_fd, codec, stream_password, stream_threads, progress_slot)) {
+			LOGINFO("Unable to set up compression / encryption stream\n");
 			gui_err("backup_error=Error creating backup.");
+			delete stream;
 			close(output_fd);
+			output_fd = -1;
+			Finish_Chunks();
 			return -1;
 		}
-		oaes_pid = fork();
-
-		if (oaes_pid < 0) {
-			LOGINFO("fork() failed\n");
+		delete index;
+		index = NULL;
+		if (!use_encryption && !part_settings->adbbackup) {
+			index = new twrpTarIndex();
+			stream->Set_Index(index);
+		}
+#ifndef BUILD_TWRPTAR_MAIN
+		if (part_settings->generate_digest && !part_settings->adbbackup) {
+			// Hash the archive on its way to disk instead of reading it back afterwards
+			archive_digest = twrpDigestDriver::New_Backup_Digest(&archive_digest_sha2);
+			stream->Set_Digest(archive_digest);
+		}
+#endif
+		fd = output_fd;
+		output_fd = -1; // the stream owns the fd now and closes it in tar_close()
+		tar_type.writefunc = tar_stream_write;
+		tar_type.closefunc = tar_stream_close;
+		if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+			tar_stream_close(fd);
+			Finish_Chunks();
+			LOGINFO("tar_fdopen failed\n");
 			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			close(oaesfd[0]);
-			close(oaesfd[1]);
 			return -1;
-		} else if (oaes_pid == 0) {
-			// Child
-			close(oaesfd[1]);   // close unused
-			dup2(oaesfd[0], fileno(stdin)); // remap stdin
-			dup2(output_fd, fileno(stdout)); // remap stdout to output file
-			if (execlp("openaes", "openaes", "enc", "--key", password.c_str(), NULL) < 0) {
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				close(oaesfd[0]);
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(oaesfd[0]); // close parent input
-			fd = oaesfd[1];   // copy parent output
-			init_libtar_no_buffer(progress_pipe_fd);
-			tar_type.writefunc = write_tar_no_buffer;
-			if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("backup_error=Error creating backup.");
-				return -1;
-			}
-			return 0;
 		}
 	} else {
-		// Not compressed or encrypted
+		// Not compressed or encrypted adb backup
 		current_archive_type = UNCOMPRESSED;
-		init_libtar_buffer(0, progress_pipe_fd);
-		if (part_settings->adbbackup) {
-			LOGINFO("Opening TW_ADB_BACKUP uncompressed stream\n");
-			tar_type.writefunc = write_tar_no_buffer;
-			output_fd = open(TW_ADB_BACKUP, O_WRONLY);
-			if(tar_fdopen(&t, output_fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+		LOGINFO("Opening TW_ADB_BACKUP uncompressed stream\n");
+		tar_type.writefunc = write_tar_no_buffer;
+		output_fd = open(twadbbu::Stream_Fifo(TW_ADB_BACKUP, part_settings->adb_stream).c_str(), O_WRONLY);
+		if (output_fd < 0 || init_libtar_no_buffer(output_fd, progress_slot) != 0) {
+			if (output_fd >= 0)
 				close(output_fd);
-				LOGERR("tar_fdopen failed\n");
-				return -1;
-			}
+			LOGERR("Unable to open TW_ADB_BACKUP\n");
+			return -1;
 		}
-		else {
-			tar_type.writefunc = write_tar;
-			if (tar_open(&t, charTarFile, &tar_type, O_WRONLY | O_CREAT | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) == -1) {
-				LOGERR("tar_open error opening '%s'\n", tarfn.c_str());
-				gui_err("backup_error=Error creating backup.");
-				return -1;
-			}
+		if(tar_fdopen(&t, output_fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+			free_libtar_buffer(output_fd);
+			close(output_fd);
+			LOGERR("tar_fdopen failed\n");
+			return -1;
 		}
 	}
+	tar_links_reserve(t, (size_t)link_count); // only a hint, the map grows as needed
 	return 0;
 }
 
 int twrpTar::openTar() {
 	char* charRootDir = (char*) tardir.c_str();
 	char* charTarFile = (char*) tarfn.c_str();
-	string Password;
-
-	if (current_archive_type == COMPRESSED_ENCRYPTED) {
-		LOGINFO("Opening encrypted and compressed backup...\n");
-		int i, pipes[4];
-		input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
-		if (input_fd < 0) {
-			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
-			return -1;
-		}
-
-		if (pipe(pipes) < 0) {
-			LOGINFO("Error creating first pipe\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			return -1;
-		}
-		if (pipe(pipes + 2) < 0) {
-			LOGINFO("Error creating second pipe\n");
-			gui_err("restore_error=Error during restore process.");
-			close(pipes[0]);
-			close(pipes[1]);
-			close(input_fd);
-			return -1;
-		}
-		oaes_pid = fork();
+	bool chunked = false;
 
-		if (oaes_pid < 0) {
-			LOGINFO("pigz fork() failed\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			for (i = 0; i < 4; i++)
-				close(pipes[i]); // close all
-			return -1;
-		} else if (oaes_pid == 0) {
-			// openaes Child
-			close(pipes[0]); // Close pipes that are not used by this child
-			close(pipes[2]);
-			close(pipes[3]);
-			int stdinfd = fileno(stdin);
-			int stdoutfd = fileno(stdout);
-			close(stdinfd);
-			dup2(input_fd, stdinfd);
-			close(stdoutfd);
-			dup2(pipes[1], stdoutfd);
-			if (execlp("openaes", "openaes", "dec", "--key", password.c_str(), NULL) < 0) {
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("restore_error=Error during restore process.");
-				close(input_fd);
-				close(pipes[1]);
-				_exit(-1);
-			}
+#ifndef BUILD_TWRPTAR_MAIN
+	if (!part_settings->adbbackup)
+		chunked = twrpChunkStore::Is_Chunked(tarfn);
+#endif
+	if (current_archive_type != UNCOMPRESSED || archive_digest != NULL || chunked || seekable) {
+		twrpTarStream* stream;
+		string stream_password;
+		Tar_Stream_Codec codec = TAR_STREAM_GZIP;
+
+		if (current_archive_type == COMPRESSED_ENCRYPTED) {
+			LOGINFO("Opening encrypted and compressed backup...\n");
+		} else if (current_archive_type == ENCRYPTED) {
+			LOGINFO("Opening encrypted backup...\n");
+			codec = TAR_STREAM_PLAIN;
+		} else if (current_archive_type == COMPRESSED_LZ4) {
+			LOGINFO("Opening LZ4 compressed tar...\n");
+			codec = TAR_STREAM_LZ4;
+		} else if (current_archive_type == UNCOMPRESSED) {
+			LOGINFO("Opening uncompressed tar through a stream...\n");
+			codec = TAR_STREAM_PLAIN;
 		} else {
-			// Parent
-			pigz_pid = fork();
-
-			if (pigz_pid < 0) {
-				LOGINFO("openaes fork() failed\n");
-				gui_err("restore_error=Error during restore process.");
-				close(input_fd);
-				for (i = 0; i < 4; i++)
-					close(pipes[i]); // close all
-				return -1;
-			} else if (pigz_pid == 0) {
-				// pigz Child
-				close(pipes[1]); // Close pipes not used by this child
-				close(pipes[2]);
-				int stdinfd = fileno(stdin);
-				int stdoutfd = fileno(stdout);
-				close(stdinfd);
-				dup2(pipes[0], stdinfd);
-				close(stdoutfd);
-				dup2(pipes[3], stdoutfd);
-				if (execlp("pigz", "pigz", "-d", "-c", NULL) < 0) {
-					LOGINFO("execlp pigz ERROR!\n");
-					gui_err("restore_error=Error during restore process.");
-					close(input_fd);
-					close(pipes[0]);
-					close(pipes[3]);
-					_exit(-1);
-				}
-			} else {
-				// Parent
-				close(pipes[0]); // Close pipes not used by parent
-				close(pipes[1]);
-				close(pipes[3]);
-				fd = pipes[2];
-				if (tar_fdopen(&t, fd, charRootDir, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-					close(fd);
-					LOGINFO("tar_fdopen failed\n");
-					gui_err("restore_error=Error during restore process.");
-					return -1;
-				}
-			}
-		}
-	} else if (current_archive_type == ENCRYPTED) {
-		LOGINFO("Opening encrypted backup...\n");
-		int oaesfd[2];
-		input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
-		if (input_fd < 0) {
-			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
-			return -1;
+			LOGINFO("Opening gzip compressed tar...\n");
 		}
+		if (current_archive_type == ENCRYPTED || current_archive_type == COMPRESSED_ENCRYPTED)
+			stream_password = password;
 
-		if (pipe(oaesfd) < 0) {
-			LOGINFO("Error creating pipe\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			return -1;
-		}
-
-		oaes_pid = fork();
-		if (oaes_pid < 0) {
-			LOGINFO("fork() failed\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			close(oaesfd[0]);
-			close(oaesfd[1]);
-			return -1;
-		} else if (oaes_pid == 0) {
-			// Child
-			close(oaesfd[0]); // Close unused pipe
-			int stdinfd = fileno(stdin);
-			close(stdinfd);   // close stdin
-			dup2(oaesfd[1], fileno(stdout)); // remap stdout
-			dup2(input_fd, stdinfd); // remap input fd to stdin
-			if (execlp("openaes", "openaes", "dec", "--key", password.c_str(), NULL) < 0) {
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("restore_error=Error during restore process.");
-				close(input_fd);
-				close(oaesfd[1]);
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(oaesfd[1]); // close parent output
-			fd = oaesfd[0];   // copy parent input
-			if (tar_fdopen(&t, fd, charRootDir, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
+		if (part_settings->adbbackup && (current_archive_type == COMPRESSED || current_archive_type == COMPRESSED_LZ4)) {
+			LOGINFO("opening TW_ADB_RESTORE compressed stream\n");
+			input_fd = open(twadbbu::Stream_Fifo(TW_ADB_RESTORE, part_settings->adb_stream).c_str(), O_RDONLY | O_LARGEFILE);
+#ifndef BUILD_TWRPTAR_MAIN
+		} else if (chunked) {
+			LOGINFO("Reading archive from the chunk store...\n");
+			chunks = new twrpChunkStore();
+			input_fd = chunks->Open_Read(tarfn);
+			if (input_fd < 0) {
+				delete chunks;
+				chunks = NULL;
 				gui_err("restore_error=Error during restore process.");
 				return -1;
 			}
-		}
-	} else if (current_archive_type == COMPRESSED) {
-		int pigzfd[2];
-
-		LOGINFO("Opening gzip compressed tar...\n");
-		if (part_settings->adbbackup)  {
-			LOGINFO("opening TW_ADB_RESTORE compressed stream\n");
-			input_fd = open(TW_ADB_RESTORE, O_RDONLY | O_LARGEFILE);
-		}
-		else
+#endif
+		} else {
 			input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
-
+		}
 		if (input_fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
 
-		if (pipe(pigzfd) < 0) {
-			LOGINFO("Error creating pipe\n");
+		stream = new twrpTarStream();
+		if (!stream->Open_Read(input_fd, codec, stream_password, stream_threads)) {
+			LOGINFO("Unable to set up decompression / decryption stream\n");
 			gui_err("restore_error=Error during restore process.");
+			delete stream;
 			close(input_fd);
+			input_fd = -1;
+			Finish_Chunks();
 			return -1;
 		}
-
-		pigz_pid = fork();
-		if (pigz_pid < 0) {
-			LOGINFO("fork() failed\n");
+		if (archive_digest != NULL)
+			stream->Set_Digest(archive_digest);
+		fd = input_fd;
+		input_fd = -1; // the stream owns the fd now and closes it in tar_close()
+		tar_type.readfunc = tar_stream_read;
+		tar_type.closefunc = tar_stream_close;
+		if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+			tar_stream_close(fd);
+			Finish_Chunks();
+			LOGINFO("tar_fdopen failed\n");
 			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			close(pigzfd[0]);
-			close(pigzfd[1]);
 			return -1;
-		} else if (pigz_pid == 0) {
-			// Child
-			close(pigzfd[0]);
-			dup2(pigzfd[1], fileno(stdout)); // remap stdout
-			dup2(input_fd, fileno(stdin)); // remap input fd to stdin
-			if (execlp("pigz", "pigz", "-d", "-c", NULL) < 0) {
-				close(pigzfd[1]);
-				close(input_fd);
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("restore_error=Error during restore process.");
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(pigzfd[1]); // close parent output
-			fd = pigzfd[0];   // copy parent input
-			if (tar_fdopen(&t, fd, charRootDir, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("restore_error=Error during restore process.");
-				return -1;
-			}
 		}
 	} else  {
 		if (part_settings->adbbackup) {
 			LOGINFO("Opening TW_ADB_RESTORE uncompressed stream\n");
-			input_fd = open(TW_ADB_RESTORE, O_RDONLY);
+			input_fd = open(twadbbu::Stream_Fifo(TW_ADB_RESTORE, part_settings->adb_stream).c_str(), O_RDONLY);
 			if (tar_fdopen(&t, input_fd, charRootDir, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
 				LOGERR("Unable to open tar archive '%s'\n", charTarFile);
 				gui_err("restore_error=Error during restore process.");
@@ -1348,6 +1726,114 @@ int twrpTar::openTar() {
 	return 0;
 }
 
+bool twrpTar::Is_Selected(const char *name, const std::vector<std::string>& paths) {
+	// Compared as extracted, names in the archive are relative to tardir
+	string path = TWFunc::Remove_Trailing_Slashes(tardir + "/" + name);
+
+	for (size_t i = 0; i < paths.size(); i++) {
+		string selected = TWFunc::Remove_Trailing_Slashes(paths[i]);
+		if (path == selected)
+			return true;
+		if (path.size() > selected.size() && path.compare(0, selected.size(), selected) == 0 && path[selected.size()] == '/')
+			return true;
+	}
+	return false;
+}
+
+int twrpTar::Extract_Selected(const std::vector<std::string>& paths) {
+	char* charRootDir = (char*) tardir.c_str();
+	twrpTarIndex archive_index;
+	twrpTarStream *stream;
+	string realname;
+	size_t found = 0;
+	bool indexed = false;
+	int ret = 0, i;
+
+	Set_Archive_Type(Get_Archive_Type(tarfn));
+	// Encrypted and chunked archives can only be read from the start
+	if (current_archive_type != ENCRYPTED && current_archive_type != COMPRESSED_ENCRYPTED) {
+#ifndef BUILD_TWRPTAR_MAIN
+		if (!twrpChunkStore::Is_Chunked(tarfn))
+#endif
+			indexed = archive_index.Load(tarfn + TAR_INDEX_EXTENSION);
+	}
+	seekable = indexed;
+	i = openTar();
+	seekable = false;
+	if (i == -1)
+		return -1;
+
+	if (indexed) {
+		const std::vector<twrpTarIndex::Entry>& entries = archive_index.Get_Entries();
+		stream = twrpTarStream::Find(t->fd);
+		for (size_t e = 0; e < entries.size() && ret == 0; e++) {
+			if (!Is_Selected(entries[e].name.c_str(), paths))
+				continue;
+			bool positioned = stream != NULL && stream->Seek(entries[e].offset, archive_index.Get_Restart(entries[e].offset));
+			// libtar's read buffer still holds data from before the seek
+			if (positioned)
+				tar_read_discard(t);
+			if (!positioned || th_read(t) != 0) {
+				LOGINFO("Unable to find '%s' in '%s'\n", entries[e].name.c_str(), tarfn.c_str());
+				ret = -1;
+				break;
+			}
+			realname = tardir + "/" + th_get_pathname(t);
+			if (tar_extract_file(t, realname.c_str(), charRootDir, progress_slot) != 0)
+				ret = -1;
+			found++;
+		}
+	} else {
+		LOGINFO("No index for '%s', reading the whole archive\n", tarfn.c_str());
+		while ((i = th_read(t)) == 0) {
+			if (Is_Selected(th_get_pathname(t), paths)) {
+				realname = tardir + "/" + th_get_pathname(t);
+				if (tar_extract_file(t, realname.c_str(), charRootDir, progress_slot) != 0) {
+					ret = -1;
+					break;
+				}
+				found++;
+			} else if (TH_ISREG(t) && tar_skip_regfile(t) != 0) {
+				ret = -1;
+				break;
+			}
+		}
+		if (i == -1)
+			ret = -1;
+	}
+	if (tar_close(t) != 0 || !Finish_Chunks())
+		ret = -1;
+	LOGINFO("Restored %zu entries from '%s'\n", found, tarfn.c_str());
+	return ret;
+}
+
+int twrpTar::Extract_Paths(const std::vector<std::string>& paths) {
+	std::vector<string> archives;
+	string base = tarfn;
+	int ret = 0;
+
+	if (TWFunc::Path_Exists(tarfn)) {
+		archives.push_back(tarfn);
+	} else {
+		std::vector<std::vector<string> > threads = List_Archives(tarfn);
+		for (size_t i = 0; i < threads.size(); i++)
+			archives.insert(archives.end(), threads[i].begin(), threads[i].end());
+	}
+	if (archives.empty()) {
+		LOGERR("Unable to locate '%s'\n", tarfn.c_str());
+		return -1;
+	}
+	for (size_t i = 0; i < archives.size() && ret == 0; i++) {
+		tarfn = archives[i];
+		if (Extract_Selected(paths) != 0) {
+			gui_err("restore_error=Error during restore process.");
+			ret = -1;
+		}
+	}
+	tarfn = base;
+	return ret;
+}
+
 string twrpTar::Strip_Root_Dir(string Path) {
 	string temp;
 	size_t slash;
@@ -1370,12 +1856,18 @@ string twrpTar::Strip_Root_Dir(string Path) {
 
 int twrpTar::addFile(string fn, bool include_root) {
 	char* charTarFile = (char*) fn.c_str();
+	twrpTarStream *stream = (index != NULL ? twrpTarStream::Find(t->fd) : NULL);
+
 	if (include_root) {
+		if (stream != NULL)
+			index->Add_Entry(fn, stream->Position());
 		if (tar_append_file(t, charTarFile, NULL) == -1)
 			return -1;
 	} else {
 		string temp = Strip_Root_Dir(fn);
 		char* charTarPath = (char*) temp.c_str();
+		if (stream != NULL)
+			index->Add_Entry(temp, stream->Position());
 		if (tar_append_file(t, charTarFile, charTarPath) == -1)
 			return -1;
 	}
@@ -1387,40 +1879,47 @@ int twrpTar::closeTar() {
 	flush_libtar_buffer(t->fd);
 	if (tar_append_eof(t) != 0) {
 		LOGINFO("tar_append_eof(): %s\n", strerror(errno));
+		free_libtar_buffer(t->fd);
 		tar_close(t);
+		Finish_Chunks();
 		return -1;
 	}
-	if (tar_close(t) != 0) {
+	// Released before the fd is closed so another thread can not reuse the number first
+	free_libtar_buffer(t->fd);
+	if (tar_close(t) != 0 || !Finish_Chunks()) {
 		LOGINFO("Unable to close tar archive: '%s'\n", tarfn.c_str());
 		return -1;
 	}
-	if (current_archive_type > 0) {
-		close(fd);
-		int status;
-		if (pigz_pid > 0 && TWFunc::Wait_For_Child(pigz_pid, &status, "pigz") != 0)
-			return -1;
-		if (oaes_pid > 0 && TWFunc::Wait_For_Child(oaes_pid, &status, "openaes") != 0)
-			return -1;
-	}
-	free_libtar_buffer();
 	if (!part_settings->adbbackup) {
-		if (use_compression && !use_encryption) {
-			string gzname = tarfn + ".gz";
-			if (TWFunc::Path_Exists(gzname)) {
-				rename(gzname.c_str(), tarfn.c_str());
-			}
-		}
 		if (TWFunc::Get_File_Size(tarfn) == 0) {
 			gui_msg(Msg(msg::kError, "backup_size=Backup file size for '{1}' is 0 bytes.")(tarfn));
 			return -1;
 		}
+		if (index != NULL) {
+			// Only an optimization for lookups and selective restores, the backup does not need it
+			string index_fn = tarfn + TAR_INDEX_EXTENSION;
+			if (index->Write(index_fn)) {
+#ifndef BUILD_TWRPTAR_MAIN
+				tw_set_default_metadata(index_fn.c_str());
+#endif
+			}
+			delete index;
+			index = NULL;
+		}
 #ifndef BUILD_TWRPTAR_MAIN
 		tw_set_default_metadata(tarfn.c_str());
+		if (archive_digest != NULL) {
+			bool digest_ok = twrpDigestDriver::Write_Digest_File(tarfn, archive_digest, archive_digest_sha2);
+			delete archive_digest;
+			archive_digest = NULL;
+			if (!digest_ok)
+				return -1;
+		}
 #endif
 	}
 	else {
 #ifndef BUILD_TWRPTAR_MAIN
-		if (!twadbbu::Write_TWEOF())
+		if (!twadbbu::Write_TWEOF(part_settings->adb_stream))
 			return -1;
 #endif
 	}
@@ -1448,9 +1947,18 @@ int twrpTar::removeEOT(string tarFile) {
 
 int twrpTar::entryExists(string entry) {
 	char* searchstr = (char*)entry.c_str();
+	twrpTarIndex archive_index;
 	int ret;
 
-	Set_Archive_Type(TWFunc::Get_File_Type(tarfn));
+	if (!part_settings->adbbackup && archive_index.Load(tarfn + TAR_INDEX_EXTENSION)) {
+		const std::vector<twrpTarIndex::Entry>& entries = archive_index.Get_Entries();
+		for (size_t i = 0; i < entries.size(); i++) {
+			if (fnmatch(searchstr, entries[i].name.c_str(), FNM_FILE_NAME | FNM_PERIOD) == 0)
+				return 1;
+		}
+		return 0;
+	}
+	Set_Archive_Type(Get_Archive_Type(tarfn));
 
 	if (openTar() == -1)
 		ret = 0;
@@ -1463,37 +1971,52 @@ int twrpTar::entryExists(string entry) {
 	return ret;
 }
 
+string twrpTar::Archive_Name(const string& Basefn, unsigned Thread_Id, unsigned Count) {
+	char name[32];
+
+	sprintf(name, "%u%02u", Thread_Id, Count);
+	return Basefn + name;
+}
+
+// Thread ids are not always consecutive, an encrypted backup may have no
+// unencrypted thread 0, so every id a backup can use is looked for
+std::vector<std::vector<string> > twrpTar::List_Archives(const string& Basefn) {
+	std::vector<std::vector<string> > threads;
+
+	for (unsigned id = 0; id <= TAR_MAX_ARCHIVE_THREADS; id++) {
+		std::vector<string> archives;
+		for (unsigned count = 0; count < TAR_MAX_SPLIT_ARCHIVES; count++) {
+			string name = Archive_Name(Basefn, id, count);
+			if (!TWFunc::Path_Exists(name))
+				break;
+			archives.push_back(name);
+		}
+		if (!archives.empty())
+			threads.push_back(archives);
+	}
+	return threads;
+}
+
 unsigned long long twrpTar::get_size() {
 	if (part_settings->adbbackup || TWFunc::Path_Exists(tarfn)) {
 		LOGINFO("Single archive\n");
 		return uncompressedSize(tarfn);
 	} else {
 		LOGINFO("Multiple archives\n");
-		string temp;
-		char actual_filename[255];
-		int archive_count = 0;
 		unsigned long long total_restore_size = 0;
 
 		basefn = tarfn;
-		temp = basefn + "%i%02i";
 		tarfn += "000";
 		thread_id = 0;
-		sprintf(actual_filename, temp.c_str(), thread_id, archive_count);
 		if (!part_settings->adbbackup) {
-			if (!TWFunc::Path_Exists(actual_filename)) {
+			std::vector<std::vector<string> > threads = List_Archives(basefn);
+			if (threads.empty()) {
 				LOGERR("Unable to locate '%s' or '%s'\n", basefn.c_str(), tarfn.c_str());
 				return 0;
 			}
-			for (int i = 0; i < 9; i++) {
-				archive_count = 0;
-				sprintf(actual_filename, temp.c_str(), i, archive_count);
-				while (TWFunc::Path_Exists(actual_filename)) {
-					total_restore_size += uncompressedSize(actual_filename);
-					archive_count++;
-					if (archive_count > 99)
-						break;
-					sprintf(actual_filename, temp.c_str(), i, archive_count);
-				}
+			for (size_t i = 0; i < threads.size(); i++) {
+				for (size_t j = 0; j < threads[i].size(); j++)
+					total_restore_size += uncompressedSize(threads[i][j]);
 			}
 	#ifndef BUILD_TWRPTAR_MAIN
 	        if (!part_settings->adbbackup) {
@@ -1511,30 +2034,25 @@ unsigned long long twrpTar::get_size() {
 
 unsigned long long twrpTar::uncompressedSize(string filename) {
 	unsigned long long total_size = 0;
-	string Tar, Command, result;
-	vector<string> split;
 
-	Set_Archive_Type(TWFunc::Get_File_Type(tarfn));
+	// Split backups can mix encrypted and unencrypted archives
+	Set_Archive_Type(Get_Archive_Type(filename));
+#ifndef BUILD_TWRPTAR_MAIN
+	if (twrpChunkStore::Is_Chunked(filename)) {
+		// pigz can not list a chunk index, the stored size is close enough for progress
+		total_size = twrpChunkStore::Get_Size(filename);
+	} else
+#endif
 	if (current_archive_type == UNCOMPRESSED) {
 		total_size = TWFunc::Get_File_Size(filename);
-	} else if (current_archive_type == COMPRESSED) {
-		// Compressed
-		Command = "pigz -l '" + filename + "'";
-		/* if we set Command = "pigz -l " + tarfn + " | sed '1d' | cut -f5 -d' '";
-		we get the uncompressed size at once. */
-		TWFunc::Exec_Cmd(Command, result);
-		if (!result.empty()) {
-			/* Expected output:
-			compressed original  reduced name
-			95855838   179403776 -1.3%   data.yaffs2.win
-			^
-			split[5]
-			*/
-			split = TWFunc::split_string(result, ' ', true);
-			if (split.size() > 4)
-				total_size = atoi(split[5].c_str());
+	} else if (current_archive_type == COMPRESSED || current_archive_type == COMPRESSED_LZ4) {
+		// The frame table or the gzip trailer, no need to run pigz -l
+		Tar_Stream_Codec codec = (current_archive_type == COMPRESSED ? TAR_STREAM_GZIP : TAR_STREAM_LZ4);
+		if (!twrpTarStream::Get_Data_Size(filename, codec, "", &total_size)) {
+			// LZ4 archives from before the frame table, the archive size is close enough for progress
+			total_size = TWFunc::Get_File_Size(filename);
 		}
-	} else if (current_archive_type == COMPRESSED_ENCRYPTED) {
+	} else if (current_archive_type == ENCRYPTED || current_archive_type == COMPRESSED_ENCRYPTED) {
 		// File is encrypted and may be compressed
 		int ret = TWFunc::Try_Decrypting_File(filename, password);
 		if (ret < 1) {
@@ -1543,35 +2061,19 @@ unsigned long long twrpTar::uncompressedSize(string filename) {
 		} else if (ret == 1) {
 			LOGERR("Decrypted file is not in tar format.\n");
 			total_size = TWFunc::Get_File_Size(filename);
-		} else if (ret == 3) {
-			Command = "openaes dec --key \"" + password + "\" --in '" + filename + "' | pigz -l";
-			/* if we set Command = "pigz -l " + tarfn + " | sed '1d' | cut -f5 -d' '";
-			we get the uncompressed size at once. */
-			TWFunc::Exec_Cmd(Command, result);
-			if (!result.empty()) {
-				LOGINFO("result was: '%s'\n", result.c_str());
-				/* Expected output:
-				compressed original  reduced name
-				95855838   179403776 -1.3%   data.yaffs2.win
-				^
-				split[5]
-				*/
-				split = TWFunc::split_string(result, ' ', true);
-				if (split.size() > 4)
-					total_size = atoi(split[5].c_str());
-			}
-		} else {
+		} else if (!twrpTarStream::Get_Data_Size(filename, ret == 3 ? TAR_STREAM_GZIP : TAR_STREAM_PLAIN, password, &total_size)) {
 			total_size = TWFunc::Get_File_Size(filename);
 		}
 	}
+	LOGINFO("Uncompressed size of '%s' is %llu\n", filename.c_str(), total_size);
 
 	return total_size;
 }
 
 extern "C" ssize_t write_tar(int fd, const void *buffer, size_t size) {
-	return (ssize_t) write_libtar_buffer(fd, buffer, size);
+	return write_libtar_buffer(fd, buffer, size);
 }
 
 extern "C" ssize_t write_tar_no_buffer(int fd, const void *buffer, size_t size) {
-	return (ssize_t) write_libtar_no_buffer(fd, buffer, size);
+	return write_libtar_no_buffer(fd, buffer, size);
 }
@@ -24,26 +24,138 @@ extern "C" {
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <fstream>
 #include <string>
 #include <vector>
+#include <deque>
 #include "exclude.hpp"
 #include "progresstracking.hpp"
 #include "partitions.hpp"
+#include "twrpWorkPool.hpp"
 #include "twrp-functions.hpp"
+#include "twrpTarStream.hpp"
+#include "twrpManifest.hpp"
+#include "twrpChunkStore.hpp"
+#include "twrpTarIndex.hpp"
+#include "twrpSnapshot.hpp"
 
 using namespace std;
 
 struct TarListStruct {
-	std::string fn;
+	const char* fn;                                                                 // full path, owned by the twrpTarPaths of the list
 	unsigned thread_id;
+	unsigned long long size;                                                        // size of regular files, 0 for everything else
 };
 
+// Bump allocator for the paths of a backup file list. A list of a million
+// files takes a few large blocks instead of a string allocation per file,
+// and everything is freed at once with the arena.
+class twrpTarPaths {
+public:
+	twrpTarPaths();
+	~twrpTarPaths();
+	const char* Add(const char* path, size_t len);                                  // Returns a copy of path that lives as long as the arena, NULL if out of memory
+
+private:
+	twrpTarPaths(const twrpTarPaths&);
+	twrpTarPaths& operator=(const twrpTarPaths&);
+
+	std::vector<char*> blocks;
+	size_t used;                                                                    // bytes taken in the last block
+	size_t allocated;                                                               // bytes of all blocks, counted in MEMORY_TAR_LISTS
+};
+
+struct tar_list_walk;
+
 struct thread_data_struct {
 	std::vector<TarListStruct> *TarList;
 	unsigned thread_id;
 };
 
+// Split and per thread archives of one restore, handed out to a pool of extract threads
+struct extract_pool_struct {
+	std::vector<std::vector<std::string> > groups;                                  // archives in each group are extracted in order by one thread
+	size_t next;
+	int error;
+	std::string password;
+	struct tar_progress *progress;                                                  // shared with the parent, each group counts into one slot
+	PartitionSettings *part_settings;
+	unsigned stream_threads;                                                        // frames each archive keeps queued on the shared pool
+	pthread_mutex_t lock;
+};
+
+// Work queue shared by the archive threads of one backup. Each thread starts
+// with the items Generate_TarList assigned to it and, once those run out,
+// steals from the end of the thread with the most data left. Every thread
+// still writes only to its own archives, but which stolen files end up in
+// which archive depends on how fast the threads ran, so two backups of the
+// same tree can split it differently. Restores do not care: every entry
+// carries its full path, parents are created as needed, and each archive's
+// digest is taken from what was actually written to it.
+class twrpTarQueue {
+public:
+	twrpTarQueue(std::vector<TarListStruct> *TarList, unsigned first_thread, unsigned last_thread);
+	~twrpTarQueue();
+	bool Next(unsigned thread_id, size_t *index);                                   // Returns false once no thread has items left
+
+private:
+	std::vector<TarListStruct> *List;
+	unsigned first_id;
+	std::vector<std::deque<size_t> > items;                                         // list indexes still queued per thread
+	std::vector<unsigned long long> remaining;                                      // bytes still queued per thread
+	pthread_mutex_t lock;
+};
+
+#define TAR_LIST_PATH_BLOCK (256 * 1024)                                        // Size of each block of twrpTarPaths
+#define TAR_LIST_DENTS_SIZE (32 * 1024)                                         // getdents64 buffer per directory level of Generate_TarList
+#define TAR_BALANCE_UNITS 16                                                    // Units of files per archive thread, fewer would balance worse
+#define TAR_BALANCE_MIN_UNIT (4 * 1024 * 1024)                                  // Smallest cap on a unit, so small backups keep directories together
+#define TAR_BALANCE_ENTRY_COST 512                                              // Header block each entry adds to its archive
+#define TAR_MAX_ARCHIVE_THREADS 8                                               // Archive threads of a backup, restores look for thread ids up to 8
+#define TAR_MAX_SPLIT_ARCHIVES 100                                              // Archives one thread may split into, the count in the name has two digits
+#define TAR_EXTRACT_WRITERS 4                                                   // Small files of a restored archive are written by this many threads
+#define TAR_PREFETCH_FILES 32                                                   // Most files claimed ahead of the one being archived
+#define TAR_PREFETCH_BYTES (16 * 1024 * 1024)                                   // Claimed ahead data, kept small so work can still be stolen
+#define TAR_PREFETCH_FILE_BYTES (1024 * 1024)                                   // Readahead per file, the kernel follows sequential reads of larger ones
+#define TAR_ADB_SAMPLE_BYTES (4 * 1024 * 1024)                                  // Data of a partition the codecs are tried on before an adb backup
+#define TAR_ADB_SAMPLE_FILE_BYTES (64 * 1024)                                   // Taken from the start of each file so the sample covers many of them
+#define TAR_ADB_LINK_RATE (30 * 1024 * 1024)                                    // Assumed adb throughput until twrpback has measured it, about USB 2
+#define TAR_ADB_MAX_RATIO 0.9                                                   // Data that does not shrink below this is sent raw
+#define TAR_ADB_MIN_GAIN 1.1                                                    // A codec has to beat sending raw by this much to be used
+
+// Warms up the files an archive thread adds next. libtar opens, stats and reads
+// one file at a time, so on folders of small files the storage mostly sees one
+// request at a time. A helper thread looks up each upcoming path and starts
+// readahead for its start with posix_fadvise, which keeps requests queued while
+// the current file is archived. Files the archive thread already reached are
+// skipped.
+class twrpTarPrefetch {
+public:
+	twrpTarPrefetch();
+	~twrpTarPrefetch();
+	void Add(const std::string& path, unsigned long long size);                    // Queues the next file of the list, in the order it is archived
+	void Consumed();                                                               // The oldest queued file is being archived now
+
+private:
+	struct Item {
+		std::string path;
+		unsigned long long size;
+		unsigned long long seq;
+	};
+
+	static void* Prefetch_Thread(void *cookie);
+
+	std::deque<Item> items;
+	unsigned long long added;
+	unsigned long long consumed;
+	bool stop;
+	bool started;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
 class twrpTar {
 public:
 	twrpTar();
@@ -56,18 +168,38 @@ public:
 	void setpassword(string pass);
 	unsigned long long get_size();
 	void Set_Archive_Type(Archive_Type archive_type);
+	int Extract_Paths(const std::vector<std::string>& paths);                      // Restores only these paths and what is below them
+	void Select_Adb_Codec();                                                        // Sets the compression of an adb backup from the codec and link speeds
+	int Plan();                                                                     // Lists the files before createTarFork so the fork skips its walk, -1 if the backup lists in the fork
+	bool Is_Planned() { return planned; }
+	unsigned long long Planned_Size() { return Total_Backup_Size; }                 // Bytes of the listed files
+	unsigned long long Planned_Files() { return file_count; }
+	unsigned Planned_Threads() { return archive_threads; }
+	unsigned Planned_Archives();                                                    // Archive files the planned backup should write
+	string Codec_Name();                                                            // none, gzip or lz4, with aes when encrypted
+	static string Archive_Name(const string& Basefn, unsigned Thread_Id, unsigned Count); // Name of a split archive, Basefn followed by the thread id and a two digit count
+	static std::vector<std::vector<string> > List_Archives(const string& Basefn);   // Existing split archives of each thread that wrote any, in thread order
 
 public:
 	int use_encryption;
 	int userdata_encryption;
 	int use_compression;
+	int use_lz4;                                                                    // use the LZ4 codec instead of gzip when compressing
 	int split_archives;
 	string backup_name;
-	int progress_pipe_fd;
+	struct tar_progress_slot *progress_slot;                                        // counter the parent shows the progress of this archive from
 	string partition_name;
 	string backup_folder;
 	PartitionSettings *part_settings;
 	TWExclude *backup_exclusions;
+	int incremental;                                                                // record a manifest of the backup so later ones can be incremental
+	string incremental_base;                                                        // backup folder to only archive the changes since, empty for a full backup
+	int use_dedup;                                                                  // store the archive as chunks shared with other backups
+	unsigned max_threads;                                                           // archive or extract threads, 0 for one per core up to 8
+	unsigned long long split_size;                                                  // size at which an archive is split, MAX_ARCHIVE_SIZE in recovery
+	unsigned long long restore_file_count;                                          // files a restore will extract, from the backup info, 0 if not known
+	int use_snapshot;                                                               // archive a snapshot of the file system, taken when the backup starts
+	string snapshot_dir;                                                            // mounted snapshot the fork reads instead of tardir, empty for the live file system
 
 private:
 	int extract();
@@ -80,11 +212,26 @@ private:
 	int extractTar();
 	string Strip_Root_Dir(string Path);
 	int openTar();
+	int List_Files(bool exact_size);
+	unsigned Archive_Threads();
 	int Generate_TarList(string Path, std::vector<TarListStruct> *TarList, unsigned long long *Target_Size, unsigned *thread_id);
+	int Generate_TarList_Dir(struct tar_list_walk *walk, int dir_fd, unsigned depth);
+	int Open_Manifest();
+	static unsigned long long List_Size(std::vector<TarListStruct> *TarList);
+	static void Balance_TarList(std::vector<TarListStruct> *TarList, unsigned first_thread, unsigned last_thread);
 	static void* createList(void *cookie);
+	static int createListThreads(twrpTar *tars, unsigned first_thread, unsigned last_thread);
+	int extractArchives(struct tar_progress *progress);
+	void Track_Progress(pid_t pid, struct tar_progress *progress, bool count_files, unsigned long long *size, unsigned long long *files);
 	static void* extractMulti(void *cookie);
 	int tarList(std::vector<TarListStruct> *TarList, unsigned thread_id);
 	unsigned long long uncompressedSize(string filename);
+	Tar_Stream_Codec Get_Stream_Codec();
+	void Read_Sample(const string& Path, std::vector<unsigned char> *sample);
+	Archive_Type Get_Archive_Type(const string& filename);
+	int Extract_Selected(const std::vector<std::string>& paths);
+	bool Is_Selected(const char *name, const std::vector<std::string>& paths);
+	bool Finish_Chunks();
 	static void Signal_Kill(int signum);
 
 	enum Archive_Type current_archive_type;
@@ -95,9 +242,10 @@ private:
 	tartype_t tar_type; // Only used in createTar() but variable must persist while the tar is open
 	int fd;
 	int input_fd;                                                                   // this stores the fd for libtar to write to
-	pid_t pigz_pid;
-	pid_t oaes_pid;
+	unsigned stream_threads;                                                        // compression / decompression threads for this archive, 0 uses all cores
+	int extract_writers;                                                            // threads writing small files during a restore
 	unsigned long long file_count;
+	unsigned long long link_count;                                                  // regular files with more than one link, sizes libtar's hardlink map
 
 	string tardir;
 	string tarfn;
@@ -105,6 +253,18 @@ private:
 	string password;
 
 	std::vector<TarListStruct> *ItemList;
+	std::vector<TarListStruct> file_list;                                           // files of a backup that is not encrypted, from Plan or the fork
+	bool planned;                                                                   // file_list was made by Plan in the parent
+	unsigned archive_threads;                                                       // threads file_list is balanced over
+	twrpTarPaths list_paths;                                                        // paths of the lists made by Generate_TarList
+	twrpTarQueue *work_queue;                                                       // shared with the other archive threads, NULL to only take this thread's items
+	twrpDigest *archive_digest;                                                     // digest of the archive being written or restored, NULL if none is made
+	bool archive_digest_sha2;
+	string archive_expected_digest;                                                 // digest file contents the restored archive is checked against
+	twrpManifest *manifest;                                                         // manifest being recorded by an incremental backup, NULL otherwise
+	twrpChunkStore *chunks;                                                         // chunk store the open archive is written to or read from, NULL for a normal file
+	twrpTarIndex *index;                                                            // index of the archive being written, NULL if none is made
+	bool seekable;                                                                  // openTar() always reads through a stream so it can seek
 	int output_fd;                                                                  // this stores the output fd that gzip will read from
 	unsigned thread_id;
 };
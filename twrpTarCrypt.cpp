@@ -0,0 +1,407 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "twrpTarCrypt.hpp"
+#include "twrpWorkPool.hpp"
+#include "twcommon.h"
+#ifdef TW_HAVE_AES_GCM
+	#include <openssl/crypto.h>
+	#include <openssl/evp.h>
+	#include <openssl/hmac.h>
+	#include <openssl/rand.h>
+#endif
+
+#define TAR_CRYPT_CIPHER_AES_256_GCM 1
+#define TAR_CRYPT_KDF_PBKDF2_SHA256 1
+#define TAR_CRYPT_IV_SIZE 12
+#define TAR_CRYPT_MIN_CHUNK_SIZE 4096
+#define TAR_CRYPT_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+#define TAR_CRYPT_MAX_ITERATIONS 10000000
+#define TAR_CRYPT_KEY_CACHE_SIZE 16
+
+// Header offsets
+#define TAR_CRYPT_OFF_VERSION 4
+#define TAR_CRYPT_OFF_CIPHER 5
+#define TAR_CRYPT_OFF_KDF 6
+#define TAR_CRYPT_OFF_FLAGS 7
+#define TAR_CRYPT_OFF_CHUNK_SIZE 8
+#define TAR_CRYPT_OFF_ITERATIONS 12
+#define TAR_CRYPT_OFF_SALT 16
+#define TAR_CRYPT_OFF_NONCE 32
+#define TAR_CRYPT_OFF_CHECK 40
+#define TAR_CRYPT_CHECK_LABEL "TWRP backup key check"
+
+// Every archive of a backup is opened on its own, a couple of times each while
+// restoring. Keys stay cached for the session, from the password check to the
+// decryption. The writer reuses the salt of the last key derived from the same
+// password, so the key of a whole backup is only derived once per run. The IV
+// prefixes are random, chunks of different archives never share an IV.
+struct Tar_Crypt_Key {
+	std::string password;
+	unsigned char salt[TAR_CRYPT_SALT_SIZE];
+	unsigned long iterations;
+	unsigned char key[TAR_CRYPT_KEY_SIZE];
+};
+
+static std::vector<Tar_Crypt_Key> key_cache;
+static pthread_mutex_t key_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void Put_LE32(unsigned char *ptr, unsigned long value) {
+	for (int i = 0; i < 4; i++)
+		ptr[i] = (value >> (8 * i)) & 0xff;
+}
+
+static unsigned long Get_LE32(const unsigned char *ptr) {
+	return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((unsigned long) ptr[3] << 24);
+}
+
+twrpTarCrypt::twrpTarCrypt() {
+	writing = false;
+	failed = false;
+	memset(header, 0, sizeof(header));
+	memset(key, 0, sizeof(key));
+	chunk_size = TAR_CRYPT_CHUNK_SIZE;
+	next_index = 0;
+	workers = 0;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+twrpTarCrypt::~twrpTarCrypt() {
+	if (workers)
+		twrpWorkPool::Cancel(this);
+	while (!inflight.empty()) {
+		delete inflight.front();
+		inflight.pop_front();
+	}
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+#ifdef TW_HAVE_AES_GCM
+	OPENSSL_cleanse(key, sizeof(key));
+#endif
+}
+
+bool twrpTarCrypt::Available() {
+#ifdef TW_HAVE_AES_GCM
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool twrpTarCrypt::Is_Header(const unsigned char *data) {
+	return memcmp(data, TAR_CRYPT_MAGIC, 4) == 0;
+}
+
+bool twrpTarCrypt::Derive_Key(const std::string& password, const unsigned char *salt, unsigned long iterations, unsigned char *derived) {
+#ifdef TW_HAVE_AES_GCM
+	Tar_Crypt_Key entry;
+
+	pthread_mutex_lock(&key_cache_lock);
+	for (size_t i = 0; i < key_cache.size(); i++) {
+		if (key_cache[i].iterations == iterations && key_cache[i].password == password && memcmp(key_cache[i].salt, salt, TAR_CRYPT_SALT_SIZE) == 0) {
+			memcpy(derived, key_cache[i].key, TAR_CRYPT_KEY_SIZE);
+			pthread_mutex_unlock(&key_cache_lock);
+			return true;
+		}
+	}
+	pthread_mutex_unlock(&key_cache_lock);
+
+	if (!PKCS5_PBKDF2_HMAC(password.data(), password.size(), salt, TAR_CRYPT_SALT_SIZE, iterations, EVP_sha256(), TAR_CRYPT_KEY_SIZE, derived)) {
+		LOGINFO("twrpTarCrypt key derivation failed\n");
+		return false;
+	}
+	entry.password = password;
+	memcpy(entry.salt, salt, TAR_CRYPT_SALT_SIZE);
+	entry.iterations = iterations;
+	memcpy(entry.key, derived, TAR_CRYPT_KEY_SIZE);
+	pthread_mutex_lock(&key_cache_lock);
+	if (key_cache.size() >= TAR_CRYPT_KEY_CACHE_SIZE) {
+		OPENSSL_cleanse(key_cache.front().key, TAR_CRYPT_KEY_SIZE);
+		key_cache.erase(key_cache.begin());
+	}
+	key_cache.push_back(entry);
+	pthread_mutex_unlock(&key_cache_lock);
+	OPENSSL_cleanse(entry.key, TAR_CRYPT_KEY_SIZE);
+	return true;
+#else
+	return false;
+#endif
+}
+
+// The check value is a MAC of a fixed label, it tells if a key is right without
+// revealing anything about the key or the data
+bool twrpTarCrypt::Key_Check(const unsigned char *derived, unsigned char *check) {
+#ifdef TW_HAVE_AES_GCM
+	unsigned char mac[EVP_MAX_MD_SIZE];
+	unsigned int mac_len = 0;
+
+	if (HMAC(EVP_sha256(), derived, TAR_CRYPT_KEY_SIZE, (const unsigned char*) TAR_CRYPT_CHECK_LABEL, strlen(TAR_CRYPT_CHECK_LABEL), mac, &mac_len) == NULL || mac_len < TAR_CRYPT_CHECK_SIZE)
+		return false;
+	memcpy(check, mac, TAR_CRYPT_CHECK_SIZE);
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool twrpTarCrypt::Init_Write(const std::string& password, unsigned threads, bool gzip) {
+#ifdef TW_HAVE_AES_GCM
+	bool have_salt = false;
+
+	writing = true;
+	memcpy(header, TAR_CRYPT_MAGIC, 4);
+	header[TAR_CRYPT_OFF_VERSION] = TAR_CRYPT_VERSION;
+	header[TAR_CRYPT_OFF_CIPHER] = TAR_CRYPT_CIPHER_AES_256_GCM;
+	header[TAR_CRYPT_OFF_KDF] = TAR_CRYPT_KDF_PBKDF2_SHA256;
+	header[TAR_CRYPT_OFF_FLAGS] = gzip ? TAR_CRYPT_FLAG_GZIP : 0;
+	Put_LE32(header + TAR_CRYPT_OFF_CHUNK_SIZE, chunk_size);
+	Put_LE32(header + TAR_CRYPT_OFF_ITERATIONS, TAR_CRYPT_KDF_ITERATIONS);
+
+	pthread_mutex_lock(&key_cache_lock);
+	for (size_t i = key_cache.size(); i > 0 && !have_salt; i--) {
+		if (key_cache[i - 1].iterations == TAR_CRYPT_KDF_ITERATIONS && key_cache[i - 1].password == password) {
+			memcpy(header + TAR_CRYPT_OFF_SALT, key_cache[i - 1].salt, TAR_CRYPT_SALT_SIZE);
+			have_salt = true;
+		}
+	}
+	pthread_mutex_unlock(&key_cache_lock);
+	if (!have_salt && !RAND_bytes(header + TAR_CRYPT_OFF_SALT, TAR_CRYPT_SALT_SIZE)) {
+		LOGINFO("twrpTarCrypt unable to generate a salt\n");
+		return false;
+	}
+	if (!RAND_bytes(header + TAR_CRYPT_OFF_NONCE, TAR_CRYPT_NONCE_SIZE)) {
+		LOGINFO("twrpTarCrypt unable to generate an IV\n");
+		return false;
+	}
+	if (!Derive_Key(password, header + TAR_CRYPT_OFF_SALT, TAR_CRYPT_KDF_ITERATIONS, key) || !Key_Check(key, header + TAR_CRYPT_OFF_CHECK))
+		return false;
+	Start_Workers(threads);
+	return true;
+#else
+	LOGINFO("twrpTarCrypt: AES-GCM support is not included in this build\n");
+	return false;
+#endif
+}
+
+int twrpTarCrypt::Load_Header(const std::string& password, const unsigned char *archive_header) {
+#ifdef TW_HAVE_AES_GCM
+	unsigned char check[TAR_CRYPT_CHECK_SIZE];
+	unsigned long iterations;
+
+	writing = false;
+	memcpy(header, archive_header, TAR_CRYPT_HEADER_SIZE);
+	if (!Is_Header(header) || header[TAR_CRYPT_OFF_VERSION] != TAR_CRYPT_VERSION) {
+		LOGINFO("twrpTarCrypt unknown archive version\n");
+		return -1;
+	}
+	if (header[TAR_CRYPT_OFF_CIPHER] != TAR_CRYPT_CIPHER_AES_256_GCM || header[TAR_CRYPT_OFF_KDF] != TAR_CRYPT_KDF_PBKDF2_SHA256) {
+		LOGINFO("twrpTarCrypt unknown cipher %u or key derivation %u\n", header[TAR_CRYPT_OFF_CIPHER], header[TAR_CRYPT_OFF_KDF]);
+		return -1;
+	}
+	chunk_size = Get_LE32(header + TAR_CRYPT_OFF_CHUNK_SIZE);
+	iterations = Get_LE32(header + TAR_CRYPT_OFF_ITERATIONS);
+	if (chunk_size < TAR_CRYPT_MIN_CHUNK_SIZE || chunk_size > TAR_CRYPT_MAX_CHUNK_SIZE || iterations < 1 || iterations > TAR_CRYPT_MAX_ITERATIONS) {
+		LOGINFO("twrpTarCrypt archive header is damaged\n");
+		return -1;
+	}
+	if (!Derive_Key(password, header + TAR_CRYPT_OFF_SALT, iterations, key) || !Key_Check(key, check))
+		return -1;
+	if (CRYPTO_memcmp(check, header + TAR_CRYPT_OFF_CHECK, TAR_CRYPT_CHECK_SIZE) != 0) {
+		LOGINFO("twrpTarCrypt wrong password\n");
+		return 0;
+	}
+	return 1;
+#else
+	LOGINFO("twrpTarCrypt: AES-GCM support is not included in this build\n");
+	return -1;
+#endif
+}
+
+bool twrpTarCrypt::Init_Read(const std::string& password, const unsigned char *archive_header, unsigned threads) {
+	if (Load_Header(password, archive_header) <= 0)
+		return false;
+	Start_Workers(threads);
+	return true;
+}
+
+void twrpTarCrypt::Start_Workers(unsigned threads) {
+	if (threads == 0)
+		threads = twrpWorkPool::CPU_Count();
+	if (threads > TAR_CRYPT_MAX_THREADS)
+		threads = TAR_CRYPT_MAX_THREADS;
+	// One thread would only add a hand-off per chunk, Submit does the work itself then
+	if (threads < 2 || !twrpWorkPool::Start())
+		return;
+	workers = threads;
+}
+
+const unsigned char* twrpTarCrypt::Header() {
+	return header;
+}
+
+size_t twrpTarCrypt::Chunk_Size() {
+	return chunk_size;
+}
+
+size_t twrpTarCrypt::Max_Pending() {
+	return workers ? workers * 2 : 1;
+}
+
+bool twrpTarCrypt::Crypt_Chunk(unsigned long long chunk_index, bool final, const unsigned char *data, size_t size, std::vector<unsigned char> *out) {
+#ifdef TW_HAVE_AES_GCM
+	unsigned char iv[TAR_CRYPT_IV_SIZE], aad[TAR_CRYPT_HEADER_SIZE + 9];
+	size_t plain_size = writing ? size : size - TAR_CRYPT_TAG_SIZE;
+	EVP_CIPHER_CTX *ctx;
+	bool ret;
+	int len;
+
+	if (chunk_index > 0xffffffffULL || size > chunk_size + TAR_CRYPT_TAG_SIZE || (!writing && size < TAR_CRYPT_TAG_SIZE))
+		return false;
+	memcpy(iv, header + TAR_CRYPT_OFF_NONCE, TAR_CRYPT_NONCE_SIZE);
+	Put_LE32(iv + TAR_CRYPT_NONCE_SIZE, chunk_index);
+	memcpy(aad, header, TAR_CRYPT_HEADER_SIZE);
+	Put_LE32(aad + TAR_CRYPT_HEADER_SIZE, chunk_index & 0xffffffff);
+	Put_LE32(aad + TAR_CRYPT_HEADER_SIZE + 4, chunk_index >> 32);
+	aad[TAR_CRYPT_HEADER_SIZE + 8] = final ? 1 : 0;
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL)
+		return false;
+	out->resize(writing ? size + TAR_CRYPT_TAG_SIZE : plain_size);
+	if (writing) {
+		ret = EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, iv)
+			&& EVP_EncryptUpdate(ctx, NULL, &len, aad, sizeof(aad))
+			&& (size == 0 || EVP_EncryptUpdate(ctx, out->data(), &len, data, size))
+			&& EVP_EncryptFinal_ex(ctx, out->data() + size, &len)
+			&& EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAR_CRYPT_TAG_SIZE, out->data() + size);
+	} else {
+		// The plaintext is only handed out once the tag matches
+		ret = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, iv)
+			&& EVP_DecryptUpdate(ctx, NULL, &len, aad, sizeof(aad))
+			&& (plain_size == 0 || EVP_DecryptUpdate(ctx, out->data(), &len, data, plain_size))
+			&& EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAR_CRYPT_TAG_SIZE, (void*) (data + plain_size))
+			&& EVP_DecryptFinal_ex(ctx, out->data() + plain_size, &len) > 0;
+	}
+	EVP_CIPHER_CTX_free(ctx);
+	if (!ret)
+		out->clear();
+	return ret;
+#else
+	return false;
+#endif
+}
+
+void twrpTarCrypt::Run_Chunk(void *owner, void *cookie) {
+	twrpTarCrypt *crypt = (twrpTarCrypt*) owner;
+	Chunk *chunk = (Chunk*) cookie;
+
+	bool ok = crypt->Crypt_Chunk(chunk->index, chunk->final, chunk->in.data(), chunk->in.size(), &chunk->out);
+
+	pthread_mutex_lock(&crypt->lock);
+	chunk->error = !ok;
+	chunk->done = true;
+	pthread_cond_broadcast(&crypt->cond);
+	pthread_mutex_unlock(&crypt->lock);
+}
+
+bool twrpTarCrypt::Submit(std::vector<unsigned char> *data, bool final) {
+	Chunk *chunk = new Chunk;
+
+	chunk->in.swap(*data);
+	data->clear();
+	chunk->index = next_index++;
+	chunk->final = final;
+	chunk->done = false;
+	chunk->error = false;
+	if (!workers) {
+		chunk->error = !Crypt_Chunk(chunk->index, chunk->final, chunk->in.data(), chunk->in.size(), &chunk->out);
+		chunk->done = true;
+		inflight.push_back(chunk);
+		return true;
+	}
+	pthread_mutex_lock(&lock);
+	inflight.push_back(chunk);
+	pthread_mutex_unlock(&lock);
+	twrpWorkPool::Submit(this, Run_Chunk, chunk);
+	return true;
+}
+
+bool twrpTarCrypt::Next(std::vector<unsigned char> *data, bool wait) {
+	Chunk *chunk;
+
+	pthread_mutex_lock(&lock);
+	while (wait && !inflight.empty() && !inflight.front()->done)
+		pthread_cond_wait(&cond, &lock);
+	if (inflight.empty() || !inflight.front()->done) {
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+	chunk = inflight.front();
+	inflight.pop_front();
+	pthread_mutex_unlock(&lock);
+
+	if (chunk->error)
+		failed = true;
+	else
+		data->swap(chunk->out);
+	delete chunk;
+	return !failed;
+}
+
+size_t twrpTarCrypt::Pending() {
+	size_t ret;
+
+	pthread_mutex_lock(&lock);
+	ret = inflight.size();
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+bool twrpTarCrypt::Failed() {
+	return failed;
+}
+
+int twrpTarCrypt::Check_Password(const std::string& filename, const std::string& password, bool *gzip) {
+	twrpTarCrypt crypt;
+	unsigned char archive_header[TAR_CRYPT_HEADER_SIZE];
+	ssize_t bytes;
+	int fd, ret;
+
+	fd = open(filename.c_str(), O_RDONLY | O_LARGEFILE);
+	if (fd < 0) {
+		LOGERR("Failed to open '%s' to try decrypt: %s\n", filename.c_str(), strerror(errno));
+		return -1;
+	}
+	bytes = read(fd, archive_header, sizeof(archive_header));
+	close(fd);
+	if (bytes != sizeof(archive_header)) {
+		LOGERR("Failed to read the encryption header of '%s'\n", filename.c_str());
+		return -1;
+	}
+	// The flags are authenticated with every chunk, a changed header fails to decrypt
+	ret = crypt.Load_Header(password, archive_header);
+	*gzip = (archive_header[TAR_CRYPT_OFF_FLAGS] & TAR_CRYPT_FLAG_GZIP) != 0;
+	return ret;
+}
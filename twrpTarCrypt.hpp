@@ -0,0 +1,106 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPTARCRYPT_HPP
+#define __TWRPTARCRYPT_HPP
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define TAR_CRYPT_MAGIC "TWAE"
+#define TAR_CRYPT_VERSION 1
+#define TAR_CRYPT_HEADER_SIZE 64
+#define TAR_CRYPT_CHUNK_SIZE (256 * 1024)                                       // Plaintext bytes per chunk, the last chunk is always shorter
+#define TAR_CRYPT_TAG_SIZE 16
+#define TAR_CRYPT_KEY_SIZE 32
+#define TAR_CRYPT_SALT_SIZE 16
+#define TAR_CRYPT_NONCE_SIZE 8                                                  // Random part of the IV, the chunk number is the rest
+#define TAR_CRYPT_CHECK_SIZE 16                                                 // Key check value in the header
+#define TAR_CRYPT_FLAG_GZIP 0x01                                                // The encrypted data is a gzip stream
+#define TAR_CRYPT_KDF_ITERATIONS 100000                                         // PBKDF2-HMAC-SHA256
+#define TAR_CRYPT_MAX_THREADS 4
+
+// Chunked AES-256-GCM encryption of backup archives, used in place of the OAES
+// format of the openaes binary for new backups. OAES encrypts 4KB chunks in CBC
+// mode with a table based AES, this uses the AES instructions of the CPU through
+// libcrypto and works on several chunks at once on the shared twrpWorkPool.
+//
+// An archive starts with a 64 byte header: the magic, version, cipher and KDF
+// ids, flags, the chunk size and KDF iteration count as LE32, the salt, the
+// random IV prefix and a check value of the key, so a password is checked with
+// one key derivation and without reading any data. Then come the chunks, each
+// one the ciphertext followed by its GCM tag. The IV of a chunk is the prefix
+// and its number as LE32. Every chunk is authenticated together with the
+// header, its number and whether it is the last one, so damaged, reordered or
+// cut off archives fail to decrypt instead of restoring bad data. Only the last
+// chunk is shorter than the chunk size, it is written empty if the data ends on
+// a chunk boundary.
+class twrpTarCrypt
+{
+public:
+	twrpTarCrypt();
+	~twrpTarCrypt();
+
+	bool Init_Write(const std::string& password, unsigned threads, bool gzip);  // Creates the header, threads 0 uses every CPU
+	bool Init_Read(const std::string& password, const unsigned char *archive_header, unsigned threads);  // Derives the key from the header of an archive and checks it
+	const unsigned char* Header();                                             // TAR_CRYPT_HEADER_SIZE bytes that start the archive
+	size_t Chunk_Size();                                                       // Plaintext bytes of every chunk but the last
+	size_t Max_Pending();                                                      // Chunks worth keeping queued to keep every worker busy
+	bool Submit(std::vector<unsigned char> *data, bool final);                 // Queues the next chunk in order, takes the contents of data
+	bool Next(std::vector<unsigned char> *data, bool wait);                    // Result of the oldest chunk, false if it is not done yet or failed
+	size_t Pending();                                                          // Chunks submitted and not returned by Next yet
+	bool Failed();                                                             // A chunk failed to encrypt or to authenticate
+	bool Crypt_Chunk(unsigned long long chunk_index, bool final, const unsigned char *data, size_t size, std::vector<unsigned char> *out);  // Encrypts or decrypts one chunk on the calling thread
+
+	static bool Available();                                                   // Returns false if AES-GCM was not included in this build
+	static bool Is_Header(const unsigned char *data);                          // Checks the magic of the first 4 bytes of an archive
+	static int Check_Password(const std::string& filename, const std::string& password, bool *gzip);  // -1 on errors, 0 for a wrong password, 1 if it matches
+
+private:
+	struct Chunk {
+		std::vector<unsigned char> in;
+		std::vector<unsigned char> out;
+		unsigned long long index;
+		bool final;
+		bool done;
+		bool error;
+	};
+
+	static void Run_Chunk(void *owner, void *chunk);
+	static bool Derive_Key(const std::string& password, const unsigned char *salt, unsigned long iterations, unsigned char *derived);
+	static bool Key_Check(const unsigned char *derived, unsigned char *check);
+	int Load_Header(const std::string& password, const unsigned char *archive_header);
+	void Start_Workers(unsigned threads);
+
+	bool writing;
+	bool failed;
+	unsigned char header[TAR_CRYPT_HEADER_SIZE];
+	unsigned char key[TAR_CRYPT_KEY_SIZE];
+	size_t chunk_size;
+	unsigned long long next_index;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::deque<Chunk*> inflight;                                               // Chunks in archive order
+	unsigned workers;                                                          // chunks worked on at once in the twrpWorkPool, 0 does them in Submit
+};
+
+#endif // __TWRPTARCRYPT_HPP
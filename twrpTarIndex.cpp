@@ -0,0 +1,135 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "twrpTarIndex.hpp"
+#include "twrpManifest.hpp"
+#include "twcommon.h"
+
+#define TAR_INDEX_HEADER "twrp_index 1"
+
+using namespace std;
+
+twrpTarIndex::twrpTarIndex() {
+}
+
+void twrpTarIndex::Add_Entry(const string& name, unsigned long long offset) {
+	Entry entry;
+
+	entry.offset = offset;
+	entry.name = name;
+	entries.push_back(entry);
+}
+
+void twrpTarIndex::Add_Restart(unsigned long long file_offset, unsigned long long data_offset) {
+	Tar_Stream_Restart restart;
+
+	restart.file_offset = file_offset;
+	restart.data_offset = data_offset;
+	restarts.push_back(restart);
+}
+
+bool twrpTarIndex::Write(const string& filename) {
+	FILE *fp;
+	bool ret;
+
+	fp = fopen(filename.c_str(), "w");
+	if (fp == NULL) {
+		LOGINFO("Unable to create archive index '%s': %s\n", filename.c_str(), strerror(errno));
+		return false;
+	}
+	fprintf(fp, "%s\n", TAR_INDEX_HEADER);
+	for (size_t i = 0; i < restarts.size(); i++)
+		fprintf(fp, "restart %llu %llu\n", restarts[i].file_offset, restarts[i].data_offset);
+	for (size_t i = 0; i < entries.size(); i++)
+		fprintf(fp, "entry %llu %s\n", entries[i].offset, twrpManifest::Escape(entries[i].name).c_str());
+	fprintf(fp, "end %zu\n", entries.size());
+	ret = !ferror(fp);
+	if (fclose(fp) != 0)
+		ret = false;
+	if (!ret) {
+		LOGINFO("Unable to write archive index '%s'\n", filename.c_str());
+		unlink(filename.c_str());
+	}
+	return ret;
+}
+
+bool twrpTarIndex::Load(const string& filename) {
+	FILE *fp;
+	char *line = NULL;
+	size_t line_size = 0;
+	unsigned long long first, second;
+	size_t count;
+	int name_pos;
+	bool header = true, complete = false;
+
+	entries.clear();
+	restarts.clear();
+	fp = fopen(filename.c_str(), "r");
+	if (fp == NULL)
+		return false;
+	while (getline(&line, &line_size, fp) > 0) {
+		if (header) {
+			header = false;
+			if (strncmp(line, TAR_INDEX_HEADER, strlen(TAR_INDEX_HEADER)) != 0)
+				break;
+		} else if (sscanf(line, "entry %llu%n", &first, &name_pos) == 1 && line[name_pos] == ' ') {
+			Add_Entry(twrpManifest::Unescape(line + name_pos + 1), first);
+		} else if (sscanf(line, "restart %llu %llu", &first, &second) == 2) {
+			Add_Restart(first, second);
+		} else if (sscanf(line, "end %zu", &count) == 1) {
+			complete = (count == entries.size());
+			break;
+		}
+	}
+	free(line);
+	fclose(fp);
+	if (!complete) {
+		// Written after the archive was closed, a partial index is never used
+		LOGINFO("Archive index '%s' is incomplete, ignoring it\n", filename.c_str());
+		entries.clear();
+		restarts.clear();
+		return false;
+	}
+	return true;
+}
+
+Tar_Stream_Restart twrpTarIndex::Get_Restart(unsigned long long offset) {
+	Tar_Stream_Restart ret;
+	size_t low = 0, high = restarts.size();
+
+	// Uncompressed archives have no list, every offset is its own restart point
+	ret.file_offset = offset;
+	ret.data_offset = offset;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (restarts[mid].data_offset <= offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (low > 0)
+		ret = restarts[low - 1];
+	return ret;
+}
@@ -0,0 +1,56 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPTARINDEX_HPP
+#define __TWRPTARINDEX_HPP
+
+#include <string>
+#include <vector>
+#include "twrpTarStream.hpp"
+
+#define TAR_INDEX_EXTENSION ".index"                                            // Appended to each archive, e.g. data.ext4.win000.index
+
+// Index of the members of one archive, written next to it when it is created.
+// Each member is listed with the offset of its header in the tar data. For
+// compressed archives the restart points of the stream are listed as well:
+// the start of every gzip member and every LZ4 frame. A member can be read by
+// decoding from the last restart point before it, so looking up or restoring a
+// few paths does not mean reading the whole archive.
+class twrpTarIndex
+{
+public:
+	struct Entry {
+		unsigned long long offset;                                             // header offset in the tar data
+		std::string name;                                                      // member name as stored in the archive
+	};
+
+	twrpTarIndex();
+
+	void Add_Entry(const std::string& name, unsigned long long offset);
+	void Add_Restart(unsigned long long file_offset, unsigned long long data_offset);
+	bool Write(const std::string& filename);
+	bool Load(const std::string& filename);
+	const std::vector<Entry>& Get_Entries() { return entries; }
+	Tar_Stream_Restart Get_Restart(unsigned long long offset);                 // Last restart point at or before offset
+
+private:
+	std::vector<Entry> entries;
+	std::vector<Tar_Stream_Restart> restarts;
+};
+
+#endif // __TWRPTARINDEX_HPP
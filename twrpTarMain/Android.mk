@@ -7,13 +7,25 @@ LOCAL_SRC_FILES:= \
 	twrpTarMain.cpp \
 	../twrp-functions.cpp \
 	../twrpTar.cpp \
+	../twrpTarStream.cpp \
+	../twrpTarCrypt.cpp \
+	../twrpWorkPool.cpp \
+	../twrpTarIndex.cpp \
+	../twrpManifest.cpp \
+	../twrpSnapshot.cpp \
 	../tarWrite.c \
 	../exclude.cpp \
 	../progresstracking.cpp \
+	../twrpChunkStore.cpp \
+	../twrpTrace.cpp \
+	../twrpMemory.cpp \
+	../twrpDigest/twrpDigest.cpp \
+	../twrpDigest/twrpMD5.cpp \
+	../twrpDigest/digest/md5/md5.c \
 	../gui/twmsg.cpp
 LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN
 
-LOCAL_C_INCLUDES += bionic
+LOCAL_C_INCLUDES += bionic external/openssl/include
 
 LOCAL_STATIC_LIBRARIES := libc libtar_static libz
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
@@ -25,13 +37,31 @@ LOCAL_STATIC_LIBRARIES += libstdc++
 LOCAL_C_INCLUDES += external/libselinux/include
 LOCAL_STATIC_LIBRARIES += libselinux
 
+ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
+	LOCAL_CFLAGS += -DTW_NO_SHA2_LIBRARY
+else
+	LOCAL_SRC_FILES += ../twrpDigest/twrpSHA.cpp
+	LOCAL_STATIC_LIBRARIES += libcrypto_static
+endif
+
 ifneq ($(RECOVERY_SDCARD_ON_DATA),)
 	LOCAL_CFLAGS += -DRECOVERY_SDCARD_ON_DATA
 endif
+ifneq ($(wildcard external/lz4/lib/lz4frame.h),)
+	LOCAL_CFLAGS += -DTW_HAVE_LZ4
+	LOCAL_C_INCLUDES += external/lz4/lib
+	LOCAL_STATIC_LIBRARIES += liblz4
+endif
+ifneq ($(TW_TAR_BUFFER_SIZE_MB),)
+	LOCAL_CFLAGS += -DTW_TAR_BUFFER_SIZE_MB=$(TW_TAR_BUFFER_SIZE_MB)
+endif
 ifeq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
     LOCAL_CFLAGS += -DTW_EXCLUDE_ENCRYPTED_BACKUPS
 else
 	LOCAL_STATIC_LIBRARIES += libopenaes_static
+	ifeq ($(shell test $(PLATFORM_SDK_VERSION) -ge 24; echo $$?),0)
+		LOCAL_CFLAGS += -DTW_HAVE_AES_GCM
+	endif
 endif
 
 LOCAL_MODULE:= twrpTar_static
@@ -49,13 +79,25 @@ LOCAL_SRC_FILES:= \
 	twrpTarMain.cpp \
 	../twrp-functions.cpp \
 	../twrpTar.cpp \
+	../twrpTarStream.cpp \
+	../twrpTarCrypt.cpp \
+	../twrpWorkPool.cpp \
+	../twrpTarIndex.cpp \
+	../twrpManifest.cpp \
+	../twrpSnapshot.cpp \
 	../tarWrite.c \
 	../exclude.cpp \
 	../progresstracking.cpp \
+	../twrpChunkStore.cpp \
+	../twrpTrace.cpp \
+	../twrpMemory.cpp \
+	../twrpDigest/twrpDigest.cpp \
+	../twrpDigest/twrpMD5.cpp \
+	../twrpDigest/digest/md5/md5.c \
 	../gui/twmsg.cpp
 LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN
 
-LOCAL_C_INCLUDES += bionic
+LOCAL_C_INCLUDES += bionic external/openssl/include
 LOCAL_SHARED_LIBRARIES := libc libtar libz
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
     LOCAL_C_INCLUDES += external/stlport/stlport bionic/libstdc++/include
@@ -66,13 +108,31 @@ LOCAL_SHARED_LIBRARIES += libstdc++
 LOCAL_C_INCLUDES += external/libselinux/include
 LOCAL_SHARED_LIBRARIES += libselinux
 
+ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
+	LOCAL_CFLAGS += -DTW_NO_SHA2_LIBRARY
+else
+	LOCAL_SRC_FILES += ../twrpDigest/twrpSHA.cpp
+	LOCAL_SHARED_LIBRARIES += libcrypto
+endif
+
 ifneq ($(RECOVERY_SDCARD_ON_DATA),)
 	LOCAL_CFLAGS += -DRECOVERY_SDCARD_ON_DATA
 endif
+ifneq ($(wildcard external/lz4/lib/lz4frame.h),)
+	LOCAL_CFLAGS += -DTW_HAVE_LZ4
+	LOCAL_C_INCLUDES += external/lz4/lib
+	LOCAL_STATIC_LIBRARIES += liblz4
+endif
+ifneq ($(TW_TAR_BUFFER_SIZE_MB),)
+	LOCAL_CFLAGS += -DTW_TAR_BUFFER_SIZE_MB=$(TW_TAR_BUFFER_SIZE_MB)
+endif
 ifeq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
     LOCAL_CFLAGS += -DTW_EXCLUDE_ENCRYPTED_BACKUPS
 else
 	LOCAL_SHARED_LIBRARIES += libopenaes
+	ifeq ($(shell test $(PLATFORM_SDK_VERSION) -ge 24; echo $$?),0)
+		LOCAL_CFLAGS += -DTW_HAVE_AES_GCM
+	endif
 endif
 
 LOCAL_MODULE:= twrpTar
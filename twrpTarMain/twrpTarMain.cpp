@@ -23,7 +23,21 @@
 #include "../progresstracking.hpp"
 #include "../gui/gui.hpp"
 #include "../gui/twmsg.h"
+#include "../twrpTarStream.hpp"
+#include "../twrpDigest/twrpDigest.hpp"
+#include "../twrpDigest/twrpMD5.hpp"
+#ifndef TW_NO_SHA2_LIBRARY
+#include "../twrpDigest/twrpSHA.hpp"
+#endif
+#include "../variables.h"
 #include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <algorithm>
+#include <fstream>
+#include <vector>
 
 void gui_msg(const char* text)
 {
@@ -71,23 +85,116 @@ void usage() {
 	printf(" -d    target directory\n");
 	printf(" -t    output file\n");
 	printf(" -m    skip media subfolder (has data media)\n");
-	printf(" -z    compress backup (/sbin/pigz must be present)\n");
+	printf(" -z    compress backup with gzip\n");
+	printf(" -l    compress backup with LZ4\n");
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
-	printf(" -e    encrypt/decrypt backup followed by password (/sbin/openaes must be present)\n");
+	printf(" -e    encrypt/decrypt backup followed by password\n");
 	printf(" -u    encrypt using userdata encryption (must be used with -e)\n");
+#endif
+	printf(" -j    archive or extract threads, default one per core up to 8\n");
+	printf(" -b    output buffer of uncompressed archives in KiB, default %i\n", TAR_STREAM_PLAIN_BUFFER_SIZE / 1024);
+	printf(" -s    split archives at this many MiB, default %llu\n", MAX_ARCHIVE_SIZE / 1048576);
+	printf(" -g    create digests of the archives, or verify them before extracting\n");
+#ifndef TW_NO_SHA2_LIBRARY
+	printf(" -2    use SHA2 instead of MD5 for the digests\n");
 #endif
 	printf("\n\n");
 	printf("Example: twrpTar -c -d /cache -t /sdcard/test.tar\n");
 	printf("         twrpTar -x -d /cache -t /sdcard/test.tar\n");
+	printf("         twrpTar -c -d /mnt/data -t /tmp/data.ext4.win -z -j 4 -g\n");
+}
+
+struct Phase {
+	const char *name;
+	unsigned long long bytes;
+	double seconds;
+};
+
+static double Now() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void Add_Phase(std::vector<Phase> *phases, const char *name, unsigned long long bytes, double start) {
+	Phase phase;
+	phase.name = name;
+	phase.bytes = bytes;
+	phase.seconds = Now() - start;
+	phases->push_back(phase);
+}
+
+static void Print_Phases(const std::vector<Phase>& phases) {
+	printf("\n%-10s %12s %10s %10s\n", "phase", "MB", "seconds", "MB/s");
+	for (size_t i = 0; i < phases.size(); i++) {
+		double mb = phases[i].bytes / 1048576.0;
+		printf("%-10s %12.1f %10.3f %10.1f\n", phases[i].name, mb, phases[i].seconds, phases[i].seconds > 0 ? mb / phases[i].seconds : 0);
+	}
+}
+
+// The archive itself, or the split and per thread archives written
+// instead of it: the name followed by three digits
+static void Find_Archives(const string& Tar_Filename, std::vector<string> *archives) {
+	if (TWFunc::Path_Exists(Tar_Filename)) {
+		archives->push_back(Tar_Filename);
+		return;
+	}
+	string dir = TWFunc::Get_Path(Tar_Filename);
+	string base = TWFunc::Get_Filename(Tar_Filename);
+	DIR *d = opendir(dir.empty() ? "." : dir.c_str());
+	if (d == NULL)
+		return;
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		string name = de->d_name;
+		if (name.size() == base.size() + 3 && name.compare(0, base.size(), base) == 0
+				&& isdigit(name[base.size()]) && isdigit(name[base.size() + 1]) && isdigit(name[base.size() + 2]))
+			archives->push_back(dir + name);
+	}
+	closedir(d);
+	std::sort(archives->begin(), archives->end());
+}
+
+static bool Digest_Archive(const string& Filename, bool use_sha2, string *digest_str, unsigned long long *bytes) {
+	twrpDigest *digest;
+#ifndef TW_NO_SHA2_LIBRARY
+	if (use_sha2)
+		digest = new twrpSHA256();
+	else
+#endif
+		digest = new twrpMD5();
+	int fd = open(Filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		printf("Unable to open '%s': %s\n", Filename.c_str(), strerror(errno));
+		delete digest;
+		return false;
+	}
+	uint64_t read_bytes = 0;
+	int err = digest->update_from_fd(fd, &read_bytes);
+	close(fd);
+	if (err != 0) {
+		printf("Unable to read '%s': %s\n", Filename.c_str(), strerror(err));
+		delete digest;
+		return false;
+	}
+	*digest_str = digest->return_digest_string();
+	*bytes += read_bytes;
+	delete digest;
+	return true;
 }
 
 int main(int argc, char **argv) {
 	twrpTar tar;
-	int use_encryption = 0, userdata_encryption = 0, has_data_media = 0, use_compression = 0, include_root = 0;
-	int i, action = 0;
-	unsigned j;
+	int use_encryption = 0, userdata_encryption = 0, has_data_media = 0, use_compression = 0, use_lz4 = 0;
+	int i, action = 0, use_digest = 0, use_sha2 = 0;
+	unsigned j, threads = 0;
+	unsigned long long split_size = MAX_ARCHIVE_SIZE, backup_size = 0, digest_bytes = 0;
 	string Directory, Tar_Filename;
 	ProgressTracking progress(1);
+	PartitionSettings part_settings;
+	std::vector<Phase> phases;
+	std::vector<string> archives;
+	double start;
 	pid_t tar_fork_pid = 0;
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	string Password;
@@ -151,6 +258,15 @@ int main(int argc, char **argv) {
 			if (action == 2)
 				printf("NOTE: %s option not needed when extracting.\n", argv[i]);
 			use_compression = 1;
+		} else if (strcmp(argv[i], "-l") == 0) {
+			if (action == 2)
+				printf("NOTE: %s option not needed when extracting.\n", argv[i]);
+			if (!twrpTarStream::Codec_Available(TAR_STREAM_LZ4)) {
+				printf("LZ4 support not present\n");
+				return -1;
+			}
+			use_compression = 1;
+			use_lz4 = 1;
 		} else if (strcmp(argv[i], "-u") == 0) {
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 			if (action == 2)
@@ -161,16 +277,66 @@ int main(int argc, char **argv) {
 			usage();
 			return -1;
 #endif
+		} else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "-s") == 0) {
+			i++;
+			if (argc <= i || atoi(argv[i]) <= 0) {
+				printf("No valid argument specified for %s\n", argv[i - 1]);
+				usage();
+				return -1;
+			}
+			if (strcmp(argv[i - 1], "-j") == 0)
+				threads = atoi(argv[i]);
+			else if (strcmp(argv[i - 1], "-b") == 0)
+				twrpTarStream::Set_Plain_Buffer_Size((size_t)atoi(argv[i]) * 1024);
+			else
+				split_size = strtoull(argv[i], NULL, 10) * 1048576;
+		} else if (strcmp(argv[i], "-g") == 0) {
+			use_digest = 1;
 		}
+#ifndef TW_NO_SHA2_LIBRARY
+		else if (strcmp(argv[i], "-2") == 0) {
+			use_sha2 = 1;
+		}
+#endif
 	}
 
+	// Only what twrpTar reads outside of recovery, the rest is for adb backups and the GUI
+	part_settings.Part = NULL;
+	part_settings.adbbackup = false;
+	part_settings.adb_compression = 0;
+	part_settings.use_lz4 = use_lz4 != 0;
+	part_settings.adb_stream = 0;
+	part_settings.adb_resume_offset = 0;
+	part_settings.generate_digest = false;
+	part_settings.generate_md5 = false;
+	part_settings.verify_digest = false;
+	part_settings.total_restore_size = 0;
+	part_settings.img_bytes_remaining = 0;
+	part_settings.file_bytes_remaining = 0;
+	part_settings.img_time = 0;
+	part_settings.file_time = 0;
+	part_settings.img_bytes = 0;
+	part_settings.file_bytes = 0;
+	part_settings.partition_count = 1;
+	part_settings.progress = &progress;
+	part_settings.PM_Method = (action == 1 ? PM_BACKUP : PM_RESTORE);
+
 	TWExclude exclude;
-	exclude.add_absolute_dir("/data/media");
-	tar.has_data_media = has_data_media;
+	if (has_data_media)
+		exclude.add_absolute_dir(Directory + "/media");
 	tar.setdir(Directory);
 	tar.setfn(Tar_Filename);
-	tar.setsize(exclude.Get_Folder_Size(Directory));
+	tar.part_settings = &part_settings;
+	tar.max_threads = threads;
+	tar.split_size = split_size;
+	if (action == 1) {
+		start = Now();
+		backup_size = exclude.Get_Folder_Size(Directory);
+		Add_Phase(&phases, "scan", backup_size, start);
+	}
+	tar.setsize(backup_size);
 	tar.use_compression = use_compression;
+	tar.use_lz4 = use_lz4;
 	tar.backup_exclusions = &exclude;
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	if (userdata_encryption && !use_encryption) {
@@ -187,19 +353,75 @@ int main(int argc, char **argv) {
 	}
 #endif
 	if (action == 1) {
+		start = Now();
 		if (tar.createTarFork(&tar_fork_pid) != 0) {
 			sync();
 			return -1;
 		}
+		Add_Phase(&phases, "archive", backup_size, start);
+		start = Now();
 		sync();
+		Add_Phase(&phases, "sync", 0, start);
+		if (use_digest) {
+			start = Now();
+			Find_Archives(Tar_Filename, &archives);
+			for (j = 0; j < archives.size(); j++) {
+				string digest_str;
+				if (!Digest_Archive(archives[j], use_sha2, &digest_str, &digest_bytes))
+					return -1;
+				// Same format as recovery, so the backup can be restored there
+				string digest_fn = archives[j] + (use_sha2 ? ".sha2" : ".md5");
+				FILE *digest_file = fopen(digest_fn.c_str(), "w");
+				if (digest_file == NULL || fprintf(digest_file, "%s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(archives[j]).c_str()) < 0 || fclose(digest_file) != 0) {
+					printf("Unable to write '%s'\n", digest_fn.c_str());
+					return -1;
+				}
+			}
+			Add_Phase(&phases, "digest", digest_bytes, start);
+		}
 		printf("\n\ntar created successfully.\n");
 	} else if (action == 2) {
+		if (use_digest) {
+			start = Now();
+			Find_Archives(Tar_Filename, &archives);
+			for (j = 0; j < archives.size(); j++) {
+				string digest_str, expected, digest_fn = archives[j] + ".sha2";
+#ifndef TW_NO_SHA2_LIBRARY
+				bool sha2 = TWFunc::Path_Exists(digest_fn);
+#else
+				bool sha2 = false;
+#endif
+				if (!sha2)
+					digest_fn = archives[j] + ".md5";
+				std::ifstream digest_file(digest_fn.c_str());
+				if (!(digest_file >> expected)) {
+					printf("No digest found for '%s'\n", archives[j].c_str());
+					return -1;
+				}
+				if (!Digest_Archive(archives[j], sha2, &digest_str, &digest_bytes))
+					return -1;
+				if (digest_str != expected) {
+					printf("Digest failed to match on '%s'\n", archives[j].c_str());
+					return -1;
+				}
+			}
+			Add_Phase(&phases, "verify", digest_bytes, start);
+		}
+		archives.clear();
+		Find_Archives(Tar_Filename, &archives);
+		for (j = 0; j < archives.size(); j++)
+			backup_size += TWFunc::Get_File_Size(archives[j]);
+		start = Now();
 		if (tar.extractTarFork() != 0) {
 			sync();
 			return -1;
 		}
+		Add_Phase(&phases, "extract", backup_size, start);
+		start = Now();
 		sync();
+		Add_Phase(&phases, "sync", 0, start);
 		printf("\n\ntar extracted successfully.\n");
 	}
+	Print_Phases(phases);
 	return 0;
 }
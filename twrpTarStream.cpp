@@ -0,0 +1,1468 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "twrpTarStream.hpp"
+#include "twrpTarIndex.hpp"
+#include "twrpTarCrypt.hpp"
+#include "twrpWorkPool.hpp"
+#include "twcommon.h"
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	#include "openaes/inc/oaes_lib.h"
+#endif
+#ifdef TW_HAVE_LZ4
+	#include <lz4frame.h>
+#endif
+
+#define TAR_STREAM_MAX_FD 1024
+#define TAR_STREAM_FRAME_ENTRY 12                                               // file size, data size and CRC32 of a frame
+#define TAR_STREAM_FOOTER 16                                                    // magic, version, frame count and table size
+#define TAR_STREAM_GZIP_RECORD 26                                               // empty gzip member around an extra field
+#define TAR_STREAM_GZIP_RECORD_MAX (5460 * TAR_STREAM_FRAME_ENTRY)              // the extra field is limited to 64KB
+#define TAR_STREAM_LZ4_RECORD 8                                                 // skippable frame magic and size
+#define TAR_STREAM_LZ4_TABLE_MAGIC 0x184D2A5AUL
+#define TAR_STREAM_LZ4_FOOTER_MAGIC 0x184D2A5BUL
+#define TAR_STREAM_STORE_ENTROPY 7.9                                            // Bits per byte above which a block is stored instead of deflated
+#define TAR_STREAM_STORED_MAX 65535                                             // Longest deflate stored block
+
+static twrpTarStream* stream_table[TAR_STREAM_MAX_FD];
+static pthread_mutex_t stream_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+size_t twrpTarStream::plain_buffer_size = TAR_STREAM_PLAIN_BUFFER_SIZE;
+
+static void Put_LE32(unsigned char *ptr, unsigned long value) {
+	for (int i = 0; i < 4; i++)
+		ptr[i] = (value >> (8 * i)) & 0xff;
+}
+
+static unsigned long Get_LE32(const unsigned char *ptr) {
+	return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((unsigned long) ptr[3] << 24);
+}
+
+// Media, APKs and other files that are compressed already use nearly all byte
+// values evenly, deflate spends most of its time on them to save a percent or two
+static bool Looks_Incompressible(const std::vector<unsigned char>& data) {
+	unsigned long counts[256] = { 0 };
+	double bits = 0;
+
+	if (data.size() < TAR_STREAM_DICT_SIZE)
+		return false;
+	for (size_t i = 0; i < data.size(); i++)
+		counts[data[i]]++;
+	for (int i = 0; i < 256; i++) {
+		if (counts[i] != 0)
+			bits -= counts[i] * log2((double) counts[i] / data.size());
+	}
+	return bits / data.size() > TAR_STREAM_STORE_ENTROPY;
+}
+
+// Returns the payload of a frame table record at data, NULL if there is none
+static const unsigned char* Parse_Frame_Record(const unsigned char *data, size_t avail, Tar_Stream_Codec codec, bool footer, size_t *payload_size, size_t *record_size) {
+	if (codec == TAR_STREAM_GZIP) {
+		if (avail < TAR_STREAM_GZIP_RECORD || data[0] != 0x1f || data[1] != 0x8b || data[2] != 8 || data[3] != 4)
+			return NULL;
+		size_t xlen = data[10] | (data[11] << 8);
+		size_t sublen = data[14] | (data[15] << 8);
+		if (data[12] != 'T' || data[13] != (footer ? 'F' : 'W') || xlen != sublen + 4)
+			return NULL;
+		*payload_size = sublen;
+		*record_size = TAR_STREAM_GZIP_RECORD + sublen;
+		if (avail < *record_size || data[12 + xlen] != 3 || data[13 + xlen] != 0)
+			return NULL;
+		return data + 16;
+	}
+	if (avail < TAR_STREAM_LZ4_RECORD || Get_LE32(data) != (footer ? TAR_STREAM_LZ4_FOOTER_MAGIC : TAR_STREAM_LZ4_TABLE_MAGIC))
+		return NULL;
+	*payload_size = Get_LE32(data + 4);
+	*record_size = TAR_STREAM_LZ4_RECORD + *payload_size;
+	if (avail < *record_size)
+		return NULL;
+	return data + TAR_STREAM_LZ4_RECORD;
+}
+
+twrpTarStream::twrpTarStream() {
+	fd = -1;
+	prog_slot = NULL;
+	writing = false;
+	codec = TAR_STREAM_PLAIN;
+	compress = false;
+	encrypt = false;
+	failed = false;
+	oaes_ctx = NULL;
+	crypt = NULL;
+	digest = NULL;
+	index = NULL;
+	file_total = 0;
+	data_total = 0;
+	block_count = 0;
+	plain_buf = NULL;
+	plain_len = 0;
+	plain_size = plain_buffer_size;
+	current = NULL;
+	max_inflight = 0;
+	pooled = false;
+	total_in = 0;
+	frame_table = false;
+	frame_open = false;
+	frame_mode = false;
+	next_frame = 0;
+	out_pos = 0;
+	crypt_len = 0;
+	crypt_pos = 0;
+	crypt_eof = false;
+	inflate_init = false;
+	inflate_eof = false;
+	read_pos = 0;
+	read_len = 0;
+	lz4_dctx = NULL;
+	lz4_hint = 1;
+	pthread_mutex_init(&job_lock, NULL);
+	pthread_cond_init(&job_cond, NULL);
+}
+
+twrpTarStream::~twrpTarStream() {
+	Cancel_Jobs();
+	delete current;
+	delete crypt;
+	free(plain_buf);
+	if (inflate_init)
+		inflateEnd(&inflate_strm);
+#ifdef TW_HAVE_LZ4
+	if (lz4_dctx != NULL)
+		LZ4F_freeDecompressionContext((LZ4F_dctx*) lz4_dctx);
+#endif
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	if (oaes_ctx != NULL) {
+		OAES_CTX *ctx = (OAES_CTX*) oaes_ctx;
+		oaes_free(&ctx);
+	}
+#endif
+	pthread_cond_destroy(&job_cond);
+	pthread_mutex_destroy(&job_lock);
+}
+
+twrpTarStream* twrpTarStream::Find(int find_fd) {
+	if (find_fd < 0 || find_fd >= TAR_STREAM_MAX_FD)
+		return NULL;
+	return stream_table[find_fd];
+}
+
+void twrpTarStream::Set_Plain_Buffer_Size(size_t size) {
+	// Whole tar blocks, and at least one
+	size -= size % 512;
+	plain_buffer_size = size ? size : 512;
+}
+
+bool twrpTarStream::Codec_Available(Tar_Stream_Codec stream_codec) {
+#ifndef TW_HAVE_LZ4
+	if (stream_codec == TAR_STREAM_LZ4)
+		return false;
+#endif
+	return true;
+}
+
+bool twrpTarStream::Measure_Codec(Tar_Stream_Codec stream_codec, const std::vector<unsigned char>& sample, double *bytes_per_sec, double *ratio) {
+	twrpTarStream bench;
+	z_stream strm;
+	Job job;
+	struct timespec start, end;
+	unsigned long long in_size = 0, out_size = 0;
+	bool ret = true;
+
+	if (stream_codec == TAR_STREAM_PLAIN || !Codec_Available(stream_codec) || sample.empty())
+		return false;
+	memset(&strm, 0, sizeof(strm));
+	if (stream_codec == TAR_STREAM_GZIP && deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	// Blocks are compressed the way a worker thread does it, so this is the speed of one thread
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t pos = 0; ret && pos < sample.size(); pos += TAR_STREAM_BLOCK_SIZE) {
+		size_t len = std::min(sample.size() - pos, (size_t) TAR_STREAM_BLOCK_SIZE);
+		job.in.assign(sample.begin() + pos, sample.begin() + pos + len);
+		ret = (stream_codec == TAR_STREAM_GZIP ? bench.Compress_Job(&job, &strm) : bench.Compress_Job_LZ4(&job));
+		in_size += len;
+		out_size += job.out.size();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (stream_codec == TAR_STREAM_GZIP)
+		deflateEnd(&strm);
+	if (!ret)
+		return false;
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	*bytes_per_sec = in_size / std::max(secs, 1e-6);
+	*ratio = (double) out_size / in_size;
+	return true;
+}
+
+void twrpTarStream::Register() {
+	pthread_mutex_lock(&stream_table_lock);
+	stream_table[fd] = this;
+	pthread_mutex_unlock(&stream_table_lock);
+}
+
+void twrpTarStream::Unregister() {
+	pthread_mutex_lock(&stream_table_lock);
+	if (fd >= 0 && fd < TAR_STREAM_MAX_FD && stream_table[fd] == this)
+		stream_table[fd] = NULL;
+	pthread_mutex_unlock(&stream_table_lock);
+}
+
+bool twrpTarStream::Setup_Encryption(const std::string& password, unsigned threads) {
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	unsigned char header[TAR_CRYPT_HEADER_SIZE];
+	uint8_t key_data[32];
+	size_t key_data_len, j;
+
+	// New archives are written as AES-GCM chunks when the build has them. The
+	// header is written and read with the first chunk so the digest covers it.
+	if ((writing && twrpTarCrypt::Available()) || (!writing && pread64(fd, header, sizeof(header), 0) == sizeof(header) && twrpTarCrypt::Is_Header(header))) {
+		crypt = new twrpTarCrypt();
+		if (writing ? !crypt->Init_Write(password, threads, codec == TAR_STREAM_GZIP) : !crypt->Init_Read(password, header, threads))
+			return false;
+		crypt_buf.reserve(crypt->Chunk_Size() + TAR_CRYPT_TAG_SIZE);
+		encrypt = true;
+		return true;
+	}
+
+	// Key padding matches the openaes binary so archives stay interchangeable
+	for (j = 0; j < 32; j++)
+		key_data[j] = j + 1;
+	key_data_len = password.size();
+	if (key_data_len <= 16)
+		key_data_len = 16;
+	else if (key_data_len <= 24)
+		key_data_len = 24;
+	else
+		key_data_len = 32;
+	memcpy(key_data, password.c_str(), password.size() < 32 ? password.size() : 32);
+
+	OAES_CTX *ctx = oaes_alloc();
+	if (ctx == NULL) {
+		LOGINFO("twrpTarStream failed to allocate OAES\n");
+		return false;
+	}
+	oaes_key_import_data(ctx, key_data, key_data_len);
+	oaes_ctx = ctx;
+	crypt_buf.resize(TAR_STREAM_OAES_CIPHER);
+	encrypt = true;
+	return true;
+#else
+	LOGINFO("twrpTarStream: encryption support is not included in this build\n");
+	return false;
+#endif
+}
+
+bool twrpTarStream::Open_Write(int out_fd, Tar_Stream_Codec stream_codec, const std::string& password, unsigned threads, struct tar_progress_slot *progress) {
+	if (out_fd < 0 || out_fd >= TAR_STREAM_MAX_FD) {
+		LOGINFO("twrpTarStream invalid fd %i\n", out_fd);
+		return false;
+	}
+	if (!Codec_Available(stream_codec)) {
+		LOGINFO("twrpTarStream codec %i is not included in this build\n", stream_codec);
+		return false;
+	}
+	fd = out_fd;
+	prog_slot = progress;
+	writing = true;
+	codec = stream_codec;
+	compress = (codec != TAR_STREAM_PLAIN);
+	if (!password.empty() && !Setup_Encryption(password, threads))
+		return false;
+
+	if (compress) {
+		struct stat st;
+
+		if (threads == 0)
+			threads = twrpWorkPool::CPU_Count();
+		max_inflight = threads * 2;
+		// The table can only be found again at the end of an unencrypted file,
+		// without it the archive is one gzip member that pigz -l can still list
+		frame_table = (!encrypt && fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+		if (!Start_Workers())
+			return false;
+		current = new Job;
+		current->in.reserve(TAR_STREAM_BLOCK_SIZE);
+		current->restart = true;
+		current->frame_start = true;
+	} else {
+		void *buf;
+		if (posix_memalign(&buf, TAR_STREAM_BUFFER_ALIGN, plain_size) != 0) {
+			LOGINFO("twrpTarStream unable to allocate output buffer\n");
+			return false;
+		}
+		plain_buf = (unsigned char*) buf;
+	}
+	Register();
+	return true;
+}
+
+bool twrpTarStream::Open_Read(int in_fd, Tar_Stream_Codec stream_codec, const std::string& password, unsigned threads) {
+	if (in_fd < 0 || in_fd >= TAR_STREAM_MAX_FD) {
+		LOGINFO("twrpTarStream invalid fd %i\n", in_fd);
+		return false;
+	}
+	if (!Codec_Available(stream_codec)) {
+		LOGINFO("twrpTarStream codec %i is not included in this build\n", stream_codec);
+		return false;
+	}
+	fd = in_fd;
+	writing = false;
+	codec = stream_codec;
+	compress = (codec != TAR_STREAM_PLAIN);
+	if (!password.empty() && !Setup_Encryption(password, threads))
+		return false;
+
+	if (codec == TAR_STREAM_GZIP) {
+		memset(&inflate_strm, 0, sizeof(inflate_strm));
+		if (inflateInit2(&inflate_strm, 15 + 16) != Z_OK) {
+			LOGINFO("twrpTarStream inflateInit2 failed\n");
+			return false;
+		}
+		inflate_init = true;
+	}
+#ifdef TW_HAVE_LZ4
+	if (codec == TAR_STREAM_LZ4) {
+		LZ4F_dctx *dctx;
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+			LOGINFO("twrpTarStream unable to create LZ4 decompression context\n");
+			return false;
+		}
+		lz4_dctx = dctx;
+	}
+#endif
+	if (compress)
+		read_buf.resize(TAR_STREAM_BLOCK_SIZE);
+	if (compress && !encrypt && Read_Frame_Table(fd, codec, &frames)) {
+		if (threads == 0)
+			threads = twrpWorkPool::CPU_Count();
+		if (threads > TAR_STREAM_READ_THREADS)
+			threads = TAR_STREAM_READ_THREADS;
+		if (threads < 1)
+			threads = 1;
+		max_inflight = threads + 2;
+		frame_mode = Start_Workers();
+	}
+	Register();
+	return true;
+}
+
+bool twrpTarStream::Start_Workers() {
+	if (!twrpWorkPool::Start()) {
+		LOGINFO("twrpTarStream has no worker threads\n");
+		return false;
+	}
+	pooled = true;
+	return true;
+}
+
+bool twrpTarStream::Read_Frame_Table(int table_fd, Tar_Stream_Codec stream_codec, std::vector<Frame> *table) {
+	unsigned char footer[TAR_STREAM_GZIP_RECORD + TAR_STREAM_FOOTER];
+	const unsigned char *payload;
+	size_t footer_size, payload_size, record_size, pos;
+	unsigned long long frame_count, table_size, file_offset = 0, data_offset = 0;
+	std::vector<unsigned char> records, entries;
+	struct stat st;
+
+	table->clear();
+	if (stream_codec == TAR_STREAM_PLAIN || fstat(table_fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+	footer_size = (stream_codec == TAR_STREAM_GZIP ? TAR_STREAM_GZIP_RECORD : TAR_STREAM_LZ4_RECORD) + TAR_STREAM_FOOTER;
+	if ((unsigned long long) st.st_size < footer_size || pread64(table_fd, footer, footer_size, st.st_size - footer_size) != (ssize_t) footer_size)
+		return false;
+	// Archives from pigz or from before frames were added have no footer
+	payload = Parse_Frame_Record(footer, footer_size, stream_codec, true, &payload_size, &record_size);
+	if (payload == NULL || payload_size != TAR_STREAM_FOOTER || memcmp(payload, TAR_STREAM_FRAME_MAGIC, 4) != 0 || Get_LE32(payload + 4) != TAR_STREAM_FRAME_VERSION)
+		return false;
+	frame_count = Get_LE32(payload + 8);
+	table_size = Get_LE32(payload + 12);
+	if (table_size + footer_size > (unsigned long long) st.st_size || table_size < frame_count * TAR_STREAM_FRAME_ENTRY) {
+		LOGINFO("twrpTarStream frame table is damaged, reading without it\n");
+		return false;
+	}
+
+	records.resize(table_size);
+	if (pread64(table_fd, records.data(), table_size, st.st_size - footer_size - table_size) != (ssize_t) table_size)
+		return false;
+	for (pos = 0; pos < records.size(); pos += record_size) {
+		payload = Parse_Frame_Record(records.data() + pos, records.size() - pos, stream_codec, false, &payload_size, &record_size);
+		if (payload == NULL)
+			break;
+		entries.insert(entries.end(), payload, payload + payload_size);
+	}
+	if (pos != records.size() || entries.size() != frame_count * TAR_STREAM_FRAME_ENTRY) {
+		LOGINFO("twrpTarStream frame table is damaged, reading without it\n");
+		return false;
+	}
+
+	for (pos = 0; pos < entries.size(); pos += TAR_STREAM_FRAME_ENTRY) {
+		Frame frame;
+		frame.file_offset = file_offset;
+		frame.data_offset = data_offset;
+		frame.file_size = Get_LE32(entries.data() + pos);
+		frame.data_size = Get_LE32(entries.data() + pos + 4);
+		frame.crc = Get_LE32(entries.data() + pos + 8);
+		file_offset += frame.file_size;
+		data_offset += frame.data_size;
+		table->push_back(frame);
+	}
+	if (file_offset + table_size + footer_size != (unsigned long long) st.st_size) {
+		LOGINFO("twrpTarStream frame table does not match the archive, reading without it\n");
+		table->clear();
+		return false;
+	}
+	return true;
+}
+
+bool twrpTarStream::Decrypt_Tail(unsigned long long *plain_size, unsigned char *tail, size_t tail_size) {
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	OAES_CTX *ctx = (OAES_CTX*) oaes_ctx;
+	unsigned char in[TAR_STREAM_OAES_CIPHER];
+	std::vector<unsigned char> plain;
+	unsigned long long chunk_count, chunk;
+	struct stat st;
+
+	// Every chunk is encrypted on its own, only the last ones need to be read
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+		return false;
+	if (crypt != NULL) {
+		size_t record_size = crypt->Chunk_Size() + TAR_CRYPT_TAG_SIZE;
+		std::vector<unsigned char> record(record_size), out;
+		unsigned long long data_size = st.st_size - TAR_CRYPT_HEADER_SIZE;
+
+		// Only the last chunk is short, its size gives the size of the plaintext
+		if ((unsigned long long) st.st_size < TAR_CRYPT_HEADER_SIZE + TAR_CRYPT_TAG_SIZE || data_size % record_size < TAR_CRYPT_TAG_SIZE)
+			return false;
+		chunk_count = data_size / record_size + 1;
+		for (chunk = chunk_count; chunk > 0 && (chunk == chunk_count || plain.size() < tail_size); chunk--) {
+			unsigned long long offset = TAR_CRYPT_HEADER_SIZE + (chunk - 1) * record_size;
+			size_t in_len = chunk == chunk_count ? data_size % record_size : record_size;
+			if (pread64(fd, record.data(), in_len, offset) != (ssize_t) in_len || !crypt->Crypt_Chunk(chunk - 1, chunk == chunk_count, record.data(), in_len, &out))
+				return false;
+			if (chunk == chunk_count)
+				*plain_size = (chunk_count - 1) * crypt->Chunk_Size() + out.size();
+			plain.insert(plain.begin(), out.begin(), out.end());
+		}
+		if (plain.size() < tail_size)
+			return false;
+		memcpy(tail, plain.data() + plain.size() - tail_size, tail_size);
+		return true;
+	}
+	chunk_count = (st.st_size + TAR_STREAM_OAES_CIPHER - 1) / TAR_STREAM_OAES_CIPHER;
+	for (chunk = chunk_count; chunk > 0 && (chunk == chunk_count || plain.size() < tail_size); chunk--) {
+		unsigned long long offset = (chunk - 1) * TAR_STREAM_OAES_CIPHER;
+		size_t in_len = st.st_size - offset < TAR_STREAM_OAES_CIPHER ? st.st_size - offset : TAR_STREAM_OAES_CIPHER;
+		size_t out_len = TAR_STREAM_OAES_CIPHER;
+		if (pread64(fd, in, in_len, offset) != (ssize_t) in_len || oaes_decrypt(ctx, in, in_len, crypt_buf.data(), &out_len) != OAES_RET_SUCCESS)
+			return false;
+		if (chunk == chunk_count)
+			*plain_size = (chunk_count - 1) * TAR_STREAM_OAES_PLAIN + out_len;
+		plain.insert(plain.begin(), crypt_buf.begin(), crypt_buf.begin() + out_len);
+	}
+	if (plain.size() < tail_size)
+		return false;
+	memcpy(tail, plain.data() + plain.size() - tail_size, tail_size);
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool twrpTarStream::Get_Data_Size(const std::string& filename, Tar_Stream_Codec stream_codec, const std::string& password, unsigned long long *size) {
+	twrpTarStream stream;
+	std::vector<Frame> table;
+	unsigned char isize[4];
+	unsigned long long plain_size = 0;
+	struct stat st;
+	bool ret = false;
+
+	stream.fd = open(filename.c_str(), O_RDONLY | O_LARGEFILE);
+	if (stream.fd < 0)
+		return false;
+	if (!password.empty()) {
+		// Encrypted archives have no frame table and are a single gzip member
+		if (stream.Setup_Encryption(password, 1) && stream.Decrypt_Tail(&plain_size, isize, stream_codec == TAR_STREAM_GZIP ? sizeof(isize) : 0)) {
+			*size = (stream_codec == TAR_STREAM_GZIP ? Get_LE32(isize) : plain_size);
+			ret = true;
+		}
+	} else if (Read_Frame_Table(stream.fd, stream_codec, &table)) {
+		*size = 0;
+		for (size_t i = 0; i < table.size(); i++)
+			*size += table[i].data_size;
+		ret = true;
+	} else if (stream_codec == TAR_STREAM_GZIP && fstat(stream.fd, &st) == 0 && st.st_size >= 18) {
+		// Same as pigz -l, the trailer only has the size modulo 4GB
+		if (pread64(stream.fd, isize, sizeof(isize), st.st_size - sizeof(isize)) == sizeof(isize)) {
+			*size = Get_LE32(isize);
+			ret = true;
+		}
+	}
+	close(stream.fd);
+	stream.fd = -1;
+	return ret;
+}
+
+// Codec state of a pool worker, reused by the jobs of every stream it runs
+struct stream_worker_state {
+	z_stream deflate_strm;
+	z_stream inflate_strm;
+	bool deflate_ready;
+	bool inflate_ready;
+	void *lz4_dctx;
+};
+
+static pthread_key_t worker_key;
+static pthread_once_t worker_key_once = PTHREAD_ONCE_INIT;
+
+static void Free_Worker_State(void *cookie) {
+	struct stream_worker_state *state = (struct stream_worker_state*) cookie;
+
+	if (state->deflate_ready)
+		deflateEnd(&state->deflate_strm);
+	if (state->inflate_ready)
+		inflateEnd(&state->inflate_strm);
+#ifdef TW_HAVE_LZ4
+	if (state->lz4_dctx != NULL)
+		LZ4F_freeDecompressionContext((LZ4F_dctx*) state->lz4_dctx);
+#endif
+	free(state);
+}
+
+static void Create_Worker_Key() {
+	pthread_key_create(&worker_key, Free_Worker_State);
+}
+
+void twrpTarStream::Run_Job(void *owner, void *cookie) {
+	twrpTarStream *stream = (twrpTarStream*) owner;
+	Job *job = (Job*) cookie;
+	struct stream_worker_state *state;
+	bool ret = false;
+
+	pthread_once(&worker_key_once, Create_Worker_Key);
+	state = (struct stream_worker_state*) pthread_getspecific(worker_key);
+	if (state == NULL) {
+		state = (struct stream_worker_state*) calloc(1, sizeof(*state));
+		if (state != NULL)
+			pthread_setspecific(worker_key, state);
+	}
+
+	if (state == NULL) {
+		LOGINFO("twrpTarStream unable to set up a worker thread\n");
+	} else if (stream->writing && stream->codec == TAR_STREAM_LZ4) {
+		ret = stream->Compress_Job_LZ4(job);
+	} else if (stream->writing) {
+		if (!state->deflate_ready)
+			state->deflate_ready = (deflateInit2(&state->deflate_strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+		if (state->deflate_ready)
+			ret = stream->Compress_Job(job, &state->deflate_strm);
+		else
+			LOGINFO("twrpTarStream unable to set up a worker thread\n");
+	} else {
+		bool ready = true;
+		if (stream->codec == TAR_STREAM_GZIP) {
+			if (!state->inflate_ready)
+				state->inflate_ready = (inflateInit2(&state->inflate_strm, 15 + 16) == Z_OK);
+			ready = state->inflate_ready;
+		}
+#ifdef TW_HAVE_LZ4
+		if (stream->codec == TAR_STREAM_LZ4) {
+			if (state->lz4_dctx == NULL) {
+				LZ4F_dctx *lz4_ctx;
+				if (!LZ4F_isError(LZ4F_createDecompressionContext(&lz4_ctx, LZ4F_VERSION)))
+					state->lz4_dctx = lz4_ctx;
+			}
+			ready = (state->lz4_dctx != NULL);
+		}
+#endif
+		if (ready)
+			ret = stream->Decompress_Job(job, &state->inflate_strm, state->lz4_dctx);
+		else
+			LOGINFO("twrpTarStream unable to set up a worker thread\n");
+#ifdef TW_HAVE_LZ4
+		// A context left in the middle of a damaged frame is not used again
+		if (!ret && state->lz4_dctx != NULL) {
+			LZ4F_freeDecompressionContext((LZ4F_dctx*) state->lz4_dctx);
+			state->lz4_dctx = NULL;
+		}
+#endif
+	}
+
+	pthread_mutex_lock(&stream->job_lock);
+	job->error = !ret;
+	job->done = true;
+	pthread_cond_broadcast(&stream->job_cond);
+	pthread_mutex_unlock(&stream->job_lock);
+}
+
+bool twrpTarStream::Compress_Job(Job *job, z_stream *strm) {
+	size_t have = 0;
+
+	job->crc = crc32(crc32(0L, Z_NULL, 0), job->in.data(), job->in.size());
+	if (Looks_Incompressible(job->in)) {
+		// Stored blocks also end on a byte boundary, any gunzip reads them
+		// and the next block can still use this one as its window
+		job->out.resize(job->in.size() + (job->in.size() / TAR_STREAM_STORED_MAX + 1) * 5);
+		for (size_t pos = 0; pos < job->in.size(); pos += TAR_STREAM_STORED_MAX) {
+			size_t len = std::min(job->in.size() - pos, (size_t) TAR_STREAM_STORED_MAX);
+			unsigned char *header = job->out.data() + have;
+			header[0] = 0;
+			header[1] = len & 0xff;
+			header[2] = len >> 8;
+			header[3] = ~len & 0xff;
+			header[4] = (~len >> 8) & 0xff;
+			memcpy(header + 5, job->in.data() + pos, len);
+			have += len + 5;
+		}
+		job->out.resize(have);
+		return true;
+	}
+	if (deflateReset(strm) != Z_OK)
+		return false;
+	if (!job->dict.empty() && deflateSetDictionary(strm, job->dict.data(), job->dict.size()) != Z_OK)
+		return false;
+
+	job->out.resize(deflateBound(strm, job->in.size()) + 16);
+	strm->next_in = job->in.data();
+	strm->avail_in = job->in.size();
+	for (;;) {
+		strm->next_out = job->out.data() + have;
+		strm->avail_out = job->out.size() - have;
+		// Every block ends on a byte boundary with an empty stored block so the
+		// blocks can simply be concatenated, the final block is added in Close()
+		if (deflate(strm, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+			return false;
+		have = job->out.size() - strm->avail_out;
+		if (strm->avail_out != 0)
+			break;
+		job->out.resize(job->out.size() * 2);
+	}
+	job->out.resize(have);
+	return true;
+}
+
+bool twrpTarStream::Compress_Job_LZ4(Job *job) {
+#ifdef TW_HAVE_LZ4
+	LZ4F_preferences_t prefs;
+
+	// Each block is a self contained frame so workers never share state
+	job->crc = crc32(crc32(0L, Z_NULL, 0), job->in.data(), job->in.size());
+	memset(&prefs, 0, sizeof(prefs));
+	prefs.frameInfo.blockSizeID = LZ4F_max256KB;
+	prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+	prefs.frameInfo.contentSize = job->in.size();
+	job->out.resize(LZ4F_compressFrameBound(job->in.size(), &prefs));
+	size_t ret = LZ4F_compressFrame(job->out.data(), job->out.size(), job->in.data(), job->in.size(), &prefs);
+	if (LZ4F_isError(ret)) {
+		LOGINFO("twrpTarStream LZ4 compression failed: %s\n", LZ4F_getErrorName(ret));
+		return false;
+	}
+	job->out.resize(ret);
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool twrpTarStream::Decompress_Job(Job *job, z_stream *strm, void *dctx) {
+	size_t have = 0;
+
+	// job->out is sized for the frame and job->crc holds the CRC32 from the table
+	if (codec == TAR_STREAM_GZIP) {
+		unsigned char empty;
+		if (inflateReset(strm) != Z_OK)
+			return false;
+		strm->next_in = job->in.data();
+		strm->avail_in = job->in.size();
+		for (;;) {
+			strm->next_out = job->out.empty() ? &empty : job->out.data() + have;
+			strm->avail_out = job->out.size() - have;
+			int ret = inflate(strm, Z_NO_FLUSH);
+			have = job->out.size() - strm->avail_out;
+			if (ret == Z_STREAM_END && strm->avail_in == 0)
+				break;
+			if (ret == Z_STREAM_END) {
+				inflateReset(strm);
+			} else if (ret != Z_OK) {
+				LOGINFO("twrpTarStream inflate error %i in frame at %llu\n", ret, job->data_offset);
+				return false;
+			}
+		}
+	}
+#ifdef TW_HAVE_LZ4
+	if (codec == TAR_STREAM_LZ4) {
+		size_t pos = 0, hint = 0;
+		while (pos < job->in.size()) {
+			size_t dst_size = job->out.size() - have;
+			size_t src_size = job->in.size() - pos;
+			hint = LZ4F_decompress((LZ4F_dctx*) dctx, job->out.data() + have, &dst_size, job->in.data() + pos, &src_size, NULL);
+			if (LZ4F_isError(hint) || (src_size == 0 && dst_size == 0)) {
+				LOGINFO("twrpTarStream LZ4 decompression error in frame at %llu\n", job->data_offset);
+				return false;
+			}
+			pos += src_size;
+			have += dst_size;
+		}
+		if (hint != 0) {
+			LOGINFO("twrpTarStream LZ4 frame at %llu is incomplete\n", job->data_offset);
+			return false;
+		}
+	}
+#else
+	(void) dctx;
+#endif
+	if (have != job->out.size() || crc32(crc32(0L, Z_NULL, 0), job->out.data(), have) != job->crc) {
+		LOGINFO("twrpTarStream frame at %llu does not match its checksum\n", job->data_offset);
+		return false;
+	}
+	return true;
+}
+
+bool twrpTarStream::Submit_Job() {
+	Job *job = current;
+
+	if (job->in.empty())
+		return true;
+
+	current = new Job;
+	current->in.reserve(TAR_STREAM_BLOCK_SIZE);
+	current->restart = true;
+	block_count++;
+	current->frame_start = (frame_table && block_count % TAR_STREAM_FRAME_BLOCKS == 0);
+	// Only the first block of a frame starts without the window of the block before it
+	if (codec == TAR_STREAM_GZIP && !current->frame_start) {
+		size_t dict_len = job->in.size() < TAR_STREAM_DICT_SIZE ? job->in.size() : TAR_STREAM_DICT_SIZE;
+		current->dict.assign(job->in.end() - dict_len, job->in.end());
+		current->restart = false;
+	}
+
+	job->done = false;
+	job->error = false;
+	job->data_offset = total_in;
+	total_in += job->in.size();
+	pthread_mutex_lock(&job_lock);
+	inflight.push_back(job);
+	pthread_mutex_unlock(&job_lock);
+	twrpWorkPool::Submit(this, Run_Job, job);
+
+	tar_progress_add(prog_slot, job->in.size(), 0);
+	return Drain_Jobs(false);
+}
+
+bool twrpTarStream::Drain_Jobs(bool wait_all) {
+	for (;;) {
+		pthread_mutex_lock(&job_lock);
+		if (inflight.empty()) {
+			pthread_mutex_unlock(&job_lock);
+			return !failed;
+		}
+		Job *job = inflight.front();
+		// Only block when the ring is full or when we are flushing everything
+		while (!job->done && !failed && (wait_all || inflight.size() >= max_inflight))
+			pthread_cond_wait(&job_cond, &job_lock);
+		if (failed) {
+			pthread_mutex_unlock(&job_lock);
+			return false;
+		}
+		if (!job->done) {
+			pthread_mutex_unlock(&job_lock);
+			return true;
+		}
+		inflight.pop_front();
+		pthread_mutex_unlock(&job_lock);
+
+		bool ret = !job->error;
+		if (ret && job->frame_start)
+			ret = End_Frame();
+		if (ret) {
+			if (index != NULL && job->restart)
+				index->Add_Restart(file_total, job->data_offset);
+			if (job->frame_start)
+				ret = Begin_Frame(job->data_offset);
+		}
+		if (ret) {
+			Frame& frame = frames.back();
+			frame.crc = crc32_combine(frame.crc, job->crc, job->in.size());
+			frame.data_size += job->in.size();
+			ret = Write_Encoded(job->out.data(), job->out.size());
+		}
+		delete job;
+		if (!ret) {
+			failed = true;
+			return false;
+		}
+	}
+}
+
+bool twrpTarStream::Begin_Frame(unsigned long long data_offset) {
+	Frame frame;
+
+	frame.file_offset = file_total;
+	frame.data_offset = data_offset;
+	frame.file_size = 0;
+	frame.data_size = 0;
+	frame.crc = crc32(0L, Z_NULL, 0);
+	frames.push_back(frame);
+	frame_open = true;
+	if (codec == TAR_STREAM_GZIP) {
+		// gzip header: no name, no timestamp, unix OS, same as pigz reading stdin
+		const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+		return Write_Encoded(header, sizeof(header));
+	}
+	return true;
+}
+
+bool twrpTarStream::End_Frame() {
+	if (!frame_open)
+		return true;
+	frame_open = false;
+	if (codec == TAR_STREAM_GZIP) {
+		// Final empty fixed block followed by the gzip trailer of this member
+		unsigned char trailer[10] = {3, 0};
+		Put_LE32(trailer + 2, frames.back().crc);
+		Put_LE32(trailer + 6, frames.back().data_size);
+		if (!Write_Encoded(trailer, sizeof(trailer)))
+			return false;
+	}
+	frames.back().file_size = file_total - frames.back().file_offset;
+	return true;
+}
+
+bool twrpTarStream::Write_Frame_Record(bool footer, const unsigned char *data, size_t size) {
+	if (codec == TAR_STREAM_GZIP) {
+		// Empty gzip member with the data in a 'TW' or 'TF' extra field
+		unsigned char header[16] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 3};
+		const unsigned char trailer[10] = {3, 0};
+		header[10] = (size + 4) & 0xff;
+		header[11] = (size + 4) >> 8;
+		header[12] = 'T';
+		header[13] = footer ? 'F' : 'W';
+		header[14] = size & 0xff;
+		header[15] = size >> 8;
+		return Write_Encoded(header, sizeof(header)) && Write_Encoded(data, size) && Write_Encoded(trailer, sizeof(trailer));
+	}
+	unsigned char header[TAR_STREAM_LZ4_RECORD];
+	Put_LE32(header, footer ? TAR_STREAM_LZ4_FOOTER_MAGIC : TAR_STREAM_LZ4_TABLE_MAGIC);
+	Put_LE32(header + 4, size);
+	return Write_Encoded(header, sizeof(header)) && Write_Encoded(data, size);
+}
+
+bool twrpTarStream::Write_Frame_Table() {
+	std::vector<unsigned char> table(frames.size() * TAR_STREAM_FRAME_ENTRY);
+	unsigned char footer[TAR_STREAM_FOOTER];
+	unsigned long long table_start = file_total;
+	size_t pos;
+
+	for (size_t i = 0; i < frames.size(); i++) {
+		Put_LE32(table.data() + i * TAR_STREAM_FRAME_ENTRY, frames[i].file_size);
+		Put_LE32(table.data() + i * TAR_STREAM_FRAME_ENTRY + 4, frames[i].data_size);
+		Put_LE32(table.data() + i * TAR_STREAM_FRAME_ENTRY + 8, frames[i].crc);
+	}
+	for (pos = 0; pos < table.size(); ) {
+		size_t size = table.size() - pos;
+		if (codec == TAR_STREAM_GZIP && size > TAR_STREAM_GZIP_RECORD_MAX)
+			size = TAR_STREAM_GZIP_RECORD_MAX;
+		if (!Write_Frame_Record(false, table.data() + pos, size))
+			return false;
+		pos += size;
+	}
+	memcpy(footer, TAR_STREAM_FRAME_MAGIC, 4);
+	Put_LE32(footer + 4, TAR_STREAM_FRAME_VERSION);
+	Put_LE32(footer + 8, frames.size());
+	Put_LE32(footer + 12, file_total - table_start);
+	return Write_Frame_Record(true, footer, sizeof(footer));
+}
+
+bool twrpTarStream::Fill_Frames() {
+	for (;;) {
+		pthread_mutex_lock(&job_lock);
+		bool full = (inflight.size() >= max_inflight);
+		pthread_mutex_unlock(&job_lock);
+		if (full || next_frame >= frames.size())
+			return true;
+
+		const Frame& frame = frames[next_frame];
+		Job *job = new Job;
+		job->in.resize(frame.file_size);
+		if (Read_Fully(job->in.data(), frame.file_size) != (ssize_t) frame.file_size) {
+			LOGINFO("twrpTarStream unexpected end of compressed data\n");
+			delete job;
+			return false;
+		}
+		job->out.resize(frame.data_size);
+		job->crc = frame.crc;
+		job->data_offset = frame.data_offset;
+		job->restart = true;
+		job->frame_start = true;
+		job->done = false;
+		job->error = false;
+		next_frame++;
+		pthread_mutex_lock(&job_lock);
+		inflight.push_back(job);
+		pthread_mutex_unlock(&job_lock);
+		twrpWorkPool::Submit(this, Run_Job, job);
+	}
+}
+
+ssize_t twrpTarStream::Read_Frames(void *buffer, size_t size) {
+	unsigned char *out = (unsigned char*) buffer;
+	size_t total = 0;
+
+	while (total < size) {
+		if (!Fill_Frames()) {
+			failed = true;
+			return -1;
+		}
+		pthread_mutex_lock(&job_lock);
+		if (inflight.empty()) {
+			pthread_mutex_unlock(&job_lock);
+			break;
+		}
+		Job *job = inflight.front();
+		while (!job->done)
+			pthread_cond_wait(&job_cond, &job_lock);
+		pthread_mutex_unlock(&job_lock);
+		if (job->error) {
+			failed = true;
+			return -1;
+		}
+
+		size_t copy = job->out.size() - out_pos;
+		if (copy > size - total)
+			copy = size - total;
+		memcpy(out + total, job->out.data() + out_pos, copy);
+		out_pos += copy;
+		total += copy;
+		if (out_pos >= job->out.size()) {
+			pthread_mutex_lock(&job_lock);
+			inflight.pop_front();
+			pthread_mutex_unlock(&job_lock);
+			delete job;
+			out_pos = 0;
+		}
+	}
+	return total;
+}
+
+void twrpTarStream::Cancel_Jobs() {
+	Stop_Workers();
+	while (!inflight.empty()) {
+		delete inflight.front();
+		inflight.pop_front();
+	}
+	out_pos = 0;
+}
+
+void twrpTarStream::Set_Digest(twrpDigest *archive_digest) {
+	digest = archive_digest;
+}
+
+void twrpTarStream::Set_Index(twrpTarIndex *archive_index) {
+	index = archive_index;
+}
+
+unsigned long long twrpTarStream::Position() {
+	if (writing && compress)
+		return total_in + current->in.size();
+	return data_total;
+}
+
+bool twrpTarStream::Seek(unsigned long long offset, const Tar_Stream_Restart& restart) {
+	Tar_Stream_Restart start = restart;
+	size_t low = 0, high = frames.size();
+	bool reposition;
+
+	// The digest and the encryption both need every byte from the start
+	if (writing || encrypt || digest != NULL || failed)
+		return false;
+	// Every frame is a restart point, use the frame table if it has a closer one
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (frames[mid].data_offset <= offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (low > 0 && frames[low - 1].data_offset > start.data_offset) {
+		start.file_offset = frames[low - 1].file_offset;
+		start.data_offset = frames[low - 1].data_offset;
+	}
+	// Only a few members are read after a seek, decoding whole frames ahead would be wasted
+	reposition = (frame_mode || data_total < start.data_offset || data_total > offset);
+	if (frame_mode) {
+		Cancel_Jobs();
+		frame_mode = false;
+	}
+	if (reposition) {
+		if (lseek64(fd, start.file_offset, SEEK_SET) < 0) {
+			LOGINFO("twrpTarStream unable to seek: %s\n", strerror(errno));
+			return false;
+		}
+		if (codec == TAR_STREAM_GZIP) {
+			if (inflate_init)
+				inflateEnd(&inflate_strm);
+			memset(&inflate_strm, 0, sizeof(inflate_strm));
+			inflate_init = (inflateInit2(&inflate_strm, 15 + 16) == Z_OK);
+			if (!inflate_init)
+				return false;
+			inflate_eof = false;
+		}
+#ifdef TW_HAVE_LZ4
+		if (codec == TAR_STREAM_LZ4) {
+			LZ4F_dctx *dctx;
+			LZ4F_freeDecompressionContext((LZ4F_dctx*) lz4_dctx);
+			lz4_dctx = NULL;
+			if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+				return false;
+			lz4_dctx = dctx;
+			lz4_hint = 1;
+		}
+#endif
+		read_pos = 0;
+		read_len = 0;
+		file_total = start.file_offset;
+		data_total = start.data_offset;
+	}
+	if (skip_buf.empty())
+		skip_buf.resize(TAR_STREAM_BLOCK_SIZE);
+	while (data_total < offset) {
+		unsigned long long skip = offset - data_total;
+		ssize_t bytes = Read(skip_buf.data(), skip < skip_buf.size() ? skip : skip_buf.size());
+		if (bytes <= 0)
+			return false;
+	}
+	return true;
+}
+
+bool twrpTarStream::Flush_Plain() {
+	if (plain_len == 0)
+		return true;
+	if (!Write_Encoded(plain_buf, plain_len))
+		return false;
+	tar_progress_add(prog_slot, plain_len, 0);
+	plain_len = 0;
+	return true;
+}
+
+ssize_t twrpTarStream::Write(const void *buffer, size_t size) {
+	if (failed)
+		return -1;
+	if (!compress) {
+		const unsigned char *ptr = (const unsigned char*) buffer;
+		size_t remain = size;
+		while (remain > 0) {
+			size_t copy = plain_size - plain_len;
+			if (copy > remain)
+				copy = remain;
+			memcpy(plain_buf + plain_len, ptr, copy);
+			plain_len += copy;
+			data_total += copy;
+			ptr += copy;
+			remain -= copy;
+			if (plain_len >= plain_size && !Flush_Plain()) {
+				failed = true;
+				return -1;
+			}
+		}
+		return size;
+	}
+
+	const unsigned char *ptr = (const unsigned char*) buffer;
+	size_t remain = size;
+	while (remain > 0) {
+		size_t space = TAR_STREAM_BLOCK_SIZE - current->in.size();
+		size_t copy = remain < space ? remain : space;
+		current->in.insert(current->in.end(), ptr, ptr + copy);
+		ptr += copy;
+		remain -= copy;
+		if (current->in.size() >= TAR_STREAM_BLOCK_SIZE && !Submit_Job())
+			return -1;
+	}
+	return size;
+}
+
+bool twrpTarStream::Write_Fully(const unsigned char *data, size_t size) {
+	while (size > 0) {
+		ssize_t written = write(fd, data, size);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGINFO("twrpTarStream write error: %s\n", strerror(errno));
+			return false;
+		}
+		if (digest != NULL)
+			digest->update(data, written);
+		file_total += written;
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+bool twrpTarStream::Write_Chunks(const unsigned char *data, size_t size, bool final) {
+	size_t chunk_size = crypt->Chunk_Size();
+	std::vector<unsigned char> out;
+
+	if (file_total == 0 && !Write_Fully(crypt->Header(), TAR_CRYPT_HEADER_SIZE))
+		return false;
+	while (size > 0) {
+		size_t copy = std::min(size, chunk_size - crypt_buf.size());
+		crypt_buf.insert(crypt_buf.end(), data, data + copy);
+		data += copy;
+		size -= copy;
+		if (crypt_buf.size() == chunk_size) {
+			crypt->Submit(&crypt_buf, false);
+			crypt_buf.reserve(chunk_size);
+		}
+		// Waits for the oldest chunk once every worker has enough queued
+		while (crypt->Pending() >= crypt->Max_Pending()) {
+			if (!crypt->Next(&out, true) || !Write_Fully(out.data(), out.size()))
+				return false;
+		}
+	}
+	// The last chunk is shorter than the others, empty if the data filled the one before
+	if (final)
+		crypt->Submit(&crypt_buf, true);
+	while (crypt->Next(&out, final)) {
+		if (!Write_Fully(out.data(), out.size()))
+			return false;
+	}
+	if (crypt->Failed()) {
+		LOGINFO("twrpTarStream encryption failed\n");
+		return false;
+	}
+	return true;
+}
+
+bool twrpTarStream::Write_Encrypted(const unsigned char *data, size_t size, bool final) {
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	OAES_CTX *ctx = (OAES_CTX*) oaes_ctx;
+	unsigned char out[TAR_STREAM_OAES_CIPHER];
+
+	if (crypt != NULL)
+		return Write_Chunks(data, size, final);
+
+	while (size > 0 || (final && crypt_len > 0)) {
+		size_t copy = TAR_STREAM_OAES_PLAIN - crypt_len;
+		if (copy > size)
+			copy = size;
+		memcpy(crypt_buf.data() + crypt_len, data, copy);
+		crypt_len += copy;
+		data += copy;
+		size -= copy;
+		// Only full chunks are encrypted until the stream is finished
+		if (crypt_len < TAR_STREAM_OAES_PLAIN && !final)
+			break;
+		size_t out_len = sizeof(out);
+		if (oaes_encrypt(ctx, crypt_buf.data(), crypt_len, out, &out_len) != OAES_RET_SUCCESS) {
+			LOGINFO("twrpTarStream encryption failed\n");
+			return false;
+		}
+		crypt_len = 0;
+		if (!Write_Fully(out, out_len))
+			return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool twrpTarStream::Write_Encoded(const unsigned char *data, size_t size) {
+	if (encrypt)
+		return Write_Encrypted(data, size, false);
+	return Write_Fully(data, size);
+}
+
+ssize_t twrpTarStream::Read_Fully(unsigned char *buffer, size_t size) {
+	size_t total = 0;
+
+	while (total < size) {
+		ssize_t bytes = read(fd, buffer + total, size - total);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGINFO("twrpTarStream read error: %s\n", strerror(errno));
+			return -1;
+		}
+		if (bytes == 0)
+			break;
+		if (digest != NULL)
+			digest->update(buffer + total, bytes);
+		file_total += bytes;
+		total += bytes;
+	}
+	return total;
+}
+
+bool twrpTarStream::Drain_Input() {
+	// libtar stops at the end of archive blocks, the digest covers the whole file
+	std::vector<unsigned char> buf(TAR_STREAM_BLOCK_SIZE);
+	ssize_t bytes;
+
+	while ((bytes = Read_Fully(buf.data(), buf.size())) > 0)
+		;
+	return bytes == 0;
+}
+
+bool twrpTarStream::Fill_Chunks() {
+	size_t record_size = crypt->Chunk_Size() + TAR_CRYPT_TAG_SIZE;
+	std::vector<unsigned char> record;
+	ssize_t bytes;
+
+	if (file_total == 0) {
+		unsigned char header[TAR_CRYPT_HEADER_SIZE];
+		if (Read_Fully(header, sizeof(header)) != sizeof(header))
+			return false;
+	}
+	while (!crypt_eof && crypt->Pending() < crypt->Max_Pending()) {
+		record.resize(record_size);
+		bytes = Read_Fully(record.data(), record.size());
+		if (bytes < 0)
+			return false;
+		// Only the last chunk is short, a missing one means the archive was cut off
+		if ((size_t) bytes < record_size) {
+			if (bytes < TAR_CRYPT_TAG_SIZE) {
+				LOGINFO("twrpTarStream encrypted archive is truncated\n");
+				return false;
+			}
+			record.resize(bytes);
+			crypt_eof = true;
+		}
+		crypt->Submit(&record, crypt_eof);
+	}
+	return true;
+}
+
+ssize_t twrpTarStream::Read_Decrypted(unsigned char *buffer, size_t size) {
+	if (!encrypt)
+		return Read_Fully(buffer, size);
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	OAES_CTX *ctx = (OAES_CTX*) oaes_ctx;
+	unsigned char in[TAR_STREAM_OAES_CIPHER];
+	size_t total = 0;
+
+	while (total < size) {
+		if (crypt_pos >= crypt_len && crypt != NULL) {
+			if (!Fill_Chunks())
+				return -1;
+			if (crypt->Pending() == 0)
+				break;
+			if (!crypt->Next(&crypt_buf, true)) {
+				LOGINFO("twrpTarStream decryption failed, wrong password or damaged archive\n");
+				return -1;
+			}
+			crypt_len = crypt_buf.size();
+			crypt_pos = 0;
+		} else if (crypt_pos >= crypt_len) {
+			ssize_t bytes = Read_Fully(in, sizeof(in));
+			if (bytes < 0)
+				return -1;
+			if (bytes == 0)
+				break;
+			size_t out_len = TAR_STREAM_OAES_CIPHER;
+			if (oaes_decrypt(ctx, in, bytes, crypt_buf.data(), &out_len) != OAES_RET_SUCCESS) {
+				LOGINFO("twrpTarStream decryption failed\n");
+				return -1;
+			}
+			crypt_len = out_len;
+			crypt_pos = 0;
+		}
+		size_t copy = crypt_len - crypt_pos;
+		if (copy > size - total)
+			copy = size - total;
+		memcpy(buffer + total, crypt_buf.data() + crypt_pos, copy);
+		crypt_pos += copy;
+		total += copy;
+	}
+	return total;
+#else
+	return -1;
+#endif
+}
+
+ssize_t twrpTarStream::Read(void *buffer, size_t size) {
+	ssize_t ret;
+
+	if (failed)
+		return -1;
+	if (frame_mode)
+		ret = Read_Frames(buffer, size);
+	else if (codec == TAR_STREAM_GZIP)
+		ret = Read_Inflate(buffer, size);
+	else if (codec == TAR_STREAM_LZ4)
+		ret = Read_LZ4(buffer, size);
+	else
+		ret = Read_Decrypted((unsigned char*) buffer, size);
+	if (ret > 0)
+		data_total += ret;
+	return ret;
+}
+
+ssize_t twrpTarStream::Read_Inflate(void *buffer, size_t size) {
+	inflate_strm.next_out = (unsigned char*) buffer;
+	inflate_strm.avail_out = size;
+	while (inflate_strm.avail_out > 0 && !inflate_eof) {
+		if (inflate_strm.avail_in == 0) {
+			ssize_t bytes = Read_Decrypted(read_buf.data(), read_buf.size());
+			if (bytes < 0) {
+				failed = true;
+				return -1;
+			}
+			if (bytes == 0) {
+				LOGINFO("twrpTarStream unexpected end of compressed data\n");
+				failed = true;
+				return -1;
+			}
+			inflate_strm.next_in = read_buf.data();
+			inflate_strm.avail_in = bytes;
+		}
+		int ret = inflate(&inflate_strm, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			// Handle concatenated gzip members the same way pigz -d does
+			if (inflate_strm.avail_in == 0) {
+				ssize_t bytes = Read_Decrypted(read_buf.data(), read_buf.size());
+				if (bytes <= 0) {
+					inflate_eof = true;
+					break;
+				}
+				inflate_strm.next_in = read_buf.data();
+				inflate_strm.avail_in = bytes;
+			}
+			inflateReset(&inflate_strm);
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			LOGINFO("twrpTarStream inflate error %i\n", ret);
+			failed = true;
+			return -1;
+		}
+	}
+	return size - inflate_strm.avail_out;
+}
+
+ssize_t twrpTarStream::Read_LZ4(void *buffer, size_t size) {
+#ifdef TW_HAVE_LZ4
+	unsigned char *out = (unsigned char*) buffer;
+	size_t total = 0;
+
+	while (total < size) {
+		if (read_pos >= read_len) {
+			ssize_t bytes = Read_Decrypted(read_buf.data(), read_buf.size());
+			if (bytes < 0) {
+				failed = true;
+				return -1;
+			}
+			if (bytes == 0) {
+				// A hint of 0 means the last frame was complete
+				if (lz4_hint != 0) {
+					LOGINFO("twrpTarStream unexpected end of LZ4 data\n");
+					failed = true;
+					return -1;
+				}
+				break;
+			}
+			read_pos = 0;
+			read_len = bytes;
+		}
+		size_t dst_size = size - total;
+		size_t src_size = read_len - read_pos;
+		lz4_hint = LZ4F_decompress((LZ4F_dctx*) lz4_dctx, out + total, &dst_size, read_buf.data() + read_pos, &src_size, NULL);
+		if (LZ4F_isError(lz4_hint)) {
+			LOGINFO("twrpTarStream LZ4 decompression error: %s\n", LZ4F_getErrorName(lz4_hint));
+			failed = true;
+			return -1;
+		}
+		read_pos += src_size;
+		total += dst_size;
+	}
+	return total;
+#else
+	return -1;
+#endif
+}
+
+void twrpTarStream::Stop_Workers() {
+	if (!pooled)
+		return;
+	// Drops what was not started, the stream is about to go away
+	twrpWorkPool::Cancel(this);
+	pooled = false;
+}
+
+int twrpTarStream::Close() {
+	bool ret = !failed;
+
+	if (writing && compress && ret) {
+		ret = Submit_Job() && Drain_Jobs(true);
+		// An archive without any data still needs one gzip member
+		if (ret && frames.empty())
+			ret = Begin_Frame(0);
+		if (ret)
+			ret = End_Frame();
+		if (ret && frame_table)
+			ret = Write_Frame_Table();
+	}
+	if (writing)
+		Stop_Workers();
+	else
+		Cancel_Jobs();
+	if (writing && !compress && ret)
+		ret = Flush_Plain();
+	if (writing && encrypt && ret)
+		ret = Write_Encrypted(NULL, 0, true);
+	if (!writing && digest != NULL && ret)
+		ret = Drain_Input();
+	Unregister();
+	if (close(fd) != 0)
+		ret = false;
+	fd = -1;
+	return ret ? 0 : -1;
+}
+
+extern "C" ssize_t tar_stream_write(int fd, const void *buffer, size_t size) {
+	twrpTarStream *stream = twrpTarStream::Find(fd);
+	if (stream == NULL)
+		return write(fd, buffer, size);
+	return stream->Write(buffer, size);
+}
+
+extern "C" ssize_t tar_stream_read(int fd, void *buffer, size_t size) {
+	twrpTarStream *stream = twrpTarStream::Find(fd);
+	if (stream == NULL)
+		return read(fd, buffer, size);
+	return stream->Read(buffer, size);
+}
+
+extern "C" int tar_stream_close(int fd) {
+	twrpTarStream *stream = twrpTarStream::Find(fd);
+	if (stream == NULL)
+		return close(fd);
+	int ret = stream->Close();
+	delete stream;
+	return ret;
+}
@@ -0,0 +1,216 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPTARSTREAM_HPP
+#define __TWRPTARSTREAM_HPP
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "twrpDigest/twrpDigest.hpp"
+#include "libtar/tar_progress.h"
+
+#define TAR_STREAM_BLOCK_SIZE (128 * 1024)                                      // Input block size handed to each compression job (pigz default)
+#define TAR_STREAM_DICT_SIZE (32 * 1024)                                        // Deflate window primed from the previous block
+#define TAR_STREAM_FRAME_BLOCKS 32                                               // Blocks per independently decodable frame, 4MB of tar data
+#define TAR_STREAM_FRAME_MAGIC "TWFT"
+#define TAR_STREAM_FRAME_VERSION 1
+#define TAR_STREAM_READ_THREADS 4                                               // Frames decoded in parallel while reading, each one takes about 8MB
+#define TAR_STREAM_OAES_PLAIN 4064                                             // Plaintext chunk size used by the openaes binary (4096 - 2 * OAES_BLOCK_SIZE)
+#define TAR_STREAM_OAES_CIPHER 4096                                            // Encrypted chunk size written by the openaes binary
+#ifndef TW_TAR_BUFFER_SIZE_MB
+#define TW_TAR_BUFFER_SIZE_MB 1
+#endif
+#define TAR_STREAM_PLAIN_BUFFER_SIZE (TW_TAR_BUFFER_SIZE_MB * 1024 * 1024)      // Output buffer of uncompressed archives, 1 to 8 MB
+#define TAR_STREAM_BUFFER_ALIGN 4096
+
+enum Tar_Stream_Codec {
+	TAR_STREAM_PLAIN = 0,                                                      // No compression, only encryption if a password is given
+	TAR_STREAM_GZIP,                                                           // pigz compatible gzip
+	TAR_STREAM_LZ4,                                                            // One LZ4 frame per block, much faster than gzip at a lower ratio
+};
+
+// A place in an archive where decoding can start without the data before it
+struct Tar_Stream_Restart {
+	unsigned long long file_offset;                                            // offset in the archive file
+	unsigned long long data_offset;                                            // offset in the tar data
+};
+
+class twrpTarIndex;
+class twrpTarCrypt;
+
+// In-process replacement for the pigz and openaes child processes used by
+// twrpTar. libtar writes straight into a ring of compression jobs that are
+// deflated in parallel on the shared twrpWorkPool and then optionally encrypted
+// before being written to the archive. Reading reverses the chain. The output
+// is a standard gzip stream so existing tools stay compatible. Encryption uses
+// the AES-GCM chunks of twrpTarCrypt when the build has them and otherwise the
+// format of "openaes enc", which can always be read so existing backups stay
+// restorable. The LZ4 codec writes a series of standard LZ4 frames which the
+// lz4 command line tool can also decode. Every byte written to or read from the
+// archive can also be fed to a digest so it does not need a separate pass.
+//
+// Unencrypted compressed archives written to a regular file are made of frames
+// of TAR_STREAM_FRAME_BLOCKS blocks that do not depend on each other, a complete
+// gzip member or a run of LZ4 frames. They end with a frame table and a fixed
+// size footer, stored in empty gzip members or LZ4 skippable frames so other
+// tools decode the archive as usual. The table gives the size and CRC32 of each
+// frame, which lets reading decode several frames at once and gives the
+// uncompressed size without decoding anything. Other archives stay a single
+// gzip member.
+class twrpTarStream
+{
+public:
+	twrpTarStream();
+	~twrpTarStream();
+
+	bool Open_Write(int out_fd, Tar_Stream_Codec stream_codec, const std::string& password, unsigned threads, struct tar_progress_slot *progress);
+	bool Open_Read(int in_fd, Tar_Stream_Codec stream_codec, const std::string& password, unsigned threads);
+	ssize_t Write(const void *buffer, size_t size);
+	ssize_t Read(void *buffer, size_t size);
+	int Close();                                                               // Flushes all pending data and closes the underlying fd
+	void Set_Digest(twrpDigest *archive_digest);                               // Digest of the archive as written or read, owned by the caller
+	void Set_Index(twrpTarIndex *archive_index);                               // Index the restart points are added to while writing, owned by the caller
+	unsigned long long Position();                                             // Offset in the tar data of the next byte written or read
+	bool Seek(unsigned long long offset, const Tar_Stream_Restart& restart);   // Moves a read stream to offset, decoding from restart if it is not ahead
+
+	static twrpTarStream* Find(int fd);                                        // Looks up the stream registered for a libtar fd
+	static bool Codec_Available(Tar_Stream_Codec stream_codec);                // Returns false if the codec was not included in this build
+	static bool Measure_Codec(Tar_Stream_Codec stream_codec, const std::vector<unsigned char>& sample, double *bytes_per_sec, double *ratio);  // Compression speed of one thread and output / input size on sample
+	static bool Get_Data_Size(const std::string& filename, Tar_Stream_Codec stream_codec, const std::string& password, unsigned long long *size);  // Uncompressed size without decoding the archive
+	static void Set_Plain_Buffer_Size(size_t size);                           // Output buffer of uncompressed streams opened after this, for tuning from twrpTarMain
+
+private:
+	struct Frame {
+		unsigned long long file_offset;
+		unsigned long long data_offset;
+		unsigned long file_size;
+		unsigned long data_size;
+		unsigned long crc;
+	};
+
+	struct Job {
+		std::vector<unsigned char> in;
+		std::vector<unsigned char> dict;
+		std::vector<unsigned char> out;
+		unsigned long crc;
+		unsigned long long data_offset;
+		bool restart;                                                          // does not depend on the block before it
+		bool frame_start;                                                      // first block of a frame
+		bool done;
+		bool error;
+	};
+
+	static void Run_Job(void *owner, void *job);
+	bool Compress_Job(Job *job, z_stream *strm);
+	bool Compress_Job_LZ4(Job *job);
+	bool Decompress_Job(Job *job, z_stream *strm, void *dctx);
+	bool Submit_Job();
+	bool Drain_Jobs(bool wait_all);
+	bool Write_Encoded(const unsigned char *data, size_t size);
+	bool Write_Encrypted(const unsigned char *data, size_t size, bool final);
+	bool Write_Fully(const unsigned char *data, size_t size);
+	bool Flush_Plain();
+	bool Begin_Frame(unsigned long long data_offset);
+	bool End_Frame();
+	bool Write_Frame_Table();
+	bool Write_Frame_Record(bool footer, const unsigned char *data, size_t size);
+	bool Fill_Frames();
+	void Cancel_Jobs();
+	bool Drain_Input();
+	ssize_t Read_Decrypted(unsigned char *buffer, size_t size);
+	ssize_t Read_Fully(unsigned char *buffer, size_t size);
+	ssize_t Read_Inflate(void *buffer, size_t size);
+	ssize_t Read_LZ4(void *buffer, size_t size);
+	ssize_t Read_Frames(void *buffer, size_t size);
+	bool Decrypt_Tail(unsigned long long *plain_size, unsigned char *tail, size_t tail_size);
+	static bool Read_Frame_Table(int table_fd, Tar_Stream_Codec stream_codec, std::vector<Frame> *table);
+	bool Setup_Encryption(const std::string& password, unsigned threads);
+	bool Write_Chunks(const unsigned char *data, size_t size, bool final);
+	bool Fill_Chunks();
+	bool Start_Workers();
+	void Stop_Workers();
+	void Register();
+	void Unregister();
+
+	int fd;
+	struct tar_progress_slot *prog_slot;                                       // Progress counter of the archiving thread, may be NULL
+	bool writing;
+	Tar_Stream_Codec codec;
+	bool compress;
+	bool encrypt;
+	bool failed;
+	void *oaes_ctx;
+	twrpTarCrypt *crypt;                                                       // AES-GCM chunks, NULL for OAES
+	twrpDigest *digest;
+	twrpTarIndex *index;
+	unsigned long long file_total;                                             // bytes written to or read from the fd
+	unsigned long long data_total;                                             // tar data written or read, only kept for uncompressed writes and reads
+	unsigned block_count;
+	std::vector<unsigned char> skip_buf;
+
+	// Compression state
+	pthread_mutex_t job_lock;
+	pthread_cond_t job_cond;
+	std::deque<Job*> inflight;                                                 // Jobs in output order, done on the twrpWorkPool
+	Job *current;
+	unsigned max_inflight;
+	bool pooled;                                                               // jobs may be queued on or running in the twrpWorkPool
+	unsigned long long total_in;
+
+	// Frames, written while compressing or loaded from the table when reading
+	std::vector<Frame> frames;
+	bool frame_table;                                                          // write a frame table when closing
+	bool frame_open;
+	bool frame_mode;                                                           // reading whole frames on the workers
+	size_t next_frame;                                                         // next frame to read from the fd
+	size_t out_pos;                                                            // bytes of the oldest job returned by Read()
+
+	// Uncompressed output buffer, keeps 512 byte tar blocks out of write()
+	unsigned char *plain_buf;                                                  // page aligned, plain_size bytes
+	size_t plain_len;
+	size_t plain_size;
+	static size_t plain_buffer_size;                                           // TAR_STREAM_PLAIN_BUFFER_SIZE unless set
+
+	// Encryption / decryption chunk buffer
+	std::vector<unsigned char> crypt_buf;
+	size_t crypt_len;
+	size_t crypt_pos;
+	bool crypt_eof;                                                            // the last AES-GCM chunk was read
+
+	// Decompression state
+	z_stream inflate_strm;
+	bool inflate_init;
+	bool inflate_eof;
+	std::vector<unsigned char> read_buf;
+	size_t read_pos;
+	size_t read_len;
+	void *lz4_dctx;
+	size_t lz4_hint;                                                           // Bytes LZ4F_decompress expects next, 0 at the end of a frame
+};
+
+extern "C" {
+	ssize_t tar_stream_write(int fd, const void *buffer, size_t size);
+	ssize_t tar_stream_read(int fd, void *buffer, size_t size);
+	int tar_stream_close(int fd);
+}
+
+#endif // __TWRPTARSTREAM_HPP
@@ -0,0 +1,216 @@
+/*
+	Copyright 2012 to 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <string>
+#include <vector>
+
+#include "twrpTrace.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+#ifndef BUILD_TWRPTAR_MAIN
+#include "set_metadata.h"
+#endif
+
+#define TRACE_EVENTS_PER_THREAD 4096
+#define TRACE_MAX_THREAD_BUFFERS 64
+
+struct Trace_Event {
+	uint64_t timestamp_us;
+	const char* category;
+	const char* name;
+	char phase;                                        // 'B', 'E' or 'C'
+	uint64_t value;                                    // Of 'C' counter events
+};
+
+// Only the owning thread writes events, the lock is there for Dump
+struct Trace_Buffer {
+	pid_t tid;
+	bool retired;                                      // The thread has exited, the buffer may be handed to a new one
+	uint64_t count;                                    // Events written since the buffer was handed out
+	pthread_mutex_t lock;
+	Trace_Event events[TRACE_EVENTS_PER_THREAD];
+};
+
+static std::vector<Trace_Buffer*> trace_buffers;
+static pthread_mutex_t trace_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+int twrpTrace::enabled = 0;
+
+static void Retire_Buffer(void *cookie) {
+	Trace_Buffer* buffer = (Trace_Buffer*) cookie;
+
+	pthread_mutex_lock(&trace_buffers_lock);
+	buffer->retired = true;
+	pthread_mutex_unlock(&trace_buffers_lock);
+}
+
+static void Create_Trace_Key(void) {
+	pthread_key_create(&trace_key, Retire_Buffer);
+}
+
+// Hands the calling thread its buffer. Once TRACE_MAX_THREAD_BUFFERS exist
+// the oldest buffer of an exited thread is reused, and if every thread is
+// still alive the events of this one are dropped.
+static Trace_Buffer* Get_Buffer(void) {
+	pthread_once(&trace_key_once, Create_Trace_Key);
+	Trace_Buffer* buffer = (Trace_Buffer*) pthread_getspecific(trace_key);
+	if (buffer)
+		return buffer;
+
+	pthread_mutex_lock(&trace_buffers_lock);
+	if (trace_buffers.size() < TRACE_MAX_THREAD_BUFFERS) {
+		buffer = new Trace_Buffer;
+		pthread_mutex_init(&buffer->lock, NULL);
+	} else {
+		for (size_t i = 0; i < trace_buffers.size(); i++) {
+			if (trace_buffers[i]->retired) {
+				buffer = trace_buffers[i];
+				trace_buffers.erase(trace_buffers.begin() + i);
+				break;
+			}
+		}
+	}
+	if (buffer) {
+		pthread_mutex_lock(&buffer->lock);
+		buffer->tid = syscall(__NR_gettid);
+		buffer->retired = false;
+		buffer->count = 0;
+		pthread_mutex_unlock(&buffer->lock);
+		trace_buffers.push_back(buffer);
+		pthread_setspecific(trace_key, buffer);
+	}
+	pthread_mutex_unlock(&trace_buffers_lock);
+	return buffer;
+}
+
+static void Add_Event(const char* category, const char* name, char phase, uint64_t value = 0) {
+	Trace_Buffer* buffer = Get_Buffer();
+	if (!buffer)
+		return;
+
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&buffer->lock);
+	Trace_Event& event = buffer->events[buffer->count % TRACE_EVENTS_PER_THREAD];
+	event.timestamp_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	event.category = category;
+	event.name = name;
+	event.phase = phase;
+	event.value = value;
+	buffer->count++;
+	pthread_mutex_unlock(&buffer->lock);
+}
+
+void twrpTrace::Set_Enabled(bool enable) {
+	if (enable != Is_Enabled())
+		LOGINFO("Performance tracing %s\n", enable ? "enabled" : "disabled");
+	__atomic_store_n(&enabled, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+bool twrpTrace::Is_Enabled() {
+	return __atomic_load_n(&enabled, __ATOMIC_RELAXED) != 0;
+}
+
+void twrpTrace::Begin(const char* category, const char* name) {
+	if (Is_Enabled())
+		Add_Event(category, name, 'B');
+}
+
+void twrpTrace::End(const char* category, const char* name) {
+	if (Is_Enabled())
+		Add_Event(category, name, 'E');
+}
+
+void twrpTrace::Counter(const char* category, const char* name, uint64_t value) {
+	if (Is_Enabled())
+		Add_Event(category, name, 'C', value);
+}
+
+bool twrpTrace::Dump(const std::string& Filename) {
+	FILE* out = fopen(Filename.c_str(), "w");
+	if (!out) {
+		LOGINFO("Unable to write trace '%s': %s\n", Filename.c_str(), strerror(errno));
+		return false;
+	}
+
+	pid_t pid = getpid();
+	bool first = true;
+	fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+	pthread_mutex_lock(&trace_buffers_lock);
+	for (size_t i = 0; i < trace_buffers.size(); i++) {
+		Trace_Buffer* buffer = trace_buffers[i];
+
+		pthread_mutex_lock(&buffer->lock);
+		uint64_t start = buffer->count > TRACE_EVENTS_PER_THREAD ? buffer->count - TRACE_EVENTS_PER_THREAD : 0;
+		for (uint64_t n = start; n < buffer->count; n++) {
+			Trace_Event& event = buffer->events[n % TRACE_EVENTS_PER_THREAD];
+			fprintf(out, "%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"%c\", \"ts\": %llu, \"pid\": %d, \"tid\": %d",
+				first ? "" : ",", event.name, event.category, event.phase, (unsigned long long)event.timestamp_us, pid, buffer->tid);
+			if (event.phase == 'C')
+				fprintf(out, ", \"args\": {\"value\": %llu}", (unsigned long long)event.value);
+			fprintf(out, "}");
+			first = false;
+		}
+		pthread_mutex_unlock(&buffer->lock);
+	}
+	pthread_mutex_unlock(&trace_buffers_lock);
+	fprintf(out, "\n]}\n");
+
+	bool ret = (fflush(out) == 0);
+	if (fclose(out) != 0)
+		ret = false;
+	return ret;
+}
+
+void twrpTrace::Dump_With_Log(const std::string& Log_Filename) {
+	if (!Is_Enabled())
+		return;
+
+	Dump(TRACE_FILE);
+	std::string Trace_Filename = TWFunc::Get_Path(Log_Filename) + "recovery_trace.json";
+	if (Dump(Trace_Filename)) {
+#ifndef BUILD_TWRPTAR_MAIN
+		tw_set_default_metadata(Trace_Filename.c_str());
+#endif
+	}
+}
+
+twrpTraceScope::twrpTraceScope(const char* trace_category, const char* trace_name) {
+	category = trace_category;
+	name = trace_name;
+	traced = twrpTrace::Is_Enabled();
+	if (traced)
+		twrpTrace::Begin(category, name);
+}
+
+twrpTraceScope::~twrpTraceScope() {
+	// Always end what was begun, so turning tracing off mid-scope leaves no open event
+	if (traced)
+		Add_Event(category, name, 'E');
+}
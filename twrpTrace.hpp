@@ -0,0 +1,59 @@
+/*
+	Copyright 2012 to 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_TRACE
+#define __TWRP_TRACE
+
+#include <stdint.h>
+#include <string>
+
+#define TRACE_FILE "/tmp/recovery_trace.json"
+
+// Begin, end and counter events recorded in a ring buffer per thread while tracing
+// is enabled with tw_trace or the twrp.trace property, and written out in
+// the Chrome trace event format that chrome://tracing and Perfetto load.
+// Categories and names are kept as pointers, so they must be string
+// literals. Events from forked children such as the tar processes are
+// not collected; trace the parent's wait instead.
+class twrpTrace {
+public:
+	static void Set_Enabled(bool enable);                                     // Old events are kept when tracing is turned off
+	static bool Is_Enabled();
+	static void Begin(const char* category, const char* name);
+	static void End(const char* category, const char* name);
+	static void Counter(const char* category, const char* name, uint64_t value); // Plotted as a graph by the viewers
+	static bool Dump(const std::string& Filename);                           // Writes the events of every thread, oldest first
+	static void Dump_With_Log(const std::string& Log_Filename);              // Writes TRACE_FILE and recovery_trace.json next to the log
+
+private:
+	static int enabled;
+};
+
+// Traces the lifetime of the object as one event
+class twrpTraceScope {
+public:
+	twrpTraceScope(const char* category, const char* name);
+	~twrpTraceScope();
+
+private:
+	const char* category;
+	const char* name;
+	bool traced;
+};
+
+#endif // __TWRP_TRACE
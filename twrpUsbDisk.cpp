@@ -0,0 +1,785 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+#include <string>
+#include "twrpUsbDisk.hpp"
+#include "twcommon.h"
+
+#define USB_DISK_EP_OUT USB_DISK_FFS_PATH "/ep1"
+#define USB_DISK_EP_IN USB_DISK_FFS_PATH "/ep2"
+#define USB_DISK_BLOCK_SIZE 512
+#define USB_DISK_IO_SIZE (128 * 1024)                                           // Bytes moved over USB per read or write call
+#define USB_DISK_SEGMENT_SIZE (512 * 1024)                                      // Unit the read cache reads the backing in
+#define USB_DISK_SEGMENTS 32
+#define USB_DISK_WRITE_BUFFER (4 * 1024 * 1024)                                 // Consecutive writes collected before they go to the backing
+#define USB_DISK_IDLE_FLUSH_MS 1000
+#define USB_DISK_WAKE_SIGNAL SIGUSR2                                            // Interrupts the bulk thread waiting on an endpoint
+
+#define BOT_CBW_SIGNATURE 0x43425355
+#define BOT_CSW_SIGNATURE 0x53425355
+#define BOT_CBW_SIZE 31
+#define BOT_CSW_SIZE 13
+#define BOT_GET_MAX_LUN 0xfe
+#define BOT_RESET 0xff
+#define CSW_PASSED 0
+#define CSW_FAILED 1
+#define CSW_PHASE_ERROR 2
+
+#define SCSI_TEST_UNIT_READY 0x00
+#define SCSI_REQUEST_SENSE 0x03
+#define SCSI_INQUIRY 0x12
+#define SCSI_MODE_SENSE_6 0x1a
+#define SCSI_START_STOP_UNIT 0x1b
+#define SCSI_PREVENT_ALLOW 0x1e
+#define SCSI_READ_FORMAT_CAPACITIES 0x23
+#define SCSI_READ_CAPACITY_10 0x25
+#define SCSI_READ_10 0x28
+#define SCSI_WRITE_10 0x2a
+#define SCSI_VERIFY_10 0x2f
+#define SCSI_SYNCHRONIZE_CACHE_10 0x35
+#define SCSI_MODE_SENSE_10 0x5a
+#define SCSI_READ_16 0x88
+#define SCSI_WRITE_16 0x8a
+#define SCSI_SERVICE_ACTION_IN_16 0x9e
+#define SCSI_READ_CAPACITY_16 0x10
+
+#define SENSE_NONE 0x00
+#define SENSE_NOT_READY 0x02
+#define SENSE_MEDIUM_ERROR 0x03
+#define SENSE_ILLEGAL_REQUEST 0x05
+#define SENSE_DATA_PROTECT 0x07
+
+struct usb_disk_segment {
+	uint64_t index;                                                                 // offset / USB_DISK_SEGMENT_SIZE
+	size_t length;                                                                  // shorter than a segment at the end of the disk
+	uint64_t used;                                                                  // tick of the last access, 0 if empty
+	char *data;
+};
+
+struct usb_disk_command {
+	uint32_t tag;
+	uint32_t host_length;                                                           // bytes the host expects to move in the data stage
+	bool host_in;
+	uint32_t done;                                                                  // bytes moved so far
+	bool phase_error;
+};
+
+static const struct {
+	struct usb_functionfs_descs_head header;
+	struct {
+		struct usb_interface_descriptor intf;
+		struct usb_endpoint_descriptor_no_audio out;
+		struct usb_endpoint_descriptor_no_audio in;
+	} __attribute__((packed)) fs_descs, hs_descs;
+} __attribute__((packed)) usb_disk_descriptors = {
+	{ htole32(FUNCTIONFS_DESCRIPTORS_MAGIC), htole32(sizeof(usb_disk_descriptors)), htole32(3), htole32(3) },
+	{
+		{ USB_DT_INTERFACE_SIZE, USB_DT_INTERFACE, 0, 0, 2, USB_CLASS_MASS_STORAGE, 0x06, 0x50, 1 }, // SCSI transparent, bulk only
+		{ USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, 1 | USB_DIR_OUT, USB_ENDPOINT_XFER_BULK, htole16(64), 0 },
+		{ USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, 2 | USB_DIR_IN, USB_ENDPOINT_XFER_BULK, htole16(64), 0 },
+	},
+	{
+		{ USB_DT_INTERFACE_SIZE, USB_DT_INTERFACE, 0, 0, 2, USB_CLASS_MASS_STORAGE, 0x06, 0x50, 1 },
+		{ USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, 1 | USB_DIR_OUT, USB_ENDPOINT_XFER_BULK, htole16(512), 0 },
+		{ USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, 2 | USB_DIR_IN, USB_ENDPOINT_XFER_BULK, htole16(512), 0 },
+	},
+};
+
+#define USB_DISK_INTERFACE_NAME "TWRP Mass Storage"
+
+static const struct {
+	struct usb_functionfs_strings_head header;
+	struct {
+		__le16 code;
+		char str1[sizeof(USB_DISK_INTERFACE_NAME)];
+	} __attribute__((packed)) lang0;
+} __attribute__((packed)) usb_disk_strings = {
+	{ htole32(FUNCTIONFS_STRINGS_MAGIC), htole32(sizeof(usb_disk_strings)), htole32(1), htole32(1) },
+	{ htole16(0x0409), USB_DISK_INTERFACE_NAME },
+};
+
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;                   // backing, cache, write buffer and the flags below
+static pthread_cond_t disk_cond = PTHREAD_COND_INITIALIZER;                     // enabled or stopping changed
+static bool disk_running = false;
+static bool disk_enabled = false;                                               // the host configured the function
+static bool disk_stopping = false;
+static pthread_t control_thread, bulk_thread;
+static bool bulk_done = false;                                                  // the bulk thread returned
+static int control_fd = -1, bulk_out_fd = -1, bulk_in_fd = -1;
+static int wake_pipe[2] = { -1, -1 };
+static int backing_fd = -1;
+static bool backing_read_only = false;
+static uint64_t disk_blocks = 0;
+static usb_disk_segment disk_segments[USB_DISK_SEGMENTS];
+static char *segment_memory = NULL;
+static uint64_t segment_tick = 0;
+static char *write_buffer = NULL;
+static uint64_t write_start = 0;
+static size_t write_length = 0;
+static time_t last_write = 0;
+static char *io_buffer = NULL;                                                  // data stage of the command being run, bulk thread only
+static uint8_t sense_key = SENSE_NONE, sense_asc = 0;
+static bool deferred_error = false;                                             // a flush failed after the write it held was acknowledged
+
+static uint16_t Get_BE16(const uint8_t *p) {
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t Get_BE32(const uint8_t *p) {
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint64_t Get_BE64(const uint8_t *p) {
+	return ((uint64_t) Get_BE32(p) << 32) | Get_BE32(p + 4);
+}
+
+static uint32_t Get_LE32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void Put_BE32(uint8_t *p, uint32_t value) {
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static void Put_LE32(uint8_t *p, uint32_t value) {
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+static void Wake_Handler(int sig __unused) {
+}
+
+static bool Stopping() {
+	return __atomic_load_n(&disk_stopping, __ATOMIC_ACQUIRE);
+}
+
+static bool Write_Fully(int fd, const void *data, size_t length) {
+	const char *p = (const char*) data;
+
+	while (length > 0) {
+		ssize_t ret = write(fd, p, length);
+		if (ret < 0 && errno == EINTR && !Stopping())
+			continue;
+		if (ret <= 0)
+			return false;
+		p += ret;
+		length -= ret;
+	}
+	return true;
+}
+
+static bool Pwrite_Fully(int fd, const char *data, size_t length, uint64_t offset) {
+	while (length > 0) {
+		ssize_t ret = pwrite64(fd, data, length, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		data += ret;
+		length -= ret;
+		offset += ret;
+	}
+	return true;
+}
+
+// Called with disk_lock held
+static bool Flush_Writes() {
+	if (write_length == 0)
+		return true;
+	bool ret = Pwrite_Fully(backing_fd, write_buffer, write_length, write_start);
+	if (!ret)
+		LOGINFO("twrpUsbDisk unable to write %zu bytes at %llu: %s\n", write_length, (unsigned long long) write_start, strerror(errno));
+	write_length = 0;
+	return ret;
+}
+
+// Copies the part of data at offset that overlaps the segment into it
+static void Update_Segment(usb_disk_segment *segment, uint64_t offset, const char *data, size_t length) {
+	uint64_t start = segment->index * USB_DISK_SEGMENT_SIZE;
+
+	if (start >= offset + length || start + segment->length <= offset)
+		return;
+	uint64_t from = offset > start ? offset : start;
+	uint64_t to = offset + length < start + segment->length ? offset + length : start + segment->length;
+	memcpy(segment->data + (from - start), data + (from - offset), to - from);
+}
+
+static usb_disk_segment* Get_Segment(uint64_t index) {
+	usb_disk_segment *segment = &disk_segments[0];
+
+	for (int i = 0; i < USB_DISK_SEGMENTS; i++) {
+		if (disk_segments[i].used && disk_segments[i].index == index) {
+			disk_segments[i].used = ++segment_tick;
+			return &disk_segments[i];
+		}
+		if (disk_segments[i].used < segment->used)
+			segment = &disk_segments[i];
+	}
+
+	// Not cached, the least recently used segment is read over
+	uint64_t offset = index * USB_DISK_SEGMENT_SIZE, disk_size = disk_blocks * USB_DISK_BLOCK_SIZE;
+	size_t length = USB_DISK_SEGMENT_SIZE, done = 0;
+	if (offset + length > disk_size)
+		length = disk_size - offset;
+	segment->used = 0;
+	while (done < length) {
+		ssize_t ret = pread64(backing_fd, segment->data + done, length - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			LOGINFO("twrpUsbDisk unable to read at %llu: %s\n", (unsigned long long) (offset + done), strerror(errno));
+			return NULL;
+		}
+		done += ret;
+	}
+	segment->index = index;
+	segment->length = length;
+	segment->used = ++segment_tick;
+	// Writes still in the buffer are newer than the backing
+	if (write_length > 0)
+		Update_Segment(segment, write_start, write_buffer, write_length);
+	return segment;
+}
+
+// Called with disk_lock held
+static bool Cache_Read(uint64_t offset, char *data, size_t length) {
+	while (length > 0) {
+		usb_disk_segment *segment = Get_Segment(offset / USB_DISK_SEGMENT_SIZE);
+		if (segment == NULL)
+			return false;
+		size_t start = offset % USB_DISK_SEGMENT_SIZE;
+		size_t count = segment->length - start;
+		if (count > length)
+			count = length;
+		memcpy(data, segment->data + start, count);
+		data += count;
+		offset += count;
+		length -= count;
+	}
+	return true;
+}
+
+// Called with disk_lock held
+static bool Buffer_Write(uint64_t offset, const char *data, size_t length) {
+	bool ret = true;
+
+	if (write_length > 0 && (offset != write_start + write_length || write_length + length > USB_DISK_WRITE_BUFFER))
+		ret = Flush_Writes();
+	if (write_length == 0)
+		write_start = offset;
+	memcpy(write_buffer + write_length, data, length);
+	write_length += length;
+	last_write = time(NULL);
+
+	// Cached segments are kept current instead of being dropped
+	for (int i = 0; i < USB_DISK_SEGMENTS; i++) {
+		if (disk_segments[i].used)
+			Update_Segment(&disk_segments[i], offset, data, length);
+	}
+	return ret;
+}
+
+static void Set_Sense(uint8_t key, uint8_t asc) {
+	sense_key = key;
+	sense_asc = asc;
+}
+
+// Sends up to length bytes of the data stage to the host
+static bool Send_Data(usb_disk_command *cmd, const void *data, uint32_t length) {
+	if (!cmd->host_in) {
+		cmd->phase_error = true;
+		return false;
+	}
+	if (length > cmd->host_length - cmd->done)
+		length = cmd->host_length - cmd->done;
+	if (length == 0)
+		return true;
+	if (!Write_Fully(bulk_in_fd, data, length))
+		return false;
+	cmd->done += length;
+	return true;
+}
+
+static bool Receive_Data(usb_disk_command *cmd, char *data, uint32_t length) {
+	if (cmd->host_in || length > cmd->host_length - cmd->done) {
+		cmd->phase_error = true;
+		return false;
+	}
+	while (length > 0) {
+		ssize_t ret = read(bulk_out_fd, data, length);
+		if (ret < 0 && errno == EINTR && !Stopping())
+			continue;
+		if (ret <= 0)
+			return false;
+		data += ret;
+		length -= ret;
+		cmd->done += ret;
+	}
+	return true;
+}
+
+// Ends a data stage the command did not fill the way the host expects
+static void Finish_Data(usb_disk_command *cmd) {
+	if (cmd->done >= cmd->host_length)
+		return;
+	if (cmd->host_in) {
+		// Reading from an IN endpoint stalls it, the host clears the stall and reads the status
+		char c;
+		if (read(bulk_in_fd, &c, 1) < 0 && errno != EBADMSG)
+			LOGINFO("twrpUsbDisk unable to stall bulk in: %s\n", strerror(errno));
+		return;
+	}
+	while (cmd->done < cmd->host_length) {
+		uint32_t length = cmd->host_length - cmd->done;
+		if (length > USB_DISK_IO_SIZE)
+			length = USB_DISK_IO_SIZE;
+		ssize_t ret = read(bulk_out_fd, io_buffer, length);
+		if (ret < 0 && errno == EINTR && !Stopping())
+			continue;
+		if (ret <= 0)
+			break;
+		cmd->done += ret;
+	}
+}
+
+static bool Check_Range(uint64_t lba, uint32_t blocks) {
+	if (lba > disk_blocks || blocks > disk_blocks - lba) {
+		Set_Sense(SENSE_ILLEGAL_REQUEST, 0x21); // LBA out of range
+		return false;
+	}
+	return true;
+}
+
+static bool Read_Blocks(usb_disk_command *cmd, uint64_t lba, uint32_t blocks) {
+	if (!Check_Range(lba, blocks))
+		return false;
+	uint64_t offset = lba * USB_DISK_BLOCK_SIZE, remaining = (uint64_t) blocks * USB_DISK_BLOCK_SIZE;
+	while (remaining > 0 && cmd->done < cmd->host_length) {
+		size_t length = remaining < USB_DISK_IO_SIZE ? remaining : USB_DISK_IO_SIZE;
+		pthread_mutex_lock(&disk_lock);
+		bool ret = Cache_Read(offset, io_buffer, length);
+		pthread_mutex_unlock(&disk_lock);
+		if (!ret) {
+			Set_Sense(SENSE_MEDIUM_ERROR, 0x11); // unrecovered read error
+			return false;
+		}
+		if (!Send_Data(cmd, io_buffer, length))
+			return false;
+		offset += length;
+		remaining -= length;
+	}
+	return true;
+}
+
+static bool Write_Blocks(usb_disk_command *cmd, uint64_t lba, uint32_t blocks) {
+	if (!Check_Range(lba, blocks))
+		return false;
+	if (backing_read_only) {
+		Set_Sense(SENSE_DATA_PROTECT, 0x27); // write protected
+		return false;
+	}
+	uint64_t offset = lba * USB_DISK_BLOCK_SIZE, remaining = (uint64_t) blocks * USB_DISK_BLOCK_SIZE;
+	while (remaining > 0) {
+		size_t length = remaining < USB_DISK_IO_SIZE ? remaining : USB_DISK_IO_SIZE;
+		if (!Receive_Data(cmd, io_buffer, length))
+			return false;
+		pthread_mutex_lock(&disk_lock);
+		bool ret = Buffer_Write(offset, io_buffer, length);
+		pthread_mutex_unlock(&disk_lock);
+		if (!ret) {
+			Set_Sense(SENSE_MEDIUM_ERROR, 0x0c); // write error
+			return false;
+		}
+		offset += length;
+		remaining -= length;
+	}
+	return true;
+}
+
+static bool Sync_Backing() {
+	pthread_mutex_lock(&disk_lock);
+	bool ret = Flush_Writes() && fsync(backing_fd) == 0;
+	pthread_mutex_unlock(&disk_lock);
+	if (!ret)
+		Set_Sense(SENSE_MEDIUM_ERROR, 0x0c);
+	return ret;
+}
+
+// Runs one SCSI command, false sends a failed status with the sense set
+static bool Run_Command(usb_disk_command *cmd, const uint8_t *cb) {
+	uint8_t reply[36];
+	uint64_t last = disk_blocks - 1;
+
+	if (cb[0] != SCSI_REQUEST_SENSE)
+		Set_Sense(SENSE_NONE, 0);
+	if (deferred_error && cb[0] != SCSI_REQUEST_SENSE && cb[0] != SCSI_INQUIRY) {
+		deferred_error = false;
+		Set_Sense(SENSE_MEDIUM_ERROR, 0x0c);
+		return false;
+	}
+	memset(reply, 0, sizeof(reply));
+	switch (cb[0]) {
+		case SCSI_TEST_UNIT_READY:
+		case SCSI_PREVENT_ALLOW:
+		case SCSI_VERIFY_10:
+			return true;
+		case SCSI_REQUEST_SENSE:
+			reply[0] = 0x70;
+			reply[2] = sense_key;
+			reply[7] = 10;
+			reply[12] = sense_asc;
+			Set_Sense(SENSE_NONE, 0);
+			return Send_Data(cmd, reply, cb[4] < 18 ? cb[4] : 18);
+		case SCSI_INQUIRY:
+			reply[1] = 0x80; // removable
+			reply[2] = 0x04; // SPC-2
+			reply[3] = 0x02;
+			reply[4] = 31;
+			memcpy(reply + 8, "TWRP    ", 8);
+			memcpy(reply + 16, "USB Storage     ", 16);
+			memcpy(reply + 32, "1.0 ", 4);
+			return Send_Data(cmd, reply, Get_BE16(cb + 3) < 36 ? Get_BE16(cb + 3) : 36);
+		case SCSI_MODE_SENSE_6:
+			reply[0] = 3;
+			reply[2] = backing_read_only ? 0x80 : 0;
+			return Send_Data(cmd, reply, cb[4] < 4 ? cb[4] : 4);
+		case SCSI_MODE_SENSE_10:
+			reply[1] = 6;
+			reply[3] = backing_read_only ? 0x80 : 0;
+			return Send_Data(cmd, reply, Get_BE16(cb + 7) < 8 ? Get_BE16(cb + 7) : 8);
+		case SCSI_START_STOP_UNIT:
+		case SCSI_SYNCHRONIZE_CACHE_10:
+			return Sync_Backing();
+		case SCSI_READ_FORMAT_CAPACITIES:
+			reply[3] = 8;
+			Put_BE32(reply + 4, last > 0xffffffff ? 0xffffffff : last + 1);
+			Put_BE32(reply + 8, (0x02 << 24) | USB_DISK_BLOCK_SIZE); // formatted media
+			return Send_Data(cmd, reply, Get_BE16(cb + 7) < 12 ? Get_BE16(cb + 7) : 12);
+		case SCSI_READ_CAPACITY_10:
+			Put_BE32(reply, last > 0xffffffff ? 0xffffffff : last);
+			Put_BE32(reply + 4, USB_DISK_BLOCK_SIZE);
+			return Send_Data(cmd, reply, 8);
+		case SCSI_SERVICE_ACTION_IN_16:
+			if ((cb[1] & 0x1f) != SCSI_READ_CAPACITY_16)
+				break;
+			Put_BE32(reply, last >> 32);
+			Put_BE32(reply + 4, last);
+			Put_BE32(reply + 8, USB_DISK_BLOCK_SIZE);
+			return Send_Data(cmd, reply, Get_BE32(cb + 10) < 32 ? Get_BE32(cb + 10) : 32);
+		case SCSI_READ_10:
+			return Read_Blocks(cmd, Get_BE32(cb + 2), Get_BE16(cb + 7));
+		case SCSI_READ_16:
+			return Read_Blocks(cmd, Get_BE64(cb + 2), Get_BE32(cb + 10));
+		case SCSI_WRITE_10:
+			return Write_Blocks(cmd, Get_BE32(cb + 2), Get_BE16(cb + 7));
+		case SCSI_WRITE_16:
+			return Write_Blocks(cmd, Get_BE64(cb + 2), Get_BE32(cb + 10));
+	}
+	Set_Sense(SENSE_ILLEGAL_REQUEST, 0x20); // invalid command operation code
+	return false;
+}
+
+static void* Bulk_Thread(void *cookie __unused) {
+	uint8_t cbw[USB_DISK_BLOCK_SIZE], csw[BOT_CSW_SIZE];
+
+	for (;;) {
+		pthread_mutex_lock(&disk_lock);
+		while (!disk_enabled && !disk_stopping)
+			pthread_cond_wait(&disk_cond, &disk_lock);
+		bool stopping = disk_stopping;
+		pthread_mutex_unlock(&disk_lock);
+		if (stopping)
+			break;
+
+		// A whole packet is read, the endpoint may round shorter reads up
+		ssize_t length = read(bulk_out_fd, cbw, sizeof(cbw));
+		if (length < 0) {
+			// The function was disabled or the host reset the port
+			if (errno != EINTR)
+				usleep(10000);
+			continue;
+		}
+		if (length != BOT_CBW_SIZE || Get_LE32(cbw) != BOT_CBW_SIGNATURE || cbw[13] != 0 || cbw[14] < 1 || cbw[14] > 16) {
+			LOGINFO("twrpUsbDisk ignoring invalid command block of %zd bytes\n", length);
+			continue;
+		}
+
+		usb_disk_command cmd;
+		cmd.tag = Get_LE32(cbw + 4);
+		cmd.host_length = Get_LE32(cbw + 8);
+		cmd.host_in = (cbw[12] & 0x80) != 0;
+		cmd.done = 0;
+		cmd.phase_error = false;
+		bool passed = Run_Command(&cmd, cbw + 15);
+		if (Stopping())
+			break;
+		if (!cmd.phase_error)
+			Finish_Data(&cmd);
+
+		Put_LE32(csw, BOT_CSW_SIGNATURE);
+		Put_LE32(csw + 4, cmd.tag);
+		Put_LE32(csw + 8, cmd.host_length - cmd.done);
+		csw[12] = cmd.phase_error ? CSW_PHASE_ERROR : (passed ? CSW_PASSED : CSW_FAILED);
+		if (!Write_Fully(bulk_in_fd, csw, sizeof(csw)))
+			LOGINFO("twrpUsbDisk unable to send status: %s\n", strerror(errno));
+	}
+	__atomic_store_n(&bulk_done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void Handle_Setup(const struct usb_ctrlrequest *setup) {
+	bool in = (setup->bRequestType & USB_DIR_IN) != 0;
+	char c = 0;
+
+	if ((setup->bRequestType & USB_TYPE_MASK) == USB_TYPE_CLASS) {
+		if (setup->bRequest == BOT_GET_MAX_LUN && in && le16toh(setup->wLength) >= 1) {
+			// A single LUN, numbered 0
+			if (write(control_fd, &c, 1) < 0)
+				LOGINFO("twrpUsbDisk unable to answer get max lun: %s\n", strerror(errno));
+			return;
+		}
+		if (setup->bRequest == BOT_RESET && !in) {
+			// Acknowledged with a zero length status stage
+			if (read(control_fd, &c, 0) < 0)
+				LOGINFO("twrpUsbDisk unable to acknowledge reset: %s\n", strerror(errno));
+			return;
+		}
+	}
+	// Moving data against the direction of the request stalls it
+	if (in) {
+		if (read(control_fd, &c, 0) < 0 && errno != EL2HLT)
+			LOGINFO("twrpUsbDisk unable to stall request %02x\n", setup->bRequest);
+	} else {
+		if (write(control_fd, &c, 0) < 0 && errno != EL2HLT)
+			LOGINFO("twrpUsbDisk unable to stall request %02x\n", setup->bRequest);
+	}
+}
+
+static void Set_Enabled(bool enabled) {
+	pthread_mutex_lock(&disk_lock);
+	if (!enabled && !Flush_Writes())
+		deferred_error = true;
+	disk_enabled = enabled;
+	pthread_cond_broadcast(&disk_cond);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+static void* Control_Thread(void *cookie __unused) {
+	struct usb_functionfs_event event;
+	struct pollfd fds[2];
+
+	fds[0].fd = control_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = wake_pipe[0];
+	fds[1].events = POLLIN;
+	for (;;) {
+		int ret = poll(fds, 2, USB_DISK_IDLE_FLUSH_MS);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 || (fds[1].revents & POLLIN))
+			break;
+		if (ret == 0) {
+			// The host stopped writing, the collected writes should not wait for it
+			pthread_mutex_lock(&disk_lock);
+			if (write_length > 0 && time(NULL) - last_write >= USB_DISK_IDLE_FLUSH_MS / 1000 && !Flush_Writes())
+				deferred_error = true;
+			pthread_mutex_unlock(&disk_lock);
+			continue;
+		}
+		ssize_t length = read(control_fd, &event, sizeof(event));
+		if (length < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (length != sizeof(event)) {
+			LOGINFO("twrpUsbDisk control endpoint read failed: %s\n", strerror(errno));
+			break;
+		}
+		switch (event.type) {
+			case FUNCTIONFS_ENABLE:
+				Set_Enabled(true);
+				break;
+			case FUNCTIONFS_DISABLE:
+			case FUNCTIONFS_UNBIND:
+				Set_Enabled(false);
+				break;
+			case FUNCTIONFS_SETUP:
+				Handle_Setup(&event.u.setup);
+				break;
+			default:
+				break;
+		}
+	}
+	return NULL;
+}
+
+static void Close_All() {
+	int *fds[] = { &bulk_in_fd, &bulk_out_fd, &control_fd, &backing_fd, &wake_pipe[0], &wake_pipe[1] };
+
+	for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+		if (*fds[i] >= 0)
+			close(*fds[i]);
+		*fds[i] = -1;
+	}
+	free(segment_memory);
+	segment_memory = NULL;
+	free(write_buffer);
+	write_buffer = NULL;
+	free(io_buffer);
+	io_buffer = NULL;
+}
+
+bool twrpUsbDisk::Start(const std::string& backing) {
+	struct stat st;
+	uint64_t size = 0;
+	struct sigaction action;
+
+	if (disk_running)
+		return true;
+	backing_read_only = false;
+	backing_fd = open(backing.c_str(), O_RDWR | O_CLOEXEC);
+	if (backing_fd < 0) {
+		backing_read_only = true;
+		backing_fd = open(backing.c_str(), O_RDONLY | O_CLOEXEC);
+	}
+	if (backing_fd < 0 || fstat(backing_fd, &st) != 0) {
+		LOGERR("Unable to open '%s' for USB storage: %s\n", backing.c_str(), strerror(errno));
+		Close_All();
+		return false;
+	}
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(backing_fd, BLKGETSIZE64, &size) != 0)
+			size = 0;
+	} else {
+		size = st.st_size;
+	}
+	disk_blocks = size / USB_DISK_BLOCK_SIZE;
+	if (disk_blocks == 0) {
+		LOGERR("'%s' is empty, not exporting it over USB\n", backing.c_str());
+		Close_All();
+		return false;
+	}
+
+	segment_memory = (char*) malloc(USB_DISK_SEGMENTS * USB_DISK_SEGMENT_SIZE);
+	write_buffer = (char*) malloc(USB_DISK_WRITE_BUFFER);
+	io_buffer = (char*) malloc(USB_DISK_IO_SIZE);
+	if (segment_memory == NULL || write_buffer == NULL || io_buffer == NULL || pipe2(wake_pipe, O_CLOEXEC) != 0) {
+		LOGERR("Unable to set up USB storage\n");
+		Close_All();
+		return false;
+	}
+	for (int i = 0; i < USB_DISK_SEGMENTS; i++) {
+		disk_segments[i].used = 0;
+		disk_segments[i].data = segment_memory + i * USB_DISK_SEGMENT_SIZE;
+	}
+	segment_tick = 0;
+	write_length = 0;
+	sense_key = SENSE_NONE;
+	deferred_error = false;
+
+	// The endpoint files only appear once the descriptors are written
+	control_fd = open(USB_DISK_FFS_EP0, O_RDWR | O_CLOEXEC);
+	if (control_fd < 0 || write(control_fd, &usb_disk_descriptors, sizeof(usb_disk_descriptors)) < 0 ||
+		write(control_fd, &usb_disk_strings, sizeof(usb_disk_strings)) < 0) {
+		LOGERR("Unable to set up the USB storage function at '%s': %s\n", USB_DISK_FFS_PATH, strerror(errno));
+		Close_All();
+		return false;
+	}
+	bulk_out_fd = open(USB_DISK_EP_OUT, O_RDWR | O_CLOEXEC);
+	bulk_in_fd = open(USB_DISK_EP_IN, O_RDWR | O_CLOEXEC);
+	if (bulk_out_fd < 0 || bulk_in_fd < 0) {
+		LOGERR("Unable to open the USB storage endpoints: %s\n", strerror(errno));
+		Close_All();
+		return false;
+	}
+
+	// No SA_RESTART, the signal has to end a blocking endpoint read
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = Wake_Handler;
+	sigemptyset(&action.sa_mask);
+	sigaction(USB_DISK_WAKE_SIGNAL, &action, NULL);
+
+	disk_enabled = false;
+	disk_stopping = false;
+	bulk_done = false;
+	if (pthread_create(&control_thread, NULL, Control_Thread, NULL) != 0) {
+		LOGERR("Unable to start the USB storage threads\n");
+		Close_All();
+		return false;
+	}
+	if (pthread_create(&bulk_thread, NULL, Bulk_Thread, NULL) != 0) {
+		LOGERR("Unable to start the USB storage threads\n");
+		if (write(wake_pipe[1], "x", 1) < 0)
+			LOGINFO("twrpUsbDisk unable to wake control thread\n");
+		pthread_join(control_thread, NULL);
+		Close_All();
+		return false;
+	}
+	disk_running = true;
+	LOGINFO("USB storage serving '%s', %llu blocks%s\n", backing.c_str(), (unsigned long long) disk_blocks, backing_read_only ? ", read only" : "");
+	return true;
+}
+
+void twrpUsbDisk::Stop() {
+	if (!disk_running)
+		return;
+	pthread_mutex_lock(&disk_lock);
+	__atomic_store_n(&disk_stopping, true, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&disk_cond);
+	pthread_mutex_unlock(&disk_lock);
+	if (write(wake_pipe[1], "x", 1) < 0)
+		LOGINFO("twrpUsbDisk unable to wake control thread\n");
+	pthread_join(control_thread, NULL);
+	// A read of a disabled endpoint waits for the function to come back, the
+	// signal is repeated in case it came before the thread entered the read
+	while (!__atomic_load_n(&bulk_done, __ATOMIC_ACQUIRE)) {
+		pthread_kill(bulk_thread, USB_DISK_WAKE_SIGNAL);
+		usleep(10000);
+	}
+	pthread_join(bulk_thread, NULL);
+
+	pthread_mutex_lock(&disk_lock);
+	if (!Flush_Writes() || fsync(backing_fd) != 0)
+		LOGERR("Unable to write all USB storage data: %s\n", strerror(errno));
+	pthread_mutex_unlock(&disk_lock);
+	Close_All();
+	disk_running = false;
+}
+
+bool twrpUsbDisk::Is_Running() {
+	return disk_running;
+}
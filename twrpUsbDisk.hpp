@@ -0,0 +1,44 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPUSBDISK_HPP
+#define __TWRPUSBDISK_HPP
+
+#include <string>
+
+#define USB_DISK_FFS_PATH "/dev/usb-ffs/ums"                                    // FunctionFS instance mounted by init.rc
+#define USB_DISK_FFS_EP0 USB_DISK_FFS_PATH "/ep0"
+#define USB_DISK_IMAGE_FILE "usbdisk.img"                                      // In the TWRP folder, exported when storage is /data/media
+
+// USB mass storage served from recovery itself through FunctionFS instead of
+// the kernel mass storage function. The host sees a single LUN speaking the
+// bulk only transport, the SCSI commands are answered here and the blocks
+// come from a block device or an image file. Reads go through a cache of
+// large segments so the small requests hosts send turn into few large reads
+// of the backing, and consecutive writes are collected and written together.
+// Written data is flushed on SYNCHRONIZE CACHE, when the host ejects the
+// disk, after a second without writes and when the disk is stopped.
+class twrpUsbDisk
+{
+public:
+	static bool Start(const std::string& backing);                             // Opens backing and the endpoints, before the function is enabled
+	static void Stop();                                                        // Flushes and closes, after the function was removed from the gadget
+	static bool Is_Running();
+};
+
+#endif // __TWRPUSBDISK_HPP
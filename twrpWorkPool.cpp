@@ -0,0 +1,146 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <deque>
+#include <map>
+#include "twrpWorkPool.hpp"
+#include "twcommon.h"
+
+struct work_pool_job {
+	void *owner;
+	twrpWorkPool::Job_Func func;
+	void *job;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;                     // a job was queued
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;                     // a job finished
+static std::deque<work_pool_job> pool_queue;
+static std::map<void*, unsigned> pool_running;                                  // jobs taken by a worker and not done, per owner
+static unsigned pool_workers = 0;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+// The pool lock is held across fork so a child never gets the queue half changed
+static void Pool_Fork_Prepare() {
+	pthread_mutex_lock(&pool_lock);
+}
+
+static void Pool_Fork_Parent() {
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static void Pool_Fork_Child() {
+	// Only the thread that forked exists in the child, none of the workers
+	pthread_cond_init(&pool_cond, NULL);
+	pthread_cond_init(&pool_done, NULL);
+	pool_queue.clear();
+	pool_running.clear();
+	pool_workers = 0;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static void Pool_Init() {
+	pthread_atfork(Pool_Fork_Prepare, Pool_Fork_Parent, Pool_Fork_Child);
+}
+
+static void* Pool_Thread(void *cookie __unused) {
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (pool_queue.empty())
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		work_pool_job item = pool_queue.front();
+		pool_queue.pop_front();
+		pool_running[item.owner]++;
+		pthread_mutex_unlock(&pool_lock);
+
+		item.func(item.owner, item.job);
+
+		pthread_mutex_lock(&pool_lock);
+		if (--pool_running[item.owner] == 0)
+			pool_running.erase(item.owner);
+		pthread_cond_broadcast(&pool_done);
+	}
+	return NULL;
+}
+
+unsigned twrpWorkPool::CPU_Count() {
+	long count = 0;
+#ifdef CPU_COUNT
+	cpu_set_t set;
+
+	// Cores that are offline or kept from recovery by cpusets do not count
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		count = CPU_COUNT(&set);
+#endif
+	if (count < 1)
+		count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count < 1 ? 1 : (unsigned) count;
+}
+
+bool twrpWorkPool::Start() {
+	unsigned count;
+
+	pthread_once(&pool_once, Pool_Init);
+	pthread_mutex_lock(&pool_lock);
+	count = CPU_Count();
+	while (pool_workers < count) {
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		int ret = pthread_create(&thread, &attr, Pool_Thread, NULL);
+		pthread_attr_destroy(&attr);
+		if (ret != 0) {
+			LOGINFO("twrpWorkPool unable to create worker thread %u\n", pool_workers);
+			break;
+		}
+		pool_workers++;
+	}
+	count = pool_workers;
+	pthread_mutex_unlock(&pool_lock);
+	return count > 0;
+}
+
+void twrpWorkPool::Submit(void *owner, Job_Func func, void *job) {
+	work_pool_job item;
+
+	item.owner = owner;
+	item.func = func;
+	item.job = job;
+	pthread_mutex_lock(&pool_lock);
+	pool_queue.push_back(item);
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void twrpWorkPool::Cancel(void *owner) {
+	pthread_mutex_lock(&pool_lock);
+	for (std::deque<work_pool_job>::iterator it = pool_queue.begin(); it != pool_queue.end();) {
+		if (it->owner == owner)
+			it = pool_queue.erase(it);
+		else
+			++it;
+	}
+	while (pool_running.find(owner) != pool_running.end())
+		pthread_cond_wait(&pool_done, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+}
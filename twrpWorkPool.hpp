@@ -0,0 +1,40 @@
+/*
+	Copyright 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPWORKPOOL_HPP
+#define __TWRPWORKPOOL_HPP
+
+// Process wide pool of worker threads, one for each CPU the process may run
+// on. The compression and encryption jobs of every archive stream run on it,
+// so archives written or restored side by side share the CPUs instead of each
+// of them starting threads of its own. Jobs are run in the order they are
+// submitted but may finish in any order, each owner keeps track of its own
+// results. A forked child starts its own workers the first time it uses the
+// pool, the threads of the parent do not exist there.
+class twrpWorkPool
+{
+public:
+	typedef void (*Job_Func)(void *owner, void *job);
+
+	static unsigned CPU_Count();                                               // CPUs in the affinity mask of the process, at least 1
+	static bool Start();                                                       // Starts the workers if needed, false if none could be started
+	static void Submit(void *owner, Job_Func func, void *job);                 // Runs func(owner, job) on a worker, Start() must have succeeded
+	static void Cancel(void *owner);                                           // Drops the queued jobs of owner and waits for the ones running
+};
+
+#endif // __TWRPWORKPOOL_HPP
@@ -90,6 +90,8 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -120,6 +122,8 @@
 
 static constexpr int WINDOW_SIZE = 5;
 static constexpr int FIBMAP_RETRY_LIMIT = 3;
+static constexpr size_t FIEMAP_EXTENTS = 256;
+static constexpr size_t REWRITE_CHUNK_SIZE = 1024 * 1024;
 
 // uncrypt provides three services: SETUP_BCB, CLEAR_BCB and UNCRYPT.
 //
@@ -249,48 +253,10 @@ static int retry_fibmap(const int fd, const char* name, int* block, const int he
     return kUncryptIoctlError;
 }
 
-static int produce_block_map(const char* path, const char* map_file, const char* blk_dev,
-                             bool encrypted, bool f2fs_fs, int socket) {
-    std::string err;
-    if (!android::base::RemoveFileIfExists(map_file, &err)) {
-        LOG(ERROR) << "failed to remove the existing map file " << map_file << ": " << err;
-        return kUncryptFileRemoveError;
-    }
-    std::string tmp_map_file = std::string(map_file) + ".tmp";
-    android::base::unique_fd mapfd(open(tmp_map_file.c_str(),
-                                        O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR));
-    if (mapfd == -1) {
-        PLOG(ERROR) << "failed to open " << tmp_map_file;
-        return kUncryptFileOpenError;
-    }
-
-    // Make sure we can write to the socket.
-    if (!write_status_to_socket(0, socket)) {
-        LOG(ERROR) << "failed to write to socket " << socket;
-        return kUncryptSocketWriteError;
-    }
-
-    struct stat sb;
-    if (stat(path, &sb) != 0) {
-        LOG(ERROR) << "failed to stat " << path;
-        return kUncryptFileStatError;
-    }
-
-    LOG(INFO) << " block size: " << sb.st_blksize << " bytes";
-
-    int blocks = ((sb.st_size-1) / sb.st_blksize) + 1;
-    LOG(INFO) << "  file size: " << sb.st_size << " bytes, " << blocks << " blocks";
-
-    std::vector<int> ranges;
-
-    std::string s = android::base::StringPrintf("%s\n%" PRId64 " %" PRId64 "\n",
-                       blk_dev, static_cast<int64_t>(sb.st_size),
-                       static_cast<int64_t>(sb.st_blksize));
-    if (!android::base::WriteStringToFd(s, mapfd)) {
-        PLOG(ERROR) << "failed to write " << tmp_map_file;
-        return kUncryptWriteError;
-    }
-
+// Maps the file one block at a time with FIBMAP, and for encrypted devices
+// writes every block through to its place on the block device.
+static int map_blocks(int fd, int wfd, const char* path, const struct stat& sb, bool encrypted,
+                      int socket, std::vector<int>& ranges) {
     std::vector<std::vector<unsigned char>> buffers;
     if (encrypted) {
         buffers.resize(WINDOW_SIZE, std::vector<unsigned char>(sb.st_blksize));
@@ -298,32 +264,6 @@ static int produce_block_map(const char* path, const char* map_file, const char*
     int head_block = 0;
     int head = 0, tail = 0;
 
-    android::base::unique_fd fd(open(path, O_RDONLY));
-    if (fd == -1) {
-        PLOG(ERROR) << "failed to open " << path << " for reading";
-        return kUncryptFileOpenError;
-    }
-
-    android::base::unique_fd wfd;
-    if (encrypted) {
-        wfd.reset(open(blk_dev, O_WRONLY));
-        if (wfd == -1) {
-            PLOG(ERROR) << "failed to open " << blk_dev << " for writing";
-            return kUncryptBlockOpenError;
-        }
-    }
-
-#ifndef F2FS_IOC_SET_DONTMOVE
-#ifndef F2FS_IOCTL_MAGIC
-#define F2FS_IOCTL_MAGIC		0xf5
-#endif
-#define F2FS_IOC_SET_DONTMOVE		_IO(F2FS_IOCTL_MAGIC, 13)
-#endif
-    if (f2fs_fs && ioctl(fd, F2FS_IOC_SET_DONTMOVE) < 0) {
-        PLOG(ERROR) << "Failed to set non-movable file for f2fs: " << path << " on " << blk_dev;
-        return kUncryptIoctlError;
-    }
-
     off64_t pos = 0;
     int last_progress = 0;
     while (pos < sb.st_size) {
@@ -405,6 +345,191 @@ static int produce_block_map(const char* path, const char* map_file, const char*
         head = (head + 1) % WINDOW_SIZE;
         ++head_block;
     }
+    return kUncryptNoError;
+}
+
+// Maps the file with FS_IOC_FIEMAP, one ioctl per FIEMAP_EXTENTS extents
+// instead of one FIBMAP per block. Returns false if the file system can't do
+// it or an extent isn't plain data at a fixed place on the block device
+// (delayed allocation, inline or encoded data, holes); the caller falls back
+// to FIBMAP then.
+static bool map_extents(int fd, const struct stat& sb, std::vector<int>& ranges) {
+    std::vector<unsigned char> buffer(sizeof(struct fiemap) +
+                                      FIEMAP_EXTENTS * sizeof(struct fiemap_extent));
+    struct fiemap* fm = reinterpret_cast<struct fiemap*>(buffer.data());
+    const uint64_t block_size = sb.st_blksize;
+    const uint64_t blocks = (sb.st_size + block_size - 1) / block_size;
+    const uint32_t unusable = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+                              FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_NOT_ALIGNED |
+                              FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL |
+                              FIEMAP_EXTENT_UNWRITTEN;
+    uint64_t next_block = 0;
+
+    while (next_block < blocks) {
+        memset(fm, 0, sizeof(struct fiemap));
+        fm->fm_start = next_block * block_size;
+        fm->fm_length = FIEMAP_MAX_OFFSET - fm->fm_start;
+        // Like the fsync before retrying FIBMAP, flushes delayed allocations first.
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = FIEMAP_EXTENTS;
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0) {
+            PLOG(INFO) << "FIEMAP not usable, mapping blocks with FIBMAP";
+            return false;
+        }
+        if (fm->fm_mapped_extents == 0) {
+            LOG(INFO) << "FIEMAP found no extent for block " << next_block;
+            return false;
+        }
+        for (uint32_t i = 0; i < fm->fm_mapped_extents && next_block < blocks; i++) {
+            const struct fiemap_extent& fe = fm->fm_extents[i];
+            if ((fe.fe_flags & unusable) != 0 || fe.fe_logical != next_block * block_size ||
+                fe.fe_physical % block_size != 0 || fe.fe_length % block_size != 0) {
+                LOG(INFO) << "FIEMAP extent at " << fe.fe_logical << " (flags 0x" << std::hex
+                          << fe.fe_flags << std::dec << ") can't be used";
+                return false;
+            }
+            uint64_t count = std::min<uint64_t>(fe.fe_length / block_size, blocks - next_block);
+            uint64_t start = fe.fe_physical / block_size;
+            if (start == 0 || start + count > static_cast<uint64_t>(INT_MAX)) {
+                return false;
+            }
+            if (!ranges.empty() && static_cast<uint64_t>(ranges.back()) == start) {
+                ranges.back() += static_cast<int>(count);
+            } else {
+                ranges.push_back(static_cast<int>(start));
+                ranges.push_back(static_cast<int>(start + count));
+            }
+            next_block += count;
+        }
+    }
+    return true;
+}
+
+// For encrypted devices, copies the readable contents of the file over its
+// own blocks on the block device, a range at a time in large chunks.
+static int rewrite_ranges(int fd, int wfd, const char* path, const char* blk_dev,
+                          const struct stat& sb, const std::vector<int>& ranges, int socket) {
+    std::vector<unsigned char> buffer(REWRITE_CHUNK_SIZE);
+    const off64_t block_size = sb.st_blksize;
+    off64_t pos = 0;
+    int last_progress = 0;
+
+    if (TEMP_FAILURE_RETRY(lseek64(fd, 0, SEEK_SET)) == -1) {
+        PLOG(ERROR) << "failed to seek " << path;
+        return kUncryptReadError;
+    }
+    for (size_t i = 0; i < ranges.size(); i += 2) {
+        off64_t offset = ranges[i] * block_size;
+        off64_t end = ranges[i + 1] * block_size;
+        while (offset < end && pos < sb.st_size) {
+            size_t length = static_cast<size_t>(std::min(end - offset,
+                    static_cast<off64_t>(buffer.size())));
+            size_t to_read = static_cast<size_t>(
+                    std::min(static_cast<off64_t>(length), sb.st_size - pos));
+            if (!android::base::ReadFully(fd, buffer.data(), to_read)) {
+                PLOG(ERROR) << "failed to read " << path;
+                return kUncryptReadError;
+            }
+            // The tail of the last block is padded with zeros.
+            length = (to_read + block_size - 1) / block_size * block_size;
+            memset(buffer.data() + to_read, 0, length - to_read);
+            if (write_at_offset(buffer.data(), length, wfd, offset) != 0) {
+                LOG(ERROR) << "failed to write " << blk_dev;
+                return kUncryptWriteError;
+            }
+            pos += to_read;
+            offset += length;
+
+            int progress = static_cast<int>(100 * (double(pos) / double(sb.st_size)));
+            if (progress > last_progress && progress < 100) {
+                last_progress = progress;
+                write_status_to_socket(progress, socket);
+            }
+        }
+    }
+    return kUncryptNoError;
+}
+
+static int produce_block_map(const char* path, const char* map_file, const char* blk_dev,
+                             bool encrypted, bool f2fs_fs, int socket) {
+    std::string err;
+    if (!android::base::RemoveFileIfExists(map_file, &err)) {
+        LOG(ERROR) << "failed to remove the existing map file " << map_file << ": " << err;
+        return kUncryptFileRemoveError;
+    }
+    std::string tmp_map_file = std::string(map_file) + ".tmp";
+    android::base::unique_fd mapfd(open(tmp_map_file.c_str(),
+                                        O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR));
+    if (mapfd == -1) {
+        PLOG(ERROR) << "failed to open " << tmp_map_file;
+        return kUncryptFileOpenError;
+    }
+
+    // Make sure we can write to the socket.
+    if (!write_status_to_socket(0, socket)) {
+        LOG(ERROR) << "failed to write to socket " << socket;
+        return kUncryptSocketWriteError;
+    }
+
+    struct stat sb;
+    if (stat(path, &sb) != 0) {
+        LOG(ERROR) << "failed to stat " << path;
+        return kUncryptFileStatError;
+    }
+
+    LOG(INFO) << " block size: " << sb.st_blksize << " bytes";
+
+    int blocks = ((sb.st_size-1) / sb.st_blksize) + 1;
+    LOG(INFO) << "  file size: " << sb.st_size << " bytes, " << blocks << " blocks";
+
+    std::vector<int> ranges;
+
+    std::string s = android::base::StringPrintf("%s\n%" PRId64 " %" PRId64 "\n",
+                       blk_dev, static_cast<int64_t>(sb.st_size),
+                       static_cast<int64_t>(sb.st_blksize));
+    if (!android::base::WriteStringToFd(s, mapfd)) {
+        PLOG(ERROR) << "failed to write " << tmp_map_file;
+        return kUncryptWriteError;
+    }
+
+    android::base::unique_fd fd(open(path, O_RDONLY));
+    if (fd == -1) {
+        PLOG(ERROR) << "failed to open " << path << " for reading";
+        return kUncryptFileOpenError;
+    }
+
+    android::base::unique_fd wfd;
+    if (encrypted) {
+        wfd.reset(open(blk_dev, O_WRONLY));
+        if (wfd == -1) {
+            PLOG(ERROR) << "failed to open " << blk_dev << " for writing";
+            return kUncryptBlockOpenError;
+        }
+    }
+
+#ifndef F2FS_IOC_SET_DONTMOVE
+#ifndef F2FS_IOCTL_MAGIC
+#define F2FS_IOCTL_MAGIC		0xf5
+#endif
+#define F2FS_IOC_SET_DONTMOVE		_IO(F2FS_IOCTL_MAGIC, 13)
+#endif
+    if (f2fs_fs && ioctl(fd, F2FS_IOC_SET_DONTMOVE) < 0) {
+        PLOG(ERROR) << "Failed to set non-movable file for f2fs: " << path << " on " << blk_dev;
+        return kUncryptIoctlError;
+    }
+
+    int error;
+    if (map_extents(fd, sb, ranges)) {
+        LOG(INFO) << "  mapped " << ranges.size() / 2 << " ranges with FIEMAP";
+        error = encrypted ? rewrite_ranges(fd, wfd, path, blk_dev, sb, ranges, socket)
+                          : kUncryptNoError;
+    } else {
+        ranges.clear();
+        error = map_blocks(fd, wfd, path, sb, encrypted, socket, ranges);
+    }
+    if (error != kUncryptNoError) {
+        return error;
+    }
 
     if (!android::base::WriteStringToFd(
             android::base::StringPrintf("%zu\n", ranges.size() / 2), mapfd)) {
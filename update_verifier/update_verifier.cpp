@@ -45,8 +45,11 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <future>
+#include <map>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -73,14 +76,10 @@ static int dm_name_filter(const dirent* de) {
   return 0;
 }
 
-static bool read_blocks(const std::string& partition, const std::string& range_str) {
-  if (partition != "system" && partition != "vendor" && partition != "product") {
-    LOG(ERROR) << "Invalid partition name \"" << partition << "\"";
-    return false;
-  }
-  // Iterate the content of "/sys/block/dm-X/dm/name". If it matches one of "system", "vendor" or
-  // "product", then dm-X is a dm-wrapped device for that target. We will later read all the
-  // ("cared") blocks from "/dev/block/dm-X" to ensure the target partition's integrity.
+// Iterate the content of "/sys/block/dm-X/dm/name" and map every target name (e.g. "system",
+// "vendor" or "product") to its dm-wrapped device "/dev/block/dm-X". The directory is scanned once
+// per run, not once per partition.
+static bool find_dm_block_devices(std::map<std::string, std::string>* dm_block_devices) {
   static constexpr auto DM_PATH_PREFIX = "/sys/block/";
   dirent** namelist;
   int n = scandir(DM_PATH_PREFIX, &namelist, dm_name_filter, alphasort);
@@ -89,13 +88,12 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
     return false;
   }
   if (n == 0) {
-    LOG(ERROR) << "dm block device not found for " << partition;
+    LOG(ERROR) << "dm block device not found";
     return false;
   }
 
   static constexpr auto DM_PATH_SUFFIX = "/dm/name";
   static constexpr auto DEV_PATH = "/dev/block/";
-  std::string dm_block_device;
   while (n--) {
     std::string path = DM_PATH_PREFIX + std::string(namelist[n]->d_name) + DM_PATH_SUFFIX;
     std::string content;
@@ -109,19 +107,31 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
         dm_block_name = "system";
       }
 #endif
-      if (dm_block_name == partition) {
-        dm_block_device = DEV_PATH + std::string(namelist[n]->d_name);
-        while (n--) {
-          free(namelist[n]);
-        }
-        break;
-      }
+      // The last dm-X in alphabetical order wins, as it did when each partition scanned the list.
+      dm_block_devices->emplace(dm_block_name, DEV_PATH + std::string(namelist[n]->d_name));
     }
     free(namelist[n]);
   }
   free(namelist);
+  return true;
+}
+
+// The cared blocks of one partition, to be read from its dm-verity device.
+struct CareMapEntry {
+  std::string partition;
+  std::string dm_block_device;
+  RangeSet ranges;
+};
 
-  if (dm_block_device.empty()) {
+static bool parse_care_map_entry(const std::map<std::string, std::string>& dm_block_devices,
+                                 const std::string& partition, const std::string& range_str,
+                                 CareMapEntry* entry) {
+  if (partition != "system" && partition != "vendor" && partition != "product") {
+    LOG(ERROR) << "Invalid partition name \"" << partition << "\"";
+    return false;
+  }
+  auto it = dm_block_devices.find(partition);
+  if (it == dm_block_devices.end()) {
     LOG(ERROR) << "Failed to find dm block device for " << partition;
     return false;
   }
@@ -136,47 +146,89 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
     return false;
   }
 
-  // RangeSet::Split() splits the ranges into multiple groups with same number of blocks (except for
-  // the last group).
-  size_t thread_num = std::thread::hardware_concurrency() ?: 4;
-  std::vector<RangeSet> groups = ranges.Split(thread_num);
+  entry->partition = partition;
+  entry->dm_block_device = it->second;
+  entry->ranges = std::move(ranges);
+  return true;
+}
 
-  std::vector<std::future<bool>> threads;
-  for (const auto& group : groups) {
-    auto thread_func = [&group, &dm_block_device, &partition]() {
-      android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(dm_block_device.c_str(), O_RDONLY)));
-      if (fd.get() == -1) {
-        PLOG(ERROR) << "Error reading " << dm_block_device << " for partition " << partition;
+static constexpr size_t kBlockSize = 4096;
+// Blocks per read(2). Large reads let dm-verity verify whole hash tree levels at a time.
+static constexpr size_t kReadBlocks = 1024;
+// Blocks per unit of work handed to a thread; partitions are cut into pieces of about this size so
+// that the threads finish together even when one partition is much larger than the others.
+static constexpr size_t kTaskBlocks = 16 * kReadBlocks;
+
+// Reads all the blocks in group from dm_block_device, so that dm-verity checks them.
+static bool read_block_group(const std::string& dm_block_device, const RangeSet& group,
+                             std::vector<uint8_t>* buf) {
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(dm_block_device.c_str(), O_RDONLY)));
+  if (fd.get() == -1) {
+    PLOG(ERROR) << "Error reading " << dm_block_device;
+    return false;
+  }
+  posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  for (const auto& range : group) {
+    size_t range_start = range.first;
+    size_t range_end = range.second;
+    for (size_t block = range_start; block < range_end; block += kReadBlocks) {
+      size_t to_read = std::min(range_end - block, kReadBlocks) * kBlockSize;
+      off64_t offset = static_cast<off64_t>(block) * kBlockSize;
+      // Start reading the next chunk while this one is being verified.
+      if (block + kReadBlocks < range_end) {
+        posix_fadvise(fd.get(), offset + to_read,
+                      std::min(range_end - block - kReadBlocks, kReadBlocks) * kBlockSize,
+                      POSIX_FADV_WILLNEED);
+      }
+      if (!android::base::ReadFullyAtOffset(fd.get(), buf->data(), to_read, offset)) {
+        PLOG(ERROR) << "Failed to read blocks " << range_start << " to " << range_end << " on "
+                    << dm_block_device;
         return false;
       }
+    }
+  }
+  return true;
+}
 
-      static constexpr size_t kBlockSize = 4096;
-      std::vector<uint8_t> buf(1024 * kBlockSize);
-
-      size_t block_count = 0;
-      for (const auto& range : group) {
-        size_t range_start = range.first;
-        size_t range_end = range.second;
-        if (lseek64(fd.get(), static_cast<off64_t>(range_start) * kBlockSize, SEEK_SET) == -1) {
-          PLOG(ERROR) << "lseek to " << range_start << " failed";
-          return false;
-        }
-
-        size_t remain = (range_end - range_start) * kBlockSize;
-        while (remain > 0) {
-          size_t to_read = std::min(remain, 1024 * kBlockSize);
-          if (!android::base::ReadFully(fd.get(), buf.data(), to_read)) {
-            PLOG(ERROR) << "Failed to read blocks " << range_start << " to " << range_end;
-            return false;
-          }
-          remain -= to_read;
-        }
-        block_count += (range_end - range_start);
+// Reads the cared blocks of all the partitions on one pool of threads. Every partition is split
+// into groups, and the threads take the groups in order until there are none left, so partitions
+// are read side by side instead of one after another.
+static bool read_blocks(const std::vector<CareMapEntry>& entries) {
+  struct Task {
+    const CareMapEntry* entry;
+    RangeSet group;
+  };
+  size_t thread_num = std::thread::hardware_concurrency() ?: 4;
+  std::vector<Task> tasks;
+  for (const auto& entry : entries) {
+    size_t groups = std::max(thread_num, entry.ranges.blocks() / kTaskBlocks);
+    for (auto& group : entry.ranges.Split(groups)) {
+      tasks.push_back({ &entry, std::move(group) });
+    }
+  }
+  thread_num = std::min(thread_num, tasks.size());
+
+  std::atomic<size_t> next_task(0);
+  std::atomic<bool> failed(false);
+  auto thread_func = [&tasks, &next_task, &failed]() {
+    std::vector<uint8_t> buf(kReadBlocks * kBlockSize);
+    size_t block_count = 0;
+    for (size_t i = next_task++; i < tasks.size() && !failed; i = next_task++) {
+      const Task& task = tasks[i];
+      if (!read_block_group(task.entry->dm_block_device, task.group, &buf)) {
+        LOG(ERROR) << "Failed to read blocks for partition " << task.entry->partition;
+        failed = true;
+        return false;
       }
-      LOG(INFO) << "Finished reading " << block_count << " blocks on " << dm_block_device;
-      return true;
-    };
+      block_count += task.group.blocks();
+    }
+    LOG(INFO) << "Finished reading " << block_count << " blocks";
+    return true;
+  };
 
+  std::vector<std::future<bool>> threads;
+  for (size_t i = 0; i < thread_num; i++) {
     threads.emplace_back(std::async(std::launch::async, thread_func));
   }
 
@@ -184,8 +236,11 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
   for (auto& t : threads) {
     ret = t.get() && ret;
   }
-  LOG(INFO) << "Finished reading blocks on " << dm_block_device << " with " << thread_num
-            << " threads.";
+  for (const auto& entry : entries) {
+    LOG(INFO) << "Finished reading " << entry.ranges.blocks() << " blocks on "
+              << entry.dm_block_device << " for " << entry.partition;
+  }
+  LOG(INFO) << "Finished reading blocks with " << thread_num << " threads.";
   return ret;
 }
 
@@ -222,18 +277,29 @@ bool verify_image(const std::string& care_map_name) {
     return false;
   }
 
+  std::map<std::string, std::string> dm_block_devices;
+  std::vector<CareMapEntry> entries;
   for (size_t i = 0; i < lines.size(); i += 2) {
     // We're seeing an N care_map.txt. Skip the verification since it's not compatible with O
     // update_verifier (the last few metadata blocks can't be read via device mapper).
     if (android::base::StartsWith(lines[i], "/dev/block/")) {
       LOG(WARNING) << "Found legacy care_map.txt; skipped.";
-      return true;
+      break;
     }
-    if (!read_blocks(lines[i], lines[i+1])) {
+    if (dm_block_devices.empty() && !find_dm_block_devices(&dm_block_devices)) {
       return false;
     }
+    CareMapEntry entry;
+    if (!parse_care_map_entry(dm_block_devices, lines[i], lines[i + 1], &entry)) {
+      return false;
+    }
+    entries.push_back(std::move(entry));
   }
 
+  // The partitions listed before a legacy entry are still verified.
+  if (!entries.empty() && !read_blocks(entries)) {
+    return false;
+  }
   return true;
 }
 
@@ -35,6 +35,7 @@
 
 #include <functional>
 #include <limits>
+#include <map>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -73,6 +74,24 @@ static CauseCode failure_type = kNoCause;
 static bool is_retry = false;
 static std::unordered_map<std::string, RangeSet> stash_map;
 
+// Where the time of an update goes, logged through the command pipe when it finishes so that
+// transfer lists and devices can be compared. Hashing and stash I/O also count towards the time
+// of the command they happen in.
+struct UpdateStats {
+  std::map<std::string, std::pair<size_t, uint64_t>> commands;  // name -> count, nanoseconds
+  uint64_t hash_ns;
+  uint64_t fsync_ns;
+  uint64_t stash_read_bytes;
+  uint64_t stash_write_bytes;
+};
+static UpdateStats update_stats;
+
+static uint64_t NowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
 static void DeleteLastCommandFile() {
   std::string last_command_file = CacheLocation::location().last_command_file();
   if (unlink(last_command_file.c_str()) == -1 && errno != ENOENT) {
@@ -338,66 +357,78 @@ class RangeSinkWriter {
  * of the archive (it's compressed) without writing it to a temp file, but we can't write each
  * section until it's that transfer's turn to go.
  *
- * To achieve this, we expand the new data from the archive in a background thread, and block that
- * threads 'receive uncompressed data' function until the main thread has reached a point where we
- * want some new data to be written. We signal the background thread with the destination for the
- * data and block the main thread, waiting for the background thread to complete writing that
- * section. Then it signals the main thread to wake up and goes back to blocking waiting for a
- * transfer.
+ * To achieve this, we expand the new data from the archive in a background thread into a ring
+ * buffer. The background thread keeps decoding ahead of the transfers while the main thread runs
+ * other commands, and only blocks when the ring is full. When the main thread reaches a 'new'
+ * transfer, it takes the data out of the ring and writes it to the target blocks, waiting for the
+ * background thread only when the ring runs empty.
  *
- * NewThreadInfo is the struct used to pass information back and forth between the two threads. When
- * the main thread wants some data written, it sets writer to the destination location and signals
- * the condition. When the background thread is done writing, it clears writer and signals the
- * condition again.
+ * NewThreadInfo is the struct used to pass information back and forth between the two threads. The
+ * background thread appends to the ring and the main thread consumes from it; each signals the
+ * condition after changing ring_used. Only the main thread writes to the partition.
  */
 struct NewThreadInfo {
   ZipArchiveHandle za;
   ZipEntry entry;
   bool brotli_compressed;
 
-  std::unique_ptr<RangeSinkWriter> writer;
   BrotliDecoderState* brotli_decoder_state;
   bool receiver_available;
 
+  std::vector<uint8_t> ring;
+  // The offset of the oldest decoded byte in ring, and the number of decoded bytes.
+  size_t ring_start;
+  size_t ring_used;
+
   pthread_mutex_t mu;
   pthread_cond_t cv;
 };
 
+// Size of the ring buffer that new data is decoded into ahead of the 'new' commands.
+static constexpr size_t NEW_DATA_RING_SIZE = 16 << 20;
+
+// Waits for free space in the ring, and returns the contiguous free space at the write position in
+// *out. Returns false if the main thread no longer wants any data.
+static bool wait_ring_space(NewThreadInfo* nti, uint8_t** out, size_t* space) {
+  pthread_mutex_lock(&nti->mu);
+  while (nti->ring_used == nti->ring.size()) {
+    // End the new data receiver if we encounter an error when performing block image update.
+    if (!nti->receiver_available) {
+      pthread_mutex_unlock(&nti->mu);
+      return false;
+    }
+    pthread_cond_wait(&nti->cv, &nti->mu);
+  }
+  size_t end = (nti->ring_start + nti->ring_used) % nti->ring.size();
+  *out = nti->ring.data() + end;
+  *space = std::min(nti->ring.size() - nti->ring_used, nti->ring.size() - end);
+  pthread_mutex_unlock(&nti->mu);
+  return true;
+}
+
+static void commit_ring_data(NewThreadInfo* nti, size_t size) {
+  pthread_mutex_lock(&nti->mu);
+  nti->ring_used += size;
+  pthread_cond_broadcast(&nti->cv);
+  pthread_mutex_unlock(&nti->mu);
+}
+
 static bool receive_new_data(const uint8_t* data, size_t size, void* cookie) {
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
 
   while (size > 0) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the new data receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
-      pthread_cond_wait(&nti->cv, &nti->mu);
-    }
-    pthread_mutex_unlock(&nti->mu);
-
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-    size_t write_now = std::min(size, nti->writer->AvailableSpace());
-    if (nti->writer->Write(data, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
+    uint8_t* out;
+    size_t space;
+    if (!wait_ring_space(nti, &out, &space)) {
       return false;
     }
 
-    data += write_now;
-    size -= write_now;
-
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
+    size_t copy_now = std::min(size, space);
+    memcpy(out, data, copy_now);
+    commit_ring_data(nti, copy_now);
 
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
-    }
+    data += copy_now;
+    size -= copy_now;
   }
 
   return true;
@@ -407,30 +438,14 @@ static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cook
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
 
   while (size > 0 || BrotliDecoderHasMoreOutput(nti->brotli_decoder_state)) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
-      pthread_cond_wait(&nti->cv, &nti->mu);
-    }
-    pthread_mutex_unlock(&nti->mu);
-
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-
-    size_t buffer_size = std::min<size_t>(32768, nti->writer->AvailableSpace());
-    if (buffer_size == 0) {
-      LOG(ERROR) << "No space left in output range";
+    uint8_t* next_out;
+    size_t buffer_size;
+    if (!wait_ring_space(nti, &next_out, &buffer_size)) {
       return false;
     }
-    uint8_t buffer[buffer_size];
+
     size_t available_in = size;
     size_t available_out = buffer_size;
-    uint8_t* next_out = buffer;
 
     // The brotli decoder will update |data|, |available_in|, |next_out| and |available_out|.
     BrotliDecoderResult result = BrotliDecoderDecompressStream(
@@ -442,26 +457,13 @@ static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cook
       return false;
     }
 
-    LOG(DEBUG) << "bytes to write: " << buffer_size - available_out << ", bytes consumed "
+    LOG(DEBUG) << "bytes decoded: " << buffer_size - available_out << ", bytes consumed "
                << size - available_in << ", decoder status " << result;
 
-    size_t write_now = buffer_size - available_out;
-    if (nti->writer->Write(buffer, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
-      return false;
-    }
+    commit_ring_data(nti, buffer_size - available_out);
 
     // Update the remaining size. The input data ptr is already updated by brotli decoder function.
     size = available_in;
-
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
-
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
-    }
   }
 
   return true;
@@ -476,9 +478,7 @@ static void* unzip_new_data(void* cookie) {
   }
   pthread_mutex_lock(&nti->mu);
   nti->receiver_available = false;
-  if (nti->writer != nullptr) {
-    pthread_cond_broadcast(&nti->cv);
-  }
+  pthread_cond_broadcast(&nti->cv);
   pthread_mutex_unlock(&nti->mu);
   return nullptr;
 }
@@ -524,6 +524,26 @@ static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer,
   return 0;
 }
 
+// The tgt and src ranges of the next move/bsdiff/imgdiff command, read from a second fd on a
+// background thread while the current command runs. The main thread joins the thread before it
+// executes the next command, so the fields are never accessed concurrently.
+struct PrefetchInfo {
+  android::base::unique_fd fd;
+  bool running;
+  bool ok;
+  int cmdindex;
+  RangeSet ranges[2];
+  std::vector<uint8_t> data[2];
+  pthread_t thread;
+};
+
+// A stash that is only held in memory. It's written to the stash directory before any command
+// overwrites its source blocks.
+struct MemoryStash {
+  RangeSet src;
+  std::vector<uint8_t> data;
+};
+
 // Parameters for transfer list command functions
 struct CommandParameters {
     std::vector<std::string> tokens;
@@ -541,13 +561,155 @@ struct CommandParameters {
     int version;
     size_t written;
     size_t stashed;
+    std::unordered_map<std::string, MemoryStash> memstash;
+    size_t memstash_bytes;
+    size_t memstash_budget;
+    // The last command that wrote to the stash while memstash wasn't empty. The last command file
+    // is only moved to it once all memory stashes are on disk.
+    int memstash_cmdindex;
+    std::string memstash_cmdline;
     NewThreadInfo nti;
     pthread_t thread;
+    PrefetchInfo prefetch;
     std::vector<uint8_t> buffer;
     uint8_t* patch_start;
     bool target_verified;  // The target blocks have expected contents already.
 };
 
+// Don't read ahead commands that would need more than this much memory on top of params.buffer.
+static constexpr size_t PREFETCH_MAX_BYTES = 32 << 20;
+
+static bool pread_ranges(int fd, const RangeSet& ranges, std::vector<uint8_t>& buffer) {
+  buffer.resize(ranges.blocks() * BLOCKSIZE);
+  size_t p = 0;
+  for (const auto& range : ranges) {
+    off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
+    size_t size = (range.second - range.first) * BLOCKSIZE;
+    while (size > 0) {
+      ssize_t r = TEMP_FAILURE_RETRY(pread64(fd, buffer.data() + p, size, offset));
+      if (r <= 0) {
+        return false;
+      }
+      p += r;
+      offset += r;
+      size -= r;
+    }
+  }
+  return true;
+}
+
+static void* prefetch_blocks(void* cookie) {
+  PrefetchInfo* pf = static_cast<PrefetchInfo*>(cookie);
+  pf->ok = pread_ranges(pf->fd, pf->ranges[0], pf->data[0]) &&
+           pread_ranges(pf->fd, pf->ranges[1], pf->data[1]);
+  return nullptr;
+}
+
+// Gets the blocks of the partition that the command in tokens may write. Returns false if they
+// can't be determined.
+static bool CommandWriteRanges(const std::vector<std::string>& tokens, RangeSet* written) {
+  const std::string& cmd = tokens[0];
+  size_t pos;
+  if (cmd == "stash" || cmd == "free") {
+    written->Clear();
+    return true;
+  } else if (cmd == "zero" || cmd == "new" || cmd == "erase") {
+    pos = 1;
+  } else if (cmd == "move") {
+    pos = 2;
+  } else if (cmd == "bsdiff" || cmd == "imgdiff") {
+    pos = 5;
+  } else {
+    return false;
+  }
+  if (pos >= tokens.size()) {
+    return false;
+  }
+  *written = RangeSet::Parse(tokens[pos]);
+  return static_cast<bool>(*written);
+}
+
+// Waits for the read ahead started by StartPrefetch(), if any.
+static void FinishPrefetch(CommandParameters& params) {
+  PrefetchInfo& pf = params.prefetch;
+  if (!pf.running) {
+    return;
+  }
+  pthread_join(pf.thread, nullptr);
+  pf.running = false;
+}
+
+// Starts reading the tgt and src ranges of the next command (line) if it is a move, bsdiff or
+// imgdiff. This runs alongside the current command in params, so it is only done when the current
+// command doesn't write to any of those blocks. Anything that isn't read ahead is read by
+// ReadCommandBlocks() as before.
+static void StartPrefetch(CommandParameters& params, const std::string& line, int cmdindex) {
+  PrefetchInfo& pf = params.prefetch;
+  pf.ok = false;
+  pf.data[0].clear();
+  pf.data[1].clear();
+  if (pf.fd == -1) {
+    return;
+  }
+
+  std::vector<std::string> tokens = android::base::Split(line, " ");
+  size_t tgt_pos;
+  if (tokens[0] == "move") {
+    tgt_pos = 2;
+  } else if (tokens[0] == "bsdiff" || tokens[0] == "imgdiff") {
+    tgt_pos = 5;
+  } else {
+    return;
+  }
+  // <tgt_range> <src_block_count> <src_range>|-
+  if (tgt_pos + 2 >= tokens.size()) {
+    return;
+  }
+  RangeSet tgt = RangeSet::Parse(tokens[tgt_pos]);
+  RangeSet src;
+  if (tokens[tgt_pos + 2] != "-") {
+    src = RangeSet::Parse(tokens[tgt_pos + 2]);
+    if (!src) {
+      return;
+    }
+  }
+  if (!tgt || (tgt.blocks() + src.blocks()) * BLOCKSIZE > PREFETCH_MAX_BYTES) {
+    return;
+  }
+
+  if (params.canwrite) {
+    RangeSet written;
+    if (!CommandWriteRanges(params.tokens, &written) || written.Overlaps(tgt) ||
+        written.Overlaps(src)) {
+      return;
+    }
+  }
+
+  pf.cmdindex = cmdindex;
+  pf.ranges[0] = std::move(tgt);
+  pf.ranges[1] = std::move(src);
+  if (pthread_create(&pf.thread, nullptr, prefetch_blocks, &pf) == 0) {
+    pf.running = true;
+  }
+}
+
+// Reads the blocks in ranges into buffer, taking them from the read ahead copy if the current
+// command was read ahead.
+static int ReadCommandBlocks(CommandParameters& params, const RangeSet& ranges,
+                             std::vector<uint8_t>& buffer) {
+  PrefetchInfo& pf = params.prefetch;
+  if (!pf.running && pf.ok && pf.cmdindex == params.cmdindex) {
+    for (size_t i = 0; i < 2; ++i) {
+      if (!pf.data[i].empty() && pf.ranges[i] == ranges) {
+        memcpy(buffer.data(), pf.data[i].data(), pf.data[i].size());
+        std::vector<uint8_t>().swap(pf.data[i]);
+        return 0;
+      }
+    }
+  }
+  return ReadBlocks(ranges, buffer, params.fd);
+}
+
 // Print the hash in hex for corrupted source blocks (excluding the stashed blocks which is
 // handled separately).
 static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
@@ -656,7 +818,9 @@ static int VerifyBlocks(const std::string& expected, const std::vector<uint8_t>&
     uint8_t digest[SHA_DIGEST_LENGTH];
     const uint8_t* data = buffer.data();
 
+    uint64_t start = NowNs();
     SHA1(data, blocks * BLOCKSIZE, digest);
+    update_stats.hash_ns += NowNs() - start;
 
     std::string hexdigest = print_sha1(digest);
 
@@ -760,6 +924,16 @@ static int LoadStash(CommandParameters& params, const std::string& id, bool veri
     blocks = &blockcount;
   }
 
+  // Memory stashes were verified when they were stashed.
+  auto memstash = params.memstash.find(id);
+  if (memstash != params.memstash.end()) {
+    LOG(INFO) << " loading " << id << " from memory";
+    allocate(memstash->second.data.size(), buffer);
+    memcpy(buffer.data(), memstash->second.data.data(), memstash->second.data.size());
+    *blocks = memstash->second.data.size() / BLOCKSIZE;
+    return 0;
+  }
+
   std::string fn = GetStashFileName(params.stashbase, id, "");
 
   struct stat sb;
@@ -789,6 +963,7 @@ static int LoadStash(CommandParameters& params, const std::string& id, bool veri
   if (read_all(fd, buffer, sb.st_size) == -1) {
     return -1;
   }
+  update_stats.stash_read_bytes += sb.st_size;
 
   *blocks = sb.st_size / BLOCKSIZE;
 
@@ -855,6 +1030,7 @@ static int WriteStash(const std::string& base, const std::string& id, int blocks
     if (write_all(fd, buffer, blocks * BLOCKSIZE) == -1) {
         return -1;
     }
+    update_stats.stash_write_bytes += blocks * BLOCKSIZE;
 
     if (ota_fsync(fd) == -1) {
         failure_type = kFsyncFailure;
@@ -885,6 +1061,84 @@ static int WriteStash(const std::string& base, const std::string& id, int blocks
     return 0;
 }
 
+// Returns how much of the currently available memory may be used for memory stashes.
+static size_t GetMemoryStashBudget() {
+  std::string meminfo;
+  if (!android::base::ReadFileToString("/proc/meminfo", &meminfo)) {
+    PLOG(WARNING) << "Failed to read /proc/meminfo";
+    return 0;
+  }
+
+  for (const auto& line : android::base::Split(meminfo, "\n")) {
+    std::vector<std::string> fields = android::base::Split(line, " ");
+    size_t available_kb;
+    // MemAvailable:    1234567 kB
+    if (fields.size() >= 3 && fields[0] == "MemAvailable:" &&
+        android::base::ParseUint(fields[fields.size() - 2], &available_kb)) {
+      // Leave most of it for the patching buffers and the page cache.
+      return available_kb / 4 * 1024;
+    }
+  }
+  return 0;
+}
+
+// Records that the current command wrote to the stash. The last command file must not be moved
+// past a stash command whose stash is only in memory, as resuming would skip it; in that case the
+// update is deferred to FlushMemoryStashes().
+static void UpdateLastStashCommand(CommandParameters& params) {
+  if (!params.memstash.empty()) {
+    params.memstash_cmdindex = params.cmdindex;
+    params.memstash_cmdline = params.cmdline;
+    return;
+  }
+
+  if (!UpdateLastCommandIndex(params.cmdindex, params.cmdline)) {
+    LOG(WARNING) << "Failed to update the last command file.";
+  }
+}
+
+// Writes all memory stashes to the stash directory.
+static int FlushMemoryStashes(CommandParameters& params) {
+  if (params.memstash.empty()) {
+    return 0;
+  }
+
+  for (auto& memstash : params.memstash) {
+    int blocks = memstash.second.data.size() / BLOCKSIZE;
+    if (WriteStash(params.stashbase, memstash.first, blocks, memstash.second.data, false,
+                   nullptr) != 0) {
+      LOG(ERROR) << "failed to write memory stash " << memstash.first;
+      return -1;
+    }
+  }
+  params.memstash.clear();
+  params.memstash_bytes = 0;
+
+  if (!params.memstash_cmdline.empty()) {
+    if (!UpdateLastCommandIndex(params.memstash_cmdindex, params.memstash_cmdline)) {
+      LOG(WARNING) << "Failed to update the last command file.";
+    }
+    params.memstash_cmdline.clear();
+  }
+  return 0;
+}
+
+// Writes the memory stashes to disk if the current command may overwrite any of their source
+// blocks.
+static int ProtectMemoryStashes(CommandParameters& params) {
+  if (params.memstash.empty()) {
+    return 0;
+  }
+
+  RangeSet written;
+  bool overwrites = !CommandWriteRanges(params.tokens, &written);
+  for (const auto& memstash : params.memstash) {
+    if (overwrites) break;
+    overwrites = written.Overlaps(memstash.second.src);
+  }
+  return overwrites ? FlushMemoryStashes(params) : 0;
+}
+
 // Creates a directory for storing stash files and checks if the /cache partition
 // hash enough space for the expected amount of blocks we need to store. Returns
 // >0 if we created the directory, zero if it existed already, and <0 of failure.
@@ -1034,7 +1288,7 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
     CHECK(static_cast<bool>(src));
     *overlap = src.Overlaps(tgt);
 
-    if (ReadBlocks(src, params.buffer, params.fd) == -1) {
+    if (ReadCommandBlocks(params, src, params.buffer) == -1) {
       return -1;
     }
 
@@ -1135,7 +1389,7 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
   CHECK(static_cast<bool>(tgt));
 
   std::vector<uint8_t> tgtbuffer(tgt.blocks() * BLOCKSIZE);
-  if (ReadBlocks(tgt, tgtbuffer, params.fd) == -1) {
+  if (ReadCommandBlocks(params, tgt, tgtbuffer) == -1) {
     return -1;
   }
 
@@ -1163,9 +1417,7 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
         return -1;
       }
 
-      if (!UpdateLastCommandIndex(params.cmdindex, params.cmdline)) {
-        LOG(WARNING) << "Failed to update the last command file.";
-      }
+      UpdateLastStashCommand(params);
 
       params.stashed += *src_blocks;
       // Can be deleted when the write has completed.
@@ -1274,12 +1526,21 @@ static int PerformCommandStash(CommandParameters& params) {
     return 0;
   }
 
+  size_t size = blocks * BLOCKSIZE;
+  if (params.memstash_bytes + size <= params.memstash_budget) {
+    LOG(INFO) << "stashing " << blocks << " blocks to " << id << " in memory";
+    MemoryStash& memstash = params.memstash[id];
+    memstash.src = src;
+    memstash.data.assign(params.buffer.begin(), params.buffer.begin() + size);
+    params.memstash_bytes += size;
+    params.stashed += blocks;
+    return 0;
+  }
+
   LOG(INFO) << "stashing " << blocks << " blocks to " << id;
   int result = WriteStash(params.stashbase, id, blocks, params.buffer, false, nullptr);
   if (result == 0) {
-    if (!UpdateLastCommandIndex(params.cmdindex, params.cmdline)) {
-      LOG(WARNING) << "Failed to update the last command file.";
-    }
+    UpdateLastStashCommand(params);
 
     params.stashed += blocks;
   }
@@ -1296,6 +1557,12 @@ static int PerformCommandFree(CommandParameters& params) {
   const std::string& id = params.tokens[params.cpos++];
   stash_map.erase(id);
 
+  auto memstash = params.memstash.find(id);
+  if (memstash != params.memstash.end()) {
+    params.memstash_bytes -= memstash->second.data.size();
+    params.memstash.erase(memstash);
+  }
+
   if (params.createdstash || params.canwrite) {
     return FreeStash(params.stashbase, id);
   }
@@ -1358,21 +1625,36 @@ static int PerformCommandNew(CommandParameters& params) {
   if (params.canwrite) {
     LOG(INFO) << " writing " << tgt.blocks() << " blocks of new data";
 
-    pthread_mutex_lock(&params.nti.mu);
-    params.nti.writer = std::make_unique<RangeSinkWriter>(params.fd, tgt);
-    pthread_cond_broadcast(&params.nti.cv);
-
-    while (params.nti.writer != nullptr) {
-      if (!params.nti.receiver_available) {
-        LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - params.nti.writer->BytesWritten())
-                   << " bytes of new data";
-        pthread_mutex_unlock(&params.nti.mu);
+    NewThreadInfo& nti = params.nti;
+    RangeSinkWriter writer(params.fd, tgt);
+    while (!writer.Finished()) {
+      pthread_mutex_lock(&nti.mu);
+      while (nti.ring_used == 0) {
+        if (!nti.receiver_available) {
+          LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - writer.BytesWritten())
+                     << " bytes of new data";
+          pthread_mutex_unlock(&nti.mu);
+          return -1;
+        }
+        pthread_cond_wait(&nti.cv, &nti.mu);
+      }
+      // The background thread doesn't touch the used part of the ring, so it can be written out
+      // without holding the lock.
+      size_t write_now = std::min(nti.ring_used, nti.ring.size() - nti.ring_start);
+      pthread_mutex_unlock(&nti.mu);
+
+      write_now = std::min(write_now, writer.AvailableSpace());
+      if (writer.Write(nti.ring.data() + nti.ring_start, write_now) != write_now) {
+        LOG(ERROR) << "Failed to write " << write_now << " bytes.";
         return -1;
       }
-      pthread_cond_wait(&params.nti.cv, &params.nti.mu);
-    }
 
-    pthread_mutex_unlock(&params.nti.mu);
+      pthread_mutex_lock(&nti.mu);
+      nti.ring_start = (nti.ring_start + write_now) % nti.ring.size();
+      nti.ring_used -= write_now;
+      pthread_cond_broadcast(&nti.cv);
+      pthread_mutex_unlock(&nti.mu);
+    }
   }
 
   params.written += tgt.blocks();
@@ -1528,6 +1810,7 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
                                       const Command* commands, size_t cmdcount, bool dryrun) {
   CommandParameters params = {};
   params.canwrite = !dryrun;
+  update_stats = UpdateStats();
 
   LOG(INFO) << "performing " << (dryrun ? "verification" : "update");
   if (state->is_retry) {
@@ -1600,6 +1883,12 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("");
   }
 
+  // Reads ahead use their own fd, so they don't race with the file offset of params.fd.
+  params.prefetch.fd.reset(TEMP_FAILURE_RETRY(open(blockdev_filename->data.c_str(), O_RDONLY)));
+  if (params.prefetch.fd == -1) {
+    PLOG(WARNING) << "open \"" << blockdev_filename->data << "\" for read ahead failed";
+  }
+
   if (params.canwrite) {
     params.nti.za = za;
     params.nti.entry = new_entry;
@@ -1609,6 +1898,7 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
       params.nti.brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
     }
     params.nti.receiver_available = true;
+    params.nti.ring.resize(NEW_DATA_RING_SIZE);
 
     pthread_mutex_init(&params.nti.mu, nullptr);
     pthread_cond_init(&params.nti.cv, nullptr);
@@ -1674,6 +1964,11 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
 
   params.createdstash = res;
 
+  if (params.canwrite) {
+    params.memstash_budget = GetMemoryStashBudget();
+    LOG(INFO) << "memory stash budget " << params.memstash_budget << " bytes";
+  }
+
   // When performing an update, save the index and cmdline of the current command into
   // the last_command_file if this command writes to the stash either explicitly of implicitly.
   // Upon resuming an update, read the saved index first; then
@@ -1742,10 +2037,29 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
       continue;
     }
 
+    // Wait for the blocks read ahead for this command, then start reading ahead the ones of the
+    // next command while this one runs.
+    FinishPrefetch(params);
+    for (size_t j = i + 1; j < lines.size(); j++) {
+      if (lines[j].empty()) continue;
+      if (j - start <= std::numeric_limits<int>::max()) {
+        StartPrefetch(params, lines[j], j - start);
+      }
+      break;
+    }
+
+    if (params.canwrite && ProtectMemoryStashes(params) == -1) {
+      goto pbiudone;
+    }
+
+    uint64_t cmd_start = NowNs();
     if (cmd->f(params) == -1) {
       LOG(ERROR) << "failed to execute command [" << line << "]";
       goto pbiudone;
     }
+    auto& cmd_stats = update_stats.commands[params.cmdname];
+    cmd_stats.first++;
+    cmd_stats.second += NowNs() - cmd_start;
 
     // In verify mode, check if the commands before the saved last_command_index have been
     // executed correctly. If some target blocks have unexpected contents, delete the last command
@@ -1763,11 +2077,13 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
       }
     }
     if (params.canwrite) {
+      uint64_t fsync_start = NowNs();
       if (ota_fsync(params.fd) == -1) {
         failure_type = kFsyncFailure;
         PLOG(ERROR) << "fsync failed";
         goto pbiudone;
       }
+      update_stats.fsync_ns += NowNs() - fsync_start;
       fprintf(cmd_pipe, "set_progress %.4f\n", static_cast<double>(params.written) / total_blocks);
       fflush(cmd_pipe);
     }
@@ -1776,9 +2092,16 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   rc = 0;
 
 pbiudone:
+  FinishPrefetch(params);
+
+  // Keep what has been stashed so far if the update can be resumed.
+  if (params.canwrite && rc != 0 && !params.isunresumable) {
+    FlushMemoryStashes(params);
+  }
+
   if (params.canwrite) {
     pthread_mutex_lock(&params.nti.mu);
-    if (params.nti.receiver_available) {
+    if (params.nti.receiver_available || params.nti.ring_used != 0) {
       LOG(WARNING) << "new data receiver is still available after executing all commands.";
     }
     params.nti.receiver_available = false;
@@ -1798,6 +2121,20 @@ pbiudone:
       if (partition != nullptr && *(partition + 1) != 0) {
         fprintf(cmd_pipe, "log bytes_written_%s: %zu\n", partition + 1, params.written * BLOCKSIZE);
         fprintf(cmd_pipe, "log bytes_stashed_%s: %zu\n", partition + 1, params.stashed * BLOCKSIZE);
+        for (const auto& command : update_stats.commands) {
+          fprintf(cmd_pipe, "log commands_%s_%s: %zu\n", command.first.c_str(), partition + 1,
+                  command.second.first);
+          fprintf(cmd_pipe, "log time_us_%s_%s: %" PRIu64 "\n", command.first.c_str(),
+                  partition + 1, command.second.second / 1000);
+        }
+        fprintf(cmd_pipe, "log time_us_hash_%s: %" PRIu64 "\n", partition + 1,
+                update_stats.hash_ns / 1000);
+        fprintf(cmd_pipe, "log time_us_fsync_%s: %" PRIu64 "\n", partition + 1,
+                update_stats.fsync_ns / 1000);
+        fprintf(cmd_pipe, "log bytes_stash_read_%s: %" PRIu64 "\n", partition + 1,
+                update_stats.stash_read_bytes);
+        fprintf(cmd_pipe, "log bytes_stash_written_%s: %" PRIu64 "\n", partition + 1,
+                update_stats.stash_write_bytes);
         fflush(cmd_pipe);
       }
       // Delete stash only after successfully completing the update, as it may contain blocks needed
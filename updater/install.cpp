@@ -17,10 +17,11 @@
 #include "updater/install.h"
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <ftw.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,6 +36,8 @@
 #include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <deque>
 #include <memory>
 #include <string>
 #include <vector>
@@ -497,6 +500,7 @@ Value* FormatFn(const char* name, State* state, const std::vector<std::unique_pt
   if (!ReadArgs(state, argv, &args)) {
     return ErrorAbort(state, kArgsParsingFailure, "%s() Failed to parse the argument(s)", name);
   }
+  ota_note_write();
   const std::string& fs_type = args[0];
   const std::string& partition_type = args[1];
   const std::string& location = args[2];
@@ -975,8 +979,13 @@ static int ApplyParsedPerms(State* state, const char* filename, const struct sta
                             struct perm_parsed_args parsed) {
   int bad = 0;
 
+  // Files extracted by package_extract_dir mostly carry the label already; leaving those alone
+  // saves rewriting the xattr of every file in the tree.
   if (parsed.has_selabel) {
-    if (lsetfilecon(filename, parsed.selabel) != 0) {
+    char* current = nullptr;
+    bool labeled = lgetfilecon(filename, &current) > 0 && strcmp(current, parsed.selabel) == 0;
+    freecon(current);
+    if (!labeled && lsetfilecon(filename, parsed.selabel) != 0) {
       uiPrintf(state, "ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n", filename,
                parsed.selabel, strerror(errno));
       bad++;
@@ -988,32 +997,50 @@ static int ApplyParsedPerms(State* state, const char* filename, const struct sta
     return bad;
   }
 
-  if (parsed.has_uid) {
-    if (chown(filename, parsed.uid, -1) < 0) {
-      uiPrintf(state, "ApplyParsedPerms: chown of %s to %d failed: %s\n", filename, parsed.uid,
-               strerror(errno));
-      bad++;
+  // Owner and group go in one chown. An unchanged owner is skipped, but once chown ran it may
+  // have cleared the setuid bits, so the modes below are set again regardless.
+  bool owner_changed = false;
+  if (parsed.has_uid && parsed.has_gid) {
+    if (statptr->st_uid != parsed.uid || statptr->st_gid != parsed.gid) {
+      owner_changed = true;
+      if (chown(filename, parsed.uid, parsed.gid) < 0) {
+        uiPrintf(state, "ApplyParsedPerms: chown of %s to %d:%d failed: %s\n", filename,
+                 parsed.uid, parsed.gid, strerror(errno));
+        bad++;
+      }
     }
-  }
-
-  if (parsed.has_gid) {
-    if (chown(filename, -1, parsed.gid) < 0) {
-      uiPrintf(state, "ApplyParsedPerms: chgrp of %s to %d failed: %s\n", filename, parsed.gid,
-               strerror(errno));
-      bad++;
+  } else if (parsed.has_uid) {
+    if (statptr->st_uid != parsed.uid) {
+      owner_changed = true;
+      if (chown(filename, parsed.uid, -1) < 0) {
+        uiPrintf(state, "ApplyParsedPerms: chown of %s to %d failed: %s\n", filename, parsed.uid,
+                 strerror(errno));
+        bad++;
+      }
+    }
+  } else if (parsed.has_gid) {
+    if (statptr->st_gid != parsed.gid) {
+      owner_changed = true;
+      if (chown(filename, -1, parsed.gid) < 0) {
+        uiPrintf(state, "ApplyParsedPerms: chgrp of %s to %d failed: %s\n", filename, parsed.gid,
+                 strerror(errno));
+        bad++;
+      }
     }
   }
+  mode_t current_mode = owner_changed ? static_cast<mode_t>(-1) : (statptr->st_mode & 07777);
 
   if (parsed.has_mode) {
-    if (chmod(filename, parsed.mode) < 0) {
+    if (current_mode != parsed.mode && chmod(filename, parsed.mode) < 0) {
       uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n", filename, parsed.mode,
                strerror(errno));
       bad++;
     }
+    current_mode = parsed.mode;
   }
 
   if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
-    if (chmod(filename, parsed.dmode) < 0) {
+    if (current_mode != parsed.dmode && chmod(filename, parsed.dmode) < 0) {
       uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n", filename, parsed.dmode,
                strerror(errno));
       bad++;
@@ -1021,7 +1048,7 @@ static int ApplyParsedPerms(State* state, const char* filename, const struct sta
   }
 
   if (parsed.has_fmode && S_ISREG(statptr->st_mode)) {
-    if (chmod(filename, parsed.fmode) < 0) {
+    if (current_mode != parsed.fmode && chmod(filename, parsed.fmode) < 0) {
       uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n", filename, parsed.fmode,
                strerror(errno));
       bad++;
@@ -1055,14 +1082,167 @@ static int ApplyParsedPerms(State* state, const char* filename, const struct sta
   return bad;
 }
 
-// nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
-static State* recursive_state;
+// set_metadata_recursive walks the tree on up to this many threads.
+static constexpr size_t MAX_METADATA_THREADS = 4;
+
+struct metadata_dir {
+  std::string path;
+  struct stat sb;
+  metadata_dir* parent;
+  size_t pending;  // Unfinished subdirectories, plus one until this one has been read.
+};
+
+// State shared by the set_metadata_recursive workers. Directories are read through their fds
+// and the entries stat'ed with fstatat. As with the FTW_DEPTH nftw walk, a directory gets its
+// metadata only after everything under it, and the walk stops at the first failure.
+struct metadata_walk {
+  State* state;
+  const struct perm_parsed_args* parsed;
+  pthread_mutex_t mu;
+  pthread_cond_t cv;
+  std::deque<metadata_dir*> queue;
+  std::vector<std::unique_ptr<metadata_dir>> dirs;
+  size_t active;
+  int bad;
+};
+
+static void FailMetadataWalk(metadata_walk* walk, int bad) {
+  pthread_mutex_lock(&walk->mu);
+  walk->bad += bad;
+  pthread_cond_broadcast(&walk->cv);
+  pthread_mutex_unlock(&walk->mu);
+}
+
+// Drops one reference to dir, and once nothing under it is left applies its metadata and does
+// the same for its parent.
+static void FinishMetadataDir(metadata_walk* walk, metadata_dir* dir) {
+  while (dir != nullptr) {
+    pthread_mutex_lock(&walk->mu);
+    bool done = --dir->pending == 0 && walk->bad == 0;
+    pthread_mutex_unlock(&walk->mu);
+    if (!done) {
+      return;
+    }
+    int bad = ApplyParsedPerms(walk->state, dir->path.c_str(), &dir->sb, *walk->parsed);
+    if (bad != 0) {
+      FailMetadataWalk(walk, bad);
+      return;
+    }
+    dir = dir->parent;
+  }
+}
+
+static void ReadMetadataDir(metadata_walk* walk, metadata_dir* dir) {
+  int fd = open(dir->path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  DIR* d = fd == -1 ? nullptr : fdopendir(fd);
+  if (d == nullptr) {
+    uiPrintf(walk->state, "set_metadata_recursive: failed to open %s: %s\n", dir->path.c_str(),
+             strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    FailMetadataWalk(walk, 1);
+    return;
+  }
+
+  std::string prefix = dir->path;
+  if (prefix.back() != '/') {
+    prefix += '/';
+  }
+  struct dirent* de;
+  while ((de = readdir(d)) != nullptr) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    struct stat sb;
+    if (fstatat(fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+      uiPrintf(walk->state, "set_metadata_recursive: failed to stat %s%s: %s\n", prefix.c_str(),
+               de->d_name, strerror(errno));
+      FailMetadataWalk(walk, 1);
+      break;
+    }
+    if (S_ISDIR(sb.st_mode)) {
+      std::unique_ptr<metadata_dir> child(new metadata_dir{ prefix + de->d_name, sb, dir, 1 });
+      pthread_mutex_lock(&walk->mu);
+      dir->pending++;
+      walk->queue.push_back(child.get());
+      walk->dirs.push_back(std::move(child));
+      pthread_cond_signal(&walk->cv);
+      pthread_mutex_unlock(&walk->mu);
+    } else {
+      std::string path = prefix + de->d_name;
+      int bad = ApplyParsedPerms(walk->state, path.c_str(), &sb, *walk->parsed);
+      if (bad != 0) {
+        FailMetadataWalk(walk, bad);
+        break;
+      }
+    }
+  }
+  closedir(d);
+  FinishMetadataDir(walk, dir);
+}
+
+static void* MetadataWalkWorker(void* cookie) {
+  metadata_walk* walk = static_cast<metadata_walk*>(cookie);
+  pthread_mutex_lock(&walk->mu);
+  while (true) {
+    while (walk->bad == 0 && walk->queue.empty() && walk->active > 0) {
+      pthread_cond_wait(&walk->cv, &walk->mu);
+    }
+    if (walk->bad != 0 || walk->queue.empty()) {
+      break;
+    }
+    metadata_dir* dir = walk->queue.front();
+    walk->queue.pop_front();
+    walk->active++;
+    pthread_mutex_unlock(&walk->mu);
+
+    ReadMetadataDir(walk, dir);
+
+    pthread_mutex_lock(&walk->mu);
+    walk->active--;
+    if (walk->active == 0 && walk->queue.empty()) {
+      pthread_cond_broadcast(&walk->cv);
+    }
+  }
+  pthread_mutex_unlock(&walk->mu);
+  return nullptr;
+}
+
+// Applies parsed to root and everything under it, returns the number of failures.
+static int SetMetadataRecursive(State* state, const std::string& root, const struct stat& sb,
+                                const struct perm_parsed_args& parsed) {
+  if (!S_ISDIR(sb.st_mode)) {
+    return ApplyParsedPerms(state, root.c_str(), &sb, parsed);
+  }
+
+  metadata_walk walk;
+  walk.state = state;
+  walk.parsed = &parsed;
+  pthread_mutex_init(&walk.mu, nullptr);
+  pthread_cond_init(&walk.cv, nullptr);
+  walk.dirs.emplace_back(new metadata_dir{ root, sb, nullptr, 1 });
+  walk.queue.push_back(walk.dirs.back().get());
+  walk.active = 0;
+  walk.bad = 0;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t num_threads = std::min<size_t>(MAX_METADATA_THREADS, cpus > 0 ? cpus : 1);
+  std::vector<pthread_t> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, MetadataWalkWorker, &walk) == 0) {
+      threads.push_back(thread);
+    }
+  }
+  MetadataWalkWorker(&walk);
+  for (pthread_t thread : threads) {
+    pthread_join(thread, nullptr);
+  }
 
-static int do_SetMetadataRecursive(const char* filename, const struct stat* statptr, int fileflags,
-                                   struct FTW* pfwt) {
-  return ApplyParsedPerms(recursive_state, filename, statptr, recursive_parsed_args);
+  pthread_cond_destroy(&walk.cv);
+  pthread_mutex_destroy(&walk.mu);
+  return walk.bad;
 }
 
 static Value* SetMetadataFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
@@ -1087,11 +1267,7 @@ static Value* SetMetadataFn(const char* name, State* state, const std::vector<st
   bool recursive = (strcmp(name, "set_metadata_recursive") == 0);
 
   if (recursive) {
-    recursive_parsed_args = parsed;
-    recursive_state = state;
-    bad += nftw(args[0].c_str(), do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-    memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
-    recursive_state = NULL;
+    bad += SetMetadataRecursive(state, args[0], sb, parsed);
   } else {
     bad += ApplyParsedPerms(state, args[0].c_str(), &sb, parsed);
   }
@@ -1231,6 +1407,8 @@ Value* RunProgramFn(const char* name, State* state, const std::vector<std::uniqu
   if (!ReadArgs(state, argv, &args)) {
     return ErrorAbort(state, kArgsParsingFailure, "%s() Failed to parse the argument(s)", name);
   }
+  // The program may write to any file or partition behind ota_io's back.
+  ota_note_write();
 
   char* args2[argv.size() + 1];
   for (size_t i = 0; i < argv.size(); i++) {
@@ -1296,6 +1474,7 @@ Value* WriteValueFn(const char* name, State* state, const std::vector<std::uniqu
   if (!ReadArgs(state, argv, &args)) {
     return ErrorAbort(state, kArgsParsingFailure, "%s(): Failed to parse the argument(s)", name);
   }
+  ota_note_write();
 
   const std::string& filename = args[1];
   if (filename.empty()) {
@@ -1465,6 +1644,7 @@ Value* Tune2FsFn(const char* name, State* state, const std::vector<std::unique_p
   if (!ReadArgs(state, argv, &args)) {
     return ErrorAbort(state, kArgsParsingFailure, "%s() could not read args", name);
   }
+  ota_note_write();
 
   char* args2[argv.size() + 1];
   // Tune2fs expects the program name as its args[0]
@@ -21,6 +21,14 @@
 #define TW_VERSION_STR TW_MAIN_VERSION_STR TW_DEVICE_VERSION
 
 #define TW_USE_COMPRESSION_VAR      "tw_use_compression"
+#define TW_ADB_BACKUP_STREAMS_VAR   "tw_adb_backup_streams"
+#define TW_ADB_AUTO_CODEC_VAR       "tw_adb_auto_codec"
+#define TW_USE_LZ4_VAR              "tw_use_lz4_compression"
+#define TW_SPARSE_IMAGE_BACKUP_VAR  "tw_sparse_image_backup"
+#define TW_INCREMENTAL_BACKUP_VAR   "tw_incremental_backup"
+#define TW_DEDUP_BACKUP_VAR         "tw_dedup_backup"
+#define TW_SNAPSHOT_BACKUP_VAR      "tw_snapshot_backup"
+#define TW_USED_BLOCKS_BACKUP_VAR   "tw_used_blocks_backup"
 #define TW_FILENAME                 "tw_filename"
 #define TW_ZIP_INDEX                "tw_zip_index"
 #define TW_ZIP_QUEUE_COUNT       "tw_zip_queue_count"
@@ -70,8 +78,11 @@
 #define TW_ZIP_EXTERNAL_VAR         "tw_zip_external"
 #define TW_DISABLE_FREE_SPACE_VAR   "tw_disable_free_space"
 #define TW_FORCE_DIGEST_CHECK_VAR   "tw_force_digest_check"
+#define TW_TRACE_VAR                "tw_trace"
 #define TW_SKIP_DIGEST_CHECK_VAR    "tw_skip_digest_check"
 #define TW_SKIP_DIGEST_GENERATE_VAR "tw_skip_digest_generate"
+#define TW_VERIFY_DIGEST_INLINE_VAR "tw_verify_digest_during_restore"
+#define TW_VERIFY_INTERVAL_VAR      "tw_verify_interval_days"
 #define TW_SIGNED_ZIP_VERIFY_VAR    "tw_signed_zip_verify"
 #define TW_INSTALL_REBOOT_VAR       "tw_install_reboot"
 #define TW_TIME_ZONE_VAR            "tw_time_zone"
@@ -155,6 +166,8 @@
 // Max archive size for tar backups before we split (1.5GB)
 #define MAX_ARCHIVE_SIZE 1610612736LLU
 //#define MAX_ARCHIVE_SIZE 52428800LLU // 50MB split for testing
+// Minimum amount of data per archive thread for unencrypted tar backups (256MB)
+#define MIN_THREAD_ARCHIVE_SIZE 268435456LLU
 
 #ifndef CUSTOM_LUN_FILE
 #define CUSTOM_LUN_FILE "/sys/class/android_usb/android0/f_mass_storage/lun%d/file"
@@ -17,6 +17,8 @@
 #ifndef _RECOVERY_VERIFIER_H
 #define _RECOVERY_VERIFIER_H
 
+#include <stdint.h>
+
 #include <functional>
 #include <memory>
 #include <vector>
@@ -74,6 +76,13 @@ struct Certificate {
 int verify_file(const unsigned char* addr, size_t length, const std::vector<Certificate>& keys,
                 const std::function<void(float)>& set_progress = nullptr);
 
+/*
+ * Same as above for the update package of 'length' bytes open as 'fd'. The package is read in
+ * bounded windows instead of being mapped, so memory use does not grow with its size.
+ */
+int verify_file(int fd, uint64_t length, const std::vector<Certificate>& keys,
+                const std::function<void(float)>& set_progress = nullptr);
+
 bool load_keys(const char* filename, std::vector<Certificate>& certs);
 
 #define VERIFY_SUCCESS        0
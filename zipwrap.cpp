@@ -33,6 +33,9 @@
 
 ZipWrap::ZipWrap() {
 	zip_open = false;
+#ifdef USE_MINZIP
+	file_mapped = false;
+#endif
 }
 
 ZipWrap::~ZipWrap() {
@@ -57,30 +60,72 @@ bool ZipWrap::Open(const char* file, MemMapping* map) {
 	return true;
 }
 
+// Opens the zip from the file instead of a map of all of it. libziparchive
+// only maps the central directory and reads entries when they are extracted,
+// minzip needs the whole zip in memory and maps the file itself.
+bool ZipWrap::Open(const char* file) {
+	if (zip_open) {
+		printf("ZipWrap '%s' is already open\n", zip_file.c_str());
+		return true;
+	}
+	zip_file = file;
+#ifdef USE_MINZIP
+	if (sysMapFile(file, &file_map) != 0) {
+		printf("Unable to map '%s'\n", file);
+		return false;
+	}
+	if (mzOpenZipArchive(file_map.addr, file_map.length, &Zip) != 0) {
+		sysReleaseMap(&file_map);
+		return false;
+	}
+	file_mapped = true;
+#else
+	if (OpenArchive(file, &Zip) != 0) {
+		CloseArchive(Zip);
+		return false;
+	}
+#endif
+	zip_open = true;
+	return true;
+}
+
 void ZipWrap::Close() {
 	if (zip_open)
 #ifdef USE_MINZIP
 		mzCloseZipArchive(&Zip);
+	if (file_mapped) {
+		sysReleaseMap(&file_map);
+		file_mapped = false;
+	}
 #else
 		CloseArchive(Zip);
+	entries.clear();
 #endif
 	zip_open = false;
 }
 
-bool ZipWrap::EntryExists(const string& filename) {
+// Install and theme loading look up the same few names several times per
+// package (exists, size, extract), so each lookup is done once per open zip.
 #ifdef USE_MINZIP
-	const ZipEntry* file_location = mzFindZipEntry(&Zip, filename.c_str());
-	if (file_location != NULL)
-		return true;
-	return false;
+const ZipEntry* ZipWrap::Find_Entry(const string& filename) {
+	// minzip keeps its own hash table of the entries
+	return mzFindZipEntry(&Zip, filename.c_str());
+}
 #else
-	ZipString zip_string(filename.c_str());
-	ZipEntry file_entry;
-
-	if (FindEntry(Zip, zip_string, &file_entry) != 0)
-		return false;
-	return true;
+ZipEntry* ZipWrap::Find_Entry(const string& filename) {
+	unordered_map<string, CachedEntry>::iterator it = entries.find(filename);
+	if (it == entries.end()) {
+		CachedEntry cached;
+		ZipString zip_string(filename.c_str());
+		cached.exists = FindEntry(Zip, zip_string, &cached.entry) == 0;
+		it = entries.emplace(filename, cached).first;
+	}
+	return it->second.exists ? &it->second.entry : NULL;
+}
 #endif
+
+bool ZipWrap::EntryExists(const string& filename) {
+	return Find_Entry(filename) != NULL;
 }
 
 bool ZipWrap::ExtractEntry(const string& source_file, const string& target_file, mode_t mode) {
@@ -94,9 +139,10 @@ bool ZipWrap::ExtractEntry(const string& source_file, const string& target_file,
 	}
 
 #ifdef USE_MINZIP
-	const ZipEntry* file_entry = mzFindZipEntry(&Zip, source_file.c_str());
+	const ZipEntry* file_entry = Find_Entry(source_file);
 	if (file_entry == NULL) {
 		printf("'%s' does not exist in zip '%s'\n", source_file.c_str(), zip_file.c_str());
+		close(fd);
 		return false;
 	}
 	int ret_val = mzExtractZipEntryToFile(&Zip, file_entry, fd);
@@ -107,12 +153,12 @@ bool ZipWrap::ExtractEntry(const string& source_file, const string& target_file,
 		return false;
 	}
 #else
-	ZipString zip_string(source_file.c_str());
-	ZipEntry file_entry;
-
-	if (FindEntry(Zip, zip_string, &file_entry) != 0)
+	ZipEntry* file_entry = Find_Entry(source_file);
+	if (file_entry == NULL) {
+		close(fd);
 		return false;
-	int32_t ret_val = ExtractEntryToFile(Zip, &file_entry, fd);
+	}
+	int32_t ret_val = ExtractEntryToFile(Zip, file_entry, fd);
 	close(fd);
 
 	if (ret_val != 0) {
@@ -134,25 +180,35 @@ bool ZipWrap::ExtractRecursive(const string& source_dir, const string& target_di
 
 long ZipWrap::GetUncompressedSize(const string& filename) {
 #ifdef USE_MINZIP
-	const ZipEntry* file_entry = mzFindZipEntry(&Zip, filename.c_str());
+	const ZipEntry* file_entry = Find_Entry(filename);
 	if (file_entry == NULL) {
 		printf("'%s' does not exist in zip '%s'\n", filename.c_str(), zip_file.c_str());
 		return 0;
 	}
 	return file_entry->uncompLen;
 #else
-	ZipString zip_string(filename.c_str());
-	ZipEntry file_entry;
-
-	if (FindEntry(Zip, zip_string, &file_entry) != 0)
+	ZipEntry* file_entry = Find_Entry(filename);
+	if (file_entry == NULL)
 		return 0;
-	return file_entry.uncompressed_length;
+	return file_entry->uncompressed_length;
 #endif
 }
 
+bool ZipWrap::GetEntryCrc32(const string& filename, uint32_t* crc32) {
+#ifdef USE_MINZIP
+	const ZipEntry* file_entry = Find_Entry(filename);
+#else
+	ZipEntry* file_entry = Find_Entry(filename);
+#endif
+	if (file_entry == NULL)
+		return false;
+	*crc32 = file_entry->crc32;
+	return true;
+}
+
 bool ZipWrap::ExtractToBuffer(const string& filename, uint8_t* buffer) {
 #ifdef USE_MINZIP
-	const ZipEntry* file_entry = mzFindZipEntry(&Zip, filename.c_str());
+	const ZipEntry* file_entry = Find_Entry(filename);
 	if (file_entry == NULL) {
 		printf("'%s' does not exist in zip '%s'\n", filename.c_str(), zip_file.c_str());
 		return false;
@@ -162,12 +218,10 @@ bool ZipWrap::ExtractToBuffer(const string& filename, uint8_t* buffer) {
 		return false;
 	}
 #else
-	ZipString zip_string(filename.c_str());
-	ZipEntry file_entry;
-
-	if (FindEntry(Zip, zip_string, &file_entry) != 0)
+	ZipEntry* file_entry = Find_Entry(filename);
+	if (file_entry == NULL)
 		return false;
-	if (ExtractToMemory(Zip, &file_entry, buffer, file_entry.uncompressed_length) != 0) {
+	if (ExtractToMemory(Zip, file_entry, buffer, file_entry->uncompressed_length) != 0) {
 		printf("Failed to read '%s'\n", filename.c_str());
 		return false;
 	}
@@ -177,7 +231,7 @@ bool ZipWrap::ExtractToBuffer(const string& filename, uint8_t* buffer) {
 
 #ifdef USE_MINZIP
 loff_t ZipWrap::GetEntryOffset(const string& filename) {
-	const ZipEntry* file_entry = mzFindZipEntry(&Zip, filename.c_str());
+	const ZipEntry* file_entry = Find_Entry(filename);
 	if (file_entry == NULL) {
 		printf("'%s' does not exist in zip '%s'\n", filename.c_str(), zip_file.c_str());
 		return 0;
@@ -186,14 +240,12 @@ loff_t ZipWrap::GetEntryOffset(const string& filename) {
 }
 #else
 off64_t ZipWrap::GetEntryOffset(const string& filename) {
-	ZipString zip_string(filename.c_str());
-	ZipEntry file_entry;
-
-	if (FindEntry(Zip, zip_string, &file_entry) != 0) {
+	ZipEntry* file_entry = Find_Entry(filename);
+	if (file_entry == NULL) {
 		printf("'%s' does not exist in zip '%s'\n", filename.c_str(), zip_file.c_str());
 		return 0;
 	}
-	return file_entry.offset;
+	return file_entry->offset;
 }
 
 ZipArchiveHandle ZipWrap::GetZipArchiveHandle() {
@@ -19,6 +19,7 @@
 #define __ZIPWRAP_HPP
 
 #include <string>
+#include <unordered_map>
 #ifdef USE_MINZIP
 #include "minzip/Zip.h"
 #include "minzip/SysUtil.h"
@@ -35,11 +36,13 @@ class ZipWrap {
 		~ZipWrap();
 
 		bool Open(const char* file, MemMapping* map);
+		bool Open(const char* file);
 		void Close();
 		bool EntryExists(const string& filename);
 		bool ExtractEntry(const string& source_file, const string& target_file, mode_t mode);
 
 		long GetUncompressedSize(const string& filename);
+		bool GetEntryCrc32(const string& filename, uint32_t* crc32);
 		bool ExtractToBuffer(const string& filename, uint8_t* begin);
 		bool ExtractRecursive(const string& source_dir, const string& target_dir);
 #ifdef USE_MINZIP
@@ -51,9 +54,19 @@ class ZipWrap {
 
 	private:
 #ifdef USE_MINZIP
+		const ZipEntry* Find_Entry(const string& filename);
 		ZipArchive Zip;
+		MemMapping file_map;
+		bool file_mapped;
 #else
+		struct CachedEntry {
+			bool exists;
+			ZipEntry entry;
+		};
+		ZipEntry* Find_Entry(const string& filename);
 		ZipArchiveHandle Zip;
+		// Lookups already done on the open zip, including the missing names
+		unordered_map<string, CachedEntry> entries;
 #endif
 		string zip_file;
 		bool zip_open;